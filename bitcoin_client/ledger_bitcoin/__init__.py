@@ -2,9 +2,14 @@
 """Ledger Nano Bitcoin app client"""
 
 from .client_base import Client, TransportClient
-from .client import createClient
+from .client import createClient, PreparedPsbt
+from .client_async import AsyncNewClient, AsyncTransportClient
+from .multi_device import sign_psbt_on_devices, async_sign_psbt_on_devices
 from .common import Chain
+from .instrumentation import Instrumentation, ClientStats, PerfCounters, CacheStats
+from .request_cache import RequestCache
+from .merkle import get_messages_merkle_root
 
-from .wallet import AddressType, Wallet, MultisigWallet, PolicyMapWallet
+from .wallet import AddressType, Wallet, WalletType, MultisigWallet, PolicyMapWallet
 
-__all__ = ["Client", "TransportClient", "createClient", "Chain", "AddressType", "Wallet", "MultisigWallet", "PolicyMapWallet"]
+__all__ = ["Client", "TransportClient", "createClient", "PreparedPsbt", "AsyncNewClient", "AsyncTransportClient", "sign_psbt_on_devices", "async_sign_psbt_on_devices", "Instrumentation", "ClientStats", "PerfCounters", "CacheStats", "RequestCache", "get_messages_merkle_root", "Chain", "AddressType", "Wallet", "WalletType", "MultisigWallet", "PolicyMapWallet"]
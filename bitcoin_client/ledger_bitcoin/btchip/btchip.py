@@ -105,11 +105,39 @@ class btchip:
 		result['chainCode'] = response[offset : offset + 32]
 		return result
 
+	def getWalletPublicKeys(self, paths):
+		# Compressed public key and chain code of up to 3 paths, without any address
+		if len(paths) == 0 or len(paths) > 3:
+			raise BTChipException("Invalid number of paths")
+		apdu = [ self.BTCHIP_CLA, self.BTCHIP_INS_GET_WALLET_PUBLIC_KEY, 0x00, 0x04 ]
+		params = bytearray()
+		for path in paths:
+			params.extend(parse_bip32_path(path))
+		apdu.append(len(params))
+		apdu.extend(params)
+		response = self.dongle.exchange(bytearray(apdu))
+		return [ {'publicKey': response[65 * i : 65 * i + 33], 'chainCode': response[65 * i + 33 : 65 * (i + 1)]} for i in range(len(paths)) ]
+
 	def getTrustedInput(self, transaction, index):
 		result = {}
+		result['trustedInput'] = True
+		result['value'] = self._streamTrustedInputTransaction(transaction, 0x00, bytearray.fromhex("%.8x" % (index)))
+		return result
+
+	def getTrustedInputs(self, transaction, indexes):
+		# One Trusted Input for each output index, parsing the transaction once
+		if len(indexes) == 0 or len(indexes) > 4 or sorted(set(indexes)) != list(indexes):
+			raise BTChipException("Invalid output indexes")
+		params = bytearray([len(indexes)])
+		for index in indexes:
+			params.extend(bytearray.fromhex("%.8x" % (index)))
+		response = self._streamTrustedInputTransaction(transaction, 0x01, params)
+		return [ {'trustedInput': True, 'value': response[56 * i : 56 * (i + 1)]} for i in range(len(indexes)) ]
+
+	def _streamTrustedInputTransaction(self, transaction, p2, params):
 		# Header
-		apdu = [ self.BTCHIP_CLA, self.BTCHIP_INS_GET_TRUSTED_INPUT, 0x00, 0x00 ]
-		params = bytearray.fromhex("%.8x" % (index))
+		apdu = [ self.BTCHIP_CLA, self.BTCHIP_INS_GET_TRUSTED_INPUT, 0x00, p2 ]
+		params = bytearray(params)
 		params.extend(transaction.version)
 		writeVarint(len(transaction.inputs), params)
 		apdu.append(len(params))
@@ -169,10 +197,7 @@ class btchip:
 		# Locktime
 		apdu = [ self.BTCHIP_CLA, self.BTCHIP_INS_GET_TRUSTED_INPUT, 0x80, 0x00, len(transaction.lockTime) ]
 		apdu.extend(transaction.lockTime)
-		response = self.dongle.exchange(bytearray(apdu))
-		result['trustedInput'] = True
-		result['value'] = response
-		return result
+		return self.dongle.exchange(bytearray(apdu))
 
 	def startUntrustedTransaction(self, newTransaction, inputIndex, outputList, redeemScript, version=0x01, cashAddr=False, continueSegwit=False):
 		# Start building a fake transaction with the passed inputs
@@ -217,27 +242,24 @@ class btchip:
 			if currentIndex != inputIndex:
 				script = bytearray()
 			writeVarint(len(script), params)
+			# The input header is sent alone when a script follows (the app detects untrusted inputs
+			# from the length of that APDU), otherwise together with the sequence
+			if len(script) == 0:
+				params.extend(sequence)
 			apdu.append(len(params))
 			apdu.extend(params)
 			self.dongle.exchange(bytearray(apdu))
+			# Script and sequence in full APDUs, without splitting the sequence
+			data = script + sequence if len(script) > 0 else bytearray()
 			offset = 0
-			while(offset < len(script)):
-				blockLength = 255
-				if ((offset + blockLength) < len(script)):
-					dataLength = blockLength
-				else:
-					dataLength = len(script) - offset
-				params = script[offset : offset + dataLength]
-				if ((offset + dataLength) == len(script)):
-					params.extend(sequence)
-				apdu = [ self.BTCHIP_CLA, self.BTCHIP_INS_HASH_INPUT_START, 0x80, 0x00, len(params) ]
-				apdu.extend(params)
+			while(offset < len(data)):
+				dataLength = min(255, len(data) - offset)
+				if (len(data) - offset - dataLength) in (1, 2, 3):
+					dataLength = len(data) - offset - len(sequence)
+				apdu = [ self.BTCHIP_CLA, self.BTCHIP_INS_HASH_INPUT_START, 0x80, 0x00, dataLength ]
+				apdu.extend(data[offset : offset + dataLength])
 				self.dongle.exchange(bytearray(apdu))
-				offset += blockLength
-			if len(script) == 0:
-				apdu = [ self.BTCHIP_CLA, self.BTCHIP_INS_HASH_INPUT_START, 0x80, 0x00, len(sequence) ]
-				apdu.extend(sequence)
-				self.dongle.exchange(bytearray(apdu))				
+				offset += dataLength
 			currentIndex += 1
 
 	def finalizeInput(self, outputAddress, amount, fees, changePath, rawTx=None):
@@ -358,9 +380,13 @@ class btchip:
 			params = [];
 			if offset == 0:
 				params.extend(donglePath)
-				params.append((len(message) >> 8) & 0xff)
-				params.append(len(message) & 0xff)
-				p2 = 0x01
+				if len(message) > 0xffff:
+					params.extend(len(message).to_bytes(4, byteorder="big"))
+					p2 = 0x02
+				else:
+					params.append((len(message) >> 8) & 0xff)
+					params.append(len(message) & 0xff)
+					p2 = 0x01
 			else:
 				p2 = 0x80
 			blockLength = 255 - len(params)
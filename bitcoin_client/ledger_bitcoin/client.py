@@ -1,44 +1,263 @@
-from typing import Tuple, List, Mapping, Optional, Union
+from typing import Any, Callable, FrozenSet, Iterator, Tuple, List, Mapping, Optional, Sequence, Union
 import base64
-from io import BytesIO, BufferedReader
-
-from .command_builder import BitcoinCommandBuilder, BitcoinInsType
-from .common import Chain, read_varint
-from .client_command import ClientCommandInterpreter
-from .client_base import Client, TransportClient
+import mmap
+from concurrent.futures import ThreadPoolExecutor
+import queue
+import threading
+from io import BytesIO
+
+from .command_builder import BitcoinCommandBuilder, BitcoinInsType, WalletAddressesMode
+from .common import AddressType, Chain, bip32_path_from_string, read, read_varint, sha256, write_varint
+from .client_command import ClientCommandInterpreter, ClientCapability, KnownMerkleTrees, KnownPreimages, CLIENT_CAPABILITIES, MAX_RESPONSE_LEN, MIN_RESPONSE_LEN
+from .client_base import Client, ClientFlow, SignPsbtCheckpoint, TransportClient, cached_client_flow, client_flow
 from .client_legacy import LegacyClient
 from .exception import DeviceException
-from .merkle import get_merkleized_map_commitment
+from .instrumentation import Instrumentation, parse_cache_stats, parse_perf_counters
 from .wallet import Wallet, WalletType, PolicyMapWallet
-from .psbt import PSBT
-from ._serialize import deser_string
+from .wallet_scripts import compute_wallet_scripts_merkle_root
+from .request_cache import RequestCache
+from .psbt import PSBT, PartiallySignedInput, OWNERSHIP_TOKEN_LEN, PREVOUT_TOKEN_LEN, prune_for_signing
+from ._serialize import ser_sig_der
+from .merkle import MerkleTree
 
 
-def parse_stream_to_map(f: BufferedReader) -> Mapping[bytes, bytes]:
-    result = {}
-    while True:
-        try:
-            key = deser_string(f)
-        except Exception:
-            break
+# length of the chunks the message is split into in sign_message
+MESSAGE_CHUNK_SIZE = 255
 
-        # Check for separator
-        if len(key) == 0:
-            break
+# first byte of the checkpoints yielded by sign_psbt among the signatures
+SIGN_PSBT_CHECKPOINT_MARKER = 0xFF
 
-        value = deser_string(f)
+# first byte of the trusted prevout tokens yielded by sign_psbt among the signatures
+SIGN_PSBT_PREVOUT_TOKEN_MARKER = 0xFE
 
-        result[key] = value
-    return result
+# the key of the witness UTXO in the input maps
+_PSBT_IN_WITNESS_UTXO_KEY = bytes([PartiallySignedInput.PSBT_IN_WITNESS_UTXO])
 
 
-class NewClient(Client):
-    # internal use for testing: if set to True, sign_psbt will not clone the psbt before converting to psbt version 2
-    _no_clone_psbt: bool = False
+def _is_schnorr_input(input_map: Mapping[bytes, bytes]) -> bool:
+    """Returns True if the device signs the input with a Schnorr signature, that is, if the scriptPubKey of its witness
+    UTXO is a segwit v1 output."""
+    witness_utxo = input_map.get(_PSBT_IN_WITNESS_UTXO_KEY)
+    if witness_utxo is None or len(witness_utxo) <= 8:
+        return False
+    f = BytesIO(witness_utxo[8:])  # after the amount
+    return read_varint(f) > 1 and f.read(1) == b"\x51"
+
+
+def _der_from_compact_signature(signature: bytes) -> bytes:
+    """Re-encodes an ECDSA signature yielded in the compact encoding (r and s, followed by the sighash byte only if it is
+    not SIGHASH_ALL) as in the PSBT_IN_PARTIAL_SIG fields: in DER, followed by the sighash byte."""
+    if len(signature) not in (64, 65):
+        raise RuntimeError("Invalid response")
+    sighash_byte = signature[64:] or b"\x01"
+    return ser_sig_der(signature[:32], signature[32:64]) + sighash_byte
+
+
+# the wallet types of PolicyMapWallet
+_POLICY_MAP_WALLET_TYPES = [WalletType.POLICYMAP, WalletType.POLICYMAP_BINARY, WalletType.POLICYMAP_BINARY_KEYS]
+
+
+class PreparedPsbt:
+    """A PSBT and a wallet policy, prepared for SIGN_PSBT.
+
+    The PSBT is parsed into its maps, in order to compute the Merkleized map commitments sent in the command, and the
+    preimages and Merkle trees that the hardware wallet can ask about while signing it are collected in `known_trees`.
+    The hardware wallet never modifies them, therefore the same instance can be passed to `sign_psbt` repeatedly (for
+    example, to retry after a communication error), or to sign the PSBT on several devices (see `multi_device`).
+
+    It can also be saved with `serialize`, and loaded with `deserialize` in another process; all the trees are built
+    before serializing, so that nothing is hashed again when loading.
+
+    With `from_file`, the PSBT is memory-mapped from a file instead, and only the positions of the values are kept:
+    the values are read from the file when hashed or sent to the device, so that the memory used does not grow with
+    the size of the PSBT (for example, of its non-witness UTXOs).
+
+    The fields that the hardware wallet never reads while signing (see `prune_for_signing`) are left out of the maps,
+    so that they are neither hashed nor sent; as the PSBT itself is not modified, they are all still in it after
+    signing.
+
+    If the PSBT lists other wallet policies whose inputs are signed in the same command (see `add_wallet_policy`), they
+    must be given in `other_wallets`, so that the hardware wallet can ask about them.
+
+    With `max_workers` greater than 1, the Merkleized map commitments of the maps are computed in a pool of that many
+    threads, which makes preparing PSBTs with hundreds of inputs faster on multi-core hosts.
+
+    The indices of the inputs signed with Schnorr signatures are kept in `schnorr_inputs`, so that the device can yield
+    the ECDSA signatures of the other inputs in the compact encoding (see `sign_psbt`).
+    """
+
+    SERIALIZATION_VERSION = 2
+
+    def __init__(self, psbt: PSBT, wallet: Wallet, other_wallets: Sequence[Wallet] = (), max_workers: int = 1) -> None:
+        # A PSBTv0 is sent as-is, without converting it to version 2: the device parses the inputs' outpoints and
+        # sequences, and the outputs, from the unsigned transaction.
+
+        # We get the individual maps (global map, each input map, and each output map) directly from the psbt, in order
+        # to produce the serialized Merkleized map commitments.
+        self._prepare(wallet, other_wallets, psbt.get_map(), [psbt_in.get_map() for psbt_in in psbt.inputs],
+                      [psbt_out.get_map() for psbt_out in psbt.outputs], max_workers)
+
+    @classmethod
+    def from_file(cls, path: str, wallet: Wallet, other_wallets: Sequence[Wallet] = (),
+                  max_workers: int = 1) -> "PreparedPsbt":
+        """Prepares the PSBT in the file at `path`, without loading it in memory; the file must contain the binary
+        serialization of the PSBT (as returned by `PSBT.serialize_bytes`), not its base 64 encoding, and must not be
+        modified while the returned instance is in use."""
+        with open(path, "rb") as f:
+            mapped = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+        prepared = cls.__new__(cls)
+        prepared._mmap = mapped  # the values of the maps are views of it
+        prepared._prepare(wallet, other_wallets, *PSBT.scan_maps(memoryview(mapped)), max_workers)
+        return prepared
+
+    def _prepare(self, wallet: Wallet, other_wallets: Sequence[Wallet], global_map: Mapping[bytes, bytes],
+                 input_maps: List[Mapping[bytes, bytes]], output_maps: List[Mapping[bytes, bytes]],
+                 max_workers: int = 1) -> None:
+        # We collect all the relevant Merkle trees and pre-images in the psbt, for the client interpreter to respond on
+        # queries.
+        self.wallet_id = wallet.id
+
+        known = ClientCommandInterpreter()
+        self.known_trees = known.known_trees
 
-    def __init__(self, comm_client: TransportClient, chain: Chain = Chain.MAIN, debug: bool = False) -> None:
-        super().__init__(comm_client, chain, debug)
+        wallets = [wallet, *other_wallets]
+        for w in wallets:
+            known.add_known_list(w.serialized_keys_info())
+            known.add_known_preimage(w.serialize())
+
+        # If all the keys of the wallets have an origin, the BIP32 derivations of other keys are pruned too
+        keys_info = [k for w in wallets for k in w.keys_info]
+        fingerprints = None
+        if all(k.startswith("[") for k in keys_info):
+            fingerprints = {bytes.fromhex(k[1:9]) for k in keys_info}
+        global_map, input_maps, output_maps = prune_for_signing(global_map, input_maps, output_maps, fingerprints)
+
+        self.schnorr_inputs: Optional[FrozenSet[int]] = frozenset(
+            i for i, input_map in enumerate(input_maps) if _is_schnorr_input(input_map))
+
+        # The Merkle trees of the maps are only built if the device asks about them
+        self.global_commitment = known.add_known_mapping(global_map)
+
+        if max_workers > 1:
+            with ThreadPoolExecutor(max_workers) as executor:
+                input_commitments = known.add_known_mappings(input_maps, executor)
+                output_commitments = known.add_known_mappings(output_maps, executor)
+        else:
+            input_commitments = known.add_known_mappings(input_maps)
+            output_commitments = known.add_known_mappings(output_maps)
+
+        # We also add the Merkle tree of the input (resp. output) map commitments as a known tree
+
+        self.n_inputs = len(input_commitments)
+        self.inputs_root = self.known_trees.build(input_commitments).root
+        self.n_outputs = len(output_commitments)
+        self.outputs_root = self.known_trees.build(output_commitments).root
+
+    @classmethod
+    def of(cls, psbt: Union[PSBT, "PreparedPsbt"], wallet: Wallet) -> "PreparedPsbt":
+        """Returns `psbt` if already prepared, after checking that it was prepared with `wallet`; otherwise, prepares
+        it."""
+        if not isinstance(psbt, PreparedPsbt):
+            return cls(psbt, wallet)
+
+        if psbt.wallet_id != wallet.id:
+            raise ValueError("The PSBT was prepared with a different wallet")
+        return psbt
+
+    def build_all_trees(self) -> None:
+        """Builds all the Merkle trees that are built lazily otherwise; afterwards, `known_trees` is only read while
+        signing, so that the PSBT can be signed on several devices concurrently."""
+        self.known_trees.build_all()
+
+    def serialize(self) -> bytes:
+        """Returns the serialization of the prepared PSBT, to be loaded with `deserialize`."""
+        self.build_all_trees()
+
+        preimages = dict.items(self.known_trees.known_preimages)
+        trees = dict.values(self.known_trees)
+
+        # without the indices of the Schnorr inputs, if loaded from the version 1
+        version = self.SERIALIZATION_VERSION if self.schnorr_inputs is not None else 1
+
+        result = [
+            bytes([version]),
+            self.wallet_id,
+            write_varint(len(self.global_commitment)),
+            self.global_commitment,
+            write_varint(self.n_inputs),
+            self.inputs_root,
+            write_varint(self.n_outputs),
+            self.outputs_root,
+        ]
+        if self.schnorr_inputs is not None:
+            result.append(write_varint(len(self.schnorr_inputs)))
+            result += [write_varint(i) for i in sorted(self.schnorr_inputs)]
+        result.append(write_varint(len(preimages)))
+        for key, preimage in preimages:
+            result += [key, write_varint(len(preimage)), bytes(preimage)]
+
+        result.append(write_varint(len(trees)))
+        for mt in trees:
+            result.append(write_varint(len(mt.levels)))
+            for level in mt.levels:
+                result += [write_varint(len(level)), *level]
+
+        return b"".join(result)
+
+    @classmethod
+    def deserialize(cls, data: bytes) -> "PreparedPsbt":
+        """Loads a prepared PSBT from the result of `serialize`."""
+        f = BytesIO(data)
+
+        version = f.read(1)
+        if version not in (bytes([1]), bytes([cls.SERIALIZATION_VERSION])):
+            raise ValueError("Unsupported serialization of PreparedPsbt")
+
+        prepared = cls.__new__(cls)
+        prepared.wallet_id = read(f, 32)
+        prepared.global_commitment = read(f, read_varint(f))
+        prepared.n_inputs = read_varint(f)
+        prepared.inputs_root = read(f, 32)
+        prepared.n_outputs = read_varint(f)
+        prepared.outputs_root = read(f, 32)
+        # unknown in version 1, where the signatures are then yielded in DER
+        prepared.schnorr_inputs = None
+        if version != bytes([1]):
+            prepared.schnorr_inputs = frozenset(read_varint(f) for _ in range(read_varint(f)))
+
+        known_preimages = KnownPreimages()
+        for _ in range(read_varint(f)):
+            key = read(f, 32)
+            dict.__setitem__(known_preimages, key, read(f, read_varint(f)))
+
+        prepared.known_trees = KnownMerkleTrees(known_preimages)
+        for _ in range(read_varint(f)):
+            levels = [[read(f, 32) for _ in range(read_varint(f))] for _ in range(read_varint(f))]
+            mt = MerkleTree.from_levels(levels)
+            prepared.known_trees[mt.root] = mt
+
+        if f.read(1) != b"":
+            raise ValueError("Unexpected data after the serialization of PreparedPsbt")
+
+        return prepared
+
+
+class NewClient(Client):
+    def __init__(self, comm_client: TransportClient, chain: Chain = Chain.MAIN, debug: bool = False,
+                 instrumentation: Optional[Instrumentation] = None,
+                 request_cache: Optional[RequestCache] = None) -> None:
+        super().__init__(comm_client, chain, debug, instrumentation)
         self.builder = BitcoinCommandBuilder()
+        self._max_response_len: Optional[int] = None
+        self._max_speculative_len: Optional[int] = None
+        # if not None, the results of get_extended_pubkey and get_wallet_address are cached in it (see RequestCache)
+        self.request_cache = request_cache
+        # the master fingerprint of the device, queried once for the keys of request_cache
+        self._master_fingerprint: Optional[bytes] = None
+        self._master_fingerprint_lock = threading.Lock()
+        # cleared if the device does not support GET_PERF_COUNTERS (see Instrumentation.collect_device_stats)
+        self._device_stats_supported = True
 
     # Modifies the behavior of the base method by taking care of SW_INTERRUPTED_EXECUTION responses
     def _make_request(
@@ -51,29 +270,125 @@ class NewClient(Client):
                 raise RuntimeError("Unexpected SW_INTERRUPTED_EXECUTION received.")
 
             command_response = client_intepreter.execute(response)
-            sw, response = self._apdu_exchange(
-                self.builder.continue_interrupted(command_response)
+
+            # if possible, also send the responses to the next client commands, if predictable
+            speculative_responses = client_intepreter.get_speculative_responses(
+                self._get_max_response_len() - 1 - len(command_response)
             )
+            if len(speculative_responses) > 0:
+                continue_apdu = self.builder.continue_interrupted_speculative(
+                    command_response, speculative_responses
+                )
+            else:
+                continue_apdu = self.builder.continue_interrupted(command_response)
+
+            sw, response = self._apdu_exchange(continue_apdu)
+
+        if self._should_collect_device_stats():
+            perf_sw, perf_response = self._apdu_exchange(self.builder.get_perf_counters())
+            cache_sw, cache_response = perf_sw, b""
+            if perf_sw == 0x9000:
+                cache_sw, cache_response = self._apdu_exchange(self.builder.get_cache_stats())
+            self._report_device_stats(apdu, perf_sw, perf_response, cache_sw, cache_response)
 
         return sw, response
 
+    def _should_collect_device_stats(self) -> bool:
+        return (self.instrumentation is not None and self.instrumentation.collect_device_stats
+                and self._device_stats_supported)
+
+    def _report_device_stats(self, apdu: dict, perf_sw: int, perf_response: bytes, cache_sw: int,
+                             cache_response: bytes) -> None:
+        """Passes the statistics of the device for the command `apdu` to the instrumentation; they are not queried
+        again if the device does not support them."""
+        if perf_sw != 0x9000 or cache_sw != 0x9000:
+            self._device_stats_supported = False
+            return
+        self.instrumentation.on_device_stats(int(apdu["cla"]), int(apdu["ins"]), parse_perf_counters(perf_response),
+                                             parse_cache_stats(cache_response))
+
+    def _get_max_response_len(self) -> int:
+        """Returns the maximum length of a response to a client command supported by the device.
+
+        The device is only queried the first time; versions of the app that do not support the
+        GET_MAX_RESPONSE_LEN command are assumed to support responses up to 255 bytes, and no
+        speculative responses.
+        """
+        if self._max_response_len is None:
+            self._set_max_response_len(*self._apdu_exchange(self.builder.get_max_response_len()))
+        return self._max_response_len
+
+    def _set_max_response_len(self, sw: int, response: bytes) -> None:
+        """Stores the maximum lengths from the response to the GET_MAX_RESPONSE_LEN command."""
+        if sw == 0x9000 and len(response) >= 2:
+            max_response_len = int.from_bytes(response[0:2], byteorder="big")
+            self._max_response_len = max(MIN_RESPONSE_LEN, min(max_response_len, MAX_RESPONSE_LEN))
+            self._max_speculative_len = response[2] if len(response) >= 3 else 0
+        else:
+            self._max_response_len = MAX_RESPONSE_LEN
+            self._max_speculative_len = 0
+
+    def _get_max_speculative_len(self) -> int:
+        """Returns the maximum total length of the speculative responses supported by the device."""
+        self._get_max_response_len()
+        return self._max_speculative_len
+
+    def _get_cached_master_fingerprint(self) -> bytes:
+        with self._master_fingerprint_lock:
+            if self._master_fingerprint is None:
+                self._master_fingerprint = self.get_master_fingerprint()
+            return self._master_fingerprint
+
+    def _run_cached_flow(self, key: tuple, make_flow: Callable[[], ClientFlow]) -> Any:
+        """Runs the flow returned by `make_flow`, unless the result of the same request to the same device is in the
+        request cache, or is already being requested by another thread."""
+        key = (self._get_cached_master_fingerprint(), self.chain) + key
+        return self.request_cache.run(key, lambda: self._run_flow(make_flow()))
+
+    def _new_client_interpreter(self, client_capabilities: int = 0,
+                                known_trees: Optional[KnownMerkleTrees] = None,
+                                on_yield: Optional[Callable[[bytes], None]] = None) -> ClientCommandInterpreter:
+        return ClientCommandInterpreter(self._get_max_response_len(), self._get_max_speculative_len(),
+                                        client_capabilities, known_trees, self.instrumentation, on_yield)
+
+    def _get_extended_pubkey_cache_key(self, path: str, display: bool = False) -> Optional[tuple]:
+        return None if display else tuple(bip32_path_from_string(path))
+
+    @cached_client_flow(_get_extended_pubkey_cache_key)
     def get_extended_pubkey(self, path: str, display: bool = False) -> str:
-        sw, response = self._make_request(self.builder.get_extended_pubkey(path, display))
+        sw, response = yield from self._request(self.builder.get_extended_pubkey(path, display))
 
         if sw != 0x9000:
             raise DeviceException(error_code=sw, ins=BitcoinInsType.GET_EXTENDED_PUBKEY)
 
         return response.decode()
 
+    @client_flow
+    def get_extended_pubkeys(self, paths: List[str]) -> List[str]:
+        client_intepreter = self._new_client_interpreter(CLIENT_CAPABILITIES)
+
+        sw, _ = yield from self._request(
+            self.builder.get_extended_pubkeys(paths, CLIENT_CAPABILITIES), client_intepreter
+        )
+
+        if sw != 0x9000:
+            raise DeviceException(error_code=sw, ins=BitcoinInsType.GET_EXTENDED_PUBKEYS)
+
+        if len(client_intepreter.yielded) != len(paths):
+            raise RuntimeError("Invalid response")
+
+        return [res.decode() for res in client_intepreter.yielded]
+
+    @client_flow
     def register_wallet(self, wallet: Wallet) -> Tuple[bytes, bytes]:
-        if wallet.type != WalletType.POLICYMAP:
-            raise ValueError("wallet type must be POLICYMAP")
+        if wallet.type not in _POLICY_MAP_WALLET_TYPES:
+            raise ValueError("wallet type must be POLICYMAP, POLICYMAP_BINARY or POLICYMAP_BINARY_KEYS")
 
-        client_intepreter = ClientCommandInterpreter()
+        client_intepreter = self._new_client_interpreter()
         client_intepreter.add_known_preimage(wallet.serialize())
-        client_intepreter.add_known_list([k.encode() for k in wallet.keys_info])
+        client_intepreter.add_known_list(wallet.serialized_keys_info())
 
-        sw, response = self._make_request(
+        sw, response = yield from self._request(
             self.builder.register_wallet(wallet), client_intepreter
         )
 
@@ -88,6 +403,66 @@ class NewClient(Client):
 
         return wallet_id, wallet_hmac
 
+    @client_flow
+    def register_wallets(self, wallets: List[Wallet]) -> List[Tuple[bytes, bytes]]:
+        for wallet in wallets:
+            if wallet.type not in _POLICY_MAP_WALLET_TYPES:
+                raise ValueError("wallet type must be POLICYMAP, POLICYMAP_BINARY or POLICYMAP_BINARY_KEYS")
+
+        if len(wallets) == 0:
+            raise ValueError("no wallets to register")
+
+        client_intepreter = self._new_client_interpreter()
+        for wallet in wallets:
+            client_intepreter.add_known_preimage(wallet.serialize())
+        # the keys must be the same for all the wallets
+        client_intepreter.add_known_list(wallets[0].serialized_keys_info())
+
+        sw, response = yield from self._request(
+            self.builder.register_wallets(wallets), client_intepreter
+        )
+
+        if sw != 0x9000:
+            raise DeviceException(error_code=sw, ins=BitcoinInsType.REGISTER_WALLETS)
+
+        if len(response) != 32 * len(wallets):
+            raise RuntimeError(f"Invalid response length: {len(response)}")
+
+        return [(wallet.id, response[32 * i:32 * (i + 1)]) for i, wallet in enumerate(wallets)]
+
+    @client_flow
+    def open_wallet_session(self, wallet: Wallet, wallet_hmac: bytes) -> None:
+        if wallet.type not in _POLICY_MAP_WALLET_TYPES or not isinstance(
+            wallet, PolicyMapWallet
+        ):
+            raise ValueError("wallet type must be POLICYMAP, POLICYMAP_BINARY or POLICYMAP_BINARY_KEYS")
+
+        if len(wallet_hmac) != 32:
+            raise ValueError("wallet_hmac must be exactly 32 bytes long")
+
+        client_intepreter = self._new_client_interpreter(CLIENT_CAPABILITIES)
+        client_intepreter.add_known_preimage(wallet.serialize())
+        client_intepreter.add_known_list(wallet.serialized_keys_info())
+
+        sw, _ = yield from self._request(
+            self.builder.open_wallet_session(wallet, wallet_hmac, CLIENT_CAPABILITIES), client_intepreter
+        )
+
+        if sw != 0x9000:
+            raise DeviceException(error_code=sw, ins=BitcoinInsType.OPEN_WALLET_SESSION)
+
+    @client_flow
+    def close_wallet_session(self) -> None:
+        sw, _ = yield from self._request(self.builder.close_wallet_session())
+
+        if sw != 0x9000:
+            raise DeviceException(error_code=sw, ins=BitcoinInsType.CLOSE_WALLET_SESSION)
+
+    def _get_wallet_address_cache_key(self, wallet: Wallet, wallet_hmac: Optional[bytes], change: int,
+                                      address_index: int, display: bool) -> Optional[tuple]:
+        return None if display else (wallet.id, wallet_hmac, change, address_index)
+
+    @cached_client_flow(_get_wallet_address_cache_key)
     def get_wallet_address(
         self,
         wallet: Wallet,
@@ -97,21 +472,21 @@ class NewClient(Client):
         display: bool,
     ) -> str:
 
-        if wallet.type != WalletType.POLICYMAP or not isinstance(
+        if wallet.type not in _POLICY_MAP_WALLET_TYPES or not isinstance(
             wallet, PolicyMapWallet
         ):
-            raise ValueError("wallet type must be POLICYMAP")
+            raise ValueError("wallet type must be POLICYMAP, POLICYMAP_BINARY or POLICYMAP_BINARY_KEYS")
 
         if change != 0 and change != 1:
             raise ValueError("Invalid change")
 
-        client_intepreter = ClientCommandInterpreter()
-        client_intepreter.add_known_list([k.encode() for k in wallet.keys_info])
+        client_intepreter = self._new_client_interpreter(CLIENT_CAPABILITIES)
+        client_intepreter.add_known_list(wallet.serialized_keys_info())
         client_intepreter.add_known_preimage(wallet.serialize())
 
-        sw, response = self._make_request(
+        sw, response = yield from self._request(
             self.builder.get_wallet_address(
-                wallet, wallet_hmac, address_index, change, display
+                wallet, wallet_hmac, address_index, change, display, CLIENT_CAPABILITIES
             ),
             client_intepreter,
         )
@@ -121,18 +496,199 @@ class NewClient(Client):
 
         return response.decode()
 
-    def sign_psbt(self, psbt: PSBT, wallet: Wallet, wallet_hmac: Optional[bytes]) -> Mapping[int, bytes]:
+    def _get_wallet_addresses(
+        self,
+        wallet: Wallet,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        start_index: int,
+        count: int,
+        mode: WalletAddressesMode,
+    ) -> ClientFlow:
+
+        if wallet.type not in _POLICY_MAP_WALLET_TYPES or not isinstance(
+            wallet, PolicyMapWallet
+        ):
+            raise ValueError("wallet type must be POLICYMAP, POLICYMAP_BINARY or POLICYMAP_BINARY_KEYS")
+
+        if change != 0 and change != 1:
+            raise ValueError("Invalid change")
+
+        client_intepreter = self._new_client_interpreter(CLIENT_CAPABILITIES)
+        client_intepreter.add_known_list(wallet.serialized_keys_info())
+        client_intepreter.add_known_preimage(wallet.serialize())
+
+        sw, response = yield from self._request(
+            self.builder.get_wallet_addresses(
+                wallet, wallet_hmac, start_index, count, change, mode, CLIENT_CAPABILITIES
+            ),
+            client_intepreter,
+        )
+
+        if sw != 0x9000:
+            raise DeviceException(error_code=sw, ins=BitcoinInsType.GET_WALLET_ADDRESSES)
+
+        if len(response) != 32:
+            raise RuntimeError("Invalid response")
+
+        # the addresses, or the ownership tokens
+        elements: List[bytes] = []
+        for i, res in enumerate(client_intepreter.yielded):
+            if len(res) <= 4 or int.from_bytes(res[:4], byteorder="big") != start_index + i:
+                raise RuntimeError("Invalid response")
+            elements.append(res[4:])
+
+        if mode == WalletAddressesMode.YIELD:
+            if len(elements) != count or sha256(b''.join(bytes([len(a)]) + a for a in elements)) != response:
+                raise RuntimeError("Invalid response")
+            return [a.decode() for a in elements], response
+        elif mode == WalletAddressesMode.OWNERSHIP_TOKENS:
+            if len(elements) != count or any(len(t) != OWNERSHIP_TOKEN_LEN for t in elements):
+                raise RuntimeError("Invalid response")
+        elif len(elements) != 0:
+            raise RuntimeError("Invalid response")
+
+        return elements, response
+
+    @client_flow
+    def get_wallet_addresses(
+        self,
+        wallet: Wallet,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        start_index: int,
+        count: int,
+    ) -> List[str]:
+        addresses, _ = yield from self._get_wallet_addresses(
+            wallet, wallet_hmac, change, start_index, count, WalletAddressesMode.YIELD)
+        return addresses
+
+    @client_flow
+    def get_wallet_addresses_digest(
+        self,
+        wallet: Wallet,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        start_index: int,
+        count: int,
+    ) -> bytes:
+        _, digest = yield from self._get_wallet_addresses(
+            wallet, wallet_hmac, change, start_index, count, WalletAddressesMode.DIGEST)
+        return digest
+
+    @client_flow
+    def get_wallet_scripts_merkle_root(
+        self,
+        wallet: Wallet,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        start_index: int,
+        count: int,
+    ) -> bytes:
+        _, root = yield from self._get_wallet_addresses(
+            wallet, wallet_hmac, change, start_index, count, WalletAddressesMode.SCRIPTS_MERKLE_ROOT)
+        return root
+
+    @client_flow
+    def verify_wallet_scripts(
+        self,
+        wallet: Wallet,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        start_index: int,
+        count: int,
+    ) -> bool:
+        if not isinstance(wallet, PolicyMapWallet):
+            raise ValueError("wallet type must be POLICYMAP, POLICYMAP_BINARY or POLICYMAP_BINARY_KEYS")
+
+        # computed before the request, so that an unsupported policy fails without any exchange with the device
+        expected_root = compute_wallet_scripts_merkle_root(wallet, change, start_index, count)
+
+        _, root = yield from self._get_wallet_addresses(
+            wallet, wallet_hmac, change, start_index, count, WalletAddressesMode.SCRIPTS_MERKLE_ROOT)
+        return root == expected_root
+
+    @client_flow
+    def get_wallet_ownership_tokens(
+        self,
+        wallet: Wallet,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        start_index: int,
+        count: int,
+    ) -> List[bytes]:
+        tokens, _ = yield from self._get_wallet_addresses(
+            wallet, wallet_hmac, change, start_index, count, WalletAddressesMode.OWNERSHIP_TOKENS)
+        return tokens
+
+    @client_flow
+    def scan_wallet_scripts(
+        self,
+        wallet: Wallet,
+        wallet_hmac: Optional[bytes],
+        scripts: List[bytes],
+        start_index: int,
+        window_size: int,
+    ) -> List[Tuple[int, int, int]]:
+
+        if wallet.type not in _POLICY_MAP_WALLET_TYPES or not isinstance(
+            wallet, PolicyMapWallet
+        ):
+            raise ValueError("wallet type must be POLICYMAP, POLICYMAP_BINARY or POLICYMAP_BINARY_KEYS")
+
+        if len(scripts) == 0:
+            raise ValueError("The list of scripts cannot be empty")
+
+        client_intepreter = self._new_client_interpreter(CLIENT_CAPABILITIES)
+        client_intepreter.add_known_list(wallet.serialized_keys_info())
+        client_intepreter.add_known_preimage(wallet.serialize())
+        client_intepreter.add_known_list(scripts)
+
+        sw, response = yield from self._request(
+            self.builder.scan_wallet_scripts(
+                wallet, wallet_hmac, scripts, start_index, window_size, CLIENT_CAPABILITIES
+            ),
+            client_intepreter,
+        )
+
+        if sw != 0x9000:
+            raise DeviceException(error_code=sw, ins=BitcoinInsType.SCAN_WALLET_SCRIPTS)
+
+        if len(response) != 4 or int.from_bytes(response, byteorder="big") != len(client_intepreter.yielded):
+            raise RuntimeError("Invalid response")
+
+        matches: List[Tuple[int, int, int]] = []
+        for res in client_intepreter.yielded:
+            if len(res) != 9:
+                raise RuntimeError("Invalid response")
+            list_index = int.from_bytes(res[0:4], byteorder="big")
+            change = res[4]
+            address_index = int.from_bytes(res[5:9], byteorder="big")
+            if (list_index >= len(scripts) or change > 1
+                    or not (start_index <= address_index < start_index + window_size)):
+                raise RuntimeError("Invalid response")
+            matches.append((list_index, change, address_index))
+
+        return matches
+
+    def sign_psbt(self, psbt: Union[PSBT, PreparedPsbt], wallet: Wallet, wallet_hmac: Optional[bytes],
+                  checkpoint: Optional[SignPsbtCheckpoint] = None,
+                  batch_review: bool = False,
+                  on_signature: Optional[Callable[[int, bytes], None]] = None,
+                  selected_inputs: Optional[Sequence[int]] = None) -> Mapping[int, bytes]:
         """Signs a PSBT using a registered wallet (or a standard wallet that does not need registration).
 
-        Signature requires explicit approval from the user.
+        Signature requires explicit approval from the user, unless a checkpoint is given.
 
         Parameters
         ----------
-        psbt : PSBT
+        psbt : Union[PSBT, PreparedPsbt]
             A PSBT of version 0 or 2, with all the necessary information to sign the inputs already filled in; what the
             required fields changes depending on the type of input.
             The non-witness UTXO must be present for both legacy and SegWit inputs, or the hardware wallet will reject
             signing. This is not required for Taproot inputs.
+            It can also be a `PreparedPsbt` of the PSBT with the same wallet, in order to not prepare it again when
+            signing the same PSBT more than once.
 
         wallet : Wallet
             The registered wallet policy, or a standard wallet policy.
@@ -140,60 +696,92 @@ class NewClient(Client):
         wallet_hmac: Optional[bytes]
             For a registered wallet, the hmac obtained at wallet registration. `None` for a standard wallet policy.
 
+        checkpoint: Optional[SignPsbtCheckpoint]
+            The `last_sign_psbt_checkpoint` after a previous call for the same PSBT and wallet that failed, for example
+            because of a communication error. Signing resumes from it, without the approval of the user; the
+            signatures of the checkpoint are included in the result.
+
+        batch_review: bool
+            If True and the transaction has at least 10 outputs, the user reviews the external outputs in summary: their
+            count, their total amount and a digest of all the outputs, instead of one at a time. The digest is the hex
+            of the first 16 bytes of the BIP-143 hashOutputs of the transaction (see `get_batch_review_digest`), and
+            must be shown to the user so that they can compare it with the one on the device.
+
+        on_signature: Optional[Callable[[int, bytes], None]]
+            If not None, it is called with the input index and the signature of each signature, as soon as it is
+            received, while the device keeps signing the other inputs; if it raises, signing is aborted. See also
+            `sign_psbt_iter`.
+
+        selected_inputs: Optional[Sequence[int]]
+            If not None, only the inputs with these indices are signed (if they are internal); the others are treated as
+            external without checking whether they belong to the wallet, which is faster for transactions where few
+            inputs are internal, like a CoinJoin. The user is warned about the external inputs, as usual.
+
         Returns
         -------
         Mapping[int, bytes]
             A mapping that has as keys the indexes of inputs that the Hardware Wallet signed, and the corresponding signatures as values.
         """
-        if psbt.version != 2:
-            if self._no_clone_psbt:
-                psbt.convert_to_v2()
-                psbt_v2 = psbt
-            else:
-                psbt_v2 = PSBT()
-                psbt_v2.deserialize(psbt.serialize())  # clone psbt
-                psbt_v2.convert_to_v2()
-        else:
-            psbt_v2 = psbt
-
-        psbt_bytes = base64.b64decode(psbt_v2.serialize())
-        f = BytesIO(psbt_bytes)
+        return self.sign_prepared_psbt(PreparedPsbt.of(psbt, wallet), wallet_hmac, checkpoint, batch_review,
+                                       on_signature, selected_inputs)
+
+    @client_flow
+    def sign_prepared_psbt(self, prepared: PreparedPsbt, wallet_hmac: Optional[bytes],
+                           checkpoint: Optional[SignPsbtCheckpoint] = None,
+                           batch_review: bool = False,
+                           on_signature: Optional[Callable[[int, bytes], None]] = None,
+                           selected_inputs: Optional[Sequence[int]] = None) -> Mapping[int, bytes]:
+        """The same as `sign_psbt`, for a PSBT and a wallet already prepared with `PreparedPsbt`."""
+        self.last_sign_psbt_checkpoint = None
+        self.last_sign_psbt_prevout_tokens = {}
+        results_map = dict(checkpoint.signatures) if checkpoint is not None else {}
+
+        # the ECDSA signatures are yielded in the compact encoding, and re-encoded in DER here, if the Schnorr inputs
+        # are known
+        client_capabilities = CLIENT_CAPABILITIES | (ClientCapability.BATCH_REVIEW if batch_review else 0)
+        if prepared.schnorr_inputs is not None:
+            client_capabilities |= ClientCapability.COMPACT_SIGNATURES
+
+        # the results are parsed as soon as they are received, so that the last checkpoint can be used to resume
+        # signing even if the command fails
+        def on_yield(res: bytes) -> None:
+            if len(res) <= 1:
+                raise RuntimeError("Invalid response")
 
-        # We parse the individual maps (global map, each input map, and each output map) from the psbt serialized as a
-        # sequence of bytes, in order to produce the serialized Merkleized map commitments. Moreover, we prepare the
-        # client interpreter to respond on queries on all the relevant Merkle trees and pre-images in the psbt.
-
-        assert f.read(5) == b"psbt\xff"
-
-        client_intepreter = ClientCommandInterpreter()
-        client_intepreter.add_known_list([k.encode() for k in wallet.keys_info])
-        client_intepreter.add_known_preimage(wallet.serialize())
-
-        global_map: Mapping[bytes, bytes] = parse_stream_to_map(f)
-        client_intepreter.add_known_mapping(global_map)
+            res_buffer = BytesIO(res)
+            if res[0] == SIGN_PSBT_CHECKPOINT_MARKER:
+                res_buffer.read(1)
+                next_input_index = int.from_bytes(res_buffer.read(4), byteorder="big")
+                self.last_sign_psbt_checkpoint = SignPsbtCheckpoint(
+                    next_input_index, res_buffer.read(), dict(results_map))
+                return
+            elif res[0] == SIGN_PSBT_PREVOUT_TOKEN_MARKER:
+                if len(res) != 1 + 4 + PREVOUT_TOKEN_LEN:
+                    raise RuntimeError("Invalid response")
+                self.last_sign_psbt_prevout_tokens[int.from_bytes(res[1:5], byteorder="big")] = res[5:]
+                return
 
-        input_maps: List[Mapping[bytes, bytes]] = []
-        for _ in range(len(psbt_v2.inputs)):
-            input_maps.append(parse_stream_to_map(f))
-        for m in input_maps:
-            client_intepreter.add_known_mapping(m)
+            input_index = read_varint(res_buffer)
+            signature = res_buffer.read()
+            if prepared.schnorr_inputs is not None and input_index not in prepared.schnorr_inputs:
+                signature = _der_from_compact_signature(signature)
 
-        output_maps: List[Mapping[bytes, bytes]] = []
-        for _ in range(len(psbt_v2.outputs)):
-            output_maps.append(parse_stream_to_map(f))
-        for m in output_maps:
-            client_intepreter.add_known_mapping(m)
+            if input_index in results_map:
+                raise RuntimeError(f"Multiple signatures produced for the same input: {input_index}")
 
-        # We also add the Merkle tree of the input (resp. output) map commitments as a known tree
-        input_commitments = [get_merkleized_map_commitment(m_in) for m_in in input_maps]
-        output_commitments = [get_merkleized_map_commitment(m_out) for m_out in output_maps]
+            results_map[input_index] = signature
+            if on_signature is not None:
+                on_signature(input_index, signature)
 
-        client_intepreter.add_known_list(input_commitments)
-        client_intepreter.add_known_list(output_commitments)
+        client_intepreter = self._new_client_interpreter(client_capabilities, prepared.known_trees, on_yield)
 
-        sw, _ = self._make_request(
+        sw, _ = yield from self._request(
             self.builder.sign_psbt(
-                global_map, input_maps, output_maps, wallet, wallet_hmac
+                prepared.global_commitment, prepared.n_inputs, prepared.inputs_root,
+                prepared.n_outputs, prepared.outputs_root, prepared.wallet_id, wallet_hmac,
+                client_capabilities,
+                (checkpoint.next_input_index, checkpoint.token) if checkpoint is not None else None,
+                sorted(set(selected_inputs)) if selected_inputs is not None else ()
             ),
             client_intepreter,
         )
@@ -201,59 +789,123 @@ class NewClient(Client):
         if sw != 0x9000:
             raise DeviceException(error_code=sw, ins=BitcoinInsType.SIGN_PSBT)
 
-        # parse results and return a structured version instead
-        results = client_intepreter.yielded
-
-        if any(len(x) <= 1 for x in results):
-            raise RuntimeError("Invalid response")
-
-        results_map = {}
-        for res in results:
-            res_buffer = BytesIO(res)
-            input_index = read_varint(res_buffer)
-            signature = res_buffer.read()
-
-            if input_index in results_map:
-                raise RuntimeError(f"Multiple signatures produced for the same input: {input_index}")
-
-            results_map[input_index] = signature
-
         return results_map
 
+    def sign_psbt_iter(self, psbt: Union[PSBT, PreparedPsbt], wallet: Wallet, wallet_hmac: Optional[bytes],
+                       checkpoint: Optional[SignPsbtCheckpoint] = None,
+                       batch_review: bool = False,
+                       selected_inputs: Optional[Sequence[int]] = None) -> Iterator[Tuple[int, bytes]]:
+        """The same as `sign_psbt`, as a generator of the pairs (input index, signature), each yielded as soon as it
+        is received from the device, while the device keeps signing the other inputs.
+
+        While the generator runs, the device is driven by another thread, and the client must not be used otherwise.
+        If signing fails, the error is raised by the generator after the signatures received before it. If the
+        generator is closed before the end, signing is aborted when the next signature is received.
+        """
+        results: "queue.Queue[Any]" = queue.Queue()
+        closed = threading.Event()
+
+        def on_signature(input_index: int, signature: bytes) -> None:
+            if closed.is_set():
+                raise RuntimeError("sign_psbt_iter was closed")
+            results.put((input_index, signature))
+
+        def sign() -> None:
+            try:
+                self.sign_psbt(psbt, wallet, wallet_hmac, checkpoint, batch_review, on_signature, selected_inputs)
+                results.put(None)
+            except BaseException as e:
+                results.put(e)
+
+        thread = threading.Thread(target=sign, daemon=True)
+        thread.start()
+        try:
+            while True:
+                result = results.get()
+                if result is None:
+                    return
+                if isinstance(result, BaseException):
+                    raise result
+                yield result
+        finally:
+            closed.set()
+            thread.join()
+
+    @client_flow
     def get_master_fingerprint(self) -> bytes:
-        sw, response = self._make_request(self.builder.get_master_fingerprint())
+        sw, response = yield from self._request(self.builder.get_master_fingerprint())
 
         if sw != 0x9000:
             raise DeviceException(error_code=sw, ins=BitcoinInsType.GET_EXTENDED_PUBKEY)
 
         return response
 
+    @client_flow
     def sign_message(self, message: Union[str, bytes], bip32_path: str) -> str:
         if isinstance(message, str):
             message_bytes = message.encode("utf-8")
         else:
             message_bytes = message
 
-        chunks = [message_bytes[64 * i: 64 * i + 64] for i in range((len(message_bytes) + 63) // 64)]
+        # the largest chunks supported by the device, in order to minimize the number of chunks to fetch
+        chunk_size = MESSAGE_CHUNK_SIZE
+        n_chunks = (len(message_bytes) + chunk_size - 1) // chunk_size
+        chunks = [message_bytes[chunk_size * i: chunk_size * i + chunk_size] for i in range(n_chunks)]
 
-        client_intepreter = ClientCommandInterpreter()
+        client_intepreter = self._new_client_interpreter()
         client_intepreter.add_known_list(chunks)
 
-        sw, response = self._make_request(self.builder.sign_message(message_bytes, bip32_path), client_intepreter)
+        sw, response = yield from self._request(
+            self.builder.sign_message(message_bytes, bip32_path, chunk_size), client_intepreter
+        )
 
         if sw != 0x9000:
             raise DeviceException(error_code=sw, ins=BitcoinInsType.GET_EXTENDED_PUBKEY)
 
         return base64.b64encode(response).decode('utf-8')
 
+    @client_flow
+    def sign_message_bip322(self, messages: List[Union[str, bytes]], bip32_path: str,
+                            address_type: AddressType) -> List[str]:
+        messages_bytes = [m.encode("utf-8") if isinstance(m, str) else m for m in messages]
+
+        client_intepreter = self._new_client_interpreter(CLIENT_CAPABILITIES)
+        client_intepreter.add_known_list(messages_bytes)
+
+        sw, _ = yield from self._request(
+            self.builder.sign_message_bip322(messages_bytes, bip32_path, address_type, CLIENT_CAPABILITIES),
+            client_intepreter
+        )
+
+        if sw != 0x9000:
+            raise DeviceException(error_code=sw, ins=BitcoinInsType.SIGN_MESSAGE_BIP322)
+
+        signatures: List[Optional[str]] = [None] * len(messages)
+        for res in client_intepreter.yielded:
+            res_buffer = BytesIO(res)
+            message_index = read_varint(res_buffer)
+            witness = res_buffer.read()
+
+            if message_index >= len(messages) or signatures[message_index] is not None or len(witness) == 0:
+                raise RuntimeError("Invalid response")
+
+            signatures[message_index] = base64.b64encode(witness).decode('utf-8')
+
+        if any(sig is None for sig in signatures):
+            raise RuntimeError("Missing signatures in the response")
+
+        return signatures
+
 
-def createClient(comm_client: Optional[TransportClient] = None, chain: Chain = Chain.MAIN, debug: bool = False) -> Union[LegacyClient, NewClient]:
+def createClient(comm_client: Optional[TransportClient] = None, chain: Chain = Chain.MAIN, debug: bool = False,
+                 instrumentation: Optional[Instrumentation] = None,
+                 request_cache: Optional[RequestCache] = None) -> Union[LegacyClient, NewClient]:
     if comm_client is None:
         comm_client = TransportClient("hid")
 
-    base_client = Client(comm_client, chain, debug)
+    base_client = Client(comm_client, chain, debug, instrumentation)
     _, app_version, _ = base_client.get_version()
     if app_version >= "2":
-        return NewClient(comm_client, chain, debug)
+        return NewClient(comm_client, chain, debug, instrumentation, request_cache)
     else:
-        return LegacyClient(comm_client, chain, debug)
+        return LegacyClient(comm_client, chain, debug, instrumentation)
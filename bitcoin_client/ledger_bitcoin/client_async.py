@@ -0,0 +1,292 @@
+import asyncio
+import time
+from typing import Any, AsyncIterator, Callable, List, Literal, Optional, Sequence, Tuple, Union
+
+from .client import NewClient, PreparedPsbt
+from .client_base import ApduException, ClientFlow, SignPsbtCheckpoint, print_apdu, print_response
+from .client_command import ClientCommandInterpreter
+from .common import Chain
+from .instrumentation import Instrumentation
+from .psbt import PSBT
+from .request_cache import RequestCache
+from .wallet import Wallet
+
+
+# vendor id of the Ledger devices, and usage page of the HID interface of the apps
+LEDGER_VENDOR_ID = 0x2C97
+LEDGER_USAGE_PAGE = 0xFFA0
+
+# framing of the APDUs over HID
+HID_PACKET_SIZE = 64
+HID_CHANNEL = 0x0101
+HID_TAG_APDU = 0x05
+
+# interval between two reads of the HID device while waiting for a response, in seconds
+HID_POLL_INTERVAL = 0.001
+
+
+def serialize_apdu(cla: int, ins: int, p1: int, p2: int, data: bytes) -> bytes:
+    return bytes([cla, ins, p1, p2, len(data)]) + data
+
+
+def wrap_hid_packets(apdu: bytes) -> List[bytes]:
+    """Splits an APDU in the HID packets of the Ledger transport protocol: each packet starts with the channel, the
+    tag and its sequence number, and the first one also contains the length of the APDU."""
+    data = len(apdu).to_bytes(2, byteorder="big") + apdu
+    packets = []
+    offset = 0
+    while offset < len(data) or len(packets) == 0:
+        header = HID_CHANNEL.to_bytes(2, byteorder="big") + bytes([HID_TAG_APDU]) + \
+            len(packets).to_bytes(2, byteorder="big")
+        chunk = data[offset:offset + HID_PACKET_SIZE - len(header)]
+        packets.append((header + chunk).ljust(HID_PACKET_SIZE, b"\x00"))
+        offset += len(chunk)
+    return packets
+
+
+class AsyncTransportClient:
+    """Asynchronous transport to a device, over HID or to Speculos over TCP. Nothing blocks the event loop while
+    waiting for the device, therefore a single event loop (and thread) can drive many devices at once. At most one
+    APDU is exchanged at a time on each transport."""
+
+    def __init__(self, interface: Literal['hid', 'tcp'] = "tcp", server: str = "127.0.0.1", port: int = 9999,
+                 debug: bool = False, hid_path: Optional[bytes] = None):
+        self.interface = interface
+        self.server = server
+        self.port = port
+        self.debug = debug
+        self.hid_path = hid_path
+
+        self.reader: Optional[asyncio.StreamReader] = None
+        self.writer: Optional[asyncio.StreamWriter] = None
+        self.hid_device = None
+        self.lock: Optional[asyncio.Lock] = None  # created in the event loop of the first exchange
+
+    async def _open(self) -> None:
+        if self.interface == "tcp":
+            if self.writer is None:
+                self.reader, self.writer = await asyncio.open_connection(self.server, self.port)
+        elif self.hid_device is None:
+            import hid
+
+            path = self.hid_path
+            if path is None:
+                for info in hid.enumerate(LEDGER_VENDOR_ID, 0):
+                    if info["interface_number"] == 0 or info["usage_page"] == LEDGER_USAGE_PAGE:
+                        path = info["path"]
+                        break
+                else:
+                    raise RuntimeError("No Ledger device found")
+
+            device = hid.device()
+            device.open_path(path)
+            device.set_nonblocking(True)
+            self.hid_device = device
+
+    async def _exchange_tcp(self, apdu: bytes) -> Tuple[int, bytes]:
+        self.writer.write(len(apdu).to_bytes(4, byteorder="big") + apdu)
+        await self.writer.drain()
+
+        length = int.from_bytes(await self.reader.readexactly(4), byteorder="big")
+        data = await self.reader.readexactly(length)
+        sw = int.from_bytes(await self.reader.readexactly(2), byteorder="big")
+        return sw, data
+
+    async def _read_hid_packet(self) -> bytes:
+        while True:
+            packet = self.hid_device.read(HID_PACKET_SIZE)
+            if len(packet) > 0:
+                return bytes(packet)
+            await asyncio.sleep(HID_POLL_INTERVAL)
+
+    async def _exchange_hid(self, apdu: bytes) -> Tuple[int, bytes]:
+        for packet in wrap_hid_packets(apdu):
+            self.hid_device.write(b"\x00" + packet)  # report id, then the packet
+
+        data = b""
+        length = None
+        seq = 0
+        while length is None or len(data) < length:
+            packet = await self._read_hid_packet()
+            if int.from_bytes(packet[0:2], byteorder="big") != HID_CHANNEL or packet[2] != HID_TAG_APDU or \
+                    int.from_bytes(packet[3:5], byteorder="big") != seq:
+                raise RuntimeError("Invalid HID packet received")
+            if seq == 0:
+                length = int.from_bytes(packet[5:7], byteorder="big")
+                data += packet[7:]
+            else:
+                data += packet[5:]
+            seq += 1
+
+        response = data[:length]
+        if len(response) < 2:
+            raise RuntimeError("Invalid response received")
+        return int.from_bytes(response[-2:], byteorder="big"), response[:-2]
+
+    async def apdu_exchange(
+        self, cla: int, ins: int, data: bytes = b"", p1: int = 0, p2: int = 0
+    ) -> bytes:
+        apdu = serialize_apdu(cla, ins, p1, p2, data)
+        if self.lock is None:
+            self.lock = asyncio.Lock()
+        async with self.lock:
+            await self._open()
+            if self.interface == "tcp":
+                sw, response = await self._exchange_tcp(apdu)
+            else:
+                sw, response = await self._exchange_hid(apdu)
+
+        if sw != 0x9000:
+            raise ApduException(sw, response)
+
+        return response
+
+    async def stop(self) -> None:
+        if self.writer is not None:
+            self.writer.close()
+            await self.writer.wait_closed()
+            self.reader = self.writer = None
+        if self.hid_device is not None:
+            self.hid_device.close()
+            self.hid_device = None
+
+
+class AsyncNewClient(NewClient):
+    """The same client as `NewClient`, for an `AsyncTransportClient`: all the methods that communicate with the device
+    are coroutines, with the same parameters and results.
+
+    The client commands of the device are still answered by the synchronous `ClientCommandInterpreter`, whose work is
+    CPU-bound and short; therefore, many devices can be driven concurrently from the same event loop, for example with
+    `asyncio.gather`.
+    """
+
+    def __init__(self, transport_client: AsyncTransportClient, chain: Chain = Chain.MAIN, debug: bool = False,
+                 instrumentation: Optional[Instrumentation] = None,
+                 request_cache: Optional[RequestCache] = None) -> None:
+        super().__init__(transport_client, chain, debug, instrumentation, request_cache)
+        self._master_fingerprint_async_lock: Optional[asyncio.Lock] = None  # created in the event loop when needed
+
+    async def _apdu_exchange(self, apdu: dict) -> Tuple[int, bytes]:
+        start = time.perf_counter()
+        try:
+            if self.debug:
+                print_apdu(apdu)
+
+            response = await self.transport_client.apdu_exchange(**apdu)
+            if self.debug:
+                print_response(0x9000, response)
+
+            self._record_apdu(apdu, 0x9000, response, start)
+            return 0x9000, response
+        except ApduException as e:
+            if self.debug:
+                print_response(e.sw, e.data)
+
+            self._record_apdu(apdu, e.sw, e.data, start)
+            return e.sw, e.data
+
+    async def _make_request(
+        self, apdu: dict, client_intepreter: ClientCommandInterpreter = None
+    ) -> Tuple[int, bytes]:
+        sw, response = await self._apdu_exchange(apdu)
+
+        while sw == 0xE000:
+            if not client_intepreter:
+                raise RuntimeError("Unexpected SW_INTERRUPTED_EXECUTION received.")
+
+            command_response = client_intepreter.execute(response)
+
+            speculative_responses = client_intepreter.get_speculative_responses(
+                self._get_max_response_len() - 1 - len(command_response)
+            )
+            if len(speculative_responses) > 0:
+                continue_apdu = self.builder.continue_interrupted_speculative(
+                    command_response, speculative_responses
+                )
+            else:
+                continue_apdu = self.builder.continue_interrupted(command_response)
+
+            sw, response = await self._apdu_exchange(continue_apdu)
+
+        if self._should_collect_device_stats():
+            perf_sw, perf_response = await self._apdu_exchange(self.builder.get_perf_counters())
+            cache_sw, cache_response = perf_sw, b""
+            if perf_sw == 0x9000:
+                cache_sw, cache_response = await self._apdu_exchange(self.builder.get_cache_stats())
+            self._report_device_stats(apdu, perf_sw, perf_response, cache_sw, cache_response)
+
+        return sw, response
+
+    def _get_max_response_len(self) -> int:
+        # queried by _run_flow before the flows run, as it can not be awaited from them
+        assert self._max_response_len is not None
+        return self._max_response_len
+
+    async def _run_flow(self, flow: ClientFlow) -> Any:
+        if self._max_response_len is None:
+            self._set_max_response_len(*await self._apdu_exchange(self.builder.get_max_response_len()))
+
+        try:
+            request = next(flow)
+            while True:
+                try:
+                    response = await self._make_request(*request)
+                except Exception as e:
+                    request = flow.throw(e)
+                else:
+                    request = flow.send(response)
+        except StopIteration as e:
+            return e.value
+
+    async def _get_cached_master_fingerprint(self) -> bytes:
+        if self._master_fingerprint_async_lock is None:
+            self._master_fingerprint_async_lock = asyncio.Lock()
+        async with self._master_fingerprint_async_lock:
+            if self._master_fingerprint is None:
+                self._master_fingerprint = await self.get_master_fingerprint()
+            return self._master_fingerprint
+
+    async def _run_cached_flow(self, key: tuple, make_flow: Callable[[], ClientFlow]) -> Any:
+        key = (await self._get_cached_master_fingerprint(), self.chain) + key
+        return await self.request_cache.run_async(key, lambda: self._run_flow(make_flow()))
+
+    async def sign_psbt_iter(self, psbt: Union[PSBT, PreparedPsbt], wallet: Wallet, wallet_hmac: Optional[bytes],
+                             checkpoint: Optional[SignPsbtCheckpoint] = None,
+                             batch_review: bool = False,
+                             selected_inputs: Optional[Sequence[int]] = None) -> AsyncIterator[Tuple[int, bytes]]:
+        """The same as `NewClient.sign_psbt_iter`, as an asynchronous generator; the device is driven by another task
+        of the event loop."""
+        results: "asyncio.Queue[Any]" = asyncio.Queue()
+        closed = False
+
+        def on_signature(input_index: int, signature: bytes) -> None:
+            if closed:
+                raise RuntimeError("sign_psbt_iter was closed")
+            results.put_nowait((input_index, signature))
+
+        task = asyncio.ensure_future(self.sign_psbt(psbt, wallet, wallet_hmac, checkpoint, batch_review, on_signature,
+                                                    selected_inputs))
+        task.add_done_callback(lambda _: results.put_nowait(None))
+        try:
+            while True:
+                result = await results.get()
+                if result is None:
+                    break
+                yield result
+            task.result()  # raises the error of signing, if any
+        finally:
+            closed = True
+            await asyncio.wait([task])
+            if not task.cancelled():
+                task.exception()  # the error is expected if the generator was closed
+
+    async def stop(self) -> None:
+        """Stops the transport_client."""
+
+        await self.transport_client.stop()
+
+    async def __aenter__(self):
+        return self
+
+    async def __aexit__(self, exc_type, exc_val, exc_tb):
+        await self.transport_client.stop()
@@ -1,12 +1,15 @@
-from typing import Tuple, Mapping, Optional, Union, Literal
+from typing import Any, Callable, Dict, Generator, List, Tuple, Mapping, Optional, Sequence, Union, Literal
 from io import BytesIO
+import functools
+import time
 
 from ledgercomm import Transport
 
-from .common import Chain
+from .common import AddressType, Chain, hash256
 
 from .command_builder import DefaultInsType
 from .exception import DeviceException
+from .instrumentation import Instrumentation
 
 from .wallet import Wallet
 from .psbt import PSBT
@@ -60,13 +63,77 @@ def print_response(sw: int, data: bytes) -> None:
     print(f"<= {data.hex()}{sw.to_bytes(2, byteorder='big').hex()}")
 
 
+# A command of the client written as a generator: it yields the arguments of each request to the device (as for
+# `_make_request`), receives the tuple (sw, response), and returns the result of the command.
+ClientFlow = Generator[tuple, Tuple[int, bytes], Any]
+
+
+def client_flow(flow_fn: Callable[..., ClientFlow]) -> Callable[..., Any]:
+    """Decorator for the methods of a client that are written as a `ClientFlow`; the requests are sent with the
+    `_run_flow` method of the client, that is blocking for `Client`, while `AsyncNewClient` awaits them. The generator
+    function is kept as the `flow` attribute of the decorated method."""
+
+    @functools.wraps(flow_fn)
+    def wrapper(self, *args, **kwargs):
+        return self._run_flow(flow_fn(self, *args, **kwargs))
+
+    wrapper.flow = flow_fn
+    return wrapper
+
+
+def cached_client_flow(key_fn: Callable[..., Optional[tuple]]) -> Callable[[Callable[..., ClientFlow]], Callable[..., Any]]:
+    """Like `client_flow`, for the commands whose result only depends on the seed of the device and on their parameters.
+    If the client has a `request_cache`, the command is sent with its `_run_cached_flow` method, with the key returned
+    by `key_fn` when called with the same arguments as the method; if `key_fn` returns None (for example, if the result
+    is shown on the screen), the command is always sent to the device."""
+
+    def decorator(flow_fn: Callable[..., ClientFlow]) -> Callable[..., Any]:
+        @functools.wraps(flow_fn)
+        def wrapper(self, *args, **kwargs):
+            key = key_fn(self, *args, **kwargs) if self.request_cache is not None else None
+            if key is None:
+                return self._run_flow(flow_fn(self, *args, **kwargs))
+            return self._run_cached_flow((flow_fn.__name__,) + key, lambda: flow_fn(self, *args, **kwargs))
+
+        wrapper.flow = flow_fn
+        return wrapper
+
+    return decorator
+
+
+class SignPsbtCheckpoint:
+    """A checkpoint of `sign_psbt`, from which signing the same PSBT can resume without the approval of the user."""
+
+    def __init__(self, next_input_index: int, token: bytes, signatures: Mapping[int, bytes]) -> None:
+        self.next_input_index = next_input_index
+        self.token = token
+        # the signatures received before the checkpoint, for the inputs before next_input_index
+        self.signatures = signatures
+
+
+def get_batch_review_digest(psbt: PSBT) -> str:
+    """Returns the digest of the outputs of the PSBT that the device shows when signing with `batch_review`: the hex of
+    the first 16 bytes of the BIP-143 hashOutputs of the transaction."""
+    tx = psbt.get_unsigned_tx()
+    return hash256(b"".join(txout.serialize() for txout in tx.vout))[:16].hex()
+
+
 class Client:
-    def __init__(self, transport_client: TransportClient, chain: Chain = Chain.MAIN, debug: bool = False) -> None:
+    def __init__(self, transport_client: TransportClient, chain: Chain = Chain.MAIN, debug: bool = False,
+                 instrumentation: Optional[Instrumentation] = None) -> None:
         self.transport_client = transport_client
         self.chain = chain
         self.debug = debug
+        # if not None, its hooks are called for each APDU and client command
+        self.instrumentation = instrumentation
+        # the last checkpoint received during the last call to sign_psbt, if any
+        self.last_sign_psbt_checkpoint: Optional[SignPsbtCheckpoint] = None
+        # the trusted prevout tokens received during the last call to sign_psbt, by input index; they are only
+        # yielded if requested in the PSBT with `psbt.request_prevout_tokens`
+        self.last_sign_psbt_prevout_tokens: Dict[int, bytes] = {}
 
     def _apdu_exchange(self, apdu: dict) -> Tuple[int, bytes]:
+        start = time.perf_counter()
         try:
             if self.debug:
                 print_apdu(apdu)
@@ -75,16 +142,42 @@ class Client:
             if self.debug:
                 print_response(0x9000, response)
 
+            self._record_apdu(apdu, 0x9000, response, start)
             return 0x9000, response
         except ApduException as e:
             if self.debug:
                 print_response(e.sw, e.data)
 
+            self._record_apdu(apdu, e.sw, e.data, start)
             return e.sw, e.data
 
+    def _record_apdu(self, apdu: dict, sw: int, response: bytes, start: float) -> None:
+        """Calls the `on_apdu` hook of the instrumentation, if any, for an APDU sent at time `start`."""
+        if self.instrumentation is not None:
+            self.instrumentation.on_apdu(int(apdu["cla"]), int(apdu["ins"]), sw, 5 + len(apdu.get("data", b"")),
+                                         len(response) + 2, time.perf_counter() - start)
+
     def _make_request(self, apdu: dict) -> Tuple[int, bytes]:
         return self._apdu_exchange(apdu)
 
+    def _request(self, *args) -> ClientFlow:
+        """Sends a request with `_make_request(*args)` from a `ClientFlow`, and returns the tuple (sw, response)."""
+        return (yield args)
+
+    def _run_flow(self, flow: ClientFlow) -> Any:
+        """Runs a `ClientFlow`, sending each of its requests with `_make_request`."""
+        try:
+            request = next(flow)
+            while True:
+                try:
+                    response = self._make_request(*request)
+                except Exception as e:
+                    request = flow.throw(e)
+                else:
+                    request = flow.send(response)
+        except StopIteration as e:
+            return e.value
+
     def __enter__(self):
         return self
 
@@ -96,6 +189,7 @@ class Client:
 
         self.transport_client.stop()
 
+    @client_flow
     def get_version(self) -> Tuple[str, str, bytes]:
         """Queries the hardware wallet for the currently running app's name, version and state flags.
 
@@ -107,7 +201,7 @@ class Client:
             The third element is a binary string representing the platform's global state (pin lock etc).
         """
 
-        sw, response = self._make_request(
+        sw, response = yield from self._request(
             {"cla": 0xB0, "ins": DefaultInsType.GET_VERSION, "p1": 0, "p2": 0, "data": b''})
 
         if sw != 0x9000:
@@ -146,6 +240,24 @@ class Client:
 
         raise NotImplementedError
 
+    def get_extended_pubkeys(self, paths: List[str]) -> List[str]:
+        """Gets the serialized extended public keys for multiple BIP32 paths at once, without user validation.
+        All the paths must be standard. Consecutive paths with the same parent (for example, multiple accounts of the same
+        purpose) share the derivation of the parent key, so they are faster to compute.
+
+        Parameters
+        ----------
+        paths : List[str]
+            The BIP32 paths of the requested public keys; at most 16.
+
+        Returns
+        -------
+        List[str]
+            The requested serialized extended public keys, in the same order as `paths`.
+        """
+
+        raise NotImplementedError
+
     def register_wallet(self, wallet: Wallet) -> Tuple[bytes, bytes]:
         """Registers a wallet policy with the user. After approval returns the wallet id and hmac to be stored on the client.
 
@@ -163,6 +275,44 @@ class Client:
 
         raise NotImplementedError
 
+    def register_wallets(self, wallets: List[Wallet]) -> List[Tuple[bytes, bytes]]:
+        """Registers multiple wallet policies with the same keys, for example the wallets of the different accounts
+        of the same multisig setup. Each wallet policy is shown to the user, but the keys are shown only once.
+        After approval returns the wallet id and hmac to be stored on the client for each of the wallets.
+
+        Parameters
+        ----------
+        wallets : List[Wallet]
+            The Wallet policies to register on the device; at most 4, with the same keys and different names.
+
+        Returns
+        -------
+        List[Tuple[bytes, bytes]]
+            For each wallet, in the same order as `wallets`, the 32-bytes wallet id and the hmac.
+        """
+
+        raise NotImplementedError
+
+    def open_wallet_session(self, wallet: Wallet, wallet_hmac: bytes) -> None:
+        """Opens a session for a registered wallet policy: the device verifies the wallet policy and decodes its keys
+        once, and keeps them until the session is closed, another session is opened, or the device is locked.
+        The following commands with the same wallet policy and hmac do not need to send them again.
+
+        Parameters
+        ----------
+        wallet : Wallet
+            The registered wallet policy.
+        wallet_hmac : bytes
+            The 32-bytes hmac returned when the wallet policy was registered.
+        """
+
+        raise NotImplementedError
+
+    def close_wallet_session(self) -> None:
+        """Closes the wallet session opened with `open_wallet_session`, if any."""
+
+        raise NotImplementedError
+
     def get_wallet_address(
         self,
         wallet: Wallet,
@@ -199,10 +349,173 @@ class Client:
 
         raise NotImplementedError
 
-    def sign_psbt(self, psbt: PSBT, wallet: Wallet, wallet_hmac: Optional[bytes]) -> Mapping[int, bytes]:
+    def get_wallet_addresses(
+        self,
+        wallet: Wallet,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        start_index: int,
+        count: int,
+    ) -> List[str]:
+        """For a given wallet that was already registered on the device (or a standard wallet that does not need registration),
+        returns the addresses for a certain `change` and for `count` consecutive address indexes, starting from `start_index`.
+        The wallet is only verified once; the addresses are not shown on the device.
+
+        Parameters
+        ----------
+        wallet : Wallet
+            The registered wallet policy, or a standard wallet policy.
+
+        wallet_hmac: Optional[bytes]
+            For a registered wallet, the hmac obtained at wallet registration. `None` for a standard wallet policy.
+
+        change: int
+            0 for a standard receive address, 1 for a change address. Other values are invalid.
+
+        start_index: int
+            The address index of the first address.
+
+        count: int
+            The number of addresses.
+
+        Returns
+        -------
+        List[str]
+            The requested addresses, in order of address index.
+        """
+
+        raise NotImplementedError
+
+    def get_wallet_addresses_digest(
+        self,
+        wallet: Wallet,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        start_index: int,
+        count: int,
+    ) -> bytes:
+        """Like `get_wallet_addresses`, but the device only returns the SHA256 digest of the addresses, each preceded by
+        its length in one byte; this allows to verify a precomputed list of addresses without transferring them.
+
+        Returns
+        -------
+        bytes
+            The 32-byte digest of the list of addresses.
+        """
+
+        raise NotImplementedError
+
+    def get_wallet_scripts_merkle_root(
+        self,
+        wallet: Wallet,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        start_index: int,
+        count: int,
+    ) -> bytes:
+        """Like `get_wallet_addresses`, but the device only returns the root of the Merkle tree whose leaves are the
+        scriptPubKeys of the addresses, in order. The root can be compared with `MerkleRootBuilder` (or `MerkleTree`)
+        from the `merkle` module, using `element_hash` of each scriptPubKey as leaves.
+
+        Returns
+        -------
+        bytes
+            The 32-byte Merkle root of the scriptPubKeys.
+        """
+
+        raise NotImplementedError
+
+    def verify_wallet_scripts(
+        self,
+        wallet: Wallet,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        start_index: int,
+        count: int,
+    ) -> bool:
+        """Verifies that the device derives the same scriptPubKeys as the host for a range of addresses: the root
+        returned by `get_wallet_scripts_merkle_root` is compared with the one computed by
+        `wallet_scripts.compute_wallet_scripts_merkle_root`. Only the 32-byte root is transferred.
+
+        Raises `NotImplementedError` if the host cannot derive the scripts of the policy of the wallet.
+
+        Returns
+        -------
+        bool
+            True if the scriptPubKeys match, False otherwise.
+        """
+
+        raise NotImplementedError
+
+    def get_wallet_ownership_tokens(
+        self,
+        wallet: Wallet,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        start_index: int,
+        count: int,
+    ) -> List[bytes]:
+        """Like `get_wallet_addresses`, but the device returns the 16-byte ownership token of the scriptPubKey of each
+        address, instead of the address. The tokens remain valid as long as the seed is the same, so they can be stored
+        together with the addresses.
+        When signing a PSBT, the token of an input or a change output can be attached with `set_ownership_token` from
+        the `psbt` module; the device then verifies the token instead of deriving the scriptPubKey again. The input or
+        output must still have its BIP32 derivation.
+
+        Returns
+        -------
+        List[bytes]
+            The ownership tokens, in order of address index.
+        """
+
+        raise NotImplementedError
+
+    def scan_wallet_scripts(
+        self,
+        wallet: Wallet,
+        wallet_hmac: Optional[bytes],
+        scripts: List[bytes],
+        start_index: int,
+        window_size: int,
+    ) -> List[Tuple[int, int, int]]:
+        """For a given wallet that was already registered on the device (or a standard wallet that does not need registration),
+        finds which of the given scriptPubKeys belong to the wallet, among the receive and change addresses with address
+        index in the window from `start_index` (included) to `start_index + window_size` (excluded).
+
+        Parameters
+        ----------
+        wallet : Wallet
+            The registered wallet policy, or a standard wallet policy.
+
+        wallet_hmac: Optional[bytes]
+            For a registered wallet, the hmac obtained at wallet registration. `None` for a standard wallet policy.
+
+        scripts: List[bytes]
+            The list of scriptPubKeys to scan.
+
+        start_index: int
+            The address index of the first address of the window.
+
+        window_size: int
+            The number of address indexes of the window; the maximum supported value depends on the device.
+
+        Returns
+        -------
+        List[Tuple[int, int, int]]
+            The list of matches, in order; each match is a tuple `(list_index, change, address_index)`, where
+            `list_index` is the position of the matching script in `scripts`.
+        """
+
+        raise NotImplementedError
+
+    def sign_psbt(self, psbt: PSBT, wallet: Wallet, wallet_hmac: Optional[bytes],
+                  checkpoint: Optional[SignPsbtCheckpoint] = None,
+                  batch_review: bool = False,
+                  on_signature: Optional[Callable[[int, bytes], None]] = None,
+                  selected_inputs: Optional[Sequence[int]] = None) -> Mapping[int, bytes]:
         """Signs a PSBT using a registered wallet (or a standard wallet that does not need registration).
 
-        Signature requires explicit approval from the user.
+        Signature requires explicit approval from the user, unless a checkpoint is given.
 
         Parameters
         ----------
@@ -218,6 +531,27 @@ class Client:
         wallet_hmac: Optional[bytes]
             For a registered wallet, the hmac obtained at wallet registration. `None` for a standard wallet policy.
 
+        checkpoint: Optional[SignPsbtCheckpoint]
+            The `last_sign_psbt_checkpoint` after a previous call for the same PSBT and wallet that failed, for example
+            because of a communication error. Signing resumes from it, without the approval of the user; the
+            signatures of the checkpoint are included in the result.
+
+        batch_review: bool
+            If True and the transaction has at least 10 outputs, the user reviews the external outputs in summary: their
+            count, their total amount and a digest of all the outputs, instead of one at a time. The digest is the hex
+            of the first 16 bytes of the BIP-143 hashOutputs of the transaction (see `get_batch_review_digest`), and
+            must be shown to the user so that they can compare it with the one on the device. It is ignored (and each
+            output is reviewed as usual) unless the user enabled "Batch review" in the settings of the app.
+
+        on_signature: Optional[Callable[[int, bytes], None]]
+            If not None, it is called with the input index and the signature of each signature, as soon as it is
+            received, while the device keeps signing the other inputs; if it raises, signing is aborted.
+
+        selected_inputs: Optional[Sequence[int]]
+            If not None, only the inputs with these indices are signed (if they are internal); the others are treated as
+            external without checking whether they belong to the wallet, which is faster for transactions where few
+            inputs are internal, like a CoinJoin. The user is warned about the external inputs, as usual.
+
         Returns
         -------
         Mapping[int, bytes]
@@ -247,3 +581,19 @@ class Client:
         :return: The signature
         """
         raise NotImplementedError
+
+    def sign_message_bip322(self, messages: List[Union[str, bytes]], bip32_path: str,
+                            address_type: AddressType) -> List[str]:
+        """
+        Sign one or more messages with the BIP-322 "simple" format.
+        All the messages are signed with the key at the given path, for the single-key address of the given type;
+        the user approves the whole batch at once. For more than one message, the device shows the root of their
+        Merkle tree, that can be compared with the one computed by `get_messages_merkle_root` for the expected
+        messages.
+        :param messages: The messages to be signed. Each one is first encoded as bytes if not already.
+        :param bip32_path: The BIP 32 derivation for the key to sign the messages with. It must be a standard path
+        for the address type.
+        :param address_type: The type of the address, either AddressType.WIT or AddressType.TAP.
+        :return: The signatures, in the same order as the messages; each is the base64-encoded witness stack.
+        """
+        raise NotImplementedError
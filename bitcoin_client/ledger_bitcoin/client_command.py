@@ -1,10 +1,24 @@
 from enum import IntEnum
-from typing import List, Mapping
+import time
+from typing import TYPE_CHECKING, Callable, Dict, List, Mapping, Optional, Sequence, Tuple, Union
 from collections import deque
+from concurrent.futures import Executor
 from hashlib import sha256
+from io import BytesIO
 
 from .common import ByteStreamParser, sha256, write_varint
-from .merkle import MerkleTree, element_hash
+from .merkle import MerkleRootBuilder, MerkleTree, element_hash
+from .tx import CTransaction
+
+if TYPE_CHECKING:
+    from .instrumentation import Instrumentation  # imports this module
+
+
+# Maximum length of a response to a client command, unless the device advertises a smaller one
+MAX_RESPONSE_LEN = 255
+
+# Smallest supported maximum response length (enough for at least one 32-byte hash per message)
+MIN_RESPONSE_LEN = 34
 
 
 class ClientCommandCode(IntEnum):
@@ -12,9 +26,123 @@ class ClientCommandCode(IntEnum):
     GET_PREIMAGE = 0x40
     GET_MERKLE_LEAF_PROOF = 0x41
     GET_MERKLE_LEAF_INDEX = 0x42
+    GET_MERKLE_MULTIPROOF = 0x43
+    GET_MERKLEIZED_MAP_VALUE = 0x44
+    STREAM_MERKLE_LEAVES = 0x45
+    GET_STRIPPED_RAWTX = 0x46
+    GET_MERKLE_LEAF_PARTIAL_PROOF = 0x47
+    GET_PREIMAGES = 0x48
+    PUT_RECORD = 0x50
+    GET_RECORD = 0x51
     GET_MORE_ELEMENTS = 0xA0
 
 
+class ClientCapability(IntEnum):
+    """Bits of the P2 field of the commands, declaring the optional features supported by the client; the bits from
+    0x100 are in the P1 field."""
+    HOST_STORAGE = 0x01
+    BATCHED_YIELD = 0x02
+    STREAM_MERKLE_LEAVES = 0x04
+    STRIPPED_RAWTX = 0x08
+    SIGN_PSBT_CHECKPOINTS = 0x10
+    BATCH_REVIEW = 0x20
+    PARTIAL_MERKLE_PROOF = 0x40
+    BATCHED_PREIMAGES = 0x80
+    COMPACT_SIGNATURES = 0x100
+
+
+# Capabilities supported by ClientCommandInterpreter
+CLIENT_CAPABILITIES = (ClientCapability.HOST_STORAGE | ClientCapability.BATCHED_YIELD
+                       | ClientCapability.STREAM_MERKLE_LEAVES | ClientCapability.STRIPPED_RAWTX
+                       | ClientCapability.SIGN_PSBT_CHECKPOINTS | ClientCapability.PARTIAL_MERKLE_PROOF
+                       | ClientCapability.BATCHED_PREIMAGES)
+
+
+class QueuedElements:
+    """Consecutive elements in the queue of GET_MORE_ELEMENTS, stored as a single byte string: all the
+    elements are `element_len` bytes long, except possibly the last one, that can be shorter.
+
+    Each response is sliced from the byte string when it is sent, so that the queue does not hold
+    one object per element, and each GET_MORE_ELEMENTS takes constant time."""
+
+    def __init__(self, data: Union[bytes, memoryview], element_len: int):
+        self.data = data
+        self.element_len = element_len
+        self.offset = 0
+
+    def pop_response(self, max_response_len: int) -> bytes:
+        """Returns the response to GET_MORE_ELEMENTS with the next elements, as many as fit in
+        `max_response_len` bytes."""
+
+        remaining = len(self.data) - self.offset
+        if remaining >= self.element_len:
+            element_len = self.element_len
+            n_elements = min((max_response_len - 2) // element_len, remaining // element_len)
+        else:
+            # the last, shorter element is sent alone
+            element_len = remaining
+            n_elements = 1
+
+        payload = self.data[self.offset: self.offset + n_elements * element_len]
+        self.offset += n_elements * element_len
+        return b"".join([
+            n_elements.to_bytes(1, byteorder="big"),
+            element_len.to_bytes(1, byteorder="big"),
+            payload,
+        ])
+
+    def is_empty(self) -> bool:
+        return self.offset >= len(self.data)
+
+
+def split_into_chunks(data: Union[bytes, memoryview], max_response_len: int) -> List[QueuedElements]:
+    """Splits a byte string in chunks, each filling a whole response to GET_MORE_ELEMENTS (except
+    possibly the last one); the result is empty if `data` is empty, otherwise it contains a single
+    `QueuedElements` to be added to the queue."""
+
+    chunk_len = max_response_len - 2  # 2 bytes for the number and the length of the elements
+    return [QueuedElements(data, chunk_len)] if len(data) > 0 else []
+
+
+def queue_hashes(hashes: List[bytes]) -> List[QueuedElements]:
+    """Returns the 32-byte hashes `hashes` as elements to be added to the queue; the result is empty if
+    there are no hashes."""
+
+    return [QueuedElements(b"".join(hashes), 32)] if len(hashes) > 0 else []
+
+
+def pack_hashes(header: bytes, hashes: List[bytes], max_response_len: int,
+                queue: "deque[QueuedElements]") -> bytes:
+    """Returns the response made of `header`, the number of `hashes`, and as many of them as fit in
+    `max_response_len` bytes, preceded by their number; the other ones are added to `queue`, for
+    GET_MORE_ELEMENTS. It is the format of the responses to GET_MERKLE_LEAF_PROOF and
+    GET_MERKLE_MULTIPROOF."""
+
+    n_response_elements = min((max_response_len - len(header) - 1 - 1) // 32, len(hashes))
+    queue.extend(queue_hashes(hashes[n_response_elements:]))
+    return b"".join([
+        header,
+        len(hashes).to_bytes(1, byteorder="big"),
+        n_response_elements.to_bytes(1, byteorder="big"),
+        *hashes[:n_response_elements],
+    ])
+
+
+def pack_bytes(data: Union[bytes, memoryview], max_response_len: int, queue: "deque[QueuedElements]") -> bytes:
+    """Returns the response made of the length of `data` (as a varint), and as many of its bytes as fit in
+    `max_response_len` bytes, preceded by their number; the other ones are added to `queue`, in chunks that
+    fill whole responses to GET_MORE_ELEMENTS."""
+
+    data_len_out = write_varint(len(data))
+    payload_size = min(max_response_len - len(data_len_out) - 1, len(data))
+    queue.extend(split_into_chunks(data[payload_size:], max_response_len))
+    return b"".join([
+        data_len_out,
+        payload_size.to_bytes(1, byteorder="big"),
+        data[:payload_size],
+    ])
+
+
 class ClientCommand:
     def execute(self, request: bytes) -> bytes:
         raise NotImplementedError("Subclasses should implement this method.")
@@ -25,22 +153,41 @@ class ClientCommand:
 
 
 class YieldCommand(ClientCommand):
-    def __init__(self, results: List[bytes]):
+    def __init__(self, results: List[bytes], batched: bool = False,
+                 on_yield: Optional[Callable[[bytes], None]] = None):
         self.results = results
+        self.batched = batched
+        self.on_yield = on_yield
+
+    def _add_result(self, result: bytes) -> None:
+        self.results.append(result)
+        if self.on_yield is not None:
+            self.on_yield(result)
 
     @property
     def code(self) -> int:
         return ClientCommandCode.YIELD
 
     def execute(self, request: bytes) -> bytes:
-        self.results.append(request[1:])  # only skip the first byte (command code)
+        if not self.batched:
+            self._add_result(request[1:])  # only skip the first byte (command code)
+            return b""
+
+        # batched format: <n> followed by n length-prefixed results
+        req = ByteStreamParser(request[1:])
+        n = req.read_uint(1)
+        for _ in range(n):
+            el_len = req.read_uint(1)
+            self._add_result(req.read_bytes(el_len))
+        req.assert_empty()
         return b""
 
 
 class GetPreimageCommand(ClientCommand):
-    def __init__(self, known_preimages: Mapping[bytes, bytes], queue: "deque[bytes]"):
+    def __init__(self, known_preimages: Mapping[bytes, bytes], queue: "deque[QueuedElements]", max_response_len: int = MAX_RESPONSE_LEN):
         self.queue = queue
         self.known_preimages = known_preimages
+        self.max_response_len = max_response_len
 
     @property
     def code(self) -> int:
@@ -56,40 +203,86 @@ class GetPreimageCommand(ClientCommand):
         req.assert_empty()
 
         if req_hash in self.known_preimages:
-            known_preimage = self.known_preimages[req_hash]
+            return pack_bytes(self.known_preimages[req_hash], self.max_response_len, self.queue)
+
+        # not found
+        raise RuntimeError(f"Requested unknown preimage for: {req_hash.hex()}")
+
+
+class GetPreimagesCommand(ClientCommand):
+    """Returns the preimages of several hashes at once, as a single byte stream where each preimage is prefixed by
+    its length."""
+
+    # Maximum number of hashes in a request
+    MAX_HASHES = 7
 
-            preimage_len_out = write_varint(len(known_preimage))
+    def __init__(self, known_preimages: Mapping[bytes, bytes], queue: "deque[QueuedElements]", max_response_len: int = MAX_RESPONSE_LEN):
+        self.queue = queue
+        self.known_preimages = known_preimages
+        self.max_response_len = max_response_len
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.GET_PREIMAGES
 
-            # We can send at most 255 - len(preimage_len_out) - 1 bytes in a single message;
-            # the rest will be stored for GET_MORE_ELEMENTS
+    def execute(self, request: bytes) -> bytes:
+        req = ByteStreamParser(request[1:])
 
-            max_payload_size = 255 - len(preimage_len_out) - 1
+        n_hashes = req.read_uint(1)
+        if n_hashes == 0 or n_hashes > self.MAX_HASHES:
+            raise ValueError(f"Invalid number of hashes: {n_hashes}.")
 
-            payload_size = min(max_payload_size, len(known_preimage))
+        req_hashes = [req.read_bytes(32) for _ in range(n_hashes)]
+        req.assert_empty()
 
-            if payload_size < len(known_preimage):
-                # split into list of length-1 bytes elements
-                extra_elements = [
-                    known_preimage[i: i + 1]
-                    for i in range(payload_size, len(known_preimage))
-                ]
-                # add to the queue any remaining extra bytes
-                self.queue.extend(extra_elements)
+        for req_hash in req_hashes:
+            if req_hash not in self.known_preimages:
+                raise RuntimeError(f"Requested unknown preimage for: {req_hash.hex()}")
 
-            return (
-                preimage_len_out
-                + payload_size.to_bytes(1, byteorder="big")
-                + known_preimage[:payload_size]
+        if len(self.queue) != 0:
+            raise RuntimeError(
+                "This command should not execute when the queue is not empty."
             )
 
-        # not found
-        raise RuntimeError(f"Requested unknown preimage for: {req_hash.hex()}")
+        stream = b"".join(write_varint(len(self.known_preimages[h])) + self.known_preimages[h] for h in req_hashes)
+        return pack_bytes(stream, self.max_response_len, self.queue)
+
+
+class GetStrippedRawtxCommand(ClientCommand):
+    def __init__(self, known_preimages: Mapping[bytes, bytes], queue: "deque[QueuedElements]", max_response_len: int = MAX_RESPONSE_LEN):
+        self.queue = queue
+        self.known_preimages = known_preimages
+        self.max_response_len = max_response_len
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.GET_STRIPPED_RAWTX
+
+    def execute(self, request: bytes) -> bytes:
+        req = ByteStreamParser(request[1:])
+
+        req_hash = req.read_bytes(32)
+        req.assert_empty()
+
+        if req_hash not in self.known_preimages:
+            raise RuntimeError(f"Requested unknown preimage for: {req_hash.hex()}")
+
+        if len(self.queue) != 0:
+            raise RuntimeError(
+                "This command should not execute when the queue is not empty."
+            )
+
+        # the preimage is the 0x00 prefix, followed by the serialized transaction
+        tx = CTransaction()
+        tx.deserialize(BytesIO(self.known_preimages[req_hash][1:]))
+        return pack_bytes(tx.serialize_without_witness(), self.max_response_len, self.queue)
 
 
 class GetMerkleLeafProofCommand(ClientCommand):
-    def __init__(self, known_trees: Mapping[bytes, MerkleTree], queue: "deque[bytes]"):
+    def __init__(self, known_trees: Mapping[bytes, MerkleTree], queue: "deque[QueuedElements]", max_response_len: int = MAX_RESPONSE_LEN):
         self.queue = queue
         self.known_trees = known_trees
+        self.max_response_len = max_response_len
 
     @property
     def code(self) -> int:
@@ -116,24 +309,49 @@ class GetMerkleLeafProofCommand(ClientCommand):
                 "This command should not execute when the queue is not empty."
             )
 
+        return pack_hashes(mt.get(leaf_index), mt.prove_leaf(leaf_index), self.max_response_len, self.queue)
+
+
+class GetMerkleLeafPartialProofCommand(ClientCommand):
+    """Like GET_MERKLE_LEAF_PROOF, but only returns the first `n` elements of the proof (from the bottom of the
+    tree); the device already knows the rest of the path from a leaf it verified before."""
+
+    def __init__(self, known_trees: Mapping[bytes, MerkleTree], queue: "deque[QueuedElements]", max_response_len: int = MAX_RESPONSE_LEN):
+        self.queue = queue
+        self.known_trees = known_trees
+        self.max_response_len = max_response_len
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.GET_MERKLE_LEAF_PARTIAL_PROOF
+
+    def execute(self, request: bytes) -> bytes:
+        req = ByteStreamParser(request[1:])
+
+        root = req.read_bytes(32)
+        tree_size = req.read_varint()
+        leaf_index = req.read_varint()
+        n = req.read_uint(1)
+        req.assert_empty()
+
+        if not root in self.known_trees:
+            raise ValueError(f"Unknown Merkle root: {root.hex()}.")
+
+        mt: MerkleTree = self.known_trees[root]
+
+        if leaf_index >= tree_size or len(mt) != tree_size:
+            raise ValueError(f"Invalid index or tree size.")
+
         proof = mt.prove_leaf(leaf_index)
+        if n > len(proof):
+            raise ValueError(f"Invalid number of proof elements.")
 
-        # Compute how many elements we can fit in 255 - 32 - 1 - 1 = 221 bytes
-        n_response_elements = min((255 - 32 - 1 - 1) // 32, len(proof))
-        n_leftover_elements = len(proof) - n_response_elements
-
-        # Add to the queue any proof elements that do not fit the response
-        if (n_leftover_elements > 0):
-            self.queue.extend(proof[-n_leftover_elements:])
-
-        return b"".join(
-            [
-                mt.get(leaf_index),
-                len(proof).to_bytes(1, byteorder="big"),
-                n_response_elements.to_bytes(1, byteorder="big"),
-                *proof[:n_response_elements],
-            ]
-        )
+        if len(self.queue) != 0:
+            raise RuntimeError(
+                "This command should not execute when the queue is not empty."
+            )
+
+        return pack_hashes(mt.get(leaf_index), proof[:n], self.max_response_len, self.queue)
 
 
 class GetMerkleLeafIndexCommand(ClientCommand):
@@ -164,9 +382,207 @@ class GetMerkleLeafIndexCommand(ClientCommand):
         return found.to_bytes(1, byteorder="big") + write_varint(leaf_index)
 
 
+class GetMerkleMultiproofCommand(ClientCommand):
+    def __init__(self, known_trees: Mapping[bytes, MerkleTree], queue: "deque[QueuedElements]", max_response_len: int = MAX_RESPONSE_LEN):
+        self.queue = queue
+        self.known_trees = known_trees
+        self.max_response_len = max_response_len
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.GET_MERKLE_MULTIPROOF
+
+    def execute(self, request: bytes) -> bytes:
+        req = ByteStreamParser(request[1:])
+
+        root = req.read_bytes(32)
+        tree_size = req.read_varint()
+        n_leaves = req.read_uint(1)
+        leaf_indices = [req.read_varint() for _ in range(n_leaves)]
+        req.assert_empty()
+
+        if not root in self.known_trees:
+            raise ValueError(f"Unknown Merkle root: {root.hex()}.")
+
+        mt: MerkleTree = self.known_trees[root]
+
+        if len(mt) != tree_size or any(leaf_index >= tree_size for leaf_index in leaf_indices):
+            raise ValueError(f"Invalid index or tree size.")
+
+        if len(self.queue) != 0:
+            raise RuntimeError(
+                "This command should not execute when the queue is not empty."
+            )
+
+        # the hashes shared by the proofs of several leaves are only sent once
+        return pack_hashes(b"", mt.prove_leaves(leaf_indices), self.max_response_len, self.queue)
+
+
+class StreamMerkleLeavesCommand(ClientCommand):
+    def __init__(self, known_preimages: Mapping[bytes, bytes], known_trees: Mapping[bytes, MerkleTree], queue: "deque[QueuedElements]", max_response_len: int = MAX_RESPONSE_LEN):
+        self.queue = queue
+        self.known_preimages = known_preimages
+        self.known_trees = known_trees
+        self.max_response_len = max_response_len
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.STREAM_MERKLE_LEAVES
+
+    def execute(self, request: bytes) -> bytes:
+        req = ByteStreamParser(request[1:])
+
+        root = req.read_bytes(32)
+        tree_size = req.read_varint()
+        req.assert_empty()
+
+        if not root in self.known_trees:
+            raise ValueError(f"Unknown Merkle root: {root.hex()}.")
+
+        mt: MerkleTree = self.known_trees[root]
+
+        if len(mt) != tree_size:
+            raise ValueError(f"Invalid tree size.")
+
+        if len(self.queue) != 0:
+            raise RuntimeError(
+                "This command should not execute when the queue is not empty."
+            )
+
+        # concatenation of all the leaves, each prefixed by its length (without the 0x00 prefix)
+        stream = b"".join(
+            write_varint(len(leaf)) + leaf
+            for leaf in (self.known_preimages[mt.get(i)][1:] for i in range(tree_size))
+        )
+
+        return pack_bytes(stream, self.max_response_len, self.queue)
+
+
+class GetMerkleizedMapValueCommand(ClientCommand):
+    def __init__(self, known_preimages: Mapping[bytes, bytes], known_trees: Mapping[bytes, MerkleTree], queue: "deque[QueuedElements]", max_response_len: int = MAX_RESPONSE_LEN):
+        self.queue = queue
+        self.known_preimages = known_preimages
+        self.known_trees = known_trees
+        self.max_response_len = max_response_len
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.GET_MERKLEIZED_MAP_VALUE
+
+    def execute(self, request: bytes) -> bytes:
+        req = ByteStreamParser(request[1:])
+
+        keys_root = req.read_bytes(32)
+        values_root = req.read_bytes(32)
+        map_size = req.read_varint()
+        key_hash = req.read_bytes(32)
+
+        # optional index of the key, if already known to the device
+        index_hint_bytes = req.stream.read()
+        index_hint: Optional[int] = None
+        if len(index_hint_bytes) > 0:
+            hint_parser = ByteStreamParser(index_hint_bytes)
+            index_hint = hint_parser.read_varint()
+            hint_parser.assert_empty()
+
+        for root in [keys_root, values_root]:
+            if not root in self.known_trees:
+                raise ValueError(f"Unknown Merkle root: {root.hex()}.")
+
+        keys_tree: MerkleTree = self.known_trees[keys_root]
+        values_tree: MerkleTree = self.known_trees[values_root]
+
+        if len(keys_tree) != map_size or len(values_tree) != map_size:
+            raise ValueError(f"Invalid map size.")
+
+        if len(self.queue) != 0:
+            raise RuntimeError(
+                "This command should not execute when the queue is not empty."
+            )
+
+        if index_hint is not None:
+            if index_hint >= map_size or keys_tree.get(index_hint) != key_hash:
+                raise ValueError("Wrong key index.")
+            leaf_index = index_hint
+        else:
+            try:
+                leaf_index = keys_tree.leaf_index(key_hash)
+            except ValueError:
+                leaf_index = None
+
+        if leaf_index is None:
+            response = b'\0'
+        else:
+            value_leaf_hash = values_tree.get(leaf_index)
+            if value_leaf_hash not in self.known_preimages:
+                raise RuntimeError(f"Requested unknown preimage for: {value_leaf_hash.hex()}")
+            value = self.known_preimages[value_leaf_hash][1:]  # skip the 0x00 prefix
+
+            value_proof = values_tree.prove_leaf(leaf_index)
+            # the proof for the key is not needed if the device already knows its index
+            key_proof = keys_tree.prove_leaf(leaf_index) if index_hint is None else []
+
+            response = b"".join([
+                b'\1',
+                write_varint(leaf_index),
+                len(value_proof).to_bytes(1, byteorder="big"),
+                *key_proof,
+                write_varint(len(value)),
+                value,
+                *value_proof,
+            ])
+
+        return pack_bytes(response, self.max_response_len, self.queue)
+
+
+class PutRecordCommand(ClientCommand):
+    def __init__(self, records: Mapping[int, bytes]):
+        self.records = records
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.PUT_RECORD
+
+    def execute(self, request: bytes) -> bytes:
+        req = ByteStreamParser(request[1:])
+
+        record_id = req.read_uint(4, byteorder="big")
+        data_len = req.read_uint(1)
+        data = req.read_bytes(data_len)
+        hmac = req.read_bytes(32)
+        req.assert_empty()
+
+        # the record is authenticated by the hardware wallet; we just store it
+        self.records[record_id] = data + hmac
+        return b""
+
+
+class GetRecordCommand(ClientCommand):
+    def __init__(self, records: Mapping[int, bytes]):
+        self.records = records
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.GET_RECORD
+
+    def execute(self, request: bytes) -> bytes:
+        req = ByteStreamParser(request[1:])
+
+        record_id = req.read_uint(4, byteorder="big")
+        req.assert_empty()
+
+        if record_id not in self.records:
+            return b"\0"
+
+        record = self.records[record_id]
+        data_len = len(record) - 32
+        return b"\1" + data_len.to_bytes(1, byteorder="big") + record
+
+
 class GetMoreElementsCommand(ClientCommand):
-    def __init__(self, queue: "deque[bytes]"):
+    def __init__(self, queue: "deque[QueuedElements]", max_response_len: int = MAX_RESPONSE_LEN):
         self.queue = queue
+        self.max_response_len = max_response_len
 
     @property
     def code(self) -> int:
@@ -179,28 +595,127 @@ class GetMoreElementsCommand(ClientCommand):
         if len(self.queue) == 0:
             raise ValueError("No elements to get.")
 
-        element_len = len(self.queue[0])
-        if any(len(el) != element_len for el in self.queue):
-            raise ValueError(
-                "The queue contains elements of different byte length, which is not expected."
-            )
+        elements: QueuedElements = self.queue[0]
+        if elements.element_len == 0 or elements.element_len > self.max_response_len - 2:
+            raise ValueError("The queue contains elements of invalid length.")
 
-        # pop from the queue, keeping the total response length at most 255
+        response = elements.pop_response(self.max_response_len)
+        if elements.is_empty():
+            self.queue.popleft()
 
-        response_elements = bytearray()
+        return response
 
-        n_added_elements = 0
-        while len(self.queue) > 0 and len(response_elements) + element_len <= 253:
-            response_elements.extend(self.queue.popleft())
-            n_added_elements += 1
 
-        return b"".join(
-            [
-                n_added_elements.to_bytes(1, byteorder="big"),
-                element_len.to_bytes(1, byteorder="big"),
-                bytes(response_elements),
-            ]
-        )
+class LeafPreimageView:
+    """The preimage of the hash of a leaf of a Merkle tree, that is the 0x00 prefix followed by the element, for an
+    element that is a `memoryview` (for example, of a memory-mapped file).
+
+    The preimage is not copied: a slice that does not include the prefix is a `memoryview` of the element, and only
+    the slices that include the prefix are copied.
+    """
+
+    def __init__(self, element: memoryview):
+        self.element = element
+
+    def __len__(self) -> int:
+        return 1 + len(self.element)
+
+    def __getitem__(self, key: slice) -> Union[bytes, memoryview]:
+        start, stop, step = key.indices(len(self))
+        if step != 1:
+            raise ValueError("Only contiguous slices are supported")
+        if start >= 1:
+            return self.element[start - 1:max(start, stop) - 1]
+        return b'\0' + bytes(self.element[:max(stop - 1, 0)])
+
+    def __bytes__(self) -> bytes:
+        return b'\0' + bytes(self.element)
+
+
+def leaf_preimage(element: Union[bytes, memoryview]) -> Union[bytes, LeafPreimageView]:
+    """Returns the preimage of the hash of the leaf of `element` in a Merkle tree, without copying the element if it is
+    a `memoryview`."""
+    return LeafPreimageView(element) if isinstance(element, memoryview) else b'\0' + element
+
+
+class KnownPreimages(dict):
+    """The preimages known to the client, mapped by their sha256 hash.
+
+    A preimage that is not found might be the one of a leaf of a Merkle tree that was not built yet: all the pending
+    trees of `known_trees` are built before giving up.
+    """
+
+    def __init__(self):
+        super().__init__()
+        self.known_trees: Optional["KnownMerkleTrees"] = None
+
+    def __contains__(self, key: bytes) -> bool:
+        if not super().__contains__(key) and self.known_trees is not None:
+            self.known_trees.build_all()
+        return super().__contains__(key)
+
+    def __missing__(self, key: bytes) -> bytes:
+        if self.known_trees is not None and len(self.known_trees.pending) > 0:
+            self.known_trees.build_all()
+            return self[key]
+        raise KeyError(key)
+
+
+def _mapping_roots(mapping: Mapping[bytes, bytes]) -> Tuple[int, List[bytes], List[bytes], bytes, bytes]:
+    """Returns the number of pairs of `mapping`, its keys and values ordered by key, and the Merkle roots of both."""
+    items_sorted = list(sorted(mapping.items()))
+
+    keys = [i[0] for i in items_sorted]
+    values = [i[1] for i in items_sorted]
+    keys_root = MerkleRootBuilder(element_hash(k) for k in keys).root
+    values_root = MerkleRootBuilder(element_hash(v) for v in values).root
+    return len(mapping), keys, values, keys_root, values_root
+
+
+class KnownMerkleTrees(dict):
+    """The Merkle trees known to the client, mapped by their root.
+
+    The trees of the lists added with `add_lazy` are only built when their root is first looked up; only then, the
+    leaves are also added to the known preimages. Therefore, the lists that the hardware wallet never asks about are
+    only hashed once, in order to compute their root.
+    """
+
+    def __init__(self, known_preimages: KnownPreimages):
+        super().__init__()
+        self.known_preimages = known_preimages
+        self.pending: Dict[bytes, List[bytes]] = {}
+        known_preimages.known_trees = self
+
+    def add_lazy(self, root: bytes, elements: List[bytes]) -> None:
+        """Adds the list `elements`, whose Merkle root is `root`, without building its tree yet."""
+        if not super().__contains__(root):
+            self.pending.setdefault(root, elements)
+
+    def build(self, elements: List[bytes]) -> MerkleTree:
+        """Builds the Merkle tree of the list `elements` and adds it, together with the preimages of its leaves.
+
+        The elements can also be instances of `memoryview`, that are not copied."""
+        leaf_hashes = [element_hash(el) for el in elements]
+        for leaf_hash, el in zip(leaf_hashes, elements):
+            dict.__setitem__(self.known_preimages, leaf_hash, leaf_preimage(el))
+
+        mt = MerkleTree(leaf_hashes)
+        self[mt.root] = mt
+        return mt
+
+    def build_all(self) -> None:
+        """Builds all the pending trees."""
+        while len(self.pending) > 0:
+            _, elements = self.pending.popitem()
+            self.build(elements)
+
+    def __contains__(self, root: bytes) -> bool:
+        return super().__contains__(root) or root in self.pending
+
+    def __missing__(self, root: bytes) -> MerkleTree:
+        if root not in self.pending:
+            raise KeyError(root)
+        return self.build(self.pending.pop(root))
 
 
 class ClientCommandInterpreter:
@@ -211,7 +726,7 @@ class ClientCommandInterpreter:
     - known Merkle trees from lists of elements
 
     Moreover, it containes the state that is relevant for the interpreted client side commands:
-    - a queue of bytes that contains any bytes that could not fit in a response from the
+    - a queue of the elements (`QueuedElements`) that could not fit in a response from the
       GET_PREIMAGE client command (when a preimage is too long to fit in a single message) or the
       GET_MERKLE_LEAF_PROOF command (which returns a Merkle proof, which might be too long to fit
       in a single message). The data in the queue is returned in one (or more) successive
@@ -227,20 +742,65 @@ class ClientCommandInterpreter:
         processing of an APDU.
     """
 
-    def __init__(self):
-        self.known_preimages: Mapping[bytes, bytes] = {}
-        self.known_trees: Mapping[bytes, MerkleTree] = {}
+    def __init__(self, max_response_len: int = MAX_RESPONSE_LEN, max_speculative_len: int = 0,
+                 client_capabilities: int = 0, known_trees: Optional[KnownMerkleTrees] = None,
+                 instrumentation: Optional["Instrumentation"] = None,
+                 on_yield: Optional[Callable[[bytes], None]] = None):
+        """Creates a new interpreter.
+
+        Parameters
+        ----------
+        max_response_len : int
+            The maximum length of a response to a client command, as advertised by the device.
+        max_speculative_len : int
+            The maximum total length of the speculative responses the device accepts in a CONTINUE
+            command, as advertised by the device; 0 if not supported.
+        client_capabilities : int
+            The capabilities declared in the P2 field of the command; they must be a subset of
+            CLIENT_CAPABILITIES.
+        known_trees : Optional[KnownMerkleTrees]
+            The known Merkle trees, together with their known preimages, if shared with other
+            interpreters; otherwise, the interpreter starts with no known trees and preimages.
+        instrumentation : Optional[Instrumentation]
+            If not None, its `on_client_command` hook is called after each executed client command.
+        on_yield : Optional[Callable[[bytes], None]]
+            If not None, it is called with each value sent with a YIELD client command, as soon as it is
+            received; if it raises, the execution of the client command fails.
+        """
+
+        if not MIN_RESPONSE_LEN <= max_response_len <= MAX_RESPONSE_LEN:
+            raise ValueError(f"Unsupported maximum response length: {max_response_len}")
+
+        self.max_speculative_len = max_speculative_len
+        self.instrumentation = instrumentation
+        self.last_request: Optional[bytes] = None
+
+        if known_trees is None:
+            known_trees = KnownMerkleTrees(KnownPreimages())
+        self.known_trees = known_trees
+        self.known_preimages = known_trees.known_preimages
+        self.records: Mapping[int, bytes] = {}
 
         self.yielded: List[bytes] = []
 
         queue = deque()
+        self.queue = queue
 
         commands = [
-            YieldCommand(self.yielded),
-            GetPreimageCommand(self.known_preimages, queue),
+            YieldCommand(self.yielded, bool(client_capabilities & ClientCapability.BATCHED_YIELD), on_yield),
+            GetPreimageCommand(self.known_preimages, queue, max_response_len),
+            GetPreimagesCommand(self.known_preimages, queue, max_response_len),
+            GetStrippedRawtxCommand(self.known_preimages, queue, max_response_len),
             GetMerkleLeafIndexCommand(self.known_trees),
-            GetMerkleLeafProofCommand(self.known_trees, queue),
-            GetMoreElementsCommand(queue),
+            GetMerkleLeafProofCommand(self.known_trees, queue, max_response_len),
+            GetMerkleLeafPartialProofCommand(self.known_trees, queue, max_response_len),
+            GetMerkleMultiproofCommand(self.known_trees, queue, max_response_len),
+            StreamMerkleLeavesCommand(self.known_preimages, self.known_trees, queue, max_response_len),
+            GetMerkleizedMapValueCommand(
+                self.known_preimages, self.known_trees, queue, max_response_len),
+            PutRecordCommand(self.records),
+            GetRecordCommand(self.records),
+            GetMoreElementsCommand(queue, max_response_len),
         ]
 
         self.commands = {cmd.code: cmd for cmd in commands}
@@ -272,7 +832,96 @@ class ClientCommandInterpreter:
                 "Unexpected command code: 0x{:02X}".format(cmd_code)
             )
 
-        return self.commands[cmd_code].execute(hw_response)
+        start = time.perf_counter()
+        response = self.commands[cmd_code].execute(hw_response)
+        self.last_request = hw_response
+        if self.instrumentation is not None:
+            self.instrumentation.on_client_command(cmd_code, len(hw_response), len(response),
+                                                   time.perf_counter() - start)
+        return response
+
+    def predict_requests(self, request: bytes) -> List[bytes]:
+        """Returns the client commands that the hardware wallet is expected to send next, in order,
+        after `request` was executed successfully.
+
+        Only the requests that follow with certainty in the flows of the hardware wallet are
+        predicted:
+        - GET_MERKLE_LEAF_INDEX is followed by GET_MERKLE_LEAF_PROOF for the same leaf, if found;
+        - GET_MERKLE_LEAF_PROOF is followed by GET_PREIMAGE for the leaf.
+
+        The second one is not certain (the leaf might only be needed for its hash), but it is the
+        most common case.
+        """
+
+        cmd_code = request[0]
+        req = ByteStreamParser(request[1:])
+        if cmd_code == ClientCommandCode.GET_MERKLE_LEAF_INDEX:
+            root = req.read_bytes(32)
+            leaf_hash = req.read_bytes(32)
+            mt = self.known_trees[root]
+            try:
+                leaf_index = mt.leaf_index(leaf_hash)
+            except ValueError:
+                return []
+
+            leaf_proof_req = b"".join([
+                bytes([ClientCommandCode.GET_MERKLE_LEAF_PROOF]),
+                root,
+                write_varint(len(mt)),
+                write_varint(leaf_index),
+            ])
+            return [leaf_proof_req, *self.predict_requests(leaf_proof_req)]
+        elif cmd_code == ClientCommandCode.GET_MERKLE_LEAF_PROOF:
+            root = req.read_bytes(32)
+            req.read_varint()  # tree size
+            leaf_index = req.read_varint()
+            leaf_hash = self.known_trees[root].get(leaf_index)
+            return [bytes([ClientCommandCode.GET_PREIMAGE, 0]) + leaf_hash]
+        return []
+
+    def get_speculative_responses(self, max_len: int) -> bytes:
+        """Computes the speculative responses to the client commands that are expected after the
+        last executed one, to be sent together with its response in the CONTINUE command.
+
+        Each speculative response is encoded as the first 4 bytes of the SHA-256 hash of the
+        request, followed by the 1-byte length of the response and the response itself.
+        No speculative response is computed if it would change the state of the interpreter (that
+        is, if it would add elements to the queue of GET_MORE_ELEMENTS).
+
+        Parameters
+        ----------
+        max_len : int
+            The maximum total length of the speculative responses.
+
+        Returns
+        -------
+        bytes
+            The concatenation of the speculative responses; empty if there are none.
+        """
+
+        max_len = min(max_len, self.max_speculative_len)
+
+        if max_len <= 0 or self.last_request is None or len(self.queue) != 0:
+            return b""
+
+        result = b""
+        for request in self.predict_requests(self.last_request):
+            try:
+                response = self.commands[request[0]].execute(request)
+            except Exception:
+                break
+
+            if len(self.queue) != 0:
+                # the response did not fit a single message; this request can't be anticipated
+                self.queue.clear()
+                break
+
+            entry = sha256(request)[:4] + len(response).to_bytes(1, byteorder="big") + response
+            if len(result) + len(entry) > max_len:
+                break
+            result += entry
+
+        return result
 
     def add_known_preimage(self, element: bytes) -> None:
         """Adds a preimage to the list of known preimages.
@@ -306,29 +955,49 @@ class ClientCommandInterpreter:
             A list of `bytes` corresponding to the leafs of the Merkle tree.
         """
 
-        for el in elements:
-            self.add_known_preimage(b"\x00" + el)
+        self.known_trees.build(elements)
 
-        mt = MerkleTree(element_hash(el) for el in elements)
-
-        self.known_trees[mt.root] = mt
-
-    def add_known_mapping(self, mapping: Mapping[bytes, bytes]) -> None:
+    def add_known_mapping(self, mapping: Mapping[bytes, bytes]) -> bytes:
         """Adds the Merkle trees of keys, and the Merkle tree of values (ordered by key)
         of a mapping of bytes to bytes.
 
         Adds the Merkle tree of the list of keys, and the Merkle tree of the list of corresponding
-        values, with the same semantics as the `add_known_list` applied separately to the two lists. 
+        values, with the same semantics as the `add_known_list` applied separately to the two lists.
+        However, the trees and the preimages of their leaves are only built if the hardware wallet
+        asks about them: only their roots are computed here.
 
         Parameters
         ----------
         mapping : Mapping[bytes, bytes]
             A mapping whose keys and values are `bytes`.
+
+        Returns
+        -------
+        bytes
+            The Merkleized map commitment of `mapping`, as in `get_merkleized_map_commitment`.
         """
 
-        items_sorted = list(sorted(mapping.items()))
+        return self._add_mapping_roots(_mapping_roots(mapping))
+
+    def add_known_mappings(self, mappings: Sequence[Mapping[bytes, bytes]],
+                           executor: Optional[Executor] = None) -> List[bytes]:
+        """Adds each of `mappings` as with `add_known_mapping`, and returns their Merkleized map
+        commitments, in the same order.
+
+        If `executor` is not None, the roots of the mappings are computed in its workers. hashlib
+        releases the GIL while hashing long values, therefore a `ThreadPoolExecutor` computes them
+        in parallel for PSBTs with many inputs (and large non-witness UTXOs).
+        """
+
+        if executor is None:
+            roots = map(_mapping_roots, mappings)
+        else:
+            roots = executor.map(_mapping_roots, mappings)
+        return [self._add_mapping_roots(r) for r in roots]
+
+    def _add_mapping_roots(self, roots: Tuple[int, List[bytes], List[bytes], bytes, bytes]) -> bytes:
+        n, keys, values, keys_root, values_root = roots
+        self.known_trees.add_lazy(keys_root, keys)
+        self.known_trees.add_lazy(values_root, values)
 
-        keys = [i[0] for i in items_sorted]
-        values = [i[1] for i in items_sorted]
-        self.add_known_list(keys)
-        self.add_known_list(values)
+        return write_varint(n) + keys_root + values_root
@@ -11,8 +11,10 @@ import re
 import base64
 
 from .client import Client, TransportClient
+from .client_base import SignPsbtCheckpoint
+from .instrumentation import Instrumentation
 
-from typing import List, Tuple, Mapping, Optional, Union
+from typing import Callable, Dict, List, Tuple, Mapping, Optional, Sequence, Union
 
 from .common import AddressType, Chain, hash160
 from .key import ExtendedKey, parse_path
@@ -71,14 +73,28 @@ class DongleAdaptor:
 class LegacyClient(Client):
     """Wrapper for Ledger Bitcoin app before version 2.0.0."""
 
-    def __init__(self, comm_client: TransportClient, chain: Chain = Chain.MAIN, debug: bool = False):
-        super().__init__(comm_client, chain, debug)
+    def __init__(self, comm_client: TransportClient, chain: Chain = Chain.MAIN, debug: bool = False,
+                 instrumentation: Optional[Instrumentation] = None):
+        super().__init__(comm_client, chain, debug, instrumentation)
 
         self.app = btchip(DongleAdaptor(comm_client))
 
         if self.app.getAppName() not in ["Bitcoin", "Bitcoin Test", "app"]:
             raise ValueError("Ledger is not in either the Bitcoin or Bitcoin Testnet app")
 
+        # Trusted inputs already computed by the device, keyed by (master fingerprint, txid, vout).
+        # Streaming the previous transaction is by far the slowest part of signing; the HMAC key of
+        # the trusted inputs only changes when the app is reinstalled, which ends the transport
+        # session (and therefore the lifetime of this client).
+        self._trusted_inputs: Dict[Tuple[bytes, int, int], dict] = {}
+
+    def _get_trusted_input(self, master_fpr: bytes, prevtx_bytes: bytes, txid: int, vout: int) -> dict:
+        key = (master_fpr, txid, vout)
+        if key not in self._trusted_inputs:
+            self._trusted_inputs[key] = self.app.getTrustedInput(bitcoinTransaction(prevtx_bytes), vout)
+        # callers add the "sequence" of the spending input
+        return dict(self._trusted_inputs[key])
+
     def get_extended_pubkey(self, path: str, display: bool = False) -> str:
         # mostly taken from HWI
 
@@ -155,7 +171,20 @@ class LegacyClient(Client):
         assert isinstance(output["address"], str)
         return output['address'][12:-2] # HACK: A bug in getWalletPublicKey results in the address being returned as the string "bytearray(b'<address>')". This extracts the actual address to work around this.
 
-    def sign_psbt(self, psbt: PSBT, wallet: Wallet, wallet_hmac: Optional[bytes]) -> Mapping[int, bytes]:
+    def sign_psbt(self, psbt: PSBT, wallet: Wallet, wallet_hmac: Optional[bytes],
+                  checkpoint: Optional[SignPsbtCheckpoint] = None,
+                  batch_review: bool = False,
+                  on_signature: Optional[Callable[[int, bytes], None]] = None,
+                  selected_inputs: Optional[Sequence[int]] = None) -> Mapping[int, bytes]:
+        if checkpoint is not None:
+            raise NotImplementedError("Checkpoints are not supported by this version of the app")
+
+        if batch_review:
+            raise NotImplementedError("Batch review is not supported by this version of the app")
+
+        if selected_inputs is not None:
+            raise NotImplementedError("Selecting the inputs is not supported by this version of the app")
+
         if wallet_hmac != None or wallet.n_keys != 1:
             raise NotImplementedError("Policy wallets are only supported from version 2.0.0. Please update your Ledger hardware wallet")
 
@@ -248,14 +277,14 @@ class LegacyClient(Client):
                 # We only need legacy inputs in the case where all inputs are legacy, we check
                 # later
                 assert psbt_in.non_witness_utxo is not None
-                ledger_prevtx = bitcoinTransaction(psbt_in.non_witness_utxo.serialize())
-                legacy_inputs.append(self.app.getTrustedInput(ledger_prevtx, txin.prevout.n))
+                legacy_inputs.append(self._get_trusted_input(
+                    master_fpr, psbt_in.non_witness_utxo.serialize(), txin.prevout.hash, txin.prevout.n))
                 legacy_inputs[-1]["sequence"] = seq_hex
                 has_legacy = True
 
             if psbt_in.non_witness_utxo and use_trusted_segwit:
-                ledger_prevtx = bitcoinTransaction(psbt_in.non_witness_utxo.serialize())
-                segwit_inputs[-1].update(self.app.getTrustedInput(ledger_prevtx, txin.prevout.n))
+                segwit_inputs[-1].update(self._get_trusted_input(
+                    master_fpr, psbt_in.non_witness_utxo.serialize(), txin.prevout.hash, txin.prevout.n))
 
             pubkeys = []
             signature_attempts = []
@@ -297,6 +326,8 @@ class LegacyClient(Client):
 
                     # tx.inputs[i].partial_sigs[signature_attempt[1]] = self.app.untrustedHashSign(signature_attempt[0], "", c_tx.nLockTime, 0x01)
                     result[i] = self.app.untrustedHashSign(signature_attempt[0], "", c_tx.nLockTime, 0x01)
+                    if on_signature is not None:
+                        on_signature(i, result[i])
         elif has_legacy:
             first_input = True
             # Legacy signing if all inputs are legacy
@@ -308,6 +339,8 @@ class LegacyClient(Client):
 
                     #tx.inputs[i].partial_sigs[signature_attempt[1]] = self.app.untrustedHashSign(signature_attempt[0], "", c_tx.nLockTime, 0x01)
                     result[i] = self.app.untrustedHashSign(signature_attempt[0], "", c_tx.nLockTime, 0x01)
+                    if on_signature is not None:
+                        on_signature(i, result[i])
 
                     first_input = False
 
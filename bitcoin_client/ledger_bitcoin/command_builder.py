@@ -1,8 +1,8 @@
 import enum
-from typing import List, Tuple, Mapping, Union, Iterator, Optional
+from typing import List, Tuple, Mapping, Union, Iterator, Optional, Sequence
 
 from .common import bip32_path_from_string, AddressType, sha256, hash256, write_varint
-from .merkle import get_merkleized_map_commitment, MerkleTree, element_hash
+from .merkle import MerkleTree, element_hash, get_messages_merkle_root
 from .wallet import Wallet
 
 
@@ -34,10 +34,26 @@ class BitcoinInsType(enum.IntEnum):
     GET_WALLET_ADDRESS = 0x03
     SIGN_PSBT = 0x04
     GET_MASTER_FINGERPRINT = 0x05
+    GET_WALLET_ADDRESSES = 0x06
+    SCAN_WALLET_SCRIPTS = 0x07
+    GET_EXTENDED_PUBKEYS = 0x08
+    REGISTER_WALLETS = 0x09
+    OPEN_WALLET_SESSION = 0x0A
+    CLOSE_WALLET_SESSION = 0x0B
     SIGN_MESSAGE = 0x10
+    SIGN_MESSAGE_BIP322 = 0x11
+
+class WalletAddressesMode(enum.IntEnum):
+    DIGEST = 0
+    YIELD = 1
+    SCRIPTS_MERKLE_ROOT = 2
+    OWNERSHIP_TOKENS = 3
 
 class FrameworkInsType(enum.IntEnum):
     CONTINUE_INTERRUPTED = 0x01
+    GET_MAX_RESPONSE_LEN = 0x02
+    GET_PERF_COUNTERS = 0x04
+    GET_CACHE_STATS = 0x06
 
 
 class BitcoinCommandBuilder:
@@ -46,6 +62,8 @@ class BitcoinCommandBuilder:
     CLA_DEFAULT: int = 0xB0
     CLA_BITCOIN: int = 0xE1
     CLA_FRAMEWORK: int = 0xF8
+    P1_CONTINUE_SPECULATIVE: int = 0x01
+    P1_CONTINUE_KEEPALIVE: int = 0x02
 
     def serialize(
         self,
@@ -94,6 +112,20 @@ class BitcoinCommandBuilder:
             cdata=cdata,
         )
 
+    def get_extended_pubkeys(self, bip32_paths: List[str], client_capabilities: int = 0):
+        cdata = bytearray([len(bip32_paths)])
+        for path in bip32_paths:
+            steps: List[bytes] = bip32_path_from_string(path)
+            cdata += len(steps).to_bytes(1, byteorder="big")
+            cdata += b''.join(steps)
+
+        return self.serialize(
+            cla=self.CLA_BITCOIN,
+            ins=BitcoinInsType.GET_EXTENDED_PUBKEYS,
+            p2=client_capabilities,
+            cdata=bytes(cdata),
+        )
+
     def register_wallet(self, wallet: Wallet):
         wallet_bytes = wallet.serialize()
 
@@ -103,6 +135,29 @@ class BitcoinCommandBuilder:
             cdata=write_varint(len(wallet_bytes)) + wallet_bytes,
         )
 
+    def register_wallets(self, wallets: List[Wallet]):
+        cdata = bytes([len(wallets)]) + b''.join(wallet.id for wallet in wallets)
+
+        return self.serialize(
+            cla=self.CLA_BITCOIN,
+            ins=BitcoinInsType.REGISTER_WALLETS,
+            cdata=cdata,
+        )
+
+    def open_wallet_session(self, wallet: Wallet, wallet_hmac: bytes, client_capabilities: int = 0):
+        return self.serialize(
+            cla=self.CLA_BITCOIN,
+            ins=BitcoinInsType.OPEN_WALLET_SESSION,
+            p2=client_capabilities,
+            cdata=wallet.id + wallet_hmac,
+        )
+
+    def close_wallet_session(self):
+        return self.serialize(
+            cla=self.CLA_BITCOIN,
+            ins=BitcoinInsType.CLOSE_WALLET_SESSION
+        )
+
     def get_wallet_address(
         self,
         wallet: Wallet,
@@ -110,6 +165,7 @@ class BitcoinCommandBuilder:
         address_index: int,
         change: bool,
         display: bool,
+        client_capabilities: int = 0,
     ):
         cdata: bytes = b"".join(
             [
@@ -124,42 +180,111 @@ class BitcoinCommandBuilder:
         return self.serialize(
             cla=self.CLA_BITCOIN,
             ins=BitcoinInsType.GET_WALLET_ADDRESS,
+            p2=client_capabilities,
             cdata=cdata,
         )
 
-    def sign_psbt(
+    def get_wallet_addresses(
         self,
-        global_mapping: Mapping[bytes, bytes],
-        input_mappings: List[Mapping[bytes, bytes]],
-        output_mappings: List[Mapping[bytes, bytes]],
         wallet: Wallet,
         wallet_hmac: Optional[bytes],
+        start_index: int,
+        count: int,
+        change: bool,
+        mode: WalletAddressesMode,
+        client_capabilities: int = 0,
     ):
-
-        cdata = bytearray()
-        cdata += get_merkleized_map_commitment(global_mapping)
-
-        cdata += write_varint(len(input_mappings))
-        cdata += MerkleTree(
+        cdata: bytes = b"".join(
             [
-                element_hash(get_merkleized_map_commitment(m_in))
-                for m_in in input_mappings
+                bytes([mode]),                                          # 1 byte
+                wallet.id,                                              # 32 bytes
+                wallet_hmac if wallet_hmac is not None else b'\0' * 32, # 32 bytes
+                b"\1" if change else b"\0",                             # 1 byte
+                start_index.to_bytes(4, byteorder="big"),               # 4 bytes
+                count.to_bytes(4, byteorder="big"),                     # 4 bytes
             ]
-        ).root
+        )
 
-        cdata += write_varint(len(output_mappings))
-        cdata += MerkleTree(
+        return self.serialize(
+            cla=self.CLA_BITCOIN,
+            ins=BitcoinInsType.GET_WALLET_ADDRESSES,
+            p2=client_capabilities,
+            cdata=cdata,
+        )
+
+    def scan_wallet_scripts(
+        self,
+        wallet: Wallet,
+        wallet_hmac: Optional[bytes],
+        scripts: List[bytes],
+        start_index: int,
+        window_size: int,
+        client_capabilities: int = 0,
+    ):
+        cdata: bytes = b"".join(
             [
-                element_hash(get_merkleized_map_commitment(m_out))
-                for m_out in output_mappings
+                wallet.id,                                              # 32 bytes
+                wallet_hmac if wallet_hmac is not None else b'\0' * 32, # 32 bytes
+                start_index.to_bytes(4, byteorder="big"),               # 4 bytes
+                window_size.to_bytes(4, byteorder="big"),               # 4 bytes
+                write_varint(len(scripts)),                             # 1-9 bytes
+                MerkleTree(element_hash(s) for s in scripts).root,      # 32 bytes
             ]
-        ).root
+        )
+
+        return self.serialize(
+            cla=self.CLA_BITCOIN,
+            ins=BitcoinInsType.SCAN_WALLET_SCRIPTS,
+            p2=client_capabilities,
+            cdata=cdata,
+        )
+
+    def sign_psbt(
+        self,
+        global_commitment: bytes,
+        n_inputs: int,
+        inputs_root: bytes,
+        n_outputs: int,
+        outputs_root: bytes,
+        wallet_id: bytes,
+        wallet_hmac: Optional[bytes],
+        client_capabilities: int = 0,
+        checkpoint: Optional[Tuple[int, bytes]] = None,
+        selected_inputs: Sequence[int] = (),
+    ):
+        """The Merkleized map commitment of the global map, and the number and the Merkle roots of the lists of
+        Merkleized map commitments of the inputs and outputs, are computed once by `PreparedPsbt`."""
+
+        cdata = bytearray()
+        cdata += global_commitment
+
+        cdata += write_varint(n_inputs)
+        cdata += inputs_root
+
+        cdata += write_varint(n_outputs)
+        cdata += outputs_root
 
-        cdata += wallet.id
+        cdata += wallet_id
         cdata += wallet_hmac if wallet_hmac is not None else b'\0' * 32
 
+        if len(selected_inputs) > 0 or checkpoint is not None:
+            # the inputs to sign, if not all of them; the list is empty if only a checkpoint is given
+            cdata += write_varint(len(selected_inputs))
+            for input_index in selected_inputs:
+                cdata += write_varint(input_index)
+
+        if checkpoint is not None:
+            # next_input_index and token of the checkpoint to resume from
+            next_input_index, token = checkpoint
+            cdata += next_input_index.to_bytes(4, byteorder="big")
+            cdata += token
+
         return self.serialize(
-            cla=self.CLA_BITCOIN, ins=BitcoinInsType.SIGN_PSBT, cdata=bytes(cdata)
+            cla=self.CLA_BITCOIN,
+            ins=BitcoinInsType.SIGN_PSBT,
+            p1=client_capabilities >> 8,
+            p2=client_capabilities & 0xFF,
+            cdata=bytes(cdata),
         )
 
     def get_master_fingerprint(self):
@@ -168,14 +293,14 @@ class BitcoinCommandBuilder:
             ins=BitcoinInsType.GET_MASTER_FINGERPRINT
         )
 
-    def sign_message(self, message: bytes, bip32_path: str):
+    def sign_message(self, message: bytes, bip32_path: str, chunk_size: int = 64):
         cdata = bytearray()
 
         bip32_path: List[bytes] = bip32_path_from_string(bip32_path)
 
-        # split message in 64-byte chunks (last chunk can be smaller)
-        n_chunks = (len(message) + 63) // 64
-        chunks = [message[64 * i: 64 * i + 64] for i in range(n_chunks)]
+        # split message in chunks of chunk_size bytes (last chunk can be smaller)
+        n_chunks = (len(message) + chunk_size - 1) // chunk_size
+        chunks = [message[chunk_size * i: chunk_size * i + chunk_size] for i in range(n_chunks)]
 
         cdata += len(bip32_path).to_bytes(1, byteorder="big")
         cdata += b''.join(bip32_path)
@@ -184,12 +309,38 @@ class BitcoinCommandBuilder:
 
         cdata += MerkleTree(element_hash(c) for c in chunks).root
 
+        # the chunk size is omitted if it is the default one
+        if chunk_size != 64:
+            cdata += chunk_size.to_bytes(1, byteorder="big")
+
         return self.serialize(
             cla=self.CLA_BITCOIN,
             ins=BitcoinInsType.SIGN_MESSAGE,
             cdata=bytes(cdata)
         )
 
+    def sign_message_bip322(self, messages: List[bytes], bip32_path: str, address_type: AddressType,
+                            client_capabilities: int = 0):
+        cdata = bytearray()
+
+        bip32_path: List[bytes] = bip32_path_from_string(bip32_path)
+
+        cdata += address_type.value.to_bytes(1, byteorder="big")
+
+        cdata += len(bip32_path).to_bytes(1, byteorder="big")
+        cdata += b''.join(bip32_path)
+
+        # each leaf of the Merkle tree is an entire message
+        cdata += write_varint(len(messages))
+        cdata += get_messages_merkle_root(messages)
+
+        return self.serialize(
+            cla=self.CLA_BITCOIN,
+            ins=BitcoinInsType.SIGN_MESSAGE_BIP322,
+            p2=client_capabilities,
+            cdata=bytes(cdata)
+        )
+
     def continue_interrupted(self, cdata: bytes):
         """Command builder for CONTINUE.
 
@@ -204,3 +355,76 @@ class BitcoinCommandBuilder:
             ins=FrameworkInsType.CONTINUE_INTERRUPTED,
             cdata=cdata,
         )
+
+    def continue_interrupted_speculative(self, cdata: bytes, speculative_responses: bytes):
+        """Command builder for CONTINUE, with speculative responses to the next client commands.
+
+        Returns
+        -------
+        bytes
+            APDU command for CONTINUE.
+
+        """
+        return self.serialize(
+            cla=self.CLA_FRAMEWORK,
+            ins=FrameworkInsType.CONTINUE_INTERRUPTED,
+            p1=self.P1_CONTINUE_SPECULATIVE,
+            cdata=len(cdata).to_bytes(1, byteorder="big") + cdata + speculative_responses,
+        )
+
+    def continue_interrupted_keepalive(self):
+        """Command builder for CONTINUE, asking for more time to respond to the current client command.
+
+        Returns
+        -------
+        bytes
+            APDU command for CONTINUE.
+
+        """
+        return self.serialize(
+            cla=self.CLA_FRAMEWORK,
+            ins=FrameworkInsType.CONTINUE_INTERRUPTED,
+            p1=self.P1_CONTINUE_KEEPALIVE,
+        )
+
+    def get_max_response_len(self):
+        """Command builder for GET_MAX_RESPONSE_LEN.
+
+        Returns
+        -------
+        bytes
+            APDU command for GET_MAX_RESPONSE_LEN.
+
+        """
+        return self.serialize(
+            cla=self.CLA_FRAMEWORK,
+            ins=FrameworkInsType.GET_MAX_RESPONSE_LEN,
+        )
+
+    def get_perf_counters(self):
+        """Command builder for GET_PERF_COUNTERS (only supported by the builds of the app with PERF_COUNTERS=1).
+
+        Returns
+        -------
+        bytes
+            APDU command for GET_PERF_COUNTERS.
+
+        """
+        return self.serialize(
+            cla=self.CLA_FRAMEWORK,
+            ins=FrameworkInsType.GET_PERF_COUNTERS,
+        )
+
+    def get_cache_stats(self):
+        """Command builder for GET_CACHE_STATS (only supported by the builds of the app with PERF_COUNTERS=1).
+
+        Returns
+        -------
+        bytes
+            APDU command for GET_CACHE_STATS.
+
+        """
+        return self.serialize(
+            cla=self.CLA_FRAMEWORK,
+            ins=FrameworkInsType.GET_CACHE_STATS,
+        )
@@ -0,0 +1,235 @@
+"""Instrumentation of the communication between a client and the device.
+
+A client created with an `Instrumentation` calls its hooks for each APDU exchanged with the device, and for each
+client command that the device requests during the execution of a command. `ClientStats` aggregates the counts, the
+bytes and the time spent on the device and on the host, and exports them as Prometheus counters.
+
+With the builds of the app compiled with `PERF_COUNTERS=1`, the clients can also query, after each command, the
+counters of the operations performed by the device and the statistics of its caches, in order to tune the sizes of
+`src/perf_config.h` for each target.
+"""
+
+import threading
+from typing import Dict, List, Mapping, NamedTuple, Optional, Tuple
+
+from .client_command import ClientCommandCode
+
+
+class PerfCounters(NamedTuple):
+    """The counters of the operations of a command, returned by GET_PERF_COUNTERS."""
+    ecfp_scalar_mult: int
+    ecfp_add_point: int
+    hmac_sha512: int
+    sha256_compressions: int
+    derive_node_bip32: int
+    interruptions: int
+
+
+class CacheStats(NamedTuple):
+    """The usage of a cache of the device during a command, returned by GET_CACHE_STATS; `bytes` is the size of the
+    memory of the cache, or 0 if it was not used."""
+    hits: int
+    misses: int
+    evictions: int
+    bytes: int
+
+
+# names of the caches in the response of GET_CACHE_STATS, in order; they match the sizes in src/perf_config.h
+CACHE_NAMES = [
+    "xpub",
+    "nvm_xpub",
+    "policy_pubkeys",
+    "policy_tr_keys",
+    "policy_multisig_keys",
+    "wallet_hmac",
+    "wallet_session",
+    "wallet_address",
+    "wallet_script_memo",
+    "tr_seckeys",
+    "prevouts",
+    "merkleized_map_index",
+    "merkle_path",
+]
+
+
+def parse_perf_counters(response: bytes) -> PerfCounters:
+    """Parses the response of GET_PERF_COUNTERS; the counters added by newer versions of the app are ignored."""
+    n = len(PerfCounters._fields)
+    if len(response) < 4 * n:
+        raise ValueError("Invalid response to GET_PERF_COUNTERS")
+    return PerfCounters(*(int.from_bytes(response[4 * i:4 * i + 4], byteorder="big") for i in range(n)))
+
+
+def parse_cache_stats(response: bytes) -> Dict[str, CacheStats]:
+    """Parses the response of GET_CACHE_STATS into the statistics of each cache, by name; the caches unknown to this
+    version of the library are named by their index."""
+    if len(response) < 1 or len(response) != 1 + 16 * response[0]:
+        raise ValueError("Invalid response to GET_CACHE_STATS")
+    result = {}
+    for i in range(response[0]):
+        entry = response[1 + 16 * i:17 + 16 * i]
+        name = CACHE_NAMES[i] if i < len(CACHE_NAMES) else f"cache_{i}"
+        result[name] = CacheStats(*(int.from_bytes(entry[j:j + 4], byteorder="big") for j in range(0, 16, 4)))
+    return result
+
+
+class Instrumentation:
+    """Hooks called by the clients; the default implementation does nothing.
+
+    The hooks are called from the thread (or the event loop) that drives the client, and they must be fast, as they
+    are called for every message. Sent bytes include the 5-byte header of the APDU, and received bytes include the
+    2-byte status word.
+
+    If `collect_device_stats` is True, `NewClient` and `AsyncNewClient` send GET_PERF_COUNTERS and GET_CACHE_STATS
+    after each command, and pass the results to `on_device_stats`; these two APDUs are also passed to `on_apdu`. If
+    the device does not support them (the builds of the app without `PERF_COUNTERS=1`), they are not sent again by the
+    same client.
+    """
+
+    collect_device_stats: bool = False
+
+    def on_apdu(self, cla: int, ins: int, sw: int, sent_bytes: int, received_bytes: int, seconds: float) -> None:
+        """Called after each APDU; `seconds` is the time between sending the APDU and receiving its response, that is
+        spent on the device and on the transport."""
+
+    def on_client_command(self, code: int, request_bytes: int, response_bytes: int, seconds: float) -> None:
+        """Called after each client command is executed successfully on the host; `seconds` is the time spent to
+        compute the response. The speculative responses sent together with it are not included."""
+
+    def on_device_stats(self, cla: int, ins: int, perf_counters: PerfCounters,
+                        cache_stats: Mapping[str, CacheStats]) -> None:
+        """Called after each command, if `collect_device_stats` is True and the device supports it, with the counters
+        of the operations and the statistics of the caches of the device during the command."""
+
+
+class ClientStats(Instrumentation):
+    """An `Instrumentation` that counts the APDUs (by CLA and INS) and the client commands (by command code), with the
+    number of bytes and the total time of each.
+
+    The same `ClientStats` can be shared among clients that run in different threads. The `labels` are added to all
+    the exported counters, for example to identify the model and the version of the app of the device:
+
+        stats = ClientStats({"model": "nanos", "version": "2.1.0"})
+        client = createClient(transport, instrumentation=stats)
+        ...
+        print(stats.to_prometheus())
+    """
+
+    def __init__(self, labels: Optional[Mapping[str, str]] = None, collect_device_stats: bool = False) -> None:
+        self.labels = dict(labels or {})
+        # (cla, ins) => [count, sent bytes, received bytes, seconds]
+        self.apdus: Dict[Tuple[int, int], List[float]] = {}
+        # client command code => [count, request bytes, response bytes, seconds]
+        self.client_commands: Dict[int, List[float]] = {}
+        self.collect_device_stats = collect_device_stats
+        # (cla, ins) => the sums of the perf counters of the device, by name
+        self.device_ops: Dict[Tuple[int, int], Dict[str, int]] = {}
+        # (cla, ins, cache name) => [hits, misses, evictions]
+        self.device_caches: Dict[Tuple[int, int, str], List[int]] = {}
+        # cache name => the largest size of its memory reported by the device
+        self.device_cache_bytes: Dict[str, int] = {}
+        self._lock = threading.Lock()
+
+    @staticmethod
+    def _add(table: dict, key, values: Tuple[int, int, float]) -> None:
+        entry = table.setdefault(key, [0, 0, 0, 0.0])
+        entry[0] += 1
+        entry[1] += values[0]
+        entry[2] += values[1]
+        entry[3] += values[2]
+
+    def on_apdu(self, cla: int, ins: int, sw: int, sent_bytes: int, received_bytes: int, seconds: float) -> None:
+        with self._lock:
+            self._add(self.apdus, (cla, ins), (sent_bytes, received_bytes, seconds))
+
+    def on_client_command(self, code: int, request_bytes: int, response_bytes: int, seconds: float) -> None:
+        with self._lock:
+            self._add(self.client_commands, code, (request_bytes, response_bytes, seconds))
+
+    def on_device_stats(self, cla: int, ins: int, perf_counters: PerfCounters,
+                        cache_stats: Mapping[str, CacheStats]) -> None:
+        with self._lock:
+            ops = self.device_ops.setdefault((cla, ins), {})
+            for name, value in perf_counters._asdict().items():
+                ops[name] = ops.get(name, 0) + value
+            for name, stats in cache_stats.items():
+                if stats.bytes == 0:
+                    continue  # not used by the command
+                entry = self.device_caches.setdefault((cla, ins, name), [0, 0, 0])
+                entry[0] += stats.hits
+                entry[1] += stats.misses
+                entry[2] += stats.evictions
+                self.device_cache_bytes[name] = max(self.device_cache_bytes.get(name, 0), stats.bytes)
+
+    def device_seconds(self) -> float:
+        """Returns the total time of the APDU exchanges (including the client commands)."""
+        with self._lock:
+            return sum(entry[3] for entry in self.apdus.values())
+
+    def host_seconds(self) -> float:
+        """Returns the total time spent on the host to execute the client commands."""
+        with self._lock:
+            return sum(entry[3] for entry in self.client_commands.values())
+
+    def reset(self) -> None:
+        with self._lock:
+            self.apdus.clear()
+            self.client_commands.clear()
+            self.device_ops.clear()
+            self.device_caches.clear()
+            self.device_cache_bytes.clear()
+
+    def to_prometheus(self, prefix: str = "ledger_bitcoin") -> str:
+        """Returns the counters in the text exposition format of Prometheus."""
+
+        def command_name(code: int) -> str:
+            try:
+                return ClientCommandCode(code).name
+            except ValueError:
+                return f"0x{code:02X}"
+
+        with self._lock:
+            apdu_rows = [({"cla": f"0x{cla:02X}", "ins": f"0x{ins:02X}"}, entry)
+                         for (cla, ins), entry in sorted(self.apdus.items())]
+            command_rows = [({"command": command_name(code)}, entry)
+                            for code, entry in sorted(self.client_commands.items())]
+            op_rows = [({"cla": f"0x{cla:02X}", "ins": f"0x{ins:02X}", "op": name}, [value])
+                       for (cla, ins), ops in sorted(self.device_ops.items()) for name, value in ops.items()]
+            cache_rows = [({"cla": f"0x{cla:02X}", "ins": f"0x{ins:02X}", "cache": name}, entry)
+                          for (cla, ins, name), entry in sorted(self.device_caches.items())]
+            cache_bytes_rows = [({"cache": name}, [value]) for name, value in sorted(self.device_cache_bytes.items())]
+
+        metrics = [
+            ("apdus_total", "APDUs exchanged with the device.", apdu_rows, 0),
+            ("apdu_sent_bytes_total", "Bytes sent to the device, including the APDU headers.", apdu_rows, 1),
+            ("apdu_received_bytes_total", "Bytes received from the device, including the status words.", apdu_rows, 2),
+            ("apdu_seconds_total", "Time between sending each APDU and receiving its response.", apdu_rows, 3),
+            ("client_commands_total", "Client commands executed on the host.", command_rows, 0),
+            ("client_command_request_bytes_total", "Bytes of the requests of the client commands.", command_rows, 1),
+            ("client_command_response_bytes_total", "Bytes of the responses to the client commands.", command_rows, 2),
+            ("client_command_seconds_total", "Time spent on the host to execute the client commands.", command_rows, 3),
+        ]
+        # only collected with collect_device_stats
+        if len(op_rows) > 0:
+            metrics += [
+                ("device_ops_total", "Operations performed by the device, by command.", op_rows, 0),
+                ("device_cache_hits_total", "Hits of the caches of the device, by command.", cache_rows, 0),
+                ("device_cache_misses_total", "Misses of the caches of the device, by command.", cache_rows, 1),
+                ("device_cache_evictions_total", "Evictions of the caches of the device, by command.", cache_rows, 2),
+                ("device_cache_bytes", "Size of the memory of the caches of the device.", cache_bytes_rows, 0),
+            ]
+
+        lines = []
+        for name, help_text, rows, column in metrics:
+            lines.append(f"# HELP {prefix}_{name} {help_text}")
+            lines.append(f"# TYPE {prefix}_{name} {'counter' if name.endswith('_total') else 'gauge'}")
+            for row_labels, entry in rows:
+                lines.append(f"{prefix}_{name}{{{_format_labels({**self.labels, **row_labels})}}} {entry[column]}")
+        return "\n".join(lines) + "\n"
+
+
+def _format_labels(labels: Mapping[str, str]) -> str:
+    def escape(value: str) -> str:
+        return str(value).replace("\\", "\\\\").replace("\"", "\\\"").replace("\n", "\\n")
+
+    return ",".join(f"{key}=\"{escape(value)}\"" for key, value in labels.items())
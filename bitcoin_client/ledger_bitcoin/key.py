@@ -33,6 +33,12 @@ from typing import (
     Tuple,
 )
 
+try:
+    # Optional: libsecp256k1 (through coincurve) computes the point multiplications much faster
+    import coincurve
+except ImportError:
+    coincurve = None
+
 
 HARDENED_FLAG = 1 << 31
 
@@ -71,6 +77,9 @@ def point_add(p1: Point, p2: Point) -> Point:
 
 
 def point_mul(p: Point, n: int) -> Point:
+    if coincurve is not None and p is not None:
+        return _point_mul_secp256k1(p, n)
+
     r = None
     for i in range(256):
         if ((n >> i) & 1):
@@ -79,6 +88,19 @@ def point_mul(p: Point, n: int) -> Point:
     return r
 
 
+def _point_mul_secp256k1(P: Tuple[int, int], k: int) -> Point:
+    k %= n
+    if k == 0:
+        return None
+    if P == G:
+        Q = coincurve.PublicKey.from_secret(k.to_bytes(32, byteorder="big"))
+    else:
+        Q = coincurve.PublicKey(b'\x04' + P[0].to_bytes(32, byteorder="big") + P[1].to_bytes(32, byteorder="big"))
+        Q = Q.multiply(k.to_bytes(32, byteorder="big"))
+    data = Q.format(compressed=False)
+    return (int.from_bytes(data[1:33], byteorder="big"), int.from_bytes(data[33:65], byteorder="big"))
+
+
 def deserialize_point(b: bytes) -> Point:
     x = int.from_bytes(b[1:], byteorder="big")
     y = pow((x * x * x + 7) % p, (p + 1) // 4, p)
@@ -1,4 +1,5 @@
-from typing import List, Iterable, Mapping
+import hashlib
+from typing import Dict, List, Iterable, Mapping
 
 from .common import write_varint, sha256
 
@@ -51,9 +52,13 @@ def largest_power_of_2_less_than(n: int) -> int:
 
 
 def element_hash(element_preimage: bytes) -> bytes:
-    """Computes the hash of an element to be stored in the Merkle tree."""
+    """Computes the hash of an element to be stored in the Merkle tree.
 
-    return sha256(b'\x00' + element_preimage)
+    The element can be any bytes-like object; it is hashed without copying it."""
+
+    h = hashlib.sha256(b'\x00')
+    h.update(element_preimage)
+    return h.digest()
 
 
 def combine_hashes(left: bytes, right: bytes) -> bytes:
@@ -63,53 +68,6 @@ def combine_hashes(left: bytes, right: bytes) -> bytes:
     return sha256(b'\x01' + left + right)
 
 
-# root is the only node with parent == None
-# leaves have left == right == None
-class Node:
-    def __init__(self, left, right, parent, value: bytes):
-        self.left = left
-        self.right = right
-        self.parent = parent
-        self.value = value
-
-    def recompute_value(self):
-        assert self.left is not None
-        assert self.right is not None
-        self.value = combine_hashes(self.left.value, self.right.value)
-
-    def sibling(self):
-        if self.parent is None:
-            raise IndexError("The root does not have a sibling.")
-
-        if self.parent.left == self:
-            return self.parent.right
-        elif self.parent.right == self:
-            return self.parent.left
-        else:
-            raise IndexError("Invalid state: not a child of his parent.")
-
-
-def make_tree(leaves: List[Node], begin: int, size: int) -> Node:
-    """Given a list of nodes, builds the left-complete Merkle tree on top of it.
-    The nodes in `leaves` are modified by setting their `parent` field appropriately.
-    It returns the root of the newly built tree.
-    """
-
-    if size == 0:
-        return []
-    if size == 1:
-        return leaves[begin]
-
-    lchild_size = largest_power_of_2_less_than(size)
-
-    lchild = make_tree(leaves, begin, lchild_size)
-    rchild = make_tree(leaves, begin + lchild_size, size - lchild_size)
-    root = Node(lchild, rchild, None, None)
-    root.recompute_value()
-    lchild.parent = rchild.parent = root
-    return root
-
-
 class MerkleTree:
     """
     Maintains a dynamic vector of values and the Merkle tree built on top of it. The elements of the vector are stored
@@ -125,30 +83,76 @@ class MerkleTree:
     - There are always n - 1 internal nodes; all the internal nodes have exactly two children.
     - If a subtree has n > 1 leaves, then the left subchild is a complete subtree with p leaves, where p is the largest
       power of 2 smaller than n.
+
+    The tree is stored as the list of its levels, from the leaves to the root: each level is obtained by combining the
+    pairs of consecutive values of the previous one, and a single last value is moved up unchanged. This gives exactly
+    the tree above, and the node (if any) covering the leaves from `begin` to `begin + size - 1` is at position
+    `begin >> ceil_lg(size)` of level `ceil_lg(size)`.
     """
 
     def __init__(self, elements: Iterable[bytes] = []):
-        self.leaves = [Node(None, None, None, el) for el in elements]
-        n_elements = len(self.leaves)
-        if n_elements > 0:
-            self.root_node = make_tree(self.leaves, 0, n_elements)
-            self.depth = ceil_lg(n_elements)
-        else:
-            self.root_node = None
-            self.depth = None
+        leaves = list(elements)
+        self.levels: List[List[bytes]] = [leaves]
+        while len(self.levels[-1]) > 1:
+            level = self.levels[-1]
+            next_level = [sha256(b'\x01' + level[i] + level[i + 1]) for i in range(0, len(level) - 1, 2)]
+            if len(level) % 2 == 1:
+                next_level.append(level[-1])
+            self.levels.append(next_level)
+
+        self._index_leaves()
+
+    @classmethod
+    def from_levels(cls, levels: List[List[bytes]]) -> "MerkleTree":
+        """Returns the tree with the given `levels`, as in the `levels` attribute of a tree, without hashing; the
+        levels are not validated."""
+        mt = cls.__new__(cls)
+        mt.levels = levels
+        mt._index_leaves()
+        return mt
+
+    def _index_leaves(self) -> None:
+        # the index of the first leaf with each hash, for leaf_index
+        self.first_index: Dict[bytes, int] = {}
+        for idx, leaf in enumerate(self.levels[0]):
+            self.first_index.setdefault(leaf, idx)
 
     def __len__(self) -> int:
         """Return the total number of leaves in the tree."""
-        return len(self.leaves)
+        return len(self.levels[0])
 
     @property
     def root(self) -> bytes:
         """Return the Merkle root, or None if the tree is empty."""
-        return NIL if self.root_node is None else self.root_node.value
+        return NIL if len(self) == 0 else self.levels[-1][0]
 
     def copy(self):
         """Return an identical copy of this Merkle tree."""
-        return MerkleTree([leaf.value for leaf in self.leaves])
+        return MerkleTree(self.levels[0])
+
+    def _update_path(self, index: int) -> None:
+        # recomputes the values of the ancestors of the leaf at `index`, adding the missing levels
+        for height in range(len(self.levels)):
+            level = self.levels[height]
+            if len(level) == 1:
+                del self.levels[height + 1:]
+                return
+
+            parent_index = index >> 1
+            left = level[2 * parent_index]
+            if 2 * parent_index + 1 < len(level):
+                value = combine_hashes(left, level[2 * parent_index + 1])
+            else:
+                value = left
+
+            if height + 1 == len(self.levels):
+                self.levels.append([])
+            parent_level = self.levels[height + 1]
+            if parent_index == len(parent_level):
+                parent_level.append(value)
+            else:
+                parent_level[parent_index] = value
+            index = parent_index
 
     def add(self, x: bytes) -> None:
         """Add an element as new leaf, and recompute the tree accordingly. Cost O(log n)."""
@@ -156,41 +160,9 @@ class MerkleTree:
         if len(x) != 32:
             raise ValueError("Inserted elements must be exactly 32 bytes long")
 
-        new_leaf = Node(None, None, None, x)
-        self.leaves.append(new_leaf)
-        if len(self.leaves) == 1:
-            self.root_node = new_leaf
-            self.depth = 0
-            return
-
-        # add a new leaf
-        if self.depth == 0:
-            ltree_size = 0
-        else:
-            # number of leaves of the left subtree of cur_root
-            ltree_size = 1 << (self.depth - 1)
-
-        cur_root = self.root_node
-        cur_root_size = len(self.leaves) - 1
-
-        while not is_power_of_2(cur_root_size):
-            cur_root = cur_root.right
-            cur_root_size -= ltree_size
-            ltree_size /= 2
-
-        # node value will be computed later
-        new_node = Node(cur_root, new_leaf, cur_root.parent, None)
-        if cur_root.parent is None:
-            # replacing the root
-            self.depth += 1
-            self.root_node = new_node
-        else:
-            assert cur_root.parent.right == cur_root
-            cur_root.parent.right = new_node
-        cur_root.parent = new_node
-        new_leaf.parent = new_node
-
-        self.fix_up(new_node)
+        self.first_index.setdefault(x, len(self))
+        self.levels[0].append(x)
+        self._update_path(len(self) - 1)
 
     def set(self, index: int, x: bytes) -> None:
         """
@@ -199,52 +171,130 @@ class MerkleTree:
 
         Cost: Worst case O(log n).
         """
-        assert 0 <= index <= len(self.leaves)
+        assert 0 <= index <= len(self)
 
-        if not (0 <= index <= len(self.leaves)):
+        if not (0 <= index <= len(self)):
             raise ValueError(
                 "The index must be at least 0, and at most the current number of leaves.")
 
         if len(x) != 32:
             raise ValueError("Inserted elements must be exactly 32 bytes long.")
 
-        if index == len(self.leaves):
+        if index == len(self):
             self.add(x)
         else:
-            self.leaves[index].value = x
-            self.fix_up(self.leaves[index].parent)
-
-    def fix_up(self, node: Node):
-        while node is not None:
-            node.recompute_value()
-            node = node.parent
+            leaves = self.levels[0]
+            old_value = leaves[index]
+            leaves[index] = x
+            if self.first_index[old_value] == index:
+                # the next leaf with the old hash, if any, is now the first one
+                del self.first_index[old_value]
+                for idx in range(index + 1, len(leaves)):
+                    if leaves[idx] == old_value:
+                        self.first_index[old_value] = idx
+                        break
+            if self.first_index.get(x, index) >= index:
+                self.first_index[x] = index
+            self._update_path(index)
 
     def get(self, i: int) -> bytes:
         """Return the value of the leaf with index `i`, where 0 <= i < len(self)."""
-        return self.leaves[i].value
+        return self.levels[0][i]
 
     def leaf_index(self, x: bytes) -> int:
-        """Return the index of the leaf with hash `x`. Raises `ValueError` if not found."""
-        idx = 0
-        while idx < len(self):
-            if self.leaves[idx].value == x:
-                return idx
-            idx += 1
-        raise ValueError("Leaf not found")
+        """Return the index of the first leaf with hash `x`. Raises `ValueError` if not found. Cost O(1)."""
+        try:
+            return self.first_index[x]
+        except KeyError:
+            raise ValueError("Leaf not found") from None
 
     def prove_leaf(self, index: int) -> List[bytes]:
         """Produce the Merkle proof of membership for the leaf with the given index where 0 <= index < len(self)."""
-        node = self.leaves[index]
+        if not (0 <= index < len(self)):
+            raise IndexError("Invalid leaf index.")
+
         proof = []
-        while node.parent is not None:
-            sibling = node.sibling()
-            assert sibling is not None
+        for level in self.levels[:-1]:
+            sibling_index = index ^ 1
+            # a last value without sibling is moved up unchanged, and is not part of the proof
+            if sibling_index < len(level):
+                proof.append(level[sibling_index])
+            index >>= 1
+        return proof
 
-            proof.append(sibling.value)
+    def prove_leaves(self, indices: List[int]) -> List[bytes]:
+        """Produce the Merkle multiproof for the leaves with the given indices, which must be strictly increasing.
 
-            node = node.parent
+        The returned list contains the hashes of the requested leaves and the roots of the maximal subtrees that do not
+        contain any of them, in the order of a depth-first, left-to-right visit of the tree. Therefore, the hashes that
+        are shared between the proofs of multiple leaves only appear once."""
 
-        return proof
+        if len(indices) == 0 or any(i >= len(self) for i in indices):
+            raise ValueError("Invalid leaf index.")
+        if any(indices[i] >= indices[i + 1] for i in range(len(indices) - 1)):
+            raise ValueError("The leaf indices must be strictly increasing.")
+
+        result = []
+
+        def visit(begin: int, size: int, pos: int) -> int:
+            # returns the position in indices of the first leaf after this subtree
+            has_leaf = pos < len(indices) and indices[pos] < begin + size
+            if size == 1 or not has_leaf:
+                height = ceil_lg(size)
+                result.append(self.levels[height][begin >> height])
+                return pos + 1 if has_leaf else pos
+
+            left_size = largest_power_of_2_less_than(size)
+            pos = visit(begin, left_size, pos)
+            return visit(begin + left_size, size - left_size, pos)
+
+        visit(0, len(self), 0)
+        return result
+
+
+class MerkleRootBuilder:
+    """
+    Computes the root of the same Merkle tree as `MerkleTree`, for leaves that are added one at a time, without storing
+    them; only the roots of the O(log n) maximal complete subtrees are kept. It matches the builder used by the device
+    in order to commit to a list of elements that is too long to keep in memory.
+    """
+
+    def __init__(self, elements: Iterable[bytes] = []):
+        self.n_leaves = 0
+        self.subtree_roots: List[bytes] = []  # subtree_roots[h] is only meaningful if bit h of n_leaves is set
+        for el in elements:
+            self.add(el)
+
+    def __len__(self) -> int:
+        return self.n_leaves
+
+    def add(self, x: bytes) -> None:
+        """Add the hash `x` as a new leaf. Amortized cost O(1)."""
+
+        if len(x) != 32:
+            raise ValueError("Inserted elements must be exactly 32 bytes long")
+
+        node = x
+        height = 0
+        while (self.n_leaves >> height) & 1:
+            node = combine_hashes(self.subtree_roots[height], node)
+            height += 1
+
+        if height == len(self.subtree_roots):
+            self.subtree_roots.append(node)
+        else:
+            self.subtree_roots[height] = node
+        self.n_leaves += 1
+
+    @property
+    def root(self) -> bytes:
+        """Return the Merkle root, or NIL if no leaf was added."""
+
+        result = None
+        for height, subtree_root in enumerate(self.subtree_roots):
+            if (self.n_leaves >> height) & 1:
+                result = subtree_root if result is None else combine_hashes(subtree_root, result)
+        return NIL if result is None else result
 
 
 def get_merkleized_map_commitment(mapping: Mapping[bytes, bytes]) -> bytes:
@@ -257,4 +307,11 @@ def get_merkleized_map_commitment(mapping: Mapping[bytes, bytes]) -> bytes:
     items_sorted = list(sorted(mapping.items()))
     keys_hashes = [element_hash(i[0]) for i in items_sorted]
     values_hashes = [element_hash(i[1]) for i in items_sorted]
-    return write_varint(len(mapping)) + MerkleTree(keys_hashes).root + MerkleTree(values_hashes).root
+    return write_varint(len(mapping)) + MerkleRootBuilder(keys_hashes).root + MerkleRootBuilder(values_hashes).root
+
+
+def get_messages_merkle_root(messages: Iterable[bytes]) -> bytes:
+    """Returns the root of the Merkle tree of a list of messages, each being a single element, that is committed by
+    `sign_message_bip322` and shown on the device when signing more than one message."""
+
+    return MerkleRootBuilder(element_hash(m) for m in messages).root
@@ -0,0 +1,115 @@
+"""Signing the same PSBT on several devices concurrently, for example on the devices of the cosigners of a multisig
+wallet.
+
+The PSBT and the wallet policy are prepared once (see `PreparedPsbt`), and the Merkle trees are shared by all the
+devices; the devices are driven concurrently, so that the total time is the one of the slowest device rather than the
+sum. The signatures are then added to the PSBT.
+"""
+
+import asyncio
+from concurrent.futures import ThreadPoolExecutor
+from typing import List, Mapping, Optional, Sequence, Tuple
+
+from .client import NewClient, PreparedPsbt
+from .client_async import AsyncNewClient
+from .psbt import PSBT
+from .wallet import Wallet
+
+
+def _prepare(psbt: PSBT, wallet: Wallet, signers: Sequence[Tuple[NewClient, Optional[bytes]]]) -> PreparedPsbt:
+    if len(signers) == 0:
+        raise ValueError("At least one signer is required")
+
+    for client, _ in signers:
+        if not isinstance(client, NewClient):
+            raise NotImplementedError("Signing on several devices requires version 2.0.0 or above of the app")
+
+    prepared = PreparedPsbt(psbt, wallet)
+    if len(signers) > 1:
+        # the lazy trees must not be built concurrently by different devices
+        prepared.build_all_trees()
+    return prepared
+
+
+def add_signatures(psbt: PSBT, fingerprint: bytes, signatures: Mapping[int, bytes]) -> None:
+    """Adds to `psbt` the signatures returned by `sign_psbt` on the device with master key fingerprint `fingerprint`.
+
+    The signatures do not identify the key they were made with: it is the key of the input whose origin is
+    `fingerprint`, that must be unique. Schnorr signatures of taproot inputs are added as key path signatures, as the
+    app does not sign for the script paths.
+    """
+    for input_index, signature in signatures.items():
+        psbt_in = psbt.inputs[input_index]
+
+        is_taproot = any(origin.fingerprint == fingerprint for _, origin in psbt_in.tap_bip32_paths.values())
+        if is_taproot and len(signature) in (64, 65):
+            psbt_in.tap_key_sig = signature
+            continue
+
+        pubkeys = [pubkey for pubkey, origin in psbt_in.hd_keypaths.items() if origin.fingerprint == fingerprint]
+        if len(pubkeys) != 1:
+            raise RuntimeError(f"Cannot identify the key of the signature for input {input_index}")
+        psbt_in.partial_sigs[pubkeys[0]] = signature
+
+
+def sign_psbt_on_devices(psbt: PSBT, wallet: Wallet, signers: Sequence[Tuple[NewClient, Optional[bytes]]],
+                         batch_review: bool = False) -> List[Mapping[int, bytes]]:
+    """Signs `psbt` with `wallet` on all the devices of `signers`, concurrently, and adds the signatures to `psbt`.
+
+    Each device is driven by its own thread, as the transports are blocking. If any device fails, the first error
+    (in the order of `signers`) is raised after all the devices are done, and `psbt` is not modified; the
+    `last_sign_psbt_checkpoint` of each client can be used to sign again without the approval of the user.
+
+    Parameters
+    ----------
+    psbt : PSBT
+        The PSBT to sign, as for `sign_psbt`.
+
+    wallet : Wallet
+        The registered wallet policy, or a standard wallet policy.
+
+    signers : Sequence[Tuple[NewClient, Optional[bytes]]]
+        The client of each device, with the hmac of the wallet on that device (`None` for a standard wallet policy).
+
+    batch_review: bool
+        As for `sign_psbt`.
+
+    Returns
+    -------
+    List[Mapping[int, bytes]]
+        The signatures returned by each device, as returned by `sign_psbt`, in the order of `signers`.
+    """
+    prepared = _prepare(psbt, wallet, signers)
+
+    def sign(client: NewClient, wallet_hmac: Optional[bytes]) -> Tuple[bytes, Mapping[int, bytes]]:
+        fingerprint = client.get_master_fingerprint()
+        return fingerprint, client.sign_prepared_psbt(prepared, wallet_hmac, batch_review=batch_review)
+
+    with ThreadPoolExecutor(max_workers=len(signers)) as executor:
+        futures = [executor.submit(sign, client, wallet_hmac) for client, wallet_hmac in signers]
+    results = [future.result() for future in futures]
+
+    for fingerprint, signatures in results:
+        add_signatures(psbt, fingerprint, signatures)
+    return [signatures for _, signatures in results]
+
+
+async def async_sign_psbt_on_devices(psbt: PSBT, wallet: Wallet,
+                                     signers: Sequence[Tuple[AsyncNewClient, Optional[bytes]]],
+                                     batch_review: bool = False) -> List[Mapping[int, bytes]]:
+    """The same as `sign_psbt_on_devices`, for asyncio clients, that are driven concurrently in the event loop."""
+    prepared = _prepare(psbt, wallet, signers)
+
+    async def sign(client: AsyncNewClient, wallet_hmac: Optional[bytes]) -> Tuple[bytes, Mapping[int, bytes]]:
+        fingerprint = await client.get_master_fingerprint()
+        return fingerprint, await client.sign_prepared_psbt(prepared, wallet_hmac, batch_review=batch_review)
+
+    results = await asyncio.gather(*[sign(client, wallet_hmac) for client, wallet_hmac in signers],
+                                   return_exceptions=True)
+    for result in results:
+        if isinstance(result, BaseException):
+            raise result
+
+    for fingerprint, signatures in results:
+        add_signatures(psbt, fingerprint, signatures)
+    return [signatures for _, signatures in results]
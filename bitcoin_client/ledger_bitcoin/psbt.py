@@ -11,6 +11,7 @@ import struct
 
 from io import BytesIO, BufferedReader
 from typing import (
+    AbstractSet,
     Dict,
     List,
     Mapping,
@@ -19,6 +20,7 @@ from typing import (
     Sequence,
     Set,
     Tuple,
+    Union,
 )
 
 from .key import KeyOriginInfo
@@ -64,22 +66,28 @@ def DeserializeHDKeypath(
 
     hd_keypaths[pubkey] = KeyOriginInfo.deserialize(deser_string(f))
 
-def SerializeHDKeypath(hd_keypaths: Mapping[bytes, KeyOriginInfo], type: bytes) -> bytes:
+def GetHDKeypathMap(hd_keypaths: Mapping[bytes, KeyOriginInfo], type: bytes) -> Dict[bytes, bytes]:
     """
     :meta private:
 
-    Serialize a public key to :class:`~hwilib.key.KeyOriginInfo` mapping as a PSBT key-value pair.
+    Get the PSBT key-value pairs of a public key to :class:`~hwilib.key.KeyOriginInfo` mapping.
 
     :param hd_keypaths: The mapping of public key to keypath
     :param type: The PSBT type bytes to use
-    :returns: The serialized keypaths
+    :returns: The mapping of the keys to the serialized keypaths
     """
-    r = b""
-    for pubkey, path in sorted(hd_keypaths.items()):
-        r += ser_string(type + pubkey)
-        packed = path.serialize()
-        r += ser_string(packed)
-    return r
+    return {type + pubkey: path.serialize() for pubkey, path in sorted(hd_keypaths.items())}
+
+def SerializeMap(m: Mapping[bytes, bytes]) -> bytes:
+    """
+    :meta private:
+
+    Serialize the key-value pairs of a PSBT map, followed by the separator.
+
+    :param m: The mapping of the keys to the values
+    :returns: The serialized map
+    """
+    return b"".join([ser_string(k) + ser_string(v) for k, v in m.items()]) + b"\x00"
 
 class PartiallySignedInput:
     """
@@ -369,109 +377,97 @@ class PartiallySignedInput:
             if self.prev_out is None:
                 raise PSBTSerializationError("Previous output's index is required in PSBTv2")
 
-    def serialize(self) -> bytes:
+    def get_map(self) -> Dict[bytes, bytes]:
         """
-        Serialize this PSBT input
+        Get the key-value pairs of this PSBT input, in the order of the serialization
 
-        :returns: The serialized PSBT input
+        :returns: The mapping of the keys to the values of the PSBT input
         """
-        r = b""
+        m: Dict[bytes, bytes] = {}
 
         if self.non_witness_utxo:
-            r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_NON_WITNESS_UTXO))
-            tx = self.non_witness_utxo.serialize_with_witness()
-            r += ser_string(tx)
+            m[ser_compact_size(PartiallySignedInput.PSBT_IN_NON_WITNESS_UTXO)] = \
+                self.non_witness_utxo.serialize_with_witness()
 
         if self.witness_utxo:
-            r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_WITNESS_UTXO))
-            tx = self.witness_utxo.serialize()
-            r += ser_string(tx)
+            m[ser_compact_size(PartiallySignedInput.PSBT_IN_WITNESS_UTXO)] = self.witness_utxo.serialize()
 
         if len(self.final_script_sig) == 0 and self.final_script_witness.is_null():
             for pubkey, sig in sorted(self.partial_sigs.items()):
-                r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_PARTIAL_SIG) + pubkey)
-                r += ser_string(sig)
+                m[ser_compact_size(PartiallySignedInput.PSBT_IN_PARTIAL_SIG) + pubkey] = sig
 
             if self.sighash is not None:
-                r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_SIGHASH_TYPE))
-                r += ser_string(struct.pack("<I", self.sighash))
+                m[ser_compact_size(PartiallySignedInput.PSBT_IN_SIGHASH_TYPE)] = struct.pack("<I", self.sighash)
 
             if len(self.redeem_script) != 0:
-                r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_REDEEM_SCRIPT))
-                r += ser_string(self.redeem_script)
+                m[ser_compact_size(PartiallySignedInput.PSBT_IN_REDEEM_SCRIPT)] = self.redeem_script
 
             if len(self.witness_script) != 0:
-                r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_WITNESS_SCRIPT))
-                r += ser_string(self.witness_script)
+                m[ser_compact_size(PartiallySignedInput.PSBT_IN_WITNESS_SCRIPT)] = self.witness_script
 
-            r += SerializeHDKeypath(self.hd_keypaths, ser_compact_size(PartiallySignedInput.PSBT_IN_BIP32_DERIVATION))
+            m.update(GetHDKeypathMap(self.hd_keypaths, ser_compact_size(PartiallySignedInput.PSBT_IN_BIP32_DERIVATION)))
 
             if len(self.tap_key_sig) != 0:
-                r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_TAP_KEY_SIG))
-                r += ser_string(self.tap_key_sig)
+                m[ser_compact_size(PartiallySignedInput.PSBT_IN_TAP_KEY_SIG)] = self.tap_key_sig
 
             for (xonly, leaf_hash), sig in self.tap_script_sigs.items():
-                r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_TAP_SCRIPT_SIG) + xonly + leaf_hash)
-                r += ser_string(sig)
+                m[ser_compact_size(PartiallySignedInput.PSBT_IN_TAP_SCRIPT_SIG) + xonly + leaf_hash] = sig
 
             for (script, leaf_ver), control_blocks in self.tap_scripts.items():
                 for control_block in control_blocks:
-                    r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_TAP_LEAF_SCRIPT) + control_block)
-                    r += ser_string(script + struct.pack("B", leaf_ver))
+                    m[ser_compact_size(PartiallySignedInput.PSBT_IN_TAP_LEAF_SCRIPT) + control_block] = \
+                        script + struct.pack("B", leaf_ver)
 
             for xonly, (leaf_hashes, origin) in self.tap_bip32_paths.items():
-                r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_TAP_BIP32_DERIVATION) + xonly)
                 value = ser_compact_size(len(leaf_hashes))
                 for lh in leaf_hashes:
                     value += lh
                 value += origin.serialize()
-                r += ser_string(value)
+                m[ser_compact_size(PartiallySignedInput.PSBT_IN_TAP_BIP32_DERIVATION) + xonly] = value
 
             if len(self.tap_internal_key) != 0:
-                r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_TAP_INTERNAL_KEY))
-                r += ser_string(self.tap_internal_key)
+                m[ser_compact_size(PartiallySignedInput.PSBT_IN_TAP_INTERNAL_KEY)] = self.tap_internal_key
 
             if len(self.tap_merkle_root) != 0:
-                r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_TAP_MERKLE_ROOT))
-                r += ser_string(self.tap_merkle_root)
+                m[ser_compact_size(PartiallySignedInput.PSBT_IN_TAP_MERKLE_ROOT)] = self.tap_merkle_root
 
         if len(self.final_script_sig) != 0:
-            r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_FINAL_SCRIPTSIG))
-            r += ser_string(self.final_script_sig)
+            m[ser_compact_size(PartiallySignedInput.PSBT_IN_FINAL_SCRIPTSIG)] = self.final_script_sig
 
         if not self.final_script_witness.is_null():
-            r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_FINAL_SCRIPTWITNESS))
-            witstack = self.final_script_witness.serialize()
-            r += ser_string(witstack)
+            m[ser_compact_size(PartiallySignedInput.PSBT_IN_FINAL_SCRIPTWITNESS)] = \
+                self.final_script_witness.serialize()
 
         if self.version >= 2:
             if len(self.prev_txid) != 0:
-                r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_PREVIOUS_TXID))
-                r += ser_string(self.prev_txid)
+                m[ser_compact_size(PartiallySignedInput.PSBT_IN_PREVIOUS_TXID)] = self.prev_txid
 
             if self.prev_out is not None:
-                r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_OUTPUT_INDEX))
-                r += ser_string(struct.pack("<I", self.prev_out))
+                m[ser_compact_size(PartiallySignedInput.PSBT_IN_OUTPUT_INDEX)] = struct.pack("<I", self.prev_out)
 
             if self.sequence is not None:
-                r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_SEQUENCE))
-                r += ser_string(struct.pack("<I", self.sequence))
+                m[ser_compact_size(PartiallySignedInput.PSBT_IN_SEQUENCE)] = struct.pack("<I", self.sequence)
 
             if self.time_locktime is not None:
-                r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_REQUIRED_TIME_LOCKTIME))
-                r += ser_string(struct.pack("<I", self.time_locktime))
+                m[ser_compact_size(PartiallySignedInput.PSBT_IN_REQUIRED_TIME_LOCKTIME)] = \
+                    struct.pack("<I", self.time_locktime)
 
             if self.height_locktime is not None:
-                r += ser_string(ser_compact_size(PartiallySignedInput.PSBT_IN_REQUIRED_HEIGHT_LOCKTIME))
-                r += ser_string(struct.pack("<I", self.height_locktime))
+                m[ser_compact_size(PartiallySignedInput.PSBT_IN_REQUIRED_HEIGHT_LOCKTIME)] = \
+                    struct.pack("<I", self.height_locktime)
 
         for key, value in sorted(self.unknown.items()):
-            r += ser_string(key)
-            r += ser_string(value)
+            m[key] = value
 
-        r += b"\x00"
+        return m
+
+    def serialize(self) -> bytes:
+        """
+        Serialize this PSBT input
 
-        return r
+        :returns: The serialized PSBT input
+        """
+        return SerializeMap(self.get_map())
 
 class PartiallySignedOutput:
     """
@@ -607,55 +603,53 @@ class PartiallySignedOutput:
             if len(self.script) == 0:
                 raise PSBTSerializationError("PSBT_OUTPUT_SCRIPT is required in PSBTv2")
 
-    def serialize(self) -> bytes:
+    def get_map(self) -> Dict[bytes, bytes]:
         """
-        Serialize this PSBT output
+        Get the key-value pairs of this PSBT output, in the order of the serialization
 
-        :returns: The serialized PSBT output
+        :returns: The mapping of the keys to the values of the PSBT output
         """
-        r = b""
+        m: Dict[bytes, bytes] = {}
         if len(self.redeem_script) != 0:
-            r += ser_string(ser_compact_size(PartiallySignedOutput.PSBT_OUT_REDEEM_SCRIPT))
-            r += ser_string(self.redeem_script)
+            m[ser_compact_size(PartiallySignedOutput.PSBT_OUT_REDEEM_SCRIPT)] = self.redeem_script
 
         if len(self.witness_script) != 0:
-            r += ser_string(ser_compact_size(PartiallySignedOutput.PSBT_OUT_WITNESS_SCRIPT))
-            r += ser_string(self.witness_script)
+            m[ser_compact_size(PartiallySignedOutput.PSBT_OUT_WITNESS_SCRIPT)] = self.witness_script
 
-        r += SerializeHDKeypath(self.hd_keypaths, ser_compact_size(PartiallySignedOutput.PSBT_OUT_BIP32_DERIVATION))
+        m.update(GetHDKeypathMap(self.hd_keypaths, ser_compact_size(PartiallySignedOutput.PSBT_OUT_BIP32_DERIVATION)))
 
         if self.version >= 2:
             if self.amount is not None:
-                r += ser_string(ser_compact_size(PartiallySignedOutput.PSBT_OUT_AMOUNT))
-                r += ser_string(struct.pack("<q", self.amount))
+                m[ser_compact_size(PartiallySignedOutput.PSBT_OUT_AMOUNT)] = struct.pack("<q", self.amount)
 
             if len(self.script) != 0:
-                r += ser_string(ser_compact_size(PartiallySignedOutput.PSBT_OUT_SCRIPT))
-                r += ser_string(self.script)
+                m[ser_compact_size(PartiallySignedOutput.PSBT_OUT_SCRIPT)] = self.script
 
         if len(self.tap_internal_key) != 0:
-            r += ser_string(ser_compact_size(PartiallySignedOutput.PSBT_OUT_TAP_INTERNAL_KEY))
-            r += ser_string(self.tap_internal_key)
+            m[ser_compact_size(PartiallySignedOutput.PSBT_OUT_TAP_INTERNAL_KEY)] = self.tap_internal_key
 
         if len(self.tap_tree) != 0:
-            r += ser_string(ser_compact_size(PartiallySignedOutput.PSBT_OUT_TAP_TREE))
-            r += ser_string(self.tap_tree)
+            m[ser_compact_size(PartiallySignedOutput.PSBT_OUT_TAP_TREE)] = self.tap_tree
 
         for xonly, (leaf_hashes, origin) in self.tap_bip32_paths.items():
-            r += ser_string(ser_compact_size(PartiallySignedOutput.PSBT_OUT_TAP_BIP32_DERIVATION) + xonly)
             value = ser_compact_size(len(leaf_hashes))
             for lh in leaf_hashes:
                 value += lh
             value += origin.serialize()
-            r += ser_string(value)
+            m[ser_compact_size(PartiallySignedOutput.PSBT_OUT_TAP_BIP32_DERIVATION) + xonly] = value
 
         for key, value in sorted(self.unknown.items()):
-            r += ser_string(key)
-            r += ser_string(value)
+            m[key] = value
 
-        r += b"\x00"
+        return m
 
-        return r
+    def serialize(self) -> bytes:
+        """
+        Serialize this PSBT output
+
+        :returns: The serialized PSBT output
+        """
+        return SerializeMap(self.get_map())
 
     def get_txout(self) -> CTxOut:
         """
@@ -883,70 +877,64 @@ class PSBT(object):
 
         self.cache_unsigned_tx_pieces()
 
-    def serialize(self) -> str:
+    def get_map(self) -> Dict[bytes, bytes]:
         """
-        Serialize the PSBT as a base 64 encoded string.
+        Get the key-value pairs of the global map of the PSBT, in the order of the serialization.
 
-        :returns: The base 64 encoded string.
+        :returns: The mapping of the keys to the values of the global map
         """
-        r = b""
-
-        # magic bytes
-        r += b"psbt\xff"
+        m: Dict[bytes, bytes] = {}
 
         if self.version == 0:
-            # unsigned tx flag
-            r += ser_string(ser_compact_size(PSBT.PSBT_GLOBAL_UNSIGNED_TX))
-
-            # write serialized tx
-            tx = self.tx.serialize_with_witness()
-            r += ser_compact_size(len(tx))
-            r += tx
+            # unsigned tx
+            m[ser_compact_size(PSBT.PSBT_GLOBAL_UNSIGNED_TX)] = self.tx.serialize_with_witness()
 
         # write xpubs
-        r += SerializeHDKeypath(self.xpub, ser_compact_size(PSBT.PSBT_GLOBAL_XPUB))
+        m.update(GetHDKeypathMap(self.xpub, ser_compact_size(PSBT.PSBT_GLOBAL_XPUB)))
 
         if self.version >= 2:
             assert self.tx_version is not None
-            r += ser_string(ser_compact_size(PSBT.PSBT_GLOBAL_TX_VERSION))
-            r += ser_string(struct.pack("<I", self.tx_version))
+            m[ser_compact_size(PSBT.PSBT_GLOBAL_TX_VERSION)] = struct.pack("<I", self.tx_version)
 
             if self.fallback_locktime is not None:
-                r += ser_string(ser_compact_size(PSBT.PSBT_GLOBAL_FALLBACK_LOCKTIME))
-                r += ser_string(struct.pack("<I", self.fallback_locktime))
+                m[ser_compact_size(PSBT.PSBT_GLOBAL_FALLBACK_LOCKTIME)] = struct.pack("<I", self.fallback_locktime)
 
-            r += ser_string(ser_compact_size(PSBT.PSBT_GLOBAL_INPUT_COUNT))
-            r += ser_string(ser_compact_size(len(self.inputs)))
+            m[ser_compact_size(PSBT.PSBT_GLOBAL_INPUT_COUNT)] = ser_compact_size(len(self.inputs))
 
-            r += ser_string(ser_compact_size(PSBT.PSBT_GLOBAL_OUTPUT_COUNT))
-            r += ser_string(ser_compact_size(len(self.outputs)))
+            m[ser_compact_size(PSBT.PSBT_GLOBAL_OUTPUT_COUNT)] = ser_compact_size(len(self.outputs))
 
             if self.tx_modifiable is not None:
-                r += ser_string(ser_compact_size(PSBT.PSBT_GLOBAL_TX_MODIFIABLE))
-                r += ser_string(struct.pack("<B", self.tx_modifiable))
+                m[ser_compact_size(PSBT.PSBT_GLOBAL_TX_MODIFIABLE)] = struct.pack("<B", self.tx_modifiable)
 
         if self.version > 0 or self.explicit_version:
-            r += ser_string(ser_compact_size(PSBT.PSBT_GLOBAL_VERSION))
-            r += ser_string(struct.pack("<I", self.version))
+            m[ser_compact_size(PSBT.PSBT_GLOBAL_VERSION)] = struct.pack("<I", self.version)
 
         # unknowns
         for key, value in sorted(self.unknown.items()):
-            r += ser_string(key)
-            r += ser_string(value)
+            m[key] = value
 
-        # separator
-        r += b"\x00"
+        return m
 
-        # inputs
-        for input in self.inputs:
-            r += input.serialize()
+    def serialize_bytes(self) -> bytes:
+        """
+        Serialize the PSBT as bytes, without the base 64 encoding.
 
-        # outputs
-        for output in self.outputs:
-            r += output.serialize()
+        :returns: The serialized PSBT.
+        """
+        return b"".join([
+            b"psbt\xff",  # magic bytes
+            SerializeMap(self.get_map()),
+            *[input.serialize() for input in self.inputs],
+            *[output.serialize() for output in self.outputs],
+        ])
 
-        # return hex string
-        return base64.b64encode(r).decode()
+    def serialize(self) -> str:
+        """
+        Serialize the PSBT as a base 64 encoded string.
+
+        :returns: The base 64 encoded string.
+        """
+        return base64.b64encode(self.serialize_bytes()).decode()
 
     def cache_unsigned_tx_pieces(self) -> None:
         """
@@ -1079,3 +1067,268 @@ class PSBT(object):
         self._convert_version(0)
         self.tx = self.get_unsigned_tx()
         self.explicit_version = False
+
+    @staticmethod
+    def scan_maps(
+        data: memoryview
+    ) -> Tuple[Dict[bytes, memoryview], List[Dict[bytes, memoryview]], List[Dict[bytes, memoryview]]]:
+        """
+        Get the key-value pairs of the global map, of each input map and of each output map of a serialized PSBT,
+        without parsing the values: each value is a slice of ``data``, therefore nothing is copied except the keys.
+
+        :param data: The serialized PSBT (not base 64 encoded), for example a memory-mapped file
+        :returns: The global map, the list of the input maps and the list of the output maps
+        """
+        pos = 5
+
+        def read_compact_size() -> int:
+            nonlocal pos
+            f = BytesIO(data[pos:pos + 9])
+            try:
+                n = deser_compact_size(f)
+            except struct.error:
+                raise PSBTSerializationError("Unexpected end of the PSBT")
+            pos += f.tell()
+            return n
+
+        def read_map() -> Dict[bytes, memoryview]:
+            nonlocal pos
+            m: Dict[bytes, memoryview] = {}
+            while True:
+                key_len = read_compact_size()
+                if key_len == 0:
+                    return m
+                key = bytes(data[pos:pos + key_len])
+                pos += key_len
+                value_len = read_compact_size()
+                if pos + value_len > len(data):
+                    raise PSBTSerializationError("Unexpected end of the PSBT")
+                if key in m:
+                    raise PSBTSerializationError("Duplicate key in the PSBT")
+                m[key] = data[pos:pos + value_len]
+                pos += value_len
+
+        if bytes(data[:5]) != b"psbt\xff":
+            raise PSBTSerializationError("invalid magic")
+
+        global_map = read_map()
+
+        unsigned_tx_key = ser_compact_size(PSBT.PSBT_GLOBAL_UNSIGNED_TX)
+        if unsigned_tx_key in global_map:
+            tx = CTransaction()
+            tx.deserialize(BytesIO(global_map[unsigned_tx_key]))
+            n_inputs, n_outputs = len(tx.vin), len(tx.vout)
+        else:
+            try:
+                n_inputs = deser_compact_size(BytesIO(global_map[ser_compact_size(PSBT.PSBT_GLOBAL_INPUT_COUNT)]))
+                n_outputs = deser_compact_size(BytesIO(global_map[ser_compact_size(PSBT.PSBT_GLOBAL_OUTPUT_COUNT)]))
+            except KeyError:
+                raise PSBTSerializationError("Missing the unsigned transaction, or the number of inputs and outputs")
+
+        input_maps = [read_map() for _ in range(n_inputs)]
+        output_maps = [read_map() for _ in range(n_outputs)]
+
+        if pos != len(data):
+            raise PSBTSerializationError("Unexpected data after the PSBT")
+
+        return global_map, input_maps, output_maps
+
+
+OWNERSHIP_TOKEN_LEN = 16
+
+# key of the proprietary field with the ownership token of an input or an output: the proprietary type 0xFC, the
+# identifier "LEDGER" prefixed by its length, and the subtype 0x00, with no keydata
+PSBT_OWNERSHIP_TOKEN_KEY = b"\xfc\x06LEDGER\x00"
+
+
+def set_ownership_token(in_out: Union[PartiallySignedInput, PartiallySignedOutput], token: bytes) -> None:
+    """
+    Attach to an input or an output of a PSBT the ownership token of its scriptPubKey, as returned by
+    `get_wallet_ownership_tokens`.
+
+    :param in_out: The input or output
+    :param token: The 16-byte ownership token
+    """
+    if len(token) != OWNERSHIP_TOKEN_LEN:
+        raise ValueError("Invalid length of the ownership token")
+    in_out.unknown[PSBT_OWNERSHIP_TOKEN_KEY] = token
+
+
+PREVOUT_TOKEN_LEN = 16
+
+# key of the proprietary field that requests the trusted prevout tokens in the global map of a PSBT, and that contains
+# the token in the map of an input: the proprietary type 0xFC, the identifier "LEDGER" prefixed by its length, and the
+# subtype 0x01, with no keydata
+PSBT_PREVOUT_TOKEN_KEY = b"\xfc\x06LEDGER\x01"
+
+
+def request_prevout_tokens(psbt: PSBT) -> None:
+    """
+    Request the trusted prevout tokens of the inputs whose non-witness UTXO is verified while signing the PSBT; they
+    are then returned in `last_sign_psbt_prevout_tokens` of the client.
+
+    :param psbt: The PSBT
+    """
+    psbt.unknown[PSBT_PREVOUT_TOKEN_KEY] = b""
+
+
+def set_prevout_token(psbt_in: PartiallySignedInput, amount: int, script: bytes, token: bytes) -> None:
+    """
+    Attach to an input of a PSBT the trusted prevout token returned when signing a PSBT with the same input, together
+    with the amount and the scriptPubKey of its prevout. The non-witness UTXO is removed, as the device verifies the
+    token instead of it.
+
+    :param psbt_in: The input
+    :param amount: The amount of the prevout
+    :param script: The scriptPubKey of the prevout
+    :param token: The 16-byte trusted prevout token
+    """
+    if len(token) != PREVOUT_TOKEN_LEN:
+        raise ValueError("Invalid length of the trusted prevout token")
+    psbt_in.unknown[PSBT_PREVOUT_TOKEN_KEY] = amount.to_bytes(8, byteorder="little") + token + script
+    psbt_in.non_witness_utxo = None
+
+
+# prefix of the key of the proprietary field that lists another wallet policy whose inputs are signed, in the global map
+# of a PSBT: the proprietary type 0xFC, the identifier "LEDGER" prefixed by its length, and the subtype 0x02, followed
+# by the wallet id as keydata
+PSBT_WALLET_POLICY_KEY = b"\xfc\x06LEDGER\x02"
+
+
+def add_wallet_policy(psbt: PSBT, wallet_id: bytes, wallet_hmac: Optional[bytes]) -> None:
+    """
+    List another wallet policy whose internal inputs are signed together with the ones of the wallet policy given to
+    `sign_psbt`, with a single review of the transaction. The wallet policy must also be given in the `other_wallets`
+    of the `PreparedPsbt` of the PSBT.
+
+    :param psbt: The PSBT
+    :param wallet_id: The id of the wallet policy
+    :param wallet_hmac: For a registered wallet policy, the hmac obtained at its registration; `None` for a standard
+        wallet policy
+    """
+    if len(wallet_id) != 32 or (wallet_hmac is not None and len(wallet_hmac) != 32):
+        raise ValueError("Invalid length of the wallet id or of the hmac")
+    psbt.unknown[PSBT_WALLET_POLICY_KEY + wallet_id] = wallet_hmac if wallet_hmac is not None else bytes(32)
+
+
+# key of the proprietary field with the order of the keys of the sorted multisig of an input or an output: the
+# proprietary type 0xFC, the identifier "LEDGER" prefixed by its length, and the subtype 0x03, with no keydata
+PSBT_SORTED_KEYS_ORDER_KEY = b"\xfc\x06LEDGER\x03"
+
+
+def set_sorted_keys_order(in_out: Union[PartiallySignedInput, PartiallySignedOutput], order: List[int]) -> None:
+    """
+    Attach to an input or an output of a PSBT the order of the keys of the sortedmulti or sortedmulti_a of its wallet
+    policy at its address: the i-th key in the script is the order[i]-th key of the multisig. For multisigs with more
+    than 5 keys, the device then derives each key once and checks that they are sorted, instead of deriving them twice
+    in order to sort them. A wrong order is detected, and only makes the device derive the keys again.
+
+    :param in_out: The input or output
+    :param order: A permutation of the positions of the keys in the multisig
+    """
+    if sorted(order) != list(range(len(order))):
+        raise ValueError("The order is not a permutation of the keys of the multisig")
+    in_out.unknown[PSBT_SORTED_KEYS_ORDER_KEY] = bytes(order)
+
+# the types of the keys of the global map, of the input maps and of the output maps that the device reads while
+# signing a PSBT; proprietary fields are only read if their identifier is "LEDGER"
+SIGN_PSBT_GLOBAL_KEY_TYPES = frozenset([
+    PSBT.PSBT_GLOBAL_UNSIGNED_TX,
+    PSBT.PSBT_GLOBAL_TX_VERSION,
+    PSBT.PSBT_GLOBAL_FALLBACK_LOCKTIME,
+    PSBT.PSBT_GLOBAL_INPUT_COUNT,
+    PSBT.PSBT_GLOBAL_OUTPUT_COUNT,
+    PSBT.PSBT_GLOBAL_VERSION,
+])
+SIGN_PSBT_INPUT_KEY_TYPES = frozenset([
+    PartiallySignedInput.PSBT_IN_NON_WITNESS_UTXO,
+    PartiallySignedInput.PSBT_IN_WITNESS_UTXO,
+    PartiallySignedInput.PSBT_IN_SIGHASH_TYPE,
+    PartiallySignedInput.PSBT_IN_REDEEM_SCRIPT,
+    PartiallySignedInput.PSBT_IN_WITNESS_SCRIPT,
+    PartiallySignedInput.PSBT_IN_BIP32_DERIVATION,
+    PartiallySignedInput.PSBT_IN_PREVIOUS_TXID,
+    PartiallySignedInput.PSBT_IN_OUTPUT_INDEX,
+    PartiallySignedInput.PSBT_IN_SEQUENCE,
+    PartiallySignedInput.PSBT_IN_TAP_BIP32_DERIVATION,
+])
+SIGN_PSBT_OUTPUT_KEY_TYPES = frozenset([
+    PartiallySignedOutput.PSBT_OUT_BIP32_DERIVATION,
+    PartiallySignedOutput.PSBT_OUT_AMOUNT,
+    PartiallySignedOutput.PSBT_OUT_SCRIPT,
+    PartiallySignedOutput.PSBT_OUT_TAP_BIP32_DERIVATION,
+])
+PSBT_LEDGER_PROPRIETARY_PREFIX = b"\xfc\x06LEDGER"
+
+
+def _derivation_fingerprint(value: bytes, is_taproot: bool) -> bytes:
+    pos = 0
+    if is_taproot:
+        # the fingerprint follows the leaf hashes
+        f = BytesIO(value[:9])
+        n_leaf_hashes = deser_compact_size(f)
+        pos = f.tell() + 32 * n_leaf_hashes
+    return bytes(value[pos:pos + 4])
+
+
+def _prune_map(m: Mapping[bytes, bytes], key_types: AbstractSet[int], derivation_types: AbstractSet[int],
+               tap_derivation_type: int, fingerprints: Optional[AbstractSet[bytes]]) -> Dict[bytes, bytes]:
+    pruned: Dict[bytes, bytes] = {}
+    for key, value in m.items():
+        if len(key) == 0 or key[0] >= 0xfd:
+            pruned[key] = value  # not a single-byte key type, kept as-is
+        elif key[0] == 0xfc:
+            if key.startswith(PSBT_LEDGER_PROPRIETARY_PREFIX):
+                pruned[key] = value
+        elif key[0] in key_types:
+            if (fingerprints is not None and key[0] in derivation_types
+                    and _derivation_fingerprint(value, key[0] == tap_derivation_type) not in fingerprints):
+                continue
+            pruned[key] = value
+    return pruned
+
+
+def _is_taproot_input(m: Mapping[bytes, bytes]) -> bool:
+    witness_utxo = m.get(bytes([PartiallySignedInput.PSBT_IN_WITNESS_UTXO]))
+    # <amount : 8> <script_len : 1> OP_1 <32 bytes>
+    return (witness_utxo is not None and len(witness_utxo) == 8 + 1 + 34
+            and bytes(witness_utxo[8:11]) == b"\x22\x51\x20")
+
+
+def prune_for_signing(
+    global_map: Mapping[bytes, bytes],
+    input_maps: Sequence[Mapping[bytes, bytes]],
+    output_maps: Sequence[Mapping[bytes, bytes]],
+    fingerprints: Optional[AbstractSet[bytes]] = None
+) -> Tuple[Dict[bytes, bytes], List[Dict[bytes, bytes]], List[Dict[bytes, bytes]]]:
+    """
+    Get the maps of a PSBT without the fields that the device never reads while signing it, in order to send and
+    hash less: for example the partial signatures, the final scriptSigs and witnesses, the global xpubs, and the
+    non-witness UTXOs of the Taproot inputs. The PSBT itself is not modified.
+
+    :param global_map: The global map, as returned by `PSBT.get_map` or `PSBT.scan_maps`
+    :param input_maps: The input maps
+    :param output_maps: The output maps
+    :param fingerprints: If not None, the fingerprints of all the keys of the wallet policy; the BIP32 derivations
+        with a different fingerprint are removed too
+    :returns: The pruned global map, input maps and output maps
+    """
+    in_derivation_types = {PartiallySignedInput.PSBT_IN_BIP32_DERIVATION,
+                           PartiallySignedInput.PSBT_IN_TAP_BIP32_DERIVATION}
+    out_derivation_types = {PartiallySignedOutput.PSBT_OUT_BIP32_DERIVATION,
+                            PartiallySignedOutput.PSBT_OUT_TAP_BIP32_DERIVATION}
+
+    pruned_inputs = []
+    for m in input_maps:
+        key_types = set(SIGN_PSBT_INPUT_KEY_TYPES)
+        if _is_taproot_input(m):
+            key_types.remove(PartiallySignedInput.PSBT_IN_NON_WITNESS_UTXO)
+        pruned_inputs.append(_prune_map(m, key_types, in_derivation_types,
+                                        PartiallySignedInput.PSBT_IN_TAP_BIP32_DERIVATION, fingerprints))
+
+    return (
+        _prune_map(global_map, SIGN_PSBT_GLOBAL_KEY_TYPES, set(), -1, None),
+        pruned_inputs,
+        [_prune_map(m, SIGN_PSBT_OUTPUT_KEY_TYPES, out_derivation_types,
+                    PartiallySignedOutput.PSBT_OUT_TAP_BIP32_DERIVATION, fingerprints) for m in output_maps]
+    )
@@ -0,0 +1,113 @@
+"""Cache of the results of the requests to the devices that only depend on their seed.
+
+A client created with a `RequestCache` serves the repeated calls to `get_extended_pubkey` and `get_wallet_address`
+(when nothing is shown on the screen) from the cache, and concurrent identical calls share a single exchange with the
+device. The results are keyed by the master fingerprint of the device, the chain of the client and the parameters of
+the request; therefore, the same cache can be shared among the clients of different devices.
+"""
+
+import asyncio
+from collections import OrderedDict
+from concurrent.futures import Future
+import threading
+from typing import Any, Awaitable, Callable, Dict, Hashable, Tuple
+
+
+class RequestCache:
+    """Least recently used cache of up to `max_entries` results, with the deduplication of the requests in flight.
+
+    It can be used both by clients that run in different threads, and by the `AsyncNewClient`s of an event loop. An
+    error is not cached: it is raised to all the callers waiting for the same request, and the next call retries.
+    """
+
+    def __init__(self, max_entries: int = 4096) -> None:
+        if max_entries < 1:
+            raise ValueError("max_entries must be positive")
+        self.max_entries = max_entries
+        self._results: "OrderedDict[Hashable, Any]" = OrderedDict()
+        self._in_flight: Dict[Hashable, Future] = {}
+        self._in_flight_async: Dict[Hashable, asyncio.Future] = {}
+        self._lock = threading.Lock()
+
+    def __len__(self) -> int:
+        return len(self._results)
+
+    def clear(self) -> None:
+        """Removes all the cached results; the requests in flight are not affected."""
+        with self._lock:
+            self._results.clear()
+
+    def _lookup(self, key: Hashable) -> Tuple[bool, Any]:
+        # must be called with the lock held
+        if key in self._results:
+            self._results.move_to_end(key)
+            return True, self._results[key]
+        return False, None
+
+    def _store(self, key: Hashable, value: Any) -> None:
+        with self._lock:
+            self._results[key] = value
+            self._results.move_to_end(key)
+            while len(self._results) > self.max_entries:
+                self._results.popitem(last=False)
+
+    def run(self, key: Hashable, compute: Callable[[], Any]) -> Any:
+        """Returns the cached result of `key`; otherwise, waits for the identical request in flight in another thread,
+        if any, or computes it with `compute` and caches it."""
+        with self._lock:
+            found, value = self._lookup(key)
+            if found:
+                return value
+            future = self._in_flight.get(key)
+            is_owner = future is None
+            if is_owner:
+                future = self._in_flight[key] = Future()
+
+        if not is_owner:
+            return future.result()
+
+        try:
+            value = compute()
+        except BaseException as e:
+            future.set_exception(e)
+            raise
+        else:
+            self._store(key, value)
+            future.set_result(value)
+            return value
+        finally:
+            with self._lock:
+                del self._in_flight[key]
+
+    async def run_async(self, key: Hashable, compute: Callable[[], Awaitable[Any]]) -> Any:
+        """The same as `run`, for the coroutines of an event loop: waiting for the identical request in flight does not
+        block the event loop."""
+        with self._lock:
+            found, value = self._lookup(key)
+            if found:
+                return value
+            future = self._in_flight_async.get(key)
+            is_owner = future is None
+            if is_owner:
+                future = self._in_flight_async[key] = asyncio.get_running_loop().create_future()
+
+        if not is_owner:
+            # shielded, so that cancelling a waiting caller does not cancel the request of the others
+            return await asyncio.shield(future)
+
+        try:
+            value = await compute()
+        except asyncio.CancelledError:
+            future.cancel()
+            raise
+        except BaseException as e:
+            future.set_exception(e)
+            future.exception()  # marks the error as retrieved, even if no other caller is waiting
+            raise
+        else:
+            self._store(key, value)
+            future.set_result(value)
+            return value
+        finally:
+            with self._lock:
+                del self._in_flight_async[key]
@@ -1,13 +1,193 @@
+import re
 from enum import IntEnum
-from typing import List
+from typing import List, Optional, Tuple
 
 from hashlib import sha256
 
+from . import _base58 as base58
 from .common import serialize_str, AddressType, write_varint
 from .merkle import MerkleTree, element_hash
 
 class WalletType(IntEnum):
     POLICYMAP = 1
+    POLICYMAP_BINARY = 2
+    POLICYMAP_BINARY_KEYS = 3
+
+
+# flags of the first byte of a key information in the binary encoding
+KEY_INFO_BINARY_HAS_KEY_ORIGIN = 0x01
+KEY_INFO_BINARY_HAS_WILDCARD = 0x02
+KEY_INFO_BINARY_HAS_MULTIPATH = 0x04
+
+_MULTIPATH_WILDCARD = re.compile(r"/<(0|[1-9][0-9]*);(0|[1-9][0-9]*)>/\*$")
+
+
+def split_key_wildcard(key_info: str) -> Tuple[str, Optional[Tuple[int, int]]]:
+    """
+    Splits the wildcard from a key information. Returns the key information without it, and the steps
+    of the change level of the receive and the change addresses: (0, 1) for "/**", (M, N) for the
+    multipath wildcard "/<M;N>/*", or None if there is no wildcard.
+    """
+    if key_info.endswith("/**"):
+        return key_info[:-3], (0, 1)
+    match = _MULTIPATH_WILDCARD.search(key_info)
+    if match is None:
+        return key_info, None
+    steps = (int(match.group(1)), int(match.group(2)))
+    if steps[0] == steps[1] or max(steps) >= 0x80000000:
+        raise ValueError("Invalid multipath wildcard")
+    return key_info[:match.start()], steps
+
+
+def encode_key_info(key_info: str) -> bytes:
+    """
+    Returns the binary encoding of a key information, used by POLICYMAP_BINARY_KEYS wallets: a byte
+    with the KEY_INFO_BINARY_* flags; if there is a key origin, the 4-byte fingerprint, the number of
+    derivation steps (1 byte) and each step as 4 bytes little-endian; then, the 78-byte serialized
+    extended pubkey, without the base58 checksum; finally, for a multipath wildcard other than
+    "/<0;1>/*", its two steps as 4 bytes little-endian.
+    """
+    flags = 0
+    origin = b""
+    if key_info.startswith("["):
+        end = key_info.index("]")
+        fpr, *steps = key_info[1:end].split("/")
+        origin = bytes.fromhex(fpr) + len(steps).to_bytes(1, byteorder="little")
+        for step in steps:
+            hardened = step[-1] in "'h"
+            index = int(step[:-1] if hardened else step)
+            origin += (index | (0x80000000 if hardened else 0)).to_bytes(4, byteorder="little")
+        flags |= KEY_INFO_BINARY_HAS_KEY_ORIGIN
+        key_info = key_info[end + 1:]
+    key_info, steps = split_key_wildcard(key_info)
+    multipath = b""
+    if steps is not None:
+        flags |= KEY_INFO_BINARY_HAS_WILDCARD
+        if steps != (0, 1):
+            flags |= KEY_INFO_BINARY_HAS_MULTIPATH
+            multipath = b"".join(step.to_bytes(4, byteorder="little") for step in steps)
+
+    ext_pubkey = base58.decode(key_info)[:-4]
+    if len(ext_pubkey) != 78:
+        raise ValueError("Invalid extended pubkey")
+    return flags.to_bytes(1, byteorder="little") + origin + ext_pubkey + multipath
+
+
+# tags of the nodes in the binary encoding of the policy maps, in the same order as the device
+_POLICY_TOKENS = [
+    "sh", "wsh", "pkh", "wpkh", "multi", "sortedmulti", "tr",
+    "0", "1", "pk", "pk_k", "pk_h", "older", "after", "sha256", "hash256", "ripemd160", "hash160",
+    "andor", "and_v", "and_b", "and_n", "or_b", "or_c", "or_d", "or_i", "thresh",
+]
+_POLICY_WRAPPERS = ["a", "s", "c", "t", "d", "v", "j", "n", "l", "u"]
+
+
+def encode_policy_map(policy_map: str) -> bytes:
+    """
+    Returns the compact binary encoding of a policy map, that the device decodes without parsing
+    the text. Each node is encoded in pre-order as its tag, followed by its arguments: key indexes,
+    thresholds and the number of keys or children are 1 byte each, timelocks are 4 bytes
+    little-endian, hashes are in binary, and the tree of tr() starts with 0x00 if there is no tree
+    and 0x01 otherwise; each tree is either 0x00 followed by a script, or 0x01 followed by the two
+    subtrees.
+
+    The policy is not validated, except for its syntax; the device performs the same checks on
+    both encodings.
+    """
+
+    pos = 0
+
+    def expect(c: str) -> None:
+        nonlocal pos
+        if not policy_map.startswith(c, pos):
+            raise ValueError(f"Expected '{c}' at position {pos} of the policy map")
+        pos += len(c)
+
+    def read_word() -> str:
+        nonlocal pos
+        start = pos
+        while pos < len(policy_map) and (policy_map[pos].isalnum() or policy_map[pos] == "_"):
+            pos += 1
+        return policy_map[start:pos]
+
+    def read_number() -> int:
+        word = read_word()
+        if not word.isdigit():
+            raise ValueError(f"Expected a number at position {pos} of the policy map")
+        return int(word)
+
+    def read_key() -> bytes:
+        expect("@")
+        return read_number().to_bytes(1, byteorder="little")
+
+    def encode_tree() -> bytes:
+        if policy_map.startswith("{", pos):
+            expect("{")
+            left = encode_tree()
+            expect(",")
+            right = encode_tree()
+            expect("}")
+            return b"\x01" + left + right
+        return b"\x00" + encode_script()
+
+    def encode_script() -> bytes:
+        nonlocal pos
+        word = read_word()
+        result = b""
+        if policy_map.startswith(":", pos):
+            expect(":")
+            result = bytes(len(_POLICY_TOKENS) + _POLICY_WRAPPERS.index(w) for w in word)
+            word = read_word()
+
+        if word not in _POLICY_TOKENS:
+            raise ValueError(f"Unknown token: {word}")
+        result += _POLICY_TOKENS.index(word).to_bytes(1, byteorder="little")
+        if word in ["0", "1"]:
+            return result
+
+        expect("(")
+        if word in ["sh", "wsh"]:
+            result += encode_script()
+        elif word == "tr":
+            result += read_key()
+            if policy_map.startswith(",", pos):
+                expect(",")
+                result += b"\x01" + encode_tree()
+            else:
+                result += b"\x00"
+        elif word in ["pkh", "wpkh", "pk", "pk_k", "pk_h"]:
+            result += read_key()
+        elif word in ["multi", "sortedmulti"]:
+            k = read_number()
+            keys = []
+            while policy_map.startswith(",", pos):
+                expect(",")
+                keys.append(read_key())
+            result += bytes([k, len(keys)]) + b"".join(keys)
+        elif word in ["older", "after"]:
+            result += read_number().to_bytes(4, byteorder="little")
+        elif word in ["sha256", "hash256", "ripemd160", "hash160"]:
+            result += bytes.fromhex(read_word())
+        elif word == "thresh":
+            k = read_number()
+            children = []
+            while policy_map.startswith(",", pos):
+                expect(",")
+                children.append(encode_script())
+            result += bytes([k, len(children)]) + b"".join(children)
+        else:
+            n_children = 3 if word == "andor" else 2
+            for i in range(n_children):
+                if i > 0:
+                    expect(",")
+                result += encode_script()
+        expect(")")
+        return result
+
+    result = encode_script()
+    if pos != len(policy_map):
+        raise ValueError("Unexpected characters at the end of the policy map")
+    return result
 
 
 # should not be instantiated directly
@@ -34,16 +214,19 @@ class PolicyMapWallet(Wallet):
        - 1 byte   : wallet type
        - 1 byte   : length of the wallet name (max 16)
        - (var)    : wallet name (ASCII string)
-       - (varint) : length of the policy map, at most 74 bytes at this time
-       - (var)    : policy map
+       - (varint) : length of the policy map, at most 74 bytes on Nano S, 128 bytes otherwise
+       - (var)    : policy map; for POLICYMAP_BINARY and POLICYMAP_BINARY_KEYS wallets, its
+                    encoding by encode_policy_map
        - (varint) : number of keys (not larger than 252)
-       - 32-bytes : root of the Merkle tree of all the keys information.
+       - 32-bytes : root of the Merkle tree of all the keys information; for POLICYMAP_BINARY_KEYS
+                    wallets, of their encoding by encode_key_info.
 
     The specific format of the keys is deferred to subclasses.
     """
 
-    def __init__(self, name: str, policy_map: str, keys_info: List[str]):
-        super().__init__(name, WalletType.POLICYMAP)
+    def __init__(self, name: str, policy_map: str, keys_info: List[str],
+                 wallet_type: WalletType = WalletType.POLICYMAP):
+        super().__init__(name, wallet_type)
         self.policy_map = policy_map
         self.keys_info = keys_info
 
@@ -51,13 +234,24 @@ class PolicyMapWallet(Wallet):
     def n_keys(self) -> int:
         return len(self.keys_info)
 
+    def serialized_keys_info(self) -> List[bytes]:
+        """The leaves of the Merkle tree of the keys information, as sent to the device."""
+        if self.type == WalletType.POLICYMAP_BINARY_KEYS:
+            return [encode_key_info(k) for k in self.keys_info]
+        return [k.encode("latin-1") for k in self.keys_info]
+
     def serialize(self) -> bytes:
-        keys_info_hashes = map(lambda k: element_hash(k.encode("latin-1")), self.keys_info)
+        keys_info_hashes = map(element_hash, self.serialized_keys_info())
+
+        if self.type != WalletType.POLICYMAP:
+            policy_map = encode_policy_map(self.policy_map)
+        else:
+            policy_map = self.policy_map.encode("latin-1")
 
         return b"".join([
             super().serialize(),
-            write_varint(len(self.policy_map)),
-            self.policy_map.encode("latin-1"),
+            write_varint(len(policy_map)),
+            policy_map,
             write_varint(len(self.keys_info)),
             MerkleTree(keys_info_hashes).root
         ])
@@ -65,9 +259,9 @@ class PolicyMapWallet(Wallet):
     def get_descriptor(self, change: bool) -> str:
         desc = self.policy_map
         for i in reversed(range(self.n_keys)):
-            key = self.keys_info[i]
-            if "/**" in key:
-                key = key.replace("/**", f"/{1 if change else 0}/*")
+            key, steps = split_key_wildcard(self.keys_info[i])
+            if steps is not None:
+                key += f"/{steps[1 if change else 0]}/*"
             desc = desc.replace(f"@{i}", key)
         return desc
 
@@ -0,0 +1,275 @@
+"""
+Derivation of the scriptPubKeys of a range of addresses of a wallet policy on the host, in order to compare them with
+the Merkle root returned by `get_wallet_scripts_merkle_root`.
+
+The extended pubkey of each key at the change level is derived only once; then, each index only costs an HMAC-SHA512
+and the addition of a multiple of the generator. With coincurve installed the point operations run on libsecp256k1;
+otherwise, all the indexes of the range are processed together in pure python, with a precomputed table of multiples
+of the generator and a single modular inversion for the whole range.
+
+Only the policies made of `sh`, `wsh`, `pkh`, `wpkh`, `pk`, `multi`, `sortedmulti` and `tr` without a script tree
+are supported.
+"""
+
+import hashlib
+import hmac
+import struct
+from typing import List, Optional, Sequence, Tuple
+
+from .common import hash160, sha256
+from .key import G, ExtendedKey, bytes_to_point, coincurve, n, p, point_add, point_to_bytes, tagged_hash
+from .merkle import MerkleRootBuilder, element_hash
+from .wallet import PolicyMapWallet, split_key_wildcard
+
+AffinePoint = Tuple[int, int]
+JacobianPoint = Optional[Tuple[int, int, int]]  # None is the point at infinity
+
+# width in bits of the windows of the table of multiples of the generator
+_WINDOW_BITS = 8
+
+# _G_TABLE[w][d - 1] is d * 2^(_WINDOW_BITS * w) * G; computed at the first use
+_G_TABLE: List[List[AffinePoint]] = []
+
+
+def _get_g_table() -> List[List[AffinePoint]]:
+    if len(_G_TABLE) == 0:
+        base = G
+        for _ in range(256 // _WINDOW_BITS):
+            row = [base]
+            for _ in range((1 << _WINDOW_BITS) - 2):
+                row.append(point_add(row[-1], base))
+            _G_TABLE.append(row)
+            base = point_add(row[-1], base)
+    return _G_TABLE
+
+
+def _jacobian_double(P: JacobianPoint) -> JacobianPoint:
+    if P is None or P[1] == 0:
+        return None
+    X, Y, Z = P
+    A = X * X % p
+    B = Y * Y % p
+    C = B * B % p
+    D = 2 * ((X + B) * (X + B) - A - C) % p
+    E = 3 * A % p
+    X3 = (E * E - 2 * D) % p
+    return (X3, (E * (D - X3) - 8 * C) % p, 2 * Y * Z % p)
+
+
+def _jacobian_add_affine(P: JacobianPoint, Q: AffinePoint) -> JacobianPoint:
+    if P is None:
+        return (Q[0], Q[1], 1)
+    X1, Y1, Z1 = P
+    Z1Z1 = Z1 * Z1 % p
+    H = (Q[0] * Z1Z1 - X1) % p
+    r = (Q[1] * Z1 * Z1Z1 - Y1) % p
+    if H == 0:
+        return _jacobian_double(P) if r == 0 else None
+    HH = H * H % p
+    HHH = H * HH % p
+    V = X1 * HH % p
+    X3 = (r * r - HHH - 2 * V) % p
+    return (X3, (r * (V - X3) - Y1 * HHH) % p, Z1 * H % p)
+
+
+def _to_affine_batch(points: Sequence[JacobianPoint]) -> List[Optional[AffinePoint]]:
+    # Montgomery's trick: a single modular inversion for all the points
+    prefix = []
+    acc = 1
+    for P in points:
+        prefix.append(acc)
+        if P is not None:
+            acc = acc * P[2] % p
+    inv = pow(acc, p - 2, p)
+
+    result: List[Optional[AffinePoint]] = [None] * len(points)
+    for i in reversed(range(len(points))):
+        P = points[i]
+        if P is None:
+            continue
+        z_inv = inv * prefix[i] % p
+        inv = inv * P[2] % p
+        z_inv2 = z_inv * z_inv % p
+        result[i] = (P[0] * z_inv2 % p, P[1] * z_inv2 * z_inv % p)
+    return result
+
+
+def add_mul_g_batch(points: Sequence[AffinePoint], scalars: Sequence[int]) -> List[AffinePoint]:
+    """Returns the list of `points[i] + scalars[i] * G`. Raises `ValueError` if any of them is the point at
+    infinity."""
+
+    if coincurve is not None:
+        result = []
+        for P, k in zip(points, scalars):
+            Q = coincurve.PublicKey(point_to_bytes(P)).add(k.to_bytes(32, byteorder="big"))
+            data = Q.format(compressed=False)
+            result.append((int.from_bytes(data[1:33], byteorder="big"), int.from_bytes(data[33:65], byteorder="big")))
+        return result
+
+    table = _get_g_table()
+    mask = (1 << _WINDOW_BITS) - 1
+    sums: List[JacobianPoint] = []
+    for P, k in zip(points, scalars):
+        acc: JacobianPoint = (P[0], P[1], 1)
+        for w, row in enumerate(table):
+            d = (k >> (_WINDOW_BITS * w)) & mask
+            if d != 0:
+                acc = _jacobian_add_affine(acc, row[d - 1])
+        sums.append(acc)
+
+    result = _to_affine_batch(sums)
+    if any(Q is None for Q in result):
+        raise ValueError("Invalid derived key")
+    return result  # type: ignore
+
+
+def derive_pubkeys(ext_key: ExtendedKey, start_index: int, count: int) -> List[AffinePoint]:
+    """Returns the pubkeys (as affine points) of the unhardened children of `ext_key` from `start_index` to
+    `start_index + count - 1`."""
+
+    if not (0 <= start_index and start_index + count <= 0x80000000):
+        raise ValueError("Invalid range of indexes")
+
+    K = bytes_to_point(ext_key.pubkey)
+    mac = hmac.new(ext_key.chaincode, ext_key.pubkey, hashlib.sha512)
+    scalars = []
+    for i in range(start_index, start_index + count):
+        h = mac.copy()
+        h.update(struct.pack(">L", i))
+        Il = int.from_bytes(h.digest()[:32], byteorder="big")
+        if Il >= n:
+            raise ValueError("Invalid derived key")
+        scalars.append(Il)
+    return add_mul_g_batch([K] * count, scalars)
+
+
+def _parse_policy(policy_map: str) -> tuple:
+    # returns the tree of the policy as nested tuples (name, args...); the keys are their indexes
+    pos = 0
+
+    def parse_node() -> tuple:
+        nonlocal pos
+        is_top_level = pos == 0
+        end = policy_map.find("(", pos)
+        if end == -1:
+            raise NotImplementedError(f"Unsupported policy: {policy_map}")
+        name = policy_map[pos:end]
+        pos = end + 1
+        if name in ["sh", "wsh"]:
+            node: tuple = (name, parse_node())
+        elif name in ["pkh", "wpkh", "pk"] or (name == "tr" and is_top_level):
+            node = (name, parse_key())
+        elif name in ["multi", "sortedmulti"]:
+            end = policy_map.index(",", pos)
+            threshold = int(policy_map[pos:end])
+            pos = end
+            keys = []
+            while policy_map.startswith(",", pos):
+                pos += 1
+                keys.append(parse_key())
+            node = (name, threshold, keys)
+        else:
+            raise NotImplementedError(f"Unsupported policy: {policy_map}")
+        if not policy_map.startswith(")", pos):
+            raise NotImplementedError(f"Unsupported policy: {policy_map}")
+        pos += 1
+        return node
+
+    def parse_key() -> int:
+        nonlocal pos
+        if not policy_map.startswith("@", pos):
+            raise ValueError(f"Expected a key at position {pos} of the policy map")
+        end = pos + 1
+        while end < len(policy_map) and policy_map[end].isdigit():
+            end += 1
+        index = int(policy_map[pos + 1:end])
+        pos = end
+        return index
+
+    tree = parse_node()
+    if pos != len(policy_map):
+        raise ValueError("Unexpected characters at the end of the policy map")
+    return tree
+
+
+def _get_key_indexes(node: tuple) -> List[int]:
+    if node[0] in ["sh", "wsh"]:
+        return _get_key_indexes(node[1])
+    elif node[0] in ["multi", "sortedmulti"]:
+        return node[2]
+    return [node[1]]
+
+
+def _derive_key_info(key_info: str, change: int, start_index: int, count: int) -> List[AffinePoint]:
+    if key_info.startswith("["):
+        key_info = key_info[key_info.index("]") + 1:]
+    key_info, steps = split_key_wildcard(key_info)
+    if steps is not None:
+        ext_key = ExtendedKey.deserialize(key_info).derive_pub(steps[change])
+        return derive_pubkeys(ext_key, start_index, count)
+    return [bytes_to_point(ExtendedKey.deserialize(key_info).pubkey)] * count
+
+
+def _get_script(node: tuple, pubkeys: List[bytes], tr_output_key: Optional[bytes]) -> bytes:
+    name = node[0]
+    if name == "sh":
+        return b"\xa9\x14" + hash160(_get_script(node[1], pubkeys, None)) + b"\x87"
+    elif name == "wsh":
+        return b"\x00\x20" + sha256(_get_script(node[1], pubkeys, None))
+    elif name == "pkh":
+        return b"\x76\xa9\x14" + hash160(pubkeys[node[1]]) + b"\x88\xac"
+    elif name == "wpkh":
+        return b"\x00\x14" + hash160(pubkeys[node[1]])
+    elif name == "pk":
+        return b"\x21" + pubkeys[node[1]] + b"\xac"
+    elif name == "tr":
+        assert tr_output_key is not None
+        return b"\x51\x20" + tr_output_key
+    else:
+        _, threshold, key_indexes = node
+        keys = [pubkeys[i] for i in key_indexes]
+        if name == "sortedmulti":
+            keys.sort()
+        return bytes([0x50 + threshold]) + b"".join(b"\x21" + k for k in keys) + bytes([0x50 + len(keys), 0xae])
+
+
+def derive_wallet_scripts(wallet: PolicyMapWallet, change: int, start_index: int, count: int) -> List[bytes]:
+    """Returns the scriptPubKeys of the addresses of `wallet` from `start_index` to `start_index + count - 1`, for the
+    receive (`change` = 0) or change (`change` = 1) addresses."""
+
+    if change != 0 and change != 1:
+        raise ValueError("Invalid change")
+
+    tree = _parse_policy(wallet.policy_map)
+    key_indexes = sorted(set(_get_key_indexes(tree)))
+    if any(i >= wallet.n_keys for i in key_indexes):
+        raise ValueError("Invalid key index in the policy map")
+
+    derived = {i: _derive_key_info(wallet.keys_info[i], change, start_index, count) for i in key_indexes}
+
+    output_keys: List[Optional[bytes]] = [None] * count
+    if tree[0] == "tr":
+        # BIP-86 tweak of the internal keys, that are lifted to the point with even y
+        internal_keys = [(P[0], P[1] if P[1] % 2 == 0 else p - P[1]) for P in derived[tree[1]]]
+        tweaks = []
+        for P in internal_keys:
+            t = int.from_bytes(tagged_hash("TapTweak", P[0].to_bytes(32, byteorder="big")), byteorder="big")
+            if t >= n:
+                raise ValueError("Invalid taproot tweak")
+            tweaks.append(t)
+        output_keys = [Q[0].to_bytes(32, byteorder="big") for Q in add_mul_g_batch(internal_keys, tweaks)]
+
+    scripts = []
+    for pos in range(count):
+        pubkeys = [b""] * wallet.n_keys
+        for i in key_indexes:
+            pubkeys[i] = point_to_bytes(derived[i][pos])
+        scripts.append(_get_script(tree, pubkeys, output_keys[pos]))
+    return scripts
+
+
+def compute_wallet_scripts_merkle_root(wallet: PolicyMapWallet, change: int, start_index: int, count: int) -> bytes:
+    """Returns the root of the Merkle tree of the scriptPubKeys returned by `derive_wallet_scripts`, with the same
+    layout as the one computed by the device for `get_wallet_scripts_merkle_root`."""
+
+    return MerkleRootBuilder(element_hash(s) for s in derive_wallet_scripts(wallet, change, start_index, count)).root
@@ -13,7 +13,8 @@ import { listen } from "@ledgerhq/logs";
 import type { Log } from "@ledgerhq/logs";
 
 
-import { AppClient, DefaultWalletPolicy, PsbtV2, WalletPolicy } from ".."
+import { AppClient, DefaultWalletPolicy, PreparedPsbt, PsbtV2, WalletPolicy } from ".."
+import type { ExchangeStats } from ".."
 
 jest.setTimeout(10000);
 
@@ -84,6 +85,39 @@ async function setSpeculosAutomation(transport: SpeculosTransport, automationObj
 }
 
 
+// psbt from test_sign_psbt_singlesig_wpkh_2to2 in the main test suite, converted to PSBTv2, and its signatures
+const wpkh2to2PsbtBase64 = "cHNidP8BAAoBAAAAAAAAAAAAAQIEAgAAAAEDBAAAAAABBAECAQUBAgH7BAIAAAAAAQBxAgAAAAGTarLgEHL3k8/kyXdU3hth/gPn22U2yLLyHdC1dCxIRQEAAAAA/v///wLe4ccAAAAAABYAFOt418QL8QY7Dj/OKcNWW2ichVmrECcAAAAAAAAWABQjGNZvhP71xIdfkzsDjcY4MfjaE/mXHgABAR8QJwAAAAAAABYAFCMY1m+E/vXEh1+TOwONxjgx+NoTIgYDRV7nztyXsLpDW4AGb8ksljo0xgAxeYHRNTMMTuQ6x6MY9azC/VQAAIABAACAAAAAgAAAAAABAAAAAQ4gniz+J/Cth7eKI31ddAXUowZmyjYdWFpGew3+QiYrTbQBDwQBAAAAARAE/f///wESBAAAAAAAAQBxAQAAAAEORx706Sway1HvyGYPjT9pk26pybK/9y/5vIHFHvz0ZAEAAAAAAAAAAAJgrgoAAAAAABYAFDXG4N1tPISxa6iF3Kc6yGPQtZPsrwYyAAAAAAAWABTcKG4M0ua9N86+nsNJ+18IkFZy/AAAAAABAR9grgoAAAAAABYAFDXG4N1tPISxa6iF3Kc6yGPQtZPsIgYCcbW3ea2HCDhYd5e89vDHrsWr52pwnXJPSNLibPh08KAY9azC/VQAAIABAACAAAAAgAEAAAAAAAAAAQ4gr7+uBlkPdB/xr1m2rEYRJjNqTEqC21U99v76tzesM/MBDwQAAAAAARAE/f///wESBAAAAAAAIgICKexHcnEx7SWIogxG7amrt9qm9J/VC6/nC5xappYcTswY9azC/VQAAIABAACAAAAAgAEAAAAKAAAAAQMIqDoGAAAAAAABBBYAFOs4+puBKPgfJule2wxf+uqDaQ/kAAEDCOCTBAAAAAAAAQQiACA/qWbJ3c3C/ZbkpeG8dlufr2zos+tPEQSq1r33cyTlvgA=";
+const wpkh2to2Signatures = [
+  "304402206b3e877655f08c6e7b1b74d6d893a82cdf799f68a5ae7cecae63a71b0339e5ce022019b94aa3fb6635956e109f3d89c996b1bfbbaf3c619134b5a302badfaf52180e01",
+  "3045022100e2e98e4f8c70274f10145c89a5d86e216d0376bdf9f42f829e4315ea67d79d210220743589fd4f55e540540a976a5af58acd610fa5e188a5096dfe7d36baf3afb94001",
+];
+
+// if prepared, the psbt is prepared, serialized and deserialized before signing
+async function signWpkh2to2Psbt(app: AppClient, transport: SpeculosTransport, prepared = false): Promise<void> {
+  const automation = JSON.parse(fs.readFileSync('src/__tests__/automations/sign_with_wallet_accept.json').toString());
+  await setSpeculosAutomation(transport, automation);
+
+  const walletPolicy = new DefaultWalletPolicy(
+    "wpkh(@0)",
+    "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**"
+  );
+
+  const psbt = new PsbtV2();
+  psbt.deserialize(Buffer.from(wpkh2to2PsbtBase64, "base64"));
+  const streamed = new Map<number, Buffer>();
+  const onSignature = (inputIndex: number, signature: Buffer) => streamed.set(inputIndex, signature);
+  const result = prepared
+    ? await app.signPsbt(PreparedPsbt.deserialize(app.preparePsbt(psbt, walletPolicy).serialize()), walletPolicy, null)
+    : await app.signPsbt(psbt, walletPolicy, null, () => {}, onSignature);
+
+  if (!prepared) {
+    expect(streamed).toEqual(result);
+  }
+  expect(result.size).toEqual(2);
+  expect(result.get(0)).toEqual(Buffer.from(wpkh2to2Signatures[0], "hex"));
+  expect(result.get(1)).toEqual(Buffer.from(wpkh2to2Signatures[1], "hex"));
+}
+
 describe("test AppClient", () => {
   let sp: ChildProcessWithoutNullStreams;
   let transport: SpeculosTransport;
@@ -255,33 +289,31 @@ describe("test AppClient", () => {
   });
 
   it("can sign a psbt", async () => {
-    // psbt from test_sign_psbt_singlesig_wpkh_2to2 in the main test suite, converted to PSBTv2
-    const psbtBuf = Buffer.from(
-      "cHNidP8BAAoBAAAAAAAAAAAAAQIEAgAAAAEDBAAAAAABBAECAQUBAgH7BAIAAAAAAQBxAgAAAAGTarLgEHL3k8/kyXdU3hth/gPn22U2yLLyHdC1dCxIRQEAAAAA/v///wLe4ccAAAAAABYAFOt418QL8QY7Dj/OKcNWW2ichVmrECcAAAAAAAAWABQjGNZvhP71xIdfkzsDjcY4MfjaE/mXHgABAR8QJwAAAAAAABYAFCMY1m+E/vXEh1+TOwONxjgx+NoTIgYDRV7nztyXsLpDW4AGb8ksljo0xgAxeYHRNTMMTuQ6x6MY9azC/VQAAIABAACAAAAAgAAAAAABAAAAAQ4gniz+J/Cth7eKI31ddAXUowZmyjYdWFpGew3+QiYrTbQBDwQBAAAAARAE/f///wESBAAAAAAAAQBxAQAAAAEORx706Sway1HvyGYPjT9pk26pybK/9y/5vIHFHvz0ZAEAAAAAAAAAAAJgrgoAAAAAABYAFDXG4N1tPISxa6iF3Kc6yGPQtZPsrwYyAAAAAAAWABTcKG4M0ua9N86+nsNJ+18IkFZy/AAAAAABAR9grgoAAAAAABYAFDXG4N1tPISxa6iF3Kc6yGPQtZPsIgYCcbW3ea2HCDhYd5e89vDHrsWr52pwnXJPSNLibPh08KAY9azC/VQAAIABAACAAAAAgAEAAAAAAAAAAQ4gr7+uBlkPdB/xr1m2rEYRJjNqTEqC21U99v76tzesM/MBDwQAAAAAARAE/f///wESBAAAAAAAIgICKexHcnEx7SWIogxG7amrt9qm9J/VC6/nC5xappYcTswY9azC/VQAAIABAACAAAAAgAEAAAAKAAAAAQMIqDoGAAAAAAABBBYAFOs4+puBKPgfJule2wxf+uqDaQ/kAAEDCOCTBAAAAAAAAQQiACA/qWbJ3c3C/ZbkpeG8dlufr2zos+tPEQSq1r33cyTlvgA=",
-      "base64"
-    );
+    await signWpkh2to2Psbt(app, transport);
+  });
 
-    const automation = JSON.parse(fs.readFileSync('src/__tests__/automations/sign_with_wallet_accept.json').toString());
-    await setSpeculosAutomation(transport, automation);
+  it("can sign a prepared psbt", async () => {
+    await signWpkh2to2Psbt(app, transport, true);
+  });
 
-    const walletPolicy = new DefaultWalletPolicy(
-      "wpkh(@0)",
-      "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**"
-    );
+  it("can sign a psbt in pipelined mode", async () => {
+    const exchanges: ExchangeStats[] = [];
+    const pipelinedApp = new AppClient(transport, {
+      pipelined: true,
+      onExchange: (stats) => exchanges.push(stats),
+    });
+    await signWpkh2to2Psbt(pipelinedApp, transport);
 
-    const psbt = new PsbtV2();
-    psbt.deserialize(psbtBuf);
-    const result = await app.signPsbt(psbt, walletPolicy, null, () => {});
-
-    expect(result.size).toEqual(2);
-    expect(result.get(0)).toEqual(Buffer.from(
-      "304402206b3e877655f08c6e7b1b74d6d893a82cdf799f68a5ae7cecae63a71b0339e5ce022019b94aa3fb6635956e109f3d89c996b1bfbbaf3c619134b5a302badfaf52180e01",
-      "hex"
-    ));
-    expect(result.get(1)).toEqual(Buffer.from(
-      "3045022100e2e98e4f8c70274f10145c89a5d86e216d0376bdf9f42f829e4315ea67d79d210220743589fd4f55e540540a976a5af58acd610fa5e188a5096dfe7d36baf3afb94001",
-      "hex"
-    ));
+    expect(exchanges.length).toBeGreaterThan(0);
+    expect(exchanges.every((e) => e.roundTripMs >= 0 && e.hostMs >= 0)).toBe(true);
+
+    // the speculative responses save roundtrips
+    const nPipelined = exchanges.length;
+    const serialApp = new AppClient(transport, {
+      onExchange: (stats) => exchanges.push(stats),
+    });
+    await signWpkh2to2Psbt(serialApp, transport);
+    expect(exchanges.length - nPipelined).toBeGreaterThan(nPipelined);
   });
 
   it("can sign a message", async () => {
@@ -0,0 +1,58 @@
+import { crypto } from "bitcoinjs-lib";
+import fs from "fs";
+
+import { ClientCommandInterpreter, KnownPreimages } from "../lib/clientCommands";
+import { hashKey, hashLeaf, Merkle } from "../lib/merkle";
+
+function makeList(n: number, tag: number): [Buffer[], Merkle] {
+  const elements = [...Array(n).keys()].map((i) => Buffer.from([tag, i]));
+  return [elements, new Merkle(elements.map((el) => hashLeaf(el)))];
+}
+
+describe("KnownPreimages", () => {
+  it("finds the preimages of the leaves of the lists", async () => {
+    const preimages = new KnownPreimages();
+    const [elements1, tree1] = makeList(3, 1);
+    const [elements2, tree2] = makeList(5, 2);
+    preimages.addList(elements1, tree1);
+    preimages.addList(elements2, tree2);
+    preimages.add(Buffer.from("preimage"));
+
+    expect(preimages.get(hashKey(crypto.sha256(Buffer.from("preimage"))))).toEqual(Buffer.from("preimage"));
+    expect(preimages.get(hashKey(hashLeaf(elements2[4])))).toEqual(Buffer.from([0, 2, 4]));
+    expect(preimages.get(hashKey(hashLeaf(elements1[0])))).toEqual(Buffer.from([0, 1, 0]));
+    expect(preimages.get(hashKey(hashLeaf(Buffer.from([3, 0]))))).toBeUndefined();
+  });
+});
+
+describe("ClientCommandInterpreter", () => {
+  it("returns the preimages of the known lists", async () => {
+    const interpreter = new ClientCommandInterpreter();
+    const [elements, tree] = makeList(4, 1);
+    interpreter.addKnownTree(elements, tree);
+
+    const request = Buffer.concat([Buffer.from([0x40, 0]), hashLeaf(elements[2])]);
+    expect(interpreter.execute(request)).toEqual(Buffer.from([3, 3, 0, 1, 2]));
+    expect(() => interpreter.addKnownTree(elements.slice(1), tree)).toThrow();
+  });
+});
+
+// the same vectors are used by the tests of the python client, so that the two clients send
+// byte-identical responses to the client commands (including all the GET_MORE_ELEMENTS needed to
+// drain the queue)
+const vectors = JSON.parse(fs.readFileSync("src/__tests__/vectors/client_commands.json").toString());
+
+describe("ClientCommandInterpreter vectors", () => {
+  for (const testCase of vectors.cases) {
+    it(`responds like the python client with max_response_len=${testCase.max_response_len}`, async () => {
+      const interpreter = new ClientCommandInterpreter(undefined, testCase.max_response_len);
+      for (const elements of vectors.lists) {
+        interpreter.addKnownList(elements.map((el: string) => Buffer.from(el, "hex")));
+      }
+
+      for (const command of testCase.commands) {
+        expect(interpreter.execute(Buffer.from(command.request, "hex")).toString("hex")).toEqual(command.response);
+      }
+    });
+  }
+});
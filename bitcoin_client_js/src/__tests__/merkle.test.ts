@@ -0,0 +1,59 @@
+import { hashLeaf, Merkle } from "../lib/merkle";
+
+function makeLeaves(n: number): Buffer[] {
+  return [...Array(n).keys()].map((i) => hashLeaf(Buffer.from([i])));
+}
+
+// roots of the trees with leaves 0, 1, ..., n - 1 (as single bytes), from the python client
+const expectedRoots: [number, string][] = [
+  [1, "96a296d224f285c67bee93c30f8a309157f0daa35dc5b87e410b78630a09cfc7"],
+  [2, "a20bf9a7cc2dc8a08f5f415a71b19f6ac427bab54d24eec868b5d3103449953a"],
+  [3, "3b6cccd7e3e023ff393006f030315ee7ad9eb111b022b41fba7e5b7a3973f688"],
+  [5, "b855b42d6c30f5b087e05266783fbd6e394f7b926013ccaa67700a8b0c5a596f"],
+  [7, "3560191803028444b232018ac047fdb561c09c23a7a6876c85e08b5e4d48e9f3"],
+  [8, "ef7f49b620f6c7ea9b963a214da34b5021c6ded8ed57734380a311ab726aa907"],
+  [9, "162a21c2230e0284ea38cb8739ee4bb75947a1acd5d529c638ec068969fb3c4a"],
+];
+
+describe("Merkle", () => {
+  it("computes the root", async () => {
+    expect(new Merkle([]).getRoot()).toEqual(Buffer.alloc(32, 0));
+    for (const [n, root] of expectedRoots) {
+      expect(new Merkle(makeLeaves(n)).getRoot().toString("hex")).toEqual(root);
+    }
+  });
+
+  it("computes the proofs", async () => {
+    const leaves = makeLeaves(7);
+    const mt = new Merkle(leaves);
+    const subtreeRoot = (begin: number, end: number) => new Merkle(leaves.slice(begin, end)).getRoot();
+
+    expect(mt.getProof(0)).toEqual([leaves[1], subtreeRoot(2, 4), subtreeRoot(4, 7)]);
+    expect(mt.getProof(5)).toEqual([leaves[4], leaves[6], subtreeRoot(0, 4)]);
+    // the last leaf is the right child of the subtree with leaves 4 to 6
+    expect(mt.getProof(6)).toEqual([subtreeRoot(4, 6), subtreeRoot(0, 4)]);
+    expect(new Merkle(leaves.slice(0, 1)).getProof(0)).toEqual([]);
+    expect(() => mt.getProof(7)).toThrow();
+  });
+
+  it("finds the index of a leaf", async () => {
+    const leaves = makeLeaves(5);
+    const mt = new Merkle([...leaves, leaves[2]]);
+    expect(mt.getLeafIndex(leaves[4])).toEqual(4);
+    expect(mt.getLeafIndex(leaves[2])).toEqual(2); // the first one
+    expect(mt.getLeafIndex(Buffer.from(leaves[0]))).toEqual(0);
+    expect(mt.getLeafIndex(hashLeaf(Buffer.from([5])))).toEqual(-1);
+  });
+
+  it("computes the multiproofs", async () => {
+    const leaves = makeLeaves(7);
+    const mt = new Merkle(leaves);
+    const subtreeRoot = (begin: number, end: number) => new Merkle(leaves.slice(begin, end)).getRoot();
+
+    expect(mt.getMultiproof([1, 5])).toEqual([
+      leaves[0], leaves[1], subtreeRoot(2, 4), leaves[4], leaves[5], leaves[6],
+    ]);
+    expect(mt.getMultiproof([6])).toEqual([subtreeRoot(0, 4), subtreeRoot(4, 6), leaves[6]]);
+    expect(() => mt.getMultiproof([3, 2])).toThrow();
+  });
+});
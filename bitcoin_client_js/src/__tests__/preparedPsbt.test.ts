@@ -0,0 +1,104 @@
+import { ClientCommandInterpreter } from "../lib/clientCommands";
+import { MerkelizedPsbt } from "../lib/merkelizedPsbt";
+import { hashLeaf, Merkle } from "../lib/merkle";
+import {
+  PreparedPsbt,
+  PsbtWorker,
+  preparePsbtInWorker,
+  registerPsbtWorker,
+} from "../lib/preparedPsbt";
+import { DefaultWalletPolicy } from "../lib/policy";
+import { PsbtV2 } from "../lib/psbtv2";
+
+const psbtBase64 = "cHNidP8BAAoBAAAAAAAAAAAAAQIEAgAAAAEDBAAAAAABBAECAQUBAgH7BAIAAAAAAQBxAgAAAAGTarLgEHL3k8/kyXdU3hth/gPn22U2yLLyHdC1dCxIRQEAAAAA/v///wLe4ccAAAAAABYAFOt418QL8QY7Dj/OKcNWW2ichVmrECcAAAAAAAAWABQjGNZvhP71xIdfkzsDjcY4MfjaE/mXHgABAR8QJwAAAAAAABYAFCMY1m+E/vXEh1+TOwONxjgx+NoTIgYDRV7nztyXsLpDW4AGb8ksljo0xgAxeYHRNTMMTuQ6x6MY9azC/VQAAIABAACAAAAAgAAAAAABAAAAAQ4gniz+J/Cth7eKI31ddAXUowZmyjYdWFpGew3+QiYrTbQBDwQBAAAAARAE/f///wESBAAAAAAAAQBxAQAAAAEORx706Sway1HvyGYPjT9pk26pybK/9y/5vIHFHvz0ZAEAAAAAAAAAAAJgrgoAAAAAABYAFDXG4N1tPISxa6iF3Kc6yGPQtZPsrwYyAAAAAAAWABTcKG4M0ua9N86+nsNJ+18IkFZy/AAAAAABAR9grgoAAAAAABYAFDXG4N1tPISxa6iF3Kc6yGPQtZPsIgYCcbW3ea2HCDhYd5e89vDHrsWr52pwnXJPSNLibPh08KAY9azC/VQAAIABAACAAAAAgAEAAAAAAAAAAQ4gr7+uBlkPdB/xr1m2rEYRJjNqTEqC21U99v76tzesM/MBDwQAAAAAARAE/f///wESBAAAAAAAIgICKexHcnEx7SWIogxG7amrt9qm9J/VC6/nC5xappYcTswY9azC/VQAAIABAACAAAAAgAEAAAAKAAAAAQMIqDoGAAAAAAABBBYAFOs4+puBKPgfJule2wxf+uqDaQ/kAAEDCOCTBAAAAAAAAQQiACA/qWbJ3c3C/ZbkpeG8dlufr2zos+tPEQSq1r33cyTlvgA=";
+
+function makePsbt(): PsbtV2 {
+  const psbt = new PsbtV2();
+  psbt.deserialize(Buffer.from(psbtBase64, "base64"));
+  return psbt;
+}
+
+// a worker and its global scope, in the same thread, as a pair of message ports
+function makeWorkerPair(): [PsbtWorker, PsbtWorker] {
+  type Listener = (event: { data: unknown }) => void;
+  const makePort = (listeners: Set<Listener>, peerListeners: Set<Listener>): PsbtWorker => ({
+    postMessage: (message) => {
+      setImmediate(() => peerListeners.forEach((listener) => listener({ data: message })));
+    },
+    addEventListener: (_type, listener) => listeners.add(listener),
+    removeEventListener: (_type, listener) => listeners.delete(listener),
+  });
+  const workerListeners = new Set<Listener>();
+  const scopeListeners = new Set<Listener>();
+  return [makePort(workerListeners, scopeListeners), makePort(scopeListeners, workerListeners)];
+}
+
+function expectSameAsMerkelizedPsbt(prepared: PreparedPsbt) {
+  const merkelizedPsbt = new MerkelizedPsbt(makePsbt());
+  const root = (elements: Buffer[]) => new Merkle(elements.map((el) => hashLeaf(el))).getRoot();
+  expect(prepared.globalCommitment).toEqual(merkelizedPsbt.getGlobalKeysValuesRoot());
+  expect(prepared.inputCount).toEqual(merkelizedPsbt.getGlobalInputCount());
+  expect(prepared.inputsRoot).toEqual(root(merkelizedPsbt.inputMapCommitments));
+  expect(prepared.outputCount).toEqual(merkelizedPsbt.getGlobalOutputCount());
+  expect(prepared.outputsRoot).toEqual(root(merkelizedPsbt.outputMapCommitments));
+}
+
+describe("PreparedPsbt", () => {
+  it("has the commitments of the merkleized psbt", async () => {
+    expectSameAsMerkelizedPsbt(PreparedPsbt.fromPsbt(makePsbt()));
+  });
+
+  it("is serialized and deserialized", async () => {
+    const prepared = PreparedPsbt.fromPsbt(makePsbt());
+    const serialized = prepared.serialize();
+    const deserialized = PreparedPsbt.deserialize(serialized);
+    expectSameAsMerkelizedPsbt(deserialized);
+    expect(deserialized.serialize()).toEqual(serialized);
+
+    // the interpreter can serve the lists of the deserialized psbt
+    const interpreter = new ClientCommandInterpreter();
+    expect(() => deserialized.addTo(interpreter)).not.toThrow();
+
+    expect(() => PreparedPsbt.deserialize(Buffer.concat([serialized, Buffer.from([0])]))).toThrow();
+    expect(() => PreparedPsbt.deserialize(serialized.subarray(0, serialized.length - 1))).toThrow();
+  });
+
+  it("includes the wallet policy", async () => {
+    const walletPolicy = new DefaultWalletPolicy(
+      "wpkh(@0)",
+      "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**"
+    );
+    const prepared = PreparedPsbt.fromPsbt(makePsbt());
+    expect(prepared.walletId).toBeUndefined();
+
+    const withPolicy = prepared.withWalletPolicy(walletPolicy);
+    expect(withPolicy.walletId).toEqual(walletPolicy.getId());
+    expect(withPolicy.serialize()).toEqual(PreparedPsbt.fromPsbt(makePsbt(), walletPolicy).serialize());
+    expect(() => withPolicy.withWalletPolicy(walletPolicy)).toThrow();
+
+    const deserialized = PreparedPsbt.deserialize(withPolicy.serialize());
+    expect(deserialized.walletId).toEqual(walletPolicy.getId());
+    expectSameAsMerkelizedPsbt(deserialized);
+  });
+
+  it("is prepared in a worker", async () => {
+    const [worker, scope] = makeWorkerPair();
+    registerPsbtWorker(scope);
+
+    const [first, second] = await Promise.all([
+      preparePsbtInWorker(worker, makePsbt()),
+      preparePsbtInWorker(worker, makePsbt()),
+    ]);
+    expectSameAsMerkelizedPsbt(first);
+    expect(second.serialize()).toEqual(first.serialize());
+  });
+
+  it("returns the errors of the worker", async () => {
+    const [worker, scope] = makeWorkerPair();
+    registerPsbtWorker(scope);
+
+    const invalidPsbt = makePsbt();
+    invalidPsbt.serialize = () => Buffer.from("not a psbt");
+    await expect(preparePsbtInWorker(worker, invalidPsbt)).rejects.toThrow();
+  });
+});
@@ -0,0 +1,43 @@
+import { MerkelizedPsbt } from "../lib/merkelizedPsbt";
+import { PsbtV2 } from "../lib/psbtv2";
+
+// the psbt of test_sign_psbt_singlesig_wpkh_2to2 in the main test suite, converted to PSBTv2
+const psbtBase64 = "cHNidP8BAAoBAAAAAAAAAAAAAQIEAgAAAAEDBAAAAAABBAECAQUBAgH7BAIAAAAAAQBxAgAAAAGTarLgEHL3k8/kyXdU3hth/gPn22U2yLLyHdC1dCxIRQEAAAAA/v///wLe4ccAAAAAABYAFOt418QL8QY7Dj/OKcNWW2ichVmrECcAAAAAAAAWABQjGNZvhP71xIdfkzsDjcY4MfjaE/mXHgABAR8QJwAAAAAAABYAFCMY1m+E/vXEh1+TOwONxjgx+NoTIgYDRV7nztyXsLpDW4AGb8ksljo0xgAxeYHRNTMMTuQ6x6MY9azC/VQAAIABAACAAAAAgAAAAAABAAAAAQ4gniz+J/Cth7eKI31ddAXUowZmyjYdWFpGew3+QiYrTbQBDwQBAAAAARAE/f///wESBAAAAAAAAQBxAQAAAAEORx706Sway1HvyGYPjT9pk26pybK/9y/5vIHFHvz0ZAEAAAAAAAAAAAJgrgoAAAAAABYAFDXG4N1tPISxa6iF3Kc6yGPQtZPsrwYyAAAAAAAWABTcKG4M0ua9N86+nsNJ+18IkFZy/AAAAAABAR9grgoAAAAAABYAFDXG4N1tPISxa6iF3Kc6yGPQtZPsIgYCcbW3ea2HCDhYd5e89vDHrsWr52pwnXJPSNLibPh08KAY9azC/VQAAIABAACAAAAAgAEAAAAAAAAAAQ4gr7+uBlkPdB/xr1m2rEYRJjNqTEqC21U99v76tzesM/MBDwQAAAAAARAE/f///wESBAAAAAAAIgICKexHcnEx7SWIogxG7amrt9qm9J/VC6/nC5xappYcTswY9azC/VQAAIABAACAAAAAgAEAAAAKAAAAAQMIqDoGAAAAAAABBBYAFOs4+puBKPgfJule2wxf+uqDaQ/kAAEDCOCTBAAAAAAAAQQiACA/qWbJ3c3C/ZbkpeG8dlufr2zos+tPEQSq1r33cyTlvgA=";
+
+describe("PsbtV2", () => {
+  it("is serialized as deserialized", async () => {
+    const serialized = Buffer.from(psbtBase64, "base64");
+    const psbt = new PsbtV2();
+    psbt.deserialize(serialized);
+    expect(psbt.getGlobalInputCount()).toEqual(2);
+    expect(psbt.getGlobalOutputCount()).toEqual(2);
+    expect(psbt.serialize()).toEqual(serialized);
+  });
+
+  it("is not modified by the merkleized psbt", async () => {
+    const psbt = new PsbtV2();
+    psbt.deserialize(Buffer.from(psbtBase64, "base64"));
+    const merkelizedPsbt = new MerkelizedPsbt(psbt);
+
+    psbt.setInputSequence(0, 0);
+    expect(psbt.getInputSequence(0)).toEqual(0);
+    expect(merkelizedPsbt.getInputSequence(0)).toEqual(0xfffffffd);
+  });
+
+  it("does not merkleize the fields that the device does not read", async () => {
+    const psbt = new PsbtV2();
+    psbt.deserialize(Buffer.from(psbtBase64, "base64"));
+    const commitments = new MerkelizedPsbt(psbt).inputMapCommitments;
+
+    const pubkey = Buffer.alloc(33, 2);
+    const signature = Buffer.alloc(71, 1);
+    psbt.setInputPartialSig(0, pubkey, signature);
+    psbt.setInputFinalScriptsig(1, Buffer.alloc(10));
+    const merkelizedPsbt = new MerkelizedPsbt(psbt);
+
+    expect(merkelizedPsbt.getInputPartialSig(0, pubkey)).toBeUndefined();
+    expect(merkelizedPsbt.inputMapCommitments).toEqual(commitments);
+    // the psbt itself is not pruned
+    expect(psbt.getInputPartialSig(0, pubkey)).toEqual(signature);
+  });
+});
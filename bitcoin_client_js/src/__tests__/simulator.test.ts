@@ -0,0 +1,752 @@
+import { createHmac } from "crypto";
+
+import type Transport from "@ledgerhq/hw-transport";
+import { crypto } from "bitcoinjs-lib";
+
+import { AppClient, DefaultWalletPolicy, PsbtV2, RequestCache, WalletPolicy } from "..";
+import { BufferReader } from "../lib/buffertools";
+import { ClientCapability, MAX_RESPONSE_LEN } from "../lib/clientCommands";
+import { hashLeaf } from "../lib/merkle";
+import { createVarint } from "../lib/varint";
+
+/*
+An in-process stand-in for the device, to measure the throughput of the client without Speculos; it is the same as
+ProtocolSimulator in test_utils/simulator.py.
+
+ProtocolSimulator can be used as the transport of an AppClient. It answers SIGN_PSBT, REGISTER_WALLET and
+GET_WALLET_ADDRESS with the same kind of client commands as the app: it loads the wallet policy and its keys, the
+Merkleized maps of the PSBT and the values it needs from them with GET_PREIMAGE, GET_MERKLE_LEAF_PROOF,
+GET_MERKLE_LEAF_INDEX and GET_MORE_ELEMENTS, verifying every proof; then it yields one signature per input.
+GET_PUBKEY and GET_MASTER_FINGERPRINT are also answered, without client commands.
+
+Only the request patterns are reproduced: the signatures, addresses, pubkeys and hmacs it returns are placeholders, no
+user interaction is simulated, and the optional client commands negotiated with the client capabilities are not used.
+
+The benchmark is only executed if the BENCHMARK environment variable is set.
+*/
+
+const CLA_BTC = 0xe1;
+const CLA_FRAMEWORK = 0xf8;
+
+enum BitcoinIns {
+  GET_PUBKEY = 0x00,
+  REGISTER_WALLET = 0x02,
+  GET_WALLET_ADDRESS = 0x03,
+  SIGN_PSBT = 0x04,
+  GET_MASTER_FINGERPRINT = 0x05,
+}
+
+enum FrameworkIns {
+  CONTINUE_INTERRUPTED = 0x01,
+  GET_MAX_RESPONSE_LEN = 0x02,
+}
+
+enum ClientCommandCode {
+  YIELD = 0x10,
+  GET_PREIMAGE = 0x40,
+  GET_MERKLE_LEAF_PROOF = 0x41,
+  GET_MERKLE_LEAF_INDEX = 0x42,
+  GET_MORE_ELEMENTS = 0xa0,
+}
+
+const SW_OK = 0x9000;
+const SW_INCORRECT_DATA = 0x6a80;
+const SW_BAD_STATE = 0xb007;
+const SW_INS_NOT_SUPPORTED = 0x6d00;
+const SW_CLA_NOT_SUPPORTED = 0x6e00;
+const SW_INTERRUPTED_EXECUTION = 0xe000;
+
+// PSBT key types read by the simulator
+const PSBT_GLOBAL_UNSIGNED_TX = 0x00;
+const PSBT_GLOBAL_TX_VERSION = 0x02;
+const PSBT_GLOBAL_FALLBACK_LOCKTIME = 0x03;
+const PSBT_IN_NON_WITNESS_UTXO = 0x00;
+const PSBT_IN_WITNESS_UTXO = 0x01;
+const PSBT_IN_SIGHASH_TYPE = 0x03;
+const PSBT_IN_BIP32_DERIVATION = 0x06;
+const PSBT_OUT_BIP32_DERIVATION = 0x02;
+const PSBT_OUT_AMOUNT = 0x03;
+const PSBT_OUT_SCRIPT = 0x04;
+
+// A device command, written as a generator that yields the requests of the client commands, and receives the
+// responses; it returns the response of the command.
+type Flow<T> = Generator<Buffer, T, Buffer>;
+
+interface MerkleizedMap {
+  readonly size: number;
+  readonly keysRoot: Buffer;
+  readonly valuesRoot: Buffer;
+  readonly keys: Buffer[];
+}
+
+function statusWord(sw: number): Buffer {
+  return Buffer.from([sw >> 8, sw & 0xff]);
+}
+
+function readNumber(reader: BufferReader): number {
+  return Number(reader.readVarInt());
+}
+
+function assertEmpty(reader: BufferReader) {
+  if (reader.available() != 0) {
+    throw new Error("Unexpected data at the end of the response");
+  }
+}
+
+function combineHashes(left: Buffer, right: Buffer): Buffer {
+  return crypto.sha256(Buffer.concat([Buffer.from([1]), left, right]));
+}
+
+function keyOfType(keyType: number): Buffer {
+  return Buffer.from([keyType]);
+}
+
+// Returns the first key of map with type keyType, or an empty buffer if none
+function firstKey(map: MerkleizedMap, keyType: number): Buffer {
+  return map.keys.find((k) => k[0] == keyType) || Buffer.alloc(0);
+}
+
+class ProtocolSimulator {
+  // the number of commands of each type received so far
+  readonly commands: Map<string, number> = new Map();
+  // the number of client commands of each type requested so far
+  readonly clientCommands: Map<string, number> = new Map();
+
+  private flow?: Flow<Buffer>;
+
+  constructor(
+    private readonly maxResponseLen: number = MAX_RESPONSE_LEN,
+    private readonly hmacKey: Buffer = Buffer.alloc(32)
+  ) {}
+
+  asTransport(): Transport {
+    return this as unknown as Transport;
+  }
+
+  // the same as Transport.send
+  async send(
+    cla: number,
+    ins: number,
+    p1: number,
+    p2: number,
+    data: Buffer = Buffer.alloc(0),
+    statusList: readonly number[] = [SW_OK]
+  ): Promise<Buffer> {
+    const response = this.exchange(cla, ins, p1, p2, data);
+    const sw = response.readUInt16BE(response.length - 2);
+    if (!statusList.includes(sw)) {
+      throw new Error(`Unexpected status word: 0x${sw.toString(16)}`);
+    }
+    return response;
+  }
+
+  private exchange(
+    cla: number,
+    ins: number,
+    p1: number,
+    p2: number,
+    data: Buffer
+  ): Buffer {
+    if (cla == CLA_FRAMEWORK) {
+      if (ins == FrameworkIns.GET_MAX_RESPONSE_LEN) {
+        // no speculative responses
+        return Buffer.from([
+          this.maxResponseLen >> 8,
+          this.maxResponseLen & 0xff,
+          0,
+          ...statusWord(SW_OK),
+        ]);
+      }
+      if (ins == FrameworkIns.CONTINUE_INTERRUPTED && p1 == 0) {
+        if (!this.flow) {
+          return statusWord(SW_BAD_STATE);
+        }
+        return this.run((flow) => flow.next(data));
+      }
+      return statusWord(SW_INS_NOT_SUPPORTED);
+    }
+
+    if (cla != CLA_BTC) {
+      return statusWord(SW_CLA_NOT_SUPPORTED);
+    }
+
+    const req = new BufferReader(data);
+    const name = BitcoinIns[ins];
+    if (name !== undefined) {
+      this.commands.set(name, (this.commands.get(name) || 0) + 1);
+    }
+    switch (ins) {
+      case BitcoinIns.GET_PUBKEY:
+        this.flow = this.getPubkey(req);
+        break;
+      case BitcoinIns.GET_MASTER_FINGERPRINT:
+        this.flow = this.getMasterFingerprint(req);
+        break;
+      case BitcoinIns.REGISTER_WALLET:
+        this.flow = this.registerWallet(req);
+        break;
+      case BitcoinIns.GET_WALLET_ADDRESS:
+        this.flow = this.getWalletAddress(req);
+        break;
+      case BitcoinIns.SIGN_PSBT:
+        this.flow = this.signPsbt(req, p2);
+        break;
+      default:
+        return statusWord(SW_INS_NOT_SUPPORTED);
+    }
+    return this.run((flow) => flow.next());
+  }
+
+  private run(
+    advance: (flow: Flow<Buffer>) => IteratorResult<Buffer, Buffer>
+  ): Buffer {
+    let result: IteratorResult<Buffer, Buffer>;
+    try {
+      result = advance(this.flow as Flow<Buffer>);
+    } catch (e) {
+      this.flow = undefined;
+      return statusWord(SW_INCORRECT_DATA);
+    }
+
+    if (result.done) {
+      this.flow = undefined;
+      return Buffer.concat([result.value, statusWord(SW_OK)]);
+    }
+
+    const name = ClientCommandCode[result.value[0]];
+    this.clientCommands.set(name, (this.clientCommands.get(name) || 0) + 1);
+    return Buffer.concat([result.value, statusWord(SW_INTERRUPTED_EXECUTION)]);
+  }
+
+  // Client commands, as the helpers in src/handler/lib
+
+  // Reads the nTotal elements of a response whose first part is in res, preceded by the number of the elements in
+  // it; the others are requested with GET_MORE_ELEMENTS.
+  private *readElements(res: BufferReader, nTotal: number): Flow<Buffer[]> {
+    const elements: Buffer[] = [];
+    let nResponse = res.readUInt8();
+    for (let i = 0; i < nResponse; i++) {
+      elements.push(res.readSlice(32));
+    }
+    assertEmpty(res);
+    while (elements.length < nTotal) {
+      res = new BufferReader(
+        yield Buffer.from([ClientCommandCode.GET_MORE_ELEMENTS])
+      );
+      nResponse = res.readUInt8();
+      if (res.readUInt8() != 32 || nResponse == 0) {
+        throw new Error("Unexpected response to GET_MORE_ELEMENTS");
+      }
+      for (let i = 0; i < nResponse; i++) {
+        elements.push(res.readSlice(32));
+      }
+      assertEmpty(res);
+    }
+    if (elements.length != nTotal) {
+      throw new Error("Too many elements");
+    }
+    return elements;
+  }
+
+  private *getPreimage(h: Buffer): Flow<Buffer> {
+    let res = new BufferReader(
+      yield Buffer.concat([
+        Buffer.from([ClientCommandCode.GET_PREIMAGE, 0]),
+        h,
+      ])
+    );
+    const preimageLen = readNumber(res);
+    const parts = [res.readSlice(res.readUInt8())];
+    let len = parts[0].length;
+    assertEmpty(res);
+    while (len < preimageLen) {
+      res = new BufferReader(
+        yield Buffer.from([ClientCommandCode.GET_MORE_ELEMENTS])
+      );
+      const nElements = res.readUInt8();
+      const elementLen = res.readUInt8();
+      parts.push(res.readSlice(nElements * elementLen));
+      len += nElements * elementLen;
+      assertEmpty(res);
+    }
+    const preimage = Buffer.concat(parts);
+    if (preimage.length != preimageLen || !crypto.sha256(preimage).equals(h)) {
+      throw new Error("Wrong preimage");
+    }
+    return preimage;
+  }
+
+  private *getMerkleLeafHash(
+    root: Buffer,
+    size: number,
+    index: number
+  ): Flow<Buffer> {
+    const res = new BufferReader(
+      yield Buffer.concat([
+        Buffer.from([ClientCommandCode.GET_MERKLE_LEAF_PROOF]),
+        root,
+        createVarint(size),
+        createVarint(index),
+      ])
+    );
+    const leafHash = res.readSlice(32);
+    const proof = yield* this.readElements(res, res.readUInt8());
+
+    // the proof goes from the leaf to the root; the last node of a level without sibling is moved up unchanged
+    let cur = leafHash;
+    for (
+      let levelSize = size, i = index;
+      levelSize > 1;
+      levelSize = (levelSize + 1) >> 1, i >>= 1
+    ) {
+      const siblingIndex = i ^ 1;
+      if (siblingIndex < levelSize) {
+        const sibling = proof.shift();
+        if (!sibling) {
+          throw new Error("Proof too short");
+        }
+        cur =
+          siblingIndex & 1
+            ? combineHashes(cur, sibling)
+            : combineHashes(sibling, cur);
+      }
+    }
+    if (proof.length != 0 || !cur.equals(root)) {
+      throw new Error("Invalid Merkle proof");
+    }
+    return leafHash;
+  }
+
+  private *getMerkleLeafElement(
+    root: Buffer,
+    size: number,
+    index: number
+  ): Flow<Buffer> {
+    const leafHash = yield* this.getMerkleLeafHash(root, size, index);
+    const preimage = yield* this.getPreimage(leafHash);
+    if (preimage[0] != 0) {
+      throw new Error("Invalid leaf preimage");
+    }
+    return preimage.subarray(1);
+  }
+
+  private *getMerkleLeafIndex(
+    root: Buffer,
+    size: number,
+    leafHash: Buffer
+  ): Flow<number | undefined> {
+    const res = new BufferReader(
+      yield Buffer.concat([
+        Buffer.from([ClientCommandCode.GET_MERKLE_LEAF_INDEX]),
+        root,
+        leafHash,
+      ])
+    );
+    const found = res.readUInt8();
+    const index = readNumber(res);
+    assertEmpty(res);
+    if (found == 0) {
+      return undefined;
+    }
+    // the index is not trusted: it is verified with the proof of the leaf
+    if (
+      index >= size ||
+      !(yield* this.getMerkleLeafHash(root, size, index)).equals(leafHash)
+    ) {
+      throw new Error("Wrong leaf index");
+    }
+    return index;
+  }
+
+  // Parses a map commitment, and reads all the keys of the map, checking that they are sorted
+  private *getMerkleizedMap(commitment: Buffer): Flow<MerkleizedMap> {
+    const req = new BufferReader(commitment);
+    const map: MerkleizedMap = {
+      size: readNumber(req),
+      keysRoot: req.readSlice(32),
+      valuesRoot: req.readSlice(32),
+      keys: [],
+    };
+    assertEmpty(req);
+    for (let i = 0; i < map.size; i++) {
+      const key = yield* this.getMerkleLeafElement(map.keysRoot, map.size, i);
+      if (
+        map.keys.length > 0 &&
+        Buffer.compare(map.keys[map.keys.length - 1], key) >= 0
+      ) {
+        throw new Error("The keys of the map are not sorted");
+      }
+      map.keys.push(key);
+    }
+    return map;
+  }
+
+  private *getMerkleizedMapAt(
+    root: Buffer,
+    size: number,
+    index: number
+  ): Flow<MerkleizedMap> {
+    const commitment = yield* this.getMerkleLeafElement(root, size, index);
+    return yield* this.getMerkleizedMap(commitment);
+  }
+
+  private *getMerkleizedMapValue(
+    map: MerkleizedMap,
+    key: Buffer
+  ): Flow<Buffer | undefined> {
+    // the keys were all read with the map; only the index of the present ones is asked to the client
+    if (!map.keys.some((k) => k.equals(key))) {
+      return undefined;
+    }
+    const index = yield* this.getMerkleLeafIndex(
+      map.keysRoot,
+      map.size,
+      hashLeaf(key)
+    );
+    if (index === undefined) {
+      return undefined;
+    }
+    return yield* this.getMerkleLeafElement(map.valuesRoot, map.size, index);
+  }
+
+  private *yieldResults(
+    results: readonly Buffer[],
+    clientCapabilities: number
+  ): Flow<void> {
+    if (clientCapabilities & ClientCapability.BATCHED_YIELD) {
+      yield Buffer.concat([
+        Buffer.from([ClientCommandCode.YIELD, results.length]),
+        ...results.map((r) => Buffer.concat([Buffer.from([r.length]), r])),
+      ]);
+    } else {
+      for (const r of results) {
+        yield Buffer.concat([Buffer.from([ClientCommandCode.YIELD]), r]);
+      }
+    }
+  }
+
+  // Wallet policies
+
+  // Parses the wallet policy and returns its keys information
+  private *loadWallet(serializedWallet: Buffer): Flow<Buffer[]> {
+    const wallet = new BufferReader(serializedWallet);
+    wallet.readUInt8(); // type
+    wallet.readSlice(wallet.readUInt8()); // name
+    wallet.readVarSlice(); // policy map
+    const nKeys = readNumber(wallet);
+    const keysRoot = wallet.readSlice(32);
+    assertEmpty(wallet);
+
+    const keysInfo: Buffer[] = [];
+    for (let i = 0; i < nKeys; i++) {
+      keysInfo.push(yield* this.getMerkleLeafElement(keysRoot, nKeys, i));
+    }
+    return keysInfo;
+  }
+
+  // eslint-disable-next-line require-yield
+  private *getPubkey(req: BufferReader): Flow<Buffer> {
+    req.readUInt8(); // display
+    const path = req.readSlice(4 * req.readUInt8());
+    assertEmpty(req);
+
+    // a placeholder for the xpub
+    const xpub = crypto.sha256(Buffer.concat([Buffer.from("xpub"), path]));
+    return Buffer.from(xpub.toString("hex"), "ascii");
+  }
+
+  // eslint-disable-next-line require-yield
+  private *getMasterFingerprint(req: BufferReader): Flow<Buffer> {
+    assertEmpty(req);
+    return this.hmacKey.subarray(0, 4);
+  }
+
+  private walletHmac(walletId: Buffer): Buffer {
+    return createHmac("sha256", this.hmacKey).update(walletId).digest();
+  }
+
+  private *registerWallet(req: BufferReader): Flow<Buffer> {
+    const serializedWallet = req.readVarSlice();
+    assertEmpty(req);
+
+    yield* this.loadWallet(serializedWallet);
+
+    const walletId = crypto.sha256(serializedWallet);
+    return Buffer.concat([walletId, this.walletHmac(walletId)]);
+  }
+
+  private *getWalletAddress(req: BufferReader): Flow<Buffer> {
+    req.readUInt8(); // display
+    const walletId = req.readSlice(32);
+    req.readSlice(32); // wallet hmac
+    const changeAndIndex = req.readSlice(1 + 4);
+    assertEmpty(req);
+
+    const serializedWallet = yield* this.getPreimage(walletId);
+    yield* this.loadWallet(serializedWallet);
+
+    // a placeholder for the address
+    const address = crypto.sha256(Buffer.concat([walletId, changeAndIndex]));
+    return Buffer.from(address.toString("hex"), "ascii");
+  }
+
+  // SIGN_PSBT
+
+  private *signPsbt(req: BufferReader, clientCapabilities: number): Flow<Buffer> {
+    const globalCommitment = Buffer.concat([
+      createVarint(req.readVarInt()),
+      req.readSlice(64),
+    ]);
+    const nInputs = readNumber(req);
+    const inputsRoot = req.readSlice(32);
+    const nOutputs = readNumber(req);
+    const outputsRoot = req.readSlice(32);
+    const walletId = req.readSlice(32);
+    req.readSlice(32); // wallet hmac
+    // the selected inputs and the checkpoint, if any, are ignored: all the inputs are signed
+
+    const serializedWallet = yield* this.getPreimage(walletId);
+    yield* this.loadWallet(serializedWallet);
+
+    const globalMap = yield* this.getMerkleizedMap(globalCommitment);
+    const isPsbtV0 =
+      (yield* this.getMerkleizedMapValue(
+        globalMap,
+        keyOfType(PSBT_GLOBAL_UNSIGNED_TX)
+      )) !== undefined;
+    if (!isPsbtV0) {
+      yield* this.getMerkleizedMapValue(
+        globalMap,
+        keyOfType(PSBT_GLOBAL_TX_VERSION)
+      );
+      yield* this.getMerkleizedMapValue(
+        globalMap,
+        keyOfType(PSBT_GLOBAL_FALLBACK_LOCKTIME)
+      );
+    }
+
+    // first pass: the inputs and the outputs are validated
+    for (let i = 0; i < nInputs; i++) {
+      const inputMap = yield* this.getMerkleizedMapAt(inputsRoot, nInputs, i);
+      yield* this.getInputUtxo(inputMap);
+      for (const key of [
+        keyOfType(PSBT_IN_SIGHASH_TYPE),
+        firstKey(inputMap, PSBT_IN_BIP32_DERIVATION),
+      ]) {
+        yield* this.getMerkleizedMapValue(inputMap, key);
+      }
+    }
+
+    for (let i = 0; i < nOutputs; i++) {
+      const outputMap = yield* this.getMerkleizedMapAt(
+        outputsRoot,
+        nOutputs,
+        i
+      );
+      const keys = [firstKey(outputMap, PSBT_OUT_BIP32_DERIVATION)];
+      if (!isPsbtV0) {
+        keys.push(keyOfType(PSBT_OUT_AMOUNT), keyOfType(PSBT_OUT_SCRIPT));
+      }
+      for (const key of keys) {
+        yield* this.getMerkleizedMapValue(outputMap, key);
+      }
+    }
+
+    // second pass: each input is signed
+    for (let i = 0; i < nInputs; i++) {
+      const inputMap = yield* this.getMerkleizedMapAt(inputsRoot, nInputs, i);
+      yield* this.getInputUtxo(inputMap);
+
+      // a placeholder for the signature, with the length of a DER-encoded ECDSA signature and its sighash byte
+      const h = crypto.sha256(
+        Buffer.concat([inputMap.keysRoot, inputMap.valuesRoot])
+      );
+      const signature = Buffer.concat([
+        Buffer.concat([h, h, h]).subarray(0, 71),
+        Buffer.from([0x01]),
+      ]);
+      yield* this.yieldResults(
+        [Buffer.concat([createVarint(i), signature])],
+        clientCapabilities
+      );
+    }
+
+    return Buffer.alloc(0);
+  }
+
+  private *getInputUtxo(inputMap: MerkleizedMap): Flow<void> {
+    yield* this.getMerkleizedMapValue(
+      inputMap,
+      keyOfType(PSBT_IN_WITNESS_UTXO)
+    );
+    yield* this.getMerkleizedMapValue(
+      inputMap,
+      keyOfType(PSBT_IN_NON_WITNESS_UTXO)
+    );
+  }
+}
+
+const BENCHMARK_N_INPUTS = [100, 1000];
+
+const wallet = new DefaultWalletPolicy(
+  "wpkh(@0)",
+  "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**"
+);
+
+const H = 0x80000000;
+
+// A segwit v0 psbt spending nInputs outputs of wallet, with a payment and a change output
+function makePsbt(nInputs: number): PsbtV2 {
+  const fingerprint = Buffer.from("f5acc2fd", "hex");
+  const pubkey = (i: number) =>
+    Buffer.concat([Buffer.from([0x02]), crypto.sha256(createVarint(i))]);
+  const amount = (value: number) => {
+    const buf = Buffer.alloc(8);
+    buf.writeUInt32LE(value, 0);
+    return buf;
+  };
+  const p2wpkh = (pk: Buffer) =>
+    Buffer.concat([Buffer.from([0x00, 0x14]), crypto.hash160(pk)]);
+
+  const psbt = new PsbtV2();
+  psbt.setGlobalPsbtVersion(2);
+  psbt.setGlobalTxVersion(2);
+  psbt.setGlobalFallbackLocktime(0);
+  psbt.setGlobalInputCount(nInputs);
+  psbt.setGlobalOutputCount(2);
+  for (let i = 0; i < nInputs; i++) {
+    psbt.setInputPreviousTxId(i, crypto.sha256(Buffer.from(`tx ${i}`)));
+    psbt.setInputOutputIndex(i, i % 2);
+    psbt.setInputSequence(i, 0xfffffffd);
+    psbt.setInputWitnessUtxo(i, amount(10000 + 10000 * i), p2wpkh(pubkey(i)));
+    psbt.setInputBip32Derivation(i, pubkey(i), fingerprint, [
+      84 + H,
+      1 + H,
+      0 + H,
+      0,
+      i,
+    ]);
+  }
+  psbt.setOutputAmount(0, 999);
+  psbt.setOutputScript(0, p2wpkh(crypto.sha256(Buffer.from("payment"))));
+  psbt.setOutputAmount(1, 1099);
+  psbt.setOutputScript(1, p2wpkh(pubkey(nInputs)));
+  psbt.setOutputBip32Derivation(1, pubkey(nInputs), fingerprint, [
+    84 + H,
+    1 + H,
+    0 + H,
+    1,
+    0,
+  ]);
+  return psbt;
+}
+
+describe("ProtocolSimulator", () => {
+  it("registers a wallet and returns its addresses", async () => {
+    const simulator = new ProtocolSimulator();
+    const client = new AppClient(simulator.asTransport());
+    const multisig = new WalletPolicy("Cold storage", "wsh(sortedmulti(2,@0,@1))", [
+      "[76223a6e/48'/1'/0'/2']tpubDE7NQymr4AFtewpAsWtnreyq9ghkzQBXpCZjWLFVRAvnbf7vya2eMTvT2fPapNqL8SuVvLQdbUbMfWLVDCZKnsEBqp6UK93QEzL8Ck23AwF/**",
+      "[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK/**",
+    ]);
+
+    const [walletId, walletHmac] = await client.registerWallet(multisig);
+    expect(walletId).toEqual(multisig.getId());
+    expect(walletHmac.length).toEqual(32);
+
+    expect(
+      await client.getWalletAddress(multisig, walletHmac, 0, 3, false)
+    ).not.toEqual(await client.getWalletAddress(multisig, walletHmac, 0, 4, false));
+    expect(simulator.clientCommands.get("GET_MERKLE_LEAF_PROOF")).toEqual(
+      3 * multisig.keys.length
+    );
+  });
+
+  it("serves repeated requests from the request cache", async () => {
+    const cache = new RequestCache();
+    const simulator = new ProtocolSimulator();
+    const client = new AppClient(simulator.asTransport(), { requestCache: cache });
+
+    const address = await client.getWalletAddress(wallet, null, 0, 3, false);
+    expect(await client.getWalletAddress(wallet, null, 0, 3, false)).toEqual(address);
+    expect(simulator.commands.get("GET_WALLET_ADDRESS")).toEqual(1);
+
+    // another address, or an address shown on the screen, is requested to the device
+    await client.getWalletAddress(wallet, null, 0, 4, false);
+    expect(await client.getWalletAddress(wallet, null, 0, 3, true)).toEqual(address);
+    expect(simulator.commands.get("GET_WALLET_ADDRESS")).toEqual(3);
+
+    const xpub = await client.getExtendedPubkey("m/84'/1'/0'");
+    expect(await client.getExtendedPubkey("m/84'/1'/0'")).toEqual(xpub);
+    expect(simulator.commands.get("GET_PUBKEY")).toEqual(1);
+    expect(simulator.commands.get("GET_MASTER_FINGERPRINT")).toEqual(1);
+
+    // the results of a device with another seed are not shared, even with the same cache
+    const otherSimulator = new ProtocolSimulator(MAX_RESPONSE_LEN, Buffer.alloc(32, 1));
+    const otherClient = new AppClient(otherSimulator.asTransport(), { requestCache: cache });
+    await otherClient.getWalletAddress(wallet, null, 0, 3, false);
+    expect(otherSimulator.commands.get("GET_WALLET_ADDRESS")).toEqual(1);
+  });
+
+  it("merges concurrent identical requests", async () => {
+    const simulator = new ProtocolSimulator();
+    const client = new AppClient(simulator.asTransport(), { requestCache: new RequestCache() });
+
+    const addresses = await Promise.all(
+      [...Array(5).keys()].map(() => client.getWalletAddress(wallet, null, 1, 7, false))
+    );
+
+    expect(new Set(addresses).size).toEqual(1);
+    expect(simulator.commands.get("GET_WALLET_ADDRESS")).toEqual(1);
+    expect(simulator.commands.get("GET_MASTER_FINGERPRINT")).toEqual(1);
+  });
+
+  for (const maxResponseLen of [64, 255]) {
+    it(`signs a psbt with max response length ${maxResponseLen}`, async () => {
+      const simulator = new ProtocolSimulator(maxResponseLen);
+      const client = new AppClient(simulator.asTransport());
+
+      const result = await client.signPsbt(makePsbt(10), wallet, null);
+
+      expect([...result.keys()].sort((a, b) => a - b)).toEqual([...Array(10).keys()]);
+      if (maxResponseLen == 64) {
+        // the key information does not fit in a single response
+        expect(simulator.clientCommands.get("GET_MORE_ELEMENTS")).toBeGreaterThan(0);
+      }
+    });
+  }
+
+  it("signs a psbt with more than 252 inputs", async () => {
+    // the indexes of the yielded signatures are varints longer than one byte
+    const simulator = new ProtocolSimulator();
+    const client = new AppClient(simulator.asTransport());
+
+    const result = await client.signPsbt(makePsbt(300), wallet, null);
+
+    expect([...result.keys()].sort((a, b) => a - b)).toEqual([...Array(300).keys()]);
+  });
+
+  for (const nInputs of BENCHMARK_N_INPUTS) {
+    (process.env.BENCHMARK ? it : it.skip)(`benchmark: signs a psbt with ${nInputs} inputs`, async () => {
+      const simulator = new ProtocolSimulator();
+      let exchanges = 0;
+      let hostMs = 0;
+      const client = new AppClient(simulator.asTransport(), {
+        onExchange: (stats) => {
+          exchanges++;
+          hostMs += stats.hostMs;
+        },
+      });
+      const psbt = makePsbt(nInputs);
+
+      const start = Date.now();
+      const result = await client.signPsbt(psbt, wallet, null);
+      const totalMs = Date.now() - start;
+
+      expect(result.size).toEqual(nInputs);
+      console.log(
+        `sign_psbt_simulator: ${nInputs} inputs, ${exchanges} APDUs, ${totalMs} ms (${hostMs.toFixed(0)} ms on the host)`
+      );
+    }, 600000);
+  }
+});
@@ -1,7 +1,24 @@
-import AppClient from './lib/appClient';
+import AppClient, { AppClientOptions, ExchangeStats } from './lib/appClient';
 import { DefaultWalletPolicy, WalletPolicy } from './lib/policy';
+import {
+  PreparedPsbt,
+  PsbtWorker,
+  preparePsbtInWorker,
+  registerPsbtWorker,
+} from './lib/preparedPsbt';
 import { PsbtV2 } from './lib/psbtv2';
+import { RequestCache } from './lib/requestCache';
 
-export { AppClient, PsbtV2, DefaultWalletPolicy, WalletPolicy };
+export {
+  AppClient,
+  PsbtV2,
+  DefaultWalletPolicy,
+  WalletPolicy,
+  PreparedPsbt,
+  preparePsbtInWorker,
+  registerPsbtWorker,
+  RequestCache,
+};
+export type { AppClientOptions, ExchangeStats, PsbtWorker };
 
 export default AppClient;
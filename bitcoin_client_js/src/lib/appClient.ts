@@ -1,12 +1,18 @@
 import Transport from '@ledgerhq/hw-transport';
 
 import { pathElementsToBuffer, pathStringToArray } from './bip32';
-import { ClientCommandInterpreter } from './clientCommands';
-import { MerkelizedPsbt } from './merkelizedPsbt';
+import {
+  ClientCapability,
+  ClientCommandInterpreter,
+  MAX_RESPONSE_LEN,
+  MIN_RESPONSE_LEN,
+} from './clientCommands';
 import { hashLeaf, Merkle } from './merkle';
 import { WalletPolicy } from './policy';
+import { PreparedPsbt } from './preparedPsbt';
 import { PsbtV2 } from './psbtv2';
-import { createVarint } from './varint';
+import { RequestCache } from './requestCache';
+import { createVarint, parseVarint, sanitizeBigintToNumber } from './varint';
 
 const CLA_BTC = 0xe1;
 const CLA_FRAMEWORK = 0xf8;
@@ -22,6 +28,49 @@ enum BitcoinIns {
 
 enum FrameworkIns {
   CONTINUE_INTERRUPTED = 0x01,
+  GET_MAX_RESPONSE_LEN = 0x02,
+}
+
+// P1 of CONTINUE_INTERRUPTED when speculative responses follow the response
+const P1_CONTINUE_SPECULATIVE = 0x01;
+
+/**
+ * The statistics of an APDU exchanged with the device by the AppClient.
+ */
+export interface ExchangeStats {
+  readonly cla: number;
+  readonly ins: number;
+  /** bytes sent, including the 5-byte APDU header */
+  readonly sentBytes: number;
+  /** bytes received, including the 2-byte status word */
+  readonly receivedBytes: number;
+  /** time between sending the APDU and receiving its response, in milliseconds */
+  readonly roundTripMs: number;
+  /** time spent on the host to prepare the APDU (for CONTINUE, to execute the client command) */
+  readonly hostMs: number;
+}
+
+export interface AppClientOptions {
+  /**
+   * If true, the responses to the client commands that the device is expected to send next are
+   * computed in advance and sent together with each response, if the device supports it; each
+   * of them saves a roundtrip with the device.
+   */
+  readonly pipelined?: boolean;
+  /** called after each APDU exchanged with the device, with its statistics */
+  readonly onExchange?: (stats: ExchangeStats) => void;
+  /**
+   * If set, the results of `getExtendedPubkey` and `getWalletAddress` are cached in it, unless
+   * they are shown on the screen; identical requests in flight share a single exchange with the
+   * device. It can be shared among the clients of different devices.
+   */
+  readonly requestCache?: RequestCache;
+}
+
+function now(): number {
+  // performance.now() is available in browsers and in recent versions of node
+  const perf = (globalThis as { performance?: { now(): number } }).performance;
+  return perf ? perf.now() : Date.now();
 }
 
 /**
@@ -31,43 +80,162 @@ enum FrameworkIns {
 export class AppClient {
   readonly transport: Transport;
 
-  constructor(transport: Transport) {
+  private readonly options: AppClientOptions;
+
+  private maxResponseLen?: number;
+  private maxSpeculativeLen = 0;
+  // the master fingerprint of the device, queried once for the keys of the request cache
+  private masterFingerprint?: Promise<string>;
+
+  /**
+   * @param transport the transport of the device
+   * @param options the options of the communication with the device
+   */
+  constructor(transport: Transport, options: AppClientOptions = {}) {
     this.transport = transport;
+    this.options = options;
+  }
+
+  /**
+   * Returns the maximum length of a response to a client command supported by the device.
+   * The device is only queried the first time; versions of the app that do not support the
+   * GET_MAX_RESPONSE_LEN command are assumed to support responses up to 255 bytes.
+   */
+  private async getMaxResponseLen(): Promise<number> {
+    if (this.maxResponseLen === undefined) {
+      let maxResponseLen = MAX_RESPONSE_LEN;
+      try {
+        const response = await this.transport.send(
+          CLA_FRAMEWORK,
+          FrameworkIns.GET_MAX_RESPONSE_LEN,
+          0,
+          0
+        );
+        if (response.length >= 2 + 2) {
+          maxResponseLen = Math.max(
+            MIN_RESPONSE_LEN,
+            Math.min(response.readUInt16BE(0), MAX_RESPONSE_LEN)
+          );
+        }
+        if (response.length >= 3 + 2) {
+          this.maxSpeculativeLen = response[2];
+        }
+      } catch (e) {
+        // not supported by the device, keep the default
+      }
+      this.maxResponseLen = maxResponseLen;
+    }
+    return this.maxResponseLen;
+  }
+
+  /**
+   * Returns the result of the request identified by `key`, from the request cache if it is in the
+   * options and it has the result of the same request to the same device; otherwise, requests it
+   * with `compute`.
+   */
+  private async cachedRequest(
+    key: string,
+    compute: () => Promise<string>
+  ): Promise<string> {
+    const cache = this.options.requestCache;
+    if (!cache) {
+      return compute();
+    }
+    if (this.masterFingerprint === undefined) {
+      this.masterFingerprint = this.getMasterFingerprint();
+      this.masterFingerprint.catch(() => {
+        this.masterFingerprint = undefined; // queried again at the next request
+      });
+    }
+    return cache.run(`${await this.masterFingerprint}/${key}`, compute);
   }
 
   private async makeRequest(
     ins: BitcoinIns,
     data: Buffer,
-    cci?: ClientCommandInterpreter
+    cci?: ClientCommandInterpreter,
+    clientCapabilities: number = 0
   ): Promise<Buffer> {
-    let response: Buffer = await this.transport.send(
+    const pipelined = cci != undefined && this.options.pipelined === true;
+    const maxResponseLen = pipelined ? await this.getMaxResponseLen() : 0;
+
+    let response: Buffer = await this.exchange(
       CLA_BTC,
       ins,
       0,
-      0,
+      clientCapabilities,
       data,
-      [0x9000, 0xe000]
+      0
     );
     while (response.readUInt16BE(response.length - 2) === 0xe000) {
       if (!cci) {
         throw new Error('Unexpected SW_INTERRUPTED_EXECUTION');
       }
 
+      const start = now();
       const hwRequest = response.slice(0, -2);
       const commandResponse = cci.execute(hwRequest);
 
-      response = await this.transport.send(
+      let p1 = 0;
+      let continueData = commandResponse;
+      if (pipelined) {
+        const speculativeResponses = cci.getSpeculativeResponses(
+          Math.min(
+            this.maxSpeculativeLen,
+            maxResponseLen - 1 - commandResponse.length
+          )
+        );
+        if (speculativeResponses.length > 0) {
+          p1 = P1_CONTINUE_SPECULATIVE;
+          continueData = Buffer.concat([
+            Buffer.from([commandResponse.length]),
+            commandResponse,
+            speculativeResponses,
+          ]);
+        }
+      }
+
+      response = await this.exchange(
         CLA_FRAMEWORK,
         FrameworkIns.CONTINUE_INTERRUPTED,
+        p1,
         0,
-        0,
-        commandResponse,
-        [0x9000, 0xe000]
+        continueData,
+        now() - start
       );
     }
     return response.slice(0, -2); // drop the status word (can only be 0x9000 at this point)
   }
 
+  /**
+   * Sends an APDU, accepting the status words 0x9000 and 0xe000, and reports its statistics
+   * to the onExchange callback, if any.
+   */
+  private async exchange(
+    cla: number,
+    ins: number,
+    p1: number,
+    p2: number,
+    data: Buffer,
+    hostMs: number
+  ): Promise<Buffer> {
+    const start = now();
+    const response = await this.transport.send(cla, ins, p1, p2, data, [
+      0x9000, 0xe000,
+    ]);
+    if (this.options.onExchange) {
+      this.options.onExchange({
+        cla,
+        ins,
+        sentBytes: 5 + data.length,
+        receivedBytes: response.length,
+        roundTripMs: now() - start,
+        hostMs,
+      });
+    }
+    return response;
+  }
+
   /**
    * Requests the BIP-32 extended pubkey to the hardware wallet.
    * If `display` is `false`, only standard paths will be accepted; an error is returned if an unusual path is
@@ -87,14 +255,20 @@ export class AppClient {
     if (pathElements.length > 6) {
       throw new Error('Path too long. At most 6 levels allowed.');
     }
-    const response = await this.makeRequest(
-      BitcoinIns.GET_PUBKEY,
-      Buffer.concat([
-        Buffer.from(display ? [1] : [0]),
-        pathElementsToBuffer(pathElements),
-      ])
-    );
-    return response.toString('ascii');
+    const request = async () => {
+      const response = await this.makeRequest(
+        BitcoinIns.GET_PUBKEY,
+        Buffer.concat([
+          Buffer.from(display ? [1] : [0]),
+          pathElementsToBuffer(pathElements),
+        ])
+      );
+      return response.toString('ascii');
+    };
+    if (display) {
+      return request();
+    }
+    return this.cachedRequest(`xpub/${pathElements.join('/')}`, request);
   }
 
   /**
@@ -111,7 +285,10 @@ export class AppClient {
   ): Promise<readonly [Buffer, Buffer]> {
     const serializedWalletPolicy = walletPolicy.serialize();
 
-    const clientInterpreter = new ClientCommandInterpreter();
+    const clientInterpreter = new ClientCommandInterpreter(
+      undefined,
+      await this.getMaxResponseLen()
+    );
     clientInterpreter.addKnownPreimage(serializedWalletPolicy);
     clientInterpreter.addKnownList(
       walletPolicy.keys.map((k) => Buffer.from(k, 'ascii'))
@@ -162,99 +339,134 @@ export class AppClient {
       throw new Error('Invalid HMAC length');
     }
 
-    const clientInterpreter = new ClientCommandInterpreter();
-    clientInterpreter.addKnownList(
-      walletPolicy.keys.map((k) => Buffer.from(k, 'ascii'))
-    );
-    clientInterpreter.addKnownPreimage(walletPolicy.serialize());
-
-    const addressIndexBuffer = Buffer.alloc(4);
-    addressIndexBuffer.writeUInt32BE(addressIndex, 0);
+    const request = async () => {
+      const clientInterpreter = new ClientCommandInterpreter(
+        undefined,
+        await this.getMaxResponseLen()
+      );
+      clientInterpreter.addKnownList(
+        walletPolicy.keys.map((k) => Buffer.from(k, 'ascii'))
+      );
+      clientInterpreter.addKnownPreimage(walletPolicy.serialize());
+
+      const addressIndexBuffer = Buffer.alloc(4);
+      addressIndexBuffer.writeUInt32BE(addressIndex, 0);
+
+      const response = await this.makeRequest(
+        BitcoinIns.GET_WALLET_ADDRESS,
+        Buffer.concat([
+          Buffer.from(display ? [1] : [0]),
+          walletPolicy.getId(),
+          walletHMAC || Buffer.alloc(32, 0),
+          Buffer.from([change]),
+          addressIndexBuffer,
+        ]),
+        clientInterpreter
+      );
 
-    const response = await this.makeRequest(
-      BitcoinIns.GET_WALLET_ADDRESS,
-      Buffer.concat([
-        Buffer.from(display ? [1] : [0]),
-        walletPolicy.getId(),
-        walletHMAC || Buffer.alloc(32, 0),
-        Buffer.from([change]),
-        addressIndexBuffer,
-      ]),
-      clientInterpreter
+      return response.toString('ascii');
+    };
+    if (display) {
+      return request();
+    }
+    const hmacHex = walletHMAC ? walletHMAC.toString('hex') : '';
+    return this.cachedRequest(
+      `address/${walletPolicy.getId().toString('hex')}/${hmacHex}/${change}/${addressIndex}`,
+      request
     );
+  }
 
-    return response.toString('ascii');
+  /**
+   * Prepares a psbt for signing with a (standard or registered) `WalletPolicy`, computing all the Merkle trees
+   * that the device can query. The result can be passed to `signPsbt` any number of times (for example, to retry
+   * after an error, or to sign on several devices), and saved with its `serialize` method; only host-side work is
+   * done, without communicating with the device.
+   * @param psbt an instance of `PsbtV2`
+   * @param walletPolicy the `WalletPolicy` that will be used for signing
+   * @returns the `PreparedPsbt`
+   */
+  preparePsbt(psbt: PsbtV2, walletPolicy: WalletPolicy): PreparedPsbt {
+    return PreparedPsbt.fromPsbt(psbt, walletPolicy);
   }
 
   /**
    * Signs a psbt using a (standard or registered) `WalletPolicy`. This is an interactive command, as user validation
    * is necessary using the device's secure screen.
    * On success, a map of input indexes and signatures is returned.
-   * @param psbt an instance of `PsbtV2`
+   * @param psbt an instance of `PsbtV2`, or the same PSBT prepared with `preparePsbt` or `preparePsbtInWorker`
    * @param walletPolicy the `WalletPolicy` to use for signing
    * @param walletHMAC the 32-byte hmac obtained during wallet policy registration, or `null` for a standard policy
    * @param progressCallback optionally, a callback that will be called every time a signature is produced during
    * the signing process. The callback does not receive any argument, but can be used to track progress.
+   * @param onSignature optionally, a callback that receives each signature as soon as the device produces it,
+   * while the device keeps signing the other inputs; for example, to start combining it with the signatures of
+   * other cosigners. If it throws, signing is aborted.
    * @returns a map from numbers to signatures. For each input index `i` that is a key of the returned map, the
    * corresponding value is the signature for the `i`-th input of the `psbt`.
    */
   async signPsbt(
-    psbt: PsbtV2,
+    psbt: PsbtV2 | PreparedPsbt,
     walletPolicy: WalletPolicy,
     walletHMAC: Buffer | null,
-    progressCallback?: () => void
+    progressCallback?: () => void,
+    onSignature?: (inputIndex: number, signature: Buffer) => void
   ): Promise<Map<number, Buffer>> {
-    const merkelizedPsbt = new MerkelizedPsbt(psbt);
+    let preparedPsbt =
+      psbt instanceof PreparedPsbt
+        ? psbt
+        : PreparedPsbt.fromPsbt(psbt, walletPolicy);
+    if (!preparedPsbt.walletId) {
+      preparedPsbt = preparedPsbt.withWalletPolicy(walletPolicy);
+    } else if (!preparedPsbt.walletId.equals(walletPolicy.getId())) {
+      throw new Error('The PSBT was prepared for a different wallet policy');
+    }
 
     if (walletHMAC != null && walletHMAC.length != 32) {
       throw new Error('Invalid HMAC length');
     }
 
-    const clientInterpreter = new ClientCommandInterpreter(progressCallback);
+    // the host storage capability is not supported by this client
+    const clientCapabilities = ClientCapability.BATCHED_YIELD;
 
-    // prepare ClientCommandInterpreter
-    clientInterpreter.addKnownList(
-      walletPolicy.keys.map((k) => Buffer.from(k, 'ascii'))
-    );
-    clientInterpreter.addKnownPreimage(walletPolicy.serialize());
+    const ret: Map<number, Buffer> = new Map();
+    const onYield = (inputAndSig: Buffer) => {
+      // the input index is a varint
+      const [index, indexLen] = parseVarint(inputAndSig, 0);
+      const inputIndex = sanitizeBigintToNumber(index);
+      const signature = inputAndSig.slice(indexLen);
+      ret.set(inputIndex, signature);
+      if (progressCallback) {
+        progressCallback();
+      }
+      if (onSignature) {
+        onSignature(inputIndex, signature);
+      }
+    };
 
-    clientInterpreter.addKnownMapping(merkelizedPsbt.globalMerkleMap);
-    for (const map of merkelizedPsbt.inputMerkleMaps) {
-      clientInterpreter.addKnownMapping(map);
-    }
-    for (const map of merkelizedPsbt.outputMerkleMaps) {
-      clientInterpreter.addKnownMapping(map);
-    }
+    const clientInterpreter = new ClientCommandInterpreter(
+      onYield,
+      await this.getMaxResponseLen(),
+      clientCapabilities
+    );
 
-    clientInterpreter.addKnownList(merkelizedPsbt.inputMapCommitments);
-    const inputMapsRoot = new Merkle(
-      merkelizedPsbt.inputMapCommitments.map((m) => hashLeaf(m))
-    ).getRoot();
-    clientInterpreter.addKnownList(merkelizedPsbt.outputMapCommitments);
-    const outputMapsRoot = new Merkle(
-      merkelizedPsbt.outputMapCommitments.map((m) => hashLeaf(m))
-    ).getRoot();
+    // prepare ClientCommandInterpreter
+    preparedPsbt.addTo(clientInterpreter);
 
     await this.makeRequest(
       BitcoinIns.SIGN_PSBT,
       Buffer.concat([
-        merkelizedPsbt.getGlobalKeysValuesRoot(),
-        createVarint(merkelizedPsbt.getGlobalInputCount()),
-        inputMapsRoot,
-        createVarint(merkelizedPsbt.getGlobalOutputCount()),
-        outputMapsRoot,
+        preparedPsbt.globalCommitment,
+        createVarint(preparedPsbt.inputCount),
+        preparedPsbt.inputsRoot,
+        createVarint(preparedPsbt.outputCount),
+        preparedPsbt.outputsRoot,
         walletPolicy.getId(),
         walletHMAC || Buffer.alloc(32, 0),
       ]),
-      clientInterpreter
+      clientInterpreter,
+      clientCapabilities
     );
 
-    const yielded = clientInterpreter.getYielded();
-
-    const ret: Map<number, Buffer> = new Map();
-    for (const inputAndSig of yielded) {
-      ret.set(inputAndSig[0], inputAndSig.slice(1));
-    }
     return ret;
   }
 
@@ -284,7 +496,10 @@ export class AppClient {
   ): Promise<string> {
     const pathElements = pathStringToArray(path);
 
-    const clientInterpreter = new ClientCommandInterpreter();
+    const clientInterpreter = new ClientCommandInterpreter(
+      undefined,
+      await this.getMaxResponseLen()
+    );
 
     // prepare ClientCommandInterpreter
     const nChunks = Math.ceil(message.length / 64);
@@ -1,18 +1,224 @@
 import { crypto } from 'bitcoinjs-lib';
 
 import { BufferReader } from './buffertools';
-import { hashLeaf, Merkle } from './merkle';
+import { hashKey, hashLeaf, Merkle } from './merkle';
 import { MerkleMap } from './merkleMap';
 import { createVarint, sanitizeBigintToNumber } from './varint';
 
+// Maximum length of a response to a client command, unless the device advertises a smaller one
+export const MAX_RESPONSE_LEN = 255;
+
+// Smallest supported maximum response length (enough for at least one 32-byte hash per message)
+export const MIN_RESPONSE_LEN = 34;
+
 enum ClientCommandCode {
   YIELD = 0x10,
   GET_PREIMAGE = 0x40,
   GET_MERKLE_LEAF_PROOF = 0x41,
   GET_MERKLE_LEAF_INDEX = 0x42,
+  GET_MERKLE_MULTIPROOF = 0x43,
+  GET_MERKLEIZED_MAP_VALUE = 0x44,
   GET_MORE_ELEMENTS = 0xa0,
 }
 
+/**
+ * Bits of the P2 field of the commands, declaring the optional features supported by the client.
+ */
+export enum ClientCapability {
+  HOST_STORAGE = 0x01,
+  BATCHED_YIELD = 0x02,
+}
+
+/**
+ * The preimages known to the client, mapped by the hashKey of their sha256
+ * hash.
+ *
+ * The preimages of the leaves of the lists added with addList are not stored:
+ * each is computed when it is requested, and the leaves are only indexed when
+ * a preimage is first not found, one list at a time. Therefore, preparing a
+ * list does not copy its elements.
+ */
+export class KnownPreimages {
+  private readonly preimages: Map<string, Buffer> = new Map();
+  // hashKey of the leaf hash => element, for the lists indexed so far
+  private readonly leaves: Map<string, Buffer> = new Map();
+  private readonly lists: {
+    readonly elements: readonly Buffer[];
+    readonly tree: Merkle;
+  }[] = [];
+  // number of lists already indexed in leaves
+  private indexedLists = 0;
+
+  add(preimage: Buffer): void {
+    this.preimages.set(hashKey(crypto.sha256(preimage)), preimage);
+  }
+
+  /**
+   * Adds the preimages of the leaves of tree, whose hashes are the hashLeaf
+   * of elements.
+   */
+  addList(elements: readonly Buffer[], tree: Merkle): void {
+    this.lists.push({ elements, tree });
+  }
+
+  get(key: string): Buffer | undefined {
+    const preimage = this.preimages.get(key);
+    if (preimage !== undefined) {
+      return preimage;
+    }
+
+    let element = this.leaves.get(key);
+    while (element === undefined && this.indexedLists < this.lists.length) {
+      const { elements, tree } = this.lists[this.indexedLists++];
+      for (let i = 0; i < elements.length; i++) {
+        this.leaves.set(hashKey(tree.getLeafHash(i)), elements[i]);
+      }
+      element = this.leaves.get(key);
+    }
+    return element && Buffer.concat([Buffer.from([0]), element]);
+  }
+}
+
+/**
+ * The queue of the elements returned by GET_MORE_ELEMENTS.
+ *
+ * Consecutive elements are stored as a single buffer: all the elements of a buffer have the same
+ * length, except possibly the last one, that can be shorter. Each response is sliced from the
+ * buffer when it is sent, so that the queue does not hold one buffer per element, and each
+ * GET_MORE_ELEMENTS takes constant time.
+ */
+export class ElementQueue {
+  private segments: { data: Buffer; elementLen: number }[] = [];
+  private offset = 0; // offset of the next element in the first segment
+
+  /**
+   * Adds to the queue the elements of elementLen bytes in data (the last one can be shorter).
+   */
+  push(data: Buffer, elementLen: number): void {
+    if (data.length > 0) {
+      this.segments.push({ data, elementLen });
+    }
+  }
+
+  /**
+   * Adds to the queue a buffer, in chunks each filling a whole response to GET_MORE_ELEMENTS
+   * (except possibly the last one).
+   */
+  pushChunks(data: Buffer, max_response_len: number): void {
+    // 2 bytes for the number and the length of the elements
+    this.push(data, max_response_len - 2);
+  }
+
+  /**
+   * Adds to the queue a list of 32-byte hashes.
+   */
+  pushHashes(hashes: Buffer[]): void {
+    this.push(Buffer.concat(hashes), 32);
+  }
+
+  isEmpty(): boolean {
+    return this.segments.length === 0;
+  }
+
+  clear(): void {
+    this.segments = [];
+    this.offset = 0;
+  }
+
+  /**
+   * Removes from the queue the next elements, as many as fit in a response of max_response_len
+   * bytes, and returns the response to GET_MORE_ELEMENTS.
+   */
+  popResponse(max_response_len: number): Buffer {
+    if (this.segments.length === 0) {
+      throw new Error('No elements to get');
+    }
+
+    const { data, elementLen } = this.segments[0];
+    if (elementLen == 0 || elementLen > max_response_len - 2) {
+      throw new Error('The queue contains elements of invalid length');
+    }
+
+    const remaining = data.length - this.offset;
+    let element_len: number;
+    let n_elements: number;
+    if (remaining >= elementLen) {
+      element_len = elementLen;
+      n_elements = Math.min(
+        Math.floor((max_response_len - 2) / element_len),
+        Math.floor(remaining / element_len)
+      );
+    } else {
+      // the last, shorter element is sent alone
+      element_len = remaining;
+      n_elements = 1;
+    }
+
+    const end = this.offset + n_elements * element_len;
+    const payload = data.subarray(this.offset, end);
+    if (end >= data.length) {
+      this.segments.shift();
+      this.offset = 0;
+    } else {
+      this.offset = end;
+    }
+
+    return Buffer.concat([
+      Buffer.from([n_elements]),
+      Buffer.from([element_len]),
+      payload,
+    ]);
+  }
+}
+
+/**
+ * Returns the response made of header, the number of hashes, and as many of them as fit in
+ * max_response_len bytes, preceded by their number; the other ones are added to queue, for
+ * GET_MORE_ELEMENTS. It is the format of the responses to GET_MERKLE_LEAF_PROOF and
+ * GET_MERKLE_MULTIPROOF.
+ */
+export function packHashes(
+  header: Buffer,
+  hashes: Buffer[],
+  max_response_len: number,
+  queue: ElementQueue
+): Buffer {
+  const n_response_elements = Math.min(
+    Math.floor((max_response_len - header.length - 1 - 1) / 32),
+    hashes.length
+  );
+  queue.pushHashes(hashes.slice(n_response_elements));
+  return Buffer.concat([
+    header,
+    Buffer.from([hashes.length]),
+    Buffer.from([n_response_elements]),
+    ...hashes.slice(0, n_response_elements),
+  ]);
+}
+
+/**
+ * Returns the response made of the length of data (as a varint), and as many of its bytes as fit
+ * in max_response_len bytes, preceded by their number; the other ones are added to queue, in
+ * chunks that fill whole responses to GET_MORE_ELEMENTS.
+ */
+export function packBytes(
+  data: Buffer,
+  max_response_len: number,
+  queue: ElementQueue
+): Buffer {
+  const data_len_varint = createVarint(data.length);
+  const payload_size = Math.min(
+    max_response_len - data_len_varint.length - 1,
+    data.length
+  );
+  queue.pushChunks(data.subarray(payload_size), max_response_len);
+  return Buffer.concat([
+    data_len_varint,
+    Buffer.from([payload_size]),
+    data.subarray(0, payload_size),
+  ]);
+}
+
 abstract class ClientCommand {
   abstract code: ClientCommandCode;
   abstract execute(request: Buffer): Buffer;
@@ -25,35 +231,59 @@ export class YieldCommand extends ClientCommand {
 
   constructor(
     results: Buffer[],
-    private readonly progressCallback?: () => void
+    private readonly progressCallback?: (result: Buffer) => void,
+    private readonly batched: boolean = false
   ) {
     super();
     this.results = results;
   }
 
   execute(request: Buffer): Buffer {
-    this.results.push(Buffer.from(request.subarray(1)));
-    if (this.progressCallback) {
-      this.progressCallback();
+    if (!this.batched) {
+      const result = Buffer.from(request.subarray(1));
+      this.results.push(result);
+      if (this.progressCallback) {
+        this.progressCallback(result);
+      }
+      return Buffer.from('');
+    }
+
+    // batched format: <n> followed by n length-prefixed results
+    const req = new BufferReader(request.subarray(1));
+    const n = req.readUInt8();
+    for (let i = 0; i < n; i++) {
+      const elLen = req.readUInt8();
+      const result = Buffer.from(req.readSlice(elLen));
+      this.results.push(result);
+      if (this.progressCallback) {
+        this.progressCallback(result);
+      }
+    }
+    if (req.available() != 0) {
+      throw new Error('Invalid batched YIELD request');
     }
     return Buffer.from('');
   }
 }
 
 export class GetPreimageCommand extends ClientCommand {
-  private readonly known_preimages: ReadonlyMap<string, Buffer>;
-  private queue: Buffer[];
+  private readonly known_preimages: KnownPreimages;
+  private queue: ElementQueue;
 
   readonly code = ClientCommandCode.GET_PREIMAGE;
 
-  constructor(known_preimages: ReadonlyMap<string, Buffer>, queue: Buffer[]) {
+  constructor(
+    known_preimages: KnownPreimages,
+    queue: ElementQueue,
+    private readonly max_response_len: number = MAX_RESPONSE_LEN
+  ) {
     super();
     this.known_preimages = known_preimages;
     this.queue = queue;
   }
 
   execute(request: Buffer): Buffer {
-    const req = Buffer.from(request.subarray(1));
+    const req = request.subarray(1);
 
     // we expect no more data to read
     if (req.length != 1 + 32) {
@@ -64,54 +294,35 @@ export class GetPreimageCommand extends ClientCommand {
       throw new Error('Unsupported request, the first byte should be 0');
     }
 
-    // read the hash
-    const hash = Buffer.alloc(32);
-    for (let i = 0; i < 32; i++) {
-      hash[i] = req[1 + i];
-    }
-    const req_hash_hex = hash.toString('hex');
+    const hash = req.subarray(1, 1 + 32);
 
-    const known_preimage = this.known_preimages.get(req_hash_hex);
+    const known_preimage = this.known_preimages.get(hashKey(hash));
     if (known_preimage != undefined) {
-      const preimage_len_varint = createVarint(known_preimage.length);
-
-      // We can send at most 255 - len(preimage_len_out) - 1 bytes in a single message;
-      // the rest will be stored in the queue for GET_MORE_ELEMENTS
-      const max_payload_size = 255 - preimage_len_varint.length - 1;
-
-      const payload_size = Math.min(max_payload_size, known_preimage.length);
-
-      if (payload_size < known_preimage.length) {
-        for (let i = payload_size; i < known_preimage.length; i++) {
-          this.queue.push(Buffer.from([known_preimage[i]]));
-        }
-      }
-
-      return Buffer.concat([
-        preimage_len_varint,
-        Buffer.from([payload_size]),
-        Buffer.from(known_preimage.subarray(0, payload_size)),
-      ]);
+      return packBytes(known_preimage, this.max_response_len, this.queue);
     }
 
-    throw Error(`Requested unknown preimage for: ${req_hash_hex}`);
+    throw Error(`Requested unknown preimage for: ${hash.toString('hex')}`);
   }
 }
 
 export class GetMerkleLeafProofCommand extends ClientCommand {
   private readonly known_trees: ReadonlyMap<string, Merkle>;
-  private queue: Buffer[];
+  private queue: ElementQueue;
 
   readonly code = ClientCommandCode.GET_MERKLE_LEAF_PROOF;
 
-  constructor(known_trees: ReadonlyMap<string, Merkle>, queue: Buffer[]) {
+  constructor(
+    known_trees: ReadonlyMap<string, Merkle>,
+    queue: ElementQueue,
+    private readonly max_response_len: number = MAX_RESPONSE_LEN
+  ) {
     super();
     this.known_trees = known_trees;
     this.queue = queue;
   }
 
   execute(request: Buffer): Buffer {
-    const req = Buffer.from(request.subarray(1));
+    const req = request.subarray(1);
 
     if (req.length < 32 + 1 + 1) {
       throw new Error('Invalid request, expected at least 34 bytes');
@@ -119,7 +330,6 @@ export class GetMerkleLeafProofCommand extends ClientCommand {
 
     const reqBuf = new BufferReader(req);
     const hash = reqBuf.readSlice(32);
-    const hash_hex = hash.toString('hex');
 
     let tree_size: number;
     let leaf_index: number;
@@ -132,40 +342,29 @@ export class GetMerkleLeafProofCommand extends ClientCommand {
       );
     }
 
-    const mt = this.known_trees.get(hash_hex);
+    const mt = this.known_trees.get(hashKey(hash));
     if (!mt) {
-      throw Error(`Requested Merkle leaf proof for unknown tree: ${hash_hex}`);
+      throw Error(
+        `Requested Merkle leaf proof for unknown tree: ${hash.toString('hex')}`
+      );
     }
 
     if (leaf_index >= tree_size || mt.size() != tree_size) {
       throw Error('Invalid index or tree size.');
     }
 
-    if (this.queue.length != 0) {
+    if (!this.queue.isEmpty()) {
       throw Error(
         'This command should not execute when the queue is not empty.'
       );
     }
 
-    const proof = mt.getProof(leaf_index);
-
-    const n_response_elements = Math.min(
-      Math.floor((255 - 32 - 1 - 1) / 32),
-      proof.length
-    );
-    const n_leftover_elements = proof.length - n_response_elements;
-
-    // Add to the queue any proof elements that do not fit the response
-    if (n_leftover_elements > 0) {
-      this.queue.push(...proof.slice(-n_leftover_elements));
-    }
-
-    return Buffer.concat([
+    return packHashes(
       mt.getLeafHash(leaf_index),
-      Buffer.from([proof.length]),
-      Buffer.from([n_response_elements]),
-      ...proof.slice(0, n_response_elements),
-    ]);
+      mt.getProof(leaf_index),
+      this.max_response_len,
+      this.queue
+    );
   }
 }
 
@@ -180,83 +379,243 @@ export class GetMerkleLeafIndexCommand extends ClientCommand {
   }
 
   execute(request: Buffer): Buffer {
-    const req = Buffer.from(request.subarray(1));
+    const req = request.subarray(1);
 
     if (req.length != 32 + 32) {
       throw new Error('Invalid request, unexpected trailing data');
     }
 
-    // read the root hash
-    const root_hash = Buffer.alloc(32);
-    for (let i = 0; i < 32; i++) {
-      root_hash[i] = req.readUInt8(i);
+    const root_hash = req.subarray(0, 32);
+    const leaf_hash = req.subarray(32, 32 + 32);
+
+    const mt = this.known_trees.get(hashKey(root_hash));
+    if (!mt) {
+      throw Error(
+        `Requested Merkle leaf index for unknown root: ${root_hash.toString(
+          'hex'
+        )}`
+      );
+    }
+
+    const leaf_index = mt.getLeafIndex(leaf_hash);
+    const found = leaf_index == -1 ? 0 : 1;
+    return Buffer.concat([
+      Buffer.from([found]),
+      createVarint(found ? leaf_index : 0),
+    ]);
+  }
+}
+
+export class GetMerkleMultiproofCommand extends ClientCommand {
+  private readonly known_trees: ReadonlyMap<string, Merkle>;
+  private queue: ElementQueue;
+
+  readonly code = ClientCommandCode.GET_MERKLE_MULTIPROOF;
+
+  constructor(
+    known_trees: ReadonlyMap<string, Merkle>,
+    queue: ElementQueue,
+    private readonly max_response_len: number = MAX_RESPONSE_LEN
+  ) {
+    super();
+    this.known_trees = known_trees;
+    this.queue = queue;
+  }
+
+  execute(request: Buffer): Buffer {
+    const req = request.subarray(1);
+
+    if (req.length < 32 + 1 + 1) {
+      throw new Error('Invalid request, expected at least 34 bytes');
+    }
+
+    const reqBuf = new BufferReader(req);
+    const hash = reqBuf.readSlice(32);
+
+    let tree_size: number;
+    const leaf_indices: number[] = [];
+    try {
+      tree_size = sanitizeBigintToNumber(reqBuf.readVarInt());
+      const n_leaves = reqBuf.readUInt8();
+      for (let i = 0; i < n_leaves; i++) {
+        leaf_indices.push(sanitizeBigintToNumber(reqBuf.readVarInt()));
+      }
+    } catch (e) {
+      throw new Error(
+        "Invalid request, couldn't parse tree_size or leaf indices"
+      );
     }
-    const root_hash_hex = root_hash.toString('hex');
 
-    // read the leaf hash
-    const leef_hash = Buffer.alloc(32);
-    for (let i = 0; i < 32; i++) {
-      leef_hash[i] = req.readUInt8(32 + i);
+    if (reqBuf.available() != 0) {
+      throw new Error('Invalid request, unexpected trailing data');
     }
-    const leef_hash_hex = leef_hash.toString('hex');
 
-    const mt = this.known_trees.get(root_hash_hex);
+    const mt = this.known_trees.get(hashKey(hash));
     if (!mt) {
       throw Error(
-        `Requested Merkle leaf index for unknown root: ${root_hash_hex}`
+        `Requested Merkle multiproof for unknown tree: ${hash.toString('hex')}`
       );
     }
 
-    let leaf_index = 0;
-    let found = 0;
-    for (let i = 0; i < mt.size(); i++) {
-      if (mt.getLeafHash(i).toString('hex') == leef_hash_hex) {
-        found = 1;
-        leaf_index = i;
-        break;
-      }
+    if (
+      mt.size() != tree_size ||
+      leaf_indices.some((leaf_index) => leaf_index >= tree_size)
+    ) {
+      throw Error('Invalid index or tree size.');
     }
-    return Buffer.concat([Buffer.from([found]), createVarint(leaf_index)]);
+
+    if (!this.queue.isEmpty()) {
+      throw Error(
+        'This command should not execute when the queue is not empty.'
+      );
+    }
+
+    // the hashes shared by the proofs of several leaves are only sent once
+    return packHashes(
+      Buffer.alloc(0),
+      mt.getMultiproof(leaf_indices),
+      this.max_response_len,
+      this.queue
+    );
   }
 }
 
-export class GetMoreElementsCommand extends ClientCommand {
-  queue: Buffer[];
+export class GetMerkleizedMapValueCommand extends ClientCommand {
+  private readonly known_preimages: KnownPreimages;
+  private readonly known_trees: ReadonlyMap<string, Merkle>;
+  private queue: ElementQueue;
 
-  readonly code = ClientCommandCode.GET_MORE_ELEMENTS;
+  readonly code = ClientCommandCode.GET_MERKLEIZED_MAP_VALUE;
 
-  constructor(queue: Buffer[]) {
+  constructor(
+    known_preimages: KnownPreimages,
+    known_trees: ReadonlyMap<string, Merkle>,
+    queue: ElementQueue,
+    private readonly max_response_len: number = MAX_RESPONSE_LEN
+  ) {
     super();
+    this.known_preimages = known_preimages;
+    this.known_trees = known_trees;
     this.queue = queue;
   }
 
   execute(request: Buffer): Buffer {
-    if (request.length != 1) {
-      throw new Error('Invalid request, unexpected trailing data');
+    const req = request.subarray(1);
+
+    if (req.length < 32 + 32 + 1 + 32) {
+      throw new Error('Invalid request, expected at least 97 bytes');
     }
 
-    if (this.queue.length === 0) {
-      throw new Error('No elements to get');
+    const reqBuf = new BufferReader(req);
+    const keys_root = reqBuf.readSlice(32);
+    const values_root = reqBuf.readSlice(32);
+
+    let map_size: number;
+    try {
+      map_size = sanitizeBigintToNumber(reqBuf.readVarInt());
+    } catch (e) {
+      throw new Error("Invalid request, couldn't parse map_size");
+    }
+    const key_hash = reqBuf.readSlice(32);
+
+    // optional index of the key, if already known to the device
+    let index_hint = -1;
+    if (reqBuf.available() != 0) {
+      try {
+        index_hint = sanitizeBigintToNumber(reqBuf.readVarInt());
+      } catch (e) {
+        throw new Error("Invalid request, couldn't parse the key index");
+      }
+      if (reqBuf.available() != 0) {
+        throw new Error('Invalid request, unexpected trailing data');
+      }
     }
 
-    // all elements should have the same length
-    const element_len = this.queue[0].length;
-    if (this.queue.some((el) => el.length != element_len)) {
-      throw new Error(
-        'The queue contains elements with different byte length, which is not expected'
+    const keys_tree = this.known_trees.get(hashKey(keys_root));
+    const values_tree = this.known_trees.get(hashKey(values_root));
+    if (!keys_tree || !values_tree) {
+      throw Error(
+        `Requested map value for unknown trees: ${keys_root.toString(
+          'hex'
+        )}, ${values_root.toString('hex')}`
       );
     }
 
-    const max_elements = Math.floor(253 / element_len);
-    const n_returned_elements = Math.min(max_elements, this.queue.length);
+    if (keys_tree.size() != map_size || values_tree.size() != map_size) {
+      throw Error('Invalid map size.');
+    }
 
-    const returned_elements = this.queue.splice(0, n_returned_elements);
+    if (!this.queue.isEmpty()) {
+      throw Error(
+        'This command should not execute when the queue is not empty.'
+      );
+    }
 
-    return Buffer.concat([
-      Buffer.from([n_returned_elements]),
-      Buffer.from([element_len]),
-      ...returned_elements,
-    ]);
+    let leaf_index = -1;
+    if (index_hint != -1) {
+      if (
+        index_hint >= map_size ||
+        !keys_tree.getLeafHash(index_hint).equals(key_hash)
+      ) {
+        throw Error('Wrong key index.');
+      }
+      leaf_index = index_hint;
+    } else {
+      leaf_index = keys_tree.getLeafIndex(key_hash);
+    }
+
+    let response: Buffer;
+    if (leaf_index == -1) {
+      response = Buffer.from([0]);
+    } else {
+      const value_leaf_hash = values_tree.getLeafHash(leaf_index);
+      const preimage = this.known_preimages.get(hashKey(value_leaf_hash));
+      if (preimage == undefined) {
+        throw Error(
+          `Requested unknown preimage for: ${value_leaf_hash.toString('hex')}`
+        );
+      }
+      const value = preimage.subarray(1); // skip the 0x00 prefix
+
+      const value_proof = values_tree.getProof(leaf_index);
+      // the proof for the key is not needed if the device already knows its index
+      const key_proof =
+        index_hint == -1 ? keys_tree.getProof(leaf_index) : [];
+
+      response = Buffer.concat([
+        Buffer.from([1]),
+        createVarint(leaf_index),
+        Buffer.from([value_proof.length]),
+        ...key_proof,
+        createVarint(value.length),
+        value,
+        ...value_proof,
+      ]);
+    }
+
+    return packBytes(response, this.max_response_len, this.queue);
+  }
+}
+
+export class GetMoreElementsCommand extends ClientCommand {
+  queue: ElementQueue;
+
+  readonly code = ClientCommandCode.GET_MORE_ELEMENTS;
+
+  constructor(
+    queue: ElementQueue,
+    private readonly max_response_len: number = MAX_RESPONSE_LEN
+  ) {
+    super();
+    this.queue = queue;
+  }
+
+  execute(request: Buffer): Buffer {
+    if (request.length != 1) {
+      throw new Error('Invalid request, unexpected trailing data');
+    }
+
+    return this.queue.popResponse(this.max_response_len);
   }
 }
 
@@ -277,21 +636,53 @@ export class GetMoreElementsCommand extends ClientCommand {
  */
 export class ClientCommandInterpreter {
   private readonly roots: Map<string, Merkle> = new Map();
-  private readonly preimages: Map<string, Buffer> = new Map();
+  private readonly preimages = new KnownPreimages();
 
   private yielded: Buffer[] = [];
 
-  private queue: Buffer[] = [];
+  private queue = new ElementQueue();
+
+  // the last client command executed by execute, if any
+  private lastRequest?: Buffer;
 
   private readonly commands: Map<ClientCommandCode, ClientCommand> = new Map();
 
-  constructor(progressCallback?: () => void) {
+  /**
+   * @param progressCallback called with each value received with a YIELD client command, as soon as
+   * it is received
+   * @param maxResponseLen the maximum length of a response to a client command, as advertised by
+   * the hardware device
+   * @param clientCapabilities the capabilities declared in the P2 field of the command
+   */
+  constructor(
+    progressCallback?: (result: Buffer) => void,
+    maxResponseLen: number = MAX_RESPONSE_LEN,
+    clientCapabilities: number = 0
+  ) {
+    if (
+      maxResponseLen < MIN_RESPONSE_LEN ||
+      maxResponseLen > MAX_RESPONSE_LEN
+    ) {
+      throw new Error(`Unsupported maximum response length: ${maxResponseLen}`);
+    }
+
     const commands = [
-      new YieldCommand(this.yielded, progressCallback),
-      new GetPreimageCommand(this.preimages, this.queue),
+      new YieldCommand(
+        this.yielded,
+        progressCallback,
+        (clientCapabilities & ClientCapability.BATCHED_YIELD) != 0
+      ),
+      new GetPreimageCommand(this.preimages, this.queue, maxResponseLen),
       new GetMerkleLeafIndexCommand(this.roots),
-      new GetMerkleLeafProofCommand(this.roots, this.queue),
-      new GetMoreElementsCommand(this.queue),
+      new GetMerkleLeafProofCommand(this.roots, this.queue, maxResponseLen),
+      new GetMerkleMultiproofCommand(this.roots, this.queue, maxResponseLen),
+      new GetMerkleizedMapValueCommand(
+        this.preimages,
+        this.roots,
+        this.queue,
+        maxResponseLen
+      ),
+      new GetMoreElementsCommand(this.queue, maxResponseLen),
     ];
 
     for (const cmd of commands) {
@@ -307,21 +698,33 @@ export class ClientCommandInterpreter {
   }
 
   addKnownPreimage(preimage: Buffer): void {
-    this.preimages.set(crypto.sha256(preimage).toString('hex'), preimage);
+    this.preimages.add(preimage);
   }
 
   addKnownList(elements: readonly Buffer[]): void {
-    for (const el of elements) {
-      const preimage = Buffer.concat([Buffer.from([0]), el]);
-      this.addKnownPreimage(preimage);
-    }
     const mt = new Merkle(elements.map((el) => hashLeaf(el)));
-    this.roots.set(mt.getRoot().toString('hex'), mt);
+    this.addKnownTree(elements, mt);
   }
 
   addKnownMapping(mm: MerkleMap): void {
-    this.addKnownList(mm.keys);
-    this.addKnownList(mm.values);
+    this.addKnownTree(mm.keys, mm.keysTree);
+    this.addKnownTree(mm.values, mm.valuesTree);
+  }
+
+  /**
+   * Adds a list whose Merkle tree is already built, without hashing its
+   * elements again.
+   *
+   * @param elements the elements of the list
+   * @param tree the Merkle tree of the list, whose leaves are the hashLeaf of
+   * the elements
+   */
+  addKnownTree(elements: readonly Buffer[], tree: Merkle): void {
+    if (elements.length != tree.size()) {
+      throw new Error('The elements do not match the leaves of the tree');
+    }
+    this.preimages.addList(elements, tree);
+    this.roots.set(hashKey(tree.getRoot()), tree);
   }
 
   execute(request: Buffer): Buffer {
@@ -335,6 +738,97 @@ export class ClientCommandInterpreter {
       throw new Error(`Unexpected command code ${cmdCode}`);
     }
 
-    return cmd.execute(request);
+    const response = cmd.execute(request);
+    this.lastRequest = request;
+    return response;
+  }
+
+  /**
+   * Returns the client commands that the hardware device is expected to send
+   * next, in order, after request was executed successfully. Only the requests
+   * that follow with certainty in the flows of the hardware device are
+   * predicted: GET_MERKLE_LEAF_INDEX is followed by GET_MERKLE_LEAF_PROOF for
+   * the same leaf, if found, and GET_MERKLE_LEAF_PROOF is followed by
+   * GET_PREIMAGE for the leaf (which is not certain, but it is the most common
+   * case).
+   */
+  predictRequests(request: Buffer): Buffer[] {
+    const cmdCode = request[0];
+    const req = new BufferReader(request.subarray(1));
+    if (cmdCode == ClientCommandCode.GET_MERKLE_LEAF_INDEX) {
+      const root = req.readSlice(32);
+      const mt = this.roots.get(hashKey(root));
+      if (!mt) return [];
+      const leafIndex = mt.getLeafIndex(req.readSlice(32));
+      if (leafIndex == -1) return [];
+
+      const leafProofRequest = Buffer.concat([
+        Buffer.from([ClientCommandCode.GET_MERKLE_LEAF_PROOF]),
+        root,
+        createVarint(mt.size()),
+        createVarint(leafIndex),
+      ]);
+      return [leafProofRequest, ...this.predictRequests(leafProofRequest)];
+    } else if (cmdCode == ClientCommandCode.GET_MERKLE_LEAF_PROOF) {
+      const mt = this.roots.get(hashKey(req.readSlice(32)));
+      if (!mt) return [];
+      req.readVarInt(); // tree size
+      const leafIndex = sanitizeBigintToNumber(req.readVarInt());
+      if (leafIndex >= mt.size()) return [];
+      return [
+        Buffer.concat([
+          Buffer.from([ClientCommandCode.GET_PREIMAGE, 0]),
+          mt.getLeafHash(leafIndex),
+        ]),
+      ];
+    }
+    return [];
+  }
+
+  /**
+   * Computes the speculative responses to the client commands that are
+   * expected after the last executed one, to be sent together with its
+   * response in the CONTINUE command, as documented in doc/bitcoin.md. No
+   * speculative response is computed if it would change the state of the
+   * interpreter (that is, if it would add elements to the queue of
+   * GET_MORE_ELEMENTS).
+   *
+   * @param maxLen the maximum total length of the speculative responses
+   * @returns the concatenation of the speculative responses; empty if there are none
+   */
+  getSpeculativeResponses(maxLen: number): Buffer {
+    if (maxLen <= 0 || !this.lastRequest || !this.queue.isEmpty()) {
+      return Buffer.alloc(0);
+    }
+
+    const entries: Buffer[] = [];
+    let totalLen = 0;
+    for (const request of this.predictRequests(this.lastRequest)) {
+      const cmd = this.commands.get(request[0]);
+      if (!cmd) break;
+
+      let response: Buffer;
+      try {
+        response = cmd.execute(request);
+      } catch (e) {
+        break;
+      }
+
+      if (!this.queue.isEmpty()) {
+        // the response did not fit a single message; this request can't be anticipated
+        this.queue.clear();
+        break;
+      }
+
+      const entry = Buffer.concat([
+        crypto.sha256(request).subarray(0, 4),
+        Buffer.from([response.length]),
+        response,
+      ]);
+      if (totalLen + entry.length > maxLen) break;
+      entries.push(entry);
+      totalLen += entry.length;
+    }
+    return Buffer.concat(entries);
   }
 }
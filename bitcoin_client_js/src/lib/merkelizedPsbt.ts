@@ -1,5 +1,36 @@
 import { MerkleMap } from './merkleMap';
-import { PsbtV2 } from './psbtv2';
+import { psbtGlobal, psbtIn, psbtOut, PsbtV2 } from './psbtv2';
+
+// The types of the keys that the hardware app reads while signing; the other
+// fields (partial signatures, final scripts, xpubs, ...) are not merkleized.
+// Proprietary fields are only read if their identifier is "LEDGER".
+const SIGN_PSBT_GLOBAL_KEY_TYPES: readonly number[] = [
+  psbtGlobal.TX_VERSION,
+  psbtGlobal.FALLBACK_LOCKTIME,
+  psbtGlobal.INPUT_COUNT,
+  psbtGlobal.OUTPUT_COUNT,
+  psbtGlobal.VERSION,
+];
+const SIGN_PSBT_INPUT_KEY_TYPES: readonly number[] = [
+  psbtIn.NON_WITNESS_UTXO,
+  psbtIn.WITNESS_UTXO,
+  psbtIn.SIGHASH_TYPE,
+  psbtIn.REDEEM_SCRIPT,
+  psbtIn.WITNESS_SCRIPT,
+  psbtIn.BIP32_DERIVATION,
+  psbtIn.PREVIOUS_TXID,
+  psbtIn.OUTPUT_INDEX,
+  psbtIn.SEQUENCE,
+  psbtIn.TAP_BIP32_DERIVATION,
+];
+const SIGN_PSBT_OUTPUT_KEY_TYPES: readonly number[] = [
+  psbtOut.BIP_32_DERIVATION,
+  psbtOut.AMOUNT,
+  psbtOut.SCRIPT,
+  psbtOut.TAP_BIP32_DERIVATION,
+];
+// <0xFC> <identifier_len : 1> "LEDGER", hex encoded like the keys of the maps
+const LEDGER_PROPRIETARY_PREFIX = 'fc064c4544474552';
 
 /**
  * This class merkelizes a PSBTv2, by merkelizing the different
@@ -20,7 +51,21 @@ export class MerkelizedPsbt extends PsbtV2 {
   public outputMapCommitments: Buffer[];
   constructor(psbt: PsbtV2) {
     super();
-    psbt.copy(this);
+    // the values are only hashed and served to the device, never modified
+    psbt.shallowCopy(this);
+    // only the maps of the copy are pruned: the fields are still in psbt
+    MerkelizedPsbt.pruneMap(this.globalMap, SIGN_PSBT_GLOBAL_KEY_TYPES);
+    this.inputMaps.forEach((map) => {
+      const keyTypes = MerkelizedPsbt.isTaprootInput(map)
+        ? SIGN_PSBT_INPUT_KEY_TYPES.filter(
+            (t) => t != psbtIn.NON_WITNESS_UTXO
+          )
+        : SIGN_PSBT_INPUT_KEY_TYPES;
+      MerkelizedPsbt.pruneMap(map, keyTypes);
+    });
+    this.outputMaps.forEach((map) =>
+      MerkelizedPsbt.pruneMap(map, SIGN_PSBT_OUTPUT_KEY_TYPES)
+    );
     this.globalMerkleMap = MerkelizedPsbt.createMerkleMap(this.globalMap);
 
     for (let i = 0; i < this.getGlobalInputCount(); i++) {
@@ -49,6 +94,36 @@ export class MerkelizedPsbt extends PsbtV2 {
     return this.globalMerkleMap.commitment();
   }
 
+  private static pruneMap(
+    map: Map<string, Buffer>,
+    keyTypes: readonly number[]
+  ): void {
+    for (const k of [...map.keys()]) {
+      const keyType = parseInt(k.substring(0, 2), 16);
+      if (keyType >= 0xfd) {
+        continue; // not a single-byte key type, kept as-is
+      }
+      const keep =
+        keyType == 0xfc
+          ? k.startsWith(LEDGER_PROPRIETARY_PREFIX)
+          : keyTypes.includes(keyType);
+      if (!keep) {
+        map.delete(k);
+      }
+    }
+  }
+
+  // the non-witness utxo of a taproot input is not needed
+  private static isTaprootInput(map: ReadonlyMap<string, Buffer>): boolean {
+    const witnessUtxo = map.get('01'); // psbtIn.WITNESS_UTXO
+    // <amount : 8> <script_len : 1> OP_1 <32 bytes>
+    return (
+      witnessUtxo !== undefined &&
+      witnessUtxo.length == 8 + 1 + 34 &&
+      witnessUtxo.subarray(8, 11).equals(Buffer.from([0x22, 0x51, 0x20]))
+    );
+  }
+
   private static createMerkleMap(map: ReadonlyMap<string, Buffer>): MerkleMap {
     const sortedKeysStrings = [...map.keys()].sort();
     const values = sortedKeysStrings.map((k) => {
@@ -7,21 +7,60 @@ import { crypto } from 'bitcoinjs-lib';
  */
 export class Merkle {
   private leaves: Buffer[];
-  private rootNode: Node;
-  private leafNodes: Node[];
+  // The hashes of the internal nodes, level by level from the bottom, in a
+  // single buffer; level 0 (the leaves) is not included. Level l + 1 contains
+  // the hashes of the pairs of consecutive nodes of level l; if level l has an
+  // odd number of nodes, the last one is copied to level l + 1.
+  private nodes: Buffer;
+  // offset (in number of hashes) of each level in nodes, starting from level 1
+  private levelOffsets: number[] = [];
+  // number of nodes of each level, starting from level 0
+  private levelSizes: number[] = [];
+  private root: Buffer;
+  // index of the first leaf with each hash (by hashKey), built when first needed
+  private leafIndices?: Map<string, number>;
   private h: (buf: Buffer) => Buffer;
+  /**
+   * @param leaves the hashes of the leaves
+   * @param hasher the hash function of the internal nodes
+   * @param nodes optionally, the internal nodes of the same tree, as returned
+   * by getNodes() (for example, for a tree built in a worker); they are not
+   * recomputed nor verified
+   */
   constructor(
     leaves: Buffer[],
-    hasher: (buf: Buffer) => Buffer = crypto.sha256
+    hasher: (buf: Buffer) => Buffer = crypto.sha256,
+    nodes?: Buffer
   ) {
     this.leaves = leaves;
     this.h = hasher;
-    const nodes = this.calculateRoot(leaves);
-    this.rootNode = nodes.root;
-    this.leafNodes = nodes.leaves;
+
+    let nNodes = 0;
+    for (let size = leaves.length; size > 1; size = Math.ceil(size / 2)) {
+      this.levelSizes.push(size);
+      this.levelOffsets.push(nNodes);
+      nNodes += Math.ceil(size / 2);
+    }
+    this.levelSizes.push(leaves.length > 0 ? 1 : 0);
+
+    if (nodes) {
+      if (nodes.length != 32 * nNodes) {
+        throw new Error('Invalid length of the nodes of the tree');
+      }
+      this.nodes = nodes;
+    } else {
+      this.nodes = Buffer.alloc(32 * nNodes);
+      this.computeNodes();
+    }
+
+    if (leaves.length == 0) {
+      this.root = Buffer.alloc(32, 0);
+    } else {
+      this.root = this.getNode(this.levelSizes.length - 1, 0);
+    }
   }
   getRoot(): Buffer {
-    return this.rootNode.hash;
+    return this.root;
   }
   size(): number {
     return this.leaves.length;
@@ -29,44 +68,127 @@ export class Merkle {
   getLeaves(): Buffer[] {
     return this.leaves;
   }
+  /**
+   * Returns the hashes of the internal nodes of the tree, in a single buffer.
+   */
+  getNodes(): Buffer {
+    return this.nodes;
+  }
   getLeafHash(index: number): Buffer {
-    return this.leafNodes[index].hash;
+    return this.leaves[index];
+  }
+  /**
+   * Returns the index of the first leaf with the given hash, or -1 if there
+   * is none.
+   */
+  getLeafIndex(leafHash: Buffer): number {
+    if (!this.leafIndices) {
+      this.leafIndices = new Map();
+      for (let i = this.leaves.length - 1; i >= 0; i--) {
+        this.leafIndices.set(hashKey(this.leaves[i]), i);
+      }
+    }
+    const index = this.leafIndices.get(hashKey(leafHash));
+    return index == undefined ? -1 : index;
   }
   getProof(index: number): Buffer[] {
     if (index >= this.leaves.length) throw Error('Index out of bounds');
-    return proveNode(this.leafNodes[index]);
+    const proof: Buffer[] = [];
+    for (let level = 0; level + 1 < this.levelSizes.length; level++) {
+      const sibling = index ^ 1;
+      // the last node of a level with an odd size has no sibling
+      if (sibling < this.levelSizes[level]) {
+        proof.push(this.getNode(level, sibling));
+      }
+      index >>= 1;
+    }
+    return proof;
   }
-
-  calculateRoot(leaves: Buffer[]): {
-    root: Node;
-    leaves: Node[];
-  } {
-    const n = leaves.length;
-    if (n == 0) {
-      return {
-        root: new Node(undefined, undefined, Buffer.alloc(32, 0)),
-        leaves: [],
-      };
+  /**
+   * Returns the multiproof for the leaves with the given (strictly increasing)
+   * indices: the hashes of the requested leaves and of the roots of the
+   * maximal subtrees that contain none of them, in the order of a depth-first,
+   * left-to-right visit of the tree.
+   */
+  getMultiproof(indices: readonly number[]): Buffer[] {
+    if (indices.length == 0) throw Error('No leaves requested');
+    for (let i = 0; i < indices.length; i++) {
+      if (indices[i] >= this.leaves.length) throw Error('Index out of bounds');
+      if (i > 0 && indices[i] <= indices[i - 1]) {
+        throw Error('Indices must be strictly increasing');
+      }
     }
-    if (n == 1) {
-      const newNode = new Node(undefined, undefined, leaves[0]);
-      return { root: newNode, leaves: [newNode] };
+    const result: Buffer[] = [];
+    let pos = 0;
+    // the subtrees to visit, as [begin, size], with the next one at the end
+    const stack: [number, number][] = [[0, this.leaves.length]];
+    while (stack.length > 0) {
+      const [begin, size] = stack.pop() as [number, number];
+      const hasLeaf = pos < indices.length && indices[pos] < begin + size;
+      if (size == 1 || !hasLeaf) {
+        result.push(this.getSubtreeRoot(begin, size));
+        if (hasLeaf) pos++;
+        continue;
+      }
+      const leftSize = highestPowerOf2LessThan(size);
+      stack.push([begin + leftSize, size - leftSize]);
+      stack.push([begin, leftSize]);
     }
-    const leftCount = highestPowerOf2LessThan(n);
-    const leftBranch = this.calculateRoot(leaves.slice(0, leftCount));
-    const rightBranch = this.calculateRoot(leaves.slice(leftCount));
-    const leftChild = leftBranch.root;
-    const rightChild = rightBranch.root;
-    const hash = this.hashNode(leftChild.hash, rightChild.hash);
-    const node = new Node(leftChild, rightChild, hash);
-    leftChild.parent = node;
-    rightChild.parent = node;
-    return { root: node, leaves: leftBranch.leaves.concat(rightBranch.leaves) };
+    return result;
   }
 
   hashNode(left: Buffer, right: Buffer): Buffer {
     return this.h(Buffer.concat([Buffer.from([1]), left, right]));
   }
+
+  private computeNodes(): void {
+    // scratch buffer for the preimage of the hash of each internal node
+    const scratch = Buffer.alloc(65);
+    scratch[0] = 1;
+    for (let level = 0; level + 1 < this.levelSizes.length; level++) {
+      const size = this.levelSizes[level];
+      const out = 32 * this.levelOffsets[level];
+      for (let i = 0; i + 1 < size; i += 2) {
+        this.getNode(level, i).copy(scratch, 1);
+        this.getNode(level, i + 1).copy(scratch, 33);
+        this.h(scratch).copy(this.nodes, out + 16 * i);
+      }
+      if (size % 2 == 1) {
+        this.getNode(level, size - 1).copy(this.nodes, out + 16 * (size - 1));
+      }
+    }
+  }
+
+  /**
+   * Returns the hash of the node with the given index in the given level.
+   */
+  private getNode(level: number, index: number): Buffer {
+    if (level == 0) {
+      return this.leaves[index];
+    }
+    const offset = 32 * (this.levelOffsets[level - 1] + index);
+    return this.nodes.subarray(offset, offset + 32);
+  }
+
+  /**
+   * Returns the root of the subtree with the leaves from begin to
+   * begin + size - 1, where begin is a multiple of the smallest power of 2
+   * that is at least size (as for all the subtrees of the tree): it is the
+   * node in the level of that power of 2.
+   */
+  private getSubtreeRoot(begin: number, size: number): Buffer {
+    const level = size == 1 ? 0 : Math.ceil(Math.log2(size));
+    return this.getNode(level, begin >> level);
+  }
+}
+
+/**
+ * Returns the key of a hash in the maps indexed by hash: a string with one
+ * character per byte, which is cheaper to compute and to compare than the
+ * hex encoding.
+ */
+export function hashKey(hash: Buffer): string {
+  return hash.toString('latin1');
 }
 
 export function hashLeaf(
@@ -84,38 +206,6 @@ function hashConcat(
   return hashFunction(Buffer.concat([bufA, bufB]));
 }
 
-class Node {
-  leftChild?: Node;
-  rightChild?: Node;
-  parent?: Node;
-  hash: Buffer;
-  constructor(left: Node | undefined, right: Node | undefined, hash: Buffer) {
-    this.leftChild = left;
-    this.rightChild = right;
-    this.hash = hash;
-  }
-  isLeaf(): boolean {
-    return this.leftChild == undefined;
-  }
-}
-
-function proveNode(node: Node): Buffer[] {
-  if (!node.parent) {
-    return [];
-  }
-  if (node.parent.leftChild == node) {
-    if (!node.parent.rightChild) {
-      throw new Error('Expected right child to exist');
-    }
-    return [node.parent.rightChild.hash, ...proveNode(node.parent)];
-  } else {
-    if (!node.parent.leftChild) {
-      throw new Error('Expected left child to exist');
-    }
-    return [node.parent.leftChild.hash, ...proveNode(node.parent)];
-  }
-}
-
 function highestPowerOf2LessThan(n: number) {
   if (n < 2) {
     throw Error('Expected n >= 2');
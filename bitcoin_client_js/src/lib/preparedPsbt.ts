@@ -0,0 +1,315 @@
+import { BufferReader, BufferWriter } from './buffertools';
+import { ClientCommandInterpreter } from './clientCommands';
+import { MerkelizedPsbt } from './merkelizedPsbt';
+import { hashLeaf, Merkle } from './merkle';
+import { MerkleMap } from './merkleMap';
+import { WalletPolicy } from './policy';
+import { PsbtV2 } from './psbtv2';
+import { sanitizeBigintToNumber } from './varint';
+
+/**
+ * A list of elements known to the ClientCommandInterpreter, with its Merkle
+ * tree.
+ */
+interface PreparedList {
+  readonly elements: readonly Buffer[];
+  readonly tree: Merkle;
+}
+
+const SERIALIZATION_VERSION = 2;
+
+/**
+ * A PSBTv2 prepared for signing: the commitments sent in the SIGN_PSBT
+ * command, and the lists (with their Merkle trees) of the merkleized maps of
+ * the PSBT and of the map commitments, that are served to the hardware device;
+ * optionally, also the preimages of the wallet policy used to sign it.
+ *
+ * The hardware device never modifies them, therefore the same PreparedPsbt can
+ * be passed to AppClient.signPsbt (instead of the PsbtV2) repeatedly, for
+ * example to retry after an error, or to sign on several devices. It can also
+ * be saved with serialize, and loaded with deserialize without hashing again.
+ *
+ * Preparing a large PSBT is dominated by the hashing of all the keys and
+ * values of its maps; preparePsbtInWorker does it in a Web Worker, so that the
+ * calling thread stays responsive.
+ */
+export class PreparedPsbt {
+  private constructor(
+    readonly globalCommitment: Buffer,
+    readonly inputCount: number,
+    readonly inputsRoot: Buffer,
+    readonly outputCount: number,
+    readonly outputsRoot: Buffer,
+    private readonly lists: readonly PreparedList[],
+    // the id of the wallet policy, if its preimages are included
+    readonly walletId: Buffer | undefined,
+    // preimages that are not elements of a list
+    private readonly preimages: readonly Buffer[]
+  ) {}
+
+  /**
+   * @param psbt the PSBT to prepare
+   * @param walletPolicy optionally, the wallet policy that will sign the PSBT;
+   * otherwise, it is added by signPsbt
+   */
+  static fromPsbt(psbt: PsbtV2, walletPolicy?: WalletPolicy): PreparedPsbt {
+    const merkelizedPsbt = new MerkelizedPsbt(psbt);
+
+    const lists: PreparedList[] = [];
+    const addMap = (map: MerkleMap) => {
+      lists.push({ elements: map.keys, tree: map.keysTree });
+      lists.push({ elements: map.values, tree: map.valuesTree });
+    };
+    const addList = (elements: readonly Buffer[]): Merkle => {
+      const tree = new Merkle(elements.map((el) => hashLeaf(el)));
+      lists.push({ elements, tree });
+      return tree;
+    };
+
+    addMap(merkelizedPsbt.globalMerkleMap);
+    merkelizedPsbt.inputMerkleMaps.forEach(addMap);
+    merkelizedPsbt.outputMerkleMaps.forEach(addMap);
+    const inputsTree = addList(merkelizedPsbt.inputMapCommitments);
+    const outputsTree = addList(merkelizedPsbt.outputMapCommitments);
+
+    const prepared = new PreparedPsbt(
+      merkelizedPsbt.getGlobalKeysValuesRoot(),
+      merkelizedPsbt.getGlobalInputCount(),
+      inputsTree.getRoot(),
+      merkelizedPsbt.getGlobalOutputCount(),
+      outputsTree.getRoot(),
+      lists,
+      undefined,
+      []
+    );
+    return walletPolicy ? prepared.withWalletPolicy(walletPolicy) : prepared;
+  }
+
+  /**
+   * Returns the same PreparedPsbt, with the preimages of walletPolicy; the
+   * lists of the PSBT are shared, not copied.
+   */
+  withWalletPolicy(walletPolicy: WalletPolicy): PreparedPsbt {
+    if (this.walletId) {
+      throw new Error('The PSBT is already prepared with a wallet policy');
+    }
+    const keys = walletPolicy.keys.map((k) => Buffer.from(k, 'ascii'));
+    const keysList: PreparedList = {
+      elements: keys,
+      tree: new Merkle(keys.map((k) => hashLeaf(k))),
+    };
+    return new PreparedPsbt(
+      this.globalCommitment,
+      this.inputCount,
+      this.inputsRoot,
+      this.outputCount,
+      this.outputsRoot,
+      [...this.lists, keysList],
+      walletPolicy.getId(),
+      [walletPolicy.serialize()]
+    );
+  }
+
+  /**
+   * Adds all the lists and preimages to the ones known by the interpreter.
+   */
+  addTo(interpreter: ClientCommandInterpreter): void {
+    for (const list of this.lists) {
+      interpreter.addKnownTree(list.elements, list.tree);
+    }
+    for (const preimage of this.preimages) {
+      interpreter.addKnownPreimage(preimage);
+    }
+  }
+
+  /**
+   * Serializes the PreparedPsbt, including the leaves and the internal nodes
+   * of all the trees, so that deserialize does not compute any hash.
+   */
+  serialize(): Buffer {
+    const buf = new BufferWriter();
+    buf.writeUInt8(SERIALIZATION_VERSION);
+    buf.writeVarSlice(this.globalCommitment);
+    buf.writeVarInt(this.inputCount);
+    buf.writeSlice(this.inputsRoot);
+    buf.writeVarInt(this.outputCount);
+    buf.writeSlice(this.outputsRoot);
+    buf.writeVarInt(this.lists.length);
+    for (const list of this.lists) {
+      buf.writeVarInt(list.elements.length);
+      for (const element of list.elements) {
+        buf.writeVarSlice(element);
+      }
+      for (let i = 0; i < list.tree.size(); i++) {
+        buf.writeSlice(list.tree.getLeafHash(i));
+      }
+      buf.writeVarSlice(list.tree.getNodes());
+    }
+    buf.writeVarInt(this.preimages.length);
+    for (const preimage of this.preimages) {
+      buf.writeVarSlice(preimage);
+    }
+    buf.writeVarSlice(this.walletId ?? Buffer.alloc(0));
+    return buf.buffer();
+  }
+
+  /**
+   * Deserializes a PreparedPsbt returned by serialize; the result refers to
+   * the memory of psbt, that is not copied.
+   */
+  static deserialize(psbt: Buffer): PreparedPsbt {
+    const buf = new BufferReader(psbt);
+    const readNumber = () => sanitizeBigintToNumber(buf.readVarInt());
+
+    if (buf.readUInt8() != SERIALIZATION_VERSION) {
+      throw new Error('Unsupported version of the prepared PSBT');
+    }
+    const globalCommitment = buf.readVarSlice();
+    const inputCount = readNumber();
+    const inputsRoot = buf.readSlice(32);
+    const outputCount = readNumber();
+    const outputsRoot = buf.readSlice(32);
+    const lists: PreparedList[] = [];
+    const nLists = readNumber();
+    for (let i = 0; i < nLists; i++) {
+      const n = readNumber();
+      const elements: Buffer[] = [];
+      for (let j = 0; j < n; j++) {
+        elements.push(buf.readVarSlice());
+      }
+      const leaves: Buffer[] = [];
+      for (let j = 0; j < n; j++) {
+        leaves.push(buf.readSlice(32));
+      }
+      const tree = new Merkle(leaves, undefined, buf.readVarSlice());
+      lists.push({ elements, tree });
+    }
+    const preimages: Buffer[] = [];
+    const nPreimages = readNumber();
+    for (let i = 0; i < nPreimages; i++) {
+      preimages.push(buf.readVarSlice());
+    }
+    const walletId = buf.readVarSlice();
+    if (walletId.length != 0 && walletId.length != 32) {
+      throw new Error('Invalid wallet id');
+    }
+    if (buf.available() != 0) {
+      throw new Error('Unexpected data after the prepared PSBT');
+    }
+    return new PreparedPsbt(
+      globalCommitment,
+      inputCount,
+      inputsRoot,
+      outputCount,
+      outputsRoot,
+      lists,
+      walletId.length != 0 ? walletId : undefined,
+      preimages
+    );
+  }
+}
+
+/**
+ * The subset of the interface of a Web Worker (or of its global scope, in the
+ * worker) that is used to prepare PSBTs in the worker.
+ */
+export interface PsbtWorker {
+  postMessage(message: unknown, transfer: ArrayBuffer[]): void;
+  addEventListener(type: 'message', listener: MessageListener): void;
+  removeEventListener(type: 'message', listener: MessageListener): void;
+}
+
+type MessageListener = (event: { data: unknown }) => void;
+
+// the messages exchanged with the worker
+interface PrepareRequest {
+  readonly id: number;
+  readonly psbt: ArrayBuffer;
+}
+interface PrepareResponse {
+  readonly id: number;
+  readonly prepared?: ArrayBuffer;
+  readonly error?: string;
+}
+
+let nextRequestId = 0;
+
+/**
+ * Prepares a PSBT in a Web Worker, whose script must call registerPsbtWorker;
+ * the serialized PSBT and the result are transferred without copies. The same
+ * worker can prepare several PSBTs concurrently.
+ *
+ * Example (with a bundler that supports workers):
+ *
+ *     // psbtWorker.js
+ *     import { registerPsbtWorker } from 'ledger-bitcoin';
+ *     registerPsbtWorker(self);
+ *
+ *     // main thread
+ *     const worker = new Worker(new URL('./psbtWorker.js', import.meta.url));
+ *     const prepared = await preparePsbtInWorker(worker, psbt);
+ *     const sigs = await app.signPsbt(prepared, walletPolicy, walletHMAC);
+ */
+export function preparePsbtInWorker(
+  worker: PsbtWorker,
+  psbt: PsbtV2
+): Promise<PreparedPsbt> {
+  const id = nextRequestId++;
+  const serializedPsbt = toTransferable(psbt.serialize());
+  return new Promise((resolve, reject) => {
+    const listener: MessageListener = (event) => {
+      const message = event.data as PrepareResponse | undefined;
+      if (!message || message.id !== id) {
+        return; // the response to another request
+      }
+      worker.removeEventListener('message', listener);
+      if (message.prepared === undefined) {
+        reject(new Error(message.error));
+      } else {
+        try {
+          resolve(PreparedPsbt.deserialize(Buffer.from(message.prepared)));
+        } catch (e) {
+          reject(e);
+        }
+      }
+    };
+    worker.addEventListener('message', listener);
+    const request: PrepareRequest = { id, psbt: serializedPsbt };
+    worker.postMessage(request, [serializedPsbt]);
+  });
+}
+
+/**
+ * Handles the requests of preparePsbtInWorker; it must be called in the
+ * script of the worker, with its global scope (self).
+ */
+export function registerPsbtWorker(scope: PsbtWorker): void {
+  scope.addEventListener('message', (event) => {
+    const { id, psbt } = event.data as PrepareRequest;
+    let response: PrepareResponse;
+    try {
+      const psbtV2 = new PsbtV2();
+      psbtV2.deserialize(Buffer.from(psbt));
+      const prepared = PreparedPsbt.fromPsbt(psbtV2).serialize();
+      response = { id, prepared: toTransferable(prepared) };
+    } catch (e) {
+      response = { id, error: e instanceof Error ? e.message : String(e) };
+    }
+    const transfer = response.prepared ? [response.prepared] : [];
+    scope.postMessage(response, transfer);
+  });
+}
+
+/**
+ * Returns an ArrayBuffer with the content of buf, that can be transferred;
+ * buf is only copied if it does not cover the whole of its ArrayBuffer.
+ */
+function toTransferable(buf: Buffer): ArrayBuffer {
+  if (buf.byteOffset == 0 && buf.byteLength == buf.buffer.byteLength) {
+    return buf.buffer as ArrayBuffer;
+  }
+  return buf.buffer.slice(
+    buf.byteOffset,
+    buf.byteOffset + buf.byteLength
+  ) as ArrayBuffer;
+}
@@ -22,6 +22,7 @@ export enum psbtIn {
   PARTIAL_SIG = 0x02,
   SIGHASH_TYPE = 0x03,
   REDEEM_SCRIPT = 0x04,
+  WITNESS_SCRIPT = 0x05,
   BIP32_DERIVATION = 0x06,
   FINAL_SCRIPTSIG = 0x07,
   FINAL_SCRIPTWITNESS = 0x08,
@@ -324,6 +325,16 @@ export class PsbtV2 {
     this.copyMaps(this.inputMaps, to.inputMaps);
     this.copyMaps(this.outputMaps, to.outputMaps);
   }
+  /**
+   * Like copy, but the values are shared instead of copied: this is only safe
+   * as long as they are not modified in place (the getters return copies, and
+   * the setters replace the values).
+   */
+  shallowCopy(to: PsbtV2) {
+    to.globalMap = new Map(this.globalMap);
+    to.inputMaps = this.inputMaps.map((m) => new Map(m));
+    to.outputMaps = this.outputMaps.map((m) => new Map(m));
+  }
   copyMaps(
     from: readonly ReadonlyMap<string, Buffer>[],
     to: Map<string, Buffer>[]
@@ -349,6 +360,10 @@ export class PsbtV2 {
     });
     return buf.buffer();
   }
+  /**
+   * Parses a serialized psbt; the values are views of psbt, that is not
+   * copied, and must not be modified afterwards.
+   */
   deserialize(psbt: Buffer) {
     const buf = new BufferReader(psbt);
     if (!buf.readSlice(5).equals(PSBT_MAGIC_BYTES)) {
@@ -369,10 +384,9 @@ export class PsbtV2 {
     if (keyLen == 0) {
       return false;
     }
-    const keyType = buf.readUInt8();
-    const keyData = buf.readSlice(keyLen - 1);
-    const value = buf.readVarSlice();
-    set(map, keyType, keyData, value);
+    // the key is used as serialized (key type and key data)
+    const key = buf.readSlice(keyLen).toString('hex');
+    map.set(key, buf.readVarSlice());
     return true;
   }
   private getKeyDatas(
@@ -388,7 +402,7 @@ export class PsbtV2 {
     return result;
   }
   private isKeyType(hexKey: string, keyTypes: readonly KeyType[]): boolean {
-    const keyType = Buffer.from(hexKey.substring(0, 2), 'hex').readUInt8(0);
+    const keyType = parseInt(hexKey.substring(0, 2), 16);
     return keyTypes.some((k) => k == keyType);
   }
   private setGlobal(keyType: KeyType, value: Buffer) {
@@ -560,8 +574,7 @@ function createKey(buf: Buffer): Key {
   return new Key(buf.readUInt8(0), buf.slice(1));
 }
 function serializeMap(buf: BufferWriter, map: ReadonlyMap<string, Buffer>) {
-  for (const k in map.keys) {
-    const value = map.get(k)!;
+  for (const [k, value] of map) {
     const keyPair = new KeyPair(createKey(Buffer.from(k, 'hex')), value);
     keyPair.serialize(buf);
   }
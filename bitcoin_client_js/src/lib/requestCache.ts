@@ -0,0 +1,60 @@
+/**
+ * Cache of the results of the requests to the devices that only depend on their seed.
+ *
+ * An `AppClient` created with a `RequestCache` in its options serves the repeated calls to
+ * `getExtendedPubkey` and `getWalletAddress` (when nothing is shown on the screen) from the cache,
+ * and concurrent identical calls share a single exchange with the device. The results are keyed by
+ * the master fingerprint of the device and the parameters of the request; therefore, the same
+ * cache can be shared among the clients of different devices.
+ *
+ * At most `maxEntries` results are kept, evicting the least recently used ones. An error is not
+ * cached: it is returned to all the callers waiting for the same request, and the next call
+ * retries.
+ */
+export class RequestCache {
+  // the results, and the requests in flight, in order of last use
+  private readonly entries: Map<string, Promise<string>> = new Map();
+
+  constructor(readonly maxEntries: number = 4096) {
+    if (!(maxEntries >= 1)) {
+      throw new Error('maxEntries must be positive');
+    }
+  }
+
+  get size(): number {
+    return this.entries.size;
+  }
+
+  /**
+   * Removes all the cached results; the requests in flight are not affected.
+   */
+  clear(): void {
+    this.entries.clear();
+  }
+
+  /**
+   * Returns the result of `key`, if it is cached or already requested; otherwise, requests it with
+   * `compute`, and caches it.
+   */
+  run(key: string, compute: () => Promise<string>): Promise<string> {
+    let result = this.entries.get(key);
+    if (result !== undefined) {
+      // moved to the end, as the most recently used
+      this.entries.delete(key);
+    } else {
+      result = compute();
+      result.catch(() => {
+        // only the promise of the failed request is removed, as it could be already replaced
+        if (this.entries.get(key) === result) {
+          this.entries.delete(key);
+        }
+      });
+    }
+    this.entries.set(key, result);
+
+    while (this.entries.size > this.maxEntries) {
+      this.entries.delete(this.entries.keys().next().value as string);
+    }
+    return result;
+  }
+}
@@ -0,0 +1,148 @@
+import argparse
+import json
+import os
+import sys
+
+from typing import Dict, List, Optional
+
+"""
+Merges the results of the benchmark matrix of the CI in a single report, to compare the targets (Nano S, Nano X,
+Nano S Plus) and the variants of the app.
+
+Each argument is the folder with the results of one build, named after it (for example nanos-bitcoin_testnet), that
+can contain any of:
+
+- memory_report.json, written by `make memory-report MEMORY_REPORT_JSON=...`;
+- stack_profile_report.json, written by tests/test_stack_profile.py with an app compiled with STACK_PROFILE=1;
+- benchmark_report.json, written by tests/test_benchmark_sign_psbt.py;
+- apdu_trace.json, written by tests/test_apdu_trace.py.
+
+The report is written in Markdown (for example, to $GITHUB_STEP_SUMMARY), and with --json also as a JSON file:
+
+```
+$ python dev-tools/benchmark_matrix.py results/* --json benchmark_matrix.json >> $GITHUB_STEP_SUMMARY
+```
+"""
+
+# quantities of the memory report in the table, with their heading
+MEMORY_COLUMNS = [
+    ("flash", "flash"),
+    ("ram", "RAM"),
+    ("ram_free", "free RAM"),
+    ("stack", "stack"),
+    ("sizeof(command_state_t)", "command state"),
+]
+
+
+def load(folder: str, name: str) -> Optional[dict]:
+    path = os.path.join(folder, name)
+    if not os.path.isfile(path):
+        return None
+    with open(path) as f:
+        return json.load(f)
+
+
+def table(header: List[str], rows: List[List[str]]) -> List[str]:
+    lines = ["| " + " | ".join(header) + " |", "|" + "|".join("---" for _ in header) + "|"]
+    lines += ["| " + " | ".join(row) + " |" for row in rows]
+    return lines
+
+
+def fmt(value) -> str:
+    if value is None:
+        return "-"
+    if isinstance(value, float):
+        return f"{value:.2f}"
+    return str(value)
+
+
+def benchmark_case(result: dict) -> str:
+    params = [f"{key}={result[key]}" for key in ("policy", "n_inputs", "n_outputs", "fixture") if key in result]
+    return f"{result['name']} ({', '.join(params)})" if params else result["name"]
+
+
+def merge(folders: List[str]) -> dict:
+    """Returns the results of each build, by name of the folder."""
+    builds: Dict[str, dict] = {}
+    for folder in folders:
+        name = os.path.basename(os.path.normpath(folder))
+        builds[name] = {
+            "memory": load(folder, "memory_report.json"),
+            "stack_profile": load(folder, "stack_profile_report.json"),
+            "benchmarks": load(folder, "benchmark_report.json"),
+            "apdu_trace": load(folder, "apdu_trace.json"),
+        }
+    return builds
+
+
+def report(builds: Dict[str, dict]) -> List[str]:
+    lines = ["# Benchmark matrix", ""]
+
+    # memory, and the stack headroom measured with STACK_PROFILE=1
+    rows = []
+    for name, build in builds.items():
+        memory = build["memory"] or {}
+        values = memory.get("values", {})
+        headroom = memory.get("headroom", {})
+        profiles = (build["stack_profile"] or {}).get("results", [])
+        max_depth = max((p["max_depth"] for p in profiles), default=None)
+        stack_headroom = min((p["headroom"] for p in profiles), default=None)
+        rows.append([name, memory.get("target", "-")] + [fmt(values.get(key)) for key, _ in MEMORY_COLUMNS] +
+                    [fmt(max_depth), fmt(stack_headroom),
+                     fmt(min(headroom.values(), default=None))])
+    lines.append("## Memory (bytes)")
+    lines.append("")
+    lines += table(["build", "target"] + [heading for _, heading in MEMORY_COLUMNS] +
+                   ["max stack depth", "stack headroom", "min budget headroom"], rows)
+    lines.append("")
+
+    # wall time and APDUs of each benchmark, with the builds as columns
+    names = [name for name, build in builds.items() if build["benchmarks"] is not None]
+    if names:
+        cases: Dict[str, Dict[str, dict]] = {}
+        for name in names:
+            for result in builds[name]["benchmarks"]["results"]:
+                cases.setdefault(benchmark_case(result), {})[name] = result
+        rows = [[case] + [f"{fmt(results[name]['wall_time'])} s, {results[name]['apdus']} APDUs"
+                          if name in results else "-" for name in names]
+                for case, results in cases.items()]
+        lines.append("## Latency of SIGN_PSBT")
+        lines.append("")
+        lines += table(["benchmark"] + names, rows)
+        lines.append("")
+
+    # split of the time between device, host and transport
+    names = [name for name, build in builds.items() if build["apdu_trace"] is not None]
+    if names:
+        cases = {}
+        for name in names:
+            for result in builds[name]["apdu_trace"]["otherData"]["results"]:
+                cases.setdefault(result["name"], {})[name] = result
+        rows = [[case] + ["/".join(fmt(results[name][key]) for key in ("device_time", "host_time", "transport_time"))
+                          if name in results else "-" for name in names]
+                for case, results in cases.items()]
+        lines.append("## Time on the device / host / transport (s)")
+        lines.append("")
+        lines += table(["run"] + names, rows)
+        lines.append("")
+
+    return lines
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Merges the results of the benchmark matrix in a single report.")
+    parser.add_argument("folders", nargs="+", help="the folders with the results of each build")
+    parser.add_argument("--json", help="also write the merged results to this JSON file")
+    args = parser.parse_args()
+
+    builds = merge(args.folders)
+    print("\n".join(report(builds)))
+
+    if args.json is not None:
+        with open(args.json, "w") as f:
+            json.dump(builds, f, indent=2)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
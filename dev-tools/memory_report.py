@@ -0,0 +1,384 @@
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+
+from dataclasses import dataclass
+from typing import Dict, Iterator, List, Optional, Tuple
+
+"""
+Reports the RAM and flash budget of a build of the app, and checks it against the budgets of the target in
+dev-tools/memory_budget.json.
+
+The ELF is read with `readelf` (the one of binutils is enough for the ARM binaries; set $READELF to use another
+one), and the linker map for the memory regions and the size of each input section. The report includes:
+
+- the size of the flash and of the RAM used by the app, and the stack reserved at the end of the RAM;
+- the size of the overlapped `.legacy_globals` and `.new_globals` sections of script-nanos.ld (on Nano S; on the
+  other targets, they are regular sections);
+- the size of the main global variables and of their types, and of each member of `command_state_t`, read from
+  the DWARF debugging information;
+- the flash used by each source file.
+
+Each budget in memory_budget.json is the maximum size in bytes of one of the reported quantities, by name, per
+target; `null` budgets are only reported. With `--update-budget`, the budgets of the target are set to the current
+values (plus `--margin` bytes), so that any later growth has to be accepted deliberately. With `--json`, the values,
+the budgets and the headroom left by each budget are also written to a JSON file, for example to compare the
+targets.
+
+It must be run from the root of the repository after a build, for example:
+
+```
+$ make memory-report
+$ python dev-tools/memory_report.py --elf bin/app.elf --map debug/app.map --target TARGET_NANOS
+```
+"""
+
+DEFAULT_BUDGET_PATH = os.path.join(os.path.dirname(os.path.abspath(__file__)), "memory_budget.json")
+
+# global variables, and the types whose total size is reported
+GLOBALS = ["G_command_state", "G_dispatcher_context", "btchip_context_D", "G_io_apdu_buffer"]
+TYPES = ["command_state_t", "btchip_context_t", "dispatcher_context_t"]
+
+# the union whose members (the states of the handlers) are reported one by one
+COMMAND_STATE_TYPE = "command_state_t"
+
+# input sections of script-nanos.ld that are overlapped on Nano S
+OVERLAPPED_SECTIONS = [".legacy_globals", ".new_globals"]
+
+
+def readelf(elf: str, *args: str) -> str:
+    cmd = [os.environ.get("READELF", "readelf"), "--wide", *args, elf]
+    return subprocess.run(cmd, check=True, stdout=subprocess.PIPE, universal_newlines=True).stdout
+
+
+@dataclass
+class Region:
+    name: str
+    origin: int
+    length: int
+
+    def __contains__(self, address: int) -> bool:
+        return self.origin <= address < self.origin + self.length
+
+
+@dataclass
+class InputSection:
+    name: str
+    output_section: str
+    address: int
+    size: int
+    source: str
+
+
+def source_name(path: str) -> str:
+    # the objects of the app are named after their sources, in the obj/ folder of the build; the objects of the
+    # toolchain (and its archives, with the name of their member) are named by their file name only
+    path = path.strip()
+    if "obj/" in path:
+        return path[path.rindex("obj/") + 4:]
+    return os.path.basename(path)
+
+
+def parse_map(lines: List[str]) -> Tuple[Dict[str, Region], List[InputSection]]:
+    """Returns the memory regions and the input sections of a GNU ld map file."""
+
+    regions: Dict[str, Region] = {}
+    sections: List[InputSection] = []
+
+    region_re = re.compile(r"^(\S+)\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)")
+    output_re = re.compile(r"^(\.\S+|COMMON)(\s+0x[0-9a-f]+)?")
+    input_re = re.compile(r"^ (\S+)?\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S.*)$")
+
+    in_memory_config = in_memory_map = False
+    output_section = ""
+    pending_name: Optional[str] = None  # the name of an input section, when its address is on the next line
+    for line in lines:
+        line = line.rstrip("\n")
+        if line.startswith("Memory Configuration"):
+            in_memory_config = True
+            continue
+        if line.startswith("Linker script and memory map"):
+            in_memory_config, in_memory_map = False, True
+            continue
+
+        if in_memory_config:
+            m = region_re.match(line)
+            if m and m.group(1) != "Name" and m.group(1) != "*default*":
+                regions[m.group(1)] = Region(m.group(1), int(m.group(2), 16), int(m.group(3), 16))
+            continue
+
+        if not in_memory_map:
+            continue
+
+        m = output_re.match(line)
+        if m:
+            output_section = m.group(1)
+            pending_name = None
+            continue
+
+        if re.match(r"^ \S+$", line) and not line.strip().startswith("*"):
+            pending_name = line.strip()
+            continue
+
+        m = input_re.match(line)
+        if m and not line.startswith(" *fill*"):
+            name = m.group(1) or pending_name
+            pending_name = None
+            if name is None or name.startswith("*"):
+                continue
+            size = int(m.group(3), 16)
+            if size > 0:
+                sections.append(InputSection(name, output_section, int(m.group(2), 16), size,
+                                             source_name(m.group(4))))
+            continue
+
+        pending_name = None
+
+    return regions, sections
+
+
+def is_flash(section: InputSection, regions: Dict[str, Region]) -> bool:
+    if "FLASH" in regions:
+        return section.address in regions["FLASH"]
+    # without a memory configuration (for example, with the default linker script of the host)
+    return section.output_section.startswith((".text", ".rodata"))
+
+
+def parse_symbols(elf: str) -> Dict[str, Tuple[int, int]]:
+    """Returns the address and the size of each symbol of the ELF."""
+
+    symbols: Dict[str, Tuple[int, int]] = {}
+    symbol_re = re.compile(r"^\s*\d+:\s+([0-9a-f]+)\s+(\d+|0x[0-9a-f]+)\s+\S+\s+\S+\s+\S+\s+\S+\s+(\S+)$")
+    for line in readelf(elf, "--syms").splitlines():
+        m = symbol_re.match(line)
+        if m:
+            symbols.setdefault(m.group(3), (int(m.group(1), 16), int(m.group(2), 0)))
+    return symbols
+
+
+@dataclass
+class Die:
+    tag: str
+    attrs: Dict[str, str]
+    children: List[int]
+
+
+def parse_dwarf(elf: str) -> Dict[int, Die]:
+    """Returns the debugging information entries of the ELF, by offset, from the output of readelf."""
+
+    dies: Dict[int, Die] = {}
+    die_re = re.compile(r"^\s*<(\d+)><([0-9a-f]+)>: Abbrev Number: \d+ \((DW_TAG_\w+)\)")
+    attr_re = re.compile(r"^\s*<[0-9a-f]+>\s+(DW_AT_\w+)\s*:\s*(.*)$")
+
+    parents: List[int] = []  # the offsets of the current DIE and its ancestors, by depth
+    current: Optional[Die] = None
+    for line in readelf(elf, "--debug-dump=info").splitlines():
+        m = die_re.match(line)
+        if m:
+            depth, offset = int(m.group(1)), int(m.group(2), 16)
+            current = Die(m.group(3), {}, [])
+            dies[offset] = current
+            del parents[depth:]
+            if depth > 0 and len(parents) == depth:
+                dies[parents[-1]].children.append(offset)
+            parents.append(offset)
+            continue
+
+        m = attr_re.match(line)
+        if m and current is not None:
+            current.attrs[m.group(1)] = m.group(2).strip()
+
+    return dies
+
+
+def attr_name(die: Die) -> Optional[str]:
+    name = die.attrs.get("DW_AT_name")
+    # depending on the version of readelf and on the form, the name can be preceded by a description of its form,
+    # like "(string) name" or "(indirect string, offset: 0x1a2): name"
+    return None if name is None else re.sub(r"^(\([^()]*\):?\s*)+", "", name)
+
+
+def attr_int(die: Die, attr: str) -> Optional[int]:
+    value = die.attrs.get(attr)
+    if value is None:
+        return None
+    m = re.search(r"(0x[0-9a-f]+|\d+)\s*$", value)
+    return int(m.group(1), 0) if m else None
+
+
+def attr_ref(die: Die, attr: str) -> Optional[int]:
+    m = re.search(r"<0x([0-9a-f]+)>", die.attrs.get(attr, ""))
+    return int(m.group(1), 16) if m else None
+
+
+def type_size(dies: Dict[int, Die], offset: Optional[int]) -> Optional[int]:
+    while offset is not None and offset in dies:
+        die = dies[offset]
+        if die.tag == "DW_TAG_array_type":
+            element_size = type_size(dies, attr_ref(die, "DW_AT_type"))
+            if element_size is None:
+                return None
+            for child in map(dies.get, die.children):
+                count = attr_int(child, "DW_AT_count")
+                if count is None:
+                    upper_bound = attr_int(child, "DW_AT_upper_bound")
+                    count = None if upper_bound is None else upper_bound + 1
+                if count is None:
+                    return None
+                element_size *= count
+            return element_size
+
+        size = attr_int(die, "DW_AT_byte_size")
+        if size is not None:
+            return size
+        offset = attr_ref(die, "DW_AT_type")  # typedefs and qualifiers
+    return None
+
+
+def find_type(dies: Dict[int, Die], name: str) -> Optional[int]:
+    for offset, die in dies.items():
+        if die.tag == "DW_TAG_typedef" and attr_name(die) == name and type_size(dies, offset) is not None:
+            return offset
+    return None
+
+
+def members(dies: Dict[int, Die], type_offset: int) -> Iterator[Tuple[str, Optional[int]]]:
+    offset: Optional[int] = type_offset
+    while dies[offset].tag == "DW_TAG_typedef":
+        offset = attr_ref(dies[offset], "DW_AT_type")
+    for child in map(dies.get, dies[offset].children):
+        if child.tag == "DW_TAG_member":
+            yield attr_name(child) or "?", type_size(dies, attr_ref(child, "DW_AT_type"))
+
+
+def measure(elf: str, map_lines: List[str], n_sources: Optional[int]) -> Tuple[Dict[str, int], List[str]]:
+    """Returns the measured quantities by name, and the lines of the report."""
+
+    regions, sections = parse_map(map_lines)
+    symbols = parse_symbols(elf)
+    dies = parse_dwarf(elf)
+
+    values: Dict[str, int] = {}
+    report: List[str] = []
+
+    def add(name: str, value: Optional[int], description: str = ""):
+        if value is not None:
+            values[name] = value
+        report.append(f"  {name:<48} {'?' if value is None else value:>8}  {description}".rstrip())
+
+    flash_by_source: Dict[str, int] = {}
+    for section in sections:
+        if is_flash(section, regions):
+            flash_by_source[section.source] = flash_by_source.get(section.source, 0) + section.size
+
+    report.append("Memory:")
+    add("flash", sum(flash_by_source.values()), "code and constants")
+    if "_ebss" in symbols and "SRAM" in regions:
+        ram = symbols["_ebss"][0] - regions["SRAM"].origin
+        add("ram", ram, f"globals, of {regions['SRAM'].length} bytes of SRAM")
+    if "_stack" in symbols and "_estack" in symbols:
+        add("stack", symbols["_estack"][0] - symbols["_stack"][0], "reserved at the end of the SRAM")
+    if "_ebss" in symbols and "_stack" in symbols:
+        add("ram_free", symbols["_stack"][0] - symbols["_ebss"][0], "unused, between the globals and the stack")
+    for name in OVERLAPPED_SECTIONS:
+        add(name, sum(s.size for s in sections if s.name == name), "section")
+
+    report.append("Globals and types:")
+    for name in GLOBALS:
+        if name in symbols:
+            add(name, symbols[name][1])
+    command_state = None
+    for name in TYPES:
+        offset = find_type(dies, name)
+        if name == COMMAND_STATE_TYPE:
+            command_state = offset
+        add(f"sizeof({name})", None if offset is None else type_size(dies, offset))
+
+    if command_state is not None:
+        report.append(f"Members of {COMMAND_STATE_TYPE}:")
+        for member, size in members(dies, command_state):
+            add(f"{COMMAND_STATE_TYPE}.{member}", size)
+
+    report.append("Flash by source file:")
+    by_size = sorted(flash_by_source.items(), key=lambda item: -item[1])
+    for source, size in by_size[:n_sources]:
+        add(f"flash:{source}", size)
+    if n_sources is not None and len(by_size) > n_sources:
+        report.append(f"  ... and {len(by_size) - n_sources} more (use --all-sources)")
+
+    return values, report
+
+
+def check_budget(values: Dict[str, int], budget: Dict[str, Optional[int]]) -> List[str]:
+    """Returns the error messages for the quantities that exceed their budget."""
+    errors = []
+    for name, maximum in budget.items():
+        if maximum is None:
+            continue
+        if name not in values:
+            errors.append(f"{name}: not found in the build")
+        elif values[name] > maximum:
+            errors.append(f"{name}: {values[name]} bytes, over the budget of {maximum} bytes by "
+                          f"{values[name] - maximum}")
+    return errors
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Reports the RAM and flash budget of a build of the app.")
+    parser.add_argument("--elf", default="bin/app.elf", help="the ELF of the app")
+    parser.add_argument("--map", default="debug/app.map", help="the linker map of the app")
+    parser.add_argument("--target", required=True, help="the target of the build, for example TARGET_NANOS")
+    parser.add_argument("--budget", default=DEFAULT_BUDGET_PATH, help="the JSON file with the budgets per target")
+    parser.add_argument("--all-sources", action="store_true", help="report the flash of all the source files")
+    parser.add_argument("--update-budget", action="store_true",
+                        help="set the budgets of the target to the current values, instead of checking them")
+    parser.add_argument("--margin", type=int, default=0, help="bytes added to the current values with --update-budget")
+    parser.add_argument("--json", help="also write the values, the budgets and the headroom to this JSON file")
+    args = parser.parse_args()
+
+    with open(args.map) as f:
+        values, report = measure(args.elf, f.readlines(), None if args.all_sources else 20)
+
+    print(f"Memory report of {args.elf} ({args.target})")
+    print("\n".join(report))
+
+    with open(args.budget) as f:
+        budgets = json.load(f)
+    budget = budgets.get(args.target, {})
+
+    if args.json is not None:
+        with open(args.json, "w") as f:
+            json.dump({
+                "target": args.target,
+                "values": values,
+                "budget": budget,
+                "headroom": {name: maximum - values[name] for name, maximum in budget.items()
+                             if maximum is not None and name in values},
+            }, f, indent=2)
+
+    if args.update_budget:
+        for name in budget:
+            if name in values:
+                budget[name] = values[name] + args.margin
+        budgets[args.target] = budget
+        with open(args.budget, "w") as f:
+            json.dump(budgets, f, indent=2)
+            f.write("\n")
+        print(f"Budgets of {args.target} updated in {args.budget}")
+        return 0
+
+    errors = check_budget(values, budget)
+    if errors:
+        print(f"Budgets of {args.target} exceeded:", file=sys.stderr)
+        for error in errors:
+            print(f"  {error}", file=sys.stderr)
+        return 1
+    print(f"All the budgets of {args.target} are met")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
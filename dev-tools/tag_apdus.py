@@ -1,13 +1,15 @@
 from ctypes import ArgumentError
+import argparse
 import sys
 
-from dataclasses import dataclass
+from dataclasses import dataclass, field
 
-from typing import List, Mapping, Optional
+from typing import Dict, Iterable, Iterator, List, Mapping, Optional, Set, Tuple
 
 from bitcoin_client.ledger_bitcoin.client_command import ClientCommandCode
 from bitcoin_client.ledger_bitcoin.command_builder import BitcoinInsType, FrameworkInsType, BitcoinCommandBuilder
 from bitcoin_client.ledger_bitcoin.common import ByteStreamParser, sha256
+from bitcoin_client.ledger_bitcoin.psbt import PSBT, PartiallySignedInput, PartiallySignedOutput
 
 """
 Parses from standard input a transcript of a complete APDU exchange with the app, formatted as following:
@@ -38,7 +40,16 @@ and produces a more human-readable representation of the transcript:
 => ▶ <preimage_len:138><payload_size: 138><payload:005b66356163633266642f3438272f31272f30272f31275d747075624446417145474e7961643335596748387a787678465a714e556f507472356d446f6a7337777a6258514248545a347848655658473677324876734b766a4270615270546d6a59446a64506735773263365776753851426b794d44726d4257644379716b444d3772655373592f2a2a>)
 <= a47f78a76a965d19df634511401803db2af6c5883033bb8d1f1249f93317cdc9ff96c09cfacf89f836ded409b7315b9d7f242db8033e4de4db1cb4c275153988 9000
 
-It must be run from the root of the repository.
+With `--profile`, it instead aggregates the transcript into a cost report: the number of APDUs and bytes of each
+command and of each client command, the values of the PSBT maps requested by key type, the redundant client commands
+(the same request sent more than once during the same command, like the same Merkle leaf proof or the same preimage),
+and the latency estimated with a cost per APDU and per byte for USB and for BLE (see `--help`).
+
+It must be run from the root of the repository, for example:
+
+```
+$ python dev-tools/tag_apdus.py --profile < transcript.txt
+```
 """
 
 
@@ -454,6 +465,225 @@ client_command_formatters_map: Mapping[ClientCommandCode, ClientCommandFormatter
 }
 
 
+@dataclass
+class Stats:
+    count: int = 0
+    bytes_to_device: int = 0
+    bytes_from_device: int = 0
+
+    def add(self, bytes_to_device: int, bytes_from_device: int) -> None:
+        self.count += 1
+        self.bytes_to_device += bytes_to_device
+        self.bytes_from_device += bytes_from_device
+
+    @property
+    def bytes(self) -> int:
+        return self.bytes_to_device + self.bytes_from_device
+
+
+@dataclass
+class LinkCost:
+    """A simple model of the latency of a transport: a fixed cost for each APDU exchange (the round trip of the
+    first packet), and a cost for each byte sent or received."""
+    name: str
+    apdu_ms: float
+    byte_ms: float
+
+    def estimate_ms(self, stats: Stats) -> float:
+        return stats.count * self.apdu_ms + stats.bytes * self.byte_ms
+
+
+# rough defaults, that should be calibrated with a measured transcript: a USB HID report of 64 bytes per
+# millisecond, and a BLE connection interval of 15 ms with about 10 kB/s of throughput
+DEFAULT_USB_COST = LinkCost("USB", apdu_ms=2.0, byte_ms=0.016)
+DEFAULT_BLE_COST = LinkCost("BLE", apdu_ms=15.0, byte_ms=0.1)
+
+
+# names of the key types of each kind of PSBT map
+PSBT_KEY_TYPE_NAMES: Mapping[str, Mapping[int, str]] = {
+    kind: {value: name for name, value in vars(cls).items() if name.startswith(prefix)}
+    for kind, cls, prefix in [("global", PSBT, "PSBT_GLOBAL_"), ("input", PartiallySignedInput, "PSBT_IN_"),
+                              ("output", PartiallySignedOutput, "PSBT_OUT_")]
+}
+
+
+@dataclass
+class TranscriptProfiler:
+    """Aggregates the costs of a transcript, one APDU exchange at a time (see `add_exchange`).
+
+    The PSBT key type of a requested value is only known if the device sends the hash of a key whose preimage was
+    seen in the transcript (or is a single byte, as most keys of PSBTv2); the kind of map (global, input or output)
+    is known once the device has fetched its map commitment with GET_MERKLE_LEAF_PROOF and GET_PREIMAGE."""
+
+    apdus: Stats = field(default_factory=Stats)
+    commands: Dict[str, Stats] = field(default_factory=dict)
+    client_commands: Dict[str, Stats] = field(default_factory=dict)
+    key_types: Dict[str, Stats] = field(default_factory=dict)
+    redundant: Dict[str, Stats] = field(default_factory=dict)
+    speculative_bytes: int = 0
+
+    def __post_init__(self) -> None:
+        self.known_preimages = CommandContext().known_preimages
+        self.current_command: Optional[str] = None
+        self.client_request: Optional[bytes] = None
+        self.seen_requests: Set[bytes] = set()
+        # keys root => kind of the map
+        self.map_kinds: Dict[bytes, str] = {}
+        # root of the tree of the map commitments => kind of the maps
+        self.commitment_tree_kinds: Dict[bytes, str] = {}
+        # hash of a leaf of a tree of map commitments => kind of the map
+        self.commitment_kinds: Dict[bytes, str] = {}
+
+    def add_exchange(self, apdu_raw: bytes, response_raw: bytes) -> None:
+        apdu = APDU.from_raw(apdu_raw)
+        sw = int.from_bytes(response_raw[-2:], byteorder="big")
+        response = response_raw[:-2]
+
+        if apdu.cla == BitcoinCommandBuilder.CLA_BITCOIN:
+            try:
+                self.current_command = BitcoinInsType(apdu.ins).name
+            except ValueError:
+                self.current_command = f"0x{apdu.ins:02X}"
+            self.seen_requests.clear()
+            if apdu.ins == BitcoinInsType.SIGN_PSBT:
+                self._start_sign_psbt(apdu.data)
+        elif (apdu.cla == BitcoinCommandBuilder.CLA_FRAMEWORK and apdu.ins == FrameworkInsType.CONTINUE_INTERRUPTED
+              and self.client_request is not None):
+            cdata = apdu.data
+            if apdu.p1 == BitcoinCommandBuilder.P1_CONTINUE_SPECULATIVE:
+                self.speculative_bytes += len(cdata) - 1 - cdata[0]
+                cdata = cdata[1:1 + cdata[0]]
+            self._add_client_command(self.client_request, cdata)
+        elif self.current_command is None:
+            self.current_command = f"{apdu.cla:02X}{apdu.ins:02X}"
+
+        self.apdus.add(len(apdu_raw), len(response_raw))
+        self.commands.setdefault(self.current_command, Stats()).add(len(apdu_raw), len(response_raw))
+
+        self.client_request = response if sw == 0xE000 and len(response) > 0 else None
+        if self.client_request is None:
+            self.current_command = None
+
+    def _start_sign_psbt(self, data: bytes) -> None:
+        stream = ByteStreamParser(data)
+        stream.read_varint()
+        self.map_kinds[stream.read_bytes(32)] = "global"
+        stream.read_bytes(32)
+        stream.read_varint()
+        self.commitment_tree_kinds[stream.read_bytes(32)] = "input"
+        stream.read_varint()
+        self.commitment_tree_kinds[stream.read_bytes(32)] = "output"
+
+    def _key_type(self, keys_root: bytes, key_hash: bytes) -> str:
+        kind = self.map_kinds.get(keys_root, "unknown map")
+        preimage = self.known_preimages.get(key_hash)
+        if preimage is None or len(preimage) < 2:
+            return f"{kind} unknown key"
+        key_type = preimage[1]  # after the 0x00 prefix of the leaves
+        return PSBT_KEY_TYPE_NAMES.get(kind, {}).get(key_type, f"{kind} 0x{key_type:02x}")
+
+    def _add_client_command(self, request: bytes, response: bytes) -> None:
+        code = request[0]
+        try:
+            name = ClientCommandCode(code).name
+        except ValueError:
+            name = f"0x{code:02X}"
+        self.client_commands.setdefault(name, Stats()).add(len(response), len(request))
+
+        if code not in (ClientCommandCode.YIELD, ClientCommandCode.GET_MORE_ELEMENTS):
+            if request in self.seen_requests:
+                self.redundant.setdefault(name, Stats()).add(len(response), len(request))
+            self.seen_requests.add(request)
+
+        stream = ByteStreamParser(request[1:])
+        if code == ClientCommandCode.GET_MERKLEIZED_MAP_VALUE:
+            keys_root = stream.read_bytes(32)
+            stream.read_bytes(32)
+            stream.read_varint()
+            key = self._key_type(keys_root, stream.read_bytes(32))
+            self.key_types.setdefault(key, Stats()).add(len(response), len(request))
+        elif code == ClientCommandCode.GET_MERKLE_LEAF_INDEX:
+            root = stream.read_bytes(32)
+            if root in self.map_kinds:
+                key = self._key_type(root, stream.read_bytes(32))
+                self.key_types.setdefault(key, Stats()).add(len(response), len(request))
+        elif code == ClientCommandCode.GET_MERKLE_LEAF_PROOF:
+            root = stream.read_bytes(32)
+            if root in self.commitment_tree_kinds and len(response) >= 32:
+                self.commitment_kinds[response[:32]] = self.commitment_tree_kinds[root]
+        elif code == ClientCommandCode.GET_PREIMAGE:
+            stream.read_bytes(1)
+            image = stream.read_bytes(32)
+            response_stream = ByteStreamParser(response)
+            preimage_len = response_stream.read_varint()
+            payload = response_stream.read_bytes(response_stream.read_uint(1))
+            if len(payload) == preimage_len:
+                self.known_preimages[image] = payload
+                if image in self.commitment_kinds:
+                    # the map commitment: <0x00> <size> <keys root> <values root>
+                    payload_stream = ByteStreamParser(payload[1:])
+                    payload_stream.read_varint()
+                    self.map_kinds[payload_stream.read_bytes(32)] = self.commitment_kinds[image]
+
+    def report(self, costs: Iterable[LinkCost]) -> str:
+        costs = list(costs)
+        lines: List[str] = []
+
+        def table(title: str, rows: Mapping[str, Stats]) -> None:
+            lines.append(title)
+            header = f"  {'':<34}{'count':>8}{'to device':>12}{'from device':>13}"
+            lines.append(header + "".join(f"{cost.name + ' ms':>12}" for cost in costs))
+            for name, stats in sorted(rows.items(), key=lambda item: -item[1].bytes):
+                row = f"  {name:<34}{stats.count:>8}{stats.bytes_to_device:>12}{stats.bytes_from_device:>13}"
+                lines.append(row + "".join(f"{cost.estimate_ms(stats):>12.1f}" for cost in costs))
+            lines.append("")
+
+        table("APDUs (including the headers and the status words), by command:", self.commands)
+        table("Client commands (bytes of the requests and of the responses):", self.client_commands)
+        if len(self.key_types) > 0:
+            table("Values of the PSBT maps, by key type:", self.key_types)
+        if len(self.redundant) > 0:
+            table("Redundant client commands (the same request sent again during the same command):", self.redundant)
+
+        total = self.apdus
+        lines.append(f"Total: {total.count} APDUs, {total.bytes_to_device} bytes to the device, "
+                     f"{total.bytes_from_device} bytes from the device")
+        if self.speculative_bytes > 0:
+            lines.append(f"Speculative responses: {self.speculative_bytes} bytes")
+        n_redundant = sum(stats.count for stats in self.redundant.values())
+        for cost in costs:
+            # each redundant client command costs a whole APDU exchange
+            wasted = Stats(n_redundant, sum(s.bytes_to_device for s in self.redundant.values()) + 5 * n_redundant,
+                           sum(s.bytes_from_device for s in self.redundant.values()) + 2 * n_redundant)
+            lines.append(f"Estimated {cost.name} latency: {cost.estimate_ms(total):.1f} ms "
+                         f"({cost.apdu_ms} ms per APDU, {cost.byte_ms} ms per byte), "
+                         f"of which {cost.estimate_ms(wasted):.1f} ms for the redundant client commands")
+        return "\n".join(lines)
+
+
+def read_transcript(lines: Iterable[str]) -> Iterator[Tuple[bytes, bytes]]:
+    """Returns the pairs (APDU, response) of a transcript, skipping the empty lines."""
+    apdu_raw: Optional[bytes] = None
+    for line in lines:
+        if len(line.strip()) == 0:
+            continue
+        direction, data = line.strip().split(' ')
+        if apdu_raw is None:
+            assert direction == '=>'
+            apdu_raw = bytes.fromhex(data)
+        else:
+            assert direction == '<='
+            yield apdu_raw, bytes.fromhex(data)
+            apdu_raw = None
+
+
+def profile(lines: Iterable[str], costs: Iterable[LinkCost]) -> str:
+    profiler = TranscriptProfiler()
+    for apdu_raw, response_raw in read_transcript(lines):
+        profiler.add_exchange(apdu_raw, response_raw)
+    return profiler.report(costs)
+
+
 def run():
     # True if expecting an APDU going to the HWW (line starting with '=>'),
     # False if expecting a response (line starting with '<=')
@@ -565,4 +795,20 @@ def run():
 
 
 if __name__ == "__main__":
-    run()
+    parser = argparse.ArgumentParser(description="Tags or profiles a transcript of APDUs read from standard input.")
+    parser.add_argument("--profile", action="store_true", help="print a cost report instead of the tagged transcript")
+    parser.add_argument("--usb-apdu-ms", type=float, default=DEFAULT_USB_COST.apdu_ms,
+                        help="estimated cost of each APDU exchange over USB, in milliseconds")
+    parser.add_argument("--usb-byte-ms", type=float, default=DEFAULT_USB_COST.byte_ms,
+                        help="estimated cost of each byte over USB, in milliseconds")
+    parser.add_argument("--ble-apdu-ms", type=float, default=DEFAULT_BLE_COST.apdu_ms,
+                        help="estimated cost of each APDU exchange over BLE, in milliseconds")
+    parser.add_argument("--ble-byte-ms", type=float, default=DEFAULT_BLE_COST.byte_ms,
+                        help="estimated cost of each byte over BLE, in milliseconds")
+    args = parser.parse_args()
+
+    if args.profile:
+        print(profile(sys.stdin, [LinkCost("USB", args.usb_apdu_ms, args.usb_byte_ms),
+                                  LinkCost("BLE", args.ble_apdu_ms, args.ble_byte_ms)]))
+    else:
+        run()
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "../perf_config.h"
+
 /**
  * APDU instruction class for command defined by the framework.
  */
@@ -9,3 +11,62 @@
  * Framework instruction to continue execution after an interruption.
  */
 #define INS_CONTINUE 0x01
+
+/**
+ * P1 value of INS_CONTINUE if the data also contains speculative responses to the next client
+ * commands.
+ */
+#define P1_CONTINUE_SPECULATIVE 0x01
+
+/**
+ * P1 value of INS_CONTINUE, with no data, to ask for more time to prepare the response to the
+ * pending client command. It restarts the interruption timeout, and is answered with
+ * SW_INTERRUPTED_EXECUTION and no data.
+ */
+#define P1_CONTINUE_KEEPALIVE 0x02
+
+/**
+ * Length of the tag identifying the request of a speculative response (a prefix of the SHA-256
+ * hash of the request).
+ */
+#define SPECULATIVE_RESPONSE_TAG_LEN 4
+
+/**
+ * Framework instruction to get the maximum length of the data of a CONTINUE command, and the
+ * maximum length of the speculative responses it can contain.
+ */
+#define INS_GET_MAX_RESPONSE_LEN 0x02
+
+/**
+ * Framework instruction to read the trace of the dispatcher; only supported in the builds with
+ * HAVE_DISPATCHER_TRACE.
+ */
+#define INS_GET_TRACE 0x03
+
+/**
+ * P2 value of INS_GET_TRACE to clear the trace after reading it.
+ */
+#define P2_GET_TRACE_CLEAR 0x01
+
+/**
+ * Framework instruction to read the counters of the expensive operations performed by the last
+ * command; only supported in the builds with HAVE_PERF_COUNTERS.
+ */
+#define INS_GET_PERF_COUNTERS 0x04
+
+/**
+ * Framework instruction to read the stack usage measured since startup; only supported in the
+ * builds with HAVE_STACK_PROFILE.
+ */
+#define INS_GET_STACK_PROFILE 0x05
+
+/**
+ * P2 value of INS_GET_STACK_PROFILE to clear the measurements after reading them.
+ */
+#define P2_GET_STACK_PROFILE_CLEAR 0x01
+
+/**
+ * Framework instruction to read the hits, misses and evictions of the caches during the last
+ * command; only supported in the builds with HAVE_PERF_COUNTERS.
+ */
+#define INS_GET_CACHE_STATS 0x06
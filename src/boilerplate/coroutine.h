@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "dispatcher.h"
+
+/**
+ * Stackless coroutines (in the style of protothreads) on top of the machine contexts of the
+ * dispatcher.
+ *
+ * A coroutine is a command processor that runs in its own machine context, started with
+ * start_flow; its state is a struct whose first member is a coroutine_t. Instead of waiting for
+ * the response of a client command in a nested call to process_interruption, the coroutine returns
+ * to the dispatcher with CO_AWAIT, and it is called again from the point where it left once the
+ * response is received. Therefore, the frames of the coroutine and of its callers are not on the
+ * stack while waiting for the client.
+ *
+ * As the body is resumed by jumping inside a switch statement, the local variables are not
+ * preserved across CO_AWAIT and CO_CALL: anything that is needed after them must be in the state.
+ * For the same reason, CO_AWAIT and CO_CALL can not be used inside another switch statement, and at
+ * most once per line.
+ *
+ * Example:
+ *
+ *     static void my_coroutine(dispatcher_context_t *dc) {
+ *         my_coroutine_state_t *state = (my_coroutine_state_t *) dc->machine_context_ptr;
+ *
+ *         CO_BEGIN(&state->co, my_coroutine);
+ *
+ *         buffer_t req = dc_get_request_buffer(dc);
+ *         ... write the request ...
+ *         CO_AWAIT(dc, &state->co, &req);
+ *
+ *         ... parse the response from dc->read_buffer ...
+ *
+ *         CO_END(&state->co);
+ *     }
+ */
+
+typedef struct {
+    machine_context_t ctx;       // must be the first member, as for any machine context
+    command_processor_t resume;  // the processor that implements the coroutine
+    uint16_t resume_line;        // 0 at the beginning, otherwise the line where to resume
+} coroutine_t;
+
+/**
+ * Initializes a coroutine, and starts it as a subflow of the current machine context; the
+ * return_processor is called after the coroutine ends.
+ */
+static inline void co_start(dispatcher_context_t *dc,
+                            coroutine_t *co,
+                            command_processor_t coroutine,
+                            command_processor_t return_processor) {
+    co->resume = coroutine;
+    co->resume_line = 0;
+    dc->start_flow(coroutine, &co->ctx, return_processor);
+}
+
+/**
+ * Must be at the beginning of the body of the coroutine, which is the processor fn.
+ */
+#define CO_BEGIN(co, fn)         \
+    (co)->resume = (fn);         \
+    switch ((co)->resume_line) { \
+        case 0:
+
+/**
+ * Sends the request, written in the buffer returned by dc_get_request_buffer, and yields to the
+ * dispatcher. The coroutine resumes after the response is received in dc->read_buffer.
+ */
+#define CO_AWAIT(dc, co, request)                        \
+    do {                                                 \
+        (co)->resume_line = __LINE__;                    \
+        dispatcher_await((dc), (request), (co)->resume); \
+        return;                                          \
+        case __LINE__:;                                  \
+    } while (0)
+
+/**
+ * Runs another coroutine (already initialized with its inputs) as a subflow, and resumes after it
+ * ends.
+ */
+#define CO_CALL(dc, co, sub_co, sub_fn)                   \
+    do {                                                  \
+        (co)->resume_line = __LINE__;                     \
+        co_start((dc), (sub_co), (sub_fn), (co)->resume); \
+        return;                                           \
+        case __LINE__:;                                   \
+    } while (0)
+
+/**
+ * Must be at the end of the body of the coroutine. Returning from the body in any other way (for
+ * example, after an error) also ends the coroutine.
+ */
+#define CO_END(co) \
+    }              \
+    (co)->resume_line = 0
@@ -18,6 +18,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "cx.h"
+
 #include "dispatcher.h"
 #include "constants.h"
 #include "globals.h"
@@ -25,6 +27,15 @@
 #include "sw.h"
 
 #include "common/buffer.h"
+#include "common/write.h"
+
+#ifdef HAVE_PERF_COUNTERS
+#include "../crypto.h"
+#endif
+
+#include "../ui/display.h"
+
+#include "debug-helpers/stack_profile.h"
 
 extern dispatcher_context_t G_dispatcher_context;
 
@@ -36,33 +47,358 @@ struct {
     bool paused;
     uint16_t sw;
     bool had_ux_flow;  // set to true if there was any UX flow during the APDU processing
+    bool awaiting;     // set to true if the last processor yielded with dispatcher_await
+    // the background task of the current command, if any; step is NULL once it is completed
+    dispatcher_background_step_t background_step;
+    command_processor_t background_on_end;
 } G_dispatcher_state;
 
+// Responses to the next client commands that the client sent in advance, with an INS_CONTINUE with
+// P1 = P1_CONTINUE_SPECULATIVE. Each entry is:
+// <tag : SPECULATIVE_RESPONSE_TAG_LEN> <response_len : 1> <response : response_len>
+// where the tag is the prefix of the SHA-256 hash of the request.
+struct {
+    uint8_t data[MAX_SPECULATIVE_RESPONSES_LEN];
+    size_t len;
+    size_t offset;
+} G_speculative_responses;
+
+#ifdef HAVE_STACK_PROFILE
+// Maximum length of the response of GET_STACK_PROFILE, and of the function names in it
+#define MAX_STACK_PROFILE_RESPONSE_LEN 250
+#define MAX_STACK_PROFILE_NAME_LEN     40
+#endif
+
+#ifdef HAVE_DISPATCHER_TRACE
+
+extern uint16_t G_ticks;
+
+#ifdef TARGET_NANOS
+#define DISPATCHER_TRACE_SIZE 32
+#else
+#define DISPATCHER_TRACE_SIZE 128
+#endif
+
+// Number of entries returned by each GET_TRACE command
+#define DISPATCHER_TRACE_ENTRIES_PER_RESPONSE 28
+
+// Events recorded in the trace, with the meaning of their code and value
+typedef enum {
+    TRACE_EVENT_COMMAND = 1,       // INS of a new command, and length of its data
+    TRACE_EVENT_PROCESSOR = 2,     // nesting depth of the processor, and its address
+    TRACE_EVENT_INTERRUPTION = 3,  // client command code, and length of the request
+    TRACE_EVENT_SPECULATIVE = 4,   // same, for a request answered with a speculative response
+    TRACE_EVENT_CONTINUE = 5,      // 0, and length of the data of the CONTINUE command
+    TRACE_EVENT_END = 6,           // 0, and status word of the final response
+    TRACE_EVENT_KEEPALIVE = 7,     // 0, and 0
+} trace_event_t;
+
+typedef struct {
+    uint16_t ticks;  // value of G_ticks when the event was recorded
+    uint8_t event;
+    uint8_t code;
+    uint32_t value;
+} trace_entry_t;
+
+// Ring buffer with the last DISPATCHER_TRACE_SIZE events. n_events counts all the events since the
+// trace was last cleared, so that the host can tell how many were overwritten.
+// The ticker events are only processed during the io_exchange calls; therefore, a long computation
+// between two exchanges is only accounted for in the ticks of the events after the next exchange.
+struct {
+    trace_entry_t entries[DISPATCHER_TRACE_SIZE];
+    uint32_t n_events;
+} G_dispatcher_trace;
+
+static void trace(trace_event_t event, uint8_t code, uint32_t value) {
+    trace_entry_t *entry =
+        &G_dispatcher_trace.entries[G_dispatcher_trace.n_events % DISPATCHER_TRACE_SIZE];
+    entry->ticks = G_ticks;
+    entry->event = event;
+    entry->code = code;
+    entry->value = value;
+    ++G_dispatcher_trace.n_events;
+}
+
+// Responds to GET_TRACE with the total number of events, followed by up to
+// DISPATCHER_TRACE_ENTRIES_PER_RESPONSE entries starting from the one with index P1, where 0 is the
+// oldest entry still in the buffer.
+static void send_trace(const command_t *cmd) {
+    if (cmd->p2 != 0 && cmd->p2 != P2_GET_TRACE_CLEAR) {
+        io_send_sw(SW_WRONG_P1P2);
+        return;
+    }
+
+    uint32_t n_events = G_dispatcher_trace.n_events;
+    uint32_t n_entries = n_events < DISPATCHER_TRACE_SIZE ? n_events : DISPATCHER_TRACE_SIZE;
+    uint32_t first = n_events - n_entries;  // index of the oldest entry, in the count of events
+
+    uint8_t response[4 + 8 * DISPATCHER_TRACE_ENTRIES_PER_RESPONSE];
+    size_t response_len = 0;
+    write_u32_be(response, 0, n_events);
+    response_len += 4;
+    for (uint32_t i = cmd->p1;
+         i < n_entries && i < cmd->p1 + DISPATCHER_TRACE_ENTRIES_PER_RESPONSE;
+         i++) {
+        const trace_entry_t *entry =
+            &G_dispatcher_trace.entries[(first + i) % DISPATCHER_TRACE_SIZE];
+        write_u16_be(response, response_len, entry->ticks);
+        response[response_len + 2] = entry->event;
+        response[response_len + 3] = entry->code;
+        write_u32_be(response, response_len + 4, entry->value);
+        response_len += 8;
+    }
+
+    if (cmd->p2 == P2_GET_TRACE_CLEAR) {
+        G_dispatcher_trace.n_events = 0;
+    }
+
+    io_send_response(response, response_len, SW_OK);
+}
+
+#define TRACE(event, code, value) trace(event, code, value)
+#else
+#define TRACE(event, code, value)
+#endif
+
+#ifdef HAVE_PERF_COUNTERS
+// Responds to GET_PERF_COUNTERS with the counters of the last command, each as a 4-byte big-endian
+// integer, in the order of perf_counters_t.
+static void send_perf_counters(const command_t *cmd) {
+    if (cmd->p1 != 0 || cmd->p2 != 0) {
+        io_send_sw(SW_WRONG_P1P2);
+        return;
+    }
+
+    const uint32_t counters[] = {G_perf_counters.ecfp_scalar_mult,
+                                 G_perf_counters.ecfp_add_point,
+                                 G_perf_counters.hmac_sha512,
+                                 G_perf_counters.sha256_compressions,
+                                 G_perf_counters.derive_node_bip32,
+                                 G_perf_counters.interruptions};
+
+    uint8_t response[4 * sizeof(counters) / sizeof(counters[0])];
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        write_u32_be(response, 4 * i, counters[i]);
+    }
+    io_send_response(response, sizeof(response), SW_OK);
+}
+
+_Static_assert(1 + 16 * N_CACHES <= 255, "The statistics of the caches must fit in a response");
+
+// Responds to GET_CACHE_STATS with <n_caches : 1>, followed by <hits : 4> <misses : 4>
+// <evictions : 4> <bytes : 4> for each cache of the last command, in the order of cache_id_t, with
+// the integers in big-endian.
+static void send_cache_stats(const command_t *cmd) {
+    if (cmd->p1 != 0 || cmd->p2 != 0) {
+        io_send_sw(SW_WRONG_P1P2);
+        return;
+    }
+
+    uint8_t response[1 + 16 * N_CACHES];
+    response[0] = N_CACHES;
+    for (size_t i = 0; i < N_CACHES; i++) {
+        write_u32_be(response, 1 + 16 * i, G_cache_stats[i].hits);
+        write_u32_be(response, 1 + 16 * i + 4, G_cache_stats[i].misses);
+        write_u32_be(response, 1 + 16 * i + 8, G_cache_stats[i].evictions);
+        write_u32_be(response, 1 + 16 * i + 12, G_cache_stats[i].bytes);
+    }
+    io_send_response(response, sizeof(response), SW_OK);
+}
+#endif
+
+#ifdef HAVE_STACK_PROFILE
+// Responds to GET_STACK_PROFILE with:
+// <stack_size : 2> <max_depth : 2> <n_entries : 1> <n_dropped : 1>
+// followed by the entries starting from the one with index P1, as many as fit in the response:
+// <kind : 1> <max_depth : 2> <address : 4> for a processor, or
+// <kind : 1> <max_depth : 2> <name_len : 1> <name : name_len> for a function.
+static void send_stack_profile(const command_t *cmd) {
+    if (cmd->p2 != 0 && cmd->p2 != P2_GET_STACK_PROFILE_CLEAR) {
+        io_send_sw(SW_WRONG_P1P2);
+        return;
+    }
+
+    uint8_t response[MAX_STACK_PROFILE_RESPONSE_LEN];
+    write_u16_be(response, 0, stack_profile_stack_size());
+    write_u16_be(response, 2, stack_profile_high_water());
+    response[4] = G_stack_profile.n_entries;
+    response[5] = G_stack_profile.n_dropped;
+    size_t response_len = 6;
+
+    for (unsigned int i = cmd->p1; i < G_stack_profile.n_entries; i++) {
+        const stack_profile_entry_t *entry = &G_stack_profile.entries[i];
+        size_t name_len = 0;
+        size_t entry_len = 3 + 4;
+        if (entry->kind == STACK_PROFILE_FUNCTION) {
+            name_len = strnlen((const char *) entry->key, MAX_STACK_PROFILE_NAME_LEN);
+            entry_len = 3 + 1 + name_len;
+        }
+
+        if (response_len + entry_len > sizeof(response)) {
+            break;
+        }
+
+        response[response_len] = entry->kind;
+        write_u16_be(response, response_len + 1, entry->max_depth);
+        if (entry->kind == STACK_PROFILE_FUNCTION) {
+            response[response_len + 3] = (uint8_t) name_len;
+            memcpy(response + response_len + 4, entry->key, name_len);
+        } else {
+            write_u32_be(response, response_len + 3, (uint32_t) (uintptr_t) entry->key);
+        }
+        response_len += entry_len;
+    }
+
+    if (cmd->p2 == P2_GET_STACK_PROFILE_CLEAR) {
+        stack_profile_clear();
+    }
+
+    io_send_response(response, response_len, SW_OK);
+}
+#endif
+
 static void dispatcher_loop();
 
+static void discard_speculative_responses() {
+    G_speculative_responses.len = 0;
+    G_speculative_responses.offset = 0;
+}
+
+// Sets the read_buffer to the response contained in the data of an INS_CONTINUE command, and stores
+// the speculative responses, if any. Returns false if the data is malformed.
+static bool parse_continue_data(dispatcher_context_t *dc, const command_t *cmd) {
+    discard_speculative_responses();
+
+    if (cmd->p1 == 0) {
+        dc->read_buffer = buffer_create(cmd->data, cmd->lc);
+        return true;
+    } else if (cmd->p1 != P1_CONTINUE_SPECULATIVE) {
+        return false;
+    }
+
+    // <response_len : 1> <response : response_len> <speculative responses>
+    if (cmd->lc < 1 || cmd->data[0] > cmd->lc - 1) {
+        return false;
+    }
+    size_t response_len = cmd->data[0];
+    dc->read_buffer = buffer_create(cmd->data + 1, response_len);
+
+    const uint8_t *speculative_data = cmd->data + 1 + response_len;
+    size_t speculative_len = cmd->lc - 1 - response_len;
+    if (speculative_len > MAX_SPECULATIVE_RESPONSES_LEN) {
+        return false;
+    }
+
+    // check that the entries are well formed
+    size_t pos = 0;
+    while (pos < speculative_len) {
+        if (speculative_len - pos < SPECULATIVE_RESPONSE_TAG_LEN + 1) {
+            return false;
+        }
+        size_t entry_response_len = speculative_data[pos + SPECULATIVE_RESPONSE_TAG_LEN];
+        pos += SPECULATIVE_RESPONSE_TAG_LEN + 1 + entry_response_len;
+        if (pos > speculative_len) {
+            return false;
+        }
+    }
+
+    memcpy(G_speculative_responses.data, speculative_data, speculative_len);
+    G_speculative_responses.len = speculative_len;
+    return true;
+}
+
+// If the next speculative response is for the request that is currently in the output buffer,
+// uses it instead of sending the request. Otherwise, all the speculative responses are discarded,
+// as the client predicted the client commands incorrectly.
+// Returns true if a speculative response was used.
+static bool use_speculative_response(dispatcher_context_t *dc) {
+    if (G_speculative_responses.offset >= G_speculative_responses.len) {
+        return false;
+    }
+
+    if (G_output_len < 2 || G_output_len > IO_APDU_BUFFER_SIZE) {
+        discard_speculative_responses();
+        return false;
+    }
+
+    // the request is in G_io_apdu_buffer, followed by the status word
+    uint8_t request_hash[32];
+    cx_hash_sha256(G_io_apdu_buffer, G_output_len - 2, request_hash, sizeof(request_hash));
+
+    const uint8_t *entry = G_speculative_responses.data + G_speculative_responses.offset;
+    if (memcmp(entry, request_hash, SPECULATIVE_RESPONSE_TAG_LEN) != 0) {
+        discard_speculative_responses();
+        return false;
+    }
+
+    size_t response_len = entry[SPECULATIVE_RESPONSE_TAG_LEN];
+    dc->read_buffer =
+        buffer_create((void *) (entry + SPECULATIVE_RESPONSE_TAG_LEN + 1), response_len);
+    G_speculative_responses.offset += SPECULATIVE_RESPONSE_TAG_LEN + 1 + response_len;
+
+    // the request is not sent
+    G_output_len = 0;
+    G_dispatcher_state.sw = 0;
+    return true;
+}
+
 static void next(command_processor_t next_processor) {
     G_dispatcher_context.machine_context_ptr->next_processor = next_processor;
 }
 
-static void add_to_response(const void *rdata, size_t rdata_len) {
+void dispatcher_add_to_response(const void *rdata, size_t rdata_len) {
     io_add_to_response(rdata, rdata_len);
 }
 
-static void finalize_response(uint16_t sw) {
+// Calls the on_end function of the background task (if any), and removes it.
+static void end_background_task(void) {
+    command_processor_t on_end = G_dispatcher_state.background_on_end;
+    G_dispatcher_state.background_step = NULL;
+    G_dispatcher_state.background_on_end = NULL;
+    if (on_end != NULL) {
+        on_end(&G_dispatcher_context);
+    }
+}
+
+void dispatcher_finalize_response(uint16_t sw) {
     G_dispatcher_state.sw = sw;
+    if (sw != SW_INTERRUPTED_EXECUTION) {
+        // the command ends
+        end_background_task();
+    }
     io_finalize_response(sw);
 }
 
-static void send_response() {
+void dispatcher_send_response(void) {
     io_confirm_response();
 }
 
+static void mark_ux_flow() {
+    // the screen of the ux flow replaces the "Processing..." screen
+    io_clear_processing_screen();
+
+    G_dispatcher_state.had_ux_flow = true;
+}
+
 static void pause() {
     G_dispatcher_state.paused = true;
 
-    // pause() is _always_ called for ux flows that wait for user input.
-    // No other flows should exist.
-    G_dispatcher_state.had_ux_flow = true;
+    // pause() is _always_ called for ux flows that wait for user input, except for the ones with a
+    // deferred approval, that call mark_ux_flow() when shown. No other flows should exist.
+    mark_ux_flow();
+}
+
+static void set_background_task(dispatcher_background_step_t step, command_processor_t on_end) {
+    G_dispatcher_state.background_step = step;
+    G_dispatcher_state.background_on_end = on_end;
+}
+
+void dispatcher_run_background_task(void) {
+    if (G_dispatcher_state.paused && G_dispatcher_state.background_step != NULL &&
+        !G_dispatcher_state.background_step(&G_dispatcher_context)) {
+        // completed; on_end is still called when the command ends
+        G_dispatcher_state.background_step = NULL;
+    }
 }
 
 static void run() {
@@ -86,22 +422,56 @@ static void start_flow(command_processor_t first_processor,
     G_dispatcher_context.machine_context_ptr = subcontext;
 }
 
+// Returns true if the apdu is an INS_CONTINUE with P1 = P1_CONTINUE_KEEPALIVE and no data.
+static bool is_keepalive(const uint8_t *apdu, int apdu_len) {
+    return apdu_len == 5 && apdu[0] == CLA_FRAMEWORK && apdu[1] == INS_CONTINUE &&
+           apdu[2] == P1_CONTINUE_KEEPALIVE && apdu[3] == 0 && apdu[4] == 0;
+}
+
 // TODO: refactor code in common with the main apdu loop
-static int process_interruption(dispatcher_context_t *dc) {
+int dispatcher_process_interruption(dispatcher_context_t *dc) {
     command_t cmd;
     int input_len;
 
+#ifdef HAVE_DISPATCHER_TRACE
+    uint8_t client_command_code = G_output_len > 2 ? G_io_apdu_buffer[0] : 0;
+    uint32_t request_len = G_output_len > 2 ? G_output_len - 2 : 0;
+#endif
+
+    if (use_speculative_response(dc)) {
+        TRACE(TRACE_EVENT_SPECULATIVE, client_command_code, request_len);
+        return 0;
+    }
+
+    TRACE(TRACE_EVENT_INTERRUPTION, client_command_code, request_len);
+    PERF_COUNT(interruptions, 1);
+
     // Reset structured APDU command
     memset(&cmd, 0, sizeof(cmd));
 
-    io_start_interruption_timeout();
+    while (true) {
+        io_start_interruption_timeout();
 
-    // Receive command bytes in G_io_apdu_buffer
-    if ((input_len = io_exchange(CHANNEL_APDU, G_output_len)) < 0) {
-        return -1;
+        // Receive command bytes in G_io_apdu_buffer
+        if ((input_len = io_exchange(CHANNEL_APDU, G_output_len)) < 0) {
+            return -1;
+        }
+
+        io_clear_interruption_timeout();
+
+        if (!is_keepalive(G_io_apdu_buffer, input_len)) {
+            break;
+        }
+
+        // The client needs more time for its response: the timeout restarts, and the client
+        // receives an interruption without data, so that it can send the actual response.
+        TRACE(TRACE_EVENT_KEEPALIVE, 0, 0);
+        G_io_apdu_buffer[0] = (SW_INTERRUPTED_EXECUTION >> 8) & 0xFF;
+        G_io_apdu_buffer[1] = SW_INTERRUPTED_EXECUTION & 0xFF;
+        G_output_len = 2;
     }
 
-    io_clear_interruption_timeout();
+    TRACE(TRACE_EVENT_CONTINUE, 0, input_len);
 
     G_output_len = 0;
 
@@ -136,11 +506,68 @@ static int process_interruption(dispatcher_context_t *dc) {
         return -1;
     }
 
-    dc->read_buffer = buffer_create(cmd.data, cmd.lc);
+    if (cmd.p2 != 0 || !parse_continue_data(dc, &cmd)) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return -1;
+    }
 
     return 0;
 }
 
+buffer_t dispatcher_get_request_buffer(dispatcher_context_t *dc) {
+    // the response of the client that is still in the APDU buffer is about to be overwritten
+    dc->read_buffer = buffer_create(NULL, 0);
+
+    io_reset_response();
+    return buffer_create(G_io_apdu_buffer, IO_APDU_BUFFER_SIZE - 2);
+}
+
+int dispatcher_exchange(dispatcher_context_t *dc, const buffer_t *request) {
+    if (request->ptr != G_io_apdu_buffer || request->offset > IO_APDU_BUFFER_SIZE - 2) {
+        return -1;  // not a buffer returned by dispatcher_get_request_buffer
+    }
+    G_output_len = request->offset;
+    dispatcher_finalize_response(SW_INTERRUPTED_EXECUTION);
+    return dispatcher_process_interruption(dc);
+}
+
+void dispatcher_await(dispatcher_context_t *dc,
+                      const buffer_t *request,
+                      command_processor_t resume_processor) {
+    if (request->ptr != G_io_apdu_buffer || request->offset > IO_APDU_BUFFER_SIZE - 2) {
+        SEND_SW(dc, SW_BAD_STATE);  // not a buffer returned by dispatcher_get_request_buffer
+        return;
+    }
+    G_output_len = request->offset;
+    dispatcher_finalize_response(SW_INTERRUPTED_EXECUTION);
+
+    dc->machine_context_ptr->next_processor = resume_processor;
+    G_dispatcher_state.awaiting = true;
+}
+
+// Sends the request of a processor that yielded with dispatcher_await, unless the next speculative
+// response is for it. Returns true if the response is already available, and the processor can be
+// resumed immediately.
+static bool send_awaited_request(dispatcher_context_t *dc) {
+#ifdef HAVE_DISPATCHER_TRACE
+    uint8_t client_command_code = G_output_len > 2 ? G_io_apdu_buffer[0] : 0;
+    uint32_t request_len = G_output_len > 2 ? G_output_len - 2 : 0;
+#endif
+
+    if (use_speculative_response(dc)) {
+        TRACE(TRACE_EVENT_SPECULATIVE, client_command_code, request_len);
+        return true;
+    }
+
+    TRACE(TRACE_EVENT_INTERRUPTION, client_command_code, request_len);
+    PERF_COUNT(interruptions, 1);
+
+    // the response will be in the data of the next INS_CONTINUE, received in the main loop
+    io_start_interruption_timeout();
+    dispatcher_send_response();
+    return false;
+}
+
 void apdu_dispatcher(command_descriptor_t const cmd_descriptors[],
                      int n_descriptors,
                      machine_context_t *top_context,
@@ -152,38 +579,116 @@ void apdu_dispatcher(command_descriptor_t const cmd_descriptors[],
     G_dispatcher_state.termination_cb = termination_cb;
     G_dispatcher_state.paused = false;
     G_dispatcher_state.sw = 0;
+    G_dispatcher_state.awaiting = false;
 
     G_dispatcher_context.next = next;
-    G_dispatcher_context.add_to_response = add_to_response;
-    G_dispatcher_context.finalize_response = finalize_response;
-    G_dispatcher_context.send_response = send_response;
+    G_dispatcher_context.add_to_response = dispatcher_add_to_response;
+    G_dispatcher_context.finalize_response = dispatcher_finalize_response;
+    G_dispatcher_context.send_response = dispatcher_send_response;
     G_dispatcher_context.pause = pause;
+    G_dispatcher_context.mark_ux_flow = mark_ux_flow;
     G_dispatcher_context.run = run;
+    G_dispatcher_context.set_background_task = set_background_task;
     G_dispatcher_context.start_flow = start_flow;
-    G_dispatcher_context.process_interruption = process_interruption;
+    G_dispatcher_context.process_interruption = dispatcher_process_interruption;
 
     G_dispatcher_context.read_buffer = buffer_create(cmd->data, cmd->lc);
 
-    if (cmd->cla == CLA_FRAMEWORK && cmd->ins == INS_CONTINUE) {
+    if (cmd->cla == CLA_FRAMEWORK && cmd->ins == INS_GET_MAX_RESPONSE_LEN) {
+        // Does not change the state of the dispatcher, so it can be sent at any time.
         if (cmd->p1 != 0 || cmd->p2 != 0) {
             io_send_sw(SW_WRONG_P1P2);
             return;
         }
 
-        if (G_dispatcher_context.machine_context_ptr == NULL ||
-            G_dispatcher_context.machine_context_ptr->next_processor == NULL) {
+        uint8_t response[3] = {(MAX_CLIENT_RESPONSE_LEN >> 8) & 0xFF,
+                               MAX_CLIENT_RESPONSE_LEN & 0xFF,
+                               MAX_SPECULATIVE_RESPONSES_LEN};
+        io_send_response(response, sizeof(response), SW_OK);
+        return;
+    } else if (cmd->cla == CLA_FRAMEWORK && cmd->ins == INS_GET_TRACE) {
+        // Like GET_MAX_RESPONSE_LEN, it does not change the state of the dispatcher.
+#ifdef HAVE_DISPATCHER_TRACE
+        send_trace(cmd);
+#else
+        io_send_sw(SW_INS_NOT_SUPPORTED);
+#endif
+        return;
+    } else if (cmd->cla == CLA_FRAMEWORK && cmd->ins == INS_GET_PERF_COUNTERS) {
+        // Returns the counters of the last command, therefore it must not reset them.
+#ifdef HAVE_PERF_COUNTERS
+        send_perf_counters(cmd);
+#else
+        io_send_sw(SW_INS_NOT_SUPPORTED);
+#endif
+        return;
+    } else if (cmd->cla == CLA_FRAMEWORK && cmd->ins == INS_GET_CACHE_STATS) {
+        // Like GET_PERF_COUNTERS, it returns the statistics of the last command without resetting
+        // them.
+#ifdef HAVE_PERF_COUNTERS
+        send_cache_stats(cmd);
+#else
+        io_send_sw(SW_INS_NOT_SUPPORTED);
+#endif
+        return;
+    } else if (cmd->cla == CLA_FRAMEWORK && cmd->ins == INS_GET_STACK_PROFILE) {
+        // Like GET_MAX_RESPONSE_LEN, it does not change the state of the dispatcher.
+#ifdef HAVE_STACK_PROFILE
+        send_stack_profile(cmd);
+#else
+        io_send_sw(SW_INS_NOT_SUPPORTED);
+#endif
+        return;
+    } else if (cmd->cla == CLA_FRAMEWORK && cmd->ins == INS_CONTINUE) {
+        bool is_interrupted = G_dispatcher_context.machine_context_ptr != NULL &&
+                              G_dispatcher_context.machine_context_ptr->next_processor != NULL;
+
+        if (is_interrupted && cmd->p1 == P1_CONTINUE_KEEPALIVE && cmd->p2 == 0 && cmd->lc == 0) {
+            // Same as in process_interruption, for a request sent with dispatcher_await.
+            TRACE(TRACE_EVENT_KEEPALIVE, 0, 0);
+            io_start_interruption_timeout();
+            io_send_sw(SW_INTERRUPTED_EXECUTION);
+            return;
+        }
+
+        if ((cmd->p1 != 0 && cmd->p1 != P1_CONTINUE_SPECULATIVE) || cmd->p2 != 0) {
+            io_send_sw(SW_WRONG_P1P2);
+            return;
+        }
+
+        if (!parse_continue_data(&G_dispatcher_context, cmd)) {
+            io_send_sw(SW_INCORRECT_DATA);
+            return;
+        }
+
+        if (!is_interrupted) {
             PRINTF("Unexpected INS_CONTINUE.\n");
             io_send_sw(SW_BAD_STATE);  // received INS_CONTINUE, but no command was interrupted.
             return;
         }
+
+        TRACE(TRACE_EVENT_CONTINUE, 0, cmd->lc);
+
+        io_clear_interruption_timeout();
+        io_start_processing_timeout();
     } else {
         // If a previous command was interrupted but any command other than INS_CONTINUE is
         // received, the interrupted command is discarded.
+        end_background_task();
 
         G_dispatcher_context.machine_context_ptr = top_context;
 
+        discard_speculative_responses();
+        io_clear_interruption_timeout();
+
         // Safety measure: reset to 0 the entire context before starting.
         explicit_bzero(top_context, top_context_size);
+        G_dispatcher_context.arena = buffer_create(top_context, top_context_size);
+
+        G_dispatcher_context.client_capabilities = (uint16_t) (cmd->p2 | (cmd->p1 << 8));
+
+        // handlers may extend it for the rest of the command, see io_set_interruption_timeout
+        io_set_interruption_timeout(INTERRUPTION_TIMEOUT_TICKS);
 
         bool cla_found = false, ins_found = false;
         command_handler_t handler;
@@ -205,6 +710,17 @@ void apdu_dispatcher(command_descriptor_t const cmd_descriptors[],
             return;
         }
 
+        TRACE(TRACE_EVENT_COMMAND, cmd->ins, cmd->lc);
+
+#ifdef HAVE_PERF_COUNTERS
+        memset(&G_perf_counters, 0, sizeof(G_perf_counters));
+        memset(G_cache_stats, 0, sizeof(G_cache_stats));
+#endif
+
+        ui_clear_progress();
+        ui_clear_deferred_approval();
+        // only the "Processing..." screen shown during this command requires the termination_cb
+        G_was_processing_screen_shown = false;
         io_start_processing_timeout();
         handler(&G_dispatcher_context);
     }
@@ -234,7 +750,26 @@ static void dispatcher_loop() {
             command_processor_t proc = G_dispatcher_context.machine_context_ptr->next_processor;
             G_dispatcher_context.machine_context_ptr->next_processor = NULL;
 
+#ifdef HAVE_DISPATCHER_TRACE
+            uint8_t depth = 0;
+            for (machine_context_t *ctx = G_dispatcher_context.machine_context_ptr;
+                 ctx->parent_context != NULL;
+                 ctx = ctx->parent_context) {
+                ++depth;
+            }
+            TRACE(TRACE_EVENT_PROCESSOR, depth, (uint32_t) (uintptr_t) proc);
+#endif
+
+#ifdef HAVE_STACK_PROFILE
+            // the stack is painted again below the frame of the dispatcher, so that the high-water
+            // mark only accounts for this processor (and the functions it calls)
+            stack_profile_paint();
             proc(&G_dispatcher_context);
+            uint16_t depth = stack_profile_high_water();
+            stack_profile_record(STACK_PROFILE_PROCESSOR, (const void *) proc, depth);
+#else
+            proc(&G_dispatcher_context);
+#endif
 
             // if an interruption is sent, should exit the loop and persist the context for the next
             // call in that case, there MUST be a next_processor
@@ -243,6 +778,13 @@ static void dispatcher_loop() {
                     PRINTF("Interruption requested, but the next processor was not set.\n");
                 }
 
+                if (G_dispatcher_state.awaiting) {
+                    G_dispatcher_state.awaiting = false;
+                    if (send_awaited_request(&G_dispatcher_context)) {
+                        continue;
+                    }
+                }
+
                 io_clear_processing_timeout();
                 return;
             }
@@ -263,10 +805,13 @@ static void dispatcher_loop() {
         io_send_sw(SW_BAD_STATE);
     }
 
+    TRACE(TRACE_EVENT_END, 0, G_dispatcher_state.sw);
+
     // We call the termination callback if given, but only if the UX is "dirty", that is either
     // - there was some kind of UX flow with user interaction;
     // - background processing took long enough that the "Processing..." screen was shown.
     bool is_ux_dirty = G_dispatcher_state.had_ux_flow || G_was_processing_screen_shown;
+    io_clear_processing_screen();
     if (G_dispatcher_state.termination_cb != NULL && is_ux_dirty) {
         G_dispatcher_state.termination_cb();
     }
@@ -6,6 +6,8 @@
 
 #include "common/buffer.h"
 
+#include "sw.h"
+
 // TODO: continue brainstorming on a nice interface.
 // A command descriptor should contain:
 //   - a command handler, that can access all the input and the global state
@@ -37,6 +39,12 @@ typedef struct {
     dispatcher_callback_t fn;
 } dispatcher_callback_descriptor_t;
 
+/**
+ * A step of a background task, that a command runs while the dispatcher is paused waiting for the
+ * user; it returns true if there is more work to do. See set_background_task.
+ */
+typedef bool (*dispatcher_background_step_t)(dispatcher_context_t *);
+
 static inline dispatcher_callback_descriptor_t make_callback(void *state,
                                                              dispatcher_callback_t fn) {
     return (dispatcher_callback_descriptor_t){.state = state, .fn = fn};
@@ -50,7 +58,15 @@ struct dispatcher_context_s {
     buffer_t read_buffer;
 
     void (*pause)();
+    // marks that a ux flow is shown without pausing the dispatcher, that pauses it later (if ever)
+    void (*mark_ux_flow)();
     void (*run)();
+    // Sets a background task for the rest of the command: each time the ticker fires while the
+    // dispatcher is paused, step is called, until it returns false. Each step must be short, and
+    // only use data that was already verified; the command must not rely on the task being
+    // completed. If not NULL, on_end is called when the command ends, with any status word (for
+    // example, to wipe the secrets computed by the steps if the user rejects).
+    void (*set_background_task)(dispatcher_background_step_t step, command_processor_t on_end);
     void (*next)(command_processor_t next_processor);
     void (*add_to_response)(const void *rdata, size_t rdata_len);
     void (*finalize_response)(uint16_t sw);
@@ -59,39 +75,160 @@ struct dispatcher_context_s {
                        machine_context_t *subcontext,
                        command_processor_t return_processor);
     int (*process_interruption)(dispatcher_context_t *dispatcher_context);
+
+    // The P2 of the command being processed, as a bitmask of the optional features supported by
+    // the client (for example, optional client commands); the P1 extends it with 8 more bits.
+    uint16_t client_capabilities;
+
+    // The memory of the command state, as an arena that is reset when a new command starts.
+    // Handlers that use it must first allocate their own state, which is at its beginning; the data
+    // structures sized by the inputs of the command are then allocated after it.
+    buffer_t arena;
 };
 
-static inline void SEND_SW(struct dispatcher_context_s *dc, uint16_t sw) {
+/**
+ * Allocates size bytes from the arena of the command state, 32-bit aligned. All the allocations
+ * are released at once when the next command starts.
+ *
+ * @return a pointer to the allocated memory, or NULL if the arena does not have enough space.
+ */
+static inline void *dispatcher_arena_alloc(dispatcher_context_t *dc, size_t size) {
+    return buffer_alloc(&dc->arena, size, true);
+}
+
+/**
+ * Returns the largest size that dispatcher_arena_alloc can currently allocate.
+ */
+static inline size_t dispatcher_arena_available(const dispatcher_context_t *dc) {
+    size_t misalignment = (uintptr_t) buffer_get_cur(&dc->arena) % 4;
+    size_t padding = misalignment == 0 ? 0 : 4 - misalignment;
+    size_t left = dc->arena.size - dc->arena.offset;
+    return left > padding ? left - padding : 0;
+}
+
+/*
+ * The implementation of the dispatcher context in dispatcher.c. In the builds with
+ * HAVE_DISPATCHER_STATIC_BINDING, where it is the only one, the dc_* functions below call it
+ * directly, bound at link time; otherwise, they call the function pointers of the context, which
+ * other implementations (for example, the mocks of a test) can replace.
+ */
+void dispatcher_add_to_response(const void *rdata, size_t rdata_len);
+void dispatcher_finalize_response(uint16_t sw);
+void dispatcher_send_response(void);
+int dispatcher_process_interruption(dispatcher_context_t *dispatcher_context);
+
+/**
+ * Runs the next step of the background task of the current command, if the dispatcher is paused.
+ * Called by io_event at each ticker event.
+ */
+void dispatcher_run_background_task(void);
+
+/**
+ * Returns a buffer where the request for the client is written in place, directly in the APDU
+ * buffer, before sending it with dc_exchange. As the APDU buffer also contains the last response of
+ * the client, the read_buffer is emptied: it must not be used until the next response.
+ */
+buffer_t dispatcher_get_request_buffer(dispatcher_context_t *dispatcher_context);
+
+/**
+ * Sends the request written in the buffer returned by dispatcher_get_request_buffer, and waits for
+ * the response of the client, which is then in the read_buffer. It is equivalent to SET_RESPONSE
+ * (with SW_INTERRUPTED_EXECUTION) followed by process_interruption, without copying the request.
+ *
+ * @return 0 on success, or a negative number on error.
+ */
+int dispatcher_exchange(dispatcher_context_t *dispatcher_context, const buffer_t *request);
+
+/**
+ * Like dispatcher_exchange, but without waiting for the response in a nested call: the current
+ * processor must return right after this call, and the dispatcher sends the request. Once the
+ * response of the client is received in the next INS_CONTINUE (or is available among the
+ * speculative responses), resume_processor is called with the response in the read_buffer.
+ * The stack is therefore unwound while waiting for the client; see coroutine.h.
+ */
+void dispatcher_await(dispatcher_context_t *dispatcher_context,
+                      const buffer_t *request,
+                      command_processor_t resume_processor);
+
+static inline void dc_add_to_response(dispatcher_context_t *dc,
+                                      const void *rdata,
+                                      size_t rdata_len) {
+#ifdef HAVE_DISPATCHER_STATIC_BINDING
+    (void) dc;
+    dispatcher_add_to_response(rdata, rdata_len);
+#else
+    dc->add_to_response(rdata, rdata_len);
+#endif
+}
+
+static inline void dc_finalize_response(dispatcher_context_t *dc, uint16_t sw) {
+#ifdef HAVE_DISPATCHER_STATIC_BINDING
+    (void) dc;
+    dispatcher_finalize_response(sw);
+#else
     dc->finalize_response(sw);
+#endif
+}
+
+static inline void dc_send_response(dispatcher_context_t *dc) {
+#ifdef HAVE_DISPATCHER_STATIC_BINDING
+    (void) dc;
+    dispatcher_send_response();
+#else
     dc->send_response();
+#endif
+}
+
+static inline int dc_process_interruption(dispatcher_context_t *dc) {
+#ifdef HAVE_DISPATCHER_STATIC_BINDING
+    return dispatcher_process_interruption(dc);
+#else
+    return dc->process_interruption(dc);
+#endif
+}
+
+static inline buffer_t dc_get_request_buffer(dispatcher_context_t *dc) {
+    return dispatcher_get_request_buffer(dc);
+}
+
+static inline int dc_exchange(dispatcher_context_t *dc, const buffer_t *request) {
+#ifdef HAVE_DISPATCHER_STATIC_BINDING
+    return dispatcher_exchange(dc, request);
+#else
+    // the request is already at the beginning of the response, so adding it does not move it
+    dc->add_to_response(request->ptr, request->offset);
+    dc->finalize_response(SW_INTERRUPTED_EXECUTION);
+    return dc->process_interruption(dc);
+#endif
+}
+
+static inline void SEND_SW(struct dispatcher_context_s *dc, uint16_t sw) {
+    dc_finalize_response(dc, sw);
+    dc_send_response(dc);
 }
 
 static inline void SET_RESPONSE(struct dispatcher_context_s *dc,
                                 void *rdata,
                                 size_t rdata_len,
                                 uint16_t sw) {
-    dc->add_to_response(rdata, rdata_len);
-    dc->finalize_response(sw);
+    dc_add_to_response(dc, rdata, rdata_len);
+    dc_finalize_response(dc, sw);
 }
 
 static inline void SEND_RESPONSE(struct dispatcher_context_s *dc,
                                  void *rdata,
                                  size_t rdata_len,
                                  uint16_t sw) {
-    dc->add_to_response(rdata, rdata_len);
-    dc->finalize_response(sw);
-    dc->send_response();
+    dc_add_to_response(dc, rdata, rdata_len);
+    dc_finalize_response(dc, sw);
+    dc_send_response(dc);
 }
 
-// TODO: instead of exposing a method like send_response, it might be more efficient to expose the
-// response buffer,
-//       so that one could use the buffer_write_* methods directly.
-//       On the other hand, buth the read_buffer and the write buffer would point to the same shared
-//       global space (part of G_io_apdu_buffer). Therefore, one would have to make sure that no
-//       read happens after writes happen, and it would probably be better if the dispatcher
-//       enforces this, by making it impossible to accidentally read the read_buffer after writes
-//       happened. One way could be have a function get_output_buffer() in the dispatcher context,
-//       that returns the output buffer but it first zeroes the read_buffer.
+// Requests for the client should be serialized in place with dc_get_request_buffer and the
+// buffer_write_* methods, then sent with dc_exchange; SET_RESPONSE copies the request into the APDU
+// buffer, and is best kept for the final response of a command. Since the request and the last
+// response of the client share G_io_apdu_buffer, dc_get_request_buffer empties the read_buffer, so
+// that it cannot be read accidentally after writing started.
 
 /**
  * Describes a command that can be processed by the dispatcher.
@@ -29,6 +29,9 @@
 
 #include "dispatcher.h"
 
+#include "../main.h"
+#include "../ui/display.h"
+
 extern dispatcher_context_t G_dispatcher_context;
 extern command_processor_t G_command_continuation;
 
@@ -50,8 +53,11 @@ bool G_was_processing_screen_shown;
 uint16_t G_interruption_timeout_start_tick;
 uint16_t G_processing_timeout_start_tick;
 
-UX_STEP_NOCB(ux_processing_flow_1_step, pn, {&C_icon_processing, "Processing..."});
-UX_FLOW(ux_processing_flow, &ux_processing_flow_1_step);
+uint16_t G_interruption_timeout_ticks = INTERRUPTION_TIMEOUT_TICKS;
+
+// set to true while the "Processing..." screen is shown, in order to refresh its progress
+bool G_is_processing_screen_visible;
+uint16_t G_processing_refresh_start_tick;
 
 void io_seproxyhal_display(const bagl_element_t *element) {
     io_seproxyhal_display_default((bagl_element_t *) element);
@@ -66,6 +72,11 @@ void io_clear_interruption_timeout() {
     G_is_timeout_active.interruption = false;
 }
 
+void io_set_interruption_timeout(uint16_t ticks) {
+    G_interruption_timeout_ticks =
+        ticks < MAX_INTERRUPTION_TIMEOUT_TICKS ? ticks : MAX_INTERRUPTION_TIMEOUT_TICKS;
+}
+
 void io_start_processing_timeout() {
     G_processing_timeout_start_tick = G_ticks;
     G_is_timeout_active.processing = true;
@@ -75,9 +86,15 @@ void io_clear_processing_timeout() {
     G_is_timeout_active.processing = false;
 }
 
+void io_clear_processing_screen() {
+    G_is_processing_screen_visible = false;
+}
+
 void io_reset_timeouts() {
     io_clear_interruption_timeout();
     io_clear_processing_timeout();
+    io_clear_processing_screen();
+    G_interruption_timeout_ticks = INTERRUPTION_TIMEOUT_TICKS;
     G_was_processing_screen_shown = false;
 }
 
@@ -101,16 +118,35 @@ uint8_t io_event(uint8_t channel) {
         case SEPROXYHAL_TAG_TICKER_EVENT:
             ++G_ticks;
 
-            if (G_is_timeout_active.processing &&
+            // the state derived from the seed must not outlive the unlocked session, nor wait for
+            // the next APDU to be forgotten
+            if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+                clear_seed_derived_state();
+            }
+
+            // the "Processing..." screen does not replace a screen that waits for the user
+            if (G_is_timeout_active.processing && !ui_is_approval_pending() &&
                 G_ticks - G_processing_timeout_start_tick >= PROCESSING_TIMEOUT_TICKS) {
                 io_clear_processing_timeout();
 
                 G_was_processing_screen_shown = true;
-                ux_flow_init(0, ux_processing_flow, NULL);
+                G_processing_refresh_start_tick = G_ticks;
+                if (!G_is_processing_screen_visible) {
+                    G_is_processing_screen_visible = true;
+                    ui_display_processing();
+                } else {
+                    // the screen is sticky: it is still shown from a previous interruption cycle
+                    // of the same command, therefore it is only drawn again if the progress changed
+                    ui_refresh_processing();
+                }
+            } else if (G_is_processing_screen_visible &&
+                       G_ticks - G_processing_refresh_start_tick >= PROCESSING_REFRESH_TICKS) {
+                G_processing_refresh_start_tick = G_ticks;
+                ui_refresh_processing();
             }
 
             if (G_is_timeout_active.interruption &&
-                G_ticks - G_interruption_timeout_start_tick >= INTERRUPTION_TIMEOUT_TICKS) {
+                G_ticks - G_interruption_timeout_start_tick >= G_interruption_timeout_ticks) {
                 io_clear_interruption_timeout();
 
                 // TODO: It would be better to have the dispatcher be notified somehow.
@@ -119,6 +155,9 @@ uint8_t io_event(uint8_t channel) {
                 THROW(EXCEPTION_IO_RESET);
             }
 
+            // while the user reviews, the command can precompute what it needs after the approval
+            dispatcher_run_background_task();
+
             UX_TICKER_EVENT(G_io_seproxyhal_spi_buffer, {});
             break;
         default:
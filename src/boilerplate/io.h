@@ -23,13 +23,27 @@ uint16_t io_exchange_al(uint8_t channel, uint16_t tx_len);
 #define INTERRUPTION_TIMEOUT_TICKS 50
 #define PROCESSING_TIMEOUT_TICKS   10
 
+// Upper bound for the interruption timeout set with io_set_interruption_timeout (1 minute)
+#define MAX_INTERRUPTION_TIMEOUT_TICKS 600
+
+// Minimum number of ticks between two refreshes of the progress in the "Processing..." screen
+#define PROCESSING_REFRESH_TICKS 3
+
 /**
- * Instructs io_event to reset the app if INTERRUPTION_TIMEOUT_TICKS tick events are received before
- * io_clear_interruption_timeout is called. Used to cause an app reset if the client stop responding
- * while an APDU is being processed.
+ * Instructs io_event to reset the app if the current interruption timeout elapses before
+ * io_clear_interruption_timeout is called; it is INTERRUPTION_TIMEOUT_TICKS, unless changed with
+ * io_set_interruption_timeout. Used to cause an app reset if the client stop responding while an
+ * APDU is being processed.
  */
 void io_start_interruption_timeout();
 
+/**
+ * Sets the number of ticks after which the interruption timeout expires, capped to
+ * MAX_INTERRUPTION_TIMEOUT_TICKS, for the rest of the current command. It is restored to
+ * INTERRUPTION_TIMEOUT_TICKS by io_reset_timeouts.
+ */
+void io_set_interruption_timeout(uint16_t ticks);
+
 /**
  * Removes the timeout started from io_start_interruption_timeout.
  */
@@ -47,8 +61,13 @@ void io_start_processing_timeout();
 void io_clear_processing_timeout();
 
 /**
- * Clears both the interruption and processing timeouts, and sets G_was_processing_screen_shown to
- * false.
+ * Stops refreshing the progress of the "Processing..." screen, as another screen replaces it.
+ */
+void io_clear_processing_screen();
+
+/**
+ * Clears both the interruption and processing timeouts, restores the default interruption timeout,
+ * and sets G_was_processing_screen_shown to false.
  */
 void io_reset_timeouts();
 
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef HAVE_PERF_COUNTERS
+/**
+ * Caches whose usage is counted in the builds with HAVE_PERF_COUNTERS, in the order of the
+ * response of the GET_CACHE_STATS framework command; new caches are only appended.
+ */
+typedef enum {
+    CACHE_XPUB = 0,              // XPUB_CACHE_SIZE
+    CACHE_NVM_XPUB,              // NVM_XPUB_CACHE_SIZE
+    CACHE_POLICY_PUBKEYS,        // POLICY_PUBKEYS_CACHE_SIZE, POLICY_PUBKEYS_CACHE_CHANGE_STEPS
+    CACHE_POLICY_TR_KEYS,        // POLICY_TR_KEYS_CACHE_SIZE
+    CACHE_POLICY_MULTISIG_KEYS,  // POLICY_MULTISIG_KEYS_CACHE_SIZE
+    CACHE_WALLET_HMAC,           // WALLET_HMAC_CACHE_SIZE
+    CACHE_WALLET_SESSION,        // WALLET_SESSION_MAX_WALLETS
+    CACHE_WALLET_ADDRESS,        // WALLET_ADDRESS_CACHE_SIZE
+    CACHE_WALLET_SCRIPT_MEMO,    // WALLET_SCRIPT_MEMO_SIZE
+    CACHE_TR_SECKEYS,            // TR_SECKEYS_CACHE_SIZE
+    CACHE_PREVOUTS,              // PREVOUTS_CACHE_SIZE, and the shared arena
+    CACHE_MERKLEIZED_MAP_INDEX,  // MERKLEIZED_MAP_INDEX_CACHE_SIZE
+    CACHE_MERKLE_PATH,           // MERKLE_PATH_CACHE_DEPTH
+    N_CACHES
+} cache_id_t;
+
+/**
+ * Usage of a cache since the beginning of the last command; like the perf_counters_t, they are
+ * reset by the dispatcher at each new command.
+ */
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;  // valid entries replaced by a new one
+    uint32_t bytes;      // size of the memory of the cache, as of its last use; 0 if unused
+} cache_stats_t;
+
+extern cache_stats_t G_cache_stats[N_CACHES];
+
+/**
+ * Counts an event (hits, misses or evictions) of the cache, whose memory is cache_size bytes.
+ */
+#define PERF_COUNT_CACHE(cache, event, cache_size) \
+    (G_cache_stats[cache].event += 1, G_cache_stats[cache].bytes = (uint32_t) (cache_size))
+#else
+#define PERF_COUNT_CACHE(cache, event, cache_size) ((void) 0)
+#endif
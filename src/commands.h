@@ -6,8 +6,10 @@
 #include "handler/get_extended_pubkey.h"
 #include "handler/get_wallet_address.h"
 #include "handler/register_wallet.h"
+#include "handler/open_wallet_session.h"
 #include "handler/sign_psbt.h"
 #include "handler/sign_message.h"
+#include "handler/sign_message_bip322.h"
 
 /**
  * Enumeration with expected INS of APDU commands.
@@ -18,21 +20,37 @@ typedef enum {
     GET_WALLET_ADDRESS = 0x03,
     SIGN_PSBT = 0x04,
     GET_MASTER_FINGERPRINT = 0x05,
+    GET_WALLET_ADDRESSES = 0x06,
+    SCAN_WALLET_SCRIPTS = 0x07,
+    GET_EXTENDED_PUBKEYS = 0x08,
+    REGISTER_WALLETS = 0x09,
+    OPEN_WALLET_SESSION = 0x0A,
+    CLOSE_WALLET_SESSION = 0x0B,
     SIGN_MESSAGE = 0x10,
+    SIGN_MESSAGE_BIP322 = 0x11,
 } command_e;
 
 /**
- * Union of the global state for all the commands.
+ * Union of the global state for all the commands. The handlers that allocate data structures from
+ * the arena of the dispatcher can use the whole union, after their state.
  */
 typedef union {
     get_master_fingerprint_t get_master_fingerprint;
     get_extended_pubkey_state_t get_extended_pubkey_state;
     register_wallet_state_t register_wallet_state;
+    open_wallet_session_state_t open_wallet_session_state;
     get_wallet_address_state_t get_wallet_address_state;
     sign_psbt_state_t sign_psbt_state;
+    uint8_t sign_psbt_arena[SIGN_PSBT_ARENA_SIZE];  // sign_psbt_state_t and its arrays
     sign_message_state_t sign_message_state;
+    sign_message_bip322_state_t sign_message_bip322_state;
 } command_state_t;
 
+#ifdef COMMAND_STATE_BUDGET
+_Static_assert(sizeof(command_state_t) <= COMMAND_STATE_BUDGET,
+               "The command state exceeds COMMAND_STATE_BUDGET; reduce the sizes in perf_config.h");
+#endif
+
 /**
  * Since only one command can execute at the same time, we share the same global space
  * for the command state of all the commands.
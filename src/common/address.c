@@ -0,0 +1,114 @@
+#include <string.h>
+
+#include "../common/address.h"
+#include "../common/segwit_addr.h"
+#include "../common/base58.h"
+#include "../common/write.h"
+
+#include "../crypto.h"
+
+int address_encode_base58check(const uint8_t hash[static 20],
+                               uint32_t version,
+                               char *out,
+                               size_t out_len) {
+    if (out_len == 0) {
+        return -1;
+    }
+
+    uint8_t tmp[4 + 20 + 4] = {0};  // version + hash + checksum
+
+    uint8_t version_len;
+    if (version < 256) {
+        tmp[0] = (uint8_t) version;
+        version_len = 1;
+    } else if (version < 65536) {
+        write_u16_be(tmp, 0, (uint16_t) version);
+        version_len = 2;
+    } else {
+        write_u32_be(tmp, 0, version);
+        version_len = 4;
+    }
+
+    memcpy(tmp + version_len, hash, 20);
+    crypto_get_checksum(tmp, version_len + 20, tmp + version_len + 20);
+
+    int addr_len = base58_encode(tmp, version_len + 20 + 4, out, out_len - 1);
+    if (addr_len < 0) {
+        return -1;
+    }
+    out[addr_len] = '\0';
+    return addr_len;
+}
+
+int address_encode_segwit(const char *hrp,
+                          int witver,
+                          const uint8_t *witprog,
+                          size_t witprog_len,
+                          char *out,
+                          size_t out_len) {
+    // the witness version, the program in groups of 5 bits, and the 6 characters of checksum
+    size_t addr_len = strlen(hrp) + 1 + 1 + (witprog_len * 8 + 4) / 5 + 6;
+    if (out_len < addr_len + 1) {
+        return -1;
+    }
+
+    if (segwit_addr_encode(out, hrp, witver, witprog, witprog_len) != 1) {
+        return -1;
+    }
+    return (int) addr_len;
+}
+
+static uint64_t cashaddr_polymod_step(uint64_t pre) {
+    uint8_t b = pre >> 35;
+    return ((pre & 0x07ffffffffULL) << 5) ^ (-((b >> 0) & 1) & 0x98f2bc8e61ULL) ^
+           (-((b >> 1) & 1) & 0x79b76d99e2ULL) ^ (-((b >> 2) & 1) & 0xf33e5fb3c4ULL) ^
+           (-((b >> 3) & 1) & 0xae2eabe2a8ULL) ^ (-((b >> 4) & 1) & 0x1e4f43e470ULL);
+}
+
+int address_encode_cashaddr(const uint8_t hash[static 20], int type, char *out, size_t out_len) {
+    static const char prefix[] = "bitcoincash";
+
+    if ((type != CASHADDR_TYPE_P2PKH && type != CASHADDR_TYPE_P2SH) ||
+        out_len < CASHADDR_ADDRESS_LENGTH + 1) {
+        return -1;
+    }
+
+    uint64_t chk = 1;
+    for (size_t i = 0; i < sizeof(prefix) - 1; i++) {
+        chk = cashaddr_polymod_step(chk) ^ (prefix[i] & 0x1f);
+    }
+    chk = cashaddr_polymod_step(chk);  // the separator
+
+    // the version byte (the type in bits 3 to 6, and 0 for the size of a 160-bit hash), followed
+    // by the hash; each group of 5 bits is added to the checksum as soon as it is complete
+    uint32_t val = (uint32_t) type << 3;
+    int bits = 8;
+    size_t pos = 0;
+    for (size_t i = 0; i <= 20; i++) {
+        while (bits >= 5) {
+            bits -= 5;
+            uint8_t v = (val >> bits) & 0x1f;
+            chk = cashaddr_polymod_step(chk) ^ v;
+            out[pos++] = bech32_charset[v];
+        }
+        if (i < 20) {
+            val = (val << 8) | hash[i];
+            bits += 8;
+        }
+    }
+    if (bits) {
+        uint8_t v = (val << (5 - bits)) & 0x1f;
+        chk = cashaddr_polymod_step(chk) ^ v;
+        out[pos++] = bech32_charset[v];
+    }
+
+    for (int i = 0; i < 8; i++) {
+        chk = cashaddr_polymod_step(chk);
+    }
+    chk ^= 1;
+    for (int i = 0; i < 8; i++) {
+        out[pos++] = bech32_charset[(chk >> (5 * (7 - i))) & 0x1f];
+    }
+    out[pos] = '\0';
+    return (int) pos;
+}
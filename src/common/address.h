@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Encoders of the addresses shown to the user, shared by the app and by the legacy code. Each one
+ * writes the null-terminated address directly into the caller's buffer, and returns its length
+ * (excluding the terminating null character), or -1 if the buffer is too short or the inputs are
+ * invalid.
+ */
+
+/**
+ * Type of a CashAddr address (the value of the type bits in the version byte).
+ */
+#define CASHADDR_TYPE_P2PKH 0
+#define CASHADDR_TYPE_P2SH  1
+
+/**
+ * Length of a CashAddr address for a 20-bytes hash, excluding the "bitcoincash:" prefix: 34
+ * characters for the version byte and the hash, followed by 8 characters of checksum.
+ */
+#define CASHADDR_ADDRESS_LENGTH 42
+
+/**
+ * Encodes a 20-bytes hash in base58 with checksum, after prepending a version prefix.
+ * If version < 256, it is prepended as 1 byte.
+ * If 256 <= version < 65536, it is prepended in big-endian as 2 bytes.
+ * Otherwise, it is prepended in big-endian as 4 bytes.
+ *
+ * @param[in]  hash
+ *   Pointer to the 20-bytes hash to encode.
+ * @param[in]  version
+ *   The 1-byte, 2-byte or 4-byte version prefix.
+ * @param[out]  out
+ *   The pointer to the output array.
+ * @param[in]  out_len
+ *   The length of the output array, including the space for the terminating null character.
+ *
+ * @return the length of the address on success, -1 on failure.
+ */
+int address_encode_base58check(const uint8_t hash[static 20],
+                               uint32_t version,
+                               char *out,
+                               size_t out_len);
+
+/**
+ * Encodes a segwit address with the given human-readable part; bech32 is used for witness
+ * version 0, bech32m for the later versions.
+ *
+ * @param[in]  hrp
+ *   The null-terminated human-readable part.
+ * @param[in]  witver
+ *   The witness version, between 0 and 16.
+ * @param[in]  witprog
+ *   Pointer to the witness program.
+ * @param[in]  witprog_len
+ *   The length of the witness program, between 2 and 40 bytes (20 or 32 for version 0).
+ * @param[out]  out
+ *   The pointer to the output array.
+ * @param[in]  out_len
+ *   The length of the output array, including the space for the terminating null character.
+ *
+ * @return the length of the address on success, -1 on failure.
+ */
+int address_encode_segwit(const char *hrp,
+                          int witver,
+                          const uint8_t *witprog,
+                          size_t witprog_len,
+                          char *out,
+                          size_t out_len);
+
+/**
+ * Encodes a 20-bytes hash as a CashAddr address for the "bitcoincash" prefix; the prefix itself is
+ * not part of the output.
+ *
+ * @param[in]  hash
+ *   Pointer to the 20-bytes hash to encode.
+ * @param[in]  type
+ *   Either CASHADDR_TYPE_P2PKH or CASHADDR_TYPE_P2SH.
+ * @param[out]  out
+ *   The pointer to the output array.
+ * @param[in]  out_len
+ *   The length of the output array, including the space for the terminating null character.
+ *
+ * @return the length of the address (CASHADDR_ADDRESS_LENGTH) on success, -1 on failure.
+ */
+int address_encode_cashaddr(const uint8_t hash[static 20], int type, char *out, size_t out_len);
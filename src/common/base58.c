@@ -54,139 +54,156 @@ char const BASE58_ALPHABET[] = {
     'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z'             //
 };
 
+/**
+ * Number of base58 digits accumulated at once when decoding; 58^5 < 2^32, therefore a group of
+ * digits fits in a 32-bit limb.
+ */
+#define DEC_DIGITS_PER_PASS 5
+
+/**
+ * Number of base58 digits in each 32-bit limb of the result when encoding; 58^4 < 2^24, therefore
+ * a limb multiplied by 256 (plus the carry) does not overflow.
+ */
+#define ENC_DIGITS_PER_LIMB 4
+#define ENC_LIMB_BASE       (58 * 58 * 58 * 58)
+
+/**
+ * Number of 32-bit limbs of the decoded number; each base58 digit is less than 6 bits.
+ */
+#define DEC_N_LIMBS ((MAX_DEC_INPUT_SIZE * 6 + 31) / 32)
+
+/**
+ * Number of limbs of the encoded number; each byte requires at most 138/100 base58 digits.
+ */
+#define ENC_N_LIMBS \
+    ((MAX_ENC_INPUT_SIZE * 138 / 100 + 1 + ENC_DIGITS_PER_LIMB - 1) / ENC_DIGITS_PER_LIMB)
+
+static const uint32_t POWERS_OF_58[DEC_DIGITS_PER_PASS + 1] = {1,
+                                                               58,
+                                                               58 * 58,
+                                                               58 * 58 * 58,
+                                                               58 * 58 * 58 * 58,
+                                                               58 * 58 * 58 * 58 * 58};
+
 int base58_decode(const char *in, size_t in_len, uint8_t *out, size_t out_len) {
 #ifdef USE_CXRAM_SECTION
-    // allocate buffers inside the cxram section; safe as there are no syscalls here
-    uint8_t *tmp = get_cxram_buffer();                          // MAX_DEC_INPUT_SIZE bytes buffer
-    uint8_t *buffer = get_cxram_buffer() + MAX_DEC_INPUT_SIZE;  // MAX_DEC_INPUT_SIZE bytes buffer
+    // allocate the buffer inside the cxram section; safe as there are no syscalls here
+    uint32_t *limbs = (uint32_t *) get_cxram_buffer();  // DEC_N_LIMBS limbs buffer
+    _Static_assert(DEC_N_LIMBS * sizeof(uint32_t) <= CXRAM_SCRATCH_OFFSET,
+                   "The limbs overlap the scratch area");
 #else
-    uint8_t tmp[MAX_DEC_INPUT_SIZE] = {0};
-    uint8_t buffer[MAX_DEC_INPUT_SIZE] = {0};
+    uint32_t limbs[DEC_N_LIMBS];
 #endif
 
-    memset(tmp, 0, MAX_DEC_INPUT_SIZE);
-    memset(buffer, 0, MAX_DEC_INPUT_SIZE);
-
-    uint8_t j;
-    uint8_t start_at;
-    uint8_t zero_count = 0;
-
     if (in_len > MAX_DEC_INPUT_SIZE || in_len < 2) {
         return -1;
     }
 
-    memmove(tmp, in, in_len);
-
-    // uses a trimmed version of BASE58_TABLE to save space, while staying functionally equivalent
-    for (uint8_t i = 0; i < in_len; i++) {
-        int pos_trimmed = (in[i]) - 49;
-        if (pos_trimmed < 0 || pos_trimmed >= (int) sizeof(BASE58_TABLE_TRIMMED)) {
-            return -1;
-        }
-
-        tmp[i] = BASE58_TABLE_TRIMMED[pos_trimmed];
-
-        if (tmp[i] == 0xFF) {
-            return -1;
-        }
-    }
-
-    // // original code for reference
-    // for (uint8_t i = 0; i < in_len; i++) {
-    //     if (in[i] >= sizeof(BASE58_TABLE)) {
-    //         return -1;
-    //     }
-
-    //     tmp[i] = BASE58_TABLE[(int) in[i]];
+    // the decoded number, as 32-bit limbs in little-endian order; only the first n_limbs are used,
+    // as that is enough for in_len digits
+    size_t n_limbs = (in_len * 6 + 31) / 32;
+    memset(limbs, 0, n_limbs * sizeof(uint32_t));
 
-    //     if (tmp[i] == 0xFF) {
-    //         return -1;
-    //     }
-    // }
-
-    while ((zero_count < in_len) && (tmp[zero_count] == 0)) {
+    size_t zero_count = 0;
+    while (zero_count < in_len && in[zero_count] == BASE58_ALPHABET[0]) {
         ++zero_count;
     }
 
-    j = in_len;
-    start_at = zero_count;
-    while (start_at < in_len) {
-        uint16_t remainder = 0;
-        for (uint8_t div_loop = start_at; div_loop < in_len; div_loop++) {
-            uint16_t digit256 = (uint16_t) (tmp[div_loop] & 0xFF);
-            uint16_t tmp_div = remainder * 58 + digit256;
-            tmp[div_loop] = (uint8_t) (tmp_div / 256);
-            remainder = tmp_div % 256;
+    for (size_t i = 0; i < in_len; i += DEC_DIGITS_PER_PASS) {
+        size_t n_digits = in_len - i < DEC_DIGITS_PER_PASS ? in_len - i : DEC_DIGITS_PER_PASS;
+
+        // accumulate the next n_digits digits
+        uint32_t group = 0;
+        for (size_t k = i; k < i + n_digits; k++) {
+            // uses a trimmed version of BASE58_TABLE to save space, while staying functionally
+            // equivalent
+            int pos_trimmed = (in[k]) - 49;
+            if (pos_trimmed < 0 || pos_trimmed >= (int) sizeof(BASE58_TABLE_TRIMMED) ||
+                BASE58_TABLE_TRIMMED[pos_trimmed] == 0xFF) {
+                return -1;
+            }
+            group = group * 58 + BASE58_TABLE_TRIMMED[pos_trimmed];
         }
 
-        if (tmp[start_at] == 0) {
-            ++start_at;
+        // limbs = limbs * 58^n_digits + group
+        uint64_t carry = group;
+        for (size_t l = 0; l < n_limbs; l++) {
+            carry += (uint64_t) limbs[l] * POWERS_OF_58[n_digits];
+            limbs[l] = (uint32_t) carry;
+            carry >>= 32;
         }
-
-        buffer[--j] = (uint8_t) remainder;
     }
 
-    while ((j < in_len) && (buffer[j] == 0)) {
-        ++j;
+    // skip the leading zero bytes of the number
+    size_t n_bytes = n_limbs * 4;
+    while (n_bytes > 0 && ((limbs[(n_bytes - 1) / 4] >> (8 * ((n_bytes - 1) % 4))) & 0xFF) == 0) {
+        --n_bytes;
     }
 
-    int length = in_len - (j - zero_count);
-
-    if ((int) out_len < length) {
+    size_t length = zero_count + n_bytes;
+    if (out_len < length) {
         return -1;
     }
 
-    memmove(out, buffer + j - zero_count, length);
+    // each leading '1' is a zero byte, followed by the number in big-endian order
+    memset(out, 0, zero_count);
+    for (size_t k = 0; k < n_bytes; k++) {
+        size_t pos = n_bytes - 1 - k;  // position of the byte, starting from the least significant
+        out[zero_count + k] = (uint8_t) (limbs[pos / 4] >> (8 * (pos % 4)));
+    }
 
     return length;
 }
 
 int base58_encode(const uint8_t *in, size_t in_len, char *out, size_t out_len) {
-    uint8_t buffer[MAX_ENC_INPUT_SIZE * 138 / 100 + 1] = {0};
-    size_t i, j;
-    size_t stop_at;
-    size_t zero_count = 0;
-    size_t output_size;
+    // the encoded number, as limbs of ENC_DIGITS_PER_LIMB base58 digits in little-endian order
+    uint32_t limbs[ENC_N_LIMBS] = {0};
 
     if (in_len > MAX_ENC_INPUT_SIZE) {
         return -1;
     }
 
+    size_t zero_count = 0;
     while ((zero_count < in_len) && (in[zero_count] == 0)) {
         ++zero_count;
     }
 
-    output_size = (in_len - zero_count) * 138 / 100 + 1;
-    stop_at = output_size - 1;
-    for (size_t start_at = zero_count; start_at < in_len; start_at++) {
-        unsigned int carry = in[start_at];
-        for (j = output_size - 1; (int) j >= 0; j--) {
-            carry += 256 * buffer[j];
-            buffer[j] = carry % 58;
-            carry /= 58;
-
-            if (j <= stop_at - 1 && carry == 0) {
-                break;
-            }
+    // number of limbs that are currently non-zero
+    size_t n_limbs = 0;
+    for (size_t i = zero_count; i < in_len; i++) {
+        // limbs = limbs * 256 + in[i]
+        uint32_t carry = in[i];
+        for (size_t l = 0; l < n_limbs; l++) {
+            carry += limbs[l] << 8;
+            limbs[l] = carry % ENC_LIMB_BASE;
+            carry /= ENC_LIMB_BASE;
+        }
+        if (carry > 0) {
+            limbs[n_limbs++] = carry;  // carry < 256 < ENC_LIMB_BASE
         }
-        stop_at = j;
     }
 
-    j = 0;
-    while (j < output_size && buffer[j] == 0) {
-        j += 1;
+    // number of digits, skipping the leading zero digits of the most significant limb
+    size_t n_digits = n_limbs * ENC_DIGITS_PER_LIMB;
+    if (n_limbs > 0) {
+        uint32_t top = limbs[n_limbs - 1];
+        for (uint32_t p = ENC_LIMB_BASE / 58; top < p; p /= 58) {
+            --n_digits;
+        }
     }
 
-    if (out_len < zero_count + output_size - j) {
+    if (out_len < zero_count + n_digits) {
         return -1;
     }
 
     memset(out, BASE58_ALPHABET[0], zero_count);
 
-    i = zero_count;
-    while (j < output_size) {
-        out[i++] = BASE58_ALPHABET[buffer[j++]];
+    // write the digits from the least significant one
+    for (size_t k = 0; k < n_digits; k++) {
+        uint32_t *limb = &limbs[k / ENC_DIGITS_PER_LIMB];
+        out[zero_count + n_digits - 1 - k] = BASE58_ALPHABET[*limb % 58];
+        *limb /= 58;
     }
 
-    return i;
+    return zero_count + n_digits;
 }
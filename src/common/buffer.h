@@ -279,6 +279,21 @@ bool buffer_write_u64(buffer_t *buffer, uint64_t value, endianness_t endianness)
  */
 bool buffer_write_bytes(buffer_t *buffer, const uint8_t *data, size_t n);
 
+/**
+ * Write Bitcoin-like varint into buffer.
+ *
+ * @see https://en.bitcoin.it/wiki/Protocol_documentation#Variable_length_integer
+ *
+ * @param[in,out]  buffer
+ *   Pointer to output buffer struct.
+ * @param[in]      value
+ *   64-bit unsigned integer to write as varint.
+ *
+ * @return true if success, false if not enough space left in the buffer.
+ *
+ */
+bool buffer_write_varint(buffer_t *buffer, uint64_t value);
+
 /**
  * Creates a buffer pointing at ptr and with the given size; the initial offset is 0.
  *
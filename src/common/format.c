@@ -16,7 +16,7 @@
 
 #include <stddef.h>   // size_t
 #include <stdint.h>   // int*_t, uint*_t
-#include <string.h>   // strncpy, memmove
+#include <string.h>   // strncpy, memmove, memcpy
 #include <stdbool.h>  // bool
 
 #include "format.h"
@@ -60,39 +60,131 @@ bool format_i64(char *dst, size_t dst_len, const int64_t value) {
     return true;
 }
 
+// "00" "01" ... "99": the decimal digits of all the numbers from 0 to 99
+static const char digit_pairs[200] = {
+    '0', '0', '0', '1', '0', '2', '0', '3', '0', '4', '0', '5', '0', '6', '0', '7', '0', '8', '0',
+    '9', '1', '0', '1', '1', '1', '2', '1', '3', '1', '4', '1', '5', '1', '6', '1', '7', '1', '8',
+    '1', '9', '2', '0', '2', '1', '2', '2', '2', '3', '2', '4', '2', '5', '2', '6', '2', '7', '2',
+    '8', '2', '9', '3', '0', '3', '1', '3', '2', '3', '3', '3', '4', '3', '5', '3', '6', '3', '7',
+    '3', '8', '3', '9', '4', '0', '4', '1', '4', '2', '4', '3', '4', '4', '4', '5', '4', '6', '4',
+    '7', '4', '8', '4', '9', '5', '0', '5', '1', '5', '2', '5', '3', '5', '4', '5', '5', '5', '6',
+    '5', '7', '5', '8', '5', '9', '6', '0', '6', '1', '6', '2', '6', '3', '6', '4', '6', '5', '6',
+    '6', '6', '7', '6', '8', '6', '9', '7', '0', '7', '1', '7', '2', '7', '3', '7', '4', '7', '5',
+    '7', '6', '7', '7', '7', '8', '7', '9', '8', '0', '8', '1', '8', '2', '8', '3', '8', '4', '8',
+    '5', '8', '6', '8', '7', '8', '8', '8', '9', '9', '0', '9', '1', '9', '2', '9', '3', '9', '4',
+    '9', '5', '9', '6', '9', '7', '9', '8', '9', '9'};
+
+// Division and modulus operators over uint64_t cause the inclusion of the __udivmoddi4 and other
+// library functions, that occupy more than 400 bytes. The only 64-bit division needed is by 10^8,
+// that is computed exactly as a multiplication by its reciprocal: n / 10^8 equals
+// ((n >> 8) * ceil(2^82 / 5^8)) >> 82 for any 64-bit n.
+static uint64_t mulhi_u64(uint64_t a, uint64_t b) {
+    uint64_t a_lo = (uint32_t) a, a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t) b, b_hi = b >> 32;
+
+    uint64_t lo_lo = a_lo * b_lo;
+    uint64_t hi_lo = a_hi * b_lo;
+    uint64_t lo_hi = a_lo * b_hi;
+    uint64_t hi_hi = a_hi * b_hi;
+
+    // cannot overflow, as lo_hi <= (2^32 - 1)^2
+    uint64_t cross = (lo_lo >> 32) + (uint32_t) hi_lo + lo_hi;
+    return hi_hi + (hi_lo >> 32) + (cross >> 32);
+}
+
+static inline uint64_t div100000000(uint64_t n) {
+    return mulhi_u64(n >> 8, 0xABCC77118461CEFDULL) >> 18;
+}
+
+// n / 100 for any 32-bit n, computed with a multiplication by the reciprocal
+static inline uint32_t div100(uint32_t n) {
+    return (uint32_t) (((uint64_t) n * 0x51EB851FU) >> 37);
+}
+
+// Writes the decimal digits of value two at a time, from the least significant ones, ending right
+// before end; zeros are prepended to write at least min_digits digits. Returns a pointer to the
+// first written character.
+static char *write_u32_backwards(char *end, uint32_t value, size_t min_digits) {
+    char *const last = end;
+    while (value >= 100) {
+        uint32_t quotient = div100(value);
+        uint32_t pair = value - 100 * quotient;
+        end -= 2;
+        end[0] = digit_pairs[2 * pair];
+        end[1] = digit_pairs[2 * pair + 1];
+        value = quotient;
+    }
+    if (value >= 10) {
+        end -= 2;
+        end[0] = digit_pairs[2 * value];
+        end[1] = digit_pairs[2 * value + 1];
+    } else {
+        *--end = (char) ('0' + value);
+    }
+    while ((size_t) (last - end) < min_digits) {
+        *--end = '0';
+    }
+    return end;
+}
+
+// Writes the decimal representation of value ending right before end, with zeros prepended to
+// write at least min_digits digits (at most 20). Returns a pointer to the first written character.
+static char *write_u64_backwards(char *end, uint64_t value, size_t min_digits) {
+    char *const last = end;
+    // at most two iterations, as UINT64_MAX < 10^8 * 10^8 * 2^32
+    while (value > UINT32_MAX) {
+        uint64_t quotient = div100000000(value);
+        end = write_u32_backwards(end, (uint32_t) (value - quotient * 100000000), 8);
+        value = quotient;
+    }
+    size_t written = last - end;
+    return write_u32_backwards(end,
+                               (uint32_t) value,
+                               min_digits > written ? min_digits - written : 1);
+}
+
 bool format_u64(char *out, size_t outLen, uint64_t in) {
-    uint8_t i = 0;
+    char buffer[20];
+    char *end = buffer + sizeof(buffer);
+    char *start = write_u64_backwards(end, in, 1);
 
-    if (outLen == 0) {
+    size_t len = end - start;
+    if (len + 1 > outLen) {
         return false;
     }
-    outLen--;
+    memcpy(out, start, len);
+    out[len] = '\0';
+    return true;
+}
 
-    while (in > 9) {
-        out[i] = in % 10 + '0';
-        in /= 10;
-        i++;
-        if (i + 1 > outLen) {
-            return false;
-        }
+int format_amount(char *dst, size_t dst_len, uint64_t value, uint8_t decimals) {
+    if (decimals > MAX_FORMAT_AMOUNT_DECIMALS) {
+        return -1;
     }
-    out[i] = in + '0';
-    out[i + 1] = '\0';
 
-    uint8_t j = 0;
-    char tmp;
+    // the digits of value, with at least one digit before the fractional part
+    char buffer[20];
+    char *end = buffer + sizeof(buffer);
+    char *start = write_u64_backwards(end, value, decimals + 1);
 
-    // revert the string
-    while (j < i) {
-        // swap out[j] and out[i]
-        tmp = out[j];
-        out[j] = out[i];
-        out[i] = tmp;
+    size_t integral_len = (end - start) - decimals;
+    size_t fractional_len = decimals;
+    // drop trailing zeros
+    while (fractional_len > 0 && start[integral_len + fractional_len - 1] == '0') {
+        --fractional_len;
+    }
 
-        i--;
-        j++;
+    size_t len = integral_len + (fractional_len > 0 ? 1 + fractional_len : 0);
+    if (len + 1 > dst_len) {
+        return -1;
     }
-    return true;
+    memcpy(dst, start, integral_len);
+    if (fractional_len > 0) {
+        dst[integral_len] = '.';
+        memcpy(dst + integral_len + 1, start + integral_len, fractional_len);
+    }
+    dst[len] = '\0';
+    return (int) len;
 }
 
 bool format_fpu64(char *dst, size_t dst_len, const uint64_t value, uint8_t decimals) {
@@ -4,6 +4,9 @@
 #include <stdint.h>   // int*_t, uint*_t
 #include <stdbool.h>  // bool
 
+// maximum number of decimals supported by format_amount
+#define MAX_FORMAT_AMOUNT_DECIMALS 19
+
 /**
  * Format 64-bit signed integer as string.
  *
@@ -51,6 +54,27 @@ bool format_u64(char *dst, size_t dst_len, uint64_t value);
  */
 bool format_fpu64(char *dst, size_t dst_len, const uint64_t value, uint8_t decimals);
 
+/**
+ * Format 64-bit unsigned integer as a decimal amount, where value is a multiple of
+ * 1/10^decimals. Trailing zeros of the fractional part are dropped, and there is no decimal
+ * separator if the amount is integral.
+ *
+ * For example, the value 123450000 with 8 decimals is formatted as "1.2345".
+ *
+ * @param[out] dst
+ *   Pointer to output string.
+ * @param[in]  dst_len
+ *   Length of output string.
+ * @param[in]  value
+ *   64-bit unsigned integer to format.
+ * @param[in]  decimals
+ *   Number of digits after decimal separator, at most MAX_FORMAT_AMOUNT_DECIMALS.
+ *
+ * @return length of the output string (not including the terminating 0) if success, -1 otherwise.
+ *
+ */
+int format_amount(char *dst, size_t dst_len, uint64_t value, uint8_t decimals);
+
 /**
  * Format byte buffer to uppercase hexadecimal string.
  *
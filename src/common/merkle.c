@@ -25,33 +25,41 @@
 #include "merkle.h"
 
 #include "cx_ram.h"
+#include "../cxram_stash.h"
 
-void merkle_compute_element_hash(const uint8_t *in, size_t in_len, uint8_t out[static 32]) {
-    cx_sha256_t hash;
-    cx_sha256_init(&hash);
+void merkle_compute_element_hash_ctx(cx_sha256_t *hash,
+                                     const uint8_t *in,
+                                     size_t in_len,
+                                     uint8_t out[static 32]) {
+    cx_sha256_init(hash);
 
     // H(0x00 | in)
-    crypto_hash_update_u8(&hash.header, 0x00);
-    crypto_hash_update(&hash.header, in, in_len);
+    crypto_hash_update_u8(&hash->header, 0x00);
+    crypto_hash_update(&hash->header, in, in_len);
 
-    crypto_hash_digest(&hash.header, out, 32);
+    crypto_hash_digest(&hash->header, out, 32);
 }
 
-// void merkle_combine_hashes(const uint8_t left[static 32],
-//                            const uint8_t right[static 32],
-//                            uint8_t out[static 32]) {
-//     PRINT_STACK_POINTER();
+void merkle_compute_element_hash(const uint8_t *in, size_t in_len, uint8_t out[static 32]) {
+    cx_sha256_t hash;
+    merkle_compute_element_hash_ctx(&hash, in, in_len, out);
+}
 
-//     cx_sha256_t hash;
-//     cx_sha256_init(&hash);
+void merkle_combine_hashes_ctx(cx_sha256_t *hash,
+                               const uint8_t left[static 32],
+                               const uint8_t right[static 32],
+                               uint8_t out[static 32]) {
+    cx_sha256_init_no_throw(hash);
 
-//     // H(0x01 | left | right)
-//     crypto_hash_update_u8(&hash.header, 0x01);
-//     crypto_hash_update(&hash.header, left, 32);
-//     crypto_hash_update(&hash.header, right, 32);
+    // H(0x01 | left | right)
+    uint8_t prefix = 0x01;
+    cx_sha256_update(hash, &prefix, 1);
+    cx_sha256_update(hash, left, 32);
+    cx_sha256_update(hash, right, 32);
 
-//     crypto_hash_digest(&hash.header, out, 32);
-// }
+    cx_sha256_final(hash, out);
+    PERF_COUNT(sha256_compressions, 2);  // 65 bytes, plus the padding
+}
 
 // implementation using the cxram section, in order to save ram
 void merkle_combine_hashes(const uint8_t left[static 32],
@@ -59,16 +67,96 @@ void merkle_combine_hashes(const uint8_t left[static 32],
                            uint8_t out[static 32]) {
     PRINT_STACK_POINTER();
 
-    cx_sha256_init_no_throw(&G_cx.sha256);
+    _Static_assert(sizeof(cx_sha256_t) <= CXRAM_SCRATCH_OFFSET,
+                   "The sha256 context overlaps the scratch area");
 
-    uint8_t prefix = 0x01;
-    cx_sha256_update(&G_cx.sha256, &prefix, 1);
+    merkle_combine_hashes_ctx(&G_cx.sha256, left, right, out);
+    explicit_bzero(&G_cx.sha256, sizeof(cx_sha256_t));
+}
+
+int merkle_verify_proof(uint32_t tree_size,
+                        uint32_t leaf_index,
+                        uint8_t proof_size,
+                        uint8_t first_step,
+                        const uint8_t *proof,
+                        size_t n_elements,
+                        uint8_t cur_hash[static 32]) {
+    PRINT_STACK_POINTER();
+
+    if (leaf_index >= tree_size || (size_t) first_step + n_elements > proof_size) {
+        return -1;
+    }
+
+    // directions of the path from the root to the leaf (1 if the node is a right child), with the
+    // one of the leaf in the lowest bit: bit i is the direction of the node whose sibling is the
+    // proof element i
+    uint32_t directions = 0;
+    int depth = 0;
+    while (tree_size > 1) {
+        // the left subtree has the largest power of 2 strictly smaller than tree_size leaves
+        uint32_t left_size = 1 << (ceil_lg(tree_size) - 1);
+        directions <<= 1;
+        if (leaf_index >= left_size) {
+            directions |= 1;
+            tree_size -= left_size;
+            leaf_index -= left_size;
+        } else {
+            tree_size = left_size;
+        }
+        ++depth;
+    }
 
-    cx_sha256_update(&G_cx.sha256, left, 32);
-    cx_sha256_update(&G_cx.sha256, right, 32);
+    if (depth != proof_size) {
+        PRINTF("Wrong length of the Merkle proof\n");
+        return -1;
+    }
 
-    cx_sha256_final(&G_cx.sha256, out);
+    for (size_t i = 0; i < n_elements; i++) {
+        const uint8_t *sibling_hash = proof + 32 * i;
+        if ((directions >> (first_step + i)) & 1) {
+            merkle_combine_hashes_ctx(&G_cx.sha256, sibling_hash, cur_hash, cur_hash);
+        } else {
+            merkle_combine_hashes_ctx(&G_cx.sha256, cur_hash, sibling_hash, cur_hash);
+        }
+    }
     explicit_bzero(&G_cx.sha256, sizeof(cx_sha256_t));
+    return 0;
+}
+
+void merkle_root_builder_add(merkle_root_builder_t *builder, const uint8_t leaf_hash[static 32]) {
+    uint8_t node[32];
+    memcpy(node, leaf_hash, 32);
+
+    // like incrementing a binary counter: each complete subtree of the same size is merged with
+    // the new one, from the smallest
+    int height = 0;
+    while ((builder->n_leaves >> height) & 1) {
+        merkle_combine_hashes(builder->subtree_roots[height], node, node);
+        ++height;
+    }
+    memcpy(builder->subtree_roots[height], node, 32);
+    ++builder->n_leaves;
+}
+
+void merkle_root_builder_get_root(const merkle_root_builder_t *builder, uint8_t out[static 32]) {
+    // the left subtree of each node is the largest complete subtree; therefore, the root is
+    // obtained by combining the complete subtrees from the smallest (the rightmost) to the largest
+    bool found = false;
+    for (int height = 0; height < MAX_MERKLE_TREE_DEPTH; height++) {
+        if (((builder->n_leaves >> height) & 1) == 0) {
+            continue;
+        }
+        if (!found) {
+            memcpy(out, builder->subtree_roots[height], 32);
+            found = true;
+        } else {
+            merkle_combine_hashes(builder->subtree_roots[height], out, out);
+        }
+    }
+
+    if (!found) {
+        memset(out, 0, 32);
+    }
 }
 
 // TODO: make this O(log n), or possibly O(1). Currently O(log^2 n).
@@ -1,7 +1,14 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+#include "cx.h"
+
+#include "../perf_config.h"
+#include "../cache_stats.h"
 
 // TODO: RFC6962 defines the empty list hash as sha256(b''); while we're using 0 here. Should we
 // change?
@@ -57,6 +64,116 @@ void merkle_combine_hashes(const uint8_t left[static 32],
                            const uint8_t right[static 32],
                            uint8_t out[static 32]);
 
+/**
+ * Same as merkle_compute_element_hash, using the given SHA256 context, that is initialized by the
+ * function; the prefix byte and the input are passed to it directly.
+ *
+ * @param[out] hash
+ *   Pointer to the SHA256 context to use.
+ * @param[in] in
+ *   Pointer to the input buffer.
+ * @param[in] in_len
+ *   Length of the input buffer.
+ * @param[out] out
+ *   Pointer to a 32-bytes buffer to store the result.
+ */
+void merkle_compute_element_hash_ctx(cx_sha256_t *hash,
+                                     const uint8_t *in,
+                                     size_t in_len,
+                                     uint8_t out[static 32]);
+
+/**
+ * Same as merkle_combine_hashes, using the given SHA256 context, that is initialized by the
+ * function; the context is not wiped, so that it can be reused for consecutive hashes.
+ *
+ * @param[out] hash
+ *   Pointer to the SHA256 context to use.
+ * @param[in] left
+ *   Pointer to the 32-byte hash of the left child.
+ * @param[in] right
+ *   Pointer to the 32-byte hash of the right child.
+ * @param[out] out
+ *   Pointer to a 32-bytes buffer to store the result; it can overlap left or right.
+ */
+void merkle_combine_hashes_ctx(cx_sha256_t *hash,
+                               const uint8_t left[static 32],
+                               const uint8_t right[static 32],
+                               uint8_t out[static 32]);
+
+/**
+ * Verifies consecutive elements of the Merkle proof of the leaf with index leaf_index in a tree
+ * with tree_size leaves, combining them with the hash of the subtree verified so far. The
+ * directions of the path of the leaf are computed once per call, and all the hashes share the same
+ * SHA256 context. A proof received in a single response is verified with a single call; otherwise,
+ * the elements of each response are verified with consecutive calls.
+ *
+ * @param[in] tree_size
+ *   The number of leaves of the Merkle tree.
+ * @param[in] leaf_index
+ *   The index of the leaf.
+ * @param[in] proof_size
+ *   The total number of elements of the proof, that must be the depth of the leaf.
+ * @param[in] first_step
+ *   The number of elements of the proof already verified.
+ * @param[in] proof
+ *   Pointer to the n_elements 32-byte hashes to verify, from the one closest to the leaf.
+ * @param[in] n_elements
+ *   The number of elements to verify; first_step + n_elements must be at most proof_size.
+ * @param[in,out] cur_hash
+ *   The hash of the subtree verified so far, that is the leaf hash when first_step is 0; it is
+ *   updated with the hash of the parent of each element, and after the last element of the proof,
+ *   it is the Merkle root, that the caller must compare with the expected one.
+ *
+ * @return 0 on success, or -1 if the arguments are not consistent with the tree.
+ */
+int merkle_verify_proof(uint32_t tree_size,
+                        uint32_t leaf_index,
+                        uint8_t proof_size,
+                        uint8_t first_step,
+                        const uint8_t *proof,
+                        size_t n_elements,
+                        uint8_t cur_hash[static 32]);
+
+/**
+ * State of the computation of the root of a Merkle tree whose leaves are added one at a time,
+ * without storing them: it only keeps the roots of the complete subtrees of the leaves added so
+ * far, that is one root for each bit set in n_leaves. The tree is the same as the one computed by
+ * the client.
+ */
+typedef struct {
+    uint32_t n_leaves;
+    uint8_t subtree_roots[MAX_MERKLE_TREE_DEPTH][32];  // the root at index i has 2^i leaves
+} merkle_root_builder_t;
+
+/**
+ * Initializes an empty merkle_root_builder_t.
+ */
+static inline void merkle_root_builder_init(merkle_root_builder_t *builder) {
+    builder->n_leaves = 0;
+}
+
+/**
+ * Adds a leaf to the tree, given its hash as computed by merkle_compute_element_hash. At most
+ * 2^32 - 1 leaves can be added.
+ *
+ * @param[in,out] builder
+ *   Pointer to the builder.
+ * @param[in] leaf_hash
+ *   Pointer to the 32-byte hash of the new leaf.
+ */
+void merkle_root_builder_add(merkle_root_builder_t *builder, const uint8_t leaf_hash[static 32]);
+
+/**
+ * Computes the root of the Merkle tree of all the leaves added so far; the root of the empty tree
+ * is 32 zero bytes. The builder is not modified, and more leaves can be added afterwards.
+ *
+ * @param[in] builder
+ *   Pointer to the builder.
+ * @param[out] out
+ *   Pointer to a 32-bytes buffer to store the result.
+ */
+void merkle_root_builder_get_root(const merkle_root_builder_t *builder, uint8_t out[static 32]);
+
 // inlined to save on stack depth
 static inline uint8_t ceil_lg(uint32_t n) {
     uint8_t r = 0;
@@ -76,9 +193,56 @@ int merkle_get_ith_direction(size_t size, size_t index, size_t i);
  * Represents the Merkleized version of a key-value map, holding the number of elements, the root of
  * the Merkle tree of the sorted list of keys, and the root of the Merkle tree of the values (sorted
  * by their correpsonding key).
+ *
+ * It also contains a cache of the indices of the keys of length 1 (like most PSBT key types), that
+ * is filled when all the keys of the map are verified; if cache_complete is true, all the keys of
+ * length 1 in the map are in the cache.
  */
 typedef struct {
     uint64_t size;
     uint8_t keys_root[32];
     uint8_t values_root[32];
-} merkleized_map_commitment_t;
\ No newline at end of file
+    uint8_t n_cached_keys;
+    bool cache_complete;
+    uint8_t cached_keys[MERKLEIZED_MAP_INDEX_CACHE_SIZE];
+    uint8_t cached_indices[MERKLEIZED_MAP_INDEX_CACHE_SIZE];
+} merkleized_map_commitment_t;
+
+/**
+ * Looks up a key in the index cache of a merkleized map.
+ *
+ * @param[in] map
+ *   Pointer to the merkleized map commitment.
+ * @param[in] key
+ *   Pointer to the key.
+ * @param[in] key_len
+ *   Length of the key.
+ *
+ * @return the index of the key if it is in the cache; -1 if the key is certainly not in the map;
+ * -2 if the cache does not contain information about the key.
+ */
+static inline int merkleized_map_cached_index(const merkleized_map_commitment_t *map,
+                                              const uint8_t *key,
+                                              int key_len) {
+    if (key_len != 1) {
+        return -2;
+    }
+    for (int i = 0; i < map->n_cached_keys; i++) {
+        if (map->cached_keys[i] == key[0]) {
+            PERF_COUNT_CACHE(CACHE_MERKLEIZED_MAP_INDEX,
+                             hits,
+                             sizeof(map->cached_keys) + sizeof(map->cached_indices));
+            return map->cached_indices[i];
+        }
+    }
+    if (map->cache_complete) {
+        PERF_COUNT_CACHE(CACHE_MERKLEIZED_MAP_INDEX,
+                         hits,
+                         sizeof(map->cached_keys) + sizeof(map->cached_indices));
+        return -1;
+    }
+    PERF_COUNT_CACHE(CACHE_MERKLEIZED_MAP_INDEX,
+                     misses,
+                     sizeof(map->cached_keys) + sizeof(map->cached_indices));
+    return -2;
+}
\ No newline at end of file
@@ -106,6 +106,27 @@ bool dbuffer_read_varint(buffer_t *buffers[2], uint64_t *out) {
     return true;
 }
 
+size_t dbuffer_skip_bytes(buffer_t *buffers[2],
+                          size_t n,
+                          void (*callback)(const uint8_t *data, size_t data_len, void *cb_state),
+                          void *cb_state) {
+    size_t n_skipped = 0;
+    for (int i = 0; i < 2 && n_skipped < n; i++) {
+        size_t len = buffers[i]->size - buffers[i]->offset;
+        if (len > n - n_skipped) {
+            len = n - n_skipped;
+        }
+        if (len > 0) {
+            if (callback != NULL) {
+                callback(buffers[i]->ptr + buffers[i]->offset, len, cb_state);
+            }
+            buffer_seek_cur(buffers[i], len);
+            n_skipped += len;
+        }
+    }
+    return n_skipped;
+}
+
 bool parser_consolidate_buffers(buffer_t *buffers[2], size_t max_size) {
     size_t length0 = buffers[0]->size - buffers[0]->offset;
     size_t length1 = buffers[1]->size - buffers[1]->offset;
@@ -59,6 +59,20 @@ bool dbuffer_read_u32(buffer_t *buffers[2], uint32_t *out, endianness_t endianne
  */
 bool dbuffer_read_varint(buffer_t *buffers[2], uint64_t *out);
 
+/**
+ * Consumes up to n bytes from the concatenation of the two buffers, without copying them; if
+ * callback is not NULL, it is called with each contiguous portion of the consumed bytes, in order.
+ * Useful to hash (or simply skip) long fields that do not need to be stored, as all the available
+ * bytes are consumed, instead of reading them in chunks of a fixed size.
+ *
+ * Returns the number of bytes consumed, that is less than n if the buffers do not contain enough
+ * data.
+ */
+size_t dbuffer_skip_bytes(buffer_t *buffers[2],
+                          size_t n,
+                          void (*callback)(const uint8_t *data, size_t data_len, void *cb_state),
+                          void *cb_state);
+
 /**
  * TODO: docs.
  */
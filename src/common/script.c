@@ -1,14 +1,17 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <limits.h>
+#include <string.h>
 
 #include "../common/bip32.h"
 #include "../common/buffer.h"
 #include "../common/read.h"
 #include "../common/script.h"
-#include "../common/segwit_addr.h"
 
 #ifndef SKIP_FOR_CMOCKA
+#include "../common/address.h"
+#include "../common/base58.h"
+#include "../common/segwit_addr.h"
 #include "../crypto.h"
 #endif
 
@@ -57,18 +60,13 @@ int get_script_address(const uint8_t script[],
                        char *out,
                        size_t out_len) {
     int script_type = get_script_type(script, script_len);
-    int addr_len;
     switch (script_type) {
         case SCRIPT_TYPE_P2PKH:
         case SCRIPT_TYPE_P2SH: {
             int offset = (script_type == SCRIPT_TYPE_P2PKH) ? 3 : 2;
-            int ver = (script_type == SCRIPT_TYPE_P2PKH) ? coin_config->p2pkh_version
-                                                         : coin_config->p2sh_version;
-            addr_len = base58_encode_address(script + offset, ver, out, out_len - 1);
-            if (addr_len < 0) {
-                return -1;
-            }
-            break;
+            int ver = (script_type == SCRIPT_TYPE_P2PKH) ? COIN_CONFIG_P2PKH_VERSION(coin_config)
+                                                         : COIN_CONFIG_P2SH_VERSION(coin_config);
+            return address_encode_base58check(script + offset, ver, out, out_len);
         }
         case SCRIPT_TYPE_P2WPKH:
         case SCRIPT_TYPE_P2WSH:
@@ -79,31 +77,89 @@ int get_script_address(const uint8_t script[],
             // witness program version
             int version = (script[0] == 0 ? 0 : script[0] - 80);
 
-            // make sure that the output buffer is long enough
-            if (out_len < 73 + strlen(coin_config->native_segwit_prefix)) {
-                return -1;
-            }
-
-            int ret = segwit_addr_encode(out,
-                                         coin_config->native_segwit_prefix,
+            return address_encode_segwit(COIN_CONFIG_NATIVE_SEGWIT_PREFIX(coin_config),
                                          version,
                                          script + 2,
-                                         prog_len);
-
-            if (ret != 1) {
-                return -1;  // should never happen
-            }
-
-            addr_len = strlen(out);
-            break;
+                                         prog_len,
+                                         out,
+                                         out_len);
         }
         default:
             return -1;
     }
-    if (addr_len >= 0) {
-        out[addr_len] = '\0';
+}
+
+// Returns the length of the version prefix of base58check addresses, as in
+// address_encode_base58check.
+static size_t base58check_version_len(uint32_t version) {
+    return version < 256 ? 1 : (version < 65536 ? 2 : 4);
+}
+
+// Returns true if the decoded base58check payload starts with the given version prefix.
+static bool base58check_has_version(const uint8_t *payload, uint32_t version) {
+    size_t version_len = base58check_version_len(version);
+    for (size_t i = 0; i < version_len; i++) {
+        if (payload[i] != (uint8_t) (version >> (8 * (version_len - 1 - i)))) {
+            return false;
+        }
     }
-    return addr_len;
+    return true;
+}
+
+int get_address_script(const char *address,
+                       const global_context_t *coin_config,
+                       uint8_t out[static MAX_ADDRESS_SCRIPT_LEN]) {
+    // segwit addresses
+    const char *native_segwit_prefix = COIN_CONFIG_NATIVE_SEGWIT_PREFIX(coin_config);
+    if (native_segwit_prefix != NULL) {
+        int version;
+        uint8_t prog[40];
+        size_t prog_len;
+        if (segwit_addr_decode(&version,
+                               prog,
+                               &prog_len,
+                               native_segwit_prefix,
+                               address) == 1) {
+            out[0] = version == 0 ? OP_0 : OP_1 + (version - 1);
+            out[1] = (uint8_t) prog_len;
+            memcpy(out + 2, prog, prog_len);
+            return 2 + prog_len;
+        }
+    }
+
+    // base58check addresses: version prefix, 20-bytes hash, 4-bytes checksum
+    uint8_t payload[4 + 20 + 4];
+    int payload_len = base58_decode(address, strlen(address), payload, sizeof(payload));
+    if (payload_len < 1 + 20 + 4) {
+        return -1;
+    }
+    uint8_t checksum[4];
+    crypto_get_checksum(payload, payload_len - 4, checksum);
+    if (memcmp(checksum, payload + payload_len - 4, 4) != 0) {
+        return -1;
+    }
+    size_t hash_offset = payload_len - 4 - 20;
+    uint32_t p2pkh_version = COIN_CONFIG_P2PKH_VERSION(coin_config);
+    uint32_t p2sh_version = COIN_CONFIG_P2SH_VERSION(coin_config);
+    if (hash_offset == base58check_version_len(p2pkh_version) &&
+        base58check_has_version(payload, p2pkh_version)) {
+        out[0] = OP_DUP;
+        out[1] = OP_HASH160;
+        out[2] = 0x14;
+        memcpy(out + 3, payload + hash_offset, 20);
+        out[23] = OP_EQUALVERIFY;
+        out[24] = OP_CHECKSIG;
+        return 25;
+    }
+    if (hash_offset == base58check_version_len(p2sh_version) &&
+        base58check_has_version(payload, p2sh_version)) {
+        out[0] = OP_HASH160;
+        out[1] = 0x14;
+        memcpy(out + 2, payload + hash_offset, 20);
+        out[22] = OP_EQUAL;
+        return 23;
+    }
+    return -1;
 }
 
 #endif
@@ -156,6 +156,14 @@ typedef enum {
     SCRIPT_TYPE_UNKNOWN_SEGWIT = 0xFF  // a valid but undefined segwit script
 } script_type_e;
 
+// the longest scriptPubKey with an address, a segwit script with a 40-bytes witness program
+#define MAX_ADDRESS_SCRIPT_LEN 42
+
+static inline bool is_p2sh(const uint8_t script[], size_t script_len) {
+    return script_len == 23 && script[0] == OP_HASH160 && script[1] == 0x14 &&
+           script[22] == OP_EQUAL;
+}
+
 static inline bool is_p2wpkh(const uint8_t script[], size_t script_len) {
     return script_len == 22 && script[0] == 0x00 && script[1] == 0x14;
 }
@@ -199,6 +207,20 @@ int get_script_address(const uint8_t script[],
                        char *out,
                        size_t out_len);
 
+/**
+ * Computes the scriptPubKey of the given address; it is the inverse of get_script_address, for the
+ * same types of scripts.
+ *
+ * @param address the null-terminated address
+ * @param coin_config the configuration for the coin
+ * @param out the output buffer of MAX_ADDRESS_SCRIPT_LEN bytes
+ * @return the length of the scriptPubKey on success; -1 if the address is invalid or of an
+ * unsupported type.
+ */
+int get_address_script(const char *address,
+                       const global_context_t *coin_config,
+                       uint8_t out[static MAX_ADDRESS_SCRIPT_LEN]);
+
 #endif
 
 // the longest OP_RETURN description "OP_RETURN 0x" followed by 160 hexadecimal characters
@@ -27,14 +27,20 @@
 
 #include "segwit_addr.h"
 
+/** The xor of the generators of the checksum selected by each of the values of five bits. */
+static const uint32_t bech32_polymod_table[32] = {
+    0x00000000, 0x3b6a57b2, 0x26508e6d, 0x1d3ad9df,
+    0x1ea119fa, 0x25cb4e48, 0x38f19797, 0x039bc025,
+    0x3d4233dd, 0x0628646f, 0x1b12bdb0, 0x2078ea02,
+    0x23e32a27, 0x18897d95, 0x05b3a44a, 0x3ed9f3f8,
+    0x2a1462b3, 0x117e3501, 0x0c44ecde, 0x372ebb6c,
+    0x34b57b49, 0x0fdf2cfb, 0x12e5f524, 0x298fa296,
+    0x1756516e, 0x2c3c06dc, 0x3106df03, 0x0a6c88b1,
+    0x09f74894, 0x329d1f26, 0x2fa7c6f9, 0x14cd914b
+};
+
 static uint32_t bech32_polymod_step(uint32_t pre) {
-    uint8_t b = pre >> 25;
-    return ((pre & 0x1FFFFFF) << 5) ^
-        (-((b >> 0) & 1) & 0x3b6a57b2UL) ^
-        (-((b >> 1) & 1) & 0x26508e6dUL) ^
-        (-((b >> 2) & 1) & 0x1ea119faUL) ^
-        (-((b >> 3) & 1) & 0x3d4233ddUL) ^
-        (-((b >> 4) & 1) & 0x2a1462b3UL);
+    return ((pre & 0x1FFFFFF) << 5) ^ bech32_polymod_table[pre >> 25];
 }
 
 static uint32_t bech32_final_constant(bech32_encoding enc) {
@@ -44,7 +50,7 @@ static uint32_t bech32_final_constant(bech32_encoding enc) {
     return 0; // suppress compiler warning on missing return value
 }
 
-static const char* charset = "qpzry9x8gf2tvdw0s3jn54khce6mua7l";
+const char bech32_charset[33] = "qpzry9x8gf2tvdw0s3jn54khce6mua7l";
 
 static const int8_t charset_rev[128] = {
     -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
@@ -57,7 +63,12 @@ static const int8_t charset_rev[128] = {
      1,  0,  3, 16, 11, 28, 12, 14,  6,  4,  2, -1, -1, -1, -1, -1
 };
 
-int bech32_encode(char *output, const char *hrp, const uint8_t *data, size_t data_len, bech32_encoding enc) {
+/**
+ * Writes the human-readable part and the separator to output, and computes the initial checksum.
+ * Returns the number of characters written, or 0 if the hrp is invalid or the encoding of data_len
+ * values would be too long.
+ */
+static size_t bech32_encode_hrp(char *output, uint32_t *chk_out, const char *hrp, size_t data_len) {
     uint32_t chk = 1;
     size_t i = 0;
     while (hrp[i] != 0) {
@@ -72,24 +83,38 @@ int bech32_encode(char *output, const char *hrp, const uint8_t *data, size_t dat
     }
     if (i + 7 + data_len > 90) return 0;
     chk = bech32_polymod_step(chk);
-    while (*hrp != 0) {
-        chk = bech32_polymod_step(chk) ^ (*hrp & 0x1f);
-        *(output++) = *(hrp++);
-    }
-    *(output++) = '1';
-    for (i = 0; i < data_len; ++i) {
-        if (*data >> 5) return 0;
-        chk = bech32_polymod_step(chk) ^ (*data);
-        *(output++) = charset[*(data++)];
+    for (size_t j = 0; j < i; ++j) {
+        chk = bech32_polymod_step(chk) ^ (hrp[j] & 0x1f);
+        output[j] = hrp[j];
     }
-    for (i = 0; i < 6; ++i) {
+    output[i] = '1';
+    *chk_out = chk;
+    return i + 1;
+}
+
+/** Writes the checksum and the terminating null character to output. */
+static void bech32_encode_checksum(char *output, uint32_t chk, bech32_encoding enc) {
+    for (size_t i = 0; i < 6; ++i) {
         chk = bech32_polymod_step(chk);
     }
     chk ^= bech32_final_constant(enc);
-    for (i = 0; i < 6; ++i) {
-        *(output++) = charset[(chk >> ((5 - i) * 5)) & 0x1f];
+    for (size_t i = 0; i < 6; ++i) {
+        *(output++) = bech32_charset[(chk >> ((5 - i) * 5)) & 0x1f];
     }
     *output = 0;
+}
+
+int bech32_encode(char *output, const char *hrp, const uint8_t *data, size_t data_len, bech32_encoding enc) {
+    uint32_t chk;
+    size_t hrp_len = bech32_encode_hrp(output, &chk, hrp, data_len);
+    if (hrp_len == 0) return 0;
+    output += hrp_len;
+    for (size_t i = 0; i < data_len; ++i) {
+        if (*data >> 5) return 0;
+        chk = bech32_polymod_step(chk) ^ (*data);
+        *(output++) = bech32_charset[*(data++)];
+    }
+    bech32_encode_checksum(output, chk, enc);
     return 1;
 }
 
@@ -179,17 +204,44 @@ static int convert_bits(uint8_t* out, size_t* outlen, int outbits, const uint8_t
 }
 
 int segwit_addr_encode(char *output, const char *hrp, int witver, const uint8_t *witprog, size_t witprog_len) {
-    uint8_t data[65];
-    size_t datalen = 0;
     bech32_encoding enc = BECH32_ENCODING_BECH32;
-    if (witver > 16) return 0;
+    if (witver < 0 || witver > 16) return 0;
     if (witver == 0 && witprog_len != 20 && witprog_len != 32) return 0;
     if (witprog_len < 2 || witprog_len > 40) return 0;
     if (witver > 0) enc = BECH32_ENCODING_BECH32M;
-    data[0] = witver;
-    convert_bits(data + 1, &datalen, 5, witprog, witprog_len, 8, 1);
-    ++datalen;
-    return bech32_encode(output, hrp, data, datalen, enc);
+
+    // the witness version, followed by the program converted to groups of 5 bits (padded)
+    size_t data_len = 1 + (witprog_len * 8 + 4) / 5;
+    uint32_t chk;
+    size_t hrp_len = bech32_encode_hrp(output, &chk, hrp, data_len);
+    if (hrp_len == 0) return 0;
+    output += hrp_len;
+
+    chk = bech32_polymod_step(chk) ^ witver;
+    *(output++) = bech32_charset[witver];
+
+    // each group is added to the checksum and encoded as soon as it is complete, without
+    // converting the whole program first
+    uint32_t val = 0;
+    int bits = 0;
+    for (size_t i = 0; i < witprog_len; ++i) {
+        val = (val << 8) | witprog[i];
+        bits += 8;
+        while (bits >= 5) {
+            bits -= 5;
+            uint8_t v = (val >> bits) & 0x1f;
+            chk = bech32_polymod_step(chk) ^ v;
+            *(output++) = bech32_charset[v];
+        }
+    }
+    if (bits) {
+        uint8_t v = (val << (5 - bits)) & 0x1f;
+        chk = bech32_polymod_step(chk) ^ v;
+        *(output++) = bech32_charset[v];
+    }
+
+    bech32_encode_checksum(output, chk, enc);
+    return 1;
 }
 
 int segwit_addr_decode(int* witver, uint8_t* witdata, size_t* witdata_len, const char* hrp, const char* addr) {
@@ -26,6 +26,8 @@
 
 #include <stdint.h>
 
+/** The 32 characters of the bech32 alphabet, also used by CashAddr. */
+extern const char bech32_charset[33];
 
 /** Encode a SegWit address
  *
@@ -42,6 +42,12 @@ Currently supported wallet policies for multisig:
    WRAPPED SEGWIT
   sh(wsh(multi(...)))
   sh(wsh(sortedmulti(...)))
+
+More generally, the script inside wsh() (or sh(wsh())) can be any miniscript, for example:
+  wsh(or_d(multi(2,@0,@1),and_v(v:pkh(@2),older(52560))))
+
+Taproot policies can also have a tree of miniscripts (without multi() and sortedmulti()), like:
+  tr(@0,{pk(@1),and_v(v:pk(@2),older(144))})
 */
 
 #pragma GCC diagnostic pop
@@ -60,7 +66,41 @@ static const token_descriptor_t KNOWN_TOKENS[] = {
     {.type = TOKEN_WPKH, .name = "wpkh"},
     {.type = TOKEN_MULTI, .name = "multi"},
     {.type = TOKEN_SORTEDMULTI, .name = "sortedmulti"},
-    {.type = TOKEN_TR, .name = "tr"}};
+    {.type = TOKEN_TR, .name = "tr"},
+    {.type = TOKEN_0, .name = "0"},
+    {.type = TOKEN_1, .name = "1"},
+    {.type = TOKEN_PK, .name = "pk"},
+    {.type = TOKEN_PK_K, .name = "pk_k"},
+    {.type = TOKEN_PK_H, .name = "pk_h"},
+    {.type = TOKEN_OLDER, .name = "older"},
+    {.type = TOKEN_AFTER, .name = "after"},
+    {.type = TOKEN_SHA256, .name = "sha256"},
+    {.type = TOKEN_HASH256, .name = "hash256"},
+    {.type = TOKEN_RIPEMD160, .name = "ripemd160"},
+    {.type = TOKEN_HASH160, .name = "hash160"},
+    {.type = TOKEN_ANDOR, .name = "andor"},
+    {.type = TOKEN_AND_V, .name = "and_v"},
+    {.type = TOKEN_AND_B, .name = "and_b"},
+    {.type = TOKEN_AND_N, .name = "and_n"},
+    {.type = TOKEN_OR_B, .name = "or_b"},
+    {.type = TOKEN_OR_C, .name = "or_c"},
+    {.type = TOKEN_OR_D, .name = "or_d"},
+    {.type = TOKEN_OR_I, .name = "or_i"},
+    {.type = TOKEN_THRESH, .name = "thresh"}};
+
+/**
+ * The miniscript wrappers, each identified by a single character.
+ */
+static const token_descriptor_t KNOWN_WRAPPERS[] = {{.type = TOKEN_A, .name = "a"},
+                                                    {.type = TOKEN_S, .name = "s"},
+                                                    {.type = TOKEN_C, .name = "c"},
+                                                    {.type = TOKEN_T, .name = "t"},
+                                                    {.type = TOKEN_D, .name = "d"},
+                                                    {.type = TOKEN_V, .name = "v"},
+                                                    {.type = TOKEN_J, .name = "j"},
+                                                    {.type = TOKEN_N, .name = "n"},
+                                                    {.type = TOKEN_L, .name = "l"},
+                                                    {.type = TOKEN_U, .name = "u"}};
 
 /**
  * Length of the longest token in the policy wallet descriptor language (not including the
@@ -73,7 +113,8 @@ int read_policy_map_wallet(buffer_t *buffer, policy_map_wallet_header_t *header)
         return -1;
     }
 
-    if (header->type != WALLET_TYPE_POLICY_MAP) {
+    if (header->type != WALLET_TYPE_POLICY_MAP && header->type != WALLET_TYPE_POLICY_MAP_BINARY &&
+        header->type != WALLET_TYPE_POLICY_MAP_BINARY_KEYS) {
         return -2;
     }
 
@@ -91,7 +132,8 @@ int read_policy_map_wallet(buffer_t *buffer, policy_map_wallet_header_t *header)
     header->name[header->name_len] = '\0';
 
     uint64_t policy_map_len;
-    if (!buffer_read_varint(buffer, &policy_map_len) || policy_map_len > 74) {
+    if (!buffer_read_varint(buffer, &policy_map_len) ||
+        policy_map_len > MAX_POLICY_MAP_STR_LENGTH) {
         return -6;
     }
     header->policy_map_len = (uint16_t) policy_map_len;
@@ -146,7 +188,8 @@ static uint8_t lowercase_hex_to_int(char c) {
 static size_t read_word(buffer_t *buffer, char *out, size_t out_len) {
     size_t word_len = 0;
     uint8_t c;
-    while (word_len < out_len && buffer_peek(buffer, &c) && is_alpha((char) c)) {
+    while (word_len < out_len && buffer_peek(buffer, &c) &&
+           (is_alphanumeric((char) c) || c == '_')) {
         out[word_len++] = (char) c;
         buffer_seek_cur(buffer, 1);
     }
@@ -154,21 +197,14 @@ static size_t read_word(buffer_t *buffer, char *out, size_t out_len) {
 }
 
 /**
- * Read the next word from buffer (or up to MAX_TOKEN_LENGTH characters), and
- * returns the index of this word in KNOWN_TOKENS if found; -1 otherwise.
+ * Returns the type of the token whose name is word in the given table, or -1 if not found.
  */
-static int parse_token(buffer_t *buffer) {
-    char word[MAX_TOKEN_LENGTH + 1];
-
-    size_t word_len = read_word(buffer, word, MAX_TOKEN_LENGTH);
-    word[word_len] = '\0';
-
-    for (unsigned int i = 0; i < sizeof(KNOWN_TOKENS) / sizeof(KNOWN_TOKENS[0]); i++) {
-        if (strncmp((const char *) PIC(KNOWN_TOKENS[i].name), word, MAX_TOKEN_LENGTH) == 0) {
-            return (int) PIC(KNOWN_TOKENS[i].type);
+static int get_token_type(const token_descriptor_t *tokens, size_t n_tokens, const char *word) {
+    for (unsigned int i = 0; i < n_tokens; i++) {
+        if (strncmp((const char *) PIC(tokens[i].name), word, MAX_TOKEN_LENGTH) == 0) {
+            return (int) PIC(tokens[i].type);
         }
     }
-
     return -1;
 }
 
@@ -219,7 +255,7 @@ static int parse_unsigned_decimal(buffer_t *buffer, size_t *out) {
 // Reads a derivation step expressed in decimal, with the symbol ' to mark if hardened (h is not
 // supported) Returns 0 on success, -1 on error.
 static int buffer_read_derivation_step(buffer_t *buffer, uint32_t *out) {
-    uint32_t der_step;
+    size_t der_step;
     if (parse_unsigned_decimal(buffer, &der_step) == -1 || der_step >= BIP32_FIRST_HARDENED_CHILD) {
         PRINTF("Failed reading derivation step\n");
         return -1;
@@ -236,10 +272,88 @@ static int buffer_read_derivation_step(buffer_t *buffer, uint32_t *out) {
     return 0;
 }
 
+// the two steps of a multipath wildcard must be different and unhardened
+static bool is_valid_multipath(const uint32_t multipath[static 2]) {
+    return multipath[0] < BIP32_FIRST_HARDENED_CHILD && multipath[1] < BIP32_FIRST_HARDENED_CHILD &&
+           multipath[0] != multipath[1];
+}
+
+// parses the rest of a multipath wildcard "/<M;N>/*", after the initial "/<"
+static int parse_multipath_suffix(buffer_t *buffer, uint32_t multipath[static 2]) {
+    for (int i = 0; i < 2; i++) {
+        size_t step;
+        uint8_t c;
+        if (parse_unsigned_decimal(buffer, &step) == -1 || step >= BIP32_FIRST_HARDENED_CHILD ||
+            !buffer_read_u8(buffer, &c) || c != (i == 0 ? ';' : '>')) {
+            return -1;
+        }
+        multipath[i] = (uint32_t) step;
+    }
+
+    uint8_t wildcard[2];
+    if (!buffer_read_bytes(buffer, wildcard, 2) || wildcard[0] != '/' || wildcard[1] != '*' ||
+        !is_valid_multipath(multipath)) {
+        return -1;
+    }
+    return 0;
+}
+
 // TODO: we are currently enforcing that the master key fingerprint (if present) is in lowercase
 // hexadecimal digits,
 //       and that the symbol for "hardened derivation" is "'".
 //       This implies descriptors should be normalized on the client side.
+// parses a key information in the binary encoding, whose first byte is in the buffer
+static int parse_policy_map_key_info_binary(buffer_t *buffer, policy_map_key_info_t *out) {
+    uint8_t flags;
+    if (!buffer_read_u8(buffer, &flags) ||
+        (flags & ~(KEY_INFO_BINARY_HAS_KEY_ORIGIN | KEY_INFO_BINARY_HAS_WILDCARD |
+                   KEY_INFO_BINARY_HAS_MULTIPATH)) != 0) {
+        return -1;
+    }
+
+    out->is_binary = 1;
+    out->has_key_origin = (flags & KEY_INFO_BINARY_HAS_KEY_ORIGIN) != 0;
+    out->has_wildcard = (flags & KEY_INFO_BINARY_HAS_WILDCARD) != 0;
+    bool has_multipath = (flags & KEY_INFO_BINARY_HAS_MULTIPATH) != 0;
+    if (has_multipath && !out->has_wildcard) {
+        return -1;
+    }
+
+    if (out->has_key_origin) {
+        if (!buffer_read_bytes(buffer, out->master_key_fingerprint, 4) ||
+            !buffer_read_u8(buffer, &out->master_key_derivation_len) ||
+            out->master_key_derivation_len > MAX_BIP32_PATH_STEPS) {
+            return -1;
+        }
+        for (int i = 0; i < out->master_key_derivation_len; i++) {
+            if (!buffer_read_u32(buffer, &out->master_key_derivation[i], LE)) {
+                return -1;
+            }
+        }
+    }
+
+    if (!buffer_read_bytes(buffer, out->serialized_ext_pubkey, SERIALIZED_EXTENDED_PUBKEY_LEN)) {
+        return -1;
+    }
+
+    if (has_multipath) {
+        if (!buffer_read_u32(buffer, &out->multipath[0], LE) ||
+            !buffer_read_u32(buffer, &out->multipath[1], LE) ||
+            !is_valid_multipath(out->multipath)) {
+            return -1;
+        }
+    } else if (out->has_wildcard) {
+        out->multipath[0] = 0;
+        out->multipath[1] = 1;
+    }
+
+    // nothing else must be left in the buffer
+    if (buffer_can_read(buffer, 1)) {
+        return -1;
+    }
+    return 0;
+}
+
 int parse_policy_map_key_info(buffer_t *buffer, policy_map_key_info_t *out) {
     memset(out, 0, sizeof(policy_map_key_info_t));
 
@@ -248,6 +362,11 @@ int parse_policy_map_key_info(buffer_t *buffer, policy_map_key_info_t *out) {
         return -1;
     }
 
+    if (c <= (KEY_INFO_BINARY_HAS_KEY_ORIGIN | KEY_INFO_BINARY_HAS_WILDCARD |
+              KEY_INFO_BINARY_HAS_MULTIPATH)) {
+        return parse_policy_map_key_info_binary(buffer, out);
+    }
+
     if (c == '[') {
         out->has_key_origin = 1;
 
@@ -288,7 +407,7 @@ int parse_policy_map_key_info(buffer_t *buffer, policy_map_key_info_t *out) {
         }
     }
 
-    // consume the rest of the buffer into the pubkey, except possibly the final "/**"
+    // consume the rest of the buffer into the pubkey, except possibly the final wildcard
     unsigned int ext_pubkey_len = 0;
     while (ext_pubkey_len < MAX_SERIALIZED_PUBKEY_LENGTH && buffer_peek(buffer, &c) &&
            is_alphanumeric(c)) {
@@ -298,7 +417,8 @@ int parse_policy_map_key_info(buffer_t *buffer, policy_map_key_info_t *out) {
     }
     out->ext_pubkey[ext_pubkey_len] = '\0';
 
-    // either the string terminates now, or it has a final "/**" suffix for the wildcard.
+    // either the string terminates now, or it has a final "/**" or "/<M;N>/*" suffix for the
+    // wildcard.
     if (!buffer_can_read(buffer, 1)) {
         // no wildcard
         return 0;
@@ -306,13 +426,23 @@ int parse_policy_map_key_info(buffer_t *buffer, policy_map_key_info_t *out) {
 
     out->has_wildcard = 1;
 
-    // Only the final "/**" suffix should be left
-    uint8_t wildcard[3];
+    uint8_t wildcard[2];
+    if (!buffer_read_bytes(buffer, wildcard, 2) || wildcard[0] != '/') {
+        return -1;
+    }
+    if (wildcard[1] == '<') {
+        if (parse_multipath_suffix(buffer, out->multipath) == -1) {
+            return -1;
+        }
+    } else if (wildcard[1] != '*' || !buffer_read_u8(buffer, &c) || c != '*') {
+        return -1;
+    } else {
+        out->multipath[0] = 0;
+        out->multipath[1] = 1;
+    }
+
     // Make sure that the buffer is indeed exhausted
-    if (!buffer_read_bytes(buffer, wildcard, 3)  // should be able to read 3 characters
-        || buffer_can_read(buffer, 1)            // but nothing more
-        || wildcard[0] != '/'                    // suffix should be exactly "/**"
-        || wildcard[1] != '*' || wildcard[2] != '*') {
+    if (buffer_can_read(buffer, 1)) {
         return -1;
     }
 
@@ -332,7 +462,126 @@ static size_t parse_key_index(buffer_t *in_buf) {
     return k;
 }
 
-#define CONTEXT_WITHIN_SH 1
+#define CONTEXT_WITHIN_SH  1
+#define CONTEXT_WITHIN_WSH 2  // the script is a miniscript
+#define CONTEXT_WITHIN_TR  4  // the script is a miniscript in a leaf of a tr() tree (tapscript)
+
+#define CONTEXT_MINISCRIPT (CONTEXT_WITHIN_WSH | CONTEXT_WITHIN_TR)
+
+static int parse_script(buffer_t *in_buf,
+                        buffer_t *out_buf,
+                        size_t depth,
+                        unsigned long context_flags);
+
+/**
+ * Parses the lowercase hexadecimal encoding of a hash of hash_len bytes from buffer.
+ * Returns 0 on success, -1 on failure.
+ */
+static int parse_hash(buffer_t *buffer, uint8_t *out, size_t hash_len) {
+    for (unsigned int i = 0; i < hash_len; i++) {
+        char num[2];
+        if (!buffer_read_bytes(buffer, (uint8_t *) num, 2) || !is_lowercase_hex(num[0]) ||
+            !is_lowercase_hex(num[1])) {
+            return -1;
+        }
+        out[i] = 16 * lowercase_hex_to_int(num[0]) + lowercase_hex_to_int(num[1]);
+    }
+    return 0;
+}
+
+// pkh(), multi() and sortedmulti() are also valid miniscript fragments
+static bool is_miniscript_token(int token) {
+    return token == TOKEN_PKH || token == TOKEN_MULTI || token == TOKEN_SORTEDMULTI ||
+           token >= TOKEN_0;
+}
+
+/**
+ * Checks that a fragment with the given token (or -1 if unknown) can appear at the given depth and
+ * context of a policy; common to the parsers of the textual and of the binary encoding.
+ * Returns 0 if it is allowed, a negative number otherwise.
+ */
+static int check_token_context(int token, size_t depth, unsigned long context_flags) {
+    if (depth > MAX_POLICY_DEPTH) {
+        return -20;
+    }
+
+    // miniscript fragments are only allowed inside wsh() and in taproot trees, and nothing else is
+    // allowed there; multi() and sortedmulti() are not valid in tapscript
+    if ((context_flags & CONTEXT_MINISCRIPT) != 0) {
+        if (!is_miniscript_token(token)) {
+            return -21;
+        }
+        if ((context_flags & CONTEXT_WITHIN_TR) != 0 &&
+            (token == TOKEN_MULTI || token == TOKEN_SORTEDMULTI)) {
+            return -21;
+        }
+    } else if (token >= TOKEN_0) {
+        return -21;
+    }
+
+    if (token == TOKEN_SH && depth != 0) {
+        return -2;  // can only be top-level
+    }
+    if (token == TOKEN_WSH && depth != 0 && (context_flags & CONTEXT_WITHIN_SH) == 0) {
+        return -3;  // only top-level or inside sh
+    }
+    if (token == TOKEN_TR && depth != 0) {
+        return -37;  // can only be top-level
+    }
+    return 0;
+}
+
+/**
+ * Parses a TREE expression of a tr() policy, that is either a SCRIPT, or a pair of TREE expressions
+ * in the form {TREE,TREE}. tree_depth is the depth in the tree of scripts.
+ */
+static int parse_tree(buffer_t *in_buf, buffer_t *out_buf, size_t depth, size_t tree_depth) {
+    if (tree_depth > MAX_TAPTREE_POLICY_DEPTH || depth > MAX_POLICY_DEPTH) {
+        return -1;
+    }
+
+    policy_node_tree_t *node =
+        (policy_node_tree_t *) buffer_alloc(out_buf, sizeof(policy_node_tree_t), true);
+    if (node == NULL) {
+        return -2;
+    }
+
+    if (!buffer_can_read(in_buf, 1) || in_buf->ptr[in_buf->offset] != '{') {
+        // the leaf script is recursively parsed in the current location of the output buffer
+        node->is_leaf = true;
+        node->script = (policy_node_t *) (out_buf->ptr + out_buf->offset);
+
+        int res2;
+        if ((res2 = parse_script(in_buf, out_buf, depth, CONTEXT_WITHIN_TR)) < 0) {
+            return res2 * 100 - 3;
+        }
+        return 0;
+    }
+
+    buffer_seek_cur(in_buf, 1);  // skip the '{' character
+
+    node->is_leaf = false;
+    for (unsigned int i = 0; i < 2; i++) {
+        char c;
+        if (i > 0 && (!buffer_read_u8(in_buf, (uint8_t *) &c) || c != ',')) {
+            return -4;
+        }
+
+        node->subtrees[i] = (policy_node_tree_t *) (out_buf->ptr + out_buf->offset);
+
+        int res2;
+        // the error of the subtree is returned as is, so that the error code can't overflow
+        if ((res2 = parse_tree(in_buf, out_buf, depth + 1, tree_depth + 1)) < 0) {
+            return res2;
+        }
+    }
+
+    char c;
+    if (!buffer_read_u8(in_buf, (uint8_t *) &c) || c != '}') {
+        return -6;
+    }
+    return 0;
+}
 
 /**
  * Parses a SCRIPT expression from the in_buf buffer, allocating the nodes and variables in out_buf.
@@ -342,29 +591,63 @@ static int parse_script(buffer_t *in_buf,
                         buffer_t *out_buf,
                         size_t depth,
                         unsigned long context_flags) {
-    // We read the token, we'll do different parsing based on what token we find
-    int token = parse_token(in_buf);
+    char word[MAX_TOKEN_LENGTH + 1];
+    size_t word_len = read_word(in_buf, word, MAX_TOKEN_LENGTH);
+    word[word_len] = '\0';
+
     char c;
 
-    // Opening '('
-    if (!buffer_read_u8(in_buf, (uint8_t *) &c) && c != '(') {
+    // A word followed by ':' is a sequence of miniscript wrappers, applied to the following
+    // fragment; each wrapper is the parent of the node allocated right after it.
+    if (buffer_can_read(in_buf, 1) && in_buf->ptr[in_buf->offset] == ':') {
+        buffer_seek_cur(in_buf, 1);
+
+        if ((context_flags & CONTEXT_MINISCRIPT) == 0 || word_len == 0) {
+            return -17;
+        }
+
+        for (unsigned int i = 0; i < word_len; i++) {
+            char wrapper_name[2] = {word[i], '\0'};
+            int wrapper = get_token_type(KNOWN_WRAPPERS,
+                                         sizeof(KNOWN_WRAPPERS) / sizeof(KNOWN_WRAPPERS[0]),
+                                         wrapper_name);
+            if (wrapper == -1) {
+                return -18;
+            }
+
+            policy_node_with_script_t *node =
+                (policy_node_with_script_t *) buffer_alloc(out_buf,
+                                                           sizeof(policy_node_with_script_t),
+                                                           true);
+            if (node == NULL) {
+                return -19;
+            }
+            node->type = wrapper;
+            node->script = (policy_node_t *) (out_buf->ptr + out_buf->offset);
+        }
+        depth += word_len;
+
+        word_len = read_word(in_buf, word, MAX_TOKEN_LENGTH);
+        word[word_len] = '\0';
+    }
+
+    // We read the token, we'll do different parsing based on what token we find
+    int token = get_token_type(KNOWN_TOKENS, sizeof(KNOWN_TOKENS) / sizeof(KNOWN_TOKENS[0]), word);
+
+    int res = check_token_context(token, depth, context_flags);
+    if (res < 0) {
+        return res;
+    }
+
+    // Opening '(', except for the 0 and 1 fragments that have no arguments
+    bool has_arguments = (token != TOKEN_0 && token != TOKEN_1);
+    if (has_arguments && (!buffer_read_u8(in_buf, (uint8_t *) &c) || c != '(')) {
         return -1;
     }
 
     switch (token) {
         case TOKEN_SH:
         case TOKEN_WSH: {
-            if (token == TOKEN_SH) {
-                if (depth != 0) {
-                    return -2;  // can only be top-level
-                }
-
-            } else if (token == TOKEN_WSH) {
-                if (depth != 0 && (context_flags & CONTEXT_WITHIN_SH) == 0) {
-                    return -3;  // only top-level or inside sh
-                }
-            }
-
             policy_node_with_script_t *node =
                 (policy_node_with_script_t *) buffer_alloc(out_buf,
                                                            sizeof(policy_node_with_script_t),
@@ -378,6 +661,8 @@ static int parse_script(buffer_t *in_buf,
 
             if (token == TOKEN_SH) {
                 inner_context_flags |= CONTEXT_WITHIN_SH;
+            } else {
+                inner_context_flags |= CONTEXT_WITHIN_WSH;
             }
 
             // the internal script is recursively parsed (if successful) in the current location of
@@ -392,10 +677,39 @@ static int parse_script(buffer_t *in_buf,
 
             break;
         }
+        case TOKEN_TR: {  // not currently supporting x-only keys
+            policy_node_tr_t *node =
+                (policy_node_tr_t *) buffer_alloc(out_buf, sizeof(policy_node_tr_t), true);
+            if (node == NULL) {
+                return -38;
+            }
+            node->type = token;
+
+            int key_index = parse_key_index(in_buf);
+            if (key_index == -1) {
+                return -39;
+            }
+            node->key_index = (size_t) key_index;
+
+            // optional tree of scripts, after a comma
+            node->tree = NULL;
+            if (buffer_can_read(in_buf, 1) && in_buf->ptr[in_buf->offset] == ',') {
+                buffer_seek_cur(in_buf, 1);
+
+                node->tree = (policy_node_tree_t *) (out_buf->ptr + out_buf->offset);
+
+                int res2;
+                if ((res2 = parse_tree(in_buf, out_buf, depth + 1, 0)) < 0) {
+                    return res2 * 100 - 40;
+                }
+            }
+            break;
+        }
         case TOKEN_PKH:
         case TOKEN_WPKH:
-        case TOKEN_TR:  // not currently supporting x-only keys
-        {
+        case TOKEN_PK:
+        case TOKEN_PK_K:
+        case TOKEN_PK_H: {
             policy_node_with_key_t *node =
                 (policy_node_with_key_t *) buffer_alloc(out_buf,
                                                         sizeof(policy_node_with_key_t),
@@ -468,12 +782,163 @@ static int parse_script(buffer_t *in_buf,
 
             break;
         }
+        case TOKEN_0:
+        case TOKEN_1: {
+            policy_node_t *node =
+                (policy_node_t *) buffer_alloc(out_buf, sizeof(policy_node_t), true);
+            if (node == NULL) {
+                return -22;
+            }
+            node->type = token;
+            break;
+        }
+        case TOKEN_OLDER:
+        case TOKEN_AFTER: {
+            policy_node_with_uint32_t *node =
+                (policy_node_with_uint32_t *) buffer_alloc(out_buf,
+                                                           sizeof(policy_node_with_uint32_t),
+                                                           true);
+            if (node == NULL) {
+                return -23;
+            }
+            node->type = token;
+
+            if (parse_unsigned_decimal(in_buf, &node->n) == -1 || node->n < 1 ||
+                node->n > 0x7FFFFFFF) {
+                return -24;
+            }
+            break;
+        }
+        case TOKEN_SHA256:
+        case TOKEN_HASH256: {
+            policy_node_with_hash_256_t *node =
+                (policy_node_with_hash_256_t *) buffer_alloc(out_buf,
+                                                             sizeof(policy_node_with_hash_256_t),
+                                                             true);
+            if (node == NULL) {
+                return -25;
+            }
+            node->type = token;
+
+            if (parse_hash(in_buf, node->h, 32) == -1) {
+                return -26;
+            }
+            break;
+        }
+        case TOKEN_RIPEMD160:
+        case TOKEN_HASH160: {
+            policy_node_with_hash_160_t *node =
+                (policy_node_with_hash_160_t *) buffer_alloc(out_buf,
+                                                             sizeof(policy_node_with_hash_160_t),
+                                                             true);
+            if (node == NULL) {
+                return -27;
+            }
+            node->type = token;
+
+            if (parse_hash(in_buf, node->h, 20) == -1) {
+                return -28;
+            }
+            break;
+        }
+        case TOKEN_ANDOR:
+        case TOKEN_AND_V:
+        case TOKEN_AND_B:
+        case TOKEN_AND_N:
+        case TOKEN_OR_B:
+        case TOKEN_OR_C:
+        case TOKEN_OR_D:
+        case TOKEN_OR_I: {
+            unsigned int n_children;
+            policy_node_t **scripts;
+            if (token == TOKEN_ANDOR) {
+                policy_node_with_script3_t *node =
+                    (policy_node_with_script3_t *) buffer_alloc(out_buf,
+                                                                sizeof(policy_node_with_script3_t),
+                                                                true);
+                if (node == NULL) {
+                    return -29;
+                }
+                node->type = token;
+                n_children = 3;
+                scripts = node->scripts;
+            } else {
+                policy_node_with_script2_t *node =
+                    (policy_node_with_script2_t *) buffer_alloc(out_buf,
+                                                                sizeof(policy_node_with_script2_t),
+                                                                true);
+                if (node == NULL) {
+                    return -29;
+                }
+                node->type = token;
+                n_children = 2;
+                scripts = node->scripts;
+            }
+
+            for (unsigned int i = 0; i < n_children; i++) {
+                if (i > 0 && (!buffer_read_u8(in_buf, (uint8_t *) &c) || c != ',')) {
+                    return -30;
+                }
+
+                // each child is recursively parsed in the current location of the output buffer
+                scripts[i] = (policy_node_t *) (out_buf->ptr + out_buf->offset);
+
+                int res2;
+                if ((res2 = parse_script(in_buf, out_buf, depth + 1, context_flags)) < 0) {
+                    return res2 * 100 - 31;
+                }
+            }
+            break;
+        }
+        case TOKEN_THRESH: {
+            policy_node_thresh_t *node =
+                (policy_node_thresh_t *) buffer_alloc(out_buf, sizeof(policy_node_thresh_t), true);
+            if (node == NULL) {
+                return -32;
+            }
+            node->type = token;
+
+            if (parse_unsigned_decimal(in_buf, &node->k) == -1) {
+                return -33;
+            }
+
+            node->n = 0;
+            policy_node_scripts_list_t **next = &node->scripts;
+            while (buffer_can_read(in_buf, 1) && in_buf->ptr[in_buf->offset] == ',') {
+                buffer_seek_cur(in_buf, 1);
+
+                policy_node_scripts_list_t *item =
+                    (policy_node_scripts_list_t *) buffer_alloc(out_buf,
+                                                                sizeof(policy_node_scripts_list_t),
+                                                                true);
+                if (item == NULL) {
+                    return -34;
+                }
+                item->next = NULL;
+                item->script = (policy_node_t *) (out_buf->ptr + out_buf->offset);
+
+                int res2;
+                if ((res2 = parse_script(in_buf, out_buf, depth + 1, context_flags)) < 0) {
+                    return res2 * 100 - 35;
+                }
+
+                *next = item;
+                next = &item->next;
+                ++node->n;
+            }
+            *next = NULL;
+
+            if (!(1 <= node->k && node->k <= node->n)) {
+                return -36;
+            }
+            break;
+        }
         default:
             PRINTF("Unknown token\n");
             return -14;
     }
 
-    if (!buffer_read_u8(in_buf, (uint8_t *) &c) && c != ')') {
+    if (has_arguments && (!buffer_read_u8(in_buf, (uint8_t *) &c) || c != ')')) {
         return -15;
     }
 
@@ -496,6 +961,478 @@ int parse_policy_map(buffer_t *in_buf, void *out, size_t out_len) {
     return parse_script(in_buf, &out_buf, 0, 0);
 }
 
+static int decode_script(buffer_t *in_buf,
+                         buffer_t *out_buf,
+                         size_t depth,
+                         unsigned long context_flags);
+
+/**
+ * Decodes the binary encoding of a TREE of a tr() policy: either 0x00 followed by a SCRIPT, or 0x01
+ * followed by two TREEs. The nodes are allocated in the same order as parse_tree.
+ */
+static int decode_tree(buffer_t *in_buf, buffer_t *out_buf, size_t depth, size_t tree_depth) {
+    if (tree_depth > MAX_TAPTREE_POLICY_DEPTH || depth > MAX_POLICY_DEPTH) {
+        return -1;
+    }
+
+    policy_node_tree_t *node =
+        (policy_node_tree_t *) buffer_alloc(out_buf, sizeof(policy_node_tree_t), true);
+    uint8_t is_branch;
+    if (node == NULL || !buffer_read_u8(in_buf, &is_branch) || is_branch > 1) {
+        return -2;
+    }
+
+    if (!is_branch) {
+        node->is_leaf = true;
+        node->script = (policy_node_t *) (out_buf->ptr + out_buf->offset);
+        return decode_script(in_buf, out_buf, depth, CONTEXT_WITHIN_TR);
+    }
+
+    node->is_leaf = false;
+    for (unsigned int i = 0; i < 2; i++) {
+        node->subtrees[i] = (policy_node_tree_t *) (out_buf->ptr + out_buf->offset);
+
+        int res = decode_tree(in_buf, out_buf, depth + 1, tree_depth + 1);
+        if (res < 0) {
+            return res;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Decodes the binary encoding of a SCRIPT, in a single pass; see decode_policy_map for the format.
+ * The nodes are allocated in the same order as parse_script, and the same checks are performed,
+ * so that both produce the same output for equivalent policies.
+ * Returns 0 on success, a negative number on failure.
+ */
+static int decode_script(buffer_t *in_buf,
+                         buffer_t *out_buf,
+                         size_t depth,
+                         unsigned long context_flags) {
+    uint8_t token;
+    if (!buffer_read_u8(in_buf, &token)) {
+        return -1;
+    }
+
+    // each miniscript wrapper is the parent of the node allocated right after it
+    while (token >= TOKEN_A && token <= TOKEN_U) {
+        if ((context_flags & CONTEXT_MINISCRIPT) == 0) {
+            return -2;
+        }
+
+        policy_node_with_script_t *node =
+            (policy_node_with_script_t *) buffer_alloc(out_buf,
+                                                       sizeof(policy_node_with_script_t),
+                                                       true);
+        if (node == NULL) {
+            return -3;
+        }
+        node->type = token;
+        node->script = (policy_node_t *) (out_buf->ptr + out_buf->offset);
+        ++depth;
+
+        if (!buffer_read_u8(in_buf, &token)) {
+            return -1;
+        }
+    }
+
+    if (token > TOKEN_THRESH) {
+        return -4;
+    }
+
+    int res = check_token_context(token, depth, context_flags);
+    if (res < 0) {
+        return res * 100 - 5;
+    }
+
+    switch (token) {
+        case TOKEN_SH:
+        case TOKEN_WSH: {
+            policy_node_with_script_t *node =
+                (policy_node_with_script_t *) buffer_alloc(out_buf,
+                                                           sizeof(policy_node_with_script_t),
+                                                           true);
+            if (node == NULL) {
+                return -6;
+            }
+            node->type = token;
+            node->script = (policy_node_t *) (out_buf->ptr + out_buf->offset);
+
+            unsigned int inner_context_flags =
+                context_flags | (token == TOKEN_SH ? CONTEXT_WITHIN_SH : CONTEXT_WITHIN_WSH);
+            if ((res = decode_script(in_buf, out_buf, depth + 1, inner_context_flags)) < 0) {
+                return res;
+            }
+            break;
+        }
+        case TOKEN_TR: {
+            policy_node_tr_t *node =
+                (policy_node_tr_t *) buffer_alloc(out_buf, sizeof(policy_node_tr_t), true);
+            uint8_t key_index, has_tree;
+            if (node == NULL || !buffer_read_u8(in_buf, &key_index) ||
+                !buffer_read_u8(in_buf, &has_tree) || has_tree > 1) {
+                return -7;
+            }
+            node->type = token;
+            node->key_index = key_index;
+
+            node->tree = NULL;
+            if (has_tree) {
+                node->tree = (policy_node_tree_t *) (out_buf->ptr + out_buf->offset);
+                if ((res = decode_tree(in_buf, out_buf, depth + 1, 0)) < 0) {
+                    return res * 100 - 8;
+                }
+            }
+            break;
+        }
+        case TOKEN_PKH:
+        case TOKEN_WPKH:
+        case TOKEN_PK:
+        case TOKEN_PK_K:
+        case TOKEN_PK_H: {
+            policy_node_with_key_t *node =
+                (policy_node_with_key_t *) buffer_alloc(out_buf,
+                                                        sizeof(policy_node_with_key_t),
+                                                        true);
+            uint8_t key_index;
+            if (node == NULL || !buffer_read_u8(in_buf, &key_index)) {
+                return -9;
+            }
+            node->type = token;
+            node->key_index = key_index;
+            break;
+        }
+        case TOKEN_MULTI:
+        case TOKEN_SORTEDMULTI: {
+            policy_node_multisig_t *node =
+                (policy_node_multisig_t *) buffer_alloc(out_buf,
+                                                        sizeof(policy_node_multisig_t),
+                                                        true);
+            uint8_t k, n;
+            if (node == NULL || !buffer_read_u8(in_buf, &k) || !buffer_read_u8(in_buf, &n)) {
+                return -10;
+            }
+            if (!(1 <= k && k <= n && n <= MAX_POLICY_MAP_COSIGNERS)) {
+                return -11;
+            }
+            node->type = token;
+            node->k = k;
+            node->n = n;
+
+            node->key_indexes = (size_t *) (out_buf->ptr + out_buf->offset);
+            for (unsigned int i = 0; i < n; i++) {
+                size_t *key_index_out = (size_t *) buffer_alloc(out_buf, sizeof(size_t), true);
+                uint8_t key_index;
+                if (key_index_out == NULL || !buffer_read_u8(in_buf, &key_index)) {
+                    return -12;
+                }
+                *key_index_out = key_index;
+            }
+            break;
+        }
+        case TOKEN_0:
+        case TOKEN_1: {
+            policy_node_t *node =
+                (policy_node_t *) buffer_alloc(out_buf, sizeof(policy_node_t), true);
+            if (node == NULL) {
+                return -13;
+            }
+            node->type = token;
+            break;
+        }
+        case TOKEN_OLDER:
+        case TOKEN_AFTER: {
+            policy_node_with_uint32_t *node =
+                (policy_node_with_uint32_t *) buffer_alloc(out_buf,
+                                                           sizeof(policy_node_with_uint32_t),
+                                                           true);
+            uint32_t n;
+            if (node == NULL || !buffer_read_u32(in_buf, &n, LE) || n < 1 || n > 0x7FFFFFFF) {
+                return -14;
+            }
+            node->type = token;
+            node->n = n;
+            break;
+        }
+        case TOKEN_SHA256:
+        case TOKEN_HASH256:
+        case TOKEN_RIPEMD160:
+        case TOKEN_HASH160: {
+            // the two structures only differ by the length of the hash
+            bool is_256 = (token == TOKEN_SHA256 || token == TOKEN_HASH256);
+            size_t node_size =
+                is_256 ? sizeof(policy_node_with_hash_256_t) : sizeof(policy_node_with_hash_160_t);
+            policy_node_with_hash_256_t *node =
+                (policy_node_with_hash_256_t *) buffer_alloc(out_buf, node_size, true);
+            if (node == NULL || !buffer_read_bytes(in_buf, node->h, is_256 ? 32 : 20)) {
+                return -15;
+            }
+            node->type = token;
+            break;
+        }
+        case TOKEN_ANDOR:
+        case TOKEN_AND_V:
+        case TOKEN_AND_B:
+        case TOKEN_AND_N:
+        case TOKEN_OR_B:
+        case TOKEN_OR_C:
+        case TOKEN_OR_D:
+        case TOKEN_OR_I: {
+            // policy_node_with_script2_t is a prefix of policy_node_with_script3_t
+            unsigned int n_children = (token == TOKEN_ANDOR) ? 3 : 2;
+            size_t node_size = (token == TOKEN_ANDOR) ? sizeof(policy_node_with_script3_t)
+                                                      : sizeof(policy_node_with_script2_t);
+            policy_node_with_script3_t *node =
+                (policy_node_with_script3_t *) buffer_alloc(out_buf, node_size, true);
+            if (node == NULL) {
+                return -16;
+            }
+            node->type = token;
+
+            for (unsigned int i = 0; i < n_children; i++) {
+                node->scripts[i] = (policy_node_t *) (out_buf->ptr + out_buf->offset);
+                if ((res = decode_script(in_buf, out_buf, depth + 1, context_flags)) < 0) {
+                    return res;
+                }
+            }
+            break;
+        }
+        case TOKEN_THRESH: {
+            policy_node_thresh_t *node =
+                (policy_node_thresh_t *) buffer_alloc(out_buf, sizeof(policy_node_thresh_t), true);
+            uint8_t k, n;
+            if (node == NULL || !buffer_read_u8(in_buf, &k) || !buffer_read_u8(in_buf, &n)) {
+                return -17;
+            }
+            if (!(1 <= k && k <= n)) {
+                return -18;
+            }
+            node->type = token;
+            node->k = k;
+            node->n = n;
+
+            policy_node_scripts_list_t **next = &node->scripts;
+            for (unsigned int i = 0; i < n; i++) {
+                policy_node_scripts_list_t *item =
+                    (policy_node_scripts_list_t *) buffer_alloc(out_buf,
+                                                                sizeof(policy_node_scripts_list_t),
+                                                                true);
+                if (item == NULL) {
+                    return -19;
+                }
+                item->next = NULL;
+                item->script = (policy_node_t *) (out_buf->ptr + out_buf->offset);
+
+                if ((res = decode_script(in_buf, out_buf, depth + 1, context_flags)) < 0) {
+                    return res;
+                }
+
+                *next = item;
+                next = &item->next;
+            }
+            *next = NULL;
+            break;
+        }
+        default:
+            return -20;
+    }
+
+    if (depth == 0 && buffer_can_read(in_buf, 1)) {
+        return -21;
+    }
+    return 0;
+}
+
+int decode_policy_map(buffer_t *in_buf, void *out, size_t out_len) {
+    if ((unsigned long) out % 4 != 0) {
+        PRINTF("Unaligned pointer\n");
+        return -1;
+    }
+
+    buffer_t out_buf = buffer_create(out, out_len);
+
+    return decode_script(in_buf, &out_buf, 0, 0);
+}
+
+/**
+ * Returns the name of the token of the given type in the table, or NULL if not found.
+ */
+static const char *get_token_name(const token_descriptor_t *tokens, size_t n_tokens, int type) {
+    for (unsigned int i = 0; i < n_tokens; i++) {
+        if ((int) PIC(tokens[i].type) == type) {
+            return (const char *) PIC(tokens[i].name);
+        }
+    }
+    return NULL;
+}
+
+static bool format_write_str(buffer_t *out, const char *str) {
+    return buffer_write_bytes(out, (const uint8_t *) str, strlen(str));
+}
+
+static bool format_write_u32(buffer_t *out, uint32_t n) {
+    char digits[10];
+    int n_digits = 0;
+    do {
+        digits[n_digits++] = '0' + (n % 10);
+        n /= 10;
+    } while (n > 0);
+
+    while (n_digits > 0) {
+        if (!buffer_write_u8(out, (uint8_t) digits[--n_digits])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool format_write_key(buffer_t *out, size_t key_index) {
+    return buffer_write_u8(out, '@') && format_write_u32(out, (uint32_t) key_index);
+}
+
+static bool format_script(const policy_node_t *node, buffer_t *out);
+
+static bool format_tree(const policy_node_tree_t *tree, buffer_t *out) {
+    if (tree->is_leaf) {
+        return format_script(tree->script, out);
+    }
+    return buffer_write_u8(out, '{') && format_tree(tree->subtrees[0], out) &&
+           buffer_write_u8(out, ',') && format_tree(tree->subtrees[1], out) &&
+           buffer_write_u8(out, '}');
+}
+
+/**
+ * Writes the textual encoding of the SCRIPT rooted at node to out; the recursion is bounded by the
+ * depth of the policy, that is checked by its parser. Returns false if out is too short.
+ */
+static bool format_script(const policy_node_t *node, buffer_t *out) {
+    // a sequence of wrappers is written as a single word, followed by ':'
+    if (node->type >= TOKEN_A) {
+        const char *wrapper = get_token_name(KNOWN_WRAPPERS,
+                                             sizeof(KNOWN_WRAPPERS) / sizeof(KNOWN_WRAPPERS[0]),
+                                             node->type);
+        const policy_node_t *script = ((const policy_node_with_script_t *) node)->script;
+        return wrapper != NULL && format_write_str(out, wrapper) &&
+               (script->type >= TOKEN_A || buffer_write_u8(out, ':')) && format_script(script, out);
+    }
+
+    const char *name =
+        get_token_name(KNOWN_TOKENS, sizeof(KNOWN_TOKENS) / sizeof(KNOWN_TOKENS[0]), node->type);
+    if (name == NULL || !format_write_str(out, name)) {
+        return false;
+    }
+    if (node->type == TOKEN_0 || node->type == TOKEN_1) {
+        return true;  // no arguments
+    }
+
+    if (!buffer_write_u8(out, '(')) {
+        return false;
+    }
+
+    bool ok = true;
+    switch (node->type) {
+        case TOKEN_SH:
+        case TOKEN_WSH:
+            ok = format_script(((const policy_node_with_script_t *) node)->script, out);
+            break;
+        case TOKEN_TR: {
+            const policy_node_tr_t *tr = (const policy_node_tr_t *) node;
+            ok = format_write_key(out, tr->key_index) &&
+                 (tr->tree == NULL || (buffer_write_u8(out, ',') && format_tree(tr->tree, out)));
+            break;
+        }
+        case TOKEN_PKH:
+        case TOKEN_WPKH:
+        case TOKEN_PK:
+        case TOKEN_PK_K:
+        case TOKEN_PK_H:
+            ok = format_write_key(out, ((const policy_node_with_key_t *) node)->key_index);
+            break;
+        case TOKEN_MULTI:
+        case TOKEN_SORTEDMULTI: {
+            const policy_node_multisig_t *multi = (const policy_node_multisig_t *) node;
+            ok = format_write_u32(out, (uint32_t) multi->k);
+            for (unsigned int i = 0; ok && i < multi->n; i++) {
+                ok = buffer_write_u8(out, ',') && format_write_key(out, multi->key_indexes[i]);
+            }
+            break;
+        }
+        case TOKEN_OLDER:
+        case TOKEN_AFTER:
+            ok = format_write_u32(out, (uint32_t) ((const policy_node_with_uint32_t *) node)->n);
+            break;
+        case TOKEN_SHA256:
+        case TOKEN_HASH256:
+        case TOKEN_RIPEMD160:
+        case TOKEN_HASH160: {
+            const uint8_t *h = ((const policy_node_with_hash_256_t *) node)->h;
+            size_t hash_len = (node->type == TOKEN_SHA256 || node->type == TOKEN_HASH256) ? 32 : 20;
+            static const char hex_digits[] = "0123456789abcdef";
+            for (unsigned int i = 0; ok && i < hash_len; i++) {
+                ok = buffer_write_u8(out, (uint8_t) hex_digits[h[i] >> 4]) &&
+                     buffer_write_u8(out, (uint8_t) hex_digits[h[i] & 0x0F]);
+            }
+            break;
+        }
+        case TOKEN_ANDOR:
+        case TOKEN_AND_V:
+        case TOKEN_AND_B:
+        case TOKEN_AND_N:
+        case TOKEN_OR_B:
+        case TOKEN_OR_C:
+        case TOKEN_OR_D:
+        case TOKEN_OR_I: {
+            const policy_node_with_script3_t *parent = (const policy_node_with_script3_t *) node;
+            unsigned int n_children = (node->type == TOKEN_ANDOR) ? 3 : 2;
+            for (unsigned int i = 0; ok && i < n_children; i++) {
+                ok = (i == 0 || buffer_write_u8(out, ',')) &&
+                     format_script(parent->scripts[i], out);
+            }
+            break;
+        }
+        case TOKEN_THRESH: {
+            const policy_node_thresh_t *thresh = (const policy_node_thresh_t *) node;
+            ok = format_write_u32(out, (uint32_t) thresh->k);
+            for (const policy_node_scripts_list_t *item = thresh->scripts; ok && item != NULL;
+                 item = item->next) {
+                ok = buffer_write_u8(out, ',') && format_script(item->script, out);
+            }
+            break;
+        }
+        default:
+            return false;
+    }
+
+    return ok && buffer_write_u8(out, ')');
+}
+
+int format_policy_map(const policy_node_t *policy, char *out, size_t out_len) {
+    if (out_len == 0) {
+        return -1;
+    }
+
+    // the last byte is reserved for the terminating \0
+    buffer_t out_buf = buffer_create(out, out_len - 1);
+    if (!format_script(policy, &out_buf)) {
+        return -1;
+    }
+    out[out_buf.offset] = '\0';
+    return (int) out_buf.offset;
+}
+
+int parse_wallet_policy_map(const policy_map_wallet_header_t *wallet_header,
+                            void *out,
+                            size_t out_len) {
+    buffer_t policy_map_buffer =
+        buffer_create((void *) wallet_header->policy_map, wallet_header->policy_map_len);
+
+    if (wallet_header->type != WALLET_TYPE_POLICY_MAP) {
+        return decode_policy_map(&policy_map_buffer, out, out_len);
+    }
+    return parse_policy_map(&policy_map_buffer, out, out_len);
+}
+
 #ifndef SKIP_FOR_CMOCKA
 
 void get_policy_wallet_id(policy_map_wallet_header_t *wallet_header, uint8_t out[static 32]) {
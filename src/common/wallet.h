@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "common/bip32.h"
@@ -15,28 +16,59 @@
 #define WALLET_TYPE_POLICY_MAP 1
 
 /**
- * Maximum supported number of keys for a policy map.
+ * Like WALLET_TYPE_POLICY_MAP, but the policy map is in the compact binary encoding described in
+ * decode_policy_map, instead of the textual one.
+ */
+#define WALLET_TYPE_POLICY_MAP_BINARY 2
+
+/**
+ * Like WALLET_TYPE_POLICY_MAP_BINARY, but the key informations are also in the binary encoding
+ * described in parse_policy_map_key_info, so that no base58 decoding is needed to use the keys.
+ */
+#define WALLET_TYPE_POLICY_MAP_BINARY_KEYS 3
+
+/**
+ * Flags of the first byte of a key information in the binary encoding. As the byte is never a
+ * printable character, binary and textual key informations can not be confused.
  */
-#define MAX_POLICY_MAP_COSIGNERS 5
+#define KEY_INFO_BINARY_HAS_KEY_ORIGIN 0x01
+#define KEY_INFO_BINARY_HAS_WILDCARD   0x02
+#define KEY_INFO_BINARY_HAS_MULTIPATH  0x04
+
+/**
+ * Length of a BIP32 extended pubkey serialized in binary, without the base58 checksum.
+ */
+#define SERIALIZED_EXTENDED_PUBKEY_LEN 78
+
+/**
+ * Maximum supported number of keys in a multi() or sortedmulti() of a policy map.
+ */
+#define MAX_POLICY_MAP_COSIGNERS 15
 
 /**
  * Maximum supported number of keys for a policy map.
  */
-#define MAX_POLICY_MAP_KEYS 5
+#define MAX_POLICY_MAP_KEYS 15
 
 // The string describing a pubkey can contain:
 // - (optional) the key origin info, which we limit to 46 bytes (2 + 8 + 3*12 = 46 bytes)
 // - the xpub itself (up to 113 characters)
-// - optional, the "/**" suffix.
-// Therefore, the total length of the key info string is at most 162 bytes.
-#define MAX_POLICY_KEY_INFO_LEN (46 + MAX_SERIALIZED_PUBKEY_LENGTH + 3)
+// - optional, the "/**" suffix, or a multipath suffix up to "/<2147483647;2147483646>/*" (26
+//   bytes).
+// Therefore, the total length of the key info string is at most 185 bytes.
+#define MAX_POLICY_KEY_INFO_LEN (46 + MAX_SERIALIZED_PUBKEY_LENGTH + 26)
 
-// Enough to store "sh(wsh(sortedmulti(15,@0,@1,@2,@3,@4,@5,@6,@7,@8,@9,@10,@11,@12,@13,@14)))"
+// Enough to store "sh(wsh(sortedmulti(15,@0,@1,@2,@3,@4,@5,@6,@7,@8,@9,@10,@11,@12,@13,@14)))";
+// longer miniscript policies (for example, containing hashes) are supported on the other devices.
+#ifdef TARGET_NANOS
 #define MAX_POLICY_MAP_STR_LENGTH 74
+#else
+#define MAX_POLICY_MAP_STR_LENGTH 128
+#endif
 
 #define MAX_POLICY_MAP_NAME_LENGTH 16
 
-// at most 126 bytes
+// at most 126 bytes on Nano S
 // wallet type (1 byte)
 // name length (1 byte)
 // name (max MAX_POLICY_MAP_NAME_LENGTH bytes)
@@ -48,7 +80,23 @@
     (1 + MAX_POLICY_MAP_NAME_LENGTH + 1 + MAX_POLICY_MAP_STR_LENGTH + 32)
 
 // Maximum size of a parsed policy map in memory
+#ifdef TARGET_NANOS
 #define MAX_POLICY_MAP_BYTES 128
+#else
+#define MAX_POLICY_MAP_BYTES 256
+#endif
+
+/**
+ * Maximum depth of the nested fragments of a policy map, counting each miniscript wrapper as one
+ * level; it bounds both the recursion of the parser and the stack used to compile the policy.
+ */
+#define MAX_POLICY_DEPTH 10
+
+/**
+ * Maximum depth of the tree of scripts of a tr() policy; the computation of the taproot output key
+ * keeps up to MAX_TAPTREE_POLICY_DEPTH + 1 hashes in memory.
+ */
+#define MAX_TAPTREE_POLICY_DEPTH 4
 
 // Currently only multisig is supported
 #define MAX_POLICY_MAP_LEN MAX_MULTISIG_POLICY_MAP_LENGTH
@@ -58,20 +106,30 @@ typedef struct {
     uint8_t master_key_fingerprint[4];
     uint8_t master_key_derivation_len;
     uint8_t has_key_origin;
-    uint8_t has_wildcard;  // true iff the keys ends with the /** wildcard
-    char ext_pubkey[MAX_SERIALIZED_PUBKEY_LENGTH + 1];
+    uint8_t has_wildcard;  // true iff the keys ends with the /** or a /<M;N>/* wildcard
+    uint8_t is_binary;     // true iff the key information was in the binary encoding
+    // if has_wildcard, the child of the receive and of the change addresses at the change level;
+    // {0, 1} for the /** wildcard
+    uint32_t multipath[2];
+    union {
+        char ext_pubkey[MAX_SERIALIZED_PUBKEY_LENGTH + 1];            // if !is_binary
+        uint8_t serialized_ext_pubkey[SERIALIZED_EXTENDED_PUBKEY_LEN];  // if is_binary
+    };
 } policy_map_key_info_t;
 
 typedef struct {
-    uint8_t type;  // Currently the only supported value is WALLET_TYPE_POLICY_MAP
+    uint8_t type;  // one of the WALLET_TYPE_POLICY_MAP* constants
     uint8_t name_len;
     char name[MAX_WALLET_NAME_LENGTH + 1];
     uint16_t policy_map_len;
-    char policy_map[MAX_POLICY_MAP_STR_LENGTH];
+    char policy_map[MAX_POLICY_MAP_STR_LENGTH];  // textual or binary encoding, based on the type
     size_t n_keys;
     uint8_t keys_info_merkle_root[32];  // root of the Merkle tree of the keys information
 } policy_map_wallet_header_t;
 
+// The values are used as the tags of the nodes in the binary encoding of the policies; therefore,
+// new tokens must be added right before the miniscript wrappers, and the existing values must not
+// change.
 typedef enum {
     TOKEN_SH,
     TOKEN_WSH,
@@ -84,6 +142,41 @@ typedef enum {
     TOKEN_TR,
     // TOKEN_ADDR,     // unsupported
     // TOKEN_RAW,      // unsupported
+
+    // miniscript fragments, only supported inside wsh() and in the leaves of tr(); multi(),
+    // sortedmulti() (not in tr()) and pkh() are also valid fragments (the latter is c:pk_h())
+    TOKEN_0,
+    TOKEN_1,
+    TOKEN_PK,  // equivalent to c:pk_k()
+    TOKEN_PK_K,
+    TOKEN_PK_H,
+    TOKEN_OLDER,
+    TOKEN_AFTER,
+    TOKEN_SHA256,
+    TOKEN_HASH256,
+    TOKEN_RIPEMD160,
+    TOKEN_HASH160,
+    TOKEN_ANDOR,
+    TOKEN_AND_V,
+    TOKEN_AND_B,
+    TOKEN_AND_N,
+    TOKEN_OR_B,
+    TOKEN_OR_C,
+    TOKEN_OR_D,
+    TOKEN_OR_I,
+    TOKEN_THRESH,
+
+    // miniscript wrappers, written as a prefix like in "sln:older(144)"
+    TOKEN_A,
+    TOKEN_S,
+    TOKEN_C,
+    TOKEN_T,
+    TOKEN_D,
+    TOKEN_V,
+    TOKEN_J,
+    TOKEN_N,
+    TOKEN_L,
+    TOKEN_U,
 } PolicyNodeType;
 
 // TODO: the following structures are using size_t for all integers to avoid alignment problems;
@@ -97,15 +190,67 @@ typedef struct {
 } policy_node_t;
 
 typedef struct {
-    PolicyNodeType type;  // == TOKEN_SH, == TOKEN_WSH
+    PolicyNodeType type;  // == TOKEN_SH, == TOKEN_WSH, or any miniscript wrapper
     policy_node_t *script;
 } policy_node_with_script_t;
 
 typedef struct {
-    PolicyNodeType type;  // == TOKEN_PK, == TOKEN_PKH, == TOKEN_WPKH
+    PolicyNodeType type;  // == TOKEN_AND_V, == TOKEN_AND_B, == TOKEN_AND_N, == TOKEN_OR_*
+    policy_node_t *scripts[2];
+} policy_node_with_script2_t;
+
+typedef struct {
+    PolicyNodeType type;  // == TOKEN_ANDOR
+    policy_node_t *scripts[3];
+} policy_node_with_script3_t;
+
+typedef struct {
+    PolicyNodeType type;  // == TOKEN_PK, == TOKEN_PKH, == TOKEN_WPKH, == TOKEN_PK_K, == TOKEN_PK_H
     size_t key_index;     // index of the key
 } policy_node_with_key_t;
 
+typedef struct {
+    PolicyNodeType type;  // == TOKEN_OLDER, == TOKEN_AFTER
+    size_t n;             // the relative or absolute locktime, between 1 and 2^31 - 1
+} policy_node_with_uint32_t;
+
+typedef struct {
+    PolicyNodeType type;  // == TOKEN_SHA256, == TOKEN_HASH256
+    uint8_t h[32];
+} policy_node_with_hash_256_t;
+
+typedef struct {
+    PolicyNodeType type;  // == TOKEN_RIPEMD160, == TOKEN_HASH160
+    uint8_t h[20];
+} policy_node_with_hash_160_t;
+
+// linked list of the children of a thresh() fragment
+typedef struct policy_node_scripts_list_s {
+    policy_node_t *script;
+    struct policy_node_scripts_list_s *next;
+} policy_node_scripts_list_t;
+
+typedef struct {
+    PolicyNodeType type;                  // == TOKEN_THRESH
+    size_t k;                             // threshold
+    size_t n;                             // number of children
+    policy_node_scripts_list_t *scripts;  // list of exactly n children
+} policy_node_thresh_t;
+
+typedef struct policy_node_tree_s {
+    bool is_leaf;  // true for a script, false for a pair of subtrees
+    union {
+        policy_node_t *script;                   // the miniscript of a leaf
+        struct policy_node_tree_s *subtrees[2];  // the two subtrees of an inner node
+    };
+} policy_node_tree_t;
+
+typedef struct {
+    PolicyNodeType type;       // == TOKEN_TR
+    size_t key_index;          // index of the internal key; same layout as policy_node_with_key_t
+    policy_node_tree_t *tree;  // the tree of scripts, or NULL if there is none
+} policy_node_tr_t;
+
 typedef struct {
     PolicyNodeType type;  // == TOKEN_MULTI, == TOKEN_SORTEDMULTI
     size_t k;             // threshold
@@ -124,9 +269,24 @@ int read_policy_map_wallet(buffer_t *buffer, policy_map_wallet_header_t *header)
  * The string is compatible with the output descriptor format, except that the pubkey must _not_
  * have derivation steps (the key origin info, if present, does have derivation steps from the
  * master key fingerprint). The serialized base58check-encoded pubkey is _not_ validated.
+ * The pubkey can be followed by a wildcard: either the usual one, or a multipath wildcard with two
+ * different unhardened steps M and N (that is, <M;N> followed by the wildcard step), used for the
+ * change level of the receive and the change addresses respectively. The usual wildcard is the
+ * same as the multipath wildcard with the steps 0 and 1.
  *
  * For example:
  * "[d34db33f/44'/0'/0']xpub6ERApfZwUNrhLCkDtcHTcxd75RbzS1ed54G1LkBUHQVHQKqhMkhgbmJbZRkrgZw4koxb5JaHWkY4ALHY2grBGRjaDMzQLcgJvLJuZZvRcEL"
+ *
+ * The key information can also be in the binary encoding used by the wallets of type
+ * WALLET_TYPE_POLICY_MAP_BINARY_KEYS, recognized by its first byte:
+ * - 1 byte: the KEY_INFO_BINARY_* flags;
+ * - if KEY_INFO_BINARY_HAS_KEY_ORIGIN is set: the 4-byte master key fingerprint, the 1-byte
+ *   number of derivation steps (at most MAX_BIP32_PATH_STEPS), and each step as 4 bytes in
+ *   little-endian;
+ * - the 78-byte serialized extended pubkey, without checksum;
+ * - if KEY_INFO_BINARY_HAS_MULTIPATH is set (only together with KEY_INFO_BINARY_HAS_WILDCARD):
+ *   the two steps M and N of the multipath wildcard, as 4 bytes each in little-endian.
+ * The result has is_binary set, and the pubkey in serialized_ext_pubkey instead of ext_pubkey.
  */
 int parse_policy_map_key_info(buffer_t *buffer, policy_map_key_info_t *out);
 
@@ -135,6 +295,57 @@ int parse_policy_map_key_info(buffer_t *buffer, policy_map_key_info_t *out);
  */
 int parse_policy_map(buffer_t *in_buf, void *out, size_t out_len);
 
+/**
+ * Decodes the compact binary encoding of a policy map into the same tree of nodes produced by
+ * parse_policy_map for the equivalent textual policy, in a single pass and without tokenizing.
+ * Each node is encoded in pre-order as its PolicyNodeType value (1 byte), followed by:
+ * - sh, wsh and each miniscript wrapper: the child;
+ * - pkh, wpkh, pk, pk_k, pk_h: the key index (1 byte);
+ * - tr: the key index (1 byte), then 0x00 if there is no tree, or 0x01 followed by the tree; each
+ *   tree is either 0x00 followed by a leaf, or 0x01 followed by the two subtrees;
+ * - multi, sortedmulti: k and n (1 byte each), then n key indexes (1 byte each);
+ * - 0, 1: nothing;
+ * - older, after: the 32-bit value, little-endian;
+ * - sha256, hash256, ripemd160, hash160: the 32 or 20 bytes of the hash;
+ * - andor, and_*, or_*: the 3 or 2 children;
+ * - thresh: k and n (1 byte each), then the n children.
+ *
+ * @param[in] in_buf
+ *   Buffer with the binary encoding; it must be consumed entirely.
+ * @param[out] out
+ *   Pointer to a 4-byte aligned memory area where the nodes are allocated.
+ * @param[in] out_len
+ *   Size of the memory area.
+ *
+ * @return 0 on success, a negative number on failure.
+ */
+int decode_policy_map(buffer_t *in_buf, void *out, size_t out_len);
+
+/**
+ * Parses the policy map of a wallet header, with parse_policy_map or decode_policy_map based on
+ * the wallet type.
+ *
+ * @return 0 on success, a negative number on failure.
+ */
+int parse_wallet_policy_map(const policy_map_wallet_header_t *wallet_header,
+                            void *out,
+                            size_t out_len);
+
+/**
+ * Writes the textual encoding of a parsed policy map as a 0-terminated string, for example in order
+ * to show a policy received in the binary encoding.
+ *
+ * @param[in] policy
+ *   Pointer to the root node of the policy.
+ * @param[out] out
+ *   Pointer to the output string.
+ * @param[in] out_len
+ *   Size of the output buffer, including the terminating 0 byte.
+ *
+ * @return the length of the string on success, or -1 if the buffer is too short.
+ */
+int format_policy_map(const policy_node_t *policy, char *out, size_t out_len);
+
 #ifndef SKIP_FOR_CMOCKA
 
 /**
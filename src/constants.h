@@ -67,6 +67,14 @@
  */
 #define MAX_OUTPUT_SCRIPTPUBKEY_LEN 83  // max 83 for OP_RETURN; other scripts are shorter
 
+/**
+ * Maximum length of the redeemScript of a P2SH input, and of the witnessScript of a P2WSH input,
+ * that we can sign; they are the limits of the standardness rules. These scripts are streamed while
+ * verified and hashed, therefore the limits do not require any memory.
+ */
+#define MAX_P2SH_REDEEMSCRIPT_LEN   520
+#define MAX_P2WSH_WITNESSSCRIPT_LEN 3600
+
 /**
  * Maximum length of a wallet registered into the device (characters), excluding terminating NULL.
  */
@@ -78,6 +86,7 @@
 #define MAX_SERIALIZED_PUBKEY_LENGTH 113
 
 // SIGHASH flags
+#define SIGHASH_DEFAULT      0x00000000  // only valid for taproot inputs
 #define SIGHASH_ALL          0x00000001
 #define SIGHASH_NONE         0x00000002
 #define SIGHASH_SINGLE       0x00000003
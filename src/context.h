@@ -4,3 +4,34 @@
 
 // We reuse the same struct as the global app for backward compatibility
 typedef btchip_altcoin_config_t global_context_t;
+
+/**
+ * Accessors of the parameters of a coin configuration. The builds that can never be the library
+ * of another app define COIN_CONFIG_STATIC: their configuration is always the one filled by
+ * init_coin_config from the DEFINES of the Makefile, therefore the accessors are constants, with
+ * no memory access. In the other builds, the configuration can be the one of the altcoin that
+ * called the app, and the accessors read it.
+ */
+#ifdef COIN_CONFIG_STATIC
+
+#ifndef COIN_NATIVE_SEGWIT_PREFIX
+#error "COIN_CONFIG_STATIC requires COIN_NATIVE_SEGWIT_PREFIX"
+#endif
+
+#define COIN_CONFIG_BIP32_PUBKEY_VERSION(config)  ((void) (config), BIP32_PUBKEY_VERSION)
+#define COIN_CONFIG_BIP44_COIN_TYPE(config)       ((void) (config), BIP44_COIN_TYPE)
+#define COIN_CONFIG_BIP44_COIN_TYPE_2(config)     ((void) (config), BIP44_COIN_TYPE_2)
+#define COIN_CONFIG_P2PKH_VERSION(config)         ((void) (config), COIN_P2PKH_VERSION)
+#define COIN_CONFIG_P2SH_VERSION(config)          ((void) (config), COIN_P2SH_VERSION)
+#define COIN_CONFIG_NATIVE_SEGWIT_PREFIX(config)  ((void) (config), COIN_NATIVE_SEGWIT_PREFIX)
+
+#else
+
+#define COIN_CONFIG_BIP32_PUBKEY_VERSION(config)  ((config)->bip32_pubkey_version)
+#define COIN_CONFIG_BIP44_COIN_TYPE(config)       ((config)->bip44_coin_type)
+#define COIN_CONFIG_BIP44_COIN_TYPE_2(config)     ((config)->bip44_coin_type2)
+#define COIN_CONFIG_P2PKH_VERSION(config)         ((config)->p2pkh_version)
+#define COIN_CONFIG_P2SH_VERSION(config)          ((config)->p2sh_version)
+#define COIN_CONFIG_NATIVE_SEGWIT_PREFIX(config)  ((config)->native_segwit_prefix)
+
+#endif
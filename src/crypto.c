@@ -21,9 +21,11 @@
 
 #include "os.h"
 #include "cx.h"
+#ifndef SKIP_FOR_CMOCKA
 #include "cx_stubs.h"
 #include "cx_ecfp.h"
 #include "ox_ec.h"
+#endif
 
 #include "common/base58.h"
 #include "common/bip32.h"
@@ -33,10 +35,33 @@
 
 #include "crypto.h"
 
+#ifndef SKIP_FOR_CMOCKA
 #include "cx_ram.h"
 #include "lcx_ripemd160.h"
 #include "cx_ripemd160.h"
-#include "../../cxram_stash.h"
+#endif
+
+#include "cxram_stash.h"
+
+#ifdef HAVE_PERF_COUNTERS
+perf_counters_t G_perf_counters;
+cache_stats_t G_cache_stats[N_CACHES];
+
+void crypto_count_hash(const cx_hash_t *hash_context, size_t in_len, bool last) {
+    if (hash_context->algo != CX_SHA256) {
+        return;
+    }
+
+    // a compression is computed for each complete 64-byte block; the final hash pads the data with
+    // at least 9 bytes
+    size_t len = ((const cx_sha256_t *) hash_context)->blen + in_len;
+    uint32_t n_compressions = len / 64;
+    if (last) {
+        n_compressions += (len % 64 + 9 > 64) ? 2 : 1;
+    }
+    PERF_COUNT(sha256_compressions, n_compressions);
+}
+#endif
 
 /**
  * Generator for secp256k1, value 'g' defined in "Standards for Efficient Cryptography"
@@ -72,8 +97,47 @@ static const uint8_t secp256k1_sqr_exponent[] = {
     0x3f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
     0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xbf, 0xff, 0xff, 0x0c};
 
-/* BIP0341 tags for computing the tagged hashes when tweaking public keys */
-static const uint8_t BIP0341_taptweak_tag[] = {'T', 'a', 'p', 'T', 'w', 'e', 'a', 'k'};
+/* Midstates of the tagged hashes, as computed by crypto_tr_tagged_hash_init for each tag */
+const uint32_t BIP0341_taptweak_midstate[8] = {0xd129a2f3,
+                                               0x701c655d,
+                                               0x6583b6c3,
+                                               0xb9419727,
+                                               0x95f4e232,
+                                               0x94fd54f4,
+                                               0xa2ae8d85,
+                                               0x47ca590b};
+const uint32_t BIP0341_tapsighash_midstate[8] = {0xf504a425,
+                                                 0xd7f8783b,
+                                                 0x1363868a,
+                                                 0xe3e55658,
+                                                 0x6eee945d,
+                                                 0xbc7888dd,
+                                                 0x02a6e2c3,
+                                                 0x1873fe9f};
+const uint32_t BIP0341_tapleaf_midstate[8] = {0x9ce0e4e6,
+                                              0x7c116c39,
+                                              0x38b3caf2,
+                                              0xc30f5089,
+                                              0xd3f3936c,
+                                              0x47636e60,
+                                              0x7db33eea,
+                                              0xddc6f0c9};
+const uint32_t BIP0341_tapbranch_midstate[8] = {0x23a865a9,
+                                                0xb8a40da7,
+                                                0x977c1e04,
+                                                0xc49e246f,
+                                                0xb5be1376,
+                                                0x9d24c9b7,
+                                                0xb583b5d4,
+                                                0xa8d226d2};
+const uint32_t BIP0322_signed_message_midstate[8] = {0x896e65a6,
+                                                     0x9e182133,
+                                                     0x9aa0d959,
+                                                     0xa7b9defc,
+                                                     0x733cba8c,
+                                                     0x972f0214,
+                                                     0x5e48b86f,
+                                                     0xf83bf99c};
 
 static int secp256k1_point(const uint8_t scalar[static 32], uint8_t out[static 65]);
 
@@ -83,6 +147,7 @@ static int secp256k1_point(const uint8_t scalar[static 32], uint8_t out[static 6
  */
 static int secp256k1_point(const uint8_t k[static 32], uint8_t out[static 65]) {
     memcpy(out, secp256k1_generator, 65);
+    PERF_COUNT(ecfp_scalar_mult, 1);
     return cx_ecfp_scalar_mult(CX_CURVE_SECP256K1, out, 65, k, 32);
 }
 
@@ -90,6 +155,12 @@ int crypto_derive_private_key(cx_ecfp_private_key_t *private_key,
                               uint8_t chain_code[static 32],
                               const uint32_t *bip32_path,
                               uint8_t bip32_path_len) {
+    PRINT_STACK_POINTER();
+
+    if (cxram_scratch_in_use()) {
+        return -1;  // the elliptic curve operations may overwrite the scratch area
+    }
+
     uint8_t raw_private_key[32] = {0};
 
     int ret = 0;
@@ -97,6 +168,7 @@ int crypto_derive_private_key(cx_ecfp_private_key_t *private_key,
         TRY {
             // derive the seed with bip32_path
 
+            PERF_COUNT(derive_node_bip32, 1);
             os_perso_derive_node_bip32(CX_CURVE_256K1,
                                        bip32_path,
                                        bip32_path_len,
@@ -121,17 +193,18 @@ int crypto_derive_private_key(cx_ecfp_private_key_t *private_key,
     return ret;
 }
 
-int bip32_CKDpub(const serialized_extended_pubkey_t *parent,
-                 uint32_t index,
-                 serialized_extended_pubkey_t *child) {
+int bip32_CKDpub_point(const uint8_t parent_pubkey[static 65],
+                       uint8_t chain_code[static 32],
+                       uint32_t index,
+                       uint8_t child_pubkey[static 65]) {
     PRINT_STACK_POINTER();
 
-    if (index >= BIP32_FIRST_HARDENED_CHILD) {
-        return -1;  // can only derive unhardened children
+    if (cxram_scratch_in_use()) {
+        return -1;  // the elliptic curve operations may overwrite the scratch area
     }
 
-    if (parent->depth == 255) {
-        return -2;  // maximum derivation depth reached
+    if (index >= BIP32_FIRST_HARDENED_CHILD) {
+        return -1;  // can only derive unhardened children
     }
 
     uint8_t I[64];
@@ -139,10 +212,11 @@ int bip32_CKDpub(const serialized_extended_pubkey_t *parent,
     {  // make sure that heavy memory allocations are freed as soon as possible
 
         uint8_t tmp[33 + 4];
-        memcpy(tmp, parent->compressed_pubkey, 33);
+        crypto_get_compressed_pubkey(parent_pubkey, tmp);
         write_u32_be(tmp, 33, index);
 
-        cx_hmac_sha512(parent->chain_code, 32, tmp, sizeof(tmp), I, 64);
+        PERF_COUNT(hmac_sha512, 1);
+        cx_hmac_sha512(chain_code, 32, tmp, sizeof(tmp), I, 64);
     }
 
     uint8_t *I_L = &I[0];
@@ -153,47 +227,208 @@ int bip32_CKDpub(const serialized_extended_pubkey_t *parent,
         return -1;
     }
 
-    uint8_t child_uncompressed_pubkey[65];
-
     {  // make sure that heavy memory allocations are freed as soon as possible
         // compute point(I_L)
         uint8_t P[65];
         secp256k1_point(I_L, P);
 
-        uint8_t K_par[65];
-        crypto_get_uncompressed_pubkey(parent->compressed_pubkey, K_par);
-
         // add K_par
-        if (cx_ecfp_add_point(CX_CURVE_SECP256K1,
-                              child_uncompressed_pubkey,
-                              P,
-                              K_par,
-                              sizeof(child_uncompressed_pubkey)) == 0) {
+        uint8_t child[65];
+        PERF_COUNT(ecfp_add_point, 1);
+        if (cx_ecfp_add_point(CX_CURVE_SECP256K1, child, P, parent_pubkey, sizeof(child)) == 0) {
             return -3;  // the point at infinity is not a valid child pubkey (should never happen in
                         // practice)
         }
+
+        memcpy(child_pubkey, child, 65);
     }
 
-    memmove(child->version, parent->version, 4);
-    child->depth = parent->depth + 1;
+    memcpy(chain_code, I_R, 32);
+
+    return 0;
+}
+
+int bip32_CKDpub_range(const uint8_t parent_pubkey[static 65],
+                       const uint8_t chain_code[static 32],
+                       uint32_t first_index,
+                       size_t n,
+                       uint8_t out[][33]) {
+    PRINT_STACK_POINTER();
+
+    if (cxram_scratch_in_use()) {
+        return -1;  // the elliptic curve operations may overwrite the scratch area
+    }
+
+    if (first_index >= BIP32_FIRST_HARDENED_CHILD ||
+        n > BIP32_FIRST_HARDENED_CHILD - first_index) {
+        return -1;  // can only derive unhardened children
+    }
+
+    // the data of the hmac is the compressed parent pubkey, followed by the index
+    uint8_t data[33 + 4];
+    crypto_get_compressed_pubkey(parent_pubkey, data);
+
+    // The key is set only once: after each computation with CX_LAST, cx_hmac reinitializes the
+    // context with the same key.
+    cx_hmac_sha512_t hmac_context;
+    cx_hmac_sha512_init(&hmac_context, chain_code, 32);
+
+    for (size_t i = 0; i < n; i++) {
+        uint8_t I[64];
+
+        write_u32_be(data, 33, first_index + (uint32_t) i);
+        PERF_COUNT(hmac_sha512, 1);
+        cx_hmac((cx_hmac_t *) &hmac_context, CX_LAST, data, sizeof(data), I, sizeof(I));
 
+        // fail if I_L is not smaller than the group order n, but the probability is < 1/2^128
+        if (cx_math_cmp(I, secp256k1_n, 32) >= 0) {
+            return -2;
+        }
+
+        // compute point(I_L) + K_par
+        uint8_t P[65];
+        secp256k1_point(I, P);
+
+        uint8_t child[65];
+        PERF_COUNT(ecfp_add_point, 1);
+        if (cx_ecfp_add_point(CX_CURVE_SECP256K1, child, P, parent_pubkey, sizeof(child)) == 0) {
+            return -3;  // the point at infinity is not a valid child pubkey (should never happen in
+                        // practice)
+        }
+
+        crypto_get_compressed_pubkey(child, out[i]);
+    }
+
+    return 0;
+}
+
+int bip32_CKDpub(const serialized_extended_pubkey_t *parent,
+                 uint32_t index,
+                 serialized_extended_pubkey_t *child) {
+    PRINT_STACK_POINTER();
+
+    if (parent->depth == 255) {
+        return -2;  // maximum derivation depth reached
+    }
+
+    uint8_t K[65];
+    crypto_get_uncompressed_pubkey(parent->compressed_pubkey, K);
+
+    uint8_t chain_code[32];
+    memcpy(chain_code, parent->chain_code, 32);
+
+    int ret = bip32_CKDpub_point(K, chain_code, index, K);
+    if (ret < 0) {
+        return ret;
+    }
+
+    // computed before overwriting the child, as it is allowed to equal the parent
     uint32_t parent_fingerprint = crypto_get_key_fingerprint(parent->compressed_pubkey);
 
+    memmove(child->version, parent->version, 4);
+    child->depth = parent->depth + 1;
+
     write_u32_be(child->parent_fingerprint, 0, parent_fingerprint);
     write_u32_be(child->child_number, 0, index);
 
-    memcpy(child->chain_code, I_R, 32);
+    memcpy(child->chain_code, chain_code, 32);
 
-    crypto_get_compressed_pubkey(child_uncompressed_pubkey, child->compressed_pubkey);
+    crypto_get_compressed_pubkey(K, child->compressed_pubkey);
 
     return 0;
 }
 
+// CKDpriv of BIP-32, for both hardened and unhardened children
+static int bip32_CKDpriv_any(uint8_t privkey[static 32],
+                             uint8_t chain_code[static 32],
+                             uint32_t index) {
+    PRINT_STACK_POINTER();
+
+    uint8_t I[64];
+
+    int ret = 0;
+    BEGIN_TRY {
+        TRY {
+            {  // make sure that heavy memory allocations are freed as soon as possible
+                uint8_t tmp[33 + 4];
+                if (index >= BIP32_FIRST_HARDENED_CHILD) {
+                    // hardened child: the data is 0x00 || privkey || index
+                    tmp[0] = 0x00;
+                    memcpy(tmp + 1, privkey, 32);
+                } else {
+                    uint8_t P[65];
+                    if (secp256k1_point(privkey, P) == 0) {
+                        CLOSE_TRY;
+                        ret = -2;  // invalid private key
+                        goto end;
+                    }
+                    crypto_get_compressed_pubkey(P, tmp);
+                }
+                write_u32_be(tmp, 33, index);
+
+                PERF_COUNT(hmac_sha512, 1);
+        cx_hmac_sha512(chain_code, 32, tmp, sizeof(tmp), I, 64);
+                explicit_bzero(tmp, sizeof(tmp));
+            }
+
+            uint8_t *I_L = &I[0];
+            uint8_t *I_R = &I[32];
+
+            // fail if I_L is not smaller than the group order n, but the probability is < 1/2^128
+            if (cx_math_cmp(I_L, secp256k1_n, 32) >= 0) {
+                CLOSE_TRY;
+                ret = -3;
+                goto end;
+            }
+
+            cx_math_addm(privkey, privkey, I_L, secp256k1_n, 32);
+
+            // the child private key 0 is invalid (should never happen in practice)
+            if (cx_math_is_zero(privkey, 32)) {
+                CLOSE_TRY;
+                ret = -4;
+                goto end;
+            }
+
+            memcpy(chain_code, I_R, 32);
+        }
+        CATCH_ALL {
+            ret = -5;
+        }
+        FINALLY {
+        end:
+            explicit_bzero(I, sizeof(I));
+        }
+    }
+    END_TRY;
+
+    return ret;
+}
+
+int bip32_CKDpriv(uint8_t privkey[static 32], uint8_t chain_code[static 32], uint32_t index) {
+    if (index >= BIP32_FIRST_HARDENED_CHILD) {
+        return -1;  // can only derive unhardened children
+    }
+    return bip32_CKDpriv_any(privkey, chain_code, index);
+}
+
+int bip32_CKDpriv_hardened(uint8_t privkey[static 32],
+                           uint8_t chain_code[static 32],
+                           uint32_t index) {
+    if (index < BIP32_FIRST_HARDENED_CHILD) {
+        return -1;  // can only derive hardened children
+    }
+    return bip32_CKDpriv_any(privkey, chain_code, index);
+}
+
 #ifndef _NR_cx_hash_ripemd160
 /** Missing in some SDKs, we implement it using the cxram section if needed. */
 static size_t cx_hash_ripemd160(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len) {
     PRINT_STACK_POINTER();
 
+    _Static_assert(sizeof(cx_ripemd160_t) <= CXRAM_SCRATCH_OFFSET,
+                   "The ripemd160 context overlaps the scratch area");
+
     if (out_len < CX_RIPEMD160_SIZE) {
         return 0;
     }
@@ -213,7 +448,49 @@ void crypto_hash160(const uint8_t *in, uint16_t inlen, uint8_t out[static 20]) {
     PRINT_STACK_POINTER();
 
     uint8_t buffer[32];
-    cx_hash_sha256(in, inlen, buffer, 32);
+    crypto_sha256(in, inlen, buffer);
+    crypto_ripemd160(buffer, 32, out);
+}
+
+void crypto_buffered_hash_update(crypto_buffered_hash_t *bh, const void *in, size_t in_len) {
+    const uint8_t *data = (const uint8_t *) in;
+
+    if (bh->buffer_len + in_len < CRYPTO_HASH_BUFFER_SIZE) {
+        memcpy(bh->buffer + bh->buffer_len, data, in_len);
+        bh->buffer_len += in_len;
+        return;
+    }
+
+    // complete the buffered block
+    size_t n = CRYPTO_HASH_BUFFER_SIZE - bh->buffer_len;
+    memcpy(bh->buffer + bh->buffer_len, data, n);
+    crypto_hash_update(bh->hash_context, bh->buffer, CRYPTO_HASH_BUFFER_SIZE);
+    data += n;
+    in_len -= n;
+
+    // whole blocks are hashed in place, and only the rest is buffered
+    size_t n_blocks_len = in_len - in_len % CRYPTO_HASH_BUFFER_SIZE;
+    if (n_blocks_len > 0) {
+        crypto_hash_update(bh->hash_context, data, n_blocks_len);
+    }
+    memcpy(bh->buffer, data + n_blocks_len, in_len - n_blocks_len);
+    bh->buffer_len = in_len - n_blocks_len;
+}
+
+void crypto_buffered_hash_flush(crypto_buffered_hash_t *bh) {
+    if (bh->buffer_len > 0) {
+        crypto_hash_update(bh->hash_context, bh->buffer, bh->buffer_len);
+        bh->buffer_len = 0;
+    }
+}
+
+void crypto_hash160_init(crypto_hash160_ctx_t *ctx) {
+    cx_sha256_init(&ctx->sha256_context);
+}
+
+void crypto_hash160_final(crypto_hash160_ctx_t *ctx, uint8_t out[static 20]) {
+    uint8_t buffer[32];
+    crypto_hash_digest(&ctx->sha256_context.header, buffer, 32);
     crypto_ripemd160(buffer, 32, out);
 }
 
@@ -229,6 +506,15 @@ int crypto_get_compressed_pubkey(const uint8_t uncompressed_key[static 65],
     return 0;
 }
 
+int crypto_get_compressed_pubkey_from_privkey(const uint8_t privkey[static 32],
+                                              uint8_t out[static 33]) {
+    uint8_t P[65];
+    if (secp256k1_point(privkey, P) == 0) {
+        return -1;  // invalid private key
+    }
+    return crypto_get_compressed_pubkey(P, out);
+}
+
 int crypto_get_uncompressed_pubkey(const uint8_t compressed_key[static 33],
                                    uint8_t out[static 65]) {
     PRINT_STACK_POINTER();
@@ -263,8 +549,8 @@ int crypto_get_uncompressed_pubkey(const uint8_t compressed_key[static 33],
 // TODO: missing unit tests
 void crypto_get_checksum(const uint8_t *in, uint16_t in_len, uint8_t out[static 4]) {
     uint8_t buffer[32];
-    cx_hash_sha256(in, in_len, buffer, 32);
-    cx_hash_sha256(buffer, 32, buffer, 32);
+    crypto_sha256(in, in_len, buffer);
+    crypto_sha256(buffer, 32, buffer);
     memmove(out, buffer, 4);
 }
 
@@ -272,6 +558,12 @@ bool crypto_get_compressed_pubkey_at_path(const uint32_t bip32_path[],
                                           uint8_t bip32_path_len,
                                           uint8_t pubkey[static 33],
                                           uint8_t chain_code[]) {
+    PRINT_STACK_POINTER();
+
+    if (cxram_scratch_in_use()) {
+        return false;  // the elliptic curve operations may overwrite the scratch area
+    }
+
     struct {
         uint8_t prefix;
         uint8_t raw_public_key[64];
@@ -293,6 +585,7 @@ bool crypto_get_compressed_pubkey_at_path(const uint32_t bip32_path[],
             }
 
             // generate corresponding public key
+            PERF_COUNT(ecfp_scalar_mult, 1);
             cx_ecfp_generate_pair(CX_CURVE_256K1, &public_key, &private_key, 1);
 
             memmove(keydata.raw_public_key, public_key.W + 1, 64);
@@ -322,13 +615,37 @@ uint32_t crypto_get_key_fingerprint(const uint8_t pub_key[static 33]) {
     return read_u32_be(key_rip, 0);
 }
 
-uint32_t crypto_get_master_key_fingerprint() {
+// The identifier of the master key (the HASH160 of its pubkey, whose first 4 bytes are the master
+// key fingerprint) is computed once per app session, at the first call of
+// get_master_key_identifier, until crypto_clear_key_caches is called.
+static bool master_key_identifier_cached = false;
+static uint8_t master_key_identifier[20];
+
+// returns the identifier of the master key, or NULL on error
+static const uint8_t *get_master_key_identifier() {
+    if (master_key_identifier_cached) {
+        return master_key_identifier;
+    }
+
     uint8_t master_pub_key[33];
-    uint32_t bip32_path[] = {};
-    crypto_get_compressed_pubkey_at_path(bip32_path, 0, master_pub_key, NULL);
-    return crypto_get_key_fingerprint(master_pub_key);
+    uint32_t bip32_path[1] = {0};  // empty path; the array is not accessed
+    if (!crypto_get_compressed_pubkey_at_path(bip32_path, 0, master_pub_key, NULL)) {
+        return NULL;  // should never happen; the result is not cached
+    }
+    crypto_hash160(master_pub_key, 33, master_key_identifier);
+    master_key_identifier_cached = true;
+    return master_key_identifier;
 }
 
+uint32_t crypto_get_master_key_fingerprint() {
+    const uint8_t *identifier = get_master_key_identifier();
+    if (identifier == NULL) {
+        return 0;
+    }
+    return read_u32_be(identifier, 0);
+}
+
+
 void crypto_derive_symmetric_key(const char *label, size_t label_len, uint8_t key[static 32]) {
     // TODO: is there a better way?
     //       The label is a byte string in SLIP-0021, but os_perso_derive_node_with_seed_key
@@ -351,69 +668,365 @@ void crypto_derive_symmetric_key(const char *label, size_t label_len, uint8_t ke
 // TODO: Split serialization from key derivation?
 //       It might be difficult to have a clean API without wasting memory, as the checksum
 //       needs to be concatenated to the data before base58 serialization.
+/**
+ * An extended pubkey computed by get_serialized_extended_pubkey_at_path or
+ * get_extended_pubkey_at_path, both decoded and serialized.
+ */
+typedef struct {
+    bool is_valid;
+    uint8_t bip32_path_len;
+    uint32_t bip32_path[MAX_BIP32_PATH_STEPS];
+    uint32_t bip32_pubkey_version;
+    uint32_t last_used;  // value of xpub_cache_counter when the entry was last used
+    serialized_extended_pubkey_t ext_pubkey;
+    char serialized_pubkey[MAX_SERIALIZED_PUBKEY_LENGTH + 1];
+} xpub_cache_entry_t;
+
+// least recently used cache of the serialized extended pubkeys, as the same (account-level) paths
+// are usually requested many times in the app session; cleared by crypto_clear_key_caches
+static uint32_t xpub_cache_counter = 0;
+static xpub_cache_entry_t xpub_cache[XPUB_CACHE_SIZE];
+
+void crypto_clear_key_caches() {
+    master_key_identifier_cached = false;
+    explicit_bzero(master_key_identifier, sizeof(master_key_identifier));
+
+    xpub_cache_counter = 0;
+    explicit_bzero(xpub_cache, sizeof(xpub_cache));
+}
+
+static int compute_serialized_extended_pubkey_at_path(
+    const uint32_t bip32_path[],
+    uint8_t bip32_path_len,
+    uint32_t bip32_pubkey_version,
+    char out[static MAX_SERIALIZED_PUBKEY_LENGTH + 1],
+    serialized_extended_pubkey_t *ext_pubkey_out);
+
+#if NVM_XPUB_CACHE_SIZE > 0
+// the persistent cache only contains the extended pubkeys of the first accounts of the standard
+// purposes, that the hosts request when they connect; the longest is m/48'/coin'/account'/type'
+#define NVM_XPUB_CACHE_MAX_PATH_LEN 4
+// the accounts with a larger index are not cached, so that a host scanning many accounts does not
+// evict the first ones, nor wear the flash memory
+#define NVM_XPUB_CACHE_MAX_ACCOUNT 4
+
+typedef struct {
+    uint8_t bip32_path_len;  // 0 if the entry is empty
+    uint32_t bip32_path[NVM_XPUB_CACHE_MAX_PATH_LEN];
+    uint32_t bip32_pubkey_version;
+    serialized_extended_pubkey_t ext_pubkey;
+} nvm_xpub_cache_entry_t;
+
+typedef struct {
+    // identifier of the master key of the seed the entries were derived from
+    uint8_t master_key_identifier[20];
+    uint8_t next_entry;  // the entry replaced by the next insertion
+    nvm_xpub_cache_entry_t entries[NVM_XPUB_CACHE_SIZE];
+} nvm_xpub_cache_t;
+
+// persistent cache of extended pubkeys, in the flash memory of the app; it is only written with
+// nvm_write, and read through PIC, so that the compiler does not assume that its content is fixed
+const nvm_xpub_cache_t N_xpub_cache_real;
+#define N_xpub_cache (*(const nvm_xpub_cache_t *) PIC(&N_xpub_cache_real))
+
+static bool is_nvm_xpub_cache_path(const uint32_t bip32_path[], uint8_t bip32_path_len) {
+    if (bip32_path_len < 3 || bip32_path_len > NVM_XPUB_CACHE_MAX_PATH_LEN) {
+        return false;
+    }
+    for (int i = 0; i < bip32_path_len; i++) {
+        if (bip32_path[i] < BIP32_FIRST_HARDENED_CHILD) {
+            return false;
+        }
+    }
+
+    uint32_t purpose = bip32_path[0] - BIP32_FIRST_HARDENED_CHILD;
+    if (purpose != 44 && purpose != 49 && purpose != 84 && purpose != 86 && purpose != 48) {
+        return false;
+    }
+    return bip32_path_len == (purpose == 48 ? 4 : 3) &&
+           bip32_path[2] - BIP32_FIRST_HARDENED_CHILD < NVM_XPUB_CACHE_MAX_ACCOUNT;
+}
+
+// returns true if the persistent cache can be used for the current seed; if it was filled for a
+// different seed (or never), it is wiped first
+static bool check_nvm_xpub_cache_seed() {
+    const uint8_t *identifier = get_master_key_identifier();
+    if (identifier == NULL) {
+        return false;
+    }
+    if (memcmp(N_xpub_cache.master_key_identifier, identifier, 20) != 0) {
+        nvm_write((void *) &N_xpub_cache, NULL, sizeof(nvm_xpub_cache_t));
+        nvm_write((void *) N_xpub_cache.master_key_identifier, (void *) identifier, 20);
+    }
+    return true;
+}
+
+// copies the extended pubkey at the given path in out if it is in the persistent cache; returns
+// true on success, or false if it is not cached
+static bool load_nvm_xpub_cache_entry(const uint32_t bip32_path[],
+                                      uint8_t bip32_path_len,
+                                      uint32_t bip32_pubkey_version,
+                                      serialized_extended_pubkey_t *out) {
+    for (int i = 0; i < NVM_XPUB_CACHE_SIZE; i++) {
+        const nvm_xpub_cache_entry_t *cur = &N_xpub_cache.entries[i];
+        if (cur->bip32_path_len == bip32_path_len &&
+            cur->bip32_pubkey_version == bip32_pubkey_version &&
+            memcmp(cur->bip32_path, bip32_path, bip32_path_len * sizeof(uint32_t)) == 0) {
+            memcpy(out, &cur->ext_pubkey, sizeof(serialized_extended_pubkey_t));
+            PERF_COUNT_CACHE(CACHE_NVM_XPUB, hits, sizeof(nvm_xpub_cache_t));
+            return true;
+        }
+    }
+    PERF_COUNT_CACHE(CACHE_NVM_XPUB, misses, sizeof(nvm_xpub_cache_t));
+    return false;
+}
+
+// stores the extended pubkey at the given path in the persistent cache, replacing the oldest entry
+static void store_nvm_xpub_cache_entry(const uint32_t bip32_path[],
+                                       uint8_t bip32_path_len,
+                                       uint32_t bip32_pubkey_version,
+                                       const serialized_extended_pubkey_t *ext_pubkey) {
+    nvm_xpub_cache_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.bip32_path_len = bip32_path_len;
+    memcpy(entry.bip32_path, bip32_path, bip32_path_len * sizeof(uint32_t));
+    entry.bip32_pubkey_version = bip32_pubkey_version;
+    memcpy(&entry.ext_pubkey, ext_pubkey, sizeof(serialized_extended_pubkey_t));
+
+    uint8_t index = N_xpub_cache.next_entry % NVM_XPUB_CACHE_SIZE;
+    if (N_xpub_cache.entries[index].bip32_path_len != 0) {
+        PERF_COUNT_CACHE(CACHE_NVM_XPUB, evictions, sizeof(nvm_xpub_cache_t));
+    }
+    nvm_write((void *) &N_xpub_cache.entries[index], &entry, sizeof(entry));
+
+    uint8_t next_entry = (index + 1) % NVM_XPUB_CACHE_SIZE;
+    nvm_write((void *) &N_xpub_cache.next_entry, &next_entry, sizeof(next_entry));
+}
+#endif
+
+// computes the extended pubkey at the given path in the entry, unless it is in the persistent
+// cache; returns the length of the serialized pubkey, or -1 on error
+static int fill_xpub_cache_entry(const uint32_t bip32_path[],
+                                 uint8_t bip32_path_len,
+                                 uint32_t bip32_pubkey_version,
+                                 xpub_cache_entry_t *entry) {
+#if NVM_XPUB_CACHE_SIZE > 0
+    bool use_nvm_cache =
+        is_nvm_xpub_cache_path(bip32_path, bip32_path_len) && check_nvm_xpub_cache_seed();
+    if (use_nvm_cache && load_nvm_xpub_cache_entry(bip32_path,
+                                                   bip32_path_len,
+                                                   bip32_pubkey_version,
+                                                   &entry->ext_pubkey)) {
+        return crypto_serialize_extended_pubkey(&entry->ext_pubkey, entry->serialized_pubkey);
+    }
+#endif
+
+    int serialized_pubkey_len = compute_serialized_extended_pubkey_at_path(bip32_path,
+                                                                           bip32_path_len,
+                                                                           bip32_pubkey_version,
+                                                                           entry->serialized_pubkey,
+                                                                           &entry->ext_pubkey);
+#if NVM_XPUB_CACHE_SIZE > 0
+    if (serialized_pubkey_len > 0 && use_nvm_cache) {
+        store_nvm_xpub_cache_entry(bip32_path,
+                                   bip32_path_len,
+                                   bip32_pubkey_version,
+                                   &entry->ext_pubkey);
+    }
+#endif
+    return serialized_pubkey_len;
+}
+
+// returns the cache entry of the extended pubkey at the given path if it is cached, or NULL
+static xpub_cache_entry_t *find_xpub_cache_entry(const uint32_t bip32_path[],
+                                                 uint8_t bip32_path_len,
+                                                 uint32_t bip32_pubkey_version) {
+    for (int i = 0; i < XPUB_CACHE_SIZE; i++) {
+        xpub_cache_entry_t *cur = &xpub_cache[i];
+        if (cur->is_valid && cur->bip32_path_len == bip32_path_len &&
+            cur->bip32_pubkey_version == bip32_pubkey_version &&
+            memcmp(cur->bip32_path, bip32_path, bip32_path_len * sizeof(uint32_t)) == 0) {
+            cur->last_used = ++xpub_cache_counter;
+            return cur;
+        }
+    }
+    return NULL;
+}
+
+// returns the cache entry of the extended pubkey at the given path, computing it if it is not
+// cached; returns NULL on error
+static const xpub_cache_entry_t *get_xpub_cache_entry(const uint32_t bip32_path[],
+                                                      uint8_t bip32_path_len,
+                                                      uint32_t bip32_pubkey_version) {
+    if (bip32_path_len > MAX_BIP32_PATH_STEPS) {
+        return NULL;
+    }
+
+    xpub_cache_entry_t *entry =
+        find_xpub_cache_entry(bip32_path, bip32_path_len, bip32_pubkey_version);
+    if (entry != NULL) {
+        PERF_COUNT_CACHE(CACHE_XPUB, hits, sizeof(xpub_cache));
+        return entry;
+    }
+    PERF_COUNT_CACHE(CACHE_XPUB, misses, sizeof(xpub_cache));
+
+    // choose an empty entry, or the least recently used one
+    entry = &xpub_cache[0];
+    for (int i = 1; i < XPUB_CACHE_SIZE; i++) {
+        xpub_cache_entry_t *cur = &xpub_cache[i];
+        if (entry->is_valid && (!cur->is_valid || cur->last_used < entry->last_used)) {
+            entry = cur;
+        }
+    }
+
+    if (entry->is_valid) {
+        PERF_COUNT_CACHE(CACHE_XPUB, evictions, sizeof(xpub_cache));
+    }
+    entry->is_valid = false;
+    int serialized_pubkey_len =
+        fill_xpub_cache_entry(bip32_path, bip32_path_len, bip32_pubkey_version, entry);
+    if (serialized_pubkey_len <= 0) {
+        return NULL;
+    }
+
+    entry->is_valid = true;
+    entry->bip32_path_len = bip32_path_len;
+    memcpy(entry->bip32_path, bip32_path, bip32_path_len * sizeof(uint32_t));
+    entry->bip32_pubkey_version = bip32_pubkey_version;
+    entry->last_used = ++xpub_cache_counter;
+    return entry;
+}
+
 int get_serialized_extended_pubkey_at_path(const uint32_t bip32_path[],
                                            uint8_t bip32_path_len,
                                            uint32_t bip32_pubkey_version,
                                            char out[static MAX_SERIALIZED_PUBKEY_LENGTH + 1]) {
-    // find parent key's fingerprint and child number
-    uint32_t parent_fingerprint = 0;
-    uint32_t child_number = 0;
-    if (bip32_path_len > 0) {
-        // here we reuse the storage for the parent keys that we will later use
-        // for the response, in order to save memory
+    const xpub_cache_entry_t *entry =
+        get_xpub_cache_entry(bip32_path, bip32_path_len, bip32_pubkey_version);
+    if (entry == NULL) {
+        return -1;
+    }
 
-        uint8_t parent_pubkey[33];
-        crypto_get_compressed_pubkey_at_path(bip32_path, bip32_path_len - 1, parent_pubkey, NULL);
+    size_t len = strlen(entry->serialized_pubkey);
+    memcpy(out, entry->serialized_pubkey, len + 1);
+    return (int) len;
+}
 
-        parent_fingerprint = crypto_get_key_fingerprint(parent_pubkey);
-        child_number = bip32_path[bip32_path_len - 1];
+int get_extended_pubkey_at_path(const uint32_t bip32_path[],
+                                uint8_t bip32_path_len,
+                                uint32_t bip32_pubkey_version,
+                                serialized_extended_pubkey_t *out) {
+    const xpub_cache_entry_t *entry =
+        get_xpub_cache_entry(bip32_path, bip32_path_len, bip32_pubkey_version);
+    if (entry == NULL) {
+        return -1;
     }
 
-    struct {
-        serialized_extended_pubkey_t ext_pubkey;
-        uint8_t checksum[4];
-    } ext_pubkey_check;  // extended pubkey and checksum
+    memcpy(out, &entry->ext_pubkey, sizeof(serialized_extended_pubkey_t));
+    return 0;
+}
+
+static int compute_serialized_extended_pubkey_at_path(
+    const uint32_t bip32_path[],
+    uint8_t bip32_path_len,
+    uint32_t bip32_pubkey_version,
+    char out[static MAX_SERIALIZED_PUBKEY_LENGTH + 1],
+    serialized_extended_pubkey_t *ext_pubkey_out) {
+    if (cxram_scratch_in_use()) {
+        return -1;  // the elliptic curve operations may overwrite the scratch area
+    }
 
-    serialized_extended_pubkey_t *ext_pubkey = &ext_pubkey_check.ext_pubkey;
+    serialized_extended_pubkey_t *ext_pubkey = ext_pubkey_out;
+
+    if (bip32_path_len == 0) {
+        write_u32_be(ext_pubkey->version, 0, bip32_pubkey_version);
+        ext_pubkey->depth = 0;
+        write_u32_be(ext_pubkey->parent_fingerprint, 0, 0);
+        write_u32_be(ext_pubkey->child_number, 0, 0);
+        if (!crypto_get_compressed_pubkey_at_path(bip32_path,
+                                                  0,
+                                                  ext_pubkey->compressed_pubkey,
+                                                  ext_pubkey->chain_code)) {
+            return -1;
+        }
+        return crypto_serialize_extended_pubkey(ext_pubkey, out);
+    }
 
-    write_u32_be(ext_pubkey->version, 0, bip32_pubkey_version);
-    ext_pubkey->depth = bip32_path_len;
-    write_u32_be(ext_pubkey->parent_fingerprint, 0, parent_fingerprint);
-    write_u32_be(ext_pubkey->child_number, 0, child_number);
+    uint32_t child_number = bip32_path[bip32_path_len - 1];
 
-    crypto_get_compressed_pubkey_at_path(bip32_path,
-                                         bip32_path_len,
-                                         ext_pubkey->compressed_pubkey,
-                                         ext_pubkey->chain_code);
-    crypto_get_checksum((uint8_t *) ext_pubkey, 78, ext_pubkey_check.checksum);
+    // the unhardened child of a cached extended pubkey is derived without accessing the seed
+    const xpub_cache_entry_t *parent =
+        child_number < BIP32_FIRST_HARDENED_CHILD
+            ? find_xpub_cache_entry(bip32_path, bip32_path_len - 1, bip32_pubkey_version)
+            : NULL;
+    if (parent != NULL) {
+        if (bip32_CKDpub(&parent->ext_pubkey, child_number, ext_pubkey) < 0) {
+            return -1;
+        }
+        return crypto_serialize_extended_pubkey(ext_pubkey, out);
+    }
 
-    int serialized_pubkey_len =
-        base58_encode((uint8_t *) &ext_pubkey_check, 78 + 4, out, MAX_SERIALIZED_PUBKEY_LENGTH);
+    // otherwise, only the parent key is derived from the seed, and the child key with CKDpriv;
+    // the parent is needed anyway for its fingerprint
+    uint8_t privkey[32];
+    uint8_t chain_code[32];
+    int ret = 0;
+    BEGIN_TRY {
+        TRY {
+            PERF_COUNT(derive_node_bip32, 1);
+            os_perso_derive_node_bip32(CX_CURVE_256K1,
+                                       bip32_path,
+                                       bip32_path_len - 1,
+                                       privkey,
+                                       chain_code);
 
-    if (serialized_pubkey_len > 0) {
-        out[serialized_pubkey_len] = '\0';
+            uint8_t parent_pubkey[33];
+            uint8_t *child_pubkey = ext_pubkey->compressed_pubkey;
+            if (crypto_get_compressed_pubkey_from_privkey(privkey, parent_pubkey) < 0 ||
+                bip32_CKDpriv_any(privkey, chain_code, child_number) < 0 ||
+                crypto_get_compressed_pubkey_from_privkey(privkey, child_pubkey) < 0) {
+                ret = -1;
+            } else {
+                write_u32_be(ext_pubkey->version, 0, bip32_pubkey_version);
+                ext_pubkey->depth = bip32_path_len;
+                write_u32_be(ext_pubkey->parent_fingerprint,
+                             0,
+                             crypto_get_key_fingerprint(parent_pubkey));
+                write_u32_be(ext_pubkey->child_number, 0, child_number);
+                memcpy(ext_pubkey->chain_code, chain_code, 32);
+            }
+        }
+        CATCH_ALL {
+            ret = -1;
+        }
+        FINALLY {
+            explicit_bzero(privkey, sizeof(privkey));
+            explicit_bzero(chain_code, sizeof(chain_code));
+        }
     }
-    return serialized_pubkey_len;
+    END_TRY;
+
+    if (ret < 0) {
+        return ret;
+    }
+    return crypto_serialize_extended_pubkey(ext_pubkey, out);
 }
 
-int base58_encode_address(const uint8_t in[20], uint32_t version, char *out, size_t out_len) {
-    uint8_t tmp[4 + 20 + 4];  // version + max_in_len + checksum
+int crypto_serialize_extended_pubkey(const serialized_extended_pubkey_t *ext_pubkey,
+                                     char out[static MAX_SERIALIZED_PUBKEY_LENGTH + 1]) {
+    serialized_extended_pubkey_check_t ext_pubkey_check;
+    memcpy(&ext_pubkey_check.serialized_extended_pubkey,
+           ext_pubkey,
+           sizeof(serialized_extended_pubkey_t));
+    crypto_get_checksum((uint8_t *) ext_pubkey, 78, ext_pubkey_check.checksum);
 
-    uint8_t version_len;
-    if (version < 256) {
-        tmp[0] = (uint8_t) version;
-        version_len = 1;
-    } else if (version < 65536) {
-        write_u16_be(tmp, 0, (uint16_t) version);
-        version_len = 2;
-    } else {
-        write_u32_be(tmp, 0, version);
-        version_len = 4;
+    int serialized_pubkey_len =
+        base58_encode((uint8_t *) &ext_pubkey_check, 78 + 4, out, MAX_SERIALIZED_PUBKEY_LENGTH);
+    if (serialized_pubkey_len <= 0) {
+        return -1;
     }
-
-    memcpy(tmp + version_len, in, 20);
-    crypto_get_checksum(tmp, version_len + 20, tmp + version_len + 20);
-    return base58_encode(tmp, version_len + 20 + 4, out, out_len);
+    out[serialized_pubkey_len] = '\0';
+    return serialized_pubkey_len;
 }
 
 int crypto_ecdsa_sign_sha256_hash_with_key(const uint32_t bip32_path[],
@@ -421,6 +1034,12 @@ int crypto_ecdsa_sign_sha256_hash_with_key(const uint32_t bip32_path[],
                                            const uint8_t hash[static 32],
                                            uint8_t out[static MAX_DER_SIG_LEN],
                                            uint32_t *info) {
+    PRINT_STACK_POINTER();
+
+    if (cxram_scratch_in_use()) {
+        return -1;  // the elliptic curve operations may overwrite the scratch area
+    }
+
     cx_ecfp_private_key_t private_key = {0};
     uint8_t chain_code[32] = {0};
     uint32_t info_internal = 0;
@@ -460,6 +1079,92 @@ int crypto_ecdsa_sign_sha256_hash_with_key(const uint32_t bip32_path[],
     return sig_len;
 }
 
+int crypto_ecdsa_sign_sha256_hash_with_raw_key(const uint8_t raw_private_key[static 32],
+                                               const uint8_t hash[static 32],
+                                               uint8_t out[static MAX_DER_SIG_LEN],
+                                               uint32_t *info) {
+    PRINT_STACK_POINTER();
+
+    if (cxram_scratch_in_use()) {
+        return -1;  // the elliptic curve operations may overwrite the scratch area
+    }
+
+    cx_ecfp_private_key_t private_key = {0};
+    uint32_t info_internal = 0;
+
+    int sig_len = 0;
+    bool error = false;
+    BEGIN_TRY {
+        TRY {
+            cx_ecfp_init_private_key(CX_CURVE_256K1, raw_private_key, 32, &private_key);
+            sig_len = cx_ecdsa_sign(&private_key,
+                                    CX_RND_RFC6979,
+                                    CX_SHA256,
+                                    hash,
+                                    32,
+                                    out,
+                                    MAX_DER_SIG_LEN,
+                                    &info_internal);
+        }
+        CATCH_ALL {
+            error = true;
+        }
+        FINALLY {
+            explicit_bzero(&private_key, sizeof(private_key));
+        }
+    }
+    END_TRY;
+
+    if (error) {
+        // unexpected error when signing
+        return -1;
+    }
+
+    if (info != NULL) {
+        *info = info_internal;
+    }
+
+    return sig_len;
+}
+
+// Reads the DER-encoded integer at *pos, and writes it to out as a 32-byte big-endian integer.
+static int read_der_integer(const uint8_t *der, size_t der_len, size_t *pos, uint8_t out[static 32]) {
+    if (*pos + 2 > der_len || der[*pos] != 0x02) {
+        return -1;
+    }
+    size_t len = der[*pos + 1];
+    const uint8_t *value = der + *pos + 2;
+    if (len == 0 || *pos + 2 + len > der_len) {
+        return -1;
+    }
+    *pos += 2 + len;
+
+    // the 0x00 byte that keeps the integer positive is not part of the value
+    while (len > 32 && value[0] == 0x00) {
+        ++value;
+        --len;
+    }
+    if (len > 32) {
+        return -1;
+    }
+    memset(out, 0, 32 - len);
+    memcpy(out + 32 - len, value, len);
+    return 0;
+}
+
+int crypto_ecdsa_der_to_compact(const uint8_t *der, size_t der_len, uint8_t out[static 64]) {
+    if (der_len < 2 || der[0] != 0x30 || der[1] != der_len - 2) {
+        return -1;
+    }
+
+    size_t pos = 2;
+    if (read_der_integer(der, der_len, &pos, out) < 0 ||
+        read_der_integer(der, der_len, &pos, out + 32) < 0 || pos != der_len) {
+        return -1;
+    }
+    return 0;
+}
+
 void crypto_tr_tagged_hash_init(cx_sha256_t *hash_context, const uint8_t *tag, uint16_t tag_len) {
     // we recycle the input to save memory (will reinit later)
     cx_sha256_init(hash_context);
@@ -473,18 +1178,17 @@ void crypto_tr_tagged_hash_init(cx_sha256_t *hash_context, const uint8_t *tag, u
     crypto_hash_update(&hash_context->header, hashtag, sizeof(hashtag));
 }
 
-static void crypto_tr_tagged_hash(const uint8_t *tag,
-                                  uint16_t tag_len,
-                                  const uint8_t *data,
-                                  uint16_t data_len,
-                                  uint8_t out[static 32]) {
-    cx_sha256_t hash_context;
-    cx_sha256_init(&hash_context);
+_Static_assert(sizeof(((cx_sha256_t *) 0)->acc) == 8 * sizeof(uint32_t),
+               "Unexpected size of the state of cx_sha256_t");
 
-    crypto_tr_tagged_hash_init(&hash_context, tag, tag_len);
+void crypto_tr_tagged_hash_init_midstate(cx_sha256_t *hash_context,
+                                         const uint32_t midstate[static 8]) {
+    cx_sha256_init(hash_context);
 
-    crypto_hash_update(&hash_context.header, data, data_len);
-    crypto_hash_digest(&hash_context.header, out, 32);
+    // the state after compressing the first block, that is SHA256(tag) || SHA256(tag)
+    memcpy(hash_context->acc, midstate, sizeof(hash_context->acc));
+    hash_context->header.counter = 1;  // number of 64-byte blocks already processed
+    hash_context->blen = 0;
 }
 
 static int crypto_tr_lift_x(const uint8_t x[static 32], uint8_t out[static 65]) {
@@ -521,12 +1225,41 @@ static int crypto_tr_lift_x(const uint8_t x[static 32], uint8_t out[static 65])
     return 0;
 }
 
+// Computes the TapTweak hash of the x-only pubkey, committing to the merkle root if not NULL
+static void crypto_tr_tweak_hash(const uint8_t pubkey[static 32],
+                                 const uint8_t *merkle_root,
+                                 uint8_t out[static 32]) {
+    cx_sha256_t hash_context;
+
+    crypto_tr_tagged_hash_init_midstate(&hash_context, BIP0341_taptweak_midstate);
+
+    crypto_hash_update(&hash_context.header, pubkey, 32);
+    if (merkle_root != NULL) {
+        crypto_hash_update(&hash_context.header, merkle_root, 32);
+    }
+    crypto_hash_digest(&hash_context.header, out, 32);
+}
+
 // Like taproot_tweak_pubkey of BIP0341, with empty string h
 // TODO: should it recycle pubkey also for the output (like crypto_tr_tweak_seckey below)?
 int crypto_tr_tweak_pubkey(uint8_t pubkey[static 32], uint8_t *y_parity, uint8_t out[static 32]) {
+    return crypto_tr_tweak_pubkey_with_merkle_root(pubkey, NULL, y_parity, out);
+}
+
+// Like taproot_tweak_pubkey of BIP0341, with h equal to the merkle root (or empty if NULL)
+int crypto_tr_tweak_pubkey_with_merkle_root(uint8_t pubkey[static 32],
+                                            const uint8_t *merkle_root,
+                                            uint8_t *y_parity,
+                                            uint8_t out[static 32]) {
+    PRINT_STACK_POINTER();
+
+    if (cxram_scratch_in_use()) {
+        return -1;  // the elliptic curve operations may overwrite the scratch area
+    }
+
     uint8_t t[32];
 
-    crypto_tr_tagged_hash(BIP0341_taptweak_tag, sizeof(BIP0341_taptweak_tag), pubkey, 32, t);
+    crypto_tr_tweak_hash(pubkey, merkle_root, t);
 
     // fail if t is not smaller than the curve order
     if (cx_math_cmp(t, secp256k1_n, 32) >= 0) {
@@ -545,6 +1278,8 @@ int crypto_tr_tweak_pubkey(uint8_t pubkey[static 32], uint8_t *y_parity, uint8_t
         return -1;
     }
 
+    PERF_COUNT(ecfp_add_point, 1);
+
     if (cx_ecfp_add_point(CX_CURVE_SECP256K1, Q, Q, lifted_pubkey, sizeof(Q)) == 0) {
         return -1;  // the point at infinity is not valid (should never happen in practice)
     }
@@ -556,6 +1291,14 @@ int crypto_tr_tweak_pubkey(uint8_t pubkey[static 32], uint8_t *y_parity, uint8_t
 
 // Like taproot_tweak_seckey of BIP0341, with empty string h
 int crypto_tr_tweak_seckey(uint8_t seckey[static 32]) {
+    return crypto_tr_tweak_seckey_with_merkle_root(seckey, NULL);
+}
+
+// Like taproot_tweak_seckey of BIP0341, with h equal to the merkle root (or empty if NULL)
+int crypto_tr_tweak_seckey_with_merkle_root(uint8_t seckey[static 32],
+                                            const uint8_t *merkle_root) {
+    PRINT_STACK_POINTER();
+
     uint8_t P[65];
 
     int ret = 0;
@@ -569,11 +1312,9 @@ int crypto_tr_tweak_seckey(uint8_t seckey[static 32]) {
             }
 
             uint8_t t[32];
-            crypto_tr_tagged_hash(BIP0341_taptweak_tag,
-                                  sizeof(BIP0341_taptweak_tag),
-                                  &P[1],  // P[1:33] is x(P)
-                                  32,
-                                  t);
+            crypto_tr_tweak_hash(&P[1],  // P[1:33] is x(P)
+                                 merkle_root,
+                                 t);
 
             // fail if t is not smaller than the curve order
             if (cx_math_cmp(t, secp256k1_n, 32) >= 0) {
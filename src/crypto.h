@@ -7,11 +7,44 @@
 #include "os.h"
 #include "cx.h"
 #include "constants.h"
+#include "perf_config.h"
+#include "cache_stats.h"
 
 #include "./common/bip32.h"
 #include "./common/varint.h"
 #include "./common/write.h"
 
+#ifdef HAVE_PERF_COUNTERS
+/**
+ * Number of the most expensive operations performed since the beginning of the last command, in
+ * the builds with HAVE_PERF_COUNTERS. They are reset by the dispatcher at each new command, and
+ * returned by the GET_PERF_COUNTERS framework command.
+ */
+typedef struct {
+    uint32_t ecfp_scalar_mult;  // including the ones in cx_ecfp_generate_pair
+    uint32_t ecfp_add_point;
+    uint32_t hmac_sha512;
+    uint32_t sha256_compressions;
+    uint32_t derive_node_bip32;
+    uint32_t interruptions;  // client commands sent to the host, excluding the speculative ones
+} perf_counters_t;
+
+extern perf_counters_t G_perf_counters;
+
+#define PERF_COUNT(counter, n) (G_perf_counters.counter += (n))
+
+/**
+ * Counts the compressions of SHA-256 performed by adding in_len bytes to the hash context (and
+ * computing the final hash, if last is true). Other hash functions are ignored.
+ */
+void crypto_count_hash(const cx_hash_t *hash_context, size_t in_len, bool last);
+
+#define PERF_COUNT_HASH(hash_context, in_len, last) crypto_count_hash(hash_context, in_len, last)
+#else
+#define PERF_COUNT(counter, n)                      ((void) 0)
+#define PERF_COUNT_HASH(hash_context, in_len, last) ((void) 0)
+#endif
+
 /**
  * A serialized extended pubkey according to BIP32 specifications.
  * All the fields are represented as fixed-length arrays serialized in big-endian.
@@ -68,6 +101,102 @@ int bip32_CKDpub(const serialized_extended_pubkey_t *parent,
                  uint32_t index,
                  serialized_extended_pubkey_t *child);
 
+/**
+ * Derives the unhardened child of a public key, like bip32_CKDpub; the keys are represented as
+ * uncompressed points, and the metadata of the extended pubkey (including the parent fingerprint)
+ * is not computed. This avoids the decompression of the child key when multiple derivation steps
+ * are chained.
+ *
+ * @param[in]  parent_pubkey
+ *   Pointer to the 65-byte uncompressed pubkey of the parent.
+ * @param[in,out] chain_code
+ *   The 32-byte chain code of the parent; it is overwritten with the chain code of the child.
+ * @param[in] index
+ *   Index of the child to derive. It MUST be not hardened, that is, strictly less than 0x80000000.
+ * @param[out] child_pubkey
+ *   Pointer to the 65-byte output array for the uncompressed pubkey of the child. It can equal
+ * parent_pubkey, which in that case is overwritten.
+ *
+ * @return 0 if success, a negative number on failure.
+ */
+int bip32_CKDpub_point(const uint8_t parent_pubkey[static 65],
+                       uint8_t chain_code[static 32],
+                       uint32_t index,
+                       uint8_t child_pubkey[static 65]);
+
+/**
+ * Derives the compressed pubkeys of n consecutive unhardened children of the same parent, starting
+ * from the index first_index (for example, the addresses of a range at the same change step). The
+ * hmac key is only set once for all the children.
+ *
+ * @param[in]  parent_pubkey
+ *   Pointer to the 65-byte uncompressed pubkey of the parent.
+ * @param[in] chain_code
+ *   The 32-byte chain code of the parent.
+ * @param[in] first_index
+ *   Index of the first child to derive. All the derived indexes MUST be not hardened, that is,
+ * strictly less than 0x80000000.
+ * @param[in] n
+ *   Number of children to derive.
+ * @param[out] out
+ *   Array of n 33-byte arrays, that will contain the compressed pubkeys of the children.
+ *
+ * @return 0 if success, a negative number on failure.
+ */
+int bip32_CKDpub_range(const uint8_t parent_pubkey[static 65],
+                       const uint8_t chain_code[static 32],
+                       uint32_t first_index,
+                       size_t n,
+                       uint8_t out[][33]);
+
+/**
+ * Derives the unhardened child of an extended private key, as the CKDpriv function of BIP-32.
+ * This allows to derive the final steps of a BIP-32 path from a previously derived key, without
+ * repeating the entire derivation from the seed.
+ *
+ * @param[in,out] privkey
+ *   The 32-byte private key of the parent; it is overwritten with the private key of the child.
+ * @param[in,out] chain_code
+ *   The 32-byte chain code of the parent; it is overwritten with the chain code of the child.
+ * @param[in] index
+ *   Index of the child to derive. It MUST be not hardened, that is, strictly less than 0x80000000.
+ *
+ * @return 0 if success, a negative number on failure.
+ */
+int bip32_CKDpriv(uint8_t privkey[static 32], uint8_t chain_code[static 32], uint32_t index);
+
+/**
+ * Derives the hardened child of an extended private key, as the CKDpriv function of BIP-32. This
+ * allows to share the derivation from the seed of a common hardened prefix between multiple paths.
+ *
+ * @param[in,out] privkey
+ *   The 32-byte private key of the parent; it is overwritten with the private key of the child.
+ * @param[in,out] chain_code
+ *   The 32-byte chain code of the parent; it is overwritten with the chain code of the child.
+ * @param[in] index
+ *   Index of the child to derive. It MUST be hardened, that is, at least 0x80000000.
+ *
+ * @return 0 if success, a negative number on failure.
+ */
+int bip32_CKDpriv_hardened(uint8_t privkey[static 32],
+                           uint8_t chain_code[static 32],
+                           uint32_t index);
+
+/**
+ * Convenience wrapper for cx_hash_sha256, computing the SHA-256 hash of some data.
+ *
+ * @param[in] in
+ *   Pointer to the data to hash.
+ * @param[in] in_len
+ *   Size of the data.
+ * @param[out] out
+ *   Pointer to the 32-bytes output buffer; it can overlap with the input.
+ */
+static inline void crypto_sha256(const uint8_t *in, size_t in_len, uint8_t out[static 32]) {
+    PERF_COUNT(sha256_compressions, (in_len + 9 + 63) / 64);
+    cx_hash_sha256(in, in_len, out, 32);
+}
+
 /**
  * Convenience wrapper for cx_hash to add some data to an initialized hash context.
  *
@@ -81,6 +210,7 @@ int bip32_CKDpub(const serialized_extended_pubkey_t *parent,
  * @return the return value of cx_hash.
  */
 static inline int crypto_hash_update(cx_hash_t *hash_context, const void *in, size_t in_len) {
+    PERF_COUNT_HASH(hash_context, in_len, false);
     return cx_hash(hash_context, 0, in, in_len, NULL, 0);
 }
 
@@ -98,6 +228,7 @@ static inline int crypto_hash_update(cx_hash_t *hash_context, const void *in, si
  * @return the return value of cx_hash.
  */
 static inline int crypto_hash_digest(cx_hash_t *hash_context, uint8_t *out, size_t out_len) {
+    PERF_COUNT_HASH(hash_context, 0, true);
     return cx_hash(hash_context, CX_LAST, NULL, 0, out, out_len);
 }
 
@@ -166,6 +297,93 @@ static inline int crypto_hash_update_u32(cx_hash_t *hash_context, uint32_t data)
     return crypto_hash_update(hash_context, &buf, sizeof(buf));
 }
 
+#define CRYPTO_HASH_BUFFER_SIZE 64
+
+/**
+ * A hash context whose updates are buffered in block-sized chunks, in order to coalesce many short
+ * updates (versions, varints, amounts) into few calls to the hash function of the SDK.
+ * The underlying hash context must not be updated directly until crypto_buffered_hash_flush is
+ * called.
+ */
+typedef struct {
+    cx_hash_t *hash_context;
+    size_t buffer_len;
+    uint8_t buffer[CRYPTO_HASH_BUFFER_SIZE];
+} crypto_buffered_hash_t;
+
+/**
+ * Initializes a buffered hash on top of an already initialized hash context.
+ *
+ * @param[out] bh
+ *   Pointer to the buffered hash to initialize.
+ * @param[in] hash_context
+ *   The context of the hash, which must already be initialized.
+ */
+static inline void crypto_buffered_hash_init(crypto_buffered_hash_t *bh, cx_hash_t *hash_context) {
+    bh->hash_context = hash_context;
+    bh->buffer_len = 0;
+}
+
+/**
+ * Adds some data to a buffered hash. The data is only passed to the underlying hash context once a
+ * full block is buffered; the whole blocks of a long input are passed without copying them.
+ *
+ * @param[in,out] bh
+ *   Pointer to a buffered hash initialized with crypto_buffered_hash_init.
+ * @param[in] in
+ *   Pointer to the data to be added to the hash computation.
+ * @param[in] in_len
+ *   Size of the passed data.
+ */
+void crypto_buffered_hash_update(crypto_buffered_hash_t *bh, const void *in, size_t in_len);
+
+/**
+ * Passes the buffered data to the underlying hash context, which can then be used directly.
+ *
+ * @param[in,out] bh
+ *   Pointer to a buffered hash initialized with crypto_buffered_hash_init.
+ */
+void crypto_buffered_hash_flush(crypto_buffered_hash_t *bh);
+
+/**
+ * Convenience wrapper for crypto_buffered_hash_update, updating the hash with an uint8_t.
+ */
+static inline void crypto_buffered_hash_update_u8(crypto_buffered_hash_t *bh, uint8_t data) {
+    crypto_buffered_hash_update(bh, &data, 1);
+}
+
+/**
+ * Convenience wrapper for crypto_buffered_hash_update, updating the hash with an uint32_t,
+ * encoded in little-endian.
+ */
+static inline void crypto_buffered_hash_update_u32_le(crypto_buffered_hash_t *bh, uint32_t data) {
+    uint8_t buf[4];
+    write_u32_le(buf, 0, data);
+    crypto_buffered_hash_update(bh, buf, sizeof(buf));
+}
+
+/**
+ * Convenience wrapper for crypto_buffered_hash_update, updating the hash with an uint64_t,
+ * serialized as a variable length integer in bitcoin's format.
+ */
+static inline void crypto_buffered_hash_update_varint(crypto_buffered_hash_t *bh, uint64_t data) {
+    uint8_t buf[9];
+    int len = varint_write(buf, 0, data);
+    crypto_buffered_hash_update(bh, buf, len);
+}
+
+/**
+ * Flushes the buffered hash, and computes the final hash of the underlying hash context.
+ *
+ * @return the return value of cx_hash.
+ */
+static inline int crypto_buffered_hash_digest(crypto_buffered_hash_t *bh,
+                                              uint8_t *out,
+                                              size_t out_len) {
+    crypto_buffered_hash_flush(bh);
+    return crypto_hash_digest(bh->hash_context, out, out_len);
+}
+
 /**
  * Computes RIPEMD160(in).
  *
@@ -188,7 +406,50 @@ void crypto_ripemd160(const uint8_t *in, uint16_t inlen, uint8_t out[static 20])
  * @param[out] out
  *   Pointer to the 160-bit (20 bytes) output array.
  */
-void crypto_hash160(const uint8_t *in, uint16_t in_len, uint8_t *out);
+void crypto_hash160(const uint8_t *in, uint16_t in_len, uint8_t out[static 20]);
+
+/**
+ * Context of a streaming computation of RIPEMD160(SHA256(data)). Only the SHA256 is computed
+ * incrementally, as RIPEMD160 is applied to its 32-byte digest; therefore, the data does not need
+ * to be kept in memory.
+ */
+typedef struct {
+    cx_sha256_t sha256_context;
+} crypto_hash160_ctx_t;
+
+/**
+ * Initializes a streaming computation of HASH160.
+ *
+ * @param[out] ctx
+ *   Pointer to the context to initialize.
+ */
+void crypto_hash160_init(crypto_hash160_ctx_t *ctx);
+
+/**
+ * Adds some data to a streaming computation of HASH160.
+ *
+ * @param[in,out] ctx
+ *   Pointer to a context initialized with crypto_hash160_init.
+ * @param[in] in
+ *   Pointer to input data.
+ * @param[in] in_len
+ *   Length of input data.
+ *
+ * @return the return value of cx_hash.
+ */
+static inline int crypto_hash160_update(crypto_hash160_ctx_t *ctx, const void *in, size_t in_len) {
+    return crypto_hash_update(&ctx->sha256_context.header, in, in_len);
+}
+
+/**
+ * Completes a streaming computation of HASH160.
+ *
+ * @param[in,out] ctx
+ *   Pointer to a context initialized with crypto_hash160_init; it must not be used after this call.
+ * @param[out] out
+ *   Pointer to the 160-bit (20 bytes) output array.
+ */
+void crypto_hash160_final(crypto_hash160_ctx_t *ctx, uint8_t out[static 20]);
 
 /**
  * Computes the 33-bytes compressed public key from the uncompressed 65-bytes public key.
@@ -205,6 +466,19 @@ void crypto_hash160(const uint8_t *in, uint16_t in_len, uint8_t *out);
  */
 int crypto_get_compressed_pubkey(const uint8_t uncompressed_key[static 65], uint8_t out[static 33]);
 
+/**
+ * Computes the 33-bytes compressed public key of a private key.
+ *
+ * @param[in] privkey
+ *   Pointer to the 32-byte private key.
+ * @param[out] out
+ *   Pointer to the output array, that must be 33 bytes long.
+ *
+ * @return 0 on success, a negative number on failure.
+ */
+int crypto_get_compressed_pubkey_from_privkey(const uint8_t privkey[static 32],
+                                              uint8_t out[static 33]);
+
 /**
  * Computes the 65-bytes uncompressed public key from the compressed 33-bytes public key.
  *
@@ -264,14 +538,29 @@ bool crypto_get_compressed_pubkey_at_path(const uint32_t bip32_path[],
 uint32_t crypto_get_key_fingerprint(const uint8_t pub_key[static 33]);
 
 /**
- * Computes the fingerprint of the master key as per BIP32.
+ * Computes the fingerprint of the master key as per BIP32. It is only computed at the first call in
+ * the app session, and kept in RAM for the following calls.
  *
  * @return the fingerprint of the master key.
  */
 uint32_t crypto_get_master_key_fingerprint();
 
 /**
- * Computes the base58check-encoded extended pubkey at a given path.
+ * Forgets the master key fingerprint cached by crypto_get_master_key_fingerprint, and the extended
+ * pubkeys cached in RAM by get_serialized_extended_pubkey_at_path, which are recomputed if needed.
+ * The persistent cache of the account-level extended pubkeys is kept, as it is tied to the seed.
+ * It must be called when the device is locked.
+ */
+void crypto_clear_key_caches();
+
+/**
+ * Computes the base58check-encoded extended pubkey at a given path. The most recently computed
+ * extended pubkeys are cached, therefore repeated requests for the same path (and version) do not
+ * require any derivation. Otherwise, the key is derived from the seed only once; an unhardened
+ * child of a cached extended pubkey is derived from it, without accessing the seed.
+ * The extended pubkeys of the first accounts of the standard purposes (44', 49', 84', 86' and 48')
+ * are also kept in the flash memory of the app, for the seed whose master key they were derived
+ * from, so that they are not derived again after the app is restarted.
  *
  * @param[in]  bip32_path
  *   Pointer to 32-bit array of BIP-32 derivation steps.
@@ -290,6 +579,40 @@ int get_serialized_extended_pubkey_at_path(const uint32_t bip32_path[],
                                            uint32_t bip32_pubkey_version,
                                            char out[static MAX_SERIALIZED_PUBKEY_LENGTH + 1]);
 
+/**
+ * Computes the extended pubkey at a given path, like get_serialized_extended_pubkey_at_path, but
+ * without base58 serialization. It shares the same cache.
+ *
+ * @param[in]  bip32_path
+ *   Pointer to 32-bit array of BIP-32 derivation steps.
+ * @param[in]  bip32_path_len
+ *   Number of steps in the BIP32 derivation.
+ * @param[in]  bip32_pubkey_version
+ *   Version prefix to use for the pubkey.
+ * @param[out] out
+ *   Pointer to the output extended pubkey.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+int get_extended_pubkey_at_path(const uint32_t bip32_path[],
+                                uint8_t bip32_path_len,
+                                uint32_t bip32_pubkey_version,
+                                serialized_extended_pubkey_t *out);
+
+/**
+ * Encodes an extended pubkey in base58check, as defined in BIP-32.
+ *
+ * @param[in]  ext_pubkey
+ *   Pointer to the extended pubkey.
+ * @param[out] out
+ *   Pointer to the output buffer, which must be long enough to contain the result (including the
+ * terminating null).
+ *
+ * @return the length of the output pubkey (not including the null character), or -1 on error.
+ */
+int crypto_serialize_extended_pubkey(const serialized_extended_pubkey_t *ext_pubkey,
+                                     char out[static MAX_SERIALIZED_PUBKEY_LENGTH + 1]);
+
 /**
  * Derives the level-1 symmetric key at the given label using SLIP-0021.
  * Must be wrapped in a TRY/FINALLY block to make sure that the output key is wiped after using it.
@@ -303,26 +626,6 @@ int get_serialized_extended_pubkey_at_path(const uint32_t bip32_path[],
  */
 void crypto_derive_symmetric_key(const char *label, size_t label_len, uint8_t key[static 32]);
 
-/**
- * Encodes a 20-bytes hash in base58 with checksum, after prepending a version prefix.
- * If version < 256, it is prepended as 1 byte.
- * If 256 <= version < 65536, it is prepended in big-endian as 2 bytes.
- * Otherwise, it is prepended in big-endian as 4 bytes.
- *
- * @param[in]  in
- *   Pointer to the 20-bytes hash to encode.
- * @param[in]  version
- *   The 1-byte, 2-byte or 4-byte version prefix.
- * @param[out]  out
- *   The pointer to the output array.
- * @param[in]  out_len
- *   The length of the output array.
- *
- * @return the length of the encoded output on success, -1 on failure (that is, if the output
- *   would be longer than out_len).
- */
-int base58_encode_address(const uint8_t in[20], uint32_t version, char *out, size_t out_len);
-
 /**
  * Signs a SHA-256 hash using the ECDSA with deterministic nonce accordin to RFC6979; the signing
  * private key is the one derived at the given BIP-32 path. The signature is returned in the
@@ -348,6 +651,42 @@ int crypto_ecdsa_sign_sha256_hash_with_key(const uint32_t bip32_path[],
                                            uint8_t out[static MAX_DER_SIG_LEN],
                                            uint32_t *info);
 
+/**
+ * Signs a SHA-256 hash using the ECDSA with deterministic nonce accordin to RFC6979, like
+ * crypto_ecdsa_sign_sha256_hash_with_key; the signing private key is given in raw form.
+ *
+ * @param[in]  raw_private_key
+ *   Pointer to the 32-byte private key.
+ * @param[in]  hash
+ *   Pointer to a 32-byte SHA-256 hash digest.
+ * @param[out]  out
+ *   The pointer to the output array to contain the signature, that must be of length
+ * `MAX_DER_SIG_LEN`.
+ * @param[out]  info
+ *   Pointer to contain the `info` variable returned by `cx_ecdsa_sign`, or `NULL` if not needed.
+ *
+ * @return the length of the signature on success, or -1 in case of error.
+ */
+int crypto_ecdsa_sign_sha256_hash_with_raw_key(const uint8_t raw_private_key[static 32],
+                                               const uint8_t hash[static 32],
+                                               uint8_t out[static MAX_DER_SIG_LEN],
+                                               uint32_t *info);
+
+/**
+ * Converts a DER-encoded ECDSA signature, as returned by crypto_ecdsa_sign_sha256_hash_with_key,
+ * to its 64-byte compact encoding: r followed by s, both as 32-byte big-endian integers.
+ *
+ * @param[in]  der
+ *   Pointer to the DER-encoded signature.
+ * @param[in]  der_len
+ *   Length of the DER-encoded signature.
+ * @param[out]  out
+ *   Pointer to a 64-byte array that will contain the compact signature.
+ *
+ * @return 0 on success, or -1 if the DER encoding is not valid.
+ */
+int crypto_ecdsa_der_to_compact(const uint8_t *der, size_t der_len, uint8_t out[static 64]);
+
 /**
  * Initializes the "tagged" SHA256 hash with the given tag, as defined by BIP-0340.
  *
@@ -360,6 +699,28 @@ int crypto_ecdsa_sign_sha256_hash_with_key(const uint32_t bip32_path[],
  */
 void crypto_tr_tagged_hash_init(cx_sha256_t *hash_context, const uint8_t *tag, uint16_t tag_len);
 
+/**
+ * Precomputed midstates of the tagged hashes used in the app, that is, the SHA256 state (as 8 32-bit
+ * words) after processing the first 64-byte block SHA256(tag) || SHA256(tag).
+ */
+extern const uint32_t BIP0341_taptweak_midstate[8];         // "TapTweak"
+extern const uint32_t BIP0341_tapsighash_midstate[8];       // "TapSighash"
+extern const uint32_t BIP0341_tapleaf_midstate[8];          // "TapLeaf"
+extern const uint32_t BIP0341_tapbranch_midstate[8];        // "TapBranch"
+extern const uint32_t BIP0322_signed_message_midstate[8];  // "BIP0322-signed-message"
+
+/**
+ * Initializes the "tagged" SHA256 hash from the precomputed midstate of its tag; it is equivalent
+ * to crypto_tr_tagged_hash_init, but it avoids two SHA256 compressions.
+ *
+ * @param[out]  hash_context
+ *   Pointer to the hash context to initialize.
+ * @param[in]  midstate
+ *   Pointer to one of the precomputed midstates.
+ */
+void crypto_tr_tagged_hash_init_midstate(cx_sha256_t *hash_context,
+                                         const uint32_t midstate[static 8]);
+
 /**
  * Builds a tweaked public key from a BIP340 public key array.
  * Implementation of taproot_tweak_pubkey of BIP341 with `h` set to the empty byte string.
@@ -374,6 +735,25 @@ void crypto_tr_tagged_hash_init(cx_sha256_t *hash_context, const uint8_t *tag, u
  */
 int crypto_tr_tweak_pubkey(uint8_t pubkey[static 32], uint8_t *y_parity, uint8_t out[static 32]);
 
+/**
+ * Like crypto_tr_tweak_pubkey, but committing to the merkle root of a tree of scripts, as
+ * taproot_tweak_pubkey of BIP341 with `h` set to the merkle root.
+ *
+ * @param[in]  pubkey
+ *   Pointer to the 32-byte to be used as public key.
+ * @param[in]  merkle_root
+ *   Pointer to the 32-byte merkle root of the tree of scripts, or NULL if there is no tree.
+ * @param[out]  y_parity
+ *   Pointer to a variable that will be set to 0/1 according to the parity of th y-coordinate of the
+ * final tweaked pubkey.
+ * @param[out]  out
+ *  Pointer to the a 32-byte array that will contain the x coordinate of the tweaked key.
+ */
+int crypto_tr_tweak_pubkey_with_merkle_root(uint8_t pubkey[static 32],
+                                            const uint8_t *merkle_root,
+                                            uint8_t *y_parity,
+                                            uint8_t out[static 32]);
+
 /**
  * Builds a tweaked public key from a BIP340 public key array.
  * Implementation of taproot_tweak_seckey of BIP341 with `h` set to the empty byte string.
@@ -383,3 +763,16 @@ int crypto_tr_tweak_pubkey(uint8_t pubkey[static 32], uint8_t *y_parity, uint8_t
  * key.
  */
 int crypto_tr_tweak_seckey(uint8_t seckey[static 32]);
+
+/**
+ * Like crypto_tr_tweak_seckey, but committing to the merkle root of a tree of scripts, as
+ * taproot_tweak_seckey of BIP341 with `h` set to the merkle root.
+ *
+ * @param[in|out] seckey
+ *   Pointer to the 32-byte containing the secret key; it will contain the output tweaked secret
+ * key.
+ * @param[in]  merkle_root
+ *   Pointer to the 32-byte merkle root of the tree of scripts, or NULL if there is no tree.
+ */
+int crypto_tr_tweak_seckey_with_merkle_root(uint8_t seckey[static 32],
+                                            const uint8_t *merkle_root);
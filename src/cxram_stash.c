@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <string.h>
 
 #include "cxram_stash.h"
 #include "cx_ram.h"
@@ -11,8 +12,31 @@ union cx_u G_cx;
 
 #ifdef USE_CXRAM_SECTION
 
+static size_t G_cxram_scratch_size;  // size of the buffer in use in the scratch area, or 0
+
 uint8_t *get_cxram_buffer() {
     return (uint8_t *) &G_cx;
 }
 
+uint8_t *cxram_scratch_acquire(size_t size) {
+    if (G_cxram_scratch_size != 0 || size == 0 || sizeof(G_cx) < CXRAM_SCRATCH_OFFSET ||
+        size > sizeof(G_cx) - CXRAM_SCRATCH_OFFSET) {
+        return NULL;
+    }
+    G_cxram_scratch_size = size;
+    return get_cxram_buffer() + CXRAM_SCRATCH_OFFSET;
+}
+
+void cxram_scratch_release(uint8_t *buffer) {
+    if (buffer == NULL || buffer != get_cxram_buffer() + CXRAM_SCRATCH_OFFSET) {
+        return;
+    }
+    explicit_bzero(buffer, G_cxram_scratch_size);
+    G_cxram_scratch_size = 0;
+}
+
+bool cxram_scratch_in_use(void) {
+    return G_cxram_scratch_size != 0;
+}
+
 #endif
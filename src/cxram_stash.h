@@ -1,5 +1,9 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 /*
  * Due to lack of available stack on NanoS, we make use of a 1K RAM region that is shared between
  * applications and bolos, and used as temporary memory for cryptographic computations.
@@ -9,9 +13,59 @@
  */
 
 /**
- * Returns the address of the 1K cxram section.
+ * Offset of the scratch area within the cxram section. The bytes before it are used by the
+ * short-lived contexts of the app itself (the sha256 context of merkle_combine_hashes, the
+ * ripemd160 context of crypto.c and the limbs of base58_decode), which therefore work while the
+ * scratch area is in use.
  */
+#define CXRAM_SCRATCH_OFFSET 512
 
 #ifdef USE_CXRAM_SECTION
+
+/**
+ * Returns the address of the 1K cxram section.
+ */
 uint8_t *get_cxram_buffer();
-#endif
\ No newline at end of file
+
+/**
+ * Reserves a transient buffer of the given size in the scratch area of the cxram section.
+ *
+ * While the buffer is in use, the caller must not perform any elliptic curve operation (that may
+ * use the whole section); the functions in crypto.c that do so fail if the scratch area is in use.
+ *
+ * @return a pointer to the buffer, or NULL if the size is too large or the scratch area is already
+ * in use.
+ */
+uint8_t *cxram_scratch_acquire(size_t size);
+
+/**
+ * Zeroes and releases the buffer returned by cxram_scratch_acquire.
+ */
+void cxram_scratch_release(uint8_t *buffer);
+
+/**
+ * Returns true if a buffer of the scratch area is currently in use.
+ */
+bool cxram_scratch_in_use(void);
+
+/**
+ * Declares type *name, pointing to a transient buffer of n elements in the scratch area of the
+ * cxram section, or NULL if it is not available; it must be released with CXRAM_SCRATCH_RELEASE.
+ */
+#define CXRAM_SCRATCH_BUFFER(type, name, n) \
+    type *name = (type *) cxram_scratch_acquire((n) * sizeof(type))
+#define CXRAM_SCRATCH_RELEASE(name) cxram_scratch_release((uint8_t *) (name))
+
+#else
+
+static inline bool cxram_scratch_in_use(void) {
+    return false;
+}
+
+// without the cxram section, the transient buffers are in the stack
+#define CXRAM_SCRATCH_BUFFER(type, name, n) \
+    type name##_storage[n];                 \
+    type *name = name##_storage
+#define CXRAM_SCRATCH_RELEASE(name) ((void) (name))
+
+#endif
@@ -6,8 +6,12 @@ int semihosted_printf(const char *format, ...);
 
 void print_stack_pointer(const char *file, int line, const char *func_name);
 
-// Helper macro
-#ifdef HAVE_PRINT_STACK_POINTER
+void stack_profile_sample(const char *func_name);
+
+// Helper macro; in the builds with HAVE_STACK_PROFILE, it records the depth of the stack instead
+#if defined(HAVE_STACK_PROFILE)
+#define PRINT_STACK_POINTER() stack_profile_sample(__func__)
+#elif defined(HAVE_PRINT_STACK_POINTER)
 #define PRINT_STACK_POINTER() print_stack_pointer(__FILE__, __LINE__, __func__)
 #else
 #define PRINT_STACK_POINTER()
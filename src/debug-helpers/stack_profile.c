@@ -0,0 +1,99 @@
+#ifdef HAVE_STACK_PROFILE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "stack_profile.h"
+
+// Bounds of the stack, defined by the linker script of the SDK; the stack grows downwards from
+// _estack. The first words after _stack are left untouched, as they contain the stack canary.
+extern uint32_t _stack;
+extern uint32_t _estack;
+
+#define STACK_PROFILE_GUARD_WORDS 4
+
+// Words that are not painted below the frame of stack_profile_paint, to leave space for the
+// functions it calls
+#define STACK_PROFILE_MARGIN_WORDS 16
+
+#define STACK_PAINT 0xA5A5A5A5
+
+stack_profile_t G_stack_profile;
+
+static bool G_stack_painted;  // false until the stack is painted the first time
+
+static uint32_t *stack_bottom(void) {
+    return &_stack + STACK_PROFILE_GUARD_WORDS;
+}
+
+static uint16_t depth_of(const volatile void *address) {
+    return (uint16_t) ((uintptr_t) &_estack - (uintptr_t) address);
+}
+
+uint16_t stack_profile_stack_size(void) {
+    return depth_of(&_stack);
+}
+
+void __attribute__((noinline)) stack_profile_paint(void) {
+    volatile uint32_t marker = 0;
+    uint32_t *end = (uint32_t *) &marker - STACK_PROFILE_MARGIN_WORDS;
+
+    // the usage since the last painting is accounted for in the global high-water mark
+    if (G_stack_painted) {
+        stack_profile_high_water();
+    }
+    G_stack_painted = true;
+
+    for (uint32_t *p = stack_bottom(); p < end; p++) {
+        *p = STACK_PAINT;
+    }
+}
+
+uint16_t stack_profile_high_water(void) {
+    uint32_t *p = stack_bottom();
+    while (p < &_estack && *p == STACK_PAINT) {
+        ++p;
+    }
+    uint16_t depth = depth_of(p);
+    if (depth > G_stack_profile.max_depth) {
+        G_stack_profile.max_depth = depth;
+    }
+    return depth;
+}
+
+void stack_profile_record(stack_profile_kind_t kind, const void *key, uint16_t depth) {
+    for (unsigned int i = 0; i < G_stack_profile.n_entries; i++) {
+        stack_profile_entry_t *entry = &G_stack_profile.entries[i];
+        if (entry->kind == kind && entry->key == key) {
+            if (depth > entry->max_depth) {
+                entry->max_depth = depth;
+            }
+            return;
+        }
+    }
+
+    if (G_stack_profile.n_entries == STACK_PROFILE_SIZE) {
+        if (G_stack_profile.n_dropped < UINT8_MAX) {
+            ++G_stack_profile.n_dropped;
+        }
+        return;
+    }
+
+    stack_profile_entry_t *entry = &G_stack_profile.entries[G_stack_profile.n_entries++];
+    entry->key = key;
+    entry->kind = kind;
+    entry->max_depth = depth;
+}
+
+void __attribute__((noinline)) stack_profile_sample(const char *func_name) {
+    // the depth in the caller, where the frame of this function begins
+    volatile uint32_t marker = 0;
+    stack_profile_record(STACK_PROFILE_FUNCTION, func_name, depth_of(&marker));
+}
+
+void stack_profile_clear(void) {
+    memset(&G_stack_profile, 0, sizeof(G_stack_profile));
+}
+
+#endif
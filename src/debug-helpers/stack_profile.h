@@ -0,0 +1,73 @@
+#pragma once
+
+#ifdef HAVE_STACK_PROFILE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Stack profiling, only in the builds with HAVE_STACK_PROFILE.
+ *
+ * The unused part of the stack is painted with a known pattern; the deepest word that no longer
+ * contains the pattern gives the high-water mark of the stack usage. The dispatcher measures it for
+ * each processor (painting the stack again before running it), while PRINT_STACK_POINTER records
+ * the depth of the stack in the functions where it is used.
+ */
+
+#ifdef TARGET_NANOS
+#define STACK_PROFILE_SIZE 24
+#else
+#define STACK_PROFILE_SIZE 48
+#endif
+
+typedef enum {
+    STACK_PROFILE_PROCESSOR = 1,  // high-water mark of a processor; the key is its address
+    STACK_PROFILE_FUNCTION = 2,   // depth at a PRINT_STACK_POINTER; the key is the function's name
+} stack_profile_kind_t;
+
+typedef struct {
+    const void *key;
+    uint16_t max_depth;  // in bytes, from the top of the stack
+    uint8_t kind;        // a stack_profile_kind_t
+} stack_profile_entry_t;
+
+typedef struct {
+    stack_profile_entry_t entries[STACK_PROFILE_SIZE];
+    uint8_t n_entries;
+    uint8_t n_dropped;   // number of keys not recorded, as the table was full
+    uint16_t max_depth;  // high-water mark since the stack was painted at startup, or cleared
+} stack_profile_t;
+
+extern stack_profile_t G_stack_profile;
+
+/**
+ * Returns the size of the stack, in bytes.
+ */
+uint16_t stack_profile_stack_size(void);
+
+/**
+ * Paints the unused part of the stack, below the frame of the caller.
+ */
+void stack_profile_paint(void);
+
+/**
+ * Returns the high-water mark of the stack since it was last painted, in bytes.
+ */
+uint16_t stack_profile_high_water(void);
+
+/**
+ * Records the depth for the given key, if larger than the one previously recorded.
+ */
+void stack_profile_record(stack_profile_kind_t kind, const void *key, uint16_t depth);
+
+/**
+ * Records the current depth of the stack in the function with the given name.
+ */
+void stack_profile_sample(const char *func_name);
+
+/**
+ * Clears all the recorded entries and the global high-water mark.
+ */
+void stack_profile_clear(void);
+
+#endif
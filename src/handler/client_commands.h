@@ -6,6 +6,9 @@
 // Used to send results to the host while processing a command
 // Request : context specific
 // Response: empty
+// If the client declares the CLIENT_CAPABILITY_BATCHED_YIELD capability, the device can instead
+// send multiple results in a single request:
+// Request : <CCMD_YIELD : 1> <n : 1> <len_1 : 1> <result_1 : len_1> ... <len_n : 1> <result_n : len_n>
 #define CCMD_YIELD 0x10
 
 /* MERKLE PROOFS */
@@ -25,6 +28,86 @@
 // Response: <is_found(0 or 1) : 1> <leaf_index : 4>
 #define CCMD_GET_MERKLE_LEAF_INDEX 0x42
 
+// Request : <CCMD_GET_MERKLE_MULTIPROOF : 1> <merkle_root : 32> <tree_size : var> <n_leaves : 1>
+//           <leaf_index 1 : var> ... <leaf_index n_leaves : var>
+// Response: <n_hashes : 1> <n_hashes_in_response : 1> <hash 1 : 32> ... <hash
+//           n_hashes_in_response : 32>
+//           The hashes are the leaf hashes of the requested leaves and the roots of the subtrees
+//           containing none of them, in the order of a depth-first, left-to-right visit of the tree;
+//           siblings shared by multiple leaves are therefore only sent once.
+//           If n_hashes_in_response < n_hashes, then subsequent hashes will be given as responses
+//           of CCMD_GET_MORE_ELEMENTS.
+#define CCMD_GET_MERKLE_MULTIPROOF 0x43
+
+// Request : <CCMD_GET_MERKLEIZED_MAP_VALUE : 1> <keys_root : 32> <values_root : 32> <map_size : var>
+//           <key_hash : 32> [<leaf_index : var>]
+//           The optional leaf_index is given if the device already knows the index of the key; then
+//           the key proof is omitted from the response (but leaf_index and proof_size are not).
+// Response: <len = response length : var> <partial_len : 1> <response : partial_len>
+//           The response is <is_found(0 or 1) : 1>, followed if found by:
+//           <leaf_index : var> <proof_size : 1> <key_proof_hash 1 : 32> ...
+//           <key_proof_hash proof_size : 32> <value_len : var> <value : value_len>
+//           <value_proof_hash 1 : 32> ... <value_proof_hash proof_size : 32>
+//           If partial_len < len, the remaining bytes will be given as responses of
+//           CCMD_GET_MORE_ELEMENTS.
+#define CCMD_GET_MERKLEIZED_MAP_VALUE 0x44
+
+// Only used if the client declares the CLIENT_CAPABILITY_STREAM_MERKLE_LEAVES capability.
+// Request : <CCMD_STREAM_MERKLE_LEAVES : 1> <merkle_root : 32> <tree_size : var>
+// Response: <len = stream length : var> <partial_len : 1> <stream : partial_len>
+//           The stream is the concatenation of all the leaves of the tree, without the 0x00
+//           prefix, in order: <leaf_len 1 : var> <leaf 1 : leaf_len 1> ... <leaf_len n : var>
+//           <leaf n : leaf_len n>.
+//           If partial_len < len, the remaining bytes will be given as responses of
+//           CCMD_GET_MORE_ELEMENTS.
+#define CCMD_STREAM_MERKLE_LEAVES 0x45
+
+// Only used if the client declares the CLIENT_CAPABILITY_STRIPPED_RAWTX capability.
+// Request : <CCMD_GET_STRIPPED_RAWTX : 1> <hash : 32>
+//           The hash is the leaf hash of a serialized transaction, like GET_PREIMAGE.
+// Response: <len = stripped tx length : var> <partial_len : 1> <stripped_tx : partial_len>
+//           The stripped tx is the serialization of the transaction without the witnesses.
+//           If partial_len < len, the remaining bytes will be given as responses of
+//           CCMD_GET_MORE_ELEMENTS.
+#define CCMD_GET_STRIPPED_RAWTX 0x46
+
+// Only used if the client declares the CLIENT_CAPABILITY_PARTIAL_MERKLE_PROOF capability.
+// Request : <CCMD_GET_MERKLE_LEAF_PARTIAL_PROOF : 1> <merkle_root : 32> <tree_size : var>
+//           <leaf_index : var> <n : 1>
+// Response: the same as CCMD_GET_MERKLE_LEAF_PROOF, but the proof only contains its first n
+//           elements (the siblings closest to the leaf), and proof_size is n; the device already
+//           knows the rest of the proof from a previous leaf of the same tree.
+#define CCMD_GET_MERKLE_LEAF_PARTIAL_PROOF 0x47
+
+// Only used if the client declares the CLIENT_CAPABILITY_BATCHED_PREIMAGES capability.
+// Request : <CCMD_GET_PREIMAGES : 1> <n : 1> <hash_1 : 32> ... <hash_n : 32>
+//           n is between 1 and MAX_GET_PREIMAGES_HASHES.
+// Response: <len = stream length : var> <partial_len : 1> <stream : partial_len>
+//           The stream is the concatenation of the preimages of the hashes, in order, each
+//           prefixed by its length, as in GET_PREIMAGE: <preimage_len 1 : var>
+//           <preimage 1 : preimage_len 1> ... <preimage_len n : var> <preimage n : preimage_len n>.
+//           If partial_len < len, the remaining bytes will be given as responses of
+//           CCMD_GET_MORE_ELEMENTS.
+#define CCMD_GET_PREIMAGES 0x48
+
+// Maximum number of hashes in a CCMD_GET_PREIMAGES request, so that the request fits in an APDU.
+#define MAX_GET_PREIMAGES_HASHES 7
+
+/* HOST STORAGE */
+
+// Only used if the client declares the CLIENT_CAPABILITY_HOST_STORAGE capability.
+
+// Used to store a record on the host. Each record_id is only stored once during a command; the hmac
+// is computed by the device, and the client does not need to verify it.
+// Request : <CCMD_PUT_RECORD : 1> <record_id : 4> <len : 1> <data : len> <hmac : 32>
+// Response: empty
+#define CCMD_PUT_RECORD 0x50
+
+// Used to retrieve a record previously stored with CCMD_PUT_RECORD during the same command.
+// Request : <CCMD_GET_RECORD : 1> <record_id : 4>
+// Response: <is_found(0 or 1) : 1>, followed if found by <len : 1> <data : len> <hmac : 32>
+#define CCMD_GET_RECORD 0x51
+
 /* GENERIC/MULTIPURPOSE */
 
 // Used to get additional elements from the host when the required response from an interruption did
@@ -33,3 +116,39 @@
 // Response: <n_elements : 1> <el_len = size of each element: 1> <element 1 : el_len> <element 2 :
 // el_len> ... <element n_elements : el_len>
 #define CCMD_GET_MORE_ELEMENTS 0xA0
+
+/* CLIENT CAPABILITIES */
+
+// Bits of the P2 field of the commands, set if the client supports the corresponding feature; the
+// bits from 0x0100 are in the P1 field.
+
+// The client supports CCMD_PUT_RECORD and CCMD_GET_RECORD.
+#define CLIENT_CAPABILITY_HOST_STORAGE 0x01
+
+// The client supports the batched format of CCMD_YIELD.
+#define CLIENT_CAPABILITY_BATCHED_YIELD 0x02
+
+// The client supports CCMD_STREAM_MERKLE_LEAVES.
+#define CLIENT_CAPABILITY_STREAM_MERKLE_LEAVES 0x04
+
+// The client supports CCMD_GET_STRIPPED_RAWTX.
+#define CLIENT_CAPABILITY_STRIPPED_RAWTX 0x08
+
+// The client accepts the checkpoints of SIGN_PSBT among the yielded signatures.
+#define CLIENT_CAPABILITY_SIGN_PSBT_CHECKPOINTS 0x10
+
+// The client shows the digest of the outputs to the user, who reviews the external outputs of
+// SIGN_PSBT in summary (if there are at least SIGN_PSBT_BATCH_REVIEW_MIN_OUTPUTS outputs). It is
+// ignored unless the user enabled the batch review in the settings of the app.
+#define CLIENT_CAPABILITY_BATCH_REVIEW 0x20
+
+// The client supports CCMD_GET_MERKLE_LEAF_PARTIAL_PROOF.
+#define CLIENT_CAPABILITY_PARTIAL_MERKLE_PROOF 0x40
+
+// The client supports CCMD_GET_PREIMAGES.
+#define CLIENT_CAPABILITY_BATCHED_PREIMAGES 0x80
+
+// The client accepts the ECDSA signatures of SIGN_PSBT in the compact encoding: r and s as 32-byte
+// integers instead of DER, followed by the sighash byte only if it is not SIGHASH_ALL. The client
+// re-encodes them in DER for the PSBT_IN_PARTIAL_SIG fields.
+#define CLIENT_CAPABILITY_COMPACT_SIGNATURES 0x0100
@@ -20,15 +20,20 @@
 #include "boilerplate/io.h"
 #include "boilerplate/dispatcher.h"
 #include "boilerplate/sw.h"
+#include "../common/write.h"
 #include "../commands.h"
 #include "../constants.h"
 #include "../crypto.h"
+#include "../cxram_stash.h"
 #include "../ui/display.h"
 #include "../ui/menu.h"
 
+#include "client_commands.h"
+
 extern global_context_t *G_coin_config;
 
 static void send_response(dispatcher_context_t *dc);
+static void compute_extended_pubkeys(dispatcher_context_t *dc);
 
 static bool is_path_safe_for_pubkey_export(const uint32_t bip32_path[],
                                            size_t bip32_path_len,
@@ -146,7 +151,8 @@ void handler_get_extended_pubkey(dispatcher_context_t *dc) {
         return;
     }
 
-    uint32_t coin_types[2] = {G_coin_config->bip44_coin_type, G_coin_config->bip44_coin_type2};
+    uint32_t coin_types[2] = {COIN_CONFIG_BIP44_COIN_TYPE(G_coin_config),
+                              COIN_CONFIG_BIP44_COIN_TYPE_2(G_coin_config)};
     bool is_safe = is_path_safe_for_pubkey_export(bip32_path, bip32_path_len, coin_types, 2);
 
     if (!is_safe && !display) {
@@ -157,23 +163,35 @@ void handler_get_extended_pubkey(dispatcher_context_t *dc) {
     int serialized_pubkey_len =
         get_serialized_extended_pubkey_at_path(bip32_path,
                                                bip32_path_len,
-                                               G_coin_config->bip32_pubkey_version,
+                                               COIN_CONFIG_BIP32_PUBKEY_VERSION(G_coin_config),
                                                state->serialized_pubkey_str);
     if (serialized_pubkey_len == -1) {
         SEND_SW(dc, SW_BAD_STATE);
         return;
     }
 
-    char path_str[MAX_SERIALIZED_BIP32_PATH_LENGTH + 1] = "(Master key)";
-    if (bip32_path_len > 0) {
-        bip32_path_format(bip32_path, bip32_path_len, path_str, sizeof(path_str));
+    if (!display) {
+        dc->next(send_response);
+        return;
     }
 
-    if (display) {
-        ui_display_pubkey(dc, path_str, !is_safe, state->serialized_pubkey_str, send_response);
+    // the path is only needed until it is copied to the state of the UI
+    CXRAM_SCRATCH_BUFFER(char, path_str, MAX_SERIALIZED_BIP32_PATH_LENGTH + 1);
+    if (path_str == NULL) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
+    }
+    if (bip32_path_len > 0) {
+        bip32_path_format(bip32_path,
+                          bip32_path_len,
+                          path_str,
+                          MAX_SERIALIZED_BIP32_PATH_LENGTH + 1);
     } else {
-        dc->next(send_response);
+        strncpy(path_str, "(Master key)", MAX_SERIALIZED_BIP32_PATH_LENGTH + 1);
     }
+
+    ui_display_pubkey(dc, path_str, !is_safe, state->serialized_pubkey_str, send_response);
+    CXRAM_SCRATCH_RELEASE(path_str);
 }
 
 static void send_response(dispatcher_context_t *dc) {
@@ -183,3 +201,248 @@ static void send_response(dispatcher_context_t *dc) {
 
     SEND_RESPONSE(dc, state->serialized_pubkey_str, strlen(state->serialized_pubkey_str), SW_OK);
 }
+
+void handler_get_extended_pubkeys(dispatcher_context_t *dc) {
+    get_extended_pubkey_state_t *state = (get_extended_pubkey_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    // Device must be unlocked
+    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
+        return;
+    }
+
+    if (!buffer_read_u8(&dc->read_buffer, &state->n_paths)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    if (state->n_paths == 0 || state->n_paths > MAX_EXTENDED_PUBKEYS_BATCH_SIZE) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    uint32_t coin_types[2] = {COIN_CONFIG_BIP44_COIN_TYPE(G_coin_config),
+                              COIN_CONFIG_BIP44_COIN_TYPE_2(G_coin_config)};
+
+    // all the paths are read before responding, as the following exchanges overwrite the request
+    for (unsigned int i = 0; i < state->n_paths; i++) {
+        if (!buffer_read_u8(&dc->read_buffer, &state->bip32_paths_len[i])) {
+            SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+            return;
+        }
+
+        if (state->bip32_paths_len[i] > MAX_BIP32_PATH_STEPS) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+
+        if (!buffer_read_bip32_path(&dc->read_buffer,
+                                    state->bip32_paths[i],
+                                    state->bip32_paths_len[i])) {
+            SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+            return;
+        }
+
+        // as the pubkeys are not shown, only paths that are safe to export are accepted
+        if (!is_path_safe_for_pubkey_export(state->bip32_paths[i],
+                                            state->bip32_paths_len[i],
+                                            coin_types,
+                                            2)) {
+            SEND_SW(dc, SW_NOT_SUPPORTED);
+            return;
+        }
+    }
+
+    state->has_parent_key = false;
+
+    state->use_batched_yield = (dc->client_capabilities & CLIENT_CAPABILITY_BATCHED_YIELD) != 0;
+    state->n_yield_buffer_elements = 0;
+    state->yield_buffer_len = 0;
+
+    dc->next(compute_extended_pubkeys);
+}
+
+static void wipe_parent_key(get_extended_pubkey_state_t *state) {
+    explicit_bzero(state->parent_privkey, sizeof(state->parent_privkey));
+    explicit_bzero(state->parent_chain_code, sizeof(state->parent_chain_code));
+    state->has_parent_key = false;
+}
+
+static int bip32_CKDpriv_step(uint8_t privkey[static 32],
+                              uint8_t chain_code[static 32],
+                              uint32_t index) {
+    if (index >= BIP32_FIRST_HARDENED_CHILD) {
+        return bip32_CKDpriv_hardened(privkey, chain_code, index);
+    }
+    return bip32_CKDpriv(privkey, chain_code, index);
+}
+
+// Makes sure that parent_privkey and parent_chain_code are the key at the given path. If the path
+// extends the previous parent key, only the missing steps are derived; otherwise, it is derived
+// from the seed.
+// returns -1 on error. 0 on success.
+static int derive_parent_key(get_extended_pubkey_state_t *state,
+                             const uint32_t parent_path[],
+                             uint8_t parent_path_len) {
+    bool is_extension = state->has_parent_key && state->parent_path_len <= parent_path_len &&
+                        memcmp(state->parent_path,
+                               parent_path,
+                               state->parent_path_len * sizeof(uint32_t)) == 0;
+    if (is_extension && state->parent_path_len == parent_path_len) {
+        return 0;  // same parent
+    }
+
+    if (is_extension) {
+        for (unsigned int i = state->parent_path_len; i < parent_path_len; i++) {
+            if (bip32_CKDpriv_step(state->parent_privkey,
+                                   state->parent_chain_code,
+                                   parent_path[i]) < 0) {
+                wipe_parent_key(state);
+                return -1;
+            }
+        }
+    } else {
+        cx_ecfp_private_key_t private_key = {0};
+        int ret = crypto_derive_private_key(&private_key,
+                                            state->parent_chain_code,
+                                            parent_path,
+                                            parent_path_len);
+        memcpy(state->parent_privkey, private_key.d, sizeof(state->parent_privkey));
+        explicit_bzero(&private_key, sizeof(private_key));
+        if (ret < 0) {
+            wipe_parent_key(state);
+            return -1;
+        }
+    }
+
+    uint8_t parent_pubkey[33];
+    if (crypto_get_compressed_pubkey_from_privkey(state->parent_privkey, parent_pubkey) < 0) {
+        wipe_parent_key(state);
+        return -1;
+    }
+    state->parent_fingerprint = crypto_get_key_fingerprint(parent_pubkey);
+
+    state->has_parent_key = true;
+    state->parent_path_len = parent_path_len;
+    memcpy(state->parent_path, parent_path, parent_path_len * sizeof(uint32_t));
+    return 0;
+}
+
+// Computes the serialized extended pubkey at the given path in serialized_pubkey_str; only the last
+// step is derived from the parent key.
+// returns the length of the serialized pubkey on success, or -1 on error.
+static int derive_extended_pubkey(get_extended_pubkey_state_t *state,
+                                  const uint32_t bip32_path[],
+                                  uint8_t bip32_path_len) {
+    // safe paths have at least 3 steps
+    if (bip32_path_len == 0 || derive_parent_key(state, bip32_path, bip32_path_len - 1) < 0) {
+        return -1;
+    }
+
+    uint32_t child_number = bip32_path[bip32_path_len - 1];
+
+    serialized_extended_pubkey_t ext_pubkey;
+    write_u32_be(ext_pubkey.version, 0, COIN_CONFIG_BIP32_PUBKEY_VERSION(G_coin_config));
+    ext_pubkey.depth = bip32_path_len;
+    write_u32_be(ext_pubkey.parent_fingerprint, 0, state->parent_fingerprint);
+    write_u32_be(ext_pubkey.child_number, 0, child_number);
+
+    uint8_t privkey[32];
+    memcpy(privkey, state->parent_privkey, sizeof(privkey));
+    memcpy(ext_pubkey.chain_code, state->parent_chain_code, sizeof(ext_pubkey.chain_code));
+
+    int ret = 0;
+    if (bip32_CKDpriv_step(privkey, ext_pubkey.chain_code, child_number) < 0 ||
+        crypto_get_compressed_pubkey_from_privkey(privkey, ext_pubkey.compressed_pubkey) < 0) {
+        ret = -1;
+    }
+    explicit_bzero(privkey, sizeof(privkey));
+    if (ret < 0) {
+        return -1;
+    }
+
+    return crypto_serialize_extended_pubkey(&ext_pubkey, state->serialized_pubkey_str);
+}
+
+static int flush_yield_buffer(dispatcher_context_t *dc, get_extended_pubkey_state_t *state) {
+    if (state->n_yield_buffer_elements == 0) {
+        return 0;
+    }
+
+    buffer_t req = dc_get_request_buffer(dc);
+    bool ok = buffer_write_u8(&req, CCMD_YIELD) &&
+              buffer_write_u8(&req, state->n_yield_buffer_elements) &&
+              buffer_write_bytes(&req, state->yield_buffer, state->yield_buffer_len);
+
+    state->n_yield_buffer_elements = 0;
+    state->yield_buffer_len = 0;
+
+    if (!ok || dc_exchange(dc, &req) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Yields the serialized pubkey in serialized_pubkey_str. If the client supports batched yields, it
+// is accumulated in the yield buffer instead, which is flushed when full.
+// returns -1 on error. 0 on success.
+static int yield_extended_pubkey(dispatcher_context_t *dc,
+                                 get_extended_pubkey_state_t *state,
+                                 size_t len) {
+    if (!state->use_batched_yield) {
+        buffer_t req = dc_get_request_buffer(dc);
+        if (!buffer_write_u8(&req, CCMD_YIELD) ||
+            !buffer_write_bytes(&req, (uint8_t *) state->serialized_pubkey_str, len)) {
+            return -1;
+        }
+        return dc_exchange(dc, &req) < 0 ? -1 : 0;
+    }
+
+    if (state->yield_buffer_len + 1 + len > sizeof(state->yield_buffer) &&
+        flush_yield_buffer(dc, state) < 0) {
+        return -1;
+    }
+
+    state->yield_buffer[state->yield_buffer_len] = (uint8_t) len;
+    memcpy(state->yield_buffer + state->yield_buffer_len + 1, state->serialized_pubkey_str, len);
+
+    state->yield_buffer_len += 1 + len;
+    ++state->n_yield_buffer_elements;
+    return 0;
+}
+
+// Derives and yields the extended pubkeys of all the requested paths, in order. Consecutive paths
+// with the same parent (like the accounts of the same purpose and coin type) only require one
+// derivation step each, instead of a full derivation from the seed.
+static void compute_extended_pubkeys(dispatcher_context_t *dc) {
+    get_extended_pubkey_state_t *state = (get_extended_pubkey_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    for (unsigned int i = 0; i < state->n_paths; i++) {
+        int serialized_pubkey_len =
+            derive_extended_pubkey(state, state->bip32_paths[i], state->bip32_paths_len[i]);
+        if (serialized_pubkey_len < 0) {
+            wipe_parent_key(state);
+            SEND_SW(dc, SW_BAD_STATE);
+            return;
+        }
+
+        if (yield_extended_pubkey(dc, state, serialized_pubkey_len) < 0) {
+            wipe_parent_key(state);
+            SEND_SW(dc, SW_BAD_STATE);
+            return;
+        }
+    }
+
+    wipe_parent_key(state);
+
+    if (flush_yield_buffer(dc, state) < 0) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
+    }
+
+    SEND_SW(dc, SW_OK);
+}
@@ -1,11 +1,36 @@
 #pragma once
 
+#include "../crypto.h"
 #include "../common/bip32.h"
 #include "../boilerplate/dispatcher.h"
+#include "../perf_config.h"
+
+// maximum number of paths in a single GET_EXTENDED_PUBKEYS request
+#define MAX_EXTENDED_PUBKEYS_BATCH_SIZE 16
 
 typedef struct {
     machine_context_t ctx;
     char serialized_pubkey_str[MAX_SERIALIZED_PUBKEY_LENGTH + 1];
+
+    // only for GET_EXTENDED_PUBKEYS
+    uint8_t n_paths;
+    uint8_t bip32_paths_len[MAX_EXTENDED_PUBKEYS_BATCH_SIZE];
+    uint32_t bip32_paths[MAX_EXTENDED_PUBKEYS_BATCH_SIZE][MAX_BIP32_PATH_STEPS];
+
+    // the most recently derived parent key, shared between consecutive paths with the same parent
+    bool has_parent_key;
+    uint8_t parent_path_len;
+    uint32_t parent_path[MAX_BIP32_PATH_STEPS];
+    uint8_t parent_privkey[32];
+    uint8_t parent_chain_code[32];
+    uint32_t parent_fingerprint;
+
+    bool use_batched_yield;
+    uint8_t n_yield_buffer_elements;
+    size_t yield_buffer_len;
+    uint8_t yield_buffer[EXTENDED_PUBKEYS_YIELD_BUFFER_LEN];
 } get_extended_pubkey_state_t;
 
 void handler_get_extended_pubkey(dispatcher_context_t *dispatcher_context);
+
+void handler_get_extended_pubkeys(dispatcher_context_t *dispatcher_context);
@@ -25,6 +25,7 @@
 #include "../common/read.h"
 #include "../common/script.h"
 #include "../common/segwit_addr.h"
+#include "../common/write.h"
 #include "../common/wallet.h"
 #include "../commands.h"
 #include "../constants.h"
@@ -34,15 +35,84 @@
 
 #include "lib/policy.h"
 #include "lib/get_preimage.h"
+#include "lib/ownership_token.h"
+#include "lib/wallet_session.h"
 
 #include "get_wallet_address.h"
 #include "client_commands.h"
 
 extern global_context_t *G_coin_config;
 
+static void load_wallet(dispatcher_context_t *dc);
 static void compute_address(dispatcher_context_t *dc);
+static void display_address(dispatcher_context_t *dc);
+static void compute_addresses(dispatcher_context_t *dc);
+static void scan_scripts(dispatcher_context_t *dc);
 static void send_response(dispatcher_context_t *dc);
 
+/**
+ * An address computed by GET_WALLET_ADDRESS for a wallet policy that was verified.
+ */
+typedef struct {
+    bool is_valid;
+    uint32_t last_used;  // value of wallet_address_cache_counter when the entry was last used
+    uint8_t wallet_id[32];
+    uint8_t is_change;
+    uint32_t address_index;
+    int address_len;
+    char address[MAX_ADDRESS_LENGTH_STR + 1];
+} wallet_address_cache_entry_t;
+
+// least recently used cache of the computed addresses; it is only looked up after the wallet policy
+// is verified, and it is cleared by clear_wallet_address_cache
+static uint32_t wallet_address_cache_counter = 0;
+static wallet_address_cache_entry_t wallet_address_cache[WALLET_ADDRESS_CACHE_SIZE];
+
+void clear_wallet_address_cache() {
+    wallet_address_cache_counter = 0;
+    explicit_bzero(wallet_address_cache, sizeof(wallet_address_cache));
+}
+
+// copies the address of the request to the state if it is cached; returns true if it was found
+static bool get_cached_wallet_address(get_wallet_address_state_t *state) {
+    for (int i = 0; i < WALLET_ADDRESS_CACHE_SIZE; i++) {
+        wallet_address_cache_entry_t *cur = &wallet_address_cache[i];
+        if (cur->is_valid && cur->is_change == state->is_change &&
+            cur->address_index == state->address_index &&
+            memcmp(cur->wallet_id, state->wallet_id, 32) == 0) {
+            cur->last_used = ++wallet_address_cache_counter;
+            state->address_len = cur->address_len;
+            memcpy(state->address, cur->address, sizeof(state->address));
+            PERF_COUNT_CACHE(CACHE_WALLET_ADDRESS, hits, sizeof(wallet_address_cache));
+            return true;
+        }
+    }
+    PERF_COUNT_CACHE(CACHE_WALLET_ADDRESS, misses, sizeof(wallet_address_cache));
+    return false;
+}
+
+static void store_cached_wallet_address(const get_wallet_address_state_t *state) {
+    // choose an empty entry, or the least recently used one
+    wallet_address_cache_entry_t *entry = &wallet_address_cache[0];
+    for (int i = 1; i < WALLET_ADDRESS_CACHE_SIZE; i++) {
+        wallet_address_cache_entry_t *cur = &wallet_address_cache[i];
+        if (entry->is_valid && (!cur->is_valid || cur->last_used < entry->last_used)) {
+            entry = cur;
+        }
+    }
+
+    if (entry->is_valid) {
+        PERF_COUNT_CACHE(CACHE_WALLET_ADDRESS, evictions, sizeof(wallet_address_cache));
+    }
+    entry->is_valid = true;
+    entry->last_used = ++wallet_address_cache_counter;
+    memcpy(entry->wallet_id, state->wallet_id, 32);
+    entry->is_change = state->is_change;
+    entry->address_index = state->address_index;
+    entry->address_len = state->address_len;
+    memcpy(entry->address, state->address, sizeof(entry->address));
+}
+
 void handler_get_wallet_address(dispatcher_context_t *dc) {
     LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
 
@@ -77,11 +147,111 @@ void handler_get_wallet_address(dispatcher_context_t *dc) {
         return;
     }
 
-    // Fetch the serialized wallet policy from the client
-    int serialized_wallet_policy_len = call_get_preimage(dc,
+    state->is_batch = false;
+    state->is_scan = false;
+    dc->next(load_wallet);
+}
+
+void handler_get_wallet_addresses(dispatcher_context_t *dc) {
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    get_wallet_address_state_t *state = (get_wallet_address_state_t *) &G_command_state;
+
+    // Device must be unlocked
+    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
+        return;
+    }
+
+    if (!buffer_read_u8(&dc->read_buffer, &state->mode) ||
+        !buffer_read_bytes(&dc->read_buffer, state->wallet_id, 32) ||
+        !buffer_read_bytes(&dc->read_buffer, state->wallet_hmac, 32) ||
+        !buffer_read_u8(&dc->read_buffer, &state->is_change) ||
+        !buffer_read_u32(&dc->read_buffer, &state->address_index, BE) ||
+        !buffer_read_u32(&dc->read_buffer, &state->n_addresses, BE)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    if (state->mode > WALLET_ADDRESSES_MODE_OWNERSHIP_TOKENS ||
+        (state->is_change != 0 && state->is_change != 1) ||
+        state->address_index >= BIP32_FIRST_HARDENED_CHILD || state->n_addresses == 0 ||
+        state->n_addresses > BIP32_FIRST_HARDENED_CHILD - state->address_index) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    state->use_batched_yield = (dc->client_capabilities & CLIENT_CAPABILITY_BATCHED_YIELD) != 0;
+    state->n_yield_buffer_elements = 0;
+    state->yield_buffer_len = 0;
+
+    state->is_batch = true;
+    state->is_scan = false;
+    dc->next(load_wallet);
+}
+
+void handler_scan_wallet_scripts(dispatcher_context_t *dc) {
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    get_wallet_address_state_t *state = (get_wallet_address_state_t *) &G_command_state;
+
+    // Device must be unlocked
+    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
+        return;
+    }
+
+    uint64_t n_scripts;
+    if (!buffer_read_bytes(&dc->read_buffer, state->wallet_id, 32) ||
+        !buffer_read_bytes(&dc->read_buffer, state->wallet_hmac, 32) ||
+        !buffer_read_u32(&dc->read_buffer, &state->address_index, BE) ||
+        !buffer_read_u32(&dc->read_buffer, &state->n_addresses, BE) ||
+        !buffer_read_varint(&dc->read_buffer, &n_scripts) ||
+        !buffer_read_bytes(&dc->read_buffer, state->scripts_merkle_root, 32)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    if (state->address_index >= BIP32_FIRST_HARDENED_CHILD || state->n_addresses == 0 ||
+        state->n_addresses > MAX_SCAN_WINDOW_SIZE ||
+        state->n_addresses > BIP32_FIRST_HARDENED_CHILD - state->address_index ||
+        n_scripts == 0 || n_scripts > UINT32_MAX) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+    state->n_scripts = (uint32_t) n_scripts;
+
+    // both the receive and the change addresses are scanned; this is only used when validating the
+    // derivation path of a default wallet, which is standard for either value
+    state->is_change = 0;
+
+    state->use_batched_yield = (dc->client_capabilities & CLIENT_CAPABILITY_BATCHED_YIELD) != 0;
+    state->n_yield_buffer_elements = 0;
+    state->yield_buffer_len = 0;
+
+    state->is_batch = true;
+    state->is_scan = true;
+    dc->next(load_wallet);
+}
+
+// Fetches and verifies the wallet policy; common to GET_WALLET_ADDRESS and GET_WALLET_ADDRESSES
+static void load_wallet(dispatcher_context_t *dc) {
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    get_wallet_address_state_t *state = (get_wallet_address_state_t *) &G_command_state;
+
+    // Fetch the serialized wallet policy from the client, unless it is in the wallet session
+    int serialized_wallet_policy_len =
+        wallet_session_get_policy(state->wallet_id,
+                                  state->wallet_hmac,
+                                  state->serialized_wallet_policy,
+                                  sizeof(state->serialized_wallet_policy));
+    if (serialized_wallet_policy_len < 0) {
+        serialized_wallet_policy_len = call_get_preimage(dc,
                                                          state->wallet_id,
                                                          state->serialized_wallet_policy,
                                                          sizeof(state->serialized_wallet_policy));
+    }
     if (serialized_wallet_policy_len < 0) {
         SEND_SW(dc, SW_INCORRECT_DATA);
         return;
@@ -99,12 +269,9 @@ void handler_get_wallet_address(dispatcher_context_t *dc) {
            sizeof(state->wallet_header.keys_info_merkle_root));
     state->wallet_header_n_keys = state->wallet_header.n_keys;
 
-    buffer_t policy_map_buffer =
-        buffer_create(&state->wallet_header.policy_map, state->wallet_header.policy_map_len);
-
-    if (parse_policy_map(&policy_map_buffer,
-                         state->wallet_policy_map_bytes,
-                         sizeof(state->wallet_policy_map_bytes)) < 0) {
+    if (parse_wallet_policy_map(&state->wallet_header,
+                                state->wallet_policy_map_bytes,
+                                sizeof(state->wallet_policy_map_bytes)) < 0) {
         SEND_SW(dc, SW_INCORRECT_DATA);
         return;
     }
@@ -159,18 +326,13 @@ void handler_get_wallet_address(dispatcher_context_t *dc) {
         }
 
         // generate pubkey and check if it matches
-        char pubkey_derived[MAX_SERIALIZED_PUBKEY_LENGTH + 1];
-        int serialized_pubkey_len =
-            get_serialized_extended_pubkey_at_path(key_info.master_key_derivation,
-                                                   key_info.master_key_derivation_len,
-                                                   G_coin_config->bip32_pubkey_version,
-                                                   pubkey_derived);
-        if (serialized_pubkey_len == -1) {
+        int ret = check_key_info_pubkey(&key_info, COIN_CONFIG_BIP32_PUBKEY_VERSION(G_coin_config));
+        if (ret == -1) {
             SEND_SW(dc, SW_BAD_STATE);
             return;
         }
 
-        if (strncmp(key_info.ext_pubkey, pubkey_derived, MAX_SERIALIZED_PUBKEY_LENGTH) != 0) {
+        if (ret == 0) {
             SEND_SW(dc, SW_INCORRECT_DATA);
             return;
         }
@@ -180,12 +342,15 @@ void handler_get_wallet_address(dispatcher_context_t *dc) {
         // Based on the address type, we set the expected bip44 purpose for this canonical wallet
         int bip44_purpose = get_bip44_purpose(state->address_type);
 
-        if (key_info.master_key_derivation_len != 3) {
+        // the change step must be the standard one, too
+        if (key_info.master_key_derivation_len != 3 ||
+            (key_info.has_wildcard && (key_info.multipath[0] != 0 || key_info.multipath[1] != 1))) {
             SEND_SW(dc, SW_INCORRECT_DATA);
             return;
         }
 
-        uint32_t coin_types[2] = {G_coin_config->bip44_coin_type, G_coin_config->bip44_coin_type2};
+        uint32_t coin_types[2] = {COIN_CONFIG_BIP44_COIN_TYPE(G_coin_config),
+                                  COIN_CONFIG_BIP44_COIN_TYPE_2(G_coin_config)};
 
         uint32_t bip32_path[5];
         for (int i = 0; i < 3; i++) {
@@ -199,6 +364,31 @@ void handler_get_wallet_address(dispatcher_context_t *dc) {
             return;
         }
 
+        // for a range of addresses, the last one must be standard, too
+        if (state->is_batch) {
+            bip32_path[4] = state->address_index + state->n_addresses - 1;
+            if (!is_address_path_standard(bip32_path, 5, bip44_purpose, coin_types, 2, -1)) {
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
+            }
+        }
+
+        // the key is ours: when computing the address, it is derived from the seed (usually from
+        // the cache of the extended pubkeys) instead of being requested again and decoded
+        serialized_extended_pubkey_t ext_pubkey;
+        if (get_extended_pubkey_at_path(key_info.master_key_derivation,
+                                        key_info.master_key_derivation_len,
+                                        COIN_CONFIG_BIP32_PUBKEY_VERSION(G_coin_config),
+                                        &ext_pubkey) == -1) {
+            SEND_SW(dc, SW_BAD_STATE);
+            return;
+        }
+        memset(&state->pubkeys_cache, 0, sizeof(state->pubkeys_cache));
+        policy_pubkeys_cache_set_single_key(&state->pubkeys_cache,
+                                            &ext_pubkey,
+                                            key_info.has_wildcard,
+                                            key_info.multipath);
+
         state->is_wallet_canonical = true;
     } else {
         // Verify hmac
@@ -209,6 +399,9 @@ void handler_get_wallet_address(dispatcher_context_t *dc) {
             return;
         }
 
+        memset(&state->pubkeys_cache, 0, sizeof(state->pubkeys_cache));
+        wallet_session_load_pubkeys(state->wallet_id, state->wallet_hmac, &state->pubkeys_cache);
+
         state->is_wallet_canonical = false;
     }
 
@@ -220,7 +413,22 @@ void handler_get_wallet_address(dispatcher_context_t *dc) {
         return;
     }
 
-    dc->next(compute_address);
+    // if the client supports it, the key informations are all received at once
+    if (!state->is_wallet_canonical && !state->pubkeys_cache.has_ext_pubkeys &&
+        (dc->client_capabilities & CLIENT_CAPABILITY_STREAM_MERKLE_LEAVES) != 0 &&
+        call_load_policy_pubkeys(dc,
+                                 state->wallet_header_keys_info_merkle_root,
+                                 state->wallet_header_n_keys,
+                                 &state->pubkeys_cache) < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    if (state->is_scan) {
+        dc->next(scan_scripts);
+    } else {
+        dc->next(state->is_batch ? compute_addresses : compute_address);
+    }
 }
 
 // stack-intensive, split from the previous function to optimize stack usage
@@ -229,12 +437,19 @@ static void compute_address(dispatcher_context_t *dc) {
 
     get_wallet_address_state_t *state = (get_wallet_address_state_t *) &G_command_state;
 
+    // the wallet policy is verified at this point; the address is only computed if it is not cached
+    if (get_cached_wallet_address(state)) {
+        dc->next(display_address);
+        return;
+    }
+
     buffer_t script_buf = buffer_create(state->script, sizeof(state->script));
 
     int script_len = call_get_wallet_script(dc,
                                             &state->wallet_policy_map,
                                             state->wallet_header_keys_info_merkle_root,
                                             state->wallet_header_n_keys,
+                                            &state->pubkeys_cache,
                                             state->is_change,
                                             state->address_index,
                                             &script_buf);
@@ -254,6 +469,16 @@ static void compute_address(dispatcher_context_t *dc) {
         return;
     }
 
+    store_cached_wallet_address(state);
+
+    dc->next(display_address);
+}
+
+static void display_address(dispatcher_context_t *dc) {
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    get_wallet_address_state_t *state = (get_wallet_address_state_t *) &G_command_state;
+
     if (state->display_address == 0) {
         dc->next(send_response);
     } else {
@@ -264,6 +489,324 @@ static void compute_address(dispatcher_context_t *dc) {
     }
 }
 
+static int flush_yield_buffer(dispatcher_context_t *dc, get_wallet_address_state_t *state) {
+    if (state->n_yield_buffer_elements == 0) {
+        return 0;
+    }
+
+    buffer_t req = dc_get_request_buffer(dc);
+    bool ok = buffer_write_u8(&req, CCMD_YIELD) &&
+              buffer_write_u8(&req, state->n_yield_buffer_elements) &&
+              buffer_write_bytes(&req, state->yield_buffer, state->yield_buffer_len);
+
+    state->n_yield_buffer_elements = 0;
+    state->yield_buffer_len = 0;
+
+    if (!ok || dc_exchange(dc, &req) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Yields the concatenation of head and tail. If the client supports batched yields, it is
+// accumulated in the yield buffer instead, which is flushed when full.
+// returns -1 on error. 0 on success.
+static int yield_element(dispatcher_context_t *dc,
+                         get_wallet_address_state_t *state,
+                         const uint8_t *head,
+                         size_t head_len,
+                         const uint8_t *tail,
+                         size_t tail_len) {
+    size_t el_len = head_len + tail_len;
+
+    if (!state->use_batched_yield) {
+        buffer_t req = dc_get_request_buffer(dc);
+        if (!buffer_write_u8(&req, CCMD_YIELD) || !buffer_write_bytes(&req, head, head_len) ||
+            !buffer_write_bytes(&req, tail, tail_len)) {
+            return -1;
+        }
+        return dc_exchange(dc, &req) < 0 ? -1 : 0;
+    }
+
+    if (state->yield_buffer_len + 1 + el_len > sizeof(state->yield_buffer) &&
+        flush_yield_buffer(dc, state) < 0) {
+        return -1;
+    }
+
+    uint8_t *p = state->yield_buffer + state->yield_buffer_len;
+    *p++ = (uint8_t) el_len;
+    memcpy(p, head, head_len);
+    memcpy(p + head_len, tail, tail_len);
+
+    state->yield_buffer_len += 1 + el_len;
+    ++state->n_yield_buffer_elements;
+    return 0;
+}
+
+// Yields the address at the current address_index, encoded as <address_index : 4> <address>.
+static int yield_address(dispatcher_context_t *dc, get_wallet_address_state_t *state) {
+    uint8_t address_index[4];
+    write_u32_be(address_index, 0, state->address_index);
+    return yield_element(dc,
+                         state,
+                         address_index,
+                         sizeof(address_index),
+                         (const uint8_t *) state->address,
+                         state->address_len);
+}
+
+// Yields the ownership token of the script of length script_len at the current address_index,
+// encoded as <address_index : 4> <token : 16>.
+static int yield_ownership_token(dispatcher_context_t *dc,
+                                 get_wallet_address_state_t *state,
+                                 size_t script_len) {
+    uint8_t address_index[4];
+    write_u32_be(address_index, 0, state->address_index);
+
+    uint8_t token[OWNERSHIP_TOKEN_LEN];
+    compute_ownership_token(state->wallet_id,
+                            state->is_change,
+                            state->address_index,
+                            state->script,
+                            script_len,
+                            token);
+    return yield_element(dc, state, address_index, sizeof(address_index), token, sizeof(token));
+}
+
+// Computes the addresses at consecutive indexes; the policy is compiled only once, and the pubkeys
+// cache keeps the extended pubkeys of the keys at the change step, so each address only requires
+// the last unhardened derivation of each key.
+// In WALLET_ADDRESSES_MODE_SCRIPTS_ROOT, the scriptPubKeys are accumulated in a Merkle tree
+// instead, and only its root is returned. In WALLET_ADDRESSES_MODE_OWNERSHIP_TOKENS, the ownership
+// token of each scriptPubKey is yielded instead of the address.
+static void compute_addresses(dispatcher_context_t *dc) {
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    get_wallet_address_state_t *state = (get_wallet_address_state_t *) &G_command_state;
+
+    if (compile_policy_script_template(&state->wallet_policy_map, &state->script_template) < 0) {
+        SEND_SW(dc, SW_NOT_SUPPORTED);
+        return;
+    }
+
+    cx_sha256_t addresses_hash_context;
+    cx_sha256_init(&addresses_hash_context);
+
+    merkle_root_builder_init(&state->scripts_merkle_root_builder);
+
+    for (uint32_t i = 0; i < state->n_addresses; i++, state->address_index++) {
+        buffer_t script_buf = buffer_create(state->script, sizeof(state->script));
+
+        int script_len =
+            call_get_wallet_script_from_template(dc,
+                                                 &state->script_template,
+                                                 state->wallet_header_keys_info_merkle_root,
+                                                 state->wallet_header_n_keys,
+                                                 &state->pubkeys_cache,
+                                                 state->is_change,
+                                                 state->address_index,
+                                                 &script_buf);
+        if (script_len < 0) {
+            SEND_SW(dc, SW_BAD_STATE);  // unexpected
+            return;
+        }
+
+        if (state->mode == WALLET_ADDRESSES_MODE_SCRIPTS_ROOT) {
+            // the scriptPubKeys are the leaves; no address is encoded
+            uint8_t leaf_hash[32];
+            merkle_compute_element_hash(state->script, script_len, leaf_hash);
+            merkle_root_builder_add(&state->scripts_merkle_root_builder, leaf_hash);
+            continue;
+        }
+
+        state->address_len = get_script_address(state->script,
+                                                script_len,
+                                                G_coin_config,
+                                                state->address,
+                                                sizeof(state->address));
+        if (state->address_len < 0) {
+            SEND_SW(dc, SW_BAD_STATE);  // unexpected
+            return;
+        }
+
+        // digest of all the addresses, each prefixed by its length
+        crypto_hash_update_u8(&addresses_hash_context.header, (uint8_t) state->address_len);
+        crypto_hash_update(&addresses_hash_context.header, state->address, state->address_len);
+
+        if ((state->mode == WALLET_ADDRESSES_MODE_YIELD && yield_address(dc, state) < 0) ||
+            (state->mode == WALLET_ADDRESSES_MODE_OWNERSHIP_TOKENS &&
+             yield_ownership_token(dc, state, script_len) < 0)) {
+            SEND_SW(dc, SW_BAD_STATE);
+            return;
+        }
+    }
+
+    if (flush_yield_buffer(dc, state) < 0) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
+    }
+
+    uint8_t result[32];
+    if (state->mode == WALLET_ADDRESSES_MODE_SCRIPTS_ROOT) {
+        merkle_root_builder_get_root(&state->scripts_merkle_root_builder, result);
+    } else {
+        crypto_hash_digest(&addresses_hash_context.header, result, 32);
+    }
+
+    SEND_RESPONSE(dc, result, sizeof(result), SW_OK);
+}
+
+// Computes the leaf hash of the script at position window_pos of the scanned window.
+// returns -1 on error. 0 on success.
+static int get_window_script_hash(dispatcher_context_t *dc,
+                                  get_wallet_address_state_t *state,
+                                  uint32_t window_pos,
+                                  uint8_t leaf_hash[static 32]) {
+    buffer_t script_buf = buffer_create(state->script, sizeof(state->script));
+
+    int script_len =
+        call_get_wallet_script_from_template(dc,
+                                             &state->script_template,
+                                             state->wallet_header_keys_info_merkle_root,
+                                             state->wallet_header_n_keys,
+                                             &state->pubkeys_cache,
+                                             window_pos / state->n_addresses,
+                                             state->address_index + window_pos % state->n_addresses,
+                                             &script_buf);
+    if (script_len < 0) {
+        return -1;
+    }
+
+    merkle_compute_element_hash(state->script, script_len, leaf_hash);
+    return 0;
+}
+
+// Looks up the leaf hash of the script at position list_index of the list in the table of the
+// derived scripts, and yields <list_index : 4> <change : 1> <address_index : 4> if found.
+// returns -1 on error. 0 on success.
+static int match_script(dispatcher_context_t *dc,
+                        get_wallet_address_state_t *state,
+                        uint32_t list_index,
+                        const uint8_t leaf_hash[static 32]) {
+    uint32_t short_hash = read_u32_be(leaf_hash, 0);
+    size_t n_entries = 2 * state->n_addresses;
+
+    // find the first entry with the same short hash
+    size_t lo = 0, hi = n_entries;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (state->scan_table[mid].short_hash < short_hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // short hashes can collide: the script is derived again to compare the full hash
+    for (; lo < n_entries && state->scan_table[lo].short_hash == short_hash; lo++) {
+        uint32_t window_pos = state->scan_table[lo].window_pos;
+
+        uint8_t derived_leaf_hash[32];
+        if (get_window_script_hash(dc, state, window_pos, derived_leaf_hash) < 0) {
+            return -1;
+        }
+        if (memcmp(derived_leaf_hash, leaf_hash, 32) != 0) {
+            continue;
+        }
+
+        uint8_t match[4 + 1 + 4];
+        write_u32_be(match, 0, list_index);
+        match[4] = (uint8_t) (window_pos / state->n_addresses);
+        write_u32_be(match, 5, state->address_index + window_pos % state->n_addresses);
+
+        ++state->n_matches;
+        return yield_element(dc, state, match, 5, match + 5, 4);
+    }
+    return 0;
+}
+
+// Derives the receive and change scripts of the window once, storing the first 4 bytes of their
+// leaf hashes in a sorted table; then, the leaf hashes of the scripts in the client's list are
+// requested and looked up in the table, so each script of the list only costs a binary search.
+static void scan_scripts(dispatcher_context_t *dc) {
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    get_wallet_address_state_t *state = (get_wallet_address_state_t *) &G_command_state;
+
+    if (compile_policy_script_template(&state->wallet_policy_map, &state->script_template) < 0) {
+        SEND_SW(dc, SW_NOT_SUPPORTED);
+        return;
+    }
+
+    size_t n_entries = 2 * state->n_addresses;
+    for (uint32_t window_pos = 0; window_pos < n_entries; window_pos++) {
+        uint8_t leaf_hash[32];
+        if (get_window_script_hash(dc, state, window_pos, leaf_hash) < 0) {
+            SEND_SW(dc, SW_BAD_STATE);  // unexpected
+            return;
+        }
+
+        // insertion sort, as the table is small
+        uint32_t short_hash = read_u32_be(leaf_hash, 0);
+        size_t j = window_pos;
+        while (j > 0 && state->scan_table[j - 1].short_hash > short_hash) {
+            state->scan_table[j] = state->scan_table[j - 1];
+            --j;
+        }
+        state->scan_table[j].short_hash = short_hash;
+        state->scan_table[j].window_pos = window_pos;
+    }
+
+    state->n_matches = 0;
+
+    // the leaf hashes are requested with a multiproof if the list is small enough
+    bool use_multiproof = state->n_scripts <= (1U << MAX_MERKLE_MULTIPROOF_DEPTH);
+
+    for (uint32_t i = 0; i < state->n_scripts;) {
+        size_t n_leaves = 1;
+        if (use_multiproof) {
+            n_leaves = MIN(MAX_MERKLE_MULTIPROOF_LEAVES, state->n_scripts - i);
+
+            uint32_t leaf_indices[MAX_MERKLE_MULTIPROOF_LEAVES];
+            for (size_t k = 0; k < n_leaves; k++) {
+                leaf_indices[k] = i + k;
+            }
+            if (call_get_merkle_leaf_hashes(dc,
+                                            state->scripts_merkle_root,
+                                            state->n_scripts,
+                                            n_leaves,
+                                            leaf_indices,
+                                            state->scan_leaf_hashes) < 0) {
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
+            }
+        } else if (call_get_merkle_leaf_hash(dc,
+                                             state->scripts_merkle_root,
+                                             state->n_scripts,
+                                             i,
+                                             state->scan_leaf_hashes[0]) < 0) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+
+        for (size_t k = 0; k < n_leaves; k++, i++) {
+            if (match_script(dc, state, i, state->scan_leaf_hashes[k]) < 0) {
+                SEND_SW(dc, SW_BAD_STATE);
+                return;
+            }
+        }
+    }
+
+    if (flush_yield_buffer(dc, state) < 0) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
+    }
+
+    uint8_t response[4];
+    write_u32_be(response, 0, state->n_matches);
+    SEND_RESPONSE(dc, response, sizeof(response), SW_OK);
+}
+
 static void send_response(dispatcher_context_t *dc) {
     get_wallet_address_state_t *state = (get_wallet_address_state_t *) &G_command_state;
 
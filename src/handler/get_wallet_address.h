@@ -2,10 +2,21 @@
 
 #include "../crypto.h"
 #include "../common/bip32.h"
+#include "../common/merkle.h"
 #include "../common/wallet.h"
 #include "../boilerplate/dispatcher.h"
+#include "../perf_config.h"
 
 #include "lib/get_merkle_leaf_element.h"
+#include "lib/get_merkle_leaf_hash.h"
+#include "lib/policy.h"
+
+// modes of GET_WALLET_ADDRESSES
+#define WALLET_ADDRESSES_MODE_DIGEST       0  // only return the digest of the addresses
+#define WALLET_ADDRESSES_MODE_YIELD        1  // also yield each of the addresses
+#define WALLET_ADDRESSES_MODE_SCRIPTS_ROOT 2  // return the Merkle root of the scriptPubKeys
+#define WALLET_ADDRESSES_MODE_OWNERSHIP_TOKENS \
+    3  // also yield the ownership token of each of the scriptPubKeys
 
 typedef struct {
     machine_context_t ctx;
@@ -14,6 +25,17 @@ typedef struct {
     uint8_t is_change;
     uint8_t display_address;
 
+    // only for GET_WALLET_ADDRESSES; address_index is the index of the next address to compute
+    bool is_batch;
+    uint8_t mode;  // one of the WALLET_ADDRESSES_MODE_* constants
+    uint32_t n_addresses;
+
+    // only for SCAN_WALLET_SCRIPTS; the window is given by address_index and n_addresses
+    bool is_scan;
+    uint32_t n_scripts;
+    uint8_t scripts_merkle_root[32];
+    uint32_t n_matches;
+
     bool is_wallet_canonical;
     int address_type;
 
@@ -35,12 +57,48 @@ typedef struct {
         policy_node_t wallet_policy_map;
     };
 
+    // for canonical wallets, it contains our key derived from the seed; otherwise, it is empty
+    policy_pubkeys_cache_t pubkeys_cache;
+
     uint8_t script[MAX_PREVOUT_SCRIPTPUBKEY_LEN];
 
     int address_len;
     char address[MAX_ADDRESS_LENGTH_STR + 1];  // null-terminated string
 
     uint8_t key_info_str[MAX_POLICY_KEY_INFO_LEN];
+
+    // only for GET_WALLET_ADDRESSES
+    policy_script_template_t script_template;
+
+    union {
+        // only for WALLET_ADDRESSES_MODE_SCRIPTS_ROOT
+        merkle_root_builder_t scripts_merkle_root_builder;
+
+        // only for SCAN_WALLET_SCRIPTS: the first 4 bytes of the leaf hash of each of the derived
+        // scripts, sorted; each entry also contains the index of the script in the window
+        struct {
+            uint32_t short_hash;
+            uint32_t window_pos;  // change * n_addresses + (address index - start of the window)
+        } scan_table[2 * MAX_SCAN_WINDOW_SIZE];
+    };
+
+    // only for SCAN_WALLET_SCRIPTS: the leaf hashes of the scripts of the list being scanned
+    uint8_t scan_leaf_hashes[MAX_MERKLE_MULTIPROOF_LEAVES][32];
+
+    bool use_batched_yield;
+    uint8_t n_yield_buffer_elements;
+    size_t yield_buffer_len;
+    uint8_t yield_buffer[ADDRESSES_YIELD_BUFFER_LEN];
 } get_wallet_address_state_t;
 
 void handler_get_wallet_address(dispatcher_context_t *dispatcher_context);
+
+void handler_get_wallet_addresses(dispatcher_context_t *dispatcher_context);
+
+void handler_scan_wallet_scripts(dispatcher_context_t *dispatcher_context);
+
+/**
+ * Clears the cache of the addresses computed by GET_WALLET_ADDRESS. It is called when the device is
+ * locked.
+ */
+void clear_wallet_address_cache();
@@ -0,0 +1,104 @@
+#include <string.h>
+
+#include "authenticated_token.h"
+
+#include "../../crypto.h"
+
+#define LABEL_ENTRY(label) \
+    { label, sizeof(label) - 1 }  // sizeof counts the terminating 0
+
+static const struct {
+    const char *label;
+    size_t label_len;
+} key_labels[N_AUTH_TOKEN_KEYS] = {
+    [AUTH_TOKEN_KEY_OWNERSHIP] = LABEL_ENTRY(OWNERSHIP_TOKEN_SLIP0021_LABEL),
+    [AUTH_TOKEN_KEY_PREVOUT] = LABEL_ENTRY(PREVOUT_TOKEN_SLIP0021_LABEL),
+    [AUTH_TOKEN_KEY_SIGN_PSBT_CHECKPOINT] = LABEL_ENTRY(SIGN_PSBT_CHECKPOINT_SLIP0021_LABEL),
+    [AUTH_TOKEN_KEY_HOST_STORAGE] = LABEL_ENTRY(HOST_STORAGE_SLIP0021_LABEL),
+};
+
+static bool is_key_initialized[N_AUTH_TOKEN_KEYS];
+static uint8_t keys[N_AUTH_TOKEN_KEYS][32];
+
+static bool has_nonce(authenticated_token_key_id_t key_id) {
+    return key_id == AUTH_TOKEN_KEY_SIGN_PSBT_CHECKPOINT || key_id == AUTH_TOKEN_KEY_HOST_STORAGE;
+}
+
+static void init_key(authenticated_token_key_id_t key_id) {
+    if (!has_nonce(key_id)) {
+        crypto_derive_symmetric_key(key_labels[key_id].label,
+                                    key_labels[key_id].label_len,
+                                    keys[key_id]);
+        is_key_initialized[key_id] = true;
+        return;
+    }
+
+    uint8_t symmetric_key[32];
+    uint8_t nonce[32];
+
+    BEGIN_TRY {
+        TRY {
+            crypto_derive_symmetric_key(key_labels[key_id].label,
+                                        key_labels[key_id].label_len,
+                                        symmetric_key);
+            cx_rng(nonce, sizeof(nonce));
+
+            cx_hmac_sha256(symmetric_key,
+                           sizeof(symmetric_key),
+                           nonce,
+                           sizeof(nonce),
+                           keys[key_id],
+                           sizeof(keys[key_id]));
+            is_key_initialized[key_id] = true;
+        }
+        FINALLY {
+            explicit_bzero(symmetric_key, sizeof(symmetric_key));
+        }
+    }
+    END_TRY;
+}
+
+void authenticated_token_compute(authenticated_token_key_id_t key_id,
+                                 const uint8_t *data,
+                                 size_t data_len,
+                                 uint8_t *out,
+                                 size_t out_len) {
+    if (!is_key_initialized[key_id]) {
+        init_key(key_id);
+    }
+
+    uint8_t hmac[32];
+    cx_hmac_sha256(keys[key_id], sizeof(keys[key_id]), data, data_len, hmac, sizeof(hmac));
+    memcpy(out, hmac, MIN(out_len, sizeof(hmac)));
+    explicit_bzero(hmac, sizeof(hmac));
+}
+
+bool authenticated_token_check(authenticated_token_key_id_t key_id,
+                               const uint8_t *data,
+                               size_t data_len,
+                               const uint8_t *token,
+                               size_t token_len) {
+    if (token_len == 0 || token_len > AUTHENTICATED_TOKEN_MAX_LEN) {
+        return false;
+    }
+
+    uint8_t correct_token[AUTHENTICATED_TOKEN_MAX_LEN];
+    authenticated_token_compute(key_id, data, data_len, correct_token, token_len);
+
+    // It is important to use a constant-time function to compare the tokens, to avoid timing
+    // attacks that could be exploited to forge one.
+    bool result = os_secure_memcmp((void *) token, (void *) correct_token, token_len) == 0;
+    explicit_bzero(correct_token, sizeof(correct_token));
+    return result;
+}
+
+void clear_authenticated_token_key(authenticated_token_key_id_t key_id) {
+    is_key_initialized[key_id] = false;
+    explicit_bzero(keys[key_id], sizeof(keys[key_id]));
+}
+
+void clear_authenticated_token_keys() {
+    for (int i = 0; i < N_AUTH_TOKEN_KEYS; i++) {
+        clear_authenticated_token_key((authenticated_token_key_id_t) i);
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The labels used to derive, according to SLIP-0021, the symmetric keys of the authenticated
+ * tokens that the app hands to the host and later accepts back.
+ */
+#define OWNERSHIP_TOKEN_SLIP0021_LABEL      "\0LEDGER-Ownership token"
+#define PREVOUT_TOKEN_SLIP0021_LABEL        "\0LEDGER-Trusted prevout"
+#define SIGN_PSBT_CHECKPOINT_SLIP0021_LABEL "\0LEDGER-PSBT checkpoint"
+#define HOST_STORAGE_SLIP0021_LABEL         "\0LEDGER-Host storage"
+
+/**
+ * Maximum length of an authenticated token, that is the length of an HMAC-SHA256.
+ */
+#define AUTHENTICATED_TOKEN_MAX_LEN 32
+
+/**
+ * The keys of the authenticated tokens. The keys of the tokens that must only be accepted until the
+ * app is restarted (or the key is cleared) are derived from the symmetric key of their label and a
+ * random nonce; the others only from the symmetric key, therefore their tokens remain valid as long
+ * as the seed is the same.
+ */
+typedef enum {
+    AUTH_TOKEN_KEY_OWNERSHIP = 0,         // OWNERSHIP_TOKEN_SLIP0021_LABEL
+    AUTH_TOKEN_KEY_PREVOUT,               // PREVOUT_TOKEN_SLIP0021_LABEL
+    AUTH_TOKEN_KEY_SIGN_PSBT_CHECKPOINT,  // SIGN_PSBT_CHECKPOINT_SLIP0021_LABEL, with a nonce
+    AUTH_TOKEN_KEY_HOST_STORAGE,          // HOST_STORAGE_SLIP0021_LABEL, with a nonce
+    N_AUTH_TOKEN_KEYS
+} authenticated_token_key_id_t;
+
+/**
+ * Computes the token of some data, that is the first out_len bytes of its HMAC-SHA256 with the
+ * given key. The key is derived when it is first needed, and kept until it is cleared.
+ *
+ * @param[in] key_id
+ *   The key of the token.
+ * @param[in] data
+ *   The authenticated data.
+ * @param[in] data_len
+ *   The length of data.
+ * @param[out] out
+ *   Pointer to the output buffer for the token.
+ * @param[in] out_len
+ *   The length of the token, at most AUTHENTICATED_TOKEN_MAX_LEN.
+ */
+void authenticated_token_compute(authenticated_token_key_id_t key_id,
+                                 const uint8_t *data,
+                                 size_t data_len,
+                                 uint8_t *out,
+                                 size_t out_len);
+
+/**
+ * Verifies, in constant time, the token of some data computed with authenticated_token_compute.
+ *
+ * @return true if the token is valid, false otherwise.
+ */
+bool authenticated_token_check(authenticated_token_key_id_t key_id,
+                               const uint8_t *data,
+                               size_t data_len,
+                               const uint8_t *token,
+                               size_t token_len);
+
+/**
+ * Forgets a key; it is derived again when it is next needed. If it is derived with a nonce, all
+ * the tokens computed so far with it become invalid.
+ */
+void clear_authenticated_token_key(authenticated_token_key_id_t key_id);
+
+/**
+ * Forgets all the keys of the authenticated tokens.
+ */
+void clear_authenticated_token_keys();
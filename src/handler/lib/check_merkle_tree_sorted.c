@@ -2,29 +2,167 @@
 
 #include "check_merkle_tree_sorted.h"
 #include "get_merkle_leaf_element.h"
+#include "get_merkle_leaf_hash.h"
+#include "get_merkle_preimage.h"
+#include "stream_merkle_leaves.h"
+
+#include "../../common/merkle.h"
+#include "../client_commands.h"
+
+// number of leaf hashes requested with each multiproof
+#define CHECK_MERKLE_TREE_SORTED_BATCH_SIZE 4
+
+_Static_assert(CHECK_MERKLE_TREE_SORTED_BATCH_SIZE <= MAX_GET_PREIMAGES_HASHES,
+               "A batch must fit in a single GET_PREIMAGES request");
 
 static int compare_byte_arrays(const uint8_t array1[],
                                size_t array1_len,
                                const uint8_t array2[],
                                size_t array2_len);
 
+typedef struct {
+    dispatcher_callback_descriptor_t callback;
+    bool has_prev_el;
+    uint8_t prev_el[MAX_CHECK_MERKLE_TREE_SORTED_PREIMAGE_SIZE];
+    size_t prev_el_len;
+} check_sorted_stream_state_t;
+
+// checks the order of each leaf against the previous one, then calls the callback
+static int check_sorted_next_leaf(check_sorted_stream_state_t *state, buffer_t *leaf) {
+    const uint8_t *cur_el = buffer_get_cur(leaf);
+    size_t cur_el_len = leaf->size - leaf->offset;
+
+    if (state->has_prev_el &&
+        compare_byte_arrays(state->prev_el, state->prev_el_len, cur_el, cur_el_len) >= 0) {
+        // elements are not in (strict) lexicographical order
+        PRINTF("Keys not in order\n");
+        return -1;
+    }
+
+    memcpy(state->prev_el, cur_el, cur_el_len);
+    state->prev_el_len = cur_el_len;
+    state->has_prev_el = true;
+
+    if (state->callback.fn != NULL) {
+        state->callback.fn(state->callback.state, leaf);
+    }
+    return 0;
+}
+
+// callback of call_stream_merkle_leaves
+static int check_sorted_stream_callback(uint32_t index, buffer_t *leaf, void *state_ptr) {
+    (void) index;
+    return check_sorted_next_leaf((check_sorted_stream_state_t *) state_ptr, leaf);
+}
+
+// callback of call_get_merkle_preimages
+static int check_sorted_preimages_callback(size_t index, buffer_t *leaf, void *state_ptr) {
+    (void) index;
+    return check_sorted_next_leaf((check_sorted_stream_state_t *) state_ptr, leaf);
+}
+
 int call_check_merkle_tree_sorted_with_callback(dispatcher_context_t *dispatcher_context,
                                                 const uint8_t root[static 32],
                                                 size_t size,
                                                 dispatcher_callback_descriptor_t callback) {
     // LOG_PROCESSOR(dispatcher_context, __FILE__, __LINE__, __func__);
 
+    // if the client supports it, all the elements are received in a single stream, and the Merkle
+    // root is recomputed from them instead of verifying a proof for each element
+    if ((dispatcher_context->client_capabilities & CLIENT_CAPABILITY_STREAM_MERKLE_LEAVES) != 0 &&
+        size > 0 && size <= MAX_STREAM_MERKLE_LEAVES_TREE_SIZE) {
+        check_sorted_stream_state_t state = {.callback = callback, .has_prev_el = false};
+        uint8_t cur_el[MAX_CHECK_MERKLE_TREE_SORTED_PREIMAGE_SIZE];
+        return call_stream_merkle_leaves(dispatcher_context,
+                                         root,
+                                         size,
+                                         cur_el,
+                                         sizeof(cur_el),
+                                         check_sorted_stream_callback,
+                                         &state);
+    }
+
+    // if the tree is small enough, the leaf hashes are fetched in batches with a single multiproof
+    bool use_multiproof = ceil_lg(size) <= MAX_MERKLE_MULTIPROOF_DEPTH;
+
+    uint8_t leaf_hashes[CHECK_MERKLE_TREE_SORTED_BATCH_SIZE][32];
+    uint32_t leaf_indices[CHECK_MERKLE_TREE_SORTED_BATCH_SIZE];
+
+    // if the client supports it, the preimages of each batch are also fetched at once
+    if (use_multiproof &&
+        (dispatcher_context->client_capabilities & CLIENT_CAPABILITY_BATCHED_PREIMAGES) != 0) {
+        check_sorted_stream_state_t state = {.callback = callback, .has_prev_el = false};
+        uint8_t cur_el[MAX_CHECK_MERKLE_TREE_SORTED_PREIMAGE_SIZE];
+
+        for (size_t first_el_idx = 0; first_el_idx < size;
+             first_el_idx += CHECK_MERKLE_TREE_SORTED_BATCH_SIZE) {
+            size_t batch_size = size - first_el_idx;
+            if (batch_size > CHECK_MERKLE_TREE_SORTED_BATCH_SIZE) {
+                batch_size = CHECK_MERKLE_TREE_SORTED_BATCH_SIZE;
+            }
+            for (size_t i = 0; i < batch_size; i++) {
+                leaf_indices[i] = first_el_idx + i;
+            }
+
+            if (0 > call_get_merkle_leaf_hashes(dispatcher_context,
+                                                root,
+                                                size,
+                                                batch_size,
+                                                leaf_indices,
+                                                leaf_hashes) ||
+                0 > call_get_merkle_preimages(dispatcher_context,
+                                              (const uint8_t(*)[32]) leaf_hashes,
+                                              batch_size,
+                                              cur_el,
+                                              sizeof(cur_el),
+                                              check_sorted_preimages_callback,
+                                              &state)) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
     int prev_el_len = 0;
     uint8_t prev_el[MAX_CHECK_MERKLE_TREE_SORTED_PREIMAGE_SIZE];
 
     for (size_t cur_el_idx = 0; cur_el_idx < size; cur_el_idx++) {
+        size_t batch_pos = cur_el_idx % CHECK_MERKLE_TREE_SORTED_BATCH_SIZE;
+
+        if (use_multiproof && batch_pos == 0) {
+            size_t batch_size = size - cur_el_idx;
+            if (batch_size > CHECK_MERKLE_TREE_SORTED_BATCH_SIZE) {
+                batch_size = CHECK_MERKLE_TREE_SORTED_BATCH_SIZE;
+            }
+            for (size_t i = 0; i < batch_size; i++) {
+                leaf_indices[i] = cur_el_idx + i;
+            }
+
+            if (0 > call_get_merkle_leaf_hashes(dispatcher_context,
+                                                root,
+                                                size,
+                                                batch_size,
+                                                leaf_indices,
+                                                leaf_hashes)) {
+                return -1;
+            }
+        }
+
         uint8_t cur_el[MAX_CHECK_MERKLE_TREE_SORTED_PREIMAGE_SIZE];
-        int cur_el_len = call_get_merkle_leaf_element(dispatcher_context,
+        int cur_el_len;
+        if (use_multiproof) {
+            cur_el_len = call_get_merkle_preimage(dispatcher_context,
+                                                  leaf_hashes[batch_pos],
+                                                  cur_el,
+                                                  sizeof(cur_el));
+        } else {
+            cur_el_len = call_get_merkle_leaf_element(dispatcher_context,
                                                       root,
                                                       size,
                                                       cur_el_idx,
                                                       cur_el,
                                                       sizeof(cur_el));
+        }
 
         if (cur_el_len < 0) {
             return -1;
@@ -11,6 +11,10 @@
  * (verifying Merkle proofs) and verifies that the leaf preimages are in lexicographical order. If a
  * callback to a non-NULL function is given, it is called once for each of the elements of the
  * Merkle tree, in lexicographical order.
+ * If the client declares the CLIENT_CAPABILITY_STREAM_MERKLE_LEAVES capability and the tree has at
+ * most MAX_STREAM_MERKLE_LEAVES_TREE_SIZE elements, they are all received with a single
+ * STREAM_MERKLE_LEAVES command, and the Merkle root is only verified after the last one; in any
+ * case, the caller must discard anything computed by the callback if this function fails.
  *
  * Returns 0 on success, or a negative number on failure.
  */
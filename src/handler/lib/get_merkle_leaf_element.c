@@ -23,3 +23,40 @@ int call_get_merkle_leaf_element(dispatcher_context_t *dispatcher_context,
     }
     return call_get_merkle_preimage(dispatcher_context, leaf_hash, out_ptr, out_ptr_len);
 }
+
+void co_get_merkle_leaf_element_init(co_get_merkle_leaf_element_t *state,
+                                     const uint8_t merkle_root[static 32],
+                                     uint32_t tree_size,
+                                     uint32_t leaf_index,
+                                     uint8_t *out_ptr,
+                                     size_t out_ptr_len) {
+    state->result = -1;
+    state->out_ptr = out_ptr;
+    state->out_ptr_len = out_ptr_len;
+    co_get_merkle_leaf_hash_init(&state->sub.get_leaf_hash,
+                                 merkle_root,
+                                 tree_size,
+                                 leaf_index,
+                                 state->leaf_hash);
+}
+
+void co_get_merkle_leaf_element(dispatcher_context_t *dc) {
+    co_get_merkle_leaf_element_t *state = (co_get_merkle_leaf_element_t *) dc->machine_context_ptr;
+
+    CO_BEGIN(&state->co, co_get_merkle_leaf_element);
+
+    CO_CALL(dc, &state->co, &state->sub.get_leaf_hash.co, co_get_merkle_leaf_hash);
+    if (state->sub.get_leaf_hash.result < 0) {
+        state->result = state->sub.get_leaf_hash.result;
+        return;
+    }
+
+    co_get_merkle_preimage_init(&state->sub.get_preimage,
+                                state->leaf_hash,
+                                state->out_ptr,
+                                state->out_ptr_len);
+    CO_CALL(dc, &state->co, &state->sub.get_preimage.co, co_get_merkle_preimage);
+    state->result = state->sub.get_preimage.result;
+
+    CO_END(&state->co);
+}
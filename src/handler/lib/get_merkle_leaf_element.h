@@ -1,7 +1,11 @@
 #pragma once
 
+#include "../../boilerplate/coroutine.h"
 #include "../../boilerplate/dispatcher.h"
 
+#include "get_merkle_leaf_hash.h"
+#include "get_merkle_preimage.h"
+
 /**
  * TODO: docs
  */
@@ -11,3 +15,39 @@ int call_get_merkle_leaf_element(dispatcher_context_t *dispatcher_context,
                                  uint32_t leaf_index,
                                  uint8_t *out_ptr,
                                  size_t out_ptr_len);
+
+/**
+ * State of the coroutine version of call_get_merkle_leaf_element.
+ */
+typedef struct {
+    coroutine_t co;
+    // the return value of call_get_merkle_leaf_element; set when the coroutine ends
+    int result;
+
+    // inputs; the memory they point to must stay valid until the coroutine ends
+    uint8_t *out_ptr;
+    size_t out_ptr_len;
+
+    uint8_t leaf_hash[32];
+    union {
+        co_get_merkle_leaf_hash_t get_leaf_hash;
+        co_get_merkle_preimage_t get_preimage;
+    } sub;
+} co_get_merkle_leaf_element_t;
+
+/**
+ * Initializes the state of co_get_merkle_leaf_element, with the same arguments as
+ * call_get_merkle_leaf_element; the coroutine is then started with co_start or CO_CALL.
+ */
+void co_get_merkle_leaf_element_init(co_get_merkle_leaf_element_t *state,
+                                     const uint8_t merkle_root[static 32],
+                                     uint32_t tree_size,
+                                     uint32_t leaf_index,
+                                     uint8_t *out_ptr,
+                                     size_t out_ptr_len);
+
+/**
+ * Coroutine version of call_get_merkle_leaf_element, that does not keep its frame on the stack
+ * while waiting for the responses of the client.
+ */
+void co_get_merkle_leaf_element(dispatcher_context_t *dispatcher_context);
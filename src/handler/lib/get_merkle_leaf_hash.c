@@ -9,6 +9,96 @@
 #include "../../boilerplate/sw.h"
 #include "../client_commands.h"
 
+// Writes the GET_MERKLE_LEAF_PROOF request. Returns false if it does not fit in the buffer.
+static bool write_leaf_proof_request(buffer_t *req,
+                                     const uint8_t merkle_root[static 32],
+                                     uint32_t tree_size,
+                                     uint32_t leaf_index) {
+    return buffer_write_u8(req, CCMD_GET_MERKLE_LEAF_PROOF) &&
+           buffer_write_bytes(req, merkle_root, 32) && buffer_write_varint(req, tree_size) &&
+           buffer_write_varint(req, leaf_index);
+}
+
+// Parses the response to GET_MERKLE_LEAF_PROOF, and initializes the proof verification with the
+// leaf hash. The proof elements in the response are left in the read buffer.
+static int read_leaf_proof_response(buffer_t *read_buffer,
+                                    merkle_leaf_proof_t *proof,
+                                    uint8_t *n_proof_elements) {
+    if (!buffer_read_bytes(read_buffer, proof->cur_hash, 32) ||
+        !buffer_read_u8(read_buffer, &proof->proof_size) ||
+        !buffer_read_u8(read_buffer, n_proof_elements)) {
+        return -1;
+    }
+
+    if (*n_proof_elements > proof->proof_size) {
+        PRINTF("Received more proof data than expected.\n");
+
+        // Wrong length of the Merkle proof.
+        return -1;
+    }
+
+    if (!buffer_can_read(read_buffer, 32 * (size_t) *n_proof_elements)) {
+        return -1;
+    }
+
+    proof->cur_step = 0;
+    return 0;
+}
+
+// Parses the response to GET_MORE_ELEMENTS, while receiving the proof elements.
+static int read_more_proof_elements_response(buffer_t *read_buffer,
+                                             const merkle_leaf_proof_t *proof,
+                                             uint8_t *n_proof_elements) {
+    uint8_t elements_len;
+    if (!buffer_read_u8(read_buffer, n_proof_elements) ||
+        !buffer_read_u8(read_buffer, &elements_len) ||
+        !buffer_can_read(read_buffer, (size_t) *n_proof_elements * elements_len)) {
+        return -1;
+    }
+
+    if (elements_len != 32) {
+        return -1;
+    }
+
+    if (proof->cur_step + *n_proof_elements > proof->proof_size) {
+        // Receiving more data then expected
+        return -1;
+    }
+    return 0;
+}
+
+// Combines the current hash with the next n_proof_elements proof elements in the read buffer.
+static int verify_proof_elements(buffer_t *read_buffer,
+                                 merkle_leaf_proof_t *proof,
+                                 uint8_t n_proof_elements,
+                                 uint32_t tree_size,
+                                 uint32_t leaf_index) {
+    // we use the memory in the buffer directly, to avoid copying the hashes unnecessarily
+    if (merkle_verify_proof(tree_size,
+                            leaf_index,
+                            proof->proof_size,
+                            proof->cur_step,
+                            read_buffer->ptr + read_buffer->offset,
+                            n_proof_elements,
+                            proof->cur_hash) < 0) {
+        return -1;
+    }
+
+    buffer_seek_cur(read_buffer, 32 * (size_t) n_proof_elements);  // consume the sibling hashes
+    proof->cur_step += n_proof_elements;
+    return 0;
+}
+
+// Checks the root computed at the end of the proof verification.
+static int check_proof_root(const merkle_leaf_proof_t *proof,
+                            const uint8_t merkle_root[static 32]) {
+    if (memcmp(merkle_root, proof->cur_hash, 32) != 0) {
+        PRINTF("Merkle root mismatch");
+        return -1;
+    }
+    return 0;
+}
+
 // Reads the inputs and sends the GET_MERKLE_LEAF_PROOF request.
 int call_get_merkle_leaf_hash(dispatcher_context_t *dc,
                               const uint8_t merkle_root[static 32],
@@ -19,107 +109,443 @@ int call_get_merkle_leaf_hash(dispatcher_context_t *dc,
 
     PRINT_STACK_POINTER();
 
-    {  // make sure memory is deallocated as soon as possible
-        uint8_t tmp[9];
-        tmp[0] = CCMD_GET_MERKLE_LEAF_PROOF;
-        dc->add_to_response(tmp, 1);
+    // the request is written directly in the APDU buffer
+    buffer_t req = dc_get_request_buffer(dc);
+    if (!write_leaf_proof_request(&req, merkle_root, tree_size, leaf_index) ||
+        dc_exchange(dc, &req) < 0) {
+        return -1;
+    }
+
+    merkle_leaf_proof_t proof;
+    uint8_t n_proof_elements;
+    if (read_leaf_proof_response(&dc->read_buffer, &proof, &n_proof_elements) < 0) {
+        return -1;
+    }
+
+    // Copy leaf hash to output (although it is not verified yet)
+    memcpy(out, proof.cur_hash, 32);
+
+    while (true) {
+        if (verify_proof_elements(&dc->read_buffer,
+                                  &proof,
+                                  n_proof_elements,
+                                  tree_size,
+                                  leaf_index) < 0) {
+            return -1;
+        }
+
+        if (proof.cur_step == proof.proof_size) {
+            break;
+        }
+
+        buffer_t req_more = dc_get_request_buffer(dc);
+        if (!buffer_write_u8(&req_more, CCMD_GET_MORE_ELEMENTS) ||
+            dc_exchange(dc, &req_more) < 0 ||
+            read_more_proof_elements_response(&dc->read_buffer, &proof, &n_proof_elements) < 0) {
+            return -1;
+        }
+    }
+
+    return check_proof_root(&proof, merkle_root);
+}
+
+// Writes in directions the directions from the root to the leaf with the given index (0 for left,
+// 1 for right), as merkle_get_ith_direction; returns their number, or -1 if there are more than
+// max_directions.
+static int get_leaf_directions(uint32_t tree_size,
+                               uint32_t leaf_index,
+                               uint8_t directions[],
+                               int max_directions) {
+    int n_directions = 0;
+    while (tree_size > 1) {
+        if (n_directions == max_directions) {
+            return -1;
+        }
+        uint32_t left_size = 1 << (ceil_lg(tree_size) - 1);
+        if (leaf_index >= left_size) {
+            directions[n_directions] = 1;
+            tree_size -= left_size;
+            leaf_index -= left_size;
+        } else {
+            directions[n_directions] = 0;
+            tree_size = left_size;
+        }
+        ++n_directions;
+    }
+    return n_directions;
+}
+
+int call_get_merkle_leaf_hash_cached(dispatcher_context_t *dc,
+                                     merkle_path_cache_t *cache,
+                                     const uint8_t merkle_root[static 32],
+                                     uint32_t tree_size,
+                                     uint32_t leaf_index,
+                                     uint8_t out[static 32]) {
+    // LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    PRINT_STACK_POINTER();
+
+    if (cache == NULL || (dc->client_capabilities & CLIENT_CAPABILITY_PARTIAL_MERKLE_PROOF) == 0 ||
+        leaf_index >= tree_size || ceil_lg(tree_size) > MERKLE_PATH_CACHE_DEPTH) {
+        return call_get_merkle_leaf_hash(dc, merkle_root, tree_size, leaf_index, out);
+    }
+
+    uint8_t directions[MERKLE_PATH_CACHE_DEPTH];
+    int depth = get_leaf_directions(tree_size, leaf_index, directions, MERKLE_PATH_CACHE_DEPTH);
+    if (depth < 0) {
+        return -1;
+    }
+
+    // depth of the lowest common ancestor with the leaf in the cache, or -1 if there is none
+    int lca_depth = -1;
+    if (cache->is_valid && cache->tree_size == tree_size &&
+        memcmp(cache->path[0], merkle_root, 32) == 0) {
+        if (cache->leaf_index == leaf_index) {
+            PERF_COUNT_CACHE(CACHE_MERKLE_PATH, hits, sizeof(cache->path));
+            memcpy(out, cache->path[depth], 32);
+            return 0;
+        }
+
+        uint8_t cached_directions[MERKLE_PATH_CACHE_DEPTH];
+        if (get_leaf_directions(tree_size,
+                                cache->leaf_index,
+                                cached_directions,
+                                MERKLE_PATH_CACHE_DEPTH) < 0) {
+            return -1;
+        }
+        // the paths of two different leaves diverge before reaching either of them
+        lca_depth = 0;
+        while (lca_depth < depth && directions[lca_depth] == cached_directions[lca_depth]) {
+            ++lca_depth;
+        }
+        if (lca_depth == depth) {
+            return -1;  // unexpected, as the cached path is of the same tree
+        }
+    }
+
+    // the child of the common ancestor on the path of the cached leaf is the sibling of the
+    // child on the path of the new leaf, and it is the only one known of its proof
+    uint8_t known_sibling[32];
+    if (lca_depth >= 0) {
+        memcpy(known_sibling, cache->path[lca_depth + 1], 32);
+    }
+
+    // a partially reused path still requires a partial proof
+    PERF_COUNT_CACHE(CACHE_MERKLE_PATH, misses, sizeof(cache->path));
+    if (cache->is_valid) {
+        PERF_COUNT_CACHE(CACHE_MERKLE_PATH, evictions, sizeof(cache->path));
+    }
+
+    // the path is only valid again once the proof is verified
+    cache->is_valid = false;
+
+    merkle_leaf_proof_t proof;
+    uint8_t n_proof_elements;
+    buffer_t req = dc_get_request_buffer(dc);
+    if (!buffer_write_u8(&req, CCMD_GET_MERKLE_LEAF_PARTIAL_PROOF) ||
+        !buffer_write_bytes(&req, merkle_root, 32) || !buffer_write_varint(&req, tree_size) ||
+        !buffer_write_varint(&req, leaf_index) ||
+        !buffer_write_u8(&req, (uint8_t) (depth - lca_depth - 1)) || dc_exchange(dc, &req) < 0 ||
+        read_leaf_proof_response(&dc->read_buffer, &proof, &n_proof_elements) < 0) {
+        return -1;
+    }
+
+    if (proof.proof_size != depth - lca_depth - 1) {
+        PRINTF("Unexpected length of the partial Merkle proof\n");
+        return -1;
+    }
+
+    memcpy(cache->path[depth], proof.cur_hash, 32);
+
+    // the hashes of the path are computed upwards, from the leaf to the child of the common
+    // ancestor (or to the root)
+    while (true) {
+        for (uint8_t i = 0; i < n_proof_elements; i++) {
+            int d = depth - proof.cur_step - 1;  // depth of the parent of the current node
+            const uint8_t *sibling_hash = dc->read_buffer.ptr + dc->read_buffer.offset;
+            if (directions[d] == 0) {
+                merkle_combine_hashes(proof.cur_hash, sibling_hash, proof.cur_hash);
+            } else {
+                merkle_combine_hashes(sibling_hash, proof.cur_hash, proof.cur_hash);
+            }
+            buffer_seek_cur(&dc->read_buffer, 32);
+            memcpy(cache->path[d], proof.cur_hash, 32);
+            ++proof.cur_step;
+        }
+
+        if (proof.cur_step == proof.proof_size) {
+            break;
+        }
+
+        buffer_t req_more = dc_get_request_buffer(dc);
+        if (!buffer_write_u8(&req_more, CCMD_GET_MORE_ELEMENTS) ||
+            dc_exchange(dc, &req_more) < 0 ||
+            read_more_proof_elements_response(&dc->read_buffer, &proof, &n_proof_elements) < 0) {
+            return -1;
+        }
+    }
+
+    // the common ancestor is recomputed, and compared with the one already verified
+    const uint8_t *expected = merkle_root;
+    if (lca_depth >= 0) {
+        if (directions[lca_depth] == 0) {
+            merkle_combine_hashes(proof.cur_hash, known_sibling, proof.cur_hash);
+        } else {
+            merkle_combine_hashes(known_sibling, proof.cur_hash, proof.cur_hash);
+        }
+        expected = cache->path[lca_depth];
+    }
+    if (memcmp(expected, proof.cur_hash, 32) != 0) {
+        PRINTF("Merkle root mismatch");
+        return -1;
+    }
+
+    memcpy(cache->path[0], merkle_root, 32);
+    cache->tree_size = tree_size;
+    cache->leaf_index = leaf_index;
+    cache->is_valid = true;
+
+    memcpy(out, cache->path[depth], 32);
+    return 0;
+}
+
+void co_get_merkle_leaf_hash_init(co_get_merkle_leaf_hash_t *state,
+                                  const uint8_t merkle_root[static 32],
+                                  uint32_t tree_size,
+                                  uint32_t leaf_index,
+                                  uint8_t out[static 32]) {
+    state->result = -1;
+    state->merkle_root = merkle_root;
+    state->tree_size = tree_size;
+    state->leaf_index = leaf_index;
+    state->out = out;
+}
+
+// Same as call_get_merkle_leaf_hash, as a coroutine.
+void co_get_merkle_leaf_hash(dispatcher_context_t *dc) {
+    co_get_merkle_leaf_hash_t *state = (co_get_merkle_leaf_hash_t *) dc->machine_context_ptr;
+
+    buffer_t req;
+    uint8_t n_proof_elements;
+
+    CO_BEGIN(&state->co, co_get_merkle_leaf_hash);
+
+    PRINT_STACK_POINTER();
+
+    req = dc_get_request_buffer(dc);
+    if (!write_leaf_proof_request(&req, state->merkle_root, state->tree_size, state->leaf_index)) {
+        return;
+    }
+    CO_AWAIT(dc, &state->co, &req);
 
-        dc->add_to_response(merkle_root, 32);
+    if (read_leaf_proof_response(&dc->read_buffer, &state->proof, &n_proof_elements) < 0) {
+        return;
+    }
 
-        int tree_size_len = varint_write(tmp, 0, tree_size);
-        dc->add_to_response(tmp, tree_size_len);
+    memcpy(state->out, state->proof.cur_hash, 32);
 
-        int leaf_index_len = varint_write(tmp, 0, leaf_index);
-        dc->add_to_response(tmp, leaf_index_len);
+    while (true) {
+        if (verify_proof_elements(&dc->read_buffer,
+                                  &state->proof,
+                                  n_proof_elements,
+                                  state->tree_size,
+                                  state->leaf_index) < 0) {
+            return;
+        }
 
-        dc->finalize_response(SW_INTERRUPTED_EXECUTION);
+        if (state->proof.cur_step == state->proof.proof_size) {
+            break;
+        }
+
+        req = dc_get_request_buffer(dc);
+        if (!buffer_write_u8(&req, CCMD_GET_MORE_ELEMENTS)) {
+            return;
+        }
+        CO_AWAIT(dc, &state->co, &req);
+
+        if (read_more_proof_elements_response(&dc->read_buffer,
+                                              &state->proof,
+                                              &n_proof_elements) < 0) {
+            return;
+        }
     }
 
-    if (dc->process_interruption(dc) < 0) {
+    state->result = check_proof_root(&state->proof, state->merkle_root);
+
+    CO_END(&state->co);
+}
+
+// Reads the next hash of a multiproof from the read buffer, requesting more elements to the host
+// with GET_MORE_ELEMENTS if the current response has been consumed.
+static int read_next_multiproof_hash(dispatcher_context_t *dc,
+                                     uint8_t *n_remaining_in_response,
+                                     uint8_t *n_remaining_total,
+                                     uint8_t out[static 32]) {
+    if (*n_remaining_total == 0) {
+        PRINTF("Multiproof is too short\n");
         return -1;
     }
 
-    {
-        int cur_step;          // counter for the proof steps
-        uint8_t cur_hash[32];  // temporary buffer for intermediate hashes
-        uint8_t proof_size;
-        uint8_t n_proof_elements;
-        if (!buffer_read_bytes(&dc->read_buffer, cur_hash, 32) ||
-            !buffer_read_u8(&dc->read_buffer, &proof_size) ||
-            !buffer_read_u8(&dc->read_buffer, &n_proof_elements)) {
+    if (*n_remaining_in_response == 0) {
+        buffer_t req_more = dc_get_request_buffer(dc);
+        if (!buffer_write_u8(&req_more, CCMD_GET_MORE_ELEMENTS) || dc_exchange(dc, &req_more) < 0) {
             return -1;
         }
 
-        if (n_proof_elements > proof_size) {
-            PRINTF("Received more proof data than expected.\n");
+        uint8_t elements_len;
+        if (!buffer_read_u8(&dc->read_buffer, n_remaining_in_response) ||
+            !buffer_read_u8(&dc->read_buffer, &elements_len) ||
+            !buffer_can_read(&dc->read_buffer, (size_t) *n_remaining_in_response * elements_len)) {
+            return -1;
+        }
 
-            // Wrong length of the Merkle proof.
+        if (elements_len != 32 || *n_remaining_in_response == 0 ||
+            *n_remaining_in_response > *n_remaining_total) {
             return -1;
         }
+    }
 
-        if (!buffer_can_read(&dc->read_buffer, 32 * (size_t) n_proof_elements)) {
+    if (!buffer_read_bytes(&dc->read_buffer, out, 32)) {
+        return -1;
+    }
+
+    --*n_remaining_in_response;
+    --*n_remaining_total;
+    return 0;
+}
+
+int call_get_merkle_leaf_hashes(dispatcher_context_t *dc,
+                                const uint8_t merkle_root[static 32],
+                                uint32_t tree_size,
+                                size_t n_leaves,
+                                const uint32_t leaf_indices[],
+                                uint8_t out[][32]) {
+    // LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    PRINT_STACK_POINTER();
+
+    if (n_leaves == 0 || n_leaves > MAX_MERKLE_MULTIPROOF_LEAVES ||
+        ceil_lg(tree_size) > MAX_MERKLE_MULTIPROOF_DEPTH) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < n_leaves; i++) {
+        if (leaf_indices[i] >= tree_size || (i > 0 && leaf_indices[i] <= leaf_indices[i - 1])) {
+            PRINTF("Leaf indices must be strictly increasing\n");
             return -1;
         }
+    }
 
-        // Copy leaf hash to output (although it is not verified yet)
-        memcpy(out, cur_hash, 32);
+    // the request is written directly in the APDU buffer
+    buffer_t req = dc_get_request_buffer(dc);
+    if (!buffer_write_u8(&req, CCMD_GET_MERKLE_MULTIPROOF) ||
+        !buffer_write_bytes(&req, merkle_root, 32) || !buffer_write_varint(&req, tree_size) ||
+        !buffer_write_u8(&req, (uint8_t) n_leaves)) {
+        return -1;
+    }
+    for (size_t i = 0; i < n_leaves; i++) {
+        if (!buffer_write_varint(&req, leaf_indices[i])) {
+            return -1;  // too many leaves for a single request
+        }
+    }
 
-        // Initialize proof verification
-        cur_step = 0;
+    if (dc_exchange(dc, &req) < 0) {
+        return -1;
+    }
 
-        while (true) {
-            int end_step = cur_step + n_proof_elements;
-            for (; cur_step < end_step; cur_step++) {
-                // we use the memory in the buffer directly, to avoid copying the hash unnecessarily
-                const uint8_t *sibling_hash = dc->read_buffer.ptr + dc->read_buffer.offset;
+    uint8_t n_remaining_total, n_remaining_in_response;
+    if (!buffer_read_u8(&dc->read_buffer, &n_remaining_total) ||
+        !buffer_read_u8(&dc->read_buffer, &n_remaining_in_response) ||
+        !buffer_can_read(&dc->read_buffer, 32 * (size_t) n_remaining_in_response)) {
+        return -1;
+    }
 
-                int i = proof_size - cur_step - 1;
-                int direction = merkle_get_ith_direction(tree_size, leaf_index, i);
+    if (n_remaining_in_response > n_remaining_total) {
+        PRINTF("Received more proof data than expected.\n");
+        return -1;
+    }
 
-                if (direction == 0) {
-                    merkle_combine_hashes(cur_hash, sibling_hash, cur_hash);
-                } else if (direction == 1) {
-                    merkle_combine_hashes(sibling_hash, cur_hash, cur_hash);
-                } else {
-                    return -1;  // unexpected, proof too long?
-                }
+    // Depth-first visit of the tree, without recursion. Each frame is a subtree with the given
+    // first leaf and size; state is 0 if the subtree was not visited yet, 1 if its left child is
+    // being visited, 2 if its right child is being visited (and the left child's hash is in
+    // left_hashes at the same depth).
+    struct {
+        uint32_t begin;
+        uint32_t size;
+        uint8_t state;
+    } frames[MAX_MERKLE_MULTIPROOF_DEPTH + 1];
+    uint8_t left_hashes[MAX_MERKLE_MULTIPROOF_DEPTH][32];
+    uint8_t cur_hash[32];
 
-                buffer_seek_cur(&dc->read_buffer, 32);  // consume the bytes of the sibling hash
-            }
+    size_t next_leaf = 0;  // position in leaf_indices of the next leaf to be visited
+    int depth = 0;
 
-            if (cur_step == proof_size) {
-                break;
-            }
+    frames[0].begin = 0;
+    frames[0].size = tree_size;
+    frames[0].state = 0;
 
-            uint8_t req_more[] = {CCMD_GET_MORE_ELEMENTS};
-            SET_RESPONSE(dc, req_more, sizeof(req_more), SW_INTERRUPTED_EXECUTION);
-            if (dc->process_interruption(dc) < 0) {
-                return -1;
-            }
+    while (true) {
+        uint32_t begin = frames[depth].begin;
+        uint32_t size = frames[depth].size;
 
-            // Parse response to CCMD_GET_MORE_ELEMENTS
-            uint8_t elements_len;
-            if (!buffer_read_u8(&dc->read_buffer, &n_proof_elements) ||
-                !buffer_read_u8(&dc->read_buffer, &elements_len) ||
-                !buffer_can_read(&dc->read_buffer, (size_t) n_proof_elements * elements_len)) {
-                return -1;
-            }
+        // leaves are visited in order, therefore this is true iff the subtree contains a leaf
+        bool has_leaf = next_leaf < n_leaves && leaf_indices[next_leaf] < begin + size;
 
-            if (elements_len != 32) {
-                return -1;
-            }
+        if (size > 1 && has_leaf) {
+            // visit the left child
+            frames[depth].state = 1;
+            ++depth;
+            frames[depth].begin = begin;
+            frames[depth].size = 1 << (ceil_lg(size) - 1);
+            frames[depth].state = 0;
+            continue;
+        }
+
+        // either a requested leaf, or the root of a subtree not containing any requested leaf
+        if (read_next_multiproof_hash(dc, &n_remaining_in_response, &n_remaining_total, cur_hash) <
+            0) {
+            return -1;
+        }
 
-            if (cur_step + n_proof_elements > proof_size) {
-                // Receiving more data then expected
-                return -1;
+        if (has_leaf) {
+            memcpy(out[next_leaf], cur_hash, 32);
+            ++next_leaf;
+        }
+
+        // go up until the first subtree whose right child is not visited yet
+        while (depth > 0) {
+            --depth;
+            if (frames[depth].state == 2) {
+                merkle_combine_hashes(left_hashes[depth], cur_hash, cur_hash);
+                continue;
             }
+
+            // the left child was visited; visit the right child
+            uint32_t left_size = 1 << (ceil_lg(frames[depth].size) - 1);
+            memcpy(left_hashes[depth], cur_hash, 32);
+            frames[depth].state = 2;
+            ++depth;
+            frames[depth].begin = frames[depth - 1].begin + left_size;
+            frames[depth].size = frames[depth - 1].size - left_size;
+            frames[depth].state = 0;
+            break;
         }
 
-        if (memcmp(merkle_root, cur_hash, 32) != 0) {
-            PRINTF("Merkle root mismatch");
-            return -1;
+        if (depth == 0) {
+            // back to the root, and there's nothing left to visit
+            break;
         }
     }
 
+    if (n_remaining_total != 0 || next_leaf != n_leaves) {
+        PRINTF("Unexpected multiproof length\n");
+        return -1;
+    }
+
+    if (memcmp(merkle_root, cur_hash, 32) != 0) {
+        PRINTF("Merkle root mismatch");
+        return -1;
+    }
+
     return 0;
 }
@@ -1,6 +1,19 @@
 #pragma once
 
+#include "../../boilerplate/coroutine.h"
 #include "../../boilerplate/dispatcher.h"
+#include "../../perf_config.h"
+
+/**
+ * Maximum number of leaves that can be requested in a single call to call_get_merkle_leaf_hashes.
+ */
+#define MAX_MERKLE_MULTIPROOF_LEAVES 16
+
+/**
+ * Maximum depth of a Merkle tree supported by call_get_merkle_leaf_hashes; callers must fall back
+ * to call_get_merkle_leaf_hash for larger trees.
+ */
+#define MAX_MERKLE_MULTIPROOF_DEPTH 8
 
 /**
  * TODO: docs
@@ -9,4 +22,107 @@ int call_get_merkle_leaf_hash(dispatcher_context_t *dispatcher_context,
                               const uint8_t merkle_root[static 32],
                               uint32_t tree_size,
                               uint32_t leaf_index,
-                              uint8_t out[static 32]);
\ No newline at end of file
+                              uint8_t out[static 32]);
+
+/**
+ * The last leaf of a Merkle tree whose proof was verified by call_get_merkle_leaf_hash_cached,
+ * with the hashes of all the nodes on the path from the root to the leaf; the proof of another
+ * leaf of the same tree only needs the siblings below the lowest common ancestor of the two leaves.
+ */
+typedef struct {
+    bool is_valid;
+    uint32_t tree_size;
+    uint32_t leaf_index;
+    // path[d] is the hash of the node at depth d on the path of the leaf: path[0] is the Merkle
+    // root, and the last one is the leaf hash
+    uint8_t path[MERKLE_PATH_CACHE_DEPTH + 1][32];
+} merkle_path_cache_t;
+
+/**
+ * Same as call_get_merkle_leaf_hash, but if the client declares the
+ * CLIENT_CAPABILITY_PARTIAL_MERKLE_PROOF capability and the tree has depth at most
+ * MERKLE_PATH_CACHE_DEPTH, the path of the leaf is kept in the cache: if the previous leaf in the
+ * cache is of the same tree, only the siblings below their lowest common ancestor are requested,
+ * and verified against the hash of the ancestor in the cache. Therefore, visiting the leaves of a
+ * tree in order costs an amortized constant number of hashes per leaf.
+ *
+ * @param[in,out] cache
+ *   The path of the last verified leaf, or NULL; it is invalidated if the verification fails.
+ *
+ * @return 0 on success, or a negative number on failure.
+ */
+int call_get_merkle_leaf_hash_cached(dispatcher_context_t *dispatcher_context,
+                                     merkle_path_cache_t *cache,
+                                     const uint8_t merkle_root[static 32],
+                                     uint32_t tree_size,
+                                     uint32_t leaf_index,
+                                     uint8_t out[static 32]);
+
+/**
+ * Progress of the verification of the Merkle proof of a leaf.
+ */
+typedef struct {
+    uint8_t cur_hash[32];  // the hash of the subtree verified so far
+    uint8_t proof_size;
+    uint8_t cur_step;  // number of proof elements already verified
+} merkle_leaf_proof_t;
+
+/**
+ * State of the coroutine version of call_get_merkle_leaf_hash.
+ */
+typedef struct {
+    coroutine_t co;
+    int result;  // 0 on success, or a negative number on failure; set when the coroutine ends
+
+    // inputs; the memory they point to must stay valid until the coroutine ends
+    const uint8_t *merkle_root;
+    uint32_t tree_size;
+    uint32_t leaf_index;
+    uint8_t *out;
+
+    merkle_leaf_proof_t proof;
+} co_get_merkle_leaf_hash_t;
+
+/**
+ * Initializes the state of co_get_merkle_leaf_hash, with the same arguments as
+ * call_get_merkle_leaf_hash; the coroutine is then started with co_start or CO_CALL.
+ */
+void co_get_merkle_leaf_hash_init(co_get_merkle_leaf_hash_t *state,
+                                  const uint8_t merkle_root[static 32],
+                                  uint32_t tree_size,
+                                  uint32_t leaf_index,
+                                  uint8_t out[static 32]);
+
+/**
+ * Coroutine version of call_get_merkle_leaf_hash, that does not keep its frame on the stack while
+ * waiting for the responses of the client.
+ */
+void co_get_merkle_leaf_hash(dispatcher_context_t *dispatcher_context);
+
+/**
+ * Requests the leaf hashes of multiple leaves of the Merkle tree with the given root, using the
+ * GET_MERKLE_MULTIPROOF client command; the multiproof is verified against the root, and each
+ * sibling hash shared by the proofs of different leaves is only received once.
+ *
+ * @param[in] dispatcher_context
+ *   Pointer to the dispatcher context.
+ * @param[in] merkle_root
+ *   The root of the Merkle tree.
+ * @param[in] tree_size
+ *   The number of leaves of the Merkle tree; it must be at most 2^MAX_MERKLE_MULTIPROOF_DEPTH.
+ * @param[in] n_leaves
+ *   The number of requested leaves, between 1 and MAX_MERKLE_MULTIPROOF_LEAVES.
+ * @param[in] leaf_indices
+ *   The indices of the requested leaves, in strictly increasing order.
+ * @param[out] out
+ *   Array of n_leaves 32-byte buffers, where the leaf hashes are stored, in the same order as
+ *   leaf_indices.
+ *
+ * @return 0 on success, or a negative number on failure.
+ */
+int call_get_merkle_leaf_hashes(dispatcher_context_t *dispatcher_context,
+                                const uint8_t merkle_root[static 32],
+                                uint32_t tree_size,
+                                size_t n_leaves,
+                                const uint32_t leaf_indices[],
+                                uint8_t out[][32]);
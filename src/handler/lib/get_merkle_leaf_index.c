@@ -11,15 +11,11 @@ int call_get_merkle_leaf_index(dispatcher_context_t *dispatcher_context,
                                const uint8_t leaf_hash[static 32]) {
     // LOG_PROCESSOR(dispatcher_context, __FILE__, __LINE__, __func__);
 
-    {  // free memory as soon as possible
-        uint8_t request[1 + 32 + 32];
-        request[0] = CCMD_GET_MERKLE_LEAF_INDEX;
-        memcpy(request + 1, root, 32);
-        memcpy(request + 1 + 32, leaf_hash, 32);
-
-        SET_RESPONSE(dispatcher_context, request, sizeof(request), SW_INTERRUPTED_EXECUTION);
-    }
-    if (dispatcher_context->process_interruption(dispatcher_context) < 0) {
+    // the request is written directly in the APDU buffer
+    buffer_t request = dc_get_request_buffer(dispatcher_context);
+    if (!buffer_write_u8(&request, CCMD_GET_MERKLE_LEAF_INDEX) ||
+        !buffer_write_bytes(&request, root, 32) || !buffer_write_bytes(&request, leaf_hash, 32) ||
+        dc_exchange(dispatcher_context, &request) < 0) {
         return -3;
     }
 
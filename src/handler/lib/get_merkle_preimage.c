@@ -7,114 +7,195 @@
 #include "../../crypto.h"
 #include "../client_commands.h"
 
-// TODO: refactor common code with stream_preimage.c
-
 int call_get_merkle_preimage(dispatcher_context_t *dispatcher_context,
                              const uint8_t hash[static 32],
                              uint8_t *out_ptr,
                              size_t out_ptr_len) {
-    // LOG_PROCESSOR(dispatcher_context, __FILE__, __LINE__, __func__);
-
-    PRINT_STACK_POINTER();
+    preimage_destination_t dest = {.is_merkle_leaf = true, .out = out_ptr, .out_len = out_ptr_len};
 
-    uint8_t cmd = CCMD_GET_PREIMAGE;
-    dispatcher_context->add_to_response(&cmd, 1);
-
-    uint8_t zero = 0;
-    dispatcher_context->add_to_response(&zero, 1);
+    int res = call_get_preimage_into(dispatcher_context, hash, &dest);
+    if (res >= 0 && (size_t) res > out_ptr_len) {
+        PRINTF("Output buffer too short\n");
+        return -11;
+    }
+    return res;
+}
+
+int call_get_merkle_preimages(dispatcher_context_t *dc,
+                              const uint8_t hashes[][32],
+                              size_t n_hashes,
+                              uint8_t *out_buf,
+                              size_t out_buf_len,
+                              int (*callback)(size_t, buffer_t *, void *),
+                              void *callback_state) {
+    // LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
 
-    dispatcher_context->add_to_response(hash, 32);
-    dispatcher_context->finalize_response(SW_INTERRUPTED_EXECUTION);
+    PRINT_STACK_POINTER();
 
-    if (dispatcher_context->process_interruption(dispatcher_context) < 0) {
+    if (n_hashes == 0 || n_hashes > MAX_GET_PREIMAGES_HASHES || out_buf_len >= 0xFC) {
         return -1;
     }
 
-    uint64_t preimage_len;
+    // the request is written directly in the APDU buffer
+    buffer_t req = dc_get_request_buffer(dc);
+    if (!buffer_write_u8(&req, CCMD_GET_PREIMAGES) || !buffer_write_u8(&req, (uint8_t) n_hashes) ||
+        !buffer_write_bytes(&req, hashes[0], 32 * n_hashes) || dc_exchange(dc, &req) < 0) {
+        return -1;
+    }
 
+    uint64_t bytes_remaining;
     uint8_t partial_data_len;
-
-    if (!buffer_read_varint(&dispatcher_context->read_buffer, &preimage_len) ||
-        !buffer_read_u8(&dispatcher_context->read_buffer, &partial_data_len) ||
-        !buffer_can_read(&dispatcher_context->read_buffer, partial_data_len)) {
+    if (!buffer_read_varint(&dc->read_buffer, &bytes_remaining) ||
+        !buffer_read_u8(&dc->read_buffer, &partial_data_len) ||
+        !buffer_can_read(&dc->read_buffer, partial_data_len) ||
+        partial_data_len > bytes_remaining) {
         return -2;
     }
 
-    if (preimage_len == 0 || partial_data_len == 0) {
-        return -3;
-    }
-
-    if (preimage_len - 1 > out_ptr_len) {
-        PRINTF("Output buffer too short\n");
-        return -4;
-    }
-
-    if (partial_data_len > preimage_len) {
-        return -5;
-    }
-
-    uint8_t *data_ptr =
-        dispatcher_context->read_buffer.ptr + dispatcher_context->read_buffer.offset;
-
     cx_sha256_t hash_context;
+    size_t preimage_index = 0;
+    bool has_preimage_len = false;  // true if the length of the current preimage was received
+    size_t preimage_len = 0;        // including the 0x00 prefix
+    size_t preimage_pos = 0;
+
+    size_t chunk_len = partial_data_len;
+    while (true) {
+        while (chunk_len > 0) {
+            if (!has_preimage_len) {
+                // only lengths encoded in a single byte are supported, as out_buf_len < 0xFC
+                uint8_t len_byte;
+                buffer_read_u8(&dc->read_buffer, &len_byte);
+                --chunk_len;
+                --bytes_remaining;
+
+                if (preimage_index >= n_hashes || len_byte == 0 || len_byte - 1 > out_buf_len) {
+                    PRINTF("Unexpected preimage\n");
+                    return -3;
+                }
+                preimage_len = len_byte;
+                preimage_pos = 0;
+                has_preimage_len = true;
+                cx_sha256_init(&hash_context);
+            } else {
+                size_t n_bytes = preimage_len - preimage_pos;
+                if (n_bytes > chunk_len) {
+                    n_bytes = chunk_len;
+                }
+                uint8_t *data_ptr = buffer_get_cur(&dc->read_buffer);
+                crypto_hash_update(&hash_context.header, data_ptr, n_bytes);
+                if (preimage_pos == 0) {
+                    // the 0x00 prefix is hashed, but not copied
+                    memcpy(out_buf, data_ptr + 1, n_bytes - 1);
+                } else {
+                    memcpy(out_buf + preimage_pos - 1, data_ptr, n_bytes);
+                }
+                buffer_seek_cur(&dc->read_buffer, n_bytes);
+                preimage_pos += n_bytes;
+                chunk_len -= n_bytes;
+                bytes_remaining -= n_bytes;
+            }
+
+            if (has_preimage_len && preimage_pos == preimage_len) {
+                uint8_t computed_hash[32];
+                crypto_hash_digest(&hash_context.header, computed_hash, 32);
+                if (memcmp(computed_hash, hashes[preimage_index], 32) != 0) {
+                    PRINTF("Hash mismatch.\n");
+                    return -4;
+                }
+
+                buffer_t preimage = buffer_create(out_buf, preimage_len - 1);
+                if (callback(preimage_index, &preimage, callback_state) < 0) {
+                    return -5;
+                }
+
+                ++preimage_index;
+                has_preimage_len = false;
+            }
+        }
 
-    cx_sha256_init(&hash_context);
-
-    // update hash
-    crypto_hash_update(&hash_context.header, data_ptr, partial_data_len);
-
-    buffer_t out_buffer = buffer_create(out_ptr, out_ptr_len);
-
-    // write bytes to output
-    buffer_write_bytes(&out_buffer, data_ptr + 1, partial_data_len - 1);  // we skip the first byte
-
-    size_t bytes_remaining = (size_t) preimage_len - partial_data_len;
+        if (bytes_remaining == 0) {
+            break;
+        }
 
-    while (bytes_remaining > 0) {
-        uint8_t get_more_elements_req[] = {CCMD_GET_MORE_ELEMENTS};
-        SET_RESPONSE(dispatcher_context, get_more_elements_req, 1, SW_INTERRUPTED_EXECUTION);
-        if (dispatcher_context->process_interruption(dispatcher_context) < 0) {
+        buffer_t req_more = dc_get_request_buffer(dc);
+        if (!buffer_write_u8(&req_more, CCMD_GET_MORE_ELEMENTS) || dc_exchange(dc, &req_more) < 0) {
             return -6;
         }
 
-        // Parse response to CCMD_GET_MORE_ELEMENTS
-        uint8_t n_bytes, elements_len;
-        if (!buffer_read_u8(&dispatcher_context->read_buffer, &n_bytes) ||
-            !buffer_read_u8(&dispatcher_context->read_buffer, &elements_len) ||
-            !buffer_can_read(&dispatcher_context->read_buffer, (size_t) n_bytes * elements_len)) {
+        // the elements are consecutive chunks of the stream, of any length
+        uint8_t n_elements, elements_len;
+        if (!buffer_read_u8(&dc->read_buffer, &n_elements) ||
+            !buffer_read_u8(&dc->read_buffer, &elements_len) ||
+            !buffer_can_read(&dc->read_buffer, (size_t) n_elements * elements_len)) {
             return -7;
         }
 
-        if (elements_len != 1) {
-            PRINTF("Elements should be single bytes\n");
+        chunk_len = (size_t) n_elements * elements_len;
+        if (chunk_len == 0 || chunk_len > bytes_remaining) {
+            PRINTF("Unexpected length of the stream\n");
             return -8;
         }
+    }
 
-        if (n_bytes > bytes_remaining) {
-            PRINTF("Received more bytes than expected.\n");
-            return -9;
-        }
+    if (preimage_index != n_hashes || has_preimage_len) {
+        PRINTF("Unexpected number of preimages\n");
+        return -9;
+    }
+
+    return 0;
+}
+
+void co_get_merkle_preimage_init(co_get_merkle_preimage_t *state,
+                                 const uint8_t hash[static 32],
+                                 uint8_t *out_ptr,
+                                 size_t out_ptr_len) {
+    state->result = -1;
+    state->hash = hash;
+    state->dest = (preimage_destination_t){.is_merkle_leaf = true,
+                                           .out = out_ptr,
+                                           .out_len = out_ptr_len};
+}
+
+// Same as call_get_merkle_preimage, as a coroutine.
+void co_get_merkle_preimage(dispatcher_context_t *dc) {
+    co_get_merkle_preimage_t *state = (co_get_merkle_preimage_t *) dc->machine_context_ptr;
 
-        // update hash
-        crypto_hash_update(
-            &hash_context.header,
-            dispatcher_context->read_buffer.ptr + dispatcher_context->read_buffer.offset,
-            n_bytes);
+    buffer_t req;
 
-        // write bytes to output
-        buffer_write_bytes(&out_buffer, data_ptr, n_bytes);
+    CO_BEGIN(&state->co, co_get_merkle_preimage);
 
-        bytes_remaining -= n_bytes;
+    PRINT_STACK_POINTER();
+
+    req = dc_get_request_buffer(dc);
+    if (!preimage_write_request(&req, state->hash)) {
+        return;
     }
+    CO_AWAIT(dc, &state->co, &req);
 
-    // hack: we pass the address of the final accumulator inside cx_sha256_t, so we don't need
-    // an additional variable in the stack to store the final hash.
-    crypto_hash_digest(&hash_context.header, (uint8_t *) &hash_context.acc, 32);
+    state->result = preimage_read_response(&dc->read_buffer, &state->progress, &state->dest);
+    if (state->result < 0) {
+        return;
+    }
+
+    while (preimage_is_incomplete(&state->progress)) {
+        req = dc_get_request_buffer(dc);
+        if (!buffer_write_u8(&req, CCMD_GET_MORE_ELEMENTS)) {
+            state->result = -6;
+            return;
+        }
+        CO_AWAIT(dc, &state->co, &req);
 
-    if (memcmp(hash_context.acc, hash, 32) != 0) {
-        PRINTF("Hash mismatch.\n");
-        return -10;
+        state->result = preimage_read_more_response(&dc->read_buffer, &state->progress);
+        if (state->result < 0) {
+            return;
+        }
+    }
+
+    state->result = preimage_check_hash(&state->progress, state->hash);
+    if (state->result >= 0 && (size_t) state->result > state->dest.out_len) {
+        PRINTF("Output buffer too short\n");
+        state->result = -11;
     }
 
-    return (int) (preimage_len - 1);
-}
\ No newline at end of file
+    CO_END(&state->co);
+}
@@ -1,16 +1,82 @@
 #pragma once
 
+#include "../../boilerplate/coroutine.h"
 #include "../../boilerplate/dispatcher.h"
+#include "../../common/buffer.h"
+#include "../../crypto.h"
+#include "get_preimage.h"
 
 /**
- * In this flow, the HWW sends a CCMD_GET_PREIMAGE command with a SHA256 hash.
- * The client must respond with a the preimage (at most 254 bytes), prefixed by its length.
- * The flow fails with SW_WRONG_DATA_LENGTH if the response is too short; it will fail with
- * SW_INCORRECT_DATA if the computed hash does not match.
+ * In this flow, the HWW sends a CCMD_GET_PREIMAGE command with the SHA256 hash of a Merkle leaf.
+ * The client must respond with the preimage, prefixed by its length; the preimage (without the
+ * 0x00 prefix) is copied to out_ptr as it is received. This is call_get_preimage_into with a
+ * destination covering the whole out_ptr.
  *
- * Returns the length of the preimage on success, or a negative number in case of failure.
+ * Returns the length of the preimage on success, or a negative number in case of failure
+ * (including if the preimage is longer than out_ptr_len, or if its hash does not match).
  */
 int call_get_merkle_preimage(dispatcher_context_t *dispatcher_context,
                              const uint8_t hash[static 32],
                              uint8_t *out_ptr,
                              size_t out_ptr_len);
+
+/**
+ * Requests the preimages of several Merkle leaf hashes at once, using the GET_PREIMAGES client
+ * command; each preimage is hashed as it is received, and passed (without the 0x00 prefix) to the
+ * callback as soon as its hash is verified, together with its position in hashes.
+ * The client must declare the CLIENT_CAPABILITY_BATCHED_PREIMAGES capability.
+ *
+ * @param[in] dispatcher_context
+ *   Pointer to the dispatcher context.
+ * @param[in] hashes
+ *   The leaf hashes.
+ * @param[in] n_hashes
+ *   The number of hashes, between 1 and MAX_GET_PREIMAGES_HASHES.
+ * @param[out] out_buf
+ *   Pointer to a buffer where each preimage is stored before calling the callback.
+ * @param[in] out_buf_len
+ *   Length of out_buf, and maximum length of each preimage; it must be less than 0xFC.
+ * @param[in] callback
+ *   Called for each preimage; if it returns a negative number, the reception is interrupted.
+ * @param[in] callback_state
+ *   Pointer passed to the callback.
+ *
+ * @return 0 on success, or a negative number on failure.
+ */
+int call_get_merkle_preimages(dispatcher_context_t *dispatcher_context,
+                              const uint8_t hashes[][32],
+                              size_t n_hashes,
+                              uint8_t *out_buf,
+                              size_t out_buf_len,
+                              int (*callback)(size_t, buffer_t *, void *),
+                              void *callback_state);
+
+/**
+ * State of the coroutine version of call_get_merkle_preimage.
+ */
+typedef struct {
+    coroutine_t co;
+    // the return value of call_get_merkle_preimage; set when the coroutine ends
+    int result;
+
+    // inputs; the memory they point to must stay valid until the coroutine ends
+    const uint8_t *hash;
+
+    preimage_destination_t dest;
+    preimage_progress_t progress;
+} co_get_merkle_preimage_t;
+
+/**
+ * Initializes the state of co_get_merkle_preimage, with the same arguments as
+ * call_get_merkle_preimage; the coroutine is then started with co_start or CO_CALL.
+ */
+void co_get_merkle_preimage_init(co_get_merkle_preimage_t *state,
+                                 const uint8_t hash[static 32],
+                                 uint8_t *out_ptr,
+                                 size_t out_ptr_len);
+
+/**
+ * Coroutine version of call_get_merkle_preimage, that does not keep its frame on the stack while
+ * waiting for the responses of the client.
+ */
+void co_get_merkle_preimage(dispatcher_context_t *dispatcher_context);
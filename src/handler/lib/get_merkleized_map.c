@@ -2,12 +2,66 @@
 
 #include "get_merkleized_map.h"
 
-#include "get_merkle_leaf_element.h"
+#include "get_merkle_leaf_hash.h"
+#include "get_merkle_preimage.h"
 #include "check_merkle_tree_sorted.h"
 
 #include "../../common/buffer.h"
 
+typedef struct {
+    merkleized_map_commitment_t *map;
+    dispatcher_callback_descriptor_t callback;
+    size_t cur_index;
+    bool cache_overflow;
+} keys_index_cache_state_t;
+
+// Called for each key of the map, in order; stores the index of each key of length 1 in the cache,
+// then calls the original callback (if any).
+static void keys_index_cache_callback(keys_index_cache_state_t *state, buffer_t *data) {
+    merkleized_map_commitment_t *map = state->map;
+
+    if (data->size - data->offset == 1) {
+        if (map->n_cached_keys < MERKLEIZED_MAP_INDEX_CACHE_SIZE && state->cur_index <= 0xFF) {
+            map->cached_keys[map->n_cached_keys] = data->ptr[data->offset];
+            map->cached_indices[map->n_cached_keys] = (uint8_t) state->cur_index;
+            ++map->n_cached_keys;
+        } else {
+            state->cache_overflow = true;
+        }
+    }
+    ++state->cur_index;
+
+    if (state->callback.fn != NULL) {
+        state->callback.fn(state->callback.state, data);
+    }
+}
+
+int call_check_merkleized_map_keys_with_callback(dispatcher_context_t *dispatcher_context,
+                                                 merkleized_map_commitment_t *map,
+                                                 dispatcher_callback_descriptor_t keys_callback) {
+    map->n_cached_keys = 0;
+    map->cache_complete = false;
+
+    keys_index_cache_state_t cache_state = {.map = map,
+                                            .callback = keys_callback,
+                                            .cur_index = 0,
+                                            .cache_overflow = false};
+
+    int res = call_check_merkle_tree_sorted_with_callback(
+        dispatcher_context,
+        map->keys_root,
+        (size_t) map->size,
+        make_callback(&cache_state, (dispatcher_callback_t) keys_index_cache_callback));
+    if (res < 0) {
+        return res;
+    }
+
+    map->cache_complete = !cache_state.cache_overflow;
+    return 0;
+}
+
 int call_get_merkleized_map_with_callback(dispatcher_context_t *dispatcher_context,
+                                          merkle_path_cache_t *path_cache,
                                           const uint8_t root[static 32],
                                           int size,
                                           int index,
@@ -18,12 +72,18 @@ int call_get_merkleized_map_with_callback(dispatcher_context_t *dispatcher_conte
     uint8_t raw_output[9 + 2 * 32];  // maximum size of serialized result (9 bytes for the varint,
                                      // and the 2 Merkle roots)
 
-    int el_len = call_get_merkle_leaf_element(dispatcher_context,
-                                              root,
-                                              size,
-                                              index,
-                                              raw_output,
-                                              sizeof(raw_output));
+    uint8_t leaf_hash[32];
+    if (call_get_merkle_leaf_hash_cached(dispatcher_context,
+                                         path_cache,
+                                         root,
+                                         size,
+                                         index,
+                                         leaf_hash) < 0) {
+        return -1;
+    }
+
+    int el_len =
+        call_get_merkle_preimage(dispatcher_context, leaf_hash, raw_output, sizeof(raw_output));
     if (el_len < 0) {
         return -1;
     }
@@ -35,8 +95,5 @@ int call_get_merkleized_map_with_callback(dispatcher_context_t *dispatcher_conte
         return -1;
     }
 
-    return call_check_merkle_tree_sorted_with_callback(dispatcher_context,
-                                                       out_ptr->keys_root,
-                                                       out_ptr->size,
-                                                       keys_callback);
+    return call_check_merkleized_map_keys_with_callback(dispatcher_context, out_ptr, keys_callback);
 }
\ No newline at end of file
@@ -2,11 +2,30 @@
 
 #include "../../boilerplate/dispatcher.h"
 #include "../../common/merkle.h"
+#include "get_merkle_leaf_hash.h"
 
 /**
- * TODO: docs
+ * Verifies that the keys of a merkleized map are sorted, like call_check_merkle_tree_sorted, and
+ * fills the index cache of the map with the indices of the keys of length 1. If a callback to a
+ * non-NULL function is given, it is called once for each of the keys, in lexicographical order.
+ *
+ * Returns 0 on success, or a negative number on failure.
+ */
+int call_check_merkleized_map_keys_with_callback(dispatcher_context_t *dispatcher_context,
+                                                 merkleized_map_commitment_t *map,
+                                                 dispatcher_callback_descriptor_t keys_callback);
+
+/**
+ * Requests the commitment of the merkleized map with the given index in the Merkle tree of map
+ * commitments with the given root and size, and verifies its keys with
+ * call_check_merkleized_map_keys_with_callback. If path_cache is not NULL, the proof of the
+ * commitment is verified with call_get_merkle_leaf_hash_cached, so that consecutive maps of the
+ * same list (like the inputs, or the outputs of a PSBT) share the upper part of their proofs.
+ *
+ * Returns 0 on success, or a negative number on failure.
  */
 int call_get_merkleized_map_with_callback(dispatcher_context_t *dispatcher_context,
+                                          merkle_path_cache_t *path_cache,
                                           const uint8_t root[static 32],
                                           int size,
                                           int index,
@@ -22,6 +41,7 @@ static inline int call_get_merkleized_map(dispatcher_context_t *dispatcher_conte
                                           int index,
                                           merkleized_map_commitment_t *out_ptr) {
     return call_get_merkleized_map_with_callback(dispatcher_context,
+                                                 NULL,
                                                  root,
                                                  size,
                                                  index,
@@ -2,32 +2,246 @@
 
 #include "get_merkleized_map_value.h"
 
-#include "get_merkle_leaf_index.h"
-#include "get_merkle_leaf_element.h"
-
-int call_get_merkleized_map_value(dispatcher_context_t *dispatcher_context,
-                                  const merkleized_map_commitment_t *map,
-                                  const uint8_t *key,
-                                  int key_len,
-                                  uint8_t *out,
-                                  int out_len) {
+#include "../../boilerplate/sw.h"
+#include "../../common/varint.h"
+#include "../client_commands.h"
+
+// Keeps track of the position in the response to CCMD_GET_MERKLEIZED_MAP_VALUE, that might span
+// multiple messages.
+typedef struct {
+    size_t remaining;        // number of bytes of the response that are not read yet
+    size_t chunk_remaining;  // number of bytes of the response left in the read buffer
+} map_value_response_t;
+
+// Reads len bytes of the response, requesting more bytes with GET_MORE_ELEMENTS if necessary.
+static int read_response_bytes(dispatcher_context_t *dc,
+                               map_value_response_t *response,
+                               uint8_t *out,
+                               size_t len) {
+    while (len > 0) {
+        if (response->remaining == 0) {
+            PRINTF("Response too short\n");
+            return -1;
+        }
+
+        if (response->chunk_remaining == 0) {
+            buffer_t get_more_elements_req = dc_get_request_buffer(dc);
+            if (!buffer_write_u8(&get_more_elements_req, CCMD_GET_MORE_ELEMENTS) ||
+                dc_exchange(dc, &get_more_elements_req) < 0) {
+                return -1;
+            }
+
+            uint8_t n_elements, elements_len;
+            if (!buffer_read_u8(&dc->read_buffer, &n_elements) ||
+                !buffer_read_u8(&dc->read_buffer, &elements_len) ||
+                !buffer_can_read(&dc->read_buffer, (size_t) n_elements * elements_len)) {
+                return -1;
+            }
+
+            // the elements are consecutive chunks of the response, of any length
+            size_t n_bytes = (size_t) n_elements * elements_len;
+
+            if (n_bytes == 0 || n_bytes > response->remaining) {
+                PRINTF("Received more bytes than expected.\n");
+                return -1;
+            }
+            response->chunk_remaining = n_bytes;
+        }
+
+        size_t n = len < response->chunk_remaining ? len : response->chunk_remaining;
+        if (!buffer_read_bytes(&dc->read_buffer, out, n)) {
+            return -1;
+        }
+        out += n;
+        len -= n;
+        response->chunk_remaining -= n;
+        response->remaining -= n;
+    }
+    return 0;
+}
+
+static int read_response_varint(dispatcher_context_t *dc,
+                                map_value_response_t *response,
+                                uint64_t *out) {
+    uint8_t prefix;
+    if (read_response_bytes(dc, response, &prefix, 1) < 0) {
+        return -1;
+    }
+
+    uint8_t len = prefix < 0xFD ? 0 : (prefix == 0xFD ? 2 : (prefix == 0xFE ? 4 : 8));
+    if (len == 0) {
+        *out = prefix;
+        return 0;
+    }
+
+    uint8_t data[8];
+    if (read_response_bytes(dc, response, data, len) < 0) {
+        return -1;
+    }
+    *out = 0;
+    for (int i = len - 1; i >= 0; i--) {
+        *out = (*out << 8) | data[i];
+    }
+    return 0;
+}
+
+// Reads a Merkle proof from the response, and verifies that the leaf with hash leaf_hash has index
+// leaf_index in the Merkle tree of the given size and root.
+static int read_and_verify_proof(dispatcher_context_t *dc,
+                                 map_value_response_t *response,
+                                 const uint8_t root[static 32],
+                                 size_t size,
+                                 size_t leaf_index,
+                                 uint8_t proof_size,
+                                 const uint8_t leaf_hash[static 32]) {
+    uint8_t cur_hash[32];
+    uint8_t sibling_hash[32];
+
+    if (size > UINT32_MAX || leaf_index >= size) {
+        return -1;
+    }
+
+    memcpy(cur_hash, leaf_hash, 32);
+
+    for (int step = 0; step < proof_size; step++) {
+        if (read_response_bytes(dc, response, sibling_hash, 32) < 0) {
+            return -1;
+        }
+
+        if (merkle_verify_proof((uint32_t) size,
+                                (uint32_t) leaf_index,
+                                proof_size,
+                                (uint8_t) step,
+                                sibling_hash,
+                                1,
+                                cur_hash) < 0) {
+            return -1;
+        }
+    }
+
+    if (memcmp(root, cur_hash, 32) != 0) {
+        PRINTF("Merkle root mismatch\n");
+        return -1;
+    }
+    return 0;
+}
+
+int call_get_merkleized_map_value_with_index(dispatcher_context_t *dispatcher_context,
+                                             const merkleized_map_commitment_t *map,
+                                             const uint8_t *key,
+                                             int key_len,
+                                             int key_index,
+                                             uint8_t *out,
+                                             int out_len) {
     // LOG_PROCESSOR(dispatcher_context, __FILE__, __LINE__, __func__);
 
+    // if the index of the key is already known, the client does not need to prove it
+    int cached_index = key_index >= 0 ? key_index : merkleized_map_cached_index(map, key, key_len);
+    if (cached_index == -1) {
+        PRINTF("Key not found.\n");
+        return -1;
+    }
+    if (cached_index >= 0 && (uint64_t) cached_index >= map->size) {
+        return -1;
+    }
+
     uint8_t key_merkle_hash[32];
     merkle_compute_element_hash(key, key_len, key_merkle_hash);
 
-    int index =
-        call_get_merkle_leaf_index(dispatcher_context, map->size, map->keys_root, key_merkle_hash);
+    // the request is written directly in the APDU buffer
+    buffer_t req = dc_get_request_buffer(dispatcher_context);
+    if (!buffer_write_u8(&req, CCMD_GET_MERKLEIZED_MAP_VALUE) ||
+        !buffer_write_bytes(&req, map->keys_root, 32) ||
+        !buffer_write_bytes(&req, map->values_root, 32) || !buffer_write_varint(&req, map->size) ||
+        !buffer_write_bytes(&req, key_merkle_hash, 32) ||
+        (cached_index >= 0 && !buffer_write_varint(&req, (uint64_t) cached_index))) {
+        return -1;
+    }
 
-    if (index < 0) {
+    if (dc_exchange(dispatcher_context, &req) < 0) {
+        return -1;
+    }
+
+    map_value_response_t response;
+    uint64_t response_len;
+    uint8_t partial_len;
+    if (!buffer_read_varint(&dispatcher_context->read_buffer, &response_len) ||
+        !buffer_read_u8(&dispatcher_context->read_buffer, &partial_len) ||
+        !buffer_can_read(&dispatcher_context->read_buffer, partial_len)) {
+        return -1;
+    }
+
+    if (partial_len > response_len) {
+        return -1;
+    }
+
+    response.remaining = (size_t) response_len;
+    response.chunk_remaining = partial_len;
+
+    uint8_t found;
+    if (read_response_bytes(dispatcher_context, &response, &found, 1) < 0) {
+        return -1;
+    }
+
+    if (found != 1) {
         PRINTF("Key not found, or incorrect data.\n");
         return -1;
     }
 
-    return call_get_merkle_leaf_element(dispatcher_context,
-                                        map->values_root,
-                                        map->size,
-                                        index,
-                                        out,
-                                        out_len);
-}
\ No newline at end of file
+    uint64_t index;
+    uint8_t proof_size;
+    if (read_response_varint(dispatcher_context, &response, &index) < 0 || index >= map->size ||
+        read_response_bytes(dispatcher_context, &response, &proof_size, 1) < 0) {
+        return -1;
+    }
+
+    if (cached_index >= 0) {
+        // no proof for the key is sent, as its index is already verified
+        if (index != (uint64_t) cached_index) {
+            PRINTF("Unexpected key index\n");
+            return -1;
+        }
+    } else if (read_and_verify_proof(dispatcher_context,
+                                     &response,
+                                     map->keys_root,
+                                     map->size,
+                                     index,
+                                     proof_size,
+                                     key_merkle_hash) < 0) {
+        return -1;
+    }
+
+    uint64_t value_len;
+    if (read_response_varint(dispatcher_context, &response, &value_len) < 0) {
+        return -1;
+    }
+
+    if (value_len > (uint64_t) out_len) {
+        PRINTF("Output buffer too short\n");
+        return -1;
+    }
+
+    if (read_response_bytes(dispatcher_context, &response, out, value_len) < 0) {
+        return -1;
+    }
+
+    // we reuse key_merkle_hash to store the leaf hash of the value
+    merkle_compute_element_hash(out, value_len, key_merkle_hash);
+
+    if (read_and_verify_proof(dispatcher_context,
+                              &response,
+                              map->values_root,
+                              map->size,
+                              index,
+                              proof_size,
+                              key_merkle_hash) < 0) {
+        return -1;
+    }
+
+    if (response.remaining != 0) {
+        PRINTF("Unexpected trailing data\n");
+        return -1;
+    }
+
+    return (int) value_len;
+}
@@ -9,19 +9,45 @@
  * corresponding to the key, then fetches the corresponding element and verifies that its hash and
  * Merkle proof matches. The value is then stored in the `out` pointer, which must be large enough
  * to contain the preimage.
+ * The index, both Merkle proofs and the value are obtained with a single
+ * GET_MERKLEIZED_MAP_VALUE client command (plus any GET_MORE_ELEMENTS needed for the overflow).
  *
  * Returns a negative number if the response is too long to fit into the output buffer, or if the
  * key is not found, or if any of the proofs failed. Returns the length of the preimage on success.
  *
+ * If key_index is not negative, it must be the index of the key in the map, as verified by the
+ * caller (for example, by counting the keys passed to the callback of
+ * call_get_merkleized_map_with_callback); then, no Merkle proof for the key is requested.
+ *
  * NOTE: this does _not_ check that the keys are lexicographically sorted; the sanity check needs to
  * be done before.
  */
-int call_get_merkleized_map_value(dispatcher_context_t *dispatcher_context,
-                                  const merkleized_map_commitment_t *map,
-                                  const uint8_t *key,
-                                  int key_len,
-                                  uint8_t *out,
-                                  int out_len);
+int call_get_merkleized_map_value_with_index(dispatcher_context_t *dispatcher_context,
+                                             const merkleized_map_commitment_t *map,
+                                             const uint8_t *key,
+                                             int key_len,
+                                             int key_index,
+                                             uint8_t *out,
+                                             int out_len);
+
+/**
+ * Same as call_get_merkleized_map_value_with_index, for a key whose index is not known (other than
+ * possibly from the index cache of the map).
+ */
+static inline int call_get_merkleized_map_value(dispatcher_context_t *dispatcher_context,
+                                                const merkleized_map_commitment_t *map,
+                                                const uint8_t *key,
+                                                int key_len,
+                                                uint8_t *out,
+                                                int out_len) {
+    return call_get_merkleized_map_value_with_index(dispatcher_context,
+                                                    map,
+                                                    key,
+                                                    key_len,
+                                                    -1,
+                                                    out,
+                                                    out_len);
+}
 
 /**
  * Convenience shortcut to read a little-endian unsigned 32-bit int.
@@ -1,41 +1,84 @@
 #include <string.h>
 
 #include "../../boilerplate/sw.h"
-#include "stream_preimage.h"
+#include "get_preimage.h"
 
 #include "../../crypto.h"
 #include "../client_commands.h"
 
-int call_get_preimage(dispatcher_context_t *dispatcher_context,
-                      const uint8_t hash[static 32],
-                      uint8_t *out,
-                      size_t out_len) {
-    // LOG_PROCESSOR(dispatcher_context, __FILE__, __LINE__, __func__);
+bool preimage_write_request(buffer_t *req, const uint8_t hash[static 32]) {
+    // the 0 byte is reserved
+    return buffer_write_u8(req, CCMD_GET_PREIMAGE) && buffer_write_u8(req, 0) &&
+           buffer_write_bytes(req, hash, 32);
+}
 
-    uint8_t cmd = CCMD_GET_PREIMAGE;
-    dispatcher_context->add_to_response(&cmd, 1);
-    uint8_t zero = 0;
-    dispatcher_context->add_to_response(&zero, 1);
-    dispatcher_context->add_to_response(hash, 32);
-    dispatcher_context->finalize_response(SW_INTERRUPTED_EXECUTION);
+// Hashes the next n_bytes bytes of the preimage from read_buffer, and writes them to the
+// destination.
+static int process_chunk(buffer_t *read_buffer, preimage_progress_t *progress, size_t n_bytes) {
+    const preimage_destination_t *dest = progress->dest;
 
-    if (dispatcher_context->process_interruption(dispatcher_context) < 0) {
+    if (n_bytes > progress->preimage_len - progress->bytes_received) {
+        PRINTF("Received more bytes than expected.\n");
         return -1;
     }
 
-    uint64_t preimage_len_u64;  // preimage len (including the 0x00 prefix of Merkle tree leaves)
+    uint8_t *data_ptr = buffer_get_cur(read_buffer);
+    buffer_seek_cur(read_buffer, n_bytes);
+
+    crypto_hash_update(&progress->hash_context.header, data_ptr, n_bytes);
+
+    size_t pos = progress->bytes_received;  // position of data_ptr in the data sent to dest
+    progress->bytes_received += n_bytes;
+
+    if (dest->is_merkle_leaf) {
+        if (pos == 0) {
+            // the 0x00 prefix is hashed, but not written
+            if (n_bytes == 0 || data_ptr[0] != 0x00) {
+                return -1;
+            }
+            ++data_ptr;
+            --n_bytes;
+        } else {
+            --pos;
+        }
+    }
+
+    if (n_bytes == 0) {
+        return 0;
+    }
+
+    if (dest->callback != NULL) {
+        buffer_t buf = buffer_create(data_ptr, n_bytes);
+        dest->callback(&buf, dest->callback_state);
+    }
+
+    // copy the intersection of [pos, pos + n_bytes) with the window [offset, offset + out_len)
+    size_t begin = pos > dest->offset ? pos : dest->offset;
+    size_t end = pos + n_bytes;
+    if (end > dest->offset + dest->out_len) {
+        end = dest->offset + dest->out_len;
+    }
+    if (begin < end) {
+        memcpy(dest->out + (begin - dest->offset), data_ptr + (begin - pos), end - begin);
+    }
+    return 0;
+}
+
+int preimage_read_response(buffer_t *read_buffer,
+                           preimage_progress_t *progress,
+                           const preimage_destination_t *dest) {
+    uint64_t preimage_len;  // preimage len (including the 0x00 prefix of Merkle tree leaves)
 
     uint8_t partial_data_len;
 
-    if (!buffer_read_varint(&dispatcher_context->read_buffer, &preimage_len_u64) ||
-        !buffer_read_u8(&dispatcher_context->read_buffer, &partial_data_len) ||
-        !buffer_can_read(&dispatcher_context->read_buffer, partial_data_len)) {
+    if (!buffer_read_varint(read_buffer, &preimage_len) ||
+        !buffer_read_u8(read_buffer, &partial_data_len) ||
+        !buffer_can_read(read_buffer, partial_data_len)) {
         return -2;
     }
-    uint32_t preimage_len = (uint32_t) preimage_len_u64;
 
-    if (preimage_len < 1) {
-        // at least the initial 0x00 prefix should be there
+    // the length is returned as an int
+    if (preimage_len < 1 || preimage_len > INT32_MAX) {
         return -3;
     }
 
@@ -43,68 +86,96 @@ int call_get_preimage(dispatcher_context_t *dispatcher_context,
         return -4;
     }
 
-    buffer_t buffer_out = buffer_create(out, out_len);
+    progress->dest = dest;
+    progress->preimage_len = (size_t) preimage_len;
+    progress->bytes_received = 0;
 
-    uint8_t *data_ptr =
-        dispatcher_context->read_buffer.ptr + dispatcher_context->read_buffer.offset;
+    cx_sha256_init(&progress->hash_context);
 
-    cx_sha256_t hash_context;
-    cx_sha256_init(&hash_context);
-    // update hash
-    crypto_hash_update(&hash_context.header, data_ptr, partial_data_len);
+    if (dest->len_callback != NULL) {
+        dest->len_callback(progress->preimage_len - (dest->is_merkle_leaf ? 1 : 0),
+                           dest->callback_state);
+    }
 
-    // write to output buffer
-    buffer_write_bytes(&buffer_out, data_ptr, partial_data_len);
+    return process_chunk(read_buffer, progress, partial_data_len) < 0 ? -5 : 0;
+}
 
-    size_t bytes_remaining = (size_t) preimage_len - partial_data_len;
+int preimage_read_more_response(buffer_t *read_buffer, preimage_progress_t *progress) {
+    uint8_t n_elements, elements_len;
+    if (!buffer_read_u8(read_buffer, &n_elements) || !buffer_read_u8(read_buffer, &elements_len) ||
+        !buffer_can_read(read_buffer, (size_t) n_elements * elements_len)) {
+        return -7;
+    }
 
-    while (bytes_remaining > 0) {
-        uint8_t get_more_elements_req[] = {CCMD_GET_MORE_ELEMENTS};
-        SET_RESPONSE(dispatcher_context,
-                     get_more_elements_req,
-                     sizeof(get_more_elements_req),
-                     SW_INTERRUPTED_EXECUTION);
-        if (dispatcher_context->process_interruption(dispatcher_context) < 0) {
-            return -5;
-        }
+    // the elements are consecutive chunks of the preimage, of any length
+    size_t n_bytes = (size_t) n_elements * elements_len;
 
-        // Parse response to CCMD_GET_MORE_ELEMENTS
-        uint8_t n_bytes, elements_len;
-        if (!buffer_read_u8(&dispatcher_context->read_buffer, &n_bytes) ||
-            !buffer_read_u8(&dispatcher_context->read_buffer, &elements_len) ||
-            !buffer_can_read(&dispatcher_context->read_buffer, (size_t) n_bytes * elements_len)) {
-            return -6;
-        }
+    if (n_bytes == 0) {
+        PRINTF("Received no bytes.\n");
+        return -8;
+    }
 
-        if (elements_len != 1) {
-            PRINTF("Elements should be single bytes\n");
-            return -7;
-        }
+    return process_chunk(read_buffer, progress, n_bytes) < 0 ? -9 : 0;
+}
 
-        if (n_bytes > bytes_remaining) {
-            PRINTF("Received more bytes than expected.\n");
-            return -8;
-        }
+int preimage_check_hash(preimage_progress_t *progress, const uint8_t hash[static 32]) {
+    // hack: we pass the address of the final accumulator inside cx_sha256_t, so we don't need
+    // an additional variable in the stack to store the final hash.
+    crypto_hash_digest(&progress->hash_context.header, (uint8_t *) &progress->hash_context.acc, 32);
+
+    if (memcmp(progress->hash_context.acc, hash, 32) != 0) {
+        PRINTF("Hash mismatch.\n");
+        return -10;
+    }
 
-        uint8_t *data_ptr =
-            dispatcher_context->read_buffer.ptr + dispatcher_context->read_buffer.offset;
+    return (int) (progress->preimage_len - (progress->dest->is_merkle_leaf ? 1 : 0));
+}
 
-        // update hash
-        crypto_hash_update(&hash_context.header, data_ptr, n_bytes);
+int call_get_preimage_into(dispatcher_context_t *dispatcher_context,
+                           const uint8_t hash[static 32],
+                           const preimage_destination_t *dest) {
+    // LOG_PROCESSOR(dispatcher_context, __FILE__, __LINE__, __func__);
 
-        buffer_write_bytes(&buffer_out, data_ptr, n_bytes);
+    PRINT_STACK_POINTER();
 
-        bytes_remaining -= n_bytes;
+    // the request is written directly in the APDU buffer
+    buffer_t req = dc_get_request_buffer(dispatcher_context);
+    if (!preimage_write_request(&req, hash) || dc_exchange(dispatcher_context, &req) < 0) {
+        return -1;
     }
 
-    uint8_t computed_hash[32];
+    preimage_progress_t progress;
+    int res = preimage_read_response(&dispatcher_context->read_buffer, &progress, dest);
+    if (res < 0) {
+        return res;
+    }
 
-    crypto_hash_digest(&hash_context.header, computed_hash, 32);
+    while (preimage_is_incomplete(&progress)) {
+        buffer_t more_req = dc_get_request_buffer(dispatcher_context);
+        if (!buffer_write_u8(&more_req, CCMD_GET_MORE_ELEMENTS) ||
+            dc_exchange(dispatcher_context, &more_req) < 0) {
+            return -6;
+        }
 
-    if (memcmp(computed_hash, hash, 32) != 0) {
-        PRINTF("Hash mismatch.\n");
-        return -9;
+        res = preimage_read_more_response(&dispatcher_context->read_buffer, &progress);
+        if (res < 0) {
+            return res;
+        }
     }
 
-    return (int) preimage_len;
+    return preimage_check_hash(&progress, hash);
+}
+
+int call_get_preimage(dispatcher_context_t *dispatcher_context,
+                      const uint8_t hash[static 32],
+                      uint8_t *out,
+                      size_t out_len) {
+    preimage_destination_t dest = {.is_merkle_leaf = false, .out = out, .out_len = out_len};
+
+    int res = call_get_preimage_into(dispatcher_context, hash, &dest);
+    if (res >= 0 && (size_t) res > out_len) {
+        PRINTF("Output buffer too short\n");
+        return -11;
+    }
+    return res;
 }
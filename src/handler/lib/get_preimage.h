@@ -1,12 +1,97 @@
 #pragma once
 
 #include "../../boilerplate/dispatcher.h"
+#include "../../common/buffer.h"
+#include "../../crypto.h"
 
 /**
- * Given a sha256 hash, requests the corresponding pre-image to the host.
+ * Destination of the bytes of a preimage received with the GET_PREIMAGE client command.
  *
- * Returns a negative number on error, or the preimage length on success. This function validates
- * that the SHA256 of the data provided by the host does indeed match the expected hash.
+ * Each chunk of the preimage is hashed and consumed directly from the APDU buffer, without any
+ * intermediate copy: the bytes in the window [offset, offset + out_len) of the preimage are copied
+ * to out, each chunk is passed to callback (if not NULL), and all the other bytes are discarded
+ * once hashed. With out_len == 0 and no callback, the preimage is only verified against its hash.
+ */
+typedef struct {
+    // if true, the preimage is a leaf of a Merkle tree: its first byte must be the 0x00 prefix,
+    // that is not copied, not passed to the callbacks, and not counted in offset and in the lengths
+    bool is_merkle_leaf;
+    size_t offset;
+    uint8_t *out;
+    size_t out_len;
+    // if not NULL, called with the length of the preimage before any call to callback
+    void (*len_callback)(size_t, void *);
+    void (*callback)(buffer_t *, void *);
+    void *callback_state;
+} preimage_destination_t;
+
+/**
+ * Progress of the reception of a preimage.
+ */
+typedef struct {
+    cx_sha256_t hash_context;  // hash of the part of the preimage received so far
+    const preimage_destination_t *dest;
+    size_t preimage_len;    // including the 0x00 prefix of Merkle leaves
+    size_t bytes_received;  // including the 0x00 prefix of Merkle leaves
+} preimage_progress_t;
+
+/**
+ * Writes the GET_PREIMAGE request for the given hash. Returns false if it does not fit in req.
+ */
+bool preimage_write_request(buffer_t *req, const uint8_t hash[static 32]);
+
+/**
+ * Parses the response to GET_PREIMAGE from read_buffer, and processes its chunk of the preimage.
+ * The memory pointed by dest must stay valid until the reception is complete.
+ *
+ * Returns 0 on success, or a negative number on failure.
+ */
+int preimage_read_response(buffer_t *read_buffer,
+                           preimage_progress_t *progress,
+                           const preimage_destination_t *dest);
+
+/**
+ * Parses a response to GET_MORE_ELEMENTS from read_buffer, and processes its chunk of the
+ * preimage.
+ *
+ * Returns 0 on success, or a negative number on failure.
+ */
+int preimage_read_more_response(buffer_t *read_buffer, preimage_progress_t *progress);
+
+/**
+ * Returns true if the preimage was not completely received yet.
+ */
+static inline bool preimage_is_incomplete(const preimage_progress_t *progress) {
+    return progress->bytes_received < progress->preimage_len;
+}
+
+/**
+ * Checks the hash of the whole preimage, once it is completely received.
+ *
+ * Returns the length of the preimage (without the 0x00 prefix of Merkle leaves) if the hash
+ * matches, or a negative number otherwise.
+ */
+int preimage_check_hash(preimage_progress_t *progress, const uint8_t hash[static 32]);
+
+/**
+ * Given a sha256 hash, requests the corresponding pre-image to the host, and writes its bytes
+ * to dest as they are received (see preimage_destination_t).
+ *
+ * Returns a negative number on error, or the length of the whole preimage on success (without
+ * the 0x00 prefix if dest->is_merkle_leaf is true); if it is shorter than dest->offset +
+ * dest->out_len, only the available bytes are written to dest->out. This function validates that
+ * the SHA256 of the data provided by the host does indeed match the expected hash.
+ */
+int call_get_preimage_into(dispatcher_context_t *dispatcher_context,
+                           const uint8_t hash[static 32],
+                           const preimage_destination_t *dest);
+
+/**
+ * Given a sha256 hash, requests the corresponding pre-image to the host, and copies it to out.
+ *
+ * Returns a negative number on error (including if the preimage is longer than out_len), or the
+ * preimage length on success. This function validates that the SHA256 of the data provided by the
+ * host does indeed match the expected hash.
  */
 int call_get_preimage(dispatcher_context_t *dispatcher_context,
                       const uint8_t hash[static 32],
@@ -0,0 +1,177 @@
+#include <string.h>
+
+#include "host_storage.h"
+
+#include "authenticated_token.h"
+
+#include "../../boilerplate/sw.h"
+#include "../../common/read.h"
+#include "../../common/write.h"
+#include "../client_commands.h"
+
+void host_storage_init_session() {
+    clear_authenticated_token_key(AUTH_TOKEN_KEY_HOST_STORAGE);
+}
+
+// <record_id : 4 (big-endian)> <data>
+static size_t get_record_msg(uint32_t record_id,
+                             const uint8_t *data,
+                             size_t data_len,
+                             uint8_t out[static 4 + HOST_STORAGE_MAX_RECORD_LEN]) {
+    write_u32_be(out, 0, record_id);
+    memcpy(out + 4, data, data_len);
+    return 4 + data_len;
+}
+
+int call_put_record(dispatcher_context_t *dispatcher_context,
+                    uint32_t record_id,
+                    const uint8_t *data,
+                    size_t data_len) {
+    if (data_len > HOST_STORAGE_MAX_RECORD_LEN) {
+        return -1;
+    }
+
+    uint8_t msg[4 + HOST_STORAGE_MAX_RECORD_LEN];
+    uint8_t hmac[32];
+    size_t msg_len = get_record_msg(record_id, data, data_len, msg);
+    authenticated_token_compute(AUTH_TOKEN_KEY_HOST_STORAGE, msg, msg_len, hmac, sizeof(hmac));
+
+    buffer_t req = dc_get_request_buffer(dispatcher_context);
+    if (!buffer_write_u8(&req, CCMD_PUT_RECORD) || !buffer_write_u32(&req, record_id, BE) ||
+        !buffer_write_u8(&req, (uint8_t) data_len) || !buffer_write_bytes(&req, data, data_len) ||
+        !buffer_write_bytes(&req, hmac, sizeof(hmac)) ||
+        dc_exchange(dispatcher_context, &req) < 0) {
+        return -2;
+    }
+
+    if (buffer_can_read(&dispatcher_context->read_buffer, 1)) {
+        return -3;  // the response must be empty
+    }
+    return 0;
+}
+
+int call_get_record(dispatcher_context_t *dispatcher_context,
+                    uint32_t record_id,
+                    uint8_t *out,
+                    size_t out_len) {
+    buffer_t req = dc_get_request_buffer(dispatcher_context);
+    if (!buffer_write_u8(&req, CCMD_GET_RECORD) || !buffer_write_u32(&req, record_id, BE) ||
+        dc_exchange(dispatcher_context, &req) < 0) {
+        return -1;
+    }
+
+    uint8_t is_found, data_len;
+    if (!buffer_read_u8(&dispatcher_context->read_buffer, &is_found) || is_found > 1) {
+        return -2;
+    }
+    if (is_found == 0) {
+        return -3;
+    }
+
+    if (!buffer_read_u8(&dispatcher_context->read_buffer, &data_len) ||
+        data_len > HOST_STORAGE_MAX_RECORD_LEN || data_len > out_len) {
+        return -4;
+    }
+
+    uint8_t hmac[32];
+    if (!buffer_read_bytes(&dispatcher_context->read_buffer, out, data_len) ||
+        !buffer_read_bytes(&dispatcher_context->read_buffer, hmac, sizeof(hmac)) ||
+        buffer_can_read(&dispatcher_context->read_buffer, 1)) {
+        return -5;
+    }
+
+    uint8_t msg[4 + HOST_STORAGE_MAX_RECORD_LEN];
+    size_t msg_len = get_record_msg(record_id, out, data_len, msg);
+    if (!authenticated_token_check(AUTH_TOKEN_KEY_HOST_STORAGE, msg, msg_len, hmac, sizeof(hmac))) {
+        explicit_bzero(out, data_len);
+        return -6;
+    }
+
+    return data_len;
+}
+
+void host_storage_writer_init(host_storage_writer_t *writer, uint32_t first_record_id) {
+    writer->first_record_id = first_record_id;
+    writer->n_records = 0;
+    writer->buf_len = 0;
+}
+
+int call_write_stream(dispatcher_context_t *dispatcher_context,
+                      host_storage_writer_t *writer,
+                      const uint8_t *data,
+                      size_t data_len) {
+    while (data_len > 0) {
+        if (writer->buf_len == sizeof(writer->buf)) {
+            if (call_put_record(dispatcher_context,
+                                writer->first_record_id + writer->n_records,
+                                writer->buf,
+                                writer->buf_len) < 0) {
+                return -1;
+            }
+            ++writer->n_records;
+            writer->buf_len = 0;
+        }
+
+        size_t n = MIN(data_len, sizeof(writer->buf) - writer->buf_len);
+        memcpy(writer->buf + writer->buf_len, data, n);
+        writer->buf_len += n;
+        data += n;
+        data_len -= n;
+    }
+    return 0;
+}
+
+int call_flush_stream(dispatcher_context_t *dispatcher_context, host_storage_writer_t *writer) {
+    if (writer->buf_len == 0) {
+        return 0;
+    }
+
+    if (call_put_record(dispatcher_context,
+                        writer->first_record_id + writer->n_records,
+                        writer->buf,
+                        writer->buf_len) < 0) {
+        return -1;
+    }
+    ++writer->n_records;
+    writer->buf_len = 0;
+    return 0;
+}
+
+void host_storage_reader_init(host_storage_reader_t *reader, uint32_t first_record_id) {
+    reader->first_record_id = first_record_id;
+    reader->n_records = 0;
+    reader->buf_len = 0;
+    reader->buf_pos = 0;
+}
+
+int call_read_stream(dispatcher_context_t *dispatcher_context,
+                     host_storage_reader_t *reader,
+                     uint8_t *out,
+                     size_t out_len) {
+    while (out_len > 0) {
+        if (reader->buf_pos == reader->buf_len) {
+            // only the last record of the stream can be shorter than HOST_STORAGE_MAX_RECORD_LEN
+            if (reader->n_records > 0 && reader->buf_len != sizeof(reader->buf)) {
+                return -1;
+            }
+
+            int res = call_get_record(dispatcher_context,
+                                      reader->first_record_id + reader->n_records,
+                                      reader->buf,
+                                      sizeof(reader->buf));
+            if (res <= 0) {
+                return -2;
+            }
+            ++reader->n_records;
+            reader->buf_len = (size_t) res;
+            reader->buf_pos = 0;
+        }
+
+        size_t n = MIN(out_len, reader->buf_len - reader->buf_pos);
+        memcpy(out, reader->buf + reader->buf_pos, n);
+        reader->buf_pos += n;
+        out += n;
+        out_len -= n;
+    }
+    return 0;
+}
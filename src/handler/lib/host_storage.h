@@ -0,0 +1,103 @@
+#pragma once
+
+#include "../../boilerplate/dispatcher.h"
+
+/**
+ * Maximum length of the data of a record stored on the host.
+ */
+#define HOST_STORAGE_MAX_RECORD_LEN 176
+
+/**
+ * Starts a new session of the host storage. The records are authenticated with the key
+ * AUTH_TOKEN_KEY_HOST_STORAGE, derived from the symmetric key of the HOST_STORAGE_SLIP0021_LABEL
+ * label and a random nonce that is drawn again at each new session; therefore, the records stored
+ * in a different session are rejected.
+ * The records are authenticated, but not encrypted; therefore, they must not contain secrets.
+ */
+void host_storage_init_session();
+
+/**
+ * Stores a record on the host, using the CCMD_PUT_RECORD client command. Each record_id must only be
+ * stored once per session, as a previous record with the same record_id could be returned instead.
+ *
+ * @return 0 on success, a negative number on failure.
+ */
+int call_put_record(dispatcher_context_t *dispatcher_context,
+                    uint32_t record_id,
+                    const uint8_t *data,
+                    size_t data_len);
+
+/**
+ * Retrieves a record from the host, using the CCMD_GET_RECORD client command, and verifies that it
+ * was stored with the given record_id during the same session.
+ *
+ * @return the length of the record on success; a negative number on failure, including if the
+ * record is not found or not authentic, or if it is longer than out_len.
+ */
+int call_get_record(dispatcher_context_t *dispatcher_context,
+                    uint32_t record_id,
+                    uint8_t *out,
+                    size_t out_len);
+
+/**
+ * State of a sequential writer of a byte stream stored on the host. The stream is split in records
+ * of HOST_STORAGE_MAX_RECORD_LEN bytes (except possibly the last one), with consecutive record ids
+ * starting from first_record_id.
+ */
+typedef struct {
+    uint32_t first_record_id;
+    uint32_t n_records;  // number of records already stored
+    size_t buf_len;
+    uint8_t buf[HOST_STORAGE_MAX_RECORD_LEN];
+} host_storage_writer_t;
+
+/**
+ * State of a sequential reader of a byte stream stored with a host_storage_writer_t.
+ */
+typedef struct {
+    uint32_t first_record_id;
+    uint32_t n_records;  // number of records already retrieved
+    size_t buf_len;
+    size_t buf_pos;
+    uint8_t buf[HOST_STORAGE_MAX_RECORD_LEN];
+} host_storage_reader_t;
+
+/**
+ * Initializes a writer for a stream whose first record has id first_record_id.
+ */
+void host_storage_writer_init(host_storage_writer_t *writer, uint32_t first_record_id);
+
+/**
+ * Appends data to the stream, storing a record on the host every time HOST_STORAGE_MAX_RECORD_LEN
+ * bytes are accumulated.
+ *
+ * @return 0 on success, a negative number on failure.
+ */
+int call_write_stream(dispatcher_context_t *dispatcher_context,
+                      host_storage_writer_t *writer,
+                      const uint8_t *data,
+                      size_t data_len);
+
+/**
+ * Stores the last (possibly partial) record of the stream. It must be called once, after the last
+ * call to call_write_stream.
+ *
+ * @return 0 on success, a negative number on failure.
+ */
+int call_flush_stream(dispatcher_context_t *dispatcher_context, host_storage_writer_t *writer);
+
+/**
+ * Initializes a reader for a stream whose first record has id first_record_id.
+ */
+void host_storage_reader_init(host_storage_reader_t *reader, uint32_t first_record_id);
+
+/**
+ * Reads the next out_len bytes of the stream, retrieving the records from the host as needed.
+ *
+ * @return 0 on success, a negative number on failure, including if the stream is shorter than
+ * requested or any of its records is not authentic.
+ */
+int call_read_stream(dispatcher_context_t *dispatcher_context,
+                     host_storage_reader_t *reader,
+                     uint8_t *out,
+                     size_t out_len);
@@ -0,0 +1,62 @@
+#include <string.h>
+
+#include "ownership_token.h"
+
+#include "authenticated_token.h"
+
+#include "../../common/write.h"
+
+#define OWNERSHIP_TOKEN_MAX_MSG_LEN (32 + 1 + 4 + 1 + OWNERSHIP_TOKEN_MAX_SCRIPT_LEN)
+
+// serializes <wallet_id : 32> <change : 1> <address_index : 4> <script_len : 1> <script>, and
+// returns its length; script_len must be at most OWNERSHIP_TOKEN_MAX_SCRIPT_LEN
+static size_t get_ownership_token_msg(const uint8_t wallet_id[static 32],
+                                      uint32_t change,
+                                      uint32_t address_index,
+                                      const uint8_t *script,
+                                      size_t script_len,
+                                      uint8_t out[static OWNERSHIP_TOKEN_MAX_MSG_LEN]) {
+    memcpy(out, wallet_id, 32);
+    out[32] = (uint8_t) change;
+    write_u32_be(out, 33, address_index);
+    out[37] = (uint8_t) script_len;
+    memcpy(out + 38, script, script_len);
+    return 38 + script_len;
+}
+
+void compute_ownership_token(const uint8_t wallet_id[static 32],
+                             uint32_t change,
+                             uint32_t address_index,
+                             const uint8_t *script,
+                             size_t script_len,
+                             uint8_t out[static OWNERSHIP_TOKEN_LEN]) {
+    if (script_len > OWNERSHIP_TOKEN_MAX_SCRIPT_LEN) {
+        memset(out, 0, OWNERSHIP_TOKEN_LEN);  // never accepted by check_ownership_token
+        return;
+    }
+
+    uint8_t msg[OWNERSHIP_TOKEN_MAX_MSG_LEN];
+    size_t msg_len =
+        get_ownership_token_msg(wallet_id, change, address_index, script, script_len, msg);
+    authenticated_token_compute(AUTH_TOKEN_KEY_OWNERSHIP, msg, msg_len, out, OWNERSHIP_TOKEN_LEN);
+}
+
+bool check_ownership_token(const uint8_t wallet_id[static 32],
+                           uint32_t change,
+                           uint32_t address_index,
+                           const uint8_t *script,
+                           size_t script_len,
+                           const uint8_t token[static OWNERSHIP_TOKEN_LEN]) {
+    if (change > 1 || script_len > OWNERSHIP_TOKEN_MAX_SCRIPT_LEN) {
+        return false;
+    }
+
+    uint8_t msg[OWNERSHIP_TOKEN_MAX_MSG_LEN];
+    size_t msg_len =
+        get_ownership_token_msg(wallet_id, change, address_index, script, script_len, msg);
+    return authenticated_token_check(AUTH_TOKEN_KEY_OWNERSHIP,
+                                     msg,
+                                     msg_len,
+                                     token,
+                                     OWNERSHIP_TOKEN_LEN);
+}
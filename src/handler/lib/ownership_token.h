@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define OWNERSHIP_TOKEN_LEN 16
+
+/**
+ * Maximum length of a script with an ownership token; enough for the scriptPubKey of any
+ * supported wallet policy.
+ */
+#define OWNERSHIP_TOKEN_MAX_SCRIPT_LEN 34
+
+/**
+ * Key of the proprietary field of a PSBT input or output that contains its ownership token:
+ * <PSBT_{IN,OUT}_PROPRIETARY> <identifier_len : 1> "LEDGER" <subtype : 1>, with no keydata.
+ */
+#define PSBT_OWNERSHIP_TOKEN_KEY     "\xFC\x06LEDGER\x00"
+#define PSBT_OWNERSHIP_TOKEN_KEY_LEN (sizeof(PSBT_OWNERSHIP_TOKEN_KEY) - 1)
+
+/**
+ * Computes the ownership token of the scriptPubKey of a wallet policy at the given change and
+ * address_index, that is the first OWNERSHIP_TOKEN_LEN bytes of the HMAC-SHA256 of
+ * <wallet_id : 32> <change : 1> <address_index : 4 (big-endian)> <script_len : 1> <script>.
+ * The key is AUTH_TOKEN_KEY_OWNERSHIP, derived from the symmetric key of the
+ * OWNERSHIP_TOKEN_SLIP0021_LABEL label only; therefore, the tokens remain valid as long as the seed
+ * is the same.
+ *
+ * Only compute tokens for scripts that were derived from the wallet policy, as a valid token
+ * is accepted by SIGN_PSBT instead of deriving the script again. If script_len is larger than
+ * OWNERSHIP_TOKEN_MAX_SCRIPT_LEN, the output is zeroed, and never accepted as a token.
+ */
+void compute_ownership_token(const uint8_t wallet_id[static 32],
+                             uint32_t change,
+                             uint32_t address_index,
+                             const uint8_t *script,
+                             size_t script_len,
+                             uint8_t out[static OWNERSHIP_TOKEN_LEN]);
+
+/**
+ * Verifies, in constant time, the ownership token of a scriptPubKey.
+ *
+ * @return true if the token is valid, false otherwise.
+ */
+bool check_ownership_token(const uint8_t wallet_id[static 32],
+                           uint32_t change,
+                           uint32_t address_index,
+                           const uint8_t *script,
+                           size_t script_len,
+                           const uint8_t token[static OWNERSHIP_TOKEN_LEN]);
@@ -3,50 +3,54 @@
 #include "policy.h"
 
 #include "../lib/get_merkle_leaf_element.h"
+#include "../lib/stream_merkle_leaves.h"
+#include "../client_commands.h"
 #include "../../crypto.h"
 #include "../../common/base58.h"
+#include "../../common/read.h"
+#include "../../common/script.h"
 #include "../../common/segwit_addr.h"
 
-extern global_context_t G_context;
-
-#define MAX_POLICY_DEPTH 3
-
-#define MODE_OUT_BYTES 0
-#define MODE_OUT_HASH  1
-
-typedef struct {
-    const policy_node_t *policy_node;
-
-    // Only one of the two is used, depending on the `mode`
-    union {
-        cx_sha256_t *hash_context;
-        buffer_t *out_buf;
-    };
-
-    // used to identify the stage of execution for nodes that require multiple rounds
-    uint8_t step;
-
-    // MODE_OUT_BYTES if the current node is outputting the actual script bytes, or MODE_OUT_HASH
-    // if it is outputting the script hash
-    uint8_t mode;
-} policy_parser_node_state_t;
+/**
+ * Opcodes of the code of a policy_script_template_t.
+ */
+#define TEMPLATE_OP_BYTES         0x00  // followed by a length byte, and that many literal bytes
+#define TEMPLATE_OP_KEY_HASH160   0x01  // followed by a key index; hash160 of the derived pubkey
+#define TEMPLATE_OP_KEYS          0x02  // followed by n and n key indexes; pushes of the pubkeys
+#define TEMPLATE_OP_SORTED_KEYS   0x03  // like TEMPLATE_OP_KEYS, with the pubkeys sorted
+#define TEMPLATE_OP_TR_OUTPUT_KEY 0x04  // followed by a key index; tweaked taproot output key
+#define TEMPLATE_OP_KEY           0x05  // followed by a key index; the derived compressed pubkey
+#define TEMPLATE_OP_XONLY_KEY     0x06  // followed by a key index; the x-only derived pubkey
+#define TEMPLATE_OP_XONLY_HASH160 0x07  // followed by a key index; hash160 of the x-only pubkey
+#define TEMPLATE_OP_TAPLEAF       0x08  // followed by the 2-byte length of the leaf script
+#define TEMPLATE_OP_TAPLEAF_END   0x09  // pushes the TapLeaf hash of the leaf to the stack
+#define TEMPLATE_OP_TAPBRANCH     0x0A  // replaces the top two hashes with their TapBranch hash
 
 typedef struct {
     dispatcher_context_t *dispatcher_context;
     const uint8_t *keys_merkle_root;
     uint32_t n_keys;
+    policy_pubkeys_cache_t *pubkeys_cache;  // NULL if not used
     bool change;
     size_t address_index;
 
-    policy_parser_node_state_t nodes[MAX_POLICY_DEPTH];  // stack of nodes being processed
-    int node_stack_eos;  // index of node being processed within nodes; will be set -1 at the end of
-                         // processing
+    // the script is written to out_buf if not NULL; otherwise, it is added to the hash_context
+    buffer_t *out_buf;
+    cx_sha256_t hash_context;
 
-    cx_sha256_t hash_context;  // shared among all the nodes; there are never two concurrent hash
-                               // computations in process.
-    uint8_t hash[32];  // when a node processed in hash mode is popped, the hash is computed here
+    // if not NULL, the merkle root of the tree of a tr() policy is written here instead of the
+    // script
+    uint8_t *tr_merkle_root_out;
+
+    // set once the first sorted multisig whose keys are streamed is emitted, as the order of the
+    // keys in the cache only refers to it
+    bool has_streamed_sorted_keys;
 } policy_parser_state_t;
 
+// returned while emitting the script if the keys of a sorted multisig are not in the order of the
+// hint in the cache
+#define SORTED_KEYS_ORDER_MISMATCH (-2)
+
 // comparator for pointers to compressed pubkeys
 static int cmp_compressed_pubkeys(const void *a, const void *b) {
     const uint8_t *key_a = (const uint8_t *) a;
@@ -64,34 +68,22 @@ static int cmp_compressed_pubkeys(const void *a, const void *b) {
 // p2sh (also nested segwit) ==> legacy script  (start with 3 on mainnet, 2 on testnet)
 // p2wpkh or p2wsh           ==> bech32         (sart with bc1 on mainnet, tb1 on testnet)
 
-// convenience function, split from get_derived_pubkey only to improve stack usage
-// returns -1 on error, 0 if the returned key info has no wildcard (**), 1 if it has the wildcard
-static int __attribute__((noinline)) get_extended_pubkey(policy_parser_state_t *state,
-                                                         int key_index,
-                                                         serialized_extended_pubkey_t *out) {
-    PRINT_STACK_POINTER();
-
+// decodes the extended pubkey of a key information, and the steps of its wildcard in multipath
+// returns -1 on error, 0 if the key info has no wildcard, 1 if it has the wildcard (** or <M;N>/*)
+static int decode_key_info(buffer_t *key_info_buffer,
+                           serialized_extended_pubkey_t *out,
+                           uint32_t multipath[static 2]) {
     policy_map_key_info_t key_info;
+    if (parse_policy_map_key_info(key_info_buffer, &key_info) == -1) {
+        return -1;
+    }
 
-    {
-        char key_info_str[MAX_POLICY_KEY_INFO_LEN];
-
-        int key_info_len = call_get_merkle_leaf_element(state->dispatcher_context,
-                                                        state->keys_merkle_root,
-                                                        state->n_keys,
-                                                        key_index,
-                                                        (uint8_t *) key_info_str,
-                                                        sizeof(key_info_str));
-        if (key_info_len == -1) {
-            return -1;
-        }
-
-        // Make a sub-buffer for the pubkey info
-        buffer_t key_info_buffer = buffer_create(key_info_str, key_info_len);
+    multipath[0] = key_info.multipath[0];
+    multipath[1] = key_info.multipath[1];
 
-        if (parse_policy_map_key_info(&key_info_buffer, &key_info) == -1) {
-            return -1;
-        }
+    if (key_info.is_binary) {
+        memcpy(out, key_info.serialized_ext_pubkey, sizeof(serialized_extended_pubkey_t));
+        return key_info.has_wildcard ? 1 : 0;
     }
 
     // decode pubkey
@@ -111,73 +103,167 @@ static int __attribute__((noinline)) get_extended_pubkey(policy_parser_state_t *
     return key_info.has_wildcard ? 1 : 0;
 }
 
-static int get_derived_pubkey(policy_parser_state_t *state, int key_index, uint8_t out[static 33]) {
-    PRINT_STACK_POINTER();
+_Static_assert(sizeof(serialized_extended_pubkey_t) == SERIALIZED_EXTENDED_PUBKEY_LEN,
+               "Unexpected size of serialized_extended_pubkey_t");
 
-    serialized_extended_pubkey_t ext_pubkey;
+int check_key_info_pubkey(const policy_map_key_info_t *key_info, uint32_t bip32_pubkey_version) {
+    if (key_info->is_binary) {
+        serialized_extended_pubkey_t pubkey_derived;
+        if (get_extended_pubkey_at_path(key_info->master_key_derivation,
+                                        key_info->master_key_derivation_len,
+                                        bip32_pubkey_version,
+                                        &pubkey_derived) == -1) {
+            return -1;
+        }
+        return memcmp(&pubkey_derived, key_info->serialized_ext_pubkey, sizeof(pubkey_derived)) == 0
+                   ? 1
+                   : 0;
+    }
 
-    int ret = get_extended_pubkey(state, key_index, &ext_pubkey);
-    if (ret < 0) {
+    char pubkey_derived[MAX_SERIALIZED_PUBKEY_LENGTH + 1];
+    if (get_serialized_extended_pubkey_at_path(key_info->master_key_derivation,
+                                               key_info->master_key_derivation_len,
+                                               bip32_pubkey_version,
+                                               pubkey_derived) == -1) {
         return -1;
     }
+    return strncmp(key_info->ext_pubkey, pubkey_derived, MAX_SERIALIZED_PUBKEY_LENGTH) == 0 ? 1 : 0;
+}
+
+// convenience function, split from get_derived_pubkey only to improve stack usage
+// returns -1 on error, 0 if the returned key info has no wildcard, 1 if it has the wildcard
+static int __attribute__((noinline)) get_extended_pubkey(dispatcher_context_t *dispatcher_context,
+                                                         const uint8_t keys_merkle_root[static 32],
+                                                         uint32_t n_keys,
+                                                         int key_index,
+                                                         serialized_extended_pubkey_t *out,
+                                                         uint32_t multipath[static 2]) {
+    PRINT_STACK_POINTER();
+
+    char key_info_str[MAX_POLICY_KEY_INFO_LEN];
 
-    if (ret == 1) {
-        // we derive the /0/i child of this pubkey
-        // we reuse the same memory of ext_pubkey
-        bip32_CKDpub(&ext_pubkey, state->change, &ext_pubkey);
-        bip32_CKDpub(&ext_pubkey, state->address_index, &ext_pubkey);
+    int key_info_len = call_get_merkle_leaf_element(dispatcher_context,
+                                                    keys_merkle_root,
+                                                    n_keys,
+                                                    key_index,
+                                                    (uint8_t *) key_info_str,
+                                                    sizeof(key_info_str));
+    if (key_info_len < 0) {
+        return -1;
     }
 
-    memcpy(out, ext_pubkey.compressed_pubkey, 33);
+    // Make a sub-buffer for the pubkey info
+    buffer_t key_info_buffer = buffer_create(key_info_str, key_info_len);
 
-    return 0;
+    return decode_key_info(&key_info_buffer, out, multipath);
 }
 
-/**
- * Pushes a node onto the stack. Returns 0 on success, -1 if the stack is exhausted.
- */
-static int state_stack_push(policy_parser_state_t *state, policy_node_t *policy_node) {
-    ++state->node_stack_eos;
-
-    if (state->node_stack_eos >= MAX_POLICY_DEPTH) {
+// fills the cache entry of a key for the receive (change = 0) or change (change = 1) addresses:
+// for a key with wildcard, its child at the step of the multipath wildcard; otherwise, the key
+// returns -1 on error, 0 on success
+static int derive_pubkey_cache_entry(const serialized_extended_pubkey_t *ext_pubkey,
+                                     bool has_wildcard,
+                                     const uint32_t multipath[static 2],
+                                     bool change,
+                                     policy_pubkey_cache_entry_t *entry) {
+    if (crypto_get_uncompressed_pubkey(ext_pubkey->compressed_pubkey, entry->pubkey) < 0) {
         return -1;
     }
+    memcpy(entry->chain_code, ext_pubkey->chain_code, 32);
 
-    policy_parser_node_state_t *node = &state->nodes[state->node_stack_eos];
-    cx_sha256_init(&state->hash_context);
-    node->policy_node = policy_node;
-    node->step = 0;
-    node->mode = MODE_OUT_HASH;
-    node->hash_context = &state->hash_context;
+    uint32_t step = multipath[change ? 1 : 0];
+    if (has_wildcard &&
+        bip32_CKDpub_point(entry->pubkey, entry->chain_code, step, entry->pubkey) < 0) {
+        return -1;
+    }
 
+    entry->is_valid = true;
+    entry->has_wildcard = has_wildcard;
+    entry->change = change;
     return 0;
 }
 
-/**
- * Pops a node the stack. If the node is in HASH mode, computes the hash.
- * Returns 0 on success, -1 on error.
- */
-static int state_stack_pop(policy_parser_state_t *state) {
-    policy_parser_node_state_t *node = &state->nodes[state->node_stack_eos];
+static int get_derived_pubkey(policy_parser_state_t *state, int key_index, uint8_t out[static 33]) {
+    PRINT_STACK_POINTER();
 
-    if (state->node_stack_eos >= MAX_POLICY_DEPTH || state->node_stack_eos <= -1) {
-        return -1;
+    // the keys are kept uncompressed while deriving, and only compressed at the end
+    policy_pubkey_cache_entry_t derived;
+    uint8_t *pubkey = derived.pubkey;
+    uint8_t *chain_code = derived.chain_code;
+
+    policy_pubkey_cache_entry_t *cached = NULL;
+    if (state->pubkeys_cache != NULL && key_index >= 0 && key_index < POLICY_PUBKEYS_CACHE_SIZE) {
+        // with a single entry per key, it holds the most recently used change step
+        cached = &state->pubkeys_cache
+                      ->keys[key_index][state->change ? POLICY_PUBKEYS_CACHE_CHANGE_STEPS - 1 : 0];
     }
 
-    if (node->mode == MODE_OUT_HASH) {
-        crypto_hash_digest(&state->hash_context.header, state->hash, 32);
+    if (cached != NULL && cached->is_valid &&
+        (!cached->has_wildcard || cached->change == state->change)) {
+        PERF_COUNT_CACHE(CACHE_POLICY_PUBKEYS, hits, sizeof(state->pubkeys_cache->keys));
+        memcpy(&derived, cached, sizeof(derived));
+    } else {
+        if (cached != NULL) {
+            PERF_COUNT_CACHE(CACHE_POLICY_PUBKEYS, misses, sizeof(state->pubkeys_cache->keys));
+        }
+        serialized_extended_pubkey_t ext_pubkey;
+        bool has_wildcard;
+        uint32_t multipath[2];
+
+        if (cached != NULL && state->pubkeys_cache->has_ext_pubkeys &&
+            (uint32_t) key_index < state->n_keys) {
+            memcpy(&ext_pubkey, &state->pubkeys_cache->ext_pubkeys[key_index], sizeof(ext_pubkey));
+            has_wildcard = state->pubkeys_cache->has_wildcard[key_index];
+            memcpy(multipath, state->pubkeys_cache->multipath[key_index], sizeof(multipath));
+        } else {
+            int ret = get_extended_pubkey(state->dispatcher_context,
+                                          state->keys_merkle_root,
+                                          state->n_keys,
+                                          key_index,
+                                          &ext_pubkey,
+                                          multipath);
+            if (ret < 0) {
+                return -1;
+            }
+            has_wildcard = (ret == 1);
+        }
+
+        // for keys with wildcard, we derive the child at the change level
+        if (derive_pubkey_cache_entry(&ext_pubkey,
+                                      has_wildcard,
+                                      multipath,
+                                      state->change,
+                                      &derived) < 0) {
+            return -1;
+        }
+
+        if (cached != NULL) {
+            if (cached->is_valid) {
+                PERF_COUNT_CACHE(CACHE_POLICY_PUBKEYS,
+                                 evictions,
+                                 sizeof(state->pubkeys_cache->keys));
+            }
+            memcpy(cached, &derived, sizeof(derived));
+        }
     }
 
-    --state->node_stack_eos;
+    if (derived.has_wildcard) {
+        // we derive the /i child of the /change pubkey
+        if (bip32_CKDpub_point(pubkey, chain_code, state->address_index, pubkey) < 0) {
+            return -1;
+        }
+    }
+
+    crypto_get_compressed_pubkey(pubkey, out);
+
     return 0;
 }
 
 static void update_output(policy_parser_state_t *state, const uint8_t *data, size_t data_len) {
-    policy_parser_node_state_t *node = &state->nodes[state->node_stack_eos];
-    if (node->mode == MODE_OUT_BYTES) {
-        buffer_write_bytes(node->out_buf, data, data_len);
+    if (state->out_buf != NULL) {
+        buffer_write_bytes(state->out_buf, data, data_len);
     } else {
-        crypto_hash_update(&node->hash_context->header, data, data_len);
+        crypto_hash_update(&state->hash_context.header, data, data_len);
     }
 }
 
@@ -185,269 +271,1565 @@ static void update_output_u8(policy_parser_state_t *state, const uint8_t data) {
     update_output(state, &data, 1);
 }
 
-static int __attribute__((noinline)) process_pkh_wpkh_node(policy_parser_state_t *state) {
-    PRINT_STACK_POINTER();
+/**
+ * Sorting network for up to 5 elements; the comparators involving the positions past the number of
+ * elements are skipped, which still sorts them.
+ */
+static const uint8_t sorting_network[][2] =
+    {{0, 1}, {3, 4}, {2, 4}, {2, 3}, {0, 3}, {0, 2}, {1, 4}, {1, 3}, {1, 2}};
+
+_Static_assert(POLICY_MULTISIG_MAX_CACHED_KEYS <= 5, "The sorting network is too small");
+
+// sorts the permutation `order` of the n pubkeys, so that they are in lexicographic order
+static void sort_compressed_pubkeys(uint8_t pubkeys[][33], uint8_t *order, unsigned int n) {
+    for (unsigned int i = 0; i < sizeof(sorting_network) / sizeof(sorting_network[0]); i++) {
+        uint8_t a = sorting_network[i][0];
+        uint8_t b = sorting_network[i][1];
+        if (b < n && cmp_compressed_pubkeys(pubkeys[order[a]], pubkeys[order[b]]) > 0) {
+            uint8_t t = order[a];
+            order[a] = order[b];
+            order[b] = t;
+        }
+    }
+}
+
+static void emit_pubkey_push(policy_parser_state_t *state, const uint8_t pubkey[static 33]) {
+    // push <pubkey> (33 = 0x21 bytes)
+    update_output_u8(state, 0x21);
+    update_output(state, pubkey, 33);
+}
+
+// stores the order of the keys of a sorted multisig in the cache entry known_order, if not NULL
+static void remember_sorted_keys_order(const policy_parser_state_t *state,
+                                       policy_sorted_keys_order_t *known_order,
+                                       const uint8_t *order,
+                                       unsigned int n) {
+    if (known_order != NULL) {
+        known_order->is_valid = true;
+        known_order->change = state->change;
+        known_order->n = (uint8_t) n;
+        known_order->address_index = (uint32_t) state->address_index;
+        memcpy(known_order->order, order, n);
+    }
+}
 
-    policy_parser_node_state_t *node = &state->nodes[state->node_stack_eos];
+/**
+ * Emits the pushes of the pubkeys of a multisig with more than POLICY_MULTISIG_MAX_CACHED_KEYS
+ * keys, deriving them one at a time, so that only a few pubkeys are in memory at any time.
+ * For sortedmulti, a first pass sorts the keys by their first 4 bytes; in the unlikely case that
+ * two of them are equal, the keys are instead ordered by repeated selection passes, each deriving
+ * all the keys and emitting the smallest one that follows the previously emitted one.
+ * If the order of the keys at this address is in the cache, the keys are instead derived once in
+ * that order, and SORTED_KEYS_ORDER_MISMATCH is returned as soon as they turn out not to be sorted;
+ * otherwise, the order is stored in the cache once known.
+ */
+static int __attribute__((noinline)) stream_multisig_keys(policy_parser_state_t *state,
+                                                          const uint8_t *key_indexes,
+                                                          unsigned int n,
+                                                          bool sorted) {
+    PRINT_STACK_POINTER();
 
-    if (node->step != 0) {
+    if (n > MAX_POLICY_MAP_COSIGNERS) {
         return -1;
     }
 
-    policy_node_with_key_t *policy = (policy_node_with_key_t *) node->policy_node;
+    uint8_t pubkey[33];
+    uint8_t prev_pubkey[33];
+
+    policy_sorted_keys_order_t *known_order = NULL;
+    if (sorted && state->pubkeys_cache != NULL && !state->has_streamed_sorted_keys) {
+        state->has_streamed_sorted_keys = true;
+        known_order = &state->pubkeys_cache->sorted_keys_order;
+
+        if (known_order->is_valid && known_order->n == n &&
+            known_order->change == state->change &&
+            known_order->address_index == state->address_index) {
+            // the keys only need to be derived once, and checked to be in order
+            for (unsigned int i = 0; i < n; i++) {
+                if (-1 == get_derived_pubkey(state, key_indexes[known_order->order[i]], pubkey)) {
+                    return -1;
+                }
+                if (i > 0 && cmp_compressed_pubkeys(prev_pubkey, pubkey) > 0) {
+                    return SORTED_KEYS_ORDER_MISMATCH;
+                }
+                emit_pubkey_push(state, pubkey);
+                memcpy(prev_pubkey, pubkey, 33);
+            }
+            return 0;
+        }
+    }
 
-    unsigned int out_len;
-    if (policy->type == TOKEN_PKH) {
-        out_len = 3 + 20 + 2;
-    } else {
-        out_len = 2 + 20;
+    uint8_t order[MAX_POLICY_MAP_COSIGNERS];
+    for (unsigned int i = 0; i < n; i++) {
+        order[i] = i;
     }
 
-    if (node->mode == MODE_OUT_BYTES && !buffer_can_read(node->out_buf, out_len)) {
-        return -1;
+    bool has_prefix_collision = false;
+    if (sorted) {
+        uint32_t prefixes[MAX_POLICY_MAP_COSIGNERS];
+        for (unsigned int i = 0; i < n; i++) {
+            if (-1 == get_derived_pubkey(state, key_indexes[i], pubkey)) {
+                return -1;
+            }
+            prefixes[i] = read_u32_be(pubkey, 0);
+        }
+
+        // insertion sort of the permutation
+        for (unsigned int i = 1; i < n; i++) {
+            uint8_t cur = order[i];
+            unsigned int j = i;
+            while (j > 0 && prefixes[order[j - 1]] > prefixes[cur]) {
+                order[j] = order[j - 1];
+                --j;
+            }
+            order[j] = cur;
+        }
+
+        for (unsigned int i = 1; i < n; i++) {
+            if (prefixes[order[i - 1]] == prefixes[order[i]]) {
+                has_prefix_collision = true;
+            }
+        }
     }
 
-    uint8_t compressed_pubkey[33];
+    if (!has_prefix_collision) {
+        for (unsigned int i = 0; i < n; i++) {
+            if (-1 == get_derived_pubkey(state, key_indexes[order[i]], pubkey)) {
+                return -1;
+            }
+            emit_pubkey_push(state, pubkey);
+        }
+        remember_sorted_keys_order(state, known_order, order, n);
+        return 0;
+    }
 
-    if (node->mode == MODE_OUT_HASH) {
-        cx_sha256_init(&state->hash_context);
+    // the keys are ordered by (pubkey, position), so that equal pubkeys are also emitted once each
+    int prev_index = -1;
+    for (unsigned int j = 0; j < n; j++) {
+        uint8_t best_pubkey[33];
+        int best_index = -1;
+        for (unsigned int i = 0; i < n; i++) {
+            if (-1 == get_derived_pubkey(state, key_indexes[i], pubkey)) {
+                return -1;
+            }
+
+            if (prev_index >= 0) {
+                int cmp = cmp_compressed_pubkeys(pubkey, prev_pubkey);
+                if (cmp < 0 || (cmp == 0 && (int) i <= prev_index)) {
+                    continue;  // already emitted
+                }
+            }
+
+            if (best_index == -1 || cmp_compressed_pubkeys(pubkey, best_pubkey) < 0) {
+                memcpy(best_pubkey, pubkey, 33);
+                best_index = i;
+            }
+        }
+
+        emit_pubkey_push(state, best_pubkey);
+        memcpy(prev_pubkey, best_pubkey, 33);
+        prev_index = best_index;
+        order[j] = (uint8_t) best_index;
     }
+    remember_sorted_keys_order(state, known_order, order, n);
+    return 0;
+}
 
-    int result;
-    if (-1 == get_derived_pubkey(state, policy->key_index, compressed_pubkey)) {
-        return -1;
-    } else if (policy->type == TOKEN_PKH) {
-        update_output_u8(state, 0x76);
-        update_output_u8(state, 0xa9);
-        update_output_u8(state, 0x14);
+static int __attribute__((noinline)) emit_multisig_keys(policy_parser_state_t *state,
+                                                        const uint8_t *key_indexes,
+                                                        unsigned int n,
+                                                        bool sorted) {
+    PRINT_STACK_POINTER();
 
-        crypto_hash160(compressed_pubkey, 33, compressed_pubkey);  // reuse memory
-        update_output(state, compressed_pubkey, 20);
+    if (n > POLICY_MULTISIG_MAX_CACHED_KEYS) {
+        return stream_multisig_keys(state, key_indexes, n, sorted);
+    }
 
-        update_output_u8(state, 0x88);
-        update_output_u8(state, 0xac);
+    // there is only one multisig in a policy, therefore the keys only depend on the address
+    policy_pubkeys_cache_t *cache = state->pubkeys_cache;
+    policy_multisig_keys_cache_entry_t *entry = NULL;
+    if (cache != NULL) {
+        entry = &cache->multisig_keys[0];
+        for (int i = 0; i < POLICY_MULTISIG_KEYS_CACHE_SIZE; i++) {
+            policy_multisig_keys_cache_entry_t *cur = &cache->multisig_keys[i];
+            if (cur->is_valid && cur->n == n && cur->change == state->change &&
+                cur->address_index == state->address_index) {
+                cur->last_used = ++cache->multisig_keys_counter;
+                PERF_COUNT_CACHE(CACHE_POLICY_MULTISIG_KEYS, hits, sizeof(cache->multisig_keys));
+                for (unsigned int j = 0; j < n; j++) {
+                    emit_pubkey_push(state, cur->pubkeys[j]);
+                }
+                return 0;
+            }
 
-        result = 3 + 20 + 2;
-    } else {  // policy->type == TOKEN_WPKH
-        update_output_u8(state, 0x00);
-        update_output_u8(state, 0x14);
+            // choose an empty entry, or the least recently used one
+            if (entry->is_valid && (!cur->is_valid || cur->last_used < entry->last_used)) {
+                entry = cur;
+            }
+        }
+        PERF_COUNT_CACHE(CACHE_POLICY_MULTISIG_KEYS, misses, sizeof(cache->multisig_keys));
+    }
+
+    // derive each key
+    uint8_t compressed_pubkeys[POLICY_MULTISIG_MAX_CACHED_KEYS][33];
+    uint8_t order[POLICY_MULTISIG_MAX_CACHED_KEYS];
+    for (unsigned int i = 0; i < n; i++) {
+        if (-1 == get_derived_pubkey(state, key_indexes[i], compressed_pubkeys[i])) {
+            return -1;
+        }
+        order[i] = i;
+    }
 
-        crypto_hash160(compressed_pubkey, 33, compressed_pubkey);  // reuse memory
-        update_output(state, compressed_pubkey, 20);
+    // we avoid using qsort, as it takes ~700 bytes in binary size
+    if (sorted) {
+        sort_compressed_pubkeys(compressed_pubkeys, order, n);
+    }
 
-        result = 2 + 20;
+    for (unsigned int i = 0; i < n; i++) {
+        emit_pubkey_push(state, compressed_pubkeys[order[i]]);
     }
 
-    if (-1 == state_stack_pop(state)) {
-        return -1;
+    if (entry != NULL) {
+        if (entry->is_valid) {
+            PERF_COUNT_CACHE(CACHE_POLICY_MULTISIG_KEYS, evictions, sizeof(cache->multisig_keys));
+        }
+        entry->is_valid = true;
+        entry->change = state->change;
+        entry->n = n;
+        entry->address_index = (uint32_t) state->address_index;
+        entry->last_used = ++cache->multisig_keys_counter;
+        for (unsigned int i = 0; i < n; i++) {
+            memcpy(entry->pubkeys[i], compressed_pubkeys[order[i]], 33);
+        }
     }
-    return result;
+    return 0;
 }
 
-static int __attribute__((noinline)) process_sh_wsh_node(policy_parser_state_t *state) {
-    PRINT_STACK_POINTER();
+// Computes the taproot output key of a tr() policy, using the cache of tweaked keys if available.
+// The tweaked key only depends on the address, as a cache is not shared among different policies.
+// merkle_root is the root of the tree of scripts at this address, or NULL if there is none.
+static int get_tr_output_key(policy_parser_state_t *state,
+                             int key_index,
+                             const uint8_t *merkle_root,
+                             uint8_t out[static 32]) {
+    policy_pubkeys_cache_t *cache = state->pubkeys_cache;
+
+    policy_tr_key_cache_entry_t *entry = NULL;
+    if (cache != NULL) {
+        entry = &cache->tr_keys[0];
+        for (int i = 0; i < POLICY_TR_KEYS_CACHE_SIZE; i++) {
+            policy_tr_key_cache_entry_t *cur = &cache->tr_keys[i];
+            if (cur->is_valid && cur->change == state->change &&
+                cur->address_index == state->address_index) {
+                cur->last_used = ++cache->tr_keys_counter;
+                PERF_COUNT_CACHE(CACHE_POLICY_TR_KEYS, hits, sizeof(cache->tr_keys));
+                memcpy(out, cur->tweaked_key, 32);
+                return 0;
+            }
 
-    policy_parser_node_state_t *node = &state->nodes[state->node_stack_eos];
+            // choose an empty entry, or the least recently used one
+            if (entry->is_valid && (!cur->is_valid || cur->last_used < entry->last_used)) {
+                entry = cur;
+            }
+        }
+        PERF_COUNT_CACHE(CACHE_POLICY_TR_KEYS, misses, sizeof(cache->tr_keys));
+    }
 
-    policy_node_with_script_t *policy = (policy_node_with_script_t *) node->policy_node;
+    uint8_t compressed_pubkey[33];
+    if (-1 == get_derived_pubkey(state, key_index, compressed_pubkey)) {
+        return -1;
+    }
 
-    if (node->step != 0 && node->step != 1) {
+    uint8_t parity;
+    if (crypto_tr_tweak_pubkey_with_merkle_root(compressed_pubkey + 1, merkle_root, &parity, out) <
+        0) {
         return -1;
     }
 
-    if (node->step == 0) {
-        // process child in HASH mode
-        if (-1 == state_stack_push(state, policy->script)) {
-            return -1;
+    if (entry != NULL) {
+        if (entry->is_valid) {
+            PERF_COUNT_CACHE(CACHE_POLICY_TR_KEYS, evictions, sizeof(cache->tr_keys));
         }
-        ++node->step;
-        return 0;
+        entry->is_valid = true;
+        entry->change = state->change;
+        entry->address_index = (uint32_t) state->address_index;
+        entry->last_used = ++cache->tr_keys_counter;
+        memcpy(entry->tweaked_key, out, 32);
     }
+    return 0;
+}
 
-    // child already computed
+/**
+ * Runs the code of a template, filling the key slots with the keys derived at the change and
+ * address index of the state. Returns 0 on success, SORTED_KEYS_ORDER_MISMATCH if the order of the
+ * keys of a sorted multisig in the cache is wrong, -1 on other errors.
+ */
+static int __attribute__((noinline)) emit_template_code(policy_parser_state_t *state,
+                                                        const policy_script_template_t *template) {
+    PRINT_STACK_POINTER();
+
+    // hashes of the subtrees of a taproot tree that are not yet combined; as the tree is visited in
+    // post-order, at most one hash per level is kept
+    uint8_t tree_hashes[MAX_TAPTREE_POLICY_DEPTH + 1][32];
+    unsigned int n_tree_hashes = 0;
+    buffer_t *saved_out_buf = NULL;
+
+    const uint8_t *code = template->code;
+    unsigned int pos = 0;
+    while (pos < template->code_len) {
+        uint8_t op = code[pos++];
+        switch (op) {
+            case TEMPLATE_OP_BYTES: {
+                uint8_t len = code[pos++];
+                update_output(state, &code[pos], len);
+                pos += len;
+                break;
+            }
+            case TEMPLATE_OP_KEY_HASH160: {
+                uint8_t compressed_pubkey[33];
+                if (-1 == get_derived_pubkey(state, code[pos++], compressed_pubkey)) {
+                    return -1;
+                }
+                crypto_hash160(compressed_pubkey, 33, compressed_pubkey);  // reuse memory
+                update_output(state, compressed_pubkey, 20);
+                break;
+            }
+            case TEMPLATE_OP_KEY: {
+                uint8_t compressed_pubkey[33];
+                if (-1 == get_derived_pubkey(state, code[pos++], compressed_pubkey)) {
+                    return -1;
+                }
+                update_output(state, compressed_pubkey, 33);
+                break;
+            }
+            case TEMPLATE_OP_KEYS:
+            case TEMPLATE_OP_SORTED_KEYS: {
+                uint8_t n = code[pos++];
+                int ret = emit_multisig_keys(state, &code[pos], n, op == TEMPLATE_OP_SORTED_KEYS);
+                if (ret < 0) {
+                    return ret;
+                }
+                pos += n;
+                break;
+            }
+            case TEMPLATE_OP_XONLY_KEY:
+            case TEMPLATE_OP_XONLY_HASH160: {
+                uint8_t compressed_pubkey[33];
+                if (-1 == get_derived_pubkey(state, code[pos++], compressed_pubkey)) {
+                    return -1;
+                }
+                if (op == TEMPLATE_OP_XONLY_KEY) {
+                    update_output(state, compressed_pubkey + 1, 32);
+                } else {
+                    crypto_hash160(compressed_pubkey + 1, 32, compressed_pubkey);  // reuse memory
+                    update_output(state, compressed_pubkey, 20);
+                }
+                break;
+            }
+            case TEMPLATE_OP_TAPLEAF: {
+                // the leaf script is streamed into its TapLeaf hash
+                uint16_t leaf_len = read_u16_le(code, pos);
+                pos += 2;
+                if (n_tree_hashes >= MAX_TAPTREE_POLICY_DEPTH + 1) {
+                    return -1;
+                }
+                saved_out_buf = state->out_buf;
+                state->out_buf = NULL;
+                crypto_tr_tagged_hash_init_midstate(&state->hash_context,
+                                                    BIP0341_tapleaf_midstate);
+                update_output_u8(state, 0xC0);  // leaf version
+                if (leaf_len < 0xFD) {
+                    update_output_u8(state, (uint8_t) leaf_len);
+                } else {
+                    update_output_u8(state, 0xFD);
+                    update_output_u8(state, leaf_len & 0xFF);
+                    update_output_u8(state, leaf_len >> 8);
+                }
+                break;
+            }
+            case TEMPLATE_OP_TAPLEAF_END: {
+                crypto_hash_digest(&state->hash_context.header, tree_hashes[n_tree_hashes++], 32);
+                state->out_buf = saved_out_buf;
+                break;
+            }
+            case TEMPLATE_OP_TAPBRANCH: {
+                if (n_tree_hashes < 2) {
+                    return -1;
+                }
+                // the hashes of the two children are concatenated in lexicographic order
+                uint8_t *left = tree_hashes[n_tree_hashes - 2];
+                uint8_t *right = tree_hashes[n_tree_hashes - 1];
+                bool swap = memcmp(left, right, 32) > 0;
+                crypto_tr_tagged_hash_init_midstate(&state->hash_context,
+                                                    BIP0341_tapbranch_midstate);
+                crypto_hash_update(&state->hash_context.header, swap ? right : left, 32);
+                crypto_hash_update(&state->hash_context.header, swap ? left : right, 32);
+                crypto_hash_digest(&state->hash_context.header, left, 32);
+                --n_tree_hashes;
+                break;
+            }
+            case TEMPLATE_OP_TR_OUTPUT_KEY: {
+                if (n_tree_hashes > 1) {
+                    return -1;
+                }
+                const uint8_t *merkle_root = n_tree_hashes == 1 ? tree_hashes[0] : NULL;
+                if (state->tr_merkle_root_out != NULL) {
+                    if (merkle_root == NULL) {
+                        return -1;
+                    }
+                    memcpy(state->tr_merkle_root_out, merkle_root, 32);
+                    state->tr_merkle_root_out = NULL;  // marks that the root was written
+                    return 0;
+                }
 
-    if (node->mode == MODE_OUT_HASH) {
-        cx_sha256_init(&state->hash_context);
+                uint8_t tweaked_key[32];
+                if (-1 == get_tr_output_key(state, code[pos++], merkle_root, tweaked_key)) {
+                    return -1;
+                }
+                update_output(state, tweaked_key, 32);
+                break;
+            }
+            default:
+                return -1;
+        }
     }
+    return 0;
+}
 
-    int result;
-    if (policy->type == TOKEN_SH) {
-        update_output_u8(state, 0xa9);
-        update_output_u8(state, 0x14);
+/**
+ * Like emit_template_code, but if the order of the keys of a sorted multisig in the cache turns out
+ * to be wrong, it is discarded and the code is run again from the start. Returns 0 on success, -1 on
+ * error.
+ */
+static int run_template_code(policy_parser_state_t *state,
+                             const policy_script_template_t *template) {
+    buffer_t *out_buf = state->out_buf;
+    size_t out_offset = out_buf != NULL ? out_buf->offset : 0;
+    uint8_t *tr_merkle_root_out = state->tr_merkle_root_out;
+
+    int ret = emit_template_code(state, template);
+    if (ret == SORTED_KEYS_ORDER_MISMATCH) {
+        PRINTF("Wrong order of the keys of the sorted multisig\n");
+        state->pubkeys_cache->sorted_keys_order.is_valid = false;
+        state->has_streamed_sorted_keys = false;
+        state->tr_merkle_root_out = tr_merkle_root_out;
+        state->out_buf = out_buf;
+        if (out_buf != NULL) {
+            buffer_seek_set(out_buf, out_offset);
+        } else {
+            cx_sha256_init(&state->hash_context);
+        }
+        ret = emit_template_code(state, template);
+    }
+    return ret < 0 ? -1 : 0;
+}
 
-        crypto_ripemd160(state->hash, 32, state->hash);  // reuse memory
-        update_output(state, state->hash, 20);
+static bool template_append(policy_script_template_t *out, const uint8_t *data, size_t data_len) {
+    if (out->code_len + data_len > sizeof(out->code)) {
+        return false;
+    }
+    memcpy(&out->code[out->code_len], data, data_len);
+    out->code_len += data_len;
+    return true;
+}
 
-        update_output_u8(state, 0x87);
+/**
+ * State of compile_policy_script_template while it emits the code of the inner script.
+ */
+typedef struct {
+    policy_script_template_t *out;
+    int last_run;             // position of the last instruction if it is TEMPLATE_OP_BYTES, or -1
+    unsigned int script_len;  // length of the part of the inner script emitted so far
+    bool is_tapscript;        // true while compiling the leaves of a tr() tree
+    unsigned int n_ops;       // upper bound of the non-push opcodes of the current script
+    unsigned int n_items;     // upper bound of the witness elements of the current script
+} template_compiler_t;
+
+// appends literal bytes, extending the last TEMPLATE_OP_BYTES instruction if possible
+static bool compiler_emit_bytes(template_compiler_t *c, const uint8_t *data, size_t data_len) {
+    c->script_len += data_len;
+    if (c->last_run >= 0 && c->out->code[c->last_run + 1] + data_len <= 0xFF) {
+        c->out->code[c->last_run + 1] += data_len;
+        return template_append(c->out, data, data_len);
+    }
+    c->last_run = c->out->code_len;
+    uint8_t header[2] = {TEMPLATE_OP_BYTES, (uint8_t) data_len};
+    return template_append(c->out, header, 2) && template_append(c->out, data, data_len);
+}
 
-        result = 2 + 20 + 1;
-    } else {  // policy->type == TOKEN_WSH
-        update_output_u8(state, 0x00);
-        update_output_u8(state, 0x20);
+static bool compiler_emit_u8(template_compiler_t *c, uint8_t data) {
+    return compiler_emit_bytes(c, &data, 1);
+}
 
-        update_output(state, state->hash, 32);
+// appends an instruction with a single key slot, that produces data_len bytes of the script
+static bool compiler_emit_key(template_compiler_t *c,
+                              uint8_t op,
+                              size_t key_index,
+                              size_t data_len) {
+    if (key_index > 0xFF) {
+        return false;
+    }
+    c->script_len += data_len;
+    c->last_run = -1;
+    uint8_t instruction[2] = {op, (uint8_t) key_index};
+    return template_append(c->out, instruction, 2);
+}
 
-        result = 2 + 32;
+// appends the minimal push of a positive number, as in CScript::operator<<(int64_t)
+static bool compiler_emit_number(template_compiler_t *c, uint32_t n) {
+    if (n <= 16) {
+        return compiler_emit_u8(c, n == 0 ? OP_0 : OP_1 + n - 1);
     }
+    uint8_t push[1 + 5];
+    uint8_t len = 0;
+    while (n > 0) {
+        push[1 + len++] = n & 0xFF;
+        n >>= 8;
+    }
+    if (push[len] & 0x80) {
+        push[1 + len++] = 0x00;  // the sign bit must be clear
+    }
+    push[0] = len;
+    return compiler_emit_bytes(c, push, 1 + len);
+}
 
-    if (-1 == state_stack_pop(state)) {
-        return -1;
+// appends OP_VERIFY, or replaces the last opcode with its VERIFY version if there is one
+static bool compiler_emit_verify(template_compiler_t *c) {
+    if (c->last_run >= 0) {
+        // literal runs emitted by the compiler always end with an opcode
+        uint8_t *last_op = &c->out->code[c->out->code_len - 1];
+        if (*last_op == OP_CHECKSIG || *last_op == OP_CHECKMULTISIG || *last_op == OP_EQUAL ||
+            *last_op == OP_NUMEQUAL) {
+            ++*last_op;  // OP_CHECKSIGVERIFY, OP_CHECKMULTISIGVERIFY, OP_EQUALVERIFY, ...
+            return true;
+        }
     }
-    return result;
+    return compiler_emit_u8(c, OP_VERIFY);
 }
 
-static int __attribute__((noinline)) process_multi_sortedmulti_node(policy_parser_state_t *state) {
-    PRINT_STACK_POINTER();
+/**
+ * Types and properties of miniscript expressions, as defined in https://bitcoin.sipa.be/miniscript/.
+ * The timelock properties g, h, i, j and k have longer names, as MS_K is already the key type.
+ */
+#define MS_B            0x00001  // base
+#define MS_V            0x00002  // verify
+#define MS_K            0x00004  // key
+#define MS_W            0x00008  // wrapped
+#define MS_Z            0x00010  // zero-arg
+#define MS_O            0x00020  // one-arg
+#define MS_N            0x00040  // nonzero
+#define MS_D            0x00080  // dissatisfiable
+#define MS_U            0x00100  // unit
+#define MS_S            0x00200  // safe: every satisfaction needs a signature
+#define MS_F            0x00400  // forced: there is no dissatisfaction
+#define MS_E            0x00800  // expressive: there is a unique, non-malleable dissatisfaction
+#define MS_M            0x01000  // non-malleable
+#define MS_REL_TIME     0x02000  // g: contains a relative timelock based on time
+#define MS_REL_HEIGHT   0x04000  // h: contains a relative timelock based on heights
+#define MS_ABS_TIME     0x08000  // i: contains an absolute timelock based on time
+#define MS_ABS_HEIGHT   0x10000  // j: contains an absolute timelock based on heights
+#define MS_NO_TIME_MIX  0x20000  // k: no satisfaction needs both a height and a time timelock
+
+#define MS_TIMELOCKS    (MS_REL_TIME | MS_REL_HEIGHT | MS_ABS_TIME | MS_ABS_HEIGHT)
+#define MS_TIME_PROPS   (MS_TIMELOCKS | MS_NO_TIME_MIX)
+
+#define MS_TYPE_0 (MS_B | MS_Z | MS_U | MS_D | MS_E | MS_M | MS_S | MS_NO_TIME_MIX)
+#define MS_TYPE_1 (MS_B | MS_Z | MS_U | MS_F | MS_M | MS_NO_TIME_MIX)
+
+#define MS_HAS(t, props) (((t) & (props)) == (props))
+
+// the locktimes of older() with this bit set, and those of after() at least equal to the threshold,
+// are based on time; the others on heights
+#define SEQUENCE_LOCKTIME_TYPE_FLAG (1 << 22)
+#define LOCKTIME_THRESHOLD          500000000
+
+// true if one of x and y has a timelock based on heights, and the other one of the same kind based
+// on time; no transaction can satisfy both
+static bool has_time_mix(unsigned int x, unsigned int y) {
+    return (MS_HAS(x, MS_REL_TIME) && MS_HAS(y, MS_REL_HEIGHT)) ||
+           (MS_HAS(x, MS_REL_HEIGHT) && MS_HAS(y, MS_REL_TIME)) ||
+           (MS_HAS(x, MS_ABS_TIME) && MS_HAS(y, MS_ABS_HEIGHT)) ||
+           (MS_HAS(x, MS_ABS_HEIGHT) && MS_HAS(y, MS_ABS_TIME));
+}
 
-    policy_parser_node_state_t *node = &state->nodes[state->node_stack_eos];
+// timelock properties of a fragment whose satisfactions need both x and y
+static unsigned int get_and_time_props(unsigned int x, unsigned int y) {
+    return ((x | y) & MS_TIMELOCKS) |
+           (MS_HAS(x & y, MS_NO_TIME_MIX) && !has_time_mix(x, y) ? MS_NO_TIME_MIX : 0);
+}
+
+// timelock properties of a fragment whose satisfactions need either x or y
+static unsigned int get_or_time_props(unsigned int x, unsigned int y) {
+    return ((x | y) & MS_TIMELOCKS) | (x & y & MS_NO_TIME_MIX);
+}
 
-    if (node->step != 0) {
+// o=o_x*z_y+z_x*o_y, approximated as in Bitcoin Core
+static unsigned int get_and_o_property(unsigned int x, unsigned int y) {
+    return MS_HAS(x | y, MS_Z) ? (x | y) & MS_O : 0;
+}
+
+static int get_andor_type(unsigned int x, unsigned int y, unsigned int z) {
+    if (!MS_HAS(x, MS_B | MS_D | MS_U) || (y & z & (MS_B | MS_K | MS_V)) == 0) {
         return -1;
     }
+    unsigned int o_args = x | (y & z);
+    bool z_forced = MS_HAS(x, MS_S) || MS_HAS(y, MS_F);  // z is the only dissatisfaction
+    return (y & z & (MS_B | MS_K | MS_V | MS_U)) | (x & y & z & MS_Z) |
+           (MS_HAS(o_args, MS_Z) ? o_args & MS_O : 0) | (z & MS_D) |
+           (z_forced ? z & (MS_F | MS_E) : 0) |
+           (MS_HAS(x, MS_E) && MS_HAS(x | y | z, MS_S) ? x & y & z & MS_M : 0) |
+           (z & (x | y) & MS_S) | ((x | y | z) & MS_TIMELOCKS) |
+           (get_and_time_props(x, y) & z & MS_NO_TIME_MIX);
+}
 
-    policy_node_multisig_t *policy = (policy_node_multisig_t *) node->policy_node;
-
-    // k {pubkey_1} ... {pubkey_n} n OP_CHECKMULTISIG
-    unsigned int out_len = 1 + 34 * policy->n + 1 + 1;
+static int get_and_v_type(unsigned int x, unsigned int y) {
+    if (!MS_HAS(x, MS_V) || (y & (MS_B | MS_K | MS_V)) == 0) {
+        return -1;
+    }
+    return (y & (MS_B | MS_K | MS_V | MS_U)) | (x & MS_N) | (MS_HAS(x, MS_Z) ? y & MS_N : 0) |
+           get_and_o_property(x, y) | (x & y & (MS_D | MS_Z | MS_M)) | ((x | y) & MS_S) |
+           (MS_HAS(y, MS_F) || MS_HAS(x, MS_S) ? MS_F : 0) | get_and_time_props(x, y);
+}
 
-    if (node->mode == MODE_OUT_BYTES && !buffer_can_read(node->out_buf, out_len)) {
+static int get_or_i_type(unsigned int x, unsigned int y) {
+    if ((x & y & (MS_B | MS_K | MS_V)) == 0) {
         return -1;
     }
+    return (x & y & (MS_B | MS_K | MS_V | MS_U | MS_F | MS_S)) | (MS_HAS(x & y, MS_Z) ? MS_O : 0) |
+           ((x | y) & MS_D) | (MS_HAS(x | y, MS_F) ? (x | y) & MS_E : 0) |
+           (MS_HAS(x | y, MS_S) ? x & y & MS_M : 0) | get_or_time_props(x, y);
+}
 
-    if (node->mode == MODE_OUT_HASH) {
-        cx_sha256_init(&state->hash_context);
+/**
+ * Returns the type of a miniscript fragment, given the types its children as they appear in the
+ * policy; returns -1 if the types of the children are not valid for the fragment. thresh() is
+ * handled separately, as it has an arbitrary number of children.
+ */
+static int get_miniscript_type(const policy_node_t *node,
+                               const unsigned int *t,
+                               bool is_tapscript) {
+    unsigned int x = t[0], y = t[1];
+    switch (node->type) {
+        case TOKEN_WPKH:
+        case TOKEN_TR:
+            return 0;  // not miniscript
+        case TOKEN_0:
+            return MS_TYPE_0;
+        case TOKEN_1:
+            return MS_TYPE_1;
+        case TOKEN_PK_K:
+            return MS_K | MS_O | MS_N | MS_D | MS_U | MS_E | MS_M | MS_S | MS_NO_TIME_MIX;
+        case TOKEN_PK_H:
+            return MS_K | MS_N | MS_D | MS_U | MS_E | MS_M | MS_S | MS_NO_TIME_MIX;
+        case TOKEN_PK:  // c:pk_k
+            return MS_B | MS_O | MS_N | MS_D | MS_U | MS_E | MS_M | MS_S | MS_NO_TIME_MIX;
+        case TOKEN_PKH:  // c:pk_h
+        case TOKEN_MULTI:
+        case TOKEN_SORTEDMULTI:
+            return MS_B | MS_N | MS_D | MS_U | MS_E | MS_M | MS_S | MS_NO_TIME_MIX;
+        case TOKEN_SHA256:
+        case TOKEN_HASH256:
+        case TOKEN_RIPEMD160:
+        case TOKEN_HASH160:
+            return MS_B | MS_O | MS_N | MS_D | MS_U | MS_M | MS_NO_TIME_MIX;
+        case TOKEN_OLDER: {
+            size_t n = ((const policy_node_with_uint32_t *) node)->n;
+            return MS_B | MS_Z | MS_F | MS_M | MS_NO_TIME_MIX |
+                   ((n & SEQUENCE_LOCKTIME_TYPE_FLAG) ? MS_REL_TIME : MS_REL_HEIGHT);
+        }
+        case TOKEN_AFTER: {
+            size_t n = ((const policy_node_with_uint32_t *) node)->n;
+            return MS_B | MS_Z | MS_F | MS_M | MS_NO_TIME_MIX |
+                   (n >= LOCKTIME_THRESHOLD ? MS_ABS_TIME : MS_ABS_HEIGHT);
+        }
+        case TOKEN_A:
+            if (!MS_HAS(x, MS_B)) {
+                return -1;
+            }
+            return MS_W | (x & (MS_U | MS_D | MS_F | MS_E | MS_M | MS_S | MS_TIME_PROPS));
+        case TOKEN_S:
+            if (!MS_HAS(x, MS_B | MS_O)) {
+                return -1;
+            }
+            return MS_W | (x & (MS_U | MS_D | MS_F | MS_E | MS_M | MS_S | MS_TIME_PROPS));
+        case TOKEN_C:
+            if (!MS_HAS(x, MS_K)) {
+                return -1;
+            }
+            return MS_B | (x & (MS_O | MS_N | MS_D | MS_F | MS_E | MS_M | MS_TIME_PROPS)) | MS_U |
+                   MS_S;
+        case TOKEN_T:  // and_v(X,1)
+            return get_and_v_type(x, MS_TYPE_1);
+        case TOKEN_D:  // u only in tapscript
+            if (!MS_HAS(x, MS_V | MS_Z)) {
+                return -1;
+            }
+            return MS_B | MS_O | MS_N | MS_D | (is_tapscript ? MS_U : 0) |
+                   (MS_HAS(x, MS_F) ? MS_E : 0) | (x & (MS_M | MS_S | MS_TIME_PROPS));
+        case TOKEN_V:
+            if (!MS_HAS(x, MS_B)) {
+                return -1;
+            }
+            return MS_V | (x & (MS_Z | MS_O | MS_N | MS_M | MS_S | MS_TIME_PROPS)) | MS_F;
+        case TOKEN_J:
+            if (!MS_HAS(x, MS_B | MS_N)) {
+                return -1;
+            }
+            return MS_B | (x & (MS_O | MS_U | MS_M | MS_S | MS_TIME_PROPS)) | MS_N | MS_D |
+                   (MS_HAS(x, MS_F) ? MS_E : 0);
+        case TOKEN_N:
+            if (!MS_HAS(x, MS_B)) {
+                return -1;
+            }
+            return (x & (MS_B | MS_Z | MS_O | MS_N | MS_D | MS_F | MS_E | MS_M | MS_S |
+                         MS_TIME_PROPS)) |
+                   MS_U;
+        case TOKEN_L:  // or_i(0,X)
+            return get_or_i_type(MS_TYPE_0, x);
+        case TOKEN_U:  // or_i(X,0)
+            return get_or_i_type(x, MS_TYPE_0);
+        case TOKEN_AND_V:
+            return get_and_v_type(x, y);
+        case TOKEN_AND_B:
+            if (!MS_HAS(x, MS_B) || !MS_HAS(y, MS_W)) {
+                return -1;
+            }
+            return MS_B | (x & MS_N) | (MS_HAS(x, MS_Z) ? y & MS_N : 0) |
+                   get_and_o_property(x, y) | (x & y & (MS_D | MS_Z | MS_M)) |
+                   (MS_HAS(x & y, MS_S) ? x & y & MS_E : 0) |
+                   (MS_HAS(x & y, MS_F) || MS_HAS(x, MS_S | MS_F) || MS_HAS(y, MS_S | MS_F)
+                        ? MS_F
+                        : 0) |
+                   ((x | y) & MS_S) | MS_U | get_and_time_props(x, y);
+        case TOKEN_AND_N:  // andor(X,Y,0)
+            return get_andor_type(x, y, MS_TYPE_0);
+        case TOKEN_ANDOR:
+            return get_andor_type(x, y, t[2]);
+        case TOKEN_OR_B:
+            if (!MS_HAS(x, MS_B | MS_D) || !MS_HAS(y, MS_W | MS_D)) {
+                return -1;
+            }
+            return MS_B | get_and_o_property(x, y) |
+                   (MS_HAS(x | y, MS_S) && MS_HAS(x & y, MS_E) ? x & y & MS_M : 0) |
+                   (x & y & (MS_Z | MS_S | MS_E)) | MS_D | MS_U | get_or_time_props(x, y);
+        case TOKEN_OR_C:
+            if (!MS_HAS(x, MS_B | MS_D | MS_U) || !MS_HAS(y, MS_V)) {
+                return -1;
+            }
+            return MS_V | (MS_HAS(y, MS_Z) ? x & MS_O : 0) | (x & y & (MS_Z | MS_S)) |
+                   (MS_HAS(x, MS_E) && MS_HAS(x | y, MS_S) ? x & y & MS_M : 0) | MS_F |
+                   get_or_time_props(x, y);
+        case TOKEN_OR_D:
+            if (!MS_HAS(x, MS_B | MS_D | MS_U) || !MS_HAS(y, MS_B)) {
+                return -1;
+            }
+            return MS_B | (MS_HAS(y, MS_Z) ? x & MS_O : 0) | (x & y & (MS_Z | MS_S)) |
+                   (y & (MS_U | MS_D | MS_F | MS_E)) |
+                   (MS_HAS(x, MS_E) && MS_HAS(x | y, MS_S) ? x & y & MS_M : 0) |
+                   get_or_time_props(x, y);
+        case TOKEN_OR_I:
+            return get_or_i_type(x, y);
+        default:
+            return -1;
     }
+}
+
+/**
+ * Returns true if a miniscript has a type that is acceptable for the whole script, following the
+ * checks of IsSane() in Bitcoin Core: it must be of type B, every satisfaction must need a
+ * signature, it must not be malleable, and it must not need timelocks based on heights and on time
+ * at once. The limits on the number of opcodes and on the size of the witness are checked by
+ * is_within_script_limits.
+ */
+static bool is_sane_top_level_type(int type) {
+    return type >= 0 && MS_HAS(type, MS_B | MS_S | MS_M | MS_NO_TIME_MIX);
+}
 
-    update_output_u8(state, 0x50 + policy->k);  // OP_k
+/**
+ * Limits of Bitcoin Core that a script must respect to be spendable: the number of non-push
+ * opcodes (only in segwit v0 scripts), and the number of elements of the witness.
+ */
+#define MAX_OPS_PER_SCRIPT             201
+#define MAX_STANDARD_P2WSH_STACK_ITEMS 100
+#define MAX_TAPSCRIPT_STACK_SIZE       1000
 
-    // derive each key
-    uint8_t compressed_pubkeys[MAX_POLICY_MAP_KEYS][33];
-    for (unsigned int i = 0; i < policy->n; i++) {
-        if (-1 == get_derived_pubkey(state, policy->key_indexes[i], compressed_pubkeys[i])) {
-            return -1;
+/**
+ * Adds to the counters of the compiler the non-push opcodes of the script of a fragment, and the
+ * largest number of elements that its satisfaction or dissatisfaction adds to the witness, without
+ * those of its children. Every opcode counts towards MAX_OPS_PER_SCRIPT, even in the branches that
+ * are not executed, as do the keys of OP_CHECKMULTISIG; therefore, the sums over all the fragments
+ * are upper bounds for any satisfaction. The v: wrapper is counted even when it is fused.
+ */
+static void add_node_limits(template_compiler_t *c, const policy_node_t *node) {
+    unsigned int n_ops = 0, n_items = 0;
+    switch (node->type) {
+        case TOKEN_PK:
+            n_ops = 1;  // OP_CHECKSIG
+            n_items = 1;
+            break;
+        case TOKEN_PK_K:
+            n_items = 1;
+            break;
+        case TOKEN_PKH:
+            n_ops = 4;  // OP_DUP OP_HASH160 OP_EQUALVERIFY OP_CHECKSIG
+            n_items = 2;
+            break;
+        case TOKEN_PK_H:
+            n_ops = 3;
+            n_items = 2;
+            break;
+        case TOKEN_MULTI:
+        case TOKEN_SORTEDMULTI: {
+            const policy_node_multisig_t *multi = (const policy_node_multisig_t *) node;
+            n_ops = 1 + multi->n;
+            n_items = 1 + multi->k;
+            break;
         }
+        case TOKEN_OLDER:
+        case TOKEN_AFTER:
+        case TOKEN_S:
+        case TOKEN_C:
+        case TOKEN_V:
+        case TOKEN_N:
+        case TOKEN_AND_B:
+        case TOKEN_OR_B:
+            n_ops = 1;
+            break;
+        case TOKEN_SHA256:
+        case TOKEN_HASH256:
+        case TOKEN_RIPEMD160:
+        case TOKEN_HASH160:
+            n_ops = 4;  // OP_SIZE OP_EQUALVERIFY {hash opcode} OP_EQUAL
+            n_items = 1;
+            break;
+        case TOKEN_A:
+        case TOKEN_OR_C:
+            n_ops = 2;
+            break;
+        case TOKEN_J:
+            n_ops = 4;  // OP_SIZE OP_0NOTEQUAL OP_IF OP_ENDIF
+            n_items = 1;
+            break;
+        case TOKEN_D:
+        case TOKEN_L:
+        case TOKEN_U:
+        case TOKEN_OR_I:
+            n_ops = 3;
+            n_items = 1;  // the selector of the branch
+            break;
+        case TOKEN_AND_N:
+        case TOKEN_ANDOR:
+        case TOKEN_OR_D:
+            n_ops = 3;
+            break;
+        case TOKEN_THRESH:
+            // OP_ADD for each child but the first one, and OP_EQUAL
+            n_ops = ((const policy_node_thresh_t *) node)->n;
+            break;
+        default:
+            break;
     }
+    c->n_ops += n_ops;
+    c->n_items += n_items;
+}
 
-    if (policy->type == TOKEN_SORTEDMULTI) {
-        // sort the pubkeys (we avoid using qsort, as it takes ~700 bytes in binary size)
+/**
+ * Returns true if the script compiled since the counters of the compiler were reset is within the
+ * limits on the number of opcodes and on the size of the witness. The execution stack cannot
+ * exceed its own limit, as the scripts of the templates only push a few hundred elements at most.
+ */
+static bool is_within_script_limits(const template_compiler_t *c) {
+    if (c->is_tapscript) {
+        return c->n_items <= MAX_TAPSCRIPT_STACK_SIZE;  // no limit on the opcodes
+    }
+    return c->n_ops <= MAX_OPS_PER_SCRIPT && c->n_items <= MAX_STANDARD_P2WSH_STACK_ITEMS;
+}
 
-        // bubble sort
-        bool swapped;
-        do {
-            swapped = false;
-            for (unsigned int i = 1; i < policy->n; i++) {
-                if (cmp_compressed_pubkeys(compressed_pubkeys[i - 1], compressed_pubkeys[i]) > 0) {
-                    swapped = true;
+/**
+ * Returns the number of children of a node of the policy, or -1 if the node is not supported
+ * inside the compiled script.
+ */
+static int get_n_children(const policy_node_t *node) {
+    switch (node->type) {
+        case TOKEN_SH:
+        case TOKEN_WSH:
+            return -1;  // only supported as the outer wrappers
+        case TOKEN_A:
+        case TOKEN_S:
+        case TOKEN_C:
+        case TOKEN_T:
+        case TOKEN_D:
+        case TOKEN_V:
+        case TOKEN_J:
+        case TOKEN_N:
+        case TOKEN_L:
+        case TOKEN_U:
+            return 1;
+        case TOKEN_AND_V:
+        case TOKEN_AND_B:
+        case TOKEN_AND_N:
+        case TOKEN_OR_B:
+        case TOKEN_OR_C:
+        case TOKEN_OR_D:
+        case TOKEN_OR_I:
+            return 2;
+        case TOKEN_ANDOR:
+            return 3;
+        case TOKEN_THRESH:
+            return ((const policy_node_thresh_t *) node)->n;
+        default:
+            return 0;
+    }
+}
 
-                    for (int j = 0; j < 33; j++) {
-                        uint8_t t = compressed_pubkeys[i - 1][j];
-                        compressed_pubkeys[i - 1][j] = compressed_pubkeys[i][j];
-                        compressed_pubkeys[i][j] = t;
-                    }
+/**
+ * Emits the part of the script of a node that precedes its child with index i in the script, or
+ * the part that follows the last child if i is equal to the number of children.
+ */
+static bool emit_node_part(template_compiler_t *c, const policy_node_t *node, unsigned int i) {
+    switch (node->type) {
+        case TOKEN_PKH:
+        case TOKEN_PK_H: {
+            // in tapscript, the hash is computed from the x-only key
+            const policy_node_with_key_t *pkh = (const policy_node_with_key_t *) node;
+            uint8_t op = c->is_tapscript ? TEMPLATE_OP_XONLY_HASH160 : TEMPLATE_OP_KEY_HASH160;
+            bool ok = compiler_emit_bytes(c, (const uint8_t[]){OP_DUP, OP_HASH160, 0x14}, 3) &&
+                      compiler_emit_key(c, op, pkh->key_index, 20) &&
+                      compiler_emit_u8(c, OP_EQUALVERIFY);
+            return ok && (node->type == TOKEN_PK_H || compiler_emit_u8(c, OP_CHECKSIG));
+        }
+        case TOKEN_WPKH: {
+            const policy_node_with_key_t *wpkh = (const policy_node_with_key_t *) node;
+            return compiler_emit_bytes(c, (const uint8_t[]){0x00, 0x14}, 2) &&
+                   compiler_emit_key(c, TEMPLATE_OP_KEY_HASH160, wpkh->key_index, 20);
+        }
+        case TOKEN_TR: {
+            const policy_node_with_key_t *tr = (const policy_node_with_key_t *) node;
+            return compiler_emit_bytes(c, (const uint8_t[]){0x51, 0x20}, 2) &&
+                   compiler_emit_key(c, TEMPLATE_OP_TR_OUTPUT_KEY, tr->key_index, 32);
+        }
+        case TOKEN_PK:
+        case TOKEN_PK_K: {
+            // in tapscript, the keys are x-only
+            const policy_node_with_key_t *pk = (const policy_node_with_key_t *) node;
+            bool ok = c->is_tapscript
+                          ? compiler_emit_u8(c, 0x20) &&
+                                compiler_emit_key(c, TEMPLATE_OP_XONLY_KEY, pk->key_index, 32)
+                          : compiler_emit_u8(c, 0x21) &&
+                                compiler_emit_key(c, TEMPLATE_OP_KEY, pk->key_index, 33);
+            return ok && (node->type == TOKEN_PK_K || compiler_emit_u8(c, OP_CHECKSIG));
+        }
+        case TOKEN_MULTI:
+        case TOKEN_SORTEDMULTI: {
+            // k {pubkey_1} ... {pubkey_n} n OP_CHECKMULTISIG
+            const policy_node_multisig_t *multi = (const policy_node_multisig_t *) node;
+            if (multi->n > MAX_POLICY_MAP_COSIGNERS || c->is_tapscript) {
+                return false;  // OP_CHECKMULTISIG is disabled in tapscript
+            }
+
+            if (!compiler_emit_u8(c, 0x50 + multi->k)) {
+                return false;
+            }
+            uint8_t keys_header[2] = {
+                node->type == TOKEN_SORTEDMULTI ? TEMPLATE_OP_SORTED_KEYS : TEMPLATE_OP_KEYS,
+                (uint8_t) multi->n};
+            if (!template_append(c->out, keys_header, 2)) {
+                return false;
+            }
+            for (unsigned int j = 0; j < multi->n; j++) {
+                if (multi->key_indexes[j] > 0xFF) {
+                    return false;
+                }
+                uint8_t key_index = (uint8_t) multi->key_indexes[j];
+                if (!template_append(c->out, &key_index, 1)) {
+                    return false;
                 }
             }
-        } while (swapped);
+            c->script_len += 34 * multi->n;
+            c->last_run = -1;
+            return compiler_emit_bytes(c, (const uint8_t[]){0x50 + multi->n, OP_CHECKMULTISIG}, 2);
+        }
+        case TOKEN_0:
+            return compiler_emit_u8(c, OP_0);
+        case TOKEN_1:
+            return compiler_emit_u8(c, OP_1);
+        case TOKEN_OLDER:
+        case TOKEN_AFTER:
+            return compiler_emit_number(c, ((const policy_node_with_uint32_t *) node)->n) &&
+                   compiler_emit_u8(c,
+                                    node->type == TOKEN_OLDER ? OP_CHECKSEQUENCEVERIFY
+                                                              : OP_CHECKLOCKTIMEVERIFY);
+        case TOKEN_SHA256:
+        case TOKEN_HASH256:
+        case TOKEN_RIPEMD160:
+        case TOKEN_HASH160: {
+            // SIZE <32> EQUALVERIFY {hash opcode} <h> EQUAL
+            bool is_256 = (node->type == TOKEN_SHA256 || node->type == TOKEN_HASH256);
+            uint8_t hash_len = is_256 ? 32 : 20;
+            const uint8_t *h = is_256 ? ((const policy_node_with_hash_256_t *) node)->h
+                                      : ((const policy_node_with_hash_160_t *) node)->h;
+            uint8_t op = node->type == TOKEN_SHA256    ? OP_SHA256
+                         : node->type == TOKEN_HASH256 ? OP_HASH256
+                         : node->type == TOKEN_RIPEMD160 ? OP_RIPEMD160
+                                                         : OP_HASH160;
+            return compiler_emit_bytes(c,
+                                       (const uint8_t[]){OP_SIZE, 0x01, 0x20, OP_EQUALVERIFY, op},
+                                       5) &&
+                   compiler_emit_u8(c, hash_len) && compiler_emit_bytes(c, h, hash_len) &&
+                   compiler_emit_u8(c, OP_EQUAL);
+        }
+        case TOKEN_A:
+            return compiler_emit_u8(c, i == 0 ? OP_TOALTSTACK : OP_FROMALTSTACK);
+        case TOKEN_S:
+            return i != 0 || compiler_emit_u8(c, OP_SWAP);
+        case TOKEN_C:
+            return i == 0 || compiler_emit_u8(c, OP_CHECKSIG);
+        case TOKEN_T:
+            return i == 0 || compiler_emit_u8(c, OP_1);
+        case TOKEN_D:
+            return i == 0 ? compiler_emit_bytes(c, (const uint8_t[]){OP_DUP, OP_IF}, 2)
+                          : compiler_emit_u8(c, OP_ENDIF);
+        case TOKEN_V:
+            return i == 0 || compiler_emit_verify(c);
+        case TOKEN_J:
+            return i == 0 ? compiler_emit_bytes(c,
+                                                (const uint8_t[]){OP_SIZE, OP_0NOTEQUAL, OP_IF},
+                                                3)
+                          : compiler_emit_u8(c, OP_ENDIF);
+        case TOKEN_N:
+            return i == 0 || compiler_emit_u8(c, OP_0NOTEQUAL);
+        case TOKEN_L:
+            return i == 0 ? compiler_emit_bytes(c, (const uint8_t[]){OP_IF, OP_0, OP_ELSE}, 3)
+                          : compiler_emit_u8(c, OP_ENDIF);
+        case TOKEN_U:
+            return i == 0 ? compiler_emit_u8(c, OP_IF)
+                          : compiler_emit_bytes(c, (const uint8_t[]){OP_ELSE, OP_0, OP_ENDIF}, 3);
+        case TOKEN_AND_V:
+            return true;
+        case TOKEN_AND_B:
+        case TOKEN_OR_B:
+            return i != 2 ||
+                   compiler_emit_u8(c, node->type == TOKEN_AND_B ? OP_BOOLAND : OP_BOOLOR);
+        case TOKEN_AND_N:
+            // [X] NOTIF 0 ELSE [Y] ENDIF
+            return i == 0 ||
+                   (i == 1 ? compiler_emit_bytes(c, (const uint8_t[]){OP_NOTIF, OP_0, OP_ELSE}, 3)
+                           : compiler_emit_u8(c, OP_ENDIF));
+        case TOKEN_ANDOR:
+            // [X] NOTIF [Z] ELSE [Y] ENDIF
+            return i == 0 || compiler_emit_u8(c, i == 1 ? OP_NOTIF : i == 2 ? OP_ELSE : OP_ENDIF);
+        case TOKEN_OR_C:
+            // [X] NOTIF [Z] ENDIF
+            return i == 0 || compiler_emit_u8(c, i == 1 ? OP_NOTIF : OP_ENDIF);
+        case TOKEN_OR_D:
+            // [X] IFDUP NOTIF [Z] ENDIF
+            return i == 0 ||
+                   (i == 1 ? compiler_emit_bytes(c, (const uint8_t[]){OP_IFDUP, OP_NOTIF}, 2)
+                           : compiler_emit_u8(c, OP_ENDIF));
+        case TOKEN_OR_I:
+            // IF [X] ELSE [Z] ENDIF
+            return compiler_emit_u8(c, i == 0 ? OP_IF : i == 1 ? OP_ELSE : OP_ENDIF);
+        case TOKEN_THRESH: {
+            // [X1] [X2] ADD ... [Xn] ADD <k> EQUAL
+            const policy_node_thresh_t *thresh = (const policy_node_thresh_t *) node;
+            if (i >= 2 && !compiler_emit_u8(c, OP_ADD)) {
+                return false;
+            }
+            return i < thresh->n ||
+                   (compiler_emit_number(c, thresh->k) && compiler_emit_u8(c, OP_EQUAL));
+        }
+        default:
+            return false;
     }
+}
 
-    for (unsigned int i = 0; i < policy->n; i++) {
-        // push <i-th pubkey> (33 = 0x21 bytes)
-        update_output_u8(state, 0x21);
-        update_output(state, compressed_pubkeys[i], 33);
+/**
+ * A node of the policy being compiled by compile_script_node, with the state of its children.
+ */
+typedef struct {
+    const policy_node_t *node;
+    const policy_node_scripts_list_t *next_child;  // only used for thresh()
+    unsigned int n_compiled;                       // number of children already compiled
+    unsigned int child_types[3];                   // indexed by the position in the policy
+    // for thresh(), the properties of the children compiled so far
+    unsigned int thresh_args;   // sum of 0 for z children, 1 for o, 2 otherwise
+    unsigned int thresh_n_s;    // number of s children
+    unsigned int thresh_props;  // e and m if all the children have them, and timelock properties
+} compiler_frame_t;
+
+// records the type of the child with index i of a thresh(); returns false if it is not valid
+static bool add_thresh_child_type(compiler_frame_t *frame, unsigned int type, unsigned int i) {
+    // thresh(k,X1,...,Xn) requires that X1 is Bdu, and the others are Wdu
+    if (!MS_HAS(type, (i == 0 ? MS_B : MS_W) | MS_D | MS_U)) {
+        return false;
     }
 
-    update_output_u8(state, 0x50 + policy->n);  // OP_n
-    update_output_u8(state, 0xae);              // OP_CHECKMULTISIG
+    // timelocks of different children are only combined if more than one child is needed
+    const policy_node_thresh_t *thresh = (const policy_node_thresh_t *) frame->node;
+    unsigned int props = i == 0 ? MS_E | MS_M | MS_NO_TIME_MIX : frame->thresh_props;
+    bool no_time_mix = MS_HAS(props & type, MS_NO_TIME_MIX) &&
+                       (thresh->k <= 1 || !has_time_mix(props, type));
+    frame->thresh_props = (props & type & (MS_E | MS_M)) | ((props | type) & MS_TIMELOCKS) |
+                          (no_time_mix ? MS_NO_TIME_MIX : 0);
+    frame->thresh_args += MS_HAS(type, MS_Z) ? 0 : MS_HAS(type, MS_O) ? 1 : 2;
+    frame->thresh_n_s += MS_HAS(type, MS_S) ? 1 : 0;
+    return true;
+}
 
-    if (-1 == state_stack_pop(state)) {
-        return -1;
+// returns the type of a thresh(), once the types of all its children are recorded
+static int get_thresh_type(const compiler_frame_t *frame) {
+    const policy_node_thresh_t *thresh = (const policy_node_thresh_t *) frame->node;
+    unsigned int props = frame->thresh_props;
+    size_t n_s = frame->thresh_n_s;
+    return MS_B | MS_D | MS_U | (frame->thresh_args == 0 ? MS_Z : 0) |
+           (frame->thresh_args == 1 ? MS_O : 0) |
+           (MS_HAS(props, MS_E) && n_s == thresh->n ? MS_E : 0) |
+           (MS_HAS(props, MS_E | MS_M) && n_s >= thresh->n - thresh->k ? MS_M : 0) |
+           (n_s >= thresh->n - thresh->k + 1 ? MS_S : 0) | (props & MS_TIME_PROPS);
+}
+
+/**
+ * Emits the code of the script of node, and of all its descendants. The tree is visited in the
+ * order of the script with an explicit stack, so that the stack usage is bounded by
+ * MAX_POLICY_DEPTH frames. Returns the miniscript type of node on success, -1 on error.
+ */
+static int __attribute__((noinline)) compile_script_node(template_compiler_t *c,
+                                                         const policy_node_t *node) {
+    compiler_frame_t frames[MAX_POLICY_DEPTH];
+    unsigned int n_frames = 1;
+    memset(&frames[0], 0, sizeof(frames[0]));
+    frames[0].node = node;
+
+    while (true) {
+        compiler_frame_t *frame = &frames[n_frames - 1];
+        int n_children = get_n_children(frame->node);
+        if (n_children < 0) {
+            return -1;
+        }
+
+        if (frame->n_compiled == 0) {
+            add_node_limits(c, frame->node);
+        }
+
+        if (!emit_node_part(c, frame->node, frame->n_compiled)) {
+            return -1;
+        }
+
+        if (frame->n_compiled < (unsigned int) n_children) {
+            // the children of andor(X,Y,Z) appear in the order X, Z, Y in the script
+            unsigned int pos = frame->n_compiled;
+            if (frame->node->type == TOKEN_ANDOR && pos > 0) {
+                pos = 3 - pos;
+            }
+
+            const policy_node_t *child;
+            if (frame->node->type == TOKEN_THRESH) {
+                if (frame->n_compiled == 0) {
+                    frame->next_child = ((const policy_node_thresh_t *) frame->node)->scripts;
+                }
+                child = frame->next_child->script;
+                frame->next_child = frame->next_child->next;
+            } else if (n_children == 1) {
+                child = ((const policy_node_with_script_t *) frame->node)->script;
+            } else if (n_children == 2) {
+                child = ((const policy_node_with_script2_t *) frame->node)->scripts[pos];
+            } else {
+                child = ((const policy_node_with_script3_t *) frame->node)->scripts[pos];
+            }
+
+            if (n_frames >= MAX_POLICY_DEPTH) {
+                return -1;
+            }
+            memset(&frames[n_frames], 0, sizeof(frames[n_frames]));
+            frames[n_frames++].node = child;
+            continue;
+        }
+
+        int type;
+        if (frame->node->type == TOKEN_THRESH) {
+            type = get_thresh_type(frame);
+        } else {
+            type = get_miniscript_type(frame->node, frame->child_types, c->is_tapscript);
+        }
+        if (type < 0) {
+            return -1;
+        }
+
+        if (--n_frames == 0) {
+            return type;
+        }
+
+        // record the type in the parent
+        compiler_frame_t *parent = &frames[n_frames - 1];
+        unsigned int pos = parent->n_compiled;
+        if (parent->node->type == TOKEN_THRESH) {
+            if (!add_thresh_child_type(parent, type, pos)) {
+                return -1;
+            }
+        } else {
+            if (parent->node->type == TOKEN_ANDOR && pos > 0) {
+                pos = 3 - pos;
+            }
+            parent->child_types[pos] = type;
+        }
+        ++parent->n_compiled;
     }
-    return out_len;
 }
 
-static int __attribute__((noinline)) process_tr_node(policy_parser_state_t *state) {
-    PRINT_STACK_POINTER();
+/**
+ * Emits the code computing the merkle root of a tree of scripts of a tr() policy: the TapLeaf hash
+ * of each leaf script is computed while the script is streamed, and the subtrees are combined in
+ * post-order with TEMPLATE_OP_TAPBRANCH. Returns 0 on success, -1 on error.
+ */
+static int compile_taptree(template_compiler_t *c,
+                           const policy_node_tree_t *tree,
+                           unsigned int tree_depth) {
+    if (tree_depth > MAX_TAPTREE_POLICY_DEPTH) {
+        return -1;
+    }
 
-    policy_parser_node_state_t *node = &state->nodes[state->node_stack_eos];
+    if (!tree->is_leaf) {
+        for (unsigned int i = 0; i < 2; i++) {
+            if (compile_taptree(c, tree->subtrees[i], tree_depth + 1) < 0) {
+                return -1;
+            }
+        }
+        uint8_t op = TEMPLATE_OP_TAPBRANCH;
+        c->last_run = -1;
+        return template_append(c->out, &op, 1) ? 0 : -1;
+    }
 
-    if (node->step != 0) {
+    // the length of the leaf script is filled once it is compiled
+    unsigned int header_pos = c->out->code_len;
+    if (!template_append(c->out, (const uint8_t[]){TEMPLATE_OP_TAPLEAF, 0, 0}, 3)) {
+        return -1;
+    }
+    c->last_run = -1;
+
+    unsigned int outer_script_len = c->script_len;
+    c->script_len = 0;
+    c->n_ops = 0;
+    c->n_items = 0;
+    c->is_tapscript = true;
+    int type = compile_script_node(c, tree->script);
+    bool is_within_limits = is_within_script_limits(c);
+    c->is_tapscript = false;
+    unsigned int leaf_len = c->script_len;
+    c->script_len = outer_script_len;
+
+    // the leaf script must be a sane miniscript
+    if (!is_sane_top_level_type(type) || !is_within_limits || leaf_len > 0xFFFF) {
         return -1;
     }
+    c->out->code[header_pos + 1] = leaf_len & 0xFF;
+    c->out->code[header_pos + 2] = leaf_len >> 8;
 
-    policy_node_with_key_t *policy = (policy_node_with_key_t *) node->policy_node;
+    uint8_t op = TEMPLATE_OP_TAPLEAF_END;
+    c->last_run = -1;
+    return template_append(c->out, &op, 1) ? 0 : -1;
+}
+
+int compile_policy_script_template(const policy_node_t *policy, policy_script_template_t *out) {
+    memset(out, 0, sizeof(policy_script_template_t));
+
+    // the sh() and wsh() wrappers are listed from the outermost one; they are applied in the
+    // opposite order
+    uint8_t outer_wrappers[POLICY_SCRIPT_TEMPLATE_MAX_WRAPPERS];
+    unsigned int n_wrappers = 0;
+    const policy_node_t *node = policy;
+    while (node->type == TOKEN_SH || node->type == TOKEN_WSH) {
+        if (n_wrappers >= POLICY_SCRIPT_TEMPLATE_MAX_WRAPPERS) {
+            return -1;
+        }
+        outer_wrappers[n_wrappers++] = node->type;
+        node = ((const policy_node_with_script_t *) node)->script;
+    }
+    out->n_wrappers = n_wrappers;
+    for (unsigned int i = 0; i < n_wrappers; i++) {
+        out->wrappers[i] = outer_wrappers[n_wrappers - 1 - i];
+    }
 
-    unsigned int out_len = 2 + 32;
+    template_compiler_t compiler = {.out = out,
+                                    .last_run = -1,
+                                    .script_len = 0,
+                                    .is_tapscript = false};
 
-    if (node->mode == MODE_OUT_BYTES && !buffer_can_read(node->out_buf, out_len)) {
+    // the tree of scripts of a tr() policy is hashed before computing the output key
+    if (node->type == TOKEN_TR && ((const policy_node_tr_t *) node)->tree != NULL) {
+        if (n_wrappers > 0 ||
+            compile_taptree(&compiler, ((const policy_node_tr_t *) node)->tree, 0) < 0) {
+            return -1;
+        }
+    }
+
+    compiler.n_ops = 0;
+    compiler.n_items = 0;
+    int type = compile_script_node(&compiler, node);
+    if (type < 0) {
         return -1;
     }
 
-    int result;
+    if (n_wrappers > 0 && out->wrappers[0] == TOKEN_WSH) {
+        // the script inside wsh() must be a sane miniscript
+        if (!is_sane_top_level_type(type) || !is_within_script_limits(&compiler)) {
+            return -1;
+        }
+    } else if (node->type >= TOKEN_0) {
+        return -1;  // miniscript fragments are only supported inside wsh()
+    }
 
-    uint8_t compressed_pubkey[33];
-    uint8_t tweaked_key[32];
+    unsigned int script_len = compiler.script_len;
+    if (n_wrappers > 0) {
+        // the outermost wrapper determines the length of the final script
+        script_len = (outer_wrappers[0] == TOKEN_SH) ? 2 + 20 + 1 : 2 + 32;
+    }
+    out->script_len = script_len;
+    return 0;
+}
 
-    if (-1 == get_derived_pubkey(state, policy->key_index, compressed_pubkey)) {
+int call_get_wallet_script_from_template(dispatcher_context_t *dispatcher_context,
+                                         const policy_script_template_t *template,
+                                         const uint8_t keys_merkle_root[static 32],
+                                         uint32_t n_keys,
+                                         policy_pubkeys_cache_t *pubkeys_cache,
+                                         bool change,
+                                         size_t address_index,
+                                         buffer_t *out_buf) {
+    if (!buffer_can_read(out_buf, template->script_len)) {
         return -1;
+    }
+
+    policy_parser_state_t state = {.dispatcher_context = dispatcher_context,
+                                   .keys_merkle_root = keys_merkle_root,
+                                   .n_keys = n_keys,
+                                   .pubkeys_cache = pubkeys_cache,
+                                   .change = change,
+                                   .address_index = address_index,
+                                   .out_buf = NULL};
+
+    // if there are wrappers, the inner script is only needed to compute its hash
+    if (template->n_wrappers == 0) {
+        state.out_buf = out_buf;
     } else {
-        update_output_u8(state, 0x51);
-        update_output_u8(state, 0x20);
+        cx_sha256_init(&state.hash_context);
+    }
 
-        uint8_t parity;
-        crypto_tr_tweak_pubkey(compressed_pubkey + 1, &parity, tweaked_key);
+    if (-1 == run_template_code(&state, template)) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < template->n_wrappers; i++) {
+        uint8_t hash[32];
+        crypto_hash_digest(&state.hash_context.header, hash, 32);
+
+        if (i == template->n_wrappers - 1u) {
+            state.out_buf = out_buf;
+        } else {
+            cx_sha256_init(&state.hash_context);
+        }
+
+        if (template->wrappers[i] == TOKEN_SH) {
+            update_output_u8(&state, 0xa9);
+            update_output_u8(&state, 0x14);
+
+            crypto_ripemd160(hash, 32, hash);  // reuse memory
+            update_output(&state, hash, 20);
 
-        update_output(state, tweaked_key, 32);
+            update_output_u8(&state, 0x87);
+        } else {  // template->wrappers[i] == TOKEN_WSH
+            update_output_u8(&state, 0x00);
+            update_output_u8(&state, 0x20);
 
-        result = 2 + 32;
+            update_output(&state, hash, 32);
+        }
     }
 
-    if (-1 == state_stack_pop(state)) {
+    return template->script_len;
+}
+
+int call_get_wallet_tr_merkle_root(dispatcher_context_t *dispatcher_context,
+                                   const policy_script_template_t *template,
+                                   const uint8_t keys_merkle_root[static 32],
+                                   uint32_t n_keys,
+                                   policy_pubkeys_cache_t *pubkeys_cache,
+                                   bool change,
+                                   size_t address_index,
+                                   uint8_t out[static 32]) {
+    // the start of the scriptPubKey is written to a scratch buffer, as only the root is needed
+    uint8_t script[34];
+    buffer_t script_buf = buffer_create(script, sizeof(script));
+
+    policy_parser_state_t state = {.dispatcher_context = dispatcher_context,
+                                   .keys_merkle_root = keys_merkle_root,
+                                   .n_keys = n_keys,
+                                   .pubkeys_cache = pubkeys_cache,
+                                   .change = change,
+                                   .address_index = address_index,
+                                   .out_buf = &script_buf,
+                                   .tr_merkle_root_out = out};
+
+    // the code of tr() policies has no wrappers, and ends with TEMPLATE_OP_TR_OUTPUT_KEY, where the
+    // execution stops early
+    if (template->n_wrappers != 0 || template->script_len > sizeof(script) ||
+        -1 == run_template_code(&state, template) ||
+        state.tr_merkle_root_out != NULL) {
         return -1;
     }
-    return result;
+    return 0;
 }
 
 int call_get_wallet_script(dispatcher_context_t *dispatcher_context,
                            const policy_node_t *policy,
                            const uint8_t keys_merkle_root[static 32],
                            uint32_t n_keys,
+                           policy_pubkeys_cache_t *pubkeys_cache,
                            bool change,
                            size_t address_index,
                            buffer_t *out_buf) {
-    policy_parser_state_t state = {.dispatcher_context = dispatcher_context,
-                                   .keys_merkle_root = keys_merkle_root,
-                                   .n_keys = n_keys,
-                                   .change = change,
-                                   .address_index = address_index,
-                                   .node_stack_eos = 0};
-
-    state.nodes[0] = (policy_parser_node_state_t){.mode = MODE_OUT_BYTES,
-                                                  .step = 0,
-                                                  .policy_node = policy,
-                                                  .out_buf = out_buf};
-
-    int ret;
-    do {
-        switch (state.nodes[state.node_stack_eos].policy_node->type) {
-            case TOKEN_PKH:
-            case TOKEN_WPKH:
-                ret = process_pkh_wpkh_node(&state);
-                break;
-            case TOKEN_SH:
-            case TOKEN_WSH:
-                ret = process_sh_wsh_node(&state);
-                break;
-            case TOKEN_MULTI:
-            case TOKEN_SORTEDMULTI:
-                ret = process_multi_sortedmulti_node(&state);
-                break;
-            case TOKEN_TR:
-                ret = process_tr_node(&state);
-                break;
-            default:
-                ret = -1;
+    policy_script_template_t template;
+    if (-1 == compile_policy_script_template(policy, &template)) {
+        return -1;
+    }
+
+    return call_get_wallet_script_from_template(dispatcher_context,
+                                                &template,
+                                                keys_merkle_root,
+                                                n_keys,
+                                                pubkeys_cache,
+                                                change,
+                                                address_index,
+                                                out_buf);
+}
+
+bool policy_pubkeys_cache_set_sorted_keys_order(policy_pubkeys_cache_t *pubkeys_cache,
+                                                bool change,
+                                                uint32_t address_index,
+                                                const uint8_t *order,
+                                                size_t n) {
+    _Static_assert(MAX_POLICY_MAP_COSIGNERS <= 16, "The keys do not fit in the bitmask");
+
+    if (n > MAX_POLICY_MAP_COSIGNERS) {
+        return false;
+    }
+
+    uint16_t seen = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (order[i] >= n || (seen & (1 << order[i])) != 0) {
+            return false;
+        }
+        seen |= 1 << order[i];
+    }
+
+    policy_sorted_keys_order_t *known_order = &pubkeys_cache->sorted_keys_order;
+    known_order->is_valid = true;
+    known_order->change = change;
+    known_order->n = (uint8_t) n;
+    known_order->address_index = address_index;
+    memcpy(known_order->order, order, n);
+    return true;
+}
+
+// decodes each key information streamed by call_load_policy_pubkeys into the cache
+static int load_policy_pubkey_callback(uint32_t key_index, buffer_t *key_info, void *state) {
+    policy_pubkeys_cache_t *pubkeys_cache = (policy_pubkeys_cache_t *) state;
+
+    int ret = decode_key_info(key_info,
+                              &pubkeys_cache->ext_pubkeys[key_index],
+                              pubkeys_cache->multipath[key_index]);
+    if (ret < 0) {
+        return -1;
+    }
+    pubkeys_cache->has_wildcard[key_index] = (ret == 1);
+    return 0;
+}
+
+int call_load_policy_pubkeys(dispatcher_context_t *dispatcher_context,
+                             const uint8_t keys_merkle_root[static 32],
+                             uint32_t n_keys,
+                             policy_pubkeys_cache_t *pubkeys_cache) {
+    if (n_keys > POLICY_PUBKEYS_CACHE_SIZE) {
+        return 0;  // not an error, but the pubkeys will be fetched when needed
+    }
+
+    if ((dispatcher_context->client_capabilities & CLIENT_CAPABILITY_STREAM_MERKLE_LEAVES) != 0) {
+        // all the key informations are received at once, and verified against the Merkle root
+        uint8_t key_info_str[MAX_POLICY_KEY_INFO_LEN];
+        if (call_stream_merkle_leaves(dispatcher_context,
+                                      keys_merkle_root,
+                                      n_keys,
+                                      key_info_str,
+                                      sizeof(key_info_str),
+                                      load_policy_pubkey_callback,
+                                      pubkeys_cache) < 0) {
+            return -1;
+        }
+
+        pubkeys_cache->has_ext_pubkeys = true;
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < n_keys; i++) {
+        int ret = get_extended_pubkey(dispatcher_context,
+                                      keys_merkle_root,
+                                      n_keys,
+                                      i,
+                                      &pubkeys_cache->ext_pubkeys[i],
+                                      pubkeys_cache->multipath[i]);
+        if (ret < 0) {
+            return -1;
+        }
+        pubkeys_cache->has_wildcard[i] = (ret == 1);
+    }
+
+    pubkeys_cache->has_ext_pubkeys = true;
+    return 0;
+}
+
+int policy_pubkeys_cache_get_change(const policy_pubkeys_cache_t *pubkeys_cache,
+                                    uint32_t n_keys,
+                                    uint32_t step) {
+    bool has_wildcard = false;
+    if (pubkeys_cache->has_ext_pubkeys && n_keys <= POLICY_PUBKEYS_CACHE_SIZE) {
+        for (uint32_t i = 0; i < n_keys; i++) {
+            if (!pubkeys_cache->has_wildcard[i]) {
+                continue;
+            }
+            has_wildcard = true;
+            if (step == pubkeys_cache->multipath[i][0]) {
+                return 0;
+            } else if (step == pubkeys_cache->multipath[i][1]) {
+                return 1;
+            }
         }
-    } while (ret >= 0 && state.node_stack_eos >= 0);
-    return ret;
+    }
+    if (has_wildcard) {
+        return -1;
+    }
+    return step <= 1 ? (int) step : -1;
+}
+
+int policy_pubkeys_cache_derive_change_steps(policy_pubkeys_cache_t *pubkeys_cache,
+                                             uint32_t n_keys) {
+    if (POLICY_PUBKEYS_CACHE_CHANGE_STEPS < 2 || !pubkeys_cache->has_ext_pubkeys ||
+        n_keys > POLICY_PUBKEYS_CACHE_SIZE) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < n_keys; i++) {
+        if (!pubkeys_cache->has_wildcard[i]) {
+            continue;
+        }
+        for (int change = 0; change < POLICY_PUBKEYS_CACHE_CHANGE_STEPS; change++) {
+            if (derive_pubkey_cache_entry(&pubkeys_cache->ext_pubkeys[i],
+                                          true,
+                                          pubkeys_cache->multipath[i],
+                                          change == 1,
+                                          &pubkeys_cache->keys[i][change]) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
 }
 
 int get_policy_address_type(const policy_node_t *policy) {
@@ -464,13 +1846,74 @@ int get_policy_address_type(const policy_node_t *policy) {
             }
             return -1;
         case TOKEN_TR:
+            // only tr(KEY) is canonical, not if there is a tree of scripts
+            if (((policy_node_tr_t *) policy)->tree != NULL) {
+                return -1;
+            }
             return ADDRESS_TYPE_TR;
         default:
             return -1;
     }
 }
 
+/**
+ * A wallet id and its hmac, either verified by check_wallet_hmac or produced when the wallet was
+ * registered.
+ */
+typedef struct {
+    bool is_valid;
+    uint32_t last_used;  // value of wallet_hmac_cache_counter when the entry was last used
+    uint8_t wallet_id[32];
+    uint8_t wallet_hmac[32];
+} wallet_hmac_cache_entry_t;
+
+// least recently used cache of the verified wallet hmacs, as consecutive commands often use the
+// same wallet; cleared by clear_wallet_hmac_cache
+static uint32_t wallet_hmac_cache_counter = 0;
+static wallet_hmac_cache_entry_t wallet_hmac_cache[WALLET_HMAC_CACHE_SIZE];
+
+void store_verified_wallet_hmac(const uint8_t wallet_id[static 32],
+                                const uint8_t wallet_hmac[static 32]) {
+    wallet_hmac_cache_entry_t *entry = &wallet_hmac_cache[0];
+    for (int i = 0; i < WALLET_HMAC_CACHE_SIZE; i++) {
+        wallet_hmac_cache_entry_t *cur = &wallet_hmac_cache[i];
+        if (cur->is_valid && memcmp(cur->wallet_id, wallet_id, 32) == 0) {
+            entry = cur;  // the hmac of a wallet id is unique, but we overwrite it anyway
+            break;
+        }
+
+        // choose an empty entry, or the least recently used one
+        if (entry->is_valid && (!cur->is_valid || cur->last_used < entry->last_used)) {
+            entry = cur;
+        }
+    }
+
+    if (entry->is_valid && memcmp(entry->wallet_id, wallet_id, 32) != 0) {
+        PERF_COUNT_CACHE(CACHE_WALLET_HMAC, evictions, sizeof(wallet_hmac_cache));
+    }
+    entry->is_valid = true;
+    entry->last_used = ++wallet_hmac_cache_counter;
+    memcpy(entry->wallet_id, wallet_id, 32);
+    memcpy(entry->wallet_hmac, wallet_hmac, 32);
+}
+
+void clear_wallet_hmac_cache() {
+    wallet_hmac_cache_counter = 0;
+    explicit_bzero(wallet_hmac_cache, sizeof(wallet_hmac_cache));
+}
+
 bool check_wallet_hmac(const uint8_t wallet_id[static 32], const uint8_t wallet_hmac[static 32]) {
+    for (int i = 0; i < WALLET_HMAC_CACHE_SIZE; i++) {
+        wallet_hmac_cache_entry_t *cur = &wallet_hmac_cache[i];
+        if (cur->is_valid && memcmp(cur->wallet_id, wallet_id, 32) == 0 &&
+            os_secure_memcmp((void *) wallet_hmac, cur->wallet_hmac, 32) == 0) {
+            cur->last_used = ++wallet_hmac_cache_counter;
+            PERF_COUNT_CACHE(CACHE_WALLET_HMAC, hits, sizeof(wallet_hmac_cache));
+            return true;
+        }
+    }
+    PERF_COUNT_CACHE(CACHE_WALLET_HMAC, misses, sizeof(wallet_hmac_cache));
+
     uint8_t key[32];
     uint8_t correct_hmac[32];
 
@@ -492,5 +1935,8 @@ bool check_wallet_hmac(const uint8_t wallet_id[static 32], const uint8_t wallet_
     }
     END_TRY;
 
+    if (result) {
+        store_verified_wallet_hmac(wallet_id, wallet_hmac);
+    }
     return result;
 }
\ No newline at end of file
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <string.h>
+
 #include "../../boilerplate/dispatcher.h"
 #include "../../common/wallet.h"
+#include "../../crypto.h"
+#include "../../perf_config.h"
 
 /**
  * The label used to derive the symmetric key used to register/verify wallet policies on device.
@@ -10,8 +14,298 @@
 #define WALLET_SLIP0021_LABEL_LEN \
     (sizeof(WALLET_SLIP0021_LABEL) - 1)  // sizeof counts the terminating 0
 
+/**
+ * A cached pubkey of a key placeholder of a wallet policy: for keys with wildcard, the extended
+ * pubkey derived at the change level for the receive (`change` = 0) or change (`change` = 1)
+ * addresses, that is, at the step of its multipath wildcard; otherwise, the key itself. The pubkey
+ * is kept uncompressed, in order to avoid decompressing it for each derivation.
+ */
+typedef struct {
+    bool is_valid;
+    bool has_wildcard;
+    uint8_t change;
+    uint8_t chain_code[32];
+    uint8_t pubkey[65];
+} policy_pubkey_cache_entry_t;
+
+/**
+ * A cached taproot output key, that is the tweaked key of the tr() policy at the given address.
+ */
+typedef struct {
+    bool is_valid;
+    bool change;
+    uint32_t address_index;
+    uint32_t last_used;  // value of tr_keys_counter when the entry was last used
+    uint8_t tweaked_key[32];
+} policy_tr_key_cache_entry_t;
+
+/**
+ * Maximum number of keys of a multisig policy whose derived pubkeys are cached; the pubkeys of
+ * larger multisigs are streamed to the output, in order to only keep few keys in memory.
+ */
+#define POLICY_MULTISIG_MAX_CACHED_KEYS 5
+
+/**
+ * The cached derived pubkeys of the multi() or sortedmulti() of a policy at the given address, in
+ * the order they appear in the script (that is, already sorted for sortedmulti).
+ */
+typedef struct {
+    bool is_valid;
+    bool change;
+    uint8_t n;
+    uint32_t address_index;
+    uint32_t last_used;  // value of multisig_keys_counter when the entry was last used
+    uint8_t pubkeys[POLICY_MULTISIG_MAX_CACHED_KEYS][33];
+} policy_multisig_keys_cache_entry_t;
+
+/**
+ * The order of the keys of a sortedmulti() or sortedmulti_a() with more than
+ * POLICY_MULTISIG_MAX_CACHED_KEYS keys at the given address: the i-th key in the script is the
+ * order[i]-th key of the multisig. It is only a hint, either provided by the client or remembered
+ * from a previous derivation at the same address: the keys are derived in this order, and checked to
+ * be sorted while they are emitted, instead of being derived twice in order to sort them.
+ */
+typedef struct {
+    bool is_valid;
+    bool change;
+    uint8_t n;
+    uint32_t address_index;
+    uint8_t order[MAX_POLICY_MAP_COSIGNERS];
+} policy_sorted_keys_order_t;
+
+/**
+ * Cache of the pubkeys of the key placeholders of a wallet policy, in order to avoid fetching,
+ * decoding and deriving them again when computing the scripts of multiple addresses of the same
+ * wallet policy. For each key, POLICY_PUBKEYS_CACHE_CHANGE_STEPS change-level children are kept: the
+ * entry of index `change` if there are 2, otherwise only the most recently derived one.
+ * It must be zeroed before first use; it must not be shared among different wallet policies.
+ */
+typedef struct {
+    policy_pubkey_cache_entry_t keys[POLICY_PUBKEYS_CACHE_SIZE][POLICY_PUBKEYS_CACHE_CHANGE_STEPS];
+
+    // if true, ext_pubkeys, has_wildcard and multipath contain the decoded extended pubkeys and
+    // the wildcards of all the keys of the policy, as loaded by call_load_policy_pubkeys; the
+    // extended pubkey of a key with wildcard might be omitted if the entries in keys are valid for
+    // both the change steps, as they are never evicted
+    bool has_ext_pubkeys;
+    serialized_extended_pubkey_t ext_pubkeys[POLICY_PUBKEYS_CACHE_SIZE];
+    bool has_wildcard[POLICY_PUBKEYS_CACHE_SIZE];
+    uint32_t multipath[POLICY_PUBKEYS_CACHE_SIZE][2];
+
+    // least recently used cache of the output keys of tr() policies, as transactions often contain
+    // multiple inputs or outputs at the same address
+    uint32_t tr_keys_counter;
+    policy_tr_key_cache_entry_t tr_keys[POLICY_TR_KEYS_CACHE_SIZE];
+
+    // least recently used cache of the ordered pubkeys of multisig policies, for the same reason
+    uint32_t multisig_keys_counter;
+    policy_multisig_keys_cache_entry_t multisig_keys[POLICY_MULTISIG_KEYS_CACHE_SIZE];
+
+    // order of the keys of the large sorted multisig at the most recent address
+    policy_sorted_keys_order_t sorted_keys_order;
+} policy_pubkeys_cache_t;
+
+/**
+ * Key of the proprietary field of a PSBT input or output that contains the order of the keys of the
+ * sorted multisig of its wallet policy at its address, as in policy_sorted_keys_order_t:
+ * <PSBT_{IN,OUT}_PROPRIETARY> <identifier_len : 1> "LEDGER" <subtype : 1>, with no keydata.
+ */
+#define PSBT_SORTED_KEYS_ORDER_KEY     "\xFC\x06LEDGER\x03"
+#define PSBT_SORTED_KEYS_ORDER_KEY_LEN (sizeof(PSBT_SORTED_KEYS_ORDER_KEY) - 1)
+
+/**
+ * Stores in the cache the extended pubkey of the only key of a single-key wallet policy, when it is
+ * already known (for example, because it is our key, derived from the seed); afterwards,
+ * call_get_wallet_script does not request it to the client.
+ *
+ * @param[out] pubkeys_cache
+ *   Pointer to the cache; it must be zeroed before calling this function.
+ * @param[in] ext_pubkey
+ *   The extended pubkey of the key
+ * @param[in] has_wildcard
+ *   Whether the key information of the key has the wildcard suffix.
+ * @param[in] multipath
+ *   The steps of the wildcard for the receive and the change addresses, if has_wildcard.
+ */
+static inline void policy_pubkeys_cache_set_single_key(
+    policy_pubkeys_cache_t *pubkeys_cache,
+    const serialized_extended_pubkey_t *ext_pubkey,
+    bool has_wildcard,
+    const uint32_t multipath[static 2]) {
+    memcpy(&pubkeys_cache->ext_pubkeys[0], ext_pubkey, sizeof(serialized_extended_pubkey_t));
+    pubkeys_cache->has_wildcard[0] = has_wildcard;
+    pubkeys_cache->multipath[0][0] = multipath[0];
+    pubkeys_cache->multipath[0][1] = multipath[1];
+    pubkeys_cache->has_ext_pubkeys = true;
+}
+
+/**
+ * Returns whether a derivation step at the change level of the keys of a wallet policy is the one
+ * of the receive or of the change addresses, according to the multipath wildcards of the keys
+ * loaded in the cache; if no key with wildcard is loaded, the step must be 0 or 1, as for the usual
+ * wildcard.
+ *
+ * @param[in] pubkeys_cache
+ *   Pointer to the cache
+ * @param[in] n_keys
+ *   The number of keys of the wallet policy
+ * @param[in] step
+ *   The derivation step at the change level
+ *
+ * @return 0 for the receive addresses, 1 for the change addresses, or -1 if the step is neither.
+ */
+int policy_pubkeys_cache_get_change(const policy_pubkeys_cache_t *pubkeys_cache,
+                                    uint32_t n_keys,
+                                    uint32_t step);
+
+/**
+ * Derives, for each key with wildcard loaded in the cache by call_load_policy_pubkeys, the
+ * change-level children of both the receive and the change addresses, so that each later address
+ * only needs one derivation per key. Nothing is done if POLICY_PUBKEYS_CACHE_CHANGE_STEPS is 1.
+ *
+ * @param[in,out] pubkeys_cache
+ *   Pointer to the cache
+ * @param[in] n_keys
+ *   The number of keys of the wallet policy
+ *
+ * @return 0 on success, -1 in case of error.
+ */
+int policy_pubkeys_cache_derive_change_steps(policy_pubkeys_cache_t *pubkeys_cache,
+                                             uint32_t n_keys);
+
+/**
+ * Stores in the cache the order of the keys of the sorted multisig of the policy at the given
+ * address, as provided by the client; a wrong order only costs an additional derivation of the
+ * keys, as it is detected when the script is computed.
+ *
+ * @param[in,out] pubkeys_cache
+ *   Pointer to the cache
+ * @param[in] change
+ *   0 for a receive address, 1 for a change address
+ * @param[in] address_index
+ *   The address index
+ * @param[in] order
+ *   The position in the multisig of each key, in the order they appear in the script
+ * @param[in] n
+ *   The number of keys of the multisig
+ *
+ * @return true on success, false if order is not a permutation of the first n integers.
+ */
+bool policy_pubkeys_cache_set_sorted_keys_order(policy_pubkeys_cache_t *pubkeys_cache,
+                                                bool change,
+                                                uint32_t address_index,
+                                                const uint8_t *order,
+                                                size_t n);
+
+/**
+ * Fetches all the key informations of a wallet policy, and stores their decoded extended pubkeys in
+ * the cache; afterwards, call_get_wallet_script does not request them again to the client.
+ * Nothing is loaded if the policy has more than POLICY_PUBKEYS_CACHE_SIZE keys.
+ * If the client declares the CLIENT_CAPABILITY_STREAM_MERKLE_LEAVES capability, all the key
+ * informations are received in a single stream, instead of with a separate Merkle proof for each.
+ *
+ * @param[in] dispatcher_context
+ *   Pointer to the dispatcher context
+ * @param[in] keys_merkle_root
+ *   The Merkle root of the tree of key informations in the policy
+ * @param[in] n_keys
+ *   The number of key information placeholders in the policy
+ * @param[out] pubkeys_cache
+ *   Pointer to the cache; it must be zeroed before calling this function.
+ *
+ * @return 0 on success, -1 in case of error.
+ */
+int call_load_policy_pubkeys(dispatcher_context_t *dispatcher_context,
+                             const uint8_t keys_merkle_root[static 32],
+                             uint32_t n_keys,
+                             policy_pubkeys_cache_t *pubkeys_cache);
+
+/**
+ * Maximum number of sh() and wsh() wrappers around the inner script of a compiled policy.
+ */
+#define POLICY_SCRIPT_TEMPLATE_MAX_WRAPPERS 2
+
+/**
+ * Maximum length of the code of a compiled policy; enough for the longest multisig, and for
+ * miniscript policies of moderate size. Policies whose code is longer are rejected.
+ */
+#ifdef TARGET_NANOS
+#define POLICY_SCRIPT_TEMPLATE_MAX_CODE_LEN 64
+#else
+#define POLICY_SCRIPT_TEMPLATE_MAX_CODE_LEN 192
+#endif
+
+/**
+ * A wallet policy lowered by compile_policy_script_template into a flat template of its script.
+ * The code describes the innermost script as runs of literal bytes and slots for the derived keys;
+ * each wrapper replaces the script computed so far with a script containing its hash. It only
+ * depends on the policy, therefore it can be reused to compute the script at any address.
+ */
+typedef struct {
+    uint8_t n_wrappers;
+    // TOKEN_SH or TOKEN_WSH, starting from the innermost one
+    uint8_t wrappers[POLICY_SCRIPT_TEMPLATE_MAX_WRAPPERS];
+    uint16_t script_len;  // length of the final script
+    uint8_t code_len;
+    uint8_t code[POLICY_SCRIPT_TEMPLATE_MAX_CODE_LEN];
+} policy_script_template_t;
+
+/**
+ * Compiles a wallet policy into the template of its script. The miniscript inside wsh() and in the
+ * leaves of a tr() tree is type-checked, and must be sane: of type B, non-malleable, requiring a
+ * signature, and without timelocks based on both heights and time in the same spending path. Its
+ * number of opcodes and the size of its witness must be within the limits of Bitcoin Core, as the
+ * script would not be spendable otherwise.
+ *
+ * @param[in] policy
+ *   Pointer to the root node of the policy
+ * @param[out] out
+ *   Pointer to the template to fill
+ *
+ * @return 0 on success, -1 if the policy is not supported.
+ */
+int compile_policy_script_template(const policy_node_t *policy, policy_script_template_t *out);
+
+/**
+ * Computes the script of a wallet policy compiled with compile_policy_script_template, for a
+ * certain change and address index. The parameters are the same as call_get_wallet_script, except
+ * for the template that replaces the policy.
+ *
+ * @return The length of the output on success; -1 in case of error.
+ */
+int call_get_wallet_script_from_template(dispatcher_context_t *dispatcher_context,
+                                         const policy_script_template_t *template,
+                                         const uint8_t keys_merkle_root[static 32],
+                                         uint32_t n_keys,
+                                         policy_pubkeys_cache_t *pubkeys_cache,
+                                         bool change,
+                                         size_t address_index,
+                                         buffer_t *out_buf);
+
+/**
+ * Computes the merkle root of the tree of scripts of a tr() policy compiled with
+ * compile_policy_script_template, for a certain change and address index; it is needed in order to
+ * tweak the internal key for key-path spending. The parameters are the same as
+ * call_get_wallet_script_from_template, except for the output.
+ *
+ * @param[out] out
+ *   Pointer to a 32-byte array that will contain the merkle root.
+ *
+ * @return 0 on success; -1 in case of error, or if the policy is not tr() with a tree of scripts.
+ */
+int call_get_wallet_tr_merkle_root(dispatcher_context_t *dispatcher_context,
+                                   const policy_script_template_t *template,
+                                   const uint8_t keys_merkle_root[static 32],
+                                   uint32_t n_keys,
+                                   policy_pubkeys_cache_t *pubkeys_cache,
+                                   bool change,
+                                   size_t address_index,
+                                   uint8_t out[static 32]);
+
 /**
  * Computes the script corresponding to a wallet policy, for a certain change and address index.
+ * The policy is compiled at each call; in order to compute the scripts of multiple addresses, it is
+ * more efficient to compile it once and use call_get_wallet_script_from_template.
  *
  * @param[in] dispatcher_context
  *   Pointer to the dispatcher context
@@ -21,6 +315,8 @@
  *   The Merkle root of the tree of key informations in the policy
  * @param[in] n_keys
  *   The number of key information placeholders in the policy
+ * @param[in,out] pubkeys_cache
+ *   Pointer to a cache of the pubkeys of the keys of the policy, or NULL if no cache is used.
  * @param[in] change
  *   0 for a receive address, 1 for a change address
  * @param[in] address_index
@@ -36,6 +332,7 @@ int call_get_wallet_script(dispatcher_context_t *dispatcher_context,
                            const policy_node_t *policy,
                            const uint8_t keys_merkle_root[static 32],
                            uint32_t n_keys,
+                           policy_pubkeys_cache_t *pubkeys_cache,
                            bool change,
                            size_t address_index,
                            buffer_t *out_buf);
@@ -52,14 +349,46 @@ int call_get_wallet_script(dispatcher_context_t *dispatcher_context,
 int get_policy_address_type(const policy_node_t *policy);
 
 /**
- * Verifies if the wallet_hmac is correct for the given wallet_id, using the symmetric key derived
- * with the WALLET_SLIP0021_LABEL label according to SLIP-0021.
+ * Checks if the extended pubkey of a key information is the one derived from the seed at the
+ * derivation of its key origin. Binary key informations are compared to the serialized pubkey,
+ * textual ones to its base58 encoding. The master key fingerprint is not checked.
  *
- * @param[in] policy
- *   Pointer to the root node of the policy
- * @param[in] policy
- *   Pointer to the root node of the policy
+ * @param[in] key_info
+ *   The key information, as parsed by parse_policy_map_key_info
+ * @param[in] bip32_pubkey_version
+ *   Version prefix of the extended pubkeys of the coin
+ *
+ * @return 1 if the pubkey matches, 0 if it does not, or -1 on error.
+ */
+int check_key_info_pubkey(const policy_map_key_info_t *key_info, uint32_t bip32_pubkey_version);
 
+/**
+ * Verifies if the wallet_hmac is correct for the given wallet_id, using the symmetric key derived
+ * with the WALLET_SLIP0021_LABEL label according to SLIP-0021. The most recently verified pairs
+ * are cached, therefore verifying again the same wallet does not require any derivation.
+ *
+ * @param[in] wallet_id
+ *   The id of the wallet
+ * @param[in] wallet_hmac
+ *   The hmac to verify
+ *
  * @return true if the given hmac is valid, false otherwise.
  */
-bool check_wallet_hmac(const uint8_t wallet_id[static 32], const uint8_t wallet_hmac[static 32]);
\ No newline at end of file
+bool check_wallet_hmac(const uint8_t wallet_id[static 32], const uint8_t wallet_hmac[static 32]);
+
+/**
+ * Adds a wallet id and its correct hmac to the cache used by check_wallet_hmac; used when the hmac
+ * is produced while registering the wallet.
+ *
+ * @param[in] wallet_id
+ *   The id of the wallet
+ * @param[in] wallet_hmac
+ *   The hmac of the wallet
+ */
+void store_verified_wallet_hmac(const uint8_t wallet_id[static 32],
+                                const uint8_t wallet_hmac[static 32]);
+
+/**
+ * Clears the cache of the verified wallet hmacs. It is called when the device is locked.
+ */
+void clear_wallet_hmac_cache();
@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -7,6 +8,7 @@
 
 #include "get_merkleized_map_value_hash.h"
 #include "stream_preimage.h"
+#include "stream_stripped_rawtx.h"
 
 #include "../../boilerplate/dispatcher.h"
 #include "../../boilerplate/sw.h"
@@ -34,7 +36,9 @@ typedef struct {
 typedef struct parse_rawtx_state_s {
     cx_sha256_t *hash_context;
 
+    bool is_stripped;  // true if the transaction is received without the witnesses
     bool is_segwit;
+    bool is_hashing_tail;  // true once the remaining bytes are only needed to compute the txid
     unsigned int n_inputs;
     unsigned int n_outputs;
 
@@ -62,6 +66,7 @@ typedef struct parse_rawtx_state_s {
         };
     };
 
+    int input_index;   // index of queried input, or -1
     int output_index;  // index of queried output, or -1
 
     txid_parser_outputs_t *parser_outputs;
@@ -74,17 +79,32 @@ typedef struct psbt_parse_rawtx_state_s {
     unsigned int store_data_length;  // size of data currently in store
     parse_rawtx_state_t parser_state;
     parser_context_t parser_context;
-    bool parser_error;  // set to true if there was an error during parsing
+    bool parser_error;      // set to true if there was an error during parsing
+    bool parser_completed;  // set to true once the whole transaction is parsed
 } psbt_parse_rawtx_state_t;
 
+// Callback for dbuffer_skip_bytes that adds the data to the hash computation.
+static void hash_update_callback(const uint8_t *data, size_t data_len, void *cb_state) {
+    crypto_hash_update(&((cx_sha256_t *) cb_state)->header, data, data_len);
+}
+
 /*   PARSER FOR A RAWTX INPUT */
 
+// Returns true if the input being parsed is the queried one.
+static bool is_queried_input(const parse_rawtx_state_t *state) {
+    return state->input_index != -1 && state->in_counter == (unsigned int) state->input_index;
+}
+
 // parses the 32-bytes txid of an input in a rawtx
 static int parse_rawtxinput_txid(parse_rawtxinput_state_t *state, buffer_t *buffers[2]) {
     uint8_t txid[32];
     bool result = dbuffer_read_bytes(buffers, txid, 32);
     if (result) {
         crypto_hash_update(&state->parent_state->hash_context->header, txid, 32);
+
+        if (is_queried_input(state->parent_state)) {
+            memcpy(state->parent_state->parser_outputs->vin_txin_entry, txid, 32);
+        }
     }
     return result;
 }
@@ -96,6 +116,10 @@ static int parse_rawtxinput_vout(parse_rawtxinput_state_t *state, buffer_t *buff
     bool result = dbuffer_read_bytes(buffers, vout_bytes, 4);
     if (result) {
         crypto_hash_update(&state->parent_state->hash_context->header, vout_bytes, 4);
+
+        if (is_queried_input(state->parent_state)) {
+            memcpy(state->parent_state->parser_outputs->vin_txin_entry + 32, vout_bytes, 4);
+        }
     }
     return result;
 }
@@ -122,28 +146,13 @@ static int parse_rawtxinput_scriptsig_init(parse_rawtxinput_state_t *state, buff
 }
 
 static int parse_rawtxinput_scriptsig(parse_rawtxinput_state_t *state, buffer_t *buffers[2]) {
-    uint8_t data[32];
-
-    while (true) {
-        int remaining_len = state->scriptsig_size - state->scriptsig_counter;
-
-        // We read in chunks of at most 32 bytes, so that we can always interrupt with less than 32
-        // unparsed bytes
-        int data_len = MIN(32, remaining_len);
-
-        bool read_result = dbuffer_read_bytes(buffers, data, data_len);
-        if (!read_result) {
-            return 0;  // could not read enough data
-        }
-
-        crypto_hash_update(&state->parent_state->hash_context->header, data, data_len);
-
-        state->scriptsig_counter += data_len;
+    // the scriptSig is only hashed, therefore all the available bytes are consumed at once
+    state->scriptsig_counter += dbuffer_skip_bytes(buffers,
+                                                   state->scriptsig_size - state->scriptsig_counter,
+                                                   hash_update_callback,
+                                                   state->parent_state->hash_context);
 
-        if (state->scriptsig_counter == state->scriptsig_size) {
-            return 1;  // done
-        }
-    }
+    return state->scriptsig_counter == state->scriptsig_size;  // 0 if more data is needed
 }
 
 static int parse_rawtxinput_sequence(parse_rawtxinput_state_t *state, buffer_t *buffers[2]) {
@@ -152,6 +161,10 @@ static int parse_rawtxinput_sequence(parse_rawtxinput_state_t *state, buffer_t *
     bool result = dbuffer_read_bytes(buffers, sequence_bytes, 4);
     if (result) {
         crypto_hash_update(&state->parent_state->hash_context->header, sequence_bytes, 4);
+
+        if (is_queried_input(state->parent_state)) {
+            memcpy(state->parent_state->parser_outputs->vin_txin_entry + 36, sequence_bytes, 4);
+        }
     }
     return result;
 }
@@ -237,17 +250,15 @@ static int parse_rawtxoutput_scriptpubkey(parse_rawtxoutput_state_t *state, buff
         if (state->parent_state->output_index != -1) {
             unsigned int relevant_output_index = (unsigned int) state->parent_state->output_index;
             if (state->parent_state->out_counter == relevant_output_index) {
-                unsigned int scriptpubkey_len =
-                    state->parent_state->parser_outputs->vout_scriptpubkey_len;
-                if (scriptpubkey_len > MAX_PREVOUT_SCRIPTPUBKEY_LEN) {
-                    return -1;  // not expecting any scriptPubkey larger than
-                                // MAX_PREVOUT_SCRIPTPUBKEY_LEN
+                // only the beginning of a longer scriptPubKey is kept
+                const unsigned int max_len =
+                    sizeof(state->parent_state->parser_outputs->vout_scriptpubkey);
+                if (state->scriptpubkey_counter < max_len) {
+                    memcpy(state->parent_state->parser_outputs->vout_scriptpubkey +
+                               state->scriptpubkey_counter,
+                           data,
+                           MIN((unsigned int) data_len, max_len - state->scriptpubkey_counter));
                 }
-
-                memcpy(state->parent_state->parser_outputs->vout_scriptpubkey +
-                           state->scriptpubkey_counter,
-                       data,
-                       data_len);
             }
         }
 
@@ -277,6 +288,8 @@ static int parse_rawtx_version(parse_rawtx_state_t *state, buffer_t *buffers[2])
     bool result = dbuffer_read_bytes(buffers, version_bytes, 4);
     if (result) {
         crypto_hash_update(&state->hash_context->header, version_bytes, 4);
+
+        state->parser_outputs->version = read_u32_le(version_bytes, 0);
     }
     return result;
 }
@@ -298,6 +311,9 @@ static int parse_rawtx_check_segwit(parse_rawtx_state_t *state, buffer_t *buffer
     if (first_byte != 0) {
         state->is_segwit = false;
         return 1;  // legacy format, use the legacy parsing scheme
+    } else if (state->is_stripped) {
+        PRINTF("Unexpected segwit marker in a stripped transaction.\n");
+        return -1;
     } else {
         // Segwit format, the first byte is 0x00 and the next should be the 0x01 flag.
         if (!dbuffer_can_read(buffers, 2)) {
@@ -322,6 +338,7 @@ static int parse_rawtx_input_count(parse_rawtx_state_t *state, buffer_t *buffers
     bool result = dbuffer_read_varint(buffers, &n_inputs);
     if (result) {
         state->n_inputs = (unsigned int) n_inputs;
+        state->parser_outputs->n_inputs = state->n_inputs;
 
         crypto_hash_update_varint(&state->hash_context->header, n_inputs);
     }
@@ -341,6 +358,11 @@ static int parse_rawtx_inputs_init(parse_rawtx_state_t *state, buffer_t *buffers
 
 static int parse_rawtx_inputs(parse_rawtx_state_t *state, buffer_t *buffers[2]) {
     while (state->in_counter < state->n_inputs) {
+        if (state->is_hashing_tail) {
+            dbuffer_skip_bytes(buffers, SIZE_MAX, hash_update_callback, state->hash_context);
+            return 0;  // everything until the end of the stream is hashed
+        }
+
         while (true) {
             bool result = parser_run(parse_rawtxinput_steps,
                                      n_parse_rawtxinput_steps,
@@ -356,6 +378,13 @@ static int parse_rawtx_inputs(parse_rawtx_state_t *state, buffer_t *buffers[2])
 
         ++state->in_counter;
         parser_init_context(&state->input_parser_context, &state->input_parser_state);
+
+        // Similarly to the outputs, if only an input is queried, the rest of a transaction in the
+        // legacy serialization is only hashed
+        if (!state->is_segwit && state->input_index >= 0 && state->output_index == -1 &&
+            state->in_counter == (unsigned int) state->input_index + 1) {
+            state->is_hashing_tail = true;
+        }
     }
     return 1;
 }
@@ -365,6 +394,7 @@ static int parse_rawtx_output_count(parse_rawtx_state_t *state, buffer_t *buffer
     bool result = dbuffer_read_varint(buffers, &n_outputs);
     if (result) {
         state->n_outputs = (unsigned int) n_outputs;
+        state->parser_outputs->n_outputs = state->n_outputs;
 
         crypto_hash_update_varint(&state->hash_context->header, n_outputs);
     }
@@ -383,6 +413,11 @@ static int parse_rawtx_outputs_init(parse_rawtx_state_t *state, buffer_t *buffer
 
 static int parse_rawtx_outputs(parse_rawtx_state_t *state, buffer_t *buffers[2]) {
     while (state->out_counter < state->n_outputs) {
+        if (state->is_hashing_tail) {
+            dbuffer_skip_bytes(buffers, SIZE_MAX, hash_update_callback, state->hash_context);
+            return 0;  // everything until the end of the stream is hashed
+        }
+
         while (true) {
             bool result = parser_run(parse_rawtxoutput_steps,
                                      n_parse_rawtxoutput_steps,
@@ -398,6 +433,15 @@ static int parse_rawtx_outputs(parse_rawtx_state_t *state, buffer_t *buffers[2])
 
         ++state->out_counter;
         parser_init_context(&state->output_parser_context, &state->output_parser_state);
+
+        // In the legacy serialization, the bytes after the queried output (the other outputs and
+        // the locktime) are only needed for the txid, therefore they are hashed without parsing
+        // them. The txid still commits to them, and it is verified by the callers.
+        if (!state->is_segwit && state->output_index >= 0 &&
+            state->out_counter == (unsigned int) state->output_index + 1 &&
+            state->out_counter < state->n_outputs) {
+            state->is_hashing_tail = true;
+        }
     }
     return 1;
 }
@@ -447,18 +491,14 @@ static int parse_rawtx_witnesses(parse_rawtx_state_t *state, buffer_t *buffers[2
                 state->cur_wit_el_bytes_read = 0;
             }
 
-            while (state->cur_wit_el_bytes_read < state->cur_wit_elem_len) {
-                uint8_t data[32];
-                int remaining_len = state->cur_wit_elem_len - state->cur_wit_el_bytes_read;
-
-                // We read in chunks of at most 32 bytes, so that we can always interrupt with less
-                // than 32 unparsed bytes
-                int data_len = MIN(32, remaining_len);
-                if (!dbuffer_read_bytes(buffers, data, data_len)) {
-                    return 0;
-                }
-
-                state->cur_wit_el_bytes_read += data_len;
+            // the witnesses are not part of the txid, they are simply skipped
+            state->cur_wit_el_bytes_read +=
+                dbuffer_skip_bytes(buffers,
+                                   state->cur_wit_elem_len - state->cur_wit_el_bytes_read,
+                                   NULL,
+                                   NULL);
+            if (state->cur_wit_el_bytes_read < state->cur_wit_elem_len) {
+                return 0;  // incomplete, read more data
             }
 
             ++state->wit_stack_el_counter;
@@ -477,6 +517,8 @@ static int parse_rawtx_locktime(parse_rawtx_state_t *state, buffer_t *buffers[2]
     bool result = dbuffer_read_bytes(buffers, locktime_bytes, 4);
     if (result) {
         crypto_hash_update(&state->hash_context->header, locktime_bytes, 4);
+
+        state->parser_outputs->locktime = read_u32_le(locktime_bytes, 0);
     }
     return result;
 }
@@ -498,8 +540,8 @@ const int n_parse_rawtx_steps = sizeof(parse_rawtx_steps) / sizeof(parse_rawtx_s
 static void cb_process_data(buffer_t *data, void *cb_state) {
     psbt_parse_rawtx_state_t *state = (psbt_parse_rawtx_state_t *) cb_state;
 
-    if (state->parser_error) {
-        // there was already a parsing error, ignore any additional data received
+    if (state->parser_error || state->parser_completed) {
+        // there was already a parsing error, or the parsing is complete; ignore any additional data
         return;
     }
 
@@ -514,16 +556,17 @@ static void cb_process_data(buffer_t *data, void *cb_state) {
     } else if (result < 0) {
         PRINTF("Parser error\n");
         state->parser_error = true;  // abort any remaining parsing
+    } else {
+        state->parser_completed = true;
     }
 }
 
-int call_psbt_parse_rawtx(dispatcher_context_t *dispatcher_context,
-                          const merkleized_map_commitment_t *map,
-                          const uint8_t *key,
-                          int key_len,
-                          int output_index,
-                          txid_parser_outputs_t *outputs) {
-    LOG_PROCESSOR(dispatcher_context, __FILE__, __LINE__, __func__);
+static int parse_rawtx(dispatcher_context_t *dispatcher_context,
+                       const uint8_t value_hash[static 32],
+                       int input_index,
+                       int output_index,
+                       bool stripped,
+                       txid_parser_outputs_t *outputs) {
 
     cx_sha256_t hash_context;
     cx_sha256_init(&hash_context);
@@ -534,27 +577,107 @@ int call_psbt_parse_rawtx(dispatcher_context_t *dispatcher_context,
 
     flow_state.store_data_length = 0;
     flow_state.parser_error = false;
+    flow_state.parser_completed = false;
     parser_init_context(&flow_state.parser_context, &flow_state.parser_state);
 
+    flow_state.parser_state.input_index = input_index;
     flow_state.parser_state.output_index = output_index;
-
-    uint8_t value_hash[32];
-    int res = call_get_merkleized_map_value_hash(dispatcher_context, map, key, key_len, value_hash);
-    if (res < 0) {
-        return -1;
-    }
+    flow_state.parser_state.is_stripped = stripped;
+    flow_state.parser_state.is_hashing_tail = false;
 
     // init the state of the parser (global)
     flow_state.parser_state.hash_context = &hash_context;
 
     flow_state.parser_state.parser_outputs = outputs;
 
-    res = call_stream_preimage(dispatcher_context, value_hash, NULL, cb_process_data, &flow_state);
-    if (res < 0 || flow_state.parser_error) {
+    int res;
+    if (stripped) {
+        res = call_stream_stripped_rawtx(dispatcher_context,
+                                         value_hash,
+                                         cb_process_data,
+                                         &flow_state);
+    } else {
+        res = call_stream_preimage(dispatcher_context,
+                                   value_hash,
+                                   NULL,
+                                   cb_process_data,
+                                   &flow_state);
+    }
+    // if the tail of the transaction is hashed without parsing it, the end of the stream is also
+    // the end of the transaction
+    bool is_complete = flow_state.parser_completed || flow_state.parser_state.is_hashing_tail;
+    if (res < 0 || flow_state.parser_error || !is_complete) {
+        return -1;
+    }
+
+    // the queried input and output must exist
+    if ((input_index >= 0 && (unsigned int) input_index >= flow_state.parser_state.n_inputs) ||
+        (output_index >= 0 && (unsigned int) output_index >= flow_state.parser_state.n_outputs)) {
+        PRINTF("The queried input or output is not in the transaction\n");
         return -1;
     }
 
+    // the marker, the flag and the witnesses are never part of the txid, therefore it is the same
+    // for both serializations
     crypto_hash_digest(&hash_context.header, outputs->txid, 32);
-    cx_hash_sha256(outputs->txid, 32, outputs->txid, 32);
+    crypto_sha256(outputs->txid, 32, outputs->txid);
     return 0;
 }
+
+int call_parse_rawtx(dispatcher_context_t *dispatcher_context,
+                     const uint8_t value_hash[static 32],
+                     int output_index,
+                     bool stripped,
+                     txid_parser_outputs_t *outputs) {
+    LOG_PROCESSOR(dispatcher_context, __FILE__, __LINE__, __func__);
+
+    return parse_rawtx(dispatcher_context, value_hash, -1, output_index, stripped, outputs);
+}
+
+int call_parse_unsigned_tx(dispatcher_context_t *dispatcher_context,
+                           const uint8_t value_hash[static 32],
+                           int input_index,
+                           int output_index,
+                           txid_parser_outputs_t *outputs) {
+    LOG_PROCESSOR(dispatcher_context, __FILE__, __LINE__, __func__);
+
+    return parse_rawtx(dispatcher_context, value_hash, input_index, output_index, false, outputs);
+}
+
+static int parse_rawtx_in_map(dispatcher_context_t *dispatcher_context,
+                              const merkleized_map_commitment_t *map,
+                              const uint8_t *key,
+                              int key_len,
+                              int output_index,
+                              bool stripped,
+                              txid_parser_outputs_t *outputs) {
+    uint8_t value_hash[32];
+    int res = call_get_merkleized_map_value_hash(dispatcher_context, map, key, key_len, value_hash);
+    if (res < 0) {
+        return -1;
+    }
+
+    return call_parse_rawtx(dispatcher_context, value_hash, output_index, stripped, outputs);
+}
+
+int call_psbt_parse_rawtx(dispatcher_context_t *dispatcher_context,
+                          const merkleized_map_commitment_t *map,
+                          const uint8_t *key,
+                          int key_len,
+                          int output_index,
+                          txid_parser_outputs_t *outputs) {
+    LOG_PROCESSOR(dispatcher_context, __FILE__, __LINE__, __func__);
+
+    return parse_rawtx_in_map(dispatcher_context, map, key, key_len, output_index, false, outputs);
+}
+
+int call_psbt_parse_stripped_rawtx(dispatcher_context_t *dispatcher_context,
+                                   const merkleized_map_commitment_t *map,
+                                   const uint8_t *key,
+                                   int key_len,
+                                   int output_index,
+                                   txid_parser_outputs_t *outputs) {
+    LOG_PROCESSOR(dispatcher_context, __FILE__, __LINE__, __func__);
+
+    return parse_rawtx_in_map(dispatcher_context, map, key, key_len, output_index, true, outputs);
+}
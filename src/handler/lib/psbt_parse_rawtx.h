@@ -7,8 +7,18 @@
 typedef struct {
     uint64_t vout_value;                 // will contain the value of the requested output
     unsigned int vout_scriptpubkey_len;  // will contain the len of the scriptPubKey
-    uint8_t vout_scriptpubkey[MAX_PREVOUT_SCRIPTPUBKEY_LEN];  // will contain the scriptPubKey
-    uint8_t txid[32];                                         // will contain the computed txid
+    // will contain the scriptPubKey, or only its beginning if it is longer than the buffer
+    uint8_t vout_scriptpubkey[MAX_OUTPUT_SCRIPTPUBKEY_LEN];
+    uint8_t txid[32];  // will contain the computed txid
+
+    // will contain the outpoint and the nSequence of the requested input, as serialized in the
+    // transaction
+    uint8_t vin_txin_entry[32 + 4 + 4];
+
+    uint32_t version;        // will contain the version of the transaction
+    uint32_t locktime;       // will contain the locktime, if no input or output is requested
+    unsigned int n_inputs;   // will contain the number of inputs
+    unsigned int n_outputs;  // will contain the number of outputs
 } txid_parser_outputs_t;
 
 /**
@@ -22,3 +32,40 @@ int call_psbt_parse_rawtx(dispatcher_context_t *dispatcher_context,
                           int key_len,
                           int output_index,
                           txid_parser_outputs_t *outputs);
+
+/**
+ * Like call_psbt_parse_rawtx, but the transaction is requested to the host without the witnesses,
+ * with the GET_STRIPPED_RAWTX client command. As the received data cannot be verified against the
+ * commitment of the value, the caller MUST check that the computed txid matches the expected one.
+ */
+int call_psbt_parse_stripped_rawtx(dispatcher_context_t *dispatcher_context,
+                                   const merkleized_map_commitment_t *map,
+                                   const uint8_t *key,
+                                   int key_len,
+                                   int output_index,
+                                   txid_parser_outputs_t *outputs);
+
+/**
+ * Parses the serialized transaction that is the preimage of the Merkle leaf with hash value_hash
+ * (for example, a value of a merkleized map whose hash was obtained with
+ * call_get_merkleized_map_value_hash), like call_psbt_parse_rawtx. If stripped is true, the
+ * transaction is requested without the witnesses, and the same caveats of
+ * call_psbt_parse_stripped_rawtx apply.
+ */
+int call_parse_rawtx(dispatcher_context_t *dispatcher_context,
+                     const uint8_t value_hash[static 32],
+                     int output_index,
+                     bool stripped,
+                     txid_parser_outputs_t *outputs);
+
+/**
+ * Parses the unsigned transaction of a PSBTv0 (the value of PSBT_GLOBAL_UNSIGNED_TX) that is the
+ * preimage of the Merkle leaf with hash value_hash. If input_index is not -1, the outpoint and the
+ * nSequence of that input are returned; if output_index is not -1, the amount and the scriptPubKey
+ * of that output. The version and the number of inputs and outputs are always returned.
+ */
+int call_parse_unsigned_tx(dispatcher_context_t *dispatcher_context,
+                           const uint8_t value_hash[static 32],
+                           int input_index,
+                           int output_index,
+                           txid_parser_outputs_t *outputs);
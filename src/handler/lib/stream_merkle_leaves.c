@@ -0,0 +1,146 @@
+#include <string.h>
+
+#include "stream_merkle_leaves.h"
+
+#include "../../common/buffer.h"
+#include "../../common/varint.h"
+#include "../../boilerplate/sw.h"
+#include "../client_commands.h"
+
+int call_stream_merkle_leaves(dispatcher_context_t *dc,
+                              const uint8_t merkle_root[static 32],
+                              uint32_t tree_size,
+                              uint8_t *leaf_buf,
+                              size_t leaf_buf_len,
+                              int (*callback)(uint32_t, buffer_t *, void *),
+                              void *callback_state) {
+    // LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    PRINT_STACK_POINTER();
+
+    if (tree_size == 0 || tree_size > MAX_STREAM_MERKLE_LEAVES_TREE_SIZE || leaf_buf_len >= 0xFD) {
+        return -1;
+    }
+
+    // the request is written directly in the APDU buffer
+    buffer_t req = dc_get_request_buffer(dc);
+    if (!buffer_write_u8(&req, CCMD_STREAM_MERKLE_LEAVES) ||
+        !buffer_write_bytes(&req, merkle_root, 32) || !buffer_write_varint(&req, tree_size) ||
+        dc_exchange(dc, &req) < 0) {
+        return -1;
+    }
+
+    uint64_t bytes_remaining;
+    uint8_t partial_data_len;
+    if (!buffer_read_varint(&dc->read_buffer, &bytes_remaining) ||
+        !buffer_read_u8(&dc->read_buffer, &partial_data_len) ||
+        !buffer_can_read(&dc->read_buffer, partial_data_len) ||
+        partial_data_len > bytes_remaining) {
+        return -1;
+    }
+
+    // Roots of the complete subtrees of the leaves received so far, with strictly decreasing
+    // heights; the Merkle tree of the first i leaves has a complete subtree for each bit of i.
+    uint8_t subtree_hashes[MAX_STREAM_MERKLE_LEAVES_DEPTH + 1][32];
+    uint8_t subtree_heights[MAX_STREAM_MERKLE_LEAVES_DEPTH + 1];
+    int n_subtrees = 0;
+
+    uint32_t leaf_index = 0;
+    bool has_leaf_len = false;  // true if the length of the current leaf was already received
+    size_t leaf_len = 0;
+    size_t leaf_pos = 0;
+
+    size_t chunk_len = partial_data_len;
+    while (true) {
+        while (chunk_len > 0) {
+            if (!has_leaf_len) {
+                // only lengths encoded in a single byte are supported, as leaf_buf_len < 0xFD
+                uint8_t len_byte;
+                buffer_read_u8(&dc->read_buffer, &len_byte);
+                --chunk_len;
+                --bytes_remaining;
+
+                if (leaf_index >= tree_size || len_byte > leaf_buf_len) {
+                    PRINTF("Unexpected leaf\n");
+                    return -1;
+                }
+                leaf_len = len_byte;
+                leaf_pos = 0;
+                has_leaf_len = true;
+            } else {
+                size_t n_bytes = leaf_len - leaf_pos;
+                if (n_bytes > chunk_len) {
+                    n_bytes = chunk_len;
+                }
+                buffer_read_bytes(&dc->read_buffer, leaf_buf + leaf_pos, n_bytes);
+                leaf_pos += n_bytes;
+                chunk_len -= n_bytes;
+                bytes_remaining -= n_bytes;
+            }
+
+            if (has_leaf_len && leaf_pos == leaf_len) {
+                // add the leaf hash, and merge the complete subtrees of the same height
+                merkle_compute_element_hash(leaf_buf, leaf_len, subtree_hashes[n_subtrees]);
+                subtree_heights[n_subtrees] = 0;
+                ++n_subtrees;
+                while (n_subtrees >= 2 &&
+                       subtree_heights[n_subtrees - 2] == subtree_heights[n_subtrees - 1]) {
+                    merkle_combine_hashes(subtree_hashes[n_subtrees - 2],
+                                          subtree_hashes[n_subtrees - 1],
+                                          subtree_hashes[n_subtrees - 2]);
+                    ++subtree_heights[n_subtrees - 2];
+                    --n_subtrees;
+                }
+
+                buffer_t leaf = buffer_create(leaf_buf, leaf_len);
+                if (callback(leaf_index, &leaf, callback_state) < 0) {
+                    return -1;
+                }
+
+                ++leaf_index;
+                has_leaf_len = false;
+            }
+        }
+
+        if (bytes_remaining == 0) {
+            break;
+        }
+
+        buffer_t req_more = dc_get_request_buffer(dc);
+        if (!buffer_write_u8(&req_more, CCMD_GET_MORE_ELEMENTS) || dc_exchange(dc, &req_more) < 0) {
+            return -1;
+        }
+
+        // the elements are consecutive chunks of the stream, of any length
+        uint8_t n_elements, elements_len;
+        if (!buffer_read_u8(&dc->read_buffer, &n_elements) ||
+            !buffer_read_u8(&dc->read_buffer, &elements_len) ||
+            !buffer_can_read(&dc->read_buffer, (size_t) n_elements * elements_len)) {
+            return -1;
+        }
+
+        chunk_len = (size_t) n_elements * elements_len;
+        if (chunk_len == 0 || chunk_len > bytes_remaining) {
+            PRINTF("Unexpected length of the stream\n");
+            return -1;
+        }
+    }
+
+    if (leaf_index != tree_size || has_leaf_len) {
+        PRINTF("Unexpected number of leaves\n");
+        return -1;
+    }
+
+    // the root of a tree whose size is not a power of 2 combines the remaining subtrees, and the
+    // right subtree of each node is the smaller one
+    for (int i = n_subtrees - 1; i > 0; i--) {
+        merkle_combine_hashes(subtree_hashes[i - 1], subtree_hashes[i], subtree_hashes[i - 1]);
+    }
+
+    if (memcmp(merkle_root, subtree_hashes[0], 32) != 0) {
+        PRINTF("Merkle root mismatch");
+        return -1;
+    }
+
+    return 0;
+}
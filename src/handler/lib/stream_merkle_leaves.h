@@ -0,0 +1,43 @@
+#pragma once
+
+#include "../../boilerplate/dispatcher.h"
+#include "../../common/merkle.h"
+#include "../../perf_config.h"
+
+/**
+ * Maximum number of leaves of a Merkle tree supported by call_stream_merkle_leaves.
+ */
+#define MAX_STREAM_MERKLE_LEAVES_TREE_SIZE (1 << MAX_STREAM_MERKLE_LEAVES_DEPTH)
+
+/**
+ * Requests all the leaves of a Merkle tree in a single stream, using the STREAM_MERKLE_LEAVES
+ * client command; the Merkle root is recomputed from the received leaves, instead of verifying a
+ * separate proof for each of them. Each leaf (without the 0x00 prefix) is passed to the callback as
+ * soon as it is received, together with its index; as the root is only verified at the end, the
+ * caller must discard anything computed by the callback if this function fails.
+ * The client must declare the CLIENT_CAPABILITY_STREAM_MERKLE_LEAVES capability.
+ *
+ * @param[in] dispatcher_context
+ *   Pointer to the dispatcher context.
+ * @param[in] merkle_root
+ *   The root of the Merkle tree.
+ * @param[in] tree_size
+ *   The number of leaves of the Merkle tree, between 1 and MAX_STREAM_MERKLE_LEAVES_TREE_SIZE.
+ * @param[out] leaf_buf
+ *   Pointer to a buffer where each leaf is stored before calling the callback.
+ * @param[in] leaf_buf_len
+ *   Length of leaf_buf, and maximum length of each leaf; it must be less than 0xFD.
+ * @param[in] callback
+ *   Called for each leaf; if it returns a negative number, the streaming is interrupted.
+ * @param[in] callback_state
+ *   Pointer passed to the callback.
+ *
+ * @return 0 on success, or a negative number on failure.
+ */
+int call_stream_merkle_leaves(dispatcher_context_t *dispatcher_context,
+                              const uint8_t merkle_root[static 32],
+                              uint32_t tree_size,
+                              uint8_t *leaf_buf,
+                              size_t leaf_buf_len,
+                              int (*callback)(uint32_t, buffer_t *, void *),
+                              void *callback_state);
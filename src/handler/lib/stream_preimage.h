@@ -5,7 +5,7 @@
 /**
  * Given the hash of a leaf of a Merkle tree, requests the corresponding pre-image to the host. The
  * data provided from the host is passed on to the given callback. The preimage send to the
- * callbacks does not include the 0x00 prefix. If len_callback is not NONE, it is called before the
+ * callbacks does not include the 0x00 prefix. If len_callback is not NULL, it is called before the
  * other callback with the length of the preimage (not including the 0x00 prefix).
  *
  * Returns a negative number on error, or the preimage length on success. This function validates
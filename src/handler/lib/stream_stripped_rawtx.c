@@ -0,0 +1,79 @@
+#include "../../boilerplate/sw.h"
+#include "stream_stripped_rawtx.h"
+
+#include "../client_commands.h"
+
+int call_stream_stripped_rawtx(dispatcher_context_t *dispatcher_context,
+                               const uint8_t hash[static 32],
+                               void (*callback)(buffer_t *, void *),
+                               void *callback_state) {
+    LOG_PROCESSOR(dispatcher_context, __FILE__, __LINE__, __func__);
+
+    buffer_t req = dc_get_request_buffer(dispatcher_context);
+    if (!buffer_write_u8(&req, CCMD_GET_STRIPPED_RAWTX) || !buffer_write_bytes(&req, hash, 32) ||
+        dc_exchange(dispatcher_context, &req) < 0) {
+        return -1;
+    }
+
+    uint64_t tx_len_u64;
+    uint8_t partial_data_len;
+
+    if (!buffer_read_varint(&dispatcher_context->read_buffer, &tx_len_u64) ||
+        !buffer_read_u8(&dispatcher_context->read_buffer, &partial_data_len) ||
+        !buffer_can_read(&dispatcher_context->read_buffer, partial_data_len)) {
+        return -2;
+    }
+
+    if (tx_len_u64 == 0 || tx_len_u64 > UINT32_MAX / 2 || partial_data_len > tx_len_u64) {
+        return -3;
+    }
+    uint32_t tx_len = (uint32_t) tx_len_u64;
+
+    // call callback with data
+    buffer_t initial_buf =
+        buffer_create(dispatcher_context->read_buffer.ptr + dispatcher_context->read_buffer.offset,
+                      partial_data_len);
+    callback(&initial_buf, callback_state);
+
+    size_t bytes_remaining = (size_t) tx_len - partial_data_len;
+
+    while (bytes_remaining > 0) {
+        buffer_t more_req = dc_get_request_buffer(dispatcher_context);
+        if (!buffer_write_u8(&more_req, CCMD_GET_MORE_ELEMENTS) ||
+            dc_exchange(dispatcher_context, &more_req) < 0) {
+            return -4;
+        }
+
+        // Parse response to CCMD_GET_MORE_ELEMENTS
+        uint8_t n_elements, elements_len;
+        if (!buffer_read_u8(&dispatcher_context->read_buffer, &n_elements) ||
+            !buffer_read_u8(&dispatcher_context->read_buffer, &elements_len) ||
+            !buffer_can_read(&dispatcher_context->read_buffer,
+                             (size_t) n_elements * elements_len)) {
+            return -5;
+        }
+
+        // the elements are consecutive chunks of the transaction, of any length
+        size_t n_bytes = (size_t) n_elements * elements_len;
+
+        if (n_bytes == 0) {
+            PRINTF("Received no bytes.\n");
+            return -6;
+        }
+
+        if (n_bytes > bytes_remaining) {
+            PRINTF("Received more bytes than expected.\n");
+            return -7;
+        }
+
+        // call callback with data
+        buffer_t buf = buffer_create(
+            dispatcher_context->read_buffer.ptr + dispatcher_context->read_buffer.offset,
+            n_bytes);
+        callback(&buf, callback_state);
+
+        bytes_remaining -= n_bytes;
+    }
+
+    return (int) tx_len;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "../../boilerplate/dispatcher.h"
+
+/**
+ * Given the hash of a leaf of a Merkle tree whose preimage is a serialized transaction (like the
+ * value of PSBT_IN_NON_WITNESS_UTXO), requests to the host the serialization of the same
+ * transaction without the witnesses, using the GET_STRIPPED_RAWTX client command; the data is
+ * passed on to the given callback. The client must declare the CLIENT_CAPABILITY_STRIPPED_RAWTX capability.
+ *
+ * The data is NOT verified against the hash, as the witnesses are not received; the caller must
+ * verify the transaction id computed from it instead.
+ *
+ * Returns a negative number on error, or the length of the stripped transaction on success.
+ */
+int call_stream_stripped_rawtx(dispatcher_context_t *dispatcher_context,
+                               const uint8_t hash[static 32],
+                               void (*callback)(buffer_t *, void *),
+                               void *callback_state);
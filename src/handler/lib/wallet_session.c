@@ -0,0 +1,190 @@
+#include <string.h>
+
+#include "wallet_session.h"
+
+/**
+ * A change-level child of a key with wildcard, with its pubkey compressed in order to save memory.
+ */
+typedef struct {
+    uint8_t chain_code[32];
+    uint8_t compressed_pubkey[33];
+} wallet_session_change_node_t;
+
+/**
+ * The decoded pubkey of a key of a wallet session: for the keys with wildcard, if the children of
+ * both change steps were precomputed, only those are kept, as the extended pubkey is not needed.
+ */
+typedef struct {
+    bool has_wildcard;
+    bool has_change_nodes;
+    uint32_t multipath[2];
+    union {
+        // if !has_change_nodes
+        serialized_extended_pubkey_t ext_pubkey;
+        // if has_change_nodes, the children for the receive and the change addresses
+        wallet_session_change_node_t change_nodes[POLICY_PUBKEYS_CACHE_CHANGE_STEPS];
+    };
+} wallet_session_key_t;
+
+/**
+ * A registered wallet policy that was already verified, kept across commands together with its
+ * decoded pubkeys.
+ */
+typedef struct {
+    bool is_open;
+    uint32_t last_used;  // the value of wallet_sessions_counter when it was last opened or used
+    uint8_t wallet_id[32];
+    uint8_t wallet_hmac[32];
+    uint16_t serialized_wallet_policy_len;
+    uint8_t serialized_wallet_policy[MAX_POLICY_MAP_SERIALIZED_LENGTH];
+
+    bool has_ext_pubkeys;
+    uint8_t n_keys;
+    wallet_session_key_t keys[WALLET_SESSION_MAX_KEYS];
+} wallet_session_t;
+
+// kept outside of G_command_state, that is cleared for each command; cleared by
+// wallet_session_close
+static wallet_session_t wallet_sessions[WALLET_SESSION_MAX_WALLETS];
+static uint32_t wallet_sessions_counter;
+
+// Returns the slot for a new session of the given wallet id: the one of the same wallet if already
+// open, otherwise a free slot or, if there is none, the least recently used one.
+static wallet_session_t *get_free_session(const uint8_t wallet_id[static 32]) {
+    wallet_session_t *result = &wallet_sessions[0];
+    for (size_t i = 0; i < WALLET_SESSION_MAX_WALLETS; i++) {
+        wallet_session_t *session = &wallet_sessions[i];
+        if (session->is_open && memcmp(session->wallet_id, wallet_id, 32) == 0) {
+            return session;
+        }
+        if (result->is_open && (!session->is_open || session->last_used < result->last_used)) {
+            result = session;
+        }
+    }
+    return result;
+}
+
+void wallet_session_open(const uint8_t wallet_id[static 32],
+                         const uint8_t wallet_hmac[static 32],
+                         const uint8_t *serialized_wallet_policy,
+                         size_t serialized_wallet_policy_len,
+                         const policy_pubkeys_cache_t *pubkeys_cache,
+                         size_t n_keys) {
+    wallet_session_t *session = get_free_session(wallet_id);
+    if (session->is_open && memcmp(session->wallet_id, wallet_id, 32) != 0) {
+        PERF_COUNT_CACHE(CACHE_WALLET_SESSION, evictions, sizeof(wallet_sessions));
+    }
+    explicit_bzero(session, sizeof(*session));
+
+    if (serialized_wallet_policy_len > sizeof(session->serialized_wallet_policy)) {
+        return;
+    }
+
+    memcpy(session->wallet_id, wallet_id, 32);
+    memcpy(session->wallet_hmac, wallet_hmac, 32);
+    memcpy(session->serialized_wallet_policy,
+           serialized_wallet_policy,
+           serialized_wallet_policy_len);
+    session->serialized_wallet_policy_len = (uint16_t) serialized_wallet_policy_len;
+
+    if (pubkeys_cache->has_ext_pubkeys && n_keys <= WALLET_SESSION_MAX_KEYS) {
+        for (size_t i = 0; i < n_keys; i++) {
+            wallet_session_key_t *key = &session->keys[i];
+            key->has_wildcard = pubkeys_cache->has_wildcard[i];
+            memcpy(key->multipath, pubkeys_cache->multipath[i], sizeof(key->multipath));
+
+            const policy_pubkey_cache_entry_t *entries = pubkeys_cache->keys[i];
+            key->has_change_nodes = key->has_wildcard && POLICY_PUBKEYS_CACHE_CHANGE_STEPS == 2 &&
+                                    entries[0].is_valid && entries[0].change == 0 &&
+                                    entries[POLICY_PUBKEYS_CACHE_CHANGE_STEPS - 1].is_valid &&
+                                    entries[POLICY_PUBKEYS_CACHE_CHANGE_STEPS - 1].change == 1;
+            if (key->has_change_nodes) {
+                for (int change = 0; change < POLICY_PUBKEYS_CACHE_CHANGE_STEPS; change++) {
+                    memcpy(key->change_nodes[change].chain_code, entries[change].chain_code, 32);
+                    crypto_get_compressed_pubkey(entries[change].pubkey,
+                                                 key->change_nodes[change].compressed_pubkey);
+                }
+            } else {
+                memcpy(&key->ext_pubkey,
+                       &pubkeys_cache->ext_pubkeys[i],
+                       sizeof(serialized_extended_pubkey_t));
+            }
+        }
+        session->n_keys = (uint8_t) n_keys;
+        session->has_ext_pubkeys = true;
+    }
+
+    session->last_used = ++wallet_sessions_counter;
+    session->is_open = true;
+}
+
+void wallet_session_close() {
+    explicit_bzero(wallet_sessions, sizeof(wallet_sessions));
+    wallet_sessions_counter = 0;
+}
+
+// returns the wallet session open for the given wallet id and hmac, or NULL if there is none
+static wallet_session_t *get_wallet_session(const uint8_t wallet_id[static 32],
+                                            const uint8_t wallet_hmac[static 32]) {
+    for (size_t i = 0; i < WALLET_SESSION_MAX_WALLETS; i++) {
+        wallet_session_t *session = &wallet_sessions[i];
+        if (session->is_open && memcmp(session->wallet_id, wallet_id, 32) == 0 &&
+            os_secure_memcmp((void *) wallet_hmac, session->wallet_hmac, 32) == 0) {
+            session->last_used = ++wallet_sessions_counter;
+            PERF_COUNT_CACHE(CACHE_WALLET_SESSION, hits, sizeof(wallet_sessions));
+            return session;
+        }
+    }
+    PERF_COUNT_CACHE(CACHE_WALLET_SESSION, misses, sizeof(wallet_sessions));
+    return NULL;
+}
+
+int wallet_session_get_policy(const uint8_t wallet_id[static 32],
+                              const uint8_t wallet_hmac[static 32],
+                              uint8_t *out,
+                              size_t out_len) {
+    const wallet_session_t *session = get_wallet_session(wallet_id, wallet_hmac);
+    if (session == NULL || session->serialized_wallet_policy_len > out_len) {
+        return -1;
+    }
+
+    memcpy(out, session->serialized_wallet_policy, session->serialized_wallet_policy_len);
+    return session->serialized_wallet_policy_len;
+}
+
+bool wallet_session_load_pubkeys(const uint8_t wallet_id[static 32],
+                                 const uint8_t wallet_hmac[static 32],
+                                 policy_pubkeys_cache_t *pubkeys_cache) {
+    const wallet_session_t *session = get_wallet_session(wallet_id, wallet_hmac);
+    if (session == NULL || !session->has_ext_pubkeys) {
+        return false;
+    }
+
+    for (size_t i = 0; i < session->n_keys; i++) {
+        const wallet_session_key_t *key = &session->keys[i];
+        pubkeys_cache->has_wildcard[i] = key->has_wildcard;
+        memcpy(pubkeys_cache->multipath[i], key->multipath, sizeof(key->multipath));
+
+        if (!key->has_change_nodes) {
+            memcpy(&pubkeys_cache->ext_pubkeys[i],
+                   &key->ext_pubkey,
+                   sizeof(serialized_extended_pubkey_t));
+            continue;
+        }
+
+        for (int change = 0; change < POLICY_PUBKEYS_CACHE_CHANGE_STEPS; change++) {
+            policy_pubkey_cache_entry_t *entry = &pubkeys_cache->keys[i][change];
+            if (crypto_get_uncompressed_pubkey(key->change_nodes[change].compressed_pubkey,
+                                               entry->pubkey) < 0) {
+                explicit_bzero(pubkeys_cache, sizeof(*pubkeys_cache));
+                return false;
+            }
+            memcpy(entry->chain_code, key->change_nodes[change].chain_code, 32);
+            entry->is_valid = true;
+            entry->has_wildcard = true;
+            entry->change = change;
+        }
+    }
+    pubkeys_cache->has_ext_pubkeys = true;
+    return true;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "../../common/wallet.h"
+#include "../../perf_config.h"
+#include "policy.h"
+
+/**
+ * Opens the wallet session for a registered wallet policy, replacing the one of the same wallet id,
+ * if any, or the least recently used one if WALLET_SESSION_MAX_WALLETS sessions are open. The
+ * caller must have already verified the wallet policy and its hmac.
+ *
+ * @param[in] wallet_id
+ *   The id of the wallet, that is, the sha256 of serialized_wallet_policy.
+ * @param[in] wallet_hmac
+ *   The hmac of the wallet, already verified.
+ * @param[in] serialized_wallet_policy
+ *   The serialized wallet policy.
+ * @param[in] serialized_wallet_policy_len
+ *   The length of serialized_wallet_policy; at most MAX_POLICY_MAP_SERIALIZED_LENGTH.
+ * @param[in] pubkeys_cache
+ *   The cache with the decoded pubkeys of the wallet policy, as loaded by call_load_policy_pubkeys;
+ *   the pubkeys are only kept if they are loaded and there are at most WALLET_SESSION_MAX_KEYS.
+ *   For the keys with wildcard whose children at both change steps were derived by
+ *   policy_pubkeys_cache_derive_change_steps, only the children are kept.
+ * @param[in] n_keys
+ *   The number of keys of the wallet policy.
+ */
+void wallet_session_open(const uint8_t wallet_id[static 32],
+                         const uint8_t wallet_hmac[static 32],
+                         const uint8_t *serialized_wallet_policy,
+                         size_t serialized_wallet_policy_len,
+                         const policy_pubkeys_cache_t *pubkeys_cache,
+                         size_t n_keys);
+
+/**
+ * Closes all the wallet sessions, if any. It is called when the device is locked.
+ */
+void wallet_session_close();
+
+/**
+ * If the wallet session is open for the given wallet id and hmac, copies its serialized wallet
+ * policy to out, so that it does not need to be requested to the client.
+ *
+ * @return the length of the serialized wallet policy, or -1 if there is no such session (or out is
+ * too short).
+ */
+int wallet_session_get_policy(const uint8_t wallet_id[static 32],
+                              const uint8_t wallet_hmac[static 32],
+                              uint8_t *out,
+                              size_t out_len);
+
+/**
+ * If the wallet session is open for the given wallet id and hmac, and it keeps the decoded pubkeys
+ * of the wallet policy, stores them in the cache, like call_load_policy_pubkeys; the precomputed
+ * children of the keys at the change level are stored, too.
+ *
+ * @param[out] pubkeys_cache
+ *   Pointer to the cache; it must be zeroed before calling this function.
+ *
+ * @return true if the pubkeys were loaded, false otherwise.
+ */
+bool wallet_session_load_pubkeys(const uint8_t wallet_id[static 32],
+                                 const uint8_t wallet_hmac[static 32],
+                                 policy_pubkeys_cache_t *pubkeys_cache);
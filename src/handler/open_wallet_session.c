@@ -0,0 +1,113 @@
+/*****************************************************************************
+ *   Ledger App Bitcoin.
+ *   (c) 2021 Ledger SAS.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *****************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "boilerplate/dispatcher.h"
+#include "boilerplate/sw.h"
+#include "../commands.h"
+#include "lib/get_preimage.h"
+#include "lib/policy.h"
+#include "lib/wallet_session.h"
+
+#include "open_wallet_session.h"
+
+/**
+ * Verifies a registered wallet policy and fetches its keys, and keeps them in the wallet session;
+ * the following commands for the same wallet id and hmac do not need to request them again.
+ */
+void handler_open_wallet_session(dispatcher_context_t *dc) {
+    open_wallet_session_state_t *state = (open_wallet_session_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    // Device must be unlocked
+    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
+        return;
+    }
+
+    if (!buffer_read_bytes(&dc->read_buffer, state->wallet_id, 32) ||
+        !buffer_read_bytes(&dc->read_buffer, state->wallet_hmac, 32)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    // only registered wallet policies; default wallets do not need any verification
+    if (!check_wallet_hmac(state->wallet_id, state->wallet_hmac)) {
+        PRINTF("Incorrect hmac\n");
+        SEND_SW(dc, SW_SIGNATURE_FAIL);
+        return;
+    }
+
+    int serialized_wallet_policy_len = call_get_preimage(dc,
+                                                         state->wallet_id,
+                                                         state->serialized_wallet_policy,
+                                                         sizeof(state->serialized_wallet_policy));
+    if (serialized_wallet_policy_len < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    buffer_t serialized_wallet_policy_buf =
+        buffer_create(state->serialized_wallet_policy, serialized_wallet_policy_len);
+    if (read_policy_map_wallet(&serialized_wallet_policy_buf, &state->wallet_header) < 0 ||
+        parse_wallet_policy_map(&state->wallet_header,
+                                state->policy_map_bytes,
+                                sizeof(state->policy_map_bytes)) < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    memset(&state->pubkeys_cache, 0, sizeof(state->pubkeys_cache));
+    if (call_load_policy_pubkeys(dc,
+                                 state->wallet_header.keys_info_merkle_root,
+                                 state->wallet_header.n_keys,
+                                 &state->pubkeys_cache) < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    // the children of the keys for the receive and the change addresses are derived once, and kept
+    // in the session, so that each address later only needs one derivation per key
+    if (policy_pubkeys_cache_derive_change_steps(&state->pubkeys_cache,
+                                                 state->wallet_header.n_keys) < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    wallet_session_open(state->wallet_id,
+                        state->wallet_hmac,
+                        state->serialized_wallet_policy,
+                        serialized_wallet_policy_len,
+                        &state->pubkeys_cache,
+                        state->wallet_header.n_keys);
+
+    SEND_SW(dc, SW_OK);
+}
+
+/**
+ * Closes all the wallet sessions.
+ */
+void handler_close_wallet_session(dispatcher_context_t *dc) {
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    wallet_session_close();
+
+    SEND_SW(dc, SW_OK);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "../boilerplate/dispatcher.h"
+#include "../common/wallet.h"
+#include "lib/policy.h"
+
+typedef struct {
+    machine_context_t ctx;
+
+    uint8_t wallet_id[32];
+    uint8_t wallet_hmac[32];
+    uint8_t serialized_wallet_policy[MAX_POLICY_MAP_SERIALIZED_LENGTH];
+    policy_map_wallet_header_t wallet_header;
+    union {
+        uint8_t policy_map_bytes[MAX_POLICY_MAP_BYTES];
+        policy_node_t policy_map;
+    };
+    policy_pubkeys_cache_t pubkeys_cache;
+} open_wallet_session_state_t;
+
+void handler_open_wallet_session(dispatcher_context_t *dispatcher_context);
+void handler_close_wallet_session(dispatcher_context_t *dispatcher_context);
@@ -23,6 +23,7 @@
 
 #include "../boilerplate/dispatcher.h"
 #include "../boilerplate/sw.h"
+#include "../common/format.h"
 #include "../common/merkle.h"
 #include "../common/read.h"
 #include "../common/wallet.h"
@@ -34,14 +35,20 @@
 #include "../ui/display.h"
 #include "../ui/menu.h"
 
+#include "lib/get_merkle_leaf_hash.h"
+#include "lib/get_merkle_preimage.h"
+#include "lib/get_preimage.h"
 #include "lib/policy.h"
 
 #include "client_commands.h"
 
 #include "register_wallet.h"
 
+static void display_next_wallet(dispatcher_context_t *dc);
+static void next_wallet(dispatcher_context_t *dc);
 static void process_cosigner_info(dispatcher_context_t *dc);
-static void next_cosigner(dispatcher_context_t *dc);
+static void check_cosigner_info(dispatcher_context_t *dc);
+static void display_cosigner_info(dispatcher_context_t *dc);
 static void finalize_response(dispatcher_context_t *dc);
 
 extern global_context_t *G_coin_config;
@@ -49,6 +56,94 @@ extern global_context_t *G_coin_config;
 static bool is_policy_acceptable(policy_node_t *policy);
 static bool is_policy_name_acceptable(const char *name, size_t name_len);
 
+/**
+ * Reads the wallet policy from the buffer in state->wallet_header, parses its policy map and
+ * computes the wallet id; then, validates the wallet policy. The policy map to be shown to the user
+ * is written in policy_map_str.
+ *
+ * @return SW_OK on success, otherwise the status word of the error.
+ */
+static uint16_t parse_wallet_policy(register_wallet_state_t *state,
+                                    buffer_t *buffer,
+                                    char policy_map_str[static MAX_POLICY_MAP_STR_LENGTH + 1]) {
+    if ((read_policy_map_wallet(buffer, &state->wallet_header)) < 0) {
+        PRINTF("Failed reading policy map\n");
+        return SW_INCORRECT_DATA;
+    }
+
+    if (parse_wallet_policy_map(&state->wallet_header,
+                                state->policy_map_bytes,
+                                sizeof(state->policy_map_bytes)) < 0) {
+        PRINTF("Failed parsing policy map\n");
+        return SW_INCORRECT_DATA;
+    }
+
+    // the policy is always shown in the textual encoding; a binary policy whose textual encoding
+    // is too long to be shown is rejected
+    if (state->wallet_header.type != WALLET_TYPE_POLICY_MAP) {
+        if (format_policy_map(&state->policy_map,
+                              policy_map_str,
+                              MAX_POLICY_MAP_STR_LENGTH + 1) < 0) {
+            PRINTF("Policy map too long to be shown\n");
+            return SW_NOT_SUPPORTED;
+        }
+    } else {
+        memcpy(policy_map_str,
+               state->wallet_header.policy_map,
+               state->wallet_header.policy_map_len);
+        policy_map_str[state->wallet_header.policy_map_len] = '\0';
+    }
+
+    // Compute the wallet id (sha256 of the serialization)
+    get_policy_wallet_id(&state->wallet_header, state->wallet_id);
+
+    // Verify that the name is acceptable
+    if (!is_policy_name_acceptable(state->wallet_header.name, state->wallet_header.name_len)) {
+        return SW_INCORRECT_DATA;
+    }
+
+    // check if policy is acceptable; only multisig is accepted at this time,
+    // and it must be one of the accepted patterns.
+    if (!is_policy_acceptable(&state->policy_map)) {
+        return SW_NOT_SUPPORTED;
+    }
+
+    return SW_OK;
+}
+
+/**
+ * Prepares the validation of the key informations in state->wallet_header, that are shown to the
+ * user one at a time by process_cosigner_info.
+ *
+ * @return 0 on success, a negative number on failure.
+ */
+static int start_cosigners(dispatcher_context_t *dc, register_wallet_state_t *state) {
+    state->master_key_fingerprint = crypto_get_master_key_fingerprint();
+
+    state->n_internal_keys = 0;
+    state->next_pubkey_index = 0;
+    state->has_key_info_hashes = false;
+
+    uint16_t n_keys = state->wallet_header.n_keys;
+    if (n_keys >= 1 && n_keys <= MAX_POLICY_MAP_KEYS && n_keys <= MAX_MERKLE_MULTIPROOF_LEAVES) {
+        // a single multiproof for all the key informations, instead of a Merkle proof for each
+        uint32_t leaf_indices[MAX_POLICY_MAP_KEYS];
+        for (uint16_t i = 0; i < n_keys; i++) {
+            leaf_indices[i] = i;
+        }
+        if (call_get_merkle_leaf_hashes(dc,
+                                        state->wallet_header.keys_info_merkle_root,
+                                        n_keys,
+                                        n_keys,
+                                        leaf_indices,
+                                        state->key_info_hashes) < 0) {
+            return -1;
+        }
+        state->has_key_info_hashes = true;
+    }
+    return 0;
+}
+
 /**
  * Validates the input, initializes the hash context and starts accumulating the wallet header in
  * it.
@@ -75,60 +170,127 @@ void handler_register_wallet(dispatcher_context_t *dc) {
         return;
     }
 
-    if ((read_policy_map_wallet(&dc->read_buffer, &state->wallet_header)) < 0) {
-        PRINTF("Failed reading policy map\n");
-        SEND_SW(dc, SW_INCORRECT_DATA);
+    char policy_map_str[MAX_POLICY_MAP_STR_LENGTH + 1];
+    uint16_t sw = parse_wallet_policy(state, &dc->read_buffer, policy_map_str);
+    if (sw != SW_OK) {
+        SEND_SW(dc, sw);
         return;
     }
 
-    buffer_t policy_map_buffer =
-        buffer_create(&state->wallet_header.policy_map, state->wallet_header.policy_map_len);
-    if (parse_policy_map(&policy_map_buffer,
-                         state->policy_map_bytes,
-                         sizeof(state->policy_map_bytes)) < 0) {
-        PRINTF("Failed parsing policy map\n");
+    state->is_batch = false;
+
+    if (start_cosigners(dc, state) < 0) {
         SEND_SW(dc, SW_INCORRECT_DATA);
         return;
     }
 
-    // Compute the wallet id (sha256 of the serialization)
-    get_policy_wallet_id(&state->wallet_header, state->wallet_id);
+    ui_display_wallet_header(dc, &state->wallet_header, policy_map_str, process_cosigner_info);
+}
 
-    // Verify that the name is acceptable
-    if (!is_policy_name_acceptable(state->wallet_header.name, state->wallet_header.name_len)) {
-        SEND_SW(dc, SW_INCORRECT_DATA);
-        return;
+/**
+ * Receives the next pubkey info, with a coroutine that does not keep the stack while waiting for
+ * the client.
+ */
+static void process_cosigner_info(dispatcher_context_t *dc) {
+    register_wallet_state_t *state = (register_wallet_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    if (state->has_key_info_hashes) {
+        co_get_merkle_preimage_init(&state->get_key_info.get_preimage,
+                                    state->key_info_hashes[state->next_pubkey_index],
+                                    state->next_pubkey_info,
+                                    MAX_POLICY_KEY_INFO_LEN);
+        co_start(dc,
+                 &state->get_key_info.get_preimage.co,
+                 co_get_merkle_preimage,
+                 check_cosigner_info);
+    } else {
+        co_get_merkle_leaf_element_init(&state->get_key_info.get_leaf_element,
+                                        state->wallet_header.keys_info_merkle_root,
+                                        state->wallet_header.n_keys,
+                                        state->next_pubkey_index,
+                                        state->next_pubkey_info,
+                                        MAX_POLICY_KEY_INFO_LEN);
+        co_start(dc,
+                 &state->get_key_info.get_leaf_element.co,
+                 co_get_merkle_leaf_element,
+                 check_cosigner_info);
     }
+}
 
-    // check if policy is acceptable; only multisig is accepted at this time,
-    // and it must be one of the accepted patterns.
-    if (!is_policy_acceptable(&state->policy_map)) {
-        SEND_SW(dc, SW_NOT_SUPPORTED);
-        return;
+/**
+ * Parses the pubkey info received by process_cosigner_info.
+ * Once the user approved the previous pubkey info, if any, asks the user to validate this one.
+ */
+/**
+ * Writes the textual encoding of a key information in the binary encoding, that must have both the
+ * key origin and the wildcard; the wildcard is written in the usual form, unless it is a multipath
+ * wildcard with steps other than 0 and 1.
+ *
+ * @return the length of the string (not including the terminating null), or -1 on error or if the
+ * string does not fit in out_len bytes.
+ */
+static int format_key_info(const policy_map_key_info_t *key_info, char *out, size_t out_len) {
+    char fingerprint[8 + 1];
+    char path[MAX_SERIALIZED_BIP32_PATH_LENGTH + 1];
+    char ext_pubkey[MAX_SERIALIZED_PUBKEY_LENGTH + 1];
+    char wildcard[sizeof("/<2147483647;2147483647>/*")] = "/**";
+
+    format_hex(key_info->master_key_fingerprint, 4, fingerprint, sizeof(fingerprint));
+    if (!bip32_path_format(key_info->master_key_derivation,
+                           key_info->master_key_derivation_len,
+                           path,
+                           sizeof(path))) {
+        return -1;
+    }
+    if (crypto_serialize_extended_pubkey(
+            (const serialized_extended_pubkey_t *) key_info->serialized_ext_pubkey,
+            ext_pubkey) < 0) {
+        return -1;
     }
 
-    state->master_key_fingerprint = crypto_get_master_key_fingerprint();
+    if (key_info->multipath[0] != 0 || key_info->multipath[1] != 1) {
+        char steps[2][10 + 1];
+        if (!bip32_path_format(&key_info->multipath[0], 1, steps[0], sizeof(steps[0])) ||
+            !bip32_path_format(&key_info->multipath[1], 1, steps[1], sizeof(steps[1]))) {
+            return -1;
+        }
+        strcpy(wildcard, "/<");
+        strcat(wildcard, steps[0]);
+        strcat(wildcard, ";");
+        strcat(wildcard, steps[1]);
+        strcat(wildcard, ">/*");
+    }
 
-    state->next_pubkey_index = 0;
+    // "[" fingerprint ("/" path) "]" ext_pubkey wildcard
+    size_t path_len = strlen(path);
+    size_t len =
+        1 + 8 + (path_len > 0 ? 1 + path_len : 0) + 1 + strlen(ext_pubkey) + strlen(wildcard);
+    if (len + 1 > out_len) {
+        return -1;
+    }
 
-    ui_display_wallet_header(dc, &state->wallet_header, process_cosigner_info);
+    strcpy(out, "[");
+    strcat(out, fingerprint);
+    if (path_len > 0) {
+        strcat(out, "/");
+        strcat(out, path);
+    }
+    strcat(out, "]");
+    strcat(out, ext_pubkey);
+    strcat(out, wildcard);
+    return (int) len;
 }
 
-/**
- * Receives and parses the next pubkey info.
- * Asks the user to validate the pubkey info.
- */
-static void process_cosigner_info(dispatcher_context_t *dc) {
+static void check_cosigner_info(dispatcher_context_t *dc) {
     register_wallet_state_t *state = (register_wallet_state_t *) &G_command_state;
 
     LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
 
-    int pubkey_info_len = call_get_merkle_leaf_element(dc,
-                                                       state->wallet_header.keys_info_merkle_root,
-                                                       state->wallet_header.n_keys,
-                                                       state->next_pubkey_index,
-                                                       state->next_pubkey_info,
-                                                       MAX_POLICY_KEY_INFO_LEN);
+    int pubkey_info_len = state->has_key_info_hashes
+                              ? state->get_key_info.get_preimage.result
+                              : state->get_key_info.get_leaf_element.result;
 
     if (pubkey_info_len < 0) {
         SEND_SW(dc, SW_INCORRECT_DATA);
@@ -147,8 +309,15 @@ static void process_cosigner_info(dispatcher_context_t *dc) {
         return;
     }
 
+    // the encoding of the key informations is committed in the wallet type, hence in the wallet id
+    if (key_info.is_binary != (state->wallet_header.type == WALLET_TYPE_POLICY_MAP_BINARY_KEYS)) {
+        PRINTF("Unexpected encoding of the key info.\n");
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
     // We refuse to register wallets without key origin information, or whose keys don't end with
-    // the wildcard ('/**'). The key origin information is necessary when signing to identify which
+    // the wildcard ('/**' or '/<M;N>/*'). The key origin information is necessary when signing to identify which
     // one is our key. Using addresses without a wildcard could potentially be supported, but
     // disabled for now (question to address: can only _some_ of the keys have a wildcard?).
 
@@ -168,18 +337,13 @@ static void process_cosigner_info(dispatcher_context_t *dc) {
     if (read_u32_be(key_info.master_key_fingerprint, 0) == state->master_key_fingerprint) {
         // it could be a collision on the fingerprint; we verify that we can actually generate the
         // same pubkey
-        char pubkey_derived[MAX_SERIALIZED_PUBKEY_LENGTH + 1];
-        int serialized_pubkey_len =
-            get_serialized_extended_pubkey_at_path(key_info.master_key_derivation,
-                                                   key_info.master_key_derivation_len,
-                                                   G_coin_config->bip32_pubkey_version,
-                                                   pubkey_derived);
-        if (serialized_pubkey_len == -1) {
+        int ret = check_key_info_pubkey(&key_info, COIN_CONFIG_BIP32_PUBKEY_VERSION(G_coin_config));
+        if (ret == -1) {
             SEND_SW(dc, SW_BAD_STATE);
             return;
         }
 
-        if (strncmp(key_info.ext_pubkey, pubkey_derived, MAX_SERIALIZED_PUBKEY_LENGTH) == 0) {
+        if (ret == 1) {
             is_key_internal = true;
             ++state->n_internal_keys;
         }
@@ -189,25 +353,214 @@ static void process_cosigner_info(dispatcher_context_t *dc) {
     // checksum)
     //       Currently we are showing to the user whichever string is passed by the host.
 
-    ui_display_policy_map_cosigner_pubkey(dc,
-                                          (char *) state->next_pubkey_info,
-                                          state->next_pubkey_index,  // 1-indexed for the UI
-                                          state->wallet_header.n_keys,
-                                          is_key_internal,
-                                          next_cosigner);
+    // the key info is always shown in the textual encoding
+    if (key_info.is_binary && format_key_info(&key_info,
+                                              (char *) state->next_pubkey_info,
+                                              sizeof(state->next_pubkey_info)) < 0) {
+        PRINTF("Key info too long to be shown\n");
+        SEND_SW(dc, SW_NOT_SUPPORTED);
+        return;
+    }
+
+    state->is_next_pubkey_internal = is_key_internal;
+
+    if (state->next_pubkey_index > 0) {
+        // the previous pubkey info is still shown, with a deferred approval
+        ui_wait_for_approval(dc, display_cosigner_info);
+    } else {
+        dc->next(display_cosigner_info);
+    }
 }
 
-static void next_cosigner(dispatcher_context_t *dc) {
+/**
+ * Shows the pubkey info validated by check_cosigner_info. Except for the last one, the approval of
+ * the user is deferred, and the next pubkey info is fetched and validated while it is shown: as
+ * the UI keeps its own copy of the string, next_pubkey_info can be overwritten.
+ */
+static void display_cosigner_info(dispatcher_context_t *dc) {
     register_wallet_state_t *state = (register_wallet_state_t *) &G_command_state;
 
     LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
 
-    ++state->next_pubkey_index;
-    if (state->next_pubkey_index < state->wallet_header.n_keys) {
+    if (state->next_pubkey_index + 1 < state->wallet_header.n_keys) {
+        ui_display_policy_map_cosigner_pubkey_deferred(dc,
+                                                       (char *) state->next_pubkey_info,
+                                                       state->next_pubkey_index,
+                                                       state->wallet_header.n_keys,
+                                                       state->is_next_pubkey_internal);
+        ++state->next_pubkey_index;
         dc->next(process_cosigner_info);
     } else {
-        dc->next(finalize_response);
+        ui_display_policy_map_cosigner_pubkey(dc,
+                                              (char *) state->next_pubkey_info,
+                                              state->next_pubkey_index,  // 1-indexed for the UI
+                                              state->wallet_header.n_keys,
+                                              state->is_next_pubkey_internal,
+                                              finalize_response);
+    }
+}
+
+/**
+ * Fetches the wallet policy with the given id from the client, and validates it like
+ * handler_register_wallet.
+ *
+ * @return SW_OK on success, otherwise the status word of the error.
+ */
+static uint16_t load_wallet_policy(dispatcher_context_t *dc,
+                                   register_wallet_state_t *state,
+                                   const uint8_t wallet_id[static 32],
+                                   char policy_map_str[static MAX_POLICY_MAP_STR_LENGTH + 1]) {
+    int serialized_wallet_policy_len = call_get_preimage(dc,
+                                                         wallet_id,
+                                                         state->serialized_wallet_policy,
+                                                         sizeof(state->serialized_wallet_policy));
+    if (serialized_wallet_policy_len < 0) {
+        return SW_INCORRECT_DATA;
+    }
+
+    buffer_t serialized_wallet_policy_buf =
+        buffer_create(state->serialized_wallet_policy, serialized_wallet_policy_len);
+
+    uint16_t sw = parse_wallet_policy(state, &serialized_wallet_policy_buf, policy_map_str);
+    if (sw != SW_OK) {
+        return sw;
     }
+
+    // the preimage was verified by call_get_preimage, but it must be exactly the wallet policy
+    if (serialized_wallet_policy_buf.offset != serialized_wallet_policy_buf.size ||
+        memcmp(state->wallet_id, wallet_id, 32) != 0) {
+        return SW_INCORRECT_DATA;
+    }
+    return SW_OK;
+}
+
+/**
+ * Registers multiple wallet policies with the same keys: each policy is validated and shown to the
+ * user, but the shared key informations are fetched, validated and shown only once.
+ */
+void handler_register_wallets(dispatcher_context_t *dc) {
+    register_wallet_state_t *state = (register_wallet_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    // Device must be unlocked
+    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
+        return;
+    }
+
+    if (!buffer_read_u8(&dc->read_buffer, &state->n_wallets)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    if (state->n_wallets < 1 || state->n_wallets > MAX_REGISTER_WALLETS_BATCH_SIZE) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    for (unsigned int i = 0; i < state->n_wallets; i++) {
+        if (!buffer_read_bytes(&dc->read_buffer, state->wallet_ids[i], 32)) {
+            SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+            return;
+        }
+    }
+
+    // all the wallets are validated before showing anything to the user
+    for (unsigned int i = 0; i < state->n_wallets; i++) {
+        char policy_map_str[MAX_POLICY_MAP_STR_LENGTH + 1];
+        uint16_t sw = load_wallet_policy(dc, state, state->wallet_ids[i], policy_map_str);
+        if (sw != SW_OK) {
+            SEND_SW(dc, sw);
+            return;
+        }
+
+        if (i == 0) {
+            state->n_keys = state->wallet_header.n_keys;
+            memcpy(state->keys_info_merkle_root,
+                   state->wallet_header.keys_info_merkle_root,
+                   sizeof(state->keys_info_merkle_root));
+        } else if (state->wallet_header.n_keys != state->n_keys ||
+                   memcmp(state->wallet_header.keys_info_merkle_root,
+                          state->keys_info_merkle_root,
+                          sizeof(state->keys_info_merkle_root)) != 0) {
+            PRINTF("The wallets do not have the same keys\n");
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+
+        // only the name is shown when spending from a registered wallet: names must be distinct
+        memcpy(state->wallet_names[i], state->wallet_header.name, state->wallet_header.name_len);
+        state->wallet_names[i][state->wallet_header.name_len] = '\0';
+        for (unsigned int j = 0; j < i; j++) {
+            if (strcmp(state->wallet_names[i], state->wallet_names[j]) == 0) {
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
+            }
+        }
+    }
+
+    state->is_batch = true;
+    state->cur_wallet_index = 0;
+    dc->next(display_next_wallet);
+}
+
+static void display_next_wallet(dispatcher_context_t *dc) {
+    register_wallet_state_t *state = (register_wallet_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    // the policy was already validated, but only one of them fits in memory
+    char policy_map_str[MAX_POLICY_MAP_STR_LENGTH + 1];
+    uint16_t sw =
+        load_wallet_policy(dc, state, state->wallet_ids[state->cur_wallet_index], policy_map_str);
+    if (sw != SW_OK) {
+        SEND_SW(dc, sw);
+        return;
+    }
+
+    ui_display_wallet_batch_header(dc,
+                                   &state->wallet_header,
+                                   policy_map_str,
+                                   state->cur_wallet_index,
+                                   state->n_wallets,
+                                   next_wallet);
+}
+
+static void next_wallet(dispatcher_context_t *dc) {
+    register_wallet_state_t *state = (register_wallet_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    ++state->cur_wallet_index;
+    if (state->cur_wallet_index < state->n_wallets) {
+        dc->next(display_next_wallet);
+        return;
+    }
+
+    // the keys are the same for all the wallets, and state->wallet_header is the last one
+    if (start_cosigners(dc, state) < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+    dc->next(process_cosigner_info);
+}
+
+// computes the hmac of the wallet id, that proves the registration of the wallet policy
+static void compute_wallet_hmac(const uint8_t wallet_id[static 32], uint8_t hmac[static 32]) {
+    uint8_t key[32];
+
+    BEGIN_TRY {
+        TRY {
+            crypto_derive_symmetric_key(WALLET_SLIP0021_LABEL, WALLET_SLIP0021_LABEL_LEN, key);
+
+            cx_hmac_sha256(key, sizeof(key), wallet_id, 32, hmac, 32);
+        }
+        FINALLY {
+            explicit_bzero(key, sizeof(key));
+        }
+    }
+    END_TRY;
 }
 
 static void finalize_response(dispatcher_context_t *dc) {
@@ -227,6 +580,16 @@ static void finalize_response(dispatcher_context_t *dc) {
     //       wallet is a sensitive operation, and a fraudulent wallet with the same name would
     //       result in loss of funds.
 
+    if (state->is_batch) {
+        uint8_t hmacs[MAX_REGISTER_WALLETS_BATCH_SIZE][32];
+        for (unsigned int i = 0; i < state->n_wallets; i++) {
+            compute_wallet_hmac(state->wallet_ids[i], hmacs[i]);
+            store_verified_wallet_hmac(state->wallet_ids[i], hmacs[i]);
+        }
+        SEND_RESPONSE(dc, hmacs, 32 * state->n_wallets, SW_OK);
+        return;
+    }
+
     struct {
         uint8_t wallet_id[32];
         uint8_t hmac[32];
@@ -244,48 +607,50 @@ static void finalize_response(dispatcher_context_t *dc) {
     //       The client must persist the metadata, together with the signature.
 
     // sign wallet id and produce response
-    uint8_t key[32];
-
-    BEGIN_TRY {
-        TRY {
-            crypto_derive_symmetric_key(WALLET_SLIP0021_LABEL, WALLET_SLIP0021_LABEL_LEN, key);
+    compute_wallet_hmac(response.wallet_id, response.hmac);
 
-            cx_hmac_sha256(key,
-                           sizeof(key),
-                           state->wallet_id,
-                           sizeof(state->wallet_id),
-                           response.hmac,
-                           sizeof(response.hmac));
-        }
-        FINALLY {
-            explicit_bzero(key, sizeof(key));
-        }
-    }
-    END_TRY;
+    // the wallet is likely used right after being registered
+    store_verified_wallet_hmac(response.wallet_id, response.hmac);
 
     SEND_RESPONSE(dc, &response, sizeof(response), SW_OK);
 }
 
 static bool is_policy_acceptable(policy_node_t *policy) {
     policy_node_t *internal_script;
-
-    if (policy->type == TOKEN_SH) {
+    bool is_within_wsh;
+
+    if (policy->type == TOKEN_TR) {
+        // tr(@0,TREE), if all the scripts in the tree are valid and they can be compiled
+        policy_script_template_t template;
+        return ((policy_node_tr_t *) policy)->tree != NULL &&
+               compile_policy_script_template(policy, &template) == 0;
+    } else if (policy->type == TOKEN_SH) {
         policy_node_t *child_node = ((policy_node_with_script_t *) policy)->script;
         if (child_node->type == TOKEN_WSH) {
             // sh(wsh({sorted}multi(@0)))
             internal_script = ((policy_node_with_script_t *) child_node)->script;
+            is_within_wsh = true;
         } else {
             // sh({sorted}multi(@0))
             internal_script = child_node;
+            is_within_wsh = false;
         }
     } else if (policy->type == TOKEN_WSH) {
         // wsh({sorted}multi(@0))
         internal_script = ((policy_node_with_script_t *) policy)->script;
+        is_within_wsh = true;
     } else {
         return false;  // unexpected policy
     }
 
-    return internal_script->type == TOKEN_MULTI || internal_script->type == TOKEN_SORTEDMULTI;
+    if (internal_script->type == TOKEN_MULTI || internal_script->type == TOKEN_SORTEDMULTI) {
+        return true;
+    }
+
+    // any other miniscript is only accepted inside wsh(), if it is valid, sane and it can be
+    // compiled
+    policy_script_template_t template;
+    return is_within_wsh && compile_policy_script_template(policy, &template) == 0;
 }
 
 static bool is_policy_name_acceptable(const char *name, size_t name_len) {
@@ -7,9 +7,22 @@
 
 #include "lib/get_merkle_leaf_element.h"
 
+// maximum number of wallet policies registered at once by REGISTER_WALLETS
+#define MAX_REGISTER_WALLETS_BATCH_SIZE 4
+
 typedef struct {
     machine_context_t ctx;
 
+    // only for REGISTER_WALLETS: the wallet policies share the same key informations
+    bool is_batch;
+    uint8_t n_wallets;
+    uint8_t cur_wallet_index;
+    uint8_t wallet_ids[MAX_REGISTER_WALLETS_BATCH_SIZE][32];
+    char wallet_names[MAX_REGISTER_WALLETS_BATCH_SIZE][MAX_WALLET_NAME_LENGTH + 1];
+    uint16_t n_keys;
+    uint8_t keys_info_merkle_root[32];
+    uint8_t serialized_wallet_policy[MAX_POLICY_MAP_SERIALIZED_LENGTH];
+
     policy_map_wallet_header_t wallet_header;
 
     uint8_t wallet_id[32];
@@ -21,8 +34,21 @@ typedef struct {
 
     uint32_t master_key_fingerprint;
 
+    // if true, the leaf hashes of all the key informations were verified at once with a multiproof,
+    // and each key information is requested by its hash
+    bool has_key_info_hashes;
+    uint8_t key_info_hashes[MAX_POLICY_MAP_KEYS][32];
+
     uint8_t next_pubkey_index;
     uint8_t next_pubkey_info[MAX_POLICY_KEY_INFO_LEN + 1];
+    bool is_next_pubkey_internal;
+
+    // the coroutine that receives the key information at next_pubkey_index
+    union {
+        co_get_merkle_preimage_t get_preimage;
+        co_get_merkle_leaf_element_t get_leaf_element;
+    } get_key_info;
 } register_wallet_state_t;
 
 void handler_register_wallet(dispatcher_context_t *dispatcher_context);
+void handler_register_wallets(dispatcher_context_t *dispatcher_context);
@@ -26,10 +26,23 @@
 #include "../ui/display.h"
 #include "../ui/menu.h"
 
+#include "lib/stream_merkle_leaf_element.h"
+
 extern global_context_t *G_coin_config;
 
 static void send_response(dispatcher_context_t *dc);
 
+// Adds a chunk of the message to the hash computations, straight from the client's response.
+static void cb_process_message_chunk(buffer_t *data, void *cb_state) {
+    sign_message_state_t *state = (sign_message_state_t *) cb_state;
+
+    size_t data_len = data->size - data->offset;
+    uint8_t *data_start_ptr = data->ptr + data->offset;
+
+    crypto_hash_update(&state->msg_hash_context.header, data_start_ptr, data_len);
+    crypto_hash_update(&state->bsm_digest_context.header, data_start_ptr, data_len);
+}
+
 static unsigned char const BSM_SIGN_MAGIC[] = {'\x18', 'B', 'i', 't', 'c', 'o', 'i', 'n', ' ',
                                                'S',    'i', 'g', 'n', 'e', 'd', ' ', 'M', 'e',
                                                's',    's', 'a', 'g', 'e', ':', '\n'};
@@ -53,7 +66,13 @@ void handler_sign_message(dispatcher_context_t *dc) {
         return;
     }
 
-    if (state->bip32_path_len > MAX_BIP32_PATH_STEPS || state->message_length >= (1LL << 32)) {
+    // the chunk size is optional, for compatibility with clients that only use 64-byte chunks
+    if (!buffer_read_u8(&dc->read_buffer, &state->message_chunk_size)) {
+        state->message_chunk_size = DEFAULT_MESSAGE_CHUNK_SIZE;
+    }
+
+    if (state->bip32_path_len > MAX_BIP32_PATH_STEPS || state->message_length >= (1LL << 32) ||
+        state->message_chunk_size == 0) {
         SEND_SW(dc, SW_INCORRECT_DATA);
         return;
     }
@@ -69,28 +88,31 @@ void handler_sign_message(dispatcher_context_t *dc) {
     crypto_hash_update(&state->bsm_digest_context.header, BSM_SIGN_MAGIC, sizeof(BSM_SIGN_MAGIC));
     crypto_hash_update_varint(&state->bsm_digest_context.header, state->message_length);
 
-    size_t n_chunks = (state->message_length + 63) / 64;
+    // Each chunk is hashed while it is streamed, without storing it; if a chunk does not match the
+    // Merkle root, the command fails, and the partial hashes are discarded
+    size_t chunk_size = state->message_chunk_size;
+    size_t n_chunks = (state->message_length + chunk_size - 1) / chunk_size;
     for (unsigned int i = 0; i < n_chunks; i++) {
-        uint8_t message_chunk[64];
-        int chunk_len = call_get_merkle_leaf_element(dc,
-                                                     state->message_merkle_root,
-                                                     n_chunks,
-                                                     i,
-                                                     message_chunk,
-                                                     sizeof(message_chunk));
-
-        if (chunk_len < 0 || (chunk_len != 64 && i != n_chunks - 1)) {
+        size_t expected_len =
+            (i != n_chunks - 1) ? chunk_size : state->message_length - i * chunk_size;
+
+        int chunk_len = call_stream_merkle_leaf_element(dc,
+                                                        state->message_merkle_root,
+                                                        n_chunks,
+                                                        i,
+                                                        NULL,
+                                                        cb_process_message_chunk,
+                                                        state);
+
+        if (chunk_len < 0 || (size_t) chunk_len != expected_len) {
             SEND_SW(dc, SW_BAD_STATE);  // should never happen
             return;
         }
-
-        crypto_hash_update(&state->msg_hash_context.header, message_chunk, chunk_len);
-        crypto_hash_update(&state->bsm_digest_context.header, message_chunk, chunk_len);
     }
 
     crypto_hash_digest(&state->msg_hash_context.header, state->message_hash, 32);
     crypto_hash_digest(&state->bsm_digest_context.header, state->bsm_digest, 32);
-    cx_hash_sha256(state->bsm_digest, 32, state->bsm_digest, 32);
+    crypto_sha256(state->bsm_digest, 32, state->bsm_digest);
 
     char message_hash_str[64 + 1];
     for (int i = 0; i < 32; i++) {
@@ -123,25 +145,10 @@ static void send_response(dispatcher_context_t *dc) {
     // convert signature to the standard Bitcoin format, always 65 bytes long
 
     uint8_t result[65];
-    memset(result, 0, sizeof(result));
-
-    // # Format signature into standard bitcoin format
-    int r_length = sig[3];
-    int s_length = sig[4 + r_length + 1];
-
-    if (r_length > 33 || s_length > 33) {
+    if (crypto_ecdsa_der_to_compact(sig, sig_len, result + 1) < 0) {
         SEND_SW(dc, SW_BAD_STATE);  // can never happen
         return;
     }
-
-    // Write s, r, and the first byte in reverse order, as the two loops will underflow by 1 byte
-    // (that needs to be discarded) when s_length and r_length (respectively) are equal to 33.
-    for (int i = s_length - 1; i >= 0; --i) {
-        result[1 + 32 + 32 - s_length + i] = sig[4 + r_length + 2 + i];
-    }
-    for (int i = r_length - 1; i >= 0; --i) {
-        result[1 + 32 - r_length + i] = sig[4 + i];
-    }
     result[0] = 27 + 4 + ((info & CX_ECCINFO_PARITY_ODD) ? 1 : 0);
 
     SEND_RESPONSE(dc, result, sizeof(result), SW_OK);
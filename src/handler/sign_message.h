@@ -3,6 +3,11 @@
 #include "../common/bip32.h"
 #include "../boilerplate/dispatcher.h"
 
+/**
+ * Length of the chunks of the message, if the client does not specify it.
+ */
+#define DEFAULT_MESSAGE_CHUNK_SIZE 64
+
 typedef struct {
     machine_context_t ctx;
 
@@ -10,6 +15,7 @@ typedef struct {
     uint32_t bip32_path[MAX_BIP32_PATH_STEPS];
     uint64_t message_length;
     uint8_t message_merkle_root[32];
+    uint8_t message_chunk_size;  // length of each chunk of the message, except the last one
 
     cx_sha256_t msg_hash_context;    // used to compute sha256(message)
     cx_sha256_t bsm_digest_context;  // used to compute the Bitcoin Message Signing digest
@@ -0,0 +1,527 @@
+/*****************************************************************************
+ *   Ledger App Bitcoin.
+ *   (c) 2021 Ledger SAS.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *****************************************************************************/
+
+#include <stdint.h>
+
+#include "boilerplate/io.h"
+#include "boilerplate/dispatcher.h"
+#include "boilerplate/sw.h"
+#include "../common/read.h"
+#include "../common/script.h"
+#include "../common/varint.h"
+#include "../common/write.h"
+#include "../commands.h"
+#include "../constants.h"
+#include "../crypto.h"
+#include "../ui/display.h"
+#include "../ui/menu.h"
+
+#include "lib/stream_merkle_leaf_element.h"
+
+#include "sign_message_bip322.h"
+#include "client_commands.h"
+
+extern global_context_t *G_coin_config;
+
+static void sign_messages(dispatcher_context_t *dc);
+
+/*
+ * BIP-322 "simple" signatures: the signature of a message is the witness stack that spends the
+ * output of the virtual transaction to_spend, which commits to the message and to the address, in
+ * the virtual transaction to_sign:
+ *
+ * to_spend: nVersion = 0, nLockTime = 0, a single input spending 0000...0000:0xFFFFFFFF with
+ *           scriptSig = OP_0 PUSH32[message_hash] and nSequence = 0, a single output with
+ *           nValue = 0 and the scriptPubKey of the address.
+ * to_sign:  nVersion = 0, nLockTime = 0, a single input spending to_spend_txid:0 with
+ *           nSequence = 0, a single output with nValue = 0 and scriptPubKey = OP_RETURN.
+ *
+ * All the fields of to_sign, except the txid of to_spend, are fixed.
+ */
+
+// the only output of to_sign: nValue = 0, scriptPubKey = OP_RETURN
+static const uint8_t TO_SIGN_OUTPUT[] = {0, 0, 0, 0, 0, 0, 0, 0, 0x01, OP_RETURN};
+
+static const uint8_t ZEROS[32] = {0};
+
+// Adds a chunk of the message to the hash computations, straight from the client's response.
+static void cb_process_message_chunk(buffer_t *data, void *cb_state) {
+    sign_message_bip322_state_t *state = (sign_message_bip322_state_t *) cb_state;
+
+    size_t data_len = data->size - data->offset;
+    uint8_t *data_start_ptr = data->ptr + data->offset;
+
+    crypto_hash_update(&state->tagged_hash_context.header, data_start_ptr, data_len);
+    if (state->n_messages == 1) {
+        crypto_hash_update(&state->msg_hash_context.header, data_start_ptr, data_len);
+    }
+}
+
+// Streams the message at the given index, and computes its BIP-322 tagged hash.
+// returns -1 on error. 0 on success.
+static int compute_message_hash(dispatcher_context_t *dc,
+                                sign_message_bip322_state_t *state,
+                                uint32_t message_index,
+                                uint8_t out[static 32]) {
+    crypto_tr_tagged_hash_init_midstate(&state->tagged_hash_context,
+                                        BIP0322_signed_message_midstate);
+    if (state->n_messages == 1) {
+        cx_sha256_init(&state->msg_hash_context);
+    }
+
+    if (call_stream_merkle_leaf_element(dc,
+                                        state->messages_merkle_root,
+                                        state->n_messages,
+                                        message_index,
+                                        NULL,
+                                        cb_process_message_chunk,
+                                        state) < 0) {
+        return -1;
+    }
+
+    crypto_hash_digest(&state->tagged_hash_context.header, out, 32);
+    return 0;
+}
+
+// Computes the txid of the to_spend transaction for the given BIP-322 message hash.
+static void compute_to_spend_txid(const sign_message_bip322_state_t *state,
+                                  const uint8_t message_hash[static 32],
+                                  uint8_t out[static 32]) {
+    cx_sha256_t txid_context;
+    cx_sha256_init(&txid_context);
+
+    // nVersion, and the only input's prevout hash
+    crypto_hash_update(&txid_context.header, ZEROS, 4);
+    crypto_hash_update_u8(&txid_context.header, 1);
+    crypto_hash_update(&txid_context.header, ZEROS, 32);
+    crypto_hash_update_u32(&txid_context.header, 0xFFFFFFFF);
+
+    // scriptSig = OP_0 PUSH32[message_hash], and nSequence
+    crypto_hash_update_u8(&txid_context.header, 2 + 32);
+    crypto_hash_update_u8(&txid_context.header, OP_0);
+    crypto_hash_update_u8(&txid_context.header, 32);
+    crypto_hash_update(&txid_context.header, message_hash, 32);
+    crypto_hash_update(&txid_context.header, ZEROS, 4);
+
+    // the only output, and nLockTime
+    crypto_hash_update_u8(&txid_context.header, 1);
+    crypto_hash_update(&txid_context.header, ZEROS, 8);
+    crypto_hash_update_varint(&txid_context.header, state->script_len);
+    crypto_hash_update(&txid_context.header, state->script, state->script_len);
+    crypto_hash_update(&txid_context.header, ZEROS, 4);
+
+    crypto_hash_digest(&txid_context.header, out, 32);
+    crypto_sha256(out, 32, out);
+}
+
+// Computes the BIP-143 sighash of to_sign with SIGHASH_ALL, for a P2WPKH address.
+static void compute_sighash_segwit_v0(const sign_message_bip322_state_t *state,
+                                      const uint8_t to_spend_txid[static 32],
+                                      uint8_t out[static 32]) {
+    cx_sha256_t sighash_context;
+    cx_sha256_init(&sighash_context);
+
+    uint8_t outpoint[36];
+    memcpy(outpoint, to_spend_txid, 32);
+    memset(outpoint + 32, 0, 4);
+
+    uint8_t dbl_hash[32];
+
+    // nVersion
+    crypto_hash_update(&sighash_context.header, ZEROS, 4);
+
+    // hashPrevouts
+    crypto_sha256(outpoint, sizeof(outpoint), dbl_hash);
+    crypto_sha256(dbl_hash, 32, dbl_hash);
+    crypto_hash_update(&sighash_context.header, dbl_hash, 32);
+
+    // hashSequence
+    crypto_sha256(ZEROS, 4, dbl_hash);
+    crypto_sha256(dbl_hash, 32, dbl_hash);
+    crypto_hash_update(&sighash_context.header, dbl_hash, 32);
+
+    // outpoint
+    crypto_hash_update(&sighash_context.header, outpoint, sizeof(outpoint));
+
+    // scriptCode of P2WPKH: the corresponding P2PKH script
+    uint8_t p2pkh_script[26] = {0x19, OP_DUP, OP_HASH160, 0x14};
+    memcpy(p2pkh_script + 4, state->script + 2, 20);
+    p2pkh_script[24] = OP_EQUALVERIFY;
+    p2pkh_script[25] = OP_CHECKSIG;
+    crypto_hash_update(&sighash_context.header, p2pkh_script, sizeof(p2pkh_script));
+
+    // amount, and nSequence
+    crypto_hash_update(&sighash_context.header, ZEROS, 8);
+    crypto_hash_update(&sighash_context.header, ZEROS, 4);
+
+    // hashOutputs
+    crypto_sha256(TO_SIGN_OUTPUT, sizeof(TO_SIGN_OUTPUT), dbl_hash);
+    crypto_sha256(dbl_hash, 32, dbl_hash);
+    crypto_hash_update(&sighash_context.header, dbl_hash, 32);
+
+    // nLockTime, and sighash type SIGHASH_ALL
+    crypto_hash_update(&sighash_context.header, ZEROS, 4);
+    uint8_t sighash_type[4];
+    write_u32_le(sighash_type, 0, SIGHASH_ALL);
+    crypto_hash_update(&sighash_context.header, sighash_type, 4);
+
+    crypto_hash_digest(&sighash_context.header, out, 32);
+    crypto_sha256(out, 32, out);
+}
+
+// Computes the BIP-341 sighash of to_sign with SIGHASH_DEFAULT, for a key path spend.
+static void compute_sighash_segwit_v1(const sign_message_bip322_state_t *state,
+                                      const uint8_t to_spend_txid[static 32],
+                                      uint8_t out[static 32]) {
+    cx_sha256_t sighash_context;
+    crypto_tr_tagged_hash_init_midstate(&sighash_context, BIP0341_tapsighash_midstate);
+
+    uint8_t outpoint[36];
+    memcpy(outpoint, to_spend_txid, 32);
+    memset(outpoint + 32, 0, 4);
+
+    uint8_t tmp_hash[32];
+
+    // epoch, hash_type, nVersion and nLockTime
+    crypto_hash_update(&sighash_context.header, ZEROS, 1 + 1 + 4 + 4);
+
+    // sha_prevouts
+    crypto_sha256(outpoint, sizeof(outpoint), tmp_hash);
+    crypto_hash_update(&sighash_context.header, tmp_hash, 32);
+
+    // sha_amounts
+    crypto_sha256(ZEROS, 8, tmp_hash);
+    crypto_hash_update(&sighash_context.header, tmp_hash, 32);
+
+    // sha_scriptpubkeys
+    cx_sha256_t spk_context;
+    cx_sha256_init(&spk_context);
+    crypto_hash_update_varint(&spk_context.header, state->script_len);
+    crypto_hash_update(&spk_context.header, state->script, state->script_len);
+    crypto_hash_digest(&spk_context.header, tmp_hash, 32);
+    crypto_hash_update(&sighash_context.header, tmp_hash, 32);
+
+    // sha_sequences
+    crypto_sha256(ZEROS, 4, tmp_hash);
+    crypto_hash_update(&sighash_context.header, tmp_hash, 32);
+
+    // sha_outputs
+    crypto_sha256(TO_SIGN_OUTPUT, sizeof(TO_SIGN_OUTPUT), tmp_hash);
+    crypto_hash_update(&sighash_context.header, tmp_hash, 32);
+
+    // spend_type (key path, no annex), and input_index
+    crypto_hash_update(&sighash_context.header, ZEROS, 1 + 4);
+
+    crypto_hash_digest(&sighash_context.header, out, 32);
+}
+
+static int flush_yielded_signatures(dispatcher_context_t *dc, sign_message_bip322_state_t *state) {
+    if (state->n_yield_buffer_elements == 0) {
+        return 0;
+    }
+
+    buffer_t req = dc_get_request_buffer(dc);
+    bool ok = buffer_write_u8(&req, CCMD_YIELD) &&
+              buffer_write_u8(&req, state->n_yield_buffer_elements) &&
+              buffer_write_bytes(&req, state->yield_buffer, state->yield_buffer_len);
+
+    state->n_yield_buffer_elements = 0;
+    state->yield_buffer_len = 0;
+
+    if (!ok || dc_exchange(dc, &req) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Yields the signature of the message at message_index, encoded as <message_index> <witness>,
+// where the witness is serialized as in the BIP-322 "simple" format. If the client supports batched
+// yields, the signature is accumulated in the yield buffer instead, which is flushed when full.
+// returns -1 on error. 0 on success.
+static int yield_signature(dispatcher_context_t *dc,
+                           sign_message_bip322_state_t *state,
+                           uint32_t message_index,
+                           const uint8_t *witness,
+                           size_t witness_len) {
+    uint8_t message_index_varint[9];
+    int message_index_varint_len = varint_write(message_index_varint, 0, message_index);
+    size_t el_len = message_index_varint_len + witness_len;
+
+    if (!state->use_batched_yield) {
+        buffer_t req = dc_get_request_buffer(dc);
+        if (!buffer_write_u8(&req, CCMD_YIELD) ||
+            !buffer_write_bytes(&req, message_index_varint, message_index_varint_len) ||
+            !buffer_write_bytes(&req, witness, witness_len)) {
+            return -1;
+        }
+        return dc_exchange(dc, &req) < 0 ? -1 : 0;
+    }
+
+    if (state->yield_buffer_len + 1 + el_len > sizeof(state->yield_buffer) &&
+        flush_yielded_signatures(dc, state) < 0) {
+        return -1;
+    }
+
+    uint8_t *p = state->yield_buffer + state->yield_buffer_len;
+    *p++ = (uint8_t) el_len;
+    memcpy(p, message_index_varint, message_index_varint_len);
+    p += message_index_varint_len;
+    memcpy(p, witness, witness_len);
+
+    state->yield_buffer_len += 1 + el_len;
+    ++state->n_yield_buffer_elements;
+    return 0;
+}
+
+// Signs the sighash with the derived key, and serializes the witness stack that spends to_spend.
+// returns the length of the witness on success, -1 on error.
+static int sign_sighash(const sign_message_bip322_state_t *state,
+                        const uint8_t sighash[static 32],
+                        uint8_t witness[static 2 + MAX_DER_SIG_LEN + 1 + 1 + 33]) {
+    if (state->address_type == ADDRESS_TYPE_WIT) {
+        // <2> <sig || SIGHASH_ALL> <pubkey>
+        int sig_len = crypto_ecdsa_sign_sha256_hash_with_raw_key(state->seckey,
+                                                                 sighash,
+                                                                 witness + 2,
+                                                                 NULL);
+        if (sig_len < 0) {
+            return -1;
+        }
+        witness[0] = 2;
+        witness[1] = (uint8_t) (sig_len + 1);
+        witness[2 + sig_len] = SIGHASH_ALL;
+        witness[2 + sig_len + 1] = 33;
+        memcpy(witness + 2 + sig_len + 2, state->pubkey, 33);
+        return 2 + sig_len + 2 + 33;
+    }
+
+    // <1> <sig>, as the sighash type byte is omitted for SIGHASH_DEFAULT
+    cx_ecfp_private_key_t private_key = {0};
+    size_t sig_len = 0;
+
+    bool error = false;
+    BEGIN_TRY {
+        TRY {
+            cx_ecfp_init_private_key(CX_CURVE_256K1, state->seckey, 32, &private_key);
+
+            unsigned int err = cx_ecschnorr_sign_no_throw(&private_key,
+                                                          CX_ECSCHNORR_BIP0340 | CX_RND_TRNG,
+                                                          CX_SHA256,
+                                                          sighash,
+                                                          32,
+                                                          witness + 2,
+                                                          &sig_len);
+            if (err != CX_OK) {
+                error = true;
+            }
+        }
+        CATCH_ALL {
+            error = true;
+        }
+        FINALLY {
+            explicit_bzero(&private_key, sizeof(private_key));
+        }
+    }
+    END_TRY;
+
+    if (error || sig_len != 64) {
+        return -1;
+    }
+    witness[0] = 1;
+    witness[1] = 64;
+    return 2 + 64;
+}
+
+void handler_sign_message_bip322(dispatcher_context_t *dc) {
+    sign_message_bip322_state_t *state = (sign_message_bip322_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    // Device must be unlocked
+    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
+        return;
+    }
+
+    uint64_t n_messages;
+    if (!buffer_read_u8(&dc->read_buffer, &state->address_type) ||
+        !buffer_read_u8(&dc->read_buffer, &state->bip32_path_len) ||
+        !buffer_read_bip32_path(&dc->read_buffer, state->bip32_path, state->bip32_path_len) ||
+        !buffer_read_varint(&dc->read_buffer, &n_messages) ||
+        !buffer_read_bytes(&dc->read_buffer, state->messages_merkle_root, 32)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    if ((state->address_type != ADDRESS_TYPE_WIT && state->address_type != ADDRESS_TYPE_TR) ||
+        state->bip32_path_len > MAX_BIP32_PATH_STEPS || n_messages == 0 ||
+        n_messages >= (1LL << 32)) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+    state->n_messages = (uint32_t) n_messages;
+
+    // as the signature is bound to an address, only the keys of the standard addresses are used
+    uint32_t coin_types[2] = {COIN_CONFIG_BIP44_COIN_TYPE(G_coin_config),
+                              COIN_CONFIG_BIP44_COIN_TYPE_2(G_coin_config)};
+    if (!is_address_path_standard(state->bip32_path,
+                                  state->bip32_path_len,
+                                  get_bip44_purpose(state->address_type),
+                                  coin_types,
+                                  2,
+                                  -1)) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    state->use_batched_yield = (dc->client_capabilities & CLIENT_CAPABILITY_BATCHED_YIELD) != 0;
+    state->n_yield_buffer_elements = 0;
+    state->yield_buffer_len = 0;
+
+    if (!crypto_get_compressed_pubkey_at_path(state->bip32_path,
+                                              state->bip32_path_len,
+                                              state->pubkey,
+                                              NULL)) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
+    }
+
+    if (state->address_type == ADDRESS_TYPE_WIT) {
+        state->script[0] = OP_0;
+        state->script[1] = 20;
+        crypto_hash160(state->pubkey, 33, state->script + 2);
+        state->script_len = 2 + 20;
+    } else {
+        uint8_t y_parity;
+        state->script[0] = OP_1;
+        state->script[1] = 32;
+        if (crypto_tr_tweak_pubkey(state->pubkey + 1, &y_parity, state->script + 2) < 0) {
+            SEND_SW(dc, SW_BAD_STATE);
+            return;
+        }
+        state->script_len = 2 + 32;
+    }
+
+    char address[MAX_ADDRESS_LENGTH_STR + 1];
+    if (get_script_address(state->script,
+                           state->script_len,
+                           G_coin_config,
+                           address,
+                           sizeof(address)) < 0) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
+    }
+
+    char path_str[MAX_SERIALIZED_BIP32_PATH_LENGTH + 1];
+    bip32_path_format(state->bip32_path, state->bip32_path_len, path_str, sizeof(path_str));
+
+    char message_hash_str[64 + 1];
+
+    if (state->n_messages > 1) {
+        // the messages are only streamed after the approval, as their hashes cannot be stored; the
+        // user verifies the Merkle root that commits to all of them against the expected messages
+        for (int i = 0; i < 32; i++) {
+            snprintf(message_hash_str + 2 * i, 3, "%02X", state->messages_merkle_root[i]);
+        }
+        ui_display_message_batch(dc,
+                                 path_str,
+                                 address,
+                                 state->n_messages,
+                                 message_hash_str,
+                                 sign_messages);
+        return;
+    }
+
+    // a single message is hashed right away, and the user verifies its sha256 hash
+    if (compute_message_hash(dc, state, 0, state->message_hash) < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    uint8_t msg_hash[32];
+    crypto_hash_digest(&state->msg_hash_context.header, msg_hash, 32);
+
+    for (int i = 0; i < 32; i++) {
+        snprintf(message_hash_str + 2 * i, 3, "%02X", msg_hash[i]);
+    }
+
+    ui_display_message_batch(dc, path_str, address, 1, message_hash_str, sign_messages);
+}
+
+static void sign_messages(dispatcher_context_t *dc) {
+    sign_message_bip322_state_t *state = (sign_message_bip322_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    // the key is derived from the seed only once for all the messages
+    {
+        cx_ecfp_private_key_t private_key = {0};
+        uint8_t chain_code[32];
+        int ret = crypto_derive_private_key(&private_key,
+                                            chain_code,
+                                            state->bip32_path,
+                                            state->bip32_path_len);
+        memcpy(state->seckey, private_key.d, sizeof(state->seckey));
+        explicit_bzero(&private_key, sizeof(private_key));
+        explicit_bzero(chain_code, sizeof(chain_code));
+
+        if (ret < 0 ||
+            (state->address_type == ADDRESS_TYPE_TR && crypto_tr_tweak_seckey(state->seckey) < 0)) {
+            explicit_bzero(state->seckey, sizeof(state->seckey));
+            SEND_SW(dc, SW_BAD_STATE);
+            return;
+        }
+    }
+
+    for (uint32_t i = 0; i < state->n_messages; i++) {
+        uint8_t message_hash[32];
+        if (state->n_messages == 1) {
+            memcpy(message_hash, state->message_hash, 32);
+        } else if (compute_message_hash(dc, state, i, message_hash) < 0) {
+            explicit_bzero(state->seckey, sizeof(state->seckey));
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+
+        uint8_t to_spend_txid[32];
+        compute_to_spend_txid(state, message_hash, to_spend_txid);
+
+        uint8_t sighash[32];
+        if (state->address_type == ADDRESS_TYPE_WIT) {
+            compute_sighash_segwit_v0(state, to_spend_txid, sighash);
+        } else {
+            compute_sighash_segwit_v1(state, to_spend_txid, sighash);
+        }
+
+        uint8_t witness[2 + MAX_DER_SIG_LEN + 1 + 1 + 33];
+        int witness_len = sign_sighash(state, sighash, witness);
+        if (witness_len < 0 || yield_signature(dc, state, i, witness, witness_len) < 0) {
+            explicit_bzero(state->seckey, sizeof(state->seckey));
+            SEND_SW(dc, SW_BAD_STATE);
+            return;
+        }
+    }
+
+    explicit_bzero(state->seckey, sizeof(state->seckey));
+
+    if (flush_yielded_signatures(dc, state) < 0) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
+    }
+
+    SEND_SW(dc, SW_OK);
+}
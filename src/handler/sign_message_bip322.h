@@ -0,0 +1,40 @@
+#pragma once
+
+#include "../crypto.h"
+#include "../common/bip32.h"
+#include "../boilerplate/dispatcher.h"
+#include "../perf_config.h"
+
+// length of the scriptPubKey of the supported addresses (P2WPKH is 22 bytes, P2TR is 34 bytes)
+#define MAX_BIP322_SCRIPTPUBKEY_LEN 34
+
+typedef struct {
+    machine_context_t ctx;
+
+    uint8_t address_type;  // ADDRESS_TYPE_WIT or ADDRESS_TYPE_TR
+    uint8_t bip32_path_len;
+    uint32_t bip32_path[MAX_BIP32_PATH_STEPS];
+    uint32_t n_messages;
+    uint8_t messages_merkle_root[32];
+
+    bool use_batched_yield;
+
+    uint8_t pubkey[33];  // compressed pubkey at bip32_path
+    uint8_t script[MAX_BIP322_SCRIPTPUBKEY_LEN];
+    size_t script_len;
+
+    cx_sha256_t msg_hash_context;     // used to compute sha256(message), only for display
+    cx_sha256_t tagged_hash_context;  // used to compute the BIP-322 tagged hash of the message
+
+    // only used if n_messages == 1, as the message is hashed before the user's approval
+    uint8_t message_hash[32];
+
+    // the private key is derived once, and used for all the messages
+    uint8_t seckey[32];
+
+    uint8_t n_yield_buffer_elements;
+    size_t yield_buffer_len;
+    uint8_t yield_buffer[BIP322_YIELD_BUFFER_LEN];
+} sign_message_bip322_state_t;
+
+void handler_sign_message_bip322(dispatcher_context_t *dispatcher_context);
@@ -18,7 +18,9 @@
 #include <stdint.h>
 
 #include "../boilerplate/dispatcher.h"
+#include "../boilerplate/io.h"
 #include "../boilerplate/sw.h"
+#include "../common/format.h"
 #include "../common/merkle.h"
 #include "../common/psbt.h"
 #include "../common/read.h"
@@ -29,6 +31,9 @@
 #include "../commands.h"
 #include "../constants.h"
 #include "../crypto.h"
+#include "../cxram_stash.h"
+#include "../settings.h"
+#include "../shared_arena.h"
 #include "../ui/display.h"
 #include "../ui/menu.h"
 
@@ -37,15 +42,22 @@
 #include "lib/policy.h"
 #include "lib/check_merkle_tree_sorted.h"
 #include "lib/get_preimage.h"
+#include "lib/wallet_session.h"
 #include "lib/get_merkleized_map.h"
 #include "lib/get_merkleized_map_value.h"
+#include "lib/get_merkleized_map_value_hash.h"
+#include "lib/host_storage.h"
+#include "lib/ownership_token.h"
 #include "lib/psbt_parse_rawtx.h"
+#include "lib/stream_merkle_leaves.h"
+#include "lib/stream_merkleized_map_value.h"
 
 #include "sign_psbt.h"
 
 #include "sign_psbt/compare_wallet_script_at_path.h"
 #include "sign_psbt/get_fingerprint_and_path.h"
 #include "sign_psbt/is_in_out_internal.h"
+#include "sign_psbt/prevout_token.h"
 #include "sign_psbt/update_hashes_with_map_value.h"
 
 #include "../swap/swap_globals.h"
@@ -53,11 +65,13 @@
 extern global_context_t *G_coin_config;
 
 // Input validation
+static void authorize_wallets_spend(dispatcher_context_t *dc);
 static void process_input_map(dispatcher_context_t *dc);
 static void check_input_owned(dispatcher_context_t *dc);
 
 static void alert_external_inputs(dispatcher_context_t *dc);
 static void alert_missing_nonwitnessutxo(dispatcher_context_t *dc);
+static void alert_nondefault_sighash(dispatcher_context_t *dc);
 
 // Output validation
 static void verify_outputs_init(dispatcher_context_t *dc);
@@ -68,10 +82,13 @@ static void output_next(dispatcher_context_t *dc);
 
 // User confirmation (all)
 static void confirm_transaction(dispatcher_context_t *dc);
+static void confirm_transaction_fee(dispatcher_context_t *dc);
 
 // Signing process (all)
 static void sign_init(dispatcher_context_t *dc);
 static void sign_process_input_map(dispatcher_context_t *dc);
+static int sign_input_get_change_and_address_index(dispatcher_context_t *dc,
+                                                   sign_psbt_state_t *state);
 
 // Legacy sighash computation (P2PKH and P2SH)
 static void sign_legacy(dispatcher_context_t *dc);
@@ -85,12 +102,19 @@ static void sign_segwit_v1(dispatcher_context_t *dc);
 // Sign input and yield result
 static void sign_sighash_ecdsa(dispatcher_context_t *dc);
 static void sign_sighash_schnorr(dispatcher_context_t *dc);
+static int sign_schnorr_batch(dispatcher_context_t *dc, sign_psbt_state_t *state);
+static void wipe_signing_keys(sign_psbt_state_t *state);
+static int yield_checkpoint(dispatcher_context_t *dc, sign_psbt_state_t *state);
+static int yield_prevout_token(dispatcher_context_t *dc,
+                               sign_psbt_state_t *state,
+                               const uint8_t txin_entry[static TXIN_RECORD_ENTRY_LEN]);
 
 // End point and return
 static void finalize(dispatcher_context_t *dc);
 
-/* BIP0341 tags for computing the tagged hashes when computing he sighash */
-static const uint8_t BIP0341_sighash_tag[] = {'T', 'a', 'p', 'S', 'i', 'g', 'h', 'a', 's', 'h'};
+// Background task while the user reviews the transaction
+static bool background_step(dispatcher_context_t *dc);
+static void background_end(dispatcher_context_t *dc);
 
 /*
 Current assumptions during signing:
@@ -107,25 +131,108 @@ the right paths to identify internal inputs/outputs.
 
 // HELPER FUNCTIONS
 
-// Updates the hash_context with the network serialization of all the outputs
+// Gets the amount and the scriptPubKey of the output with the given index: for a PSBTv0, they are
+// parsed from the unsigned transaction; otherwise, they are read from the output's map.
+// returns the length of the scriptPubKey, or -1 on error.
+static int get_output_amount_and_script(dispatcher_context_t *dc,
+                                        const sign_psbt_state_t *state,
+                                        const merkleized_map_commitment_t *map,
+                                        unsigned int output_index,
+                                        uint8_t amount_raw[static 8],
+                                        uint8_t script[static MAX_OUTPUT_SCRIPTPUBKEY_LEN]) {
+    if (state->is_psbt_v0) {
+        txid_parser_outputs_t outputs;
+        if (0 > call_parse_unsigned_tx(dc, state->unsigned_tx_hash, -1, output_index, &outputs) ||
+            outputs.vout_scriptpubkey_len > MAX_OUTPUT_SCRIPTPUBKEY_LEN) {
+            return -1;
+        }
+        write_u64_le(amount_raw, 0, outputs.vout_value);
+        memcpy(script, outputs.vout_scriptpubkey, outputs.vout_scriptpubkey_len);
+        return (int) outputs.vout_scriptpubkey_len;
+    }
+
+    if (8 != call_get_merkleized_map_value(dc,
+                                           map,
+                                           (uint8_t[]){PSBT_OUT_AMOUNT},
+                                           1,
+                                           amount_raw,
+                                           8)) {
+        return -1;
+    }
+
+    int script_len = call_get_merkleized_map_value(dc,
+                                                   map,
+                                                   (uint8_t[]){PSBT_OUT_SCRIPT},
+                                                   1,
+                                                   script,
+                                                   MAX_OUTPUT_SCRIPTPUBKEY_LEN);
+    if (script_len < 0 || script_len > MAX_OUTPUT_SCRIPTPUBKEY_LEN) {
+        return -1;
+    }
+    return script_len;
+}
+
+// Like hash_output, once the map of the output is known (NULL for a PSBTv0); out_script is the
+// buffer used for the output's scriptPubKey.
+static int hash_output_with_script(dispatcher_context_t *dc,
+                                   const merkleized_map_commitment_t *map,
+                                   unsigned int output_index,
+                                   cx_hash_t *hash_context,
+                                   host_storage_writer_t *writer,
+                                   uint8_t out_script[static MAX_OUTPUT_SCRIPTPUBKEY_LEN]) {
+    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
+
+    // get output's amount and scriptPubKey
+    uint8_t amount_raw[8];
+    int out_script_len =
+        get_output_amount_and_script(dc, state, map, output_index, amount_raw, out_script);
+    if (out_script_len < 0) {
+        return -1;
+    }
+
+    crypto_hash_update(hash_context, amount_raw, 8);
+    crypto_hash_update_varint(hash_context, out_script_len);
+    crypto_hash_update(hash_context, out_script, out_script_len);
+
+    if (writer == NULL) {
+        return 0;
+    }
+
+    uint8_t out_script_len_varint[9];
+    int varint_len = varint_write(out_script_len_varint, 0, out_script_len);
+
+    if (call_write_stream(dc, writer, amount_raw, 8) < 0 ||
+        call_write_stream(dc, writer, out_script_len_varint, varint_len) < 0 ||
+        call_write_stream(dc, writer, out_script, out_script_len) < 0) {
+        return -1;
+    }
+    state->outputs_serialization_len += 8 + varint_len + out_script_len;
+    return 0;
+}
+
+// Updates the hash_context with the network serialization of the output with the given index; if
+// writer is not NULL, the serialization is also appended to the stream stored on the host.
 // returns -1 on error. 0 on success.
-static int hash_outputs(dispatcher_context_t *dc, cx_hash_t *hash_context) {
+static int hash_output(dispatcher_context_t *dc,
+                       unsigned int output_index,
+                       cx_hash_t *hash_context,
+                       host_storage_writer_t *writer) {
     sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
 
-    // TODO: support other SIGHASH FLAGS
-    for (unsigned int i = 0; i < state->n_outputs; i++) {
-        // get this output's map
-        merkleized_map_commitment_t ith_map;
+    // get this output's map; for a PSBTv0, the output is parsed from the unsigned transaction
+    merkleized_map_commitment_t map;
 
-        int res = call_get_merkleized_map(dc, state->outputs_root, state->n_outputs, i, &ith_map);
-        if (res < 0) {
-            return -1;
-        }
+    if (!state->is_psbt_v0 &&
+        call_get_merkleized_map(dc, state->outputs_root, state->n_outputs, output_index, &map) <
+            0) {
+        return -1;
+    }
 
+    if (writer == NULL && !state->is_psbt_v0) {
         // get output's amount
         uint8_t amount_raw[8];
         if (8 != call_get_merkleized_map_value(dc,
-                                               &ith_map,
+                                               &map,
                                                (uint8_t[]){PSBT_OUT_AMOUNT},
                                                1,
                                                amount_raw,
@@ -135,22 +242,161 @@ static int hash_outputs(dispatcher_context_t *dc, cx_hash_t *hash_context) {
 
         crypto_hash_update(hash_context, amount_raw, 8);
 
-        // get output's scriptPubKey
+        // the length-prefixed scriptPubKey is only hashed, straight from the client's responses
+        int out_script_len = update_hashes_with_map_value(dc,
+                                                          &map,
+                                                          (uint8_t[]){PSBT_OUT_SCRIPT},
+                                                          1,
+                                                          NULL,
+                                                          hash_context);
+        return out_script_len < 0 ? -1 : 0;
+    }
+
+    // the scriptPubKey is in the cxram scratch area on Nano S, which is not used by the hashing and
+    // streaming functions
+    CXRAM_SCRATCH_BUFFER(uint8_t, out_script, MAX_OUTPUT_SCRIPTPUBKEY_LEN);
+    if (out_script == NULL) {
+        return -1;
+    }
+    int res = hash_output_with_script(dc,
+                                      state->is_psbt_v0 ? NULL : &map,
+                                      output_index,
+                                      hash_context,
+                                      writer,
+                                      out_script);
+    CXRAM_SCRATCH_RELEASE(out_script);
+    return res;
+}
+
+// Updates the hash_context with the network serialization of all the outputs; if writer is not
+// NULL, the serialization is also appended to the stream stored on the host.
+// returns -1 on error. 0 on success.
+static int hash_outputs(dispatcher_context_t *dc,
+                        cx_hash_t *hash_context,
+                        host_storage_writer_t *writer) {
+    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
+
+    for (unsigned int i = 0; i < state->n_outputs; i++) {
+        if (hash_output(dc, i, hash_context, writer) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Returns true if the wallet policy is a taproot policy with a tree of scripts.
+static bool has_taptree(const sign_psbt_wallet_t *wallet) {
+    return wallet->wallet_policy_map.type == TOKEN_TR &&
+           ((const policy_node_tr_t *) &wallet->wallet_policy_map)->tree != NULL;
+}
+
+// Returns true if the sighash type is supported for the inputs of the wallet policy.
+static bool is_sighash_type_supported(const sign_psbt_wallet_t *wallet, uint32_t sighash_type) {
+    switch (sighash_type) {
+        case SIGHASH_DEFAULT:
+            return wallet->wallet_policy_map.type == TOKEN_TR;
+        case SIGHASH_ALL:
+        case SIGHASH_NONE:
+        case SIGHASH_SINGLE:
+        case SIGHASH_ALL | SIGHASH_ANYONECANPAY:
+        case SIGHASH_NONE | SIGHASH_ANYONECANPAY:
+        case SIGHASH_SINGLE | SIGHASH_ANYONECANPAY:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Gets the outpoint (prevout hash and output index) and the nSequence of the input with the given
+// index and map, serialized as in the transaction, in a TXIN_RECORD_ENTRY_LEN-bytes buffer. For a
+// PSBTv0, they are parsed from the unsigned transaction.
+// returns -1 on error. 0 on success.
+static int get_txin_outpoint_and_sequence(dispatcher_context_t *dc,
+                                          unsigned int input_index,
+                                          const merkleized_map_commitment_t *map,
+                                          uint8_t out[static TXIN_RECORD_ENTRY_LEN]) {
+    const sign_psbt_state_t *state = (const sign_psbt_state_t *) &G_command_state;
+
+    if (state->is_psbt_v0) {
+        txid_parser_outputs_t outputs;
+        if (0 > call_parse_unsigned_tx(dc, state->unsigned_tx_hash, input_index, -1, &outputs)) {
+            return -1;
+        }
+        memcpy(out, outputs.vin_txin_entry, TXIN_RECORD_ENTRY_LEN);
+        return 0;
+    }
+
+    // get prevout hash and output index
+    if (32 != call_get_merkleized_map_value(dc,
+                                            map,
+                                            (uint8_t[]){PSBT_IN_PREVIOUS_TXID},
+                                            1,
+                                            out,
+                                            32)) {
+        return -1;
+    }
+
+    if (4 != call_get_merkleized_map_value(dc,
+                                           map,
+                                           (uint8_t[]){PSBT_IN_OUTPUT_INDEX},
+                                           1,
+                                           out + 32,
+                                           4)) {
+        return -1;
+    }
+
+    if (4 != call_get_merkleized_map_value(dc,
+                                           map,
+                                           (uint8_t[]){PSBT_IN_SEQUENCE},
+                                           1,
+                                           out + 36,
+                                           4)) {
+        // if no PSBT_IN_SEQUENCE is present, we must assume nSequence 0xFFFFFFFF
+        memset(out + 36, 0xFF, 4);
+    }
+    return 0;
+}
+
+// Stores on the host the outpoints and nSequences of all the inputs, and the serialization of all
+// the outputs, so that the legacy sighashes can be computed without fetching them again from the
+// PSBT.
+// returns -1 on error. 0 on success.
+static int store_tx_records(dispatcher_context_t *dc, sign_psbt_state_t *state) {
+    host_storage_writer_t writer;
+    host_storage_writer_init(&writer, TXINS_STREAM_RECORD_ID);
 
-        uint8_t out_script[MAX_OUTPUT_SCRIPTPUBKEY_LEN];
-        int out_script_len = call_get_merkleized_map_value(dc,
-                                                           &ith_map,
-                                                           (uint8_t[]){PSBT_OUT_SCRIPT},
-                                                           1,
-                                                           out_script,
-                                                           sizeof(out_script));
-        if (out_script_len == -1) {
+    for (unsigned int i = 0; i < state->n_inputs; i++) {
+        // get this input's map; not needed for a PSBTv0
+        merkleized_map_commitment_t ith_map;
+
+        if (!state->is_psbt_v0 &&
+            call_get_merkleized_map(dc, state->inputs_root, state->n_inputs, i, &ith_map) < 0) {
+            return -1;
+        }
+
+        uint8_t txin_entry[TXIN_RECORD_ENTRY_LEN];
+        if (get_txin_outpoint_and_sequence(dc, i, &ith_map, txin_entry) < 0 ||
+            call_write_stream(dc, &writer, txin_entry, sizeof(txin_entry)) < 0) {
             return -1;
         }
+    }
+
+    if (call_flush_stream(dc, &writer) < 0) {
+        return -1;
+    }
 
-        crypto_hash_update_varint(hash_context, out_script_len);
-        crypto_hash_update(hash_context, out_script, out_script_len);
+    // the outputs are only hashed in order to reuse hash_outputs; the digest is not needed
+    cx_sha256_t outputs_context;
+    cx_sha256_init(&outputs_context);
+    host_storage_writer_init(&writer, OUTPUTS_STREAM_RECORD_ID);
+    state->outputs_serialization_len = 0;
+
+    if (hash_outputs(dc, &outputs_context.header, &writer) < 0 ||
+        call_flush_stream(dc, &writer) < 0) {
+        return -1;
     }
+
+    state->tx_records_stored = true;
     return 0;
 }
 
@@ -171,215 +417,362 @@ static int get_segwit_version(const uint8_t scriptPubKey[], int scriptPubKey_len
 /*
  Convenience function to get the amount and scriptpubkey from the non-witness-utxo of a certain
  input in a PSBTv2.
- If expected_prevout_hash is not NULL, the function fails if the txid computed from the
- non-witness-utxo does not match the one pointed by expected_prevout_hash. Returns -1 on failure, 0
- on success.
+ If txin_entry (the outpoint and nSequence of the input, as serialized in the transaction) is not
+ NULL, the prevout index is taken from it, and the function fails if the txid computed from the
+ non-witness-utxo does not match its prevout hash; in that case, if the client supports it, the
+ non-witness-utxo is requested without the witnesses, as the txid check is enough to validate the
+ received data. For a PSBTv0, txin_entry is required, as there is no PSBT_IN_OUTPUT_INDEX.
+ The outputs already parsed from a non-witness-utxo with the same hash are taken from the cache,
+ instead of parsing the transaction again.
+ scriptPubKey_len is set to the full length of the scriptPubKey, but only its first
+ MAX_PREVOUT_SCRIPTPUBKEY_LEN bytes are copied in scriptPubKey.
+ Returns -1 on failure, 0 on success.
 */
 static int get_amount_scriptpubkey_from_psbt_nonwitness(
     dispatcher_context_t *dc,
+    sign_psbt_state_t *state,
     const merkleized_map_commitment_t *input_map,
     uint64_t *amount,
     uint8_t scriptPubKey[static MAX_PREVOUT_SCRIPTPUBKEY_LEN],
     size_t *scriptPubKey_len,
-    const uint8_t *expected_prevout_hash) {
+    const uint8_t *txin_entry) {
     // If there is no witness-utxo, it must be the case that this is a legacy input.
     // In this case, we can only retrieve the prevout amount and scriptPubKey by parsing
     // the non-witness-utxo
 
     // Read the prevout index
     uint32_t prevout_n;
-    if (4 != call_get_merkleized_map_value_u32_le(dc,
-                                                  input_map,
-                                                  (uint8_t[]){PSBT_IN_OUTPUT_INDEX},
-                                                  1,
-                                                  &prevout_n)) {
+    if (txin_entry != NULL) {
+        prevout_n = read_u32_le(txin_entry, 32);
+    } else if (state->is_psbt_v0 ||
+               4 != call_get_merkleized_map_value_u32_le(dc,
+                                                         input_map,
+                                                         (uint8_t[]){PSBT_IN_OUTPUT_INDEX},
+                                                         1,
+                                                         &prevout_n)) {
         return -1;
     }
 
-    txid_parser_outputs_t parser_outputs;
-    // request non-witness utxo, and get the prevout's value and scriptpubkey
-    int res = call_psbt_parse_rawtx(dc,
-                                    input_map,
-                                    (uint8_t[]){PSBT_IN_NON_WITNESS_UTXO},
-                                    1,
-                                    prevout_n,
-                                    &parser_outputs);
-    if (res < 0) {
-        PRINTF("Parsing rawtx failed\n");
+    uint8_t value_hash[32];
+    if (0 > call_get_merkleized_map_value_hash(dc,
+                                               input_map,
+                                               (uint8_t[]){PSBT_IN_NON_WITNESS_UTXO},
+                                               1,
+                                               value_hash)) {
         return -1;
     }
 
-    // if expected_prevout_hash is given, check that it matches the txid obtained from the parser
-    if (expected_prevout_hash != NULL &&
-        memcmp(parser_outputs.txid, expected_prevout_hash, 32) != 0) {
+    size_t cache_size =
+        (PREVOUTS_CACHE_SIZE + state->n_prevouts_cache_extra) * sizeof(prevout_cache_entry_t);
+    (void) cache_size;  // only used by the cache statistics
+
+    prevout_cache_entry_t *entry = NULL;
+    prevout_cache_entry_t *lru_entry = &state->prevouts_cache[0];
+    for (size_t i = 0; i < PREVOUTS_CACHE_SIZE + state->n_prevouts_cache_extra; i++) {
+        prevout_cache_entry_t *cur = i < PREVOUTS_CACHE_SIZE
+                                         ? &state->prevouts_cache[i]
+                                         : &state->prevouts_cache_extra[i - PREVOUTS_CACHE_SIZE];
+        if (cur->is_valid && cur->vout == prevout_n &&
+            memcmp(cur->value_hash, value_hash, 32) == 0) {
+            entry = cur;
+            break;
+        }
+
+        // choose an empty entry, or the least recently used one
+        if (lru_entry->is_valid && (!cur->is_valid || cur->last_used < lru_entry->last_used)) {
+            lru_entry = cur;
+        }
+    }
+
+    if (entry == NULL) {
+        PERF_COUNT_CACHE(CACHE_PREVOUTS, misses, cache_size);
+        entry = lru_entry;
+
+        txid_parser_outputs_t parser_outputs;
+        // request non-witness utxo, and get the prevout's value and scriptpubkey
+        bool stripped = txin_entry != NULL && state->use_stripped_rawtx;
+        if (0 > call_parse_rawtx(dc, value_hash, prevout_n, stripped, &parser_outputs)) {
+            PRINTF("Parsing rawtx failed\n");
+            return -1;
+        }
+
+        // the data received without the witnesses is only valid if the txid matches
+        if (stripped && memcmp(parser_outputs.txid, txin_entry, 32) != 0) {
+            PRINTF("Prevout hash did not match non-witness-utxo transaction hash\n");
+            return -1;
+        }
+
+        if (entry->is_valid) {
+            PERF_COUNT_CACHE(CACHE_PREVOUTS, evictions, cache_size);
+        }
+        entry->is_valid = true;
+        memcpy(entry->value_hash, value_hash, 32);
+        entry->vout = prevout_n;
+        entry->amount = parser_outputs.vout_value;
+        memcpy(entry->txid, parser_outputs.txid, 32);
+        entry->scriptPubKey_len = parser_outputs.vout_scriptpubkey_len;
+        memcpy(entry->scriptPubKey,
+               parser_outputs.vout_scriptpubkey,
+               MIN(parser_outputs.vout_scriptpubkey_len, MAX_PREVOUT_SCRIPTPUBKEY_LEN));
+    } else {
+        PERF_COUNT_CACHE(CACHE_PREVOUTS, hits, cache_size);
+    }
+    entry->last_used = ++state->prevouts_cache_counter;
+
+    // if txin_entry is given, check that it matches the txid obtained from the parser
+    if (txin_entry != NULL && memcmp(entry->txid, txin_entry, 32) != 0) {
         PRINTF("Prevout hash did not match non-witness-utxo transaction hash\n");
 
         return -1;
     }
 
-    *amount = parser_outputs.vout_value;
-    *scriptPubKey_len = parser_outputs.vout_scriptpubkey_len;
-    memcpy(scriptPubKey, parser_outputs.vout_scriptpubkey, parser_outputs.vout_scriptpubkey_len);
+    *amount = entry->amount;
+    *scriptPubKey_len = entry->scriptPubKey_len;
+    memcpy(scriptPubKey,
+           entry->scriptPubKey,
+           MIN(entry->scriptPubKey_len, MAX_PREVOUT_SCRIPTPUBKEY_LEN));
 
     return 0;
 }
 
 /*
- Convenience function to get the amount and scriptpubkey from the witness-utxo of a certain input in
- a PSBTv2.
- Returns -1 on failure, 0 on success.
+ Gets the amount and the scriptPubKey of the prevout of an input from its trusted prevout token,
+ whose field has the given key_index in the input map; the token is verified against the outpoint,
+ the first 36 bytes of txin_entry.
+ Returns 1 if the token is valid, 0 if it is not, -1 on failure.
 */
-static int get_amount_scriptpubkey_from_psbt_witness(
+static int get_amount_scriptpubkey_from_prevout_token(
     dispatcher_context_t *dc,
     const merkleized_map_commitment_t *input_map,
+    int key_index,
+    const uint8_t txin_entry[static TXIN_RECORD_ENTRY_LEN],
     uint64_t *amount,
     uint8_t scriptPubKey[static MAX_PREVOUT_SCRIPTPUBKEY_LEN],
     size_t *scriptPubKey_len) {
-    uint8_t raw_witnessUtxo[8 + 1 + MAX_PREVOUT_SCRIPTPUBKEY_LEN];
-
-    int wit_utxo_len = call_get_merkleized_map_value(dc,
-                                                     input_map,
-                                                     (uint8_t[]){PSBT_IN_WITNESS_UTXO},
-                                                     1,
-                                                     raw_witnessUtxo,
-                                                     sizeof(raw_witnessUtxo));
-
-    if (wit_utxo_len < 0) {
+    // <amount : 8> <token : 16> <scriptPubKey>
+    uint8_t value[8 + PREVOUT_TOKEN_LEN + MAX_PREVOUT_SCRIPTPUBKEY_LEN];
+    int value_len =
+        call_get_merkleized_map_value_with_index(dc,
+                                                 input_map,
+                                                 (const uint8_t *) PSBT_PREVOUT_TOKEN_KEY,
+                                                 PSBT_PREVOUT_TOKEN_KEY_LEN,
+                                                 key_index,
+                                                 value,
+                                                 sizeof(value));
+    if (value_len < 0) {
         return -1;
     }
-    int wit_utxo_scriptPubkey_len = raw_witnessUtxo[8];
+    if (value_len <= 8 + PREVOUT_TOKEN_LEN) {
+        return 0;
+    }
 
-    if (wit_utxo_len != 8 + 1 + wit_utxo_scriptPubkey_len) {
-        PRINTF("Length mismatch for witness utxo's scriptPubKey\n");
-        return -1;
+    uint64_t token_amount = read_u64_le(value, 0);
+    const uint8_t *token = value + 8;
+    const uint8_t *script = value + 8 + PREVOUT_TOKEN_LEN;
+    size_t script_len = value_len - 8 - PREVOUT_TOKEN_LEN;
+    if (!check_prevout_token(txin_entry, token_amount, script, script_len, token)) {
+        return 0;
     }
 
-    uint8_t *wit_utxo_scriptPubkey = raw_witnessUtxo + 9;
-    uint64_t wit_utxo_prevout_amount = read_u64_le(&raw_witnessUtxo[0], 0);
+    *amount = token_amount;
+    *scriptPubKey_len = script_len;
+    memcpy(scriptPubKey, script, script_len);
+    return 1;
+}
 
-    *amount = wit_utxo_prevout_amount;
-    *scriptPubKey_len = wit_utxo_scriptPubkey_len;
-    memcpy(scriptPubKey, wit_utxo_scriptPubkey, wit_utxo_scriptPubkey_len);
-    return 0;
+/**
+ * Callback state to stream the witness-utxo of an input, keeping only its beginning.
+ */
+typedef struct {
+    // the amount, the length of the scriptPubKey and the first bytes of the scriptPubKey
+    uint8_t data[8 + 3 + MAX_PREVOUT_SCRIPTPUBKEY_LEN];
+    size_t len;
+    cx_sha256_t *scriptPubKey_hash_context;  // if not NULL, receives all but the amount
+} witness_utxo_cb_state_t;
+
+static void cb_process_witness_utxo_data(buffer_t *data, void *cb_state) {
+    witness_utxo_cb_state_t *state = (witness_utxo_cb_state_t *) cb_state;
+
+    size_t data_len = data->size - data->offset;
+    uint8_t *data_start_ptr = data->ptr + data->offset;
+
+    if (state->scriptPubKey_hash_context != NULL) {
+        size_t skip = state->len < 8 ? MIN(data_len, 8 - state->len) : 0;
+        crypto_hash_update(&state->scriptPubKey_hash_context->header,
+                           data_start_ptr + skip,
+                           data_len - skip);
+    }
+
+    if (state->len < sizeof(state->data)) {
+        size_t n = MIN(data_len, sizeof(state->data) - state->len);
+        memcpy(state->data + state->len, data_start_ptr, n);
+    }
+    state->len += data_len;
 }
 
 /*
- Convenience function to get the amount and scriptpubkey of a certain input in a PSBTv2.
- It first tries to obtain it from the witness-utxo field; in case of failure, it then obtains it
- from the non-witness-utxo.
+ Convenience function to get the amount and scriptpubkey from the witness-utxo of a certain input in
+ a PSBTv2.
+ The witness-utxo is streamed, so that prevouts with a scriptPubKey of any length are supported:
+ scriptPubKey_len is set to the full length of the scriptPubKey, but only its first
+ MAX_PREVOUT_SCRIPTPUBKEY_LEN bytes are copied in scriptPubKey. If scriptPubKey_hash_context is not
+ NULL, the serialized scriptPubKey (prefixed with its length) is accumulated in it, as in the
+ sha_scriptpubkeys of BIP-341.
  Returns -1 on failure, 0 on success.
 */
-static int get_amount_scriptpubkey_from_psbt(
+static int get_amount_scriptpubkey_from_psbt_witness(
     dispatcher_context_t *dc,
     const merkleized_map_commitment_t *input_map,
     uint64_t *amount,
     uint8_t scriptPubKey[static MAX_PREVOUT_SCRIPTPUBKEY_LEN],
-    size_t *scriptPubKey_len) {
-    int ret = get_amount_scriptpubkey_from_psbt_witness(dc,
+    size_t *scriptPubKey_len,
+    cx_sha256_t *scriptPubKey_hash_context) {
+    witness_utxo_cb_state_t cb_state = {.len = 0,
+                                        .scriptPubKey_hash_context = scriptPubKey_hash_context};
+
+    int wit_utxo_len = call_stream_merkleized_map_value(dc,
                                                         input_map,
-                                                        amount,
-                                                        scriptPubKey,
-                                                        scriptPubKey_len);
-    if (ret >= 0) {
-        return ret;
+                                                        (uint8_t[]){PSBT_IN_WITNESS_UTXO},
+                                                        1,
+                                                        NULL,
+                                                        cb_process_witness_utxo_data,
+                                                        &cb_state);
+
+    if (wit_utxo_len < 8 + 1) {
+        return -1;
     }
 
-    return get_amount_scriptpubkey_from_psbt_nonwitness(dc,
-                                                        input_map,
-                                                        amount,
-                                                        scriptPubKey,
-                                                        scriptPubKey_len,
-                                                        NULL);
+    uint64_t wit_utxo_scriptPubkey_len;
+    int varint_len = varint_read(cb_state.data + 8,
+                                 MIN(cb_state.len, sizeof(cb_state.data)) - 8,
+                                 &wit_utxo_scriptPubkey_len);
+
+    // the length must be encoded canonically, as it is hashed as-is in sha_scriptpubkeys
+    if (varint_len < 0 || varint_len != varint_size(wit_utxo_scriptPubkey_len) ||
+        (uint64_t) wit_utxo_len != 8 + varint_len + wit_utxo_scriptPubkey_len) {
+        PRINTF("Length mismatch for witness utxo's scriptPubKey\n");
+        return -1;
+    }
+
+    *amount = read_u64_le(cb_state.data, 0);
+    *scriptPubKey_len = (size_t) wit_utxo_scriptPubkey_len;
+    memcpy(scriptPubKey,
+           cb_state.data + 8 + varint_len,
+           MIN(*scriptPubKey_len, MAX_PREVOUT_SCRIPTPUBKEY_LEN));
+    return 0;
 }
 
 /**
  * Validates the input, initializes the hash context and starts accumulating the wallet header in
  * it.
  */
-void handler_sign_psbt(dispatcher_context_t *dc) {
-    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
-
-    // Device must be unlocked
-    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
-        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
-        return;
+/**
+ * For canonical wallets, verifies that the only key of the wallet policy is our key, and stores its
+ * derivation. The extended pubkey derived from the seed (usually from the cache of the extended
+ * pubkeys) is stored in the cache of the pubkeys of the policy, so that the key information is not
+ * decoded. Returns 0 on success, -1 if the key is not internal, or on error.
+ */
+static int __attribute__((noinline)) load_canonical_wallet_key(dispatcher_context_t *dc,
+                                                               const sign_psbt_state_t *state,
+                                                               sign_psbt_wallet_t *wallet) {
+    uint8_t key_info_str[MAX_POLICY_KEY_INFO_LEN];
+
+    int key_info_len = call_get_merkle_leaf_element(dc,
+                                                    wallet->wallet_header_keys_info_merkle_root,
+                                                    wallet->wallet_header_n_keys,
+                                                    0,  // only one key
+                                                    key_info_str,
+                                                    sizeof(key_info_str));
+    if (key_info_len < 0) {
+        return -1;
     }
 
-    merkleized_map_commitment_t global_map;
-    if (!buffer_read_varint(&dc->read_buffer, &global_map.size)) {
-        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
-        return;
-    }
+    buffer_t key_info_buffer = buffer_create(key_info_str, key_info_len);
 
-    if (!buffer_read_bytes(&dc->read_buffer, global_map.keys_root, 32) ||
-        !buffer_read_bytes(&dc->read_buffer, global_map.values_root, 32)) {
-        LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
-        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
-        return;
+    policy_map_key_info_t key_info;
+    if (parse_policy_map_key_info(&key_info_buffer, &key_info) == -1 ||
+        read_u32_be(key_info.master_key_fingerprint, 0) != state->master_key_fingerprint) {
+        return -1;
     }
 
-    uint64_t n_inputs;
-    if (!buffer_read_varint(&dc->read_buffer, &n_inputs) ||
-        !buffer_read_bytes(&dc->read_buffer, state->inputs_root, 32)) {
-        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
-        return;
+    if (check_key_info_pubkey(&key_info, COIN_CONFIG_BIP32_PUBKEY_VERSION(G_coin_config)) != 1) {
+        return -1;
     }
-    if (n_inputs > MAX_N_INPUTS_CAN_SIGN) {
-        // TODO: remove this limitation
-        PRINTF("At most %d inputs are supported\n", MAX_N_INPUTS_CAN_SIGN);
-        SEND_SW(dc, SW_NOT_SUPPORTED);
-        return;
+
+    // the change step of canonical wallets is the standard one
+    if (key_info.has_wildcard && (key_info.multipath[0] != 0 || key_info.multipath[1] != 1)) {
+        return -1;
     }
-    state->n_inputs = (unsigned int) n_inputs;
 
-    uint64_t n_outputs;
-    if (!buffer_read_varint(&dc->read_buffer, &n_outputs) ||
-        !buffer_read_bytes(&dc->read_buffer, state->outputs_root, 32)) {
-        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
-        return;
+    serialized_extended_pubkey_t ext_pubkey;
+    if (get_extended_pubkey_at_path(key_info.master_key_derivation,
+                                    key_info.master_key_derivation_len,
+                                    COIN_CONFIG_BIP32_PUBKEY_VERSION(G_coin_config),
+                                    &ext_pubkey) == -1) {
+        return -1;
     }
-    state->n_outputs = (unsigned int) n_outputs;
+    policy_pubkeys_cache_set_single_key(&wallet->pubkeys_cache,
+                                        &ext_pubkey,
+                                        key_info.has_wildcard,
+                                        key_info.multipath);
 
-    uint8_t wallet_id[32];
-    uint8_t wallet_hmac[32];
-    if (!buffer_read_bytes(&dc->read_buffer, wallet_id, 32) ||
-        !buffer_read_bytes(&dc->read_buffer, wallet_hmac, 32)) {
-        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
-        return;
+    wallet->our_key_derivation_length = key_info.master_key_derivation_len;
+    for (int i = 0; i < key_info.master_key_derivation_len; i++) {
+        wallet->our_key_derivation[i] = key_info.master_key_derivation[i];
     }
+    return 0;
+}
 
-    // Fetch the serialized wallet policy from the client
+/**
+ * Loads the wallet policy whose id is in wallet->wallet_id: fetches the serialized wallet policy
+ * from the client (unless it is in the wallet session), compiles it, and loads its keys. If the
+ * hmac is all zeros, the wallet policy must be a canonical one; otherwise, the hmac is verified.
+ *
+ * @return SW_OK on success, otherwise the status word of the error.
+ */
+static uint16_t __attribute__((noinline)) load_wallet_policy(dispatcher_context_t *dc,
+                                                             const sign_psbt_state_t *state,
+                                                             sign_psbt_wallet_t *wallet,
+                                                             const uint8_t wallet_hmac[static 32]) {
     uint8_t serialized_wallet_policy[MAX_POLICY_MAP_SERIALIZED_LENGTH];
-    int serialized_wallet_policy_len = call_get_preimage(dc,
-                                                         wallet_id,
+    int serialized_wallet_policy_len = wallet_session_get_policy(wallet->wallet_id,
+                                                                 wallet_hmac,
+                                                                 serialized_wallet_policy,
+                                                                 sizeof(serialized_wallet_policy));
+    if (serialized_wallet_policy_len < 0) {
+        serialized_wallet_policy_len = call_get_preimage(dc,
+                                                         wallet->wallet_id,
                                                          serialized_wallet_policy,
                                                          sizeof(serialized_wallet_policy));
+    }
     if (serialized_wallet_policy_len < 0) {
-        SEND_SW(dc, SW_INCORRECT_DATA);
-        return;
+        return SW_INCORRECT_DATA;
     }
 
     policy_map_wallet_header_t wallet_header;
     buffer_t serialized_wallet_policy_buf =
         buffer_create(serialized_wallet_policy, serialized_wallet_policy_len);
     if ((read_policy_map_wallet(&serialized_wallet_policy_buf, &wallet_header)) < 0) {
-        SEND_SW(dc, SW_INCORRECT_DATA);
-        return;
+        return SW_INCORRECT_DATA;
     }
 
-    memcpy(state->wallet_header_keys_info_merkle_root,
+    // the serialized wallet policy was verified to be the preimage of wallet_id
+    memcpy(wallet->name, wallet_header.name, wallet_header.name_len + 1);
+    memcpy(wallet->wallet_header_keys_info_merkle_root,
            wallet_header.keys_info_merkle_root,
            sizeof(wallet_header.keys_info_merkle_root));
-    state->wallet_header_n_keys = wallet_header.n_keys;
+    wallet->wallet_header_n_keys = wallet_header.n_keys;
 
-    buffer_t policy_map_buffer =
-        buffer_create(&wallet_header.policy_map, wallet_header.policy_map_len);
+    if (parse_wallet_policy_map(&wallet_header,
+                                wallet->wallet_policy_map_bytes,
+                                sizeof(wallet->wallet_policy_map_bytes)) < 0) {
+        return SW_INCORRECT_DATA;
+    }
 
-    if (parse_policy_map(&policy_map_buffer,
-                         state->wallet_policy_map_bytes,
-                         sizeof(state->wallet_policy_map_bytes)) < 0) {
-        SEND_SW(dc, SW_INCORRECT_DATA);
-        return;
+    if (compile_policy_script_template(&wallet->wallet_policy_map,
+                                       &wallet->wallet_script_template) < 0) {
+        PRINTF("Unsupported policy\n");
+        return SW_NOT_SUPPORTED;
     }
 
     uint8_t hmac_or =
@@ -390,26 +783,23 @@ void handler_sign_psbt(dispatcher_context_t *dc) {
     if (hmac_or == 0) {
         // No hmac, verify that the policy is a canonical one that is allowed by default
 
-        if (state->wallet_header_n_keys != 1) {
+        if (wallet->wallet_header_n_keys != 1) {
             PRINTF("Non-standard policy, it should only have 1 key\n");
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
+            return SW_INCORRECT_DATA;
         }
 
-        state->address_type = get_policy_address_type(&state->wallet_policy_map);
-        if (state->address_type == -1) {
+        wallet->address_type = get_policy_address_type(&wallet->wallet_policy_map);
+        if (wallet->address_type == -1) {
             PRINTF("Non-standard policy, and no hmac provided\n");
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
+            return SW_INCORRECT_DATA;
         }
 
-        state->is_wallet_canonical = true;
+        wallet->is_wallet_canonical = true;
 
         // Based on the address type, we set the expected bip44 purpose for this canonical wallet
-        state->bip44_purpose = get_bip44_purpose(state->address_type);
-        if (state->bip44_purpose < 0) {
-            SEND_SW(dc, SW_BAD_STATE);
-            return;
+        wallet->bip44_purpose = get_bip44_purpose(wallet->address_type);
+        if (wallet->bip44_purpose < 0) {
+            return SW_BAD_STATE;
         }
 
         // We do not check here that the purpose field, coin_type and account (first three step of
@@ -417,88 +807,572 @@ void handler_sign_psbt(dispatcher_context_t *dc) {
     } else {
         // Verify hmac
 
-        if (!check_wallet_hmac(wallet_id, wallet_hmac)) {
+        if (!check_wallet_hmac(wallet->wallet_id, wallet_hmac)) {
             PRINTF("Incorrect hmac\n");
-            SEND_SW(dc, SW_SIGNATURE_FAIL);
-            return;
+            return SW_SIGNATURE_FAIL;
         }
 
-        state->is_wallet_canonical = false;
+        wallet->is_wallet_canonical = false;
     }
 
     // Swap feature: check that wallet is canonical
-    if (G_swap_state.called_from_swap && !state->is_wallet_canonical) {
+    if (G_swap_state.called_from_swap && !wallet->is_wallet_canonical) {
         PRINTF("Must be a canonical wallet for swap feature\n");
-        SEND_SW(dc, SW_INCORRECT_DATA);
-        return;
+        return SW_INCORRECT_DATA;
     }
 
-    state->inputs_total_value = 0;
-    state->internal_inputs_total_value = 0;
-    memset(state->internal_inputs, 0, sizeof(state->internal_inputs));
-
-    state->master_key_fingerprint = crypto_get_master_key_fingerprint();
-
-    // process global map
-    {
-        // Check integrity of the global map
-        if (call_check_merkle_tree_sorted(dc, global_map.keys_root, (size_t) global_map.size) < 0) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
-        }
-
-        uint8_t raw_result[9];  // max size for a varint
-        int result_len;
+    memset(&wallet->pubkeys_cache, 0, sizeof(wallet->pubkeys_cache));
+    memset(wallet->script_memo, 0, sizeof(wallet->script_memo));
 
-        // Read tx version
-        result_len = call_get_merkleized_map_value(dc,
-                                                   &global_map,
-                                                   (uint8_t[]){PSBT_GLOBAL_TX_VERSION},
-                                                   1,
-                                                   raw_result,
-                                                   sizeof(raw_result));
-        if (result_len != 4) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
+    if (wallet->is_wallet_canonical) {
+        // the only key is ours: it is derived from the seed instead of being decoded
+        if (load_canonical_wallet_key(dc, state, wallet) < 0) {
+            PRINTF("Couldn't find internal key\n");
+            return SW_BAD_STATE;
         }
-        state->tx_version = read_u32_le(raw_result, 0);
-
-        // Read fallback locktime.
-        // Unlike BIP-0370 recommendation, we use the fallback locktime as-is, ignoring each input's
-        // preferred height/block locktime. If that's relevant, the client must set the fallback
-        // locktime to the appropriate value before calling sign_psbt.
-        result_len = call_get_merkleized_map_value(dc,
-                                                   &global_map,
-                                                   (uint8_t[]){PSBT_GLOBAL_FALLBACK_LOCKTIME},
-                                                   1,
-                                                   raw_result,
-                                                   sizeof(raw_result));
-        if (result_len == -1) {
-            state->locktime = 0;
-        } else if (result_len != 4) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
-        } else {
-            state->locktime = read_u32_le(raw_result, 0);
+    } else if (!wallet_session_load_pubkeys(wallet->wallet_id,
+                                            wallet_hmac,
+                                            &wallet->pubkeys_cache)) {
+        // the keys of the wallet policy are fetched and decoded only once for the whole command
+        if (call_load_policy_pubkeys(dc,
+                                     wallet->wallet_header_keys_info_merkle_root,
+                                     wallet->wallet_header_n_keys,
+                                     &wallet->pubkeys_cache) < 0) {
+            return SW_INCORRECT_DATA;
         }
+    }
+    return SW_OK;
+}
 
-        // we already know n_inputs and n_outputs, so we skip reading from the global map
+/**
+ * Reads the optional list of the inputs to sign, <n_selected_inputs : var> followed by the
+ * strictly increasing indices of the inputs, each a varint, and sets the bits of the selected
+ * inputs in the bitvector selected. If the list is missing or empty, all the inputs are selected.
+ * The list is not supported for transactions with more than MAX_N_INPUTS_CAN_SIGN inputs, whose
+ * bitvector only holds the first chunk of inputs.
+ *
+ * Returns the number of selected inputs in the list (0 if it is missing or empty), or -1 on error.
+ */
+static int read_selected_inputs(buffer_t *buffer, unsigned int n_inputs, uint8_t *selected) {
+    uint64_t n_selected_inputs = 0;
+    if (buffer_can_read(buffer, 1) && !buffer_read_varint(buffer, &n_selected_inputs)) {
+        return -1;
+    }
+    if (n_selected_inputs > n_inputs) {
+        return -1;
     }
 
-    state->cur_input_index = 0;
+    if (n_selected_inputs == 0) {
+        memset(selected, 0xFF, BITVECTOR_REAL_SIZE(MIN(n_inputs, MAX_N_INPUTS_CAN_SIGN)));
+        return 0;
+    }
+    if (n_inputs > MAX_N_INPUTS_CAN_SIGN) {
+        PRINTF("Selected inputs are only supported up to %d inputs\n", MAX_N_INPUTS_CAN_SIGN);
+        return -1;
+    }
 
-    if (state->is_wallet_canonical) {
-        // Canonical wallet, we start processing the psbt directly
-        dc->next(process_input_map);
-    } else {
-        // Show screen to authorize spend from a registered wallet
-        ui_authorize_wallet_spend(dc, wallet_header.name, process_input_map);
+    memset(selected, 0, BITVECTOR_REAL_SIZE(n_inputs));
+    uint64_t prev_input_index = 0;
+    for (uint64_t i = 0; i < n_selected_inputs; i++) {
+        uint64_t input_index;
+        if (!buffer_read_varint(buffer, &input_index) || input_index >= n_inputs ||
+            (i > 0 && input_index <= prev_input_index)) {
+            return -1;
+        }
+        bitvector_set(selected, (unsigned int) input_index, 1);
+        prev_input_index = input_index;
     }
+    return (int) n_selected_inputs;
 }
 
-/** Inputs verification flow
- *
- *  Go though all the inputs:
+// Returns true if data, the rest of the key of a proprietary field after the key type, matches the
+// given key (including its key type).
+static bool is_proprietary_key(const buffer_t *data, const char *key, size_t key_len) {
+    return data->size - data->offset == key_len - 1 &&
+           memcmp(data->ptr + data->offset, key + 1, key_len - 1) == 0;
+}
+
+/**
+ * Callback to process all the keys of the global map; the trusted prevout tokens of the inputs are
+ * only yielded if the map has the proprietary field that requests them. The ids of the other wallet
+ * policies listed in the map are collected in the state.
+ */
+static void global_keys_callback(sign_psbt_state_t *state, buffer_t *data) {
+    uint8_t key_type;
+    if (!buffer_read_u8(data, &key_type) || key_type != PSBT_GLOBAL_PROPRIETARY) {
+        return;
+    }
+
+    if (is_proprietary_key(data, PSBT_PREVOUT_TOKEN_KEY, PSBT_PREVOUT_TOKEN_KEY_LEN)) {
+        state->yield_prevout_tokens = !G_swap_state.called_from_swap;
+    } else if (data->size - data->offset == PSBT_WALLET_POLICY_KEY_LEN - 1 + 32 &&
+               memcmp(data->ptr + data->offset,
+                      PSBT_WALLET_POLICY_KEY + 1,
+                      PSBT_WALLET_POLICY_KEY_LEN - 1) == 0) {
+        // the wallet policies beyond the maximum are only counted, and rejected afterwards
+        if (state->n_wallets < SIGN_PSBT_MAX_WALLET_POLICIES) {
+            memcpy(state->wallets[state->n_wallets].wallet_id,
+                   data->ptr + data->offset + PSBT_WALLET_POLICY_KEY_LEN - 1,
+                   32);
+        }
+        ++state->n_wallets;
+    }
+}
+
+/**
+ * Loads the other wallet policies listed in the global map, whose ids were collected by
+ * global_keys_callback; the hmac of each one is the value of its proprietary field.
+ *
+ * @return SW_OK on success, otherwise the status word of the error.
+ */
+static uint16_t load_other_wallet_policies(dispatcher_context_t *dc,
+                                           sign_psbt_state_t *state,
+                                           const merkleized_map_commitment_t *global_map) {
+    if (state->n_wallets > SIGN_PSBT_MAX_WALLET_POLICIES) {
+        PRINTF("At most %d wallet policies are supported\n", SIGN_PSBT_MAX_WALLET_POLICIES);
+        return SW_NOT_SUPPORTED;
+    }
+
+    // Swap feature: only the inputs of the wallet policy of the command are signed
+    if (G_swap_state.called_from_swap && state->n_wallets > 1) {
+        PRINTF("Only one wallet policy is supported for swap\n");
+        return SW_INCORRECT_DATA;
+    }
+
+    for (unsigned int i = 1; i < state->n_wallets; i++) {
+        sign_psbt_wallet_t *wallet = &state->wallets[i];
+
+        // the keys of the map are unique, but one could repeat the wallet policy of the command
+        if (memcmp(wallet->wallet_id, state->wallets[0].wallet_id, sizeof(wallet->wallet_id)) ==
+            0) {
+            PRINTF("Wallet policy listed twice\n");
+            return SW_INCORRECT_DATA;
+        }
+
+        uint8_t key[PSBT_WALLET_POLICY_KEY_LEN + 32];
+        memcpy(key, PSBT_WALLET_POLICY_KEY, PSBT_WALLET_POLICY_KEY_LEN);
+        memcpy(key + PSBT_WALLET_POLICY_KEY_LEN, wallet->wallet_id, sizeof(wallet->wallet_id));
+
+        uint8_t wallet_hmac[32];
+        if (call_get_merkleized_map_value(dc,
+                                          global_map,
+                                          key,
+                                          sizeof(key),
+                                          wallet_hmac,
+                                          sizeof(wallet_hmac)) != sizeof(wallet_hmac)) {
+            return SW_INCORRECT_DATA;
+        }
+
+        uint16_t sw = load_wallet_policy(dc, state, wallet, wallet_hmac);
+        if (sw != SW_OK) {
+            return sw;
+        }
+    }
+    return SW_OK;
+}
+
+// Returns the position of the bit of input_index in the chunk of the bitvectors of the inputs
+static inline unsigned int get_inputs_chunk_pos(unsigned int input_index) {
+    return input_index % MAX_N_INPUTS_CAN_SIGN;
+}
+
+/**
+ * Stores on the host the chunk of the bitvectors of the internal inputs that contains the current
+ * input, and resets them for the next chunk: all the inputs are selected, and none belongs to the
+ * second wallet policy. Only used for the transactions with more than MAX_N_INPUTS_CAN_SIGN inputs,
+ * once all the inputs of the chunk are processed.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int store_inputs_chunk(dispatcher_context_t *dc, sign_psbt_state_t *state) {
+    uint8_t record[INPUTS_CHUNK_RECORD_LEN] = {0};
+    memcpy(record, state->internal_inputs, INPUTS_CHUNK_BITVECTOR_LEN);
+    if (SIGN_PSBT_MAX_WALLET_POLICIES > 1) {
+        memcpy(record + INPUTS_CHUNK_BITVECTOR_LEN,
+               state->second_wallet_inputs,
+               INPUTS_CHUNK_BITVECTOR_LEN);
+        memset(state->second_wallet_inputs, 0, INPUTS_CHUNK_BITVECTOR_LEN);
+    }
+    memset(state->internal_inputs, 0xFF, INPUTS_CHUNK_BITVECTOR_LEN);
+
+    unsigned int chunk = state->cur_input_index / MAX_N_INPUTS_CAN_SIGN;
+    state->inputs_chunk = chunk + 1;
+    if (call_put_record(dc, INPUTS_CHUNKS_RECORD_ID + chunk, record, sizeof(record)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Makes sure that the chunk of the bitvectors of the internal inputs that contains input_index is
+ * the one in memory, retrieving it from the host if needed. Records are authenticated, therefore the
+ * host cannot change which inputs are internal.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int load_inputs_chunk(dispatcher_context_t *dc,
+                             sign_psbt_state_t *state,
+                             unsigned int input_index) {
+    unsigned int chunk = input_index / MAX_N_INPUTS_CAN_SIGN;
+    if (chunk == state->inputs_chunk) {
+        return 0;
+    }
+
+    uint8_t record[INPUTS_CHUNK_RECORD_LEN];
+    if (call_get_record(dc, INPUTS_CHUNKS_RECORD_ID + chunk, record, sizeof(record)) !=
+        (int) sizeof(record)) {
+        PRINTF("Failed to retrieve the chunk %d of the internal inputs\n", chunk);
+        return -1;
+    }
+    memcpy(state->internal_inputs, record, INPUTS_CHUNK_BITVECTOR_LEN);
+    if (SIGN_PSBT_MAX_WALLET_POLICIES > 1) {
+        memcpy(state->second_wallet_inputs,
+               record + INPUTS_CHUNK_BITVECTOR_LEN,
+               INPUTS_CHUNK_BITVECTOR_LEN);
+    }
+    state->inputs_chunk = chunk;
+    return 0;
+}
+
+// Returns the wallet policy of the internal input at input_index, whose chunk of the bitvectors of
+// the internal inputs must be the one in memory.
+static sign_psbt_wallet_t *get_input_wallet(sign_psbt_state_t *state, unsigned int input_index) {
+    if (state->n_wallets > 1 &&
+        bitvector_get(state->second_wallet_inputs, get_inputs_chunk_pos(input_index))) {
+        return &state->wallets[1];
+    }
+    return &state->wallets[0];
+}
+
+void handler_sign_psbt(dispatcher_context_t *dc) {
+    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
+
+    // Device must be unlocked
+    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
+        return;
+    }
+
+    // the state is at the beginning of the arena; the arrays sized by the PSBT are allocated after
+    if (dispatcher_arena_alloc(dc, sizeof(sign_psbt_state_t)) != state) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
+    }
+
+    merkleized_map_commitment_t global_map;
+    if (!buffer_read_varint(&dc->read_buffer, &global_map.size)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    if (!buffer_read_bytes(&dc->read_buffer, global_map.keys_root, 32) ||
+        !buffer_read_bytes(&dc->read_buffer, global_map.values_root, 32)) {
+        LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    uint64_t n_inputs;
+    if (!buffer_read_varint(&dc->read_buffer, &n_inputs) ||
+        !buffer_read_bytes(&dc->read_buffer, state->inputs_root, 32)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+    // the bitvectors of the internal inputs of larger transactions are stored on the host
+    if (n_inputs > MAX_N_INPUTS_CAN_SIGN_WITH_HOST_STORAGE ||
+        (n_inputs > MAX_N_INPUTS_CAN_SIGN &&
+         (dc->client_capabilities & CLIENT_CAPABILITY_HOST_STORAGE) == 0)) {
+        PRINTF("Too many inputs: %d\n", (int) n_inputs);
+        SEND_SW(dc, SW_NOT_SUPPORTED);
+        return;
+    }
+    state->n_inputs = (unsigned int) n_inputs;
+
+    uint64_t n_outputs;
+    if (!buffer_read_varint(&dc->read_buffer, &n_outputs) ||
+        !buffer_read_bytes(&dc->read_buffer, state->outputs_root, 32)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+    state->n_outputs = (unsigned int) n_outputs;
+
+    // the memory left after the bitvectors of the internal inputs is used for the input summaries
+    size_t inputs_bitvector_len =
+        BITVECTOR_REAL_SIZE(MIN(state->n_inputs, MAX_N_INPUTS_CAN_SIGN));
+    state->inputs_chunk = 0;
+    state->internal_inputs = dispatcher_arena_alloc(dc, inputs_bitvector_len);
+    if (SIGN_PSBT_MAX_WALLET_POLICIES > 1) {
+        state->second_wallet_inputs = dispatcher_arena_alloc(dc, inputs_bitvector_len);
+        if (state->second_wallet_inputs == NULL) {
+            SEND_SW(dc, SW_BAD_STATE);  // should never happen, as the arena has space for it
+            return;
+        }
+        memset(state->second_wallet_inputs, 0, inputs_bitvector_len);
+    }
+    state->max_n_input_summaries =
+        MIN(state->n_inputs, dispatcher_arena_available(dc) / sizeof(input_summary_t));
+    state->input_summaries =
+        dispatcher_arena_alloc(dc, state->max_n_input_summaries * sizeof(input_summary_t));
+    if (state->internal_inputs == NULL || state->input_summaries == NULL) {
+        SEND_SW(dc, SW_BAD_STATE);  // should never happen, as the arena has space for the maximum
+        return;
+    }
+
+    // The host's responses take longer for larger transactions (for example, to stream the
+    // previous transactions of the inputs), therefore the timeout grows with the announced size.
+    uint64_t n_in_out = n_inputs + MIN(n_outputs, 0xFFFF);
+    uint64_t timeout_ticks =
+        INTERRUPTION_TIMEOUT_TICKS + SIGN_PSBT_TIMEOUT_TICKS_PER_IN_OUT * n_in_out;
+    io_set_interruption_timeout((uint16_t) MIN(timeout_ticks, MAX_INTERRUPTION_TIMEOUT_TICKS));
+
+    uint8_t wallet_id[32];
+    uint8_t wallet_hmac[32];
+    if (!buffer_read_bytes(&dc->read_buffer, wallet_id, 32) ||
+        !buffer_read_bytes(&dc->read_buffer, wallet_hmac, 32)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    // optional list of the inputs to sign; it is kept in the bitvector of the internal inputs,
+    // whose bits are cleared for the selected inputs that turn out to be external
+    size_t committed_data_len = dc->read_buffer.offset;
+    int n_selected_inputs =
+        read_selected_inputs(&dc->read_buffer, state->n_inputs, state->internal_inputs);
+    if (n_selected_inputs < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    } else if (n_selected_inputs > 0) {
+        committed_data_len = dc->read_buffer.offset;
+    }
+
+    // the data read so far commits to all the maps of the PSBT, to the wallet policy and to the
+    // selected inputs, if any
+    crypto_sha256(dc->read_buffer.ptr, committed_data_len, state->checkpoint.tx_digest);
+
+    // optional checkpoint to resume from: <next_input_index : 4> <token : 32>
+    state->is_resuming = buffer_can_read(&dc->read_buffer, 1);
+    if (state->is_resuming &&
+        (!buffer_read_u32(&dc->read_buffer, &state->checkpoint.next_input_index, BE) ||
+         !buffer_read_bytes(&dc->read_buffer, state->resume_token, sizeof(state->resume_token)) ||
+         buffer_can_read(&dc->read_buffer, 1))) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    state->master_key_fingerprint = crypto_get_master_key_fingerprint();
+
+    // the wallet policy of the command; the other ones are listed in the global map
+    state->n_wallets = 1;
+    state->wallet = &state->wallets[0];
+    memcpy(state->wallet->wallet_id, wallet_id, sizeof(state->wallet->wallet_id));
+    uint16_t sw = load_wallet_policy(dc, state, state->wallet, wallet_hmac);
+    if (sw != SW_OK) {
+        SEND_SW(dc, sw);
+        return;
+    }
+
+    // Swap feature: the transaction is always validated against the request from app-exchange
+    if (G_swap_state.called_from_swap && state->is_resuming) {
+        PRINTF("Checkpoints are not supported for swap\n");
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    // Swap feature: the destination address is decoded once, and compared with the scriptPubKey
+    // of the external output
+    if (G_swap_state.called_from_swap) {
+        int swap_script_len =
+            get_address_script(G_swap_state.destination_address, G_coin_config, state->swap_script);
+        if (swap_script_len < 0) {
+            PRINTF("Invalid destination address for swap\n");
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+        state->swap_script_len = (uint8_t) swap_script_len;
+    }
+
+    state->inputs_total_value = 0;
+    state->internal_inputs_total_value = 0;
+    state->n_internal_inputs = 0;
+    state->n_input_summaries = 0;
+    state->show_missing_nonwitnessutxo_warning = false;
+    state->show_nondefault_sighash_warning = false;
+
+    state->use_batched_yield = (dc->client_capabilities & CLIENT_CAPABILITY_BATCHED_YIELD) != 0;
+    state->n_yield_buffer_elements = 0;
+    state->use_compact_signatures =
+        (dc->client_capabilities & CLIENT_CAPABILITY_COMPACT_SIGNATURES) != 0;
+
+    // the client can only request the batch review if the user enabled it in the settings;
+    // otherwise, the capability is ignored and all the external outputs are reviewed one by one
+    state->use_batch_review = settings_is_batch_review_enabled() &&
+                              (dc->client_capabilities & CLIENT_CAPABILITY_BATCH_REVIEW) != 0 &&
+                              state->n_outputs >= SIGN_PSBT_BATCH_REVIEW_MIN_OUTPUTS;
+    state->yield_buffer_len = 0;
+
+    state->account_key_derived = false;
+    state->change_key_derived = false;
+    state->outputs_verified = false;
+    state->tx_hashes_finalized = false;
+    dc->set_background_task(background_step, background_end);
+    state->tr_seckeys_counter = 0;
+    memset(state->tr_seckeys, 0, sizeof(state->tr_seckeys));
+    state->n_schnorr_batch_entries = 0;
+
+    state->use_checkpoints =
+        (dc->client_capabilities & CLIENT_CAPABILITY_SIGN_PSBT_CHECKPOINTS) != 0 &&
+        !G_swap_state.called_from_swap;
+    state->n_signed_since_checkpoint = 0;
+
+    // the tx-wide hashes for the segwit sighashes are accumulated while verifying the inputs and
+    // the outputs
+    cx_sha256_init(&state->hash_contexts.sha_prevouts);
+    cx_sha256_init(&state->hash_contexts.sha_sequences);
+    cx_sha256_init(&state->hash_contexts.sha_outputs);
+
+    state->use_host_storage = (dc->client_capabilities & CLIENT_CAPABILITY_HOST_STORAGE) != 0;
+    if (state->use_host_storage) {
+        host_storage_init_session();
+    }
+
+    state->use_stripped_rawtx = (dc->client_capabilities & CLIENT_CAPABILITY_STRIPPED_RAWTX) != 0;
+    state->path_cache.is_valid = false;
+    state->prevouts_cache_counter = 0;
+    memset(state->prevouts_cache, 0, sizeof(state->prevouts_cache));
+    size_t arena_size;
+    state->prevouts_cache_extra = (prevout_cache_entry_t *) shared_arena_acquire(&arena_size);
+    state->n_prevouts_cache_extra = arena_size / sizeof(prevout_cache_entry_t);
+    if (state->n_prevouts_cache_extra > 0) {
+        memset(state->prevouts_cache_extra,
+               0,
+               state->n_prevouts_cache_extra * sizeof(prevout_cache_entry_t));
+    }
+
+    // process global map
+    {
+        // Check integrity of the global map
+        // (this also fills the cache of the key indices used for the lookups below)
+        state->yield_prevout_tokens = false;
+        if (call_check_merkleized_map_keys_with_callback(
+                dc,
+                &global_map,
+                make_callback(state, (dispatcher_callback_t) global_keys_callback)) < 0) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+
+        // A PSBTv0 is signed as-is: the fields of the transaction are parsed from the unsigned
+        // transaction when needed, instead of being read from the maps as in a PSBTv2
+        state->is_psbt_v0 = call_get_merkleized_map_value_hash(dc,
+                                                               &global_map,
+                                                               (uint8_t[]){PSBT_GLOBAL_UNSIGNED_TX},
+                                                               1,
+                                                               state->unsigned_tx_hash) >= 0;
+        if (state->is_psbt_v0) {
+            txid_parser_outputs_t outputs;
+            if (0 > call_parse_unsigned_tx(dc, state->unsigned_tx_hash, -1, -1, &outputs) ||
+                outputs.n_inputs != state->n_inputs || outputs.n_outputs != state->n_outputs) {
+                PRINTF("Invalid unsigned transaction\n");
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
+            }
+            state->tx_version = outputs.version;
+            state->locktime = outputs.locktime;
+        } else {
+            uint8_t raw_result[9];  // max size for a varint
+            int result_len;
+
+            // Read tx version
+            result_len = call_get_merkleized_map_value(dc,
+                                                       &global_map,
+                                                       (uint8_t[]){PSBT_GLOBAL_TX_VERSION},
+                                                       1,
+                                                       raw_result,
+                                                       sizeof(raw_result));
+            if (result_len != 4) {
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
+            }
+            state->tx_version = read_u32_le(raw_result, 0);
+
+            // Read fallback locktime.
+            // Unlike BIP-0370 recommendation, we use the fallback locktime as-is, ignoring each
+            // input's preferred height/block locktime. If that's relevant, the client must set the
+            // fallback locktime to the appropriate value before calling sign_psbt.
+            result_len = call_get_merkleized_map_value(dc,
+                                                       &global_map,
+                                                       (uint8_t[]){PSBT_GLOBAL_FALLBACK_LOCKTIME},
+                                                       1,
+                                                       raw_result,
+                                                       sizeof(raw_result));
+            if (result_len == -1) {
+                state->locktime = 0;
+            } else if (result_len != 4) {
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
+            } else {
+                state->locktime = read_u32_le(raw_result, 0);
+            }
+        }
+
+        // we already know n_inputs and n_outputs, so we skip reading from the global map
+
+        sw = load_other_wallet_policies(dc, state, &global_map);
+        if (sw != SW_OK) {
+            SEND_SW(dc, sw);
+            return;
+        }
+    }
+
+    // sha_amounts and sha_scriptpubkeys are only used in the BIP-341 sighash, and only the taproot
+    // wallet policies have segwit v1 internal inputs
+    state->compute_bip341_hashes = false;
+    for (unsigned int i = 0; i < state->n_wallets; i++) {
+        if (state->wallets[i].wallet_policy_map.type == TOKEN_TR) {
+            state->compute_bip341_hashes = true;
+        }
+    }
+    if (state->compute_bip341_hashes) {
+        cx_sha256_init(&state->hash_contexts.sha_amounts);
+        cx_sha256_init(&state->hash_contexts.sha_scriptpubkeys);
+    }
+
+    state->cur_input_index = 0;
+
+    if (state->is_resuming) {
+        // Spend already authorized, we start processing the psbt directly
+        state->n_wallets_authorized = state->n_wallets;
+    } else {
+        state->n_wallets_authorized = 0;
+    }
+    dc->next(authorize_wallets_spend);
+}
+
+// Shows a screen to authorize the spend from each registered wallet policy, in turn; canonical
+// wallets do not need it.
+static void authorize_wallets_spend(dispatcher_context_t *dc) {
+    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    while (state->n_wallets_authorized < state->n_wallets &&
+           state->wallets[state->n_wallets_authorized].is_wallet_canonical) {
+        ++state->n_wallets_authorized;
+    }
+
+    if (state->n_wallets_authorized == state->n_wallets) {
+        dc->next(process_input_map);
+        return;
+    }
+
+    const sign_psbt_wallet_t *wallet = &state->wallets[state->n_wallets_authorized];
+    ++state->n_wallets_authorized;
+    ui_authorize_wallet_spend(dc, wallet->name, authorize_wallets_spend);
+}
+
+/** Inputs verification flow
+ *
+ *  Go though all the inputs:
  *  - verify the non_witness_utxo
  *  - compute value spent
  *  - detect internal inputs that should be signed, and external inputs that shouldn't
@@ -506,7 +1380,8 @@ void handler_sign_psbt(dispatcher_context_t *dc) {
 
 /**
  * Callback to process all the keys of the current input map.
- * Keeps track if the current input has a witness_utxo and/or a redeemScript.
+ * Keeps track if the current input has a witness_utxo and/or a redeemScript, and of the index of
+ * the first BIP32 derivation key and of the fields of the ownership and trusted prevout tokens.
  */
 static void input_keys_callback(sign_psbt_state_t *state, buffer_t *data) {
     size_t data_len = data->size - data->offset;
@@ -529,6 +1404,8 @@ static void input_keys_callback(sign_psbt_state_t *state, buffer_t *data) {
             // use this to identify the change and address_index, it does not matter which of the
             // keys we use here (if there are multiple), as per the assumptions above.
             state->cur.in_out.has_bip32_derivation = true;
+            state->cur.in_out.bip32_derivation_key_type = key_type;
+            state->cur.in_out.bip32_derivation_key_index = (int) state->cur.in_out.n_keys_seen;
 
             // x-only pubkeys for taproot, normal compressed pubkeys otherwise
             size_t key_len = (key_type == PSBT_IN_TAP_BIP32_DERIVATION ? 32 : 33);
@@ -540,8 +1417,27 @@ static void input_keys_callback(sign_psbt_state_t *state, buffer_t *data) {
             ) {
                 state->cur.in_out.unexpected_pubkey_error = true;
             }
+        } else if (key_type == PSBT_IN_PROPRIETARY) {
+            if (is_proprietary_key(data, PSBT_OWNERSHIP_TOKEN_KEY, PSBT_OWNERSHIP_TOKEN_KEY_LEN)) {
+                state->cur.in_out.has_ownership_token = true;
+                state->cur.in_out.ownership_token_key_index = (int) state->cur.in_out.n_keys_seen;
+            } else if (is_proprietary_key(data,
+                                          PSBT_SORTED_KEYS_ORDER_KEY,
+                                          PSBT_SORTED_KEYS_ORDER_KEY_LEN)) {
+                state->cur.in_out.has_sorted_keys_order = true;
+                state->cur.in_out.sorted_keys_order_key_index =
+                    (int) state->cur.in_out.n_keys_seen;
+            } else if (is_proprietary_key(data,
+                                          PSBT_PREVOUT_TOKEN_KEY,
+                                          PSBT_PREVOUT_TOKEN_KEY_LEN)) {
+                state->cur.input.has_prevout_token = true;
+                state->cur.input.prevout_token_key_index = (int) state->cur.in_out.n_keys_seen;
+            }
         }
     }
+
+    // keys are processed in order, so this is the index of the next key in the map
+    ++state->cur.in_out.n_keys_seen;
 }
 
 static void process_input_map(dispatcher_context_t *dc) {
@@ -555,11 +1451,14 @@ static void process_input_map(dispatcher_context_t *dc) {
         return;
     }
 
+    ui_set_progress("Inputs", state->cur_input_index + 1, state->n_inputs);
+
     // Reset cur struct
     memset(&state->cur, 0, sizeof(state->cur));
 
     int res = call_get_merkleized_map_with_callback(
         dc,
+        &state->path_cache,
         state->inputs_root,
         state->n_inputs,
         state->cur_input_index,
@@ -577,42 +1476,73 @@ static void process_input_map(dispatcher_context_t *dc) {
         return;
     }
 
-    // either witness utxo or non-witness utxo (or both) must be present.
-    if (!state->cur.input.has_nonWitnessUtxo && !state->cur.input.has_witnessUtxo) {
+    // either witness utxo or non-witness utxo (or both) must be present; a trusted prevout token
+    // can replace the non-witness utxo
+    if (!state->cur.input.has_nonWitnessUtxo && !state->cur.input.has_witnessUtxo &&
+        !state->cur.input.has_prevout_token) {
         PRINTF("No witness utxo nor non-witness utxo present in input.\n");
         SEND_SW(dc, SW_INCORRECT_DATA);
         return;
     }
 
-    // validate non-witness utxo (if present) and witness utxo (if present)
+    // outpoint and nSequence of the input, as serialized in the transaction
+    uint8_t txin_entry[TXIN_RECORD_ENTRY_LEN];
+    if (get_txin_outpoint_and_sequence(dc,
+                                       state->cur_input_index,
+                                       &state->cur.in_out.map,
+                                       txin_entry) < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
 
-    if (state->cur.input.has_nonWitnessUtxo) {
-        uint8_t prevout_hash[32];
+    // validate the trusted prevout token (if present), non-witness utxo (if present) and witness
+    // utxo (if present); a valid token replaces the non-witness utxo, which is then not parsed
 
-        // check if the prevout_hash of the transaction matches the computed one from the
-        // non-witness utxo
-        if (0 > call_get_merkleized_map_value(dc,
-                                              &state->cur.in_out.map,
-                                              (uint8_t[]){PSBT_IN_PREVIOUS_TXID},
-                                              1,
-                                              prevout_hash,
-                                              sizeof(prevout_hash))) {
+    if (state->cur.input.has_prevout_token) {
+        int res = get_amount_scriptpubkey_from_prevout_token(
+            dc,
+            &state->cur.in_out.map,
+            state->cur.input.prevout_token_key_index,
+            txin_entry,
+            &state->cur.input.prevout_amount,
+            state->cur.in_out.scriptPubKey,
+            &state->cur.in_out.scriptPubKey_len);
+        if (res < 0) {
             SEND_SW(dc, SW_INCORRECT_DATA);
             return;
+        } else if (res == 0) {
+            PRINTF("Invalid trusted prevout token for input %d\n", state->cur_input_index);
+            if (!state->cur.input.has_nonWitnessUtxo && !state->cur.input.has_witnessUtxo) {
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
+            }
         }
+        state->cur.input.is_prevout_trusted = res == 1;
+    }
 
-        // request non-witness utxo, and get the prevout's value and scriptpubkey
+    if (state->cur.input.is_prevout_trusted) {
+        state->inputs_total_value += state->cur.input.prevout_amount;
+    } else if (state->cur.input.has_nonWitnessUtxo) {
+        // request non-witness utxo, and get the prevout's value and scriptpubkey; this also checks
+        // that the prevout_hash of the transaction matches the computed one from the non-witness
+        // utxo
         if (0 > get_amount_scriptpubkey_from_psbt_nonwitness(dc,
+                                                             state,
                                                              &state->cur.in_out.map,
                                                              &state->cur.input.prevout_amount,
                                                              state->cur.in_out.scriptPubKey,
                                                              &state->cur.in_out.scriptPubKey_len,
-                                                             prevout_hash)) {
+                                                             txin_entry)) {
             SEND_SW(dc, SW_INCORRECT_DATA);
             return;
         }
 
         state->inputs_total_value += state->cur.input.prevout_amount;
+
+        if (state->yield_prevout_tokens && yield_prevout_token(dc, state, txin_entry) < 0) {
+            SEND_SW(dc, SW_BAD_STATE);
+            return;
+        }
     }
 
     if (state->cur.input.has_witnessUtxo) {
@@ -620,25 +1550,30 @@ static void process_input_map(dispatcher_context_t *dc) {
         uint8_t wit_utxo_scriptPubkey[MAX_PREVOUT_SCRIPTPUBKEY_LEN];
         uint64_t wit_utxo_prevout_amount;
 
-        if (0 > get_amount_scriptpubkey_from_psbt_witness(dc,
-                                                          &state->cur.in_out.map,
-                                                          &wit_utxo_prevout_amount,
-                                                          wit_utxo_scriptPubkey,
-                                                          &wit_utxo_scriptPubkey_len)) {
+        // the scriptPubKey is accumulated in sha_scriptpubkeys while streaming the witness-utxo
+        if (0 > get_amount_scriptpubkey_from_psbt_witness(
+                    dc,
+                    &state->cur.in_out.map,
+                    &wit_utxo_prevout_amount,
+                    wit_utxo_scriptPubkey,
+                    &wit_utxo_scriptPubkey_len,
+                    state->compute_bip341_hashes ? &state->hash_contexts.sha_scriptpubkeys
+                                                 : NULL)) {
             SEND_SW(dc, SW_INCORRECT_DATA);
             return;
         };
 
-        if (state->cur.input.has_nonWitnessUtxo) {
+        if (state->cur.input.has_nonWitnessUtxo || state->cur.input.is_prevout_trusted) {
             // we already know the scriptPubKey, but we double check that it matches
             if (state->cur.in_out.scriptPubKey_len != wit_utxo_scriptPubkey_len ||
                 memcmp(state->cur.in_out.scriptPubKey,
                        wit_utxo_scriptPubkey,
-                       wit_utxo_scriptPubkey_len) != 0 ||
+                       MIN(wit_utxo_scriptPubkey_len, MAX_PREVOUT_SCRIPTPUBKEY_LEN)) != 0 ||
                 state->cur.input.prevout_amount != wit_utxo_prevout_amount) {
                 PRINTF(
                     "scriptPubKey or amount in non-witness utxo doesn't match with witness utxo\n");
                 SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
             }
         } else {
             // we extract the scriptPubKey and prevout amount from the witness utxo
@@ -648,19 +1583,74 @@ static void process_input_map(dispatcher_context_t *dc) {
             state->cur.in_out.scriptPubKey_len = wit_utxo_scriptPubkey_len;
             memcpy(state->cur.in_out.scriptPubKey,
                    wit_utxo_scriptPubkey,
-                   wit_utxo_scriptPubkey_len);
+                   MIN(wit_utxo_scriptPubkey_len, MAX_PREVOUT_SCRIPTPUBKEY_LEN));
+        }
+    } else if (state->compute_bip341_hashes) {
+        // sha_scriptpubkeys can only be computed if the long scriptPubKey is in a witness-utxo
+        if (state->cur.in_out.scriptPubKey_len > MAX_PREVOUT_SCRIPTPUBKEY_LEN) {
+            PRINTF("Long scriptPubKey without witness-utxo is not supported for taproot wallets\n");
+            SEND_SW(dc, SW_NOT_SUPPORTED);
+            return;
         }
+        crypto_hash_update_varint(&state->hash_contexts.sha_scriptpubkeys.header,
+                                  state->cur.in_out.scriptPubKey_len);
+        crypto_hash_update(&state->hash_contexts.sha_scriptpubkeys.header,
+                           state->cur.in_out.scriptPubKey,
+                           state->cur.in_out.scriptPubKey_len);
+    }
+
+    // Only the beginning of a long scriptPubKey is kept; such an input cannot be internal
+    if (state->cur.in_out.scriptPubKey_len > MAX_PREVOUT_SCRIPTPUBKEY_LEN) {
+        state->cur.input.has_long_scriptPubKey = true;
+        state->cur.in_out.scriptPubKey_len = MAX_PREVOUT_SCRIPTPUBKEY_LEN;
+    }
+
+    // accumulate the tx-wide hashes of the inputs (BIP-143 and BIP-341)
+    crypto_hash_update(&state->hash_contexts.sha_prevouts.header, txin_entry, 36);
+    crypto_hash_update(&state->hash_contexts.sha_sequences.header, txin_entry + 36, 4);
+
+    if (state->compute_bip341_hashes) {
+        uint8_t prevout_amount_le[8];
+        write_u64_le(prevout_amount_le, 0, state->cur.input.prevout_amount);
+        crypto_hash_update(&state->hash_contexts.sha_amounts.header, prevout_amount_le, 8);
     }
 
     dc->next(check_input_owned);
 }
 
+static void fill_input_summary(const sign_psbt_state_t *state, input_summary_t *summary) {
+    memset(summary, 0, sizeof(input_summary_t));
+    summary->input_index = state->cur_input_index;
+    memcpy(&summary->map, &state->cur.in_out.map, sizeof(summary->map));
+    summary->prevout_amount = state->cur.input.prevout_amount;
+    summary->change = state->cur.in_out.change;
+    summary->address_index = state->cur.in_out.address_index;
+    summary->has_witnessUtxo = state->cur.input.has_witnessUtxo;
+    summary->has_nonWitnessUtxo = state->cur.input.has_nonWitnessUtxo;
+    summary->has_redeemScript = state->cur.input.has_redeemScript;
+    summary->has_sighash_type = state->cur.input.has_sighash_type;
+
+    // for legacy inputs, the prevout's scriptPubKey was verified from the non-witness-utxo, and it
+    // is needed again to compute the sighash
+    if (!state->cur.input.has_witnessUtxo) {
+        memcpy(summary->scriptPubKey,
+               state->cur.in_out.scriptPubKey,
+               state->cur.in_out.scriptPubKey_len);
+        summary->scriptPubKey_len = (uint8_t) state->cur.in_out.scriptPubKey_len;
+    }
+}
+
 static void check_input_owned(dispatcher_context_t *dc) {
     sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
 
     LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
 
-    int is_internal = is_in_out_internal(dc, state, &state->cur.in_out, true);
+    // the inputs that are not selected by the host are external, without checking their ownership
+    unsigned int chunk_pos = get_inputs_chunk_pos(state->cur_input_index);
+    bool is_selected = bitvector_get(state->internal_inputs, chunk_pos);
+    int is_internal = !is_selected || state->cur.input.has_long_scriptPubKey
+                          ? 0
+                          : is_in_out_internal(dc, state, &state->cur.in_out, true);
 
     if (is_internal < 0) {
         PRINTF("Error checking if input %d is internal\n", state->cur_input_index);
@@ -668,15 +1658,23 @@ static void check_input_owned(dispatcher_context_t *dc) {
         return;
     } else if (is_internal == 0) {
         PRINTF("INPUT %d is external\n", state->cur_input_index);
+        bitvector_set(state->internal_inputs, chunk_pos, 0);
     } else {
-        bitvector_set(state->internal_inputs, state->cur_input_index, 1);
+        ++state->n_internal_inputs;
         state->internal_inputs_total_value += state->cur.input.prevout_amount;
+        if (state->cur.in_out.wallet_index == 1) {
+            bitvector_set(state->second_wallet_inputs, chunk_pos, 1);
+        }
 
         int segwit_version =
             get_segwit_version(state->cur.in_out.scriptPubKey, state->cur.in_out.scriptPubKey_len);
 
+        // the trusted prevout token proves that the non-witness utxo was verified before
+        bool has_nonWitnessUtxo =
+            state->cur.input.has_nonWitnessUtxo || state->cur.input.is_prevout_trusted;
+
         // For legacy inputs, the non-witness utxo must be present
-        if (segwit_version == -1 && !state->cur.input.has_nonWitnessUtxo) {
+        if (segwit_version == -1 && !has_nonWitnessUtxo) {
             PRINTF("Non-witness utxo missing for legacy input\n");
             SEND_SW(dc, SW_INCORRECT_DATA);
             return;
@@ -684,7 +1682,7 @@ static void check_input_owned(dispatcher_context_t *dc) {
 
         // For segwitv0 inputs, the non-witness utxo _should_ be present; we show a warning
         // to the user otherwise, but we continue nonetheless on approval
-        if (segwit_version == 0 && !state->cur.input.has_nonWitnessUtxo) {
+        if (segwit_version == 0 && !has_nonWitnessUtxo) {
             PRINTF("Non-witness utxo missing for segwitv0 input. Will show a warning.\n");
             state->show_missing_nonwitnessutxo_warning = true;
         }
@@ -695,27 +1693,80 @@ static void check_input_owned(dispatcher_context_t *dc) {
             SEND_SW(dc, SW_INCORRECT_DATA);
             return;
         }
-    }
 
-    ++state->cur_input_index;
-    dc->next(process_input_map);
-}
+        if (state->cur.input.has_sighash_type) {
+            uint32_t sighash_type;
+            if (4 != call_get_merkleized_map_value_u32_le(dc,
+                                                          &state->cur.in_out.map,
+                                                          (uint8_t[]){PSBT_IN_SIGHASH_TYPE},
+                                                          1,
+                                                          &sighash_type)) {
+                PRINTF("Malformed PSBT_IN_SIGHASH_TYPE for input %d\n", state->cur_input_index);
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
+            }
 
-// If there are external inputs, it is unsafe to sign, therefore we warn the user
-static void alert_external_inputs(dispatcher_context_t *dc) {
-    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
+            if (!is_sighash_type_supported(&state->wallets[state->cur.in_out.wallet_index],
+                                           sighash_type)) {
+                PRINTF("Unsupported sighash type for input %d\n", state->cur_input_index);
+                SEND_SW(dc, SW_NOT_SUPPORTED);
+                return;
+            }
 
-    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+            // SIGHASH_SINGLE requires an output with the same index as the input
+            if ((sighash_type & 0x03) == SIGHASH_SINGLE &&
+                state->cur_input_index >= state->n_outputs) {
+                PRINTF("No output matches the SIGHASH_SINGLE input %d\n", state->cur_input_index);
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
+            }
 
-    size_t count_external_inputs = 0;
-    for (unsigned int i = 0; i < state->n_inputs; i++) {
-        if (!bitvector_get(state->internal_inputs, i)) {
-            ++count_external_inputs;
+            if (sighash_type != SIGHASH_ALL && sighash_type != SIGHASH_DEFAULT) {
+                state->show_nondefault_sighash_warning = true;
+            }
         }
-    }
 
-    if (count_external_inputs == 0) {
-        // no external inputs
+        // keep what is needed for signing, if there is space; otherwise, on the host if possible
+        if (state->n_input_summaries < state->max_n_input_summaries) {
+            fill_input_summary(state, &state->input_summaries[state->n_input_summaries]);
+            ++state->n_input_summaries;
+        } else if (state->use_host_storage) {
+            input_summary_t summary;
+            fill_input_summary(state, &summary);
+            if (call_put_record(dc,
+                                state->cur_input_index,
+                                (uint8_t *) &summary,
+                                sizeof(summary)) < 0) {
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
+            }
+        }
+    }
+
+    // the chunks of the bitvectors of the internal inputs of large transactions are stored on the
+    // host once all their inputs are processed
+    if (state->n_inputs > MAX_N_INPUTS_CAN_SIGN &&
+        (get_inputs_chunk_pos(state->cur_input_index) == MAX_N_INPUTS_CAN_SIGN - 1 ||
+         state->cur_input_index == state->n_inputs - 1) &&
+        store_inputs_chunk(dc, state) < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    ++state->cur_input_index;
+    dc->next(process_input_map);
+}
+
+// If there are external inputs, it is unsafe to sign, therefore we warn the user
+static void alert_external_inputs(dispatcher_context_t *dc) {
+    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    size_t count_external_inputs = state->n_inputs - state->n_internal_inputs;
+
+    if (count_external_inputs == 0) {
+        // no external inputs
         dc->next(alert_missing_nonwitnessutxo);
     } else if (count_external_inputs == state->n_inputs) {
         // no internal inputs, nothing to sign
@@ -730,6 +1781,12 @@ static void alert_external_inputs(dispatcher_context_t *dc) {
             return;
         }
 
+        if (state->is_resuming) {
+            // the user was already warned before approving the transaction
+            dc->next(alert_missing_nonwitnessutxo);
+            return;
+        }
+
         // some internal and some external inputs, warn the user first
         ui_warn_external_inputs(dc, alert_missing_nonwitnessutxo);
     }
@@ -741,8 +1798,22 @@ static void alert_missing_nonwitnessutxo(dispatcher_context_t *dc) {
 
     LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
 
-    if (state->show_missing_nonwitnessutxo_warning) {
-        ui_warn_unverified_segwit_inputs(dc, verify_outputs_init);
+    if (state->show_missing_nonwitnessutxo_warning && !state->is_resuming) {
+        ui_warn_unverified_segwit_inputs(dc, alert_nondefault_sighash);
+    } else {
+        dc->next(alert_nondefault_sighash);
+    }
+}
+
+// If any internal input is signed with a non-default sighash type, we warn the user, as such
+// signatures do not commit to the whole transaction
+static void alert_nondefault_sighash(dispatcher_context_t *dc) {
+    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    if (state->show_nondefault_sighash_warning && !state->is_resuming) {
+        ui_warn_nondefault_sighash(dc, verify_outputs_init);
     } else {
         dc->next(verify_outputs_init);
     }
@@ -786,6 +1857,8 @@ static void output_keys_callback(sign_psbt_state_t *state, buffer_t *data) {
             // The first time that we encounter a PSBT_OUT_BIP32_DERIVATION or
             // PSBT_OUT_TAP_BIP32_DERIVATION key, we store the pubkey.
             state->cur.in_out.has_bip32_derivation = true;
+            state->cur.in_out.bip32_derivation_key_type = key_type;
+            state->cur.in_out.bip32_derivation_key_index = (int) state->cur.in_out.n_keys_seen;
 
             // x-only pubkeys for taproot, normal compressed pubkeys otherwise
             size_t key_len = (key_type == PSBT_OUT_TAP_BIP32_DERIVATION ? 32 : 33);
@@ -797,8 +1870,22 @@ static void output_keys_callback(sign_psbt_state_t *state, buffer_t *data) {
             ) {
                 state->cur.in_out.unexpected_pubkey_error = true;
             }
+        } else if (key_type == PSBT_OUT_PROPRIETARY) {
+            if (is_proprietary_key(data, PSBT_OWNERSHIP_TOKEN_KEY, PSBT_OWNERSHIP_TOKEN_KEY_LEN)) {
+                state->cur.in_out.has_ownership_token = true;
+                state->cur.in_out.ownership_token_key_index = (int) state->cur.in_out.n_keys_seen;
+            } else if (is_proprietary_key(data,
+                                          PSBT_SORTED_KEYS_ORDER_KEY,
+                                          PSBT_SORTED_KEYS_ORDER_KEY_LEN)) {
+                state->cur.in_out.has_sorted_keys_order = true;
+                state->cur.in_out.sorted_keys_order_key_index =
+                    (int) state->cur.in_out.n_keys_seen;
+            }
         }
     }
+
+    // keys are processed in order, so this is the index of the next key in the map
+    ++state->cur.in_out.n_keys_seen;
 }
 
 static void process_output_map(dispatcher_context_t *dc) {
@@ -812,11 +1899,14 @@ static void process_output_map(dispatcher_context_t *dc) {
         return;
     }
 
+    ui_set_progress("Outputs", state->cur_output_index + 1, state->n_outputs);
+
     // Reset cur struct
     memset(&state->cur, 0, sizeof(state->cur));
 
     int res = call_get_merkleized_map_with_callback(
         dc,
+        &state->path_cache,
         state->outputs_root,
         state->n_outputs,
         state->cur_output_index,
@@ -837,14 +1927,13 @@ static void process_output_map(dispatcher_context_t *dc) {
 
     uint8_t raw_result[8];
 
-    // Read the output's amount
-    int result_len = call_get_merkleized_map_value(dc,
-                                                   &state->cur.in_out.map,
-                                                   (uint8_t[]){PSBT_OUT_AMOUNT},
-                                                   1,
-                                                   raw_result,
-                                                   sizeof(raw_result));
-    if (result_len != 8) {
+    int result_len = get_output_amount_and_script(dc,
+                                                  state,
+                                                  &state->cur.in_out.map,
+                                                  state->cur_output_index,
+                                                  raw_result,
+                                                  state->cur.in_out.scriptPubKey);
+    if (result_len < 0) {
         SEND_SW(dc, SW_INCORRECT_DATA);
         return;
     }
@@ -853,21 +1942,15 @@ static void process_output_map(dispatcher_context_t *dc) {
     state->cur.output.value = value;
     state->outputs_total_value += value;
 
-    // Read the output's scriptPubKey
-    result_len = call_get_merkleized_map_value(dc,
-                                               &state->cur.in_out.map,
-                                               (uint8_t[]){PSBT_OUT_SCRIPT},
-                                               1,
-                                               state->cur.in_out.scriptPubKey,
-                                               sizeof(state->cur.in_out.scriptPubKey));
-
-    if (result_len == -1 || result_len > (int) sizeof(state->cur.in_out.scriptPubKey)) {
-        SEND_SW(dc, SW_INCORRECT_DATA);
-        return;
-    }
-
     state->cur.in_out.scriptPubKey_len = result_len;
 
+    // accumulate the hash of the serialization of the outputs
+    crypto_hash_update(&state->hash_contexts.sha_outputs.header, raw_result, 8);
+    crypto_hash_update_varint(&state->hash_contexts.sha_outputs.header, result_len);
+    crypto_hash_update(&state->hash_contexts.sha_outputs.header,
+                       state->cur.in_out.scriptPubKey,
+                       result_len);
+
     dc->next(check_output_owned);
 }
 
@@ -886,6 +1969,22 @@ static void check_output_owned(dispatcher_context_t *dc) {
         // external output, user needs to validate
         ++state->external_outputs_count;
 
+        if (G_swap_state.called_from_swap) {
+            // Swap feature: the only external output must pay the destination address
+            if (state->external_outputs_count != 1 ||
+                state->cur.in_out.scriptPubKey_len != state->swap_script_len ||
+                memcmp(state->cur.in_out.scriptPubKey,
+                       state->swap_script,
+                       state->swap_script_len) != 0) {
+                PRINTF("Mismatching external output for swap\n");
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
+            }
+            // no need for user validation during swap
+            dc->next(output_next);
+            return;
+        }
+
         dc->next(output_validate_external);
         return;
     } else {
@@ -899,61 +1998,85 @@ static void check_output_owned(dispatcher_context_t *dc) {
     }
 }
 
-static void output_validate_external(dispatcher_context_t *dc) {
-    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
-
-    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+/**
+ * Formats the address of the current output, or the description of its OP_RETURN script, directly
+ * in the buffer of the UI screen. It is only formatted the first time it is needed for the output;
+ * the following calls return the same buffer.
+ *
+ * @return the formatted string, or NULL if the script of the output is not supported.
+ */
+static const char *format_once(sign_psbt_state_t *state) {
+    size_t output_address_size;
+    char *output_address = ui_get_output_address_buffer(&output_address_size);
+    if (state->cur.output.is_address_formatted) {
+        return output_address;
+    }
 
-    // show this output's address
-    char output_address[MAX(MAX_ADDRESS_LENGTH_STR + 1, MAX_OPRETURN_OUTPUT_DESC_SIZE)];
     int address_len = get_script_address(state->cur.in_out.scriptPubKey,
                                          state->cur.in_out.scriptPubKey_len,
                                          G_coin_config,
                                          output_address,
-                                         sizeof(output_address));
+                                         output_address_size);
     if (address_len < 0) {
         // script does not have an address; check if OP_RETURN
-        if (is_opreturn(state->cur.in_out.scriptPubKey, state->cur.in_out.scriptPubKey_len)) {
-            int res = format_opscript_script(state->cur.in_out.scriptPubKey,
-                                             state->cur.in_out.scriptPubKey_len,
-                                             output_address);
-            if (res == -1) {
-                PRINTF("Invalid or unsupported OP_RETURN for output %d\n", state->cur_output_index);
-                SEND_SW(dc, SW_NOT_SUPPORTED);
-                return;
-            }
-        } else {
+        if (!is_opreturn(state->cur.in_out.scriptPubKey, state->cur.in_out.scriptPubKey_len)) {
             PRINTF("Unknown or unsupported script type for output %d\n", state->cur_output_index);
-            SEND_SW(dc, SW_NOT_SUPPORTED);
-            return;
+            return NULL;
+        }
+        if (format_opscript_script(state->cur.in_out.scriptPubKey,
+                                   state->cur.in_out.scriptPubKey_len,
+                                   output_address) == -1) {
+            PRINTF("Invalid or unsupported OP_RETURN for output %d\n", state->cur_output_index);
+            return NULL;
         }
     }
 
-    if (G_swap_state.called_from_swap) {
-        // Swap feature: do not show the address to the user, but double check it matches the
-        // request from app-exchange; it must be the only external output (checked elsewhere).
-        int swap_addr_len = strlen(G_swap_state.destination_address);
-        if (swap_addr_len != address_len ||
-            0 != strncmp(G_swap_state.destination_address, output_address, address_len)) {
-            // address did not match
-            PRINTF("Mismatching address for swap\n");
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
-        } else {
-            // no need for user vaidation during swap
-            dc->next(output_next);
+    state->cur.output.is_address_formatted = true;
+    return output_address;
+}
+
+/**
+ * Returns true if the script of the current output has an address or is a supported OP_RETURN, as
+ * in format_once; the address itself is not encoded, as it is not shown.
+ */
+static bool is_output_script_supported(sign_psbt_state_t *state) {
+    if (get_script_type(state->cur.in_out.scriptPubKey, state->cur.in_out.scriptPubKey_len) >= 0) {
+        return true;
+    }
+    // the OP_RETURN scripts are only validated by formatting them, which is cheap
+    return format_once(state) != NULL;
+}
+
+// Not used in swap mode, as the external output is checked in check_output_owned instead.
+static void output_validate_external(dispatcher_context_t *dc) {
+    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    if (state->is_resuming || state->use_batch_review) {
+        // the output was already validated by the user before the checkpoint was issued, or the
+        // external outputs are reviewed in summary in confirm_transaction: no address is shown
+        if (!is_output_script_supported(state)) {
+            SEND_SW(dc, SW_NOT_SUPPORTED);
             return;
         }
-    } else {
-        // Show address to the user
-        ui_validate_output(dc,
-                           state->external_outputs_count,
-                           output_address,
-                           G_coin_config->name_short,
-                           state->cur.output.value,
-                           output_next);
+        dc->next(output_next);
+        return;
+    }
+
+    // show this output's address; it is formatted directly in the buffer of the UI screen
+    const char *output_address = format_once(state);
+    if (output_address == NULL) {
+        SEND_SW(dc, SW_NOT_SUPPORTED);
         return;
     }
+
+    ui_validate_output(dc,
+                       state->external_outputs_count,
+                       output_address,
+                       G_coin_config->name_short,
+                       state->cur.output.value,
+                       output_next);
 }
 
 static void output_next(dispatcher_context_t *dc) {
@@ -990,6 +2113,9 @@ static void confirm_transaction(dispatcher_context_t *dc) {
 
     uint64_t fee = state->inputs_total_value - state->outputs_total_value;
 
+    // all the outputs are verified: the tx-wide hashes can be finalized in the background
+    state->outputs_verified = true;
+
     if (G_swap_state.called_from_swap) {
         // Swap feature: check total amount and fees are as expected; moreover, only one external
         // output
@@ -1012,89 +2138,250 @@ static void confirm_transaction(dispatcher_context_t *dc) {
         }
         // No user validation required during swap
         dc->next(sign_init);
+    } else if (state->is_resuming) {
+        // the transaction was approved when the checkpoint was issued, with the same totals
+        state->checkpoint.inputs_total_value = state->inputs_total_value;
+        state->checkpoint.outputs_total_value = state->outputs_total_value;
+        state->checkpoint.change_outputs_total_value = state->change_outputs_total_value;
+        if (!check_sign_psbt_checkpoint_token(&state->checkpoint, state->resume_token)) {
+            PRINTF("Invalid checkpoint\n");
+            SEND_SW(dc, SW_SIGNATURE_FAIL);
+            return;
+        }
+        dc->next(sign_init);
+    } else if (state->use_batch_review) {
+        // The digest of the outputs is the BIP-143 hashOutputs, that the client can compute
+        // independently; it is computed on a copy of the hash context, as the context is still
+        // needed for sha_outputs in sign_init.
+        cx_sha256_t sha_outputs_context;
+        memcpy(&sha_outputs_context,
+               &state->hash_contexts.sha_outputs,
+               sizeof(sha_outputs_context));
+        uint8_t sha_outputs[32];
+        crypto_hash_digest(&sha_outputs_context.header, sha_outputs, 32);
+        uint8_t hash_outputs[32];
+        crypto_sha256(sha_outputs, 32, hash_outputs);
+
+        char digest_hex[2 * SIGN_PSBT_BATCH_REVIEW_DIGEST_LEN + 1];
+        format_hex(hash_outputs, SIGN_PSBT_BATCH_REVIEW_DIGEST_LEN, digest_hex, sizeof(digest_hex));
+
+        ui_validate_batch_outputs(dc,
+                                  state->external_outputs_count,
+                                  G_coin_config->name_short,
+                                  state->outputs_total_value - state->change_outputs_total_value,
+                                  digest_hex,
+                                  confirm_transaction_fee);
     } else {
-        // Show final user validation UI
-        ui_validate_transaction(dc, G_coin_config->name_short, fee, sign_init);
+        dc->next(confirm_transaction_fee);
     }
 }
 
+// Show final user validation UI
+static void confirm_transaction_fee(dispatcher_context_t *dc) {
+    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    uint64_t fee = state->inputs_total_value - state->outputs_total_value;
+    ui_validate_transaction(dc, G_coin_config->name_short, fee, sign_init);
+}
+
 /** SIGNING FLOW
  *
  * Iterate over all inputs. For each input that should be signed, compute and sign sighash.
  */
 
 // entry point for the signing flow
-static void sign_init(dispatcher_context_t *dc) {
-    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
+/**
+ * Checks if a key information of the wallet policy is our key, by deriving the extended pubkey at
+ * its derivation path; if so, the derivation is stored in the state.
+ * Returns 1 if the key is ours, 0 if it is not, or -1 on error.
+ */
+static int __attribute__((noinline)) check_our_key_info(sign_psbt_state_t *state,
+                                                        buffer_t *key_info_buffer) {
+    policy_map_key_info_t our_key_info;
+    if (parse_policy_map_key_info(key_info_buffer, &our_key_info) == -1) {
+        return -1;
+    }
 
-    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+    uint32_t fpr = read_u32_be(our_key_info.master_key_fingerprint, 0);
+    if (fpr != state->master_key_fingerprint) {
+        return 0;
+    }
+
+    // it could be a collision on the fingerprint; we verify that we can actually generate the same
+    // pubkey
+    int ret = check_key_info_pubkey(&our_key_info, COIN_CONFIG_BIP32_PUBKEY_VERSION(G_coin_config));
+    if (ret != 1) {
+        return ret;
+    }
+
+    state->wallet->our_key_derivation_length = our_key_info.master_key_derivation_len;
+    for (int i = 0; i < our_key_info.master_key_derivation_len; i++) {
+        state->wallet->our_key_derivation[i] = our_key_info.master_key_derivation[i];
+    }
+    return 1;
+}
+
+typedef struct {
+    sign_psbt_state_t *state;
+    bool our_key_found;
+} find_our_key_state_t;
+
+// callback of call_stream_merkle_leaves, looking for our key among the streamed key informations
+static int find_our_key_callback(uint32_t key_index, buffer_t *key_info, void *arg) {
+    find_our_key_state_t *find_state = (find_our_key_state_t *) arg;
+    sign_psbt_state_t *state = find_state->state;
+
+    // for taproot policies with a tree of scripts, only signing with the internal key (that is, for
+    // the key path) is supported
+    if (find_state->our_key_found ||
+        (has_taptree(state->wallet) &&
+         key_index != ((const policy_node_tr_t *) &state->wallet->wallet_policy_map)->key_index)) {
+        return 0;
+    }
+
+    int ret = check_our_key_info(state, key_info);
+    if (ret < 0) {
+        return -1;
+    }
+    find_state->our_key_found = (ret == 1);
+    return 0;
+}
+
+// Finalizes the tx-wide hashes accumulated while verifying the inputs and the outputs, unless it
+// was already done.
+static void finalize_tx_hashes(sign_psbt_state_t *state) {
+    if (state->tx_hashes_finalized) {
+        return;
+    }
+    crypto_hash_digest(&state->hash_contexts.sha_prevouts.header, state->hashes.sha_prevouts, 32);
+    if (state->compute_bip341_hashes) {
+        crypto_hash_digest(&state->hash_contexts.sha_amounts.header, state->hashes.sha_amounts, 32);
+        crypto_hash_digest(&state->hash_contexts.sha_scriptpubkeys.header,
+                           state->hashes.sha_scriptpubkeys,
+                           32);
+    }
+    crypto_hash_digest(&state->hash_contexts.sha_sequences.header,
+                       state->hashes.sha_sequences,
+                       32);
+    crypto_hash_digest(&state->hash_contexts.sha_outputs.header, state->hashes.sha_outputs, 32);
+    state->tx_hashes_finalized = true;
+}
+
+/**
+ * Finds and parses our registered key info in the wallet policy being signed; for canonical
+ * wallets, it was already found while loading the key of the policy.
+ *
+ * @return SW_OK on success, otherwise the status word of the error.
+ */
+static uint16_t find_our_key(dispatcher_context_t *dc, sign_psbt_state_t *state) {
+    sign_psbt_wallet_t *wallet = state->wallet;
+
+    bool our_key_found = wallet->is_wallet_canonical;
+    if (!our_key_found && (dc->client_capabilities & CLIENT_CAPABILITY_STREAM_MERKLE_LEAVES) != 0 &&
+        wallet->wallet_header_n_keys <= MAX_STREAM_MERKLE_LEAVES_TREE_SIZE) {
+        // all the key informations are received at once, and verified against the Merkle root
+        find_our_key_state_t find_state = {.state = state, .our_key_found = false};
+        uint8_t key_info_str[MAX_POLICY_KEY_INFO_LEN];
+        if (call_stream_merkle_leaves(dc,
+                                      wallet->wallet_header_keys_info_merkle_root,
+                                      wallet->wallet_header_n_keys,
+                                      key_info_str,
+                                      sizeof(key_info_str),
+                                      find_our_key_callback,
+                                      &find_state) < 0) {
+            return SW_BAD_STATE;  // should never happen
+        }
+        our_key_found = find_state.our_key_found;
+    }
+    for (unsigned int i = 0; !our_key_found && i < wallet->wallet_header_n_keys; i++) {
+        // for taproot policies with a tree of scripts, only signing with the internal key (that is,
+        // for the key path) is supported
+        if (has_taptree(wallet) &&
+            i != ((const policy_node_tr_t *) &wallet->wallet_policy_map)->key_index) {
+            continue;
+        }
 
-    // find and parse our registered key info in the wallet
-    bool our_key_found = false;
-    for (unsigned int i = 0; i < state->wallet_header_n_keys; i++) {
         uint8_t key_info_str[MAX_POLICY_KEY_INFO_LEN];
 
         int key_info_len = call_get_merkle_leaf_element(dc,
-                                                        state->wallet_header_keys_info_merkle_root,
-                                                        state->wallet_header_n_keys,
+                                                        wallet->wallet_header_keys_info_merkle_root,
+                                                        wallet->wallet_header_n_keys,
                                                         i,
                                                         key_info_str,
                                                         sizeof(key_info_str));
 
         if (key_info_len < 0) {
-            SEND_SW(dc, SW_BAD_STATE);  // should never happen
-            return;
+            return SW_BAD_STATE;  // should never happen
         }
 
         // Make a sub-buffer for the pubkey info
         buffer_t key_info_buffer = buffer_create(key_info_str, key_info_len);
 
-        policy_map_key_info_t our_key_info;
-        if (parse_policy_map_key_info(&key_info_buffer, &our_key_info) == -1) {
-            SEND_SW(dc, SW_BAD_STATE);  // should never happen
+        int ret = check_our_key_info(state, &key_info_buffer);
+        if (ret < 0) {
+            return SW_BAD_STATE;
+        }
+        our_key_found = (ret == 1);
+    }
+
+    if (!our_key_found && has_taptree(wallet)) {
+        PRINTF("Signing for the script path of taproot policies is not supported\n");
+        return SW_NOT_SUPPORTED;
+    }
+
+    if (!our_key_found) {
+        PRINTF("Couldn't find internal key\n");
+        // should never happen if we only register wallets with an internal key
+        return SW_BAD_STATE;
+    }
+    return SW_OK;
+}
+
+static void sign_init(dispatcher_context_t *dc) {
+    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    for (unsigned int i = 0; i < state->n_wallets; i++) {
+        state->wallet = &state->wallets[i];
+        uint16_t sw = find_our_key(dc, state);
+        if (sw != SW_OK) {
+            SEND_SW(dc, sw);
             return;
         }
+    }
+    // the keys derived in the background, if any, are the ones of the first wallet policy
+    state->wallet = &state->wallets[0];
 
-        uint32_t fpr = read_u32_be(our_key_info.master_key_fingerprint, 0);
-        if (fpr == state->master_key_fingerprint) {
-            // it could be a collision on the fingerprint; we verify that we can actually generate
-            // the same pubkey
-            char pubkey_derived[MAX_SERIALIZED_PUBKEY_LENGTH + 1];
-            int serialized_pubkey_len =
-                get_serialized_extended_pubkey_at_path(our_key_info.master_key_derivation,
-                                                       our_key_info.master_key_derivation_len,
-                                                       G_coin_config->bip32_pubkey_version,
-                                                       pubkey_derived);
-            if (serialized_pubkey_len == -1) {
-                SEND_SW(dc, SW_BAD_STATE);
-                return;
-            }
+    // usually already done while the user reviewed the transaction
+    finalize_tx_hashes(state);
 
-            if (strncmp(our_key_info.ext_pubkey, pubkey_derived, MAX_SERIALIZED_PUBKEY_LENGTH) ==
-                0) {
-                our_key_found = true;
+    // the hash contexts are not needed anymore; their space is reused for the sighash midstates
+    state->segwit_v0_midstate_sighash_type = SIGHASH_MIDSTATE_NONE;
+    state->segwit_v1_midstate_sighash_type = SIGHASH_MIDSTATE_NONE;
 
-                state->our_key_derivation_length = our_key_info.master_key_derivation_len;
-                for (int i = 0; i < our_key_info.master_key_derivation_len; i++) {
-                    state->our_key_derivation[i] = our_key_info.master_key_derivation[i];
-                }
+    state->tx_records_stored = false;
 
-                break;
-            }
+    state->cur_input_index = 0;
+    state->cur_input_summary = 0;
+    if (state->is_resuming) {
+        // the signatures of the inputs before the checkpoint were already yielded
+        state->cur_input_index = state->checkpoint.next_input_index;
+        while (state->cur_input_summary < state->n_input_summaries &&
+               state->input_summaries[state->cur_input_summary].input_index <
+                   state->cur_input_index) {
+            ++state->cur_input_summary;
         }
     }
 
-    if (!our_key_found) {
-        PRINTF("Couldn't find internal key\n");
-        SEND_SW(
-            dc,
-            SW_BAD_STATE);  // should never happen if we only register wallets with an internal key
+    // the first checkpoint is issued right after the approval of the user
+    if (state->use_checkpoints && yield_checkpoint(dc, state) < 0) {
+        SEND_SW(dc, SW_BAD_STATE);
         return;
     }
 
-    state->segwit_hashes_computed = false;
-
-    state->cur_input_index = 0;
     dc->next(sign_process_input_map);
 }
 
@@ -1104,8 +2391,14 @@ static void sign_process_input_map(dispatcher_context_t *dc) {
     LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
 
     // skip external inputs
-    while (state->cur_input_index < state->n_inputs &&
-           !bitvector_get(state->internal_inputs, state->cur_input_index)) {
+    while (state->cur_input_index < state->n_inputs) {
+        if (load_inputs_chunk(dc, state, state->cur_input_index) < 0) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+        if (bitvector_get(state->internal_inputs, get_inputs_chunk_pos(state->cur_input_index))) {
+            break;
+        }
         PRINTF("Skipping signing external input %d\n", state->cur_input_index);
         ++state->cur_input_index;
     }
@@ -1116,19 +2409,71 @@ static void sign_process_input_map(dispatcher_context_t *dc) {
         return;
     }
 
+    ui_set_progress("Signing", state->cur_input_index + 1, state->n_inputs);
+
+    sign_psbt_wallet_t *wallet = get_input_wallet(state, state->cur_input_index);
+    if (wallet != state->wallet) {
+        // the pending taproot inputs are signed with the keys of the previous wallet policy, that
+        // are then wiped
+        if (sign_schnorr_batch(dc, state) < 0) {
+            wipe_signing_keys(state);
+            SEND_SW(dc, SW_BAD_STATE);
+            return;
+        }
+        wipe_signing_keys(state);
+        state->wallet = wallet;
+    }
+
+    if (state->use_checkpoints &&
+        state->n_signed_since_checkpoint == SIGN_PSBT_CHECKPOINT_INTERVAL &&
+        yield_checkpoint(dc, state) < 0) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
+    }
+    ++state->n_signed_since_checkpoint;
+
     // Reset cur struct
     memset(&state->cur, 0, sizeof(state->cur));
 
-    int res = call_get_merkleized_map_with_callback(
-        dc,
-        state->inputs_root,
-        state->n_inputs,
-        state->cur_input_index,
-        make_callback(state, (dispatcher_callback_t) input_keys_callback),
-        &state->cur.in_out.map);
-    if (res < 0) {
-        SEND_SW(dc, SW_INCORRECT_DATA);
-        return;
+    const input_summary_t *summary = NULL;
+    input_summary_t stored_summary;
+    if (state->cur_input_summary < state->n_input_summaries &&
+        state->input_summaries[state->cur_input_summary].input_index == state->cur_input_index) {
+        summary = &state->input_summaries[state->cur_input_summary];
+        ++state->cur_input_summary;
+    } else if (state->use_host_storage &&
+               call_get_record(dc,
+                               state->cur_input_index,
+                               (uint8_t *) &stored_summary,
+                               sizeof(stored_summary)) == (int) sizeof(stored_summary) &&
+               stored_summary.input_index == state->cur_input_index) {
+        // if the record is not available, the input is processed from scratch
+        summary = &stored_summary;
+    }
+
+    if (summary != NULL) {
+        // the map was already fetched and verified when processing the inputs
+        memcpy(&state->cur.in_out.map, &summary->map, sizeof(state->cur.in_out.map));
+        state->cur.input.prevout_amount = summary->prevout_amount;
+        state->cur.input.has_witnessUtxo = summary->has_witnessUtxo;
+        state->cur.input.has_nonWitnessUtxo = summary->has_nonWitnessUtxo;
+        state->cur.input.has_redeemScript = summary->has_redeemScript;
+        state->cur.input.has_sighash_type = summary->has_sighash_type;
+        memcpy(state->cur.in_out.scriptPubKey, summary->scriptPubKey, summary->scriptPubKey_len);
+        state->cur.in_out.scriptPubKey_len = summary->scriptPubKey_len;
+    } else {
+        int res = call_get_merkleized_map_with_callback(
+            dc,
+            &state->path_cache,
+            state->inputs_root,
+            state->n_inputs,
+            state->cur_input_index,
+            make_callback(state, (dispatcher_callback_t) input_keys_callback),
+            &state->cur.in_out.map);
+        if (res < 0) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
     }
 
     if (!state->cur.input.has_sighash_type) {
@@ -1147,59 +2492,72 @@ static void sign_process_input_map(dispatcher_context_t *dc) {
         }
     }
 
-    // TODO: add support for other sighash flags
-    if (state->cur.input.sighash_type != SIGHASH_ALL) {
-        PRINTF("Only SIGHASH_ALL is currently supported\n");
-        SEND_SW(dc, SW_NOT_SUPPORTED);
+    // already checked while verifying the inputs
+    if (!is_sighash_type_supported(state->wallet, state->cur.input.sighash_type)) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
+    }
+
+    if (summary != NULL) {
+        state->cur.in_out.change = summary->change;
+        state->cur.in_out.address_index = summary->address_index;
+    } else if (sign_input_get_change_and_address_index(dc, state) < 0) {
+        SEND_SW(dc, SW_BAD_STATE);
         return;
     }
 
-    // get path, obtain change and address_index
+    // Sign as segwit input iff it has a witness utxo
+    if (!state->cur.input.has_witnessUtxo) {
+        dc->next(sign_legacy);
+    } else {
+        dc->next(sign_segwit);
+    }
+}
 
+// get path of the current input, obtain change and address_index
+static int sign_input_get_change_and_address_index(dispatcher_context_t *dc,
+                                                   sign_psbt_state_t *state) {
     int bip32_path_len;
     uint32_t bip32_path[MAX_BIP32_PATH_STEPS];
     uint32_t fingerprint;
 
-    if (state->wallet_policy_map.type == TOKEN_TR) {
+    if (state->wallet->wallet_policy_map.type == TOKEN_TR) {
         // taproot input, use PSBT_IN_TAP_BIP32_DERIVATION
         uint8_t key[1 + 32];
         key[0] = PSBT_IN_TAP_BIP32_DERIVATION;
         memcpy(key + 1, state->cur.in_out.bip32_derivation_pubkey, 32);
 
-        bip32_path_len = get_emptyhashes_fingerprint_and_path(dc,
-                                                              &state->cur.in_out.map,
-                                                              key,
-                                                              sizeof(key),
-                                                              &fingerprint,
-                                                              bip32_path);
+        bip32_path_len = get_emptyhashes_fingerprint_and_path(
+            dc,
+            &state->cur.in_out.map,
+            key,
+            sizeof(key),
+            get_bip32_derivation_key_index(&state->cur.in_out, key[0]),
+            &fingerprint,
+            bip32_path);
     } else {
         // legacy or segwitv0 input, use PSBT_IN_BIP32_DERIVATION
         uint8_t key[1 + 33];
         key[0] = PSBT_IN_BIP32_DERIVATION;
         memcpy(key + 1, state->cur.in_out.bip32_derivation_pubkey, 33);
 
-        bip32_path_len = get_fingerprint_and_path(dc,
-                                                  &state->cur.in_out.map,
-                                                  key,
-                                                  sizeof(key),
-                                                  &fingerprint,
-                                                  bip32_path);
+        bip32_path_len = get_fingerprint_and_path(
+            dc,
+            &state->cur.in_out.map,
+            key,
+            sizeof(key),
+            get_bip32_derivation_key_index(&state->cur.in_out, key[0]),
+            &fingerprint,
+            bip32_path);
     }
 
     if (bip32_path_len < 2) {
-        SEND_SW(dc, SW_BAD_STATE);
-        return;
+        return -1;
     }
 
-    state->cur.input.change = bip32_path[bip32_path_len - 2];
-    state->cur.input.address_index = bip32_path[bip32_path_len - 1];
-
-    // Sign as segwit input iff it has a witness utxo
-    if (!state->cur.input.has_witnessUtxo) {
-        dc->next(sign_legacy);
-    } else {
-        dc->next(sign_segwit);
-    }
+    state->cur.in_out.change = bip32_path[bip32_path_len - 2];
+    state->cur.in_out.address_index = bip32_path[bip32_path_len - 1];
+    return 0;
 }
 
 static void sign_legacy(dispatcher_context_t *dc) {
@@ -1211,13 +2569,60 @@ static void sign_legacy(dispatcher_context_t *dc) {
 
     // sign_non_witness(non_witness_utxo.vout[psbt.tx.input_[i].prevout.n].scriptPubKey, i)
 
-    uint64_t tmp;  // unused
-    if (0 > get_amount_scriptpubkey_from_psbt_nonwitness(dc,
-                                                         &state->cur.in_out.map,
-                                                         &tmp,
-                                                         state->cur.in_out.scriptPubKey,
-                                                         &state->cur.in_out.scriptPubKey_len,
-                                                         NULL)) {
+    // the prevout's scriptPubKey is already known if the input has a summary; otherwise, it is
+    // taken from the trusted prevout token if valid, or the non-witness-utxo is parsed again
+    if (state->cur.in_out.scriptPubKey_len == 0) {
+        // the non-witness-utxo was already verified against the outpoint of the input; if it is to
+        // be requested without the witnesses, the txid must be checked again, as the data is not
+        // verified against the commitment of the PSBT. For a PSBTv0, the outpoint is also where the
+        // prevout index is taken from. The token is always verified against the outpoint
+        uint8_t txin_entry[TXIN_RECORD_ENTRY_LEN];
+        bool needs_txin_entry =
+            state->use_stripped_rawtx || state->is_psbt_v0 || state->cur.input.has_prevout_token;
+        if (needs_txin_entry &&
+            get_txin_outpoint_and_sequence(dc,
+                                           state->cur_input_index,
+                                           &state->cur.in_out.map,
+                                           txin_entry) < 0) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+
+        uint64_t tmp;  // unused
+        int res = 0;
+        if (state->cur.input.has_prevout_token) {
+            res = get_amount_scriptpubkey_from_prevout_token(
+                dc,
+                &state->cur.in_out.map,
+                state->cur.input.prevout_token_key_index,
+                txin_entry,
+                &tmp,
+                state->cur.in_out.scriptPubKey,
+                &state->cur.in_out.scriptPubKey_len);
+        }
+        if (res == 0) {
+            res = get_amount_scriptpubkey_from_psbt_nonwitness(
+                dc,
+                state,
+                &state->cur.in_out.map,
+                &tmp,
+                state->cur.in_out.scriptPubKey,
+                &state->cur.in_out.scriptPubKey_len,
+                needs_txin_entry ? txin_entry : NULL);
+        }
+        if (res < 0 || state->cur.in_out.scriptPubKey_len > MAX_PREVOUT_SCRIPTPUBKEY_LEN) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+    }
+
+    // If the client supports it, the data of the other inputs and of the outputs is collected once
+    // and stored on the host, instead of fetching it from the PSBT for each legacy input; that is
+    // not needed if the sighash type only commits to the current input and to at most one output
+    bool needs_tx_records = (state->cur.input.sighash_type & SIGHASH_ANYONECANPAY) == 0 ||
+                            (state->cur.input.sighash_type & 0x1F) == SIGHASH_ALL;
+    if (state->use_host_storage && needs_tx_records && !state->tx_records_stored &&
+        store_tx_records(dc, state) < 0) {
         SEND_SW(dc, SW_INCORRECT_DATA);
         return;
     }
@@ -1233,54 +2638,56 @@ static void sign_legacy_compute_sighash(dispatcher_context_t *dc) {
     cx_sha256_t sighash_context;
     cx_sha256_init(&sighash_context);
 
-    uint8_t tmp[4];
+    uint32_t sighash_base = state->cur.input.sighash_type & 0x1F;
+    bool anyonecanpay = (state->cur.input.sighash_type & SIGHASH_ANYONECANPAY) != 0;
+
+    uint8_t tmp[8];
     write_u32_le(tmp, 0, state->tx_version);
     crypto_hash_update(&sighash_context.header, tmp, 4);
 
-    crypto_hash_update_varint(&sighash_context.header, state->n_inputs);
+    // with SIGHASH_ANYONECANPAY, only the current input is serialized
+    crypto_hash_update_varint(&sighash_context.header, anyonecanpay ? 1 : state->n_inputs);
+
+    // if the data of the inputs and outputs was stored on the host, it is streamed from there
+    host_storage_reader_t reader;
+    host_storage_reader_init(&reader, TXINS_STREAM_RECORD_ID);
 
     for (unsigned int i = 0; i < state->n_inputs; i++) {
-        // get this input's map
-        merkleized_map_commitment_t ith_map;
+        if (anyonecanpay && i != state->cur_input_index) {
+            continue;
+        }
 
-        if (i != state->cur_input_index) {
-            int res = call_get_merkleized_map(dc, state->inputs_root, state->n_inputs, i, &ith_map);
-            if (res < 0) {
+        // get prevout hash, output index and nSequence for the i-th input
+        uint8_t txin_entry[TXIN_RECORD_ENTRY_LEN];
+
+        if (state->tx_records_stored && !anyonecanpay) {
+            if (call_read_stream(dc, &reader, txin_entry, sizeof(txin_entry)) < 0) {
                 SEND_SW(dc, SW_INCORRECT_DATA);
                 return;
             }
         } else {
-            // Avoid requesting the same map unnecessarily
-            // (might be removed once a caching mechanism is implemented)
-            memcpy(&ith_map, &state->cur.in_out.map, sizeof(state->cur.in_out.map));
-        }
-
-        // get prevout hash and output index for the i-th input
-        uint8_t ith_prevout_hash[32];
-        if (32 != call_get_merkleized_map_value(dc,
-                                                &ith_map,
-                                                (uint8_t[]){PSBT_IN_PREVIOUS_TXID},
-                                                1,
-                                                ith_prevout_hash,
-                                                32)) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
-        }
+            // get this input's map; not needed for a PSBTv0
+            merkleized_map_commitment_t ith_map;
 
-        crypto_hash_update(&sighash_context.header, ith_prevout_hash, 32);
+            if (i == state->cur_input_index) {
+                // Avoid requesting the same map unnecessarily
+                memcpy(&ith_map, &state->cur.in_out.map, sizeof(state->cur.in_out.map));
+            } else if (!state->is_psbt_v0) {
+                int res =
+                    call_get_merkleized_map(dc, state->inputs_root, state->n_inputs, i, &ith_map);
+                if (res < 0) {
+                    SEND_SW(dc, SW_INCORRECT_DATA);
+                    return;
+                }
+            }
 
-        uint8_t ith_prevout_n_raw[4];
-        if (4 != call_get_merkleized_map_value(dc,
-                                               &ith_map,
-                                               (uint8_t[]){PSBT_IN_OUTPUT_INDEX},
-                                               1,
-                                               ith_prevout_n_raw,
-                                               4)) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
+            if (get_txin_outpoint_and_sequence(dc, i, &ith_map, txin_entry) < 0) {
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
+            }
         }
 
-        crypto_hash_update(&sighash_context.header, ith_prevout_n_raw, 4);
+        crypto_hash_update(&sighash_context.header, txin_entry, 36);
 
         if (i != state->cur_input_index) {
             // empty scriptcode
@@ -1296,42 +2703,71 @@ static void sign_legacy_compute_sighash(dispatcher_context_t *dc) {
             } else {
                 // P2SH, the script_code is the redeemScript
 
-                // update sighash_context with the length-prefixed redeem script
+                // update sighash_context with the length-prefixed redeem script, checking while
+                // it is streamed that the prevout's scriptPubKey is its P2SH
                 int redeemScript_len =
-                    update_hashes_with_map_value(dc,
-                                                 &state->cur.in_out.map,
-                                                 (uint8_t[]){PSBT_IN_REDEEM_SCRIPT},
-                                                 1,
-                                                 NULL,
-                                                 &sighash_context.header);
+                    update_hashes_with_script(dc,
+                                              &state->cur.in_out.map,
+                                              (uint8_t[]){PSBT_IN_REDEEM_SCRIPT},
+                                              1,
+                                              state->cur.in_out.scriptPubKey,
+                                              state->cur.in_out.scriptPubKey_len,
+                                              &sighash_context.header);
 
                 if (redeemScript_len < 0) {
-                    PRINTF("Error fetching redeemScript\n");
+                    PRINTF("Missing, too long or mismatching redeemScript\n");
                     SEND_SW(dc, SW_INCORRECT_DATA);
                     return;
                 }
             }
         }
 
-        uint8_t ith_nSequence_raw[4];
-        if (4 != call_get_merkleized_map_value(dc,
-                                               &ith_map,
-                                               (uint8_t[]){PSBT_IN_SEQUENCE},
-                                               1,
-                                               ith_nSequence_raw,
-                                               4)) {
-            // if no PSBT_IN_SEQUENCE is present, we must assume nSequence 0xFFFFFFFF
-            memset(ith_nSequence_raw, 0xFF, 4);
+        if (i != state->cur_input_index &&
+            (sighash_base == SIGHASH_NONE || sighash_base == SIGHASH_SINGLE)) {
+            // the nSequence of the other inputs is not committed to
+            crypto_hash_update_u32(&sighash_context.header, 0);
+        } else {
+            crypto_hash_update(&sighash_context.header, txin_entry + 36, 4);
         }
-
-        crypto_hash_update(&sighash_context.header, ith_nSequence_raw, 4);
     }
 
     // outputs
-    crypto_hash_update_varint(&sighash_context.header, state->n_outputs);
-    if (hash_outputs(dc, &sighash_context.header) == -1) {
-        SEND_SW(dc, SW_INCORRECT_DATA);
-        return;
+    if (sighash_base == SIGHASH_NONE) {
+        crypto_hash_update_varint(&sighash_context.header, 0);
+    } else if (sighash_base == SIGHASH_SINGLE) {
+        // the outputs before the one with the same index as the input are replaced with empty ones
+        // (value -1, empty script); the following ones are dropped. The output exists, as checked
+        // while verifying the inputs.
+        crypto_hash_update_varint(&sighash_context.header, state->cur_input_index + 1);
+        memset(tmp, 0xFF, 8);
+        for (unsigned int i = 0; i < state->cur_input_index; i++) {
+            crypto_hash_update(&sighash_context.header, tmp, 8);
+            crypto_hash_update_u8(&sighash_context.header, 0x00);
+        }
+        if (hash_output(dc, state->cur_input_index, &sighash_context.header, NULL) < 0) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+    } else if (state->tx_records_stored) {
+        crypto_hash_update_varint(&sighash_context.header, state->n_outputs);
+
+        host_storage_reader_init(&reader, OUTPUTS_STREAM_RECORD_ID);
+
+        for (size_t pos = 0; pos < state->outputs_serialization_len; pos += 32) {
+            uint8_t chunk[32];
+            size_t chunk_len = MIN(32, state->outputs_serialization_len - pos);
+            if (call_read_stream(dc, &reader, chunk, chunk_len) < 0) {
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
+            }
+            crypto_hash_update(&sighash_context.header, chunk, chunk_len);
+        }
+    } else {
+        crypto_hash_update_varint(&sighash_context.header, state->n_outputs);
+        if (hash_outputs(dc, &sighash_context.header, NULL) == -1) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
     }
 
     // nLocktime
@@ -1344,11 +2780,35 @@ static void sign_legacy_compute_sighash(dispatcher_context_t *dc) {
 
     // compute sighash
     crypto_hash_digest(&sighash_context.header, state->sighash, 32);
-    cx_hash_sha256(state->sighash, 32, state->sighash, 32);
+    crypto_sha256(state->sighash, 32, state->sighash);
 
     dc->next(sign_sighash_ecdsa);
 }
 
+/**
+ * State of the callback that streams the redeemScript of a P2SH-wrapped segwit input.
+ */
+typedef struct {
+    crypto_hash160_ctx_t hash_context;
+    uint8_t *scriptPubKey;  // receives the first MAX_OUTPUT_SCRIPTPUBKEY_LEN bytes of the script
+    size_t len;
+} redeem_script_cb_state_t;
+
+static void cb_process_redeem_script_data(buffer_t *data, void *cb_state) {
+    redeem_script_cb_state_t *state = (redeem_script_cb_state_t *) cb_state;
+
+    size_t data_len = data->size - data->offset;
+    uint8_t *data_start_ptr = data->ptr + data->offset;
+
+    crypto_hash160_update(&state->hash_context, data_start_ptr, data_len);
+
+    if (state->len < MAX_OUTPUT_SCRIPTPUBKEY_LEN) {
+        size_t n = MIN(data_len, MAX_OUTPUT_SCRIPTPUBKEY_LEN - state->len);
+        memcpy(state->scriptPubKey + state->len, data_start_ptr, n);
+    }
+    state->len += data_len;
+}
+
 static void sign_segwit(dispatcher_context_t *dc) {
     sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
 
@@ -1362,24 +2822,39 @@ static void sign_segwit(dispatcher_context_t *dc) {
                                                           &state->cur.in_out.map,
                                                           &amount,
                                                           state->cur.in_out.scriptPubKey,
-                                                          &state->cur.in_out.scriptPubKey_len)) {
+                                                          &state->cur.in_out.scriptPubKey_len,
+                                                          NULL) ||
+            state->cur.in_out.scriptPubKey_len > MAX_PREVOUT_SCRIPTPUBKEY_LEN) {
             SEND_SW(dc, SW_INCORRECT_DATA);
             return;
         }
 
         state->inputs_total_value += amount;
+        state->cur.input.prevout_amount = amount;
 
         if (state->cur.input.has_redeemScript) {
-            // Get redeemScript
-            uint8_t redeemScript[64];
+            uint8_t p2sh_scriptPubKey[2 + 20 + 1];
+            if (state->cur.in_out.scriptPubKey_len != sizeof(p2sh_scriptPubKey)) {
+                PRINTF("witnessUtxo's scriptPubKey is not P2SH\n");
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
+            }
+            memcpy(p2sh_scriptPubKey, state->cur.in_out.scriptPubKey, sizeof(p2sh_scriptPubKey));
+
+            // Stream the redeemScript, computing its hash160; only its beginning is kept, replacing
+            // the prevout's scriptPubKey, as from now on only the redeemScript is needed
+            redeem_script_cb_state_t cb_state = {.scriptPubKey = state->cur.in_out.scriptPubKey,
+                                                 .len = 0};
+            crypto_hash160_init(&cb_state.hash_context);
 
             int redeemScript_length =
-                call_get_merkleized_map_value(dc,
-                                              &state->cur.in_out.map,
-                                              (uint8_t[]){PSBT_IN_REDEEM_SCRIPT},
-                                              1,
-                                              redeemScript,
-                                              sizeof(redeemScript));
+                call_stream_merkleized_map_value(dc,
+                                                 &state->cur.in_out.map,
+                                                 (uint8_t[]){PSBT_IN_REDEEM_SCRIPT},
+                                                 1,
+                                                 NULL,
+                                                 cb_process_redeem_script_data,
+                                                 &cb_state);
             if (redeemScript_length < 0) {
                 PRINTF("Error fetching redeem script\n");
                 SEND_SW(dc, SW_INCORRECT_DATA);
@@ -1389,25 +2864,32 @@ static void sign_segwit(dispatcher_context_t *dc) {
             uint8_t p2sh_redeemscript[2 + 20 + 1];
             p2sh_redeemscript[0] = 0xa9;
             p2sh_redeemscript[1] = 0x14;
-            crypto_hash160(redeemScript, redeemScript_length, p2sh_redeemscript + 2);
+            crypto_hash160_final(&cb_state.hash_context, p2sh_redeemscript + 2);
             p2sh_redeemscript[22] = 0x87;
 
-            if (state->cur.in_out.scriptPubKey_len != 23 ||
-                memcmp(state->cur.in_out.scriptPubKey, p2sh_redeemscript, 23) != 0) {
+            if (memcmp(p2sh_scriptPubKey, p2sh_redeemscript, 23) != 0) {
                 PRINTF("witnessUtxo's scriptPubKey does not match redeemScript\n");
                 SEND_SW(dc, SW_INCORRECT_DATA);
                 return;
             }
 
-            state->cur.input.script_len = redeemScript_length;
-            memcpy(state->cur.input.script, redeemScript, redeemScript_length);
-            segwit_version = get_segwit_version(redeemScript, redeemScript_length);
-        } else {
-            state->cur.input.script_len = state->cur.in_out.scriptPubKey_len;
-            memcpy(state->cur.input.script,
-                   state->cur.in_out.scriptPubKey,
-                   state->cur.in_out.scriptPubKey_len);
+            if ((size_t) redeemScript_length > sizeof(state->cur.in_out.scriptPubKey)) {
+                // too long to be a segwit program
+                segwit_version = -1;
+            } else {
+                segwit_version = get_segwit_version(state->cur.in_out.scriptPubKey,
+                                                    redeemScript_length);
+            }
+            if (segwit_version != 0) {
+                // P2SH-wrapped scripts of other segwit versions are not supported (and, as per
+                // BIP-341, P2SH-wrapped segwit v1 outputs are not taproot)
+                PRINTF("Unsupported P2SH-wrapped segwit version: %d\n", segwit_version);
+                SEND_SW(dc, SW_NOT_SUPPORTED);
+                return;
+            }
 
+            state->cur.in_out.scriptPubKey_len = redeemScript_length;
+        } else {
             segwit_version = get_segwit_version(state->cur.in_out.scriptPubKey,
                                                 state->cur.in_out.scriptPubKey_len);
         }
@@ -1419,141 +2901,11 @@ static void sign_segwit(dispatcher_context_t *dc) {
         }
     }
 
-    // compute all the tx-wide hashes
-
-    if (!state->segwit_hashes_computed) {
-        {
-            // compute sha_prevouts and sha_sequences
-            cx_sha256_t sha_prevouts_context, sha_sequences_context;
-
-            // compute hashPrevouts and hashSequence
-            cx_sha256_init(&sha_prevouts_context);
-            cx_sha256_init(&sha_sequences_context);
-
-            for (unsigned int i = 0; i < state->n_inputs; i++) {
-                // get this input's map
-                merkleized_map_commitment_t ith_map;
-
-                int res =
-                    call_get_merkleized_map(dc, state->inputs_root, state->n_inputs, i, &ith_map);
-                if (res < 0) {
-                    SEND_SW(dc, SW_INCORRECT_DATA);
-                    return;
-                }
-
-                // get prevout hash and output index for the i-th input
-                uint8_t ith_prevout_hash[32];
-                if (32 != call_get_merkleized_map_value(dc,
-                                                        &ith_map,
-                                                        (uint8_t[]){PSBT_IN_PREVIOUS_TXID},
-                                                        1,
-                                                        ith_prevout_hash,
-                                                        32)) {
-                    SEND_SW(dc, SW_INCORRECT_DATA);
-                    return;
-                }
-
-                crypto_hash_update(&sha_prevouts_context.header, ith_prevout_hash, 32);
-
-                uint8_t ith_prevout_n_raw[4];
-                if (4 != call_get_merkleized_map_value(dc,
-                                                       &ith_map,
-                                                       (uint8_t[]){PSBT_IN_OUTPUT_INDEX},
-                                                       1,
-                                                       ith_prevout_n_raw,
-                                                       4)) {
-                    SEND_SW(dc, SW_INCORRECT_DATA);
-                    return;
-                }
-
-                crypto_hash_update(&sha_prevouts_context.header, ith_prevout_n_raw, 4);
-
-                uint8_t ith_nSequence_raw[4];
-                if (4 != call_get_merkleized_map_value(dc,
-                                                       &ith_map,
-                                                       (uint8_t[]){PSBT_IN_SEQUENCE},
-                                                       1,
-                                                       ith_nSequence_raw,
-                                                       4)) {
-                    // if no PSBT_IN_SEQUENCE is present, we must assume nSequence 0xFFFFFFFF
-                    memset(ith_nSequence_raw, 0xFF, 4);
-                }
-
-                crypto_hash_update(&sha_sequences_context.header, ith_nSequence_raw, 4);
-            }
-
-            crypto_hash_digest(&sha_prevouts_context.header, state->hashes.sha_prevouts, 32);
-            crypto_hash_digest(&sha_sequences_context.header, state->hashes.sha_sequences, 32);
-        }
-
-        {
-            // compute sha_outputs
-            cx_sha256_t sha_outputs_context;
-            cx_sha256_init(&sha_outputs_context);
-
-            if (hash_outputs(dc, &sha_outputs_context.header) == -1) {
-                SEND_SW(dc, SW_INCORRECT_DATA);
-                return;
-            }
-
-            crypto_hash_digest(&sha_outputs_context.header, state->hashes.sha_outputs, 32);
-        }
-
-        {
-            // compute sha_amounts and sha_scriptpubkeys
-            // TODO: could be skipped if there are no segwitv1 inputs to sign
-
-            cx_sha256_t sha_amounts_context, sha_scriptpubkeys_context;
-
-            cx_sha256_init(&sha_amounts_context);
-            cx_sha256_init(&sha_scriptpubkeys_context);
-
-            for (unsigned int i = 0; i < state->n_inputs; i++) {
-                // get this input's map
-                merkleized_map_commitment_t ith_map;
-
-                int res =
-                    call_get_merkleized_map(dc, state->inputs_root, state->n_inputs, i, &ith_map);
-                if (res < 0) {
-                    SEND_SW(dc, SW_INCORRECT_DATA);
-                    return;
-                }
-
-                uint64_t in_amount;
-                uint8_t in_scriptPubKey[MAX_PREVOUT_SCRIPTPUBKEY_LEN];
-                size_t in_scriptPubKey_len;
-
-                if (0 > get_amount_scriptpubkey_from_psbt(dc,
-                                                          &ith_map,
-                                                          &in_amount,
-                                                          in_scriptPubKey,
-                                                          &in_scriptPubKey_len)) {
-                    SEND_SW(dc, SW_INCORRECT_DATA);
-                    return;
-                }
-
-                uint8_t in_amount_le[8];
-                write_u64_le(in_amount_le, 0, in_amount);
-                crypto_hash_update(&sha_amounts_context.header, in_amount_le, 8);
-
-                crypto_hash_update_varint(&sha_scriptpubkeys_context.header, in_scriptPubKey_len);
-                crypto_hash_update(&sha_scriptpubkeys_context.header,
-                                   in_scriptPubKey,
-                                   in_scriptPubKey_len);
-            }
-
-            crypto_hash_digest(&sha_amounts_context.header, state->hashes.sha_amounts, 32);
-            crypto_hash_digest(&sha_scriptpubkeys_context.header,
-                               state->hashes.sha_scriptpubkeys,
-                               32);
-        }
-    }
-    state->segwit_hashes_computed = true;
-
+    // the tx-wide hashes were already computed while verifying the inputs and the outputs
     if (segwit_version == 0) {
         dc->next(sign_segwit_v0);
         return;
-    } else if (segwit_version == 1) {
+    } else if (segwit_version == 1 && state->compute_bip341_hashes) {
         dc->next(sign_segwit_v1);
 
         return;
@@ -1563,99 +2915,94 @@ static void sign_segwit(dispatcher_context_t *dc) {
     return;
 }
 
-static void sign_segwit_v0(dispatcher_context_t *dc) {
-    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
-
-    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
-
-    cx_sha256_t sighash_context;
-    cx_sha256_init(&sighash_context);
+// Computes the state of the BIP-143 sighash computation after nVersion, hashPrevouts and
+// hashSequence, that only depend on the sighash type.
+static void compute_segwit_v0_midstate(sign_psbt_state_t *state, uint32_t sighash_type) {
+    cx_sha256_t *midstate = &state->sighash_midstates.segwit_v0;
+    cx_sha256_init(midstate);
 
-    uint8_t tmp[8];
+    uint32_t sighash_base = sighash_type & 0x1F;
+    bool anyonecanpay = (sighash_type & SIGHASH_ANYONECANPAY) != 0;
 
     // nVersion
+    uint8_t tmp[4];
     write_u32_le(tmp, 0, state->tx_version);
-    crypto_hash_update(&sighash_context.header, tmp, 4);
+    crypto_hash_update(&midstate->header, tmp, 4);
 
-    {
-        uint8_t dbl_hash[32];
+    uint8_t dbl_hash[32];
 
-        // add to hash: hashPrevouts = sha256(sha_prevouts)
-        cx_hash_sha256(state->hashes.sha_prevouts, 32, dbl_hash, 32);
-        crypto_hash_update(&sighash_context.header, dbl_hash, 32);
+    // add to hash: hashPrevouts = sha256(sha_prevouts), or 32 zero bytes for ANYONECANPAY
+    if (!anyonecanpay) {
+        crypto_sha256(state->hashes.sha_prevouts, 32, dbl_hash);
+    } else {
+        memset(dbl_hash, 0, 32);
+    }
+    crypto_hash_update(&midstate->header, dbl_hash, 32);
 
-        // add to hash: hashSequence sha256(sha_sequences)
-        cx_hash_sha256(state->hashes.sha_sequences, 32, dbl_hash, 32);
-        crypto_hash_update(&sighash_context.header, dbl_hash, 32);
+    // add to hash: hashSequence sha256(sha_sequences), or 32 zero bytes for ANYONECANPAY, NONE
+    // and SINGLE
+    if (!anyonecanpay && sighash_base != SIGHASH_NONE && sighash_base != SIGHASH_SINGLE) {
+        crypto_sha256(state->hashes.sha_sequences, 32, dbl_hash);
+    } else {
+        memset(dbl_hash, 0, 32);
     }
+    crypto_hash_update(&midstate->header, dbl_hash, 32);
 
-    {
-        // outpoint (32-byte prevout hash, 4-byte index)
-
-        // get prevout hash and output index for the current input
-        uint8_t prevout_hash[32];
-        if (32 != call_get_merkleized_map_value(dc,
-                                                &state->cur.in_out.map,
-                                                (uint8_t[]){PSBT_IN_PREVIOUS_TXID},
-                                                1,
-                                                prevout_hash,
-                                                32)) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
-        }
+    state->segwit_v0_midstate_sighash_type = sighash_type;
+}
 
-        crypto_hash_update(&sighash_context.header, prevout_hash, 32);
+static void sign_segwit_v0(dispatcher_context_t *dc) {
+    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
 
-        uint8_t prevout_n_raw[4];
-        if (4 != call_get_merkleized_map_value(dc,
-                                               &state->cur.in_out.map,
-                                               (uint8_t[]){PSBT_IN_OUTPUT_INDEX},
-                                               1,
-                                               prevout_n_raw,
-                                               4)) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
-        }
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    uint32_t sighash_base = state->cur.input.sighash_type & 0x1F;
+
+    uint8_t tmp[8];
 
-        crypto_hash_update(&sighash_context.header, prevout_n_raw, 4);
+    // nVersion, hashPrevouts and hashSequence, from the midstate for this sighash type
+    if (state->segwit_v0_midstate_sighash_type != state->cur.input.sighash_type) {
+        compute_segwit_v0_midstate(state, state->cur.input.sighash_type);
+    }
+    cx_sha256_t sighash_context;
+    memcpy(&sighash_context, &state->sighash_midstates.segwit_v0, sizeof(sighash_context));
+
+    // outpoint (32-byte prevout hash, 4-byte index) and nSequence of the current input
+    uint8_t txin_entry[TXIN_RECORD_ENTRY_LEN];
+    if (get_txin_outpoint_and_sequence(dc,
+                                       state->cur_input_index,
+                                       &state->cur.in_out.map,
+                                       txin_entry) < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
     }
 
+    crypto_hash_update(&sighash_context.header, txin_entry, 36);
+
+    // the witness program, either the prevout's scriptPubKey or the redeemScript
+    const uint8_t *script = state->cur.in_out.scriptPubKey;
+    size_t script_len = state->cur.in_out.scriptPubKey_len;
+
     // scriptCode
-    if (is_p2wpkh(state->cur.input.script, state->cur.input.script_len)) {
+    if (is_p2wpkh(script, script_len)) {
         // P2WPKH(script[2:22])
         crypto_hash_update_u32(&sighash_context.header, 0x1976a914);
-        crypto_hash_update(&sighash_context.header, state->cur.input.script + 2, 20);
+        crypto_hash_update(&sighash_context.header, script + 2, 20);
         crypto_hash_update_u16(&sighash_context.header, 0x88ac);
-    } else if (is_p2wsh(state->cur.input.script, state->cur.input.script_len)) {
+    } else if (is_p2wsh(script, script_len)) {
         // P2WSH
 
-        // update sighash_context.header with the length-prefixed witnessScript,
-        // and also compute sha256(witnessScript)
-        cx_sha256_t witnessScript_hash_context;
-        cx_sha256_init(&witnessScript_hash_context);
-
-        int witnessScript_len = update_hashes_with_map_value(dc,
-                                                             &state->cur.in_out.map,
-                                                             (uint8_t[]){PSBT_IN_WITNESS_SCRIPT},
-                                                             1,
-                                                             &witnessScript_hash_context.header,
-                                                             &sighash_context.header);
-
+        // update sighash_context.header with the length-prefixed witnessScript, checking while it
+        // is streamed that script == P2WSH(witnessScript)
+        int witnessScript_len = update_hashes_with_script(dc,
+                                                          &state->cur.in_out.map,
+                                                          (uint8_t[]){PSBT_IN_WITNESS_SCRIPT},
+                                                          1,
+                                                          script,
+                                                          script_len,
+                                                          &sighash_context.header);
         if (witnessScript_len < 0) {
-            PRINTF("Error fetching witnessScript\n");
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
-        }
-
-        uint8_t witnessScript_hash[32];
-        crypto_hash_digest(&witnessScript_hash_context.header, witnessScript_hash, 32);
-
-        // check that script == P2WSH(witnessScript)
-        if (state->cur.input.script_len != 2 + 32 || state->cur.input.script[0] != 0x00 ||
-            state->cur.input.script[1] != 0x20 ||
-            memcmp(state->cur.input.script + 2, witnessScript_hash, 32) != 0) {
-            PRINTF("Mismatching witnessScript\n");
-
+            PRINTF("Missing, too long or mismatching witnessScript\n");
             SEND_SW(dc, SW_INCORRECT_DATA);
             return;
         }
@@ -1666,45 +3013,35 @@ static void sign_segwit_v0(dispatcher_context_t *dc) {
     }
 
     {
-        // input value, taken from the WITNESS_UTXO field
-        uint8_t witness_utxo[8 + 1 + MAX_PREVOUT_SCRIPTPUBKEY_LEN];
-
-        int witness_utxo_len = call_get_merkleized_map_value(dc,
-                                                             &state->cur.in_out.map,
-                                                             (uint8_t[]){PSBT_IN_WITNESS_UTXO},
-                                                             1,
-                                                             witness_utxo,
-                                                             sizeof(witness_utxo));
-        if (witness_utxo_len < 8) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
-        }
-
-        crypto_hash_update(&sighash_context.header,
-                           witness_utxo,
-                           8);  // only the first 8 bytes (amount)
+        // input value, already taken from the WITNESS_UTXO field
+        uint8_t amount_raw[8];
+        write_u64_le(amount_raw, 0, state->cur.input.prevout_amount);
+        crypto_hash_update(&sighash_context.header, amount_raw, 8);
     }
 
     // nSequence
-    {
-        uint8_t nSequence_raw[4];
-        if (4 != call_get_merkleized_map_value(dc,
-                                               &state->cur.in_out.map,
-                                               (uint8_t[]){PSBT_IN_SEQUENCE},
-                                               1,
-                                               nSequence_raw,
-                                               4)) {
-            // if no PSBT_IN_SEQUENCE is present, we must assume nSequence 0xFFFFFFFF
-            memset(nSequence_raw, 0xFF, 4);
-        }
-        crypto_hash_update(&sighash_context.header, nSequence_raw, 4);
-    }
+    crypto_hash_update(&sighash_context.header, txin_entry + 36, 4);
 
     {
-        // compute hashOutputs = sha256(sha_outputs)
-
         uint8_t hashOutputs[32];
-        cx_hash_sha256(state->hashes.sha_outputs, 32, hashOutputs, 32);
+
+        if (sighash_base != SIGHASH_NONE && sighash_base != SIGHASH_SINGLE) {
+            // hashOutputs = sha256(sha_outputs)
+            crypto_sha256(state->hashes.sha_outputs, 32, hashOutputs);
+        } else if (sighash_base == SIGHASH_SINGLE) {
+            // hashOutputs is the double sha256 of the output with the same index as the input
+            cx_sha256_t output_context;
+            cx_sha256_init(&output_context);
+            if (hash_output(dc, state->cur_input_index, &output_context.header, NULL) < 0) {
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
+            }
+            crypto_hash_digest(&output_context.header, hashOutputs, 32);
+            crypto_sha256(hashOutputs, 32, hashOutputs);
+        } else {
+            // SIGHASH_NONE
+            memset(hashOutputs, 0, 32);
+        }
 
         crypto_hash_update(&sighash_context.header, hashOutputs, 32);
     }
@@ -1719,128 +3056,403 @@ static void sign_segwit_v0(dispatcher_context_t *dc) {
 
     // compute sighash
     crypto_hash_digest(&sighash_context.header, state->sighash, 32);
-    cx_hash_sha256(state->sighash, 32, state->sighash, 32);
+    crypto_sha256(state->sighash, 32, state->sighash);
 
     dc->next(sign_sighash_ecdsa);
 }
 
-static void sign_segwit_v1(dispatcher_context_t *dc) {
-    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
-
-    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
-
-    cx_sha256_t sighash_context;
-    crypto_tr_tagged_hash_init(&sighash_context, BIP0341_sighash_tag, sizeof(BIP0341_sighash_tag));
+// Computes the state of the BIP-341 sighash computation after the fields of SigMsg that only depend
+// on the sighash type, up to spend_type.
+static void compute_segwit_v1_midstate(sign_psbt_state_t *state, uint8_t sighash_byte) {
+    cx_sha256_t *midstate = &state->sighash_midstates.segwit_v1;
+    crypto_tr_tagged_hash_init_midstate(midstate, BIP0341_tapsighash_midstate);
+    // SigMsg is made of many short fields, that are coalesced into block-sized updates
+    crypto_buffered_hash_t sighash;
+    crypto_buffered_hash_init(&sighash, &midstate->header);
     // the first 0x00 byte is not part of SigMsg
-    crypto_hash_update_u8(&sighash_context.header, 0x00);
-
-    uint8_t tmp[32];
+    crypto_buffered_hash_update_u8(&sighash, 0x00);
 
     // hash type
-    uint8_t sighash_byte = (uint8_t) (state->cur.input.sighash_type & 0xFF);
-    crypto_hash_update_u8(&sighash_context.header, sighash_byte);
+    crypto_buffered_hash_update_u8(&sighash, sighash_byte);
 
     // nVersion
-    write_u32_le(tmp, 0, state->tx_version);
-    crypto_hash_update(&sighash_context.header, tmp, 4);
+    crypto_buffered_hash_update_u32_le(&sighash, state->tx_version);
 
     // nLocktime
-    write_u32_le(tmp, 0, state->locktime);
-    crypto_hash_update(&sighash_context.header, tmp, 4);
+    crypto_buffered_hash_update_u32_le(&sighash, state->locktime);
 
     if ((sighash_byte & 0x80) != SIGHASH_ANYONECANPAY) {
-        crypto_hash_update(&sighash_context.header, state->hashes.sha_prevouts, 32);
-        crypto_hash_update(&sighash_context.header, state->hashes.sha_amounts, 32);
-        crypto_hash_update(&sighash_context.header, state->hashes.sha_scriptpubkeys, 32);
-        crypto_hash_update(&sighash_context.header, state->hashes.sha_sequences, 32);
+        crypto_buffered_hash_update(&sighash, state->hashes.sha_prevouts, 32);
+        crypto_buffered_hash_update(&sighash, state->hashes.sha_amounts, 32);
+        crypto_buffered_hash_update(&sighash, state->hashes.sha_scriptpubkeys, 32);
+        crypto_buffered_hash_update(&sighash, state->hashes.sha_sequences, 32);
     }
 
     if ((sighash_byte & 3) != SIGHASH_NONE && (sighash_byte & 3) != SIGHASH_SINGLE) {
-        crypto_hash_update(&sighash_context.header, state->hashes.sha_outputs, 32);
+        crypto_buffered_hash_update(&sighash, state->hashes.sha_outputs, 32);
     }
 
     // annex and ext_flags not supported, so spend_type = 0
-    crypto_hash_update_u8(&sighash_context.header, 0x00);
+    crypto_buffered_hash_update_u8(&sighash, 0x00);
 
-    if ((sighash_byte & 0x80) == SIGHASH_ANYONECANPAY) {
-        // outpoint (hash)
-        if (32 != call_get_merkleized_map_value(dc,
-                                                &state->cur.in_out.map,
-                                                (uint8_t[]){PSBT_IN_PREVIOUS_TXID},
-                                                1,
-                                                tmp,
-                                                32)) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
-        }
-        crypto_hash_update(&sighash_context.header, tmp, 32);
+    crypto_buffered_hash_flush(&sighash);
+    state->segwit_v1_midstate_sighash_type = sighash_byte;
+}
 
-        // outpoint (output index)
-        if (4 != call_get_merkleized_map_value(dc,
-                                               &state->cur.in_out.map,
-                                               (uint8_t[]){PSBT_IN_OUTPUT_INDEX},
-                                               1,
-                                               tmp,
-                                               4)) {
+static void sign_segwit_v1(dispatcher_context_t *dc) {
+    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    uint8_t sighash_byte = (uint8_t) (state->cur.input.sighash_type & 0xFF);
+
+    // the fields up to spend_type, from the midstate for this sighash type
+    if (state->segwit_v1_midstate_sighash_type != sighash_byte) {
+        compute_segwit_v1_midstate(state, sighash_byte);
+    }
+    cx_sha256_t sighash_context;
+    memcpy(&sighash_context, &state->sighash_midstates.segwit_v1, sizeof(sighash_context));
+    crypto_buffered_hash_t sighash;
+    crypto_buffered_hash_init(&sighash, &sighash_context.header);
+
+    uint8_t tmp[32];
+
+    if ((sighash_byte & 0x80) == SIGHASH_ANYONECANPAY) {
+        // outpoint (hash and output index)
+        uint8_t txin_entry[TXIN_RECORD_ENTRY_LEN];
+        if (get_txin_outpoint_and_sequence(dc,
+                                           state->cur_input_index,
+                                           &state->cur.in_out.map,
+                                           txin_entry) < 0) {
             SEND_SW(dc, SW_INCORRECT_DATA);
             return;
         }
-        crypto_hash_update(&sighash_context.header, tmp, 4);
+        crypto_buffered_hash_update(&sighash, txin_entry, 36);
 
         // amount
         write_u64_le(tmp, 0, state->cur.input.prevout_amount);
-        crypto_hash_update(&sighash_context.header, tmp, 8);
+        crypto_buffered_hash_update(&sighash, tmp, 8);
 
-        // scriptPubKey
-        crypto_hash_update(&sighash_context.header,
-                           state->cur.in_out.scriptPubKey,
-                           state->cur.in_out.scriptPubKey_len);
+        // scriptPubKey, serialized as inside a CTxOut
+        crypto_buffered_hash_update_varint(&sighash, state->cur.in_out.scriptPubKey_len);
+        crypto_buffered_hash_update(&sighash,
+                                    state->cur.in_out.scriptPubKey,
+                                    state->cur.in_out.scriptPubKey_len);
 
         // nSequence
-        if (4 != call_get_merkleized_map_value(dc,
-                                               &state->cur.in_out.map,
-                                               (uint8_t[]){PSBT_IN_SEQUENCE},
-                                               1,
-                                               tmp,
-                                               4)) {
-            // if no PSBT_IN_SEQUENCE is present, we must assume nSequence 0xFFFFFFFF
-            memset(tmp, 0xFF, 4);
-        }
-        crypto_hash_update(&sighash_context.header, tmp, 4);
+        crypto_buffered_hash_update(&sighash, txin_entry + 36, 4);
     } else {
         // input_index
-        write_u32_le(tmp, 0, state->cur_input_index);
-        crypto_hash_update(&sighash_context.header, tmp, 4);
+        crypto_buffered_hash_update_u32_le(&sighash, state->cur_input_index);
     }
 
     // no annex
 
-    // TODO: SIGHASH_SINGLE not implemented
+    if ((sighash_byte & 3) == SIGHASH_SINGLE) {
+        // sha_single_output: sha256 of the output with the same index as the input
+        cx_sha256_t output_context;
+        cx_sha256_init(&output_context);
+        if (hash_output(dc, state->cur_input_index, &output_context.header, NULL) < 0) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+        crypto_hash_digest(&output_context.header, tmp, 32);
+        crypto_buffered_hash_update(&sighash, tmp, 32);
+    }
 
-    crypto_hash_digest(&sighash_context.header, state->sighash, 32);
+    crypto_buffered_hash_digest(&sighash, state->sighash, 32);
 
     dc->next(sign_sighash_schnorr);
 }
 
+// Sends all the signatures accumulated in the yield buffer in a single batched CCMD_YIELD, if any.
+// returns -1 on error. 0 on success.
+static int flush_yielded_signatures(dispatcher_context_t *dc, sign_psbt_state_t *state) {
+    if (state->n_yield_buffer_elements == 0) {
+        return 0;
+    }
+
+    buffer_t req = dc_get_request_buffer(dc);
+    bool ok = buffer_write_u8(&req, CCMD_YIELD) &&
+              buffer_write_u8(&req, state->n_yield_buffer_elements) &&
+              buffer_write_bytes(&req, state->yield_buffer, state->yield_buffer_len);
+
+    state->n_yield_buffer_elements = 0;
+    state->yield_buffer_len = 0;
+
+    if (!ok || dc_exchange(dc, &req) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Wipes all the private keys cached while signing
+static void wipe_signing_keys(sign_psbt_state_t *state) {
+    explicit_bzero(state->account_privkey, sizeof(state->account_privkey));
+    explicit_bzero(state->account_chain_code, sizeof(state->account_chain_code));
+    state->account_key_derived = false;
+
+    explicit_bzero(state->change_privkey, sizeof(state->change_privkey));
+    explicit_bzero(state->change_chain_code, sizeof(state->change_chain_code));
+    state->change_key_derived = false;
+
+    explicit_bzero(state->tr_seckeys, sizeof(state->tr_seckeys));
+}
+
+// Yields an element of the results. If the client supports batched yields, the element is
+// accumulated in the yield buffer instead, which is flushed when full.
+// returns -1 on error. 0 on success.
+static int yield_element(dispatcher_context_t *dc,
+                         sign_psbt_state_t *state,
+                         const uint8_t *el,
+                         size_t el_len) {
+    if (!state->use_batched_yield) {
+        buffer_t req = dc_get_request_buffer(dc);
+        if (!buffer_write_u8(&req, CCMD_YIELD) || !buffer_write_bytes(&req, el, el_len)) {
+            return -1;
+        }
+        return dc_exchange(dc, &req) < 0 ? -1 : 0;
+    }
+
+    if (state->yield_buffer_len + 1 + el_len > sizeof(state->yield_buffer) &&
+        flush_yielded_signatures(dc, state) < 0) {
+        return -1;
+    }
+
+    state->yield_buffer[state->yield_buffer_len] = (uint8_t) el_len;
+    memcpy(state->yield_buffer + state->yield_buffer_len + 1, el, el_len);
+
+    state->yield_buffer_len += 1 + el_len;
+    ++state->n_yield_buffer_elements;
+    return 0;
+}
+
+// Yields the signature of the input at input_index, encoded as <input_index> <sig> <sighash_byte>,
+// where the sighash byte is omitted if sighash_byte is NULL.
+// returns -1 on error. 0 on success.
+static int yield_signature(dispatcher_context_t *dc,
+                           sign_psbt_state_t *state,
+                           unsigned int input_index,
+                           const uint8_t *sig,
+                           size_t sig_len,
+                           const uint8_t *sighash_byte) {
+    uint8_t el[9 + MAX_DER_SIG_LEN + 1];
+    if (sig_len > MAX_DER_SIG_LEN) {
+        return -1;
+    }
+
+    size_t el_len = varint_write(el, 0, input_index);
+    memcpy(el + el_len, sig, sig_len);
+    el_len += sig_len;
+    if (sighash_byte != NULL) {
+        el[el_len++] = *sighash_byte;
+    }
+
+    return yield_element(dc, state, el, el_len);
+}
+
+_Static_assert(MAX_N_INPUTS_CAN_SIGN_WITH_HOST_STORAGE < 0x10000,
+               "The marker of the trusted prevout tokens must not prefix the index of an input");
+
+// Yields the trusted prevout token of the current input, if it spends a legacy or v0 output.
+static int yield_prevout_token(dispatcher_context_t *dc,
+                               sign_psbt_state_t *state,
+                               const uint8_t txin_entry[static TXIN_RECORD_ENTRY_LEN]) {
+    const in_out_info_t *in_out = &state->cur.in_out;
+    if (in_out->scriptPubKey_len > MAX_PREVOUT_SCRIPTPUBKEY_LEN ||
+        get_segwit_version(in_out->scriptPubKey, in_out->scriptPubKey_len) > 0) {
+        return 0;
+    }
+
+    uint8_t el[SIGN_PSBT_PREVOUT_TOKEN_YIELD_LEN];
+    el[0] = SIGN_PSBT_PREVOUT_TOKEN_MARKER;
+    write_u32_be(el, 1, state->cur_input_index);
+    compute_prevout_token(txin_entry,
+                          state->cur.input.prevout_amount,
+                          in_out->scriptPubKey,
+                          in_out->scriptPubKey_len,
+                          el + 5);
+    return yield_element(dc, state, el, sizeof(el));
+}
+
+// Yields a checkpoint, encoded as <SIGN_PSBT_CHECKPOINT_MARKER> <next_input_index : 4> <token>,
+// with the integer in big-endian. The signatures of all the internal inputs before
+// next_input_index are yielded before it; the ones of the pending taproot inputs are not.
+// returns -1 on error. 0 on success.
+static int yield_checkpoint(dispatcher_context_t *dc, sign_psbt_state_t *state) {
+    sign_psbt_checkpoint_t *checkpoint = &state->checkpoint;
+    checkpoint->inputs_total_value = state->inputs_total_value;
+    checkpoint->outputs_total_value = state->outputs_total_value;
+    checkpoint->change_outputs_total_value = state->change_outputs_total_value;
+    checkpoint->next_input_index = state->n_schnorr_batch_entries > 0
+                                       ? state->schnorr_batch[0].input_index
+                                       : state->cur_input_index;
+
+    uint8_t el[SIGN_PSBT_CHECKPOINT_LEN];
+    el[0] = SIGN_PSBT_CHECKPOINT_MARKER;
+    write_u32_be(el, 1, checkpoint->next_input_index);
+    compute_sign_psbt_checkpoint_token(checkpoint, el + 5);
+
+    state->n_signed_since_checkpoint = 0;
+    return yield_element(dc, state, el, sizeof(el));
+}
+
+// Computes the private key and the chain code at our_key_derivation, unless they were already
+// derived (for example, in the background while the user reviewed the transaction).
+// returns -1 on error. 0 on success.
+static int derive_account_private_key(sign_psbt_state_t *state) {
+    if (state->account_key_derived) {
+        return 0;
+    }
+
+    cx_ecfp_private_key_t private_key = {0};
+    int ret = crypto_derive_private_key(&private_key,
+                                        state->account_chain_code,
+                                        state->wallet->our_key_derivation,
+                                        state->wallet->our_key_derivation_length);
+    memcpy(state->account_privkey, private_key.d, sizeof(state->account_privkey));
+    explicit_bzero(&private_key, sizeof(private_key));
+    if (ret < 0) {
+        wipe_signing_keys(state);
+        return -1;
+    }
+    state->account_key_derived = true;
+    return 0;
+}
+
+// Computes the private key at the path our_key_derivation/change/address_index.
+// The private key at our_key_derivation is only derived from the seed for the first signed input;
+// for the following ones, only the last two unhardened steps are computed, or just the last one if
+// the change step is the same as the previous input.
+// returns -1 on error. 0 on success.
+static int derive_input_private_key(sign_psbt_state_t *state,
+                                    uint32_t change,
+                                    uint32_t address_index,
+                                    uint8_t out[static 32]) {
+    if (state->change_key_derived && state->change_key_change == change) {
+        uint8_t chain_code[32];
+        memcpy(out, state->change_privkey, 32);
+        memcpy(chain_code, state->change_chain_code, sizeof(chain_code));
+
+        int ret = 0;
+        if (bip32_CKDpriv(out, chain_code, address_index) < 0) {
+            explicit_bzero(out, 32);
+            ret = -1;
+        }
+        explicit_bzero(chain_code, sizeof(chain_code));
+        return ret;
+    }
+
+    if (!state->account_key_derived && derive_account_private_key(state) < 0) {
+        return -1;
+    }
+
+    memcpy(state->change_privkey, state->account_privkey, 32);
+    memcpy(state->change_chain_code, state->account_chain_code, 32);
+    state->change_key_change = change;
+    if (bip32_CKDpriv(state->change_privkey, state->change_chain_code, state->change_key_change) <
+        0) {
+        explicit_bzero(state->change_privkey, sizeof(state->change_privkey));
+        explicit_bzero(state->change_chain_code, sizeof(state->change_chain_code));
+        state->change_key_derived = false;
+        return -1;
+    }
+    state->change_key_derived = true;
+
+    return derive_input_private_key(state, change, address_index, out);
+}
+
+// Computes the tweaked taproot private key at the path our_key_derivation/change/address_index;
+// if the policy has a tree of scripts, its merkle root at the same address is committed in the
+// tweak. The most recently used keys are cached, as the same address is often spent by multiple
+// inputs of the same transaction.
+// returns -1 on error. 0 on success.
+static int derive_input_tweaked_private_key(dispatcher_context_t *dc,
+                                            sign_psbt_state_t *state,
+                                            uint32_t change,
+                                            uint32_t address_index,
+                                            uint8_t out[static 32]) {
+    tr_seckey_cache_entry_t *entry = &state->tr_seckeys[0];
+    for (int i = 0; i < TR_SECKEYS_CACHE_SIZE; i++) {
+        tr_seckey_cache_entry_t *cur = &state->tr_seckeys[i];
+        if (cur->is_valid && cur->change == change && cur->address_index == address_index) {
+            cur->last_used = ++state->tr_seckeys_counter;
+            PERF_COUNT_CACHE(CACHE_TR_SECKEYS, hits, sizeof(state->tr_seckeys));
+            memcpy(out, cur->seckey, 32);
+            return 0;
+        }
+
+        // choose an empty entry, or the least recently used one
+        if (entry->is_valid && (!cur->is_valid || cur->last_used < entry->last_used)) {
+            entry = cur;
+        }
+    }
+    PERF_COUNT_CACHE(CACHE_TR_SECKEYS, misses, sizeof(state->tr_seckeys));
+
+    uint8_t merkle_root[32];
+    if (has_taptree(state->wallet)) {
+        // change is the step in the derivation path; the tree is computed for the receive or
+        // change addresses it corresponds to
+        int is_change = policy_pubkeys_cache_get_change(&state->wallet->pubkeys_cache,
+                                                        state->wallet->wallet_header_n_keys,
+                                                        change);
+        if (is_change < 0 ||
+            call_get_wallet_tr_merkle_root(dc,
+                                           &state->wallet->wallet_script_template,
+                                           state->wallet->wallet_header_keys_info_merkle_root,
+                                           state->wallet->wallet_header_n_keys,
+                                           &state->wallet->pubkeys_cache,
+                                           is_change == 1,
+                                           address_index,
+                                           merkle_root) < 0) {
+            return -1;
+        }
+    }
+
+    if (derive_input_private_key(state, change, address_index, out) < 0 ||
+        crypto_tr_tweak_seckey_with_merkle_root(out,
+                                                has_taptree(state->wallet) ? merkle_root : NULL) <
+            0) {
+        explicit_bzero(out, 32);
+        return -1;
+    }
+
+    if (entry->is_valid) {
+        PERF_COUNT_CACHE(CACHE_TR_SECKEYS, evictions, sizeof(state->tr_seckeys));
+    }
+    entry->is_valid = true;
+    entry->change = change;
+    entry->address_index = address_index;
+    entry->last_used = ++state->tr_seckeys_counter;
+    memcpy(entry->seckey, out, 32);
+    return 0;
+}
+
 // Common for legacy and segwitv0 transactions
 static void sign_sighash_ecdsa(dispatcher_context_t *dc) {
     sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
 
     LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
 
-    uint32_t sign_path[MAX_BIP32_PATH_STEPS];
-    for (int i = 0; i < state->our_key_derivation_length; i++) {
-        sign_path[i] = state->our_key_derivation[i];
+    // the pending taproot signatures are yielded first, so that they remain in input order
+    if (sign_schnorr_batch(dc, state) < 0) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
     }
-    sign_path[state->our_key_derivation_length] = state->cur.input.change;
-    sign_path[state->our_key_derivation_length + 1] = state->cur.input.address_index;
 
-    int sign_path_len = state->our_key_derivation_length + 2;
+    uint8_t seckey[32];
+    if (derive_input_private_key(state,
+                                 state->cur.in_out.change,
+                                 state->cur.in_out.address_index,
+                                 seckey) < 0) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
+    }
 
     uint8_t sig[MAX_DER_SIG_LEN];
 
-    int sig_len =
-        crypto_ecdsa_sign_sha256_hash_with_key(sign_path, sign_path_len, state->sighash, sig, NULL);
+    int sig_len = crypto_ecdsa_sign_sha256_hash_with_raw_key(seckey, state->sighash, sig, NULL);
+    explicit_bzero(seckey, sizeof(seckey));
     if (sig_len < 0) {
         // unexpected error when signing
         SEND_SW(dc, SW_BAD_STATE);
@@ -1848,20 +3460,24 @@ static void sign_sighash_ecdsa(dispatcher_context_t *dc) {
     }
 
     // yield signature
-    uint8_t cmd = CCMD_YIELD;
-    dc->add_to_response(&cmd, 1);
-
-    uint8_t buf[9];
-    int input_index_varint_len = varint_write(buf, 0, state->cur_input_index);
-    dc->add_to_response(&buf, input_index_varint_len);
-
-    dc->add_to_response(&sig, sig_len);
     uint8_t sighash_byte = (uint8_t) (state->cur.input.sighash_type & 0xFF);
-    dc->add_to_response(&sighash_byte, 1);
-
-    dc->finalize_response(SW_INTERRUPTED_EXECUTION);
-
-    if (dc->process_interruption(dc) < 0) {
+    int res;
+    if (state->use_compact_signatures) {
+        // the client re-encodes it in DER; the sighash byte is only appended if not SIGHASH_ALL
+        uint8_t compact_sig[64];
+        res = crypto_ecdsa_der_to_compact(sig, sig_len, compact_sig);
+        if (res == 0) {
+            res = yield_signature(dc,
+                                  state,
+                                  state->cur_input_index,
+                                  compact_sig,
+                                  sizeof(compact_sig),
+                                  sighash_byte != SIGHASH_ALL ? &sighash_byte : NULL);
+        }
+    } else {
+        res = yield_signature(dc, state, state->cur_input_index, sig, sig_len, &sighash_byte);
+    }
+    if (res < 0) {
         SEND_SW(dc, SW_BAD_STATE);
         return;
     }
@@ -1870,39 +3486,35 @@ static void sign_sighash_ecdsa(dispatcher_context_t *dc) {
     dc->next(sign_process_input_map);
 }
 
-// Signing for segwitv1 (taproot)
-static void sign_sighash_schnorr(dispatcher_context_t *dc) {
-    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
-
-    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
-
+// Signs the sighash of a batch entry with the BIP-340 signature scheme.
+// returns -1 on error. 0 on success.
+static int sign_schnorr_batch_entry(dispatcher_context_t *dc,
+                                    sign_psbt_state_t *state,
+                                    const schnorr_batch_entry_t *entry,
+                                    uint8_t sig[static 64]) {
     cx_ecfp_private_key_t private_key = {0};
-    uint8_t *seckey = private_key.d;  // convenience alias (entirely within the private_key struct)
-
-    uint8_t chain_code[32] = {0};
+    uint8_t seckey[32];
 
-    uint32_t sign_path[MAX_BIP32_PATH_STEPS];
-    for (int i = 0; i < state->our_key_derivation_length; i++) {
-        sign_path[i] = state->our_key_derivation[i];
+    // the key is derived outside of the TRY block, as it might need to interrupt the client in
+    // order to compute the keys in the tree of scripts
+    if (derive_input_tweaked_private_key(dc, state, entry->change, entry->address_index, seckey) <
+        0) {
+        return -1;
     }
-    sign_path[state->our_key_derivation_length] = state->cur.input.change;
-    sign_path[state->our_key_derivation_length + 1] = state->cur.input.address_index;
 
-    int sign_path_len = state->our_key_derivation_length + 2;
-
-    uint8_t sig[64];
-    size_t sig_len;
+    size_t sig_len = 0;
 
     bool error = false;
     BEGIN_TRY {
         TRY {
-            crypto_derive_private_key(&private_key, chain_code, sign_path, sign_path_len);
-            crypto_tr_tweak_seckey(seckey);
+            cx_ecfp_init_private_key(CX_CURVE_256K1, seckey, sizeof(seckey), &private_key);
 
+            // the nonce is drawn from the TRNG for each signature, so it is never reused across
+            // the inputs of the batch, even if they sign the same message with the same key
             unsigned int err = cx_ecschnorr_sign_no_throw(&private_key,
                                                           CX_ECSCHNORR_BIP0340 | CX_RND_TRNG,
                                                           CX_SHA256,
-                                                          state->sighash,
+                                                          entry->sighash,
                                                           32,
                                                           sig,
                                                           &sig_len);
@@ -1914,42 +3526,64 @@ static void sign_sighash_schnorr(dispatcher_context_t *dc) {
             error = true;
         }
         FINALLY {
+            explicit_bzero(seckey, sizeof(seckey));
             explicit_bzero(&private_key, sizeof(private_key));
         }
     }
     END_TRY;
 
     if (error) {
-        // unexpected error when signing
-        SEND_SW(dc, SW_BAD_STATE);
-        return;
+        return -1;
     }
 
     if (sig_len != 64) {
         PRINTF("SIG LEN: %d\n", sig_len);
-        SEND_SW(dc, SW_BAD_STATE);
-        return;
+        return -1;
     }
+    return 0;
+}
 
-    // yield signature
-    uint8_t cmd = CCMD_YIELD;
-    dc->add_to_response(&cmd, 1);
-
-    uint8_t buf[9];
-    int input_index_varint_len = varint_write(buf, 0, state->cur_input_index);
-    dc->add_to_response(&buf, input_index_varint_len);
+// Signs all the taproot sighashes collected in the batch back-to-back, and yields the signatures.
+// returns -1 on error. 0 on success.
+static int sign_schnorr_batch(dispatcher_context_t *dc, sign_psbt_state_t *state) {
+    for (unsigned int i = 0; i < state->n_schnorr_batch_entries; i++) {
+        const schnorr_batch_entry_t *entry = &state->schnorr_batch[i];
 
-    dc->add_to_response(&sig, sizeof(sig));
+        uint8_t sig[64];
+        if (sign_schnorr_batch_entry(dc, state, entry, sig) < 0) {
+            return -1;
+        }
 
-    // only append the sighash type byte if it is non-zero
-    uint8_t sighash_byte = (uint8_t) (state->cur.input.sighash_type & 0xFF);
-    if (sighash_byte != 0x00) {
-        // only add the sighash byte if not 0
-        dc->add_to_response(&sighash_byte, 1);
+        // yield signature; the sighash type byte is only appended if it is non-zero
+        if (yield_signature(dc,
+                            state,
+                            entry->input_index,
+                            sig,
+                            sizeof(sig),
+                            entry->sighash_byte != 0x00 ? &entry->sighash_byte : NULL) < 0) {
+            return -1;
+        }
     }
-    dc->finalize_response(SW_INTERRUPTED_EXECUTION);
+    state->n_schnorr_batch_entries = 0;
+    return 0;
+}
+
+// Signing for segwitv1 (taproot); the sighash is added to the batch, which is signed once full
+static void sign_sighash_schnorr(dispatcher_context_t *dc) {
+    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
+
+    LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
+
+    schnorr_batch_entry_t *entry = &state->schnorr_batch[state->n_schnorr_batch_entries];
+    entry->input_index = state->cur_input_index;
+    entry->change = state->cur.in_out.change;
+    entry->address_index = state->cur.in_out.address_index;
+    entry->sighash_byte = (uint8_t) (state->cur.input.sighash_type & 0xFF);
+    memcpy(entry->sighash, state->sighash, sizeof(entry->sighash));
+    ++state->n_schnorr_batch_entries;
 
-    if (dc->process_interruption(dc) < 0) {
+    if (state->n_schnorr_batch_entries == SCHNORR_BATCH_SIZE && sign_schnorr_batch(dc, state) < 0) {
+        // unexpected error when signing
         SEND_SW(dc, SW_BAD_STATE);
         return;
     }
@@ -1958,9 +3592,55 @@ static void sign_sighash_schnorr(dispatcher_context_t *dc) {
     dc->next(sign_process_input_map);
 }
 
+/**
+ * A step of the background task, run while the dispatcher is paused for the review of the
+ * transaction: first the private key of our account is derived (if our key is already known, as
+ * for canonical wallets), then the tx-wide hashes are finalized once all the outputs are verified.
+ * After the approval, only the keys and the sighashes of the inputs remain to be computed.
+ */
+static bool background_step(dispatcher_context_t *dc) {
+    (void) dc;
+    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
+
+    if (state->wallet->is_wallet_canonical && !state->account_key_derived) {
+        // the longest step, alone in its tick; on failure, it is retried when signing
+        return derive_account_private_key(state) == 0;
+    }
+
+    if (state->outputs_verified) {
+        finalize_tx_hashes(state);
+        return false;
+    }
+    return true;  // waiting for the outputs to be verified
+}
+
+// The private keys derived in the background must not survive a rejection or an error
+static void background_end(dispatcher_context_t *dc) {
+    (void) dc;
+    wipe_signing_keys((sign_psbt_state_t *) &G_command_state);
+}
+
 static void finalize(dispatcher_context_t *dc) {
+    sign_psbt_state_t *state = (sign_psbt_state_t *) &G_command_state;
+
     LOG_PROCESSOR(dc, __FILE__, __LINE__, __func__);
 
+    // sign the remaining taproot inputs
+    if (sign_schnorr_batch(dc, state) < 0) {
+        wipe_signing_keys(state);
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
+    }
+
+    // all the inputs are signed, the cached private keys are no longer needed
+    wipe_signing_keys(state);
+
+    // yield the signatures that are still in the buffer
+    if (flush_yielded_signatures(dc, state) < 0) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
+    }
+
     // Only if called from swap, the app should terminate after sending the response
     if (G_swap_state.called_from_swap) {
         G_swap_state.should_exit = true;
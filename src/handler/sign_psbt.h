@@ -4,10 +4,79 @@
 #include "../constants.h"
 #include "../common/bitvector.h"
 #include "../common/merkle.h"
+#include "../common/script.h"
 #include "../common/wallet.h"
-
+#include "../perf_config.h"
+#include "lib/get_merkle_leaf_hash.h"
+#include "lib/host_storage.h"
+#include "lib/policy.h"
+#include "sign_psbt/checkpoint.h"
+#include "sign_psbt/compare_wallet_script_at_path.h"
+
+// Maximum number of inputs whose bitvectors of the internal inputs are kept in memory; the
+// bitvectors of larger transactions are stored on the host, in chunks of this many inputs, therefore
+// they can only be signed if the client supports the host storage
 #define MAX_N_INPUTS_CAN_SIGN 512
 
+// Maximum number of inputs of a transaction signed with the bitvectors stored on the host
+#define MAX_N_INPUTS_CAN_SIGN_WITH_HOST_STORAGE 0xFFFF
+
+// Number of ticks added to the interruption timeout for each input and each output of the PSBT
+#define SIGN_PSBT_TIMEOUT_TICKS_PER_IN_OUT 1
+
+// Minimum number of outputs for the summary review of the external outputs, if requested
+#define SIGN_PSBT_BATCH_REVIEW_MIN_OUTPUTS 10
+
+// Number of bytes of the BIP-143 hashOutputs shown as the digest of the outputs in summary review
+#define SIGN_PSBT_BATCH_REVIEW_DIGEST_LEN 16
+
+/**
+ * Prefix of the keys of the proprietary fields of the global map of a PSBT that list the other
+ * wallet policies whose inputs are signed: <PSBT_GLOBAL_PROPRIETARY> <identifier_len : 1> "LEDGER"
+ * <subtype : 1>, followed by the wallet id as keydata; the value is the 32-byte hmac of the wallet
+ * policy, or 32 zero bytes for a default wallet policy.
+ */
+#define PSBT_WALLET_POLICY_KEY     "\xFC\x06LEDGER\x02"
+#define PSBT_WALLET_POLICY_KEY_LEN (sizeof(PSBT_WALLET_POLICY_KEY) - 1)
+
+/**
+ * A cached output of a previous transaction, parsed from a non-witness-utxo whose value has hash
+ * value_hash. Entries are only added once the data is verified, either against the hash or by
+ * comparing the txid with the outpoint of the input.
+ */
+typedef struct {
+    bool is_valid;
+    uint32_t last_used;  // value of prevouts_cache_counter when the entry was last used
+    uint8_t value_hash[32];
+    uint32_t vout;
+    uint64_t amount;
+    uint8_t txid[32];
+    uint32_t scriptPubKey_len;  // full length; only the first MAX_PREVOUT_SCRIPTPUBKEY_LEN are kept
+    uint8_t scriptPubKey[MAX_PREVOUT_SCRIPTPUBKEY_LEN];
+} prevout_cache_entry_t;
+
+/**
+ * A taproot key-path sighash waiting to be signed, with the information needed to derive the key.
+ */
+typedef struct {
+    uint32_t input_index;
+    uint32_t change;
+    uint32_t address_index;
+    uint8_t sighash_byte;
+    uint8_t sighash[32];
+} schnorr_batch_entry_t;
+
+/**
+ * A cached tweaked taproot private key, for the address at the given change and address_index.
+ */
+typedef struct {
+    bool is_valid;
+    uint32_t change;
+    uint32_t address_index;
+    uint32_t last_used;  // value of tr_seckeys_counter when the entry was last used
+    uint8_t seckey[32];
+} tr_seckey_cache_entry_t;
+
 // common info that applies to either the current input or the current output
 typedef struct {
     merkleized_map_commitment_t map;
@@ -22,10 +91,29 @@ typedef struct {
                                       // PSBT_{IN,OUT}_TAP_BIP32_DERIVATION key seen.
                                       // Could be 33 (legacy or segwitv0) or 32 bytes long
                                       // (taproot), based on the script type.
+    uint8_t bip32_derivation_key_type;  // the key type of the key of bip32_derivation_pubkey
+    int bip32_derivation_key_index;     // the index of that key in the map
+
+    // set if the map has the proprietary field with the ownership token of the scriptPubKey
+    bool has_ownership_token;
+    int ownership_token_key_index;  // the index of that key in the map
+
+    // set if the map has the proprietary field with the order of the keys of the sorted multisig
+    bool has_sorted_keys_order;
+    int sorted_keys_order_key_index;  // the index of that key in the map
+
+    size_t n_keys_seen;  // number of keys of the map processed so far by the keys callback
+
+    // the last two steps of the BIP32 derivation, and the index of the wallet policy that the input
+    // or output belongs to; only set by is_in_out_internal if the input or output is internal
+    uint32_t change;
+    uint32_t address_index;
+    uint8_t wallet_index;
 
     // For an output, its scriptPubKey
     // for an input, the prevout's scriptPubKey (either from the non-witness-utxo, or from the
-    // witness-utxo)
+    // witness-utxo). When signing a P2SH-wrapped segwit input, it is replaced with the redeemScript
+    // once verified, as only the latter is needed to compute the sighash.
 
     uint8_t scriptPubKey[MAX_OUTPUT_SCRIPTPUBKEY_LEN];
     size_t scriptPubKey_len;
@@ -39,49 +127,174 @@ typedef struct {
 
     uint64_t prevout_amount;  // the value of the prevout of the current input
 
-    uint8_t prevout_scriptpubkey[MAX_PREVOUT_SCRIPTPUBKEY_LEN];
-    size_t prevout_scriptpubkey_len;
+    // the prevout's scriptPubKey is longer than MAX_PREVOUT_SCRIPTPUBKEY_LEN; only its beginning is
+    // kept in the scriptPubKey of in_out_info_t, and the input is necessarily external
+    bool has_long_scriptPubKey;
 
-    // the script used when signing, either from the witness utxo or the redeem script
-    uint8_t script[MAX_PREVOUT_SCRIPTPUBKEY_LEN];
-    size_t script_len;
+    // set if the map has the proprietary field with the trusted prevout token of the input
+    bool has_prevout_token;
+    int prevout_token_key_index;  // the index of that key in the map
+    // the prevout amount and scriptPubKey were verified with the token, instead of the
+    // non-witness-utxo
+    bool is_prevout_trusted;
 
     uint32_t sighash_type;
-
-    int change;
-    int address_index;
 } input_info_t;
 
 typedef struct {
     uint64_t value;
+
+    // true once the address of the output was formatted by format_once
+    bool is_address_formatted;
 } output_info_t;
 
+/**
+ * Compact summary of an internal input, computed while the inputs are verified, and used while
+ * signing in order to avoid fetching the same data again from the client.
+ */
+typedef struct {
+    unsigned int input_index;
+    merkleized_map_commitment_t map;  // including the index cache of its keys
+    uint64_t prevout_amount;
+    uint32_t change;
+    uint32_t address_index;
+    bool has_witnessUtxo;
+    bool has_nonWitnessUtxo;
+    bool has_redeemScript;
+    bool has_sighash_type;
+    // for legacy inputs, the prevout's scriptPubKey; otherwise, scriptPubKey_len is 0
+    uint8_t scriptPubKey_len;
+    uint8_t scriptPubKey[MAX_PREVOUT_SCRIPTPUBKEY_LEN];
+} input_summary_t;
+
+_Static_assert(sizeof(input_summary_t) <= HOST_STORAGE_MAX_RECORD_LEN,
+               "input_summary_t too large for the host storage");
+
+/**
+ * Ids of the records stored on the host. The summaries of the internal inputs use the input index
+ * as the record id; the streams of the serialized inputs and outputs used to compute the legacy
+ * sighashes use consecutive ids from the following ones, and so do the chunks of the bitvectors of
+ * the internal inputs of the transactions with more than MAX_N_INPUTS_CAN_SIGN inputs.
+ */
+#define TXINS_STREAM_RECORD_ID   0x01000000
+#define OUTPUTS_STREAM_RECORD_ID 0x02000000
+#define INPUTS_CHUNKS_RECORD_ID  0x03000000
+
+// Length of a chunk of the bitvectors of the internal inputs, and of its record on the host: the
+// bits of the internal inputs, followed by the ones of the inputs of the second wallet policy
+#define INPUTS_CHUNK_BITVECTOR_LEN BITVECTOR_REAL_SIZE(MAX_N_INPUTS_CAN_SIGN)
+#define INPUTS_CHUNK_RECORD_LEN    (2 * INPUTS_CHUNK_BITVECTOR_LEN)
+
+_Static_assert(INPUTS_CHUNK_RECORD_LEN <= HOST_STORAGE_MAX_RECORD_LEN,
+               "The chunks of the bitvectors of the inputs are too large for the host storage");
+
+/**
+ * Length of the entry of each input in the stream of serialized inputs: the prevout hash (32
+ * bytes), the output index (4 bytes) and the nSequence (4 bytes).
+ */
+#define TXIN_RECORD_ENTRY_LEN (32 + 4 + 4)
+
+/**
+ * Value of the sighash type of a sighash midstate that is not computed; no valid sighash type uses
+ * more than the low byte.
+ */
+#define SIGHASH_MIDSTATE_NONE 0xFFFFFFFF
+
+/**
+ * Returns the index of the key identified by key_type and bip32_derivation_pubkey in the map of
+ * in_out_info if it is known, or -1 otherwise.
+ */
+static inline int get_bip32_derivation_key_index(const in_out_info_t *in_out_info,
+                                                 uint8_t key_type) {
+    if (!in_out_info->has_bip32_derivation || in_out_info->bip32_derivation_key_type != key_type) {
+        return -1;
+    }
+    return in_out_info->bip32_derivation_key_index;
+}
+
+/**
+ * A wallet policy whose internal inputs are signed, and whose internal outputs are change.
+ */
+typedef struct {
+    bool is_wallet_canonical;
+    int address_type;   // only relevant for canonical wallets
+    int bip44_purpose;  // only relevant for canonical wallets
+
+    uint8_t wallet_id[32];  // the sha256 of the serialized wallet policy
+    char name[MAX_WALLET_NAME_LENGTH + 1];
+    uint8_t wallet_header_keys_info_merkle_root[32];
+    size_t wallet_header_n_keys;
+    union {
+        uint8_t wallet_policy_map_bytes[MAX_POLICY_MAP_BYTES];
+        policy_node_t wallet_policy_map;
+    };
+
+    // the wallet policy compiled once, in order to compute the scripts of the inputs and outputs
+    policy_script_template_t wallet_script_template;
+
+    // cache of the pubkeys of the wallet policy, shared by all the calls to is_in_out_internal
+    policy_pubkeys_cache_t pubkeys_cache;
+
+    // memo table of the scripts of the wallet policy already computed by is_in_out_internal, as
+    // multiple inputs and outputs are often at the same address
+    wallet_script_memo_entry_t script_memo[WALLET_SCRIPT_MEMO_SIZE];
+
+    // the derivation of our key in the wallet policy
+    int our_key_derivation_length;
+    uint32_t our_key_derivation[MAX_BIP32_PATH_STEPS];
+} sign_psbt_wallet_t;
+
 typedef struct {
     machine_context_t ctx;
 
     uint32_t tx_version;
     uint32_t locktime;
 
+    // for a PSBTv0, the outpoints and nSequences of the inputs, and the amounts and scriptPubKeys
+    // of the outputs are parsed from the unsigned transaction, whose hash is unsigned_tx_hash
+    bool is_psbt_v0;
+    uint8_t unsigned_tx_hash[32];
+
     unsigned int n_inputs;
     uint8_t inputs_root[32];  // merkle root of the vector of input maps commitments
     unsigned int n_outputs;
     uint8_t outputs_root[32];  // merkle root of the vector of output maps commitments
 
-    bool is_wallet_canonical;
-    int address_type;   // only relevant for canonical wallets
-    int bip44_purpose;  // only relevant for canonical wallets
+    // the wallet policy of the command, followed by the other ones listed in the global map
+    unsigned int n_wallets;
+    sign_psbt_wallet_t wallets[SIGN_PSBT_MAX_WALLET_POLICIES];
+    unsigned int n_wallets_authorized;  // number of wallet policies already shown to the user
 
-    uint8_t wallet_header_keys_info_merkle_root[32];
-    size_t wallet_header_n_keys;
-    union {
-        uint8_t wallet_policy_map_bytes[MAX_POLICY_MAP_BYTES];
-        policy_node_t wallet_policy_map;
-    };
+    // the wallet policy of the input being signed; the first one before the inputs are signed
+    sign_psbt_wallet_t *wallet;
 
     uint32_t master_key_fingerprint;
 
-    // bitmap to track of which inputs are internal
-    uint8_t internal_inputs[BITVECTOR_REAL_SIZE(MAX_N_INPUTS_CAN_SIGN)];
+    // bitmap to track of which inputs are internal, with n_inputs bits (at most
+    // MAX_N_INPUTS_CAN_SIGN); allocated from the arena
+    uint8_t *internal_inputs;
+
+    // if SIGN_PSBT_MAX_WALLET_POLICIES > 1, bitmap of the internal inputs that belong to the second
+    // wallet policy, with as many bits as internal_inputs; allocated from the arena
+    uint8_t *second_wallet_inputs;
+
+    // for the transactions with more than MAX_N_INPUTS_CAN_SIGN inputs, the bitmaps above only
+    // hold the chunk of MAX_N_INPUTS_CAN_SIGN inputs with this index; the other chunks are stored
+    // on the host. Always 0 for the other transactions.
+    unsigned int inputs_chunk;
+
+    unsigned int n_internal_inputs;
+
+    // summaries of the first internal inputs, in increasing order of input index; allocated from
+    // the arena, with space for max_n_input_summaries
+    input_summary_t *input_summaries;
+    unsigned int max_n_input_summaries;
+    unsigned int n_input_summaries;
+    unsigned int cur_input_summary;  // index of the next summary to use while signing
+
+    // if the client supports it, the summaries of the other internal inputs are stored on the host,
+    // using the input index as the record id
+    bool use_host_storage;
 
     union {
         unsigned int cur_input_index;
@@ -96,11 +309,80 @@ typedef struct {
         };
     } cur;
 
+    // if the client supports it, the non-witness-utxos are requested without the witnesses; they
+    // are then verified by comparing their txid with the outpoint of the input
+    bool use_stripped_rawtx;
+
+    // if the global map of the PSBT requests them, the trusted prevout token of each input whose
+    // non-witness-utxo is parsed is yielded
+    bool yield_prevout_tokens;
+
+    // path of the last input or output map whose commitment was verified, as the maps are
+    // requested in order
+    merkle_path_cache_t path_cache;
+
+    // least recently used cache of the outputs parsed from the non-witness-utxos, as inputs often
+    // spend multiple outputs of the same transaction, and each is parsed in both passes
+    uint32_t prevouts_cache_counter;
+    prevout_cache_entry_t prevouts_cache[PREVOUTS_CACHE_SIZE];
+    // more entries of the same cache in the shared arena, if available (on NanoS only)
+    prevout_cache_entry_t *prevouts_cache_extra;
+    size_t n_prevouts_cache_extra;
+
+    // in swap mode, the scriptPubKey of the destination address of app-exchange, that the only
+    // external output must match
+    uint8_t swap_script[MAX_ADDRESS_SCRIPT_LEN];
+    uint8_t swap_script_len;
+
     // if any segwitv0 input is missing the non-witness-utxo, we show a warning
     bool show_missing_nonwitnessutxo_warning;
 
+    // if any internal input has a sighash type other than SIGHASH_ALL (or SIGHASH_DEFAULT for
+    // taproot), we show a warning
+    bool show_nondefault_sighash_warning;
+
     uint8_t sighash[32];
 
+    // if the client supports it, the signatures are accumulated and yielded in batches
+    bool use_batched_yield;
+    uint8_t n_yield_buffer_elements;
+    size_t yield_buffer_len;
+    uint8_t yield_buffer[YIELD_BUFFER_LEN];
+    // if the client supports it, the ECDSA signatures are yielded in the compact encoding
+    bool use_compact_signatures;
+
+    union {
+        // running hashes of the tx-wide hashes, updated while verifying the inputs and the outputs
+        struct {
+            cx_sha256_t sha_prevouts;
+            cx_sha256_t sha_amounts;
+            cx_sha256_t sha_scriptpubkeys;
+            cx_sha256_t sha_sequences;
+            cx_sha256_t sha_outputs;
+        } hash_contexts;
+
+        // once the tx-wide hashes are finalized, the states of the BIP-143 and BIP-341 sighash
+        // computations after the prefix that is the same for all the inputs with the same sighash
+        // type; each input is only hashed from a copy of them
+        struct {
+            cx_sha256_t segwit_v0;
+            cx_sha256_t segwit_v1;
+        } sighash_midstates;
+    };
+
+    // the sighash types of the sighash_midstates, or SIGHASH_MIDSTATE_NONE if not computed yet
+    uint32_t segwit_v0_midstate_sighash_type;
+    uint32_t segwit_v1_midstate_sighash_type;
+
+    // true if sha_amounts and sha_scriptpubkeys are computed, as they are only needed to sign
+    // segwit v1 inputs
+    bool compute_bip341_hashes;
+
+    // set once all the outputs are verified, and once the tx-wide hashes are finalized in hashes
+    // (possibly in the background, while the user reviews the transaction)
+    bool outputs_verified;
+    bool tx_hashes_finalized;
+
     struct {
         uint8_t sha_prevouts[32];
         uint8_t sha_amounts[32];
@@ -108,7 +390,10 @@ typedef struct {
         uint8_t sha_sequences[32];
         uint8_t sha_outputs[32];
     } hashes;
-    bool segwit_hashes_computed;
+
+    // true if the serialized inputs and outputs are stored on the host, for the legacy sighashes
+    bool tx_records_stored;
+    size_t outputs_serialization_len;  // length of the serialization of the outputs, if stored
 
     uint64_t inputs_total_value;
     uint64_t outputs_total_value;
@@ -120,8 +405,52 @@ typedef struct {
     int external_outputs_count;  // count of external outputs that are shown to the user
     int change_count;            // count of outputs compatible with change outputs
 
-    int our_key_derivation_length;
-    uint32_t our_key_derivation[MAX_BIP32_PATH_STEPS];
+    // if the client supports it, the external outputs are reviewed in summary, with their count,
+    // their total amount and the digest of all the outputs, instead of one at a time
+    bool use_batch_review;
+
+    // The private key and chain code at the our_key_derivation of the wallet being signed are
+    // derived once, in the background while the user reviews the transaction or when signing the
+    // first input of the wallet; the keys of each input only require the last two (unhardened)
+    // derivation steps.
+    // The node at the change step of the last signed input is also kept, so that usually only the
+    // last step is needed. They are wiped once all the inputs are signed.
+    bool account_key_derived;
+    uint8_t account_privkey[32];
+    uint8_t account_chain_code[32];
+
+    bool change_key_derived;
+    uint32_t change_key_change;  // the change step of change_privkey
+    uint8_t change_privkey[32];
+    uint8_t change_chain_code[32];
+
+    // least recently used cache of the tweaked private keys of the taproot addresses already signed
+    // for; they are also wiped once all the inputs are signed.
+    uint32_t tr_seckeys_counter;
+    tr_seckey_cache_entry_t tr_seckeys[TR_SECKEYS_CACHE_SIZE];
+
+    // sighashes of the taproot inputs that are not signed yet; they are signed when the batch is
+    // full, before signing a non-taproot input, and once all the inputs are processed
+    unsigned int n_schnorr_batch_entries;
+    schnorr_batch_entry_t schnorr_batch[SCHNORR_BATCH_SIZE];
+
+    // if the client supports it, checkpoints are yielded among the signatures; if the command data
+    // ends with a checkpoint, signing resumes from it without the approval of the user
+    bool use_checkpoints;
+    bool is_resuming;
+    uint8_t resume_token[SIGN_PSBT_CHECKPOINT_TOKEN_LEN];
+    sign_psbt_checkpoint_t checkpoint;
+    unsigned int n_signed_since_checkpoint;
 } sign_psbt_state_t;
 
+/**
+ * Size of the part of the command state used by SIGN_PSBT: its state, followed by the arrays sized
+ * by the PSBT, with space for the largest number of inputs and MAX_N_INPUT_SUMMARIES summaries
+ * (including the alignment padding).
+ */
+#define SIGN_PSBT_ARENA_SIZE                                                                    \
+    (sizeof(sign_psbt_state_t) + 4 + BITVECTOR_REAL_SIZE(MAX_N_INPUTS_CAN_SIGN) +               \
+     (SIGN_PSBT_MAX_WALLET_POLICIES > 1 ? 4 + BITVECTOR_REAL_SIZE(MAX_N_INPUTS_CAN_SIGN) : 0) + \
+     4 + MAX_N_INPUT_SUMMARIES * sizeof(input_summary_t))
+
 void handler_sign_psbt(dispatcher_context_t *dispatcher_context);
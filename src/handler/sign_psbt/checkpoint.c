@@ -0,0 +1,42 @@
+#include <string.h>
+
+#include "checkpoint.h"
+
+#include "../lib/authenticated_token.h"
+
+#include "../../common/write.h"
+
+#define CHECKPOINT_MSG_LEN (32 + 8 + 8 + 8 + 4)
+
+// <tx_digest : 32> <inputs_total_value : 8> <outputs_total_value : 8>
+// <change_outputs_total_value : 8> <next_input_index : 4>, integers in little-endian
+static void get_checkpoint_msg(const sign_psbt_checkpoint_t *checkpoint,
+                               uint8_t out[static CHECKPOINT_MSG_LEN]) {
+    memcpy(out, checkpoint->tx_digest, 32);
+    write_u64_le(out, 32, checkpoint->inputs_total_value);
+    write_u64_le(out, 40, checkpoint->outputs_total_value);
+    write_u64_le(out, 48, checkpoint->change_outputs_total_value);
+    write_u32_le(out, 56, checkpoint->next_input_index);
+}
+
+void compute_sign_psbt_checkpoint_token(const sign_psbt_checkpoint_t *checkpoint,
+                                        uint8_t out[static SIGN_PSBT_CHECKPOINT_TOKEN_LEN]) {
+    uint8_t msg[CHECKPOINT_MSG_LEN];
+    get_checkpoint_msg(checkpoint, msg);
+    authenticated_token_compute(AUTH_TOKEN_KEY_SIGN_PSBT_CHECKPOINT,
+                                msg,
+                                sizeof(msg),
+                                out,
+                                SIGN_PSBT_CHECKPOINT_TOKEN_LEN);
+}
+
+bool check_sign_psbt_checkpoint_token(const sign_psbt_checkpoint_t *checkpoint,
+                                      const uint8_t token[static SIGN_PSBT_CHECKPOINT_TOKEN_LEN]) {
+    uint8_t msg[CHECKPOINT_MSG_LEN];
+    get_checkpoint_msg(checkpoint, msg);
+    return authenticated_token_check(AUTH_TOKEN_KEY_SIGN_PSBT_CHECKPOINT,
+                                     msg,
+                                     sizeof(msg),
+                                     token,
+                                     SIGN_PSBT_CHECKPOINT_TOKEN_LEN);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * First byte of the checkpoints yielded among the signatures. It is never the first byte of the
+ * input index of a signature, as it would prefix a 9-byte varint.
+ */
+#define SIGN_PSBT_CHECKPOINT_MARKER 0xFF
+
+#define SIGN_PSBT_CHECKPOINT_TOKEN_LEN 32
+
+/**
+ * Length of a yielded checkpoint: <marker : 1> <next_input_index : 4> <token : 32>
+ */
+#define SIGN_PSBT_CHECKPOINT_LEN (1 + 4 + SIGN_PSBT_CHECKPOINT_TOKEN_LEN)
+
+/**
+ * Number of internal inputs signed between two consecutive checkpoints.
+ */
+#define SIGN_PSBT_CHECKPOINT_INTERVAL 16
+
+/**
+ * The data authenticated by a checkpoint token: the transaction that the user approved, the totals
+ * shown for its approval, and the first input whose signature was not yielded yet.
+ */
+typedef struct {
+    uint8_t tx_digest[32];  // sha256 of the data of the SIGN_PSBT command, without the checkpoint
+    uint64_t inputs_total_value;
+    uint64_t outputs_total_value;
+    uint64_t change_outputs_total_value;
+    uint32_t next_input_index;
+} sign_psbt_checkpoint_t;
+
+/**
+ * Computes the token of a checkpoint. The key is AUTH_TOKEN_KEY_SIGN_PSBT_CHECKPOINT, derived
+ * from the symmetric key of the SIGN_PSBT_CHECKPOINT_SLIP0021_LABEL label and a random nonce drawn
+ * once; therefore, the tokens remain valid after a reset of the communication, but not after the
+ * app is restarted or the key is cleared.
+ *
+ * @param[in] checkpoint
+ *   The authenticated data.
+ * @param[out] out
+ *   Pointer to the output buffer for the token.
+ */
+void compute_sign_psbt_checkpoint_token(const sign_psbt_checkpoint_t *checkpoint,
+                                        uint8_t out[static SIGN_PSBT_CHECKPOINT_TOKEN_LEN]);
+
+/**
+ * Verifies, in constant time, the token of a checkpoint.
+ *
+ * @return true if the token is valid for the checkpoint, false otherwise.
+ */
+bool check_sign_psbt_checkpoint_token(const sign_psbt_checkpoint_t *checkpoint,
+                                      const uint8_t token[static SIGN_PSBT_CHECKPOINT_TOKEN_LEN]);
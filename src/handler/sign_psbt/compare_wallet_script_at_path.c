@@ -11,29 +11,60 @@
 int compare_wallet_script_at_path(dispatcher_context_t *dispatcher_context,
                                   uint32_t change,
                                   uint32_t address_index,
-                                  const policy_node_t *policy,
+                                  const policy_script_template_t *template,
                                   const uint8_t keys_merkle_root[static 32],
                                   uint32_t n_keys,
+                                  policy_pubkeys_cache_t *pubkeys_cache,
+                                  wallet_script_memo_entry_t *script_memo,
                                   const uint8_t expected_script[],
                                   size_t expected_script_len) {
     LOG_PROCESSOR(dispatcher_context, __FILE__, __LINE__, __func__);
 
+    wallet_script_memo_entry_t *memo = NULL;
+    if (script_memo != NULL) {
+        memo = &script_memo[(2 * address_index + change) & (WALLET_SCRIPT_MEMO_SIZE - 1)];
+        if (memo->is_valid && memo->change == change && memo->address_index == address_index) {
+            PERF_COUNT_CACHE(CACHE_WALLET_SCRIPT_MEMO,
+                             hits,
+                             WALLET_SCRIPT_MEMO_SIZE * sizeof(wallet_script_memo_entry_t));
+            return memo->script_len == expected_script_len &&
+                   memcmp(memo->script, expected_script, expected_script_len) == 0;
+        }
+        PERF_COUNT_CACHE(CACHE_WALLET_SCRIPT_MEMO,
+                         misses,
+                         WALLET_SCRIPT_MEMO_SIZE * sizeof(wallet_script_memo_entry_t));
+    }
+
     // derive wallet's scriptPubKey, check if it matches the expected one
     uint8_t wallet_script[MAX_PREVOUT_SCRIPTPUBKEY_LEN];
     buffer_t wallet_script_buf = buffer_create(wallet_script, sizeof(wallet_script));
 
-    int wallet_script_len = call_get_wallet_script(dispatcher_context,
-                                                   policy,
-                                                   keys_merkle_root,
-                                                   n_keys,
-                                                   change,
-                                                   address_index,
-                                                   &wallet_script_buf);
+    int wallet_script_len = call_get_wallet_script_from_template(dispatcher_context,
+                                                                 template,
+                                                                 keys_merkle_root,
+                                                                 n_keys,
+                                                                 pubkeys_cache,
+                                                                 change,
+                                                                 address_index,
+                                                                 &wallet_script_buf);
     if (wallet_script_len < 0) {
         PRINTF("Failed to get wallet script\n");
         return -1;  // shouldn't happen
     }
 
+    if (memo != NULL && wallet_script_len <= WALLET_SCRIPT_MEMO_MAX_SCRIPT_LEN) {
+        if (memo->is_valid) {
+            PERF_COUNT_CACHE(CACHE_WALLET_SCRIPT_MEMO,
+                             evictions,
+                             WALLET_SCRIPT_MEMO_SIZE * sizeof(wallet_script_memo_entry_t));
+        }
+        memo->is_valid = true;
+        memo->change = change;
+        memo->address_index = address_index;
+        memo->script_len = (uint8_t) wallet_script_len;
+        memcpy(memo->script, wallet_script, wallet_script_len);
+    }
+
     if (wallet_script_len == (int) expected_script_len &&
         memcmp(wallet_script, expected_script, expected_script_len) == 0) {
         return 1;
@@ -3,15 +3,43 @@
 #include "../../boilerplate/dispatcher.h"
 #include "../../common/merkle.h"
 #include "../../common/wallet.h"
+#include "../../perf_config.h"
+#include "../lib/policy.h"
 
 /**
- * TODO
+ * Maximum length of a script kept in the memo table; enough for the scriptPubKey of any supported
+ * wallet policy (34 bytes for P2WSH and P2TR).
+ */
+#define WALLET_SCRIPT_MEMO_MAX_SCRIPT_LEN 34
+
+/**
+ * An entry of the memo table of the scripts of a wallet policy: the scriptPubKey at the given
+ * change and address_index. The table is direct-mapped: the entry for each (change, address_index)
+ * is always at the same position, and replaces any previous one.
+ */
+typedef struct {
+    bool is_valid;
+    uint8_t script_len;
+    uint32_t change;
+    uint32_t address_index;
+    uint8_t script[WALLET_SCRIPT_MEMO_MAX_SCRIPT_LEN];
+} wallet_script_memo_entry_t;
+
+/**
+ * Computes the script of the wallet policy at the given change and address_index, and compares it
+ * with the expected one. If script_memo is not NULL, it is a memo table of WALLET_SCRIPT_MEMO_SIZE
+ * entries (zeroed before first use) of the scripts already computed for the same wallet policy; the
+ * script is only computed if it is not already in the table.
+ *
+ * @return 1 if the script matches, 0 if it does not, -1 on error.
  */
 int compare_wallet_script_at_path(dispatcher_context_t *dispatcher_context,
                                   uint32_t change,
                                   uint32_t address_index,
-                                  const policy_node_t *policy,
+                                  const policy_script_template_t *template,
                                   const uint8_t keys_merkle_root[static 32],
                                   uint32_t n_keys,
+                                  policy_pubkeys_cache_t *pubkeys_cache,
+                                  wallet_script_memo_entry_t *script_memo,
                                   const uint8_t expected_script[],
-                                  size_t expected_script_len);
\ No newline at end of file
+                                  size_t expected_script_len);
@@ -11,18 +11,20 @@ int get_fingerprint_and_path(dispatcher_context_t *dispatcher_context,
                              const merkleized_map_commitment_t *map,
                              const uint8_t *key,
                              int key_len,
+                             int key_index,
                              uint32_t *out_fingerprint,
                              uint32_t out_bip32_path[static MAX_BIP32_PATH_STEPS]) {
     LOG_PROCESSOR(dispatcher_context, __FILE__, __LINE__, __func__);
 
     uint8_t fpt_der[4 + 4 * MAX_BIP32_PATH_STEPS];
 
-    int len = call_get_merkleized_map_value(dispatcher_context,
-                                            map,
-                                            key,
-                                            key_len,
-                                            fpt_der,
-                                            sizeof(fpt_der));
+    int len = call_get_merkleized_map_value_with_index(dispatcher_context,
+                                                       map,
+                                                       key,
+                                                       key_len,
+                                                       key_index,
+                                                       fpt_der,
+                                                       sizeof(fpt_der));
 
     if (len < 4 || len % 4 != 0) {
         return -1;
@@ -48,18 +50,20 @@ int get_emptyhashes_fingerprint_and_path(dispatcher_context_t *dispatcher_contex
                                          const merkleized_map_commitment_t *map,
                                          const uint8_t *key,
                                          int key_len,
+                                         int key_index,
                                          uint32_t *out_fingerprint,
                                          uint32_t out_bip32_path[static MAX_BIP32_PATH_STEPS]) {
     LOG_PROCESSOR(dispatcher_context, __FILE__, __LINE__, __func__);
 
     uint8_t hasheslen_fpt_der[1 + 4 + 4 * MAX_BIP32_PATH_STEPS];
 
-    int len = call_get_merkleized_map_value(dispatcher_context,
-                                            map,
-                                            key,
-                                            key_len,
-                                            hasheslen_fpt_der,
-                                            sizeof(hasheslen_fpt_der));
+    int len = call_get_merkleized_map_value_with_index(dispatcher_context,
+                                                       map,
+                                                       key,
+                                                       key_len,
+                                                       key_index,
+                                                       hasheslen_fpt_der,
+                                                       sizeof(hasheslen_fpt_der));
 
     if (len < 1 + 4 || (len - 1) % 4 != 0) {
         return -1;
@@ -6,6 +6,8 @@
 
 /**
  * Used to read PSBT_IN_BIP32_DERIVATION or PSBT_OUT_BIP32_DERIVATION entries from a PSBT map.
+ * If key_index is not negative, it is the (already verified) index of the key in the map, as in
+ * call_get_merkleized_map_value_with_index.
  * Returns the length of the BIP32 path on success, a negative number on failure.
  *
  * TODO: more precise docs
@@ -14,12 +16,15 @@ int get_fingerprint_and_path(dispatcher_context_t *dispatcher_context,
                              const merkleized_map_commitment_t *map,
                              const uint8_t *key,
                              int key_len,
+                             int key_index,
                              uint32_t *out_fingerprint,
                              uint32_t out_bip32_path[static MAX_BIP32_PATH_STEPS]);
 
 /**
  * Used to read PSBT_IN_TAP_BIP32_DERIVATION or PSBT_OUT_TAP_BIP32_DERIVATION entries from a PSBT
  * map; fails if the hashes_len is not 0 (only useful for keypath spending).
+ * If key_index is not negative, it is the (already verified) index of the key in the map, as in
+ * call_get_merkleized_map_value_with_index.
  * Returns the length of the BIP32 path on success, a negative number on failure.
  *
  * TODO: more precise docs
@@ -28,5 +33,6 @@ int get_emptyhashes_fingerprint_and_path(dispatcher_context_t *dispatcher_contex
                                          const merkleized_map_commitment_t *map,
                                          const uint8_t *key,
                                          int key_len,
+                                         int key_index,
                                          uint32_t *out_fingerprint,
                                          uint32_t out_bip32_path[static MAX_BIP32_PATH_STEPS]);
\ No newline at end of file
@@ -4,6 +4,10 @@
 #include "compare_wallet_script_at_path.h"
 #include "get_fingerprint_and_path.h"
 
+#include "../lib/get_merkleized_map_value.h"
+#include "../lib/ownership_token.h"
+#include "../lib/policy.h"
+
 #include "../../common/bip32.h"
 #include "../../common/psbt.h"
 #include "../../common/script.h"
@@ -11,9 +15,80 @@
 
 extern global_context_t *G_coin_config;
 
+// Returns the type of the scripts produced by the policy, as determined by its top-level node;
+// -1 if unknown.
+static int get_policy_script_type(const policy_node_t *policy) {
+    switch (policy->type) {
+        case TOKEN_PKH:
+            return SCRIPT_TYPE_P2PKH;
+        case TOKEN_WPKH:
+            return SCRIPT_TYPE_P2WPKH;
+        case TOKEN_SH:
+            return SCRIPT_TYPE_P2SH;
+        case TOKEN_WSH:
+            return SCRIPT_TYPE_P2WSH;
+        case TOKEN_TR:
+            return SCRIPT_TYPE_P2TR;
+        default:
+            return -1;
+    }
+}
+
+// Checks if the scriptPubKey of the input/output, whose key is at the given BIP32 path, belongs to
+// the wallet policy; change is 1 if the change step of the path is the one of the change addresses
+// of the wallet policy, 0 otherwise. token is the ownership token of the scriptPubKey, or NULL if
+// there is none.
+// Returns 1 if the script belongs to the wallet policy, 0 if not, -1 on error.
+static int is_script_in_wallet(dispatcher_context_t *dispatcher_context,
+                               sign_psbt_wallet_t *wallet,
+                               const in_out_info_t *in_out_info,
+                               bool is_input,
+                               const uint32_t bip32_path[],
+                               int bip32_path_len,
+                               uint32_t change,
+                               const uint8_t *token) {
+    uint32_t address_index = bip32_path[bip32_path_len - 1];
+
+    if (wallet->is_wallet_canonical) {
+        // for canonical wallets, the path must be exactly as expected for a change output
+        uint32_t coin_types[2] = {COIN_CONFIG_BIP44_COIN_TYPE(G_coin_config),
+                                  COIN_CONFIG_BIP44_COIN_TYPE_2(G_coin_config)};
+        if (!is_address_path_standard(bip32_path,
+                                      bip32_path_len,
+                                      wallet->bip44_purpose,
+                                      coin_types,
+                                      2,
+                                      is_input ? -1 : 1)) {
+            return 0;
+        }
+    }
+
+    // a valid ownership token proves that the scriptPubKey was derived from the wallet policy at
+    // this change and address_index; otherwise, the script is derived to compare it
+    if (token != NULL && check_ownership_token(wallet->wallet_id,
+                                               change,
+                                               address_index,
+                                               in_out_info->scriptPubKey,
+                                               in_out_info->scriptPubKey_len,
+                                               token)) {
+        return 1;
+    }
+
+    return compare_wallet_script_at_path(dispatcher_context,
+                                         change,
+                                         address_index,
+                                         &wallet->wallet_script_template,
+                                         wallet->wallet_header_keys_info_merkle_root,
+                                         wallet->wallet_header_n_keys,
+                                         &wallet->pubkeys_cache,
+                                         wallet->script_memo,
+                                         in_out_info->scriptPubKey,
+                                         in_out_info->scriptPubKey_len);
+}
+
 int is_in_out_internal(dispatcher_context_t *dispatcher_context,
-                       const sign_psbt_state_t *state,
-                       const in_out_info_t *in_out_info,
+                       sign_psbt_state_t *state,
+                       in_out_info_t *in_out_info,
                        bool is_input) {
     if (!in_out_info->has_bip32_derivation) {
         PRINTF("No BIP32 derivation\n");
@@ -35,30 +110,48 @@ int is_in_out_internal(dispatcher_context_t *dispatcher_context,
     } else if (script_type == SCRIPT_TYPE_UNKNOWN_SEGWIT) {
         // An unknown but valid segwit script type, definitely external.
         return 0;
-    } else if (script_type == SCRIPT_TYPE_P2TR) {
+    }
+
+    // Each wallet policy can only produce scripts of one type; if none of them has the type of
+    // the script, there is no need to fetch the derivation path or to derive the script.
+    bool has_script_type = false;
+    for (unsigned int i = 0; i < state->n_wallets; i++) {
+        if (script_type == get_policy_script_type(&state->wallets[i].wallet_policy_map)) {
+            has_script_type = true;
+        }
+    }
+    if (!has_script_type) {
+        return 0;
+    }
+
+    if (script_type == SCRIPT_TYPE_P2TR) {
         // taproot output, use PSBT_{IN,OUT}_TAP_BIP32_DERIVATION
         uint8_t key[1 + 32];
         key[0] = is_input ? PSBT_IN_TAP_BIP32_DERIVATION : PSBT_OUT_TAP_BIP32_DERIVATION;
         memcpy(key + 1, in_out_info->bip32_derivation_pubkey, 32);
 
-        bip32_path_len = get_emptyhashes_fingerprint_and_path(dispatcher_context,
-                                                              &in_out_info->map,
-                                                              key,
-                                                              sizeof(key),
-                                                              &fingerprint,
-                                                              bip32_path);
+        bip32_path_len = get_emptyhashes_fingerprint_and_path(
+            dispatcher_context,
+            &in_out_info->map,
+            key,
+            sizeof(key),
+            get_bip32_derivation_key_index(in_out_info, key[0]),
+            &fingerprint,
+            bip32_path);
     } else {
         // legacy or segwitv0 output, use PSBT_OUT_BIP32_DERIVATION
         uint8_t key[1 + 33];
         key[0] = is_input ? PSBT_IN_BIP32_DERIVATION : PSBT_OUT_BIP32_DERIVATION;
         memcpy(key + 1, in_out_info->bip32_derivation_pubkey, 33);
 
-        bip32_path_len = get_fingerprint_and_path(dispatcher_context,
-                                                  &in_out_info->map,
-                                                  key,
-                                                  sizeof(key),
-                                                  &fingerprint,
-                                                  bip32_path);
+        bip32_path_len = get_fingerprint_and_path(
+            dispatcher_context,
+            &in_out_info->map,
+            key,
+            sizeof(key),
+            get_bip32_derivation_key_index(in_out_info, key[0]),
+            &fingerprint,
+            bip32_path);
     }
 
     if (bip32_path_len < 0) {
@@ -74,30 +167,82 @@ int is_in_out_internal(dispatcher_context_t *dispatcher_context,
     uint32_t change = bip32_path[bip32_path_len - 2];
     uint32_t address_index = bip32_path[bip32_path_len - 1];
 
-    if (!is_input && change != 1) {
-        // unlike for inputs, change must be 1 for this output to be considered internal
+    if (change >= BIP32_FIRST_HARDENED_CHILD || address_index >= BIP32_FIRST_HARDENED_CHILD) {
+        // the last two steps of the path of a wallet policy's key are always unhardened
         return 0;
     }
 
-    if (state->is_wallet_canonical) {
-        // for canonical wallets, the path must be exactly as expected for a change output
-        uint32_t coin_types[2] = {G_coin_config->bip44_coin_type, G_coin_config->bip44_coin_type2};
-        if (!is_address_path_standard(bip32_path,
-                                      bip32_path_len,
-                                      state->bip44_purpose,
-                                      coin_types,
-                                      2,
-                                      is_input ? -1 : 1)) {
-            return 0;
+    const uint8_t *token = NULL;
+    uint8_t token_buf[OWNERSHIP_TOKEN_LEN];
+    if (in_out_info->has_ownership_token) {
+        if (call_get_merkleized_map_value_with_index(dispatcher_context,
+                                                     &in_out_info->map,
+                                                     (const uint8_t *) PSBT_OWNERSHIP_TOKEN_KEY,
+                                                     PSBT_OWNERSHIP_TOKEN_KEY_LEN,
+                                                     in_out_info->ownership_token_key_index,
+                                                     token_buf,
+                                                     sizeof(token_buf)) == sizeof(token_buf)) {
+            token = token_buf;
+        } else {
+            PRINTF("Invalid ownership token\n");
         }
     }
 
-    return compare_wallet_script_at_path(dispatcher_context,
-                                         change,
-                                         address_index,
-                                         &state->wallet_policy_map,
-                                         state->wallet_header_keys_info_merkle_root,
-                                         state->wallet_header_n_keys,
-                                         in_out_info->scriptPubKey,
-                                         in_out_info->scriptPubKey_len);
-}
\ No newline at end of file
+    // the order of the keys of a sorted multisig is only a hint, checked while deriving the script
+    uint8_t order[MAX_POLICY_MAP_COSIGNERS];
+    int order_len = -1;
+    if (in_out_info->has_sorted_keys_order) {
+        order_len =
+            call_get_merkleized_map_value_with_index(dispatcher_context,
+                                                     &in_out_info->map,
+                                                     (const uint8_t *) PSBT_SORTED_KEYS_ORDER_KEY,
+                                                     PSBT_SORTED_KEYS_ORDER_KEY_LEN,
+                                                     in_out_info->sorted_keys_order_key_index,
+                                                     order,
+                                                     sizeof(order));
+    }
+
+    for (unsigned int i = 0; i < state->n_wallets; i++) {
+        sign_psbt_wallet_t *wallet = &state->wallets[i];
+        if (script_type != get_policy_script_type(&wallet->wallet_policy_map)) {
+            continue;
+        }
+
+        // the step in the path is the one of the receive or change addresses, depending on the
+        // multipath wildcards of the keys of the wallet policy
+        int is_change = policy_pubkeys_cache_get_change(&wallet->pubkeys_cache,
+                                                        wallet->wallet_header_n_keys,
+                                                        change);
+        if (is_change < 0 || (!is_input && is_change != 1)) {
+            // unlike for inputs, the address must be a change address for this output to be
+            // considered internal
+            continue;
+        }
+
+        if (order_len >= 0 && !policy_pubkeys_cache_set_sorted_keys_order(&wallet->pubkeys_cache,
+                                                                          is_change == 1,
+                                                                          address_index,
+                                                                          order,
+                                                                          order_len)) {
+            PRINTF("Invalid order of the keys of the sorted multisig\n");
+        }
+
+        int ret = is_script_in_wallet(dispatcher_context,
+                                      wallet,
+                                      in_out_info,
+                                      is_input,
+                                      bip32_path,
+                                      bip32_path_len,
+                                      (uint32_t) is_change,
+                                      token);
+        if (ret != 0) {
+            if (ret == 1) {
+                in_out_info->change = change;
+                in_out_info->address_index = address_index;
+                in_out_info->wallet_index = (uint8_t) i;
+            }
+            return ret;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include <string.h>
+
+#include "prevout_token.h"
+
+#include "../lib/authenticated_token.h"
+
+#include "../../common/write.h"
+
+#define PREVOUT_TOKEN_MAX_MSG_LEN (36 + 8 + 1 + MAX_PREVOUT_SCRIPTPUBKEY_LEN)
+
+// serializes <txid : 32> <vout : 4> <amount : 8> <script_len : 1> <script>, and returns its
+// length; script_len must be at most MAX_PREVOUT_SCRIPTPUBKEY_LEN
+static size_t get_prevout_token_msg(const uint8_t outpoint[static 36],
+                                    uint64_t amount,
+                                    const uint8_t *script,
+                                    size_t script_len,
+                                    uint8_t out[static PREVOUT_TOKEN_MAX_MSG_LEN]) {
+    memcpy(out, outpoint, 36);
+    write_u64_le(out, 36, amount);
+    out[44] = (uint8_t) script_len;
+    memcpy(out + 45, script, script_len);
+    return 45 + script_len;
+}
+
+void compute_prevout_token(const uint8_t outpoint[static 36],
+                           uint64_t amount,
+                           const uint8_t *script,
+                           size_t script_len,
+                           uint8_t out[static PREVOUT_TOKEN_LEN]) {
+    if (script_len > MAX_PREVOUT_SCRIPTPUBKEY_LEN) {
+        memset(out, 0, PREVOUT_TOKEN_LEN);  // never accepted by check_prevout_token
+        return;
+    }
+
+    uint8_t msg[PREVOUT_TOKEN_MAX_MSG_LEN];
+    size_t msg_len = get_prevout_token_msg(outpoint, amount, script, script_len, msg);
+    authenticated_token_compute(AUTH_TOKEN_KEY_PREVOUT, msg, msg_len, out, PREVOUT_TOKEN_LEN);
+}
+
+bool check_prevout_token(const uint8_t outpoint[static 36],
+                         uint64_t amount,
+                         const uint8_t *script,
+                         size_t script_len,
+                         const uint8_t token[static PREVOUT_TOKEN_LEN]) {
+    if (script_len > MAX_PREVOUT_SCRIPTPUBKEY_LEN) {
+        return false;
+    }
+
+    uint8_t msg[PREVOUT_TOKEN_MAX_MSG_LEN];
+    size_t msg_len = get_prevout_token_msg(outpoint, amount, script, script_len, msg);
+    return authenticated_token_check(AUTH_TOKEN_KEY_PREVOUT, msg, msg_len, token, PREVOUT_TOKEN_LEN);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../constants.h"
+
+#define PREVOUT_TOKEN_LEN 16
+
+/**
+ * Key of the proprietary field of the global map of a PSBT that requests the trusted prevout tokens
+ * of its inputs, and of the proprietary field of an input map that contains the token of its
+ * prevout: <PSBT_{GLOBAL,IN}_PROPRIETARY> <identifier_len : 1> "LEDGER" <subtype : 1>, with no
+ * keydata. The value of the global field is ignored; the value of the field of an input is
+ * <amount : 8 (little-endian)> <token : PREVOUT_TOKEN_LEN> <scriptPubKey>.
+ */
+#define PSBT_PREVOUT_TOKEN_KEY     "\xFC\x06LEDGER\x01"
+#define PSBT_PREVOUT_TOKEN_KEY_LEN (sizeof(PSBT_PREVOUT_TOKEN_KEY) - 1)
+
+/**
+ * First byte of the trusted prevout tokens yielded by SIGN_PSBT. It is never the first byte of the
+ * input index of a signature, as it would prefix a 5-byte varint, and the inputs are fewer than
+ * 0x10000.
+ */
+#define SIGN_PSBT_PREVOUT_TOKEN_MARKER 0xFE
+
+/**
+ * Length of a yielded trusted prevout token: <marker : 1> <input_index : 4> <token : 16>
+ */
+#define SIGN_PSBT_PREVOUT_TOKEN_YIELD_LEN (1 + 4 + PREVOUT_TOKEN_LEN)
+
+/**
+ * Computes the trusted prevout token of an outpoint, that is the first PREVOUT_TOKEN_LEN bytes of
+ * the HMAC-SHA256 of <txid : 32> <vout : 4 (little-endian)> <amount : 8 (little-endian)>
+ * <script_len : 1> <scriptPubKey>. The key is AUTH_TOKEN_KEY_PREVOUT, derived from the symmetric
+ * key of the PREVOUT_TOKEN_SLIP0021_LABEL label only; therefore, the tokens remain valid as long
+ * as the seed is the same.
+ *
+ * Only compute tokens for amounts and scriptPubKeys that were verified against the previous
+ * transaction, as a valid token is accepted by SIGN_PSBT instead of it.
+ *
+ * @param[in] outpoint
+ *   The txid and the output index of the prevout, as serialized in a transaction input.
+ * @param[in] amount
+ *   The amount of the prevout.
+ * @param[in] script
+ *   The scriptPubKey of the prevout.
+ * @param[in] script_len
+ *   The length of script, at most MAX_PREVOUT_SCRIPTPUBKEY_LEN.
+ * @param[out] out
+ *   Pointer to the output buffer for the token.
+ */
+void compute_prevout_token(const uint8_t outpoint[static 36],
+                           uint64_t amount,
+                           const uint8_t *script,
+                           size_t script_len,
+                           uint8_t out[static PREVOUT_TOKEN_LEN]);
+
+/**
+ * Verifies, in constant time, the trusted prevout token of an outpoint.
+ *
+ * @return true if the token is valid, false otherwise.
+ */
+bool check_prevout_token(const uint8_t outpoint[static 36],
+                         uint64_t amount,
+                         const uint8_t *script,
+                         size_t script_len,
+                         const uint8_t token[static PREVOUT_TOKEN_LEN]);
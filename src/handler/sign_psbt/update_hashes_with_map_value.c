@@ -1,7 +1,11 @@
 
 #include "update_hashes_with_map_value.h"
 
+#include <string.h>
+
 #include "../lib/stream_merkleized_map_value.h"
+#include "../../common/script.h"
+#include "../../constants.h"
 #include "../../crypto.h"
 
 typedef struct {
@@ -50,3 +54,42 @@ int update_hashes_with_map_value(dispatcher_context_t *dispatcher_context,
                                             cb_process_data,
                                             &cb_state);
 }
+
+int update_hashes_with_script(dispatcher_context_t *dispatcher_context,
+                              const merkleized_map_commitment_t *map,
+                              const uint8_t *key,
+                              int key_len,
+                              const uint8_t *scriptPubKey,
+                              size_t scriptPubKey_len,
+                              cx_hash_t *hash_prefixed) {
+    bool is_wsh = is_p2wsh(scriptPubKey, scriptPubKey_len);
+    if (!is_wsh && !is_p2sh(scriptPubKey, scriptPubKey_len)) {
+        return -1;
+    }
+
+    // the script is hashed while streamed: HASH160 for P2SH, SHA256 for P2WSH. The HASH160 is
+    // computed incrementally with the same SHA256 context, applying RIPEMD160 at the end
+    crypto_hash160_ctx_t script_hash_context;
+    crypto_hash160_init(&script_hash_context);
+
+    int script_len = update_hashes_with_map_value(dispatcher_context,
+                                                  map,
+                                                  key,
+                                                  key_len,
+                                                  &script_hash_context.sha256_context.header,
+                                                  hash_prefixed);
+    if (script_len < 0 ||
+        script_len > (is_wsh ? MAX_P2WSH_WITNESSSCRIPT_LEN : MAX_P2SH_REDEEMSCRIPT_LEN)) {
+        return -1;
+    }
+
+    if (is_wsh) {
+        uint8_t script_hash[32];
+        crypto_hash_digest(&script_hash_context.sha256_context.header, script_hash, 32);
+        return memcmp(scriptPubKey + 2, script_hash, 32) == 0 ? script_len : -1;
+    } else {
+        uint8_t script_hash[20];
+        crypto_hash160_final(&script_hash_context, script_hash);
+        return memcmp(scriptPubKey + 2, script_hash, 20) == 0 ? script_len : -1;
+    }
+}
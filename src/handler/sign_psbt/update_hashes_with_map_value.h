@@ -9,7 +9,7 @@
  * responsibility of the caller to ensure that they are initialized.
  *
  * If hash_unprefixed is not NULL, it is updated with the preimage bytes.
- * If hash_unprefixed is not NULL, it is updated with the premiage length serialized as a
+ * If hash_prefixed is not NULL, it is updated with the preimage length serialized as a
  * Bitcoin-style varint, followed by the preimage bytes.
  *
  * Returns the length of the preimage on success, or -1 in case of error.
@@ -19,4 +19,24 @@ int update_hashes_with_map_value(dispatcher_context_t *dispatcher_context,
                                  const uint8_t *key,
                                  int key_len,
                                  cx_hash_t *hash_unprefixed,
-                                 cx_hash_t *hash_prefixed);
\ No newline at end of file
+                                 cx_hash_t *hash_prefixed);
+/**
+ * Streams the redeemScript of a P2SH input or the witnessScript of a P2WSH input from a merkleized
+ * map, as update_hashes_with_map_value, and verifies that it matches the input's scriptPubKey: that
+ * is, that scriptPubKey is the P2SH of the script (HASH160) or its P2WSH (SHA256). The script is
+ * never kept in memory, therefore scripts of any standard size are supported, up to
+ * MAX_P2SH_REDEEMSCRIPT_LEN and MAX_P2WSH_WITNESSSCRIPT_LEN bytes, respectively.
+ *
+ * If hash_prefixed is not NULL, it is updated with the script length serialized as a Bitcoin-style
+ * varint, followed by the script bytes.
+ *
+ * Returns the length of the script on success, or -1 in case of error, if the scriptPubKey is
+ * neither P2SH nor P2WSH, if the script is too long, or if it does not match the scriptPubKey.
+ */
+int update_hashes_with_script(dispatcher_context_t *dispatcher_context,
+                              const merkleized_map_commitment_t *map,
+                              const uint8_t *key,
+                              int key_len,
+                              const uint8_t *scriptPubKey,
+                              size_t scriptPubKey_len,
+                              cx_hash_t *hash_prefixed);
@@ -23,6 +23,62 @@
 #define GET_TRUSTED_INPUT_P1_FIRST 0x00
 #define GET_TRUSTED_INPUT_P1_NEXT 0x80
 
+// With P1_FIRST, the data starts with the number of outputs (at most
+// MAX_TRUSTED_INPUTS_BATCH) followed by their indexes, in strictly increasing
+// order, instead of a single output index; a Trusted Input is returned for each
+// of them, after parsing the transaction once.
+#define GET_TRUSTED_INPUT_P2_BATCH 0x01
+
+// Writes at out the Trusted Input of the output at index of the transaction with
+// the given id.
+static void btchip_build_trusted_input(unsigned char *out,
+                                       const unsigned char *txid,
+                                       unsigned long int index,
+                                       const unsigned char *amount) {
+    unsigned char hmac[32];
+
+    cx_rng(out, 8);
+    out[0] = MAGIC_TRUSTED_INPUT;
+    out[1] = 0x00;
+    os_memmove(out + 4, txid, 32);
+
+    btchip_write_u32_le(out + 4 + 32, index);
+    os_memmove(out + 4 + 32 + 4, amount, 8);
+
+    cx_hmac_sha256((uint8_t *)N_btchip.bkp.trustedinput_key,
+                   sizeof(N_btchip.bkp.trustedinput_key), out,
+                   TRUSTED_INPUT_SIZE, hmac, 32);
+    os_memmove(out + TRUSTED_INPUT_SIZE, hmac,
+               TRUSTED_INPUT_TOTAL_SIZE - TRUSTED_INPUT_SIZE);
+}
+
+// Reads the output indexes of a batched lookup; returns the offset of the
+// transaction data, or 0 if they are not valid.
+static unsigned char btchip_read_target_inputs(unsigned char apduLength) {
+    unsigned char count;
+    unsigned char i;
+
+    if (apduLength < 1) {
+        return 0;
+    }
+    count = G_io_apdu_buffer[ISO_OFFSET_CDATA];
+    if ((count == 0) || (count > MAX_TRUSTED_INPUTS_BATCH) ||
+        (apduLength < 1 + 4 * count)) {
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        btchip_context_D.transactionTargetInputs[i] =
+            btchip_read_u32(G_io_apdu_buffer + ISO_OFFSET_CDATA + 1 + 4 * i, 1,
+                            0);
+        if ((i > 0) && (btchip_context_D.transactionTargetInputs[i] <=
+                        btchip_context_D.transactionTargetInputs[i - 1])) {
+            return 0;
+        }
+    }
+    btchip_context_D.transactionTargetInputsCount = count;
+    return 1 + 4 * count;
+}
+
 unsigned short btchip_apdu_get_trusted_input() {
     unsigned char apduLength;
     unsigned char dataOffset = 0;
@@ -39,25 +95,36 @@ unsigned short btchip_apdu_get_trusted_input() {
     }
 
     if (G_io_apdu_buffer[ISO_OFFSET_P1] == GET_TRUSTED_INPUT_P1_FIRST) {
+        if ((G_io_apdu_buffer[ISO_OFFSET_P2] != 0x00) &&
+            (G_io_apdu_buffer[ISO_OFFSET_P2] != GET_TRUSTED_INPUT_P2_BATCH)) {
+            return BTCHIP_SW_INCORRECT_P1_P2;
+        }
         // Initialize
-        btchip_context_D.transactionTargetInput =
-            btchip_read_u32(G_io_apdu_buffer + ISO_OFFSET_CDATA, 1, 0);
+        btchip_context_D.transactionTargetInputsCount = 0;
+        if (G_io_apdu_buffer[ISO_OFFSET_P2] == GET_TRUSTED_INPUT_P2_BATCH) {
+            dataOffset = btchip_read_target_inputs(apduLength);
+            if (dataOffset == 0) {
+                return BTCHIP_SW_INCORRECT_DATA;
+            }
+        } else {
+            btchip_context_D.transactionTargetInput =
+                btchip_read_u32(G_io_apdu_buffer + ISO_OFFSET_CDATA, 1, 0);
+            dataOffset = 4;
+        }
         btchip_context_D.transactionContext.transactionState =
             BTCHIP_TRANSACTION_NONE;
         btchip_context_D.trustedInputProcessed = 0;
         btchip_context_D.transactionContext.consumeP2SH = 0;
         btchip_set_check_internal_structure_integrity(1);
-        dataOffset = 4;
         btchip_context_D.transactionHashOption = TRANSACTION_HASH_FULL;
         btchip_context_D.usingSegwit = 0;
         btchip_context_D.usingOverwinter = 0;
     } else if (G_io_apdu_buffer[ISO_OFFSET_P1] != GET_TRUSTED_INPUT_P1_NEXT) {
         return BTCHIP_SW_INCORRECT_P1_P2;
-    }
-
-    if (G_io_apdu_buffer[ISO_OFFSET_P2] != 0x00) {
+    } else if (G_io_apdu_buffer[ISO_OFFSET_P2] != 0x00) {
         return BTCHIP_SW_INCORRECT_P1_P2;
     }
+
     btchip_context_D.transactionBufferPointer =
         G_io_apdu_buffer + ISO_OFFSET_CDATA + dataOffset;
     btchip_context_D.transactionDataRemaining = apduLength - dataOffset;
@@ -66,33 +133,43 @@ unsigned short btchip_apdu_get_trusted_input() {
 
     if (btchip_context_D.transactionContext.transactionState ==
         BTCHIP_TRANSACTION_PARSED) {
+        unsigned char hash[32];
+        unsigned char txid[32];
+        unsigned char count = btchip_context_D.transactionTargetInputsCount;
+        unsigned char i;
 
         btchip_context_D.transactionContext.transactionState =
             BTCHIP_TRANSACTION_NONE;
         btchip_set_check_internal_structure_integrity(1);
-        if (!btchip_context_D.trustedInputProcessed) {
+        if ((count == 0) && !btchip_context_D.trustedInputProcessed) {
             // Output was not found
             return BTCHIP_SW_INCORRECT_DATA;
         }
+        if ((count != 0) &&
+            (btchip_context_D.trustedInputProcessed != (1 << count) - 1)) {
+            // Some output was not found
+            return BTCHIP_SW_INCORRECT_DATA;
+        }
 
         cx_hash(&btchip_context_D.transactionHashFull.sha256.header, CX_LAST,
-                (unsigned char *)NULL, 0, G_io_apdu_buffer + TRUSTED_INPUT_SIZE, 32);
+                (unsigned char *)NULL, 0, hash, 32);
+        cx_hash_sha256(hash, 32, txid, 32);
 
         // Otherwise prepare
-        cx_rng(G_io_apdu_buffer, 8);
-        G_io_apdu_buffer[0] = MAGIC_TRUSTED_INPUT;
-        G_io_apdu_buffer[1] = 0x00;
-        cx_hash_sha256(G_io_apdu_buffer + TRUSTED_INPUT_SIZE, 32, G_io_apdu_buffer + 4, 32);
-
-        btchip_write_u32_le(G_io_apdu_buffer + 4 + 32,
-                            btchip_context_D.transactionTargetInput);
-        os_memmove(G_io_apdu_buffer + 4 + 32 + 4,
-                   btchip_context_D.transactionContext.transactionAmount, 8);
-
-        cx_hmac_sha256((uint8_t *)N_btchip.bkp.trustedinput_key,
-                       sizeof(N_btchip.bkp.trustedinput_key), G_io_apdu_buffer,
-                       TRUSTED_INPUT_SIZE, G_io_apdu_buffer + TRUSTED_INPUT_SIZE, 32);
-        btchip_context_D.outLength = TRUSTED_INPUT_TOTAL_SIZE;
+        if (count == 0) {
+            btchip_build_trusted_input(
+                G_io_apdu_buffer, txid, btchip_context_D.transactionTargetInput,
+                btchip_context_D.transactionContext.transactionAmount);
+            btchip_context_D.outLength = TRUSTED_INPUT_TOTAL_SIZE;
+        } else {
+            for (i = 0; i < count; i++) {
+                btchip_build_trusted_input(
+                    G_io_apdu_buffer + i * TRUSTED_INPUT_TOTAL_SIZE, txid,
+                    btchip_context_D.transactionTargetInputs[i],
+                    btchip_context_D.transactionTargetAmounts[i]);
+            }
+            btchip_context_D.outLength = count * TRUSTED_INPUT_TOTAL_SIZE;
+        }
     }
     return BTCHIP_SW_OK;
 }
@@ -24,8 +24,7 @@
 
 #include "btchip_bagl_extensions.h"
 
-#include "segwit_addr.h"
-#include "cashaddr.h"
+#include "../common/address.h"
 #include "btchip_apdu_get_wallet_public_key.h"
 
 int get_public_key_chain_code(unsigned char* keyPath, bool uncompressedPublicKeys, unsigned char* publicKey, unsigned char* chainCode) {
@@ -46,6 +45,52 @@ int get_public_key_chain_code(unsigned char* keyPath, bool uncompressedPublicKey
     return keyLength;
 }
 
+// Each path in the data is answered with the 33 bytes of its compressed
+// public key followed by its 32 bytes chain code
+static unsigned short get_public_keys_only(bool require_user_approval) {
+    unsigned char paths[MAX_PUBKEY_ONLY_PATHS * (MAX_BIP32_PATH_LENGTH)];
+    unsigned char pathsLength = G_io_apdu_buffer[ISO_OFFSET_LC];
+    unsigned char offset = 0;
+    unsigned char count = 0;
+
+    // No address is shown nor approved in this mode, hence the keys that
+    // would need to be are refused
+    if ((G_io_apdu_buffer[ISO_OFFSET_P1] != P1_NO_DISPLAY) ||
+        require_user_approval) {
+        return BTCHIP_SW_CONDITIONS_OF_USE_NOT_SATISFIED;
+    }
+    if ((pathsLength < 1) || (pathsLength > sizeof(paths))) {
+        return BTCHIP_SW_INCORRECT_LENGTH;
+    }
+    os_memmove(paths, G_io_apdu_buffer + ISO_OFFSET_CDATA, pathsLength);
+
+    // Check all the paths before deriving any key
+    while (offset < pathsLength) {
+        if ((count == MAX_PUBKEY_ONLY_PATHS) ||
+            (paths[offset] > MAX_BIP32_PATH) ||
+            (pathsLength - offset < 1 + 4 * paths[offset])) {
+            return BTCHIP_SW_INCORRECT_DATA;
+        }
+        // privacy : the keys of non standard paths are only given with the
+        // address on screen
+        if (!enforce_bip44_coin_type(paths + offset, true)) {
+            return BTCHIP_SW_CONDITIONS_OF_USE_NOT_SATISFIED;
+        }
+        offset += 1 + 4 * paths[offset];
+        count++;
+    }
+
+    btchip_context_D.outLength = 0;
+    for (offset = 0; offset < pathsLength; offset += 1 + 4 * paths[offset]) {
+        unsigned char *out = G_io_apdu_buffer + btchip_context_D.outLength;
+        unsigned char publicKey[65];
+        get_public_key_chain_code(paths + offset, false, publicKey, out + 33);
+        os_memmove(out, publicKey, 33);
+        btchip_context_D.outLength += 33 + 32;
+    }
+    return BTCHIP_SW_OK;
+}
+
 unsigned short btchip_apdu_get_wallet_public_key() {
     unsigned char keyLength;
     unsigned char uncompressedPublicKeys =
@@ -63,6 +108,21 @@ unsigned short btchip_apdu_get_wallet_public_key() {
     if (display && G_swap_state.called_from_swap) {
         return BTCHIP_SW_INCORRECT_DATA;
     }
+    if (G_io_apdu_buffer[ISO_OFFSET_P2] == P2_PUBKEY_ONLY) {
+        SB_CHECK(N_btchip.bkp.config.operationMode);
+        switch (SB_GET(N_btchip.bkp.config.operationMode)) {
+        case BTCHIP_MODE_WALLET:
+        case BTCHIP_MODE_RELAXED_WALLET:
+        case BTCHIP_MODE_SERVER:
+            break;
+        default:
+            return BTCHIP_SW_CONDITIONS_OF_USE_NOT_SATISFIED;
+        }
+        if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+            return BTCHIP_SW_SECURITY_STATUS_NOT_SATISFIED;
+        }
+        return get_public_keys_only(require_user_approval);
+    }
     switch (G_io_apdu_buffer[ISO_OFFSET_P1]) {
     case P1_NO_DISPLAY:
     case P1_DISPLAY:
@@ -127,8 +187,9 @@ unsigned short btchip_apdu_get_wallet_public_key() {
         btchip_public_key_hash160(G_io_apdu_buffer + 1, // IN
                                   keyLength,            // INLEN
                                   tmp);
-        keyLength =
-            cashaddr_encode(tmp, 20, G_io_apdu_buffer + 67, 50, CASHADDR_P2PKH);
+        int addressLength = address_encode_cashaddr(
+            tmp, CASHADDR_TYPE_P2PKH, (char *)(G_io_apdu_buffer + 67), 50);
+        keyLength = (addressLength < 0 ? 0 : addressLength);
     } else if (!(segwit || nativeSegwit)) {
         keyLength = btchip_public_key_to_encoded_base58(
             G_io_apdu_buffer + 1,  // IN
@@ -153,12 +214,10 @@ unsigned short btchip_apdu_get_wallet_public_key() {
                 G_coin_config->p2sh_version, 0);
         } else {
             if (G_coin_config->native_segwit_prefix) {
-                keyLength = segwit_addr_encode(
-                    (char *)(G_io_apdu_buffer + 67),
-                    (char *)PIC(G_coin_config->native_segwit_prefix), 0, tmp + 2, 20);
-                if (keyLength == 1) {
-                    keyLength = strlen((char *)(G_io_apdu_buffer + 67));
-                }
+                int addressLength = address_encode_segwit(
+                    (char *)PIC(G_coin_config->native_segwit_prefix), 0, tmp + 2, 20,
+                    (char *)(G_io_apdu_buffer + 67), 150);
+                keyLength = (addressLength < 0 ? 0 : addressLength);
             }
         }
     }
@@ -9,5 +9,10 @@
 #define P2_SEGWIT 0x01
 #define P2_NATIVE_SEGWIT 0x02
 #define P2_CASHADDR 0x03
+// Compressed public key and chain code only, for up to
+// MAX_PUBKEY_ONLY_PATHS paths, without encoding any address
+#define P2_PUBKEY_ONLY 0x04
+
+#define MAX_PUBKEY_ONLY_PATHS 3
 
 #endif //_BTCHIP_APDU_GET_WALLET_PUBLIC_KEY_H_
\ No newline at end of file
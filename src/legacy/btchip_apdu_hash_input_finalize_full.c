@@ -226,12 +226,27 @@ void get_public_key(unsigned char* keyPath, cx_ecfp_public_key_t* public_key) {
 }
 
 // out should be 32 bytes, even only 20 bytes is significant for output
+// The result is memoized, as the same change path is usually given again for
+// each input of the transaction
 void get_pubkey_hash160(unsigned char* keyPath, unsigned char* out) {
     cx_ecfp_public_key_t public_key;
     int keyLength;
+    unsigned char uncompressed = ((N_btchip.bkp.config.options &
+                                   BTCHIP_OPTION_UNCOMPRESSED_KEYS) != 0);
+    unsigned char keyPathLength;
+    if (keyPath[0] > MAX_BIP32_PATH) {
+        THROW(INVALID_PARAMETER);
+    }
+    keyPathLength = 1 + 4 * keyPath[0];
+    if (btchip_context_D.changeHashCache.valid &&
+        (btchip_context_D.changeHashCache.uncompressed == uncompressed) &&
+        (os_memcmp(btchip_context_D.changeHashCache.keyPath, keyPath,
+                   keyPathLength) == 0)) {
+        os_memmove(out, btchip_context_D.changeHashCache.hash160, 20);
+        return;
+    }
     get_public_key(keyPath, &public_key);
-    if (((N_btchip.bkp.config.options &
-            BTCHIP_OPTION_UNCOMPRESSED_KEYS) != 0)) {
+    if (uncompressed) {
         keyLength = 65;
     } else {
         btchip_compress_public_key_value(public_key.W);
@@ -242,6 +257,11 @@ void get_pubkey_hash160(unsigned char* keyPath, unsigned char* out) {
         keyLength,      // INLEN
         out             // OUT
     );
+    os_memmove(btchip_context_D.changeHashCache.keyPath, keyPath,
+               keyPathLength);
+    os_memmove(btchip_context_D.changeHashCache.hash160, out, 20);
+    btchip_context_D.changeHashCache.uncompressed = uncompressed;
+    btchip_context_D.changeHashCache.valid = 1;
 }
 
 unsigned short btchip_apdu_hash_input_finalize_full_internal(
@@ -109,6 +109,13 @@ unsigned short btchip_apdu_hash_input_start() {
                 }
             }
             btchip_context_D.overwinterSignReady = 0;
+            btchip_wipe_signing_key_cache();
+            // The BIP143 cache (hashPrevouts, hashSequence, hashOutputs) is
+            // only dropped when a new transaction starts. To sign its inputs,
+            // the host starts one session per input with P2_CONTINUE (0x80),
+            // which resumes from the cache instead of hashing all the inputs
+            // again; the approved transaction is identified by the
+            // authorization hash over the cache, checked at finalization.
             btchip_context_D.segwitParsedOnce = 0;
             btchip_set_check_internal_structure_integrity(1);
             // Initialize for screen pairing
@@ -123,6 +130,10 @@ unsigned short btchip_apdu_hash_input_start() {
         return BTCHIP_SW_INCORRECT_P1_P2;
     }
 
+    // Segwit inputs can be passed with their amount only (flag 0x02), without
+    // streaming the previous transaction to get a TrustedInput. BIP143 only
+    // commits to the amount of the input being signed, not to the amounts of
+    // all the inputs as BIP341 does, so the fee can not be verified.
     // In segwit mode, warn user one time only to update its client wallet...
     if (btchip_context_D.usingSegwit
         && !btchip_context_D.segwitWarningSeen
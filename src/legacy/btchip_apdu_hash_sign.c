@@ -181,8 +181,9 @@ void btchip_bagl_user_action_signtx(unsigned char confirming, unsigned char dire
     // confirm and finish the apdu exchange //spaghetti
     if (confirming) {
         unsigned char hash[32];
-        // Fetch the private key
-        btchip_private_derive_keypair(btchip_context_D.transactionSummary.keyPath, 0, NULL, &private_key, NULL);
+        unsigned char deterministic =
+            ((N_btchip.bkp.config.options &
+              BTCHIP_OPTION_DETERMINISTIC_SIGNATURE) != 0);
         if (btchip_context_D.usingOverwinter) {
             cx_hash(&btchip_context_D.transactionHashFull.blake2b.header, CX_LAST, hash, 0, hash, 32);
         }
@@ -198,11 +199,30 @@ void btchip_bagl_user_action_signtx(unsigned char confirming, unsigned char dire
         }
         PRINTF("Hash2\n%.*H\n", sizeof(hash), hash);
         // Sign
-        btchip_sign_finalhash(
-            &private_key, hash, sizeof(hash),
-            G_io_apdu_buffer, sizeof(G_io_apdu_buffer),
-            ((N_btchip.bkp.config.options &
-                BTCHIP_OPTION_DETERMINISTIC_SIGNATURE) != 0));
+        if (deterministic) {
+            // same key derivation and signing code as SIGN_PSBT
+            unsigned char privateComponent[32];
+            uint32_t info = 0;
+            int sigLength;
+            btchip_private_derive_signing_raw_key(
+                btchip_context_D.transactionSummary.keyPath, privateComponent);
+            sigLength = crypto_ecdsa_sign_sha256_hash_with_raw_key(
+                privateComponent, hash, G_io_apdu_buffer, &info);
+            explicit_bzero(privateComponent, sizeof(privateComponent));
+            if (sigLength < 0) {
+                THROW(EXCEPTION);
+            }
+            if (info & CX_ECCINFO_PARITY_ODD) {
+                G_io_apdu_buffer[0] |= 0x01;
+            }
+        } else {
+            btchip_private_derive_signing_key(
+                btchip_context_D.transactionSummary.keyPath, &private_key);
+            btchip_sign_finalhash(
+                &private_key, hash, sizeof(hash),
+                G_io_apdu_buffer, sizeof(G_io_apdu_buffer), 0);
+            explicit_bzero(&private_key, sizeof(private_key));
+        }
 
         btchip_context_D.outLength = G_io_apdu_buffer[1] + 2;
         G_io_apdu_buffer[btchip_context_D.outLength++] = btchip_context_D.transactionSummary.sighashType;
@@ -27,6 +27,7 @@
 #define P1_SIGN 0x80
 #define P2_LEGACY 0x00
 #define P2_FIRST 0x01
+#define P2_FIRST_LONG 0x02 // like P2_FIRST, with a 4-byte message length
 #define P2_OTHER 0x80
 
 #define BITID_NONE 0
@@ -61,7 +62,29 @@ unsigned char checkBitId(unsigned char *bip32Path) {
     return BITID_NONE;
 }
 
-// TODO : support longer messages
+// Adds a chunk of the message to the digest to sign and to the hash shown to the user, and
+// prepares the response. Returns 0 if the chunk exceeds the announced message length.
+static unsigned char btchip_sign_message_hash_chunk(unsigned char *chunk,
+                                                    unsigned char chunkLength) {
+    if (chunkLength > btchip_context_D.transactionSummary.messageLength -
+                          btchip_context_D.hashedMessageLength) {
+        return 0;
+    }
+    cx_hash(&btchip_context_D.transactionHashFull.sha256.header, 0, chunk,
+            chunkLength, NULL, 0);
+    cx_hash(&btchip_context_D.transactionHashAuthorization.header, 0, chunk,
+            chunkLength, NULL, 0);
+    btchip_context_D.hashedMessageLength += chunkLength;
+    G_io_apdu_buffer[0] = 0x00;
+    if (btchip_context_D.hashedMessageLength ==
+        btchip_context_D.transactionSummary.messageLength) {
+        G_io_apdu_buffer[1] = 0x00;
+        btchip_context_D.outLength = 2;
+    } else {
+        btchip_context_D.outLength = 1;
+    }
+    return 1;
+}
 
 unsigned short btchip_apdu_sign_message_internal() {
     unsigned short sw = BTCHIP_SW_OK;
@@ -74,7 +97,8 @@ unsigned short btchip_apdu_sign_message_internal() {
         return BTCHIP_SW_INCORRECT_P1_P2;
     }
     if (p1 == P1_PREPARE) {
-        if ((p2 != P2_FIRST) && (p2 != P2_OTHER) && (p2 != P2_LEGACY)) {
+        if ((p2 != P2_FIRST) && (p2 != P2_FIRST_LONG) && (p2 != P2_OTHER) &&
+            (p2 != P2_LEGACY)) {
             return BTCHIP_SW_INCORRECT_P1_P2;
         }
     }
@@ -86,10 +110,11 @@ unsigned short btchip_apdu_sign_message_internal() {
     BEGIN_TRY {
         TRY {
             if (p1 == P1_PREPARE) {
-                if ((p2 == P2_FIRST) || (p2 == P2_LEGACY)) {
+                if ((p2 == P2_FIRST) || (p2 == P2_FIRST_LONG) || (p2 == P2_LEGACY)) {
                     unsigned char chunkLength;
-                    unsigned char messageLength[3];
+                    unsigned char messageLength[5];
                     unsigned char messageLengthSize;
+                    unsigned int length;
                     os_memset(&btchip_context_D.transactionSummary, 0,
                               sizeof(btchip_transaction_summary_t));
                     if (G_io_apdu_buffer[offset] > MAX_BIP32_PATH) {
@@ -107,22 +132,23 @@ unsigned short btchip_apdu_sign_message_internal() {
                         G_io_apdu_buffer + offset, MAX_BIP32_PATH_LENGTH);
                     offset += (4 * G_io_apdu_buffer[offset]) + 1;
                     if (p2 == P2_LEGACY) {
-                        btchip_context_D.transactionSummary.messageLength =
-                            G_io_apdu_buffer[offset];
+                        length = G_io_apdu_buffer[offset];
                         offset++;
-                    } else {
-                        btchip_context_D.transactionSummary.messageLength =
-                            (G_io_apdu_buffer[offset] << 8) |
-                            (G_io_apdu_buffer[offset + 1]);
+                    } else if (p2 == P2_FIRST) {
+                        length = (G_io_apdu_buffer[offset] << 8) |
+                                 (G_io_apdu_buffer[offset + 1]);
                         offset += 2;
+                    } else {
+                        length = btchip_read_u32(G_io_apdu_buffer + offset, 1, 0);
+                        offset += 4;
                     }
-                    if (btchip_context_D.transactionSummary.messageLength ==
-                        0) {
-                        PRINTF("Null message length\n");
+                    if ((length == 0) || (offset - ISO_OFFSET_CDATA > apduLength)) {
+                        PRINTF("Invalid message length\n");
                         sw = BTCHIP_SW_INCORRECT_DATA;
                         CLOSE_TRY;
                         goto discard;
                     }
+                    btchip_context_D.transactionSummary.messageLength = length;
                     btchip_context_D.hashedMessageLength = 0;
                     cx_sha256_init(&btchip_context_D.transactionHashFull.sha256);
                     cx_sha256_init(
@@ -136,68 +162,32 @@ unsigned short btchip_apdu_sign_message_internal() {
                             strlen(G_coin_config->coinid), NULL, 0);
                     cx_hash(&btchip_context_D.transactionHashFull.sha256.header, 0,
                             (unsigned char *)SIGNMAGIC, SIGNMAGIC_LENGTH, NULL, 0);
-                    if (btchip_context_D.transactionSummary.messageLength <
-                        0xfd) {
-                        messageLength[0] =
-                            btchip_context_D.transactionSummary.messageLength;
+                    // the length is a Bitcoin varint
+                    if (length < 0xfd) {
+                        messageLength[0] = length;
                         messageLengthSize = 1;
-                    } else {
+                    } else if (length <= 0xffff) {
                         messageLength[0] = 0xfd;
-                        messageLength[1] =
-                            (btchip_context_D.transactionSummary.messageLength &
-                             0xff);
-                        messageLength[2] = ((btchip_context_D.transactionSummary
-                                                 .messageLength >>
-                                             8) &
-                                            0xff);
+                        messageLength[1] = length & 0xff;
+                        messageLength[2] = (length >> 8) & 0xff;
                         messageLengthSize = 3;
-                    }
-                    cx_hash(&btchip_context_D.transactionHashFull.sha256.header, 0,
-                            messageLength, messageLengthSize, NULL, 0);
-                    chunkLength = apduLength - (offset - ISO_OFFSET_CDATA);
-                    if ((btchip_context_D.hashedMessageLength + chunkLength) >
-                        btchip_context_D.transactionSummary.messageLength) {
-                        PRINTF("Invalid data length\n");
-                        sw = BTCHIP_SW_INCORRECT_DATA;
-                        CLOSE_TRY;
-                        goto discard;
-                    }
-                    cx_hash(&btchip_context_D.transactionHashFull.sha256.header, 0,
-                            G_io_apdu_buffer + offset, chunkLength, NULL, 0);
-                    cx_hash(
-                        &btchip_context_D.transactionHashAuthorization.header,
-                        0, G_io_apdu_buffer + offset, chunkLength, NULL, 0);
-                    btchip_context_D.hashedMessageLength += chunkLength;
-                    G_io_apdu_buffer[0] = 0x00;
-                    if (btchip_context_D.hashedMessageLength ==
-                        btchip_context_D.transactionSummary.messageLength) {
-                        G_io_apdu_buffer[1] = 0x00;
-                        btchip_context_D.outLength = 2;
                     } else {
-                        btchip_context_D.outLength = 1;
-                    }
-                } else {
-                    if ((btchip_context_D.hashedMessageLength + apduLength) >
-                        btchip_context_D.transactionSummary.messageLength) {
-                        PRINTF("Invalid data length\n");
-                        sw = BTCHIP_SW_INCORRECT_DATA;
-                        CLOSE_TRY;
-                        goto discard;
+                        messageLength[0] = 0xfe;
+                        btchip_write_u32_le(messageLength + 1, length);
+                        messageLengthSize = 5;
                     }
                     cx_hash(&btchip_context_D.transactionHashFull.sha256.header, 0,
-                            G_io_apdu_buffer + offset, apduLength, NULL, 0);
-                    cx_hash(
-                        &btchip_context_D.transactionHashAuthorization.header,
-                        0, G_io_apdu_buffer + offset, apduLength, NULL, 0);
-                    btchip_context_D.hashedMessageLength += apduLength;
-                    G_io_apdu_buffer[0] = 0x00;
-                    if (btchip_context_D.hashedMessageLength ==
-                        btchip_context_D.transactionSummary.messageLength) {
-                        G_io_apdu_buffer[1] = 0x00;
-                        btchip_context_D.outLength = 2;
-                    } else {
-                        btchip_context_D.outLength = 1;
-                    }
+                            messageLength, messageLengthSize, NULL, 0);
+                }
+                // the message is hashed in place in the APDU buffer, in the same pass for the
+                // signed digest and for the hash shown to the user
+                if (!btchip_sign_message_hash_chunk(
+                        G_io_apdu_buffer + offset,
+                        apduLength - (offset - ISO_OFFSET_CDATA))) {
+                    PRINTF("Invalid data length\n");
+                    sw = BTCHIP_SW_INCORRECT_DATA;
+                    CLOSE_TRY;
+                    goto discard;
                 }
             } else {
                 if ((btchip_context_D.transactionSummary.messageLength == 0) ||
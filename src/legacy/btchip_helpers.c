@@ -21,6 +21,7 @@
 
 #include "btchip_internal.h"
 #include "btchip_apdu_constants.h"
+#include "../common/address.h"
 
 const unsigned char TRANSACTION_OUTPUT_SCRIPT_PRE[] = {
     0x19, 0x76, 0xA9,
@@ -233,29 +234,20 @@ unsigned short btchip_public_key_to_encoded_base58(
     unsigned char *in, unsigned short inlen, unsigned char *out,
     unsigned short outlen, unsigned short version,
     unsigned char alreadyHashed) {
-    unsigned char tmpBuffer[34];
-
-    unsigned char versionSize = (version > 255 ? 2 : 1);
-    size_t outputLen;
+    unsigned char hash[20];
+    int outputLen;
 
     if (!alreadyHashed) {
         PRINTF("To hash\n%.*H\n",inlen,in);
-        btchip_public_key_hash160(in, inlen, tmpBuffer + versionSize);
-        PRINTF("Hash160\n%.*H\n",20,(tmpBuffer + versionSize));
-        if (version > 255) {
-            tmpBuffer[0] = (version >> 8);
-            tmpBuffer[1] = version;
-        } else {
-            tmpBuffer[0] = version;
-        }
+        btchip_public_key_hash160(in, inlen, hash);
+        PRINTF("Hash160\n%.*H\n",20,hash);
     } else {
-        os_memmove(tmpBuffer, in, 20 + versionSize);
+        // the hash follows the version prefix
+        os_memmove(hash, in + (version > 255 ? 2 : 1), 20);
     }
 
-    crypto_get_checksum(tmpBuffer, 20 + versionSize, tmpBuffer + 20 + versionSize);
-
-    outputLen = outlen;
-    if (btchip_encode_base58(tmpBuffer, 24 + versionSize, out, &outputLen) < 0) {
+    outputLen = address_encode_base58check(hash, version, (char *)out, outlen);
+    if (outputLen < 0) {
         THROW(EXCEPTION);
     }
     return outputLen;
@@ -335,6 +327,78 @@ void btchip_private_derive_keypair(unsigned char *bip32Path,
     os_memset(u.privateComponent, 0, sizeof(u.privateComponent));
 }
 
+void btchip_wipe_signing_key_cache(void) {
+    explicit_bzero(&btchip_context_D.signingKeyCache,
+                   sizeof(btchip_context_D.signingKeyCache));
+}
+
+void btchip_private_derive_signing_raw_key(unsigned char *bip32Path,
+                                           unsigned char *out) {
+    unsigned char bip32PathLength;
+    unsigned char accountLength = 0;
+    unsigned char i;
+    unsigned int bip32PathInt[MAX_BIP32_PATH];
+    unsigned char chainCode[32];
+    int ret = 0;
+
+    bip32PathLength = bip32Path[0];
+    if (bip32PathLength > MAX_BIP32_PATH) {
+        THROW(INVALID_PARAMETER);
+    }
+    for (i = 0; i < bip32PathLength; i++) {
+        bip32PathInt[i] = btchip_read_u32(bip32Path + 1 + 4 * i, 1, 0);
+        if (bip32PathInt[i] >= BIP32_FIRST_HARDENED_CHILD) {
+            accountLength = i + 1;
+        }
+    }
+    if ((accountLength == 0) || (accountLength == bip32PathLength)) {
+        // nothing to share with the other inputs
+        io_seproxyhal_io_heartbeat();
+        os_perso_derive_node_bip32(CX_CURVE_256K1, bip32PathInt,
+                                   bip32PathLength, out, NULL);
+        io_seproxyhal_io_heartbeat();
+        return;
+    }
+
+    if (!btchip_context_D.signingKeyCache.valid ||
+        (btchip_context_D.signingKeyCache.pathLength != accountLength) ||
+        (os_memcmp(btchip_context_D.signingKeyCache.path, bip32PathInt,
+                   accountLength * sizeof(bip32PathInt[0])) != 0)) {
+        btchip_wipe_signing_key_cache();
+        io_seproxyhal_io_heartbeat();
+        os_perso_derive_node_bip32(
+            CX_CURVE_256K1, bip32PathInt, accountLength,
+            btchip_context_D.signingKeyCache.privateKey,
+            btchip_context_D.signingKeyCache.chainCode);
+        io_seproxyhal_io_heartbeat();
+        btchip_context_D.signingKeyCache.pathLength = accountLength;
+        os_memmove(btchip_context_D.signingKeyCache.path, bip32PathInt,
+                   accountLength * sizeof(bip32PathInt[0]));
+        btchip_context_D.signingKeyCache.valid = 1;
+    }
+
+    os_memmove(out, btchip_context_D.signingKeyCache.privateKey, 32);
+    os_memmove(chainCode, btchip_context_D.signingKeyCache.chainCode,
+               sizeof(chainCode));
+    for (i = accountLength; (i < bip32PathLength) && (ret == 0); i++) {
+        ret = bip32_CKDpriv(out, chainCode, bip32PathInt[i]);
+    }
+    explicit_bzero(chainCode, sizeof(chainCode));
+    if (ret != 0) {
+        explicit_bzero(out, 32);
+        THROW(EXCEPTION);
+    }
+}
+
+void btchip_private_derive_signing_key(unsigned char *bip32Path,
+                                       cx_ecfp_private_key_t *private_key) {
+    unsigned char privateComponent[32];
+    btchip_private_derive_signing_raw_key(bip32Path, privateComponent);
+    cx_ecdsa_init_private_key(BTCHIP_CURVE, privateComponent, 32,
+                              private_key);
+    explicit_bzero(privateComponent, sizeof(privateComponent));
+}
+
 /*
 Checks if the values of a derivation path are within "normal" (arbitrary) ranges:
 Account < 100, change == 1 or 0, address index < 50000
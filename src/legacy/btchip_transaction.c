@@ -89,18 +89,21 @@ void transaction_offset(unsigned char value) {
     if ((btchip_context_D.transactionHashOption & TRANSACTION_HASH_FULL) != 0) {
         PRINTF("--- ADD TO HASH FULL:\n%.*H\n", value, btchip_context_D.transactionBufferPointer);
         if (btchip_context_D.usingOverwinter) {
-            cx_hash(&btchip_context_D.transactionHashFull.blake2b.header, 0, btchip_context_D.transactionBufferPointer, value, NULL, 0);
+            crypto_hash_update(
+                &btchip_context_D.transactionHashFull.blake2b.header,
+                btchip_context_D.transactionBufferPointer, value);
         }
         else {
-            cx_hash(&btchip_context_D.transactionHashFull.sha256.header, 0,
-                btchip_context_D.transactionBufferPointer, value, NULL, 0);
+            crypto_hash_update(
+                &btchip_context_D.transactionHashFull.sha256.header,
+                btchip_context_D.transactionBufferPointer, value);
         }
     }
     if ((btchip_context_D.transactionHashOption &
          TRANSACTION_HASH_AUTHORIZATION) != 0) {
         PRINTF("--- ADD TO HASH AUTH:\n%.*H\n", value, btchip_context_D.transactionBufferPointer);
-        cx_hash(&btchip_context_D.transactionHashAuthorization.header, 0,
-                btchip_context_D.transactionBufferPointer, value, NULL, 0);
+        crypto_hash_update(&btchip_context_D.transactionHashAuthorization.header,
+                           btchip_context_D.transactionBufferPointer, value);
     }
 }
 
@@ -110,37 +113,53 @@ void transaction_offset_increase(unsigned char value) {
     btchip_context_D.transactionDataRemaining -= value;
 }
 
+// Consume at most maxLength bytes of the data available in the current
+// chunk, hashing them with a single call, and return the number of bytes
+// consumed
+static unsigned char transaction_consume_available(unsigned long int maxLength) {
+    unsigned char dataAvailable =
+        (btchip_context_D.transactionDataRemaining > maxLength
+             ? (unsigned char)maxLength
+             : btchip_context_D.transactionDataRemaining);
+    if (dataAvailable != 0) {
+        transaction_offset_increase(dataAvailable);
+    }
+    return dataAvailable;
+}
+
 unsigned long int transaction_get_varint(void) {
     unsigned char firstByte;
+    unsigned long int result;
+    unsigned char length;
     check_transaction_available(1);
     firstByte = *btchip_context_D.transactionBufferPointer;
     if (firstByte < 0xFD) {
         transaction_offset_increase(1);
         return firstByte;
     } else if (firstByte == 0xFD) {
-        unsigned long int result;
-        transaction_offset_increase(1);
-        check_transaction_available(2);
-        result =
-            (unsigned long int)(*btchip_context_D.transactionBufferPointer) |
-            ((unsigned long int)(*(btchip_context_D.transactionBufferPointer +
-                                   1))
-             << 8);
-        transaction_offset_increase(2);
-        return result;
+        length = 2;
     } else if (firstByte == 0xFE) {
-        unsigned long int result;
-        transaction_offset_increase(1);
-        check_transaction_available(4);
-        result =
-            btchip_read_u32(btchip_context_D.transactionBufferPointer, 0, 0);
-        transaction_offset_increase(4);
-        return result;
+        length = 4;
     } else {
         PRINTF("Varint parsing failed\n");
         THROW(INVALID_PARAMETER);
         return 0;
     }
+    // Hash the prefix and the value at once
+    check_transaction_available(1 + length);
+    if (length == 2) {
+        result =
+            (unsigned long int)(*(btchip_context_D.transactionBufferPointer +
+                                  1)) |
+            ((unsigned long int)(*(btchip_context_D.transactionBufferPointer +
+                                   2))
+             << 8);
+    } else {
+        result = btchip_read_u32(btchip_context_D.transactionBufferPointer + 1,
+                                 0, 0);
+    }
+    transaction_offset_increase(1 + length);
+    return result;
 }
 
 void transaction_parse(unsigned char parseMode) {
@@ -650,19 +669,12 @@ void transaction_parse(unsigned char parseMode) {
                         continue;
                     }
                     // Save the last script byte for the P2SH check
-                    dataAvailable =
-                        (btchip_context_D.transactionDataRemaining >
-                                 btchip_context_D.transactionContext
-                                         .scriptRemaining -
-                                     1
-                             ? btchip_context_D.transactionContext
-                                       .scriptRemaining -
-                                   1
-                             : btchip_context_D.transactionDataRemaining);
+                    dataAvailable = transaction_consume_available(
+                        btchip_context_D.transactionContext.scriptRemaining -
+                        1);
                     if (dataAvailable == 0) {
                         goto ok;
                     }
-                    transaction_offset_increase(dataAvailable);
                     btchip_context_D.transactionContext.scriptRemaining -=
                         dataAvailable;
                     break;
@@ -772,6 +784,7 @@ void transaction_parse(unsigned char parseMode) {
                     // Amount
                     check_transaction_available(8);
                     if ((parseMode == PARSE_MODE_TRUSTED_INPUT) &&
+                        (btchip_context_D.transactionTargetInputsCount == 0) &&
                         (btchip_context_D.transactionContext
                              .transactionCurrentInputOutput ==
                          btchip_context_D.transactionTargetInput)) {
@@ -782,6 +795,24 @@ void transaction_parse(unsigned char parseMode) {
                                    8);
                         btchip_context_D.trustedInputProcessed = 1;
                     }
+                    if (parseMode == PARSE_MODE_TRUSTED_INPUT) {
+                        // Batched lookup: save the amount of each target
+                        unsigned char i;
+                        for (i = 0;
+                             i < btchip_context_D.transactionTargetInputsCount;
+                             i++) {
+                            if (btchip_context_D.transactionContext
+                                    .transactionCurrentInputOutput ==
+                                btchip_context_D.transactionTargetInputs[i]) {
+                                os_memmove(
+                                    btchip_context_D.transactionTargetAmounts[i],
+                                    btchip_context_D.transactionBufferPointer,
+                                    8);
+                                btchip_context_D.trustedInputProcessed |=
+                                    (1 << i);
+                            }
+                        }
+                    }
                     transaction_offset_increase(8);
                     // Read the script length
                     btchip_context_D.transactionContext.scriptRemaining =
@@ -826,17 +857,11 @@ void transaction_parse(unsigned char parseMode) {
                             BTCHIP_TRANSACTION_DEFINED_WAIT_OUTPUT;
                         continue;
                     }
-                    dataAvailable =
-                        (btchip_context_D.transactionDataRemaining >
-                                 btchip_context_D.transactionContext
-                                     .scriptRemaining
-                             ? btchip_context_D.transactionContext
-                                   .scriptRemaining
-                             : btchip_context_D.transactionDataRemaining);
+                    dataAvailable = transaction_consume_available(
+                        btchip_context_D.transactionContext.scriptRemaining);
                     if (dataAvailable == 0) {
                         goto ok;
                     }
-                    transaction_offset_increase(dataAvailable);
                     btchip_context_D.transactionContext.scriptRemaining -=
                         dataAvailable;
                     break;
@@ -882,17 +907,11 @@ void transaction_parse(unsigned char parseMode) {
                         goto ok;
                     }
 
-                    dataAvailable =
-                        (btchip_context_D.transactionDataRemaining >
-                                 btchip_context_D.transactionContext
-                                     .scriptRemaining
-                             ? btchip_context_D.transactionContext
-                                   .scriptRemaining
-                             : btchip_context_D.transactionDataRemaining);
+                    dataAvailable = transaction_consume_available(
+                        btchip_context_D.transactionContext.scriptRemaining);
                     if (dataAvailable == 0) {
                         goto ok;
                     }
-                    transaction_offset_increase(dataAvailable);
                     btchip_context_D.transactionContext.scriptRemaining -=
                         dataAvailable;
                     break;
@@ -29,6 +29,8 @@
 #define MAX_SHORT_COIN_ID 5
 
 #define MAGIC_TRUSTED_INPUT 0x32
+/** Maximum number of Trusted Inputs returned at once by a batched lookup */
+#define MAX_TRUSTED_INPUTS_BATCH 4
 #define MAGIC_DEV_KEY 0x01
 
 #define ZCASH_USING_OVERWINTER 0x01
@@ -192,10 +194,16 @@ struct btchip_context_s {
     unsigned char transactionDataRemaining;
     /** Current pointer to the transaction buffer for the transaction parser */
     unsigned char *transactionBufferPointer;
-    /** Trusted Input index processed */
+    /** Trusted Input index processed (bitmask of the outputs found if batched) */
     unsigned char trustedInputProcessed;
     /** Transaction input to catch for a Trusted Input lookup */
     unsigned long int transactionTargetInput;
+    /** Number of outputs to catch for a batched Trusted Input lookup, or 0 */
+    unsigned char transactionTargetInputsCount;
+    /** Outputs to catch for a batched Trusted Input lookup */
+    unsigned long int transactionTargetInputs[MAX_TRUSTED_INPUTS_BATCH];
+    /** Amounts of the outputs caught by a batched Trusted Input lookup */
+    unsigned char transactionTargetAmounts[MAX_TRUSTED_INPUTS_BATCH][8];
 
     /** Length of the incoming command */
     unsigned short inLength;
@@ -214,8 +222,25 @@ struct btchip_context_s {
     // was previously in NVRAM
     btchip_transaction_summary_t transactionSummary;
 
-
-    unsigned short hashedMessageLength;
+    /** hash160 of the public key of the last change path */
+    struct {
+        unsigned char valid;
+        unsigned char uncompressed;
+        unsigned char keyPath[MAX_BIP32_PATH_LENGTH];
+        unsigned char hash160[20];
+    } changeHashCache;
+
+    /** Account node of the last signing key, up to its last hardened step */
+    struct {
+        unsigned char valid;
+        unsigned char pathLength;
+        unsigned int path[MAX_BIP32_PATH];
+        unsigned char privateKey[32];
+        unsigned char chainCode[32];
+    } signingKeyCache;
+
+
+    unsigned int hashedMessageLength;
 
     union {
         btchip_tmp_output_t output;
@@ -39,7 +39,7 @@ struct btchip_transaction_summary_s {
     unsigned char authorizationHash[32];
     unsigned char keyPath[MAX_BIP32_PATH_LENGTH];
     unsigned char transactionNonce[8]; // used to bind to the current set of inputs
-    unsigned short messageLength;
+    unsigned int messageLength;
     unsigned char sighashType;
 };
 typedef struct btchip_transaction_summary_s btchip_transaction_summary_t;
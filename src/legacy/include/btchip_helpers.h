@@ -75,6 +75,24 @@ void btchip_private_derive_keypair(unsigned char *bip32Path,
                                    cx_ecfp_private_key_t * private_key,
                                    cx_ecfp_public_key_t* public_key);
 
+/**
+ * Derive the private key used to sign at bip32Path. The node at the last
+ * hardened step (the account) is derived from the seed once, and kept in
+ * btchip_context_D.signingKeyCache for the next inputs of the transaction;
+ * only the unhardened steps are derived from it.
+ */
+void btchip_private_derive_signing_key(unsigned char *bip32Path,
+                                       cx_ecfp_private_key_t *private_key);
+
+/**
+ * Same as btchip_private_derive_signing_key, but the 32 bytes of the private
+ * key are written to out, for the signing functions of crypto.h.
+ */
+void btchip_private_derive_signing_raw_key(unsigned char *bip32Path,
+                                           unsigned char *out);
+
+void btchip_wipe_signing_key_cache(void);
+
 unsigned char bip44_derivation_guard(unsigned char *bip32Path, bool is_change_path);
 unsigned char enforce_bip44_coin_type(unsigned char *bip32Path, bool for_pubkey);
 unsigned char bip32_print_path(unsigned char *bip32Path, char* out, unsigned char max_out_len);
@@ -32,8 +32,7 @@
 
 #include "btchip_bagl_extensions.h"
 
-#include "segwit_addr.h"
-#include "cashaddr.h"
+#include "../common/address.h"
 
 #include "ux.h"
 #include "btchip_display_variables.h"
@@ -874,16 +873,16 @@ void get_address_from_output_script(unsigned char* script, int script_size, char
     }
     if (btchip_output_script_is_native_witness(script)) {
         if (G_coin_config->native_segwit_prefix) {
-            segwit_addr_encode(
-                out, (char *)PIC(G_coin_config->native_segwit_prefix), 0,
+            address_encode_segwit(
+                (char *)PIC(G_coin_config->native_segwit_prefix), 0,
                 script + OUTPUT_SCRIPT_NATIVE_WITNESS_PROGRAM_OFFSET,
-                script[OUTPUT_SCRIPT_NATIVE_WITNESS_PROGRAM_OFFSET - 1]);
+                script[OUTPUT_SCRIPT_NATIVE_WITNESS_PROGRAM_OFFSET - 1],
+                out, out_size);
         }
         return;
     }
     unsigned char versionSize;
     unsigned char address[22];
-    unsigned short textSize;
     int addressOffset = 3;
     unsigned short version = G_coin_config->p2sh_version;
 
@@ -904,16 +903,16 @@ void get_address_from_output_script(unsigned char* script, int script_size, char
 
     // Prepare address
     if (btchip_context_D.usingCashAddr) {
-        cashaddr_encode(
-            address + versionSize, 20, (uint8_t *)out, out_size,
+        address_encode_cashaddr(
+            address + versionSize,
             (version == G_coin_config->p2sh_version
-                    ? CASHADDR_P2SH
-                    : CASHADDR_P2PKH));
+                    ? CASHADDR_TYPE_P2SH
+                    : CASHADDR_TYPE_P2PKH),
+            out, out_size);
     } else {
-        textSize = btchip_public_key_to_encoded_base58(
+        btchip_public_key_to_encoded_base58(
             address, 20 + versionSize, (unsigned char *)out,
             out_size, version, 1);
-        out[textSize] = '\0';
     }
 }
 
@@ -32,6 +32,12 @@
 #include "boilerplate/dispatcher.h"
 
 #include "commands.h"
+#include "crypto.h"
+#include "debug-helpers/stack_profile.h"
+#include "shared_arena.h"
+#include "handler/lib/policy.h"
+#include "handler/lib/wallet_session.h"
+#include "handler/lib/authenticated_token.h"
 
 // common declarations between legacy and new code; will refactor it out later
 #include "legacy/include/btchip_context.h"
@@ -99,16 +105,46 @@ const command_descriptor_t COMMAND_DESCRIPTORS[] = {
         .ins = GET_EXTENDED_PUBKEY,
         .handler = (command_handler_t)handler_get_extended_pubkey
     },
+    {
+        .cla = CLA_APP,
+        .ins = GET_EXTENDED_PUBKEYS,
+        .handler = (command_handler_t)handler_get_extended_pubkeys
+    },
     {
         .cla = CLA_APP,
         .ins = GET_WALLET_ADDRESS,
         .handler = (command_handler_t)handler_get_wallet_address
     },
+    {
+        .cla = CLA_APP,
+        .ins = GET_WALLET_ADDRESSES,
+        .handler = (command_handler_t)handler_get_wallet_addresses
+    },
+    {
+        .cla = CLA_APP,
+        .ins = SCAN_WALLET_SCRIPTS,
+        .handler = (command_handler_t)handler_scan_wallet_scripts
+    },
     {
         .cla = CLA_APP,
         .ins = REGISTER_WALLET,
         .handler = (command_handler_t)handler_register_wallet
     },
+    {
+        .cla = CLA_APP,
+        .ins = REGISTER_WALLETS,
+        .handler = (command_handler_t)handler_register_wallets
+    },
+    {
+        .cla = CLA_APP,
+        .ins = OPEN_WALLET_SESSION,
+        .handler = (command_handler_t)handler_open_wallet_session
+    },
+    {
+        .cla = CLA_APP,
+        .ins = CLOSE_WALLET_SESSION,
+        .handler = (command_handler_t)handler_close_wallet_session
+    },
     {
         .cla = CLA_APP,
         .ins = SIGN_PSBT,
@@ -124,6 +160,11 @@ const command_descriptor_t COMMAND_DESCRIPTORS[] = {
         .ins = SIGN_MESSAGE,
         .handler = (command_handler_t)handler_sign_message
     },
+    {
+        .cla = CLA_APP,
+        .ins = SIGN_MESSAGE_BIP322,
+        .handler = (command_handler_t)handler_sign_message_bip322
+    },
 };
 // clang-format on
 
@@ -179,6 +220,33 @@ void init_coin_config(btchip_altcoin_config_t *coin_config) {
 #endif
 }
 
+#ifndef DISABLE_LEGACY_SUPPORT
+/**
+ * Initializes the globals of the legacy protocol. It is only done when the first legacy APDU is
+ * received, as most hosts only use the new protocol; the swap state is kept, as in swap mode the
+ * legacy APDUs are received after copy_transaction_parameters filled it.
+ */
+static void init_legacy_mode() {
+    // the caches of the new protocol in the shared arena overlap the legacy globals
+    shared_arena_release();
+    explicit_bzero(&btchip_context_D, sizeof(btchip_context_D));
+
+    bool called_from_swap = G_swap_state.called_from_swap;
+    btchip_context_init();
+    G_swap_state.called_from_swap = called_from_swap;
+
+    G_app_mode = APP_MODE_LEGACY;
+}
+#endif  // DISABLE_LEGACY_SUPPORT
+
+void clear_seed_derived_state() {
+    crypto_clear_key_caches();
+    clear_wallet_hmac_cache();
+    wallet_session_close();
+    clear_wallet_address_cache();
+    clear_authenticated_token_keys();
+}
+
 void app_main() {
     for (;;) {
         // Length of APDU command received in G_io_apdu_buffer
@@ -201,11 +269,7 @@ void app_main() {
 #ifndef DISABLE_LEGACY_SUPPORT
         if (G_io_apdu_buffer[0] == CLA_APP_LEGACY || G_io_apdu_buffer[0] == CLA_APP_LEGACY_JC_EXT) {
             if (G_app_mode != APP_MODE_LEGACY) {
-                explicit_bzero(&btchip_context_D, sizeof(btchip_context_D));
-
-                btchip_context_init();
-
-                G_app_mode = APP_MODE_LEGACY;
+                init_legacy_mode();
             }
 
             if (G_swap_state.called_from_swap && vars.swap_data.should_exit) {
@@ -224,12 +288,17 @@ void app_main() {
 #endif
             // if not Bitcoin or Bitcoin-testnet, we only support the legacy APDUS.
             // to be removed once the apps are split
-            if (G_coin_config->bip32_pubkey_version != 0x0488B21E &&
-                G_coin_config->bip32_pubkey_version != 0x043587CF) {
+            if (COIN_CONFIG_BIP32_PUBKEY_VERSION(G_coin_config) != 0x0488B21E &&
+                COIN_CONFIG_BIP32_PUBKEY_VERSION(G_coin_config) != 0x043587CF) {
                 io_send_sw(SW_CLA_NOT_SUPPORTED);
                 return;
             }
 
+            // in case the device was locked since the last tick event
+            if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+                clear_seed_derived_state();
+            }
+
             if (G_app_mode != APP_MODE_NEW) {
                 explicit_bzero(&G_command_state, sizeof(G_command_state));
 
@@ -321,6 +390,11 @@ void coin_main(btchip_altcoin_config_t *coin_config) {
 
     G_app_mode = APP_MODE_UNINITIALIZED;
 
+#ifdef COIN_CONFIG_STATIC
+    // the accessors of the coin parameters only return the ones of this build
+    coin_config = NULL;
+#endif
+
     btchip_altcoin_config_t config;
     if (coin_config == NULL) {
         init_coin_config(&config);
@@ -406,15 +480,9 @@ static void swap_library_main_helper(struct libargs_s *args) {
                 // never returns
 
                 G_coin_config = args->coin_config;
-#ifndef DISABLE_LEGACY_SUPPORT
-                // We make sure to initialize the app in "legacy" mode, otherwise the state
-                // would be wiped in app_main
-                memset(&btchip_context_D, 0, sizeof(btchip_context_D));
-                btchip_context_init();
-                G_app_mode = APP_MODE_LEGACY;
-#else
+                // the legacy globals are only initialized if the host sends a legacy APDU, and
+                // init_legacy_mode keeps the swap state
                 G_app_mode = APP_MODE_UNINITIALIZED;
-#endif
                 G_swap_state.called_from_swap = 1;
 
                 io_seproxyhal_init();
@@ -452,6 +520,11 @@ static void swap_library_main_helper(struct libargs_s *args) {
 void init_coin_config(btchip_altcoin_config_t *coin_config);
 
 void swap_library_main(struct libargs_s *args) {
+#ifdef COIN_CONFIG_STATIC
+    // the accessors of the coin parameters only return the ones of this build
+    args->coin_config = NULL;
+#endif
+
     btchip_altcoin_config_t coin_config;
     if (args->coin_config == NULL) {
         init_coin_config(&coin_config);
@@ -516,6 +589,10 @@ __attribute__((section(".boot"))) int main(int arg0) {
     // ensure exception will work as planned
     os_boot();
 
+#ifdef HAVE_STACK_PROFILE
+    stack_profile_paint();
+#endif
+
     if (!arg0) {
         // Bitcoin application launched from dashboard
         coin_main(NULL);
@@ -7,4 +7,11 @@
 /**
  * Keeps track whether the app is running in "legacy" or "new" mode.
  */
-extern uint8_t G_app_mode;
\ No newline at end of file
+extern uint8_t G_app_mode;
+
+/**
+ * Forgets all the state derived from the seed: the cached keys, wallet hmacs and addresses, the
+ * wallet session and the keys of the authenticated tokens. Called by io_event as soon as the device
+ * is locked.
+ */
+void clear_seed_derived_state();
@@ -0,0 +1,363 @@
+#pragma once
+
+/**
+ * Sizes of the caches, of the buffers of the batched responses and of the lengths negotiated with
+ * the client, per target: Nano S keeps the small sizes that fit in its RAM, while the other devices
+ * get larger caches.
+ *
+ * Each value can be overridden at compile time with the PERF_CONFIG variable of the Makefile, for
+ * example with make PERF_CONFIG="XPUB_CACHE_SIZE=8 WALLET_HMAC_CACHE_SIZE=8". The constraints of
+ * the values are checked below; the size of the command state and the stack are checked against
+ * the budgets given with COMMAND_STATE_BUDGET and STACK_BUDGET, if any.
+ */
+
+/*
+ * Caches of keys and of derivations
+ */
+
+/**
+ * Number of serialized extended pubkeys cached by get_serialized_extended_pubkey_at_path.
+ */
+#ifndef XPUB_CACHE_SIZE
+#ifdef TARGET_NANOS
+#define XPUB_CACHE_SIZE 1
+#else
+#define XPUB_CACHE_SIZE 4
+#endif
+#endif
+
+/**
+ * Number of account-level extended pubkeys kept in the flash memory of the app, so that the ones
+ * requested by the host when it connects are not derived again after each start of the app; 0
+ * disables this persistent cache.
+ */
+#ifndef NVM_XPUB_CACHE_SIZE
+#ifdef TARGET_NANOS
+#define NVM_XPUB_CACHE_SIZE 8
+#else
+#define NVM_XPUB_CACHE_SIZE 16
+#endif
+#endif
+
+/**
+ * Number of key placeholders of a wallet policy whose pubkeys are kept in the cache; the pubkeys of
+ * the keys with a larger index are fetched from the client whenever they are needed.
+ */
+#ifndef POLICY_PUBKEYS_CACHE_SIZE
+#define POLICY_PUBKEYS_CACHE_SIZE 5
+#endif
+
+/**
+ * Number of change-level children of each key with wildcard kept in the cache of the pubkeys: with
+ * 2, the children of both the receive and the change addresses are kept (and precomputed when a
+ * wallet session is opened), so that each address only costs one derivation per key; with 1, only
+ * the most recently used one is kept.
+ */
+#ifndef POLICY_PUBKEYS_CACHE_CHANGE_STEPS
+#ifdef TARGET_NANOS
+#define POLICY_PUBKEYS_CACHE_CHANGE_STEPS 1
+#else
+#define POLICY_PUBKEYS_CACHE_CHANGE_STEPS 2
+#endif
+#endif
+
+/**
+ * Number of tweaked taproot keys kept in the cache of a wallet policy.
+ */
+#ifndef POLICY_TR_KEYS_CACHE_SIZE
+#define POLICY_TR_KEYS_CACHE_SIZE 4
+#endif
+
+/**
+ * Number of multisig key lists kept in the cache of a wallet policy.
+ */
+#ifndef POLICY_MULTISIG_KEYS_CACHE_SIZE
+#ifdef TARGET_NANOS
+#define POLICY_MULTISIG_KEYS_CACHE_SIZE 1
+#else
+#define POLICY_MULTISIG_KEYS_CACHE_SIZE 2
+#endif
+#endif
+
+/**
+ * Number of verified wallet hmacs kept in the cache used by check_wallet_hmac.
+ */
+#ifndef WALLET_HMAC_CACHE_SIZE
+#ifdef TARGET_NANOS
+#define WALLET_HMAC_CACHE_SIZE 2
+#else
+#define WALLET_HMAC_CACHE_SIZE 4
+#endif
+#endif
+
+/**
+ * Maximum number of keys of a wallet policy whose decoded extended pubkeys are kept in the wallet
+ * session; for larger policies, only the wallet policy is kept, and the keys are fetched by each
+ * command as usual.
+ */
+#ifndef WALLET_SESSION_MAX_KEYS
+#ifdef TARGET_NANOS
+#define WALLET_SESSION_MAX_KEYS 2
+#else
+#define WALLET_SESSION_MAX_KEYS POLICY_PUBKEYS_CACHE_SIZE
+#endif
+#endif
+
+/**
+ * Maximum number of wallet sessions open at the same time, for hosts that switch between a few
+ * registered wallet policies; opening one more replaces the least recently used.
+ */
+#ifndef WALLET_SESSION_MAX_WALLETS
+#ifdef TARGET_NANOS
+#define WALLET_SESSION_MAX_WALLETS 1
+#else
+#define WALLET_SESSION_MAX_WALLETS 3
+#endif
+#endif
+
+/**
+ * Number of addresses computed by GET_WALLET_ADDRESS that are kept in memory, as the same address
+ * is often requested again shortly after (for example, to show it on screen).
+ */
+#ifndef WALLET_ADDRESS_CACHE_SIZE
+#ifdef TARGET_NANOS
+#define WALLET_ADDRESS_CACHE_SIZE 1
+#else
+#define WALLET_ADDRESS_CACHE_SIZE 4
+#endif
+#endif
+
+/*
+ * Caches of SIGN_PSBT
+ */
+
+/**
+ * Number of entries of the memo table of the scripts of a wallet policy; it must be a power of 2.
+ */
+#ifndef WALLET_SCRIPT_MEMO_SIZE
+#ifdef TARGET_NANOS
+#define WALLET_SCRIPT_MEMO_SIZE 4
+#else
+#define WALLET_SCRIPT_MEMO_SIZE 8
+#endif
+#endif
+
+/**
+ * Number of tweaked taproot private keys kept in the cache while signing.
+ */
+#ifndef TR_SECKEYS_CACHE_SIZE
+#ifdef TARGET_NANOS
+#define TR_SECKEYS_CACHE_SIZE 2
+#else
+#define TR_SECKEYS_CACHE_SIZE 4
+#endif
+#endif
+
+/**
+ * Maximum number of taproot sighashes that are collected before signing them back-to-back.
+ */
+#ifndef SCHNORR_BATCH_SIZE
+#ifdef TARGET_NANOS
+#define SCHNORR_BATCH_SIZE 4
+#else
+#define SCHNORR_BATCH_SIZE 8
+#endif
+#endif
+
+/**
+ * Number of outputs of previous transactions kept in the cache of the parsed non-witness-utxos.
+ */
+#ifndef PREVOUTS_CACHE_SIZE
+#ifdef TARGET_NANOS
+#define PREVOUTS_CACHE_SIZE 2
+#else
+#define PREVOUTS_CACHE_SIZE 4
+#endif
+#endif
+
+/**
+ * Minimum number of internal inputs whose summary is kept by SIGN_PSBT after the verification of
+ * the inputs; the summaries use all the space left in the arena of the command state, so more of
+ * them are kept for transactions with fewer inputs than MAX_N_INPUTS_CAN_SIGN.
+ */
+#ifndef MAX_N_INPUT_SUMMARIES
+#ifdef TARGET_NANOS
+#define MAX_N_INPUT_SUMMARIES 2
+#else
+#define MAX_N_INPUT_SUMMARIES 8
+#endif
+#endif
+
+/**
+ * Maximum number of wallet policies whose internal inputs are signed by the same SIGN_PSBT: the one
+ * given in the command, and the ones listed in the global map of the PSBT. Each one has its own
+ * compiled policy and caches in the command state, therefore Nano S only supports one.
+ */
+#ifndef SIGN_PSBT_MAX_WALLET_POLICIES
+#ifdef TARGET_NANOS
+#define SIGN_PSBT_MAX_WALLET_POLICIES 1
+#else
+#define SIGN_PSBT_MAX_WALLET_POLICIES 2
+#endif
+#endif
+
+/*
+ * Merkle trees
+ */
+
+/**
+ * Maximum number of keys of length 1 whose index is cached in a merkleized_map_commitment_t.
+ */
+#ifndef MERKLEIZED_MAP_INDEX_CACHE_SIZE
+#define MERKLEIZED_MAP_INDEX_CACHE_SIZE 12
+#endif
+
+/**
+ * Maximum depth of a Merkle tree received with STREAM_MERKLE_LEAVES; the hashes of the complete
+ * subtrees received so far (one more than the depth) are kept on the stack.
+ */
+#ifndef MAX_STREAM_MERKLE_LEAVES_DEPTH
+#ifdef TARGET_NANOS
+#define MAX_STREAM_MERKLE_LEAVES_DEPTH 4
+#else
+#define MAX_STREAM_MERKLE_LEAVES_DEPTH 6
+#endif
+#endif
+
+/**
+ * Maximum depth of the Merkle trees whose last verified path is kept by SIGN_PSBT, in order to
+ * receive only the part of the proof of the next leaf that differs; larger trees (more inputs or
+ * outputs) are verified with the whole proofs.
+ */
+#ifndef MERKLE_PATH_CACHE_DEPTH
+#ifdef TARGET_NANOS
+#define MERKLE_PATH_CACHE_DEPTH 5
+#else
+#define MERKLE_PATH_CACHE_DEPTH 10
+#endif
+#endif
+
+/*
+ * Batched responses, and lengths negotiated with the client
+ */
+
+/**
+ * Size of the buffer of the signatures yielded in a single batched CCMD_YIELD by SIGN_PSBT; it fits
+ * at least two ECDSA signatures (each up to 1 + 3 + 72 + 1 bytes, including the length prefix, the
+ * input index and the sighash byte), or three on devices with more RAM.
+ */
+#ifndef YIELD_BUFFER_LEN
+#ifdef TARGET_NANOS
+#define YIELD_BUFFER_LEN 160
+#else
+#define YIELD_BUFFER_LEN 240
+#endif
+#endif
+
+/**
+ * Size of the buffer of the addresses yielded in a single CCMD_YIELD by GET_WALLET_ADDRESSES.
+ */
+#ifndef ADDRESSES_YIELD_BUFFER_LEN
+#ifdef TARGET_NANOS
+#define ADDRESSES_YIELD_BUFFER_LEN 160
+#else
+#define ADDRESSES_YIELD_BUFFER_LEN 240
+#endif
+#endif
+
+/**
+ * Size of the buffer of the signatures yielded in a single CCMD_YIELD by SIGN_MESSAGE_BIP322.
+ */
+#ifndef BIP322_YIELD_BUFFER_LEN
+#ifdef TARGET_NANOS
+#define BIP322_YIELD_BUFFER_LEN 160
+#else
+#define BIP322_YIELD_BUFFER_LEN 240
+#endif
+#endif
+
+/**
+ * Size of the buffer of the extended pubkeys yielded in a single CCMD_YIELD by
+ * GET_EXTENDED_PUBKEYS.
+ */
+#ifndef EXTENDED_PUBKEYS_YIELD_BUFFER_LEN
+#define EXTENDED_PUBKEYS_YIELD_BUFFER_LEN 240
+#endif
+
+/**
+ * Maximum number of address indexes (for each of the receive and change addresses) in the window
+ * of SCAN_WALLET_SCRIPTS.
+ */
+#ifndef MAX_SCAN_WINDOW_SIZE
+#ifdef TARGET_NANOS
+#define MAX_SCAN_WINDOW_SIZE 32
+#else
+#define MAX_SCAN_WINDOW_SIZE 128
+#endif
+#endif
+
+/**
+ * Maximum length of the data of a CONTINUE command, that is, of the response to a client command.
+ * Only short APDUs are supported, therefore this is at most 255.
+ */
+#ifndef MAX_CLIENT_RESPONSE_LEN
+#define MAX_CLIENT_RESPONSE_LEN 255
+#endif
+
+/**
+ * Maximum total length of the speculative responses in an INS_CONTINUE command.
+ */
+#ifndef MAX_SPECULATIVE_RESPONSES_LEN
+#define MAX_SPECULATIVE_RESPONSES_LEN 128
+#endif
+
+/*
+ * Constraints of the values
+ */
+
+_Static_assert(XPUB_CACHE_SIZE >= 1, "XPUB_CACHE_SIZE must be at least 1");
+_Static_assert(NVM_XPUB_CACHE_SIZE <= 255, "NVM_XPUB_CACHE_SIZE too large");
+_Static_assert(WALLET_HMAC_CACHE_SIZE >= 1, "WALLET_HMAC_CACHE_SIZE must be at least 1");
+_Static_assert(POLICY_MULTISIG_KEYS_CACHE_SIZE >= 1,
+               "POLICY_MULTISIG_KEYS_CACHE_SIZE must be at least 1");
+_Static_assert(POLICY_PUBKEYS_CACHE_CHANGE_STEPS == 1 || POLICY_PUBKEYS_CACHE_CHANGE_STEPS == 2,
+               "POLICY_PUBKEYS_CACHE_CHANGE_STEPS must be 1 or 2");
+_Static_assert(WALLET_SESSION_MAX_KEYS <= POLICY_PUBKEYS_CACHE_SIZE,
+               "The keys of a wallet session must fit in the cache of the pubkeys");
+_Static_assert(WALLET_SESSION_MAX_WALLETS >= 1, "WALLET_SESSION_MAX_WALLETS must be at least 1");
+_Static_assert(WALLET_ADDRESS_CACHE_SIZE >= 1, "WALLET_ADDRESS_CACHE_SIZE must be at least 1");
+_Static_assert(WALLET_SCRIPT_MEMO_SIZE >= 1 &&
+                   (WALLET_SCRIPT_MEMO_SIZE & (WALLET_SCRIPT_MEMO_SIZE - 1)) == 0,
+               "WALLET_SCRIPT_MEMO_SIZE must be a power of 2");
+_Static_assert(TR_SECKEYS_CACHE_SIZE >= 1, "TR_SECKEYS_CACHE_SIZE must be at least 1");
+_Static_assert(SCHNORR_BATCH_SIZE >= 1, "SCHNORR_BATCH_SIZE must be at least 1");
+_Static_assert(MAX_N_INPUT_SUMMARIES >= 1, "MAX_N_INPUT_SUMMARIES must be at least 1");
+// the internal inputs of the second wallet policy are tracked with a bitvector
+_Static_assert(SIGN_PSBT_MAX_WALLET_POLICIES >= 1 && SIGN_PSBT_MAX_WALLET_POLICIES <= 2,
+               "SIGN_PSBT_MAX_WALLET_POLICIES must be 1 or 2");
+// the indices of the cached keys are stored in a byte, and the number of cached keys too
+_Static_assert(MERKLEIZED_MAP_INDEX_CACHE_SIZE <= 255, "MERKLEIZED_MAP_INDEX_CACHE_SIZE too large");
+_Static_assert(MERKLE_PATH_CACHE_DEPTH >= 1 && MERKLE_PATH_CACHE_DEPTH <= 32,
+               "MERKLE_PATH_CACHE_DEPTH must be between 1 and 32");
+_Static_assert(MAX_STREAM_MERKLE_LEAVES_DEPTH >= 1 && MAX_STREAM_MERKLE_LEAVES_DEPTH <= 16,
+               "MAX_STREAM_MERKLE_LEAVES_DEPTH must be between 1 and 16");
+
+// the yielded data, after the code of the client command, must fit in the response of the device
+_Static_assert(YIELD_BUFFER_LEN >= 2 * (1 + 3 + 72 + 1) && YIELD_BUFFER_LEN < 255,
+               "YIELD_BUFFER_LEN must fit two signatures, and at most 254 bytes");
+_Static_assert(ADDRESSES_YIELD_BUFFER_LEN < 255, "ADDRESSES_YIELD_BUFFER_LEN too large");
+_Static_assert(BIP322_YIELD_BUFFER_LEN < 255, "BIP322_YIELD_BUFFER_LEN too large");
+_Static_assert(EXTENDED_PUBKEYS_YIELD_BUFFER_LEN < 255,
+               "EXTENDED_PUBKEYS_YIELD_BUFFER_LEN too large");
+
+// both are returned by GET_MAX_RESPONSE_LEN, the latter in a single byte
+_Static_assert(MAX_CLIENT_RESPONSE_LEN >= 64 && MAX_CLIENT_RESPONSE_LEN <= 255,
+               "MAX_CLIENT_RESPONSE_LEN must be between 64 and 255");
+_Static_assert(MAX_SPECULATIVE_RESPONSES_LEN <= MAX_CLIENT_RESPONSE_LEN,
+               "The speculative responses must fit in a CONTINUE command");
+
+// the size of the command state is checked against COMMAND_STATE_BUDGET in commands.h
+#ifdef STACK_BUDGET
+_Static_assert(PERF_STACK_SIZE >= STACK_BUDGET,
+               "The stack of the app is smaller than STACK_BUDGET");
+#endif
@@ -0,0 +1,21 @@
+#include "os.h"
+
+#include "settings.h"
+
+typedef struct {
+    uint8_t is_batch_review_enabled;  // 0 (the initial content of the flash memory) if disabled
+} app_settings_t;
+
+// settings in the flash memory of the app; it is only written with nvm_write, and read through PIC,
+// so that the compiler does not assume that its content is fixed
+const app_settings_t N_app_settings_real;
+#define N_app_settings (*(const app_settings_t *) PIC(&N_app_settings_real))
+
+bool settings_is_batch_review_enabled(void) {
+    return N_app_settings.is_batch_review_enabled == 1;
+}
+
+void settings_set_batch_review_enabled(bool enabled) {
+    uint8_t value = enabled ? 1 : 0;
+    nvm_write((void *) &N_app_settings.is_batch_review_enabled, &value, sizeof(value));
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * Settings of the app, chosen by the user in the settings menu and kept in the flash memory of the
+ * app. They can only be changed on the device, therefore the host cannot weaken the checks that
+ * depend on them. All the settings are disabled on the first start of the app.
+ */
+
+/**
+ * Returns true if the user allowed the review in summary of the external outputs of large
+ * transactions in SIGN_PSBT, for the clients that request it.
+ */
+bool settings_is_batch_review_enabled(void);
+
+/**
+ * Enables or disables the review in summary of the external outputs of large transactions.
+ */
+void settings_set_batch_review_enabled(bool enabled);
@@ -0,0 +1,51 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "shared_arena.h"
+#include "main.h"
+#include "swap/swap_globals.h"
+
+#if defined(TARGET_NANOS) && !defined(DISABLE_LEGACY_SUPPORT)
+
+// defined in script-nanos.ld
+extern uint8_t _shared_arena[];
+extern uint8_t _eshared_arena[];
+
+static bool G_shared_arena_in_use;
+
+static size_t shared_arena_size(void) {
+    uintptr_t start = (uintptr_t) _shared_arena;
+    uintptr_t end = (uintptr_t) _eshared_arena;
+    return end > start ? end - start : 0;
+}
+
+uint8_t *shared_arena_acquire(size_t *size) {
+    *size = 0;
+    if (G_app_mode != APP_MODE_NEW || G_swap_state.called_from_swap ||
+        shared_arena_size() == 0) {
+        return NULL;
+    }
+    G_shared_arena_in_use = true;
+    *size = shared_arena_size();
+    return _shared_arena;
+}
+
+void shared_arena_release(void) {
+    if (G_shared_arena_in_use) {
+        explicit_bzero(_shared_arena, shared_arena_size());
+        G_shared_arena_in_use = false;
+    }
+}
+
+#else
+
+uint8_t *shared_arena_acquire(size_t *size) {
+    *size = 0;
+    return NULL;
+}
+
+void shared_arena_release(void) {
+}
+
+#endif
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * On NanoS, the custom linker script overlaps the globals of the legacy protocol with the ones of
+ * the new protocol, as only one of the two is in use at any time. The overlapped region is as large
+ * as the largest of the two; the part of it after the globals of the new protocol is the shared
+ * arena, that the handlers of the new protocol can use for their caches.
+ *
+ * The arena is only available while the app runs commands of the new protocol, and not in swap
+ * mode, as the swap data of the legacy protocol is kept in the legacy globals. It is zeroed when
+ * the app switches to the legacy protocol, therefore it must only contain data that can be
+ * discarded between commands.
+ *
+ * On the other devices, or without the legacy protocol, the arena is empty.
+ */
+
+/**
+ * Reserves the shared arena; its size is returned in *size.
+ *
+ * @return a pointer to the arena, aligned to 8 bytes, or NULL (and *size is 0) if the arena is
+ * empty or not available.
+ */
+uint8_t *shared_arena_acquire(size_t *size);
+
+/**
+ * Zeroes and releases the shared arena, if it was reserved.
+ */
+void shared_arena_release(void);
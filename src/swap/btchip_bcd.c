@@ -15,94 +15,40 @@
  *  limitations under the License.
  ********************************************************************************/
 
+#include <stdint.h>
+
+#include "btchip_bcd.h"
+#include "../common/format.h"
+
 #ifndef DISABLE_LEGACY_SUPPORT
 // only needed for FLAG_PEERCOIN_UNITS below
 #include "../legacy/include/btchip_context.h"
 #endif  // DISABLE_LEGACY_SUPPORT
 
-#define SCRATCH_SIZE 21
-
-unsigned char btchip_convert_hex_amount_to_displayable_no_globals(unsigned char* amount,
-                                                                  unsigned int config_flag,
-                                                                  unsigned char* out) {
-    unsigned char LOOP1;
-    unsigned char LOOP2;
+// the longest amount is UINT64_MAX with 6 decimals, with 20 digits and the decimal separator
+#define MAX_DISPLAYABLE_AMOUNT_LENGTH (20 + 1)
 
+unsigned char btchip_amount_decimals(unsigned int config_flag) {
 #ifndef DISABLE_LEGACY_SUPPORT
-    if (!(config_flag & FLAG_PEERCOIN_UNITS)) {
-        LOOP1 = 13;
-        LOOP2 = 8;
-    } else {
-        LOOP1 = 15;
-        LOOP2 = 6;
+    if (config_flag & FLAG_PEERCOIN_UNITS) {
+        return 6;
     }
 #else
-    LOOP1 = 13;
-    LOOP2 = 8;
+    (void) config_flag;
 #endif
+    return 8;
+}
 
-    unsigned short scratch[SCRATCH_SIZE];
-    unsigned char offset = 0;
-    unsigned char nonZero = 0;
-    unsigned char i;
-    unsigned char targetOffset = 0;
-    unsigned char workOffset;
-    unsigned char j;
-    unsigned char nscratch = SCRATCH_SIZE;
-    unsigned char smin = nscratch - 2;
-    unsigned char comma = 0;
-
-    for (i = 0; i < SCRATCH_SIZE; i++) {
-        scratch[i] = 0;
-    }
-    for (i = 0; i < 8; i++) {
-        for (j = 0; j < 8; j++) {
-            unsigned char k;
-            unsigned short shifted_in =
-                (((amount[i] & 0xff) & ((1 << (7 - j)))) != 0) ? (short) 1 : (short) 0;
-            for (k = smin; k < nscratch; k++) {
-                scratch[k] += ((scratch[k] >= 5) ? 3 : 0);
-            }
-            if (scratch[smin] >= 8) {
-                smin -= 1;
-            }
-            for (k = smin; k < nscratch - 1; k++) {
-                scratch[k] = ((scratch[k] << 1) & 0xF) | ((scratch[k + 1] >= 8) ? 1 : 0);
-            }
-            scratch[nscratch - 1] =
-                ((scratch[nscratch - 1] << 1) & 0x0F) | (shifted_in == 1 ? 1 : 0);
-        }
-    }
-
-    for (i = 0; i < LOOP1; i++) {
-        if (!nonZero && (scratch[offset] == 0)) {
-            offset++;
-        } else {
-            nonZero = 1;
-            out[targetOffset++] = scratch[offset++] + '0';
-        }
-    }
-    if (targetOffset == 0) {
-        out[targetOffset++] = '0';
-    }
-    workOffset = offset;
-    for (i = 0; i < LOOP2; i++) {
-        unsigned char allZero = 1;
-        unsigned char j;
-        for (j = i; j < LOOP2; j++) {
-            if (scratch[workOffset + j] != 0) {
-                allZero = 0;
-                break;
-            }
-        }
-        if (allZero) {
-            break;
-        }
-        if (!comma) {
-            out[targetOffset++] = '.';
-            comma = 1;
-        }
-        out[targetOffset++] = scratch[offset++] + '0';
+unsigned char btchip_convert_hex_amount_to_displayable_no_globals(unsigned char* amount,
+                                                                  unsigned int config_flag,
+                                                                  unsigned char* out) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | amount[i];
     }
-    return targetOffset;
+    // cannot fail, as the output is large enough for any amount
+    return (unsigned char) format_amount((char*) out,
+                                         MAX_DISPLAYABLE_AMOUNT_LENGTH + 1,
+                                         value,
+                                         btchip_amount_decimals(config_flag));
 }
@@ -17,6 +17,15 @@
 
 #pragma once
 
+/**
+ * Returns the number of decimals of the amounts of the coin with the given config flags.
+ */
+unsigned char btchip_amount_decimals(unsigned int config_flag);
+
+/**
+ * Formats the 8-bytes big-endian amount as a decimal string, with the decimals of the coin, in an
+ * output buffer of at least 22 bytes. Returns the length of the string.
+ */
 unsigned char btchip_convert_hex_amount_to_displayable_no_globals(unsigned char *amount,
                                                                   unsigned int config_flag,
                                                                   unsigned char *out);
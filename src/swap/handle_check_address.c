@@ -5,13 +5,10 @@
 #include "handle_check_address.h"
 #include "bip32_path.h"
 
-#include "../common/segwit_addr.h"
+#include "../common/address.h"
+#include "../common/script.h"
 #include "../crypto.h"
 
-#ifndef DISABLE_LEGACY_SUPPORT
-#include "../legacy/cashaddr.h"
-#endif
-
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 
 // constants previously defined in btchip_apdu_get_wallet_public_key.h
@@ -25,85 +22,70 @@
 #define P2_CASHADDR      0x03
 #define P2_TAPROOT       0x04  // bech32m
 
-bool get_address_from_compressed_public_key(unsigned char format,
-                                            unsigned char* compressed_pub_key,
-                                            unsigned short payToAddressVersion,
-                                            unsigned short payToScriptHashVersion,
-                                            const char* native_segwit_prefix,
-                                            char* address,
-                                            unsigned char max_address_length) {
-    int address_length;
-
-    // clang-format off
-#ifndef DISABLE_LEGACY_SUPPORT
-    bool cashAddr = (format == P2_CASHADDR);
-    if (cashAddr) {
-        uint8_t tmp[20];
-        crypto_hash160(compressed_pub_key,  // IN
-                       33,                  // INLEN
-                       tmp);
-        if (!cashaddr_encode(tmp, 20, (uint8_t*) address, max_address_length, CASHADDR_P2PKH))
-            return false;
-    } else
-#endif
+/**
+ * Computes the scriptPubKey of the given format for the compressed public key, without encoding
+ * it as an address. Returns the length of the script on success, or -1 on failure.
+ */
+static int get_script_from_compressed_public_key(unsigned char format,
+                                                 uint8_t compressed_pub_key[static 33],
+                                                 uint8_t out[static MAX_ADDRESS_SCRIPT_LEN]) {
     if (format == P2_LEGACY) {
-        // clang-format on
-        uint8_t tmp[20];
-        crypto_hash160(compressed_pub_key, 33, tmp);
-        address_length =
-            base58_encode_address(tmp, payToAddressVersion, address, max_address_length - 1);
-        if (address_length < 0) {
-            return false;
-        }
-        address[address_length] = 0;
-    } else {
-        uint8_t script[22];
-        script[0] = 0x00;
-        script[1] = 0x14;
-        crypto_hash160(compressed_pub_key,  // IN
-                       33,                  // INLEN
-                       script + 2           // OUT
-        );
-        if (format == P2_SEGWIT) {
-            // wrapped segwit
-            uint8_t tmp[20];
-            crypto_hash160(script, 22, tmp);
-            // wrapped segwit
-            address_length =
-                base58_encode_address(tmp, payToScriptHashVersion, address, max_address_length - 1);
-            if (address_length < 0) {
-                return false;
-            }
-            address[address_length] = 0;
-        } else {  // native segwit or taproot
-            if (!native_segwit_prefix) return false;
-            if (format == P2_NATIVE_SEGWIT) {
-                if (!segwit_addr_encode(address, native_segwit_prefix, 0, script + 2, 20)) {
-                    return false;
-                }
-            } else if (format == P2_TAPROOT) {
-                uint8_t tweaked_key[32];
+        out[0] = OP_DUP;
+        out[1] = OP_HASH160;
+        out[2] = 0x14;
+        crypto_hash160(compressed_pub_key, 33, out + 3);
+        out[23] = OP_EQUALVERIFY;
+        out[24] = OP_CHECKSIG;
+        return 25;
+    } else if (format == P2_SEGWIT) {
+        // wrapped segwit: the hash160 of the P2WPKH script
+        uint8_t witness_script[22];
+        witness_script[0] = OP_0;
+        witness_script[1] = 0x14;
+        crypto_hash160(compressed_pub_key, 33, witness_script + 2);
 
-                uint8_t parity;
-                crypto_tr_tweak_pubkey(compressed_pub_key + 1, &parity, tweaked_key);
-
-                if (!segwit_addr_encode(address, native_segwit_prefix, 1, tweaked_key, 32)) {
-                    return false;
-                }
-            } else {
-                PRINTF("Expected native segwit or taproot address\n");
-                return false;
-            }
-        }
+        out[0] = OP_HASH160;
+        out[1] = 0x14;
+        crypto_hash160(witness_script, sizeof(witness_script), out + 2);
+        out[22] = OP_EQUAL;
+        return 23;
+    } else if (format == P2_NATIVE_SEGWIT) {
+        out[0] = OP_0;
+        out[1] = 0x14;
+        crypto_hash160(compressed_pub_key, 33, out + 2);
+        return 22;
+    } else if (format == P2_TAPROOT) {
+        uint8_t parity;
+        out[0] = OP_1;
+        out[1] = 0x20;
+        crypto_tr_tweak_pubkey(compressed_pub_key + 1, &parity, out + 2);
+        return 34;
     }
-    return true;
+    PRINTF("Unsupported address format\n");
+    return -1;
 }
 
+#ifndef DISABLE_LEGACY_SUPPORT
 static int os_strcmp(const char* s1, const char* s2) {
     size_t size = strlen(s1) + 1;
     return memcmp(s1, s2, size);
 }
 
+// cashaddr addresses are not decoded by get_address_script, therefore they are still compared as
+// strings
+static bool check_cashaddr(uint8_t compressed_pub_key[static 33],
+                           const char* address_to_check) {
+    uint8_t tmp[20];
+    char address[MAX_ADDRESS_LENGTH_STR + 1];
+    crypto_hash160(compressed_pub_key, 33, tmp);
+    if (address_encode_cashaddr(tmp, CASHADDR_TYPE_P2PKH, address, sizeof(address)) < 0) {
+        PRINTF("Can't create address from given public key\n");
+        return false;
+    }
+    return os_strcmp(address, address_to_check) == 0;
+}
+#endif
+
 int handle_check_address(check_address_parameters_t* params, btchip_altcoin_config_t* coin_config) {
     unsigned char compressed_public_key[33];
     PRINTF("Params on the address %d\n", (unsigned int) params);
@@ -127,21 +109,35 @@ int handle_check_address(check_address_parameters_t* params, btchip_altcoin_conf
                                               NULL)) {
         return 0;
     }
-    char address[MAX_ADDRESS_LENGTH_STR + 1];
-    if (!get_address_from_compressed_public_key(params->address_parameters[0],
-                                                compressed_public_key,
-                                                coin_config->p2pkh_version,
-                                                coin_config->p2sh_version,
-                                                coin_config->native_segwit_prefix,
-                                                address,
-                                                sizeof(address))) {
-        PRINTF("Can't create address from given public key\n");
+
+    unsigned char format = params->address_parameters[0];
+#ifndef DISABLE_LEGACY_SUPPORT
+    if (format == P2_CASHADDR) {
+        if (!check_cashaddr(compressed_public_key, params->address_to_check)) {
+            PRINTF("Addresses don't match\n");
+            return 0;
+        }
+        PRINTF("Addresses match\n");
+        return 1;
+    }
+#endif
+
+    // The address to check is decoded, and compared in binary form with the expected script,
+    // rather than encoding the expected address and comparing the strings.
+    uint8_t expected_script[MAX_ADDRESS_SCRIPT_LEN];
+    int expected_script_len =
+        get_script_from_compressed_public_key(format, compressed_public_key, expected_script);
+    if (expected_script_len < 0) {
+        PRINTF("Can't create script from given public key\n");
         return 0;
     }
-    if (os_strcmp(address, params->address_to_check) != 0) {
+
+    uint8_t script[MAX_ADDRESS_SCRIPT_LEN];
+    int script_len = get_address_script(params->address_to_check, coin_config, script);
+    if (script_len != expected_script_len || memcmp(script, expected_script, script_len) != 0) {
         PRINTF("Addresses don't match\n");
         return 0;
     }
     PRINTF("Addresses match\n");
     return 1;
-}
\ No newline at end of file
+}
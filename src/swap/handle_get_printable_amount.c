@@ -3,6 +3,7 @@
 #include "handle_get_printable_amount.h"
 
 #include "btchip_bcd.h"
+#include "../common/format.h"
 
 int handle_get_printable_amount(get_printable_amount_parameters_t *params,
                                 const btchip_altcoin_config_t *config) {
@@ -11,17 +12,25 @@ int handle_get_printable_amount(get_printable_amount_parameters_t *params,
         PRINTF("Amount is too big");
         return 0;
     }
-    unsigned char amount[8];
-    memset(amount, 0, 8);
-    memcpy(amount + (8 - params->amount_length), params->amount, params->amount_length);
+    uint64_t amount = 0;
+    for (int i = 0; i < params->amount_length; i++) {
+        amount = (amount << 8) | params->amount[i];
+    }
     size_t coin_name_length = strlen(config->name_short);
+    if (coin_name_length + 1 >= sizeof(params->printable_amount)) {
+        PRINTF("Coin name is too long");
+        return 0;
+    }
     memmove(params->printable_amount, config->name_short, coin_name_length);
     params->printable_amount[coin_name_length] = ' ';
-    int res_length = btchip_convert_hex_amount_to_displayable_no_globals(
-        amount,
-        config->flags,
-        (uint8_t *) params->printable_amount + coin_name_length + 1);
-    params->printable_amount[res_length + coin_name_length + 1] = '\0';
+    if (format_amount(params->printable_amount + coin_name_length + 1,
+                      sizeof(params->printable_amount) - (coin_name_length + 1),
+                      amount,
+                      btchip_amount_decimals(config->flags)) < 0) {
+        PRINTF("Amount is too long");
+        params->printable_amount[0] = '\0';
+        return 0;
+    }
 
     return 1;
-}
\ No newline at end of file
+}
@@ -26,6 +26,15 @@
 // the processor to call after the user approval, for UI flows that require it
 static command_processor_t g_next_processor;
 
+// the choice of the user in a UI flow shown with a deferred approval, that the handler only acts
+// upon when it calls ui_wait_for_approval
+static enum {
+    DEFERRED_APPROVAL_NONE,     // no UI flow with a deferred approval is shown
+    DEFERRED_APPROVAL_PENDING,  // the handler is still running, the user did not choose yet
+    DEFERRED_APPROVAL_APPROVED,
+    DEFERRED_APPROVAL_REJECTED,
+} G_deferred_approval;
+
 extern dispatcher_context_t G_dispatcher_context;
 
 // TODO: hard to keep track of what globals are used in the same flows
@@ -50,10 +59,18 @@ typedef struct {
     char hash_hex[64 + 1];
 } ui_path_and_hash_state_t;
 
+typedef struct {
+    char bip32_path_str[MAX_SERIALIZED_BIP32_PATH_LENGTH + 1];
+    char address[MAX_ADDRESS_LENGTH_STR + 1];
+    char hash_hex[64 + 1];
+    char n_messages[sizeof("Sign 4294967295")];
+} ui_message_batch_state_t;
+
 typedef struct {
     char wallet_name[MAX_WALLET_NAME_LENGTH + 1];
-    char policy_map[MAX_POLICY_MAP_STR_LENGTH];
+    char policy_map[MAX_POLICY_MAP_STR_LENGTH + 1];
     char address[MAX_ADDRESS_LENGTH_STR + 1];
+    char batch_index[sizeof("Register 255 of 255")];  // only when registering multiple wallets
 } ui_wallet_state_t;
 
 typedef struct {
@@ -67,10 +84,20 @@ typedef struct {
     char amount[MAX_AMOUNT_LENGTH + 1];
 } ui_validate_output_state_t;
 
+typedef struct {
+    char n_outputs[sizeof("2147483647")];
+    char total_amount[MAX_AMOUNT_LENGTH + 1];
+    char outputs_digest[2 * 16 + 1];  // hex, see SIGN_PSBT_BATCH_REVIEW_DIGEST_LEN
+} ui_validate_batch_outputs_state_t;
+
 typedef struct {
     char fee[MAX_AMOUNT_LENGTH + 1];
 } ui_validate_transaction_state_t;
 
+typedef struct {
+    char progress[sizeof("Outputs 4294967295/4294967295")];
+} ui_processing_state_t;
+
 /**
  * Union of all the states for each of the UI screens, in order to save memory.
  */
@@ -78,10 +105,13 @@ typedef union {
     ui_path_and_pubkey_state_t path_and_pubkey;
     ui_path_and_address_state_t path_and_address;
     ui_path_and_hash_state_t path_and_hash;
+    ui_message_batch_state_t message_batch;
     ui_wallet_state_t wallet;
     ui_cosigner_pubkey_and_index_state_t cosigner_pubkey_and_index;
     ui_validate_output_state_t validate_output;
+    ui_validate_batch_outputs_state_t validate_batch_outputs;
     ui_validate_transaction_state_t validate_transaction;
+    ui_processing_state_t processing;
 } ui_state_t;
 
 #ifdef TARGET_NANOS
@@ -90,11 +120,29 @@ ui_state_t __attribute__((section(".new_globals"))) g_ui_state;
 ui_state_t g_ui_state;
 #endif
 
+// Progress shown in the "Processing..." screen, set with ui_set_progress. It is not in g_ui_state,
+// as it must survive the screens shown while a command is processed.
+static struct {
+    const char *phase;  // NULL if there is no progress to show
+    uint32_t current;
+    uint32_t total;
+    bool is_changed;  // true if changed since the "Processing..." screen was last drawn
+} G_progress;
+
 void send_deny_sw(dispatcher_context_t *dc) {
     SEND_SW(dc, SW_DENY);
 }
 
 void continue_after_approval(bool approved) {
+    if (G_deferred_approval != DEFERRED_APPROVAL_NONE) {
+        // the dispatcher is not paused: the choice is kept until ui_wait_for_approval
+        if (G_deferred_approval == DEFERRED_APPROVAL_PENDING) {
+            G_deferred_approval =
+                approved ? DEFERRED_APPROVAL_APPROVED : DEFERRED_APPROVAL_REJECTED;
+        }
+        return;
+    }
+
     if (approved) {
         G_dispatcher_context.next(g_next_processor);
     } else {
@@ -109,6 +157,18 @@ void continue_after_approval(bool approved) {
    any flow.
 */
 
+// Step with icon and "Processing..."
+UX_STEP_NOCB(ux_processing_step, pn, {&C_icon_processing, "Processing..."});
+
+// Step with icon, "Processing..." and the current progress
+UX_STEP_NOCB(ux_processing_progress_step,
+             pnn,
+             {
+                 &C_icon_processing,
+                 "Processing...",
+                 g_ui_state.processing.progress,
+             });
+
 // Step with icon and text for pubkey
 UX_STEP_NOCB(ux_display_confirm_pubkey_step, pn, {&C_icon_eye, "Confirm public key"});
 
@@ -202,6 +262,15 @@ UX_STEP_NOCB(ux_display_wallet_header_name_step,
                  g_ui_state.wallet.wallet_name,
              });
 
+// Step with icon, index and name of one of multiple wallets being registered
+UX_STEP_NOCB(ux_display_wallet_batch_header_name_step,
+             pnn,
+             {
+                 &C_icon_wallet,
+                 g_ui_state.wallet.batch_index,
+                 g_ui_state.wallet.wallet_name,
+             });
+
 // Step with description of a policy wallet
 UX_STEP_NOCB(ux_display_wallet_policy_map_type_step,
              bnnn_paging,
@@ -258,6 +327,15 @@ UX_STEP_NOCB(ux_unverified_segwit_input_flow_1_step, pb, {&C_icon_warning, "Unve
 UX_STEP_NOCB(ux_unverified_segwit_input_flow_2_step, nn, {"Update", "Ledger Live"});
 UX_STEP_NOCB(ux_unverified_segwit_input_flow_3_step, nn, {"or third party", "wallet software"});
 
+// Step with warning icon and text explaining that some inputs use a non-default sighash type
+UX_STEP_NOCB(ux_display_warning_nondefault_sighash_step,
+             pnn,
+             {
+                 &C_icon_warning,
+                 "Non-default",
+                 "sighash",
+             });
+
 // Step with eye icon and "Review" and the output index
 UX_STEP_NOCB(ux_review_step,
              pnn,
@@ -283,6 +361,33 @@ UX_STEP_NOCB(ux_validate_address_step,
                  .text = g_ui_state.validate_output.address_or_description,
              });
 
+// Step with eye icon and "Review batch payout"
+UX_STEP_NOCB(ux_review_batch_step, pnn, {&C_icon_eye, "Review", "batch payout"});
+
+// Step with "Outputs" and the number of external outputs
+UX_STEP_NOCB(ux_validate_batch_count_step,
+             bn,
+             {
+                 "Outputs",
+                 g_ui_state.validate_batch_outputs.n_outputs,
+             });
+
+// Step with "Total amount" and the total amount of the external outputs
+UX_STEP_NOCB(ux_validate_batch_amount_step,
+             bnnn_paging,
+             {
+                 .title = "Total amount",
+                 .text = g_ui_state.validate_batch_outputs.total_amount,
+             });
+
+// Step with "Outputs digest" and the paginated digest of the outputs
+UX_STEP_NOCB(ux_validate_batch_digest_step,
+             bnnn_paging,
+             {
+                 .title = "Outputs digest",
+                 .text = g_ui_state.validate_batch_outputs.outputs_digest,
+             });
+
 UX_STEP_NOCB(ux_confirm_transaction_step, pnn, {&C_icon_eye, "Confirm", "transaction"});
 UX_STEP_NOCB(ux_confirm_transaction_fees_step,
              bnnn_paging,
@@ -336,6 +441,77 @@ UX_FLOW(ux_sign_message_flow,
         &ux_sign_message_accept_new,
         &ux_display_reject_step);
 
+UX_STEP_NOCB(ux_message_batch_display_path_step,
+             bnnn_paging,
+             {
+                 .title = "Path",
+                 .text = g_ui_state.message_batch.bip32_path_str,
+             });
+
+UX_STEP_NOCB(ux_message_batch_display_address_step,
+             bnnn_paging,
+             {
+                 .title = "Address",
+                 .text = g_ui_state.message_batch.address,
+             });
+
+UX_STEP_NOCB(ux_message_batch_hash_step,
+             bnnn_paging,
+             {
+                 .title = "Message hash",
+                 .text = g_ui_state.message_batch.hash_hex,
+             });
+
+UX_STEP_NOCB(ux_message_batch_root_step,
+             bnnn_paging,
+             {
+                 .title = "Messages root",
+                 .text = g_ui_state.message_batch.hash_hex,
+             });
+
+UX_STEP_NOCB(ux_sign_messages_step,
+             pnn,
+             {
+                 &C_icon_certificate,
+                 g_ui_state.message_batch.n_messages,
+                 "messages",
+             });
+
+UX_STEP_CB(ux_sign_messages_accept,
+           pbb,
+           continue_after_approval(true),
+           {&C_icon_validate_14, g_ui_state.message_batch.n_messages, "messages"});
+
+// FLOW to display the BIP32 path, the address and the hash of a single message to sign:
+// #1 screen: certificate icon + "Sign message"
+// #2 screen: display BIP32 Path
+// #3 screen: display address
+// #4 screen: display message hash
+// #5 screen: "Sign message" and approve button
+// #6 screen: reject button
+UX_FLOW(ux_sign_message_with_address_flow,
+        &ux_sign_message_step,
+        &ux_message_batch_display_path_step,
+        &ux_message_batch_display_address_step,
+        &ux_message_batch_hash_step,
+        &ux_sign_message_accept_new,
+        &ux_display_reject_step);
+
+// FLOW to display the BIP32 path, the address and the Merkle root of a batch of messages to sign:
+// #1 screen: certificate icon + "Sign <n> messages"
+// #2 screen: display BIP32 Path
+// #3 screen: display address
+// #4 screen: display the Merkle root of the messages
+// #5 screen: "Sign <n> messages" and approve button
+// #6 screen: reject button
+UX_FLOW(ux_sign_message_batch_flow,
+        &ux_sign_messages_step,
+        &ux_message_batch_display_path_step,
+        &ux_message_batch_display_address_step,
+        &ux_message_batch_root_step,
+        &ux_sign_messages_accept,
+        &ux_display_reject_step);
+
 // FLOW to display BIP32 path and pubkey:
 // #1 screen: eye icon + "Confirm Pubkey"
 // #2 screen: display BIP32 Path
@@ -419,6 +595,17 @@ UX_FLOW(ux_display_policy_map_header_flow,
         &ux_display_approve_step,
         &ux_display_reject_step);
 
+// FLOW to display the header of one of multiple policy map wallets with the same keys:
+// #1 screen: eye icon + "Register <i> of <n>" and the wallet name
+// #2 screen: display policy map (paginated)
+// #3 screen: approve button
+// #4 screen: reject button
+UX_FLOW(ux_display_policy_map_batch_header_flow,
+        &ux_display_wallet_batch_header_name_step,
+        &ux_display_wallet_policy_map_type_step,
+        &ux_display_approve_step,
+        &ux_display_reject_step);
+
 // FLOW to display the header of a policy_map wallet:
 // #1 screen: Cosigner index and pubkey (paginated)
 // #2 screen: approve button
@@ -479,6 +666,15 @@ UX_FLOW(ux_display_unverified_segwit_inputs_flow,
         &ux_display_continue_step,
         &ux_display_reject_step);
 
+// FLOW to warn about inputs with a non-default sighash type
+// #1 screen: warning icon + "Non-default sighash"
+// #2 screen: crossmark icon + "Reject if not sure" (user can reject here)
+// #3 screen: "continue" button
+UX_FLOW(ux_display_warning_nondefault_sighash_flow,
+        &ux_display_warning_nondefault_sighash_step,
+        &ux_display_reject_if_not_sure_step,
+        &ux_display_continue_step);
+
 // FLOW to validate a single output
 // #1 screen: eye icon + "Review" + index of output to validate
 // #2 screen: output amount
@@ -492,6 +688,29 @@ UX_FLOW(ux_display_output_address_amount_flow,
         &ux_display_approve_step,
         &ux_display_reject_step);
 
+// FLOW shown during long computations
+// #1 screen: processing icon + "Processing..."
+UX_FLOW(ux_processing_flow, &ux_processing_step);
+
+// FLOW shown during long computations, with the progress set by the handler
+// #1 screen: processing icon + "Processing..." + progress
+UX_FLOW(ux_processing_progress_flow, &ux_processing_progress_step);
+
+// FLOW to validate the external outputs in summary
+// #1 screen: eye icon + "Review batch payout"
+// #2 screen: number of external outputs
+// #3 screen: total amount of the external outputs
+// #4 screen: digest of the outputs (paginated)
+// #5 screen: approve button
+// #6 screen: reject button
+UX_FLOW(ux_display_batch_outputs_flow,
+        &ux_review_batch_step,
+        &ux_validate_batch_count_step,
+        &ux_validate_batch_amount_step,
+        &ux_validate_batch_digest_step,
+        &ux_display_approve_step,
+        &ux_display_reject_step);
+
 // Finalize see the transaction fees and finally accept signing
 // #1 screen: eye icon + "Confirm Transaction"
 // #2 screen: fee amount
@@ -540,6 +759,31 @@ void ui_display_message_hash(dispatcher_context_t *context,
     ux_flow_init(0, ux_sign_message_flow, NULL);
 }
 
+void ui_display_message_batch(dispatcher_context_t *context,
+                              const char *bip32_path_str,
+                              const char *address,
+                              uint32_t n_messages,
+                              const char *message_hash,
+                              command_processor_t on_success) {
+    context->pause();
+
+    ui_message_batch_state_t *state = (ui_message_batch_state_t *) &g_ui_state;
+
+    strncpy(state->bip32_path_str, bip32_path_str, sizeof(state->bip32_path_str));
+    strncpy(state->address, address, sizeof(state->address));
+
+    strncpy(state->hash_hex, message_hash, sizeof(state->hash_hex));
+
+    g_next_processor = on_success;
+
+    if (n_messages == 1) {
+        ux_flow_init(0, ux_sign_message_with_address_flow, NULL);
+    } else {
+        snprintf(state->n_messages, sizeof(state->n_messages), "Sign %u", n_messages);
+        ux_flow_init(0, ux_sign_message_batch_flow, NULL);
+    }
+}
+
 void ui_display_address(dispatcher_context_t *context,
                         const char *address,
                         bool is_path_suspicious,
@@ -563,29 +807,48 @@ void ui_display_address(dispatcher_context_t *context,
 
 void ui_display_wallet_header(dispatcher_context_t *context,
                               const policy_map_wallet_header_t *wallet_header,
+                              const char *policy_map,
                               command_processor_t on_success) {
     context->pause();
 
     ui_wallet_state_t *state = (ui_wallet_state_t *) &g_ui_state;
 
     strncpy(state->wallet_name, wallet_header->name, sizeof(wallet_header->name));
-    strncpy(state->policy_map, wallet_header->policy_map, sizeof(wallet_header->policy_map));
+    strncpy(state->policy_map, policy_map, sizeof(state->policy_map) - 1);
+    state->policy_map[sizeof(state->policy_map) - 1] = '\0';
 
     g_next_processor = on_success;
 
     ux_flow_init(0, ux_display_policy_map_header_flow, NULL);
 }
 
-void ui_display_policy_map_cosigner_pubkey(dispatcher_context_t *context,
-                                           const char *pubkey,
-                                           uint8_t cosigner_index,
-                                           uint8_t n_keys,
-                                           bool is_internal,
-                                           command_processor_t on_success) {
-    (void) (n_keys);
-
+void ui_display_wallet_batch_header(dispatcher_context_t *context,
+                                    const policy_map_wallet_header_t *wallet_header,
+                                    const char *policy_map,
+                                    uint8_t index,
+                                    uint8_t n_wallets,
+                                    command_processor_t on_success) {
     context->pause();
 
+    ui_wallet_state_t *state = (ui_wallet_state_t *) &g_ui_state;
+
+    strncpy(state->wallet_name, wallet_header->name, sizeof(wallet_header->name));
+    strncpy(state->policy_map, policy_map, sizeof(state->policy_map) - 1);
+    state->policy_map[sizeof(state->policy_map) - 1] = '\0';
+    snprintf(state->batch_index,
+             sizeof(state->batch_index),
+             "Register %u of %u",
+             (unsigned int) index + 1,
+             (unsigned int) n_wallets);
+
+    g_next_processor = on_success;
+
+    ux_flow_init(0, ux_display_policy_map_batch_header_flow, NULL);
+}
+
+static void set_cosigner_pubkey_state(const char *pubkey,
+                                      uint8_t cosigner_index,
+                                      bool is_internal) {
     ui_cosigner_pubkey_and_index_state_t *state =
         (ui_cosigner_pubkey_and_index_state_t *) &g_ui_state;
 
@@ -602,12 +865,63 @@ void ui_display_policy_map_cosigner_pubkey(dispatcher_context_t *context,
                  "Key @%u <theirs>",
                  cosigner_index + 1);
     }
+}
+
+void ui_display_policy_map_cosigner_pubkey(dispatcher_context_t *context,
+                                           const char *pubkey,
+                                           uint8_t cosigner_index,
+                                           uint8_t n_keys,
+                                           bool is_internal,
+                                           command_processor_t on_success) {
+    (void) (n_keys);
+
+    context->pause();
+
+    set_cosigner_pubkey_state(pubkey, cosigner_index, is_internal);
 
     g_next_processor = on_success;
 
     ux_flow_init(0, ux_display_policy_map_cosigner_pubkey_flow, NULL);
 }
 
+void ui_display_policy_map_cosigner_pubkey_deferred(dispatcher_context_t *context,
+                                                    const char *pubkey,
+                                                    uint8_t cosigner_index,
+                                                    uint8_t n_keys,
+                                                    bool is_internal) {
+    (void) (n_keys);
+
+    context->mark_ux_flow();
+
+    set_cosigner_pubkey_state(pubkey, cosigner_index, is_internal);
+
+    G_deferred_approval = DEFERRED_APPROVAL_PENDING;
+
+    ux_flow_init(0, ux_display_policy_map_cosigner_pubkey_flow, NULL);
+}
+
+void ui_wait_for_approval(dispatcher_context_t *context, command_processor_t on_success) {
+    if (G_deferred_approval == DEFERRED_APPROVAL_PENDING) {
+        // from now on, the choice of the user resumes the dispatcher as for any other UI flow
+        G_deferred_approval = DEFERRED_APPROVAL_NONE;
+        context->pause();
+        g_next_processor = on_success;
+        return;
+    }
+
+    bool approved = G_deferred_approval == DEFERRED_APPROVAL_APPROVED;
+    G_deferred_approval = DEFERRED_APPROVAL_NONE;
+    context->next(approved ? on_success : send_deny_sw);
+}
+
+bool ui_is_approval_pending(void) {
+    return G_deferred_approval == DEFERRED_APPROVAL_PENDING;
+}
+
+void ui_clear_deferred_approval(void) {
+    G_deferred_approval = DEFERRED_APPROVAL_NONE;
+}
+
 void ui_display_wallet_address(dispatcher_context_t *context,
                                const char *wallet_name,
                                const char *address,
@@ -671,6 +985,19 @@ void ui_warn_unverified_segwit_inputs(dispatcher_context_t *context,
     ux_flow_init(0, ux_display_unverified_segwit_inputs_flow, NULL);
 }
 
+void ui_warn_nondefault_sighash(dispatcher_context_t *context, command_processor_t on_success) {
+    context->pause();
+
+    g_next_processor = on_success;
+
+    ux_flow_init(0, ux_display_warning_nondefault_sighash_flow, NULL);
+}
+
+char *ui_get_output_address_buffer(size_t *size) {
+    *size = sizeof(g_ui_state.validate_output.address_or_description);
+    return g_ui_state.validate_output.address_or_description;
+}
+
 void ui_validate_output(dispatcher_context_t *context,
                         int index,
                         const char *address_or_description,
@@ -682,9 +1009,12 @@ void ui_validate_output(dispatcher_context_t *context,
     ui_validate_output_state_t *state = (ui_validate_output_state_t *) &g_ui_state;
 
     snprintf(state->index, sizeof(state->index), "output #%d", index);
-    strncpy(state->address_or_description,
-            address_or_description,
-            sizeof(state->address_or_description));
+    // nothing to copy if the address was formatted in place
+    if (address_or_description != state->address_or_description) {
+        strncpy(state->address_or_description,
+                address_or_description,
+                sizeof(state->address_or_description));
+    }
     format_sats_amount(coin_name, amount, state->amount);
 
     g_next_processor = on_success;
@@ -692,6 +1022,26 @@ void ui_validate_output(dispatcher_context_t *context,
     ux_flow_init(0, ux_display_output_address_amount_flow, NULL);
 }
 
+void ui_validate_batch_outputs(dispatcher_context_t *context,
+                               int n_outputs,
+                               const char *coin_name,
+                               uint64_t total_amount,
+                               const char *outputs_digest,
+                               command_processor_t on_success) {
+    context->pause();
+
+    ui_validate_batch_outputs_state_t *state = (ui_validate_batch_outputs_state_t *) &g_ui_state;
+
+    snprintf(state->n_outputs, sizeof(state->n_outputs), "%d", n_outputs);
+    format_sats_amount(coin_name, total_amount, state->total_amount);
+    strncpy(state->outputs_digest, outputs_digest, sizeof(state->outputs_digest) - 1);
+    state->outputs_digest[sizeof(state->outputs_digest) - 1] = '\0';
+
+    g_next_processor = on_success;
+
+    ux_flow_init(0, ux_display_batch_outputs_flow, NULL);
+}
+
 void ui_validate_transaction(dispatcher_context_t *context,
                              const char *coin_name,
                              uint64_t fee,
@@ -706,3 +1056,39 @@ void ui_validate_transaction(dispatcher_context_t *context,
 
     ux_flow_init(0, ux_accept_transaction_flow, NULL);
 }
+
+void ui_set_progress(const char *phase, uint32_t current, uint32_t total) {
+    if (G_progress.phase != phase || G_progress.current != current || G_progress.total != total) {
+        G_progress.phase = phase;
+        G_progress.current = current;
+        G_progress.total = total;
+        G_progress.is_changed = true;
+    }
+}
+
+void ui_clear_progress(void) {
+    memset(&G_progress, 0, sizeof(G_progress));
+}
+
+void ui_display_processing(void) {
+    G_progress.is_changed = false;
+
+    if (G_progress.phase == NULL) {
+        ux_flow_init(0, ux_processing_flow, NULL);
+        return;
+    }
+
+    snprintf(g_ui_state.processing.progress,
+             sizeof(g_ui_state.processing.progress),
+             "%s %u/%u",
+             G_progress.phase,
+             (unsigned int) G_progress.current,
+             (unsigned int) G_progress.total);
+    ux_flow_init(0, ux_processing_progress_flow, NULL);
+}
+
+void ui_refresh_processing(void) {
+    if (G_progress.is_changed) {
+        ui_display_processing();
+    }
+}
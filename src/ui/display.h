@@ -28,6 +28,18 @@ void ui_display_message_hash(dispatcher_context_t *context,
                              const char *message_hash,
                              command_processor_t on_success);
 
+/**
+ * Displays the derivation path and the address of the key signing one or more messages, and asks
+ * the confirmation to sign. For a single message, message_hash is the hash of the message to show,
+ * in hexadecimal; otherwise, it is the Merkle root of the messages, shown with their number.
+ */
+void ui_display_message_batch(dispatcher_context_t *context,
+                              const char *bip32_path_str,
+                              const char *address,
+                              uint32_t n_messages,
+                              const char *message_hash,
+                              command_processor_t on_success);
+
 void ui_display_address(dispatcher_context_t *dispatcher_context,
                         const char *address,
                         bool is_path_suspicious,
@@ -36,8 +48,16 @@ void ui_display_address(dispatcher_context_t *dispatcher_context,
 
 void ui_display_wallet_header(dispatcher_context_t *context,
                               const policy_map_wallet_header_t *wallet_header,
+                              const char *policy_map,
                               command_processor_t on_success);
 
+void ui_display_wallet_batch_header(dispatcher_context_t *context,
+                                    const policy_map_wallet_header_t *wallet_header,
+                                    const char *policy_map,
+                                    uint8_t index,
+                                    uint8_t n_wallets,
+                                    command_processor_t on_success);
+
 void ui_display_policy_map_cosigner_pubkey(dispatcher_context_t *dispatcher_context,
                                            const char *pubkey,
                                            uint8_t cosigner_index,
@@ -45,6 +65,36 @@ void ui_display_policy_map_cosigner_pubkey(dispatcher_context_t *dispatcher_cont
                                            bool is_internal,
                                            command_processor_t on_success);
 
+/**
+ * Like ui_display_policy_map_cosigner_pubkey, but the dispatcher is not paused: the handler keeps
+ * running while the key is shown (for example, to fetch and validate the next one from the client),
+ * and then calls ui_wait_for_approval. If the user makes a choice earlier, it is kept until then.
+ */
+void ui_display_policy_map_cosigner_pubkey_deferred(dispatcher_context_t *dispatcher_context,
+                                                    const char *pubkey,
+                                                    uint8_t cosigner_index,
+                                                    uint8_t n_keys,
+                                                    bool is_internal);
+
+/**
+ * Continues with on_success once the user approves the UI flow shown with a deferred approval, or
+ * fails with SW_DENY if the user rejects it; it pauses the dispatcher if the user did not choose
+ * yet.
+ */
+void ui_wait_for_approval(dispatcher_context_t *dispatcher_context,
+                          command_processor_t on_success);
+
+/**
+ * Returns true while a UI flow with a deferred approval is shown and the user did not choose yet;
+ * the "Processing..." screen must not replace it.
+ */
+bool ui_is_approval_pending(void);
+
+/**
+ * Forgets the UI flow with a deferred approval, if any; called when a new command starts.
+ */
+void ui_clear_deferred_approval(void);
+
 void ui_display_wallet_address(dispatcher_context_t *context,
                                const char *wallet_name,
                                const char *address,
@@ -63,6 +113,15 @@ void ui_warn_external_inputs(dispatcher_context_t *context, command_processor_t
 void ui_warn_unverified_segwit_inputs(dispatcher_context_t *context,
                                       command_processor_t on_success);
 
+void ui_warn_nondefault_sighash(dispatcher_context_t *context, command_processor_t on_success);
+
+/**
+ * Returns the buffer of the validate output screen where the address or description of the output
+ * is shown, and stores its size in *size. The caller can format the address there and pass it to
+ * ui_validate_output, which then does not copy it. The buffer is overwritten by any other screen.
+ */
+char *ui_get_output_address_buffer(size_t *size);
+
 void ui_validate_output(dispatcher_context_t *context,
                         int index,
                         const char *address_or_description,
@@ -70,7 +129,43 @@ void ui_validate_output(dispatcher_context_t *context,
                         uint64_t amount,
                         command_processor_t on_success);
 
+/**
+ * Shows the summary of the external outputs of a transaction: their count, their total amount,
+ * and the digest of all the outputs, that the user compares with the one shown by the client.
+ */
+void ui_validate_batch_outputs(dispatcher_context_t *context,
+                               int n_outputs,
+                               const char *coin_name,
+                               uint64_t total_amount,
+                               const char *outputs_digest,
+                               command_processor_t on_success);
+
 void ui_validate_transaction(dispatcher_context_t *context,
                              const char *coin_name,
                              uint64_t fee,
                              command_processor_t on_success);
+
+/**
+ * Sets the progress shown in the "Processing..." screen: the name of the current phase (a string
+ * constant, at most 7 characters long), and the number of the item being processed out of the
+ * total. It only stores the values, which are drawn at most once every
+ * PROCESSING_REFRESH_TICKS ticks while the screen is shown; therefore, it is cheap enough to be
+ * called for each processed item. The progress is cleared when a new command starts.
+ */
+void ui_set_progress(const char *phase, uint32_t current, uint32_t total);
+
+/**
+ * Clears the progress set with ui_set_progress; the "Processing..." screen is shown without it.
+ */
+void ui_clear_progress(void);
+
+/**
+ * Shows the "Processing..." screen, with the progress set with ui_set_progress, if any.
+ */
+void ui_display_processing(void);
+
+/**
+ * Draws the "Processing..." screen again if the progress changed since it was last drawn; must
+ * only be called while the screen is shown.
+ */
+void ui_refresh_processing(void);
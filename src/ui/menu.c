@@ -15,10 +15,13 @@
  *  limitations under the License.
  *****************************************************************************/
 
+#include <string.h>
+
 #include "os.h"
 #include "ux.h"
 
 #include "../globals.h"
+#include "../settings.h"
 #include "menu.h"
 
 // We have a screen with the icon and "Bitcoin is ready" for Bitcoin,
@@ -30,17 +33,20 @@ UX_STEP_NOCB(ux_menu_ready_step_bitcoin_testnet,
 UX_STEP_NOCB(ux_menu_ready_step_altcoin, nn, {"Application", "is ready"});
 
 UX_STEP_NOCB(ux_menu_version_step, bn, {"Version", APPVERSION});
+UX_STEP_CB(ux_menu_settings_step, pb, ui_menu_settings(), {&C_icon_coggle, "Settings"});
 UX_STEP_CB(ux_menu_about_step, pb, ui_menu_about(), {&C_icon_certificate, "About"});
 UX_STEP_VALID(ux_menu_exit_step, pb, os_sched_exit(-1), {&C_icon_dashboard_x, "Quit"});
 
 // FLOW for the main menu (for bitcoin):
 // #1 screen: ready
 // #2 screen: version of the app
-// #3 screen: about submenu
-// #4 screen: quit
+// #3 screen: settings submenu
+// #4 screen: about submenu
+// #5 screen: quit
 UX_FLOW(ux_menu_main_flow_bitcoin,
         &ux_menu_ready_step_bitcoin,
         &ux_menu_version_step,
+        &ux_menu_settings_step,
         &ux_menu_about_step,
         &ux_menu_exit_step,
         FLOW_LOOP);
@@ -48,11 +54,13 @@ UX_FLOW(ux_menu_main_flow_bitcoin,
 // FLOW for the main menu (for bitcoin testnet):
 // #1 screen: ready
 // #2 screen: version of the app
-// #3 screen: about submenu
-// #4 screen: quit
+// #3 screen: settings submenu
+// #4 screen: about submenu
+// #5 screen: quit
 UX_FLOW(ux_menu_main_flow_bitcoin_testnet,
         &ux_menu_ready_step_bitcoin_testnet,
         &ux_menu_version_step,
+        &ux_menu_settings_step,
         &ux_menu_about_step,
         &ux_menu_exit_step,
         FLOW_LOOP);
@@ -60,11 +68,13 @@ UX_FLOW(ux_menu_main_flow_bitcoin_testnet,
 // FLOW for the main menu (for altcoins):
 // #1 screen: ready
 // #2 screen: version of the app
-// #3 screen: about submenu
-// #4 screen: quit
+// #3 screen: settings submenu
+// #4 screen: about submenu
+// #5 screen: quit
 UX_FLOW(ux_menu_main_flow_altcoin,
         &ux_menu_ready_step_altcoin,
         &ux_menu_version_step,
+        &ux_menu_settings_step,
         &ux_menu_about_step,
         &ux_menu_exit_step,
         FLOW_LOOP);
@@ -77,9 +87,10 @@ void ui_menu_main() {
         ux_stack_push();
     }
 
-    if (G_coin_config->bip32_pubkey_version == BIP32_PUBKEY_VERSION_MAINNET) {  // mainnet
+    uint32_t bip32_pubkey_version = COIN_CONFIG_BIP32_PUBKEY_VERSION(G_coin_config);
+    if (bip32_pubkey_version == BIP32_PUBKEY_VERSION_MAINNET) {  // mainnet
         ux_flow_init(0, ux_menu_main_flow_bitcoin, NULL);
-    } else if (G_coin_config->bip32_pubkey_version == BIP32_PUBKEY_VERSION_TESTNET) {  // testnet
+    } else if (bip32_pubkey_version == BIP32_PUBKEY_VERSION_TESTNET) {  // testnet
         ux_flow_init(0, ux_menu_main_flow_bitcoin_testnet, NULL);
     } else {
         ux_flow_init(0, ux_menu_main_flow_altcoin, NULL);  // some altcoin
@@ -97,3 +108,28 @@ UX_FLOW(ux_menu_about_flow, &ux_menu_info_step, &ux_menu_back_step, FLOW_LOOP);
 void ui_menu_about() {
     ux_flow_init(0, ux_menu_about_flow, NULL);
 }
+
+// "Enabled" or "Disabled", for the current value of the batch review setting
+static char batch_review_status[sizeof("Disabled")];
+
+static void toggle_batch_review() {
+    settings_set_batch_review_enabled(!settings_is_batch_review_enabled());
+    ui_menu_settings();
+}
+
+UX_STEP_CB(ux_menu_batch_review_step,
+           bn,
+           toggle_batch_review(),
+           {"Batch review", batch_review_status});
+
+// FLOW for the settings submenu:
+// #1 screen: batch review of large transactions, toggled by pressing both buttons
+// #2 screen: back button to main menu
+UX_FLOW(ux_menu_settings_flow, &ux_menu_batch_review_step, &ux_menu_back_step, FLOW_LOOP);
+
+void ui_menu_settings() {
+    strncpy(batch_review_status,
+            settings_is_batch_review_enabled() ? "Enabled" : "Disabled",
+            sizeof(batch_review_status));
+    ux_flow_init(0, ux_menu_settings_flow, NULL);
+}
@@ -0,0 +1,311 @@
+import json
+import statistics
+import time
+
+from dataclasses import dataclass, field
+from pathlib import Path
+from typing import Dict, List, Optional, Tuple, Union
+
+from bitcoin_client.ledger_bitcoin.client_base import ApduException, TransportClient
+from bitcoin_client.ledger_bitcoin.client_command import ClientCommandCode
+from bitcoin_client.ledger_bitcoin.command_builder import BitcoinInsType, FrameworkInsType
+from bitcoin_client.ledger_bitcoin.instrumentation import Instrumentation
+
+from speculos.client import SpeculosClient
+
+from .stack_profile import get_function_symbols
+
+"""
+Utilities to split the wall time of a command between the device, the host and the transport, from the timestamps
+of its APDUs and, with the builds compiled with DISPATCHER_TRACE=1, from the events of the dispatcher read with the
+GET_TRACE framework command; the timeline is written in the Chrome trace format, to be opened with chrome://tracing
+or https://ui.perfetto.dev.
+
+The time between sending an APDU and receiving its response is spent on the transport and on the device; the share
+of the transport is estimated as the round trip of GET_MAX_RESPONSE_LEN, that the device answers without any
+computation. The rest of the time of the command is spent on the host, mostly computing the responses to the client
+commands. With Speculos, the time spent on the device includes the time of the emulation and of the UI.
+"""
+
+CLA_FRAMEWORK = 0xF8
+INS_GET_TRACE = 0x03
+P2_GET_TRACE_CLEAR = 0x01
+
+SW_INS_NOT_SUPPORTED = 0x6D00
+SW_INTERRUPTED_EXECUTION = 0xE000
+
+TRACE_ENTRIES_PER_RESPONSE = 28
+
+TRACE_EVENT_COMMAND = 1
+TRACE_EVENT_PROCESSOR = 2
+TRACE_EVENT_INTERRUPTION = 3
+TRACE_EVENT_SPECULATIVE = 4
+TRACE_EVENT_CONTINUE = 5
+TRACE_EVENT_END = 6
+TRACE_EVENT_KEEPALIVE = 7
+
+# threads of the timeline of each command, in the Chrome trace
+TID_DEVICE = 1
+TID_TRANSPORT = 2
+TID_HOST = 3
+TID_TRACE_READOUT = 4
+
+
+@dataclass
+class TraceEntry:
+    ticks: int
+    event: int
+    code: int
+    value: int
+
+    def describe(self, symbols: Dict[int, str]) -> str:
+        if self.event == TRACE_EVENT_COMMAND:
+            return f"command {ins_name(0xE1, self.code)} ({self.value} bytes)"
+        elif self.event == TRACE_EVENT_PROCESSOR:
+            return f"processor {symbols.get(self.value, f'0x{self.value:08x}')} (depth {self.code})"
+        elif self.event == TRACE_EVENT_INTERRUPTION:
+            return f"client command {client_command_name(self.code)} ({self.value} bytes)"
+        elif self.event == TRACE_EVENT_SPECULATIVE:
+            return f"client command {client_command_name(self.code)} ({self.value} bytes), speculative response"
+        elif self.event == TRACE_EVENT_CONTINUE:
+            return f"continue ({self.value} bytes)"
+        elif self.event == TRACE_EVENT_END:
+            return f"end, status word 0x{self.value:04X}"
+        elif self.event == TRACE_EVENT_KEEPALIVE:
+            return "keep-alive"
+        return f"unknown event {self.event}"
+
+
+def ins_name(cla: int, ins: int) -> str:
+    try:
+        return FrameworkInsType(ins).name if cla == CLA_FRAMEWORK else BitcoinInsType(ins).name
+    except ValueError:
+        return f"0x{cla:02X} 0x{ins:02X}"
+
+
+def client_command_name(code: int) -> str:
+    try:
+        return ClientCommandCode(code).name
+    except ValueError:
+        return f"0x{code:02X}"
+
+
+def get_trace(comm: Union[TransportClient, SpeculosClient],
+              clear: bool = False) -> Optional[Tuple[int, List[TraceEntry]]]:
+    """Reads all the entries of the trace of the dispatcher, and clears it if `clear` is True. Returns the number of
+    events recorded since the trace was last cleared (that is more than the number of entries if some of them were
+    overwritten) and the entries, or None if the app was not compiled with DISPATCHER_TRACE=1."""
+
+    entries: List[TraceEntry] = []
+    while True:
+        try:
+            res = comm.apdu_exchange(CLA_FRAMEWORK, INS_GET_TRACE, b"", len(entries), 0)
+        except ApduException as e:
+            if e.sw == SW_INS_NOT_SUPPORTED:
+                return None
+            raise
+
+        n_events = int.from_bytes(res[0:4], "big")
+        for pos in range(4, len(res), 8):
+            entries.append(TraceEntry(int.from_bytes(res[pos:pos + 2], "big"), res[pos + 2], res[pos + 3],
+                                      int.from_bytes(res[pos + 4:pos + 8], "big")))
+        if len(res) < 4 + 8 * TRACE_ENTRIES_PER_RESPONSE:
+            break
+
+    if clear and n_events > 0:
+        comm.apdu_exchange(CLA_FRAMEWORK, INS_GET_TRACE, b"", len(entries), P2_GET_TRACE_CLEAR)
+
+    return n_events, entries
+
+
+def calibrate_transport(comm: Union[TransportClient, SpeculosClient], n_exchanges: int = 20) -> float:
+    """Returns the median round trip of GET_MAX_RESPONSE_LEN, in seconds, as an estimate of the time spent on the
+    transport by each APDU."""
+
+    round_trips = []
+    for _ in range(n_exchanges):
+        start = time.perf_counter()
+        comm.apdu_exchange(CLA_FRAMEWORK, int(FrameworkInsType.GET_MAX_RESPONSE_LEN), b"", 0, 0)
+        round_trips.append(time.perf_counter() - start)
+    return statistics.median(round_trips)
+
+
+@dataclass
+class Exchange:
+    cla: int
+    ins: int
+    sw: int
+    sent_bytes: int
+    received_bytes: int
+    start: float
+    end: float
+    device_events: List[TraceEntry] = field(default_factory=list)
+    n_dropped_events: int = 0
+
+
+@dataclass
+class Span:
+    name: str
+    start: float
+    end: float
+
+
+@dataclass
+class Timeline:
+    """The APDUs, the client commands and the readouts of the device trace of a single command."""
+
+    name: str
+    start: float
+    end: float = 0.0
+    transport_round_trip: float = 0.0
+    has_device_trace: bool = False
+    exchanges: List[Exchange] = field(default_factory=list)
+    client_commands: List[Span] = field(default_factory=list)
+    readouts: List[Span] = field(default_factory=list)
+
+    def transport_time(self, exchange: Exchange) -> float:
+        return min(self.transport_round_trip, exchange.end - exchange.start)
+
+    def summary(self) -> dict:
+        wall_time = self.end - self.start
+        exchanges_time = sum(x.end - x.start for x in self.exchanges)
+        transport_time = sum(self.transport_time(x) for x in self.exchanges)
+        readout_time = sum(x.end - x.start for x in self.readouts)
+        return {
+            "name": self.name,
+            "apdus": len(self.exchanges),
+            "wall_time": wall_time,
+            "device_time": exchanges_time - transport_time,
+            "transport_time": transport_time,
+            "host_time": wall_time - exchanges_time - readout_time,
+            "client_commands_time": sum(x.end - x.start for x in self.client_commands),
+            "trace_readout_time": readout_time,
+            "transport_round_trip": self.transport_round_trip,
+            "device_events": sum(len(x.device_events) for x in self.exchanges) if self.has_device_trace else None,
+            "dropped_device_events": sum(x.n_dropped_events for x in self.exchanges) if self.has_device_trace else None,
+        }
+
+    def to_chrome_events(self, pid: int, origin: float, symbols: Dict[int, str]) -> List[dict]:
+        def us(t: float) -> float:
+            return (t - origin) * 1e6
+
+        def span(name: str, tid: int, start: float, end: float, args: Optional[dict] = None) -> dict:
+            event = {"name": name, "ph": "X", "pid": pid, "tid": tid, "ts": us(start), "dur": (end - start) * 1e6}
+            if args:
+                event["args"] = args
+            return event
+
+        events = [{"name": "process_name", "ph": "M", "pid": pid, "args": {"name": self.name}}]
+        for tid, name in [(TID_DEVICE, "device"), (TID_TRANSPORT, "transport"), (TID_HOST, "host"),
+                          (TID_TRACE_READOUT, "trace readout")]:
+            events.append({"name": "thread_name", "ph": "M", "pid": pid, "tid": tid, "args": {"name": name}})
+            events.append({"name": "thread_sort_index", "ph": "M", "pid": pid, "tid": tid, "args": {"sort_index": tid}})
+
+        # the transport time is split evenly before and after the time on the device
+        for x in self.exchanges:
+            half_transport = self.transport_time(x) / 2
+            args = {"sw": f"0x{x.sw:04X}", "sent_bytes": x.sent_bytes, "received_bytes": x.received_bytes}
+            if self.has_device_trace:
+                args["device_events"] = [entry.describe(symbols) for entry in x.device_events]
+                if len(x.device_events) > 0:
+                    args["ticks"] = [x.device_events[0].ticks, x.device_events[-1].ticks]
+                if x.n_dropped_events > 0:
+                    args["dropped_device_events"] = x.n_dropped_events
+                requests = [entry.code for entry in x.device_events if entry.event == TRACE_EVENT_INTERRUPTION]
+                if x.sw == SW_INTERRUPTED_EXECUTION and len(requests) > 0:
+                    args["client_command"] = client_command_name(requests[-1])
+
+            events.append(span("send", TID_TRANSPORT, x.start, x.start + half_transport))
+            events.append(span(ins_name(x.cla, x.ins), TID_DEVICE,
+                               x.start + half_transport, x.end - half_transport, args))
+            events.append(span("receive", TID_TRANSPORT, x.end - half_transport, x.end))
+
+        for c in self.client_commands:
+            events.append(span(c.name, TID_HOST, c.start, c.end))
+        for r in self.readouts:
+            events.append(span(r.name, TID_TRACE_READOUT, r.start, r.end))
+        return events
+
+
+class TimelineRecorder(Instrumentation):
+    """An `Instrumentation` that records the timeline of the commands run between `begin` and `end`. If the app is
+    compiled with DISPATCHER_TRACE=1, the trace of the dispatcher is read (and cleared) after each APDU, so that the
+    events of the device are attributed to the APDU that caused them; the time of the readouts is excluded from the
+    host time.
+
+    The client must not be in debug mode, as the time to print the APDUs would be attributed to the device."""
+
+    def __init__(self, comm: Union[TransportClient, SpeculosClient], transport_round_trip: float = 0.0) -> None:
+        self.comm = comm
+        self.transport_round_trip = transport_round_trip
+        self.timeline: Optional[Timeline] = None
+
+    def begin(self, name: str) -> None:
+        has_device_trace = get_trace(self.comm, clear=True) is not None
+        self.timeline = Timeline(name, time.perf_counter(), transport_round_trip=self.transport_round_trip,
+                                 has_device_trace=has_device_trace)
+
+    def end(self) -> Timeline:
+        assert self.timeline is not None
+        timeline, self.timeline = self.timeline, None
+        timeline.end = time.perf_counter()
+        return timeline
+
+    def on_apdu(self, cla: int, ins: int, sw: int, sent_bytes: int, received_bytes: int, seconds: float) -> None:
+        if self.timeline is None:
+            return
+
+        end = time.perf_counter()
+        exchange = Exchange(cla, ins, sw, sent_bytes, received_bytes, end - seconds, end)
+        self.timeline.exchanges.append(exchange)
+
+        if self.timeline.has_device_trace:
+            trace = get_trace(self.comm, clear=True)
+            assert trace is not None
+            n_events, exchange.device_events = trace
+            exchange.n_dropped_events = n_events - len(exchange.device_events)
+            self.timeline.readouts.append(Span("GET_TRACE", end, time.perf_counter()))
+
+    def on_client_command(self, code: int, request_bytes: int, response_bytes: int, seconds: float) -> None:
+        if self.timeline is None:
+            return
+
+        end = time.perf_counter()
+        self.timeline.client_commands.append(Span(client_command_name(code), end - seconds, end))
+
+
+class ChromeTraceReport:
+    """Collects the timelines of the commands, and writes them as a JSON file in the Chrome trace format; the summary
+    of each timeline is in the "otherData" field."""
+
+    def __init__(self, path: Optional[Path], app_version: str, elf_path: Optional[Path]) -> None:
+        self.path = path
+        self.app_version = app_version
+        self.elf_path = elf_path
+        self.timelines: List[Timeline] = []
+
+    def add(self, timeline: Timeline) -> None:
+        self.timelines.append(timeline)
+
+    def write(self) -> None:
+        if self.path is None or len(self.timelines) == 0:
+            return
+
+        symbols = {}
+        if self.elf_path is not None and self.elf_path.is_file():
+            symbols = get_function_symbols(self.elf_path)
+
+        origin = self.timelines[0].start
+        events = []
+        for pid, timeline in enumerate(self.timelines, 1):
+            events += timeline.to_chrome_events(pid, origin, symbols)
+
+        with open(self.path, "w") as f:
+            json.dump({
+                "traceEvents": events,
+                "displayTimeUnit": "ms",
+                "otherData": {
+                    "app_version": self.app_version,
+                    "results": [timeline.summary() for timeline in self.timelines],
+                },
+            }, f, indent=2)
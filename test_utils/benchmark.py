@@ -0,0 +1,168 @@
+import json
+import time
+
+from collections import Counter
+from contextlib import contextmanager
+from pathlib import Path
+from typing import Dict, Iterator, List, Optional, Union
+from unittest.mock import patch
+
+from bitcoin_client.ledger_bitcoin.client_base import TransportClient
+from bitcoin_client.ledger_bitcoin.client_command import ClientCommandCode, ClientCommandInterpreter
+
+from speculos.client import SpeculosClient
+
+"""
+Utilities to measure the cost of the interactive protocol of a command, in terms of APDUs exchanged,
+bytes transferred, client commands executed and wall time, and to compare it with a baseline.
+"""
+
+
+class ProtocolStats:
+    def __init__(self) -> None:
+        self.n_apdus = 0
+        self.bytes_sent = 0
+        self.bytes_received = 0
+        self.client_commands: Counter = Counter()
+        self.wall_time = 0.0
+
+    def to_dict(self) -> dict:
+        return {
+            "apdus": self.n_apdus,
+            "bytes_sent": self.bytes_sent,
+            "bytes_received": self.bytes_received,
+            "client_commands": dict(sorted(self.client_commands.items())),
+            "wall_time": self.wall_time,
+        }
+
+
+def client_command_name(request: bytes) -> str:
+    try:
+        return ClientCommandCode(request[0]).name
+    except ValueError:
+        return f"0x{request[0]:02X}"
+
+
+@contextmanager
+def measure(comm: Union[TransportClient, SpeculosClient]) -> Iterator[ProtocolStats]:
+    """Instruments `comm` and the ClientCommandInterpreter for the duration of the context, and
+    records the usage statistics in the returned ProtocolStats.
+
+    Sent bytes include the 5-byte APDU header; received bytes include the 2-byte status word."""
+
+    stats = ProtocolStats()
+
+    original_apdu_exchange = comm.apdu_exchange
+
+    def apdu_exchange(cla: int, ins: int, data: bytes = b"", p1: int = 0, p2: int = 0) -> bytes:
+        stats.n_apdus += 1
+        stats.bytes_sent += 5 + len(data)
+        try:
+            response = original_apdu_exchange(cla, ins, data, p1, p2)
+        except Exception as e:
+            # the status words other than 0x9000 (including SW_INTERRUPTED_EXECUTION) are exceptions
+            stats.bytes_received += len(getattr(e, "data", b"")) + 2
+            raise
+        stats.bytes_received += len(response) + 2
+        return response
+
+    original_execute = ClientCommandInterpreter.execute
+
+    def execute(self: ClientCommandInterpreter, hw_response: bytes) -> bytes:
+        if len(hw_response) > 0:
+            stats.client_commands[client_command_name(hw_response)] += 1
+        return original_execute(self, hw_response)
+
+    comm.apdu_exchange = apdu_exchange
+    try:
+        with patch.object(ClientCommandInterpreter, "execute", execute):
+            start = time.perf_counter()
+            try:
+                yield stats
+            finally:
+                stats.wall_time = time.perf_counter() - start
+    finally:
+        comm.apdu_exchange = original_apdu_exchange
+
+
+class BenchmarkReport:
+    """Collects the results of the benchmarks, and writes them as a JSON file."""
+
+    def __init__(self, path: Optional[Path], app_version: str) -> None:
+        self.path = path
+        self.app_version = app_version
+        self.results: List[dict] = []
+
+    def add(self, name: str, params: dict, stats: ProtocolStats) -> None:
+        self.results.append({"name": name, **params, **stats.to_dict()})
+
+    def write(self) -> None:
+        if self.path is None or len(self.results) == 0:
+            return
+
+        with open(self.path, "w") as f:
+            json.dump({"app_version": self.app_version, "results": self.results}, f, indent=2)
+
+
+class PerfBaseline:
+    """The expected costs of the cases of a performance regression test, stored in a JSON file like:
+
+        {
+          "tolerances": {"apdus": 0, "bytes_sent": 0.01, "bytes_received": 0.01, "client_commands": 0},
+          "cases": {
+            "wpkh_10": {"params": {"n_inputs": 10, "mix": {"wpkh": 1}}, "expected": {"apdus": 215, ...}},
+            ...
+          }
+        }
+
+    The tolerances are relative, for each of the values of ProtocolStats.to_dict() (the client commands are
+    compared by type); the values without a tolerance (by default, the wall time) are not compared. Costs lower
+    than the expected ones always pass; the baseline should then be updated to lock in the improvement.
+
+    If update is True, the measured costs replace the expected ones, and the file is rewritten by write()."""
+
+    def __init__(self, path: Path, update: bool = False) -> None:
+        self.path = path
+        self.update = update
+        with open(path) as f:
+            baseline = json.load(f)
+        self.tolerances: Dict[str, float] = baseline["tolerances"]
+        self.cases: Dict[str, dict] = baseline["cases"]
+        self.updated = False
+
+    def check(self, name: str, stats: ProtocolStats) -> List[str]:
+        """Returns the descriptions of the regressions of stats compared to the expected costs of the case name,
+        or records stats if update is True."""
+
+        measured = stats.to_dict()
+        if self.update:
+            self.cases[name]["expected"] = measured
+            self.updated = True
+            return []
+
+        expected = self.cases[name].get("expected")
+        if expected is None:
+            return []
+
+        regressions = []
+
+        def compare(label: str, tolerance: Optional[float], expected_value: float, value: float) -> None:
+            if tolerance is not None and value > expected_value * (1 + tolerance):
+                regressions.append(f"{label}: {value} > {expected_value} (tolerance: {tolerance:.0%})")
+
+        for key, value in measured.items():
+            if key == "client_commands":
+                tolerance = self.tolerances.get(key)
+                for command in sorted(set(value) | set(expected[key])):
+                    compare(f"{key}.{command}", tolerance, expected[key].get(command, 0), value.get(command, 0))
+            else:
+                compare(key, self.tolerances.get(key), expected[key], value)
+        return regressions
+
+    def write(self) -> None:
+        if not self.updated:
+            return
+
+        with open(self.path, "w") as f:
+            json.dump({"tolerances": self.tolerances, "cases": self.cases}, f, indent=2)
+            f.write("\n")
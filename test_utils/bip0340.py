@@ -2,8 +2,11 @@
 # https://github.com/bitcoin/bips/blob/master/bip-0340/reference.py
 
 
-from typing import Tuple, Optional
+from typing import Tuple, Optional, Sequence
 import hashlib
+import secrets
+
+from bitcoin_client.ledger_bitcoin import key as _key
 
 p = 0xFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEFFFFFC2F
 n = 0xFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEBAAEDCE6AF48A03BBFD25E8CD0364141
@@ -46,6 +49,10 @@ def point_add(P1: Optional[Point], P2: Optional[Point]) -> Optional[Point]:
     return (x3, (lam * (x(P1) - x3) - y(P1)) % p)
 
 def point_mul(P: Optional[Point], n: int) -> Optional[Point]:
+    # same result, computed with libsecp256k1 if coincurve is installed
+    if _key.coincurve is not None:
+        return _key.point_mul(P, n)
+
     R = None
     for i in range(256):
         if (n >> i) & 1:
@@ -53,6 +60,16 @@ def point_mul(P: Optional[Point], n: int) -> Optional[Point]:
         P = point_add(P, P)
     return R
 
+def multi_point_mul(terms: Sequence[Tuple[Optional[Point], int]]) -> Optional[Point]:
+    """Returns the sum of k*P for all the pairs (P, k) in terms; the doublings are shared among all the terms."""
+    R = None
+    for i in reversed(range(256)):
+        R = point_add(R, R)
+        for (P, k) in terms:
+            if (k >> i) & 1:
+                R = point_add(R, P)
+    return R
+
 def bytes_from_int(x: int) -> bytes:
     return x.to_bytes(32, byteorder="big")
 
@@ -131,3 +148,28 @@ def schnorr_verify(msg: bytes, pubkey: bytes, sig: bytes) -> bool:
     if (R is None) or (not has_even_y(R)) or (x(R) != r):
         return False
     return True
+
+def schnorr_verify_batch(items: Sequence[Tuple[bytes, bytes, bytes]]) -> bool:
+    """Verifies all the (msg, pubkey, sig) triples at once, with the batch verification algorithm of BIP-340.
+
+    Without coincurve, it is several times faster than calling schnorr_verify for each triple; with it, each signature
+    is verified on its own, as libsecp256k1 does that faster than the pure python batch verification."""
+    if _key.coincurve is not None:
+        return all(schnorr_verify(msg, pubkey, sig) for (msg, pubkey, sig) in items)
+
+    lhs = 0
+    terms = []
+    for i, (msg, pubkey, sig) in enumerate(items):
+        if len(msg) != 32 or len(pubkey) != 32 or len(sig) != 64:
+            raise ValueError('Invalid length of message, public key or signature.')
+        P = lift_x(pubkey)
+        R = lift_x(sig[0:32])
+        s = int_from_bytes(sig[32:64])
+        if (P is None) or (R is None) or (s >= n):
+            return False
+        e = int_from_bytes(tagged_hash("BIP0340/challenge", sig[0:32] + pubkey + msg)) % n
+        a = 1 if i == 0 else 1 + secrets.randbelow(n - 1)
+        lhs = (lhs + a * s) % n
+        terms += [(R, a), (P, a * e % n)]
+    # (sum of a_i*s_i)*G == sum of a_i*R_i + sum of (a_i*e_i)*P_i
+    return point_mul(G, lhs) == multi_point_mul(terms)
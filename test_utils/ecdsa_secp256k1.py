@@ -0,0 +1,40 @@
+# ECDSA verification over secp256k1, with the point arithmetic of bip0340.py (that uses libsecp256k1 if coincurve is
+# installed)
+
+from typing import Sequence, Tuple
+
+from .bip0340 import G, n, int_from_bytes, multi_point_mul, point_add, point_mul, _key
+
+
+def parse_der_signature(sig: bytes) -> Tuple[int, int]:
+    """Returns r and s of a DER-encoded ECDSA signature (without the sighash byte)."""
+    if len(sig) < 8 or sig[0] != 0x30 or sig[1] != len(sig) - 2 or sig[2] != 0x02:
+        raise ValueError('Invalid DER signature.')
+    r_len = sig[3]
+    if sig[4 + r_len] != 0x02 or 6 + r_len + sig[5 + r_len] != len(sig):
+        raise ValueError('Invalid DER signature.')
+    return int_from_bytes(sig[4:4 + r_len]), int_from_bytes(sig[6 + r_len:])
+
+
+def ecdsa_verify(msg: bytes, pubkey: bytes, sig: bytes) -> bool:
+    """Verifies the DER-encoded signature `sig` of the 32-byte hash `msg` for the compressed or uncompressed public key
+    `pubkey`. Signatures with a high s are valid too."""
+    if len(msg) != 32:
+        raise ValueError('The message must be a 32-byte array.')
+    P = _key.bytes_to_point(pubkey)
+    r, s = parse_der_signature(sig)
+    if not (1 <= r < n and 1 <= s < n):
+        return False
+    w = pow(s, n - 2, n)
+    u1 = int_from_bytes(msg) * w % n
+    u2 = r * w % n
+    if _key.coincurve is not None:
+        R = point_add(point_mul(G, u1), point_mul(P, u2))
+    else:
+        R = multi_point_mul([(G, u1), (P, u2)])
+    return R is not None and R[0] % n == r
+
+
+def ecdsa_verify_batch(items: Sequence[Tuple[bytes, bytes, bytes]]) -> bool:
+    """Verifies all the (msg, pubkey, sig) triples, as ecdsa_verify."""
+    return all(ecdsa_verify(msg, pubkey, sig) for (msg, pubkey, sig) in items)
@@ -7,6 +7,9 @@ import json
 from typing import Literal, Union
 
 from . import default_settings, SpeculosGlobals
+from .benchmark import BenchmarkReport, PerfBaseline
+from .stack_profile import StackProfileReport
+from .apdu_trace import ChromeTraceReport
 
 from bitcoin_client.ledger_bitcoin import TransportClient, Client, Chain, createClient
 
@@ -22,12 +25,33 @@ BITCOIN_APP_BINARY: the full path and file name of the app's binary to use. Defa
 
 BITCOIN_APP_LIB_BINARY: the full path and file name of binary to use as Bitcoin library in speculos.
                         If omitted no library is used in speculos.
+
+SPECULOS_MODEL: the device emulated by speculos: "nanos", "nanox" or "nanosp". Default: "nanos"
+
+SPECULOS_SDK: the version of the SDK of the app for speculos. Defaults to the version of the SDK of the builder
+              image for the model
+
+Benchmarks are only executed if the --enablebenchmarks option is used; their results are written to the
+JSON file given by the --benchmarkreport option (default: benchmark_report.json).
+
+The performance regression tests compare the cost of the interactive protocol with tests/perf_baseline.json;
+with the --updateperfbaseline option, they record the measured costs in it instead.
+
+With an app compiled with STACK_PROFILE=1, the stack usage of the main commands is written to the JSON file
+given by the --stackprofilereport option (default: stack_profile_report.json).
+
+With the --apdutrace option, the time of SIGN_PSBT is split between the device, the host and the transport, and written
+as a Chrome trace in the given JSON file; with an app compiled with DISPATCHER_TRACE=1, the trace also includes the
+events of the device.
 """
 
 
 # root of the repository
 repo_root_path: Path = Path(__file__).parent.parent
 
+# version of the SDK given to speculos for each model, if SPECULOS_SDK is not set
+SPECULOS_SDK_BY_MODEL = {"nanos": "2.1", "nanox": "2.0.2", "nanosp": "1.0.3"}
+
 # path of the folder of the currently running test
 
 ASSIGNMENT_RE = re.compile(
@@ -52,6 +76,11 @@ def pytest_addoption(parser):
     parser.addoption("--hid", action="store_true")
     parser.addoption("--headless", action="store_true")
     parser.addoption("--enableslowtests", action="store_true")
+    parser.addoption("--enablebenchmarks", action="store_true")
+    parser.addoption("--benchmarkreport", action="store", default="benchmark_report.json")
+    parser.addoption("--updateperfbaseline", action="store_true")
+    parser.addoption("--stackprofilereport", action="store", default="stack_profile_report.json")
+    parser.addoption("--apdutrace", action="store", default=None)
 
 
 @pytest.fixture(scope="module")
@@ -93,6 +122,52 @@ def enable_slow_tests(pytestconfig):
     return pytestconfig.getoption("enableslowtests")
 
 
+@pytest.fixture
+def enable_benchmarks(pytestconfig):
+    return pytestconfig.getoption("enablebenchmarks")
+
+
+@pytest.fixture(scope="session")
+def benchmark_report(pytestconfig) -> BenchmarkReport:
+    report = BenchmarkReport(Path(pytestconfig.getoption("benchmarkreport")), get_app_version())
+
+    yield report
+
+    report.write()
+
+
+@pytest.fixture(scope="session")
+def perf_baseline(pytestconfig) -> PerfBaseline:
+    baseline = PerfBaseline(repo_root_path / "tests" / "perf_baseline.json",
+                            pytestconfig.getoption("updateperfbaseline"))
+
+    yield baseline
+
+    baseline.write()
+
+
+@pytest.fixture(scope="session")
+def stack_profile_report(pytestconfig) -> StackProfileReport:
+    app_binary = os.getenv("BITCOIN_APP_BINARY", str(repo_root_path.joinpath("bin/app.elf")))
+    report = StackProfileReport(Path(pytestconfig.getoption("stackprofilereport")),
+                                get_app_version(), Path(app_binary))
+
+    yield report
+
+    report.write()
+
+
+@pytest.fixture(scope="session")
+def apdu_trace_report(pytestconfig) -> ChromeTraceReport:
+    path = pytestconfig.getoption("apdutrace")
+    app_binary = os.getenv("BITCOIN_APP_BINARY", str(repo_root_path.joinpath("bin/app.elf")))
+    report = ChromeTraceReport(Path(path) if path is not None else None, get_app_version(), Path(app_binary))
+
+    yield report
+
+    report.write()
+
+
 @pytest.fixture(scope='session', autouse=True)
 def root_directory(request):
     return Path(str(request.config.rootdir))
@@ -121,9 +196,14 @@ def comm(settings, root_directory, hid, headless, app_version: str) -> Union[Tra
         else:
             lib_params = []
 
+        model = os.getenv("SPECULOS_MODEL", "nanos")
+        if model not in SPECULOS_SDK_BY_MODEL:
+            raise ValueError(f'Invalid value for SPECULOS_MODEL: {model}')
+        sdk = os.getenv("SPECULOS_SDK", SPECULOS_SDK_BY_MODEL[model])
+
         client = SpeculosClient(
             app_binary,
-            ['--sdk', '2.1', '--seed', f'{settings["mnemonic"]}']
+            ['--model', model, '--sdk', sdk, '--seed', f'{settings["mnemonic"]}']
             + ["--display", "qt" if not headless else "headless"]
             + lib_params
         )
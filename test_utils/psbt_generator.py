@@ -0,0 +1,310 @@
+import argparse
+import json
+import random
+
+from dataclasses import asdict, dataclass, field
+from pathlib import Path
+from typing import Dict, List, Optional, Tuple, Union
+
+from bitcoin_client.ledger_bitcoin import AddressType, MultisigWallet, PolicyMapWallet
+from bitcoin_client.ledger_bitcoin.common import hash160
+from bitcoin_client.ledger_bitcoin.key import KeyOriginInfo, parse_path, get_taproot_output_key
+from bitcoin_client.ledger_bitcoin.psbt import PSBT, PartiallySignedInput, PartiallySignedOutput
+from bitcoin_client.ledger_bitcoin.tx import (CScriptWitness, CTransaction, CTxIn, CTxInWitness, CTxOut, COutPoint,
+                                              CTxWitness, uint256_from_str)
+
+from embit.bip32 import HDKey
+from embit.networks import NETWORKS
+
+from .txmaker import (master_key, master_key_fpr, getDescriptorFromWallet, getKeyOriginsFromWallet,
+                      getScriptPubkeyFromWallet)
+
+"""
+Generator of deterministic synthetic PSBTs for the performance tests, with many inputs and outputs, a mix of script
+types, configurable sizes of the non-witness UTXOs, inputs spending outputs of the same previous transaction, and
+sighash types.
+
+The PSBTs are written as JSON fixture files, with the parameters and the wallet policy to sign them with; the same
+parameters (including the seed) always produce the same PSBT, so that the benchmarks are reproducible across machines.
+From the root of the repository:
+
+```
+$ python -m test_utils.psbt_generator --inputs 100 --outputs 2 --mix wpkh:3,tr:1 --shared-prevouts 0.25 \\
+    -o tests/psbt/benchmark/wpkh_tr_100.json
+```
+
+Only the inputs of the script type of the signing wallet (by default, the first one of the mix) are signed by the
+device; the other ones are external inputs, with all their key origins, so that the device still processes them.
+"""
+
+
+# as in src/handler/sign_psbt.h
+MAX_N_INPUTS_CAN_SIGN = 512
+
+# account of the keys of the speculos seed used for each single-signature script type
+SINGLESIG_ACCOUNTS = {
+    "pkh": ("pkh(@0)", "m/44'/1'/0'"),
+    "sh-wpkh": ("sh(wpkh(@0))", "m/49'/1'/0'"),
+    "wpkh": ("wpkh(@0)", "m/84'/1'/0'"),
+    "tr": ("tr(@0)", "m/86'/1'/0'"),
+}
+
+SCRIPT_TYPES = [*SINGLESIG_ACCOUNTS.keys(), "wsh-sortedmulti"]
+
+
+def key_info(root: HDKey, path: str) -> str:
+    xpub = root.derive(path).to_public().to_base58(version=NETWORKS["test"]["xpub"])
+    return f"[{root.my_fingerprint.hex()}{path[1:]}]{xpub}/**"
+
+
+def cosigner_key_info(i: int) -> str:
+    """Returns the key information of a (deterministic) external cosigner, as in the benchmarks of SIGN_PSBT."""
+    return key_info(HDKey.from_seed(bytes([i]) * 32, version=NETWORKS["test"]["xprv"]), "m/48'/1'/0'/2'")
+
+
+def get_wallet(script_type: str) -> PolicyMapWallet:
+    """Returns the wallet policy of the given script type, with the keys of the speculos seed; the multisig wallet is
+    a 2-of-3 with two external cosigners, that must be registered."""
+    if script_type == "wsh-sortedmulti":
+        return MultisigWallet("Cold storage", AddressType.WIT, 2,
+                              [key_info(master_key, "m/48'/1'/0'/2'"), cosigner_key_info(1), cosigner_key_info(2)])
+    policy_map, path = SINGLESIG_ACCOUNTS[script_type]
+    return PolicyMapWallet("", policy_map, [key_info(master_key, path)])
+
+
+# the recipient of the outputs that are not change outputs
+EXTERNAL_WALLET = PolicyMapWallet("", "wpkh(@0)", [
+    key_info(HDKey.from_seed(bytes([0xff]) * 32, version=NETWORKS["test"]["xprv"]), "m/84'/1'/0'")])
+
+
+@dataclass
+class PsbtParams:
+    n_inputs: int = 1
+    n_outputs: int = 2
+    # script type => relative weight; the inputs are split among the script types in these proportions
+    mix: Dict[str, int] = field(default_factory=lambda: {"wpkh": 1})
+    # the script type of the signing wallet; by default, the first one of the mix
+    wallet: Optional[str] = None
+    # number of change outputs (of the signing wallet), among the n_outputs outputs
+    n_change: int = 1
+    # number of inputs and outputs of each previous transaction, that determine the size of the non-witness UTXOs
+    prevout_inputs: int = 1
+    prevout_outputs: int = 2
+    # probability that an input spends another output of a previous transaction already spent by the PSBT
+    shared_prevouts: float = 0.0
+    # the sighash type of each input is chosen among these ones; if empty, the inputs have no sighash type
+    sighash_types: List[int] = field(default_factory=list)
+    seed: int = 0
+
+    def signing_script_type(self) -> str:
+        return self.wallet if self.wallet is not None else next(iter(self.mix))
+
+    def validate(self) -> None:
+        if not 1 <= self.n_inputs <= MAX_N_INPUTS_CAN_SIGN:
+            raise ValueError(f"The number of inputs must be between 1 and {MAX_N_INPUTS_CAN_SIGN}")
+        if not 0 <= self.n_change <= self.n_outputs or self.n_outputs < 1:
+            raise ValueError("Invalid number of outputs")
+        if len(self.mix) == 0 or any(t not in SCRIPT_TYPES or w <= 0 for t, w in self.mix.items()):
+            raise ValueError(f"Invalid mix; the script types are: {', '.join(SCRIPT_TYPES)}")
+        if self.signing_script_type() not in self.mix:
+            raise ValueError("The script type of the wallet must be in the mix")
+        if self.prevout_inputs < 1 or self.prevout_outputs < 1 or not 0 <= self.shared_prevouts <= 1:
+            raise ValueError("Invalid parameters of the previous transactions")
+
+
+def split_by_weight(rng: random.Random, n: int, weights: Dict[str, int]) -> List[str]:
+    """Returns n script types, in random order, in the proportions of weights (the remainders go to the first ones)."""
+    total = sum(weights.values())
+    counts = {t: n * w // total for t, w in weights.items()}
+    for t in list(weights)[:n - sum(counts.values())]:
+        counts[t] += 1
+    result = [t for t, count in counts.items() for _ in range(count)]
+    rng.shuffle(result)
+    return result
+
+
+def random_bytes(rng: random.Random, n: int) -> bytes:
+    return bytes(rng.getrandbits(8) for _ in range(n))
+
+
+@dataclass
+class Prevout:
+    tx: CTransaction
+    # (change, address_index) of each output
+    derivations: List[Tuple[int, int]]
+    n_spent: int = 0
+
+
+def create_prevout(rng: random.Random, params: PsbtParams, wallet: PolicyMapWallet, script_type: str) -> Prevout:
+    """Creates a (fake) previous transaction, whose outputs are all received by wallet."""
+    tx = CTransaction()
+    tx.nVersion = 2
+    tx.nLockTime = 0
+    tx.wit = CTxWitness()
+
+    for _ in range(params.prevout_inputs):
+        tx_in = CTxIn()
+        tx_in.prevout = COutPoint(uint256_from_str(random_bytes(rng, 32)), rng.randint(0, 20))
+        tx_in.nSequence = 0
+        tx_in.scriptSig = random_bytes(rng, 80)  # dummy
+        tx.vin.append(tx_in)
+
+    derivations = []
+    for _ in range(params.prevout_outputs):
+        change, address_index = rng.randint(0, 1), rng.randint(0, 10_000)
+        script = getScriptPubkeyFromWallet(wallet, change, address_index).data
+        tx.vout.append(CTxOut(rng.randint(10_000, 100_000_000), script))
+        derivations.append((change, address_index))
+
+    if script_type != "pkh":
+        for _ in range(params.prevout_inputs):
+            in_wit = CTxInWitness()
+            in_wit.scriptWitness = CScriptWitness()
+            in_wit.scriptWitness.stack = [random_bytes(rng, 64)]  # dummy
+            tx.wit.vtxinwit.append(in_wit)
+
+    tx.rehash()
+    return Prevout(tx, derivations)
+
+
+def add_key_info(psbt_map: Union[PartiallySignedInput, PartiallySignedOutput], script_type: str,
+                 wallet: PolicyMapWallet, change: int, address_index: int) -> None:
+    """Adds to an input or an output the scripts and the key origins of the address of wallet."""
+    if script_type == "wsh-sortedmulti":
+        psbt_map.witness_script = getDescriptorFromWallet(wallet, change, address_index).witness_script().data
+        psbt_map.hd_keypaths = getKeyOriginsFromWallet(wallet, change, address_index)
+        return
+
+    path_str = f"{SINGLESIG_ACCOUNTS[script_type][1]}/{change}/{address_index}"
+    path = parse_path(path_str)
+    key: bytes = master_key.derive(path_str).key.sec()
+    if script_type == "tr":
+        psbt_map.tap_bip32_paths[get_taproot_output_key(key)] = (list(), KeyOriginInfo(master_key_fpr, path))
+    else:
+        psbt_map.hd_keypaths[key] = KeyOriginInfo(master_key_fpr, path)
+        if script_type == "sh-wpkh":
+            psbt_map.redeem_script = b"\x00\x14" + hash160(key)
+
+
+def generate_psbt(params: PsbtParams) -> Tuple[PSBT, int]:
+    """Returns the PSBT with the given parameters, and the number of its inputs that the signing wallet signs; it only
+    depends on the parameters, including the seed."""
+    params.validate()
+    rng = random.Random(params.seed)
+
+    wallets = {script_type: get_wallet(script_type) for script_type in params.mix}
+    signing_wallet = wallets[params.signing_script_type()]
+
+    psbt = PSBT()
+    psbt.version = 0
+    tx = CTransaction()
+    tx.wit = CTxWitness()
+
+    prevouts: Dict[str, List[Prevout]] = {script_type: [] for script_type in params.mix}
+    total_amount = 0
+    n_signed_inputs = 0
+    for script_type in split_by_weight(rng, params.n_inputs, params.mix):
+        wallet = wallets[script_type]
+        # previous transactions of the same script type with outputs not spent yet
+        candidates = [p for p in prevouts[script_type] if p.n_spent < len(p.tx.vout)]
+        if len(candidates) > 0 and rng.random() < params.shared_prevouts:
+            prevout = rng.choice(candidates)
+        else:
+            prevout = create_prevout(rng, params, wallet, script_type)
+            prevouts[script_type].append(prevout)
+        n = prevout.n_spent
+        prevout.n_spent += 1
+
+        tx_in = CTxIn()
+        tx_in.prevout = COutPoint(prevout.tx.sha256, n)
+        tx_in.scriptSig = b''
+        tx_in.nSequence = 0
+        tx.vin.append(tx_in)
+
+        psbt_in = PartiallySignedInput(0)
+        if script_type != "tr":
+            psbt_in.non_witness_utxo = prevout.tx
+        if script_type != "pkh":
+            psbt_in.witness_utxo = prevout.tx.vout[n]
+        if len(params.sighash_types) > 0:
+            psbt_in.sighash = rng.choice(params.sighash_types)
+        add_key_info(psbt_in, script_type, wallet, *prevout.derivations[n])
+        psbt.inputs.append(psbt_in)
+        total_amount += prevout.tx.vout[n].nValue
+        if script_type == params.signing_script_type():
+            n_signed_inputs += 1
+
+    # the fee is 1% of the total amount of the inputs
+    separators = sorted(rng.randint(0, total_amount * 99 // 100) for _ in range(params.n_outputs - 1))
+    amounts = [b - a for a, b in zip([0, *separators], [*separators, total_amount * 99 // 100])]
+    for i, amount in enumerate(amounts):
+        psbt_out = PartiallySignedOutput(0)
+        if i < params.n_change:
+            script = getScriptPubkeyFromWallet(signing_wallet, 1, i).data
+            add_key_info(psbt_out, params.signing_script_type(), signing_wallet, 1, i)
+        else:
+            script = getScriptPubkeyFromWallet(EXTERNAL_WALLET, 0, i).data
+        tx.vout.append(CTxOut(amount, script))
+        psbt.outputs.append(psbt_out)
+
+    psbt.tx = tx
+    return psbt, n_signed_inputs
+
+
+def write_fixture(path: Path, params: PsbtParams) -> None:
+    """Writes the fixture with the PSBT generated with params, and the wallet policy to sign it with."""
+    wallet = get_wallet(params.signing_script_type())
+    psbt, n_signed_inputs = generate_psbt(params)
+    with open(path, "w") as f:
+        json.dump({
+            "params": asdict(params),
+            "wallet": {"name": wallet.name, "policy_map": wallet.policy_map, "keys_info": wallet.keys_info},
+            "n_signed_inputs": n_signed_inputs,
+            "psbt": psbt.serialize(),
+        }, f, indent=2)
+        f.write("\n")
+
+
+def load_fixture(path: Path) -> Tuple[PSBT, PolicyMapWallet, int, dict]:
+    """Returns the PSBT, the wallet policy, the number of inputs signed by the wallet and the parameters of a fixture
+    written by write_fixture."""
+    with open(path) as f:
+        fixture = json.load(f)
+    psbt = PSBT()
+    psbt.deserialize(fixture["psbt"])
+    wallet = PolicyMapWallet(fixture["wallet"]["name"], fixture["wallet"]["policy_map"], fixture["wallet"]["keys_info"])
+    return psbt, wallet, fixture["n_signed_inputs"], fixture["params"]
+
+
+def parse_mix(mix: str) -> Dict[str, int]:
+    result: Dict[str, int] = {}
+    for item in mix.split(","):
+        script_type, _, weight = item.partition(":")
+        result[script_type] = int(weight) if weight else 1
+    return result
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Generates a deterministic synthetic PSBT as a benchmark fixture.")
+    parser.add_argument("--inputs", type=int, default=1, help=f"number of inputs (at most {MAX_N_INPUTS_CAN_SIGN})")
+    parser.add_argument("--outputs", type=int, default=2, help="number of outputs")
+    parser.add_argument("--change", type=int, default=1, help="number of change outputs, among the outputs")
+    parser.add_argument("--mix", type=parse_mix, default={"wpkh": 1},
+                        help=f"script types of the inputs with their weights, like wpkh:3,tr:1 "
+                             f"({', '.join(SCRIPT_TYPES)})")
+    parser.add_argument("--wallet", choices=SCRIPT_TYPES,
+                        help="script type of the signing wallet (default: the first one of the mix)")
+    parser.add_argument("--prevout-inputs", type=int, default=1, help="number of inputs of each previous transaction")
+    parser.add_argument("--prevout-outputs", type=int, default=2, help="number of outputs of each previous transaction")
+    parser.add_argument("--shared-prevouts", type=float, default=0.0,
+                        help="probability that an input spends another output of an already spent previous transaction")
+    parser.add_argument("--sighash", type=lambda s: [int(x, 0) for x in s.split(",")], default=[],
+                        help="sighash types, like 1,0x83, chosen at random for each input (default: none)")
+    parser.add_argument("--seed", type=int, default=0, help="seed of the generator")
+    parser.add_argument("-o", "--output", type=Path, required=True, help="the fixture file to write")
+    args = parser.parse_args()
+
+    write_fixture(args.output, PsbtParams(
+        n_inputs=args.inputs, n_outputs=args.outputs, mix=args.mix, wallet=args.wallet, n_change=args.change,
+        prevout_inputs=args.prevout_inputs, prevout_outputs=args.prevout_outputs,
+        shared_prevouts=args.shared_prevouts, sighash_types=args.sighash, seed=args.seed))
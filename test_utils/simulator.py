@@ -0,0 +1,343 @@
+import hashlib
+import hmac
+
+from collections import Counter
+from typing import Generator, List, Optional
+
+from bitcoin_client.ledger_bitcoin.client_base import ApduException
+from bitcoin_client.ledger_bitcoin.client_command import ClientCapability, ClientCommandCode, MAX_RESPONSE_LEN
+from bitcoin_client.ledger_bitcoin.command_builder import BitcoinCommandBuilder, BitcoinInsType, FrameworkInsType
+from bitcoin_client.ledger_bitcoin.common import ByteStreamParser, sha256, write_varint
+from bitcoin_client.ledger_bitcoin.merkle import combine_hashes, element_hash
+
+"""
+An in-process stand-in for the device, to measure the throughput of the client without Speculos.
+
+`ProtocolSimulator` can be passed to `NewClient` in place of a `TransportClient`. It answers SIGN_PSBT, REGISTER_WALLET
+and GET_WALLET_ADDRESS with the same kind of client commands as the app: it loads the wallet policy and its keys, the
+Merkleized maps of the PSBT and the values it needs from them with GET_PREIMAGE, GET_MERKLE_LEAF_PROOF,
+GET_MERKLE_LEAF_INDEX and GET_MORE_ELEMENTS, verifying every proof; then it yields one signature per input.
+
+GET_EXTENDED_PUBKEY and GET_MASTER_FINGERPRINT are also answered, without client commands.
+
+Only the request patterns are reproduced: the signatures, addresses, pubkeys and hmacs it returns are placeholders, no
+user interaction is simulated, and the optional client commands negotiated with the client capabilities are not used.
+"""
+
+SW_OK = 0x9000
+SW_INCORRECT_DATA = 0x6A80
+SW_BAD_STATE = 0xB007
+SW_INS_NOT_SUPPORTED = 0x6D00
+SW_CLA_NOT_SUPPORTED = 0x6E00
+SW_INTERRUPTED_EXECUTION = 0xE000
+
+# PSBT key types read by the simulator
+PSBT_GLOBAL_UNSIGNED_TX = 0x00
+PSBT_GLOBAL_TX_VERSION = 0x02
+PSBT_GLOBAL_FALLBACK_LOCKTIME = 0x03
+PSBT_IN_NON_WITNESS_UTXO = 0x00
+PSBT_IN_WITNESS_UTXO = 0x01
+PSBT_IN_SIGHASH_TYPE = 0x03
+PSBT_IN_BIP32_DERIVATION = 0x06
+PSBT_OUT_BIP32_DERIVATION = 0x02
+PSBT_OUT_AMOUNT = 0x03
+PSBT_OUT_SCRIPT = 0x04
+
+# A device command, written as a generator that yields the requests of the client commands, and receives the
+# responses; it returns the response of the command.
+DeviceFlow = Generator[bytes, bytes, bytes]
+
+
+class MerkleizedMap:
+    def __init__(self, size: int, keys_root: bytes, values_root: bytes):
+        self.size = size
+        self.keys_root = keys_root
+        self.values_root = values_root
+        self.keys: List[bytes] = []
+
+
+class ProtocolSimulator:
+    """Simulates the app behind the `apdu_exchange` method of `TransportClient`.
+
+    The number of commands of each type received so far is counted in `commands`, and the number of client commands of
+    each type requested so far in `client_commands`."""
+
+    def __init__(self, max_response_len: int = MAX_RESPONSE_LEN, hmac_key: bytes = b"\0" * 32):
+        self.max_response_len = max_response_len
+        self.hmac_key = hmac_key
+        self.commands: Counter = Counter()
+        self.client_commands: Counter = Counter()
+        self._flow: Optional[DeviceFlow] = None
+
+    def apdu_exchange(self, cla: int, ins: int, data: bytes = b"", p1: int = 0, p2: int = 0) -> bytes:
+        data = bytes(data)
+        if cla == BitcoinCommandBuilder.CLA_FRAMEWORK:
+            if ins == FrameworkInsType.GET_MAX_RESPONSE_LEN:
+                # no speculative responses
+                return self.max_response_len.to_bytes(2, byteorder="big") + b"\0"
+            if ins == FrameworkInsType.CONTINUE_INTERRUPTED and p1 == 0:
+                if self._flow is None:
+                    raise ApduException(SW_BAD_STATE, b"")
+                return self._run(lambda flow: flow.send(data))
+            raise ApduException(SW_INS_NOT_SUPPORTED, b"")
+
+        if cla != BitcoinCommandBuilder.CLA_BITCOIN:
+            raise ApduException(SW_CLA_NOT_SUPPORTED, b"")
+
+        handlers = {
+            BitcoinInsType.GET_EXTENDED_PUBKEY: self._get_extended_pubkey,
+            BitcoinInsType.GET_MASTER_FINGERPRINT: self._get_master_fingerprint,
+            BitcoinInsType.REGISTER_WALLET: self._register_wallet,
+            BitcoinInsType.GET_WALLET_ADDRESS: self._get_wallet_address,
+            BitcoinInsType.SIGN_PSBT: self._sign_psbt,
+        }
+        if ins not in handlers:
+            raise ApduException(SW_INS_NOT_SUPPORTED, b"")
+
+        self.commands[BitcoinInsType(ins).name] += 1
+        # the P1 extends the client capabilities of the P2
+        self._flow = handlers[ins](ByteStreamParser(data), p2 | (p1 << 8))
+        return self._run(next)
+
+    def stop(self) -> None:
+        pass
+
+    def _run(self, advance) -> bytes:
+        try:
+            request = advance(self._flow)
+        except StopIteration as e:
+            self._flow = None
+            return e.value
+        except ValueError:
+            self._flow = None
+            raise ApduException(SW_INCORRECT_DATA, b"")
+
+        self.client_commands[ClientCommandCode(request[0]).name] += 1
+        raise ApduException(SW_INTERRUPTED_EXECUTION, request)
+
+    # Client commands, as the helpers in src/handler/lib
+
+    def _read_elements(self, req: ByteStreamParser, n_total: int) -> Generator[bytes, bytes, List[bytes]]:
+        """Reads the `n_total` elements of a response whose first part is already in `req`, followed by the number
+        of the elements in it; the others are requested with GET_MORE_ELEMENTS."""
+        elements: List[bytes] = []
+        n_response = req.read_uint(1)
+        elements += [req.read_bytes(32) for _ in range(n_response)]
+        req.assert_empty()
+        while len(elements) < n_total:
+            req = ByteStreamParser((yield bytes([ClientCommandCode.GET_MORE_ELEMENTS])))
+            n_response = req.read_uint(1)
+            if req.read_uint(1) != 32 or n_response == 0:
+                raise ValueError("Unexpected response to GET_MORE_ELEMENTS")
+            elements += [req.read_bytes(32) for _ in range(n_response)]
+            req.assert_empty()
+        if len(elements) != n_total:
+            raise ValueError("Too many elements")
+        return elements
+
+    def get_preimage(self, h: bytes) -> Generator[bytes, bytes, bytes]:
+        res = ByteStreamParser((yield bytes([ClientCommandCode.GET_PREIMAGE, 0]) + h))
+        preimage_len = res.read_varint()
+        preimage = res.read_bytes(res.read_uint(1))
+        res.assert_empty()
+        while len(preimage) < preimage_len:
+            res = ByteStreamParser((yield bytes([ClientCommandCode.GET_MORE_ELEMENTS])))
+            n_elements = res.read_uint(1)
+            element_len = res.read_uint(1)
+            preimage += res.read_bytes(n_elements * element_len)
+            res.assert_empty()
+        if len(preimage) != preimage_len or sha256(preimage) != h:
+            raise ValueError("Wrong preimage")
+        return preimage
+
+    def get_merkle_leaf_hash(self, root: bytes, size: int, index: int) -> Generator[bytes, bytes, bytes]:
+        res = ByteStreamParser((yield b"".join([
+            bytes([ClientCommandCode.GET_MERKLE_LEAF_PROOF]), root, write_varint(size), write_varint(index)
+        ])))
+        leaf_hash = res.read_bytes(32)
+        proof = yield from self._read_elements(res, res.read_uint(1))
+
+        # the proof goes from the leaf to the root; the last node of a level without sibling is moved up unchanged
+        cur, level_size = leaf_hash, size
+        for sibling_index in (index >> h ^ 1 for h in range(64)):
+            if level_size <= 1:
+                break
+            if sibling_index < level_size:
+                if len(proof) == 0:
+                    raise ValueError("Proof too short")
+                sibling = proof.pop(0)
+                cur = combine_hashes(cur, sibling) if sibling_index & 1 else combine_hashes(sibling, cur)
+            level_size = (level_size + 1) // 2
+        if len(proof) != 0 or cur != root:
+            raise ValueError("Invalid Merkle proof")
+        return leaf_hash
+
+    def get_merkle_leaf_element(self, root: bytes, size: int, index: int) -> Generator[bytes, bytes, bytes]:
+        leaf_hash = yield from self.get_merkle_leaf_hash(root, size, index)
+        preimage = yield from self.get_preimage(leaf_hash)
+        if preimage[0] != 0:
+            raise ValueError("Invalid leaf preimage")
+        return preimage[1:]
+
+    def get_merkle_leaf_index(self, root: bytes, size: int, leaf_hash: bytes) -> Generator[bytes, bytes, Optional[int]]:
+        res = ByteStreamParser((yield bytes([ClientCommandCode.GET_MERKLE_LEAF_INDEX]) + root + leaf_hash))
+        found = res.read_uint(1)
+        index = res.read_varint()
+        res.assert_empty()
+        if found == 0:
+            return None
+        # the index is not trusted: it is verified with the proof of the leaf
+        if index >= size or (yield from self.get_merkle_leaf_hash(root, size, index)) != leaf_hash:
+            raise ValueError("Wrong leaf index")
+        return index
+
+    def get_merkleized_map(self, commitment: bytes) -> Generator[bytes, bytes, MerkleizedMap]:
+        """Parses a map commitment, and reads all the keys of the map, checking that they are sorted."""
+        req = ByteStreamParser(commitment)
+        map = MerkleizedMap(req.read_varint(), req.read_bytes(32), req.read_bytes(32))
+        req.assert_empty()
+        for i in range(map.size):
+            key = yield from self.get_merkle_leaf_element(map.keys_root, map.size, i)
+            if len(map.keys) > 0 and map.keys[-1] >= key:
+                raise ValueError("The keys of the map are not sorted")
+            map.keys.append(key)
+        return map
+
+    def get_merkleized_map_at(self, root: bytes, size: int, index: int) -> Generator[bytes, bytes, MerkleizedMap]:
+        commitment = yield from self.get_merkle_leaf_element(root, size, index)
+        return (yield from self.get_merkleized_map(commitment))
+
+    def get_merkleized_map_value(self, map: MerkleizedMap, key: bytes) -> Generator[bytes, bytes, Optional[bytes]]:
+        # the keys were all read with the map; only the index of the present ones is asked to the client
+        if key not in map.keys:
+            return None
+        index = yield from self.get_merkle_leaf_index(map.keys_root, map.size, element_hash(key))
+        if index is None:
+            return None
+        return (yield from self.get_merkle_leaf_element(map.values_root, map.size, index))
+
+    def _yield_results(self, results: List[bytes], client_capabilities: int) -> Generator[bytes, bytes, None]:
+        if client_capabilities & ClientCapability.BATCHED_YIELD:
+            request = bytes([ClientCommandCode.YIELD, len(results)])
+            request += b"".join(bytes([len(r)]) + r for r in results)
+            yield request
+        else:
+            for r in results:
+                yield bytes([ClientCommandCode.YIELD]) + r
+
+    # Wallet policies
+
+    def _load_wallet(self, serialized_wallet: bytes) -> Generator[bytes, bytes, List[bytes]]:
+        """Parses the wallet policy and returns its keys information."""
+        wallet = ByteStreamParser(serialized_wallet)
+        wallet.read_uint(1)  # type
+        wallet.read_bytes(wallet.read_uint(1))  # name
+        wallet.read_bytes(wallet.read_varint())  # policy map
+        n_keys = wallet.read_varint()
+        keys_root = wallet.read_bytes(32)
+        wallet.assert_empty()
+
+        keys_info = []
+        for i in range(n_keys):
+            keys_info.append((yield from self.get_merkle_leaf_element(keys_root, n_keys, i)))
+        return keys_info
+
+    def _get_extended_pubkey(self, req: ByteStreamParser, client_capabilities: int) -> DeviceFlow:
+        req.read_uint(1)  # display
+        path = req.read_bytes(4 * req.read_uint(1))
+        req.assert_empty()
+
+        yield from ()  # no client commands
+        # a placeholder for the xpub
+        return sha256(b"xpub" + path).hex().encode()
+
+    def _get_master_fingerprint(self, req: ByteStreamParser, client_capabilities: int) -> DeviceFlow:
+        req.assert_empty()
+
+        yield from ()  # no client commands
+        return self.hmac_key[:4]
+
+    def _wallet_hmac(self, wallet_id: bytes) -> bytes:
+        return hmac.new(self.hmac_key, wallet_id, hashlib.sha256).digest()
+
+    def _register_wallet(self, req: ByteStreamParser, client_capabilities: int) -> DeviceFlow:
+        serialized_wallet = req.read_bytes(req.read_varint())
+        req.assert_empty()
+
+        yield from self._load_wallet(serialized_wallet)
+
+        wallet_id = sha256(serialized_wallet)
+        return wallet_id + self._wallet_hmac(wallet_id)
+
+    def _get_wallet_address(self, req: ByteStreamParser, client_capabilities: int) -> DeviceFlow:
+        req.read_uint(1)  # display
+        wallet_id = req.read_bytes(32)
+        req.read_bytes(32)  # wallet hmac
+        change = req.read_uint(1)
+        address_index = req.read_uint(4)
+        req.assert_empty()
+
+        serialized_wallet = yield from self.get_preimage(wallet_id)
+        yield from self._load_wallet(serialized_wallet)
+
+        # a placeholder for the address
+        return sha256(wallet_id + bytes([change]) + address_index.to_bytes(4, byteorder="big")).hex().encode()
+
+    # SIGN_PSBT
+
+    def _sign_psbt(self, req: ByteStreamParser, client_capabilities: int) -> DeviceFlow:
+        global_commitment = b"".join([write_varint(req.read_varint()), req.read_bytes(64)])
+        n_inputs = req.read_varint()
+        inputs_root = req.read_bytes(32)
+        n_outputs = req.read_varint()
+        outputs_root = req.read_bytes(32)
+        wallet_id = req.read_bytes(32)
+        req.read_bytes(32)  # wallet hmac
+        # the selected inputs and the checkpoint, if any, are ignored: all the inputs are signed
+
+        serialized_wallet = yield from self.get_preimage(wallet_id)
+        yield from self._load_wallet(serialized_wallet)
+
+        global_map = yield from self.get_merkleized_map(global_commitment)
+        is_psbt_v0 = (yield from self.get_merkleized_map_value(global_map, bytes([PSBT_GLOBAL_UNSIGNED_TX]))) is not None
+        if not is_psbt_v0:
+            yield from self.get_merkleized_map_value(global_map, bytes([PSBT_GLOBAL_TX_VERSION]))
+            yield from self.get_merkleized_map_value(global_map, bytes([PSBT_GLOBAL_FALLBACK_LOCKTIME]))
+
+        # first pass: the inputs and the outputs are validated
+        for i in range(n_inputs):
+            input_map = yield from self.get_merkleized_map_at(inputs_root, n_inputs, i)
+            yield from self._get_input_utxo(input_map)
+            for key in (bytes([PSBT_IN_SIGHASH_TYPE]), self._first_key(input_map, PSBT_IN_BIP32_DERIVATION)):
+                yield from self.get_merkleized_map_value(input_map, key)
+
+        for i in range(n_outputs):
+            output_map = yield from self.get_merkleized_map_at(outputs_root, n_outputs, i)
+            keys = [self._first_key(output_map, PSBT_OUT_BIP32_DERIVATION)]
+            if not is_psbt_v0:
+                keys += [bytes([PSBT_OUT_AMOUNT]), bytes([PSBT_OUT_SCRIPT])]
+            for key in keys:
+                yield from self.get_merkleized_map_value(output_map, key)
+
+        # second pass: each input is signed
+        for i in range(n_inputs):
+            input_map = yield from self.get_merkleized_map_at(inputs_root, n_inputs, i)
+            yield from self._get_input_utxo(input_map)
+
+            # a placeholder for the signature, with the length of a DER-encoded ECDSA signature and its sighash byte,
+            # or of a compact one (with the default sighash)
+            signature = (sha256(input_map.keys_root + input_map.values_root) * 3)[:71] + b"\x01"
+            if client_capabilities & ClientCapability.COMPACT_SIGNATURES:
+                signature = signature[:64]
+            yield from self._yield_results([write_varint(i) + signature], client_capabilities)
+
+        return b""
+
+    def _get_input_utxo(self, input_map: MerkleizedMap) -> Generator[bytes, bytes, None]:
+        yield from self.get_merkleized_map_value(input_map, bytes([PSBT_IN_WITNESS_UTXO]))
+        yield from self.get_merkleized_map_value(input_map, bytes([PSBT_IN_NON_WITNESS_UTXO]))
+
+    @staticmethod
+    def _first_key(map: MerkleizedMap, key_type: int) -> bytes:
+        """Returns the first key of `map` with type `key_type`, or an empty bytes string if none."""
+        return next((k for k in map.keys if k[0] == key_type), b"")
@@ -0,0 +1,127 @@
+import json
+
+from dataclasses import dataclass, field
+from pathlib import Path
+from typing import Dict, List, Optional, Tuple, Union
+
+from bitcoin_client.ledger_bitcoin.client_base import ApduException, TransportClient
+
+from speculos.client import SpeculosClient
+
+"""
+Utilities to read the stack usage measured by the builds compiled with STACK_PROFILE=1, with the
+GET_STACK_PROFILE framework command, and to write it as a report.
+"""
+
+CLA_FRAMEWORK = 0xF8
+INS_GET_STACK_PROFILE = 0x05
+P2_GET_STACK_PROFILE_CLEAR = 0x01
+
+SW_INS_NOT_SUPPORTED = 0x6D00
+
+STACK_PROFILE_PROCESSOR = 1
+STACK_PROFILE_FUNCTION = 2
+
+
+@dataclass
+class StackProfile:
+    stack_size: int
+    max_depth: int
+    n_dropped: int
+    processors: Dict[int, int] = field(default_factory=dict)  # address -> high-water mark
+    functions: Dict[str, int] = field(default_factory=dict)   # name -> depth
+
+    def to_dict(self, symbols: Dict[int, str]) -> dict:
+        return {
+            "stack_size": self.stack_size,
+            "max_depth": self.max_depth,
+            "headroom": self.stack_size - self.max_depth,
+            "n_dropped": self.n_dropped,
+            "processors": {
+                symbols.get(address, f"0x{address:08x}"): depth
+                for address, depth in sorted(self.processors.items(), key=lambda x: -x[1])
+            },
+            "functions": dict(sorted(self.functions.items(), key=lambda x: -x[1])),
+        }
+
+
+def get_stack_profile(comm: Union[TransportClient, SpeculosClient], clear: bool = False) -> Optional[StackProfile]:
+    """Reads all the entries of the stack profile, and clears it if `clear` is True.
+    Returns None if the app was not compiled with STACK_PROFILE=1."""
+
+    profile: Optional[StackProfile] = None
+    n_entries = 0
+    index = 0
+    while profile is None or index < n_entries:
+        try:
+            res = comm.apdu_exchange(CLA_FRAMEWORK, INS_GET_STACK_PROFILE, b"", index, 0)
+        except ApduException as e:
+            if e.sw == SW_INS_NOT_SUPPORTED:
+                return None
+            raise
+
+        if profile is None:
+            profile = StackProfile(int.from_bytes(res[0:2], "big"), int.from_bytes(res[2:4], "big"), res[5])
+            n_entries = res[4]
+
+        pos = 6
+        while pos < len(res):
+            kind, depth = res[pos], int.from_bytes(res[pos + 1:pos + 3], "big")
+            if kind == STACK_PROFILE_PROCESSOR:
+                profile.processors[int.from_bytes(res[pos + 3:pos + 7], "big")] = depth
+                pos += 7
+            elif kind == STACK_PROFILE_FUNCTION:
+                name_len = res[pos + 3]
+                profile.functions[res[pos + 4:pos + 4 + name_len].decode()] = depth
+                pos += 4 + name_len
+            else:
+                raise ValueError(f"Unknown kind of stack profile entry: {kind}")
+            index += 1
+
+    if clear:
+        comm.apdu_exchange(CLA_FRAMEWORK, INS_GET_STACK_PROFILE, b"", n_entries, P2_GET_STACK_PROFILE_CLEAR)
+
+    return profile
+
+
+def get_function_symbols(elf_path: Path) -> Dict[int, str]:
+    """Returns the names of the functions in the symbol table of the app's binary, by address; the
+    processors of the stack profile are identified by their address."""
+    from elftools.elf.elffile import ELFFile
+
+    symbols: Dict[int, str] = {}
+    with open(elf_path, "rb") as f:
+        symtab = ELFFile(f).get_section_by_name(".symtab")
+        if symtab is None:
+            return symbols
+        for symbol in symtab.iter_symbols():
+            if symbol["st_info"]["type"] == "STT_FUNC":
+                # the lowest bit of the address of Thumb functions is set
+                symbols[symbol["st_value"] & ~1] = symbol.name
+                symbols[symbol["st_value"] | 1] = symbol.name
+    return symbols
+
+
+class StackProfileReport:
+    """Collects the stack profiles of the commands, and writes them as a JSON file."""
+
+    def __init__(self, path: Optional[Path], app_version: str, elf_path: Optional[Path]) -> None:
+        self.path = path
+        self.app_version = app_version
+        self.elf_path = elf_path
+        self.profiles: List[Tuple[str, StackProfile]] = []
+
+    def add(self, name: str, profile: StackProfile) -> None:
+        self.profiles.append((name, profile))
+
+    def write(self) -> None:
+        if self.path is None or len(self.profiles) == 0:
+            return
+
+        symbols = {}
+        if self.elf_path is not None and self.elf_path.is_file():
+            symbols = get_function_symbols(self.elf_path)
+
+        results = [{"name": name, **profile.to_dict(symbols)} for name, profile in self.profiles]
+        with open(self.path, "w") as f:
+            json.dump({"app_version": self.app_version, "results": results}, f, indent=2)
@@ -1,6 +1,7 @@
+import re
 from random import randint
 
-from typing import List, Tuple, Optional
+from typing import Dict, List, Tuple, Optional
 from bitcoin_client.ledger_bitcoin import PolicyMapWallet
 from bitcoin_client.ledger_bitcoin.key import KeyOriginInfo, parse_path, get_taproot_output_key
 from bitcoin_client.ledger_bitcoin.psbt import PSBT, PartiallySignedInput, PartiallySignedOutput
@@ -40,7 +41,7 @@ def random_txid() -> bytes:
     return random_bytes(32)
 
 
-def getScriptPubkeyFromWallet(wallet: PolicyMapWallet, change: bool, address_index: int) -> Script:
+def getDescriptorFromWallet(wallet: PolicyMapWallet, change: bool, address_index: int) -> Descriptor:
     descriptor_str = wallet.policy_map
 
     # Iterate in reverse order, as strings identifying a small-index key (like @1) can be a
@@ -57,7 +58,26 @@ def getScriptPubkeyFromWallet(wallet: PolicyMapWallet, change: bool, address_ind
 
         descriptor_str = descriptor_str.replace(f"@{i}", key_info_str)
 
-    return Descriptor.from_string(descriptor_str).derive(address_index).script_pubkey()
+    return Descriptor.from_string(descriptor_str).derive(address_index)
+
+
+def getScriptPubkeyFromWallet(wallet: PolicyMapWallet, change: bool, address_index: int) -> Script:
+    return getDescriptorFromWallet(wallet, change, address_index).script_pubkey()
+
+
+def getKeyOriginsFromWallet(wallet: PolicyMapWallet, change: bool, address_index: int) -> Dict[bytes, KeyOriginInfo]:
+    """Returns the derived public keys of all the keys of the wallet, with their key origin information."""
+    result: Dict[bytes, KeyOriginInfo] = {}
+    for key_info_str in wallet.keys_info:
+        origin_end = key_info_str.index("]")
+        fpr = bytes.fromhex(key_info_str[1:9])
+        origin_path = key_info_str[9:origin_end]
+        xpub = HDKey.from_string(key_info_str[origin_end + 1:-3])
+
+        pubkey: bytes = xpub.derive([int(change), address_index]).key.sec()
+        path = parse_path(f"m{origin_path}/{int(change)}/{address_index}")
+        result[pubkey] = KeyOriginInfo(fpr, path)
+    return result
 
 
 def createFakeWalletTransaction(n_inputs: int, n_outputs: int, output_amount: int, wallet: PolicyMapWallet) -> Tuple[CTransaction, int, int, int]:
@@ -125,9 +145,11 @@ def createPsbt(wallet: PolicyMapWallet, input_amounts: List[int], output_amounts
 
     # TODO: add support for wrapped segwit wallets
 
-    if wallet.n_keys != 1:
-        raise NotImplementedError("Only 1-key wallets supported")
-    if wallet.policy_map not in ["pkh(@0)", "wpkh(@0)", "tr(@0)"]:
+    is_multisig = re.fullmatch(r"wsh\(sortedmulti\(\d+(,@\d+)+\)\)", wallet.policy_map) is not None
+
+    if wallet.n_keys != 1 and not is_multisig:
+        raise NotImplementedError("Only 1-key wallets or wsh(sortedmulti(...)) wallets supported")
+    if wallet.policy_map not in ["pkh(@0)", "wpkh(@0)", "tr(@0)"] and not is_multisig:
         raise NotImplementedError("Unsupported policy type")
 
     vin: List[CTxIn] = [CTxIn() for _ in input_amounts]
@@ -166,7 +188,7 @@ def createPsbt(wallet: PolicyMapWallet, input_amounts: List[int], output_amounts
     # simplification; good enough for the scripts we support now, but will need more work
     is_legacy = wallet.policy_map.startswith("pkh(")
     is_segwitv0 = wallet.policy_map.startswith(
-        "wpkh(") or wallet.policy_map.startswith("sh(wpkh(")
+        "wpkh(") or wallet.policy_map.startswith("sh(wpkh(") or is_multisig
     is_taproot = wallet.policy_map.startswith("tr(")
 
     key_origin = wallet.keys_info[0][1:wallet.keys_info[0].index("]")]
@@ -179,6 +201,13 @@ def createPsbt(wallet: PolicyMapWallet, input_amounts: List[int], output_amounts
             # add witness UTXO
             psbt.inputs[i].witness_utxo = prevouts[i].vout[prevout_ns[i]]
 
+        if is_multisig:
+            psbt.inputs[i].witness_script = getDescriptorFromWallet(
+                wallet, prevout_path_change[i], prevout_path_addr_idx[i]).witness_script().data
+            psbt.inputs[i].hd_keypaths = getKeyOriginsFromWallet(
+                wallet, prevout_path_change[i], prevout_path_addr_idx[i])
+            continue
+
         path_str = f"m{key_origin[8:]}/{prevout_path_change[i]}/{prevout_path_addr_idx[i]}"
         path = parse_path(path_str)
         input_key: bytes = master_key.derive(path_str).key.sec()
@@ -206,7 +235,10 @@ def createPsbt(wallet: PolicyMapWallet, input_amounts: List[int], output_amounts
         tx.vout[i].scriptPubKey = script.data
         tx.vout[i].nValue = output_amount
 
-        if output_is_change[i]:
+        if output_is_change[i] and is_multisig:
+            psbt.outputs[i].witness_script = getDescriptorFromWallet(wallet, 1, i).witness_script().data
+            psbt.outputs[i].hd_keypaths = getKeyOriginsFromWallet(wallet, 1, i)
+        elif output_is_change[i]:
             path_str = f"m{key_origin[8:]}/1/{i}"
             path = parse_path(path_str)
             output_key: bytes = master_key.derive(path_str).key.sec()
@@ -0,0 +1,68 @@
+import pytest
+
+from bitcoin_client.ledger_bitcoin import Client, PolicyMapWallet
+from speculos.client import SpeculosClient
+
+from test_utils import has_automation, txmaker
+from test_utils.apdu_trace import ChromeTraceReport, TimelineRecorder, calibrate_transport
+
+# Splits the time of SIGN_PSBT between the device, the host and the transport; only executed if the --apdutrace
+# option is used, and the timelines are written as a Chrome trace in the file given by the option. With an app
+# compiled with DISPATCHER_TRACE=1, the events of the dispatcher are attributed to each APDU.
+
+wallet_wit = PolicyMapWallet(
+    name="",
+    policy_map="wpkh(@0)",
+    keys_info=[
+        f"[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**",
+    ],
+)
+
+wallet_tr = PolicyMapWallet(
+    name="",
+    policy_map="tr(@0)",
+    keys_info=[
+        f"[f5acc2fd/86'/1'/0']tpubDDKYE6BREvDsSWMazgHoyQWiJwYaDDYPbCFjYxN3HFXJP5fokeiK4hwK5tTLBNEDBwrDXn8cQ4v9b2xdW62Xr5yxoQdMu1v6c7UDXYVH27U/**",
+    ],
+)
+
+CASES = {
+    "sign_psbt_wit_3": (wallet_wit, 3),
+    "sign_psbt_wit_10": (wallet_wit, 10),
+    "sign_psbt_tr_3": (wallet_tr, 3),
+    "sign_psbt_tr_10": (wallet_tr, 10),
+}
+
+
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_apdu_trace_sign_psbt(client: Client, comm: SpeculosClient, apdu_trace_report: ChromeTraceReport):
+    if apdu_trace_report.path is None:
+        pytest.skip("Only executed with the --apdutrace option")
+
+    recorder = TimelineRecorder(comm, calibrate_transport(comm))
+
+    # printing the APDUs would be accounted as time spent on the device
+    debug = client.debug
+    client.debug = False
+    client.instrumentation = recorder
+    try:
+        for name, (wallet, n_inputs) in CASES.items():
+            psbt = txmaker.createPsbt(wallet, [10000 + 10000 * i for i in range(n_inputs)], [999, 29000],
+                                      [False, True])
+
+            recorder.begin(name)
+            result = client.sign_psbt(psbt, wallet, None)
+            timeline = recorder.end()
+
+            assert len(result) == n_inputs
+
+            summary = timeline.summary()
+            assert summary["apdus"] > 0
+            assert min(summary["device_time"], summary["transport_time"], summary["host_time"]) >= 0
+            assert summary["device_time"] + summary["transport_time"] + summary["host_time"] + \
+                summary["trace_readout_time"] == pytest.approx(summary["wall_time"])
+
+            apdu_trace_report.add(timeline)
+    finally:
+        client.instrumentation = None
+        client.debug = debug
@@ -0,0 +1,141 @@
+import pytest
+
+import hmac
+from hashlib import sha256
+from pathlib import Path
+from typing import List, Optional
+
+from bitcoin_client.ledger_bitcoin import Client, PolicyMapWallet, MultisigWallet, AddressType
+from speculos.client import SpeculosClient
+
+from test_utils import has_automation, txmaker, SpeculosGlobals
+from test_utils.benchmark import BenchmarkReport, measure
+from test_utils.psbt_generator import load_fixture
+
+from embit.bip32 import HDKey
+from embit.networks import NETWORKS
+
+# Benchmarks of the interactive protocol of SIGN_PSBT; they are only executed if the --enablebenchmarks option
+# is used, and the results are written in the file given by the --benchmarkreport option.
+# These are not regression tests: they always pass, as long as the transaction is signed.
+
+N_INPUTS = [1, 10, 100, 500]
+N_OUTPUTS = 2  # one of them is a change output
+
+SINGLESIG_KEYS = {
+    "wpkh(@0)": "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**",
+    "tr(@0)": "[f5acc2fd/86'/1'/0']tpubDDKYE6BREvDsSWMazgHoyQWiJwYaDDYPbCFjYxN3HFXJP5fokeiK4hwK5tTLBNEDBwrDXn8cQ4v9b2xdW62Xr5yxoQdMu1v6c7UDXYVH27U/**",
+}
+
+# fixtures written by test_utils.psbt_generator; they are not committed, as they can be large
+FIXTURES_DIR = Path(__file__).parent / "psbt" / "benchmark"
+
+# key of the speculos seed at m/48'/1'/0'/2'
+MULTISIG_INTERNAL_KEY = "[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK/**"
+
+
+def cosigner_key_info(i: int) -> str:
+    """Returns the key information of a (deterministic) external cosigner."""
+    root = HDKey.from_seed(bytes([i]) * 32, version=NETWORKS["test"]["xprv"])
+    xpub = root.derive("m/48'/1'/0'/2'").to_public()
+    return f"[{root.my_fingerprint.hex()}/48'/1'/0'/2']{xpub.to_base58(version=NETWORKS['test']['xpub'])}/**"
+
+
+def run_sign_psbt_benchmark(client: Client, comm: SpeculosClient, benchmark_report: BenchmarkReport, name: str,
+                            wallet: PolicyMapWallet, wallet_hmac: Optional[bytes], n_inputs: int):
+    psbt = txmaker.createPsbt(
+        wallet,
+        [10000 + 10000 * i for i in range(n_inputs)],
+        [999 + 99 * i for i in range(N_OUTPUTS)],
+        [i == 1 for i in range(N_OUTPUTS)]
+    )
+
+    with measure(comm) as stats:
+        result = client.sign_psbt(psbt, wallet, wallet_hmac)
+
+    assert len(result) == n_inputs
+
+    benchmark_report.add(name, {
+        "policy": wallet.policy_map,
+        "n_inputs": n_inputs,
+        "n_outputs": N_OUTPUTS,
+    }, stats)
+
+
+@has_automation("automations/sign_with_default_wallet_accept.json")
+@pytest.mark.parametrize("n_inputs", N_INPUTS)
+@pytest.mark.parametrize("policy_map", SINGLESIG_KEYS.keys())
+def test_benchmark_sign_psbt_singlesig(client: Client, comm: SpeculosClient, enable_benchmarks: bool,
+                                       benchmark_report: BenchmarkReport, policy_map: str, n_inputs: int):
+    if not enable_benchmarks:
+        pytest.skip()
+
+    wallet = PolicyMapWallet("", policy_map, [SINGLESIG_KEYS[policy_map]])
+
+    run_sign_psbt_benchmark(client, comm, benchmark_report,
+                            "sign_psbt_singlesig", wallet, None, n_inputs)
+
+
+@has_automation("automations/sign_with_wallet_accept.json")
+@pytest.mark.parametrize("n_inputs", N_INPUTS)
+@pytest.mark.parametrize("threshold,n_keys", [(2, 3), (3, 5)])
+def test_benchmark_sign_psbt_multisig(client: Client, comm: SpeculosClient, enable_benchmarks: bool,
+                                      benchmark_report: BenchmarkReport, speculos_globals: SpeculosGlobals,
+                                      threshold: int, n_keys: int, n_inputs: int):
+    if not enable_benchmarks:
+        pytest.skip()
+
+    wallet = MultisigWallet(
+        name="Cold storage",
+        address_type=AddressType.WIT,
+        threshold=threshold,
+        keys_info=[MULTISIG_INTERNAL_KEY] + [cosigner_key_info(i) for i in range(1, n_keys)],
+    )
+
+    # the registration hmac is computed directly, to avoid the approval of the registration on the device
+    wallet_hmac = hmac.new(speculos_globals.wallet_registration_key, wallet.id, sha256).digest()
+
+    run_sign_psbt_benchmark(client, comm, benchmark_report,
+                            "sign_psbt_multisig", wallet, wallet_hmac, n_inputs)
+
+
+def get_fixtures(registered: bool) -> List[Path]:
+    """Returns the fixtures whose wallet is a registered wallet (if registered) or a default wallet."""
+    return [path for path in sorted(FIXTURES_DIR.glob("*.json")) if (load_fixture(path)[1].name != "") == registered]
+
+
+def run_fixture_benchmark(client: Client, comm: SpeculosClient, benchmark_report: BenchmarkReport,
+                          speculos_globals: SpeculosGlobals, fixture: Path):
+    psbt, wallet, n_signed_inputs, params = load_fixture(fixture)
+    wallet_hmac = None
+    if wallet.name != "":
+        wallet_hmac = hmac.new(speculos_globals.wallet_registration_key, wallet.id, sha256).digest()
+
+    with measure(comm) as stats:
+        result = client.sign_psbt(psbt, wallet, wallet_hmac)
+
+    assert len(result) == n_signed_inputs
+
+    benchmark_report.add("sign_psbt_fixture", {"fixture": fixture.name, **params}, stats)
+
+
+@has_automation("automations/sign_with_default_wallet_accept.json")
+@pytest.mark.parametrize("fixture", get_fixtures(False), ids=lambda path: path.stem)
+def test_benchmark_sign_psbt_fixture_singlesig(client: Client, comm: SpeculosClient, enable_benchmarks: bool,
+                                               benchmark_report: BenchmarkReport, speculos_globals: SpeculosGlobals,
+                                               fixture: Path):
+    if not enable_benchmarks:
+        pytest.skip()
+
+    run_fixture_benchmark(client, comm, benchmark_report, speculos_globals, fixture)
+
+
+@has_automation("automations/sign_with_wallet_accept.json")
+@pytest.mark.parametrize("fixture", get_fixtures(True), ids=lambda path: path.stem)
+def test_benchmark_sign_psbt_fixture_multisig(client: Client, comm: SpeculosClient, enable_benchmarks: bool,
+                                              benchmark_report: BenchmarkReport, speculos_globals: SpeculosGlobals,
+                                              fixture: Path):
+    if not enable_benchmarks:
+        pytest.skip()
+
+    run_fixture_benchmark(client, comm, benchmark_report, speculos_globals, fixture)
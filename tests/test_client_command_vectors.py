@@ -0,0 +1,22 @@
+import json
+from pathlib import Path
+
+import pytest
+
+from bitcoin_client.ledger_bitcoin.client_command import ClientCommandInterpreter
+
+# the same vectors are used by the tests of the JavaScript client, so that the two clients send byte-identical
+# responses to the client commands (including all the GET_MORE_ELEMENTS needed to drain the queue)
+vectors_path = Path(__file__).parent.parent / "bitcoin_client_js" / "src" / "__tests__" / "vectors"
+vectors = json.loads((vectors_path / "client_commands.json").read_text())
+
+
+@pytest.mark.parametrize("case", vectors["cases"], ids=lambda case: f"max_response_len={case['max_response_len']}")
+def test_client_command_vectors(case):
+    interpreter = ClientCommandInterpreter(case["max_response_len"])
+    for elements in vectors["lists"]:
+        interpreter.add_known_list([bytes.fromhex(el) for el in elements])
+
+    for command in case["commands"]:
+        assert interpreter.execute(bytes.fromhex(command["request"])).hex() == command["response"]
+    assert len(interpreter.queue) == 0
@@ -13,6 +13,9 @@ def test_dashboard(comm: SpeculosClient, is_speculos: bool, app_version: str):
     comm.wait_for_text_event("Version")
     comm.wait_for_text_event(app_version)
 
+    comm.press_and_release("right")
+    comm.wait_for_text_event("Settings")
+
     comm.press_and_release("right")
     comm.wait_for_text_event("About")
 
@@ -2,7 +2,7 @@ import threading
 
 import pytest
 
-from bitcoin_client.ledger_bitcoin import Client
+from bitcoin_client.ledger_bitcoin import Client, ClientStats
 from bitcoin_client.ledger_bitcoin.exception import DenyError, NotSupportedError
 from speculos.client import SpeculosClient
 
@@ -25,6 +25,48 @@ def test_get_extended_pubkey_standard_nodisplay(client: Client):
         )
 
 
+def test_get_extended_pubkeys(client: Client):
+    testcases = {
+        "m/44'/1'/0'": "tpubDCwYjpDhUdPGP5rS3wgNg13mTrrjBuG8V9VpWbyptX6TRPbNoZVXsoVUSkCjmQ8jJycjuDKBb9eataSymXakTTaGifxR6kmVsfFehH1ZgJT",
+        "m/44'/1'/10'": "tpubDCwYjpDhUdPGp21gSpVay2QPJVh6WNySWMXPhbcu1DsxH31dF7mY18oibbu5RxCLBc1Szerjscuc3D5HyvfYqfRvc9mesewnFqGmPjney4d",
+        "m/44'/1'/2'/1/42": "tpubDGF9YgHKv6qh777rcqVhpmDrbNzgophJM9ec7nHiSfrbss7fVBXoqhmZfohmJSvhNakDHAspPHjVVNL657tLbmTXvSeGev2vj5kzjMaeupT",
+        "m/48'/1'/4'/1'/0/7": "tpubDK8WPFx4WJo1R9mEL7Wq325wBiXvkAe8ipgb9Q1QBDTDUD2YeCfutWtzY88NPokZqJyRPKHLGwTNLT7jBG59aC6VH8q47LDGQitPB6tX2d7",
+        "m/49'/1'/1'/1/3": "tpubDGnetmJDCL18TyaaoyRAYbkSE9wbHktSdTS4mfsR6inC8c2r6TjdBt3wkqEQhHYPtXpa46xpxDaCXU2PRNUGVvDzAHPG6hHRavYbwAGfnFr",
+        "m/84'/1'/2'/0/10": "tpubDG9YpSUwScWJBBSrhnAT47NcT4NZGLcY18cpkaiWHnkUCi19EtCh8Heeox268NaFF6o56nVeSXuTyK6jpzTvV1h68Kr3edA8AZp27MiLUNt",
+        "m/86'/1'/4'/1/12": "tpubDHTZ815MvTaRmo6Qg1rnU6TEU4ZkWyA56jA1UgpmMcBGomnSsyo34EZLoctzZY9MTJ6j7bhccceUeXZZLxZj5vgkVMYfcZ7DNPsyRdFpS3f",
+    }
+
+    paths = list(testcases.keys())
+    assert client.get_extended_pubkeys(paths) == list(testcases.values())
+
+    # accounts with the same parent key, and paths extending a previous parent key
+    paths = [f"m/{purpose}'/1'/{account}'" for purpose in [44, 49, 84, 86] for account in range(3)]
+    paths += ["m/84'/1'/2'/0/10", "m/84'/1'/2'/0/11", "m/84'/1'/3'"]
+    assert client.get_extended_pubkeys(paths) == [client.get_extended_pubkey(path) for path in paths]
+
+    # all the paths must be standard
+    with pytest.raises(NotSupportedError):
+        client.get_extended_pubkeys(["m/44'/1'/0'", "m/44'/1'"])
+
+
+def test_get_extended_pubkeys_instrumentation(client: Client):
+    stats = ClientStats({"model": "speculos"})
+    client.instrumentation = stats
+    try:
+        paths = [f"m/84'/1'/{account}'" for account in range(3)]
+        assert len(client.get_extended_pubkeys(paths)) == 3
+    finally:
+        client.instrumentation = None
+
+    # a single GET_EXTENDED_PUBKEYS, whose results are returned with YIELD
+    assert stats.apdus[(0xE1, 0x08)][0] == 1
+    assert stats.client_commands[0x10][0] >= 1
+    assert stats.device_seconds() > 0
+
+    exported = stats.to_prometheus()
+    assert 'ledger_bitcoin_client_commands_total{model="speculos",command="YIELD"}' in exported
+
+
 def test_get_extended_pubkey_nonstandard_nodisplay(client: Client):
     # as these paths are not standard, the app should reject immediately if display=False
     testcases = [
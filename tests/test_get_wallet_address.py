@@ -1,5 +1,9 @@
 from bitcoin_client.ledger_bitcoin import Client, AddressType, MultisigWallet, PolicyMapWallet
+from bitcoin_client.ledger_bitcoin.common import sha256
 from bitcoin_client.ledger_bitcoin.exception.errors import IncorrectDataError
+from bitcoin_client.ledger_bitcoin.merkle import MerkleTree, element_hash
+
+from test_utils import segwit_addr
 
 
 import pytest
@@ -194,3 +198,162 @@ def test_get_wallet_address_multisig_wit(client: Client):
 
     res = client.get_wallet_address(wallet, wallet_hmac, 0, 0, False)
     assert res == "tb1qmyauyzn08cduzdqweexgna2spwd0rndj55fsrkefry2cpuyt4cpsn2pg28"
+
+
+# Ranges of addresses
+
+def segwit_script(address: str) -> bytes:
+    witver, program = segwit_addr.decode("tb", address)
+    return bytes([0x50 + witver if witver > 0 else 0, len(program)]) + bytes(program)
+
+
+def test_get_wallet_addresses_singlesig_wit(client: Client):
+    wallet = PolicyMapWallet(
+        name="",
+        policy_map="wpkh(@0)",
+        keys_info=[
+            f"[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**",
+        ],
+    )
+
+    res = client.get_wallet_addresses(wallet, None, 1, 10, 30)
+    assert len(res) == 30
+    assert res[5] == "tb1qlrvzyx8jcjfj2xuy69du9trtxnsvjuped7e289"
+    for i in [0, 13, 29]:
+        assert res[i] == client.get_wallet_address(wallet, None, 1, 10 + i, False)
+
+    digest = client.get_wallet_addresses_digest(wallet, None, 1, 10, 30)
+    assert digest == sha256(b''.join(bytes([len(a)]) + a.encode() for a in res))
+
+    scripts = [segwit_script(a) for a in res]
+    root = client.get_wallet_scripts_merkle_root(wallet, None, 1, 10, 30)
+    assert root == MerkleTree(element_hash(s) for s in scripts).root
+    assert client.get_wallet_scripts_merkle_root(wallet, None, 1, 10, 1) == element_hash(scripts[0])
+    assert client.verify_wallet_scripts(wallet, None, 1, 10, 30)
+
+    tokens = client.get_wallet_ownership_tokens(wallet, None, 1, 10, 30)
+    assert len(tokens) == 30 and all(len(t) == 16 for t in tokens)
+    # the tokens do not depend on the range, and are different for each scriptPubKey
+    assert client.get_wallet_ownership_tokens(wallet, None, 1, 15, 1) == [tokens[5]]
+    assert len(set(tokens)) == 30
+
+    # the last address of the range must not be too large for a default wallet
+    with pytest.raises(IncorrectDataError):
+        client.get_wallet_addresses(wallet, None, 0, 49990, 20)
+
+
+def test_get_wallet_addresses_multisig_wit(client: Client):
+    wallet = MultisigWallet(
+        name="Cold storage",
+        address_type=AddressType.WIT,
+        threshold=2,
+        keys_info=[
+            f"[76223a6e/48'/1'/0'/2']tpubDE7NQymr4AFtewpAsWtnreyq9ghkzQBXpCZjWLFVRAvnbf7vya2eMTvT2fPapNqL8SuVvLQdbUbMfWLVDCZKnsEBqp6UK93QEzL8Ck23AwF/**",
+            f"[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK/**",
+        ],
+    )
+    wallet_hmac = bytes.fromhex(
+        "d6434852fb3caa7edbd1165084968f1691444b3cfc10cf1e431acbbc7f48451f"
+    )
+
+    res = client.get_wallet_addresses(wallet, wallet_hmac, 0, 0, 8)
+    assert res[0] == "tb1qmyauyzn08cduzdqweexgna2spwd0rndj55fsrkefry2cpuyt4cpsn2pg28"
+    assert res[7] == client.get_wallet_address(wallet, wallet_hmac, 0, 7, False)
+
+    root = client.get_wallet_scripts_merkle_root(wallet, wallet_hmac, 0, 0, 8)
+    assert root == MerkleTree(element_hash(segwit_script(a)) for a in res).root
+
+    # the same scriptPubKeys derived on the host
+    assert client.verify_wallet_scripts(wallet, wallet_hmac, 0, 0, 8)
+
+
+def test_scan_wallet_scripts(client: Client):
+    wallet = PolicyMapWallet(
+        name="",
+        policy_map="wpkh(@0)",
+        keys_info=[
+            f"[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**",
+        ],
+    )
+
+    receive = [segwit_script(a) for a in client.get_wallet_addresses(wallet, None, 0, 100, 20)]
+    change = [segwit_script(a) for a in client.get_wallet_addresses(wallet, None, 1, 100, 20)]
+
+    unrelated = [bytes([0, 20]) + bytes([i] * 20) for i in range(10)]
+    scripts = [unrelated[0], receive[3], unrelated[1], change[19], unrelated[2], receive[0]] + unrelated[3:]
+
+    res = client.scan_wallet_scripts(wallet, None, scripts, 100, 20)
+    assert res == [(1, 0, 103), (3, 1, 119), (5, 0, 100)]
+
+    # outside of the window
+    assert client.scan_wallet_scripts(wallet, None, scripts, 101, 10) == [(1, 0, 103)]
+
+    # a list too large for a single multiproof
+    res = client.scan_wallet_scripts(wallet, None, unrelated * 30 + [change[5]], 100, 20)
+    assert res == [(300, 1, 105)]
+
+    with pytest.raises(IncorrectDataError):
+        client.scan_wallet_scripts(wallet, None, scripts, 0, 129)
+
+
+def test_get_wallet_address_cached(client: Client):
+    # the addresses are cached by wallet, change and index: requesting them again, in any order,
+    # must return the same results
+    wallet = PolicyMapWallet(
+        name="",
+        policy_map="wpkh(@0)",
+        keys_info=[
+            f"[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**",
+        ],
+    )
+    wallet_tr = PolicyMapWallet(
+        name="",
+        policy_map="tr(@0)",
+        keys_info=[
+            f"[f5acc2fd/86'/1'/0']tpubDDKYE6BREvDsSWMazgHoyQWiJwYaDDYPbCFjYxN3HFXJP5fokeiK4hwK5tTLBNEDBwrDXn8cQ4v9b2xdW62Xr5yxoQdMu1v6c7UDXYVH27U/**",
+        ],
+    )
+
+    requests = [(wallet, 0, 5), (wallet, 1, 5), (wallet, 0, 6), (wallet_tr, 0, 5)]
+    expected = [client.get_wallet_addresses(w, None, change, index, 1)[0] for w, change, index in requests]
+    assert len(set(expected)) == len(requests)
+
+    for _ in range(2):
+        for (w, change, index), address in zip(requests, expected):
+            assert client.get_wallet_address(w, None, change, index, False) == address
+
+
+def test_get_wallet_address_keepalive(client: Client):
+    # while the device waits for the response to a client command, the client can send keep-alive
+    # CONTINUE commands, each answered by an interruption without data
+    wallet = PolicyMapWallet(
+        name="",
+        policy_map="wpkh(@0)",
+        keys_info=[
+            f"[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**",
+        ],
+    )
+    expected = client.get_wallet_addresses(wallet, None, 1, 9999, 1)[0]
+
+    # not accepted outside of an interruption
+    sw, _ = client._apdu_exchange(client.builder.continue_interrupted_keepalive())
+    assert sw == 0x6A86
+
+    client_intepreter = client._new_client_interpreter()
+    client_intepreter.add_known_list([k.encode() for k in wallet.keys_info])
+    client_intepreter.add_known_preimage(wallet.serialize())
+
+    sw, response = client._apdu_exchange(
+        client.builder.get_wallet_address(wallet, None, 9999, 1, False))
+    assert sw == 0xE000
+
+    for _ in range(3):
+        sw, keepalive_response = client._apdu_exchange(client.builder.continue_interrupted_keepalive())
+        assert sw == 0xE000 and keepalive_response == b""
+
+    while sw == 0xE000:
+        sw, response = client._apdu_exchange(
+            client.builder.continue_interrupted(client_intepreter.execute(response)))
+
+    assert sw == 0x9000
+    assert response.decode() == expected
@@ -0,0 +1,65 @@
+import pytest
+
+import hmac
+import json
+from hashlib import sha256
+from pathlib import Path
+from typing import List
+
+from bitcoin_client.ledger_bitcoin import Client
+from speculos.client import SpeculosClient
+
+from test_utils import has_automation, SpeculosGlobals
+from test_utils.benchmark import PerfBaseline, measure
+from test_utils.psbt_generator import PsbtParams, generate_psbt, get_wallet
+
+# Performance regression tests of the interactive protocol of SIGN_PSBT: the synthetic PSBTs of the cases of
+# perf_baseline.json are signed, and the test fails if the number of APDUs, the bytes exchanged or the number of
+# client commands of any type exceed the expected ones by more than their tolerance.
+# After a change that intentionally modifies the costs, the baseline is updated with --updateperfbaseline.
+# The PSBTs have no external inputs and no sighash types, so that they are signed with the standard automations.
+
+with open(Path(__file__).parent / "perf_baseline.json") as f:
+    CASES = json.load(f)["cases"]
+
+
+def get_cases(registered: bool) -> List[str]:
+    """Returns the cases signed by a registered wallet (if registered) or by a default wallet."""
+    return [name for name, case in CASES.items()
+            if (PsbtParams(**case["params"]).signing_script_type() == "wsh-sortedmulti") == registered]
+
+
+def run_perf_case(client: Client, comm: SpeculosClient, perf_baseline: PerfBaseline,
+                  speculos_globals: SpeculosGlobals, name: str):
+    params = PsbtParams(**CASES[name]["params"])
+    wallet = get_wallet(params.signing_script_type())
+    wallet_hmac = None
+    if wallet.name != "":
+        # the registration hmac is computed directly, to avoid the approval of the registration on the device
+        wallet_hmac = hmac.new(speculos_globals.wallet_registration_key, wallet.id, sha256).digest()
+    psbt, n_signed_inputs = generate_psbt(params)
+
+    with measure(comm) as stats:
+        result = client.sign_psbt(psbt, wallet, wallet_hmac)
+
+    assert len(result) == n_signed_inputs
+
+    regressions = perf_baseline.check(name, stats)
+    assert regressions == [], f"Performance regressions of {name}: " + ", ".join(regressions)
+
+    if not perf_baseline.update and perf_baseline.cases[name].get("expected") is None:
+        pytest.skip(f"No baseline for {name}; record it with --updateperfbaseline")
+
+
+@has_automation("automations/sign_with_default_wallet_accept.json")
+@pytest.mark.parametrize("name", get_cases(False))
+def test_perf_sign_psbt_singlesig(client: Client, comm: SpeculosClient, perf_baseline: PerfBaseline,
+                                  speculos_globals: SpeculosGlobals, name: str):
+    run_perf_case(client, comm, perf_baseline, speculos_globals, name)
+
+
+@has_automation("automations/sign_with_wallet_accept.json")
+@pytest.mark.parametrize("name", get_cases(True))
+def test_perf_sign_psbt_multisig(client: Client, comm: SpeculosClient, perf_baseline: PerfBaseline,
+                                 speculos_globals: SpeculosGlobals, name: str):
+    run_perf_case(client, comm, perf_baseline, speculos_globals, name)
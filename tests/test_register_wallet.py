@@ -1,4 +1,4 @@
-from bitcoin_client.ledger_bitcoin import Client, AddressType, MultisigWallet, PolicyMapWallet
+from bitcoin_client.ledger_bitcoin import Client, AddressType, MultisigWallet, PolicyMapWallet, WalletType
 from bitcoin_client.ledger_bitcoin.exception.errors import IncorrectDataError, NotSupportedError
 from bitcoin_client.ledger_bitcoin.exception import DenyError
 
@@ -76,6 +76,30 @@ def test_register_wallet_accept_wit(client: Client, speculos_globals):
     )
 
 
+@has_automation("automations/register_wallet_accept.json")
+def test_register_wallet_accept_binary_policy(client: Client, speculos_globals):
+    wallet = PolicyMapWallet(
+        name="Cold storage",
+        policy_map="wsh(sortedmulti(2,@0,@1))",
+        keys_info=[
+            f"[76223a6e/48'/1'/0'/2']tpubDE7NQymr4AFtewpAsWtnreyq9ghkzQBXpCZjWLFVRAvnbf7vya2eMTvT2fPapNqL8SuVvLQdbUbMfWLVDCZKnsEBqp6UK93QEzL8Ck23AwF/**",
+            f"[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK/**",
+        ],
+        wallet_type=WalletType.POLICYMAP_BINARY,
+    )
+
+    wallet_id, wallet_hmac = client.register_wallet(wallet)
+
+    # the wallet id commits to the binary encoding of the policy
+    assert wallet_id == wallet.id
+    assert wallet_id != PolicyMapWallet(wallet.name, wallet.policy_map, wallet.keys_info).id
+
+    assert hmac.compare_digest(
+        hmac.new(speculos_globals.wallet_registration_key, wallet_id, sha256).digest(),
+        wallet_hmac,
+    )
+
+
 @has_automation("automations/register_wallet_reject.json")
 def test_register_wallet_reject_header(client: Client):
     wallet = MultisigWallet(
@@ -150,3 +174,51 @@ def test_register_wallet_unsupported_policy(client: Client):
                 f"[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK/**",
             ],
         ))
+
+
+@has_automation("automations/register_wallets_accept.json")
+def test_register_wallets_accept(client: Client, speculos_globals):
+    keys_info = [
+        f"[76223a6e/48'/1'/0'/2']tpubDE7NQymr4AFtewpAsWtnreyq9ghkzQBXpCZjWLFVRAvnbf7vya2eMTvT2fPapNqL8SuVvLQdbUbMfWLVDCZKnsEBqp6UK93QEzL8Ck23AwF/**",
+        f"[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK/**",
+    ]
+    wallets = [
+        MultisigWallet(name="Cold storage", address_type=AddressType.WIT, threshold=2, keys_info=keys_info),
+        MultisigWallet(name="Cold storage 1of2", address_type=AddressType.WIT, threshold=1, keys_info=keys_info),
+        PolicyMapWallet(name="Cold storage sh", policy_map="sh(wsh(sortedmulti(2,@0,@1)))", keys_info=keys_info),
+    ]
+
+    res = client.register_wallets(wallets)
+
+    assert len(res) == len(wallets)
+    for wallet, (wallet_id, wallet_hmac) in zip(wallets, res):
+        assert wallet_id == wallet.id
+        assert hmac.compare_digest(
+            hmac.new(speculos_globals.wallet_registration_key, wallet_id, sha256).digest(),
+            wallet_hmac,
+        )
+
+
+@has_automation("automations/register_wallets_accept.json")
+def test_register_wallets_invalid(client: Client):
+    keys_info = [
+        f"[76223a6e/48'/1'/0'/2']tpubDE7NQymr4AFtewpAsWtnreyq9ghkzQBXpCZjWLFVRAvnbf7vya2eMTvT2fPapNqL8SuVvLQdbUbMfWLVDCZKnsEBqp6UK93QEzL8Ck23AwF/**",
+        f"[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK/**",
+    ]
+    wallet = MultisigWallet(name="Cold storage", address_type=AddressType.WIT, threshold=2, keys_info=keys_info)
+
+    # the keys must be the same for all the wallets
+    with pytest.raises(IncorrectDataError):
+        client.register_wallets([
+            wallet,
+            MultisigWallet(name="Reversed keys", address_type=AddressType.WIT,
+                           threshold=2, keys_info=keys_info[::-1]),
+        ])
+
+    # the names must be different
+    with pytest.raises(IncorrectDataError):
+        client.register_wallets([
+            wallet,
+            MultisigWallet(name="Cold storage", address_type=AddressType.SH_WIT,
+                           threshold=2, keys_info=keys_info),
+        ])
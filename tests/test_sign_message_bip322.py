@@ -0,0 +1,129 @@
+import base64
+
+import pytest
+
+from bitcoin_client.ledger_bitcoin import Client, AddressType, PolicyMapWallet
+from bitcoin_client.ledger_bitcoin.exception.errors import DenyError, IncorrectDataError
+
+from test_utils import has_automation, bip0340, hash160, segwit_addr
+
+from embit.ec import PublicKey, Signature
+from embit.script import Script, p2pkh
+from embit.transaction import Transaction, TransactionInput, TransactionOutput, SIGHASH
+
+
+wallet_wit = PolicyMapWallet(
+    name="",
+    policy_map="wpkh(@0)",
+    keys_info=[
+        f"[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**",
+    ],
+)
+
+wallet_tr = PolicyMapWallet(
+    name="",
+    policy_map="tr(@0)",
+    keys_info=[
+        f"[f5acc2fd/86'/1'/0']tpubDDKYE6BREvDsSWMazgHoyQWiJwYaDDYPbCFjYxN3HFXJP5fokeiK4hwK5tTLBNEDBwrDXn8cQ4v9b2xdW62Xr5yxoQdMu1v6c7UDXYVH27U/**",
+    ],
+)
+
+
+def get_to_sign(message: bytes, script_pubkey: bytes) -> Transaction:
+    # the virtual transactions of BIP-322
+    message_hash = bip0340.tagged_hash("BIP0322-signed-message", message)
+    to_spend = Transaction(
+        version=0,
+        vin=[TransactionInput(bytes(32), 0xFFFFFFFF, Script(b'\x00\x20' + message_hash), 0)],
+        vout=[TransactionOutput(0, Script(script_pubkey))],
+        locktime=0
+    )
+    return Transaction(
+        version=0,
+        vin=[TransactionInput(to_spend.txid(), 0, Script(b''), 0)],
+        vout=[TransactionOutput(0, Script(b'\x6a'))],
+        locktime=0
+    )
+
+
+def get_witness_program(address: str) -> bytes:
+    _, program = segwit_addr.decode("tb", address)
+    return bytes(program)
+
+
+def verify_wit(message: bytes, sig_b64: str, address: str):
+    witness = base64.b64decode(sig_b64)
+    assert witness[0] == 2
+    sig = witness[2:2 + witness[1]]
+    assert sig[-1] == SIGHASH.ALL
+    assert witness[2 + witness[1]] == 33
+    pubkey_bytes = witness[2 + witness[1] + 1:]
+    assert len(pubkey_bytes) == 33
+
+    program = get_witness_program(address)
+    assert hash160(pubkey_bytes) == program
+
+    pubkey = PublicKey.parse(pubkey_bytes)
+    to_sign = get_to_sign(message, b'\x00\x14' + program)
+    msg = to_sign.sighash_segwit(0, p2pkh(pubkey), 0, SIGHASH.ALL)
+    assert pubkey.verify(Signature.parse(sig[:-1]), msg)
+
+
+def verify_tr(message: bytes, sig_b64: str, address: str):
+    witness = base64.b64decode(sig_b64)
+    assert witness[0] == 1 and witness[1] == 64 and len(witness) == 66
+
+    program = get_witness_program(address)
+    to_sign = get_to_sign(message, b'\x51\x20' + program)
+    sighash = to_sign.sighash_taproot(0, [Script(b'\x51\x20' + program)], [0], SIGHASH.DEFAULT)
+    assert bip0340.schnorr_verify(sighash, program, witness[2:])
+
+
+@has_automation("automations/sign_message_bip322_accept.json")
+def test_sign_message_bip322_wit(client: Client):
+    message = b"Hello World"
+    res = client.sign_message_bip322([message], "m/84'/1'/0'/0/0", AddressType.WIT)
+
+    assert len(res) == 1
+    verify_wit(message, res[0], client.get_wallet_address(wallet_wit, None, 0, 0, False))
+
+
+@has_automation("automations/sign_message_bip322_accept.json")
+def test_sign_message_bip322_tr(client: Client):
+    message = b""
+    res = client.sign_message_bip322([message], "m/86'/1'/0'/0/0", AddressType.TAP)
+
+    assert len(res) == 1
+    verify_tr(message, res[0], client.get_wallet_address(wallet_tr, None, 0, 0, False))
+
+
+@has_automation("automations/sign_message_bip322_accept.json")
+def test_sign_message_bip322_batch(client: Client):
+    # many challenges, some longer than a single response, signed with a single approval
+    messages = [f"challenge {i}".encode() for i in range(20)] + [b"The quick brown fox" * 20]
+
+    res = client.sign_message_bip322(messages, "m/84'/1'/0'/1/3", AddressType.WIT)
+    address = client.get_wallet_address(wallet_wit, None, 1, 3, False)
+    assert len(res) == len(messages)
+    for message, sig in zip(messages, res):
+        verify_wit(message, sig, address)
+
+    res = client.sign_message_bip322(messages, "m/86'/1'/0'/0/7", AddressType.TAP)
+    address = client.get_wallet_address(wallet_tr, None, 0, 7, False)
+    assert len(res) == len(messages)
+    for message, sig in zip(messages, res):
+        verify_tr(message, sig, address)
+
+
+def test_sign_message_bip322_nonstandard_path(client: Client):
+    with pytest.raises(IncorrectDataError):
+        client.sign_message_bip322([b"Anything"], "m/86'/1'/0'/0/0", AddressType.WIT)
+
+    with pytest.raises(IncorrectDataError):
+        client.sign_message_bip322([b"Anything"], "m/44'/1'/0'/0/0", AddressType.TAP)
+
+
+@has_automation("automations/sign_message_bip322_reject.json")
+def test_sign_message_bip322_reject(client: Client):
+    with pytest.raises(DenyError):
+        client.sign_message_bip322([b"Anything"], "m/84'/1'/0'/0/0", AddressType.WIT)
@@ -8,17 +8,23 @@ from typing import List
 
 from pathlib import Path
 
-from bitcoin_client.ledger_bitcoin import Client, PolicyMapWallet, MultisigWallet, AddressType
-from bitcoin_client.ledger_bitcoin.exception.errors import IncorrectDataError, NotSupportedError
-
-from bitcoin_client.ledger_bitcoin.psbt import PSBT
+from bitcoin_client.ledger_bitcoin import (Client, PolicyMapWallet, MultisigWallet, AddressType, PreparedPsbt,
+                                           sign_psbt_on_devices)
+from bitcoin_client.ledger_bitcoin.client_base import SignPsbtCheckpoint, get_batch_review_digest
+from bitcoin_client.ledger_bitcoin.exception.errors import (IncorrectDataError, NotSupportedError,
+                                                            SignatureFailError)
+
+from bitcoin_client.ledger_bitcoin.key import KeyOriginInfo
+from bitcoin_client.ledger_bitcoin.psbt import PSBT, request_prevout_tokens, set_prevout_token
 from bitcoin_client.ledger_bitcoin.wallet import AddressType
 from speculos.client import SpeculosClient
 
-from test_utils import has_automation, bip0340, txmaker
+from test_utils import has_automation, bip0340, ecdsa_secp256k1, txmaker
 
-from embit.script import Script
+from embit.ec import PublicKey
+from embit.script import Script, p2pkh
 from embit.networks import NETWORKS
+from embit.transaction import Transaction, SIGHASH
 
 from test_utils.speculos import automation
 
@@ -51,6 +57,23 @@ def should_go_right(event: dict):
     return False
 
 
+def enable_batch_review_setting(speculos_client: SpeculosClient):
+    """Enables "Batch review" in the settings menu, starting from the main screen of the app."""
+
+    speculos_client.press_and_release("right")
+    speculos_client.wait_for_text_event("Version")
+    speculos_client.press_and_release("right")
+    speculos_client.wait_for_text_event("Settings")
+    speculos_client.press_and_release("both")
+    speculos_client.wait_for_text_event("Disabled")
+    speculos_client.press_and_release("both")
+    speculos_client.wait_for_text_event("Enabled")
+    speculos_client.press_and_release("right")
+    speculos_client.wait_for_text_event("Back")
+    speculos_client.press_and_release("both")
+    speculos_client.wait_for_text_event("is ready")
+
+
 def ux_thread_sign_psbt(speculos_client: SpeculosClient, all_events: List[dict]):
     """Completes the signing flow always going right and accepting at the appropriate time, while collecting all the events in all_events."""
 
@@ -144,6 +167,40 @@ def test_sign_psbt_singlesig_pkh_1to1(client: Client):
     }
 
 
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_sign_psbt_with_prevout_tokens(client: Client):
+    wallet = PolicyMapWallet(
+        "",
+        "pkh(@0)",
+        [
+            "[f5acc2fd/44'/1'/0']tpubDCwYjpDhUdPGP5rS3wgNg13mTrrjBuG8V9VpWbyptX6TRPbNoZVXsoVUSkCjmQ8jJycjuDKBb9eataSymXakTTaGifxR6kmVsfFehH1ZgJT/**"
+        ],
+    )
+
+    # the tokens are only returned if requested in the PSBT
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/pkh-1to1.psbt")
+    result = client.sign_psbt(psbt, wallet, None)
+    assert client.last_sign_psbt_prevout_tokens == {}
+
+    request_prevout_tokens(psbt)
+    assert client.sign_psbt(psbt, wallet, None) == result
+    tokens = client.last_sign_psbt_prevout_tokens
+    assert list(tokens.keys()) == [0] and len(tokens[0]) == 16
+
+    # the same input is signed with the token instead of the non-witness utxo
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/pkh-1to1.psbt")
+    psbt_in = psbt.inputs[0]
+    prevout = psbt_in.non_witness_utxo.vout[psbt.tx.vin[0].prevout.n]
+    set_prevout_token(psbt_in, prevout.nValue, prevout.scriptPubKey, tokens[0])
+    assert client.sign_psbt(psbt, wallet, None) == result
+    assert client.last_sign_psbt_prevout_tokens == {}
+
+    # the token does not authenticate a different amount, and there is no non-witness utxo to fall back to
+    set_prevout_token(psbt_in, prevout.nValue + 1, prevout.scriptPubKey, tokens[0])
+    with pytest.raises(IncorrectDataError):
+        client.sign_psbt(psbt, wallet, None)
+
+
 @has_automation("automations/sign_with_default_wallet_accept.json")
 def test_sign_psbt_singlesig_sh_wpkh_1to2(client: Client):
 
@@ -233,6 +290,53 @@ def test_sign_psbt_singlesig_wpkh_2to2(client: Client):
     }
 
 
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_sign_psbt_with_unread_fields(client: Client):
+    # the same PSBT as test_sign_psbt_singlesig_wpkh_2to2, with fields that the device does not read; they are pruned
+    # by the client, therefore the signatures are the same
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt")
+
+    wallet = PolicyMapWallet(
+        "",
+        "wpkh(@0)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**"
+        ],
+    )
+
+    expected = client.sign_psbt(psbt, wallet, None)
+
+    foreign_pubkey = bytes.fromhex("02" + "11" * 32)
+    for psbt_in in psbt.inputs:
+        psbt_in.partial_sigs[foreign_pubkey] = bytes(71)
+        # sorted before the derivation of the key of the wallet, which is then the first one left
+        psbt_in.hd_keypaths[foreign_pubkey] = KeyOriginInfo(bytes.fromhex("deadbeef"), [0, 0])
+        psbt_in.unknown[b"\xfc\x05OTHER\x00"] = bytes(100)
+    psbt.outputs[0].unknown[b"\xfc\x05OTHER\x00"] = bytes(100)
+
+    assert client.sign_psbt(psbt, wallet, None) == expected
+
+
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_sign_psbt_streamed(client: Client):
+    # the same PSBT as test_sign_psbt_singlesig_wpkh_2to2; the signatures are received as the device produces them
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt")
+
+    wallet = PolicyMapWallet(
+        "",
+        "wpkh(@0)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**"
+        ],
+    )
+
+    streamed = []
+    result = client.sign_psbt(psbt, wallet, None, on_signature=lambda i, sig: streamed.append((i, sig)))
+    assert streamed == sorted(result.items())
+
+    assert list(client.sign_psbt_iter(psbt, wallet, None)) == streamed
+
+
 @has_automation("automations/sign_with_default_wallet_missing_nonwitnessutxo_accept.json")
 def test_sign_psbt_singlesig_wpkh_2to2_missing_nonwitnessutxo(client: Client):
     # Same as the previous test, but the non-witness-utxo is missing.
@@ -329,6 +433,61 @@ def test_sign_psbt_multisig_wsh(client: Client):
     }
 
 
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_sign_psbt_prepared(client: Client, tmp_path: Path):
+    # the same PSBT is signed from a PreparedPsbt, again after a serialization round trip, from a file, and prepared
+    # in a thread pool
+    wallet = PolicyMapWallet(
+        "",
+        "wpkh(@0)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**"
+        ],
+    )
+
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/wpkh-1to2.psbt")
+    prepared = PreparedPsbt(psbt, wallet)
+
+    result = client.sign_psbt(prepared, wallet, None)
+    assert result == client.sign_psbt(PreparedPsbt.deserialize(prepared.serialize()), wallet, None)
+    assert result == client.sign_psbt(psbt, wallet, None)
+
+    psbt_path = tmp_path / "wpkh-1to2.psbt"
+    psbt_path.write_bytes(psbt.serialize_bytes())
+    assert result == client.sign_psbt(PreparedPsbt.from_file(str(psbt_path), wallet), wallet, None)
+    assert result == client.sign_psbt(PreparedPsbt(psbt, wallet, max_workers=4), wallet, None)
+
+
+@has_automation("automations/sign_with_wallet_accept.json")
+def test_sign_psbt_on_devices_multisig_wsh(client: Client):
+    # the same wallet and PSBT as test_sign_psbt_multisig_wsh; the signature is added to the PSBT
+    wallet = MultisigWallet(
+        name="Cold storage",
+        address_type=AddressType.WIT,
+        threshold=2,
+        keys_info=[
+            f"[76223a6e/48'/1'/0'/2']tpubDE7NQymr4AFtewpAsWtnreyq9ghkzQBXpCZjWLFVRAvnbf7vya2eMTvT2fPapNqL8SuVvLQdbUbMfWLVDCZKnsEBqp6UK93QEzL8Ck23AwF/**",
+            f"[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK/**",
+        ],
+    )
+
+    wallet_hmac = bytes.fromhex(
+        "d6434852fb3caa7edbd1165084968f1691444b3cfc10cf1e431acbbc7f48451f"
+    )
+
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/multisig/wsh-2of2.psbt")
+
+    results = sign_psbt_on_devices(psbt, wallet, [(client, wallet_hmac)])
+
+    signature = bytes.fromhex(
+        "304402206ab297c83ab66e573723892061d827c5ac0150e2044fed7ed34742fedbcfb26e0220319cdf4eaddff63fc308cdf53e225ea034024ef96de03fd0939b6deeea1e8bd301"
+    )
+    assert results == [{0: signature}]
+
+    our_pubkeys = [pubkey for pubkey, origin in psbt.inputs[0].hd_keypaths.items()
+                   if origin.fingerprint == bytes.fromhex("f5acc2fd")]
+    assert psbt.inputs[0].partial_sigs == {our_pubkeys[0]: signature}
+
 # def test_sign_psbt_legacy_wrong_non_witness_utxo(client: Client):
 #     # legacy address
 #     # PSBT for a legacy 1-input 1-output spend
@@ -487,7 +646,7 @@ def test_sign_psbt_singlesig_large_amount(client: Client, comm: SpeculosClient,
 
 @has_automation("automations/sign_with_default_wallet_accept.json")
 def test_sign_psbt_singlesig_wpkh_512to256(client: Client, enable_slow_tests: bool):
-    # PSBT for a transaction with 512 inputs and 256 outputs (maximum currently supported in the app)
+    # PSBT for a transaction with 512 inputs and 256 outputs (maximum supported without the host storage)
     # Very slow test (esp. with DEBUG enabled), so disabled unless the --enableslowtests option is used
 
     if not enable_slow_tests:
@@ -516,6 +675,146 @@ def test_sign_psbt_singlesig_wpkh_512to256(client: Client, enable_slow_tests: bo
     assert len(result) == n_inputs
 
 
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_sign_psbt_singlesig_wpkh_1100to2(client: Client, enable_slow_tests: bool):
+    # With more than 512 inputs, the chunks of the bitvectors of the internal inputs are stored on the host
+    # Very slow test (esp. with DEBUG enabled), so disabled unless the --enableslowtests option is used
+
+    if not enable_slow_tests:
+        pytest.skip()
+
+    n_inputs = 1100
+
+    wallet = PolicyMapWallet(
+        "",
+        "wpkh(@0)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**"
+        ],
+    )
+
+    psbt = txmaker.createPsbt(
+        wallet,
+        [10000 + 10000 * i for i in range(n_inputs)],
+        [50000, 100000],
+        [False, True]
+    )
+
+    result = client.sign_psbt(psbt, wallet, None)
+    assert len(result) == n_inputs
+
+    # resuming from the last checkpoint signs the inputs of the last chunk, without approval
+    checkpoint = client.last_sign_psbt_checkpoint
+    assert checkpoint is not None
+    assert checkpoint.next_input_index == 1088
+    assert client.sign_psbt(psbt, wallet, None, checkpoint) == result
+
+
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_sign_psbt_resume_from_checkpoint(client: Client):
+    # a checkpoint is yielded after the approval, then one every 16 signed inputs
+    wallet = PolicyMapWallet(
+        "",
+        "wpkh(@0)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**"
+        ],
+    )
+
+    n_inputs = 20
+    psbt = txmaker.createPsbt(
+        wallet,
+        [10000 + 10000 * i for i in range(n_inputs)],
+        [50000, 100000],
+        [False, True]
+    )
+
+    result = client.sign_psbt(psbt, wallet, None)
+    assert len(result) == n_inputs
+
+    checkpoint = client.last_sign_psbt_checkpoint
+    assert checkpoint is not None
+    assert checkpoint.next_input_index == 16
+    assert checkpoint.signatures == {i: result[i] for i in range(16)}
+
+    # no approval is required to resume from the checkpoint; ECDSA signatures are deterministic
+    assert client.sign_psbt(psbt, wallet, None, checkpoint) == result
+
+    # the token is only valid for the same checkpoint
+    forged = SignPsbtCheckpoint(8, checkpoint.token, checkpoint.signatures)
+    with pytest.raises(SignatureFailError):
+        client.sign_psbt(psbt, wallet, None, forged)
+
+
+@has_automation("automations/sign_with_batch_review_accept.json")
+def test_sign_psbt_batch_review(client: Client, comm: SpeculosClient, is_speculos: bool):
+    # with batch review, the 11 external outputs are approved in summary, with a single screen
+
+    if not is_speculos:
+        pytest.skip("Requires speculos")
+
+    # the client can only request the batch review if the user enabled it on the device
+    enable_batch_review_setting(comm)
+
+    wallet = PolicyMapWallet(
+        "",
+        "wpkh(@0)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**"
+        ],
+    )
+
+    n_outputs = 12
+    psbt = txmaker.createPsbt(
+        wallet,
+        [1_000_000],
+        [50000 + 1000 * i for i in range(n_outputs)],
+        [i == 0 for i in range(n_outputs)]
+    )
+
+    result = client.sign_psbt(psbt, wallet, None, batch_review=True)
+    assert len(result) == 1
+
+    # the digest that the client shows to the user, for comparison with the one on the device
+    assert len(get_batch_review_digest(psbt)) == 32
+
+
+def test_sign_psbt_batch_review_disabled(client: Client, comm: SpeculosClient, is_speculos: bool):
+    # unless the user enabled it in the settings, the request of the batch review is ignored, and each external
+    # output is reviewed
+
+    if not is_speculos:
+        pytest.skip("Requires speculos")
+
+    wallet = PolicyMapWallet(
+        "",
+        "wpkh(@0)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**"
+        ],
+    )
+
+    n_outputs = 12
+    psbt = txmaker.createPsbt(
+        wallet,
+        [1_000_000],
+        [50000 + 1000 * i for i in range(n_outputs)],
+        [i == 0 for i in range(n_outputs)]
+    )
+
+    all_events: List[dict] = []
+
+    x = threading.Thread(target=ux_thread_sign_psbt, args=[comm, all_events])
+    x.start()
+    result = client.sign_psbt(psbt, wallet, None, batch_review=True)
+    x.join()
+
+    assert len(result) == 1
+
+    parsed_events = parse_signing_events(all_events)
+    assert len(parsed_events["addresses"]) == n_outputs - 1
+
+
 def test_sign_psbt_fail_11_changes(client: Client):
     # PSBT for transaction with 11 change addresses; the limit is 10, so it must fail with NotSupportedError
     # before any user interaction
@@ -567,10 +866,8 @@ def test_sign_psbt_fail_wrong_non_witness_utxo(client: Client, is_speculos: bool
     wit.rehash()
     psbt.inputs[0].non_witness_utxo = wit
 
-    client._no_clone_psbt = True
     with pytest.raises(IncorrectDataError):
         client.sign_psbt(psbt, wallet, None)
-    client._no_clone_psbt = False
 
 
 def test_sign_psbt_with_opreturn(client: Client, comm: SpeculosClient):
@@ -615,12 +912,14 @@ def test_sign_psbt_with_segwit_v16(client: Client, comm: SpeculosClient):
     assert len(hww_sigs) == 1
 
 
+# PSBT obtained by joining pkh-1to1.psbt, tr-1to2.psbt, wpkh-1to2.psbt; each input belongs to a different wallet
+EXTERNAL_INPUTS_PSBT_B64 = "cHNidP8BAP0yAQIAAAADobgj0jNtaUtJNO+bblt94XoFUT2oop2wKi7Lx6mm/m0BAAAAAP3///9RIsLN5oI+VXVBdbksnFegqOGsg8OOF4f9Oh/zNI6VEwEAAAAA/f///3oqmXlWwJ+Op/0oGcGph7sU4iv5rc2vIKiXY3Is7uJkAQAAAAD9////BaCGAQAAAAAAFgAUE5m4oJhHoDmwNS9Y0hLBgLqxf3dV/6cAAAAAACJRIAuOdIa8MGoK77enwArwQFVC2xrNc+7MqCdxzPX+XrYPeEEPAAAAAAAZdqkUE9fVgWaUbD7AIpNAZtjA0RHRu0GIrHQ4IwAAAAAAFgAU6zj6m4Eo+B8m6V7bDF/66oNpD+Sguw0AAAAAABl2qRQ0Sg9IyhUOwrkDgXZgubaLE6ZwJoisAAAAAAABASunhqkAAAAAACJRINj08dGJltthuxyvVCPeJdih7unJUNN+b/oCMBLV5i4NIRYhLqKFalzxEOZqK+nXNTFHk/28s4iyuPE/K2remC569RkA9azC/VYAAIABAACAAAAAgAEAAAAAAAAAARcgIS6ihWpc8RDmaivp1zUxR5P9vLOIsrjxPytq3pguevUAAQCMAgAAAAHsIw5TCVJWBSokKCcO7ASYlEsQ9vHFePQxwj0AmLSuWgEAAAAXFgAUKBU5gg4t6XOuQbpgBLQxySHE2G3+////AnJydQAAAAAAF6kUyLkGrymMcOYDoow+/C+uGearKA+HQEIPAAAAAAAZdqkUy65bUM+Tnm9TG4prer14j+FLApeIrITyHAAiBgLuhgggfiEChCb2nnZEfX49XgdwSfXmg8MTbCMUdipHGBj1rML9LAAAgAEAAIAAAACAAAAAAAAAAAAAAQB9AgAAAAGvv64GWQ90H/GvWbasRhEmM2pMSoLbVT32/vq3N6wz8wEAAAAA/f///wJwEQEAAAAAACIAIP3uRBxW5bBtDfgsEkxwcBSlyhlli+C5hWvKFvHtMln3pfQwAAAAAAAWABQ6+EKa1ZVKpe6KM8mD/YoehnmSSwAAAAABAR+l9DAAAAAAABYAFDr4QprVlUql7oozyYP9ih6GeZJLIgYD7iw9mOsfk8Chqo5aQAm3Dre0Tq0V8WZvE2sBKtWNMGgY9azC/VQAAIABAACAAAAAgAEAAAAIAAAAAAABBSACkIHs5WFqocuZMZ/Eh07+5H8IzrpfYARjbIxDQJpfCiEHApCB7OVhaqHLmTGfxIdO/uR/CM66X2AEY2yMQ0CaXwoZAPWswv1WAACAAQAAgAAAAIABAAAAAgAAAAAAIgICKexHcnEx7SWIogxG7amrt9qm9J/VC6/nC5xappYcTswY9azC/VQAAIABAACAAAAAgAEAAAAKAAAAAAA="
+
+
 def test_sign_psbt_with_external_inputs(client: Client, comm: SpeculosClient):
-    # PSBT obtained by joining pkh-1to1.psbt, tr-1to2.psbt, wpkh-1to2.psbt.
     # We sign it with each of the respective wallets; therefore it must show the "external inputs" warning each time.
-    psbt_b64 = "cHNidP8BAP0yAQIAAAADobgj0jNtaUtJNO+bblt94XoFUT2oop2wKi7Lx6mm/m0BAAAAAP3///9RIsLN5oI+VXVBdbksnFegqOGsg8OOF4f9Oh/zNI6VEwEAAAAA/f///3oqmXlWwJ+Op/0oGcGph7sU4iv5rc2vIKiXY3Is7uJkAQAAAAD9////BaCGAQAAAAAAFgAUE5m4oJhHoDmwNS9Y0hLBgLqxf3dV/6cAAAAAACJRIAuOdIa8MGoK77enwArwQFVC2xrNc+7MqCdxzPX+XrYPeEEPAAAAAAAZdqkUE9fVgWaUbD7AIpNAZtjA0RHRu0GIrHQ4IwAAAAAAFgAU6zj6m4Eo+B8m6V7bDF/66oNpD+Sguw0AAAAAABl2qRQ0Sg9IyhUOwrkDgXZgubaLE6ZwJoisAAAAAAABASunhqkAAAAAACJRINj08dGJltthuxyvVCPeJdih7unJUNN+b/oCMBLV5i4NIRYhLqKFalzxEOZqK+nXNTFHk/28s4iyuPE/K2remC569RkA9azC/VYAAIABAACAAAAAgAEAAAAAAAAAARcgIS6ihWpc8RDmaivp1zUxR5P9vLOIsrjxPytq3pguevUAAQCMAgAAAAHsIw5TCVJWBSokKCcO7ASYlEsQ9vHFePQxwj0AmLSuWgEAAAAXFgAUKBU5gg4t6XOuQbpgBLQxySHE2G3+////AnJydQAAAAAAF6kUyLkGrymMcOYDoow+/C+uGearKA+HQEIPAAAAAAAZdqkUy65bUM+Tnm9TG4prer14j+FLApeIrITyHAAiBgLuhgggfiEChCb2nnZEfX49XgdwSfXmg8MTbCMUdipHGBj1rML9LAAAgAEAAIAAAACAAAAAAAAAAAAAAQB9AgAAAAGvv64GWQ90H/GvWbasRhEmM2pMSoLbVT32/vq3N6wz8wEAAAAA/f///wJwEQEAAAAAACIAIP3uRBxW5bBtDfgsEkxwcBSlyhlli+C5hWvKFvHtMln3pfQwAAAAAAAWABQ6+EKa1ZVKpe6KM8mD/YoehnmSSwAAAAABAR+l9DAAAAAAABYAFDr4QprVlUql7oozyYP9ih6GeZJLIgYD7iw9mOsfk8Chqo5aQAm3Dre0Tq0V8WZvE2sBKtWNMGgY9azC/VQAAIABAACAAAAAgAEAAAAIAAAAAAABBSACkIHs5WFqocuZMZ/Eh07+5H8IzrpfYARjbIxDQJpfCiEHApCB7OVhaqHLmTGfxIdO/uR/CM66X2AEY2yMQ0CaXwoZAPWswv1WAACAAQAAgAAAAIABAAAAAgAAAAAAIgICKexHcnEx7SWIogxG7amrt9qm9J/VC6/nC5xappYcTswY9azC/VQAAIABAACAAAAAgAEAAAAKAAAAAAA="
     psbt = PSBT()
-    psbt.deserialize(psbt_b64)
+    psbt.deserialize(EXTERNAL_INPUTS_PSBT_B64)
 
     wallets = [
         PolicyMapWallet(
@@ -651,3 +950,95 @@ def test_sign_psbt_with_external_inputs(client: Client, comm: SpeculosClient):
             hww_sigs = client.sign_psbt(psbt, wallet, None)
 
         assert len(hww_sigs) == 1
+
+
+def test_sign_psbt_with_selected_inputs(client: Client, comm: SpeculosClient):
+    # only the selected inputs are checked and signed; the others are external, even if they belong to the wallet
+    psbt = PSBT()
+    psbt.deserialize(EXTERNAL_INPUTS_PSBT_B64)
+
+    wallet = PolicyMapWallet(
+        "",
+        "wpkh(@0)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**"
+        ],
+    )
+
+    with automation(comm, "automations/sign_with_wallet_external_inputs_accept.json"):
+        hww_sigs = client.sign_psbt(psbt, wallet, None)
+    assert len(hww_sigs) == 1
+    [internal_input_index] = hww_sigs.keys()
+
+    with automation(comm, "automations/sign_with_wallet_external_inputs_accept.json"):
+        assert client.sign_psbt(psbt, wallet, None, selected_inputs=[internal_input_index]) == hww_sigs
+
+    # no selected input is internal; nothing to sign
+    other_inputs = [i for i in range(len(psbt.inputs)) if i != internal_input_index]
+    with pytest.raises(IncorrectDataError):
+        client.sign_psbt(psbt, wallet, None, selected_inputs=other_inputs)
+
+    with pytest.raises(IncorrectDataError):
+        client.sign_psbt(psbt, wallet, None, selected_inputs=[len(psbt.inputs)])
+
+
+@has_automation("automations/sign_with_default_wallet_nondefault_sighash_accept.json")
+@pytest.mark.parametrize("sighash", [
+    SIGHASH.NONE,
+    SIGHASH.SINGLE,
+    SIGHASH.ALL | SIGHASH.ANYONECANPAY,
+    SIGHASH.NONE | SIGHASH.ANYONECANPAY,
+    SIGHASH.SINGLE | SIGHASH.ANYONECANPAY,
+])
+@pytest.mark.parametrize("policy_map,key_info", [
+    ("pkh(@0)", "[f5acc2fd/44'/1'/0']tpubDCwYjpDhUdPGP5rS3wgNg13mTrrjBuG8V9VpWbyptX6TRPbNoZVXsoVUSkCjmQ8jJycjuDKBb9eataSymXakTTaGifxR6kmVsfFehH1ZgJT/**"),
+    ("wpkh(@0)", "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**"),
+])
+def test_sign_psbt_singlesig_nondefault_sighash(client: Client, policy_map: str, key_info: str, sighash: int):
+    # A 2-input 2-output spend where all the inputs use the same non-default sighash type.
+    # The signatures are verified against the sighash computed by embit.
+
+    wallet = PolicyMapWallet("", policy_map, [key_info])
+
+    psbt = txmaker.createPsbt(wallet, [10000, 20000], [14000, 15000], [False, True])
+    for psbt_in in psbt.inputs:
+        psbt_in.sighash = sighash
+
+    result = client.sign_psbt(psbt, wallet, None)
+
+    assert len(result) == 2
+
+    tx = Transaction.parse(psbt.tx.serialize_without_witness())
+
+    to_verify = []
+    for i, sig in result.items():
+        assert sig[-1] == sighash
+
+        pubkey_bytes = list(psbt.inputs[i].hd_keypaths.keys())[0]
+        pubkey = PublicKey.parse(pubkey_bytes)
+        if policy_map == "pkh(@0)":
+            msg = tx.sighash_legacy(i, p2pkh(pubkey), sighash)
+        else:
+            msg = tx.sighash_segwit(i, p2pkh(pubkey), psbt.inputs[i].witness_utxo.nValue, sighash)
+
+        to_verify.append((msg, pubkey_bytes, sig[:-1]))
+
+    assert ecdsa_secp256k1.ecdsa_verify_batch(to_verify)
+
+
+def test_sign_psbt_fail_sighash_single_without_output(client: Client):
+    # SIGHASH_SINGLE is not allowed for an input without the output with the same index
+
+    wallet = PolicyMapWallet(
+        "",
+        "wpkh(@0)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**"
+        ],
+    )
+
+    psbt = txmaker.createPsbt(wallet, [10000, 20000], [25000], [False])
+    psbt.inputs[1].sighash = SIGHASH.SINGLE
+
+    with pytest.raises(IncorrectDataError):
+        client.sign_psbt(psbt, wallet, None)
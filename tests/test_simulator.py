@@ -0,0 +1,123 @@
+import asyncio
+
+import pytest
+
+from bitcoin_client.ledger_bitcoin import AsyncNewClient, PolicyMapWallet, RequestCache
+from bitcoin_client.ledger_bitcoin.client import NewClient
+
+from test_utils import txmaker
+from test_utils.benchmark import BenchmarkReport, measure
+from test_utils.simulator import ProtocolSimulator
+
+# The client against the in-process ProtocolSimulator instead of Speculos: these tests check that the client answers
+# all the client commands of the request patterns of the app, and the benchmarks (only executed with the
+# --enablebenchmarks option) measure the cost of the client alone, for PSBTs too large to be signed on Speculos in CI.
+
+BENCHMARK_N_INPUTS = [100, 1000]
+
+WALLET = PolicyMapWallet(
+    "",
+    "wpkh(@0)",
+    ["[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**"],
+)
+
+
+def create_psbt(n_inputs: int):
+    return txmaker.createPsbt(WALLET, [10000 + 10000 * i for i in range(n_inputs)], [999, 1099], [False, True])
+
+
+def test_simulator_register_wallet_and_get_address():
+    simulator = ProtocolSimulator()
+    client = NewClient(simulator)
+
+    wallet_id, wallet_hmac = client.register_wallet(WALLET)
+    assert wallet_id == WALLET.id
+    assert len(wallet_hmac) == 32
+
+    assert client.get_wallet_address(WALLET, wallet_hmac, 0, 3, False) != client.get_wallet_address(
+        WALLET, wallet_hmac, 0, 4, False)
+    assert simulator.client_commands["GET_MERKLE_LEAF_PROOF"] == 3 * WALLET.n_keys
+
+
+def test_simulator_request_cache():
+    cache = RequestCache()
+    simulator = ProtocolSimulator()
+    client = NewClient(simulator, request_cache=cache)
+
+    address = client.get_wallet_address(WALLET, None, 0, 3, False)
+    assert client.get_wallet_address(WALLET, None, 0, 3, False) == address
+    assert simulator.commands["GET_WALLET_ADDRESS"] == 1
+
+    # another address, or an address shown on the screen, is requested to the device
+    client.get_wallet_address(WALLET, None, 0, 4, False)
+    assert client.get_wallet_address(WALLET, None, 0, 3, True) == address
+    assert simulator.commands["GET_WALLET_ADDRESS"] == 3
+
+    # the same path in another notation is the same request
+    xpub = client.get_extended_pubkey("m/84'/1'/0'")
+    assert client.get_extended_pubkey("84'/1'/0'") == xpub
+    assert simulator.commands["GET_EXTENDED_PUBKEY"] == 1
+    assert simulator.commands["GET_MASTER_FINGERPRINT"] == 1
+
+    # the results of a device with another seed are not shared, even with the same cache
+    other_simulator = ProtocolSimulator(hmac_key=b"\1" * 32)
+    other_client = NewClient(other_simulator, request_cache=cache)
+    other_client.get_wallet_address(WALLET, None, 0, 3, False)
+    assert other_simulator.commands["GET_WALLET_ADDRESS"] == 1
+
+
+class AsyncProtocolSimulator(ProtocolSimulator):
+    """A `ProtocolSimulator` for an `AsyncNewClient`, that lets the other tasks run at each APDU, as a device would."""
+
+    async def apdu_exchange(self, *args, **kwargs) -> bytes:
+        await asyncio.sleep(0)
+        return ProtocolSimulator.apdu_exchange(self, *args, **kwargs)
+
+
+def test_simulator_request_cache_concurrent_requests():
+    simulator = AsyncProtocolSimulator()
+    client = AsyncNewClient(simulator, request_cache=RequestCache())
+
+    async def get_addresses():
+        return await asyncio.gather(*[client.get_wallet_address(WALLET, None, 1, 7, False) for _ in range(5)])
+
+    addresses = asyncio.run(get_addresses())
+
+    # the identical requests in flight share a single exchange with the device
+    assert len(set(addresses)) == 1
+    assert simulator.commands["GET_WALLET_ADDRESS"] == 1
+    assert simulator.commands["GET_MASTER_FINGERPRINT"] == 1
+
+
+@pytest.mark.parametrize("max_response_len", [64, 255])
+def test_simulator_sign_psbt(max_response_len: int):
+    simulator = ProtocolSimulator(max_response_len)
+    client = NewClient(simulator)
+
+    result = client.sign_psbt(create_psbt(10), WALLET, None)
+
+    assert sorted(result.keys()) == list(range(10))
+    if max_response_len == 64:
+        # the key information and the non-witness UTXOs do not fit in a single response
+        assert simulator.client_commands["GET_MORE_ELEMENTS"] > 0
+
+
+@pytest.mark.parametrize("n_inputs", BENCHMARK_N_INPUTS)
+def test_benchmark_simulator_sign_psbt(enable_benchmarks: bool, benchmark_report: BenchmarkReport, n_inputs: int):
+    if not enable_benchmarks:
+        pytest.skip()
+
+    simulator = ProtocolSimulator()
+    client = NewClient(simulator)
+    psbt = create_psbt(n_inputs)
+
+    with measure(simulator) as stats:
+        result = client.sign_psbt(psbt, WALLET, None)
+
+    assert len(result) == n_inputs
+
+    benchmark_report.add("sign_psbt_simulator", {
+        "policy": WALLET.policy_map,
+        "n_inputs": n_inputs,
+        "n_outputs": 2,
+    }, stats)
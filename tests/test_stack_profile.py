@@ -0,0 +1,52 @@
+import pytest
+
+from bitcoin_client.ledger_bitcoin import Client, PolicyMapWallet
+from speculos.client import SpeculosClient
+
+from test_utils import has_automation, txmaker
+from test_utils.stack_profile import StackProfileReport, get_stack_profile
+
+# Stack usage of the main commands; only measured if the app is compiled with STACK_PROFILE=1, otherwise the
+# test is skipped. The results are written in the file given by the --stackprofilereport option.
+
+wallet_wit = PolicyMapWallet(
+    name="",
+    policy_map="wpkh(@0)",
+    keys_info=[
+        f"[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**",
+    ],
+)
+
+wallet_tr = PolicyMapWallet(
+    name="",
+    policy_map="tr(@0)",
+    keys_info=[
+        f"[f5acc2fd/86'/1'/0']tpubDDKYE6BREvDsSWMazgHoyQWiJwYaDDYPbCFjYxN3HFXJP5fokeiK4hwK5tTLBNEDBwrDXn8cQ4v9b2xdW62Xr5yxoQdMu1v6c7UDXYVH27U/**",
+    ],
+)
+
+COMMANDS = {
+    "get_extended_pubkey": lambda client: client.get_extended_pubkey("m/84'/1'/0'", False),
+    "get_wallet_address_wit": lambda client: client.get_wallet_address(wallet_wit, None, 0, 3, False),
+    "get_wallet_address_tr": lambda client: client.get_wallet_address(wallet_tr, None, 0, 3, False),
+    "sign_psbt_wit": lambda client: client.sign_psbt(
+        txmaker.createPsbt(wallet_wit, [10000, 20000, 30000], [999, 29000], [False, True]), wallet_wit, None),
+    "sign_psbt_tr": lambda client: client.sign_psbt(
+        txmaker.createPsbt(wallet_tr, [10000, 20000, 30000], [999, 29000], [False, True]), wallet_tr, None),
+}
+
+
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_stack_profile(client: Client, comm: SpeculosClient, stack_profile_report: StackProfileReport):
+    if get_stack_profile(comm, clear=True) is None:
+        pytest.skip("The app is not compiled with STACK_PROFILE=1")
+
+    for name, run in COMMANDS.items():
+        run(client)
+
+        profile = get_stack_profile(comm, clear=True)
+        assert profile is not None
+        assert 0 < profile.max_depth <= profile.stack_size
+        assert all(depth <= profile.max_depth for depth in profile.processors.values())
+
+        stack_profile_report.add(name, profile)
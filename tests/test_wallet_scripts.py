@@ -0,0 +1,166 @@
+import pytest
+
+from bitcoin_client.ledger_bitcoin import AddressType, MultisigWallet, PolicyMapWallet
+from bitcoin_client.ledger_bitcoin import _base58 as base58
+from bitcoin_client.ledger_bitcoin.common import hash160, sha256
+from bitcoin_client.ledger_bitcoin.key import ExtendedKey
+from bitcoin_client.ledger_bitcoin.merkle import MerkleTree, element_hash
+from bitcoin_client.ledger_bitcoin.wallet_scripts import compute_wallet_scripts_merkle_root, derive_wallet_scripts
+
+from test_utils import segwit_addr
+
+# The scriptPubKeys derived on the host are compared with the addresses returned by the device in
+# test_get_wallet_address.py; these tests do not need the device.
+
+
+def address_script(address: str) -> bytes:
+    if address.startswith("tb1"):
+        witver, program = segwit_addr.decode("tb", address)
+        return bytes([0x50 + witver if witver > 0 else 0, len(program)]) + bytes(program)
+    data = base58.decode(address)[:-4]
+    if data[0] == 0x6f:  # testnet P2PKH
+        return b"\x76\xa9\x14" + data[1:] + b"\x88\xac"
+    return b"\xa9\x14" + data[1:] + b"\x87"
+
+
+def test_wallet_scripts_singlesig():
+    wallet = PolicyMapWallet(
+        name="",
+        policy_map="pkh(@0)",
+        keys_info=[
+            f"[f5acc2fd/44'/1'/0']tpubDCwYjpDhUdPGP5rS3wgNg13mTrrjBuG8V9VpWbyptX6TRPbNoZVXsoVUSkCjmQ8jJycjuDKBb9eataSymXakTTaGifxR6kmVsfFehH1ZgJT/**",
+        ],
+    )
+    assert derive_wallet_scripts(wallet, 0, 0, 1) == [address_script("mz5vLWdM1wHVGSmXUkhKVvZbJ2g4epMXSm")]
+    assert derive_wallet_scripts(wallet, 1, 10, 6)[5] == address_script("myFCUBRCKFjV7292HnZtiHqMzzHrApobpT")
+
+    wallet = PolicyMapWallet(
+        name="",
+        policy_map="wpkh(@0)",
+        keys_info=[
+            f"[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**",
+        ],
+    )
+    scripts = derive_wallet_scripts(wallet, 1, 10, 30)
+    assert scripts[5] == address_script("tb1qlrvzyx8jcjfj2xuy69du9trtxnsvjuped7e289")
+    assert derive_wallet_scripts(wallet, 1, 23, 1) == [scripts[13]]
+
+    wallet = PolicyMapWallet(
+        name="",
+        policy_map="sh(wpkh(@0))",
+        keys_info=[
+            f"[f5acc2fd/49'/1'/0']tpubDC871vGLAiKPcwAw22EjhKVLk5L98UGXBEcGR8gpcigLQVDDfgcYW24QBEyTHTSFEjgJgbaHU8CdRi9vmG4cPm1kPLmZhJEP17FMBdNheh3/**",
+        ],
+    )
+    assert derive_wallet_scripts(wallet, 0, 0, 1) == [address_script("2MyHkbusvLomaarGYMqyq7q9pSBYJRwWcsw")]
+    assert derive_wallet_scripts(wallet, 1, 15, 1) == [address_script("2NAbM4FSeBQG4o85kbXw2YNfKypcnEZS9MR")]
+
+    wallet = PolicyMapWallet(
+        name="",
+        policy_map="tr(@0)",
+        keys_info=[
+            f"[f5acc2fd/86'/1'/0']tpubDDKYE6BREvDsSWMazgHoyQWiJwYaDDYPbCFjYxN3HFXJP5fokeiK4hwK5tTLBNEDBwrDXn8cQ4v9b2xdW62Xr5yxoQdMu1v6c7UDXYVH27U/**",
+        ],
+    )
+    scripts = derive_wallet_scripts(wallet, 0, 0, 10)
+    assert scripts[0] == address_script("tb1pws8wvnj99ca6acf8kq7pjk7vyxknah0d9mexckh5s0vu2ccy68js9am6u7")
+    assert scripts[9] == address_script("tb1psl7eyk2jyjzq6evqvan854fts7a5j65rth25yqahkd2a765yvj0qggs5ne")
+    scripts = derive_wallet_scripts(wallet, 1, 0, 10)
+    assert scripts[0] == address_script("tb1pmr60r5vfjmdkrwcu4a2z8h39mzs7a6wf2rfhuml6qgcp940x9cxs7t9pdy")
+    assert scripts[9] == address_script("tb1p98d6s9jkf0la8ras4nnm72zme5r03fexn29e3pgz4qksdy84ndpqgjak72")
+
+
+def test_wallet_scripts_multisig():
+    wallet = MultisigWallet(
+        name="Cold storage",
+        address_type=AddressType.LEGACY,
+        threshold=2,
+        keys_info=[
+            f"[5c9e228d/48'/1'/0'/0']tpubDEGquuorgFNb8bjh5kNZQMPtABJzoWwNm78FUmeoPkfRtoPF7JLrtoZeT3J3ybq1HmC3Rn1Q8wFQ8J5usanzups5rj7PJoQLNyvq8QbJruW/**",
+            f"[f5acc2fd/48'/1'/0'/0']tpubDFAqEGNyad35WQAZMmPD4vgBXnjH16RGciLdWekPe4f4d5JzoHVu1PS86Sy4Tm63vDf8rfV3UjifhrRuSUDfiZj5KPffTPyZ4ZXBKvjD8jm/**",
+        ],
+    )
+    assert derive_wallet_scripts(wallet, 0, 0, 1) == [address_script("2Mx69MjHC4ViZAH1koVXPvVgaazbBCdr89j")]
+
+    wallet = MultisigWallet(
+        name="Cold storage",
+        address_type=AddressType.SH_WIT,
+        threshold=2,
+        keys_info=[
+            f"[76223a6e/48'/1'/0'/1']tpubDE7NQymr4AFtcJXi9TaWZtrhAdy8QyKmT4U6b9qYByAxCzoyMJ8zw5d8xVLVpbTRAEqP8pVUxjLE2vDt1rSFjaiS8DSz1QcNZ8D1qxUMx1g/**",
+            f"[f5acc2fd/48'/1'/0'/1']tpubDFAqEGNyad35YgH8zxvxFZqNUoPtr5mDojs7wzbXQBHTZ4xHeVXG6w2HvsKvjBpaRpTmjYDjdPg5w2c6Wvu8QBkyMDrmBWdCyqkDM7reSsY/**",
+        ],
+    )
+    assert derive_wallet_scripts(wallet, 0, 0, 1) == [address_script("2MxAUTJh27foYtyp9dcSxP7RgaSwkkVCHTU")]
+
+    keys_info = [
+        f"[76223a6e/48'/1'/0'/2']tpubDE7NQymr4AFtewpAsWtnreyq9ghkzQBXpCZjWLFVRAvnbf7vya2eMTvT2fPapNqL8SuVvLQdbUbMfWLVDCZKnsEBqp6UK93QEzL8Ck23AwF/**",
+        f"[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK/**",
+    ]
+    wallet = MultisigWallet(name="Cold storage", address_type=AddressType.WIT, threshold=2, keys_info=keys_info)
+    scripts = derive_wallet_scripts(wallet, 0, 0, 8)
+    assert scripts[0] == address_script("tb1qmyauyzn08cduzdqweexgna2spwd0rndj55fsrkefry2cpuyt4cpsn2pg28")
+
+    # the same as deriving each key with the generic BIP32 derivation
+    for i in [3, 7]:
+        pubkeys = sorted(
+            ExtendedKey.deserialize(k[k.index("]") + 1:-3]).derive_pub_path([0, i]).pubkey for k in keys_info
+        )
+        witness_script = b"\x52" + b"".join(b"\x21" + pk for pk in pubkeys) + b"\x52\xae"
+        assert scripts[i] == b"\x00\x20" + sha256(witness_script)
+
+
+def test_wallet_scripts_multipath():
+    key = "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+    wallet = PolicyMapWallet(name="", policy_map="wpkh(@0)", keys_info=[f"{key}/**"])
+
+    # "/<0;1>/*" is the same as "/**"; with the steps swapped, receive and change addresses are swapped
+    wallet_0_1 = PolicyMapWallet(name="", policy_map="wpkh(@0)", keys_info=[f"{key}/<0;1>/*"])
+    wallet_1_0 = PolicyMapWallet(name="", policy_map="wpkh(@0)", keys_info=[f"{key}/<1;0>/*"])
+    for change in [0, 1]:
+        assert derive_wallet_scripts(wallet_0_1, change, 10, 3) == derive_wallet_scripts(wallet, change, 10, 3)
+        assert derive_wallet_scripts(wallet_1_0, change, 10, 3) == derive_wallet_scripts(wallet, 1 - change, 10, 3)
+    assert derive_wallet_scripts(wallet_1_0, 0, 15, 1) == [address_script("tb1qlrvzyx8jcjfj2xuy69du9trtxnsvjuped7e289")]
+
+    # any two different unhardened steps
+    wallet_5_7 = PolicyMapWallet(name="", policy_map="wpkh(@0)", keys_info=[f"{key}/<5;7>/*"])
+    ext_key = ExtendedKey.deserialize(key[key.index("]") + 1:])
+    assert derive_wallet_scripts(wallet_5_7, 1, 2, 1) == [
+        b"\x00\x14" + hash160(ext_key.derive_pub_path([7, 2]).pubkey)
+    ]
+    assert wallet_5_7.get_descriptor(change=True) == f"wpkh({key}/7/*)"
+
+    for suffix in ["/<0;0>/*", "/<0;2147483648>/*"]:
+        with pytest.raises(ValueError):
+            derive_wallet_scripts(PolicyMapWallet("", "wpkh(@0)", [f"{key}{suffix}"]), 0, 0, 1)
+
+
+def test_wallet_scripts_merkle_root():
+    wallet = PolicyMapWallet(
+        name="",
+        policy_map="wpkh(@0)",
+        keys_info=[
+            f"[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**",
+        ],
+    )
+
+    for count in [1, 2, 7, 30]:
+        scripts = derive_wallet_scripts(wallet, 1, 10, count)
+        root = compute_wallet_scripts_merkle_root(wallet, 1, 10, count)
+        assert root == MerkleTree(element_hash(s) for s in scripts).root
+    assert compute_wallet_scripts_merkle_root(wallet, 1, 10, 1) == element_hash(scripts[0])
+
+
+def test_wallet_scripts_unsupported():
+    keys_info = [
+        f"[76223a6e/48'/1'/0'/2']tpubDE7NQymr4AFtewpAsWtnreyq9ghkzQBXpCZjWLFVRAvnbf7vya2eMTvT2fPapNqL8SuVvLQdbUbMfWLVDCZKnsEBqp6UK93QEzL8Ck23AwF/**",
+        f"[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK/**",
+    ]
+    for policy_map in ["wsh(and_v(v:pk(@0),older(5)))", "tr(@0,pk(@1))", "wsh(tr(@0))"]:
+        with pytest.raises(NotImplementedError):
+            derive_wallet_scripts(PolicyMapWallet("", policy_map, keys_info), 0, 0, 1)
+
+    with pytest.raises(ValueError):
+        derive_wallet_scripts(PolicyMapWallet("", "wpkh(@2)", keys_info), 0, 0, 1)
+    with pytest.raises(ValueError):
+        derive_wallet_scripts(PolicyMapWallet("", "wpkh(@0)", keys_info), 2, 0, 1)
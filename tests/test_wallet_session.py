@@ -0,0 +1,77 @@
+from bitcoin_client.ledger_bitcoin import Client, AddressType, MultisigWallet
+from bitcoin_client.ledger_bitcoin.client_command import ClientCommandInterpreter
+from bitcoin_client.ledger_bitcoin.exception.errors import SignatureFailError
+
+import hmac
+from hashlib import sha256
+
+import pytest
+
+
+wallet = MultisigWallet(
+    name="Cold storage",
+    address_type=AddressType.WIT,
+    threshold=2,
+    keys_info=[
+        f"[76223a6e/48'/1'/0'/2']tpubDE7NQymr4AFtewpAsWtnreyq9ghkzQBXpCZjWLFVRAvnbf7vya2eMTvT2fPapNqL8SuVvLQdbUbMfWLVDCZKnsEBqp6UK93QEzL8Ck23AwF/**",
+        f"[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK/**",
+    ],
+)
+wallet_hmac = bytes.fromhex(
+    "d6434852fb3caa7edbd1165084968f1691444b3cfc10cf1e431acbbc7f48451f"
+)
+
+
+def test_wallet_session(client: Client):
+    client.open_wallet_session(wallet, wallet_hmac)
+
+    # while the session is open, neither the wallet policy nor its keys are requested to the client
+    sw, response = client._make_request(
+        client.builder.get_wallet_address(wallet, wallet_hmac, 0, False, False),
+        ClientCommandInterpreter()
+    )
+    assert sw == 0x9000
+    assert response.decode() == "tb1qmyauyzn08cduzdqweexgna2spwd0rndj55fsrkefry2cpuyt4cpsn2pg28"
+
+    assert client.get_wallet_address(wallet, wallet_hmac, 0, 3, False) == \
+        client.get_wallet_addresses(wallet, wallet_hmac, 0, 3, 1)[0]
+
+    client.close_wallet_session()
+
+    # commands work as usual after the session is closed
+    res = client.get_wallet_address(wallet, wallet_hmac, 0, 0, False)
+    assert res == "tb1qmyauyzn08cduzdqweexgna2spwd0rndj55fsrkefry2cpuyt4cpsn2pg28"
+
+
+def test_wallet_session_wrong_hmac(client: Client):
+    with pytest.raises(SignatureFailError):
+        client.open_wallet_session(wallet, bytes(31) + b'\x01')
+
+
+def test_wallet_session_multiple(client: Client, speculos_globals):
+    other_wallet = MultisigWallet(
+        name="Hot storage",
+        address_type=AddressType.WIT,
+        threshold=1,
+        keys_info=wallet.keys_info,
+    )
+    other_wallet_hmac = hmac.new(
+        speculos_globals.wallet_registration_key, other_wallet.id, sha256
+    ).digest()
+
+    client.open_wallet_session(wallet, wallet_hmac)
+    client.open_wallet_session(other_wallet, other_wallet_hmac)
+
+    # the most recently opened session does not need the client
+    sw, _ = client._make_request(
+        client.builder.get_wallet_address(other_wallet, other_wallet_hmac, 0, False, False),
+        ClientCommandInterpreter()
+    )
+    assert sw == 0x9000
+
+    # the previous one might have been replaced on devices with less memory, but commands for it
+    # keep working as usual
+    res = client.get_wallet_address(wallet, wallet_hmac, 0, 0, False)
+    assert res == "tb1qmyauyzn08cduzdqweexgna2spwd0rndj55fsrkefry2cpuyt4cpsn2pg28"
+
+    client.close_wallet_session()
@@ -0,0 +1,199 @@
+/**
+ * Microbenchmark of the helpers in src/common that are called the most while parsing and signing a
+ * transaction: varints, Merkle trees, policy maps, BIP32 paths, amounts, scripts and addresses.
+ * Each benchmark is a single call, repeated n_iterations times; as for bench_crypto, only the
+ * relative timings are meaningful.
+ *
+ * It is also run by ctest with few iterations, with the label "bench": to only run the
+ * benchmarks of the unit tests, use ctest -L bench -V.
+ *
+ * Usage: bench_common [n_iterations]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/constants.h"
+#include "../src/crypto.h"
+
+#include "common/address.h"
+#include "common/base58.h"
+#include "common/bip32.h"
+#include "common/buffer.h"
+#include "common/format.h"
+#include "common/merkle.h"
+#include "common/script.h"
+#include "common/segwit_addr.h"
+#include "common/varint.h"
+#include "common/wallet.h"
+
+#define DEFAULT_N_ITERATIONS 100000
+
+static const uint8_t p2pkh_script[] = {0x76, 0xa9, 0x14, 0x76, 0xa0, 0x40, 0x53, 0xbd, 0xa0,
+                                       0xa8, 0x8b, 0xda, 0x51, 0x77, 0xb8, 0x6a, 0x15, 0xc3,
+                                       0xb2, 0x9f, 0x55, 0x98, 0x73, 0x88, 0xac};
+
+static const uint8_t p2tr_script[] = {0x51, 0x20, 0x79, 0xbe, 0x66, 0x7e, 0xf9, 0xdc, 0xbb, 0xac,
+                                      0x55, 0xa0, 0x62, 0x95, 0xce, 0x87, 0x0b, 0x07, 0x02, 0x9b,
+                                      0xfc, 0xdb, 0x2d, 0xce, 0x28, 0xd9, 0x59, 0xf2, 0x81, 0x5b,
+                                      0x16, 0xf8, 0x17, 0x98};
+
+static const char policy_map[] = "wsh(or_d(multi(2,@0,@1),and_v(v:pkh(@2),older(52560))))";
+
+static uint32_t counter;
+
+// prevents the compiler from optimizing away the benchmarked computations
+static volatile uint8_t sink;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static void check(bool ok) {
+    if (!ok) {
+        fprintf(stderr, "Unexpected failure\n");
+        exit(1);
+    }
+}
+
+static void bench_buffer_read_varint(void) {
+    // a 9-bytes varint, the longest encoding
+    uint8_t data[] = {0xff, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08};
+    data[1] = (uint8_t) counter++;
+    buffer_t buf = buffer_create(data, sizeof(data));
+    uint64_t value;
+    check(buffer_read_varint(&buf, &value));
+    sink ^= (uint8_t) value;
+}
+
+static void bench_varint_write(void) {
+    uint8_t out[9];
+    check(varint_write(out, 0, 0x0102030405060708ull + counter++) == 9);
+    sink ^= out[1];
+}
+
+static void bench_merkle_compute_element_hash(void) {
+    uint8_t data[65] = {0}, out[32];
+    data[0] = (uint8_t) counter++;
+    merkle_compute_element_hash(data, sizeof(data), out);
+    sink ^= out[0];
+}
+
+static void bench_merkle_combine_hashes(void) {
+    uint8_t left[32] = {0}, right[32] = {1}, out[32];
+    left[0] = (uint8_t) counter++;
+    merkle_combine_hashes(left, right, out);
+    sink ^= out[0];
+}
+
+static void bench_merkle_get_ith_direction(void) {
+    // a tree with 1000 leaves has depth 10
+    uint32_t index = counter++ % 1000;
+    int res = 0;
+    for (size_t i = 0; i < 9; i++) {
+        res ^= merkle_get_ith_direction(1000, index, i);
+    }
+    sink ^= (uint8_t) res;
+}
+
+static void bench_parse_policy_map(void) {
+    // on the host, the nodes are larger than in the app
+    uint8_t out[4 * MAX_POLICY_MAP_BYTES] __attribute__((aligned(4)));
+    buffer_t in_buf = buffer_create((void *) policy_map, sizeof(policy_map) - 1);
+    check(parse_policy_map(&in_buf, out, sizeof(out)) == 0);
+    sink ^= out[0];
+}
+
+static void bench_bip32_path_format(void) {
+    const uint32_t path[] = {0x80000056, 0x80000000, 0x80000000, 1, counter++ % 1000000};
+    char out[MAX_SERIALIZED_BIP32_PATH_LENGTH + 1];
+    check(bip32_path_format(path, 5, out, sizeof(out)));
+    sink ^= (uint8_t) out[0];
+}
+
+static void bench_format_amount(void) {
+    char out[32];
+    check(format_amount(out, sizeof(out), 1230000ull + (counter++ & 1), 8) > 0);
+    sink ^= (uint8_t) out[0];
+}
+
+static void bench_get_script_type(void) {
+    const uint8_t *script = (counter++ & 1) ? p2tr_script : p2pkh_script;
+    size_t script_len = script == p2tr_script ? sizeof(p2tr_script) : sizeof(p2pkh_script);
+    check(get_script_type(script, script_len) >= 0);
+}
+
+static void bench_base58_encode(void) {
+    // a serialized extended public key with its checksum, as in the key informations
+    uint8_t data[82];
+    char out[MAX_SERIALIZED_PUBKEY_LENGTH + 1];
+    memset(data, 0x5a, sizeof(data));
+    data[81] = (uint8_t) counter++;
+    check(base58_encode(data, sizeof(data), out, sizeof(out)) > 0);
+    sink ^= (uint8_t) out[0];
+}
+
+static void bench_segwit_addr_encode(void) {
+    char out[MAX_ADDRESS_LENGTH_STR + 1];
+    check(segwit_addr_encode(out, "bc", 1, p2tr_script + 2, 32) == 1);
+    sink ^= (uint8_t) out[4];
+}
+
+static void bench_address_encode_base58check(void) {
+    char out[MAX_ADDRESS_LENGTH_STR + 1];
+    check(address_encode_base58check(p2pkh_script + 3, 0x00, out, sizeof(out)) > 0);
+    sink ^= (uint8_t) out[1];
+}
+
+static void bench_address_encode_segwit(void) {
+    char out[MAX_ADDRESS_LENGTH_STR + 1];
+    check(address_encode_segwit("bc", 1, p2tr_script + 2, 32, out, sizeof(out)) > 0);
+    sink ^= (uint8_t) out[4];
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} benchmarks[] = {
+    {"buffer_read_varint (9 bytes)", bench_buffer_read_varint},
+    {"varint_write (9 bytes)", bench_varint_write},
+    {"merkle_compute_element_hash (65 bytes)", bench_merkle_compute_element_hash},
+    {"merkle_combine_hashes", bench_merkle_combine_hashes},
+    {"merkle_get_ith_direction (depth 10)", bench_merkle_get_ith_direction},
+    {"parse_policy_map", bench_parse_policy_map},
+    {"bip32_path_format (5 steps)", bench_bip32_path_format},
+    {"format_amount", bench_format_amount},
+    {"get_script_type", bench_get_script_type},
+    {"base58_encode (82 bytes)", bench_base58_encode},
+    {"segwit_addr_encode (p2tr)", bench_segwit_addr_encode},
+    {"address_encode_base58check (p2pkh)", bench_address_encode_base58check},
+    {"address_encode_segwit (p2tr)", bench_address_encode_segwit},
+};
+
+int main(int argc, char *argv[]) {
+    int n_iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_N_ITERATIONS;
+    if (n_iterations <= 0) {
+        fprintf(stderr, "Usage: %s [n_iterations]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-40s %14s\n", "function", "ns/op");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        benchmarks[i].fn();  // warm-up
+
+        double start = now_ns();
+        for (int j = 0; j < n_iterations; j++) {
+            benchmarks[i].fn();
+        }
+        double elapsed = now_ns() - start;
+
+        printf("%-40s %14.1f\n", benchmarks[i].name, elapsed / n_iterations);
+    }
+
+    return 0;
+}
@@ -0,0 +1,151 @@
+/**
+ * Microbenchmark of the functions in crypto.c, built against the host implementation of the cx_*
+ * functions. The absolute timings are not representative of the device, but they allow to compare
+ * the relative cost of the functions and the effect of changes in crypto.c.
+ *
+ * Usage: bench_crypto [n_iterations]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/crypto.h"
+#include "../src/common/address.h"
+
+#define DEFAULT_N_ITERATIONS 1000
+
+// clang-format off
+static const uint8_t compressed_key[] = {
+    0x02,
+    0xee,0x86,0x08,0x20,0x7e,0x21,0x02,0x84,0x26,0xf6,0x9e,0x76,0x44,0x7d,0x7e,0x3d,
+    0x5e,0x07,0x70,0x49,0xf5,0xe6,0x83,0xc3,0x13,0x6c,0x23,0x14,0x76,0x2a,0x47,0x18
+};
+
+static const uint8_t chain_code[] = {
+    0x60,0x49,0x9f,0x80,0x1b,0x89,0x6d,0x83,0x17,0x9a,0x43,0x74,0xae,0xb7,0x82,0x2a,
+    0xae,0xac,0xea,0xa0,0xdb,0x1f,0x85,0xee,0x3e,0x90,0x4c,0x4d,0xef,0xbd,0x96,0x89
+};
+// clang-format on
+
+static uint8_t uncompressed_key[65];
+static serialized_extended_pubkey_t xpub;
+
+// prevents the compiler from optimizing away the benchmarked computations
+static volatile uint8_t sink;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static void bench_bip32_CKDpub(void) {
+    serialized_extended_pubkey_t child;
+    bip32_CKDpub(&xpub, 0, &child);
+    sink ^= child.compressed_pubkey[1];
+}
+
+static void bench_bip32_CKDpub_point(void) {
+    uint8_t child[65], child_chain_code[32];
+    memcpy(child_chain_code, chain_code, 32);
+    bip32_CKDpub_point(uncompressed_key, child_chain_code, 0, child);
+    sink ^= child[1];
+}
+
+static void bench_bip32_CKDpub_range_10(void) {
+    uint8_t children[10][33];
+    bip32_CKDpub_range(uncompressed_key, chain_code, 0, 10, children);
+    sink ^= children[9][1];
+}
+
+static void bench_crypto_hash160(void) {
+    uint8_t out[20];
+    crypto_hash160(compressed_key, sizeof(compressed_key), out);
+    sink ^= out[0];
+}
+
+static void bench_crypto_get_compressed_pubkey(void) {
+    uint8_t out[33];
+    crypto_get_compressed_pubkey(uncompressed_key, out);
+    sink ^= out[1];
+}
+
+static void bench_crypto_get_uncompressed_pubkey(void) {
+    uint8_t out[65];
+    crypto_get_uncompressed_pubkey(compressed_key, out);
+    sink ^= out[64];
+}
+
+static void bench_crypto_tr_tweak_pubkey(void) {
+    uint8_t pubkey[32], y_parity, out[32];
+    memcpy(pubkey, compressed_key + 1, 32);
+    crypto_tr_tweak_pubkey(pubkey, &y_parity, out);
+    sink ^= out[0];
+}
+
+static void bench_crypto_get_checksum(void) {
+    uint8_t out[4];
+    crypto_get_checksum(compressed_key, sizeof(compressed_key), out);
+    sink ^= out[0];
+}
+
+static void bench_address_encode_base58check(void) {
+    char out[MAX_ADDRESS_LENGTH_STR + 1];
+    address_encode_base58check(compressed_key + 1, 0x6F, out, sizeof(out));
+    sink ^= out[0];
+}
+
+static void bench_address_encode_cashaddr(void) {
+    char out[CASHADDR_ADDRESS_LENGTH + 1];
+    address_encode_cashaddr(compressed_key + 1, CASHADDR_TYPE_P2PKH, out, sizeof(out));
+    sink ^= out[0];
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} benchmarks[] = {
+    {"bip32_CKDpub", bench_bip32_CKDpub},
+    {"bip32_CKDpub_point", bench_bip32_CKDpub_point},
+    {"bip32_CKDpub_range (10 children)", bench_bip32_CKDpub_range_10},
+    {"crypto_hash160", bench_crypto_hash160},
+    {"crypto_get_compressed_pubkey", bench_crypto_get_compressed_pubkey},
+    {"crypto_get_uncompressed_pubkey", bench_crypto_get_uncompressed_pubkey},
+    {"crypto_tr_tweak_pubkey", bench_crypto_tr_tweak_pubkey},
+    {"crypto_get_checksum", bench_crypto_get_checksum},
+    {"address_encode_base58check", bench_address_encode_base58check},
+    {"address_encode_cashaddr", bench_address_encode_cashaddr},
+};
+
+int main(int argc, char *argv[]) {
+    int n_iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_N_ITERATIONS;
+    if (n_iterations <= 0) {
+        fprintf(stderr, "Usage: %s [n_iterations]\n", argv[0]);
+        return 1;
+    }
+
+    if (crypto_get_uncompressed_pubkey(compressed_key, uncompressed_key) < 0) {
+        fprintf(stderr, "Invalid test vector\n");
+        return 1;
+    }
+    memcpy(xpub.compressed_pubkey, compressed_key, sizeof(compressed_key));
+    memcpy(xpub.chain_code, chain_code, sizeof(chain_code));
+
+    printf("%-36s %14s\n", "function", "ns/op");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        benchmarks[i].fn();  // warm-up
+
+        double start = now_ns();
+        for (int j = 0; j < n_iterations; j++) {
+            benchmarks[i].fn();
+        }
+        double elapsed = now_ns() - start;
+
+        printf("%-36s %14.1f\n", benchmarks[i].name, elapsed / n_iterations);
+    }
+
+    return 0;
+}
@@ -0,0 +1,110 @@
+/**
+ * Microbenchmark of format_amount in format.c, compared with the straightforward formatting with
+ * 64-bit divisions that it replaced, on amounts with different numbers of digits. As for
+ * bench_crypto, only the relative timings are meaningful.
+ *
+ * Usage: bench_format [n_iterations]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common/format.h"
+
+#define DEFAULT_N_ITERATIONS 1000000
+
+static const struct {
+    const char *name;
+    uint64_t amount;
+} amounts[] = {
+    {"1 sat", 1ull},
+    {"0.0123 BTC", 1230000ull},
+    {"21M BTC", 2100000000000000ull},
+    {"UINT64_MAX", 18446744073709551615ull},
+};
+
+static char output[32];
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+// reference implementation: one 64-bit division per digit
+static int ref_format_amount(char *dst, uint64_t value, uint8_t decimals) {
+    char buffer[32];
+    int len = 0;
+    int n_digits = 0;
+    bool nonzero_fraction = false;
+    do {
+        char digit = (char) ('0' + value % 10);
+        value /= 10;
+        if (n_digits < decimals) {
+            if (digit != '0' || nonzero_fraction) {
+                buffer[len++] = digit;
+                nonzero_fraction = true;
+            }
+            if (n_digits == decimals - 1 && nonzero_fraction) {
+                buffer[len++] = '.';
+            }
+        } else {
+            buffer[len++] = digit;
+        }
+        n_digits++;
+    } while (value != 0 || n_digits <= decimals);
+    for (int i = 0; i < len; i++) {
+        dst[i] = buffer[len - 1 - i];
+    }
+    dst[len] = '\0';
+    return len;
+}
+
+static int run_format_amount(size_t i, uint64_t salt) {
+    return format_amount(output, sizeof(output), amounts[i].amount ^ salt, 8);
+}
+
+static int run_ref_format_amount(size_t i, uint64_t salt) {
+    return ref_format_amount(output, amounts[i].amount ^ salt, 8);
+}
+
+static double bench(int (*fn)(size_t, uint64_t), size_t i, int n_iterations) {
+    double start = now_ns();
+    for (int j = 0; j < n_iterations; j++) {
+        // the salt prevents the compiler from hoisting the call out of the loop
+        if (fn(i, (uint64_t) (j & 1)) <= 0) {
+            fprintf(stderr, "Failed formatting: %s\n", amounts[i].name);
+            exit(1);
+        }
+    }
+    return (now_ns() - start) / n_iterations;
+}
+
+int main(int argc, char *argv[]) {
+    int n_iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_N_ITERATIONS;
+    if (n_iterations <= 0) {
+        fprintf(stderr, "Usage: %s [n_iterations]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%14s %14s  %s\n", "ref ns/op", "fast ns/op", "amount");
+    for (size_t i = 0; i < sizeof(amounts) / sizeof(amounts[0]); i++) {
+        double ref_ns = bench(run_ref_format_amount, i, n_iterations);
+        double fast_ns = bench(run_format_amount, i, n_iterations);
+
+        char ref_output[32];
+        ref_format_amount(ref_output, amounts[i].amount, 8);
+        format_amount(output, sizeof(output), amounts[i].amount, 8);
+        if (strcmp(ref_output, output) != 0) {
+            fprintf(stderr, "Mismatch for %s: %s != %s\n", amounts[i].name, ref_output, output);
+            return 1;
+        }
+
+        printf("%14.1f %14.1f  %s\n", ref_ns, fast_ns, amounts[i].name);
+    }
+
+    return 0;
+}
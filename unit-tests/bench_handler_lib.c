@@ -0,0 +1,199 @@
+/**
+ * Microbenchmark of the helpers of the handlers in src/handler/lib, with the client commands
+ * answered in-process by mock_client.c. Besides the time, it reports the number of client commands
+ * and the bytes exchanged for each operation, which are the same as with a real client; therefore,
+ * the effect of a change on the protocol can be measured (and profiled, for example with callgrind)
+ * without running the app in Speculos.
+ *
+ * Usage: bench_handler_lib [n_iterations]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/crypto.h"
+
+#include "../src/common/wallet.h"
+#include "../src/handler/lib/get_merkle_leaf_element.h"
+#include "../src/handler/lib/get_merkle_leaf_hash.h"
+#include "../src/handler/lib/get_merkleized_map_value.h"
+#include "../src/handler/lib/get_preimage.h"
+#include "../src/handler/lib/policy.h"
+
+#include "mock_client.h"
+
+#define DEFAULT_N_ITERATIONS 1000
+
+#define LIST_SIZE 1000
+
+static const char key_info[] =
+    "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8"
+    "upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**";
+
+static dispatcher_context_t dc;
+
+static uint8_t preimage_hash[32];
+static uint8_t list_root[32];
+static uint8_t small_list_root[32];  // the list of the first 256 elements
+static merkleized_map_commitment_t map;
+static uint8_t keys_root[32];
+static uint8_t wpkh_policy[256], tr_policy[256];
+static policy_script_template_t wpkh_template, tr_template;
+static policy_pubkeys_cache_t pubkeys_cache;
+
+static uint32_t counter;
+
+// prevents the compiler from optimizing away the benchmarked computations
+static volatile uint8_t sink;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static void check(int res) {
+    if (res < 0) {
+        fprintf(stderr, "Unexpected failure\n");
+        exit(1);
+    }
+}
+
+static void bench_call_get_preimage(void) {
+    uint8_t out[1001];
+    check(call_get_preimage(&dc, preimage_hash, out, sizeof(out)));
+    sink ^= out[1];
+}
+
+static void bench_call_get_merkle_leaf_element(void) {
+    uint8_t out[64];
+    check(call_get_merkle_leaf_element(&dc, list_root, LIST_SIZE, counter++ % LIST_SIZE, out, 64));
+    sink ^= out[0];
+}
+
+static void bench_call_get_merkle_leaf_hashes(void) {
+    const uint32_t indices[] = {3, 17, 42, 100, 101, 150, 200, 255};
+    uint8_t out[8][32];
+    check(call_get_merkle_leaf_hashes(&dc, small_list_root, 256, 8, indices, out));
+    sink ^= out[7][0];
+}
+
+static void bench_call_get_merkleized_map_value(void) {
+    uint8_t out[1000];
+    check(call_get_merkleized_map_value(&dc, &map, (const uint8_t *) "\x00", 1, out, sizeof(out)));
+    sink ^= out[0];
+}
+
+static void bench_call_get_wallet_script_from_template(const policy_script_template_t *template) {
+    uint8_t script[34];
+    buffer_t script_buf = buffer_create(script, sizeof(script));
+    check(call_get_wallet_script_from_template(&dc,
+                                               template,
+                                               keys_root,
+                                               1,
+                                               &pubkeys_cache,
+                                               false,
+                                               counter++,
+                                               &script_buf));
+    sink ^= script[2];
+}
+
+static void bench_wpkh_script(void) {
+    bench_call_get_wallet_script_from_template(&wpkh_template);
+}
+
+static void bench_tr_script(void) {
+    bench_call_get_wallet_script_from_template(&tr_template);
+}
+
+static void setup(void) {
+    mock_client_init(&dc, 0);
+
+    uint8_t data[1000];
+    memset(data, 0x5a, sizeof(data));
+    mock_client_add_preimage(data, sizeof(data), preimage_hash);
+
+    // a list of LIST_SIZE elements of 1 to 64 bytes; the first 256 ones are also a list
+    uint8_t *elements[LIST_SIZE];
+    size_t lens[LIST_SIZE];
+    for (size_t i = 0; i < LIST_SIZE; i++) {
+        lens[i] = i % 64 + 1;
+        elements[i] = malloc(lens[i]);
+        memset(elements[i], (int) i, lens[i]);
+    }
+    mock_client_add_list((const uint8_t *const *) elements, lens, LIST_SIZE, list_root);
+    mock_client_add_list((const uint8_t *const *) elements, lens, 256, small_list_root);
+    for (size_t i = 0; i < LIST_SIZE; i++) {
+        free(elements[i]);
+    }
+
+    // an input map of a PSBT, with a non-witness UTXO of 1000 bytes
+    const uint8_t *keys[] = {(const uint8_t *) "\x00", (const uint8_t *) "\x01"};
+    const size_t key_lens[] = {1, 1};
+    const uint8_t *values[] = {data, data};
+    const size_t value_lens[] = {sizeof(data), 43};
+    mock_client_add_map(keys, key_lens, values, value_lens, 2, &map);
+
+    mock_client_add_list((const uint8_t *const[]){(const uint8_t *) key_info},
+                         (const size_t[]){strlen(key_info)},
+                         1,
+                         keys_root);
+
+    buffer_t wpkh_buf = buffer_create("wpkh(@0)", 8);
+    buffer_t tr_buf = buffer_create("tr(@0)", 6);
+    if (parse_policy_map(&wpkh_buf, wpkh_policy, sizeof(wpkh_policy)) < 0 ||
+        parse_policy_map(&tr_buf, tr_policy, sizeof(tr_policy)) < 0 ||
+        compile_policy_script_template((const policy_node_t *) wpkh_policy, &wpkh_template) < 0 ||
+        compile_policy_script_template((const policy_node_t *) tr_policy, &tr_template) < 0 ||
+        call_load_policy_pubkeys(&dc, keys_root, 1, &pubkeys_cache) < 0) {
+        fprintf(stderr, "Setup failed\n");
+        exit(1);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} benchmarks[] = {
+    {"call_get_preimage (1000 bytes)", bench_call_get_preimage},
+    {"call_get_merkle_leaf_element", bench_call_get_merkle_leaf_element},
+    {"call_get_merkle_leaf_hashes (8 leaves)", bench_call_get_merkle_leaf_hashes},
+    {"call_get_merkleized_map_value (1000 bytes)", bench_call_get_merkleized_map_value},
+    {"wallet script, wpkh(@0)", bench_wpkh_script},
+    {"wallet script, tr(@0)", bench_tr_script},
+};
+
+int main(int argc, char *argv[]) {
+    int n_iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_N_ITERATIONS;
+    if (n_iterations <= 0) {
+        fprintf(stderr, "Usage: %s [n_iterations]\n", argv[0]);
+        return 1;
+    }
+
+    setup();
+
+    printf("%-44s %14s %12s %12s\n", "function", "ns/op", "commands/op", "bytes/op");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        benchmarks[i].fn();  // warm-up
+
+        mock_client_reset_stats();
+        double start = now_ns();
+        for (int j = 0; j < n_iterations; j++) {
+            benchmarks[i].fn();
+        }
+        double elapsed = now_ns() - start;
+
+        const mock_client_stats_t *stats = mock_client_get_stats();
+        printf("%-44s %14.1f %12.1f %12.1f\n",
+               benchmarks[i].name,
+               elapsed / n_iterations,
+               (double) stats->n_requests / n_iterations,
+               (double) (stats->request_bytes + stats->response_bytes) / n_iterations);
+    }
+
+    mock_client_free();
+    return 0;
+}
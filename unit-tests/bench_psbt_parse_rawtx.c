@@ -0,0 +1,105 @@
+/**
+ * Throughput benchmark of the streaming parser of transactions in psbt_parse_rawtx.c, with the
+ * vectors of rawtx_vectors.h sent by the mock client in chunks of fixed length: the parser is
+ * dominated by the per-chunk overhead for short chunks, and by the hashing for long ones. The txid
+ * of each parse is checked, so that the benchmark also fails if the parser gets broken.
+ *
+ * Usage: bench_psbt_parse_rawtx [n_iterations]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/crypto.h"
+
+#include "../src/handler/lib/psbt_parse_rawtx.h"
+
+#include "mock_client.h"
+#include "rawtx_vectors.h"
+
+#define DEFAULT_N_ITERATIONS 200
+
+#define MAX_TX_LEN 4096
+
+#define N_VECTORS (sizeof(rawtx_vectors) / sizeof(rawtx_vectors[0]))
+
+// 0 is for whole responses, as sent by the clients
+static const uint8_t chunk_lengths[] = {1, 8, 32, 100, 0};
+
+static dispatcher_context_t dc;
+
+static uint8_t tx_hashes[N_VECTORS][32];
+static uint8_t txids[N_VECTORS][32];
+static size_t total_len;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static void setup(void) {
+    mock_client_init(&dc, 0);
+
+    for (size_t i = 0; i < N_VECTORS; i++) {
+        uint8_t tx[MAX_TX_LEN];
+        size_t tx_len = rawtx_vector_decode(&rawtx_vectors[i], tx);
+        mock_client_add_preimage(tx, tx_len, tx_hashes[i]);
+        rawtx_vector_decode_txid(&rawtx_vectors[i], txids[i]);
+        total_len += tx_len;
+    }
+}
+
+static void parse_all(void) {
+    for (size_t i = 0; i < N_VECTORS; i++) {
+        txid_parser_outputs_t outputs;
+        if (call_parse_unsigned_tx(&dc, tx_hashes[i], -1, -1, &outputs) < 0 ||
+            memcmp(outputs.txid, txids[i], 32) != 0) {
+            fprintf(stderr, "%s: parsing failed, or wrong txid\n", rawtx_vectors[i].name);
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int n_iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_N_ITERATIONS;
+    if (n_iterations <= 0) {
+        fprintf(stderr, "Usage: %s [n_iterations]\n", argv[0]);
+        return 1;
+    }
+
+    setup();
+
+    printf("%zu transactions, %zu bytes\n", N_VECTORS, total_len);
+    printf("%-16s %14s %14s %12s\n", "chunk length", "ns/tx", "MB/s", "commands/tx");
+    for (size_t i = 0; i < sizeof(chunk_lengths); i++) {
+        mock_client_set_chunk_lens(&chunk_lengths[i], chunk_lengths[i] != 0 ? 1 : 0);
+        parse_all();  // warm-up
+
+        mock_client_reset_stats();
+        double start = now_ns();
+        for (int j = 0; j < n_iterations; j++) {
+            parse_all();
+        }
+        double elapsed = now_ns() - start;
+
+        const mock_client_stats_t *stats = mock_client_get_stats();
+        char name[16];
+        if (chunk_lengths[i] != 0) {
+            snprintf(name, sizeof(name), "%d", chunk_lengths[i]);
+        } else {
+            snprintf(name, sizeof(name), "whole");
+        }
+        printf("%-16s %14.1f %14.2f %12.1f\n",
+               name,
+               elapsed / ((double) n_iterations * N_VECTORS),
+               (double) total_len * n_iterations / elapsed * 1e3,
+               (double) stats->n_requests / ((double) n_iterations * N_VECTORS));
+    }
+
+    mock_client_free();
+    return 0;
+}
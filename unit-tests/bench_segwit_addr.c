@@ -0,0 +1,81 @@
+/**
+ * Microbenchmark of the encoder of segwit addresses in segwit_addr.c, compared with the
+ * straightforward reference encoder of segwit_addr_ref.h on programs of the sizes used by the
+ * standard scripts. As for bench_crypto, only the relative timings are meaningful.
+ *
+ * Usage: bench_segwit_addr [n_iterations]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common/segwit_addr.h"
+#include "segwit_addr_ref.h"
+
+#define DEFAULT_N_ITERATIONS 1000000
+
+static const struct {
+    const char *name;
+    int witver;
+    size_t witprog_len;
+} programs[] = {
+    {"P2WPKH", 0, 20},
+    {"P2WSH", 0, 32},
+    {"P2TR", 1, 32},
+    {"v16, 40 bytes", 16, 40},
+};
+
+static uint8_t witprog[40];
+static char output[91];
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static int run_segwit_addr_encode(size_t i) {
+    return segwit_addr_encode(output, "bc", programs[i].witver, witprog, programs[i].witprog_len);
+}
+
+static int run_ref_segwit_addr_encode(size_t i) {
+    ref_segwit_addr_encode(output, "bc", programs[i].witver, witprog, programs[i].witprog_len);
+    return 1;
+}
+
+static double bench(int (*fn)(size_t), size_t i, int n_iterations) {
+    double start = now_ns();
+    for (int j = 0; j < n_iterations; j++) {
+        witprog[0] = (uint8_t) j;  // prevents the compiler from hoisting the call out of the loop
+        if (fn(i) != 1) {
+            fprintf(stderr, "Failed encoding: %s\n", programs[i].name);
+            exit(1);
+        }
+    }
+    return (now_ns() - start) / n_iterations;
+}
+
+int main(int argc, char *argv[]) {
+    int n_iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_N_ITERATIONS;
+    if (n_iterations <= 0) {
+        fprintf(stderr, "Usage: %s [n_iterations]\n", argv[0]);
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(witprog); i++) {
+        witprog[i] = (uint8_t) (i * 37 + 11);
+    }
+
+    printf("%14s %14s  %s\n", "ref ns/op", "fast ns/op", "program");
+    for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+        double ref_ns = bench(run_ref_segwit_addr_encode, i, n_iterations);
+        double fast_ns = bench(run_segwit_addr_encode, i, n_iterations);
+
+        printf("%14.1f %14.1f  %s\n", ref_ns, fast_ns, programs[i].name);
+    }
+
+    return 0;
+}
@@ -0,0 +1,116 @@
+/**
+ * Microbenchmark of the parsers of the policy maps in wallet.c: the parser of the textual encoding
+ * and the decoder of the binary encoding are compared on the same policies, up to
+ * MAX_POLICY_MAP_STR_LENGTH characters. As for bench_crypto, only the relative timings are
+ * meaningful.
+ *
+ * Usage: bench_wallet [n_iterations]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common/wallet.h"
+
+#define DEFAULT_N_ITERATIONS 100000
+
+// clang-format off
+static const struct {
+    const char *policy;
+    uint8_t encoding[MAX_POLICY_MAP_STR_LENGTH];
+    size_t encoding_len;
+} policies[] = {
+    {
+        "wpkh(@0)",
+        {0x03, 0x00},
+        2
+    },
+    {
+        "wsh(or_d(multi(2,@0,@1),and_v(v:pkh(@2),older(52560))))",
+        {0x01, 0x18, 0x04, 0x02, 0x02, 0x00, 0x01, 0x13, 0x20, 0x02, 0x02, 0x0c, 0x50, 0xcd, 0x00,
+         0x00},
+        16
+    },
+    {
+        "sh(wsh(sortedmulti(15,@0,@1,@2,@3,@4,@5,@6,@7,@8,@9,@10,@11,@12,@13,@14)))",
+        {0x00, 0x01, 0x05, 0x0f, 0x0f, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
+         0x0a, 0x0b, 0x0c, 0x0d, 0x0e},
+        20
+    },
+    {
+        "tr(@0,{{pk(@1),pk(@2)},{and_v(v:pk(@3),older(144)),and_v(v:pk(@4),after(1767225600))}})",
+        {0x06, 0x00, 0x01, 0x01, 0x01, 0x00, 0x09, 0x01, 0x00, 0x09, 0x02, 0x01, 0x00, 0x13, 0x20,
+         0x09, 0x03, 0x0c, 0x90, 0x00, 0x00, 0x00, 0x00, 0x13, 0x20, 0x09, 0x04, 0x0d, 0x00, 0xb9,
+         0x55, 0x69},
+        32
+    },
+    {
+        "wsh(andor(pk(@0),after(1767225600),and_v(v:pk(@1),"
+        "hash160(0123456789abcdef0123456789abcdef01234567))))",
+        {0x01, 0x12, 0x09, 0x00, 0x0d, 0x00, 0xb9, 0x55, 0x69, 0x13, 0x20, 0x09, 0x01, 0x11, 0x01,
+         0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef,
+         0x01, 0x23, 0x45, 0x67},
+        34
+    },
+};
+// clang-format on
+
+// the memory used by the parsed policies; on the host, the nodes are larger than in the app
+static uint8_t out[4 * MAX_POLICY_MAP_BYTES] __attribute__((aligned(4)));
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static int run_parse_policy_map(size_t i) {
+    buffer_t in_buf = buffer_create((void *) policies[i].policy, strlen(policies[i].policy));
+    return parse_policy_map(&in_buf, out, sizeof(out));
+}
+
+static int run_decode_policy_map(size_t i) {
+    buffer_t in_buf = buffer_create((void *) policies[i].encoding, policies[i].encoding_len);
+    return decode_policy_map(&in_buf, out, sizeof(out));
+}
+
+static double bench(int (*fn)(size_t), size_t i, int n_iterations) {
+    double start = now_ns();
+    for (int j = 0; j < n_iterations; j++) {
+        if (fn(i) < 0) {
+            fprintf(stderr, "Failed parsing: %s\n", policies[i].policy);
+            exit(1);
+        }
+    }
+    return (now_ns() - start) / n_iterations;
+}
+
+int main(int argc, char *argv[]) {
+    int n_iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_N_ITERATIONS;
+    if (n_iterations <= 0) {
+        fprintf(stderr, "Usage: %s [n_iterations]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%5s %5s %14s %14s  %s\n", "chars", "bytes", "text ns/op", "binary ns/op", "policy");
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strlen(policies[i].policy) > MAX_POLICY_MAP_STR_LENGTH) {
+            continue;  // not supported on this device
+        }
+
+        double text_ns = bench(run_parse_policy_map, i, n_iterations);
+        double binary_ns = bench(run_decode_policy_map, i, n_iterations);
+
+        printf("%5zu %5zu %14.1f %14.1f  %s\n",
+               strlen(policies[i].policy),
+               policies[i].encoding_len,
+               text_ns,
+               binary_ns,
+               policies[i].policy);
+    }
+
+    return 0;
+}
@@ -0,0 +1,234 @@
+/**
+ * Fuzzer of the streaming parser of transactions in psbt_parse_rawtx.c. The parser receives the
+ * bytes of the transaction in the chunks sent by the client, that can have any length: each input
+ * is parsed both with the chunk lengths chosen by the fuzzer and with whole responses, and the
+ * results must be the same (besides, of course, not crashing).
+ *
+ * The input of the fuzzer is:
+ * - 1 byte: the number n of chunk lengths (modulo 16);
+ * - 1 byte: the queried input (modulo 8, minus 1; that is, -1 for no input);
+ * - 1 byte: the queried output (modulo 8, minus 1);
+ * - n bytes: the lengths of the chunks, repeated cyclically;
+ * - the serialized transaction.
+ *
+ * Usage:
+ * - built with -DFUZZ=ON and clang, it is a libFuzzer target: fuzz_psbt_parse_rawtx [corpus_dir];
+ * - otherwise, fuzz_psbt_parse_rawtx file... runs the given inputs (for example, with AFL);
+ * - fuzz_psbt_parse_rawtx --write-corpus dir writes inputs made from the vectors of
+ *   rawtx_vectors.h, as an initial corpus;
+ * - without arguments, the vectors are parsed with all the chunk lengths and with random chunks,
+ *   and the txids are checked; this is the mode run by ctest.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/crypto.h"
+
+#include "../src/handler/lib/psbt_parse_rawtx.h"
+
+#include "mock_client.h"
+#include "rawtx_vectors.h"
+
+#define MAX_TX_LEN 4096
+
+#define HEADER_LEN 3
+
+static dispatcher_context_t dc;
+
+static int parse(const uint8_t *tx,
+                 size_t tx_len,
+                 const uint8_t *chunk_lens,
+                 size_t n_chunk_lens,
+                 int input_index,
+                 int output_index,
+                 txid_parser_outputs_t *outputs) {
+    uint8_t hash[32];
+    mock_client_init(&dc, 0);
+    mock_client_add_preimage(tx, tx_len, hash);
+    mock_client_set_chunk_lens(chunk_lens, n_chunk_lens);
+
+    memset(outputs, 0, sizeof(txid_parser_outputs_t));
+    return call_parse_unsigned_tx(&dc, hash, input_index, output_index, outputs) < 0 ? -1 : 0;
+}
+
+// Parses the transaction with the given chunks and with whole responses, and aborts if the results
+// differ. Returns the result of the parsing.
+static int check_chunking_invariance(const uint8_t *tx,
+                                     size_t tx_len,
+                                     const uint8_t *chunk_lens,
+                                     size_t n_chunk_lens,
+                                     int input_index,
+                                     int output_index,
+                                     txid_parser_outputs_t *outputs) {
+    txid_parser_outputs_t expected;
+    int expected_res = parse(tx, tx_len, NULL, 0, input_index, output_index, &expected);
+    int res = parse(tx, tx_len, chunk_lens, n_chunk_lens, input_index, output_index, outputs);
+
+    if (res != expected_res || (res == 0 && memcmp(outputs, &expected, sizeof(expected)) != 0)) {
+        fprintf(stderr, "The result depends on the chunks: %d with %zu chunk lengths, %d without\n",
+                res,
+                n_chunk_lens,
+                expected_res);
+        abort();
+    }
+    return res;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size < HEADER_LEN) {
+        return 0;
+    }
+    size_t n_chunk_lens = data[0] % 16;
+    int input_index = (int) (data[1] % 8) - 1;
+    int output_index = (int) (data[2] % 8) - 1;
+    if (size < HEADER_LEN + n_chunk_lens) {
+        return 0;
+    }
+
+    const uint8_t *tx = data + HEADER_LEN + n_chunk_lens;
+    size_t tx_len = size - HEADER_LEN - n_chunk_lens;
+    if (tx_len > MAX_TX_LEN) {
+        return 0;
+    }
+
+    txid_parser_outputs_t outputs;
+    check_chunking_invariance(tx,
+                              tx_len,
+                              data + HEADER_LEN,
+                              n_chunk_lens,
+                              input_index,
+                              output_index,
+                              &outputs);
+    return 0;
+}
+
+#ifndef HAVE_LIBFUZZER
+
+static bool check_vector(const rawtx_vector_t *vector,
+                         const uint8_t *chunk_lens,
+                         size_t n_chunk_lens) {
+    uint8_t tx[MAX_TX_LEN], txid[32];
+    size_t tx_len = rawtx_vector_decode(vector, tx);
+    rawtx_vector_decode_txid(vector, txid);
+
+    txid_parser_outputs_t outputs;
+    if (check_chunking_invariance(tx, tx_len, chunk_lens, n_chunk_lens, -1, -1, &outputs) < 0 ||
+        memcmp(outputs.txid, txid, 32) != 0) {
+        fprintf(stderr, "%s: parsing failed, or wrong txid\n", vector->name);
+        return false;
+    }
+
+    // all the inputs and outputs can be queried, and no other one
+    const int n_inputs = (int) outputs.n_inputs, n_outputs = (int) outputs.n_outputs;
+    for (int input_index = -1; input_index <= n_inputs; input_index++) {
+        for (int output_index = -1; output_index <= n_outputs; output_index++) {
+            int res = check_chunking_invariance(tx,
+                                                tx_len,
+                                                chunk_lens,
+                                                n_chunk_lens,
+                                                input_index,
+                                                output_index,
+                                                &outputs);
+            bool exists = input_index < n_inputs && output_index < n_outputs;
+            if ((res == 0) != exists || (res == 0 && memcmp(outputs.txid, txid, 32) != 0)) {
+                fprintf(stderr,
+                        "%s: wrong result querying the input %d and the output %d\n",
+                        vector->name,
+                        input_index,
+                        output_index);
+                return false;
+            }
+        }
+    }
+
+    // any truncated transaction is rejected
+    for (size_t len = 0; len < tx_len; len += 1 + len / 8) {
+        if (check_chunking_invariance(tx, len, chunk_lens, n_chunk_lens, -1, -1, &outputs) == 0) {
+            fprintf(stderr, "%s: truncated transaction of %zu bytes accepted\n", vector->name, len);
+            return false;
+        }
+    }
+    return true;
+}
+
+static int run_vectors(void) {
+    const size_t n_vectors = sizeof(rawtx_vectors) / sizeof(rawtx_vectors[0]);
+
+    srand(0);
+    for (size_t i = 0; i < n_vectors; i++) {
+        // all the single chunk lengths, then random chunks
+        for (int len = 1; len <= 253; len++) {
+            const uint8_t chunk_len = (uint8_t) len;
+            if (!check_vector(&rawtx_vectors[i], &chunk_len, 1)) {
+                return 1;
+            }
+        }
+        for (int k = 0; k < 50; k++) {
+            uint8_t chunk_lens[16];
+            size_t n_chunk_lens = 1 + rand() % 16;
+            for (size_t j = 0; j < n_chunk_lens; j++) {
+                chunk_lens[j] = (uint8_t) (1 + rand() % (k < 25 ? 40 : 253));
+            }
+            if (!check_vector(&rawtx_vectors[i], chunk_lens, n_chunk_lens)) {
+                return 1;
+            }
+        }
+    }
+
+    printf("%zu transactions parsed consistently with all the chunk lengths\n", n_vectors);
+    return 0;
+}
+
+static int write_corpus(const char *dir) {
+    for (size_t i = 0; i < sizeof(rawtx_vectors) / sizeof(rawtx_vectors[0]); i++) {
+        uint8_t input[HEADER_LEN + 3 + MAX_TX_LEN] = {3, 1, 2, 1, 31, 200};
+        // 3 chunk lengths, the input 0 and the output 1
+        size_t len = HEADER_LEN + 3;
+        len += rawtx_vector_decode(&rawtx_vectors[i], input + len);
+
+        char path[512];
+        snprintf(path, sizeof(path), "%s/vector_%zu", dir, i);
+        FILE *f = fopen(path, "wb");
+        if (f == NULL || fwrite(input, 1, len, f) != len) {
+            fprintf(stderr, "Cannot write %s\n", path);
+            return 1;
+        }
+        fclose(f);
+    }
+    return 0;
+}
+
+static int run_file(const char *path) {
+    static uint8_t data[HEADER_LEN + 16 + MAX_TX_LEN];
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        return 1;
+    }
+    size_t size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+
+    LLVMFuzzerTestOneInput(data, size);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int res = 0;
+    if (argc == 1) {
+        res = run_vectors();
+    } else if (argc == 3 && strcmp(argv[1], "--write-corpus") == 0) {
+        res = write_corpus(argv[2]);
+    } else {
+        for (int i = 1; i < argc && res == 0; i++) {
+            res = run_file(argv[i]);
+        }
+    }
+    mock_client_free();
+    return res;
+}
+
+#endif
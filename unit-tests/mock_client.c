@@ -0,0 +1,658 @@
+/**
+ * In-process implementation of the client commands for the host builds of src/handler/lib; see
+ * mock_client.h. The responses have the same content and are split in the same way as the ones of
+ * ClientCommandInterpreter in the Python client, with a maximum response length of
+ * MOCK_CLIENT_MAX_RESPONSE_LEN.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mock_client.h"
+
+#include "boilerplate/sw.h"
+#include "common/buffer.h"
+#include "common/merkle.h"
+#include "common/varint.h"
+#include "handler/client_commands.h"
+
+// the APDU buffer, holding either the request of the app or the response of the client
+#define APDU_BUFFER_SIZE (5 + 255)
+
+// a preimage of an element hash, including the 0x00 prefix
+typedef struct {
+    uint8_t hash[32];
+    uint8_t *data;
+    size_t len;
+} preimage_t;
+
+// a Merkle tree, with the hashes of all its levels; the last hash of a level without a sibling is
+// moved up unchanged, like in MerkleTree in the Python client
+typedef struct {
+    size_t size;
+    uint8_t n_levels;
+    size_t level_sizes[33];
+    uint8_t (*levels[33])[32];
+} tree_t;
+
+// the bytes of the responses to GET_MORE_ELEMENTS: elements of element_len bytes, except for the
+// last one that might be shorter; the chunks of a byte stream can instead be split as set with
+// mock_client_set_chunk_lens
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t offset;
+    size_t element_len;
+    bool is_byte_stream;
+} queue_t;
+
+static uint8_t G_apdu[APDU_BUFFER_SIZE];
+static size_t G_apdu_len;
+static uint16_t G_sw;
+
+static preimage_t *G_preimages;
+static size_t G_n_preimages;
+static tree_t *G_trees;
+static size_t G_n_trees;
+static queue_t G_queue;
+static mock_client_stats_t G_stats;
+static uint8_t G_chunk_lens[256];
+static size_t G_n_chunk_lens;
+static size_t G_chunk_index;
+
+/* ----------------------------------- known data ----------------------------------- */
+
+static const preimage_t *find_preimage(const uint8_t hash[static 32]) {
+    for (size_t i = 0; i < G_n_preimages; i++) {
+        if (memcmp(G_preimages[i].hash, hash, 32) == 0) {
+            return &G_preimages[i];
+        }
+    }
+    return NULL;
+}
+
+static const tree_t *find_tree(const uint8_t root[static 32]) {
+    for (size_t i = 0; i < G_n_trees; i++) {
+        const tree_t *tree = &G_trees[i];
+        if (memcmp(tree->levels[tree->n_levels - 1][0], root, 32) == 0) {
+            return tree;
+        }
+    }
+    return NULL;
+}
+
+void mock_client_add_preimage(const uint8_t *data, size_t data_len, uint8_t hash[32]) {
+    G_preimages = realloc(G_preimages, (G_n_preimages + 1) * sizeof(preimage_t));
+    preimage_t *preimage = &G_preimages[G_n_preimages++];
+
+    preimage->len = data_len + 1;
+    preimage->data = malloc(preimage->len);
+    preimage->data[0] = 0x00;
+    memcpy(preimage->data + 1, data, data_len);
+    merkle_compute_element_hash(data, data_len, preimage->hash);
+
+    if (hash != NULL) {
+        memcpy(hash, preimage->hash, 32);
+    }
+}
+
+void mock_client_add_list(const uint8_t *const elements[],
+                          const size_t element_lens[],
+                          size_t n_elements,
+                          uint8_t root[static 32]) {
+    if (n_elements == 0) {
+        memset(root, 0, 32);  // the root of the empty tree; there is nothing to prove
+        return;
+    }
+
+    G_trees = realloc(G_trees, (G_n_trees + 1) * sizeof(tree_t));
+    tree_t *tree = &G_trees[G_n_trees++];
+
+    tree->size = n_elements;
+    tree->levels[0] = malloc(n_elements * 32);
+    tree->level_sizes[0] = n_elements;
+    for (size_t i = 0; i < n_elements; i++) {
+        mock_client_add_preimage(elements[i], element_lens[i], tree->levels[0][i]);
+    }
+
+    tree->n_levels = 1;
+    while (tree->level_sizes[tree->n_levels - 1] > 1) {
+        size_t prev_size = tree->level_sizes[tree->n_levels - 1];
+        uint8_t(*prev)[32] = tree->levels[tree->n_levels - 1];
+        size_t size = (prev_size + 1) / 2;
+        uint8_t(*level)[32] = malloc(size * 32);
+        for (size_t i = 0; i < prev_size / 2; i++) {
+            merkle_combine_hashes(prev[2 * i], prev[2 * i + 1], level[i]);
+        }
+        if (prev_size % 2 == 1) {
+            memcpy(level[size - 1], prev[prev_size - 1], 32);
+        }
+        tree->levels[tree->n_levels] = level;
+        tree->level_sizes[tree->n_levels] = size;
+        ++tree->n_levels;
+    }
+
+    memcpy(root, tree->levels[tree->n_levels - 1][0], 32);
+}
+
+void mock_client_add_map(const uint8_t *const keys[],
+                         const size_t key_lens[],
+                         const uint8_t *const values[],
+                         const size_t value_lens[],
+                         size_t n_keys,
+                         merkleized_map_commitment_t *out) {
+    memset(out, 0, sizeof(merkleized_map_commitment_t));
+    out->size = n_keys;
+    mock_client_add_list(keys, key_lens, n_keys, out->keys_root);
+    mock_client_add_list(values, value_lens, n_keys, out->values_root);
+}
+
+// Returns the number of hashes written in out, that must have room for 32 of them.
+static size_t prove_leaf(const tree_t *tree, size_t index, uint8_t out[][32]) {
+    size_t n = 0;
+    for (uint8_t level = 0; level + 1 < tree->n_levels; level++) {
+        size_t sibling = index ^ 1;
+        if (sibling < tree->level_sizes[level]) {
+            memcpy(out[n++], tree->levels[level][sibling], 32);
+        }
+        index >>= 1;
+    }
+    return n;
+}
+
+// Appends to out the hashes of the multiproof of the leaves of the subtree with the given first
+// leaf and size; returns the position in indices of the first leaf after the subtree.
+static size_t prove_leaves(const tree_t *tree,
+                           size_t begin,
+                           size_t size,
+                           const uint64_t indices[],
+                           size_t n_indices,
+                           size_t pos,
+                           uint8_t out[][32],
+                           size_t *n_out) {
+    bool has_leaf = pos < n_indices && indices[pos] < begin + size;
+    if (size == 1 || !has_leaf) {
+        uint8_t height = ceil_lg((uint32_t) size);
+        memcpy(out[(*n_out)++], tree->levels[height][begin >> height], 32);
+        return has_leaf ? pos + 1 : pos;
+    }
+
+    size_t left_size = (size_t) 1 << (ceil_lg((uint32_t) size) - 1);
+    pos = prove_leaves(tree, begin, left_size, indices, n_indices, pos, out, n_out);
+    return prove_leaves(tree, begin + left_size, size - left_size, indices, n_indices, pos, out, n_out);
+}
+
+/* ----------------------------------- responses ----------------------------------- */
+
+static bool queue_bytes(const uint8_t *data, size_t len, size_t element_len, bool is_byte_stream) {
+    if (len == 0) {
+        return true;
+    }
+    if (G_queue.offset < G_queue.len) {
+        return false;  // like the clients, a command cannot be executed before the queue is empty
+    }
+    free(G_queue.data);
+    G_queue.data = malloc(len);
+    memcpy(G_queue.data, data, len);
+    G_queue.len = len;
+    G_queue.offset = 0;
+    G_queue.element_len = element_len;
+    G_queue.is_byte_stream = is_byte_stream;
+    return true;
+}
+
+// Returns the length of the next chunk of a byte stream, at most max_len.
+static size_t next_chunk_len(size_t max_len) {
+    if (G_n_chunk_lens == 0) {
+        return max_len;
+    }
+    size_t len = G_chunk_lens[G_chunk_index++ % G_n_chunk_lens];
+    return len < max_len ? len : max_len;
+}
+
+// Writes the header, the number of hashes, and as many of them as fit in the response; the other
+// ones are queued for GET_MORE_ELEMENTS.
+static bool pack_hashes(buffer_t *out,
+                        const uint8_t *header,
+                        size_t header_len,
+                        const uint8_t hashes[][32],
+                        size_t n_hashes) {
+    size_t n_response = (MOCK_CLIENT_MAX_RESPONSE_LEN - header_len - 2) / 32;
+    if (n_response > n_hashes) {
+        n_response = n_hashes;
+    }
+    return queue_bytes(hashes[n_response], 32 * (n_hashes - n_response), 32, false) &&
+           buffer_write_bytes(out, header, header_len) &&
+           buffer_write_u8(out, (uint8_t) n_hashes) && buffer_write_u8(out, (uint8_t) n_response) &&
+           buffer_write_bytes(out, hashes[0], 32 * n_response);
+}
+
+// Writes the length of data, and as many of its bytes as fit in the response; the other ones are
+// queued for GET_MORE_ELEMENTS, in chunks that fill whole responses.
+static bool pack_bytes(buffer_t *out, const uint8_t *data, size_t len) {
+    size_t payload_len = next_chunk_len(MOCK_CLIENT_MAX_RESPONSE_LEN - varint_size(len) - 1);
+    if (payload_len > len) {
+        payload_len = len;
+    }
+    return queue_bytes(data + payload_len,
+                       len - payload_len,
+                       MOCK_CLIENT_MAX_RESPONSE_LEN - 2,
+                       true) &&
+           buffer_write_varint(out, len) && buffer_write_u8(out, (uint8_t) payload_len) &&
+           buffer_write_bytes(out, data, payload_len);
+}
+
+static bool get_more_elements(buffer_t *out) {
+    size_t remaining = G_queue.len - G_queue.offset;
+    if (remaining == 0) {
+        return false;
+    }
+
+    size_t element_len, n_elements;
+    if (G_queue.is_byte_stream && G_n_chunk_lens > 0) {
+        // a single element with the next chunk
+        element_len = next_chunk_len(MIN(remaining, MOCK_CLIENT_MAX_RESPONSE_LEN - 2));
+        n_elements = 1;
+    } else if (remaining >= G_queue.element_len) {
+        element_len = G_queue.element_len;
+        n_elements = (MOCK_CLIENT_MAX_RESPONSE_LEN - 2) / element_len;
+        if (n_elements > remaining / element_len) {
+            n_elements = remaining / element_len;
+        }
+    } else {
+        // the last, shorter element is sent alone
+        element_len = remaining;
+        n_elements = 1;
+    }
+
+    const uint8_t *payload = G_queue.data + G_queue.offset;
+    G_queue.offset += n_elements * element_len;
+    return buffer_write_u8(out, (uint8_t) n_elements) && buffer_write_u8(out, (uint8_t) element_len) &&
+           buffer_write_bytes(out, payload, n_elements * element_len);
+}
+
+static bool get_preimage(buffer_t *req, buffer_t *out) {
+    uint8_t hash_type, hash[32];
+    if (!buffer_read_u8(req, &hash_type) || hash_type != 0 || !buffer_read_bytes(req, hash, 32)) {
+        return false;
+    }
+    const preimage_t *preimage = find_preimage(hash);
+    return preimage != NULL && pack_bytes(out, preimage->data, preimage->len);
+}
+
+static bool get_merkle_leaf_proof(buffer_t *req, buffer_t *out) {
+    uint8_t root[32];
+    uint64_t tree_size, leaf_index;
+    if (!buffer_read_bytes(req, root, 32) || !buffer_read_varint(req, &tree_size) ||
+        !buffer_read_varint(req, &leaf_index)) {
+        return false;
+    }
+    const tree_t *tree = find_tree(root);
+    if (tree == NULL || tree->size != tree_size || leaf_index >= tree_size) {
+        return false;
+    }
+
+    uint8_t proof[32][32];
+    size_t proof_size = prove_leaf(tree, leaf_index, proof);
+    return pack_hashes(out, tree->levels[0][leaf_index], 32, (const uint8_t(*)[32]) proof, proof_size);
+}
+
+static bool get_merkle_leaf_partial_proof(buffer_t *req, buffer_t *out) {
+    uint8_t root[32], n_proof_elements;
+    uint64_t tree_size, leaf_index;
+    if (!buffer_read_bytes(req, root, 32) || !buffer_read_varint(req, &tree_size) ||
+        !buffer_read_varint(req, &leaf_index) || !buffer_read_u8(req, &n_proof_elements)) {
+        return false;
+    }
+    const tree_t *tree = find_tree(root);
+    if (tree == NULL || tree->size != tree_size || leaf_index >= tree_size) {
+        return false;
+    }
+
+    // only the first n_proof_elements of the proof, the closest to the leaf
+    uint8_t proof[32][32];
+    size_t proof_size = prove_leaf(tree, leaf_index, proof);
+    if (n_proof_elements > proof_size) {
+        return false;
+    }
+    return pack_hashes(out,
+                       tree->levels[0][leaf_index],
+                       32,
+                       (const uint8_t(*)[32]) proof,
+                       n_proof_elements);
+}
+
+static bool get_merkle_leaf_index(buffer_t *req, buffer_t *out) {
+    uint8_t root[32], leaf_hash[32];
+    if (!buffer_read_bytes(req, root, 32) || !buffer_read_bytes(req, leaf_hash, 32)) {
+        return false;
+    }
+    const tree_t *tree = find_tree(root);
+    if (tree == NULL) {
+        return false;
+    }
+
+    for (size_t i = 0; i < tree->size; i++) {
+        if (memcmp(tree->levels[0][i], leaf_hash, 32) == 0) {
+            return buffer_write_u8(out, 1) && buffer_write_varint(out, i);
+        }
+    }
+    return buffer_write_u8(out, 0) && buffer_write_varint(out, 0);
+}
+
+static bool get_merkle_multiproof(buffer_t *req, buffer_t *out) {
+    uint8_t root[32], n_leaves;
+    uint64_t tree_size, indices[256];
+    if (!buffer_read_bytes(req, root, 32) || !buffer_read_varint(req, &tree_size) ||
+        !buffer_read_u8(req, &n_leaves) || n_leaves == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < n_leaves; i++) {
+        if (!buffer_read_varint(req, &indices[i]) || indices[i] >= tree_size ||
+            (i > 0 && indices[i] <= indices[i - 1])) {
+            return false;
+        }
+    }
+    const tree_t *tree = find_tree(root);
+    if (tree == NULL || tree->size != tree_size) {
+        return false;
+    }
+
+    // at most one hash per leaf and per level of the tree
+    uint8_t(*hashes)[32] = malloc((size_t) n_leaves * (tree->n_levels + 1) * 32);
+    size_t n_hashes = 0;
+    prove_leaves(tree, 0, tree->size, indices, n_leaves, 0, hashes, &n_hashes);
+    bool result = pack_hashes(out, NULL, 0, (const uint8_t(*)[32]) hashes, n_hashes);
+    free(hashes);
+    return result;
+}
+
+// Appends n bytes to the dynamically allocated *data, of length *len.
+static void append(uint8_t **data, size_t *len, const void *bytes, size_t n) {
+    *data = realloc(*data, *len + n);
+    memcpy(*data + *len, bytes, n);
+    *len += n;
+}
+
+static void append_varint(uint8_t **data, size_t *len, uint64_t value) {
+    uint8_t varint[9];
+    append(data, len, varint, varint_write(varint, 0, value));
+}
+
+static bool get_merkleized_map_value(buffer_t *req, buffer_t *out) {
+    uint8_t keys_root[32], values_root[32], key_hash[32];
+    uint64_t map_size, index_hint;
+    if (!buffer_read_bytes(req, keys_root, 32) || !buffer_read_bytes(req, values_root, 32) ||
+        !buffer_read_varint(req, &map_size) || !buffer_read_bytes(req, key_hash, 32)) {
+        return false;
+    }
+    bool has_index_hint = buffer_can_read(req, 1);
+    if (has_index_hint && !buffer_read_varint(req, &index_hint)) {
+        return false;
+    }
+
+    const tree_t *keys_tree = find_tree(keys_root);
+    const tree_t *values_tree = find_tree(values_root);
+    if (keys_tree == NULL || values_tree == NULL || keys_tree->size != map_size ||
+        values_tree->size != map_size) {
+        return false;
+    }
+
+    size_t index = map_size;
+    if (has_index_hint) {
+        if (index_hint >= map_size || memcmp(keys_tree->levels[0][index_hint], key_hash, 32) != 0) {
+            return false;
+        }
+        index = index_hint;
+    } else {
+        for (size_t i = 0; i < map_size; i++) {
+            if (memcmp(keys_tree->levels[0][i], key_hash, 32) == 0) {
+                index = i;
+                break;
+            }
+        }
+    }
+
+    uint8_t *response = NULL;
+    size_t response_len = 0;
+    if (index == map_size) {
+        append(&response, &response_len, "\x00", 1);
+    } else {
+        const preimage_t *value = find_preimage(values_tree->levels[0][index]);
+        if (value == NULL) {
+            return false;
+        }
+        uint8_t value_proof[32][32], key_proof[32][32];
+        size_t proof_size = prove_leaf(values_tree, index, value_proof);
+
+        append(&response, &response_len, "\x01", 1);
+        append_varint(&response, &response_len, index);
+        append(&response, &response_len, &(uint8_t){(uint8_t) proof_size}, 1);
+        if (!has_index_hint) {
+            // the proof for the key is not needed if the device already knows its index
+            append(&response, &response_len, key_proof, 32 * prove_leaf(keys_tree, index, key_proof));
+        }
+        append_varint(&response, &response_len, value->len - 1);
+        append(&response, &response_len, value->data + 1, value->len - 1);
+        append(&response, &response_len, value_proof, 32 * proof_size);
+    }
+
+    bool result = pack_bytes(out, response, response_len);
+    free(response);
+    return result;
+}
+
+static bool stream_merkle_leaves(buffer_t *req, buffer_t *out) {
+    uint8_t root[32];
+    uint64_t tree_size;
+    if (!buffer_read_bytes(req, root, 32) || !buffer_read_varint(req, &tree_size)) {
+        return false;
+    }
+    const tree_t *tree = find_tree(root);
+    if (tree == NULL || tree->size != tree_size) {
+        return false;
+    }
+
+    // concatenation of all the leaves, each prefixed by its length (without the 0x00 prefix)
+    uint8_t *stream = NULL;
+    size_t stream_len = 0;
+    for (size_t i = 0; i < tree->size; i++) {
+        const preimage_t *leaf = find_preimage(tree->levels[0][i]);
+        if (leaf == NULL) {
+            free(stream);
+            return false;
+        }
+        append_varint(&stream, &stream_len, leaf->len - 1);
+        append(&stream, &stream_len, leaf->data + 1, leaf->len - 1);
+    }
+
+    bool result = pack_bytes(out, stream, stream_len);
+    free(stream);
+    return result;
+}
+
+static bool get_preimages(buffer_t *req, buffer_t *out) {
+    uint8_t n_hashes;
+    if (!buffer_read_u8(req, &n_hashes) || n_hashes == 0 || n_hashes > MAX_GET_PREIMAGES_HASHES) {
+        return false;
+    }
+
+    // concatenation of the preimages, each prefixed by its length (including the 0x00 prefix)
+    uint8_t *stream = NULL;
+    size_t stream_len = 0;
+    for (size_t i = 0; i < n_hashes; i++) {
+        uint8_t hash[32];
+        const preimage_t *preimage;
+        if (!buffer_read_bytes(req, hash, 32) || (preimage = find_preimage(hash)) == NULL) {
+            free(stream);
+            return false;
+        }
+        append_varint(&stream, &stream_len, preimage->len);
+        append(&stream, &stream_len, preimage->data, preimage->len);
+    }
+
+    bool result = pack_bytes(out, stream, stream_len);
+    free(stream);
+    return result;
+}
+
+// Executes the request in G_apdu, and replaces it with the response.
+static bool execute(size_t request_len) {
+    uint8_t request[APDU_BUFFER_SIZE];
+    memcpy(request, G_apdu, request_len);
+
+    buffer_t req = buffer_create(request, request_len);
+    buffer_t out = buffer_create(G_apdu, MOCK_CLIENT_MAX_RESPONSE_LEN);
+
+    uint8_t code;
+    if (!buffer_read_u8(&req, &code)) {
+        return false;
+    }
+
+    bool result;
+    switch (code) {
+        case CCMD_YIELD:
+            result = true;  // the results are not recorded
+            break;
+        case CCMD_GET_PREIMAGE:
+            result = get_preimage(&req, &out);
+            break;
+        case CCMD_GET_MERKLE_LEAF_PROOF:
+            result = get_merkle_leaf_proof(&req, &out);
+            break;
+        case CCMD_GET_MERKLE_LEAF_PARTIAL_PROOF:
+            result = get_merkle_leaf_partial_proof(&req, &out);
+            break;
+        case CCMD_GET_MERKLE_LEAF_INDEX:
+            result = get_merkle_leaf_index(&req, &out);
+            break;
+        case CCMD_GET_MERKLE_MULTIPROOF:
+            result = get_merkle_multiproof(&req, &out);
+            break;
+        case CCMD_GET_MERKLEIZED_MAP_VALUE:
+            result = get_merkleized_map_value(&req, &out);
+            break;
+        case CCMD_STREAM_MERKLE_LEAVES:
+            result = stream_merkle_leaves(&req, &out);
+            break;
+        case CCMD_GET_PREIMAGES:
+            result = get_preimages(&req, &out);
+            break;
+        case CCMD_GET_MORE_ELEMENTS:
+            result = get_more_elements(&out);
+            break;
+        default:
+            result = false;
+    }
+
+    // the requests must be consumed entirely, except for YIELD
+    if (!result || (code != CCMD_YIELD && buffer_can_read(&req, 1))) {
+        return false;
+    }
+
+    ++G_stats.n_requests;
+    ++G_stats.n_commands[code];
+    G_stats.request_bytes += request_len;
+    G_stats.response_bytes += out.offset;
+    G_apdu_len = out.offset;
+    return true;
+}
+
+/* ----------------------------------- dispatcher ----------------------------------- */
+
+static void mock_add_to_response(const void *rdata, size_t rdata_len) {
+    if (G_apdu_len + rdata_len > APDU_BUFFER_SIZE - 2) {
+        G_sw = SW_BAD_STATE;
+        return;
+    }
+    // the data might already be in the APDU buffer, as with dc_exchange
+    memmove(G_apdu + G_apdu_len, rdata, rdata_len);
+    G_apdu_len += rdata_len;
+}
+
+static void mock_finalize_response(uint16_t sw) {
+    G_sw = sw;
+}
+
+static void mock_send_response(void) {
+}
+
+static int mock_process_interruption(dispatcher_context_t *dc) {
+    if (G_sw != SW_INTERRUPTED_EXECUTION || !execute(G_apdu_len)) {
+        return -1;
+    }
+    dc->read_buffer = buffer_create(G_apdu, G_apdu_len);
+    G_apdu_len = 0;
+    return 0;
+}
+
+buffer_t dispatcher_get_request_buffer(dispatcher_context_t *dc) {
+    dc->read_buffer = buffer_create(NULL, 0);
+
+    G_apdu_len = 0;
+    return buffer_create(G_apdu, APDU_BUFFER_SIZE - 2);
+}
+
+void dispatcher_await(dispatcher_context_t *dc,
+                      const buffer_t *request,
+                      command_processor_t resume_processor) {
+    (void) dc, (void) request, (void) resume_processor;
+
+    G_sw = SW_BAD_STATE;  // not supported by the mock client
+}
+
+void mock_client_init(dispatcher_context_t *dc, uint16_t client_capabilities) {
+    mock_client_free();
+
+    memset(dc, 0, sizeof(dispatcher_context_t));
+    dc->add_to_response = mock_add_to_response;
+    dc->finalize_response = mock_finalize_response;
+    dc->send_response = mock_send_response;
+    dc->process_interruption = mock_process_interruption;
+    dc->client_capabilities = client_capabilities;
+
+    G_apdu_len = 0;
+    G_sw = 0;
+    mock_client_set_chunk_lens(NULL, 0);
+    mock_client_reset_stats();
+}
+
+void mock_client_set_chunk_lens(const uint8_t chunk_lens[], size_t n_chunk_lens) {
+    if (n_chunk_lens > sizeof(G_chunk_lens)) {
+        n_chunk_lens = sizeof(G_chunk_lens);
+    }
+    for (size_t i = 0; i < n_chunk_lens; i++) {
+        G_chunk_lens[i] = chunk_lens[i] == 0 ? 1 : chunk_lens[i];
+    }
+    G_n_chunk_lens = n_chunk_lens;
+    G_chunk_index = 0;
+}
+
+void mock_client_free(void) {
+    for (size_t i = 0; i < G_n_preimages; i++) {
+        free(G_preimages[i].data);
+    }
+    for (size_t i = 0; i < G_n_trees; i++) {
+        for (uint8_t level = 0; level < G_trees[i].n_levels; level++) {
+            free(G_trees[i].levels[level]);
+        }
+    }
+    free(G_preimages);
+    free(G_trees);
+    free(G_queue.data);
+    G_preimages = NULL;
+    G_n_preimages = 0;
+    G_trees = NULL;
+    G_n_trees = 0;
+    memset(&G_queue, 0, sizeof(G_queue));
+}
+
+const mock_client_stats_t *mock_client_get_stats(void) {
+    return &G_stats;
+}
+
+void mock_client_reset_stats(void) {
+    memset(&G_stats, 0, sizeof(G_stats));
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+/**
+ * In-process implementation of the client side of the client commands, for the code of the app
+ * that runs on the host (src/handler/lib). mock_client_init binds a dispatcher_context_t to it:
+ * each request of the app with dc_exchange is answered immediately from the preimages and the
+ * Merkle trees added to the mock client, exactly like ClientCommandInterpreter in the Python
+ * client, including the responses split over GET_MORE_ELEMENTS.
+ *
+ * The coroutine versions of the helpers (that use dispatcher_await) are not supported.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "boilerplate/dispatcher.h"
+#include "common/merkle.h"
+
+/**
+ * Maximum length of a response to a client command, as in the clients.
+ */
+#define MOCK_CLIENT_MAX_RESPONSE_LEN 255
+
+typedef struct {
+    uint32_t n_requests;         // total number of client commands answered
+    uint32_t n_commands[256];    // number of client commands answered, by command code
+    uint64_t request_bytes;      // total length of the requests
+    uint64_t response_bytes;     // total length of the responses
+} mock_client_stats_t;
+
+/**
+ * Binds dc to the mock client, and forgets all its preimages, trees and statistics.
+ *
+ * @param[out] dc
+ *   The dispatcher context to initialize.
+ * @param[in] client_capabilities
+ *   The capabilities declared by the client, as in the P2 of the commands.
+ */
+void mock_client_init(dispatcher_context_t *dc, uint16_t client_capabilities);
+
+/**
+ * Releases the memory of the preimages and of the trees of the mock client.
+ */
+void mock_client_free(void);
+
+/**
+ * Adds the preimage of the element hash of data (that is, 0x00 followed by data).
+ *
+ * @param[out] hash
+ *   If not NULL, receives the element hash of data.
+ */
+void mock_client_add_preimage(const uint8_t *data, size_t data_len, uint8_t hash[32]);
+
+/**
+ * Adds the Merkle tree of a list of elements, and the preimages of its leaves.
+ *
+ * @param[out] root
+ *   Receives the Merkle root of the list.
+ */
+void mock_client_add_list(const uint8_t *const elements[],
+                          const size_t element_lens[],
+                          size_t n_elements,
+                          uint8_t root[static 32]);
+
+/**
+ * Adds a merkleized map, whose keys must be sorted in lexicographic order, as in the maps of a
+ * PSBT; the returned commitment has an empty index cache.
+ */
+void mock_client_add_map(const uint8_t *const keys[],
+                         const size_t key_lens[],
+                         const uint8_t *const values[],
+                         const size_t value_lens[],
+                         size_t n_keys,
+                         merkleized_map_commitment_t *out);
+
+/**
+ * Sets the lengths of the successive chunks of the byte streams sent by the mock client, like the
+ * preimages and the values of the merkleized maps: each response (the first one, and the ones to
+ * GET_MORE_ELEMENTS) contains a single chunk, whose length is the next one of chunk_lens, cycling,
+ * but at most the length that fits in the response. A length of 0 is taken as 1. With no lengths,
+ * the chunks fill whole responses, like in the clients.
+ */
+void mock_client_set_chunk_lens(const uint8_t chunk_lens[], size_t n_chunk_lens);
+
+/**
+ * Returns the statistics of the client commands answered since mock_client_init or the last
+ * mock_client_reset_stats.
+ */
+const mock_client_stats_t *mock_client_get_stats(void);
+
+void mock_client_reset_stats(void);
@@ -0,0 +1,684 @@
+/**
+ * Host implementation of the subset of the cx_* and os_* functions of the BOLOS SDK that is used by
+ * src/crypto.c and src/common/merkle.c, so that they can be built and tested on the host. The
+ * elliptic curve operations, the big number arithmetic, HMAC and RIPEMD-160 are implemented with
+ * OpenSSL, while SHA-256 is implemented here with the same context layout of the SDK, as the app
+ * relies on it.
+ *
+ * The keys are derived from the seed of the default mnemonic used in Speculos and in the tests.
+ * Unlike on the device, ECDSA signatures use a random nonce instead of RFC6979.
+ */
+
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rand.h>
+#include <openssl/ripemd.h>
+
+#include "os.h"
+#include "cx.h"
+#include "cx_ram.h"
+
+#define MOCK_MNEMONIC                                                                         \
+    "glory promote mansion idle axis finger extra february uncover one trip resource lawn " \
+    "turtle enact monster seven myth punch hobby comfort wild raise skin"
+
+/* ----------------------------------- exceptions ----------------------------------- */
+
+static try_context_t *G_try_context = NULL;
+
+union cx_u G_cx;
+
+try_context_t *try_context_get(void) {
+    return G_try_context;
+}
+
+try_context_t *try_context_set(try_context_t *context) {
+    try_context_t *previous = G_try_context;
+    G_try_context = context;
+    return previous;
+}
+
+void os_longjmp(unsigned int exception) {
+    if (G_try_context == NULL) {
+        abort();  // uncaught exception
+    }
+    longjmp(G_try_context->jmp_buf, exception);
+}
+
+/* ------------------------------------- SHA-256 ------------------------------------ */
+
+static const uint32_t sha256_iv[8] = {0x6a09e667,
+                                      0xbb67ae85,
+                                      0x3c6ef372,
+                                      0xa54ff53a,
+                                      0x510e527f,
+                                      0x9b05688c,
+                                      0x1f83d9ab,
+                                      0x5be0cd19};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// as in the SDK, the state is kept in acc as 8 32-bit words in native byte order
+static void sha256_block(cx_sha256_t *hash, const uint8_t block[static 64]) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) block[4 * i] << 24) | ((uint32_t) block[4 * i + 1] << 16) |
+               ((uint32_t) block[4 * i + 2] << 8) | (uint32_t) block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t acc[8];
+    memcpy(acc, hash->acc, sizeof(acc));
+
+    uint32_t a = acc[0], b = acc[1], c = acc[2], d = acc[3];
+    uint32_t e = acc[4], f = acc[5], g = acc[6], h = acc[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) +
+                      sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    acc[0] += a;
+    acc[1] += b;
+    acc[2] += c;
+    acc[3] += d;
+    acc[4] += e;
+    acc[5] += f;
+    acc[6] += g;
+    acc[7] += h;
+
+    memcpy(hash->acc, acc, sizeof(acc));
+    ++hash->header.counter;
+}
+
+int cx_sha256_init(cx_sha256_t *hash) {
+    memset(hash, 0, sizeof(cx_sha256_t));
+    hash->header.algo = CX_SHA256;
+    memcpy(hash->acc, sha256_iv, sizeof(sha256_iv));
+    return CX_SHA256;
+}
+
+static void sha256_update(cx_sha256_t *hash, const uint8_t *in, size_t len) {
+    while (len > 0) {
+        size_t n = 64 - hash->blen;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(hash->block + hash->blen, in, n);
+        hash->blen += n;
+        in += n;
+        len -= n;
+
+        if (hash->blen == 64) {
+            sha256_block(hash, hash->block);
+            hash->blen = 0;
+        }
+    }
+}
+
+static void sha256_final(cx_sha256_t *hash, uint8_t out[static 32]) {
+    uint64_t bit_len = ((uint64_t) hash->header.counter * 64 + hash->blen) * 8;
+
+    uint8_t padding[64 + 8] = {0x80};
+    size_t padding_len = (hash->blen < 56 ? 56 : 64 + 56) - hash->blen;
+    for (int i = 0; i < 8; i++) {
+        padding[padding_len + i] = (uint8_t) (bit_len >> (56 - 8 * i));
+    }
+    sha256_update(hash, padding, padding_len + 8);
+
+    uint32_t acc[8];
+    memcpy(acc, hash->acc, sizeof(acc));
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (uint8_t) (acc[i] >> 24);
+        out[4 * i + 1] = (uint8_t) (acc[i] >> 16);
+        out[4 * i + 2] = (uint8_t) (acc[i] >> 8);
+        out[4 * i + 3] = (uint8_t) acc[i];
+    }
+}
+
+int cx_sha256_init_no_throw(cx_sha256_t *hash) {
+    cx_sha256_init(hash);
+    return 0;
+}
+
+int cx_sha256_update(cx_sha256_t *hash, const uint8_t *in, size_t in_len) {
+    sha256_update(hash, in, in_len);
+    return 0;
+}
+
+int cx_sha256_final(cx_sha256_t *hash, uint8_t *out) {
+    sha256_final(hash, out);
+    return 0;
+}
+
+int cx_hash(cx_hash_t *hash,
+            int mode,
+            const unsigned char *in,
+            unsigned int len,
+            unsigned char *out,
+            unsigned int out_len) {
+    if (hash->algo != CX_SHA256) {
+        THROW(INVALID_PARAMETER);
+    }
+
+    sha256_update((cx_sha256_t *) hash, in, len);
+    if ((mode & CX_LAST) == 0) {
+        return 0;
+    }
+
+    if (out_len < CX_SHA256_SIZE) {
+        THROW(INVALID_PARAMETER);
+    }
+    sha256_final((cx_sha256_t *) hash, out);
+    return CX_SHA256_SIZE;
+}
+
+int cx_hash_sha256(const unsigned char *in,
+                   unsigned int len,
+                   unsigned char *out,
+                   unsigned int out_len) {
+    cx_sha256_t hash;
+    cx_sha256_init(&hash);
+    return cx_hash(&hash.header, CX_LAST, in, len, out, out_len);
+}
+
+/* ---------------------------------- RIPEMD-160 ------------------------------------ */
+
+size_t cx_hash_ripemd160(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len) {
+    if (out_len < CX_RIPEMD160_SIZE) {
+        return 0;
+    }
+    RIPEMD160(in, in_len, out);
+    return CX_RIPEMD160_SIZE;
+}
+
+/* -------------------------------------- HMAC -------------------------------------- */
+
+// The mock only supports short messages, that are accumulated in the block of the sha512 context
+// and authenticated when CX_LAST is given; the key length is kept in the counter.
+
+int cx_hmac_sha512_init(cx_hmac_sha512_t *hmac, const unsigned char *key, unsigned int key_len) {
+    if (key != NULL) {
+        if (key_len > sizeof(hmac->key)) {
+            THROW(INVALID_PARAMETER);
+        }
+        memset(hmac, 0, sizeof(cx_hmac_sha512_t));
+        memcpy(hmac->key, key, key_len);
+        hmac->hash.header.counter = key_len;
+    }
+    hmac->hash.header.algo = CX_SHA512;
+    hmac->hash.blen = 0;
+    return CX_SHA512;
+}
+
+int cx_hmac(cx_hmac_t *hmac,
+            int mode,
+            const unsigned char *in,
+            unsigned int len,
+            unsigned char *mac,
+            unsigned int mac_len) {
+    cx_hmac_sha512_t *ctx = (cx_hmac_sha512_t *) hmac;
+    if (ctx->hash.header.algo != CX_SHA512 || len > sizeof(ctx->hash.block) - ctx->hash.blen) {
+        THROW(INVALID_PARAMETER);
+    }
+
+    memcpy(ctx->hash.block + ctx->hash.blen, in, len);
+    ctx->hash.blen += len;
+
+    if ((mode & CX_LAST) == 0) {
+        return 0;
+    }
+
+    uint8_t result[64];
+    HMAC(EVP_sha512(),
+         ctx->key,
+         (int) ctx->hash.header.counter,
+         ctx->hash.block,
+         ctx->hash.blen,
+         result,
+         NULL);
+    memcpy(mac, result, mac_len < sizeof(result) ? mac_len : sizeof(result));
+
+    if ((mode & CX_NO_REINIT) == 0) {
+        cx_hmac_sha512_init(ctx, NULL, 0);
+    }
+    return 64;
+}
+
+int cx_hmac_sha256(const unsigned char *key,
+                   unsigned int key_len,
+                   const unsigned char *in,
+                   unsigned int len,
+                   unsigned char *mac,
+                   unsigned int mac_len) {
+    uint8_t result[32];
+    HMAC(EVP_sha256(), key, (int) key_len, in, len, result, NULL);
+    memcpy(mac, result, mac_len < sizeof(result) ? mac_len : sizeof(result));
+    return 32;
+}
+
+int cx_hmac_sha512(const unsigned char *key,
+                   unsigned int key_len,
+                   const unsigned char *in,
+                   unsigned int len,
+                   unsigned char *mac,
+                   unsigned int mac_len) {
+    uint8_t result[64];
+    HMAC(EVP_sha512(), key, (int) key_len, in, len, result, NULL);
+    memcpy(mac, result, mac_len < sizeof(result) ? mac_len : sizeof(result));
+    return 64;
+}
+
+/* -------------------------------------- math -------------------------------------- */
+
+int cx_math_cmp(const unsigned char *a, const unsigned char *b, unsigned int len) {
+    return memcmp(a, b, len);
+}
+
+int cx_math_is_zero(const unsigned char *a, unsigned int len) {
+    for (unsigned int i = 0; i < len; i++) {
+        if (a[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int cx_math_sub(unsigned char *r, const unsigned char *a, const unsigned char *b, unsigned int len) {
+    int borrow = 0;
+    for (int i = (int) len - 1; i >= 0; i--) {
+        int d = (int) a[i] - (int) b[i] - borrow;
+        borrow = d < 0;
+        r[i] = (uint8_t) d;
+    }
+    return borrow;
+}
+
+void cx_math_addm(unsigned char *r,
+                  const unsigned char *a,
+                  const unsigned char *b,
+                  const unsigned char *m,
+                  unsigned int len) {
+    BN_CTX *ctx = BN_CTX_new();
+    BIGNUM *bn_a = BN_bin2bn(a, (int) len, NULL);
+    BIGNUM *bn_b = BN_bin2bn(b, (int) len, NULL);
+    BIGNUM *bn_m = BN_bin2bn(m, (int) len, NULL);
+    BIGNUM *bn_r = BN_new();
+
+    BN_mod_add(bn_r, bn_a, bn_b, bn_m, ctx);
+    BN_bn2binpad(bn_r, r, (int) len);
+
+    BN_free(bn_r);
+    BN_free(bn_m);
+    BN_free(bn_b);
+    BN_free(bn_a);
+    BN_CTX_free(ctx);
+}
+
+void cx_math_powm(unsigned char *r,
+                  const unsigned char *a,
+                  const unsigned char *e,
+                  unsigned int len_e,
+                  const unsigned char *m,
+                  unsigned int len) {
+    BN_CTX *ctx = BN_CTX_new();
+    BIGNUM *bn_a = BN_bin2bn(a, (int) len, NULL);
+    BIGNUM *bn_e = BN_bin2bn(e, (int) len_e, NULL);
+    BIGNUM *bn_m = BN_bin2bn(m, (int) len, NULL);
+    BIGNUM *bn_r = BN_new();
+
+    BN_mod_exp(bn_r, bn_a, bn_e, bn_m, ctx);
+    BN_bn2binpad(bn_r, r, (int) len);
+
+    BN_free(bn_r);
+    BN_free(bn_m);
+    BN_free(bn_e);
+    BN_free(bn_a);
+    BN_CTX_free(ctx);
+}
+
+/* ------------------------------------ secp256k1 ----------------------------------- */
+
+static const EC_GROUP *get_secp256k1(void) {
+    static EC_GROUP *group = NULL;
+    if (group == NULL) {
+        group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+    }
+    return group;
+}
+
+// returns false if the point is not valid
+static bool decode_point(const uint8_t *in, size_t in_len, EC_POINT *out, BN_CTX *ctx) {
+    return in_len == 65 && in[0] == 0x04 &&
+           EC_POINT_oct2point(get_secp256k1(), out, in, in_len, ctx) == 1;
+}
+
+// returns the encoding length, or 0 if the point is infinity
+static int encode_point(const EC_POINT *point, uint8_t out[static 65], BN_CTX *ctx) {
+    if (EC_POINT_is_at_infinity(get_secp256k1(), point)) {
+        return 0;
+    }
+    return (int) EC_POINT_point2oct(get_secp256k1(),
+                                    point,
+                                    POINT_CONVERSION_UNCOMPRESSED,
+                                    out,
+                                    65,
+                                    ctx);
+}
+
+int cx_ecfp_add_point(cx_curve_t curve,
+                      unsigned char *R,
+                      const unsigned char *P,
+                      const unsigned char *Q,
+                      unsigned int X_len) {
+    if (curve != CX_CURVE_SECP256K1) {
+        THROW(INVALID_PARAMETER);
+    }
+
+    BN_CTX *ctx = BN_CTX_new();
+    EC_POINT *p = EC_POINT_new(get_secp256k1());
+    EC_POINT *q = EC_POINT_new(get_secp256k1());
+
+    bool valid = decode_point(P, X_len, p, ctx) && decode_point(Q, X_len, q, ctx);
+    int ret = 0;
+    if (valid) {
+        EC_POINT_add(get_secp256k1(), p, p, q, ctx);
+        ret = encode_point(p, R, ctx);
+    }
+
+    EC_POINT_free(q);
+    EC_POINT_free(p);
+    BN_CTX_free(ctx);
+
+    if (!valid) {
+        THROW(INVALID_PARAMETER);
+    }
+    return ret;
+}
+
+int cx_ecfp_scalar_mult(cx_curve_t curve,
+                        unsigned char *P,
+                        unsigned int P_len,
+                        const unsigned char *k,
+                        unsigned int k_len) {
+    if (curve != CX_CURVE_SECP256K1) {
+        THROW(INVALID_PARAMETER);
+    }
+
+    BN_CTX *ctx = BN_CTX_new();
+    EC_POINT *p = EC_POINT_new(get_secp256k1());
+    BIGNUM *bn_k = BN_bin2bn(k, (int) k_len, NULL);
+
+    bool valid = decode_point(P, P_len, p, ctx);
+    int ret = 0;
+    if (valid) {
+        EC_POINT_mul(get_secp256k1(), p, NULL, p, bn_k, ctx);
+        ret = encode_point(p, P, ctx);
+    }
+
+    BN_free(bn_k);
+    EC_POINT_free(p);
+    BN_CTX_free(ctx);
+
+    if (!valid) {
+        THROW(INVALID_PARAMETER);
+    }
+    return ret;
+}
+
+int cx_ecfp_init_private_key(cx_curve_t curve,
+                             const unsigned char *rawkey,
+                             unsigned int key_len,
+                             cx_ecfp_private_key_t *pvkey) {
+    if (key_len > sizeof(pvkey->d)) {
+        THROW(INVALID_PARAMETER);
+    }
+    pvkey->curve = curve;
+    pvkey->d_len = key_len;
+    if (rawkey != NULL) {
+        memcpy(pvkey->d, rawkey, key_len);
+    }
+    return (int) key_len;
+}
+
+int cx_ecfp_generate_pair(cx_curve_t curve,
+                          cx_ecfp_public_key_t *pubkey,
+                          cx_ecfp_private_key_t *privkey,
+                          int keepprivate) {
+    if (curve != CX_CURVE_SECP256K1 || !keepprivate) {
+        THROW(INVALID_PARAMETER);  // generating new keys is not supported by the mock
+    }
+
+    BN_CTX *ctx = BN_CTX_new();
+    EC_POINT *w = EC_POINT_new(get_secp256k1());
+    BIGNUM *d = BN_bin2bn(privkey->d, (int) privkey->d_len, NULL);
+
+    EC_POINT_mul(get_secp256k1(), w, d, NULL, NULL, ctx);
+    pubkey->curve = curve;
+    pubkey->W_len = (unsigned int) encode_point(w, pubkey->W, ctx);
+
+    BN_clear_free(d);
+    EC_POINT_free(w);
+    BN_CTX_free(ctx);
+    return 0;
+}
+
+int cx_ecdsa_sign(const cx_ecfp_private_key_t *pvkey,
+                  int mode,
+                  cx_md_t hashID,
+                  const unsigned char *hash,
+                  unsigned int hash_len,
+                  unsigned char *sig,
+                  unsigned int sig_len,
+                  unsigned int *info) {
+    (void) mode;
+    (void) hashID;
+
+    EC_KEY *key = EC_KEY_new();
+    EC_KEY_set_group(key, get_secp256k1());
+    BIGNUM *d = BN_bin2bn(pvkey->d, (int) pvkey->d_len, NULL);
+    EC_KEY_set_private_key(key, d);
+
+    ECDSA_SIG *signature = ECDSA_do_sign(hash, (int) hash_len, key);
+
+    int ret = -1;
+    if (signature != NULL && (unsigned int) i2d_ECDSA_SIG(signature, NULL) <= sig_len) {
+        ret = i2d_ECDSA_SIG(signature, &sig);
+    }
+    if (info != NULL) {
+        *info = 0;
+    }
+
+    ECDSA_SIG_free(signature);
+    BN_clear_free(d);
+    EC_KEY_free(key);
+
+    if (ret < 0) {
+        THROW(INVALID_PARAMETER);
+    }
+    return ret;
+}
+
+/* --------------------------------- key derivation --------------------------------- */
+
+static const char *G_mock_mnemonic = MOCK_MNEMONIC;
+static bool G_mock_seed_initialized = false;
+
+// number of calls of os_perso_derive_node_bip32, checked by the tests of the caches of keys
+unsigned int G_mock_derive_node_bip32_calls = 0;
+
+// replaces the seed of the mocked key derivation, as after a restore of the device; NULL restores
+// the default mnemonic
+void mock_set_mnemonic(const char *mnemonic) {
+    G_mock_mnemonic = mnemonic != NULL ? mnemonic : MOCK_MNEMONIC;
+    G_mock_seed_initialized = false;
+}
+
+static const uint8_t *get_seed(void) {
+    static uint8_t seed[64];
+    if (!G_mock_seed_initialized) {
+        PKCS5_PBKDF2_HMAC(G_mock_mnemonic,
+                          strlen(G_mock_mnemonic),
+                          (const unsigned char *) "mnemonic",
+                          8,
+                          2048,
+                          EVP_sha512(),
+                          sizeof(seed),
+                          seed);
+        G_mock_seed_initialized = true;
+    }
+    return seed;
+}
+
+void os_perso_derive_node_bip32(cx_curve_t curve,
+                                const unsigned int *path,
+                                unsigned int pathLength,
+                                unsigned char *privateKey,
+                                unsigned char *chain) {
+    if (curve != CX_CURVE_SECP256K1) {
+        THROW(INVALID_PARAMETER);
+    }
+    ++G_mock_derive_node_bip32_calls;
+
+    uint8_t I[64];
+    HMAC(EVP_sha512(), "Bitcoin seed", 12, get_seed(), 64, I, NULL);
+
+    BN_CTX *ctx = BN_CTX_new();
+    BIGNUM *k = BN_bin2bn(I, 32, NULL);
+    BIGNUM *il = BN_new();
+    EC_POINT *K = EC_POINT_new(get_secp256k1());
+    const BIGNUM *n = EC_GROUP_get0_order(get_secp256k1());
+
+    for (unsigned int i = 0; i < pathLength; i++) {
+        uint8_t data[33 + 4];
+        if (path[i] >= 0x80000000) {
+            data[0] = 0x00;
+            BN_bn2binpad(k, data + 1, 32);
+        } else {
+            EC_POINT_mul(get_secp256k1(), K, k, NULL, NULL, ctx);
+            EC_POINT_point2oct(get_secp256k1(), K, POINT_CONVERSION_COMPRESSED, data, 33, ctx);
+        }
+        data[33] = (uint8_t) (path[i] >> 24);
+        data[34] = (uint8_t) (path[i] >> 16);
+        data[35] = (uint8_t) (path[i] >> 8);
+        data[36] = (uint8_t) path[i];
+
+        HMAC(EVP_sha512(), I + 32, 32, data, sizeof(data), I, NULL);
+
+        BN_bin2bn(I, 32, il);
+        BN_mod_add(k, k, il, n, ctx);
+    }
+
+    BN_bn2binpad(k, privateKey, 32);
+    if (chain != NULL) {
+        memcpy(chain, I + 32, 32);
+    }
+
+    EC_POINT_free(K);
+    BN_clear_free(il);
+    BN_clear_free(k);
+    BN_CTX_free(ctx);
+    explicit_bzero(I, sizeof(I));
+}
+
+void os_perso_derive_node_with_seed_key(unsigned int mode,
+                                        cx_curve_t curve,
+                                        const unsigned int *path,
+                                        unsigned int pathLength,
+                                        unsigned char *privateKey,
+                                        unsigned char *chain,
+                                        unsigned char *seed_key,
+                                        unsigned int seed_key_length) {
+    (void) curve;
+    (void) chain;
+    (void) seed_key;
+    (void) seed_key_length;
+
+    if (mode != HDW_SLIP21) {
+        THROW(INVALID_PARAMETER);
+    }
+
+    // SLIP-0021 derivation of the node at the given label (which includes the leading 0 byte)
+    uint8_t node[64];
+    HMAC(EVP_sha512(), "Symmetric key seed", 18, get_seed(), 64, node, NULL);
+    HMAC(EVP_sha512(), node, 32, (const unsigned char *) path, pathLength, node, NULL);
+
+    memcpy(privateKey, node + 32, 32);
+    explicit_bzero(node, sizeof(node));
+}
+
+/* ---------------------------------- random ---------------------------------- */
+
+unsigned char *cx_rng(unsigned char *buffer, size_t len) {
+    if (RAND_bytes(buffer, (int) len) != 1) {
+        abort();
+    }
+    return buffer;
+}
+
+/* ---------------------------------- flash memory ---------------------------------- */
+
+void nvm_write(void *dst_adr, void *src_adr, unsigned int src_len) {
+    // the N_ variables are const, therefore in read-only pages on the host
+    uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) dst_adr & ~(page_size - 1);
+    size_t len = (uintptr_t) dst_adr + src_len - start;
+    if (mprotect((void *) start, len, PROT_READ | PROT_WRITE) != 0) {
+        abort();
+    }
+
+    if (src_adr == NULL) {
+        memset(dst_adr, 0, src_len);
+    } else {
+        memmove(dst_adr, src_adr, src_len);
+    }
+    mprotect((void *) start, len, PROT_READ);
+}
+
+void *pic(void *linked_address) {
+    // on the host, the code and the data are not relocated
+    return linked_address;
+}
+
+char os_secure_memcmp(void *src1, void *src2, unsigned int length) {
+    const uint8_t *a = src1, *b = src2;
+    uint8_t diff = 0;
+    for (unsigned int i = 0; i < length; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff != 0;
+}
@@ -40,6 +40,7 @@
 /* ======================================================================= */
 
 // #include "lcx_rng.h"
+unsigned char *cx_rng(unsigned char *buffer, size_t len);
 
 /* ======================================================================= */
 /*                                   HASH                                 */
@@ -51,7 +52,7 @@
 
 #include "lcx_sha256.h"
 // #include "lcx_sha3.h"
-// #include "lcx_sha512.h"
+#include "lcx_sha512.h"
 
 // #include "lcx_blake2.h"
 
@@ -61,7 +62,7 @@
 /*                                 HASH MAC                                */
 /* ======================================================================= */
 
-// #include "lcx_hmac.h"
+#include "lcx_hmac.h"
 
 /* ======================================================================= */
 /*                                  PKDF2                                  */
@@ -93,7 +94,7 @@
 
 #include "lcx_ecfp.h"
 
-// #include "lcx_ecdsa.h"
+#include "lcx_ecdsa.h"
 // #include "lcx_ecschnorr.h"
 // #include "lcx_eddsa.h"
 
@@ -113,7 +114,7 @@
 /*                                    MATH                                 */
 /* ======================================================================= */
 
-// #include "lcx_math.h"
+#include "lcx_math.h"
 
 /* ======================================================================= */
 /*                                    DEBUG                                */
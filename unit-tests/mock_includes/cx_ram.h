@@ -0,0 +1,12 @@
+#pragma once
+
+#include "cx.h"
+
+/**
+ * Host version of the cxram section of the SDK: only the contexts that the app uses directly.
+ */
+union cx_u {
+    cx_sha256_t sha256;
+};
+
+extern union cx_u G_cx;
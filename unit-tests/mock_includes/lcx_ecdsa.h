@@ -0,0 +1,48 @@
+
+/*******************************************************************************
+*   Ledger Nano S - Secure firmware
+*   (c) 2019 Ledger
+*
+*  Licensed under the Apache License, Version 2.0 (the "License");
+*  you may not use this file except in compliance with the License.
+*  You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+*  Unless required by applicable law or agreed to in writing, software
+*  distributed under the License is distributed on an "AS IS" BASIS,
+*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*  See the License for the specific language governing permissions and
+*  limitations under the License.
+********************************************************************************/
+
+#ifndef LCX_ECDSA_H
+#define LCX_ECDSA_H
+
+/**
+ * Sign a hash message according to ECDSA specification; the signature is
+ * encoded in DER.
+ *
+ * @param [in] pvkey private key to use for signing
+ * @param [in] mode crypto mode flags: CX_RND_TRNG or CX_RND_RFC6979
+ * @param [in] hashID hash identifier used to compute the input data
+ * @param [in] hash input hash
+ * @param [in] hash_len length of the input hash
+ * @param [out] sig where to set the signature
+ * @param [in] sig_len length of the sig buffer
+ * @param [out] info set with CX_ECCINFO_PARITY_ODD if Y is odd when computing
+ * k.G
+ *
+ * @return full length of signature
+ */
+CXCALL int cx_ecdsa_sign(const cx_ecfp_private_key_t WIDE *pvkey
+                             PLENGTH(scc__cx_scc_struct_size_ecfp_privkey__pvkey),
+                         int mode, cx_md_t hashID,
+                         const unsigned char WIDE *hash PLENGTH(hash_len),
+                         unsigned int hash_len, unsigned char *sig PLENGTH(sig_len),
+                         unsigned int sig_len, unsigned int *info PLENGTH(sizeof(unsigned int)));
+
+#define CX_ECCINFO_PARITY_ODD 1
+#define CX_ECCINFO_xGTn 2
+
+#endif
@@ -0,0 +1,96 @@
+
+/*******************************************************************************
+*   Ledger Nano S - Secure firmware
+*   (c) 2019 Ledger
+*
+*  Licensed under the Apache License, Version 2.0 (the "License");
+*  you may not use this file except in compliance with the License.
+*  You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+*  Unless required by applicable law or agreed to in writing, software
+*  distributed under the License is distributed on an "AS IS" BASIS,
+*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*  See the License for the specific language governing permissions and
+*  limitations under the License.
+********************************************************************************/
+
+#ifndef LCX_HMAC_H
+#define LCX_HMAC_H
+
+/**
+ * HMAC context, concrete type for SHA-512
+ */
+typedef struct {
+  /** @internal */
+  unsigned char key[128];
+  /** @internal */
+  cx_sha512_t hash;
+} cx_hmac_sha512_t;
+
+/**
+ * HMAC abstract context.
+ */
+typedef struct {
+  /** @internal */
+  unsigned char key[128];
+  /** @internal */
+  cx_hash_t hash;
+} cx_hmac_t;
+
+/**
+ * Initialize a HMAC-SHA512 context.
+ *
+ * @param [out] hmac the context to init.
+ * @param [in] key hmac key value; passing a NULL pointer will reinit the
+ * context with the previously set key.
+ * @param [in] key_len hmac key length, at most 128 bytes.
+ *
+ * @return algorithm identifier
+ */
+CXCALL int cx_hmac_sha512_init(cx_hmac_sha512_t *hmac PLENGTH(sizeof(cx_hmac_sha512_t)),
+                               const unsigned char WIDE *key PLENGTH(key_len),
+                               unsigned int key_len);
+
+/**
+ * Add more data to hmac, and return the mac if CX_LAST is set; after CX_LAST,
+ * the context is reinitialized with the same key, unless CX_NO_REINIT is set.
+ *
+ * @param [in] hmac hmac context
+ * @param [in] mode crypto flag: CX_LAST, CX_NO_REINIT
+ * @param [in] in input data to add to the current hmac
+ * @param [in] len length of input data
+ * @param [out] mac where to set the hmac value
+ * @param [in] mac_len the size of the mac buffer
+ *
+ * @return hmac length
+ */
+CXCALL int cx_hmac(cx_hmac_t *hmac PLENGTH(scc__cx_scc_struct_size_hmac__hmac),
+                   int mode, const unsigned char WIDE *in PLENGTH(len),
+                   unsigned int len, unsigned char *mac PLENGTH(mac_len),
+                   unsigned int mac_len);
+
+/**
+ * One shot HMAC-SHA256 processing.
+ *
+ * @return hmac length
+ */
+CXCALL int cx_hmac_sha256(const unsigned char WIDE *key PLENGTH(key_len),
+                          unsigned int key_len,
+                          const unsigned char WIDE *in PLENGTH(len),
+                          unsigned int len, unsigned char *mac PLENGTH(mac_len),
+                          unsigned int mac_len);
+
+/**
+ * One shot HMAC-SHA512 processing.
+ *
+ * @return hmac length
+ */
+CXCALL int cx_hmac_sha512(const unsigned char WIDE *key PLENGTH(key_len),
+                          unsigned int key_len,
+                          const unsigned char WIDE *in PLENGTH(len),
+                          unsigned int len, unsigned char *mac PLENGTH(mac_len),
+                          unsigned int mac_len);
+
+#endif
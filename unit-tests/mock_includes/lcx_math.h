@@ -0,0 +1,69 @@
+
+/*******************************************************************************
+*   Ledger Nano S - Secure firmware
+*   (c) 2019 Ledger
+*
+*  Licensed under the Apache License, Version 2.0 (the "License");
+*  you may not use this file except in compliance with the License.
+*  You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+*  Unless required by applicable law or agreed to in writing, software
+*  distributed under the License is distributed on an "AS IS" BASIS,
+*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*  See the License for the specific language governing permissions and
+*  limitations under the License.
+********************************************************************************/
+
+#ifndef LCX_MATH_H
+#define LCX_MATH_H
+
+/**
+ * Compare to unsigned long big-endian integer.
+ *
+ * @return 0 if a==b, negative value if a<b, positive value if a>b
+ */
+CXCALL int cx_math_cmp(const unsigned char WIDE *a PLENGTH(len),
+                       const unsigned char WIDE *b PLENGTH(len),
+                       unsigned int len);
+
+/**
+ * Compare to unsigned long big-endian integer to zero.
+ *
+ * @return 1 if a==0, 0 otherwise
+ */
+CXCALL int cx_math_is_zero(const unsigned char WIDE *a PLENGTH(len),
+                           unsigned int len);
+
+/**
+ * Subtraction of two big integers: r = a-b.
+ *
+ * @return the borrow
+ */
+CXCALL int cx_math_sub(unsigned char *r PLENGTH(len),
+                       const unsigned char WIDE *a PLENGTH(len),
+                       const unsigned char WIDE *b PLENGTH(len),
+                       unsigned int len);
+
+/**
+ * Modular addition of two big integers: r = a+b mod m.
+ * a and b must be smaller than m.
+ */
+CXCALL void cx_math_addm(unsigned char *r PLENGTH(len),
+                         const unsigned char WIDE *a PLENGTH(len),
+                         const unsigned char WIDE *b PLENGTH(len),
+                         const unsigned char WIDE *m PLENGTH(len),
+                         unsigned int len);
+
+/**
+ * Modular exponentiation: r = a^e mod m.
+ */
+CXCALL void cx_math_powm(unsigned char *r PLENGTH(len),
+                         const unsigned char *a PLENGTH(len),
+                         const unsigned char WIDE *e PLENGTH(len_e),
+                         unsigned int len_e,
+                         const unsigned char WIDE *m PLENGTH(len),
+                         unsigned int len);
+
+#endif
@@ -56,4 +56,12 @@ typedef struct cx_ripemd160_s cx_ripemd160_t;
 CXCALL int
 cx_ripemd160_init(cx_ripemd160_t *hash PLENGTH(sizeof(cx_ripemd160_t)));
 
+/**
+ * One shot RIPEMD-160 digest.
+ *
+ * @return the length of the digest, or 0 if out_len is too small
+ */
+size_t cx_hash_ripemd160(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len);
+#define _NR_cx_hash_ripemd160
+
 #endif
@@ -60,6 +60,29 @@ CXCALL int cx_sha224_init(cx_sha256_t *hash PLENGTH(sizeof(cx_sha256_t)));
  */
 CXCALL int cx_sha256_init(cx_sha256_t *hash PLENGTH(sizeof(cx_sha256_t)));
 
+/**
+ * Initialize a SHA-256 context; the same as cx_sha256_init, that does not throw.
+ *
+ * @param [out] hash the context to init.
+ *
+ * @return 0 on success
+ */
+CXCALL int cx_sha256_init_no_throw(cx_sha256_t *hash PLENGTH(sizeof(cx_sha256_t)));
+
+/**
+ * Add more data to hash.
+ *
+ * @return 0 on success
+ */
+CXCALL int cx_sha256_update(cx_sha256_t *hash, const uint8_t *in, size_t in_len);
+
+/**
+ * Finalize the hash, writing the 32-byte digest to out.
+ *
+ * @return 0 on success
+ */
+CXCALL int cx_sha256_final(cx_sha256_t *hash, uint8_t *out);
+
 /**
  * One shot SHA-256 digest
  *
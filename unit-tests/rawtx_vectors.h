@@ -0,0 +1,102 @@
+#pragma once
+
+/**
+ * Real transactions (of testnet) in both the legacy and the segwit serialization, with their txid,
+ * for the tests and the benchmarks of the parser of transactions; they are the ones of the data of
+ * tests-legacy.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct {
+    const char *name;
+    const char *hex;   // the serialized transaction
+    const char *txid;  // as displayed, in reverse byte order
+} rawtx_vector_t;
+
+// clang-format off
+static const rawtx_vector_t rawtx_vectors[] = {
+    {
+        "many-to-many/p2pkh",
+        "02000000025df7b9e20c52d1da2701a244a49754215266f016f6bd77f640a5200cd1fb7e34000000006a4730"
+        "440220186ec195f04cfedc62d6d383a855e4b0fec550efedd22c177d2031b293556c16022039f05b1b8cc40c"
+        "48d07323fdf3cc0453909d54409551c7ddc259210b2862bc54012103ed3cf038f00b7ad1c3998e66cf22a688"
+        "ab5dbaed8400784cbf962d54cd42c2bffdffffff57f891351e60e944718f1df12b4f77b642cc63146184bedc"
+        "6c7bc64a0c0b39de010000006a47304402201592969826e01baba12c9833584e0e958c1562736192bd1264d0"
+        "79383e8f277902204d5aafb9566a6de419b9446536ccce62f750361530d2a8f9a3bbc5e47af6859001210358"
+        "79ca173a9c1b3f300ec587fb4cc6d54d618e30584e425c1b53b98828708f1dfdffffff025c90040000000000"
+        "1976a914d8bb03d84a3aa993ae6db1114488488dab43d6db88ac20a10700000000001976a914cbae5b50cf93"
+        "9e6f531b8a6b7abd788fe14b029788acd9041d00",
+        "6eb7ece9e847574ca460414b6c2db535cec29ba803cd79d2c0718bd66c289fba"
+    },
+    {
+        "many-to-many/p2sh-p2wpkh",
+        "0200000000010253d3c0b27291bffbf09d6ef5bd4f6051ed911914f55bef0e3315b258bb1310890000000017"
+        "160014cb078087eff485aaa2260e94a53d7d6d1c5dd151fdffffff53d3c0b27291bffbf09d6ef5bd4f6051ed"
+        "911914f55bef0e3315b258bb13108901000000171600143f8f2b556915a9306fd92eb5ae72217be9dd593ffd"
+        "ffffff02840a03000000000017a914ffc91a30e33fc6d6ecff42e4d9bd6c7e115d84988700350c0000000000"
+        "17a9142f5864a8acd23fa85977d73e9ac30fd6b341b78c8702483045022100a0173bbd3dcdfe51c24386fee9"
+        "05b8197f36c2024f582b1a838e7bf09a1ec16902206bcd803041b13738f7d8896561e6a8ccec9a3f5d243be8"
+        "645c403e83beb19b340121024ba3b77d933de9fa3f9583348c40f3caaf2effad5b6e244ece8abbfcc7244f67"
+        "02483045022100ac5701f0cc3cb4b490269674d3463c4fab74f6ee9faf7c29b3d0dea22875dd0002206ba4f4"
+        "195dce69ffd3e7d832ee5d67ee0d037bad03f4e00f841fbf84649375b5012103a1989dadf0bce57f4c96cfc4"
+        "d9e6aa9abeba7ac0733e99176f69432e852666f1d0031d00",
+        "f5ff97147f8c7cca717536325eb157c696ef9630934271905b3f8c564b18e708"
+    },
+    {
+        "many-to-many/p2wpkh",
+        "02000000000102ac4f7220317b689845cd25c42f608368b7b92a784169372d3c2ca2612ef1cd0d0000000000"
+        "fdffffffac4f7220317b689845cd25c42f608368b7b92a784169372d3c2ca2612ef1cd0d0100000000fdffff"
+        "ff02fe2bf80000000000160014c132f90de4a19728e35d8af8b3f9ec4e43cf19480187930300000000160014"
+        "3318e04fae6c12afcb009c69cd57e5b2504ae6b40247304402203aed260c81d21e36cfdd5a095ad289366103"
+        "ae3a2690011b20e15001173e44d902206f17e60fc169db8bc21820dfefe51271446a6305284bcfb73738ca38"
+        "a2715d9f012103455ee7cedc97b0ba435b80066fc92c963a34c600317981d135330c4ee43ac7a30247304402"
+        "20223a3f37f85ed5e42d6ed463ca36932db28799ff12d0391b5e02bcfef829007302206c42e9cb5817bff184"
+        "e8854848032867f129814df07a96afc49baa5542ede8a4012103affafaf410b74f019028055618695f89c234"
+        "78aa5fca3ba531f44d382ad7791a43021d00",
+        "5c09c82a4efa271adb692917aa35e92b1b360e333fade6cf081952bc7fd16a7a"
+    },
+    {
+        "one-to-one/p2pkh",
+        "02000000015122c2cde6823e55754175b92c9c57a0a8e1ac83c38e1787fd3a1ff3348e9513010000006b4830"
+        "45022100e55b3ca788721aae8def2eadff710e524ffe8c9dec1764fdaa89584f9726e196022012a30fbcf9e1"
+        "a24df31a1010356b794ab8de438b4250684757ed5772402540f4012102ee8608207e21028426f69e76447d7e"
+        "3d5e077049f5e683c3136c2314762a4718fdffffff0178410f00000000001976a91413d7d58166946c3ec022"
+        "934066d8c0d111d1bb4188ac1a041d00",
+        "f26b62046101b7cd369eafb3aed5bef343ff3849b98b3cf42dea9cdc78b4c2f4"
+    },
+    {
+        "one-to-many/p2wpkh",
+        "020000000001017a6ad17fbc521908cfe6ad3f330e361b2be935aa172969db1a27fa4e2ac8095c0100000000"
+        "fdffffff02b895980000000000160014ae4a9e12c72bafa7c09da2d0d924e0552ff68c2580f0fa0200000000"
+        "1600141347e82a037b5dbb38cf8c4759f242b1f5c7e09a02483045022100f6e4c827b7c0ffc2cc781ea9b64d"
+        "dacc9a6ac72ad50d08e84f5ae9ee26b6f88f02206441cd69a31563c6e80bd7fd21ba050d6720116330c461a4"
+        "014ac6164d24e2a401210232804f473db3282d5baca4c53713463645729335b90d738e18e2286b603d3fc5a4"
+        "021d00",
+        "2e06df6ac8282f8e93f49285a2dedb5d4d5821427cfd5cbcc8f98b24a925a09c"
+    },
+};
+// clang-format on
+
+// Decodes the transaction of the vector into out; returns its length.
+static inline size_t rawtx_vector_decode(const rawtx_vector_t *vector, uint8_t *out) {
+    size_t len = strlen(vector->hex) / 2;
+    for (size_t i = 0; i < len; i++) {
+        unsigned int byte;
+        sscanf(vector->hex + 2 * i, "%2x", &byte);
+        out[i] = (uint8_t) byte;
+    }
+    return len;
+}
+
+// Decodes the txid of the vector, in the byte order computed by the parser.
+static inline void rawtx_vector_decode_txid(const rawtx_vector_t *vector, uint8_t out[static 32]) {
+    for (size_t i = 0; i < 32; i++) {
+        unsigned int byte;
+        sscanf(vector->txid + 2 * i, "%2x", &byte);
+        out[31 - i] = (uint8_t) byte;
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+/**
+ * Straightforward encoder of segwit addresses, used as a reference for the optimized one in
+ * segwit_addr.c by test_segwit_addr and bench_segwit_addr. The program is first converted to 5-bit
+ * values, then the checksum is computed one bit of the generator at a time, as in the reference
+ * implementation of BIP-173.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+static inline uint32_t ref_polymod_step(uint32_t pre) {
+    uint8_t b = pre >> 25;
+    return ((pre & 0x1FFFFFF) << 5) ^ (-((b >> 0) & 1) & 0x3b6a57b2UL) ^
+           (-((b >> 1) & 1) & 0x26508e6dUL) ^ (-((b >> 2) & 1) & 0x1ea119faUL) ^
+           (-((b >> 3) & 1) & 0x3d4233ddUL) ^ (-((b >> 4) & 1) & 0x2a1462b3UL);
+}
+
+// witness version followed by the program regrouped in 5-bit values, padded with zeros
+static inline size_t ref_convert_bits(uint8_t *data,
+                                      int witver,
+                                      const uint8_t *witprog,
+                                      size_t witprog_len) {
+    size_t data_len = 0;
+    data[data_len++] = witver;
+    uint32_t val = 0;
+    int bits = 0;
+    for (size_t i = 0; i < witprog_len; i++) {
+        val = (val << 8) | witprog[i];
+        bits += 8;
+        while (bits >= 5) {
+            bits -= 5;
+            data[data_len++] = (val >> bits) & 0x1f;
+        }
+    }
+    if (bits) {
+        data[data_len++] = (val << (5 - bits)) & 0x1f;
+    }
+
+    return data_len;
+}
+
+static inline void ref_segwit_addr_encode(char *output,
+                                          const char *hrp,
+                                          int witver,
+                                          const uint8_t *witprog,
+                                          size_t witprog_len) {
+    static const char *charset = "qpzry9x8gf2tvdw0s3jn54khce6mua7l";
+
+    uint8_t data[65];
+    size_t data_len = ref_convert_bits(data, witver, witprog, witprog_len);
+
+    uint32_t chk = 1;
+    for (size_t i = 0; hrp[i] != 0; i++) {
+        chk = ref_polymod_step(chk) ^ (hrp[i] >> 5);
+    }
+    chk = ref_polymod_step(chk);
+    for (size_t i = 0; hrp[i] != 0; i++) {
+        chk = ref_polymod_step(chk) ^ (hrp[i] & 0x1f);
+        *(output++) = hrp[i];
+    }
+    *(output++) = '1';
+    for (size_t i = 0; i < data_len; i++) {
+        chk = ref_polymod_step(chk) ^ data[i];
+        *(output++) = charset[data[i]];
+    }
+    for (size_t i = 0; i < 6; i++) {
+        chk = ref_polymod_step(chk);
+    }
+    chk ^= witver == 0 ? 1 : 0x2bc830a3;
+    for (size_t i = 0; i < 6; i++) {
+        *(output++) = charset[(chk >> ((5 - i) * 5)) & 0x1f];
+    }
+    *output = 0;
+}
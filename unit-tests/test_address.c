@@ -0,0 +1,85 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "../src/common/address.h"
+
+// hash160 of the public key of the examples of the CashAddr specification
+static const uint8_t hash[20] = {0x76, 0xa0, 0x40, 0x53, 0xbd, 0xa0, 0xa8, 0x8b, 0xda, 0x51,
+                                 0x77, 0xb8, 0x6a, 0x15, 0xc3, 0xb2, 0x9f, 0x55, 0x98, 0x73};
+
+static void test_address_encode_base58check(void **state) {
+    (void) state;
+
+    char out[64];
+
+    assert_int_equal(address_encode_base58check(hash, 0x00, out, sizeof(out)), 34);
+    assert_string_equal(out, "1BpEi6DfDAUFd7GtittLSdBeYJvcoaVggu");
+
+    // 2-bytes and 4-bytes versions
+    assert_int_equal(address_encode_base58check(hash, 0x1cb8, out, sizeof(out)), 35);
+    assert_string_equal(out, "t1UgqiRdoBVFrDkKnfKhTaSHZny7heNpLci");
+    assert_int_equal(address_encode_base58check(hash, 0x01020304, out, sizeof(out)), 37);
+    assert_string_equal(out, "bsYnyzgHQSBLiP5cGojrHhANktZxPHBEcAdUL");
+
+    // leading zeros
+    const uint8_t zero_hash[20] = {0};
+    assert_int_equal(address_encode_base58check(zero_hash, 0x00, out, sizeof(out)), 27);
+    assert_string_equal(out, "1111111111111111111114oLvT2");
+
+    // the buffer must have space for the terminating null character
+    assert_int_equal(address_encode_base58check(hash, 0x00, out, 35), 34);
+    assert_int_equal(address_encode_base58check(hash, 0x00, out, 34), -1);
+}
+
+static void test_address_encode_segwit(void **state) {
+    (void) state;
+
+    char out[100];
+
+    assert_int_equal(address_encode_segwit("bc", 0, hash, 20, out, sizeof(out)), 42);
+    assert_string_equal(out, "bc1qw6syq5aa5z5ghkj3w7ux59wrk204txrn9k4rmm");
+    assert_int_equal(strlen(out), 42);
+
+    uint8_t witprog[32];
+    memset(witprog, 0x5a, sizeof(witprog));
+    int len = address_encode_segwit("tb", 1, witprog, 32, out, sizeof(out));
+    assert_int_equal(len, 62);
+    assert_int_equal(strlen(out), 62);
+
+    assert_int_equal(address_encode_segwit("bc", 0, hash, 20, out, 43), 42);
+    assert_int_equal(address_encode_segwit("bc", 0, hash, 20, out, 42), -1);
+    assert_int_equal(address_encode_segwit("bc", 0, hash, 19, out, sizeof(out)), -1);
+    assert_int_equal(address_encode_segwit("bc", 17, hash, 20, out, sizeof(out)), -1);
+}
+
+static void test_address_encode_cashaddr(void **state) {
+    (void) state;
+
+    char out[CASHADDR_ADDRESS_LENGTH + 1];
+
+    assert_int_equal(address_encode_cashaddr(hash, CASHADDR_TYPE_P2PKH, out, sizeof(out)),
+                     CASHADDR_ADDRESS_LENGTH);
+    assert_string_equal(out, "qpm2qsznhks23z7629mms6s4cwef74vcwvy22gdx6a");
+
+    assert_int_equal(address_encode_cashaddr(hash, CASHADDR_TYPE_P2SH, out, sizeof(out)),
+                     CASHADDR_ADDRESS_LENGTH);
+    assert_string_equal(out, "ppm2qsznhks23z7629mms6s4cwef74vcwvn0h829pq");
+
+    assert_int_equal(address_encode_cashaddr(hash, 2, out, sizeof(out)), -1);
+    assert_int_equal(address_encode_cashaddr(hash, CASHADDR_TYPE_P2PKH, out, sizeof(out) - 1), -1);
+}
+
+int main() {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_address_encode_base58check),
+        cmocka_unit_test(test_address_encode_segwit),
+        cmocka_unit_test(test_address_encode_cashaddr),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -3,7 +3,9 @@
 #include <setjmp.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include <cmocka.h>
 
@@ -27,8 +29,116 @@ static void test_base58(void **state) {
     assert_string_equal((char *) out2, expected_out2);
 }
 
+// clang-format off
+static const struct {
+    const char *hex;
+    const char *base58;
+} test_vectors[] = {
+    {"61", "2g"},
+    {"626262", "a3gV"},
+    {"ecac89cad93923c02321", "EJDM8drfXA6uyA"},
+    {"00eb15231dfceb60925886b67d065299925915aeb172c06647", "1NS17iag9jJgTHD1VXjvLCEnZuQ3rJDE9L"},
+    {"00000000000000000000", "1111111111"},
+    {"000111d38e5fc9071ffcd20b4a763cc9ae4f252bb4e48fd66a835e252ada93ff480d6dd43dc62a641155a5",
+     "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz"},
+};
+// clang-format on
+
+static size_t hex_to_bytes(const char *hex, uint8_t *out) {
+    size_t len = strlen(hex) / 2;
+    for (size_t i = 0; i < len; i++) {
+        unsigned int byte;
+        sscanf(hex + 2 * i, "%2x", &byte);
+        out[i] = (uint8_t) byte;
+    }
+    return len;
+}
+
+static void test_base58_vectors(void **state) {
+    (void) state;
+
+    for (size_t i = 0; i < sizeof(test_vectors) / sizeof(test_vectors[0]); i++) {
+        uint8_t bytes[64];
+        size_t bytes_len = hex_to_bytes(test_vectors[i].hex, bytes);
+        size_t base58_len = strlen(test_vectors[i].base58);
+
+        char encoded[100] = {0};
+        int encoded_len = base58_encode(bytes, bytes_len, encoded, sizeof(encoded));
+        assert_int_equal(encoded_len, base58_len);
+        assert_memory_equal(encoded, test_vectors[i].base58, base58_len);
+
+        uint8_t decoded[64];
+        int decoded_len =
+            base58_decode(test_vectors[i].base58, base58_len, decoded, sizeof(decoded));
+        assert_int_equal(decoded_len, bytes_len);
+        assert_memory_equal(decoded, bytes, bytes_len);
+
+        // output buffers that are too short
+        assert_int_equal(base58_encode(bytes, bytes_len, encoded, base58_len - 1), -1);
+        assert_int_equal(base58_decode(test_vectors[i].base58, base58_len, decoded, bytes_len - 1),
+                         -1);
+    }
+}
+
+static void test_base58_decode_invalid(void **state) {
+    (void) state;
+
+    uint8_t out[100];
+
+    // invalid characters
+    assert_int_equal(base58_decode("2g0", 3, out, sizeof(out)), -1);
+    assert_int_equal(base58_decode("2gO", 3, out, sizeof(out)), -1);
+    assert_int_equal(base58_decode("2gI", 3, out, sizeof(out)), -1);
+    assert_int_equal(base58_decode("2gl", 3, out, sizeof(out)), -1);
+    assert_int_equal(base58_decode("2g ", 3, out, sizeof(out)), -1);
+
+    // too short
+    assert_int_equal(base58_decode("2", 1, out, sizeof(out)), -1);
+
+    // too long
+    char in[MAX_DEC_INPUT_SIZE + 1];
+    memset(in, 'z', sizeof(in));
+    assert_int_equal(base58_decode(in, sizeof(in), out, sizeof(out)), -1);
+}
+
+// Not a regression test: measures the throughput of the encoding and decoding of an xpub
+static void test_base58_throughput(void **state) {
+    (void) state;
+
+    const char xpub[] =
+        "tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgF"
+        "xNxXn1d7QkdbL52Ty5jiSLcxPt1P";
+    const int n_iterations = 10000;
+
+    uint8_t decoded[82];
+    char encoded[MAX_ENC_INPUT_SIZE * 138 / 100 + 1];
+
+    clock_t start = clock();
+    for (int i = 0; i < n_iterations; i++) {
+        assert_int_equal(base58_decode(xpub, sizeof(xpub) - 1, decoded, sizeof(decoded)), 82);
+    }
+    clock_t decode_time = clock() - start;
+
+    start = clock();
+    for (int i = 0; i < n_iterations; i++) {
+        assert_int_equal(base58_encode(decoded, sizeof(decoded), encoded, sizeof(encoded)),
+                         sizeof(xpub) - 1);
+    }
+    clock_t encode_time = clock() - start;
+
+    assert_memory_equal(encoded, xpub, sizeof(xpub) - 1);
+
+    printf("base58_decode (xpub): %.0f ns/op\n",
+           1e9 * decode_time / CLOCKS_PER_SEC / n_iterations);
+    printf("base58_encode (xpub): %.0f ns/op\n",
+           1e9 * encode_time / CLOCKS_PER_SEC / n_iterations);
+}
+
 int main() {
-    const struct CMUnitTest tests[] = {cmocka_unit_test(test_base58)};
+    const struct CMUnitTest tests[] = {cmocka_unit_test(test_base58),
+                                       cmocka_unit_test(test_base58_vectors),
+                                       cmocka_unit_test(test_base58_decode_invalid),
+                                       cmocka_unit_test(test_base58_throughput)};
 
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
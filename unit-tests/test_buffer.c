@@ -311,6 +311,31 @@ static void test_buffer_write(void **state) {
     buffer_seek_end(&buf, 8);
     assert_true(buffer_write_u64(&buf, 0x4242424242424242ULL, BE));          // enough space this time 
 
+    // reset data
+    memcpy(data, template, sizeof(template));
+    buffer_seek_set(&buf, 0);
+
+
+    // TEST buffer_write_varint
+    buffer_seek_set(&buf, 3);
+    assert_true(buffer_write_varint(&buf, 0xFC));
+    assert_int_equal(data[3], 0xFC);
+    assert_int_equal(data[4], 0x04);
+    assert_int_equal(buf.offset, 4);
+    assert_true(buffer_write_varint(&buf, 0x3344));
+    assert_int_equal(data[4], 0xFD);
+    assert_int_equal(data[5], 0x44);
+    assert_int_equal(data[6], 0x33);
+    assert_int_equal(data[7], 0x07);
+    assert_int_equal(buf.offset, 7);
+
+    buffer_seek_end(&buf, 4);
+    assert_false(buffer_write_varint(&buf, 0x33445566));                  // not enough space
+    assert_int_equal(data[sizeof(data) - 4], template[sizeof(data) - 4]); // shouldn't change data if not enough space
+    buffer_seek_end(&buf, 5);
+    assert_true(buffer_write_varint(&buf, 0x33445566));                   // enough space this time
+    assert_int_equal(data[sizeof(data) - 5], 0xFE);
+    assert_int_equal(buf.offset, buf.size);
 }
 
 static void test_buffer_create(void **state) {
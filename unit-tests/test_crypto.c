@@ -7,17 +7,16 @@
 #include <cmocka.h>
 
 #include "../src/crypto.h"
+#include "../src/common/base58.h"
+#include "../src/common/read.h"
 
-// clang-format off
-// HACK: define empty functions for the expected imports in cx.h and os.h.
-int cx_ecfp_generate_pair ( cx_curve_t curve, cx_ecfp_public_key_t * pubkey, cx_ecfp_private_key_t * privkey, int keepprivate ){return 0;}
-int cx_hash_sha256 ( const unsigned char * in, unsigned int len, unsigned char * out, unsigned int out_len ){return 0;}
-int cx_hash ( cx_hash_t * hash, int mode, const unsigned char * in, unsigned int len, unsigned char * out, unsigned int out_len ){return 0;}
-int cx_ecfp_init_private_key ( cx_curve_t curve, const unsigned char * rawkey, unsigned int key_len, cx_ecfp_private_key_t * pvkey ){return 0;}
-int cx_ripemd160_init ( cx_ripemd160_t * hash ){return 0;}
-void os_memmove(void * dst, const void * src, unsigned int length){}
-void os_perso_derive_node_bip32 ( cx_curve_t curve, const unsigned int * path, unsigned int pathLength, unsigned char * privateKey, unsigned char * chain ){}
+#define H 0x80000000u
+
+// from mock_cx.c
+extern unsigned int G_mock_derive_node_bip32_calls;
+void mock_set_mnemonic(const char *mnemonic);
 
+// clang-format off
 const uint8_t uncompressed_key_02[] = {
     0x04,
     0xee,0x86,0x08,0x20,0x7e,0x21,0x02,0x84,0x26,0xf6,0x9e,0x76,0x44,0x7d,0x7e,0x3d,
@@ -104,11 +103,478 @@ static void test_get_compressed_pubkey_invalid(void **state) {
     assert_int_equal(ret, -1);
 }
 
+static void test_get_master_key_fingerprint(void **state) {
+    (void) state;
+
+    // fingerprint of the seed of the default mnemonic, used by the mocked key derivation
+    assert_int_equal(crypto_get_master_key_fingerprint(), 0xf5acc2fd);
+
+    // cached value
+    assert_int_equal(crypto_get_master_key_fingerprint(), 0xf5acc2fd);
+
+    crypto_clear_key_caches();
+    assert_int_equal(crypto_get_master_key_fingerprint(), 0xf5acc2fd);
+}
+
+static void test_get_serialized_extended_pubkey_at_path(void **state) {
+    (void) state;
+
+    const uint32_t path[] = {H | 84, H | 1, H | 0};
+    char out[MAX_SERIALIZED_PUBKEY_LENGTH + 1];
+    int ret = get_serialized_extended_pubkey_at_path(path, 3, 0x043587CF, out);
+
+    const char expected[] =
+        "tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgF"
+        "xNxXn1d7QkdbL52Ty5jiSLcxPt1P";
+    assert_int_equal(ret, strlen(expected));
+    assert_string_equal(out, expected);
+
+    // the same path again, from the cache
+    memset(out, 0, sizeof(out));
+    ret = get_serialized_extended_pubkey_at_path(path, 3, 0x043587CF, out);
+    assert_int_equal(ret, strlen(expected));
+    assert_string_equal(out, expected);
+
+    // a different version or path must not be returned from the cache
+    char other[MAX_SERIALIZED_PUBKEY_LENGTH + 1];
+    ret = get_serialized_extended_pubkey_at_path(path, 3, 0x0488B21E, other);
+    assert_true(ret > 0);
+    assert_true(strncmp(other, "xpub", 4) == 0);
+
+    ret = get_serialized_extended_pubkey_at_path(path, 2, 0x043587CF, other);
+    assert_true(ret > 0);
+    assert_true(strcmp(other, expected) != 0);
+
+    ret = get_serialized_extended_pubkey_at_path(path, 3, 0x043587CF, out);
+    assert_int_equal(ret, strlen(expected));
+    assert_string_equal(out, expected);
+}
+
+static void test_get_extended_pubkey_at_path(void **state) {
+    (void) state;
+
+    const uint32_t path[] = {H | 84, H | 1, H | 0};
+
+    serialized_extended_pubkey_t ext_pubkey;
+    assert_int_equal(get_extended_pubkey_at_path(path, 3, 0x043587CF, &ext_pubkey), 0);
+
+    // it must match the decoded serialized pubkey, whether it is computed or cached
+    for (int i = 0; i < 2; i++) {
+        char serialized[MAX_SERIALIZED_PUBKEY_LENGTH + 1];
+        int len = get_serialized_extended_pubkey_at_path(path, 3, 0x043587CF, serialized);
+        assert_true(len > 0);
+
+        serialized_extended_pubkey_check_t decoded;
+        assert_int_equal(base58_decode(serialized, len, (uint8_t *) &decoded, sizeof(decoded)),
+                         sizeof(decoded));
+        assert_memory_equal(&decoded.serialized_extended_pubkey, &ext_pubkey, sizeof(ext_pubkey));
+
+        crypto_clear_key_caches();
+        assert_int_equal(get_extended_pubkey_at_path(path, 3, 0x043587CF, &ext_pubkey), 0);
+    }
+
+    assert_int_equal(get_extended_pubkey_at_path(path, MAX_BIP32_PATH_STEPS + 1, 0, &ext_pubkey),
+                     -1);
+}
+
+static void test_get_extended_pubkey_at_path_child_of_cached(void **state) {
+    (void) state;
+
+    const uint32_t path[] = {H | 48, H | 1, H | 0, H | 2, 7};
+
+    // computed from the seed
+    crypto_clear_key_caches();
+    serialized_extended_pubkey_t expected;
+    assert_int_equal(get_extended_pubkey_at_path(path, 5, 0x043587CF, &expected), 0);
+
+    uint8_t pubkey[33], chain_code[32];
+    assert_true(crypto_get_compressed_pubkey_at_path(path, 5, pubkey, chain_code));
+    assert_memory_equal(expected.compressed_pubkey, pubkey, 33);
+    assert_memory_equal(expected.chain_code, chain_code, 32);
+
+    assert_true(crypto_get_compressed_pubkey_at_path(path, 4, pubkey, NULL));
+    assert_int_equal(read_u32_be(expected.parent_fingerprint, 0),
+                     crypto_get_key_fingerprint(pubkey));
+    assert_int_equal(expected.depth, 5);
+    assert_int_equal(read_u32_be(expected.child_number, 0), 7);
+
+    // computed from the cached extended pubkey of the parent
+    crypto_clear_key_caches();
+    serialized_extended_pubkey_t ext_pubkey;
+    assert_int_equal(get_extended_pubkey_at_path(path, 4, 0x043587CF, &ext_pubkey), 0);
+    assert_int_equal(get_extended_pubkey_at_path(path, 5, 0x043587CF, &ext_pubkey), 0);
+    assert_memory_equal(&ext_pubkey, &expected, sizeof(expected));
+}
+
+static void test_get_extended_pubkey_at_path_persistent_cache(void **state) {
+    (void) state;
+
+    const uint32_t path[] = {H | 84, H | 1, H | 0};
+    const uint32_t other_account_path[] = {H | 84, H | 1, H | 7};
+
+    crypto_clear_key_caches();
+    serialized_extended_pubkey_t expected;
+    assert_int_equal(get_extended_pubkey_at_path(path, 3, 0x043587CF, &expected), 0);
+
+    // after the RAM caches are cleared (as after a restart), the key is not derived again; the
+    // master key fingerprint is computed first, as the hosts request it when they connect
+    crypto_clear_key_caches();
+    crypto_get_master_key_fingerprint();
+    G_mock_derive_node_bip32_calls = 0;
+    serialized_extended_pubkey_t ext_pubkey;
+    assert_int_equal(get_extended_pubkey_at_path(path, 3, 0x043587CF, &ext_pubkey), 0);
+    assert_memory_equal(&ext_pubkey, &expected, sizeof(expected));
+    assert_int_equal(G_mock_derive_node_bip32_calls, 0);
+
+    // accounts with a large index are not persisted
+    for (int i = 0; i < 2; i++) {
+        crypto_clear_key_caches();
+        crypto_get_master_key_fingerprint();
+        G_mock_derive_node_bip32_calls = 0;
+        assert_int_equal(
+            get_extended_pubkey_at_path(other_account_path, 3, 0x043587CF, &ext_pubkey),
+            0);
+        assert_int_equal(G_mock_derive_node_bip32_calls, 1);
+    }
+
+    // a different seed does not get the persisted keys of the previous one, and wipes them
+    mock_set_mnemonic(
+        "abandon abandon abandon abandon abandon abandon abandon abandon abandon abandon abandon "
+        "about");
+    crypto_clear_key_caches();
+    assert_int_equal(get_extended_pubkey_at_path(path, 3, 0x043587CF, &ext_pubkey), 0);
+    assert_true(memcmp(&ext_pubkey, &expected, sizeof(expected)) != 0);
+
+    mock_set_mnemonic(NULL);
+    crypto_clear_key_caches();
+    crypto_get_master_key_fingerprint();
+    G_mock_derive_node_bip32_calls = 0;
+    assert_int_equal(get_extended_pubkey_at_path(path, 3, 0x043587CF, &ext_pubkey), 0);
+    assert_memory_equal(&ext_pubkey, &expected, sizeof(expected));
+    assert_int_equal(G_mock_derive_node_bip32_calls, 1);
+}
+
+static void test_bip32_CKDpub(void **state) {
+    (void) state;
+
+    const uint32_t path[] = {H | 84, H | 1, H | 0, 1, 7};
+
+    serialized_extended_pubkey_t key;
+    assert_true(
+        crypto_get_compressed_pubkey_at_path(path, 3, key.compressed_pubkey, key.chain_code));
+
+    uint8_t expected_pubkey[33];
+    assert_true(crypto_get_compressed_pubkey_at_path(path, 5, expected_pubkey, NULL));
+
+    // in place
+    assert_int_equal(bip32_CKDpub(&key, path[3], &key), 0);
+    assert_int_equal(bip32_CKDpub(&key, path[4], &key), 0);
+    assert_memory_equal(key.compressed_pubkey, expected_pubkey, 33);
+
+    // same derivation from the uncompressed points
+    uint8_t pubkey[65], chain_code[32];
+    assert_true(crypto_get_compressed_pubkey_at_path(path, 3, expected_pubkey, chain_code));
+    assert_int_equal(crypto_get_uncompressed_pubkey(expected_pubkey, pubkey), 0);
+    assert_int_equal(bip32_CKDpub_point(pubkey, chain_code, path[3], pubkey), 0);
+    assert_int_equal(bip32_CKDpub_point(pubkey, chain_code, path[4], pubkey), 0);
+
+    uint8_t compressed_pubkey[33];
+    assert_int_equal(crypto_get_compressed_pubkey(pubkey, compressed_pubkey), 0);
+    assert_memory_equal(compressed_pubkey, key.compressed_pubkey, 33);
+
+    assert_int_equal(bip32_CKDpub_point(pubkey, chain_code, 0x80000000, pubkey), -1);
+}
+
+static void test_bip32_CKDpub_range(void **state) {
+    (void) state;
+
+    uint32_t path[] = {H | 84, H | 1, H | 0, 0, 0};
+
+    uint8_t compressed_pubkey[33], pubkey[65], chain_code[32];
+    assert_true(crypto_get_compressed_pubkey_at_path(path, 4, compressed_pubkey, chain_code));
+    assert_int_equal(crypto_get_uncompressed_pubkey(compressed_pubkey, pubkey), 0);
+
+    uint8_t children[3][33];
+    assert_int_equal(bip32_CKDpub_range(pubkey, chain_code, 5, 3, children), 0);
+
+    for (int i = 0; i < 3; i++) {
+        path[4] = 5 + i;
+        assert_true(crypto_get_compressed_pubkey_at_path(path, 5, compressed_pubkey, NULL));
+        assert_memory_equal(children[i], compressed_pubkey, 33);
+    }
+}
+
+static void test_bip32_CKDpriv(void **state) {
+    (void) state;
+
+    const uint32_t path[] = {H | 84, H | 1, H | 0, 1, 3};
+
+    cx_ecfp_private_key_t private_key;
+    uint8_t chain_code[32];
+    assert_int_equal(crypto_derive_private_key(&private_key, chain_code, path, 3), 0);
+
+    uint8_t privkey[32];
+    memcpy(privkey, private_key.d, 32);
+    assert_int_equal(bip32_CKDpriv(privkey, chain_code, path[3]), 0);
+    assert_int_equal(bip32_CKDpriv(privkey, chain_code, path[4]), 0);
+
+    uint8_t expected_chain_code[32];
+    assert_int_equal(crypto_derive_private_key(&private_key, expected_chain_code, path, 5), 0);
+    assert_memory_equal(privkey, private_key.d, 32);
+    assert_memory_equal(chain_code, expected_chain_code, 32);
+
+    assert_int_equal(bip32_CKDpriv(privkey, chain_code, 0x80000000), -1);
+}
+
+static void test_bip32_CKDpriv_hardened(void **state) {
+    (void) state;
+
+    const uint32_t path[] = {H | 84, H | 1, H | 7, 1};
+
+    cx_ecfp_private_key_t private_key;
+    uint8_t chain_code[32];
+    assert_int_equal(crypto_derive_private_key(&private_key, chain_code, path, 2), 0);
+
+    uint8_t privkey[32];
+    memcpy(privkey, private_key.d, 32);
+    assert_int_equal(bip32_CKDpriv_hardened(privkey, chain_code, path[2]), 0);
+
+    uint8_t expected_chain_code[32];
+    assert_int_equal(crypto_derive_private_key(&private_key, expected_chain_code, path, 3), 0);
+    assert_memory_equal(privkey, private_key.d, 32);
+    assert_memory_equal(chain_code, expected_chain_code, 32);
+
+    // hardened and unhardened steps can be mixed
+    assert_int_equal(bip32_CKDpriv(privkey, chain_code, path[3]), 0);
+    assert_int_equal(crypto_derive_private_key(&private_key, expected_chain_code, path, 4), 0);
+    assert_memory_equal(privkey, private_key.d, 32);
+    assert_memory_equal(chain_code, expected_chain_code, 32);
+
+    uint8_t pubkey[33], expected_pubkey[33];
+    assert_int_equal(crypto_get_compressed_pubkey_from_privkey(privkey, pubkey), 0);
+    assert_true(crypto_get_compressed_pubkey_at_path(path, 4, expected_pubkey, NULL));
+    assert_memory_equal(pubkey, expected_pubkey, 33);
+
+    assert_int_equal(bip32_CKDpriv_hardened(privkey, chain_code, 1), -1);
+}
+
+static void test_crypto_hash160(void **state) {
+    (void) state;
+
+    const uint8_t expected[] = {0xb4, 0x72, 0xa2, 0x66, 0xd0, 0xbd, 0x89, 0xc1, 0x37, 0x06,
+                                0xa4, 0x13, 0x2c, 0xcf, 0xb1, 0x6f, 0x7c, 0x3b, 0x9f, 0xcb};
+
+    uint8_t out[20];
+    crypto_hash160(NULL, 0, out);
+    assert_memory_equal(out, expected, 20);
+}
+
+static void test_crypto_hash160_ctx(void **state) {
+    (void) state;
+
+    uint8_t data[150];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t) i;
+    }
+
+    uint8_t expected[20];
+    crypto_hash160(data, sizeof(data), expected);
+
+    // the data is absorbed in chunks of different lengths
+    crypto_hash160_ctx_t ctx;
+    crypto_hash160_init(&ctx);
+    crypto_hash160_update(&ctx, data, 1);
+    crypto_hash160_update(&ctx, data + 1, 64);
+    crypto_hash160_update(&ctx, data + 65, 85);
+
+    uint8_t out[20];
+    crypto_hash160_final(&ctx, out);
+    assert_memory_equal(out, expected, 20);
+}
+
+static void test_crypto_buffered_hash(void **state) {
+    (void) state;
+
+    uint8_t data[300];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t) (3 * i);
+    }
+
+    uint8_t expected[32];
+    crypto_sha256(data, sizeof(data), expected);
+
+    // short updates, updates completing a block exactly, and updates spanning several blocks
+    const size_t chunks[] = {1, 4, 59, 8, 64, 1, 130, 33};
+
+    cx_sha256_t hash_context;
+    cx_sha256_init(&hash_context);
+    crypto_buffered_hash_t bh;
+    crypto_buffered_hash_init(&bh, &hash_context.header);
+    size_t offset = 0;
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+        crypto_buffered_hash_update(&bh, data + offset, chunks[i]);
+        offset += chunks[i];
+    }
+    assert_int_equal(offset, sizeof(data));
+
+    uint8_t out[32];
+    crypto_buffered_hash_digest(&bh, out, 32);
+    assert_memory_equal(out, expected, 32);
+}
+
+static void test_tr_tagged_hash_init_midstate(void **state) {
+    (void) state;
+
+    const struct {
+        const char *tag;
+        const uint32_t *midstate;
+    } tags[] = {
+        {"TapTweak", BIP0341_taptweak_midstate},
+        {"TapSighash", BIP0341_tapsighash_midstate},
+        {"TapLeaf", BIP0341_tapleaf_midstate},
+        {"TapBranch", BIP0341_tapbranch_midstate},
+        {"BIP0322-signed-message", BIP0322_signed_message_midstate},
+    };
+
+    for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+        cx_sha256_t expected_ctx, ctx;
+        crypto_tr_tagged_hash_init(&expected_ctx,
+                                   (const uint8_t *) tags[i].tag,
+                                   strlen(tags[i].tag));
+        crypto_tr_tagged_hash_init_midstate(&ctx, tags[i].midstate);
+
+        uint8_t expected_hash[32], hash[32];
+        crypto_hash_update(&expected_ctx.header, "message", 7);
+        crypto_hash_update(&ctx.header, "message", 7);
+        crypto_hash_digest(&expected_ctx.header, expected_hash, 32);
+        crypto_hash_digest(&ctx.header, hash, 32);
+        assert_memory_equal(hash, expected_hash, 32);
+    }
+}
+
+static void test_tr_tweak_pubkey_seckey(void **state) {
+    (void) state;
+
+    const uint32_t path[] = {H | 86, H | 1, H | 0, 0, 0};
+
+    cx_ecfp_private_key_t private_key;
+    cx_ecfp_public_key_t public_key;
+    uint8_t chain_code[32];
+    assert_int_equal(crypto_derive_private_key(&private_key, chain_code, path, 5), 0);
+    cx_ecfp_generate_pair(CX_CURVE_256K1, &public_key, &private_key, 1);
+
+    uint8_t y_parity, tweaked_pubkey[32];
+    assert_int_equal(crypto_tr_tweak_pubkey(public_key.W + 1, &y_parity, tweaked_pubkey), 0);
+
+    // the tweak of the secret key must match the tweak of the public key
+    assert_int_equal(crypto_tr_tweak_seckey(private_key.d), 0);
+    cx_ecfp_generate_pair(CX_CURVE_256K1, &public_key, &private_key, 1);
+    assert_memory_equal(public_key.W + 1, tweaked_pubkey, 32);
+    assert_int_equal(public_key.W[64] & 1, y_parity);
+}
+
+static void test_tr_tweak_pubkey_seckey_with_merkle_root(void **state) {
+    (void) state;
+
+    const uint32_t path[] = {H | 86, H | 1, H | 0, 0, 0};
+
+    uint8_t merkle_root[32];
+    for (int i = 0; i < 32; i++) {
+        merkle_root[i] = (uint8_t) i;
+    }
+
+    cx_ecfp_private_key_t private_key;
+    cx_ecfp_public_key_t public_key;
+    uint8_t chain_code[32];
+    assert_int_equal(crypto_derive_private_key(&private_key, chain_code, path, 5), 0);
+    cx_ecfp_generate_pair(CX_CURVE_256K1, &public_key, &private_key, 1);
+
+    uint8_t y_parity, tweaked_pubkey[32], keypath_tweaked_pubkey[32];
+    assert_int_equal(crypto_tr_tweak_pubkey_with_merkle_root(public_key.W + 1,
+                                                             merkle_root,
+                                                             &y_parity,
+                                                             tweaked_pubkey),
+                     0);
+    assert_int_equal(crypto_tr_tweak_pubkey(public_key.W + 1, &y_parity, keypath_tweaked_pubkey),
+                     0);
+
+    // the merkle root is committed in the tweak
+    assert_true(memcmp(tweaked_pubkey, keypath_tweaked_pubkey, 32) != 0);
+
+    // the tweak of the secret key must match the tweak of the public key
+    assert_int_equal(crypto_tr_tweak_pubkey_with_merkle_root(public_key.W + 1,
+                                                             merkle_root,
+                                                             &y_parity,
+                                                             tweaked_pubkey),
+                     0);
+    assert_int_equal(crypto_tr_tweak_seckey_with_merkle_root(private_key.d, merkle_root), 0);
+    cx_ecfp_generate_pair(CX_CURVE_256K1, &public_key, &private_key, 1);
+    assert_memory_equal(public_key.W + 1, tweaked_pubkey, 32);
+    assert_int_equal(public_key.W[64] & 1, y_parity);
+}
+
+static void test_crypto_ecdsa_der_to_compact(void **state) {
+    (void) state;
+
+    // r with the 0x00 prefix that keeps it positive, s shorter than 32 bytes
+    uint8_t der[2 + 2 + 33 + 2 + 31];
+    der[0] = 0x30;
+    der[1] = sizeof(der) - 2;
+    der[2] = 0x02;
+    der[3] = 33;
+    der[4] = 0x00;
+    memset(der + 5, 0x81, 32);
+    der[37] = 0x02;
+    der[38] = 31;
+    memset(der + 39, 0x11, 31);
+
+    uint8_t compact[64], expected[64];
+    memset(expected, 0x81, 32);
+    expected[32] = 0x00;
+    memset(expected + 33, 0x11, 31);
+    assert_int_equal(crypto_ecdsa_der_to_compact(der, sizeof(der), compact), 0);
+    assert_memory_equal(compact, expected, 64);
+
+    // the signatures of crypto_ecdsa_sign_sha256_hash_with_raw_key
+    uint8_t seckey[32], hash[32], sig[MAX_DER_SIG_LEN];
+    memset(seckey, 0x42, sizeof(seckey));
+    memset(hash, 0x24, sizeof(hash));
+    int sig_len = crypto_ecdsa_sign_sha256_hash_with_raw_key(seckey, hash, sig, NULL);
+    assert_true(sig_len > 0);
+    assert_int_equal(crypto_ecdsa_der_to_compact(sig, sig_len, compact), 0);
+
+    // invalid encodings
+    assert_int_equal(crypto_ecdsa_der_to_compact(der, sizeof(der) - 1, compact), -1);
+    der[38] = 32;
+    assert_int_equal(crypto_ecdsa_der_to_compact(der, sizeof(der), compact), -1);
+    der[38] = 31;
+    der[4] = 0x01;  // r longer than 32 bytes
+    assert_int_equal(crypto_ecdsa_der_to_compact(der, sizeof(der), compact), -1);
+}
+
 int main() {
-    const struct CMUnitTest tests[] = {cmocka_unit_test(test_get_compressed_pubkey_02),
-                                       cmocka_unit_test(test_get_compressed_pubkey_03),
-                                       cmocka_unit_test(test_get_compressed_pubkey_in_place),
-                                       cmocka_unit_test(test_get_compressed_pubkey_invalid)};
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_get_compressed_pubkey_02),
+        cmocka_unit_test(test_get_compressed_pubkey_03),
+        cmocka_unit_test(test_get_compressed_pubkey_in_place),
+        cmocka_unit_test(test_get_compressed_pubkey_invalid),
+        cmocka_unit_test(test_get_master_key_fingerprint),
+        cmocka_unit_test(test_get_serialized_extended_pubkey_at_path),
+        cmocka_unit_test(test_get_extended_pubkey_at_path),
+        cmocka_unit_test(test_get_extended_pubkey_at_path_child_of_cached),
+        cmocka_unit_test(test_get_extended_pubkey_at_path_persistent_cache),
+        cmocka_unit_test(test_bip32_CKDpub),
+        cmocka_unit_test(test_bip32_CKDpub_range),
+        cmocka_unit_test(test_bip32_CKDpriv),
+        cmocka_unit_test(test_bip32_CKDpriv_hardened),
+        cmocka_unit_test(test_crypto_hash160),
+        cmocka_unit_test(test_crypto_hash160_ctx),
+        cmocka_unit_test(test_crypto_buffered_hash),
+        cmocka_unit_test(test_tr_tagged_hash_init_midstate),
+        cmocka_unit_test(test_tr_tweak_pubkey_seckey),
+        cmocka_unit_test(test_tr_tweak_pubkey_seckey_with_merkle_root),
+        cmocka_unit_test(test_crypto_ecdsa_der_to_compact),
+    };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -3,6 +3,7 @@
 #include <setjmp.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
 
 #include <cmocka.h>
@@ -82,6 +83,75 @@ static void test_format_fpu64(void **state) {
     assert_false(format_fpu64(temp2, sizeof(temp2) - 20, amount, 18));
 }
 
+static void test_format_amount(void **state) {
+    (void) state;
+
+    char temp[22] = {0};
+
+    assert_int_equal(format_amount(temp, sizeof(temp), 0, 8), 1);
+    assert_string_equal(temp, "0");
+
+    assert_int_equal(format_amount(temp, sizeof(temp), 1, 8), 10);
+    assert_string_equal(temp, "0.00000001");
+
+    assert_int_equal(format_amount(temp, sizeof(temp), 123450000, 8), 6);
+    assert_string_equal(temp, "1.2345");
+
+    assert_int_equal(format_amount(temp, sizeof(temp), 2100000000000000ull, 8), 8);
+    assert_string_equal(temp, "21000000");
+
+    assert_int_equal(format_amount(temp, sizeof(temp), 1234567, 6), 8);
+    assert_string_equal(temp, "1.234567");
+
+    assert_int_equal(format_amount(temp, sizeof(temp), 18446744073709551615ull, 0), 20);
+    assert_string_equal(temp, "18446744073709551615");
+
+    assert_int_equal(format_amount(temp, sizeof(temp), 18446744073709551615ull, 6), 21);
+    assert_string_equal(temp, "18446744073709.551615");
+
+    // buffer too small
+    assert_int_equal(format_amount(temp, 6, 123450000, 8), -1);
+    assert_int_equal(format_amount(temp, 7, 123450000, 8), 6);
+
+    assert_int_equal(format_amount(temp, sizeof(temp), 12345, 19), 21);
+    assert_string_equal(temp, "0.0000000000000012345");
+
+    // too many decimals
+    assert_int_equal(format_amount(temp, sizeof(temp), 1, MAX_FORMAT_AMOUNT_DECIMALS + 1), -1);
+}
+
+static void test_format_u64_digits(void **state) {
+    (void) state;
+
+    // compares with printf around each power of 10, around the 32-bit boundary, and around
+    // pseudo-random multiples of 10^8
+    char temp[21];
+    char expected[21];
+    uint64_t p = 1;
+    for (int i = 0; i < 20; i++, p *= 10) {
+        for (uint64_t value = p - 2; value != p + 2; value++) {
+            snprintf(expected, sizeof(expected), "%llu", (unsigned long long) value);
+            assert_true(format_u64(temp, sizeof(temp), value));
+            assert_string_equal(temp, expected);
+        }
+    }
+    for (uint64_t value = 0xFFFFFFFEull; value != 0x100000002ull; value++) {
+        snprintf(expected, sizeof(expected), "%llu", (unsigned long long) value);
+        assert_true(format_u64(temp, sizeof(temp), value));
+        assert_string_equal(temp, expected);
+    }
+    uint64_t seed = 1;
+    for (int i = 0; i < 10000; i++) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        uint64_t multiple = (seed % 184467440737ull) * 100000000ull;
+        for (uint64_t value = multiple - 1; value != multiple + 1; value++) {
+            snprintf(expected, sizeof(expected), "%llu", (unsigned long long) value);
+            assert_true(format_u64(temp, sizeof(temp), value));
+            assert_string_equal(temp, expected);
+        }
+    }
+}
+
 static void test_format_hex(void **state) {
     (void) state;
 
@@ -99,6 +169,8 @@ int main() {
     const struct CMUnitTest tests[] = {cmocka_unit_test(test_format_i64),
                                        cmocka_unit_test(test_format_u64),
                                        cmocka_unit_test(test_format_fpu64),
+                                       cmocka_unit_test(test_format_amount),
+                                       cmocka_unit_test(test_format_u64_digits),
                                        cmocka_unit_test(test_format_hex)};
 
     return cmocka_run_group_tests(tests, NULL, NULL);
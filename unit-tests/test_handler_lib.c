@@ -0,0 +1,800 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "../src/crypto.h"
+
+#include "../src/common/wallet.h"
+#include "../src/handler/client_commands.h"
+#include "../src/handler/lib/check_merkle_tree_sorted.h"
+#include "../src/handler/lib/authenticated_token.h"
+#include "../src/handler/lib/get_merkle_leaf_element.h"
+#include "../src/handler/lib/get_merkle_leaf_hash.h"
+#include "../src/handler/lib/get_merkle_leaf_index.h"
+#include "../src/handler/lib/get_merkleized_map.h"
+#include "../src/handler/lib/get_merkleized_map_value.h"
+#include "../src/handler/lib/get_merkle_preimage.h"
+#include "../src/handler/lib/get_preimage.h"
+#include "../src/handler/lib/ownership_token.h"
+#include "../src/handler/lib/policy.h"
+#include "../src/handler/lib/stream_merkle_leaves.h"
+
+#include "mock_client.h"
+
+// in unit tests, size_t integers are currently 8 compiled as 8 bytes; therefore, in the app
+// about half of the memory would be needed
+#define MAX_POLICY_MAP_MEMORY_SIZE 256
+
+static dispatcher_context_t dc;
+
+// Adds a list of n elements, where the element i is (i % 256) repeated (i % 300) + 1 times; with
+// the longest elements, the leaves span more than one response. Returns the Merkle root.
+static void add_test_list(size_t n, uint8_t root[static 32]) {
+    uint8_t **elements = malloc(n * sizeof(uint8_t *));
+    size_t *lens = malloc(n * sizeof(size_t));
+    for (size_t i = 0; i < n; i++) {
+        lens[i] = (i % 300) + 1;
+        elements[i] = malloc(lens[i]);
+        memset(elements[i], (int) (i % 256), lens[i]);
+    }
+    mock_client_add_list((const uint8_t *const *) elements, lens, n, root);
+    for (size_t i = 0; i < n; i++) {
+        free(elements[i]);
+    }
+    free(elements);
+    free(lens);
+}
+
+static void test_call_get_preimage(void **state) {
+    (void) state;
+
+    mock_client_init(&dc, 0);
+
+    uint8_t data[600];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t) i;
+    }
+
+    // the preimage of a long element spans several responses
+    for (size_t len = 0; len <= sizeof(data); len += 50) {
+        uint8_t hash[32], out[601];
+        mock_client_add_preimage(data, len, hash);
+
+        int res = call_get_preimage(&dc, hash, out, sizeof(out));
+        assert_int_equal(res, len + 1);
+        assert_int_equal(out[0], 0x00);
+        assert_memory_equal(out + 1, data, len);
+    }
+
+    // unknown preimage
+    uint8_t hash[32] = {0}, out[32];
+    assert_true(call_get_preimage(&dc, hash, out, sizeof(out)) < 0);
+}
+
+static void test_call_get_preimage_into(void **state) {
+    (void) state;
+
+    mock_client_init(&dc, 0);
+
+    uint8_t data[600];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t) i;
+    }
+    uint8_t hash[32];
+    mock_client_add_preimage(data, sizeof(data), hash);
+
+    // only a window of the preimage, spanning several responses, is copied
+    uint8_t out[300];
+    memset(out, 0xEE, sizeof(out));
+    preimage_destination_t dest = {.is_merkle_leaf = true,
+                                   .offset = 250,
+                                   .out = out,
+                                   .out_len = 200};
+    assert_int_equal(call_get_preimage_into(&dc, hash, &dest), sizeof(data));
+    assert_memory_equal(out, data + 250, 200);
+    assert_int_equal(out[200], 0xEE);
+
+    // the window is truncated at the end of the preimage
+    dest.offset = 500;
+    assert_int_equal(call_get_preimage_into(&dc, hash, &dest), sizeof(data));
+    assert_memory_equal(out, data + 500, 100);
+    assert_int_equal(out[100], (uint8_t) (250 + 100));  // left from the previous call
+
+    // verify and discard
+    preimage_destination_t discard = {.is_merkle_leaf = true};
+    assert_int_equal(call_get_preimage_into(&dc, hash, &discard), sizeof(data));
+
+    // the whole preimage is required, and does not fit
+    assert_true(call_get_merkle_preimage(&dc, hash, out, sizeof(out)) < 0);
+    assert_true(call_get_preimage(&dc, hash, out, sizeof(out)) < 0);
+
+    // wrong hash
+    uint8_t wrong_hash[32] = {0};
+    assert_true(call_get_preimage_into(&dc, wrong_hash, &discard) < 0);
+}
+
+typedef struct {
+    size_t n_received;
+    uint8_t received[MAX_GET_PREIMAGES_HASHES][200];
+    size_t received_lens[MAX_GET_PREIMAGES_HASHES];
+} received_preimages_t;
+
+static int receive_preimage_callback(size_t index, buffer_t *preimage, void *state_ptr) {
+    received_preimages_t *state = (received_preimages_t *) state_ptr;
+    assert_int_equal(index, state->n_received);
+    size_t len = preimage->size - preimage->offset;
+    memcpy(state->received[index], buffer_get_cur(preimage), len);
+    state->received_lens[index] = len;
+    ++state->n_received;
+    return 0;
+}
+
+static void test_call_get_merkle_preimages(void **state) {
+    (void) state;
+
+    uint8_t data[200];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t) (3 * i);
+    }
+
+    // the same results with the whole responses, and with chunks cut everywhere in the stream
+    const uint8_t chunk_lens[] = {1, 3, 7};
+    for (size_t n_chunk_lens = 0; n_chunk_lens <= sizeof(chunk_lens); n_chunk_lens += 3) {
+        mock_client_init(&dc, CLIENT_CAPABILITY_BATCHED_PREIMAGES);
+        mock_client_set_chunk_lens(chunk_lens, n_chunk_lens);
+
+        uint8_t hashes[MAX_GET_PREIMAGES_HASHES][32];
+        size_t lens[MAX_GET_PREIMAGES_HASHES];
+        for (size_t i = 0; i < MAX_GET_PREIMAGES_HASHES; i++) {
+            // with an empty preimage, and preimages spanning several responses
+            lens[i] = (37 * i) % 190;
+            mock_client_add_preimage(data + i, lens[i], hashes[i]);
+        }
+
+        for (size_t n = 1; n <= MAX_GET_PREIMAGES_HASHES; n++) {
+            mock_client_reset_stats();
+
+            received_preimages_t received = {.n_received = 0};
+            uint8_t out[200];
+            assert_int_equal(call_get_merkle_preimages(&dc,
+                                                       (const uint8_t(*)[32]) hashes,
+                                                       n,
+                                                       out,
+                                                       sizeof(out),
+                                                       receive_preimage_callback,
+                                                       &received),
+                             0);
+            assert_int_equal(received.n_received, n);
+            for (size_t i = 0; i < n; i++) {
+                assert_int_equal(received.received_lens[i], lens[i]);
+                assert_memory_equal(received.received[i], data + i, lens[i]);
+            }
+            assert_int_equal(mock_client_get_stats()->n_commands[CCMD_GET_PREIMAGES], 1);
+            assert_int_equal(mock_client_get_stats()->n_commands[CCMD_GET_PREIMAGE], 0);
+        }
+
+        received_preimages_t received = {.n_received = 0};
+        uint8_t out[200];
+
+        // a preimage longer than the buffer
+        assert_true(call_get_merkle_preimages(&dc,
+                                              (const uint8_t(*)[32]) hashes,
+                                              2,
+                                              out,
+                                              lens[1] - 1,
+                                              receive_preimage_callback,
+                                              &received) < 0);
+
+        // an unknown preimage
+        memset(hashes[1], 0, 32);
+        assert_true(call_get_merkle_preimages(&dc,
+                                              (const uint8_t(*)[32]) hashes,
+                                              2,
+                                              out,
+                                              sizeof(out),
+                                              receive_preimage_callback,
+                                              &received) < 0);
+    }
+}
+
+static void test_call_get_merkle_leaf_element(void **state) {
+    (void) state;
+
+    mock_client_init(&dc, 0);
+
+    // with 1000 leaves, the proofs do not fit in a single response
+    const size_t sizes[] = {1, 2, 3, 5, 8, 13, 1000};
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        uint8_t root[32];
+        add_test_list(sizes[k], root);
+
+        for (size_t i = 0; i < sizes[k]; i += 1 + sizes[k] / 20) {
+            uint8_t out[300], expected[300];
+            memset(expected, (int) (i % 256), sizeof(expected));
+
+            int res = call_get_merkle_leaf_element(&dc, root, sizes[k], i, out, sizeof(out));
+            assert_int_equal(res, (i % 300) + 1);
+            assert_memory_equal(out, expected, res);
+        }
+
+        // wrong tree size
+        uint8_t out[300];
+        assert_true(call_get_merkle_leaf_element(&dc, root, sizes[k] + 1, 0, out, sizeof(out)) < 0);
+    }
+}
+
+static void test_call_get_merkle_leaf_hashes(void **state) {
+    (void) state;
+
+    mock_client_init(&dc, 0);
+
+    uint8_t root[32];
+    add_test_list(200, root);
+
+    const uint32_t indices[] = {0, 1, 7, 64, 100, 199};
+    uint8_t hashes[6][32];
+    assert_int_equal(call_get_merkle_leaf_hashes(&dc, root, 200, 6, indices, hashes), 0);
+
+    for (size_t i = 0; i < 6; i++) {
+        uint8_t element[300], expected[32];
+        size_t len = (indices[i] % 300) + 1;
+        memset(element, (int) (indices[i] % 256), len);
+        merkle_compute_element_hash(element, len, expected);
+        assert_memory_equal(hashes[i], expected, 32);
+    }
+}
+
+static void test_call_get_merkle_leaf_index(void **state) {
+    (void) state;
+
+    mock_client_init(&dc, 0);
+
+    uint8_t root[32];
+    add_test_list(20, root);
+
+    uint8_t element[13], leaf_hash[32];
+    memset(element, 12, sizeof(element));
+    merkle_compute_element_hash(element, sizeof(element), leaf_hash);
+    assert_int_equal(call_get_merkle_leaf_index(&dc, 20, root, leaf_hash), 12);
+
+    merkle_compute_element_hash(element, sizeof(element) - 1, leaf_hash);
+    assert_true(call_get_merkle_leaf_index(&dc, 20, root, leaf_hash) < 0);
+}
+
+static void test_call_get_merkle_leaf_hash_cached(void **state) {
+    (void) state;
+
+    // the largest tree is deeper than MERKLE_PATH_CACHE_DEPTH, and verified with whole proofs
+    const uint32_t sizes[] = {1, 2, 3, 7, 16, 31, 37};
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        uint32_t n = sizes[k];
+
+        mock_client_init(&dc, CLIENT_CAPABILITY_PARTIAL_MERKLE_PROOF);
+        uint8_t root[32], other_root[32];
+        add_test_list(n, root);
+        add_test_list(n + 1, other_root);
+
+        uint8_t expected[37][32], hash[32];
+        for (uint32_t i = 0; i < n; i++) {
+            assert_int_equal(call_get_merkle_leaf_hash(&dc, root, n, i, expected[i]), 0);
+        }
+
+        // the leaves in order, then backwards, then with a stride, then again after a leaf of
+        // another tree
+        merkle_path_cache_t cache = {.is_valid = false};
+        mock_client_reset_stats();
+        for (uint32_t i = 0; i < n; i++) {
+            assert_int_equal(call_get_merkle_leaf_hash_cached(&dc, &cache, root, n, i, hash), 0);
+            assert_memory_equal(hash, expected[i], 32);
+        }
+        uint64_t sequential_bytes = mock_client_get_stats()->response_bytes;
+        for (uint32_t i = n; i > 0; i--) {
+            assert_int_equal(call_get_merkle_leaf_hash_cached(&dc, &cache, root, n, i - 1, hash),
+                             0);
+            assert_memory_equal(hash, expected[i - 1], 32);
+        }
+        for (uint32_t i = 0; i < 3 * n; i += 5) {
+            assert_int_equal(
+                call_get_merkle_leaf_hash_cached(&dc, &cache, root, n, i % n, hash),
+                0);
+            assert_memory_equal(hash, expected[i % n], 32);
+        }
+        assert_int_equal(call_get_merkle_leaf_hash_cached(&dc, &cache, other_root, n + 1, 0, hash),
+                         0);
+        assert_int_equal(call_get_merkle_leaf_hash_cached(&dc, &cache, root, n, n - 1, hash), 0);
+        assert_memory_equal(hash, expected[n - 1], 32);
+        bool is_cached = ceil_lg(n) <= MERKLE_PATH_CACHE_DEPTH;
+        assert_int_equal(mock_client_get_stats()->n_commands[CCMD_GET_MERKLE_LEAF_PROOF] == 0,
+                         is_cached);
+
+        // a wrong size of the tree, or a wrong index
+        assert_true(call_get_merkle_leaf_hash_cached(&dc, &cache, root, n + 1, 0, hash) < 0);
+        assert_true(call_get_merkle_leaf_hash_cached(&dc, &cache, root, n, n, hash) < 0);
+
+        // without the cache, each leaf costs a whole proof
+        mock_client_reset_stats();
+        for (uint32_t i = 0; i < n; i++) {
+            assert_int_equal(call_get_merkle_leaf_hash(&dc, root, n, i, hash), 0);
+        }
+        if (is_cached && n >= 7) {
+            assert_true(sequential_bytes < mock_client_get_stats()->response_bytes);
+        }
+    }
+
+    // clients without the capability receive the whole proofs
+    mock_client_init(&dc, 0);
+    uint8_t root[32], hash[32];
+    add_test_list(5, root);
+    merkle_path_cache_t cache = {.is_valid = false};
+    for (uint32_t i = 0; i < 5; i++) {
+        assert_int_equal(call_get_merkle_leaf_hash_cached(&dc, &cache, root, 5, i, hash), 0);
+    }
+    assert_int_equal(mock_client_get_stats()->n_commands[CCMD_GET_MERKLE_LEAF_PARTIAL_PROOF], 0);
+}
+
+static void test_call_get_merkleized_map_value(void **state) {
+    (void) state;
+
+    mock_client_init(&dc, 0);
+
+    // the keys of a PSBT map, with a long value that spans several responses
+    uint8_t long_key[34], long_value[400];
+    long_key[0] = 0x06;
+    memset(long_key + 1, 0x02, 33);
+    memset(long_value, 0xab, sizeof(long_value));
+
+    const uint8_t *keys[] = {(const uint8_t *) "\x00", (const uint8_t *) "\x01", long_key};
+    const size_t key_lens[] = {1, 1, sizeof(long_key)};
+    const uint8_t *values[] = {long_value, (const uint8_t *) "\x42", (const uint8_t *) "xyz"};
+    const size_t value_lens[] = {sizeof(long_value), 1, 3};
+
+    merkleized_map_commitment_t map;
+    mock_client_add_map(keys, key_lens, values, value_lens, 3, &map);
+
+    // the map is also an element of a list of map commitments, as the inputs of a PSBT
+    uint8_t commitment[65], commitments_root[32];
+    commitment[0] = 3;
+    memcpy(commitment + 1, map.keys_root, 32);
+    memcpy(commitment + 33, map.values_root, 32);
+    mock_client_add_list((const uint8_t *const[]){commitment}, (const size_t[]){65}, 1, commitments_root);
+
+    merkleized_map_commitment_t loaded;
+    assert_int_equal(call_get_merkleized_map(&dc, commitments_root, 1, 0, &loaded), 0);
+    assert_int_equal(loaded.size, 3);
+    assert_memory_equal(loaded.keys_root, map.keys_root, 32);
+    assert_true(loaded.cache_complete);
+    assert_int_equal(loaded.n_cached_keys, 2);
+
+    // with the index cache, the key is not proven again
+    for (int i = 0; i < 2; i++) {
+        merkleized_map_commitment_t *m = i == 0 ? &map : &loaded;
+        uint8_t out[400];
+        int res = call_get_merkleized_map_value(&dc, m, keys[0], 1, out, sizeof(out));
+        assert_int_equal(res, sizeof(long_value));
+        assert_memory_equal(out, long_value, sizeof(long_value));
+
+        res = call_get_merkleized_map_value(&dc, m, long_key, sizeof(long_key), out, sizeof(out));
+        assert_int_equal(res, 3);
+        assert_memory_equal(out, "xyz", 3);
+
+        assert_true(call_get_merkleized_map_value(&dc, m, (const uint8_t *) "\x02", 1, out, 1) < 0);
+    }
+}
+
+static int count_leaves_callback(uint32_t index, buffer_t *leaf, void *state) {
+    uint8_t expected[64];
+    size_t len = (index % 300) + 1;
+    memset(expected, (int) (index % 256), len);
+    if (leaf->size - leaf->offset != len || memcmp(buffer_get_cur(leaf), expected, len) != 0) {
+        return -1;
+    }
+    ++*(int *) state;
+    return 0;
+}
+
+static void test_call_stream_merkle_leaves(void **state) {
+    (void) state;
+
+    mock_client_init(&dc, CLIENT_CAPABILITY_STREAM_MERKLE_LEAVES);
+
+    uint8_t root[32], leaf_buf[64];
+    add_test_list(16, root);
+
+    int n_leaves = 0;
+    assert_int_equal(
+        call_stream_merkle_leaves(&dc, root, 16, leaf_buf, sizeof(leaf_buf), count_leaves_callback, &n_leaves),
+        0);
+    assert_int_equal(n_leaves, 16);
+    assert_int_equal(mock_client_get_stats()->n_commands[CCMD_GET_MERKLE_LEAF_PROOF], 0);
+}
+
+static void test_call_check_merkle_tree_sorted(void **state) {
+    (void) state;
+
+    const uint8_t *sorted[] = {(const uint8_t *) "\x00",
+                               (const uint8_t *) "\x01",
+                               (const uint8_t *) "\x01\x00",
+                               (const uint8_t *) "\x06\x02"};
+    const uint8_t *unsorted[] = {(const uint8_t *) "\x00",
+                                 (const uint8_t *) "\x01\x00",
+                                 (const uint8_t *) "\x01",
+                                 (const uint8_t *) "\x06\x02"};
+    const size_t sorted_lens[] = {1, 1, 2, 2}, unsorted_lens[] = {1, 2, 1, 2};
+
+    // the same results with the proofs of each element, with a single stream of all of them, and
+    // with the preimages of each batch of leaf hashes fetched at once
+    const uint8_t capabilities[] = {0,
+                                    CLIENT_CAPABILITY_STREAM_MERKLE_LEAVES,
+                                    CLIENT_CAPABILITY_BATCHED_PREIMAGES};
+    for (size_t i = 0; i < sizeof(capabilities); i++) {
+        mock_client_init(&dc, capabilities[i]);
+
+        uint8_t sorted_root[32], unsorted_root[32];
+        mock_client_add_list(sorted, sorted_lens, 4, sorted_root);
+        mock_client_add_list(unsorted, unsorted_lens, 4, unsorted_root);
+
+        assert_int_equal(call_check_merkle_tree_sorted(&dc, sorted_root, 4), 0);
+        assert_true(call_check_merkle_tree_sorted(&dc, unsorted_root, 4) < 0);
+        // a wrong size of the tree
+        assert_true(call_check_merkle_tree_sorted(&dc, sorted_root, 3) < 0);
+
+        const mock_client_stats_t *stats = mock_client_get_stats();
+        if (capabilities[i] == 0) {
+            assert_int_equal(stats->n_commands[CCMD_STREAM_MERKLE_LEAVES], 0);
+            assert_int_equal(stats->n_commands[CCMD_GET_PREIMAGES], 0);
+        } else if (capabilities[i] == CLIENT_CAPABILITY_BATCHED_PREIMAGES) {
+            // a single batch for each of the two trees with the right size
+            assert_int_equal(stats->n_commands[CCMD_GET_PREIMAGES], 2);
+            assert_int_equal(stats->n_commands[CCMD_GET_PREIMAGE], 0);
+        } else {
+            // the request with the wrong size is refused by the client, and not counted
+            assert_int_equal(stats->n_commands[CCMD_STREAM_MERKLE_LEAVES], 2);
+            assert_int_equal(stats->n_commands[CCMD_GET_MERKLE_MULTIPROOF], 0);
+            assert_int_equal(stats->n_commands[CCMD_GET_MERKLE_LEAF_PROOF], 0);
+            assert_int_equal(stats->n_commands[CCMD_GET_PREIMAGE], 0);
+        }
+    }
+}
+
+static void test_call_get_wallet_script(void **state) {
+    (void) state;
+
+    mock_client_init(&dc, 0);
+
+    const char *key_info =
+        "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9b"
+        "g8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/**";
+    uint8_t keys_root[32];
+    mock_client_add_list((const uint8_t *const[]){(const uint8_t *) key_info},
+                         (const size_t[]){strlen(key_info)},
+                         1,
+                         keys_root);
+
+    uint8_t policy_bytes[MAX_POLICY_MAP_MEMORY_SIZE];
+    const char *policy_map = "wpkh(@0)";
+    buffer_t policy_buf = buffer_create((void *) policy_map, strlen(policy_map));
+    assert_int_equal(parse_policy_map(&policy_buf, policy_bytes, sizeof(policy_bytes)), 0);
+
+    // tb1qzdr7s2sr0dwmkwx033r4nujzk86u0cy6fmzfjk and tb1qlrvzyx8jcjfj2xuy69du9trtxnsvjuped7e289
+    const uint8_t expected[2][22] = {
+        {0x00, 0x14, 0x13, 0x47, 0xe8, 0x2a, 0x03, 0x7b, 0x5d, 0xbb, 0x38,
+         0xcf, 0x8c, 0x47, 0x59, 0xf2, 0x42, 0xb1, 0xf5, 0xc7, 0xe0, 0x9a},
+        {0x00, 0x14, 0xf8, 0xd8, 0x22, 0x18, 0xf2, 0xc4, 0x93, 0x25, 0x1b,
+         0x84, 0xd1, 0x5b, 0xc2, 0xac, 0x6b, 0x34, 0xe0, 0xc9, 0x70, 0x39}};
+    const struct {
+        bool change;
+        size_t address_index;
+    } addresses[] = {{false, 0}, {true, 15}};
+
+    for (size_t i = 0; i < 2; i++) {
+        uint8_t script[34];
+        buffer_t script_buf = buffer_create(script, sizeof(script));
+        int res = call_get_wallet_script(&dc,
+                                         (const policy_node_t *) policy_bytes,
+                                         keys_root,
+                                         1,
+                                         NULL,
+                                         addresses[i].change,
+                                         addresses[i].address_index,
+                                         &script_buf);
+        assert_int_equal(res, 22);
+        assert_memory_equal(script, expected[i], 22);
+    }
+}
+
+static void test_multipath_key(void **state) {
+    (void) state;
+
+    mock_client_init(&dc, 0);
+
+    // the same key as in test_call_get_wallet_script, with the change steps swapped
+    const char *key_info =
+        "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9b"
+        "g8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P/<1;0>/*";
+    uint8_t keys_root[32];
+    mock_client_add_list((const uint8_t *const[]){(const uint8_t *) key_info},
+                         (const size_t[]){strlen(key_info)},
+                         1,
+                         keys_root);
+
+    uint8_t policy_bytes[MAX_POLICY_MAP_MEMORY_SIZE];
+    const char *policy_map = "wpkh(@0)";
+    buffer_t policy_buf = buffer_create((void *) policy_map, strlen(policy_map));
+    assert_int_equal(parse_policy_map(&policy_buf, policy_bytes, sizeof(policy_bytes)), 0);
+
+    // the receive address 15 is tb1qlrvzyx8jcjfj2xuy69du9trtxnsvjuped7e289, the change address 15
+    // of the key with the usual wildcard
+    const uint8_t expected[22] = {0x00, 0x14, 0xf8, 0xd8, 0x22, 0x18, 0xf2, 0xc4, 0x93, 0x25, 0x1b,
+                                  0x84, 0xd1, 0x5b, 0xc2, 0xac, 0x6b, 0x34, 0xe0, 0xc9, 0x70, 0x39};
+
+    static policy_pubkeys_cache_t cache;
+    memset(&cache, 0, sizeof(cache));
+    assert_int_equal(call_load_policy_pubkeys(&dc, keys_root, 1, &cache), 0);
+    assert_int_equal(cache.multipath[0][0], 1);
+    assert_int_equal(cache.multipath[0][1], 0);
+
+    // the steps in the derivation paths are mapped to the receive and change addresses
+    assert_int_equal(policy_pubkeys_cache_get_change(&cache, 1, 1), 0);
+    assert_int_equal(policy_pubkeys_cache_get_change(&cache, 1, 0), 1);
+    assert_int_equal(policy_pubkeys_cache_get_change(&cache, 1, 2), -1);
+
+    // the same script, with or without the cache, and with the precomputed change-level children
+    for (int i = 0; i < 3; i++) {
+        if (i == 2) {
+            assert_int_equal(policy_pubkeys_cache_derive_change_steps(&cache, 1), 0);
+            for (int change = 0; change < POLICY_PUBKEYS_CACHE_CHANGE_STEPS; change++) {
+                assert_true(cache.keys[0][change].is_valid);
+            }
+        }
+
+        uint8_t script[34];
+        buffer_t script_buf = buffer_create(script, sizeof(script));
+        assert_int_equal(call_get_wallet_script(&dc,
+                                                (const policy_node_t *) policy_bytes,
+                                                keys_root,
+                                                1,
+                                                i == 0 ? NULL : &cache,
+                                                false,
+                                                15,
+                                                &script_buf),
+                         22);
+        assert_memory_equal(script, expected, 22);
+    }
+}
+
+// computes the script of the template at the change address 7
+static int get_script_at_change_7(const policy_script_template_t *template,
+                                  const uint8_t keys_root[static 32],
+                                  uint32_t n_keys,
+                                  policy_pubkeys_cache_t *cache,
+                                  uint8_t out[static 34]) {
+    buffer_t out_buf = buffer_create(out, 34);
+    return call_get_wallet_script_from_template(&dc,
+                                                template,
+                                                keys_root,
+                                                n_keys,
+                                                cache,
+                                                true,
+                                                7,
+                                                &out_buf);
+}
+
+static void test_sorted_keys_order(void **state) {
+    (void) state;
+
+    mock_client_init(&dc, 0);
+
+    const char *key_infos[] = {
+        "[f5acc2fd/48'/1'/0'/2']tpubDC2Q4xK4XH72J5ED1ms4f59HXHUJPFQnVNvwjanod1u4UrHv1Mvkw1wg8XFWn"
+        "5prYhR7ik8myqtCdkhzMTnCcjY6gzbxaRj7cUrsv8WfptH/**",
+        "[f5acc2fd/48'/1'/0'/2']tpubDC2Q4xK4XH72JSrxPtt24n9hbk719hpUAN4UcEna8ns3ScmUTC5gy3zdgxzkG"
+        "JQaPyNrM2rSuRUwQ4xHzKo5A8Ei1n2yxPaf8Z6oF7xDu3n/**",
+        "[f5acc2fd/48'/1'/0'/2']tpubDC2Q4xK4XH72Hq8fuxxfQYadnMHKcrWx57c7FMnEoG8r5MHUq2VVfaSVJQU5V"
+        "bGZy6dSiSbCuaGHVQCgByyDpmiBFdjebSURFXvWMcRPnDn/**",
+        "[f5acc2fd/48'/1'/0'/2']tpubDC2Q4xK4XH72GecSqnQXXiAMEKdUEpYUfD2LYANDteyqyzSbJ2e2xvgaWwmRE"
+        "ZUmoPKRocA4SRqWjAvxZBvfNLxVjwLPeAwsL1YdGShpppW/**",
+        "[f5acc2fd/48'/1'/0'/2']tpubDC2Q4xK4XH72HGfBuQJGc1w2wAt1y56aBFGH7NnSTUTFhxxmMTc3K9zYGj3NQ"
+        "epZwTQVGcenSmUao2gtAdCSs11eiLHkWy7WiZejLpC2wTk/**",
+        "[f5acc2fd/48'/1'/0'/2']tpubDC2Q4xK4XH72JSBA7HENpUJdeSttRFKmK4twbg9v1DFHGH7iezJGJHW17H4vc"
+        "cVk8VyLVbB1KXDYR1GBxVxJ5HmaVRbywwSv5SYH7Uvg4ZN/**"};
+    const size_t n_keys = sizeof(key_infos) / sizeof(key_infos[0]);
+    size_t key_info_lens[sizeof(key_infos) / sizeof(key_infos[0])];
+    for (size_t i = 0; i < n_keys; i++) {
+        key_info_lens[i] = strlen(key_infos[i]);
+    }
+    uint8_t keys_root[32];
+    mock_client_add_list((const uint8_t *const *) key_infos, key_info_lens, n_keys, keys_root);
+
+    uint8_t policy_bytes[MAX_POLICY_MAP_MEMORY_SIZE];
+    const char *policy_map = "wsh(sortedmulti(2,@0,@1,@2,@3,@4,@5))";
+    buffer_t policy_buf = buffer_create((void *) policy_map, strlen(policy_map));
+    assert_int_equal(parse_policy_map(&policy_buf, policy_bytes, sizeof(policy_bytes)), 0);
+
+    policy_script_template_t template;
+    assert_int_equal(
+        compile_policy_script_template((const policy_node_t *) policy_bytes, &template),
+        0);
+
+    // the keys are sorted as usual without a cache
+    uint8_t expected[34];
+    assert_int_equal(get_script_at_change_7(&template, keys_root, n_keys, NULL, expected), 34);
+
+    // the order is remembered in the cache, and used at the next derivation of the same address
+    static policy_pubkeys_cache_t cache;
+    memset(&cache, 0, sizeof(cache));
+    for (int i = 0; i < 2; i++) {
+        uint8_t script[34];
+        assert_int_equal(get_script_at_change_7(&template, keys_root, n_keys, &cache, script), 34);
+        assert_memory_equal(script, expected, 34);
+        assert_true(cache.sorted_keys_order.is_valid);
+        assert_int_equal(cache.sorted_keys_order.n, n_keys);
+    }
+    uint8_t order[MAX_POLICY_MAP_COSIGNERS];
+    memcpy(order, cache.sorted_keys_order.order, n_keys);
+
+    // a wrong order is detected, and replaced by the correct one
+    uint8_t wrong_order[MAX_POLICY_MAP_COSIGNERS];
+    for (size_t i = 0; i < n_keys; i++) {
+        wrong_order[i] = order[n_keys - 1 - i];
+    }
+    assert_true(policy_pubkeys_cache_set_sorted_keys_order(&cache, true, 7, wrong_order, n_keys));
+    uint8_t script[34];
+    assert_int_equal(get_script_at_change_7(&template, keys_root, n_keys, &cache, script), 34);
+    assert_memory_equal(script, expected, 34);
+    assert_memory_equal(cache.sorted_keys_order.order, order, n_keys);
+
+    // the order of another address is not used
+    assert_true(policy_pubkeys_cache_set_sorted_keys_order(&cache, true, 8, wrong_order, n_keys));
+    assert_int_equal(get_script_at_change_7(&template, keys_root, n_keys, &cache, script), 34);
+    assert_memory_equal(script, expected, 34);
+
+    // only permutations are accepted
+    const uint8_t repeated[] = {0, 1, 2, 3, 4, 4};
+    const uint8_t out_of_range[] = {0, 1, 2, 3, 4, 6};
+    assert_false(policy_pubkeys_cache_set_sorted_keys_order(&cache, true, 7, repeated, 6));
+    assert_false(policy_pubkeys_cache_set_sorted_keys_order(&cache, true, 7, out_of_range, 6));
+}
+
+static void test_ownership_token(void **state) {
+    (void) state;
+
+    uint8_t wallet_id[32];
+    memset(wallet_id, 0x42, sizeof(wallet_id));
+    const uint8_t script[22] = {0x00, 0x14, 0x13, 0x47, 0xe8, 0x2a, 0x03, 0x7b, 0x5d, 0xbb, 0x38,
+                                0xcf, 0x8c, 0x47, 0x59, 0xf2, 0x42, 0xb1, 0xf5, 0xc7, 0xe0, 0x9a};
+
+    uint8_t token[OWNERSHIP_TOKEN_LEN];
+    compute_ownership_token(wallet_id, 1, 7, script, sizeof(script), token);
+    assert_true(check_ownership_token(wallet_id, 1, 7, script, sizeof(script), token));
+
+    // the token does not depend on the cached key
+    clear_authenticated_token_keys();
+    assert_true(check_ownership_token(wallet_id, 1, 7, script, sizeof(script), token));
+
+    // any change of the authenticated data invalidates the token
+    assert_false(check_ownership_token(wallet_id, 0, 7, script, sizeof(script), token));
+    assert_false(check_ownership_token(wallet_id, 1, 8, script, sizeof(script), token));
+    assert_false(check_ownership_token(wallet_id, 1, 7, script, sizeof(script) - 1, token));
+
+    uint8_t other_script[22];
+    memcpy(other_script, script, sizeof(script));
+    other_script[21] ^= 1;
+    assert_false(check_ownership_token(wallet_id, 1, 7, other_script, sizeof(script), token));
+
+    uint8_t other_wallet_id[32];
+    memcpy(other_wallet_id, wallet_id, sizeof(wallet_id));
+    other_wallet_id[0] ^= 1;
+    assert_false(check_ownership_token(other_wallet_id, 1, 7, script, sizeof(script), token));
+
+    uint8_t other_token[OWNERSHIP_TOKEN_LEN];
+    memcpy(other_token, token, sizeof(token));
+    other_token[OWNERSHIP_TOKEN_LEN - 1] ^= 1;
+    assert_false(check_ownership_token(wallet_id, 1, 7, script, sizeof(script), other_token));
+}
+
+static void test_authenticated_token_nonce(void **state) {
+    (void) state;
+
+    const uint8_t data[5] = {1, 2, 3, 4, 5};
+    uint8_t token[AUTHENTICATED_TOKEN_MAX_LEN];
+    authenticated_token_compute(AUTH_TOKEN_KEY_SIGN_PSBT_CHECKPOINT,
+                                data,
+                                sizeof(data),
+                                token,
+                                sizeof(token));
+    assert_true(authenticated_token_check(AUTH_TOKEN_KEY_SIGN_PSBT_CHECKPOINT,
+                                          data,
+                                          sizeof(data),
+                                          token,
+                                          sizeof(token)));
+
+    // the keys are independent
+    assert_false(authenticated_token_check(AUTH_TOKEN_KEY_HOST_STORAGE,
+                                           data,
+                                           sizeof(data),
+                                           token,
+                                           sizeof(token)));
+
+    // a key derived with a nonce invalidates the tokens once it is cleared
+    clear_authenticated_token_key(AUTH_TOKEN_KEY_SIGN_PSBT_CHECKPOINT);
+    assert_false(authenticated_token_check(AUTH_TOKEN_KEY_SIGN_PSBT_CHECKPOINT,
+                                           data,
+                                           sizeof(data),
+                                           token,
+                                           sizeof(token)));
+}
+
+// parses and compiles a policy, that must be valid
+static int compile_policy_map(const char *policy_map) {
+    uint8_t policy_bytes[MAX_POLICY_MAP_MEMORY_SIZE];
+    buffer_t policy_buf = buffer_create((void *) policy_map, strlen(policy_map));
+    assert_int_equal(parse_policy_map(&policy_buf, policy_bytes, sizeof(policy_bytes)), 0);
+
+    policy_script_template_t template;
+    return compile_policy_script_template((const policy_node_t *) policy_bytes, &template);
+}
+
+static void test_miniscript_sanity(void **state) {
+    (void) state;
+
+    assert_int_equal(compile_policy_map("wsh(and_v(v:pk(@0),older(5)))"), 0);
+    assert_int_equal(compile_policy_map("wsh(or_d(pk(@0),and_v(v:pkh(@1),older(144))))"), 0);
+    assert_int_equal(compile_policy_map("wsh(thresh(2,pk(@0),s:pk(@1),sln:older(12960)))"), 0);
+    assert_int_equal(compile_policy_map("tr(@0,and_v(v:pk(@1),after(100)))"), 0);
+
+    // spendable without any signature
+    assert_int_equal(compile_policy_map("wsh(older(5))"), -1);
+    assert_int_equal(compile_policy_map("wsh(or_d(pk(@0),older(5)))"), -1);
+    assert_int_equal(compile_policy_map("wsh(thresh(1,pk(@0),s:pk(@1),sln:older(12960)))"), -1);
+    assert_int_equal(compile_policy_map("tr(@0,older(5))"), -1);
+
+    // malleable: sha256() has no unique dissatisfaction, so a third party can change the witness
+    assert_int_equal(
+        compile_policy_map("wsh(and_v(v:pk(@0),or_d(sha256("
+                           "0000000000000000000000000000000000000000000000000000000000000000),"
+                           "older(5))))"),
+        -1);
+
+    // heights and time in the same spending path, but not in different ones
+    assert_int_equal(compile_policy_map("wsh(and_v(v:pk(@0),and_v(v:after(100),after(500000000))))"),
+                     -1);
+    assert_int_equal(
+        compile_policy_map("wsh(and_v(v:pk(@0),and_v(v:older(5),older(4194305))))"),
+        -1);
+    assert_int_equal(
+        compile_policy_map("wsh(or_i(and_v(v:pk(@0),after(100)),and_v(v:pk(@1),after(500000000))))"),
+        0);
+    assert_int_equal(
+        compile_policy_map("wsh(thresh(3,pk(@0),sln:after(100),sln:after(500000000)))"),
+        -1);
+}
+
+int main() {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_call_get_preimage),
+        cmocka_unit_test(test_call_get_preimage_into),
+        cmocka_unit_test(test_call_get_merkle_preimages),
+        cmocka_unit_test(test_call_get_merkle_leaf_element),
+        cmocka_unit_test(test_call_get_merkle_leaf_hashes),
+        cmocka_unit_test(test_call_get_merkle_leaf_index),
+        cmocka_unit_test(test_call_get_merkle_leaf_hash_cached),
+        cmocka_unit_test(test_call_get_merkleized_map_value),
+        cmocka_unit_test(test_call_stream_merkle_leaves),
+        cmocka_unit_test(test_call_check_merkle_tree_sorted),
+        cmocka_unit_test(test_call_get_wallet_script),
+        cmocka_unit_test(test_multipath_key),
+        cmocka_unit_test(test_sorted_keys_order),
+        cmocka_unit_test(test_ownership_token),
+        cmocka_unit_test(test_authenticated_token_nonce),
+        cmocka_unit_test(test_miniscript_sanity),
+    };
+
+    int res = cmocka_run_group_tests(tests, NULL, NULL);
+    mock_client_free();
+    return res;
+}
@@ -0,0 +1,190 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "../src/crypto.h"
+
+#include "../src/common/merkle.h"
+
+static void hex_to_bytes(const char *hex, uint8_t *out, size_t out_len) {
+    for (size_t i = 0; i < out_len; i++) {
+        unsigned int byte;
+        sscanf(hex + 2 * i, "%2x", &byte);
+        out[i] = (uint8_t) byte;
+    }
+}
+
+// the hash of the leaf i (as a single byte), as in the tests of the clients
+static void make_leaf(uint8_t i, uint8_t out[static 32]) {
+    merkle_compute_element_hash(&i, 1, out);
+}
+
+static void compute_root(size_t n_leaves, uint8_t out[static 32]) {
+    merkle_root_builder_t builder;
+    merkle_root_builder_init(&builder);
+    for (size_t i = 0; i < n_leaves; i++) {
+        uint8_t leaf[32];
+        make_leaf((uint8_t) i, leaf);
+        merkle_root_builder_add(&builder, leaf);
+    }
+    merkle_root_builder_get_root(&builder, out);
+}
+
+static void test_merkle_compute_element_hash(void **state) {
+    (void) state;
+
+    // H(0x00 | 0x00)
+    uint8_t expected[32];
+    hex_to_bytes("96a296d224f285c67bee93c30f8a309157f0daa35dc5b87e410b78630a09cfc7",
+                 expected,
+                 32);
+
+    uint8_t hash[32];
+    make_leaf(0, hash);
+    assert_memory_equal(hash, expected, 32);
+
+    uint8_t prefixed[] = {0x00, 0x00};
+    cx_hash_sha256(prefixed, sizeof(prefixed), expected, 32);
+    assert_memory_equal(hash, expected, 32);
+}
+
+static void test_merkle_combine_hashes(void **state) {
+    (void) state;
+
+    uint8_t left[32], right[32];
+    make_leaf(0, left);
+    make_leaf(1, right);
+
+    // H(0x01 | left | right)
+    uint8_t preimage[65];
+    preimage[0] = 0x01;
+    memcpy(preimage + 1, left, 32);
+    memcpy(preimage + 33, right, 32);
+    uint8_t expected[32];
+    cx_hash_sha256(preimage, sizeof(preimage), expected, 32);
+
+    uint8_t out[32];
+    merkle_combine_hashes(left, right, out);
+    assert_memory_equal(out, expected, 32);
+
+    // the output can overlap the inputs
+    merkle_combine_hashes(left, right, right);
+    assert_memory_equal(right, expected, 32);
+}
+
+static void test_merkle_root_builder(void **state) {
+    (void) state;
+
+    // roots of the trees with leaves 0, 1, ..., n - 1 (as single bytes), the same of the tests of
+    // the python and of the js clients
+    const struct {
+        size_t n_leaves;
+        const char *root;
+    } tests[] = {
+        {1, "96a296d224f285c67bee93c30f8a309157f0daa35dc5b87e410b78630a09cfc7"},
+        {2, "a20bf9a7cc2dc8a08f5f415a71b19f6ac427bab54d24eec868b5d3103449953a"},
+        {3, "3b6cccd7e3e023ff393006f030315ee7ad9eb111b022b41fba7e5b7a3973f688"},
+        {5, "b855b42d6c30f5b087e05266783fbd6e394f7b926013ccaa67700a8b0c5a596f"},
+        {7, "3560191803028444b232018ac047fdb561c09c23a7a6876c85e08b5e4d48e9f3"},
+        {8, "ef7f49b620f6c7ea9b963a214da34b5021c6ded8ed57734380a311ab726aa907"},
+        {9, "162a21c2230e0284ea38cb8739ee4bb75947a1acd5d529c638ec068969fb3c4a"},
+    };
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        uint8_t expected[32], root[32];
+        hex_to_bytes(tests[i].root, expected, 32);
+        compute_root(tests[i].n_leaves, root);
+        assert_memory_equal(root, expected, 32);
+    }
+
+    // the root of the empty tree is 32 zero bytes
+    uint8_t zero[32] = {0}, root[32];
+    compute_root(0, root);
+    assert_memory_equal(root, zero, 32);
+}
+
+static void test_merkle_get_ith_direction(void **state) {
+    (void) state;
+
+    // in the tree with 7 leaves, the left subtree of the root has the 4 leaves 0 to 3
+    assert_int_equal(merkle_get_ith_direction(7, 0, 0), 0);
+    assert_int_equal(merkle_get_ith_direction(7, 0, 1), 0);
+    assert_int_equal(merkle_get_ith_direction(7, 0, 2), 0);
+    assert_int_equal(merkle_get_ith_direction(7, 0, 3), -1);
+
+    assert_int_equal(merkle_get_ith_direction(7, 5, 0), 1);
+    assert_int_equal(merkle_get_ith_direction(7, 5, 1), 0);
+    assert_int_equal(merkle_get_ith_direction(7, 5, 2), 1);
+    assert_int_equal(merkle_get_ith_direction(7, 5, 3), -1);
+
+    // the last leaf is the right child of the subtree with leaves 4 to 6
+    assert_int_equal(merkle_get_ith_direction(7, 6, 0), 1);
+    assert_int_equal(merkle_get_ith_direction(7, 6, 1), 1);
+    assert_int_equal(merkle_get_ith_direction(7, 6, 2), -1);
+
+    assert_int_equal(merkle_get_ith_direction(1, 0, 0), -1);
+    assert_int_equal(merkle_get_ith_direction(7, 7, 0), -1);
+}
+
+static void test_merkle_verify_proof(void **state) {
+    (void) state;
+
+    uint8_t leaves[7][32];
+    for (int i = 0; i < 7; i++) {
+        make_leaf((uint8_t) i, leaves[i]);
+    }
+    uint8_t root[32], left_root[32];
+    compute_root(7, root);
+    compute_root(4, left_root);  // the left subtree of the root, with the leaves 0 to 3
+
+    // the proof of the leaf 5 is leaf 4, leaf 6 (alone in its subtree) and the left subtree
+    uint8_t proof[3][32];
+    memcpy(proof[0], leaves[4], 32);
+    memcpy(proof[1], leaves[6], 32);
+    memcpy(proof[2], left_root, 32);
+
+    uint8_t cur_hash[32];
+    memcpy(cur_hash, leaves[5], 32);
+    assert_int_equal(merkle_verify_proof(7, 5, 3, 0, proof[0], 3, cur_hash), 0);
+    assert_memory_equal(cur_hash, root, 32);
+
+    // the same, in two parts
+    memcpy(cur_hash, leaves[5], 32);
+    assert_int_equal(merkle_verify_proof(7, 5, 3, 0, proof[0], 1, cur_hash), 0);
+    assert_int_equal(merkle_verify_proof(7, 5, 3, 1, proof[1], 2, cur_hash), 0);
+    assert_memory_equal(cur_hash, root, 32);
+
+    // the proof of the leaf 6 is the subtree with the leaves 4 and 5, and the left subtree
+    memcpy(proof[1], left_root, 32);
+    merkle_combine_hashes(leaves[4], leaves[5], proof[0]);
+    memcpy(cur_hash, leaves[6], 32);
+    assert_int_equal(merkle_verify_proof(7, 6, 2, 0, proof[0], 2, cur_hash), 0);
+    assert_memory_equal(cur_hash, root, 32);
+
+    // a proof with the wrong length, too many elements or a wrong index
+    assert_int_equal(merkle_verify_proof(7, 6, 3, 0, proof[0], 3, cur_hash), -1);
+    assert_int_equal(merkle_verify_proof(7, 6, 2, 1, proof[0], 2, cur_hash), -1);
+    assert_int_equal(merkle_verify_proof(7, 7, 3, 0, proof[0], 3, cur_hash), -1);
+
+    // a tree with a single leaf has an empty proof
+    memcpy(cur_hash, leaves[0], 32);
+    assert_int_equal(merkle_verify_proof(1, 0, 0, 0, NULL, 0, cur_hash), 0);
+    assert_memory_equal(cur_hash, leaves[0], 32);
+}
+
+int main() {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_merkle_compute_element_hash),
+        cmocka_unit_test(test_merkle_combine_hashes),
+        cmocka_unit_test(test_merkle_root_builder),
+        cmocka_unit_test(test_merkle_get_ith_direction),
+        cmocka_unit_test(test_merkle_verify_proof),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
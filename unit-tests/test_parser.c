@@ -307,6 +307,55 @@ static void test_parser_error(void **state) {
     assert_int_equal(parser_state.a, 0xa0a1a2a3);  // a should have been parsed correctly
 }
 
+// Accumulates the data passed to the callback of dbuffer_skip_bytes
+typedef struct {
+    uint8_t data[32];
+    size_t data_len;
+    int n_calls;
+} skip_callback_state_t;
+
+static void skip_callback(const uint8_t *data, size_t data_len, void *cb_state) {
+    skip_callback_state_t *state = (skip_callback_state_t *) cb_state;
+    memcpy(state->data + state->data_len, data, data_len);
+    state->data_len += data_len;
+    ++state->n_calls;
+}
+
+static void test_dbuffer_skip_bytes(void **state) {
+    (void) state;
+
+    uint8_t store[4] = {0x00, 0x01, 0x02, 0x03};
+    uint8_t stream[8] = {0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b};
+
+    buffer_t store_buf = buffer_create(store, sizeof(store));
+    buffer_t stream_buf = buffer_create(stream, sizeof(stream));
+    buffer_t *buffers[2] = {&store_buf, &stream_buf};
+
+    skip_callback_state_t cb_state;
+    memset(&cb_state, 0, sizeof(cb_state));
+
+    // skipping across the two buffers, the callback is called once per buffer
+    assert_int_equal(dbuffer_skip_bytes(buffers, 6, skip_callback, &cb_state), 6);
+    assert_int_equal(cb_state.n_calls, 2);
+    assert_int_equal(cb_state.data_len, 6);
+    assert_memory_equal(cb_state.data, store, 4);
+    assert_memory_equal(cb_state.data + 4, stream, 2);
+    assert_int_equal(dbuffer_get_length(buffers), 6);
+
+    // without a callback, the bytes are only consumed
+    assert_int_equal(dbuffer_skip_bytes(buffers, 1, NULL, NULL), 1);
+
+    // if the data is not enough, all the available bytes are consumed
+    assert_int_equal(dbuffer_skip_bytes(buffers, 10, skip_callback, &cb_state), 5);
+    assert_int_equal(cb_state.n_calls, 3);
+    assert_memory_equal(cb_state.data + 6, stream + 3, 5);
+    assert_int_equal(dbuffer_get_length(buffers), 0);
+
+    // nothing left to consume
+    assert_int_equal(dbuffer_skip_bytes(buffers, 1, skip_callback, &cb_state), 0);
+    assert_int_equal(cb_state.n_calls, 3);
+}
+
 int main() {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_parser_init_context),
@@ -316,6 +365,7 @@ int main() {
         cmocka_unit_test(test_parser_stream_ends),
         cmocka_unit_test(test_parser_continue_partial),
         cmocka_unit_test(test_parser_error),
+        cmocka_unit_test(test_dbuffer_skip_bytes),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
@@ -0,0 +1,138 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cmocka.h>
+
+#include "common/segwit_addr.h"
+#include "segwit_addr_ref.h"
+
+static void test_segwit_addr_encode_vectors(void **state) {
+    (void) state;
+
+    // valid segwit addresses of BIP-173 and BIP-350, with bech32 and bech32m checksums
+    const struct {
+        const char *address;
+        const char *hrp;
+        int witver;
+        const char *witprog_hex;
+    } vectors[] = {
+        {"bc1qw508d6qejxtdg4y5r3zarvary0c5xw7kv8f3t4",
+         "bc",
+         0,
+         "751e76e8199196d454941c45d1b3a323f1433bd6"},
+        {"tb1qrp33g0q5c5txsp9arysrx4k6zdkfs4nce4xj0gdcccefvpysxf3q0sl5k7",
+         "tb",
+         0,
+         "1863143c14c5166804bd19203356da136c985678cd4d27a1b8c6329604903262"},
+        {"tb1qqqqqp399et2xygdj5xreqhjjvcmzhxw4aywxecjdzew6hylgvsesrxh6hy",
+         "tb",
+         0,
+         "000000c4a5cad46221b2a187905e5266362b99d5e91c6ce24d165dab93e86433"},
+        {"bc1pw508d6qejxtdg4y5r3zarvary0c5xw7kw508d6qejxtdg4y5r3zarvary0c5xw7kt5nd6y",
+         "bc",
+         1,
+         "751e76e8199196d454941c45d1b3a323f1433bd6751e76e8199196d454941c45d1b3a323f1433bd6"},
+        {"bc1sw50qgdz25j", "bc", 16, "751e"},
+        {"bc1zw508d6qejxtdg4y5r3zarvaryvaxxpcs", "bc", 2, "751e76e8199196d454941c45d1b3a323"},
+        {"tb1pqqqqp399et2xygdj5xreqhjjvcmzhxw4aywxecjdzew6hylgvsesf3hn0c",
+         "tb",
+         1,
+         "000000c4a5cad46221b2a187905e5266362b99d5e91c6ce24d165dab93e86433"},
+        {"bc1p0xlxvlhemja6c4dqv22uapctqupfhlxm9h8z3k2e72q4k9hcz7vqzk5jj0",
+         "bc",
+         1,
+         "79be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798"},
+    };
+
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        uint8_t witprog[40];
+        size_t witprog_len = strlen(vectors[i].witprog_hex) / 2;
+        for (size_t j = 0; j < witprog_len; j++) {
+            const char *hex = vectors[i].witprog_hex;
+            char byte_hex[3] = {hex[2 * j], hex[2 * j + 1], 0};
+            witprog[j] = (uint8_t) strtol(byte_hex, NULL, 16);
+        }
+
+        char output[91];
+        assert_int_equal(
+            segwit_addr_encode(output, vectors[i].hrp, vectors[i].witver, witprog, witprog_len),
+            1);
+        assert_string_equal(output, vectors[i].address);
+
+        int witver;
+        uint8_t decoded[40];
+        size_t decoded_len;
+        assert_int_equal(
+            segwit_addr_decode(&witver, decoded, &decoded_len, vectors[i].hrp, output),
+            1);
+        assert_int_equal(witver, vectors[i].witver);
+        assert_int_equal(decoded_len, witprog_len);
+        assert_memory_equal(decoded, witprog, witprog_len);
+    }
+}
+
+static void test_segwit_addr_encode_cross_check(void **state) {
+    (void) state;
+
+    const char *hrps[] = {"bc", "tb", "bcrt", "ltc", "x"};
+
+    srand(1);
+    for (int it = 0; it < 2000; it++) {
+        const char *hrp = hrps[it % (sizeof(hrps) / sizeof(hrps[0]))];
+        int witver = rand() % 17;
+        size_t witprog_len = witver == 0 ? (rand() % 2 ? 20 : 32) : 2 + rand() % 39;
+        uint8_t witprog[40];
+        for (size_t i = 0; i < witprog_len; i++) {
+            witprog[i] = (uint8_t) rand();
+        }
+
+        char output[91], expected[91];
+        assert_int_equal(segwit_addr_encode(output, hrp, witver, witprog, witprog_len), 1);
+        ref_segwit_addr_encode(expected, hrp, witver, witprog, witprog_len);
+        assert_string_equal(output, expected);
+
+        // the generic encoder must agree with the fused one
+        uint8_t data[65];
+        size_t data_len = ref_convert_bits(data, witver, witprog, witprog_len);
+        assert_int_equal(bech32_encode(output,
+                                       hrp,
+                                       data,
+                                       data_len,
+                                       witver == 0 ? BECH32_ENCODING_BECH32
+                                                   : BECH32_ENCODING_BECH32M),
+                         1);
+        assert_string_equal(output, expected);
+    }
+}
+
+static void test_segwit_addr_encode_invalid(void **state) {
+    (void) state;
+
+    uint8_t witprog[41] = {0};
+    char output[100];
+
+    assert_int_equal(segwit_addr_encode(output, "bc", 17, witprog, 20), 0);
+    assert_int_equal(segwit_addr_encode(output, "bc", -1, witprog, 20), 0);
+    assert_int_equal(segwit_addr_encode(output, "bc", 0, witprog, 21), 0);
+    assert_int_equal(segwit_addr_encode(output, "bc", 1, witprog, 1), 0);
+    assert_int_equal(segwit_addr_encode(output, "bc", 1, witprog, 41), 0);
+    assert_int_equal(segwit_addr_encode(output, "BC", 0, witprog, 20), 0);
+
+    // too long: the encoding would exceed 90 characters
+    assert_int_equal(segwit_addr_encode(output, "abcdefghijabcdefghijab", 1, witprog, 40), 0);
+}
+
+int main() {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_segwit_addr_encode_vectors),
+        cmocka_unit_test(test_segwit_addr_encode_cross_check),
+        cmocka_unit_test(test_segwit_addr_encode_invalid),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -161,6 +161,134 @@ static void test_parse_policy_map_multisig_3(void **state) {
     for (int i = 0; i < 5; i++) assert_int_equal(inner->key_indexes[i], i);
 }
 
+static void test_parse_policy_map_multisig_4(void **state) {
+    (void) state;
+
+    uint8_t out[MAX_POLICY_MAP_MEMORY_SIZE];
+
+    int res;
+
+    char *policy = "sh(wsh(sortedmulti(15,@0,@1,@2,@3,@4,@5,@6,@7,@8,@9,@10,@11,@12,@13,@14)))";
+    buffer_t policy_buf = buffer_create((void *) policy, strlen(policy));
+
+    res = parse_policy_map(&policy_buf, out, sizeof(out));
+    assert_int_equal(res, 0);
+    policy_node_with_script_t *root = (policy_node_with_script_t *) out;
+    policy_node_with_script_t *mid = (policy_node_with_script_t *) root->script;
+    policy_node_multisig_t *inner = (policy_node_multisig_t *) mid->script;
+    assert_int_equal(inner->type, TOKEN_SORTEDMULTI);
+
+    assert_int_equal(inner->k, 15);
+    assert_int_equal(inner->n, 15);
+    for (int i = 0; i < 15; i++) assert_int_equal(inner->key_indexes[i], i);
+}
+
+static void test_parse_policy_map_miniscript_1(void **state) {
+    (void) state;
+
+    uint8_t out[MAX_POLICY_MAP_MEMORY_SIZE];
+
+    int res;
+
+    char *policy = "wsh(or_d(multi(2,@0,@1),and_v(v:pkh(@2),older(52560))))";
+    buffer_t policy_buf = buffer_create((void *) policy, strlen(policy));
+
+    res = parse_policy_map(&policy_buf, out, sizeof(out));
+    assert_int_equal(res, 0);
+    policy_node_with_script_t *root = (policy_node_with_script_t *) out;
+    assert_int_equal(root->type, TOKEN_WSH);
+
+    policy_node_with_script2_t *or_d = (policy_node_with_script2_t *) root->script;
+    assert_int_equal(or_d->type, TOKEN_OR_D);
+
+    policy_node_multisig_t *multi = (policy_node_multisig_t *) or_d->scripts[0];
+    assert_int_equal(multi->type, TOKEN_MULTI);
+    assert_int_equal(multi->k, 2);
+    assert_int_equal(multi->n, 2);
+
+    policy_node_with_script2_t *and_v = (policy_node_with_script2_t *) or_d->scripts[1];
+    assert_int_equal(and_v->type, TOKEN_AND_V);
+
+    policy_node_with_script_t *v = (policy_node_with_script_t *) and_v->scripts[0];
+    assert_int_equal(v->type, TOKEN_V);
+    policy_node_with_key_t *pkh = (policy_node_with_key_t *) v->script;
+    assert_int_equal(pkh->type, TOKEN_PKH);
+    assert_int_equal(pkh->key_index, 2);
+
+    policy_node_with_uint32_t *older = (policy_node_with_uint32_t *) and_v->scripts[1];
+    assert_int_equal(older->type, TOKEN_OLDER);
+    assert_int_equal(older->n, 52560);
+}
+
+static void test_parse_policy_map_miniscript_2(void **state) {
+    (void) state;
+
+    uint8_t out[MAX_POLICY_MAP_MEMORY_SIZE];
+
+    int res;
+
+    char *policy = "wsh(thresh(2,pk(@0),s:pk(@1),sln:older(12960)))";
+    buffer_t policy_buf = buffer_create((void *) policy, strlen(policy));
+
+    res = parse_policy_map(&policy_buf, out, sizeof(out));
+    assert_int_equal(res, 0);
+    policy_node_with_script_t *root = (policy_node_with_script_t *) out;
+    policy_node_thresh_t *thresh = (policy_node_thresh_t *) root->script;
+    assert_int_equal(thresh->type, TOKEN_THRESH);
+    assert_int_equal(thresh->k, 2);
+    assert_int_equal(thresh->n, 3);
+
+    policy_node_scripts_list_t *item = thresh->scripts;
+    policy_node_with_key_t *pk = (policy_node_with_key_t *) item->script;
+    assert_int_equal(pk->type, TOKEN_PK);
+    assert_int_equal(pk->key_index, 0);
+
+    item = item->next;
+    policy_node_with_script_t *s = (policy_node_with_script_t *) item->script;
+    assert_int_equal(s->type, TOKEN_S);
+    assert_int_equal(s->script->type, TOKEN_PK);
+
+    // the wrappers are applied from the outermost one
+    item = item->next;
+    s = (policy_node_with_script_t *) item->script;
+    assert_int_equal(s->type, TOKEN_S);
+    policy_node_with_script_t *l = (policy_node_with_script_t *) s->script;
+    assert_int_equal(l->type, TOKEN_L);
+    policy_node_with_script_t *n = (policy_node_with_script_t *) l->script;
+    assert_int_equal(n->type, TOKEN_N);
+    policy_node_with_uint32_t *older = (policy_node_with_uint32_t *) n->script;
+    assert_int_equal(older->type, TOKEN_OLDER);
+    assert_int_equal(older->n, 12960);
+
+    assert_null(item->next);
+}
+
+static void test_parse_policy_map_miniscript_3(void **state) {
+    (void) state;
+
+    uint8_t out[MAX_POLICY_MAP_MEMORY_SIZE];
+
+    int res;
+
+    char *policy =
+        "wsh(andor(pk(@0),1,sha256("
+        "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef)))";
+    buffer_t policy_buf = buffer_create((void *) policy, strlen(policy));
+
+    res = parse_policy_map(&policy_buf, out, sizeof(out));
+    assert_int_equal(res, 0);
+    policy_node_with_script_t *root = (policy_node_with_script_t *) out;
+    policy_node_with_script3_t *andor = (policy_node_with_script3_t *) root->script;
+    assert_int_equal(andor->type, TOKEN_ANDOR);
+    assert_int_equal(andor->scripts[0]->type, TOKEN_PK);
+    assert_int_equal(andor->scripts[1]->type, TOKEN_1);
+
+    policy_node_with_hash_256_t *sha256 = (policy_node_with_hash_256_t *) andor->scripts[2];
+    assert_int_equal(sha256->type, TOKEN_SHA256);
+    const uint8_t expected_pattern[] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef};
+    for (int i = 0; i < 32; i++) assert_int_equal(sha256->h[i], expected_pattern[i % 8]);
+}
+
 // convenience function to parse as one liners
 
 static int parse_policy(char *policy, size_t policy_len, uint8_t *out, size_t out_len) {
@@ -170,6 +298,47 @@ static int parse_policy(char *policy, size_t policy_len, uint8_t *out, size_t ou
 
 #define PARSE_POLICY(policy, out, out_len) parse_policy(policy, sizeof(policy) - 1, out, out_len)
 
+static void test_parse_policy_map_taptree(void **state) {
+    (void) state;
+
+    uint8_t out[MAX_POLICY_MAP_MEMORY_SIZE];
+
+    int res;
+
+    char *policy = "tr(@0,{pk(@1),and_v(v:pk(@2),older(144))})";
+    buffer_t policy_buf = buffer_create((void *) policy, strlen(policy));
+
+    res = parse_policy_map(&policy_buf, out, sizeof(out));
+    assert_int_equal(res, 0);
+    policy_node_tr_t *root = (policy_node_tr_t *) out;
+    assert_int_equal(root->type, TOKEN_TR);
+    assert_int_equal(root->key_index, 0);
+
+    policy_node_tree_t *tree = root->tree;
+    assert_false(tree->is_leaf);
+
+    policy_node_tree_t *left = tree->subtrees[0];
+    assert_true(left->is_leaf);
+    policy_node_with_key_t *pk = (policy_node_with_key_t *) left->script;
+    assert_int_equal(pk->type, TOKEN_PK);
+    assert_int_equal(pk->key_index, 1);
+
+    policy_node_tree_t *right = tree->subtrees[1];
+    assert_true(right->is_leaf);
+    policy_node_with_script2_t *and_v = (policy_node_with_script2_t *) right->script;
+    assert_int_equal(and_v->type, TOKEN_AND_V);
+
+    policy_node_with_uint32_t *older = (policy_node_with_uint32_t *) and_v->scripts[1];
+    assert_int_equal(older->type, TOKEN_OLDER);
+    assert_int_equal(older->n, 144);
+
+    // a key-path only policy has no tree
+    policy = "tr(@0)";
+    policy_buf = buffer_create((void *) policy, strlen(policy));
+    assert_int_equal(parse_policy_map(&policy_buf, out, sizeof(out)), 0);
+    assert_null(((policy_node_tr_t *) out)->tree);
+}
+
 static void test_failures(void **state) {
     (void) state;
 
@@ -203,10 +372,337 @@ static void test_failures(void **state) {
     assert_true(
         0 > PARSE_POLICY("multi(6,@0,@1,@2,@3,@4)", out, sizeof(out)));  // threshold larger than n
     assert_true(0 > PARSE_POLICY("multi(0,@0,@1,@2,@3,@4)", out, sizeof(out)));
+    // too many keys in multisig
+    assert_true(0 > PARSE_POLICY(
+                        "multi(1,@0,@1,@2,@3,@4,@5,@6,@7,@8,@9,@10,@11,@12,@13,@14,@15)",
+                        out,
+                        sizeof(out)));
     // missing threshold or keys in multisig
     assert_true(0 > PARSE_POLICY("multi(@0,@1,@2,@3,@4)", out, sizeof(out)));
     assert_true(0 > PARSE_POLICY("multi(1)", out, sizeof(out)));
     assert_true(0 > PARSE_POLICY("multi(1,)", out, sizeof(out)));
+
+    // miniscript is only allowed inside wsh
+    assert_true(0 > PARSE_POLICY("pk(@0)", out, sizeof(out)));
+    assert_true(0 > PARSE_POLICY("sh(and_v(v:pk(@0),pk(@1)))", out, sizeof(out)));
+    assert_true(0 > PARSE_POLICY("v:pkh(@0)", out, sizeof(out)));
+
+    // only miniscript is allowed inside wsh
+    assert_true(0 > PARSE_POLICY("wsh(wpkh(@0))", out, sizeof(out)));
+    assert_true(0 > PARSE_POLICY("wsh(or_d(pk(@0),tr(@1)))", out, sizeof(out)));
+
+    // unknown or missing wrappers
+    assert_true(0 > PARSE_POLICY("wsh(x:pk(@0))", out, sizeof(out)));
+    assert_true(0 > PARSE_POLICY("wsh(:pk(@0))", out, sizeof(out)));
+
+    // invalid timelocks
+    assert_true(0 > PARSE_POLICY("wsh(and_v(v:pk(@0),older(0)))", out, sizeof(out)));
+    assert_true(0 > PARSE_POLICY("wsh(and_v(v:pk(@0),after(2147483648)))", out, sizeof(out)));
+
+    // invalid hashes
+    assert_true(0 > PARSE_POLICY("wsh(and_v(v:pk(@0),hash160(0123)))", out, sizeof(out)));
+    assert_true(0 > PARSE_POLICY("wsh(and_v(v:pk(@0),ripemd160("
+                                 "0123456789ABCDEF0123456789abcdef01234567)))",
+                                 out,
+                                 sizeof(out)));
+
+    // wrong number of arguments
+    assert_true(0 > PARSE_POLICY("wsh(and_v(v:pk(@0)))", out, sizeof(out)));
+    assert_true(0 > PARSE_POLICY("wsh(andor(pk(@0),pk(@1)))", out, sizeof(out)));
+    assert_true(0 > PARSE_POLICY("wsh(thresh(3,pk(@0),s:pk(@1)))", out, sizeof(out)));
+    assert_true(0 > PARSE_POLICY("wsh(0(@0))", out, sizeof(out)));
+
+    // too deep
+    assert_true(0 > PARSE_POLICY("wsh(vvvvvvvvvv:pk(@0))", out, sizeof(out)));
+
+    // tr can only be top-level
+    assert_true(0 > PARSE_POLICY("sh(tr(@0,pk(@1)))", out, sizeof(out)));
+
+    // invalid trees of scripts
+    assert_true(0 > PARSE_POLICY("tr(@0,)", out, sizeof(out)));
+    assert_true(0 > PARSE_POLICY("tr(@0,{pk(@1)})", out, sizeof(out)));
+    assert_true(0 > PARSE_POLICY("tr(@0,{pk(@1),pk(@2),pk(@3)})", out, sizeof(out)));
+    assert_true(0 > PARSE_POLICY("tr(@0,{pk(@1),multi(1,@2,@3)})", out, sizeof(out)));
+    assert_true(0 > PARSE_POLICY("tr(@0,{pk(@1),wsh(pk(@2))})", out, sizeof(out)));
+
+    // tree too deep
+    assert_true(0 > PARSE_POLICY("tr(@0,{pk(@1),{pk(@2),{pk(@3),{pk(@4),{pk(@5),pk(@6)}}}}})",
+                                 out,
+                                 sizeof(out)));
+}
+
+// checks that the binary encoding is decoded to the same nodes as the textual policy, and that
+// the textual policy is recovered by format_policy_map
+static void assert_decoded_equal(const char *policy, const uint8_t *encoding, size_t encoding_len) {
+    uint8_t out[MAX_POLICY_MAP_MEMORY_SIZE] __attribute__((aligned(4)));
+    uint8_t expected[MAX_POLICY_MAP_MEMORY_SIZE];
+
+    // both are decoded at the same address, so that the pointers in the nodes are the same
+    memset(out, 0, sizeof(out));
+    buffer_t policy_buf = buffer_create((void *) policy, strlen(policy));
+    assert_int_equal(parse_policy_map(&policy_buf, out, sizeof(out)), 0);
+    memcpy(expected, out, sizeof(out));
+
+    memset(out, 0, sizeof(out));
+    buffer_t encoding_buf = buffer_create((void *) encoding, encoding_len);
+    assert_int_equal(decode_policy_map(&encoding_buf, out, sizeof(out)), 0);
+    assert_memory_equal(out, expected, sizeof(out));
+
+    char policy_str[MAX_POLICY_MAP_STR_LENGTH + 1];
+    assert_int_equal(format_policy_map((policy_node_t *) out, policy_str, sizeof(policy_str)),
+                     strlen(policy));
+    assert_string_equal(policy_str, policy);
+}
+
+static void test_decode_policy_map(void **state) {
+    (void) state;
+
+    // clang-format off
+    assert_decoded_equal("wpkh(@0)", (const uint8_t[]){0x03, 0x00}, 2);
+
+    assert_decoded_equal("tr(@0)", (const uint8_t[]){0x06, 0x00, 0x00}, 3);
+
+    assert_decoded_equal("sh(wsh(sortedmulti(2,@0,@1,@2)))",
+                         (const uint8_t[]){0x00, 0x01, 0x05, 0x02, 0x03, 0x00, 0x01, 0x02}, 8);
+
+    assert_decoded_equal("wsh(or_d(multi(2,@0,@1),and_v(v:pkh(@2),older(52560))))",
+                         (const uint8_t[]){0x01, 0x18, 0x04, 0x02, 0x02, 0x00, 0x01, 0x13,
+                                           0x20, 0x02, 0x02, 0x0c, 0x50, 0xcd, 0x00, 0x00},
+                         16);
+
+    assert_decoded_equal("wsh(thresh(2,pk(@0),s:pk(@1),sln:older(12960)))",
+                         (const uint8_t[]){0x01, 0x1a, 0x02, 0x03, 0x09, 0x00, 0x1c, 0x09,
+                                           0x01, 0x1c, 0x23, 0x22, 0x0c, 0xa0, 0x32, 0x00,
+                                           0x00},
+                         17);
+
+    assert_decoded_equal("wsh(or_i(and_v(v:pkh(@0),sha256(ae4e1ad2af4163693b45c8f4b73cb48f1a33ebb7"
+                         "66b2936860313aaf9b8eb33d)),0))",
+                         (const uint8_t[]){0x01, 0x19, 0x13, 0x20, 0x02, 0x00, 0x0e, 0xae,
+                                           0x4e, 0x1a, 0xd2, 0xaf, 0x41, 0x63, 0x69, 0x3b,
+                                           0x45, 0xc8, 0xf4, 0xb7, 0x3c, 0xb4, 0x8f, 0x1a,
+                                           0x33, 0xeb, 0xb7, 0x66, 0xb2, 0x93, 0x68, 0x60,
+                                           0x31, 0x3a, 0xaf, 0x9b, 0x8e, 0xb3, 0x3d, 0x07},
+                         40);
+
+    assert_decoded_equal("tr(@1,{{pk(@0),pk(@2)},pk_k(@3)})",
+                         (const uint8_t[]){0x06, 0x01, 0x01, 0x01, 0x01, 0x00, 0x09, 0x00,
+                                           0x00, 0x09, 0x02, 0x00, 0x0a, 0x03},
+                         14);
+    // clang-format on
+}
+
+static int decode_policy(const uint8_t *encoding,
+                         size_t encoding_len,
+                         uint8_t *out,
+                         size_t out_len) {
+    buffer_t in_buf = buffer_create((void *) encoding, encoding_len);
+    return decode_policy_map(&in_buf, out, out_len);
+}
+
+#define DECODE_POLICY(out, out_len, ...)                  \
+    decode_policy((const uint8_t[]){__VA_ARGS__},         \
+                  sizeof((const uint8_t[]){__VA_ARGS__}), \
+                  out,                                    \
+                  out_len)
+
+static void test_decode_failures(void **state) {
+    (void) state;
+
+    uint8_t out[MAX_POLICY_MAP_MEMORY_SIZE] __attribute__((aligned(4)));
+
+    // excess byte not allowed, or truncated encoding
+    assert_true(0 > DECODE_POLICY(out, sizeof(out), 0x03, 0x00, 0x00));
+    assert_true(0 > DECODE_POLICY(out, sizeof(out), 0x03));
+    assert_true(0 > DECODE_POLICY(out, sizeof(out), 0x01, 0x05, 0x02, 0x03, 0x00, 0x01));
+
+    // unknown tag
+    assert_true(0 > DECODE_POLICY(out, sizeof(out), 0x25, 0x00));
+    assert_true(0 > DECODE_POLICY(out, sizeof(out), 0xff, 0x00));
+
+    // sh and tr not top-level
+    assert_true(0 > DECODE_POLICY(out, sizeof(out), 0x00, 0x00, 0x02, 0x00));
+    assert_true(0 > DECODE_POLICY(out, sizeof(out), 0x00, 0x06, 0x00, 0x00));
+
+    // miniscript and wrappers are only allowed inside wsh, or in taproot trees
+    assert_true(0 > DECODE_POLICY(out, sizeof(out), 0x09, 0x00));
+    assert_true(0 > DECODE_POLICY(out, sizeof(out), 0x20, 0x02, 0x00));
+
+    // multi with invalid threshold, and not in taproot trees
+    assert_true(0 > DECODE_POLICY(out, sizeof(out), 0x01, 0x04, 0x03, 0x02, 0x00, 0x01));
+    assert_true(0 > DECODE_POLICY(out, sizeof(out), 0x01, 0x04, 0x00, 0x02, 0x00, 0x01));
+    assert_true(
+        0 > DECODE_POLICY(out, sizeof(out), 0x06, 0x00, 0x01, 0x00, 0x04, 0x01, 0x01, 0x00));
+
+    // invalid timelock
+    assert_true(0 > DECODE_POLICY(out, sizeof(out), 0x01, 0x0c, 0x00, 0x00, 0x00, 0x00));
+    assert_true(0 > DECODE_POLICY(out, sizeof(out), 0x01, 0x0d, 0x00, 0x00, 0x00, 0x80));
+
+    // invalid tree marker
+    assert_true(0 > DECODE_POLICY(out, sizeof(out), 0x06, 0x00, 0x02, 0x00, 0x09, 0x00));
+    assert_true(0 > DECODE_POLICY(out, sizeof(out), 0x06, 0x00, 0x01, 0x02, 0x09, 0x00));
+
+    // too deep
+    assert_true(0 > DECODE_POLICY(out,
+                                  sizeof(out),
+                                  0x01,
+                                  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+                                  0x09, 0x00));
+}
+
+static void test_parse_policy_map_key_info(void **state) {
+    (void) state;
+
+    policy_map_key_info_t key_info;
+
+    const char *key_info_str =
+        "[d34db33f/44'/0'/0']xpub6ERApfZwUNrhLCkDtcHTcxd75RbzS1ed54G1LkBUHQVHQKqhMkhgbmJbZRkrgZw4koxb5JaHWkY4ALHY2grBGRjaDMzQLcgJvLJuZZvRcEL/**";
+    buffer_t key_info_buffer = buffer_create((void *) key_info_str, strlen(key_info_str));
+    assert_int_equal(parse_policy_map_key_info(&key_info_buffer, &key_info), 0);
+    assert_false(key_info.is_binary);
+    assert_true(key_info.has_key_origin);
+    assert_true(key_info.has_wildcard);
+    assert_int_equal(key_info.multipath[0], 0);
+    assert_int_equal(key_info.multipath[1], 1);
+    assert_memory_equal(key_info.master_key_fingerprint, "\xd3\x4d\xb3\x3f", 4);
+    assert_int_equal(key_info.master_key_derivation_len, 3);
+    assert_int_equal(key_info.master_key_derivation[0], 0x8000002C);
+    assert_int_equal(key_info.master_key_derivation[1], 0x80000000);
+    assert_int_equal(key_info.master_key_derivation[2], 0x80000000);
+    assert_string_equal(
+        key_info.ext_pubkey,
+        "xpub6ERApfZwUNrhLCkDtcHTcxd75RbzS1ed54G1LkBUHQVHQKqhMkhgbmJbZRkrgZw4koxb5JaHWkY4ALHY2grBGRjaDMzQLcgJvLJuZZvRcEL");
+
+    // the same key in the binary encoding, followed by a spare byte; the content of the serialized
+    // pubkey is not validated
+    uint8_t key_info_bin[1 + 4 + 1 + 3 * 4 + SERIALIZED_EXTENDED_PUBKEY_LEN + 1] = {0};
+    size_t key_info_bin_len = sizeof(key_info_bin) - 1;
+    uint8_t *p = key_info_bin;
+    *p++ = KEY_INFO_BINARY_HAS_KEY_ORIGIN | KEY_INFO_BINARY_HAS_WILDCARD;
+    memcpy(p, "\xd3\x4d\xb3\x3f", 4);
+    p += 4;
+    *p++ = 3;
+    memcpy(p, "\x2c\x00\x00\x80\x00\x00\x00\x80\x00\x00\x00\x80", 12);
+    p += 12;
+    for (int i = 0; i < SERIALIZED_EXTENDED_PUBKEY_LEN; i++) {
+        *p++ = i;
+    }
+
+    key_info_buffer = buffer_create(key_info_bin, key_info_bin_len);
+    assert_int_equal(parse_policy_map_key_info(&key_info_buffer, &key_info), 0);
+    assert_true(key_info.is_binary);
+    assert_true(key_info.has_key_origin);
+    assert_true(key_info.has_wildcard);
+    assert_memory_equal(key_info.master_key_fingerprint, "\xd3\x4d\xb3\x3f", 4);
+    assert_int_equal(key_info.master_key_derivation_len, 3);
+    assert_int_equal(key_info.master_key_derivation[0], 0x8000002C);
+    assert_int_equal(key_info.master_key_derivation[1], 0x80000000);
+    assert_int_equal(key_info.master_key_derivation[2], 0x80000000);
+    assert_memory_equal(key_info.serialized_ext_pubkey,
+                        key_info_bin + key_info_bin_len - SERIALIZED_EXTENDED_PUBKEY_LEN,
+                        SERIALIZED_EXTENDED_PUBKEY_LEN);
+
+    // without key origin nor wildcard, only the flags and the pubkey are present
+    key_info_bin[1 + 4 + 1 + 3 * 4 - 1] = 0;
+    key_info_buffer = buffer_create(key_info_bin + 1 + 4 + 1 + 3 * 4 - 1,
+                                    1 + SERIALIZED_EXTENDED_PUBKEY_LEN);
+    assert_int_equal(parse_policy_map_key_info(&key_info_buffer, &key_info), 0);
+    assert_true(key_info.is_binary);
+    assert_false(key_info.has_key_origin);
+    assert_false(key_info.has_wildcard);
+
+    // unknown flags, truncated or with excess bytes
+    key_info_bin[0] = 0x08;
+    key_info_buffer = buffer_create(key_info_bin, key_info_bin_len);
+    assert_int_equal(parse_policy_map_key_info(&key_info_buffer, &key_info), -1);
+    key_info_bin[0] = KEY_INFO_BINARY_HAS_KEY_ORIGIN | KEY_INFO_BINARY_HAS_WILDCARD;
+    key_info_buffer = buffer_create(key_info_bin, key_info_bin_len - 1);
+    assert_int_equal(parse_policy_map_key_info(&key_info_buffer, &key_info), -1);
+    key_info_buffer = buffer_create(key_info_bin, key_info_bin_len + 1);
+    assert_int_equal(parse_policy_map_key_info(&key_info_buffer, &key_info), -1);
+
+    // too many derivation steps
+    key_info_bin[5] = MAX_BIP32_PATH_STEPS + 1;
+    key_info_buffer = buffer_create(key_info_bin, key_info_bin_len);
+    assert_int_equal(parse_policy_map_key_info(&key_info_buffer, &key_info), -1);
+}
+
+static void test_parse_policy_map_key_info_multipath(void **state) {
+    (void) state;
+
+    policy_map_key_info_t key_info;
+
+    const char *key_info_str =
+        "[d34db33f/44'/0'/0']xpub6ERApfZwUNrhLCkDtcHTcxd75RbzS1ed54G1LkBUHQVHQKqhMkhgbmJbZRkrgZw4koxb5JaHWkY4ALHY2grBGRjaDMzQLcgJvLJuZZvRcEL/<2;10>/*";
+    buffer_t key_info_buffer = buffer_create((void *) key_info_str, strlen(key_info_str));
+    assert_int_equal(parse_policy_map_key_info(&key_info_buffer, &key_info), 0);
+    assert_true(key_info.has_wildcard);
+    assert_int_equal(key_info.multipath[0], 2);
+    assert_int_equal(key_info.multipath[1], 10);
+    assert_string_equal(
+        key_info.ext_pubkey,
+        "xpub6ERApfZwUNrhLCkDtcHTcxd75RbzS1ed54G1LkBUHQVHQKqhMkhgbmJbZRkrgZw4koxb5JaHWkY4ALHY2grBGRjaDMzQLcgJvLJuZZvRcEL");
+
+    // "/<0;1>/*" is the same as "/**"
+    const char *key_info_0_1 =
+        "xpub6ERApfZwUNrhLCkDtcHTcxd75RbzS1ed54G1LkBUHQVHQKqhMkhgbmJbZRkrgZw4koxb5JaHWkY4ALHY2grBGRjaDMzQLcgJvLJuZZvRcEL/<0;1>/*";
+    key_info_buffer = buffer_create((void *) key_info_0_1, strlen(key_info_0_1));
+    assert_int_equal(parse_policy_map_key_info(&key_info_buffer, &key_info), 0);
+    assert_true(key_info.has_wildcard);
+    assert_int_equal(key_info.multipath[0], 0);
+    assert_int_equal(key_info.multipath[1], 1);
+
+    const char *invalid_suffixes[] = {
+        "/<0;0>/*",           // same step twice
+        "/<0;1'>/*",          // hardened
+        "/<0;2147483648>/*",  // too large
+        "/<01;2>/*",          // leading zero
+        "/<0;1;2>/*",         // more than two steps
+        "/<0;1>/**",          // trailing characters
+        "/<0;1>",             // no wildcard
+        "/<0>/*",
+        "/<;1>/*",
+        "/*",
+    };
+    for (size_t i = 0; i < sizeof(invalid_suffixes) / sizeof(invalid_suffixes[0]); i++) {
+        char str[MAX_POLICY_KEY_INFO_LEN + 1];
+        strcpy(str,
+               "xpub6ERApfZwUNrhLCkDtcHTcxd75RbzS1ed54G1LkBUHQVHQKqhMkhgbmJbZRkrgZw4koxb5JaHWkY4ALHY2grBGRjaDMzQLcgJvLJuZZvRcEL");
+        strcat(str, invalid_suffixes[i]);
+        key_info_buffer = buffer_create(str, strlen(str));
+        assert_int_equal(parse_policy_map_key_info(&key_info_buffer, &key_info), -1);
+    }
+
+    // in the binary encoding, the two steps follow the pubkey
+    uint8_t key_info_bin[1 + SERIALIZED_EXTENDED_PUBKEY_LEN + 2 * 4 + 1] = {0};
+    size_t key_info_bin_len = sizeof(key_info_bin) - 1;
+    key_info_bin[0] = KEY_INFO_BINARY_HAS_WILDCARD | KEY_INFO_BINARY_HAS_MULTIPATH;
+    memcpy(key_info_bin + 1 + SERIALIZED_EXTENDED_PUBKEY_LEN, "\x02\x00\x00\x00\x0a\x00\x00\x00", 8);
+
+    key_info_buffer = buffer_create(key_info_bin, key_info_bin_len);
+    assert_int_equal(parse_policy_map_key_info(&key_info_buffer, &key_info), 0);
+    assert_true(key_info.is_binary);
+    assert_true(key_info.has_wildcard);
+    assert_int_equal(key_info.multipath[0], 2);
+    assert_int_equal(key_info.multipath[1], 10);
+
+    // truncated or with excess bytes
+    key_info_buffer = buffer_create(key_info_bin, key_info_bin_len - 1);
+    assert_int_equal(parse_policy_map_key_info(&key_info_buffer, &key_info), -1);
+    key_info_buffer = buffer_create(key_info_bin, key_info_bin_len + 1);
+    assert_int_equal(parse_policy_map_key_info(&key_info_buffer, &key_info), -1);
+
+    // the multipath requires the wildcard, and two different unhardened steps
+    key_info_bin[0] = KEY_INFO_BINARY_HAS_MULTIPATH;
+    key_info_buffer = buffer_create(key_info_bin, key_info_bin_len);
+    assert_int_equal(parse_policy_map_key_info(&key_info_buffer, &key_info), -1);
+    key_info_bin[0] = KEY_INFO_BINARY_HAS_WILDCARD | KEY_INFO_BINARY_HAS_MULTIPATH;
+    memcpy(key_info_bin + 1 + SERIALIZED_EXTENDED_PUBKEY_LEN, "\x02\x00\x00\x00\x02\x00\x00\x00", 8);
+    key_info_buffer = buffer_create(key_info_bin, key_info_bin_len);
+    assert_int_equal(parse_policy_map_key_info(&key_info_buffer, &key_info), -1);
+    memcpy(key_info_bin + 1 + SERIALIZED_EXTENDED_PUBKEY_LEN, "\x02\x00\x00\x00\x00\x00\x00\x80", 8);
+    key_info_buffer = buffer_create(key_info_bin, key_info_bin_len);
+    assert_int_equal(parse_policy_map_key_info(&key_info_buffer, &key_info), -1);
 }
 
 int main() {
@@ -217,7 +713,16 @@ int main() {
         cmocka_unit_test(test_parse_policy_map_multisig_1),
         cmocka_unit_test(test_parse_policy_map_multisig_2),
         cmocka_unit_test(test_parse_policy_map_multisig_3),
+        cmocka_unit_test(test_parse_policy_map_multisig_4),
+        cmocka_unit_test(test_parse_policy_map_miniscript_1),
+        cmocka_unit_test(test_parse_policy_map_miniscript_2),
+        cmocka_unit_test(test_parse_policy_map_miniscript_3),
+        cmocka_unit_test(test_parse_policy_map_taptree),
         cmocka_unit_test(test_failures),
+        cmocka_unit_test(test_decode_policy_map),
+        cmocka_unit_test(test_decode_failures),
+        cmocka_unit_test(test_parse_policy_map_key_info),
+        cmocka_unit_test(test_parse_policy_map_key_info_multipath),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);